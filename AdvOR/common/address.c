@@ -920,13 +920,18 @@ char *tor_dup_addr(const tor_addr_t *addr)
 	return tor_strdup("<unknown address type>");
 }
 
+/** Write a string representing the address <b>addr</b> into the TOR_ADDR_BUF_LEN-byte buffer <b>buf</b>, and return <b>buf</b> (or a static string if <b>addr</b> can't be formatted).  Unlike fmt_addr(), this is safe to call from any thread and more than once in the same statement. */
+const char *fmt_addr_buf(char *buf, const tor_addr_t *addr)
+{	if(!addr)	return "<null>";
+	if(!tor_addr_to_str(buf, addr, TOR_ADDR_BUF_LEN, 0))
+		return "???";
+	return buf;
+}
+
 /** Return a string representing the address <b>addr</b>.  This string is statically allocated, and must not be freed.  Each call to <b>fmt_addr</b> invalidates the last result of the function. This function is not thread-safe. */
 const char *fmt_addr(const tor_addr_t *addr)
 {	static char buf[TOR_ADDR_BUF_LEN];
-	if(!addr)	return "<null>";
-	if(!tor_addr_to_str(buf, addr, sizeof(buf), 0))
-		return "???";
-	return buf;
+	return fmt_addr_buf(buf, addr);
 }
 
 /** Convert the string in <b>src</b> to a tor_addr_t <b>addr</b>.  The string
@@ -938,26 +943,30 @@ const char *fmt_addr(const tor_addr_t *addr)
 int
 tor_addr_from_str(tor_addr_t *addr, const char *src)
 {
-  char *tmp = NULL; /* Holds substring if we got a dotted quad. */
-  int result;
+  char tmp[TOR_ADDR_BUF_LEN]; /* Holds the address inside the brackets. */
   struct in_addr in_tmp;
   struct in6_addr in6_tmp;
   tor_assert(addr && src);
-  if (src[0] == '[' && src[1])
-    src = tmp = tor_strndup(src+1, strlen(src)-2);
+  if (src[0] == '[' && src[1]) {
+    /* Anything too long for the buffer can't be an address anyway. */
+    size_t len = strlen(src)-2;
+    if (len >= sizeof(tmp))
+      return -1;
+    memcpy(tmp, src+1, len);
+    tmp[len] = '\0';
+    src = tmp;
+  }
 
-  if (tor_inet_pton(AF_INET6, src, &in6_tmp) > 0) {
-    result = AF_INET6;
+  /* Every IPv6 address has a colon in it; don't bother trying to parse the
+   * far more common IPv4 addresses and hostnames as IPv6. */
+  if (strchr(src, ':') && tor_inet_pton(AF_INET6, src, &in6_tmp) > 0) {
     tor_addr_from_in6(addr, &in6_tmp);
+    return AF_INET6;
   } else if (tor_inet_pton(AF_INET, src, &in_tmp) > 0) {
-    result = AF_INET;
     tor_addr_from_in(addr, &in_tmp);
-  } else {
-    result = -1;
+    return AF_INET;
   }
-
-  tor_free(tmp);
-  return result;
+  return -1;
 }
 
 /** Parse an address or address-port combination from <b>s</b>, resolve the
@@ -1316,11 +1325,28 @@ int
 tor_inet_ntoa(const struct in_addr *in, char *buf, size_t buf_len)
 {
   uint32_t a = ntohl(in->s_addr);
-  return tor_snprintf(buf, buf_len, "%d.%d.%d.%d",
-                      (int)(uint8_t)((a>>24)&0xff),
-                      (int)(uint8_t)((a>>16)&0xff),
-                      (int)(uint8_t)((a>>8 )&0xff),
-                      (int)(uint8_t)((a    )&0xff));
+  char tmp[INET_NTOA_BUF_LEN], *cp = tmp;
+  int shift, len;
+
+  /* This runs for every address we log or send, so write the digits out
+   * directly instead of going through tor_snprintf(). */
+  for (shift = 24; shift >= 0; shift -= 8) {
+    unsigned v = (a >> shift) & 0xff;
+    if (v >= 100) {
+      *cp++ = '0' + v/100;
+      v %= 100;
+      *cp++ = '0' + v/10;
+    } else if (v >= 10) {
+      *cp++ = '0' + v/10;
+    }
+    *cp++ = '0' + v%10;
+    if (shift)
+      *cp++ = '.';
+  }
+  *cp = '\0';
+  len = (int)(cp - tmp);
+  strlcpy(buf, tmp, buf_len);
+  return (size_t)len < buf_len ? len : -1;
 }
 
 /** Given a host-order <b>addr</b>, call tor_inet_ntop() on it
@@ -107,6 +107,16 @@
 # endif
 #endif
 
+/* On x86 builds with a recent enough GCC, we can also encrypt counter blocks
+ * with the AES-NI instructions; aes_set_key() turns this on for 128- and
+ * 256-bit keys when CPUID says the processor has them. */
+#if defined(__GNUC__) && (defined(CPU_IS_X86) || defined(CPU_IS_X86_64)) && \
+  ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define USE_AESNI_CTR
+# include <cpuid.h>
+# include <wmmintrin.h>
+#endif
+
 /*======================================================================*/
 /* From rijndael-alg-fst.h */
 
@@ -169,8 +179,21 @@ struct aes_cnt_cipher {
   u8 buf[16];
   /** Our current stream position within buf. */
   u8 pos;
+#ifdef USE_AESNI_CTR
+  /** Number of AES rounds to use with ni_rk, or 0 if we aren't using AES-NI
+   * for this cipher. */
+  int ni_rounds;
+  /** The expanded key, as round keys for the AES-NI instructions.  Kept as
+   * bytes, since our allocator doesn't promise 16-byte alignment. */
+  u8 ni_rk[16*15];
+#endif
 };
 
+#ifdef USE_AESNI_CTR
+static void aesni_set_key(aes_cnt_cipher_t *cipher, const char *key,
+                          int key_bits);
+#endif
+
 #if !defined(USING_COUNTER_VARS)
 #define COUNTER(c, n) ((c)->ctr_buf.buf32[3-(n)])
 #else
@@ -243,6 +266,9 @@ aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
   cipher->nr = rijndaelKeySetupEnc(cipher->rk, (const unsigned char*)key,
                                    key_bits);
 #endif
+#ifdef USE_AESNI_CTR
+  aesni_set_key(cipher, key, key_bits);
+#endif
 #ifdef USING_COUNTER_VARS
   cipher->counter0 = 0;
   cipher->counter1 = 0;
@@ -278,6 +304,202 @@ aes_free_cipher(aes_cnt_cipher_t *cipher)
 #define UPDATE_CTR_BUF(c, n)
 #endif
 
+#ifdef USE_AESNI_CTR
+/** How many counter blocks do we encrypt at once with AES-NI?  Eight keeps
+ * the AES unit busy while leaving registers for the round keys. */
+#define AESNI_CTR_BLOCKS 8
+
+/** 1 if this CPU has the AES-NI instructions, 0 if it doesn't, -1 if we
+ * haven't checked yet. */
+static int have_aesni = -1;
+
+/** Return true iff the CPU supports the AES-NI instructions. */
+static int
+aesni_available(void)
+{
+  if (have_aesni < 0) {
+    unsigned int eax, ebx, ecx, edx;
+    have_aesni = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+      (ecx & bit_AES) && (ecx & bit_SSE2) ? 1 : 0;
+  }
+  return have_aesni;
+}
+
+/** Helper for the AES-NI key schedule: fold the keygenassist output
+ * <b>t</b>, already broadcast to every word, into the previous round key
+ * <b>k</b>. */
+static INLINE __m128i __attribute__((target("aes,sse2")))
+aesni_key_mix(__m128i k, __m128i t)
+{
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  return _mm_xor_si128(k, t);
+}
+
+/** Expand the 128-bit <b>key</b> into the 11 round keys at <b>rk</b>. */
+static void __attribute__((target("aes,sse2")))
+aesni_expand_key_128(const char *key, u8 *rk)
+{
+  __m128i k = _mm_loadu_si128((const __m128i *)key);
+  _mm_storeu_si128((__m128i *)rk, k);
+#define EXPAND128(i, rcon) STMT_BEGIN                                     \
+    k = aesni_key_mix(k, _mm_shuffle_epi32(                              \
+                           _mm_aeskeygenassist_si128(k, rcon), 0xff));   \
+    _mm_storeu_si128((__m128i *)(rk + 16*(i)), k);                        \
+  STMT_END
+  EXPAND128(1, 0x01); EXPAND128(2, 0x02); EXPAND128(3, 0x04);
+  EXPAND128(4, 0x08); EXPAND128(5, 0x10); EXPAND128(6, 0x20);
+  EXPAND128(7, 0x40); EXPAND128(8, 0x80); EXPAND128(9, 0x1b);
+  EXPAND128(10, 0x36);
+#undef EXPAND128
+}
+
+/** Expand the 256-bit <b>key</b> into the 15 round keys at <b>rk</b>. */
+static void __attribute__((target("aes,sse2")))
+aesni_expand_key_256(const char *key, u8 *rk)
+{
+  __m128i k0 = _mm_loadu_si128((const __m128i *)key);
+  __m128i k1 = _mm_loadu_si128((const __m128i *)(key+16));
+  _mm_storeu_si128((__m128i *)rk, k0);
+  _mm_storeu_si128((__m128i *)(rk+16), k1);
+#define EXPAND256_A(i, rcon) STMT_BEGIN                                   \
+    k0 = aesni_key_mix(k0, _mm_shuffle_epi32(                            \
+                             _mm_aeskeygenassist_si128(k1, rcon), 0xff)); \
+    _mm_storeu_si128((__m128i *)(rk + 16*(i)), k0);                       \
+  STMT_END
+#define EXPAND256_B(i) STMT_BEGIN                                         \
+    k1 = aesni_key_mix(k1, _mm_shuffle_epi32(                            \
+                             _mm_aeskeygenassist_si128(k0, 0), 0xaa));    \
+    _mm_storeu_si128((__m128i *)(rk + 16*(i)), k1);                       \
+  STMT_END
+  EXPAND256_A(2, 0x01); EXPAND256_B(3);
+  EXPAND256_A(4, 0x02); EXPAND256_B(5);
+  EXPAND256_A(6, 0x04); EXPAND256_B(7);
+  EXPAND256_A(8, 0x08); EXPAND256_B(9);
+  EXPAND256_A(10, 0x10); EXPAND256_B(11);
+  EXPAND256_A(12, 0x20); EXPAND256_B(13);
+  EXPAND256_A(14, 0x40);
+#undef EXPAND256_A
+#undef EXPAND256_B
+}
+
+/** If the CPU has AES-NI and <b>key_bits</b> is a size we handle, set up
+ * <b>cipher</b> to use AES-NI; otherwise make sure it doesn't. */
+static void
+aesni_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
+{
+  cipher->ni_rounds = 0;
+  if (!aesni_available())
+    return;
+  if (key_bits == 128) {
+    aesni_expand_key_128(key, cipher->ni_rk);
+    cipher->ni_rounds = 10;
+  } else if (key_bits == 256) {
+    aesni_expand_key_256(key, cipher->ni_rk);
+    cipher->ni_rounds = 14;
+  }
+}
+
+/** Return the counter block for the 128-bit counter value <b>hi</b>:<b>lo</b>
+ * in big-endian byte order. */
+static INLINE __m128i __attribute__((target("aes,sse2")))
+aesni_ctr_block(uint64_t hi, uint64_t lo)
+{
+  return _mm_set_epi64x((long long)__builtin_bswap64(lo),
+                        (long long)__builtin_bswap64(hi));
+}
+
+/** Counter-mode encryption for <b>cipher</b> using AES-NI; behaves exactly
+ * like aes_crypt().  Whole blocks are encrypted AESNI_CTR_BLOCKS at a time,
+ * so that the rounds for independent counter values overlap in the
+ * pipeline.  <b>input</b> and <b>output</b> may be the same. */
+static void __attribute__((target("aes,sse2")))
+aesni_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
+            char *output)
+{
+  __m128i rk[15];
+  const int nr = cipher->ni_rounds;
+  uint64_t hi, lo;
+  int c = cipher->pos, r, i;
+
+  /* Use up the rest of the current keystream block first. */
+  while (c && len) {
+    *(output++) = *(input++) ^ cipher->buf[c];
+    --len;
+    if (++c == 16)
+      c = 0;
+  }
+  if (!len && c) {
+    cipher->pos = c;
+    return;
+  }
+
+  hi = (((uint64_t)COUNTER(cipher, 3)) << 32) | COUNTER(cipher, 2);
+  lo = (((uint64_t)COUNTER(cipher, 1)) << 32) | COUNTER(cipher, 0);
+  if (cipher->pos) {
+    /* We just finished the block that was in cipher->buf. */
+    if (!++lo)
+      ++hi;
+  }
+  for (r = 0; r <= nr; ++r)
+    rk[r] = _mm_loadu_si128((const __m128i *)(cipher->ni_rk + 16*r));
+
+  while (len >= 16*AESNI_CTR_BLOCKS) {
+    __m128i b[AESNI_CTR_BLOCKS];
+    for (i = 0; i < AESNI_CTR_BLOCKS; ++i) {
+      b[i] = _mm_xor_si128(aesni_ctr_block(hi, lo), rk[0]);
+      if (!++lo)
+        ++hi;
+    }
+    for (r = 1; r < nr; ++r)
+      for (i = 0; i < AESNI_CTR_BLOCKS; ++i)
+        b[i] = _mm_aesenc_si128(b[i], rk[r]);
+    for (i = 0; i < AESNI_CTR_BLOCKS; ++i) {
+      b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+      _mm_storeu_si128((__m128i *)(output + 16*i),
+          _mm_xor_si128(b[i],
+                        _mm_loadu_si128((const __m128i *)(input + 16*i))));
+    }
+    input += 16*AESNI_CTR_BLOCKS;
+    output += 16*AESNI_CTR_BLOCKS;
+    len -= 16*AESNI_CTR_BLOCKS;
+  }
+
+  /* Whole blocks that didn't fill a batch, then the keystream block for
+   * whatever is left over, which we keep in cipher->buf. */
+  while (1) {
+    __m128i b = _mm_xor_si128(aesni_ctr_block(hi, lo), rk[0]);
+    for (r = 1; r < nr; ++r)
+      b = _mm_aesenc_si128(b, rk[r]);
+    b = _mm_aesenclast_si128(b, rk[nr]);
+    if (len < 16) {
+      _mm_storeu_si128((__m128i *)cipher->buf, b);
+      break;
+    }
+    _mm_storeu_si128((__m128i *)output,
+        _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)input)));
+    input += 16;
+    output += 16;
+    len -= 16;
+    if (!++lo)
+      ++hi;
+  }
+  for (c = 0; c < (int)len; ++c)
+    output[c] = input[c] ^ cipher->buf[c];
+  cipher->pos = c;
+
+  COUNTER(cipher, 3) = (u32)(hi >> 32);
+  COUNTER(cipher, 2) = (u32)hi;
+  COUNTER(cipher, 1) = (u32)(lo >> 32);
+  COUNTER(cipher, 0) = (u32)lo;
+  UPDATE_CTR_BUF(cipher, 3);
+  UPDATE_CTR_BUF(cipher, 2);
+  UPDATE_CTR_BUF(cipher, 1);
+  UPDATE_CTR_BUF(cipher, 0);
+}
+#endif
+
 /** Encrypt <b>len</b> bytes from <b>input</b>, storing the result in
  * <b>output</b>.  Uses the key in <b>cipher</b>, and advances the counter
  * by <b>len</b> bytes as it encrypts.
@@ -293,6 +515,12 @@ aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
    * though. */
   int c = cipher->pos;
   if (PREDICT_UNLIKELY(!len)) return;
+#ifdef USE_AESNI_CTR
+  if (cipher->ni_rounds) {
+    aesni_crypt(cipher, input, len, output);
+    return;
+  }
+#endif
 
   while (1) {
     do {
@@ -329,6 +557,12 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
    * though. */
   int c = cipher->pos;
   if (PREDICT_UNLIKELY(!len)) return;
+#ifdef USE_AESNI_CTR
+  if (cipher->ni_rounds) {
+    aesni_crypt(cipher, data, len, data);
+    return;
+  }
+#endif
 
   while (1) {
     do {
@@ -761,6 +761,36 @@ int get_parent_directory(char *fname)
 	return -1;
 }
 
+/** Helper: parse the dotted-quad IPv4 address that makes up all of
+ * <b>s</b> into the host-order *<b>out</b>.  Each part must be one to three
+ * digits and at most 255, just as tor_sscanf(s, "%3u.%3u.%3u.%3u%c") would
+ * check, but without interpreting a pattern on every call.  Return 1 on
+ * success, 0 on failure. */
+static INLINE int
+parse_dotted_quad(const char *s, uint32_t *out)
+{
+  uint32_t result = 0;
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+    unsigned v = 0;
+    int n_digits = 0;
+    if (i && *s++ != '.')
+      return 0;
+    while (n_digits < 3 && TOR_ISDIGIT(*s)) {
+      v = v*10 + (*s++ - '0');
+      ++n_digits;
+    }
+    if (!n_digits || v > 255)
+      return 0;
+    result = (result << 8) | v;
+  }
+  if (*s)
+    return 0;
+  *out = result;
+  return 1;
+}
+
 /** Set *addr to the IP address (in dotted-quad notation) stored in c.
  * Return 1 on success, 0 if c is badly formatted.  (Like inet_aton(c,addr),
  * but works on Windows and Solaris.)
@@ -768,18 +798,26 @@ int get_parent_directory(char *fname)
 int
 tor_inet_aton(const char *str, struct in_addr* addr)
 {
-  unsigned a,b,c,d;
-  char more;
-  if (tor_sscanf(str, "%3u.%3u.%3u.%3u%c", &a,&b,&c,&d,&more) != 4)
+  uint32_t a;
+  if (!parse_dotted_quad(str, &a))
     return 0;
-  if (a > 255) return 0;
-  if (b > 255) return 0;
-  if (c > 255) return 0;
-  if (d > 255) return 0;
-  addr->s_addr = htonl((a<<24) | (b<<16) | (c<<8) | d);
+  addr->s_addr = htonl(a);
   return 1;
 }
 
+/** Helper: write <b>w</b> at <b>cp</b> in lowercase hex without leading
+ * zeros, as "%x" would, and return a pointer just past it. */
+static INLINE char *
+format_hex_word(char *cp, unsigned w)
+{
+  int shift = 12;
+  while (shift && !(w >> shift))
+    shift -= 4;
+  for ( ; shift >= 0; shift -= 4)
+    *cp++ = "0123456789abcdef"[(w >> shift) & 0xf];
+  return cp;
+}
+
 /** Given <b>af</b>==AF_INET and <b>src</b> a struct in_addr, or
  * <b>af</b>==AF_INET6 and <b>src</b> a struct in6_addr, try to format the
  * address and store it in the <b>len</b>-byte buffer <b>dst</b>.  Returns
@@ -852,8 +890,7 @@ tor_inet_ntop(int af, const void *src, char *dst, size_t len)
           ++i;
         --i; /* to compensate for loop increment. */
       } else {
-        tor_snprintf(cp, sizeof(buf)-(cp-buf), "%x", (unsigned)words[i]);
-        cp += strlen(cp);
+        cp = format_hex_word(cp, words[i]);
         if (i != 7)
           *cp++ = ':';
       }
@@ -893,23 +930,18 @@ tor_inet_pton(int af, const char *src, void *dst)
     else if (!dot)
       eow = src+strlen(src);
     else {
-      unsigned byte1,byte2,byte3,byte4;
-      char more;
+      uint32_t a;
       for (eow = dot-1; eow >= src && TOR_ISDIGIT(*eow); --eow)
         ;
       ++eow;
 
-      /* We use "scanf" because some platform inet_aton()s are too lax
-       * about IPv4 addresses of the form "1.2.3" */
-      if (tor_sscanf(eow, "%3u.%3u.%3u.%3u%c",
-                     &byte1,&byte2,&byte3,&byte4,&more) != 4)
+      /* We parse the quad ourselves because some platform inet_aton()s are
+       * too lax about IPv4 addresses of the form "1.2.3" */
+      if (!parse_dotted_quad(eow, &a))
         return 0;
 
-      if (byte1 > 255 || byte2 > 255 || byte3 > 255 || byte4 > 255)
-        return 0;
-
-      words[6] = (byte1<<8) | byte2;
-      words[7] = (byte3<<8) | byte4;
+      words[6] = (uint16_t)(a >> 16);
+      words[7] = (uint16_t)(a & 0xffff);
       setWords += 2;
     }
 
@@ -1121,6 +1153,30 @@ get_uname(void)
   return uname_result;
 }
 
+/** Return the number of logical CPUs on this machine, or -1 if we can't
+ * tell. */
+int
+compute_num_cpus(void)
+{
+#ifdef MS_WINDOWS
+  SYSTEM_INFO info;
+  memset(&info, 0, sizeof(info));
+  GetSystemInfo(&info);
+  if (info.dwNumberOfProcessors >= 1 && info.dwNumberOfProcessors < (DWORD)INT_MAX)
+    return (int)info.dwNumberOfProcessors;
+  else
+    return -1;
+#elif defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus >= 1 && cpus < INT_MAX)
+    return (int)cpus;
+  else
+    return -1;
+#else
+  return -1;
+#endif
+}
+
 /*
  *   Process control
  */
@@ -1202,11 +1258,43 @@ spawn_func(void (*func)(void *), void *data)
 #endif
 }
 
+/** How many functions can spawn_add_exit_handler() register? */
+#define MAX_SPAWN_EXIT_HANDLERS 4
+/** Functions that spawn_exit() calls to free the per-thread state of the
+ * exiting thread. */
+static void (*volatile spawn_exit_handlers[MAX_SPAWN_EXIT_HANDLERS])(void);
+/** How many entries of <b>spawn_exit_handlers</b> have been claimed? */
+static volatile long n_spawn_exit_handlers = 0;
+
+/** Arrange for <b>fn</b> to be called by every thread that ends with
+ * spawn_exit(), so that modules keeping thread-local state can release it.
+ * With win32 threads this is safe to call from any thread. */
+void
+spawn_add_exit_handler(void (*fn)(void))
+{
+#if defined(USE_WIN32_THREADS)
+  long idx = InterlockedIncrement(&n_spawn_exit_handlers) - 1;
+#else
+  long idx = n_spawn_exit_handlers++;
+#endif
+  tor_assert(idx < MAX_SPAWN_EXIT_HANDLERS);
+  spawn_exit_handlers[idx] = fn;
+}
+
 /** End the current thread/process.
  */
 void
 spawn_exit(void)
 {
+#if defined(USE_WIN32_THREADS) || defined(USE_PTHREADS)
+  int i, n = (int)n_spawn_exit_handlers;
+  if (n > MAX_SPAWN_EXIT_HANDLERS)
+    n = MAX_SPAWN_EXIT_HANDLERS;
+  for (i = 0; i < n; ++i) {
+    if (spawn_exit_handlers[i])
+      spawn_exit_handlers[i]();
+  }
+#endif
 #if defined(USE_WIN32_THREADS)
   _endthread();
   //we should never get here. my compiler thinks that _endthread returns, this
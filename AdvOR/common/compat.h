@@ -481,6 +481,7 @@ long tor_weak_random(void);
 
 /* ===== OS compatibility */
 const char *get_uname(void);
+int compute_num_cpus(void);
 
 uint16_t get_uint16(const void *cp) ATTR_PURE ATTR_NONNULL((1));
 uint32_t get_uint32(const void *cp) ATTR_PURE ATTR_NONNULL((1));
@@ -510,6 +511,7 @@ char *get_user_homedir(const char *username);
 int get_parent_directory(char *fname);
 int spawn_func(void (*func)(void *), void *data);
 void spawn_exit(void) ATTR_NORETURN;
+void spawn_add_exit_handler(void (*fn)(void));
 
 #if defined(ENABLE_THREADS) && defined(MS_WINDOWS)
 #define USE_WIN32_THREADS
@@ -34,6 +34,7 @@ smartlist_create(void)
   sl->num_used = 0;
   sl->capacity = SMARTLIST_DEFAULT_CAPACITY;
   sl->list = tor_malloc(sizeof(void *) * sl->capacity);
+  sl->local_storage = NULL;
   return sl;
 }
 
@@ -45,10 +46,25 @@ smartlist_free(smartlist_t *sl)
 {
   if (!sl)
     return;
+  tor_assert(!sl->local_storage);
   tor_free(sl->list);
   tor_free(sl);
 }
 
+/** Release any heap storage used by <b>sl</b>, which was declared with
+ * SMARTLIST_LOCAL.  Does not release storage associated with the list's
+ * elements.  If the list is used again, it lives on the heap, and must be
+ * released again. */
+void
+smartlist_local_free(smartlist_t *sl)
+{
+  tor_assert(sl->local_storage);
+  if (sl->list != sl->local_storage)
+    tor_free(sl->list);
+  sl->list = NULL;
+  sl->num_used = sl->capacity = 0;
+}
+
 /** Remove all elements from the list.
  */
 void
@@ -67,7 +83,7 @@ smartlist_ensure_capacity(smartlist_t *sl, int size)
 #define MAX_CAPACITY (int)((SIZE_MAX / (sizeof(void*))))
 #endif
   if (size > sl->capacity) {
-    int higher = sl->capacity;
+    int higher = sl->capacity ? sl->capacity : SMARTLIST_DEFAULT_CAPACITY;
     if (PREDICT_UNLIKELY(size > MAX_CAPACITY/2)) {
       tor_assert(size <= MAX_CAPACITY);
       higher = MAX_CAPACITY;
@@ -75,8 +91,15 @@ smartlist_ensure_capacity(smartlist_t *sl, int size)
       while (size > higher)
         higher *= 2;
     }
+    if (PREDICT_UNLIKELY(sl->list == sl->local_storage)) {
+      /* Spill out of the local storage onto the heap. */
+      void **list = tor_malloc(sizeof(void*)*((size_t)higher));
+      memcpy(list, sl->list, sizeof(void*)*((size_t)sl->num_used));
+      sl->list = list;
+    } else {
+      sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)higher));
+    }
     sl->capacity = higher;
-    sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)sl->capacity));
   }
 }
 
@@ -1470,3 +1493,107 @@ digestset_free(digestset_t *set)
   tor_free(set);
 }
 
+
+/** Return a newly allocated, empty ip_range_set_t. */
+ip_range_set_t *
+ip_range_set_new(void)
+{
+  ip_range_set_t *set = tor_malloc_zero(sizeof(ip_range_set_t));
+  set->compiled = 1;
+  return set;
+}
+
+/** Free all storage held in <b>set</b>. */
+void
+ip_range_set_free(ip_range_set_t *set)
+{
+  if (!set)
+    return;
+  tor_free(set->ranges);
+  tor_free(set);
+}
+
+/** Remove all ranges from <b>set</b>. */
+void
+ip_range_set_clear(ip_range_set_t *set)
+{
+  set->n_ranges = 0;
+  set->compiled = 1;
+}
+
+/** Add the addresses from <b>low</b> to <b>high</b> (host order, inclusive)
+ * to <b>set</b>. The bounds are swapped if <b>low</b> is greater. */
+void
+ip_range_set_add(ip_range_set_t *set, uint32_t low, uint32_t high)
+{
+  if (low > high) {
+    uint32_t tmp = low;
+    low = high;
+    high = tmp;
+  }
+  if (set->n_ranges == set->allocated) {
+    set->allocated = set->allocated ? set->allocated * 2 : 64;
+    set->ranges = tor_realloc(set->ranges,
+                              set->allocated * sizeof(ip_range_t));
+  }
+  set->ranges[set->n_ranges].low = low;
+  set->ranges[set->n_ranges].high = high;
+  set->n_ranges++;
+  set->compiled = 0;
+}
+
+/** Helper: qsort comparison function for ip_range_t, by lower bound. */
+static int
+_compare_ip_ranges(const void *a, const void *b)
+{
+  uint32_t a1 = ((const ip_range_t *)a)->low;
+  uint32_t b1 = ((const ip_range_t *)b)->low;
+  if (a1 < b1)
+    return -1;
+  if (a1 > b1)
+    return 1;
+  return 0;
+}
+
+/** Sort the ranges of <b>set</b> and merge the ones that overlap or touch,
+ * so that ip_range_set_contains() can bisect them. */
+void
+ip_range_set_compile(ip_range_set_t *set)
+{
+  int i, n;
+  if (set->compiled)
+    return;
+  set->compiled = 1;
+  if (!set->n_ranges)
+    return;
+  qsort(set->ranges, set->n_ranges, sizeof(ip_range_t), _compare_ip_ranges);
+  for (i = 1, n = 0; i < set->n_ranges; i++) {
+    if (set->ranges[i].low <= set->ranges[n].high ||
+        set->ranges[n].high == 0xffffffffu ||
+        set->ranges[i].low == set->ranges[n].high + 1) {
+      if (set->ranges[i].high > set->ranges[n].high)
+        set->ranges[n].high = set->ranges[i].high;
+    } else {
+      set->ranges[++n] = set->ranges[i];
+    }
+  }
+  set->n_ranges = n + 1;
+}
+
+/** Return true iff the IPv4 address <b>addr</b> (in host order) is in one of
+ * the ranges of <b>set</b>. Compiles <b>set</b> first if it has changed. */
+int
+ip_range_set_contains(ip_range_set_t *set, uint32_t addr)
+{
+  int lo = 0, hi, mid;
+  ip_range_set_compile(set);
+  hi = set->n_ranges;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (set->ranges[mid].low > addr)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo > 0 && addr <= set->ranges[lo - 1].high;
+}
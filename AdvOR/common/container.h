@@ -22,10 +22,23 @@ typedef struct smartlist_t {
   void **list;
   int num_used;
   int capacity;
+  /** If this list was declared with SMARTLIST_LOCAL, the storage it started
+   * with; <b>list</b> only points to the heap once it outgrows that.
+   * Otherwise NULL. */
+  void **local_storage;
 } smartlist_t;
 
+/** Declare a smartlist_t called <b>name</b> with room for <b>n</b> elements
+ * in local storage, so that short-lived lists that stay small never touch
+ * the heap.  Use &<b>name</b> wherever a smartlist_t * is needed, and
+ * release it with smartlist_local_free() rather than smartlist_free(). */
+#define SMARTLIST_LOCAL(name, n)                                        \
+  void *name ## _storage[n];                                           \
+  smartlist_t name = { name ## _storage, 0, (n), name ## _storage }
+
 smartlist_t *smartlist_create(void);
 void smartlist_free(smartlist_t *sl);
+void smartlist_local_free(smartlist_t *sl);
 void smartlist_clear(smartlist_t *sl);
 void smartlist_add(smartlist_t *sl, void *element);
 void smartlist_add_all(smartlist_t *sl, const smartlist_t *s2);
@@ -648,6 +661,30 @@ digestset_isin(const digestset_t *set, const char *digest)
 digestset_t *digestset_new(int max_elements);
 void digestset_free(digestset_t* set);
 
+/** A range of IPv4 addresses, in host order, from <b>low</b> to <b>high</b>
+ * inclusive. */
+typedef struct ip_range_t {
+  uint32_t low;
+  uint32_t high;
+} ip_range_t;
+
+/** A set of IPv4 address ranges. Ranges are appended as they are added; the
+ * set is sorted and merged the first time it is searched after a change, so
+ * that lookups take O(log n). */
+typedef struct ip_range_set_t {
+  ip_range_t *ranges;
+  int n_ranges;
+  int allocated;
+  int compiled; /**< True iff <b>ranges</b> is sorted and merged. */
+} ip_range_set_t;
+
+ip_range_set_t *ip_range_set_new(void);
+void ip_range_set_free(ip_range_set_t *set);
+void ip_range_set_clear(ip_range_set_t *set);
+void ip_range_set_add(ip_range_set_t *set, uint32_t low, uint32_t high);
+void ip_range_set_compile(ip_range_set_t *set);
+int ip_range_set_contains(ip_range_set_t *set, uint32_t addr);
+
 /* These functions, given an <b>array</b> of <b>n_elements</b>, return the
  * <b>nth</b> lowest element. <b>nth</b>=0 gives the lowest element;
  * <b>n_elements</b>-1 gives the highest; and (<b>n_elements</b>-1) / 2 gives
@@ -55,6 +55,9 @@
 #include "util.h"
 #include "container.h"
 #include "compat.h"
+#ifdef USE_SSSE3_CODECS
+#include <tmmintrin.h>
+#endif
 
 #if OPENSSL_VERSION_NUMBER < 0x00907000l
 #error "We require openssl >= 0.9.7"
@@ -149,6 +152,29 @@ crypto_get_rsa_padding(int padding)
 /** Boolean: has OpenSSL's crypto been initialized? */
 static int _crypto_global_initialized = 0;
 
+/** How many bytes of RNG output each thread keeps buffered. */
+#define RAND_POOL_LEN 512
+/** crypto_rand() answers requests of up to this many bytes from the calling
+ * thread's buffer; anything longer (keys, nonces, cookies) comes straight
+ * from OpenSSL. */
+#define RAND_POOL_MAX_REQUEST 8
+
+/** A buffer of RNG output for small requests from one thread. */
+typedef struct rand_pool_t {
+  unsigned char buf[RAND_POOL_LEN]; /**< RNG output; used bytes are wiped. */
+  size_t pos; /**< Index of the first unused byte in <b>buf</b>. */
+  unsigned long generation; /**< Value of rand_pool_generation when we
+                             * filled <b>buf</b>. */
+} rand_pool_t;
+
+/** Incremented whenever we reseed the RNG, so that every thread throws away
+ * output it buffered before the reseed. */
+static volatile unsigned long rand_pool_generation = 0;
+#ifdef MS_WINDOWS
+/** Thread-local storage index for each thread's rand_pool_t. */
+static DWORD rand_pool_tls_index = TLS_OUT_OF_INDEXES;
+#endif
+
 /** Log all pending crypto errors at level <b>severity</b>.  Use
  * <b>doing</b> to describe our current activities.
  */
@@ -197,6 +223,10 @@ crypto_global_init(void)
     OpenSSL_add_all_algorithms();
     _crypto_global_initialized = 1;
     setup_openssl_threading();
+#ifdef MS_WINDOWS
+    rand_pool_tls_index = TlsAlloc();
+#endif
+    spawn_add_exit_handler(crypto_thread_cleanup);
     /* XXX the below is a bug, since we can't know if we're supposed
      * to be using hardware acceleration or not. we should arrange
      * for this function to be called before init_keys. But make it
@@ -222,10 +252,21 @@ crypto_global_init(void)
   return 0;
 }
 
-/** Free crypto resources held by this thread. */
+/** Free crypto resources held by this thread, including its rand_pool_t.
+ * spawn_exit() calls this for every thread started with spawn_func(); other
+ * threads that use the crypto library should call it before they exit. */
 void
 crypto_thread_cleanup(void)
 {
+#ifdef MS_WINDOWS
+  rand_pool_t *pool;
+  if (rand_pool_tls_index != TLS_OUT_OF_INDEXES &&
+      (pool = TlsGetValue(rand_pool_tls_index))) {
+    memset(pool, 0, sizeof(rand_pool_t));
+    tor_free(pool);
+    TlsSetValue(rand_pool_tls_index, NULL);
+  }
+#endif
 #ifndef NEW_THREAD_API
   ERR_remove_state(0);
 #endif
@@ -244,6 +285,13 @@ crypto_global_cleanup(void)
   ENGINE_cleanup();
   CONF_modules_unload(1);
   CRYPTO_cleanup_all_ex_data();
+#ifdef MS_WINDOWS
+  if (rand_pool_tls_index != TLS_OUT_OF_INDEXES) {
+    crypto_thread_cleanup();
+    TlsFree(rand_pool_tls_index);
+    rand_pool_tls_index = TLS_OUT_OF_INDEXES;
+  }
+#endif
 #ifndef NEW_THREAD_API
   if (_n_openssl_mutexes) {
     int n = _n_openssl_mutexes;
@@ -1418,6 +1466,103 @@ crypto_digest256(char *digest, const char *m, size_t len,
   return (SHA256((const unsigned char*)m,len,(unsigned char*)digest) == NULL);
 }
 
+/** Round constants for the Keccak-f[1600] permutation. */
+static const uint64_t keccak_round_constants[24] = {
+  U64_LITERAL(0x0000000000000001), U64_LITERAL(0x0000000000008082),
+  U64_LITERAL(0x800000000000808a), U64_LITERAL(0x8000000080008000),
+  U64_LITERAL(0x000000000000808b), U64_LITERAL(0x0000000080000001),
+  U64_LITERAL(0x8000000080008081), U64_LITERAL(0x8000000000008009),
+  U64_LITERAL(0x000000000000008a), U64_LITERAL(0x0000000000000088),
+  U64_LITERAL(0x0000000080008009), U64_LITERAL(0x000000008000000a),
+  U64_LITERAL(0x000000008000808b), U64_LITERAL(0x800000000000008b),
+  U64_LITERAL(0x8000000000008089), U64_LITERAL(0x8000000000008003),
+  U64_LITERAL(0x8000000000008002), U64_LITERAL(0x8000000000000080),
+  U64_LITERAL(0x000000000000800a), U64_LITERAL(0x800000008000000a),
+  U64_LITERAL(0x8000000080008081), U64_LITERAL(0x8000000000008080),
+  U64_LITERAL(0x0000000080000001), U64_LITERAL(0x8000000080008008)
+};
+/** Rotation offsets for the rho step, in the order that pi visits lanes. */
+static const int keccak_rotations[24] = {
+  1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14,
+  27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44
+};
+/** The lanes that the pi step visits, starting from lane 1. */
+static const int keccak_pi_lanes[24] = {
+  10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4,
+  15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1
+};
+#define KECCAK_ROTL(x, n) (((x) << (n)) | ((x) >> (64-(n))))
+/** Number of bytes that SHA3-256 absorbs per permutation. */
+#define SHA3_256_RATE 136
+
+/** Apply the Keccak-f[1600] permutation to <b>st</b>. */
+static void
+keccak_f1600(uint64_t st[25])
+{
+  int i, j, round;
+  uint64_t t, bc[5];
+
+  for (round = 0; round < 24; ++round) {
+    /* theta */
+    for (i = 0; i < 5; ++i)
+      bc[i] = st[i] ^ st[i+5] ^ st[i+10] ^ st[i+15] ^ st[i+20];
+    for (i = 0; i < 5; ++i) {
+      t = bc[(i+4)%5] ^ KECCAK_ROTL(bc[(i+1)%5], 1);
+      for (j = 0; j < 25; j += 5)
+        st[j+i] ^= t;
+    }
+    /* rho and pi */
+    t = st[1];
+    for (i = 0; i < 24; ++i) {
+      j = keccak_pi_lanes[i];
+      bc[0] = st[j];
+      st[j] = KECCAK_ROTL(t, keccak_rotations[i]);
+      t = bc[0];
+    }
+    /* chi */
+    for (j = 0; j < 25; j += 5) {
+      for (i = 0; i < 5; ++i)
+        bc[i] = st[j+i];
+      for (i = 0; i < 5; ++i)
+        st[j+i] ^= (~bc[(i+1)%5]) & bc[(i+2)%5];
+    }
+    /* iota */
+    st[0] ^= keccak_round_constants[round];
+  }
+}
+
+/** Compute the SHA3-256 digest of the <b>len</b> bytes in <b>m</b>, and
+ * write the DIGEST256_LEN-byte result into <b>digest</b>.  Our OpenSSL
+ * doesn't know SHA3, so we do it ourselves; we only need it to name
+ * consensus documents the way current directory caches do.  Return 0 on
+ * success, -1 on failure. */
+int
+crypto_digest_sha3_256(char *digest, const char *m, size_t len)
+{
+  uint64_t st[25];
+  const unsigned char *cp = (const unsigned char *)m;
+  size_t pos = 0;
+  int i;
+
+  tor_assert(m || !len);
+  tor_assert(digest);
+  memset(st, 0, sizeof(st));
+  while (len--) {
+    st[pos/8] ^= ((uint64_t)*cp++) << (8*(pos%8));
+    if (++pos == SHA3_256_RATE) {
+      keccak_f1600(st);
+      pos = 0;
+    }
+  }
+  st[pos/8] ^= ((uint64_t)0x06) << (8*(pos%8));
+  st[(SHA3_256_RATE-1)/8] ^= ((uint64_t)0x80) << (8*((SHA3_256_RATE-1)%8));
+  keccak_f1600(st);
+  for (i = 0; i < DIGEST256_LEN; ++i)
+    digest[i] = (char)(st[i/8] >> (8*(i%8)));
+  memset(st, 0, sizeof(st));
+  return 0;
+}
+
 /** Set the digests_t in <b>ds_out</b> to contain every digest on the
  * <b>len</b> bytes in <b>m</b> that we know how to compute.  Return 0 on
  * success, -1 on failure. */
@@ -1577,6 +1722,38 @@ crypto_digest_assign(crypto_digest_env_t *into,
   memcpy(into,from,sizeof(crypto_digest_env_t));
 }
 
+/** Save the running state of <b>digest</b> into <b>checkpoint</b>, which
+ * is usually on the caller's stack, so that crypto_digest_restore() can
+ * roll <b>digest</b> back to it later.
+ */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_env_t *digest)
+{
+  tor_assert(checkpoint);
+  tor_assert(digest);
+  tor_assert(sizeof(digest->d) <= sizeof(checkpoint->u.mem));
+  if (digest->algorithm == DIGEST_SHA1)
+    memcpy(checkpoint->u.mem, &digest->d.sha1, sizeof(digest->d.sha1));
+  else
+    memcpy(checkpoint->u.mem, &digest->d, sizeof(digest->d));
+}
+
+/** Roll the state of <b>digest</b> back to the one saved in
+ * <b>checkpoint</b> by crypto_digest_checkpoint().
+ */
+void
+crypto_digest_restore(crypto_digest_env_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  tor_assert(digest);
+  tor_assert(checkpoint);
+  if (digest->algorithm == DIGEST_SHA1)
+    memcpy(&digest->d.sha1, checkpoint->u.mem, sizeof(digest->d.sha1));
+  else
+    memcpy(&digest->d, checkpoint->u.mem, sizeof(digest->d));
+}
+
 /** Compute the HMAC-SHA-1 of the <b>msg_len</b> bytes in <b>msg</b>, using
  * the <b>key</b> of length <b>key_len</b>.  Store the DIGEST_LEN-byte result
  * in <b>hmac_out</b>.
@@ -2035,6 +2212,7 @@ crypto_seed_rng(int startup)
   }
   RAND_seed(buf, sizeof(buf));
   memset(buf, 0, sizeof(buf));
+  ++rand_pool_generation;
   seed_weak_rng();
   return 0;
 #else
@@ -2050,6 +2228,7 @@ crypto_seed_rng(int startup)
     }
     RAND_seed(buf, (int)sizeof(buf));
     memset(buf, 0, sizeof(buf));
+    ++rand_pool_generation;
     seed_weak_rng();
     return 0;
   }
@@ -2059,8 +2238,48 @@ crypto_seed_rng(int startup)
 #endif
 }
 
+#ifdef MS_WINDOWS
+/** Copy <b>n</b> bytes of random data to <b>to</b> from this thread's
+ * rand_pool_t, refilling it from OpenSSL when it runs low or the RNG has
+ * been reseeded since we filled it.  Return 0 on success, -1 if we have no
+ * pool. */
+static int
+crypto_rand_from_pool(char *to, size_t n)
+{
+  rand_pool_t *pool;
+
+  if (rand_pool_tls_index == TLS_OUT_OF_INDEXES)
+    return -1;
+  if (!(pool = TlsGetValue(rand_pool_tls_index))) {
+    pool = tor_malloc_zero(sizeof(rand_pool_t));
+    pool->pos = RAND_POOL_LEN;
+    if (!TlsSetValue(rand_pool_tls_index, pool)) {
+      tor_free(pool);
+      return -1;
+    }
+  }
+  if (pool->pos + n > RAND_POOL_LEN ||
+      pool->generation != rand_pool_generation) {
+    pool->generation = rand_pool_generation;
+    if (RAND_bytes(pool->buf, RAND_POOL_LEN) != 1) {
+      memset(pool->buf, 0, RAND_POOL_LEN);
+      pool->pos = RAND_POOL_LEN;
+      return -1;
+    }
+    pool->pos = 0;
+  }
+  memcpy(to, pool->buf + pool->pos, n);
+  /* Don't leave copies of output we've handed out lying around. */
+  memset(pool->buf + pool->pos, 0, n);
+  pool->pos += n;
+  return 0;
+}
+#endif
+
 /** Write <b>n</b> bytes of strong random data to <b>to</b>. Return 0 on
- * success, -1 on failure.
+ * success, -1 on failure.  Small requests are answered from a per-thread
+ * buffer of RNG output, since they are frequent and OpenSSL is slow to
+ * produce a few bytes at a time.
  */
 int
 crypto_rand(char *to, size_t n)
@@ -2068,6 +2287,10 @@ crypto_rand(char *to, size_t n)
   int r;
   tor_assert(n < INT_MAX);
   tor_assert(to);
+#ifdef MS_WINDOWS
+  if (n <= RAND_POOL_MAX_REQUEST && !crypto_rand_from_pool(to, n))
+    return 0;
+#endif
   r = RAND_bytes((unsigned char*)to, (int)n);
   if (r == 0)
     crypto_log_errors(LOG_WARN,get_lang_str(LANG_LOG_CRYPTO_GENERATING_RANDOM_DATA));
@@ -2454,6 +2677,60 @@ static const uint8_t base64_decode_table[256] = {
   X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
 };
 
+#ifdef USE_SSSE3_CODECS
+/** Decode the first <b>srclen</b> base64 characters at <b>src</b>, 16 at a
+ * time, into <b>dest</b>.  Stop at the first block that holds anything but
+ * base64 digits, such as whitespace or padding.  Return the number of
+ * characters decoded. */
+static size_t __attribute__((target("ssse3")))
+base64_decode_ssse3(char *dest, const char *src, size_t srclen)
+{
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                     -1, -1, -1, -1);
+  char out[16];
+  size_t i;
+
+  for (i = 0; i + 16 <= srclen; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i upper = _mm_sub_epi8(in, _mm_set1_epi8('A'));
+    __m128i lower = _mm_sub_epi8(in, _mm_set1_epi8('a'));
+    __m128i digit = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+    __m128i is_upper = _mm_cmpeq_epi8(_mm_min_epu8(upper, _mm_set1_epi8(25)),
+                                      upper);
+    __m128i is_lower = _mm_cmpeq_epi8(_mm_min_epu8(lower, _mm_set1_epi8(25)),
+                                      lower);
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)),
+                                      digit);
+    __m128i is_plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+    __m128i is_slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    __m128i v;
+
+    if (_mm_movemask_epi8(_mm_or_si128(
+          _mm_or_si128(_mm_or_si128(is_upper, is_lower), is_digit),
+          _mm_or_si128(is_plus, is_slash))) != 0xffff)
+      break;
+    v = _mm_or_si128(
+          _mm_or_si128(_mm_and_si128(is_upper, upper),
+                       _mm_and_si128(is_lower,
+                                     _mm_add_epi8(lower, _mm_set1_epi8(26)))),
+          _mm_or_si128(_mm_and_si128(is_digit,
+                                     _mm_add_epi8(digit, _mm_set1_epi8(52))),
+                       _mm_or_si128(_mm_and_si128(is_plus,
+                                                  _mm_set1_epi8(62)),
+                                    _mm_and_si128(is_slash,
+                                                  _mm_set1_epi8(63)))));
+    /* Merge each group of four 6-bit values into 24 bits, then pull the three
+     * bytes of each group out in big-endian order. */
+    v = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    v = _mm_shuffle_epi8(v, pack);
+    _mm_storeu_si128((__m128i *)out, v);
+    memcpy(dest + (i/4)*3, out, 12);
+  }
+  return i;
+}
+#endif
+
 /** Base64 decode <b>srclen</b> bytes of data from <b>src</b>.  Write
  * the result into <b>dest</b>, if it will fit within <b>destlen</b>
  * bytes.  Return the number of bytes written on success; -1 if
@@ -2473,6 +2750,9 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   uint32_t n=0;
   int n_idx=0;
   char *dest_orig = dest;
+#ifdef USE_SSSE3_CODECS
+  int use_ssse3 = srclen >= 16 && codecs_have_ssse3();
+#endif
 
   /* Max number of bits == srclen*6.
    * Number of bytes required to hold all bits == (srclen*6)/8.
@@ -2491,8 +2771,21 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
    * 24 bits, batch them into 3 bytes and flush those bytes to dest.
    */
   for ( ; src < eos; ++src) {
-    unsigned char c = (unsigned char) *src;
-    uint8_t v = base64_decode_table[c];
+    unsigned char c;
+    uint8_t v;
+#ifdef USE_SSSE3_CODECS
+    /* Between groups, hand runs of plain base64 digits (such as the 64
+     * characters of a PEM line) to the vector decoder. */
+    if (use_ssse3 && n_idx == 0 && eos - src >= 16) {
+      size_t n = base64_decode_ssse3(dest, src, eos - src);
+      src += n;
+      dest += (n/4)*3;
+      if (src == eos)
+        break;
+    }
+#endif
+    c = (unsigned char) *src;
+    v = base64_decode_table[c];
     if(v == PAD)
     	break;
     switch (v) {
@@ -2618,8 +2911,9 @@ int digest256_from_base64(char *digest, const char *d64)
 void
 base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  unsigned int i, v, u;
-  size_t nbits = srclen * 8, bit;
+  const uint8_t *usrc = (const uint8_t *)src;
+  size_t nbits = srclen * 8, j;
+  char *d = dest;
 
   tor_assert(srclen < SIZE_T_CEILING/8);
 
@@ -2627,15 +2921,33 @@ base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   tor_assert((nbits/5)+1 <= destlen); /* We need enough space. */
   tor_assert(destlen < SIZE_T_CEILING);
 
-  for (i=0,bit=0; bit < nbits; ++i, bit+=5) {
-    /* set v to the 16-bit value starting at src[bits/8], 0-padded. */
-    v = ((uint8_t)src[bit/8]) << 8;
-    if (bit+5<nbits) v += (uint8_t)src[(bit/8)+1];
-    /* set u to the 5-bit value at the bit'th bit of src. */
-    u = (v >> (11-(bit%8))) & 0x1F;
-    dest[i] = BASE32_CHARS[u];
+  /* Every 5 bytes of input become 8 characters of output. */
+  for (j = 0; j < srclen; j += 5) {
+    uint64_t v = ((uint64_t)usrc[j] << 32) | ((uint64_t)usrc[j+1] << 24) |
+                 ((uint64_t)usrc[j+2] << 16) | ((uint64_t)usrc[j+3] << 8) |
+                 usrc[j+4];
+    d[0] = BASE32_CHARS[(v >> 35) & 0x1F];
+    d[1] = BASE32_CHARS[(v >> 30) & 0x1F];
+    d[2] = BASE32_CHARS[(v >> 25) & 0x1F];
+    d[3] = BASE32_CHARS[(v >> 20) & 0x1F];
+    d[4] = BASE32_CHARS[(v >> 15) & 0x1F];
+    d[5] = BASE32_CHARS[(v >> 10) & 0x1F];
+    d[6] = BASE32_CHARS[(v >> 5) & 0x1F];
+    d[7] = BASE32_CHARS[v & 0x1F];
+    d += 8;
   }
-  dest[i] = '\0';
+  *d = '\0';
+}
+
+/** Helper: given a base32 character, return its value, or -1 if it isn't
+ * base32. */
+static INLINE int
+base32_decode_digit(char c)
+{
+  if (c > 0x60 && c < 0x7B) return c - 0x61;
+  else if (c > 0x31 && c < 0x38) return c - 0x18;
+  else if (c > 0x40 && c < 0x5B) return c - 0x41;
+  return -1;
 }
 
 /** Implements base32 decoding as in rfc3548.  Limitation: Requires
@@ -2644,11 +2956,8 @@ base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 int
 base32_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  /* XXXX we might want to rewrite this along the lines of base64_decode, if
-   * it ever shows up in the profile. */
-  unsigned int i;
-  size_t nbits, j, bit;
-  char *tmp;
+  size_t nbits, j;
+  char *d = dest;
   nbits = srclen * 5;
 
   tor_assert(srclen < SIZE_T_CEILING / 5);
@@ -2656,50 +2965,27 @@ base32_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   tor_assert((nbits/8) <= destlen); /* We need enough space. */
   tor_assert(destlen < SIZE_T_CEILING);
 
-  /* Convert base32 encoded chars to the 5-bit values that they represent. */
-  tmp = tor_malloc_zero(srclen);
+  /* Check the whole input first, so that we leave dest alone on failure. */
   for (j = 0; j < srclen; ++j) {
-    if (src[j] > 0x60 && src[j] < 0x7B) tmp[j] = src[j] - 0x61;
-    else if (src[j] > 0x31 && src[j] < 0x38) tmp[j] = src[j] - 0x18;
-    else if (src[j] > 0x40 && src[j] < 0x5B) tmp[j] = src[j] - 0x41;
-    else {
+    if (base32_decode_digit(src[j]) < 0) {
       log_warn(LD_BUG,get_lang_str(LANG_LOG_CRYPTO_BASE32_ERROR));
-      tor_free(tmp);
       return -1;
     }
   }
 
-  /* Assemble result byte-wise by applying five possible cases. */
-  for (i = 0, bit = 0; bit < nbits; ++i, bit += 8) {
-    switch (bit % 40) {
-    case 0:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 3) +
-                (((uint8_t)tmp[(bit/5)+1]) >> 2);
-      break;
-    case 8:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 6) +
-                (((uint8_t)tmp[(bit/5)+1]) << 1) +
-                (((uint8_t)tmp[(bit/5)+2]) >> 4);
-      break;
-    case 16:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 4) +
-                (((uint8_t)tmp[(bit/5)+1]) >> 1);
-      break;
-    case 24:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 7) +
-                (((uint8_t)tmp[(bit/5)+1]) << 2) +
-                (((uint8_t)tmp[(bit/5)+2]) >> 3);
-      break;
-    case 32:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 5) +
-                ((uint8_t)tmp[(bit/5)+1]);
-      break;
-    }
+  /* Every 8 characters of input become 5 bytes of output. */
+  for (j = 0; j < srclen; j += 8) {
+    uint64_t v = 0;
+    int k;
+    for (k = 0; k < 8; ++k)
+      v = (v << 5) | (unsigned)base32_decode_digit(src[j+k]);
+    d[0] = (char)(v >> 32);
+    d[1] = (char)(v >> 24);
+    d[2] = (char)(v >> 16);
+    d[3] = (char)(v >> 8);
+    d[4] = (char)v;
+    d += 5;
   }
-
-  memset(tmp, 0, srclen);
-  tor_free(tmp);
-  tmp = NULL;
   return 0;
 }
 
@@ -87,6 +87,18 @@ typedef struct crypto_cipher_env_t crypto_cipher_env_t;
 typedef struct crypto_digest_env_t crypto_digest_env_t;
 typedef struct crypto_dh_env_t crypto_dh_env_t;
 
+/** How many bytes do we need to save the running state of a digest? */
+#define CRYPTO_DIGEST_CHECKPOINT_LEN 128
+/** Caller-provided storage for the state of a digest object, so that it can
+ * be saved and restored without allocating; see
+ * crypto_digest_checkpoint(). */
+typedef struct crypto_digest_checkpoint_t {
+  union {
+    uint64_t align; /**< Keeps <b>mem</b> suitably aligned. */
+    char mem[CRYPTO_DIGEST_CHECKPOINT_LEN]; /**< The saved state. */
+  } u;
+} crypto_digest_checkpoint_t;
+
 /* global state */
 int crypto_global_init(void);
 void crypto_thread_cleanup(void);
@@ -184,6 +196,10 @@ void crypto_digest_get_digest(crypto_digest_env_t *digest,
 crypto_digest_env_t *crypto_digest_dup(const crypto_digest_env_t *digest);
 void crypto_digest_assign(crypto_digest_env_t *into,
                           const crypto_digest_env_t *from);
+void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                              const crypto_digest_env_t *digest);
+void crypto_digest_restore(crypto_digest_env_t *digest,
+                           const crypto_digest_checkpoint_t *checkpoint);
 void crypto_hmac_sha1(char *hmac_out,
                       const char *key, size_t key_len,
                       const char *msg, size_t msg_len);
@@ -244,6 +260,7 @@ int crypto_pk_public_exponent_ok(crypto_pk_env_t *env);
 int crypto_digest_algorithm_parse_name(const char *name);
 int crypto_pk_num_bits(crypto_pk_env_t *env);
 int crypto_digest256(char *digest, const char *m, size_t len,digest_algorithm_t algorithm);
+int crypto_digest_sha3_256(char *digest, const char *m, size_t len);
 int crypto_digest_all(digests_t *ds_out, const char *m, size_t len);
 int crypto_pk_generate_key_with_bits(crypto_pk_env_t *env, int bits);
 int crypto_pk_generate_env_with_bits(crypto_pk_env_t *env, int bits);
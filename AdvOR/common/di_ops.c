@@ -8,6 +8,13 @@
 
 #include "orconfig.h"
 #include "di_ops.h"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DI_OPS_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 /**
  * Timing-safe version of memcmp.  As memcmp, compare the <b>sz</b> bytes at
@@ -95,6 +102,31 @@ tor_memeq(const void *a, const void *b, size_t sz)
   /* Treat a and b as byte ranges. */
   const uint8_t *ba = a, *bb = b;
   uint32_t any_difference = 0;
+#ifdef DI_OPS_USE_SSE2
+  __m128i diff128 = _mm_setzero_si128();
+#endif
+  uint32_t w1, w2;
+
+  /* Every step below only depends on sz, never on the contents of a and b:
+   * we OR together the XOR of each chunk and we never stop early. */
+#ifdef DI_OPS_USE_SSE2
+  for (; sz >= 16; sz -= 16, ba += 16, bb += 16) {
+    diff128 = _mm_or_si128(diff128,
+                           _mm_xor_si128(_mm_loadu_si128((const __m128i *)ba),
+                                         _mm_loadu_si128((const __m128i *)bb)));
+  }
+  /* Fold the 128 bits of diff128 into any_difference. */
+  diff128 = _mm_or_si128(diff128, _mm_srli_si128(diff128, 8));
+  diff128 = _mm_or_si128(diff128, _mm_srli_si128(diff128, 4));
+  any_difference = (uint32_t)_mm_cvtsi128_si32(diff128);
+#endif
+  /* Then a 32-bit word at a time.  memcpy() keeps the loads unaligned-safe
+   * and compiles to a plain load. */
+  for (; sz >= 4; sz -= 4, ba += 4, bb += 4) {
+    memcpy(&w1, ba, 4);
+    memcpy(&w2, bb, 4);
+    any_difference |= w1 ^ w2;
+  }
   while (sz--) {
     /* Set byte_diff to all of those bits that are different in *ba and *bb,
      * and advance both ba and bb. */
@@ -111,20 +143,17 @@ tor_memeq(const void *a, const void *b, size_t sz)
    * (If we say "!any_difference", the compiler might get smart enough
    * to optimize-out our data-independence stuff above.)
    *
-   * To unpack:
+   * any_difference may use all 32 bits now, so the ">> 8" trick that we
+   * used on bytes doesn't work any more.  Instead:
    *
    * If any_difference == 0:
-   *            any_difference - 1 == ~0
-   *     (any_difference - 1) >> 8 == 0x00ffffff
-   *     1 & ((any_difference - 1) >> 8) == 1
+   *     any_difference | -any_difference == 0, its top bit is 0,
+   *     and 1 ^ 0 == 1
    *
    * If any_difference != 0:
-   *            0 < any_difference < 256, so
-   *            0 < any_difference - 1 < 255
-   *            (any_difference - 1) >> 8 == 0
-   *            1 & ((any_difference - 1) >> 8) == 0
+   *     one of any_difference and -any_difference has its top bit set,
+   *     so (any_difference | -any_difference) >> 31 == 1, and 1 ^ 1 == 0
    */
 
-  return 1 & ((any_difference - 1) >> 8);
+  return 1 & (((any_difference | (0u - any_difference)) >> 31) ^ 1);
 }
-
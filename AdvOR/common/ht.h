@@ -426,6 +426,358 @@ ht_string_hash(const char *s)
     ++((head)->hth_n_entries);                              \
   }
 
+/* An open-addressed variant of the tables above, with the same
+ * HT_FIND/HT_INSERT/HT_REMOVE/HT_START/HT_NEXT/HT_CLEAR interface.  Every
+ * slot has a control byte holding 7 bits of the element's hash, so that a
+ * lookup checks a whole group of 16 slots at once (with SSE2 when we have
+ * it) and only calls eqfn on elements whose tag matches.  Use OAHT_HEAD,
+ * OAHT_ENTRY, OAHT_PROTOTYPE and OAHT_GENERATE instead of the HT_ ones;
+ * 'load' must be below 1. */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OAHT_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* How many slots do we probe at once? */
+#define OAHT_GROUP 16
+#define OAHT_CTRL_EMPTY 0x80
+#define OAHT_CTRL_DELETED 0xFE
+#define OAHT_CTRL_TAG(h) ((unsigned char)((h) & 0x7f))
+#define OAHT_CTRL_IS_FULL(c) (!((c) & 0x80))
+
+/* Helper: return a bitmask of the control bytes in the group at 'ctrl'
+ * that are equal to 'c'. */
+static INLINE unsigned
+oaht_group_match(const unsigned char *ctrl, unsigned char c)
+{
+#ifdef OAHT_USE_SSE2
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group,
+                                                    _mm_set1_epi8((char)c)));
+#else
+  unsigned i, m = 0;
+  for (i = 0; i < OAHT_GROUP; ++i) {
+    if (ctrl[i] == c)
+      m |= 1u << i;
+  }
+  return m;
+#endif
+}
+
+/* Helper: return a bitmask of the empty or deleted slots in the group at
+ * 'ctrl'. */
+static INLINE unsigned
+oaht_group_free(const unsigned char *ctrl)
+{
+#ifdef OAHT_USE_SSE2
+  return (unsigned)_mm_movemask_epi8(
+                        _mm_loadu_si128((const __m128i *)ctrl));
+#else
+  unsigned i, m = 0;
+  for (i = 0; i < OAHT_GROUP; ++i) {
+    if (ctrl[i] & 0x80)
+      m |= 1u << i;
+  }
+  return m;
+#endif
+}
+
+/* Helper: return the index of the lowest set bit of the nonzero 'm'. */
+static INLINE unsigned
+oaht_lowest_bit(unsigned m)
+{
+#ifdef __GNUC__
+  return (unsigned)__builtin_ctz(m);
+#else
+  unsigned i = 0;
+  while (!(m & 1)) {
+    m >>= 1;
+    ++i;
+  }
+  return i;
+#endif
+}
+
+#define OAHT_HEAD(name, type)                                           \
+  struct name {                                                         \
+    /* One control byte per slot: OAHT_CTRL_EMPTY, OAHT_CTRL_DELETED, or \
+     * the low 7 bits of the hash of the element in that slot. */       \
+    unsigned char *hth_ctrl;                                            \
+    /* The elements themselves. */                                      \
+    struct type **hth_table;                                            \
+    /* How long is the hash table?  Always a multiple of OAHT_GROUP. */ \
+    unsigned hth_table_length;                                          \
+    /* How many elements does the table contain? */                     \
+    unsigned hth_n_entries;                                             \
+    /* How many slots hold a deleted marker? */                         \
+    unsigned hth_n_deleted;                                             \
+    /* How many used and deleted slots before we rebuild the table? */  \
+    unsigned hth_load_limit;                                            \
+  }
+
+#define OAHT_INITIALIZER()                                              \
+  { NULL, NULL, 0, 0, 0, 0 }
+
+#define OAHT_ENTRY(type)                                                \
+  struct {                                                              \
+    unsigned hte_hash;                                                  \
+  }
+
+#define OAHT_PROTOTYPE(name, type, field, hashfn, eqfn)                 \
+  int name##_HT_GROW(struct name *ht, unsigned min_capacity);           \
+  void name##_HT_CLEAR(struct name *ht);                                \
+  int _##name##_HT_REP_IS_BAD(const struct name *ht);                   \
+  static INLINE void                                                    \
+  name##_HT_INIT(struct name *head) {                                   \
+    head->hth_ctrl = NULL;                                              \
+    head->hth_table = NULL;                                             \
+    head->hth_table_length = 0;                                         \
+    head->hth_n_entries = 0;                                            \
+    head->hth_n_deleted = 0;                                            \
+    head->hth_load_limit = 0;                                           \
+  }                                                                     \
+  /* Helper: return the index of the slot in 'head' holding an element  \
+   * matching 'elm', or -1 if there is none. */                         \
+  static INLINE int                                                     \
+  _##name##_HT_FIND_IDX(const struct name *head, struct type *elm)      \
+  {                                                                     \
+    unsigned h, pos, step = 0, mask, m;                                 \
+    struct type *e;                                                     \
+    elm->field.hte_hash = h = ht_improve_hash(hashfn(elm));             \
+    if (!head->hth_table)                                               \
+      return -1;                                                        \
+    mask = head->hth_table_length - 1;                                  \
+    pos = (h >> 7) * OAHT_GROUP & mask;                                 \
+    while (1) {                                                         \
+      m = oaht_group_match(head->hth_ctrl + pos, OAHT_CTRL_TAG(h));     \
+      while (m) {                                                       \
+        e = head->hth_table[pos + oaht_lowest_bit(m)];                  \
+        if (e->field.hte_hash == h && eqfn(e, elm))                     \
+          return (int)(pos + oaht_lowest_bit(m));                       \
+        m &= m - 1;                                                     \
+      }                                                                 \
+      if (oaht_group_match(head->hth_ctrl + pos, OAHT_CTRL_EMPTY))      \
+        return -1;                                                      \
+      step += OAHT_GROUP;                                               \
+      pos = (pos + step) & mask;                                        \
+    }                                                                   \
+  }                                                                     \
+  /* Helper: mark slot 'idx' of 'head' as free.  If its group already has \
+   * an empty slot, no probe ever went past that group, so the slot can be \
+   * made empty too; otherwise leave a deleted marker. */               \
+  static INLINE void                                                    \
+  _##name##_HT_FREE_IDX(struct name *head, unsigned idx)                \
+  {                                                                     \
+    unsigned char *group = head->hth_ctrl + (idx & ~(OAHT_GROUP-1));    \
+    if (oaht_group_match(group, OAHT_CTRL_EMPTY)) {                     \
+      head->hth_ctrl[idx] = OAHT_CTRL_EMPTY;                            \
+    } else {                                                            \
+      head->hth_ctrl[idx] = OAHT_CTRL_DELETED;                          \
+      ++head->hth_n_deleted;                                            \
+    }                                                                   \
+    head->hth_table[idx] = NULL;                                        \
+    --head->hth_n_entries;                                              \
+  }                                                                     \
+  /* Helper: put 'elm', whose hash is already set, into the first free  \
+   * slot on its probe sequence in 'head'. */                           \
+  static INLINE void                                                    \
+  _##name##_HT_PLACE(struct name *head, struct type *elm)               \
+  {                                                                     \
+    unsigned h = elm->field.hte_hash, step = 0, idx, m;                 \
+    unsigned mask = head->hth_table_length - 1;                         \
+    unsigned pos = (h >> 7) * OAHT_GROUP & mask;                        \
+    while (!(m = oaht_group_free(head->hth_ctrl + pos))) {              \
+      step += OAHT_GROUP;                                               \
+      pos = (pos + step) & mask;                                        \
+    }                                                                   \
+    idx = pos + oaht_lowest_bit(m);                                     \
+    if (head->hth_ctrl[idx] == OAHT_CTRL_DELETED)                       \
+      --head->hth_n_deleted;                                            \
+    head->hth_ctrl[idx] = OAHT_CTRL_TAG(h);                             \
+    head->hth_table[idx] = elm;                                         \
+    ++head->hth_n_entries;                                              \
+  }                                                                     \
+  /* Return a pointer to the element in the table 'head' matching 'elm', \
+   * or NULL if no such element exists */                               \
+  static INLINE struct type *                                           \
+  name##_HT_FIND(const struct name *head, struct type *elm)             \
+  {                                                                     \
+    int idx = _##name##_HT_FIND_IDX(head, elm);                         \
+    return idx < 0 ? NULL : head->hth_table[idx];                       \
+  }                                                                     \
+  /* Insert the element 'elm' into the table 'head'.  Do not call this  \
+   * function if the table might already contain a matching element. */ \
+  static INLINE void                                                    \
+  name##_HT_INSERT(struct name *head, struct type *elm)                 \
+  {                                                                     \
+    if (head->hth_n_entries + head->hth_n_deleted >= head->hth_load_limit) \
+      name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    elm->field.hte_hash = ht_improve_hash(hashfn(elm));                 \
+    _##name##_HT_PLACE(head, elm);                                      \
+  }                                                                     \
+  /* Insert the element 'elm' into the table 'head'. If there already   \
+   * a matching element in the table, replace that element and return   \
+   * it. */                                                             \
+  static INLINE struct type *                                           \
+  name##_HT_REPLACE(struct name *head, struct type *elm)                \
+  {                                                                     \
+    struct type *r;                                                     \
+    int idx = _##name##_HT_FIND_IDX(head, elm);                         \
+    if (idx >= 0) {                                                     \
+      r = head->hth_table[idx];                                         \
+      head->hth_table[idx] = elm;                                       \
+      return r == elm ? NULL : r;                                       \
+    }                                                                   \
+    name##_HT_INSERT(head, elm);                                        \
+    return NULL;                                                        \
+  }                                                                     \
+  /* Remove any element matching 'elm' from the table 'head'.  If such  \
+   * an element is found, return it; otherwise return NULL. */          \
+  static INLINE struct type *                                           \
+  name##_HT_REMOVE(struct name *head, struct type *elm)                 \
+  {                                                                     \
+    struct type *r;                                                     \
+    int idx = _##name##_HT_FIND_IDX(head, elm);                         \
+    if (idx < 0)                                                        \
+      return NULL;                                                      \
+    r = head->hth_table[idx];                                           \
+    _##name##_HT_FREE_IDX(head, (unsigned)idx);                         \
+    return r;                                                           \
+  }                                                                     \
+  /* Invoke the function 'fn' on every element of the table 'head',     \
+   * using 'data' as its second argument.  If the function returns      \
+   * nonzero, remove the most recently examined element before invoking \
+   * the function again. */                                             \
+  static INLINE void                                                    \
+  name##_HT_FOREACH_FN(struct name *head,                               \
+                       int (*fn)(struct type *, void *),                \
+                       void *data)                                      \
+  {                                                                     \
+    unsigned idx;                                                       \
+    for (idx = 0; idx < head->hth_table_length; ++idx) {                \
+      if (OAHT_CTRL_IS_FULL(head->hth_ctrl[idx]) &&                     \
+          fn(head->hth_table[idx], data))                               \
+        _##name##_HT_FREE_IDX(head, idx);                               \
+    }                                                                   \
+  }                                                                     \
+  /* Helper: return a pointer to the first used slot of 'head' at or    \
+   * after 'idx', or NULL if there is none. */                          \
+  static INLINE struct type **                                          \
+  _##name##_HT_SCAN(struct name *head, unsigned idx)                    \
+  {                                                                     \
+    while (idx < head->hth_table_length) {                              \
+      if (OAHT_CTRL_IS_FULL(head->hth_ctrl[idx]))                       \
+        return &head->hth_table[idx];                                   \
+      ++idx;                                                            \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+  /* Return a pointer to the first element in the table 'head', under   \
+   * an arbitrary order.  This order is stable under remove operations, \
+   * but not under others. If the table is empty, return NULL. */       \
+  static INLINE struct type **                                          \
+  name##_HT_START(struct name *head)                                    \
+  {                                                                     \
+    return _##name##_HT_SCAN(head, 0);                                  \
+  }                                                                     \
+  /* Return the next element in 'head' after 'elm', under the arbitrary \
+   * order used by HT_START.  If there are no more elements, return     \
+   * NULL. */                                                           \
+  static INLINE struct type **                                          \
+  name##_HT_NEXT(struct name *head, struct type **elm)                  \
+  {                                                                     \
+    return _##name##_HT_SCAN(head, (unsigned)(elm - head->hth_table) + 1); \
+  }                                                                     \
+  static INLINE struct type **                                          \
+  name##_HT_NEXT_RMV(struct name *head, struct type **elm)              \
+  {                                                                     \
+    unsigned idx = (unsigned)(elm - head->hth_table);                   \
+    _##name##_HT_FREE_IDX(head, idx);                                   \
+    return _##name##_HT_SCAN(head, idx + 1);                            \
+  }
+
+#define OAHT_GENERATE(name, type, field, hashfn, eqfn, load)            \
+  /* Rebuild the internal table of 'head' so that it can hold 'size'    \
+   * elements, dropping every deleted marker.  Return 0 on success. */  \
+  int                                                                   \
+  name##_HT_GROW(struct name *head, unsigned size)                      \
+  {                                                                     \
+    unsigned new_len = OAHT_GROUP, idx;                                 \
+    unsigned char *old_ctrl = head->hth_ctrl;                           \
+    struct type **old_table = head->hth_table;                          \
+    unsigned old_len = head->hth_table_length;                          \
+    if (size < head->hth_n_entries + 1)                                 \
+      size = head->hth_n_entries + 1;                                   \
+    while ((unsigned)(load*new_len) <= size)                            \
+      new_len <<= 1;                                                    \
+    head->hth_ctrl = tor_malloc(new_len);                               \
+    memset(head->hth_ctrl, OAHT_CTRL_EMPTY, new_len);                   \
+    head->hth_table = tor_malloc_zero(new_len*sizeof(struct type*));    \
+    head->hth_table_length = new_len;                                   \
+    head->hth_load_limit = (unsigned)(load*new_len);                    \
+    head->hth_n_entries = 0;                                            \
+    head->hth_n_deleted = 0;                                            \
+    for (idx = 0; idx < old_len; ++idx) {                               \
+      if (OAHT_CTRL_IS_FULL(old_ctrl[idx]))                             \
+        _##name##_HT_PLACE(head, old_table[idx]);                       \
+    }                                                                   \
+    tor_free(old_ctrl);                                                 \
+    tor_free(old_table);                                                \
+    return 0;                                                           \
+  }                                                                     \
+  /* Free all storage held by 'head'.  Does not free 'head' itself, or  \
+   * individual elements. */                                            \
+  void                                                                  \
+  name##_HT_CLEAR(struct name *head)                                    \
+  {                                                                     \
+    tor_free(head->hth_ctrl);                                           \
+    tor_free(head->hth_table);                                          \
+    name##_HT_INIT(head);                                               \
+  }                                                                     \
+  /* Debugging helper: return false iff the representation of 'head' is \
+   * internally consistent. */                                          \
+  int                                                                   \
+  _##name##_HT_REP_IS_BAD(const struct name *head)                      \
+  {                                                                     \
+    unsigned n = 0, n_deleted = 0, i;                                   \
+    struct type *elm;                                                   \
+    if (!head->hth_table_length) {                                      \
+      if (!head->hth_table && !head->hth_ctrl && !head->hth_n_entries && \
+          !head->hth_n_deleted && !head->hth_load_limit)                \
+        return 0;                                                       \
+      else                                                              \
+        return 1;                                                       \
+    }                                                                   \
+    if (!head->hth_table || !head->hth_ctrl || !head->hth_load_limit)   \
+      return 2;                                                         \
+    if (head->hth_n_entries + head->hth_n_deleted > head->hth_load_limit || \
+        head->hth_load_limit >= head->hth_table_length)                 \
+      return 3;                                                         \
+    if (head->hth_table_length & (head->hth_table_length - 1))          \
+      return 4;                                                         \
+    for (i = 0; i < head->hth_table_length; ++i) {                      \
+      if (head->hth_ctrl[i] == OAHT_CTRL_DELETED) {                     \
+        ++n_deleted;                                                    \
+        continue;                                                       \
+      }                                                                 \
+      if (!OAHT_CTRL_IS_FULL(head->hth_ctrl[i]))                        \
+        continue;                                                       \
+      elm = head->hth_table[i];                                         \
+      if (elm->field.hte_hash != ht_improve_hash(hashfn(elm)))          \
+        return 1000 + i;                                                \
+      if (head->hth_ctrl[i] != OAHT_CTRL_TAG(elm->field.hte_hash))      \
+        return 10000 + i;                                               \
+      if (_##name##_HT_FIND_IDX(head, elm) != (int)i)                   \
+        return 100000 + i;                                              \
+      ++n;                                                              \
+    }                                                                   \
+    if (n != head->hth_n_entries || n_deleted != head->hth_n_deleted)   \
+      return 6;                                                         \
+    return 0;                                                           \
+  }
+
 /*
  * Copyright 2005, Nick Mathewson.  Implementation logic is adapted from code
  * by Christopher Clark, retrofit to allow drop-in memory management, and to
@@ -34,16 +34,36 @@ const char log_c_id[] = "$Id: log.c 14222 2008-03-27 17:25:49Z weasel $";
 
 HWND hdialog=NULL;
 HANDLE hfile=NULL;
-int lseverity=LOG_WARN;
+/** The least severe level that is logged anywhere, and the domains that
+ * are logged.  The log macros check these before evaluating their
+ * arguments. */
+int _log_global_min_severity=LOG_WARN;
+log_domain_mask_t _log_global_domain_mask=~0u;
 char *logfilter=NULL,fltlocked=0;
+static log_filter_t *compiled_logfilter=NULL;
 smartlist_t *logcache=NULL;
 
+/** How many lines do we keep for the log window while it is closed?  When
+ * the cache grows past this, the oldest half of it is thrown away. */
+#define MAX_LOG_CACHE_LEN 2000
+
+/** Throw away the <b>n</b> oldest lines of the log cache. */
+static void log_cache_drop_oldest(int n)
+{	int i;
+	for(i = 0; i < n; i++)
+		tor_free_tagged(MEM_TAG_LOG_CACHE,logcache->list[i],strlen(logcache->list[i])+1);
+	memmove(logcache->list, logcache->list + n, (smartlist_len(logcache) - n) * sizeof(void *));
+	logcache->num_used -= n;
+}
+
 void cache_log(char *str)
 {
 	if(logcache==NULL)
 	{	logcache = smartlist_create();
 	}
-	smartlist_add(logcache,tor_strdup(str));
+	else if(smartlist_len(logcache) >= MAX_LOG_CACHE_LEN)
+		log_cache_drop_oldest(MAX_LOG_CACHE_LEN/2);
+	smartlist_add(logcache,tor_strdup_tagged(MEM_TAG_LOG_CACHE,str));
 }
 
 void setDialog(HWND hDlg)
@@ -57,7 +77,7 @@ HWND getDialog(void)
 HANDLE open_file(char *fname,DWORD access,DWORD creationDistribution);
 
 void setLog(int severity,char *fname)
-{	lseverity=severity;
+{	_log_global_min_severity=severity;
 	if(fname)
 	{	hfile=open_file(fname,GENERIC_READ|GENERIC_WRITE,OPEN_ALWAYS);
 		if(hfile==INVALID_HANDLE_VALUE) hfile=NULL;
@@ -74,16 +94,26 @@ char *getLogFilter(void)
 }
 
 void setLogFilter(char *filter)
-{	while(fltlocked) Sleep(10);
+{	log_filter_t *compiled=filter?log_filter_new(filter):NULL,*old;
+	while(fltlocked) Sleep(10);
 	fltlocked++;
 	if(logfilter) tor_free(logfilter);
 	logfilter=filter;
+	old=compiled_logfilter;
+	compiled_logfilter=compiled;
 	fltlocked=0;
+	log_filter_free(old);
 }
 
 void setLogging(int severity)
-{	lseverity=severity;
-//	_log_global_min_severity=severity;
+{	_log_global_min_severity=severity;
+}
+
+/** Only log messages in the domains in <b>mask</b>; if <b>mask</b> is 0,
+ * log every domain.  Bugs are always logged. */
+void setLogDomains(log_domain_mask_t mask)
+{	if(!mask)	_log_global_domain_mask=~0u;
+	else	_log_global_domain_mask=(mask|LD_BUG)&~LD_NOCB;
 }
 
 #ifndef PBM_SETPOS
@@ -160,9 +190,6 @@ static void logv(int severity, log_domain_mask_t domain, const char *funcname,
                  const char *format, va_list ap)
   CHECK_PRINTF(4,0);
 
-/* What's the lowest log level anybody cares about? */
-//int _log_global_min_severity = LOG_NOTICE;
-
 static void close_log(logfile_t *victim);
 
 /** Name of the application: used to generate the message we write at the
@@ -247,36 +274,174 @@ format_msg(char *buf, size_t buf_len,
   return end_of_prefix;
 }
 
-/** Helper: sends a message to the appropriate logfiles, at loglevel
- * <b>severity</b>.  If provided, <b>funcname</b> is prepended to the
- * message.  The actual message is derived as from tor_snprintf(format,ap).
- */
-static void
-logv(int severity, log_domain_mask_t domain, const char *funcname,
-     const char *format, va_list ap)
+/** The largest transition table, in entries, that we build for a log
+ * filter.  Longer filters are matched one pattern at a time. */
+#define LOG_FILTER_MAX_TABLE (1<<21)
+
+/** A log filter, compiled into an Aho-Corasick automaton so that we look at
+ * each byte of a message once, however many patterns the filter has.  The
+ * patterns are the runs of printable characters in the filter text; a
+ * message matches if any pattern occurs in it without crossing a control
+ * character. */
+struct log_filter_t {
+  /** Number of byte classes.  Class 0 holds every byte that isn't in any
+   * pattern, control characters included; it always leads back to the
+   * root. */
+  int n_classes;
+  /** Byte class of each byte value. */
+  uint8_t byte_class[256];
+  /** n_classes transitions for each state, or NULL if the table would have
+   * been too large. */
+  int *next;
+  /** For each state: true iff some pattern ends there. */
+  char *is_match;
+  /** The filter text, used when <b>next</b> is NULL. */
+  char *patterns;
+};
+
+/** Helper: return true iff one of the patterns in <b>patterns</b> occurs in
+ * <b>msg</b>, looking at one pattern at a time. */
+static int
+log_filter_scan(const char *patterns, const char *msg)
 {
-  char buf[10024];
-  int i,j,k;
-  unsigned long txtsize = 0;
-  if((severity<=lseverity)&&((!fltlocked)||(!logfilter)))
-  {
-	format_msg(buf, sizeof(buf), domain, severity, funcname, format, ap);
-	txtsize=strlen(buf);
-  	if((logfilter&&(hfile||hdialog))&&(!fltlocked))
+	int i,j,k;
+	for(j=0;patterns[j];)
+	{	for(i=0;msg[i];i++)
+		{
+			for(k=0;;k++) if(((unsigned char)msg[k+i]!=(unsigned char)patterns[k+j])||((unsigned char)patterns[k+j]<32)||((unsigned char)msg[k+i]<32)) break;
+			if((k!=0)&&((unsigned char)patterns[k+j]<32)) return 1;
+		}
+		while((unsigned char)patterns[j]>=32)	j++;
+		while((patterns[j]!=0)&&((unsigned char)patterns[j]<32)) j++;
+	}
+	return 0;
+}
+
+/** Compile the log filter text <b>filter</b> and return the result. */
+log_filter_t *
+log_filter_new(const char *filter)
+{
+  log_filter_t *lf = tor_malloc_zero(sizeof(log_filter_t));
+  const unsigned char *cp;
+  int n_states, max_states = 1, nc, s, c;
+  int *fail, *queue, q_head = 0, q_tail = 0;
+
+  lf->n_classes = 1;
+  for (cp = (const unsigned char *)filter; *cp; ++cp) {
+    if (*cp < 32)
+      continue;
+    ++max_states;
+    if (!lf->byte_class[*cp])
+      lf->byte_class[*cp] = lf->n_classes++;
+  }
+  nc = lf->n_classes;
+  if ((uint64_t)max_states * nc > LOG_FILTER_MAX_TABLE) {
+    lf->patterns = tor_strdup(filter);
+    return lf;
+  }
+
+  /* Build the trie.  Missing transitions are -1 for now. */
+  lf->next = tor_malloc(sizeof(int) * max_states * nc);
+  memset(lf->next, 0xff, sizeof(int) * max_states * nc);
+  lf->is_match = tor_malloc_zero(max_states);
+  n_states = 1;
+  for (cp = (const unsigned char *)filter; *cp; ) {
+    s = 0;
+    for ( ; *cp >= 32; ++cp) {
+      int *t = &lf->next[s*nc + lf->byte_class[*cp]];
+      if (*t < 0)
+        *t = n_states++;
+      s = *t;
+    }
+    if (s)
+      lf->is_match[s] = 1;
+    while (*cp && *cp < 32)
+      ++cp;
+  }
+
+  /* Compute the failure links breadth first, and replace each missing
+   * transition with the one from the state's failure link. */
+  fail = tor_malloc_zero(sizeof(int) * n_states);
+  queue = tor_malloc(sizeof(int) * n_states);
+  for (c = 0; c < nc; ++c) {
+    int t = lf->next[c];
+    if (t < 0) {
+      lf->next[c] = 0;
+    } else {
+      fail[t] = 0;
+      queue[q_tail++] = t;
+    }
+  }
+  while (q_head < q_tail) {
+    s = queue[q_head++];
+    lf->is_match[s] |= lf->is_match[fail[s]];
+    for (c = 0; c < nc; ++c) {
+      int t = lf->next[s*nc + c];
+      int f = lf->next[fail[s]*nc + c];
+      if (t < 0) {
+        lf->next[s*nc + c] = f;
+      } else {
+        fail[t] = f;
+        queue[q_tail++] = t;
+      }
+    }
+  }
+  tor_free(fail);
+  tor_free(queue);
+  return lf;
+}
+
+/** Return true iff the log filter <b>lf</b> matches the message
+ * <b>msg</b>. */
+int
+log_filter_matches(const log_filter_t *lf, const char *msg)
+{
+  const unsigned char *cp;
+  int s = 0;
+  if (!lf->next)
+    return log_filter_scan(lf->patterns, msg);
+  for (cp = (const unsigned char *)msg; *cp; ++cp) {
+    s = lf->next[s*lf->n_classes + lf->byte_class[*cp]];
+    if (lf->is_match[s])
+      return 1;
+  }
+  return 0;
+}
+
+/** Release all storage held by the log filter <b>lf</b>. */
+void
+log_filter_free(log_filter_t *lf)
+{
+  if (!lf)
+    return;
+  tor_free(lf->next);
+  tor_free(lf->is_match);
+  tor_free(lf->patterns);
+  tor_free(lf);
+}
+
+/** Helper: return true iff the log filter says that the formatted log line
+ * in <b>buf</b> should not be shown. */
+static int
+log_is_filtered(const char *buf)
+{
+	int r=0;
+	if((compiled_logfilter&&(hfile||hdialog))&&(!fltlocked))
 	{
 		fltlocked++;
-	//	asm(".intel_syntax noprefix\nint 3\n.att_syntax prefix");
-		for(j=0;logfilter[j];)
-		{	for(i=0;buf[i];i++)
-			{
-				for(k=0;;k++) if(((unsigned char)buf[k+i]!=(unsigned char)logfilter[k+j])||((unsigned char)logfilter[k+j]<32)||((unsigned char)buf[k+i]<32)) break;
-				if((k!=0)&&((unsigned char)logfilter[k+j]<32)){	fltlocked=0;return;}
-			}
-			while((unsigned char)logfilter[j]>=32)	j++;
-			while((logfilter[j]!=0)&&((unsigned char)logfilter[j]<32)) j++;
-		}
+		r=log_filter_matches(compiled_logfilter,buf);
 		fltlocked=0;
 	}
+	return r;
+}
+
+/** Helper: send the formatted log line in <b>buf</b>, which may be modified,
+ * to the log file and to the log window (or to the cache we show when the
+ * window is opened). */
+static void
+log_output(char *buf, int severity)
+{
+	unsigned long txtsize = strlen(buf);
 	if(hfile!=NULL)	WriteFile(hfile,buf,txtsize,&txtsize,0);
 	buf[11]='[';
 	if(hdialog!=NULL)	LangReplaceSel(&buf[11],hdialog);
@@ -284,6 +449,305 @@ logv(int severity, log_domain_mask_t domain, const char *funcname,
 	else
 	{	cache_log(&buf[11]);
 	}
+}
+
+#ifdef USE_WIN32_THREADS
+/* Asynchronous logging.  When it is on, logv() only formats each message
+ * into a slot of a fixed-size ring, and a background thread writes the
+ * slots to the log file and the log window in batches.  The ring is a
+ * bounded queue in the usual sequence-number style: each slot's <b>seq</b>
+ * says whether it is free for the producer at that position or full for the
+ * consumer at that position, and producers and consumers claim positions by
+ * compare-and-swap, so no thread ever waits on a lock to log. */
+
+/** How long a formatted message may be in async mode; longer ones are
+ * truncated. */
+#define LOG_RING_MSG_LEN 2048
+/** The smallest and largest number of ring slots we allow. */
+#define LOG_RING_MIN_SLOTS 16
+#define LOG_RING_MAX_SLOTS 65536
+/** How often, in msec, does the log thread drain the ring when nothing
+ * urgent wakes it? */
+#define LOG_RING_DRAIN_MSEC 100
+/** How many bytes of log file or log window text do we collect before
+ * writing them out? */
+#define LOG_RING_FILE_BATCH 65536
+#define LOG_RING_DIALOG_BATCH 8192
+
+/** One slot of the log ring. */
+typedef struct log_ring_entry_t {
+	volatile LONG seq; /**< Position this slot is ready for; see above. */
+	int severity; /**< Severity of the message in this slot. */
+	char msg[LOG_RING_MSG_LEN]; /**< The formatted message. */
+} log_ring_entry_t;
+
+/** The ring of formatted messages, or NULL if async logging was never
+ * started.  It has log_ring_mask+1 slots. */
+static log_ring_entry_t *log_ring = NULL;
+static LONG log_ring_mask = 0;
+/** Next position to fill, and next position to drain. */
+static volatile LONG log_ring_head = 0, log_ring_tail = 0;
+/** True iff logv() should put messages in the ring. */
+static volatile int log_ring_active = 0;
+/** When the ring is full: if true, throw away the oldest message to make
+ * room; else throw away the new one. */
+static volatile int log_ring_drop_oldest = 1;
+/** Messages dropped since the log thread last reported it, and in all. */
+static volatile LONG log_ring_n_dropped = 0;
+static uint64_t log_ring_total_dropped = 0;
+/** Held while draining, so that messages come out in order. */
+static tor_mutex_t *log_ring_drain_mutex = NULL;
+/** Signaled to make the log thread drain now, and by the log thread when it
+ * exits. */
+static HANDLE log_ring_wakeup = NULL, log_ring_exited = NULL;
+/** True iff the log thread should finish up and exit. */
+static volatile int log_ring_exiting = 0;
+/** True iff the log thread is running. */
+static int log_ring_thread_running = 0;
+
+/** Claim the oldest full slot of the ring, copy its message into
+ * <b>buf</b> (if provided) and its severity into *<b>severity</b>, and free
+ * the slot.  Return 1 on success, 0 if the ring is empty. */
+static int
+log_ring_take(char *buf, int *severity)
+{
+	for(;;)
+	{	LONG pos = log_ring_tail;
+		log_ring_entry_t *e = &log_ring[pos & log_ring_mask];
+		LONG dif = e->seq - (pos + 1);
+		if(dif == 0)
+		{	if(InterlockedCompareExchange(&log_ring_tail, pos + 1, pos) == pos)
+			{	if(buf)
+				{	memcpy(buf, e->msg, LOG_RING_MSG_LEN);
+					*severity = e->severity;
+				}
+				InterlockedExchange(&e->seq, pos + log_ring_mask + 1);
+				return 1;
+			}
+		}
+		else if(dif < 0)
+			return 0;
+	}
+}
+
+/** Claim the next free slot of the ring and return it, setting *<b>pos</b>
+ * to its position.  If the ring is full, drop a message as configured;
+ * return NULL if it was the new one. */
+static log_ring_entry_t *
+log_ring_reserve(LONG *pos_out)
+{
+	for(;;)
+	{	LONG pos = log_ring_head;
+		log_ring_entry_t *e = &log_ring[pos & log_ring_mask];
+		LONG dif = e->seq - pos;
+		if(dif == 0)
+		{	if(InterlockedCompareExchange(&log_ring_head, pos + 1, pos) == pos)
+			{	*pos_out = pos;
+				return e;
+			}
+		}
+		else if(dif < 0)
+		{	/* The ring is full. */
+			if(!log_ring_drop_oldest)
+			{	InterlockedIncrement(&log_ring_n_dropped);
+				return NULL;
+			}
+			if(log_ring_take(NULL, NULL))
+			{	InterlockedIncrement(&log_ring_n_dropped);
+				SetEvent(log_ring_wakeup);
+			}
+		}
+	}
+}
+
+/** Format a message into the ring, and wake the log thread if the message
+ * is urgent or the ring is getting full. */
+static void
+log_ring_add(int severity, log_domain_mask_t domain, const char *funcname,
+             const char *format, va_list ap)
+{
+	LONG pos;
+	log_ring_entry_t *e = log_ring_reserve(&pos);
+	if(!e)	return;
+	format_msg(e->msg, sizeof(e->msg), domain, severity, funcname, format, ap);
+	e->severity = severity;
+	InterlockedExchange(&e->seq, pos + 1);
+	if(severity <= LOG_WARN || pos - log_ring_tail >= (log_ring_mask + 1) / 2)
+		SetEvent(log_ring_wakeup);
+}
+
+/** Write everything in the ring to the log file and the log window.  The
+ * file gets one write per LOG_RING_FILE_BATCH bytes, and the window one
+ * update per LOG_RING_DIALOG_BATCH bytes. */
+static void
+log_ring_drain(void)
+{
+	char msg[LOG_RING_MSG_LEN];
+	char *filebuf, *dlgbuf;
+	size_t filelen = 0, dlglen = 0;
+	unsigned long written;
+	int severity;
+	LONG dropped;
+
+	if(!log_ring)	return;
+	filebuf = tor_malloc(LOG_RING_FILE_BATCH);
+	dlgbuf = tor_malloc(LOG_RING_DIALOG_BATCH);
+	tor_mutex_acquire(log_ring_drain_mutex);
+	while(log_ring_take(msg, &severity))
+	{	size_t len;
+		if(log_is_filtered(msg))	continue;
+		len = strlen(msg);
+		if(hfile!=NULL)
+		{	if(filelen + len > LOG_RING_FILE_BATCH)
+			{	WriteFile(hfile,filebuf,filelen,&written,0);
+				filelen = 0;
+			}
+			memcpy(filebuf + filelen, msg, len);
+			filelen += len;
+		}
+		msg[11]='[';
+		if(hdialog!=NULL)
+		{	if(dlglen + len - 11 + 1 > LOG_RING_DIALOG_BATCH)
+			{	LangReplaceSel(dlgbuf,hdialog);
+				dlglen = 0;
+			}
+			memcpy(dlgbuf + dlglen, msg + 11, len - 11 + 1);
+			dlglen += len - 11;
+		}
+		else if((!hfile)&&(severity<=LOG_ERR)) MessageBox(0,&msg[11+11],"Error",MB_OK);
+		else	cache_log(&msg[11]);
+	}
+	if(filelen && hfile!=NULL)	WriteFile(hfile,filebuf,filelen,&written,0);
+	if(dlglen && hdialog!=NULL)	LangReplaceSel(dlgbuf,hdialog);
+	tor_mutex_release(log_ring_drain_mutex);
+	tor_free(filebuf);
+	tor_free(dlgbuf);
+
+	dropped = InterlockedExchange(&log_ring_n_dropped, 0);
+	if(dropped)
+	{	log_ring_total_dropped += dropped;
+		log_notice(LD_GENERAL,get_lang_str(LANG_LOG_LOG_ASYNC_DROPPED),(int)dropped);
+	}
+}
+
+/** Main function for the log thread: drain the ring every
+ * LOG_RING_DRAIN_MSEC, or sooner when woken. */
+static void
+log_ring_main(void *arg)
+{
+	(void)arg;
+	while(!log_ring_exiting)
+	{	WaitForSingleObject(log_ring_wakeup,LOG_RING_DRAIN_MSEC);
+		log_ring_drain();
+	}
+	SetEvent(log_ring_exited);
+	spawn_exit();
+}
+
+/** Stop the log thread, if it is running, and write out whatever it left in
+ * the ring. */
+static void
+log_ring_stop(void)
+{
+	log_ring_active = 0;
+	if(log_ring_thread_running)
+	{	log_ring_exiting = 1;
+		SetEvent(log_ring_wakeup);
+		WaitForSingleObject(log_ring_exited,INFINITE);
+		log_ring_thread_running = 0;
+	}
+	if(log_ring)	log_ring_drain();
+}
+#endif
+
+/** Throw away the oldest half of the lines kept for the log window. */
+void
+log_cache_shrink(void)
+{
+#ifdef USE_WIN32_THREADS
+	tor_mutex_t *m = log_ring_drain_mutex;
+	if(m)	tor_mutex_acquire(m);
+#endif
+	if(logcache)	log_cache_drop_oldest((smartlist_len(logcache) + 1) / 2);
+#ifdef USE_WIN32_THREADS
+	if(m)	tor_mutex_release(m);
+#endif
+}
+
+/** Turn asynchronous logging on with a ring of <b>slots</b> messages, or off
+ * if <b>slots</b> is 0.  When the ring is full, drop the oldest message if
+ * <b>drop_oldest</b>, else the new one.  The ring is sized when async
+ * logging is first turned on; later changes to <b>slots</b> are ignored.
+ * Returns 0 on success, -1 if async logging couldn't be started. */
+int
+setLogAsync(int slots,int drop_oldest)
+{
+#ifdef USE_WIN32_THREADS
+	log_ring_drop_oldest = drop_oldest;
+	if(!slots)
+	{	log_ring_stop();
+		return 0;
+	}
+	if(log_ring_thread_running)
+		return 0;
+	if(!log_ring)
+	{	LONG n = LOG_RING_MIN_SLOTS, i;
+		while(n < slots && n < LOG_RING_MAX_SLOTS)	n <<= 1;
+		log_ring = tor_malloc(sizeof(log_ring_entry_t) * n);
+		for(i = 0; i < n; i++)	log_ring[i].seq = i;
+		log_ring_mask = n - 1;
+		log_ring_head = log_ring_tail = 0;
+		log_ring_drain_mutex = tor_mutex_new();
+		log_ring_wakeup = CreateEvent(NULL,FALSE,FALSE,NULL);
+		log_ring_exited = CreateEvent(NULL,FALSE,FALSE,NULL);
+	}
+	log_ring_exiting = 0;
+	if(!log_ring_wakeup || !log_ring_exited || spawn_func(log_ring_main,NULL) < 0)
+		return -1;
+	log_ring_thread_running = 1;
+	log_ring_active = 1;
+	return 0;
+#else
+	(void)slots;
+	(void)drop_oldest;
+	return -1;
+#endif
+}
+
+/** Return a newly allocated string describing the async log ring, for the
+ * controller. */
+char *
+log_async_get_stats(void)
+{
+	unsigned char *result = NULL;
+#ifdef USE_WIN32_THREADS
+	tor_asprintf(&result,"enabled=%d queued=%ld slots=%ld dropped="U64_FORMAT,log_ring_active,log_ring ? (long)(log_ring_head - log_ring_tail) : 0L,log_ring ? (long)(log_ring_mask + 1) : 0L,U64_PRINTF_ARG(log_ring_total_dropped + log_ring_n_dropped));
+#else
+	tor_asprintf(&result,"enabled=0 queued=0 slots=0 dropped=0");
+#endif
+	return (char *)result;
+}
+
+/** Helper: sends a message to the appropriate logfiles, at loglevel
+ * <b>severity</b>.  If provided, <b>funcname</b> is prepended to the
+ * message.  The actual message is derived as from tor_snprintf(format,ap).
+ */
+static void
+logv(int severity, log_domain_mask_t domain, const char *funcname,
+     const char *format, va_list ap)
+{
+  char buf[10024];
+  if(!log_is_skipped(severity,domain)&&((!fltlocked)||(!logfilter)))
+  {
+#ifdef USE_WIN32_THREADS
+	if(log_ring_active)
+	{	log_ring_add(severity, domain, funcname, format, ap);
+		return;
+	}
+#endif
+	format_msg(buf, sizeof(buf), domain, severity, funcname, format, ap);
+	if(log_is_filtered(buf))	return;
+	log_output(buf, severity);
   }
 }
 
@@ -292,8 +756,8 @@ void
 _log(int severity, log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-/*  if (severity > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(severity, domain))
+    return;
   va_start(ap,format);
   logv(severity, domain, NULL, format, ap);
   va_end(ap);
@@ -306,8 +770,8 @@ _log_fn(int severity, log_domain_mask_t domain, const char *fn,
         const char *format, ...)
 {
   va_list ap;
-/*  if (severity > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(severity, domain))
+    return;
   va_start(ap,format);
   logv(severity, domain, fn, format, ap);
   va_end(ap);
@@ -318,8 +782,8 @@ void
 _log_fn(int severity, log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-/*  if (severity > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(severity, domain))
+    return;
   va_start(ap,format);
   logv(severity, domain, _log_fn_function_name, format, ap);
   va_end(ap);
@@ -330,8 +794,8 @@ _log_debug(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
   /* For GCC we do this check in the macro. */
-/*  if (PREDICT_LIKELY(LOG_DEBUG > _log_global_min_severity))
-    return;*/
+  if (log_is_skipped(LOG_DEBUG, domain))
+    return;
   va_start(ap,format);
   logv(LOG_DEBUG, domain, _log_fn_function_name, format, ap);
   va_end(ap);
@@ -341,8 +805,8 @@ void
 _log_info(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-/*  if (LOG_INFO > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(LOG_INFO, domain))
+    return;
   va_start(ap,format);
   logv(LOG_INFO, domain, _log_fn_function_name, format, ap);
   va_end(ap);
@@ -352,8 +816,8 @@ void
 _log_notice(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-/*  if (LOG_NOTICE > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(LOG_NOTICE, domain))
+    return;
   va_start(ap,format);
   logv(LOG_NOTICE, domain, _log_fn_function_name, format, ap);
   va_end(ap);
@@ -363,8 +827,8 @@ void
 _log_warn(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-/*  if (LOG_WARN > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(LOG_WARN, domain))
+    return;
   va_start(ap,format);
   logv(LOG_WARN, domain, _log_fn_function_name, format, ap);
   va_end(ap);
@@ -374,8 +838,8 @@ void
 _log_err(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-/*  if (LOG_ERR > _log_global_min_severity)
-    return;*/
+  if (log_is_skipped(LOG_ERR, domain))
+    return;
   va_start(ap,format);
   logv(LOG_ERR, domain, _log_fn_function_name, format, ap);
   va_end(ap);
@@ -408,9 +872,23 @@ logs_free_all(void)
     log_free(victim);
   }
   tor_free(appname);
+#ifdef USE_WIN32_THREADS
+  log_ring_stop();
+  if(log_ring)
+  {
+    tor_free(log_ring);
+    tor_mutex_free(log_ring_drain_mutex);
+    log_ring_drain_mutex = NULL;
+    CloseHandle(log_ring_wakeup);
+    CloseHandle(log_ring_exited);
+    log_ring_wakeup = log_ring_exited = NULL;
+  }
+#endif
   if(logcache)
   {
-    tor_free(logcache);
+    SMARTLIST_FOREACH(logcache, char *, s,
+                      tor_free_tagged(MEM_TAG_LOG_CACHE, s, strlen(s)+1));
+    smartlist_free(logcache);
     logcache = NULL;
   }
 }
@@ -650,6 +1128,34 @@ parse_log_level(const char *level)
   return -1;
 }
 
+/** Names of the logging domains, in bit order, for LogDomains. */
+static const char *domain_list[] = {
+  "GENERAL", "CRYPTO", "NET", "CONFIG", "FS", "PROTOCOL", "MM", "HTTP",
+  "APP", "CONTROL", "CIRC", "REND", "BUG", "DIR", "DIRSERV", "OR", "EDGE",
+  "ACCT", "HIST", "PLUGIN", "HANDSHAKE", NULL
+};
+
+/** Set *<b>mask_out</b> to the union of the logging domains named in
+ * <b>names</b>.  Return 0 on success, -1 if some name isn't a logging
+ * domain. */
+int
+parse_log_domains(const smartlist_t *names, log_domain_mask_t *mask_out)
+{
+  log_domain_mask_t mask = 0;
+  SMARTLIST_FOREACH(names, const char *, name, {
+    int i;
+    for (i = 0; domain_list[i]; ++i) {
+      if (!strcasecmp(name, domain_list[i]))
+        break;
+    }
+    if (!domain_list[i])
+      return -1;
+    mask |= (1u<<i);
+  });
+  *mask_out = mask;
+  return 0;
+}
+
 /** Return the string equivalent of a given log level. */
 const char *
 log_level_to_string(int level)
@@ -116,12 +116,21 @@ typedef struct log_severity_list_t {
 /** Given a severity, yields an index into log_severity_list_t.masks to use
  * for that severity. */
 #define SEVERITY_MASK_IDX(sev) ((sev) - LOG_ERR)
+
+/** A compiled log filter. */
+typedef struct log_filter_t log_filter_t;
+log_filter_t *log_filter_new(const char *filter);
+int log_filter_matches(const log_filter_t *lf, const char *msg);
+void log_filter_free(log_filter_t *lf);
 #endif
 
 /** Callback type used for add_callback_log. */
 typedef void (*log_callback)(int severity, uint32_t domain, const char *msg);
 
 int parse_log_level(const char *level);
+struct smartlist_t;
+int parse_log_domains(const struct smartlist_t *names,
+                      log_domain_mask_t *mask_out);
 const char *log_level_to_string(int level);
 int parse_log_severity_config(const char **cfg,
                               log_severity_list_t *severity_out);
@@ -149,36 +158,57 @@ char *getLogFilter(void);
 void progressLog(int percent,const char *message);
 void setLog(int severity,char *fname);
 void setLogging(int severity);
+void setLogDomains(log_domain_mask_t mask);
+int setLogAsync(int slots,int drop_oldest);
+char *log_async_get_stats(void);
 void cache_log(char *str);
+void log_cache_shrink(void);
+
+extern int _log_global_min_severity;
+extern log_domain_mask_t _log_global_domain_mask;
+
+/** True iff nothing would be logged for a message at level
+ * <b>severity</b> in <b>domain</b>.  The log macros check this before
+ * evaluating their arguments, so that a message nobody will see costs no
+ * formatting and no get_lang_str() lookup. */
+#define log_is_skipped(severity, domain)                            \
+  (PREDICT_UNLIKELY((severity) > _log_global_min_severity) ||       \
+   PREDICT_UNLIKELY(!((domain) & _log_global_domain_mask)))
 
 /* Outputs a message to stdout */
 void _log(int severity, log_domain_mask_t domain, const char *format, ...);
-#define log _log /* hack it so we don't conflict with log() as much */
 
 #ifdef __GNUC__
-//extern int _log_global_min_severity;
+/* hack it so we don't conflict with log() as much */
+#define log(severity, domain, args...)                              \
+  (log_is_skipped(severity, domain) ? (void)0 :                     \
+   _log(severity, domain, args))
 
 void _log_fn(int severity, log_domain_mask_t domain,
              const char *funcname, const char *format, ...);
 /** Log a message at level <b>severity</b>, using a pretty-printed version
  * of the current function name. */
-#define log_fn(severity, domain, args...)               \
-  _log_fn(severity, domain, __PRETTY_FUNCTION__, args)
-#define log_debug(domain, args...)                                      \
-  STMT_BEGIN                                                            \
-      _log_fn(LOG_DEBUG, domain, __PRETTY_FUNCTION__, args);            \
+#define log_fn(severity, domain, args...)                           \
+  (log_is_skipped(severity, domain) ? (void)0 :                     \
+   _log_fn(severity, domain, __PRETTY_FUNCTION__, args))
+#define log_debug(domain, args...)                                  \
+  STMT_BEGIN                                                        \
+    if (!log_is_skipped(LOG_DEBUG, domain))                         \
+      _log_fn(LOG_DEBUG, domain, __PRETTY_FUNCTION__, args);        \
   STMT_END
-#define log_info(domain, args...)                           \
-  _log_fn(LOG_INFO, domain, __PRETTY_FUNCTION__, args)
-#define log_notice(domain, args...)                         \
-  _log_fn(LOG_NOTICE, domain, __PRETTY_FUNCTION__, args)
-#define log_warn(domain, args...)                           \
-  _log_fn(LOG_WARN, domain, __PRETTY_FUNCTION__, args)
-#define log_err(domain, args...)                            \
-  _log_fn(LOG_ERR, domain, __PRETTY_FUNCTION__, args)
+#define log_info(domain, args...)                                   \
+  log_fn(LOG_INFO, domain, args)
+#define log_notice(domain, args...)                                 \
+  log_fn(LOG_NOTICE, domain, args)
+#define log_warn(domain, args...)                                   \
+  log_fn(LOG_WARN, domain, args)
+#define log_err(domain, args...)                                    \
+  log_fn(LOG_ERR, domain, args)
 
 #else /* ! defined(__GNUC__) */
 
+#define log _log /* hack it so we don't conflict with log() as much */
+
 void _log_fn(int severity, log_domain_mask_t domain, const char *format, ...);
 void _log_debug(log_domain_mask_t domain, const char *format, ...);
 void _log_info(log_domain_mask_t domain, const char *format, ...);
@@ -87,74 +87,172 @@ typedef struct memarea_chunk_t {
 
 /** What's the smallest that we'll allocate a chunk? */
 #define CHUNK_SIZE 4096
+/** What's the largest that an area will grow its chunks to?  Allocations
+ * bigger than this still get a chunk of their own. */
+#define MAX_CHUNK_SIZE (1024*1024)
 
 /** A memarea_t is an allocation region for a set of small memory requests
  * that will all be freed at once. */
 struct memarea_t {
   memarea_chunk_t *first; /**< Top of the chunk stack: never NULL. */
+  /** How big should the next chunk we add to this area be?  Doubles with
+   * every chunk, up to MAX_CHUNK_SIZE. */
+  size_t next_chunk_size;
 };
 
-/** How many chunks will we put into the freelist before freeing them? */
-#define MAX_FREELIST_LEN 4
-/** The number of memarea chunks currently in our freelist. */
-static int freelist_len=0;
-/** A linked list of unused memory area chunks.  Used to prevent us from
- * spinning in malloc/free loops. */
-static memarea_chunk_t *freelist = NULL;
+/** How many chunks will we keep in each thread's freelist? */
+#define MAX_FREELIST_LEN 8
+/** How many bytes of chunks will we keep in each thread's freelist? */
+#define MAX_FREELIST_BYTES (4*1024*1024)
 
-/** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
+/** A list of unused memory area chunks, kept per thread so that areas can be
+ * used from any thread without locking.  Used to prevent us from spinning in
+ * malloc/free loops. */
+typedef struct memarea_freelist_t {
+  memarea_chunk_t *chunks; /**< Chunks in the freelist, smallest first. */
+  int len; /**< How many chunks are in the freelist? */
+  size_t n_bytes; /**< How many bytes do the chunks take up, in total? */
+} memarea_freelist_t;
+
+#ifdef MS_WINDOWS
+/** Thread-local storage index for each thread's memarea_freelist_t. */
+static DWORD freelist_tls_index = TLS_OUT_OF_INDEXES;
+#else
+/** The freelist for our only thread. */
+static memarea_freelist_t main_freelist;
+#endif
+
+/** Return the freelist for the current thread.  If it doesn't exist yet,
+ * create it if <b>create</b> is true and return NULL otherwise. */
+static memarea_freelist_t *
+get_freelist(int create)
+{
+#ifdef MS_WINDOWS
+  memarea_freelist_t *fl;
+  if (freelist_tls_index == TLS_OUT_OF_INDEXES) {
+    DWORD idx;
+    if (!create || (idx = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+      return NULL;
+    /* Another thread may have allocated an index at the same time. */
+    if (InterlockedCompareExchange((volatile LONG *)&freelist_tls_index,
+                                   (LONG)idx, (LONG)TLS_OUT_OF_INDEXES) !=
+        (LONG)TLS_OUT_OF_INDEXES)
+      TlsFree(idx);
+    else
+      spawn_add_exit_handler(memarea_clear_freelist);
+  }
+  fl = TlsGetValue(freelist_tls_index);
+  if (!fl && create) {
+    fl = tor_malloc_zero(sizeof(memarea_freelist_t));
+    if (!TlsSetValue(freelist_tls_index, fl))
+      tor_free(fl);
+  }
+  return fl;
+#else
+  (void)create;
+  return &main_freelist;
+#endif
+}
+
+/** Helper: allocate a new memarea chunk with room for at least
+ * <b>mem_size</b> bytes, reusing the smallest chunk in this thread's
+ * freelist that is big enough. */
 static memarea_chunk_t *
-alloc_chunk(size_t sz, int freelist_ok)
+alloc_chunk(size_t mem_size)
 {
-  tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
-    memarea_chunk_t *res = freelist;
-    freelist = res->next_chunk;
-    res->next_chunk = NULL;
-    --freelist_len;
-    CHECK_SENTINEL(res);
-    return res;
-  } else {
-    size_t chunk_size = freelist_ok ? CHUNK_SIZE : sz;
-    memarea_chunk_t *res;
-    chunk_size += SENTINEL_LEN;
-    res = tor_malloc_roundup(&chunk_size);
-    res->next_chunk = NULL;
-    res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
-    res->next_mem = res->u.mem;
-    tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
-               ((char*)res)+chunk_size);
-    tor_assert(realign_pointer(res->next_mem) == res->next_mem);
-    SET_SENTINEL(res);
-    return res;
+  memarea_freelist_t *fl = get_freelist(0);
+  memarea_chunk_t **chunkp, *res;
+  size_t chunk_size;
+  tor_assert(mem_size < SIZE_T_CEILING);
+  if (fl) {
+    for (chunkp = &fl->chunks; *chunkp; chunkp = &(*chunkp)->next_chunk) {
+      if ((*chunkp)->mem_size >= mem_size) {
+        res = *chunkp;
+        *chunkp = res->next_chunk;
+        res->next_chunk = NULL;
+        --fl->len;
+        fl->n_bytes -= CHUNK_HEADER_SIZE + res->mem_size;
+        CHECK_SENTINEL(res);
+        return res;
+      }
+    }
   }
+  chunk_size = CHUNK_HEADER_SIZE + mem_size + SENTINEL_LEN;
+  if (chunk_size < CHUNK_SIZE)
+    chunk_size = CHUNK_SIZE;
+  res = tor_malloc_roundup(&chunk_size);
+  res->next_chunk = NULL;
+  res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
+  res->next_mem = res->u.mem;
+  tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
+             ((char*)res)+chunk_size);
+  tor_assert(realign_pointer(res->next_mem) == res->next_mem);
+  SET_SENTINEL(res);
+  return res;
 }
 
-/** Release <b>chunk</b> from a memarea, either by adding it to the freelist
- * or by freeing it if the freelist is already too big. */
+/** Release <b>chunk</b> from a memarea, either by adding it to this thread's
+ * freelist or by freeing it.  When the freelist is full, we would rather
+ * keep big chunks than small ones, so that large documents can be parsed
+ * again without growing their areas from scratch. */
 static void
 chunk_free_unchecked(memarea_chunk_t *chunk)
 {
+  memarea_freelist_t *fl;
+  memarea_chunk_t **chunkp;
+  size_t size = CHUNK_HEADER_SIZE + chunk->mem_size;
   CHECK_SENTINEL(chunk);
-  if (freelist_len < MAX_FREELIST_LEN) {
-    ++freelist_len;
-    chunk->next_chunk = freelist;
-    freelist = chunk;
-    chunk->next_mem = chunk->u.mem;
-  } else {
+  if (size > MAX_FREELIST_BYTES || !(fl = get_freelist(1))) {
     tor_free(chunk);
+    return;
   }
+  while (fl->chunks && (fl->len >= MAX_FREELIST_LEN ||
+                        fl->n_bytes + size > MAX_FREELIST_BYTES) &&
+         fl->chunks->mem_size <= chunk->mem_size) {
+    memarea_chunk_t *victim = fl->chunks;
+    fl->chunks = victim->next_chunk;
+    --fl->len;
+    fl->n_bytes -= CHUNK_HEADER_SIZE + victim->mem_size;
+    tor_free(victim);
+  }
+  if (fl->len >= MAX_FREELIST_LEN || fl->n_bytes + size > MAX_FREELIST_BYTES) {
+    tor_free(chunk);
+    return;
+  }
+  for (chunkp = &fl->chunks; *chunkp; chunkp = &(*chunkp)->next_chunk) {
+    if ((*chunkp)->mem_size >= chunk->mem_size)
+      break;
+  }
+  chunk->next_chunk = *chunkp;
+  *chunkp = chunk;
+  chunk->next_mem = chunk->u.mem;
+  ++fl->len;
+  fl->n_bytes += size;
 }
 
-/** Allocate and return new memarea. */
+/** Allocate and return new memarea, whose first chunk has room for about
+ * <b>size_hint</b> bytes.  Callers that are about to parse a document of
+ * known length should pass that length, so that the area doesn't need to
+ * grow chunk by chunk. */
 memarea_t *
-memarea_new(void)
+memarea_new_sized(size_t size_hint)
 {
   memarea_t *head = tor_malloc(sizeof(memarea_t));
-  head->first = alloc_chunk(CHUNK_SIZE, 1);
+  size_t sz = CHUNK_SIZE;
+  while (sz < size_hint && sz < MAX_CHUNK_SIZE)
+    sz <<= 1;
+  head->first = alloc_chunk(sz - CHUNK_HEADER_SIZE - SENTINEL_LEN);
+  head->next_chunk_size = sz < MAX_CHUNK_SIZE ? sz << 1 : MAX_CHUNK_SIZE;
   return head;
 }
 
+/** Allocate and return new memarea. */
+memarea_t *
+memarea_new(void)
+{
+  return memarea_new_sized(CHUNK_SIZE);
+}
+
 /** Free <b>area</b>, invalidating all pointers returned from memarea_alloc()
  * and friends for this area */
 void
@@ -171,7 +269,8 @@ memarea_drop_all(memarea_t *area)
 
 /** Forget about having allocated anything in <b>area</b>, and free some of
  * the backing storage associated with it, as appropriate. Invalidates all
- * pointers returned from memarea_alloc() for this area. */
+ * pointers returned from memarea_alloc() for this area.  We keep the top
+ * chunk, which is the biggest one the area has grown to. */
 void
 memarea_clear(memarea_t *area)
 {
@@ -186,17 +285,27 @@ memarea_clear(memarea_t *area)
   area->first->next_mem = area->first->u.mem;
 }
 
-/** Remove all unused memarea chunks from the internal freelist. */
+/** Remove all unused memarea chunks from the current thread's freelist.
+ * spawn_exit() calls this for every thread started with spawn_func(); other
+ * threads that use memareas should call it before they exit. */
 void
 memarea_clear_freelist(void)
 {
+  memarea_freelist_t *fl = get_freelist(0);
   memarea_chunk_t *chunk, *next;
-  freelist_len = 0;
-  for (chunk = freelist; chunk; chunk = next) {
+  if (!fl)
+    return;
+  for (chunk = fl->chunks; chunk; chunk = next) {
     next = chunk->next_chunk;
     tor_free(chunk);
   }
-  freelist = NULL;
+  fl->chunks = NULL;
+  fl->len = 0;
+  fl->n_bytes = 0;
+#ifdef MS_WINDOWS
+  TlsSetValue(freelist_tls_index, NULL);
+  tor_free(fl);
+#endif
 }
 
 /** Return true iff <b>p</b> is in a range that has been returned by an
@@ -227,17 +336,21 @@ memarea_alloc(memarea_t *area, size_t sz)
   if (sz == 0)
     sz = 1;
   if (chunk->next_mem+sz > chunk->u.mem+chunk->mem_size) {
-    if (sz+CHUNK_HEADER_SIZE >= CHUNK_SIZE) {
+    size_t next_size = area->next_chunk_size;
+    if (sz+CHUNK_HEADER_SIZE+SENTINEL_LEN >= next_size) {
       /* This allocation is too big.  Stick it in a special chunk, and put
        * that chunk second in the list. */
-      memarea_chunk_t *new_chunk = alloc_chunk(sz+CHUNK_HEADER_SIZE, 0);
+      memarea_chunk_t *new_chunk = alloc_chunk(sz);
       new_chunk->next_chunk = chunk->next_chunk;
       chunk->next_chunk = new_chunk;
       chunk = new_chunk;
     } else {
-      memarea_chunk_t *new_chunk = alloc_chunk(CHUNK_SIZE, 1);
+      memarea_chunk_t *new_chunk =
+        alloc_chunk(next_size - CHUNK_HEADER_SIZE - SENTINEL_LEN);
       new_chunk->next_chunk = chunk;
       area->first = chunk = new_chunk;
+      if (next_size < MAX_CHUNK_SIZE)
+        area->next_chunk_size = next_size << 1;
     }
     tor_assert(chunk->mem_size >= sz);
   }
@@ -8,6 +8,7 @@
 typedef struct memarea_t memarea_t;
 
 memarea_t *memarea_new(void);
+memarea_t *memarea_new_sized(size_t size_hint);
 void memarea_drop_all(memarea_t *area);
 void memarea_clear(memarea_t *area);
 int memarea_owns_ptr(const memarea_t *area, const void *ptr);
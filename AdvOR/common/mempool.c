@@ -288,6 +288,20 @@ mp_pool_get(mp_pool_t *pool)
   return A2M(allocated);
 }
 
+/** Return a new item from *<b>pool</b>, with all of its <b>item_size</b>
+ * bytes set to zero.  If *<b>pool</b> doesn't exist yet, create it with
+ * chunks of about <b>chunk_capacity</b> bytes. */
+void *
+mp_pool_get_zero(mp_pool_t **pool, size_t item_size, size_t chunk_capacity)
+{
+  void *item;
+  if (PREDICT_UNLIKELY(!*pool))
+    *pool = mp_pool_new(item_size, chunk_capacity);
+  item = mp_pool_get(*pool);
+  memset(item, 0, item_size);
+  return item;
+}
+
 /** Return an allocated memory item to its memory pool. */
 void
 mp_pool_release(void *item)
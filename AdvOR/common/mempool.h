@@ -15,6 +15,8 @@
 typedef struct mp_pool_t mp_pool_t;
 
 void *mp_pool_get(mp_pool_t *pool);
+void *mp_pool_get_zero(mp_pool_t **pool, size_t item_size,
+                       size_t chunk_capacity);
 void mp_pool_release(void *item);
 mp_pool_t *mp_pool_new(size_t item_size, size_t chunk_capacity);
 void mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used);
@@ -31,7 +31,14 @@ typedef int pid_t;
 /* Define to 1 if process-termination monitors on this OS and Libevent
    version must poll for process termination themselves. */
 #define PROCMON_POLLS 1
-/* Currently we need to poll in some way on all systems. */
+/* We still poll on Windows until we can open a handle to the process; once
+ * we have one, a thread pool wait tells us when the process ends. */
+
+#ifdef MS_WINDOWS
+/* Define to 1 if process-termination monitors can have the system wait on
+   the process handle for them. */
+#define PROCMON_WAITS 1
+#endif
 
 #ifdef PROCMON_POLLS
 static void tor_process_monitor_poll_cb(evutil_socket_t unused1, short unused2,
@@ -100,8 +107,22 @@ struct tor_process_monitor_t {
    * periodically check whether the process we have a handle to has
    * ended. */
   HANDLE hproc;
-  /* XXX023 We can and should have Libevent watch hproc for us,
-   * if/when some version of Libevent 2.x can be told to do so. */
+
+  /** Windows-only: The RegisterWaitForSingleObject() wait on hproc, or
+   * NULL if we poll. */
+  HANDLE wait_handle;
+
+  /** Windows-only: True once the wait on hproc fired.  Protected by
+   * procmon_lock. */
+  int exited;
+
+  /** Windows-only: Next monitor in procmon_exited.  Protected by
+   * procmon_lock. */
+  struct tor_process_monitor_t *next_exited;
+
+  /** Windows-only: The event base for the notification socket, in case we
+   * only get a handle to the process when we poll. */
+  struct event_base *base;
 #endif
 
   /* XXX023 On Linux, we can and should receive the 22nd
@@ -158,6 +179,143 @@ static struct timeval poll_interval_tv = {15, 0};
  * libevent 1.x, event_add expects a pointer to a non-const struct
  * timeval. */
 
+#ifdef PROCMON_WAITS
+/* The waits run their callbacks on thread pool threads.  A callback puts
+ * its monitor on procmon_exited and writes a byte to procmon_notify_fd[1];
+ * procmon_notify_event reads it on the main thread, and calls the monitors'
+ * callbacks there.  Libevent can only wait on sockets, not on handles. */
+
+/** Protects procmon_exited, and the exited and next_exited fields of all
+ * monitors. */
+static tor_mutex_t *procmon_lock = NULL;
+/** Linked list of the monitors whose process ended, whose callbacks the main
+ * thread didn't call yet. */
+static tor_process_monitor_t *procmon_exited = NULL;
+/** Socket pair on which the waits wake the main thread, or -1. */
+static tor_socket_t procmon_notify_fd[2] = { -1, -1 };
+/** Read event on procmon_notify_fd[0], or NULL. */
+static struct event *procmon_notify_event = NULL;
+
+/** Libevent callback: call the callbacks of the monitors whose process
+ * ended. */
+static void
+tor_process_monitor_notify_cb(evutil_socket_t fd, short unused1,
+                              void *unused2)
+{
+  char buf[64];
+  tor_process_monitor_t *procmon;
+  (void)unused1; (void)unused2;
+
+  while (tor_socket_recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  for (;;) {
+    tor_mutex_acquire(procmon_lock);
+    procmon = procmon_exited;
+    if (procmon) {
+      procmon_exited = procmon->next_exited;
+      procmon->next_exited = NULL;
+    }
+    tor_mutex_release(procmon_lock);
+    if (!procmon)
+      break;
+    log_notice(procmon->log_domain, "Monitored process %d is dead.",
+               (int)procmon->pid);
+    /* The callback may free procmon, or any other monitor. */
+    procmon->cb(procmon->cb_arg);
+  }
+}
+
+/** Make sure that the waits can wake the main thread of <b>base</b>.
+ * Return 0 on success, -1 on failure. */
+static int
+tor_process_monitor_open_notify(struct event_base *base)
+{
+  int err;
+  if (procmon_notify_event)
+    return 0;
+  if (!procmon_lock)
+    procmon_lock = tor_mutex_new();
+  if ((err = tor_socketpair(SOCK_STREAM, 0, procmon_notify_fd)) < 0) {
+    log_warn(LD_GENERAL, "Couldn't open a socket pair for the process "
+             "monitors: %s", tor_socket_strerror(-err));
+    procmon_notify_fd[0] = procmon_notify_fd[1] = -1;
+    return -1;
+  }
+  set_socket_nonblocking(procmon_notify_fd[0]);
+  set_socket_nonblocking(procmon_notify_fd[1]);
+  procmon_notify_event = tor_event_new(base, procmon_notify_fd[0],
+                                       EV_READ|EV_PERSIST,
+                                       tor_process_monitor_notify_cb, NULL);
+  event_add(procmon_notify_event, NULL);
+  return 0;
+}
+
+/** Thread pool callback: the process of <b>procmon_</b> ended. */
+static VOID CALLBACK
+tor_process_monitor_wait_cb(PVOID procmon_, BOOLEAN timed_out)
+{
+  tor_process_monitor_t *procmon = (tor_process_monitor_t *)(procmon_);
+  char c = 0;
+  (void)timed_out;
+
+  tor_mutex_acquire(procmon_lock);
+  if (!procmon->exited) {
+    procmon->exited = 1;
+    procmon->next_exited = procmon_exited;
+    procmon_exited = procmon;
+  }
+  tor_mutex_release(procmon_lock);
+  tor_socket_send(procmon_notify_fd[1], &c, 1, 0);
+}
+
+/** Have the system wait on the process handle of <b>procmon</b> for us.
+ * Return 0 on success, or -1 if we must keep polling. */
+static int
+tor_process_monitor_register_wait(tor_process_monitor_t *procmon)
+{
+  if (tor_process_monitor_open_notify(procmon->base) < 0)
+    return -1;
+  if (!RegisterWaitForSingleObject(&procmon->wait_handle, procmon->hproc,
+                                   tor_process_monitor_wait_cb, procmon,
+                                   INFINITE, WT_EXECUTEONLYONCE)) {
+    char *errmsg = format_win32_error(GetLastError());
+    log_info(procmon->log_domain, "Couldn't wait for process %d (%s); "
+             "polling it instead.", (int)procmon->pid, errmsg);
+    tor_free(errmsg);
+    procmon->wait_handle = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** Close the notification socket of the waits.  All the monitors must be
+ * freed. */
+void
+tor_process_monitor_free_all(void)
+{
+  if (procmon_notify_event) {
+    tor_event_free(procmon_notify_event);
+    procmon_notify_event = NULL;
+  }
+  if (procmon_notify_fd[0] >= 0) {
+    tor_close_socket(procmon_notify_fd[0]);
+    tor_close_socket(procmon_notify_fd[1]);
+    procmon_notify_fd[0] = procmon_notify_fd[1] = -1;
+  }
+  if (procmon_lock) {
+    tor_mutex_free(procmon_lock);
+    procmon_lock = NULL;
+  }
+  procmon_exited = NULL;
+}
+#else
+/** Nothing to do when we only poll. */
+void
+tor_process_monitor_free_all(void)
+{
+}
+#endif
+
 /** Create a process-termination monitor for the process specifier
  * given in <b>process_spec</b>.  Return a newly allocated
  * tor_process_monitor_t on success; return NULL and store an error
@@ -174,7 +332,8 @@ tor_process_monitor_new(struct event_base *base,
                         tor_procmon_callback_t cb, void *cb_arg,
                         const char **msg)
 {
-  tor_process_monitor_t *procmon = tor_malloc(sizeof(tor_process_monitor_t));
+  tor_process_monitor_t *procmon =
+    tor_malloc_zero(sizeof(tor_process_monitor_t));
   struct parsed_process_specifier_t ppspec;
 
   tor_assert(msg != NULL);
@@ -193,6 +352,7 @@ tor_process_monitor_new(struct event_base *base,
   procmon->pid = ppspec.pid;
 
 #ifdef MS_WINDOWS
+  procmon->base = base;
   procmon->hproc = OpenProcess(PROCESS_QUERY_INFORMATION | SYNCHRONIZE,
                                FALSE,
                                procmon->pid);
@@ -214,6 +374,11 @@ tor_process_monitor_new(struct event_base *base,
   procmon->cb = cb;
   procmon->cb_arg = cb_arg;
 
+#ifdef PROCMON_WAITS
+  if (procmon->hproc != NULL && !tor_process_monitor_register_wait(procmon))
+    return procmon;
+#endif
+
 #ifdef PROCMON_POLLS
   procmon->e = tor_event_new(base, -1 /* no FD */, PERIODIC_TIMER_FLAGS,
                              tor_process_monitor_poll_cb, procmon);
@@ -272,6 +437,12 @@ tor_process_monitor_poll_cb(evutil_socket_t unused1, short unused2,
                procmon->pid);
       its_dead_jim = 0;
       procmon->poll_hproc = 1;
+#ifdef PROCMON_WAITS
+      if (!tor_process_monitor_register_wait(procmon)) {
+        event_del(procmon->e);
+        return;
+      }
+#endif
     } else {
       DWORD err_code = GetLastError();
       char *errmsg = format_win32_error(err_code);
@@ -323,6 +494,21 @@ tor_process_monitor_free(tor_process_monitor_t *procmon)
   if (procmon == NULL)
     return;
 
+#ifdef PROCMON_WAITS
+  if (procmon->wait_handle != NULL) {
+    tor_process_monitor_t **pp;
+    /* Wait for a callback that has already started. */
+    UnregisterWaitEx(procmon->wait_handle, INVALID_HANDLE_VALUE);
+    tor_mutex_acquire(procmon_lock);
+    for (pp = &procmon_exited; *pp; pp = &(*pp)->next_exited) {
+      if (*pp == procmon) {
+        *pp = procmon->next_exited;
+        break;
+      }
+    }
+    tor_mutex_release(procmon_lock);
+  }
+#endif
 #ifdef MS_WINDOWS
   if (procmon->hproc != NULL)
     CloseHandle(procmon->hproc);
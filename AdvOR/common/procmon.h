@@ -24,6 +24,7 @@ tor_process_monitor_t *tor_process_monitor_new(struct event_base *base,
                                                void *cb_arg,
                                                const char **msg);
 void tor_process_monitor_free(tor_process_monitor_t *procmon);
+void tor_process_monitor_free_all(void);
 
 #endif
 
@@ -314,24 +314,72 @@ compress_method_t detect_compression_method(const char *in, size_t in_len)
 struct tor_zlib_state_t
 {	struct z_stream_s stream;
 	int compress;
+	/** The method this state was made for. */
+	compress_method_t method;
 	/* Number of bytes read so far.  Used to detect zlib bombs. */
 	size_t input_so_far;
 	/* Number of bytes written so far.  Used to detect zlib bombs. */
 	size_t output_so_far;
+	/** Next state in the same pool, while this one is in a pool. */
+	struct tor_zlib_state_t *next;
 };
 
-/** Construct and return a tor_zlib_state_t object using <b>method</b>. If <b>compress</b>, it's for compression; otherwise it's for decompression. */
+/** Keep at most this many unused states of each kind for reuse. */
+#define MAX_POOLED_ZLIB_STATES 4
+
+/** Unused states, by whether they compress, and by whether they use gzip rather than zlib: deflate states take hundreds of kilobytes, so we reset and reuse them instead of setting up new ones for each directory connection. */
+static tor_zlib_state_t *zlib_pool[2][2];
+/** How many states are in each of zlib_pool? */
+static int zlib_pool_len[2][2];
+/** Protects zlib_pool, since plugins may use zlib states from their own threads.  NULL until tor_zlib_pool_init() is called: we don't reuse states before. */
+static tor_mutex_t *zlib_pool_mutex = NULL;
+
+/** Start reusing zlib states.  Called once at startup. */
+void tor_zlib_pool_init(void)
+{	if(!zlib_pool_mutex)
+		zlib_pool_mutex = tor_mutex_new();
+}
+
+/** Take a state for <b>compress</b> and <b>method</b> from the pool and reset it, or return NULL if there is none. */
+static tor_zlib_state_t *tor_zlib_pool_get(int compress, compress_method_t method)
+{	tor_zlib_state_t *out = NULL;
+	int gz = method == GZIP_METHOD;
+	if(!zlib_pool_mutex)	return NULL;
+	tor_mutex_acquire(zlib_pool_mutex);
+	if((out = zlib_pool[compress][gz]) != NULL)
+	{	zlib_pool[compress][gz] = out->next;
+		--zlib_pool_len[compress][gz];
+	}
+	tor_mutex_release(zlib_pool_mutex);
+	if(out)
+	{	if((compress ? deflateReset(&out->stream) : inflateReset(&out->stream)) != Z_OK)
+		{	if(compress)	deflateEnd(&out->stream);
+			else		inflateEnd(&out->stream);
+			tor_free(out);
+			return NULL;
+		}
+		out->input_so_far = out->output_so_far = 0;
+		out->next = NULL;
+	}
+	return out;
+}
+
+/** Construct and return a tor_zlib_state_t object using <b>method</b>. If <b>compress</b>, it's for compression; otherwise it's for decompression.  Reuse an unused state if we have one. */
 tor_zlib_state_t *tor_zlib_new(int compress, compress_method_t method)
 {	tor_zlib_state_t *out;
 	if(method == GZIP_METHOD && !is_gzip_supported())	/* Old zlib version don't support gzip in inflateInit2 */
 	{	log_warn(LD_BUG,get_lang_str(LANG_LOG_GZIP_NOT_SUPPORTED),ZLIB_VERSION);
 		return NULL;
 	}
+	compress = compress ? 1 : 0;
+	if((out = tor_zlib_pool_get(compress, method)) != NULL)
+		return out;
 	out = tor_malloc_zero(sizeof(tor_zlib_state_t));
 	out->stream.zalloc = Z_NULL;
 	out->stream.zfree = Z_NULL;
 	out->stream.opaque = NULL;
 	out->compress = compress;
+	out->method = method;
 	if(compress)
 	{	if(deflateInit2(&out->stream, Z_BEST_COMPRESSION, Z_DEFLATED,method_bits(method), 8, Z_DEFAULT_STRATEGY) == Z_OK)
 			return out;
@@ -398,12 +446,47 @@ tor_zlib_output_t tor_zlib_process(tor_zlib_state_t *state,char **out, size_t *o
 	return TOR_ZLIB_ERR;
 }
 
-/** Deallocate <b>state</b>. */
+/** Deallocate <b>state</b>, or keep it for reuse if the pool has room. */
 void tor_zlib_free(tor_zlib_state_t *state)
-{	tor_assert(state);
+{	int gz;
+	tor_assert(state);
+	gz = state->method == GZIP_METHOD;
+	if(zlib_pool_mutex)
+	{	tor_mutex_acquire(zlib_pool_mutex);
+		if(zlib_pool_len[state->compress][gz] < MAX_POOLED_ZLIB_STATES)
+		{	state->next = zlib_pool[state->compress][gz];
+			zlib_pool[state->compress][gz] = state;
+			++zlib_pool_len[state->compress][gz];
+			state = NULL;
+		}
+		tor_mutex_release(zlib_pool_mutex);
+		if(!state)	return;
+	}
 	if(state->compress)
 		deflateEnd(&state->stream);
 	else
 		inflateEnd(&state->stream);
 	tor_free(state);
 }
+
+/** Release every pooled state, and stop reusing states. */
+void tor_zlib_free_all(void)
+{	int i, j;
+	tor_zlib_state_t *state;
+	if(!zlib_pool_mutex)	return;
+	tor_mutex_acquire(zlib_pool_mutex);
+	for(i = 0; i < 2; i++)
+	{	for(j = 0; j < 2; j++)
+		{	while((state = zlib_pool[i][j]) != NULL)
+			{	zlib_pool[i][j] = state->next;
+				if(state->compress)	deflateEnd(&state->stream);
+				else			inflateEnd(&state->stream);
+				tor_free(state);
+			}
+			zlib_pool_len[i][j] = 0;
+		}
+	}
+	tor_mutex_release(zlib_pool_mutex);
+	tor_mutex_free(zlib_pool_mutex);
+	zlib_pool_mutex = NULL;
+}
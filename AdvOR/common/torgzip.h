@@ -48,6 +48,8 @@ tor_zlib_output_t tor_zlib_process(tor_zlib_state_t *state,
                                    const char **in, size_t *in_len,
                                    int finish);
 void tor_zlib_free(tor_zlib_state_t *state);
+void tor_zlib_pool_init(void);
+void tor_zlib_free_all(void);
 
 #endif
 
@@ -165,6 +165,11 @@ struct tor_tls_t {
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
   /** Argument to pass to negotiated_callback. */
   void *callback_arg;
+  /** True iff we should keep this client connection's session for
+   * resumption, under <b>session_digest</b>. */
+  unsigned int cache_session:1;
+  /** Identity digest of the peer we expect on this client connection. */
+  char session_digest[DIGEST_LEN];
 };
 
 #ifdef V2_HANDSHAKE_CLIENT
@@ -240,6 +245,13 @@ static tor_tls_context_t *tor_tls_context_new(crypto_pk_env_t *identity,
 static tor_tls_context_t *server_tls_context = NULL;
 static tor_tls_context_t *client_tls_context = NULL;
 
+/** The most client sessions we keep for resumption. */
+#define MAX_CLIENT_SESSIONS 32
+/** Map from the identity digest of a peer to the SSL_SESSION of our last
+ * client connection to it, so reconnecting to it can skip the full
+ * handshake. */
+static digestmap_t *client_session_cache = NULL;
+
 /** True iff tor_tls_init() has been called. */
 static int tls_library_is_initialized = 0;
 
@@ -434,9 +446,19 @@ tor_tls_init(void)
   }
 }
 
+/** Forget every session in the client session cache. */
+static void tor_tls_session_cache_clear(void)
+{	if(!client_session_cache)	return;
+	DIGESTMAP_FOREACH(client_session_cache, key, SSL_SESSION *, session)
+	{	SSL_SESSION_free(session);
+	} DIGESTMAP_FOREACH_END;
+	digestmap_free(client_session_cache, NULL);
+	client_session_cache = NULL;
+}
+
 /** Free all global TLS structures. */
 void tor_tls_free_all(void)
-{	if(server_tls_context)
+{	tor_tls_session_cache_clear();	if(server_tls_context)
 	{	tor_tls_context_t *ctx = server_tls_context;
 		server_tls_context = NULL;
 		tor_tls_context_decref(ctx);
@@ -727,6 +749,8 @@ tor_tls_context_incref(tor_tls_context_t *ctx)
 int tor_tls_context_init(int is_public_server,crypto_pk_env_t *client_identity,crypto_pk_env_t *server_identity,unsigned int key_lifetime)
 {	int rv1 = 0;
 	int rv2 = 0;
+	/* Sessions belong to the certificates we are rotating away from. */
+	tor_tls_session_cache_clear();
 	if(is_public_server)
 	{	tor_tls_context_t *new_ctx;
 		tor_tls_context_t *old_ctx;
@@ -1142,6 +1166,53 @@ tor_tls_new(int sock, int isServer)
   return result;
 }
 
+/** Client only: remember that <b>tls</b> is a connection to the OR with
+ * identity digest <b>identity_digest</b>, and try to resume our last session
+ * with it.  Call before the handshake starts; once the peer's identity has
+ * been checked, call tor_tls_save_session(). */
+void tor_tls_set_session_digest(tor_tls_t *tls,const char *identity_digest)
+{	SSL_SESSION *session;
+	tor_assert(tls);
+	tor_assert(!tls->isServer);
+	tor_assert(tls->state == TOR_TLS_ST_HANDSHAKE);
+	memcpy(tls->session_digest,identity_digest,DIGEST_LEN);
+	tls->cache_session = 1;
+	if(!client_session_cache)	return;
+	session = digestmap_get(client_session_cache,identity_digest);
+	if(!session)	return;
+	if(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < (long)time(NULL))
+	{	digestmap_remove(client_session_cache,identity_digest);
+		SSL_SESSION_free(session);
+		return;
+	}
+	if(!SSL_set_session(tls->ssl,session))
+		tls_log_errors(tls,LOG_INFO,LD_HANDSHAKE,"resuming session");
+}
+
+/** Client only: if <b>tls</b> was given a digest with
+ * tor_tls_set_session_digest(), keep its session so that our next
+ * connection to the same OR can resume it.  Call only once the handshake
+ * has finished and the peer has proven that identity. */
+void tor_tls_save_session(tor_tls_t *tls)
+{	SSL_SESSION *session,*old;
+	tor_assert(tls);
+	if(!tls->cache_session)	return;
+	tls->cache_session = 0;
+	if(!client_session_cache)	client_session_cache = digestmap_new();
+	if(!digestmap_get(client_session_cache,tls->session_digest) && digestmap_size(client_session_cache) >= MAX_CLIENT_SESSIONS)
+		return;
+	if(!(session = SSL_get1_session(tls->ssl)))	return;
+	old = digestmap_set(client_session_cache,tls->session_digest,session);
+	if(old)	SSL_SESSION_free(old);
+}
+
+/** Return true iff the handshake on <b>tls</b> resumed an earlier
+ * session. */
+int tor_tls_session_was_resumed(tor_tls_t *tls)
+{	tor_assert(tls);
+	return SSL_session_reused(tls->ssl) ? 1 : 0;
+}
+
 /** Make future log messages about <b>tls</b> display the address
  * <b>address</b>.
  */
@@ -1222,6 +1293,14 @@ tor_tls_free(tor_tls_t *tls)
   if (!removed) {
     log_warn(LD_BUG,get_lang_str(LANG_LOG_TLS_FREEING_TLS));
   }
+  if (tls->cache_session && client_session_cache &&
+      tls->state == TOR_TLS_ST_HANDSHAKE) {
+    /* The handshake never finished; don't offer that session again. */
+    SSL_SESSION *session = digestmap_remove(client_session_cache,
+                                            tls->session_digest);
+    if (session)
+      SSL_SESSION_free(session);
+  }
 #ifdef SSL_set_tlsext_host_name
   SSL_set_tlsext_host_name(tls->ssl, NULL);
 #endif
@@ -54,6 +54,9 @@ int tor_tls_context_init(int is_public_server,crypto_pk_env_t *client_identity,c
 int tor_tls_context_init_(int is_public_server,crypto_pk_env_t *client_identity,crypto_pk_env_t *server_identity,unsigned int key_lifetime);
 tor_tls_t *tor_tls_new(int sock, int is_server);
 void tor_tls_set_logged_address(tor_tls_t *tls, const char *address);
+void tor_tls_set_session_digest(tor_tls_t *tls,const char *identity_digest);
+void tor_tls_save_session(tor_tls_t *tls);
+int tor_tls_session_was_resumed(tor_tls_t *tls);
 void tor_tls_set_renegotiate_callback(tor_tls_t *tls,
                                       void (*cb)(tor_tls_t *, void *arg),
                                       void *arg);
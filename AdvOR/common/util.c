@@ -81,9 +81,19 @@
 #ifdef HAVE_MALLOC_NP_H
 #include <malloc_np.h>
 #endif
+#ifdef USE_SSSE3_CODECS
+#include <cpuid.h>
+#include <tmmintrin.h>
+#endif
 
 DWORD *safe_mem_root = NULL;
 int next_mem_size = 4096;
+volatile LONG mem_tag_bytes[_MEM_TAG_MAX];
+/** How many blocks _tor_malloc() has handed out. */
+uint64_t tor_malloc_calls = 0;
+/** With DEBUG_MALLOC, how many bytes the blocks that we handed out and that
+ * weren't freed yet hold, and the most they held since it was last reset. */
+uint64_t tor_malloc_live_bytes = 0, tor_malloc_peak_bytes = 0;
 
 DWORD safe_size(void *ptr);
 
@@ -95,6 +105,7 @@ void * __stdcall safe_malloc(unsigned int size)
 	}
 	if(safe_mem_root==NULL)
 	{	safe_mem_root = (DWORD *)VirtualAlloc(NULL,next_mem_size+16+16,MEM_COMMIT,PAGE_READWRITE|PAGE_NOCACHE);
+		tor_mem_account(MEM_TAG_PLUGINS,((next_mem_size>>2)<<2)+16+16);
 		safe_mem_root[0] = 0;			// next allocated buffer
 		safe_mem_root[1] = 0;			// next offset in buffer
 		safe_mem_root[2] = next_mem_size>>2;	// total
@@ -128,6 +139,7 @@ void * __stdcall safe_malloc(unsigned int size)
 		next_mem_buf = (DWORD *)next_mem_buf[0];
 	}
 	next_mem_buf = (DWORD *)VirtualAlloc(NULL,next_mem_size+16+16,MEM_COMMIT,PAGE_READWRITE|PAGE_NOCACHE);
+	tor_mem_account(MEM_TAG_PLUGINS,((next_mem_size>>2)<<2)+16+16);
 	next_mem_buf[0] = 0;			// next allocated buffer
 	next_mem_buf[1] = 0;			// next offset in buffer
 	next_mem_buf[2] = next_mem_size>>2;	// total
@@ -188,6 +200,7 @@ void __stdcall safe_free(void *buffer)
 										cbuf = (DWORD *)cbuf[0];
 									}
 								}
+								tor_mem_account(MEM_TAG_PLUGINS,-(LONG)((next_buf[2]<<2)+16+16));
 								VirtualFree(next_buf,0,MEM_RELEASE);
 							}
 						}
@@ -284,6 +297,7 @@ void *_tor_malloc(size_t size DMALLOC_PARAMS)
   tor_assert(size < SIZE_T_CEILING);
   while(!TryEnterCriticalSection(&allocCriticalSection))
   	Sleep(10);
+  ++tor_malloc_calls;
 #ifdef DEBUG_MALLOC
 	result = ALLOC(size+20
 #ifdef MALLOC_SENTINELS
@@ -307,6 +321,9 @@ void *_tor_malloc(size_t size DMALLOC_PARAMS)
 		result[3] = (uint32_t)line;
 		result[4] = size;
 		result += 5;
+		tor_malloc_live_bytes += size;
+		if(tor_malloc_live_bytes > tor_malloc_peak_bytes)
+			tor_malloc_peak_bytes = tor_malloc_live_bytes;
 #ifdef MALLOC_SENTINELS
 		unsigned char *c;
 		c = (unsigned char *)result;
@@ -346,6 +363,7 @@ void _tor_free_(void *p,const char *file,int line)
 		if(*(uint32_t *)((unsigned char *)p + next[4]) != 0x55aa1234)
 			int3
 #endif
+		tor_malloc_live_bytes -= next[4];
 		if(next == alloc_root)
 			alloc_root = (uint32_t *)next[1];
 		if(next == alloc_last)
@@ -1108,6 +1126,88 @@ tor_parse_uint64(const char *s, int base, uint64_t min,
 	return r;
 }
 
+#ifdef USE_SSSE3_CODECS
+/** 1 if this CPU has the SSSE3 instructions, 0 if it doesn't, -1 if we
+ * haven't checked yet. */
+static int have_ssse3 = -1;
+
+/** Return true iff the codecs can use the SSSE3 instructions. */
+int
+codecs_have_ssse3(void)
+{
+  if (have_ssse3 < 0) {
+    unsigned int eax, ebx, ecx, edx;
+    have_ssse3 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+      (ecx & bit_SSSE3) ? 1 : 0;
+  }
+  return have_ssse3;
+}
+
+/** Hex-encode the first <b>srclen</b> bytes at <b>src</b>, rounded down to
+ * a multiple of 16, into <b>dest</b>, without a NUL.  Return the number of
+ * bytes encoded. */
+static size_t __attribute__((target("ssse3")))
+base16_encode_ssse3(char *dest, const char *src, size_t srclen)
+{
+  const __m128i digits = _mm_setr_epi8('0','1','2','3','4','5','6','7',
+                                       '8','9','A','B','C','D','E','F');
+  const __m128i low_nibble = _mm_set1_epi8(0x0f);
+  size_t i;
+
+  for (i = 0; i + 16 <= srclen; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), low_nibble);
+    __m128i lo = _mm_and_si128(in, low_nibble);
+    hi = _mm_shuffle_epi8(digits, hi);
+    lo = _mm_shuffle_epi8(digits, lo);
+    _mm_storeu_si128((__m128i *)(dest + 2*i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dest + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+/** Helper: return a vector holding the value of each hex digit in <b>in</b>,
+ * and set *<b>bad</b> to a nonzero mask if any of them isn't hex. */
+static INLINE __m128i __attribute__((target("ssse3")))
+hex_decode_block_ssse3(__m128i in, int *bad)
+{
+  __m128i d = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+  __m128i l = _mm_sub_epi8(_mm_or_si128(in, _mm_set1_epi8(0x20)),
+                           _mm_set1_epi8('a'));
+  __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+  *bad = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) ^ 0xffff;
+  return _mm_or_si128(_mm_and_si128(is_digit, d),
+                      _mm_and_si128(is_letter,
+                                    _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+/** Decode the first <b>srclen</b> hex digits at <b>src</b>, 32 at a time,
+ * into <b>dest</b>.  Stop at the first block that holds anything but hex
+ * digits.  Return the number of digits decoded. */
+static size_t __attribute__((target("ssse3")))
+base16_decode_ssse3(char *dest, const char *src, size_t srclen)
+{
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  size_t i;
+
+  for (i = 0; i + 32 <= srclen; i += 32) {
+    int bad0, bad1;
+    __m128i v0 = hex_decode_block_ssse3(
+                   _mm_loadu_si128((const __m128i *)(src + i)), &bad0);
+    __m128i v1 = hex_decode_block_ssse3(
+                   _mm_loadu_si128((const __m128i *)(src + i + 16)), &bad1);
+    if (bad0 | bad1)
+      break;
+    /* Each pair of digits becomes (16*high + low) in one 16-bit lane. */
+    v0 = _mm_maddubs_epi16(v0, weights);
+    v1 = _mm_maddubs_epi16(v1, weights);
+    _mm_storeu_si128((__m128i *)(dest + i/2), _mm_packus_epi16(v0, v1));
+  }
+  return i;
+}
+#endif
+
 /** Encode the <b>srclen</b> bytes at <b>src</b> in a NUL-terminated,
  * uppercase hexadecimal string; store it in the <b>destlen</b>-byte buffer
  * <b>dest</b>.
@@ -1123,6 +1223,13 @@ base16_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   cp = dest;
   end = src+srclen;
+#ifdef USE_SSSE3_CODECS
+  if (srclen >= 16 && codecs_have_ssse3()) {
+    size_t n = base16_encode_ssse3(cp, src, srclen);
+    src += n;
+    cp += 2*n;
+  }
+#endif
   while (src<end) {
     *cp++ = "0123456789ABCDEF"[ (*(const uint8_t*)src) >> 4 ];
     *cp++ = "0123456789ABCDEF"[ (*(const uint8_t*)src) & 0xf ];
@@ -1178,6 +1285,15 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   if (destlen < srclen/2 || destlen > SIZE_T_CEILING)
     return -1;
   end = src+srclen;
+#ifdef USE_SSSE3_CODECS
+  /* A block with a bad digit in it is left for the loop below, which
+   * decodes the pairs before the bad one and then fails. */
+  if (srclen >= 32 && codecs_have_ssse3()) {
+    size_t n = base16_decode_ssse3(dest, src, srclen);
+    src += n;
+    dest += n/2;
+  }
+#endif
   while (src<end) {
     v1 = _hex_decode_digit(*src);
     v2 = _hex_decode_digit(*(src+1));
@@ -131,9 +131,49 @@ void _tor_free_(void *);
 #define tor_memdup(s, n)       _tor_memdup(s, n DMALLOC_ARGS)
 void tor_alloc_init(void);
 void tor_alloc_exit(void);
+extern uint64_t tor_malloc_calls;
+extern uint64_t tor_malloc_live_bytes, tor_malloc_peak_bytes;
 
 void tor_log_mallinfo(int severity);
 
+/** Subsystems whose memory we keep count of, so that we can tell where the
+ * memory goes and what to trim when we use too much. */
+typedef enum mem_tag_t {
+  MEM_TAG_BUFFERS, /**< Chunks of connection buffers, including freelists. */
+  MEM_TAG_CELL_QUEUES, /**< Room for cells on circuit queues. */
+  MEM_TAG_ROUTERLIST, /**< Router descriptor bodies; summed when asked. */
+  MEM_TAG_DNS_CACHE, /**< Cached DNS answers of an exit. */
+  MEM_TAG_ADDRESSMAP, /**< Client address mappings. */
+  MEM_TAG_COOKIES, /**< HTTP cookies that web servers have set. */
+  MEM_TAG_LOG_CACHE, /**< Lines kept for the log window while it is
+                      * closed. */
+  MEM_TAG_PLUGINS, /**< Memory that plugins got from safe_malloc(). */
+  _MEM_TAG_MAX
+} mem_tag_t;
+
+/** Bytes in use by each subsystem.  Updated from any thread. */
+extern volatile LONG mem_tag_bytes[_MEM_TAG_MAX];
+
+/** Count <b>n</b> more bytes (or fewer, if negative) against <b>tag</b>. */
+#define tor_mem_account(tag, n) \
+  InterlockedExchangeAdd(&mem_tag_bytes[(tag)], (LONG)(n))
+/** Allocate like tor_malloc(), tor_malloc_zero() or tor_strdup(), counting
+ * the memory against <b>tag</b>.  Arguments may be evaluated twice. */
+#define tor_malloc_tagged(tag, size) \
+  (tor_mem_account((tag), (size)), tor_malloc(size))
+#define tor_malloc_zero_tagged(tag, size) \
+  (tor_mem_account((tag), (size)), tor_malloc_zero(size))
+#define tor_strdup_tagged(tag, s) \
+  (tor_mem_account((tag), strlen(s)+1), tor_strdup(s))
+/** Free <b>p</b>, which was allocated with <b>size</b> bytes counted against
+ * <b>tag</b>, and set it to NULL. */
+#define tor_free_tagged(tag, p, size) STMT_BEGIN                \
+    if (PREDICT_LIKELY((p)!=NULL)) {                          \
+      tor_mem_account((tag), -(LONG)(size));                   \
+      tor_free(p);                                             \
+    }                                                          \
+  STMT_END
+
 /** Return the offset of <b>member</b> within the type <b>tp</b>, in bytes */
 #if defined(__GNUC__) && __GNUC__ > 3
 #define STRUCT_OFFSET(tp, member) __builtin_offsetof(tp, member)
@@ -245,6 +285,14 @@ int hex_decode_digit(char c);
 void base16_encode(char *dest, size_t destlen, const char *src, size_t srclen);
 int base16_decode(char *dest, size_t destlen, const char *src, size_t srclen);
 
+/* On x86 builds with a recent enough GCC, the hex and base64 codecs handle
+ * whole blocks of input with SSSE3 when CPUID says the processor has it. */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+  ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SSSE3_CODECS
+int codecs_have_ssse3(void);
+#endif
+
 /* Time helpers */
 double tv_to_double(const struct timeval *tv);
 int64_t tv_to_msec(const struct timeval *tv);
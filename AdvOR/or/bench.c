@@ -0,0 +1,767 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/* Ordinarily defined in tor_main.c; this bit is just here to provide one
+ * since we're not linking to tor_main.c */
+const char tor_svn_revision[] = "";
+char *_version;
+
+/**
+ * \file bench.c
+ * \brief Micro-benchmarks for the hot paths of the lower level modules.
+ *
+ * Every benchmark builds its fixture from fixed data and our own
+ * pseudo-random generator, so two runs time the same work.  Each one is
+ * repeated with twice as many iterations until a run takes at least
+ * BENCH_MIN_USEC, and that run is reported as a CSV line on stdout:
+ * benchmark,iterations,ns_per_op,allocs_per_op.  Allocations are the calls
+ * to _tor_malloc() made during the run, including those made to rebuild
+ * the input of each operation.
+ *
+ * With --replay DIR, we instead feed every directory document in DIR to the
+ * code that ingests it when it arrives from the network: authority
+ * certificates first, then consensuses, router descriptors and
+ * microdescriptors in the order of their file names.  Each file gets a CSV
+ * line with its size, the time, throughput and allocations it took, and the
+ * peak heap use while we took it in.
+ *
+ * With --load PORT, we are the clients of a running AdvOR instead; see
+ * loadgen.c.
+ **/
+
+#include "orconfig.h"
+
+#include <stdio.h>
+
+#define BUFFERS_PRIVATE
+#define CONFIG_PRIVATE
+#define NETWORKSTATUS_PRIVATE
+
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "geoip.h"
+#include "loadgen.h"
+#include "main.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "perf.h"
+#include "policies.h"
+#include "proxy.h"
+#include "rephist.h"
+#include "routerlist.h"
+#include "routerparse.h"
+
+/** Run each benchmark until it takes at least this many microseconds. */
+#define BENCH_MIN_USEC 200000
+/** Never run a benchmark for more than this many iterations. */
+#define BENCH_MAX_ITERS (1<<26)
+/** How many relays our consensus fixture lists. */
+#define BENCH_N_RELAYS 2000
+/** How many different addresses the lookup benchmarks cycle through. */
+#define BENCH_N_ADDRS 1024
+
+extern or_options_t *tmpOptions;
+extern char fullpath[MAX_PATH+1];
+void dlgAuthorities_initDirServers(config_line_t **option);
+
+/** State of bench_rand(). */
+static uint32_t bench_rand_state = 0x2545F491;
+
+/** Return the next value of a fixed pseudo-random sequence: unlike
+ * crypto_rand(), the same on every run. */
+static uint32_t
+bench_rand(void)
+{
+  bench_rand_state ^= bench_rand_state << 13;
+  bench_rand_state ^= bench_rand_state >> 17;
+  bench_rand_state ^= bench_rand_state << 5;
+  return bench_rand_state;
+}
+
+/** Fill <b>out</b> with <b>n</b> bytes of bench_rand() output. */
+static void
+bench_rand_bytes(char *out, size_t n)
+{
+  while (n--)
+    *out++ = (char)bench_rand();
+}
+
+/** A benchmark: runs its operation <b>iters</b> times on <b>arg</b>. */
+typedef void (*bench_fn_t)(void *arg, int iters);
+
+/** Run <b>fn</b> until a run of it takes BENCH_MIN_USEC, and print the
+ * timing and the allocations per operation of that run as <b>name</b>. */
+static void
+bench_run(const char *name, bench_fn_t fn, void *arg)
+{
+  int iters = 1;
+  uint64_t start, usec, allocs;
+  while (1) {
+    allocs = tor_malloc_calls;
+    start = perf_now_usec();
+    fn(arg, iters);
+    usec = perf_now_usec() - start;
+    allocs = tor_malloc_calls - allocs;
+    if (usec >= BENCH_MIN_USEC || iters >= BENCH_MAX_ITERS)
+      break;
+    iters *= 2;
+  }
+  printf("%s,%d,%.1f,%.2f\n", name, iters,
+         (double)usec * 1000.0 / iters, (double)allocs / iters);
+  fflush(stdout);
+}
+
+/** The record size of the buffer benchmarks: about a relay cell payload. */
+#define BENCH_BUF_RECORD 512
+
+/** The buffers and data that the buffer benchmarks work on. */
+typedef struct bench_buf_t {
+  buf_t *in;
+  buf_t *out;
+  char data[BENCH_BUF_RECORD];
+} bench_buf_t;
+
+/** Benchmark: append a record to a buffer, emptying it now and then. */
+static void
+bench_buf_write(void *arg, int iters)
+{
+  bench_buf_t *b = arg;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(b->data, sizeof(b->data), b->in);
+    if ((i & 255) == 255)
+      buf_clear(b->in);
+  }
+  buf_clear(b->in);
+}
+
+/** Benchmark: append a record to a buffer and read it back out. */
+static void
+bench_buf_write_fetch(void *arg, int iters)
+{
+  bench_buf_t *b = arg;
+  char out[BENCH_BUF_RECORD];
+  int i;
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(b->data, sizeof(b->data), b->in);
+    fetch_from_buf(out, sizeof(out), b->in);
+  }
+}
+
+/** Benchmark: append a record to a buffer and move it to another one, as
+ * we do between the two sides of a linked connection. */
+static void
+bench_buf_move(void *arg, int iters)
+{
+  bench_buf_t *b = arg;
+  size_t flushlen;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(b->data, sizeof(b->data), b->in);
+    flushlen = sizeof(b->data);
+    move_buf_to_buf(b->out, b->in, &flushlen);
+    if ((i & 255) == 255)
+      buf_clear(b->out);
+  }
+  buf_clear(b->out);
+}
+
+/** What relay_crypt_one_payload() works on. */
+typedef struct bench_crypt_t {
+  crypto_cipher_env_t *cipher;
+  char payload[CELL_PAYLOAD_SIZE];
+} bench_crypt_t;
+
+/** Benchmark: crypt one relay cell payload, as relay_crypt_one_payload()
+ * does for every hop. */
+static void
+bench_relay_crypt(void *arg, int iters)
+{
+  bench_crypt_t *c = arg;
+  int i;
+  for (i = 0; i < iters; ++i)
+    crypto_cipher_crypt_inplace(c->cipher, c->payload, CELL_PAYLOAD_SIZE);
+}
+
+/** A request like the ones that browsers send to our HTTP proxy. */
+static const char bench_http_request[] =
+  "GET http://www.example.com/index.html?q=tor HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 6.1; rv:38.0) Gecko/20100101 "
+    "Firefox/38.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Referer: http://www.example.com/\r\n"
+  "Connection: keep-alive\r\n"
+  "Proxy-Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+/** Benchmark: write a request into a buffer and parse it back out with
+ * fetch_from_buf_http(). */
+static void
+bench_fetch_from_buf_http(void *arg, int iters)
+{
+  buf_t *buf = arg;
+  char *headers, *body;
+  size_t body_used;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    write_to_buf(bench_http_request, sizeof(bench_http_request)-1, buf);
+    headers = body = NULL;
+    fetch_from_buf_http(buf, &headers, MAX_HEADERS_SIZE,
+                        &body, &body_used, MAX_HEADERS_SIZE, 0);
+    tor_free(headers);
+    tor_free(body);
+  }
+  buf_clear(buf);
+}
+
+/** Benchmark: rewrite the headers of a request with
+ * parse_request_headers(), on a copy of it since it works in place. */
+static void
+bench_parse_request_headers(void *arg, int iters)
+{
+  edge_connection_t *conn = arg;
+  char *headers, *result;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    headers = tor_strdup(bench_http_request);
+    result = parse_request_headers(headers, TO_CONN(conn));
+    tor_free(result);
+    tor_free(headers);
+  }
+}
+
+/** A policy and the destinations that the policy benchmark checks. */
+typedef struct bench_policy_t {
+  smartlist_t *policy;
+  tor_addr_t addrs[BENCH_N_ADDRS];
+  uint16_t ports[BENCH_N_ADDRS];
+} bench_policy_t;
+
+/** Benchmark: look up a destination in an exit policy. */
+static void
+bench_policy_eval(void *arg, int iters)
+{
+  bench_policy_t *p = arg;
+  int i, n = 0;
+  for (i = 0; i < iters; ++i) {
+    int k = i & (BENCH_N_ADDRS-1);
+    n += compare_tor_addr_to_addr_policy(&p->addrs[k], p->ports[k],
+                                         p->policy) == ADDR_POLICY_ACCEPTED;
+  }
+  (void)n;
+}
+
+/** Addresses for the GeoIP benchmarks; each path is two of them and a 0. */
+typedef struct bench_geoip_t {
+  uint32_t ips[BENCH_N_ADDRS];
+  uint32_t paths[BENCH_N_ADDRS/2][3];
+} bench_geoip_t;
+
+/** Benchmark: find the country of an address. */
+static void
+bench_geoip_country(void *arg, int iters)
+{
+  bench_geoip_t *g = arg;
+  int i, n = 0;
+  for (i = 0; i < iters; ++i)
+    n += geoip_get_country_by_ip(g->ips[i & (BENCH_N_ADDRS-1)]);
+  (void)n;
+}
+
+/** Size of the buffer that the AS path benchmark fills. */
+#define BENCH_AS_PATH_BUFFER 8192
+
+/** Benchmark: estimate the AS path between two addresses, without the
+ * cache of geoip_is_ip_path_safe(). */
+static void
+bench_geoip_as_path(void *arg, int iters)
+{
+  bench_geoip_t *g = arg;
+  uint32_t *aslist = tor_malloc(BENCH_AS_PATH_BUFFER);
+  int i;
+  for (i = 0; i < iters; ++i)
+    geoip_get_full_as_path(g->paths[i & (BENCH_N_ADDRS/2-1)], aslist,
+                           BENCH_AS_PATH_BUFFER - 4);
+  tor_free(aslist);
+}
+
+/** Benchmark: pick a middle relay from the consensus by its weighted
+ * bandwidth, which smartlist_choose_by_bandwidth_weights() does. */
+static void
+bench_choose_by_bw_weights(void *arg, int iters)
+{
+  networkstatus_t *ns = arg;
+  int i;
+  for (i = 0; i < iters; ++i)
+    routerstatus_sl_choose_by_bandwidth(ns->routerstatus_list,
+                                        WEIGHT_FOR_MID);
+}
+
+/** Benchmark: parse a consensus. */
+static void
+bench_consensus_parse(void *arg, int iters)
+{
+  const char *body = arg;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(body, NULL, NS_TYPE_CONSENSUS);
+    if (ns)
+      networkstatus_vote_free(ns);
+  }
+}
+
+/** Return a newly allocated consensus of BENCH_N_RELAYS relays, with
+ * bandwidth weights and one voter.  Consensus signatures are only checked
+ * once the document is parsed, so its signature is random bytes. */
+static char *
+bench_make_consensus(void)
+{
+  smartlist_t *sl = smartlist_create();
+  char published[ISO_TIME_LEN+1], fresh[ISO_TIME_LEN+1];
+  char until[ISO_TIME_LEN+1];
+  char digest[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1], d64[BASE64_DIGEST_LEN+1];
+  char voter[HEX_DIGEST_LEN+1], sigbytes[128], sig[256], *result;
+  unsigned char *cp;
+  time_t now = approx_time();
+  int i;
+
+  format_iso_time(published, now - 1800);
+  format_iso_time(fresh, now + 1800);
+  format_iso_time(until, now + 9000);
+  bench_rand_bytes(digest, DIGEST_LEN);
+  base16_encode(voter, sizeof(voter), digest, DIGEST_LEN);
+  tor_asprintf(&cp,
+      "network-status-version 3\n"
+      "vote-status consensus\n"
+      "consensus-method 9\n"
+      "valid-after %s\n"
+      "fresh-until %s\n"
+      "valid-until %s\n"
+      "voting-delay 300 300\n"
+      "client-versions 0.2.2.39\n"
+      "server-versions 0.2.2.39\n"
+      "known-flags Exit Fast Guard Running Stable V2Dir Valid\n"
+      "params circwindow=1000\n"
+      "dir-source bench %s 10.0.0.1 10.0.0.1 9030 9001\n"
+      "contact bench\n"
+      "vote-digest %s\n", published, fresh, until, voter, voter);
+  smartlist_add(sl, cp);
+
+  for (i = 0; i < BENCH_N_RELAYS; ++i) {
+    uint32_t r = bench_rand();
+    const char *flags;
+    /* Sorted by identity: the parser insists on it. */
+    bench_rand_bytes(digest, DIGEST_LEN);
+    set_uint32(digest, htonl(i));
+    digest_to_base64(id64, digest);
+    bench_rand_bytes(digest, DIGEST_LEN);
+    digest_to_base64(d64, digest);
+    switch (r & 3) {
+      case 0: flags = "Exit Fast Running Valid"; break;
+      case 1: flags = "Fast Guard Running Stable V2Dir Valid"; break;
+      case 2: flags = "Exit Fast Guard Running Stable Valid"; break;
+      default: flags = "Fast Running Valid"; break;
+    }
+    tor_asprintf(&cp,
+        "r relay%d %s %s %s %d.%d.%d.%d 9001 %d\n"
+        "s %s\n"
+        "v Tor 0.2.2.39\n"
+        "w Bandwidth=%d\n"
+        "p %s\n", i, id64, d64, published,
+        (int)((r>>8)&127)+1, (int)((r>>16)&255), (int)((r>>24)&255), i&255,
+        (r & 4) ? 9030 : 0, flags, (int)(r % 20000) + 20,
+        (r & 1) ? "reject 1-65535" : "accept 20-23,43,53,79-81,88,110,143,"
+                                     "194,220,443,464-465,543-544,563,587");
+    smartlist_add(sl, cp);
+  }
+
+  bench_rand_bytes(sigbytes, sizeof(sigbytes));
+  base64_encode(sig, sizeof(sig), sigbytes, sizeof(sigbytes),
+                BASE64_ENCODE_MULTILINE);
+  tor_asprintf(&cp,
+      "directory-footer\n"
+      "bandwidth-weights Wbd=0 Wbe=0 Wbg=4194 Wbm=10000 Wdb=10000 Web=10000 "
+        "Wed=10000 Wee=10000 Weg=10000 Wem=10000 Wgb=10000 Wgd=0 Wgg=5806 "
+        "Wgm=5806 Wmb=10000 Wmd=0 Wme=0 Wmg=4194 Wmm=10000\n"
+      "directory-signature %s %s\n"
+      "-----BEGIN SIGNATURE-----\n"
+      "%s%s"
+      "-----END SIGNATURE-----\n", voter, voter, sig,
+      (*sig && sig[strlen(sig)-1] == '\n') ? "" : "\n");
+  smartlist_add(sl, cp);
+
+  result = smartlist_join_strings(sl, "", 0, NULL);
+  SMARTLIST_FOREACH(sl, char *, s, tor_free(s));
+  smartlist_free(sl);
+  return result;
+}
+
+/** An exit policy like the ones that relays run. */
+static const char bench_exit_policy[] =
+  "reject 0.0.0.0/8:*,reject 169.254.0.0/16:*,reject 127.0.0.0/8:*,"
+  "reject 192.168.0.0/16:*,reject 10.0.0.0/8:*,reject 172.16.0.0/12:*,"
+  "accept *:20-23,accept *:43,accept *:53,accept *:79-81,accept *:88,"
+  "accept *:110,accept *:143,accept *:194,accept *:220,accept *:389,"
+  "accept *:443,accept *:464,accept *:531,accept *:543-544,accept *:554,"
+  "accept *:563,accept *:636,accept *:706,accept *:749,accept *:873,"
+  "accept *:902-904,accept *:981,accept *:989-995,accept *:1194,"
+  "accept *:1220,accept *:1293,accept *:1500,accept *:1533,accept *:1677,"
+  "accept *:1723,accept *:1755,accept *:1863,accept *:2082-2083,"
+  "accept *:2086-2087,accept *:2095-2096,accept *:2102-2104,"
+  "accept *:3128,accept *:3389,accept *:3690,accept *:4321,accept *:4643,"
+  "accept *:5050,accept *:5190,accept *:5222-5223,accept *:5228,"
+  "accept *:5900,accept *:6660-6669,accept *:6679,accept *:6697,"
+  "accept *:8000,accept *:8008,accept *:8074,accept *:8080,accept *:8087-8088,"
+  "accept *:8443,accept *:8888,accept *:9418,accept *:9999-10000,"
+  "accept *:11371,accept *:19294,accept *:19638,accept *:50002,"
+  "accept *:64738,reject *:*";
+
+/** Kinds of directory documents that --replay knows how to ingest. */
+typedef enum replay_kind_t {
+  REPLAY_UNKNOWN,
+  REPLAY_CERTS,
+  REPLAY_CONSENSUS,
+  REPLAY_DESCRIPTORS,
+  REPLAY_MICRODESCS
+} replay_kind_t;
+
+/** Names of the replay_kind_t values, for our output. */
+static const char *replay_kind_names[] = {
+  "unknown", "certs", "consensus", "descriptors", "microdescs"
+};
+
+/** Return what kind of document <b>body</b> is, by its first keyword after
+ * any annotations.  Set *<b>flavor_out</b> to the flavor of a consensus. */
+static replay_kind_t
+replay_kind_of(const char *body, const char **flavor_out)
+{
+  while (*body == '@' || *body == '\n') {
+    body = strchr(body, '\n');
+    if (!body)
+      return REPLAY_UNKNOWN;
+    ++body;
+  }
+  *flavor_out = "ns";
+  if (!strcmpstart(body, "dir-key-certificate-version"))
+    return REPLAY_CERTS;
+  if (!strcmpstart(body, "network-status-version 3")) {
+    if (!strcmpstart(body, "network-status-version 3 microdesc"))
+      *flavor_out = "microdesc";
+    return REPLAY_CONSENSUS;
+  }
+  if (!strcmpstart(body, "router "))
+    return REPLAY_DESCRIPTORS;
+  if (!strcmpstart(body, "onion-key"))
+    return REPLAY_MICRODESCS;
+  return REPLAY_UNKNOWN;
+}
+
+/** Ingest <b>body</b> as a document of kind <b>kind</b> the way we would if
+ * it had just been downloaded, and return how many documents we took or a
+ * negative value on failure. */
+static int
+replay_ingest(replay_kind_t kind, char *body, const char *flavor)
+{
+  smartlist_t *added;
+  int n;
+  switch (kind) {
+    case REPLAY_CERTS:
+      return trusted_dirs_load_certs_from_string(body, 0, 1) < 0 ? -1 : 1;
+    case REPLAY_CONSENSUS:
+      return networkstatus_set_current_consensus(body, flavor,
+                                          NSSET_DONT_DOWNLOAD_CERTS|
+                                          NSSET_ACCEPT_OBSOLETE) < 0 ? -1 : 1;
+    case REPLAY_DESCRIPTORS:
+      return router_load_routers_from_string(body, NULL, SAVED_NOWHERE,
+                                             NULL, 0, NULL);
+    case REPLAY_MICRODESCS:
+      added = microdescs_add_to_cache(get_microdesc_cache(), body, NULL,
+                                      SAVED_NOWHERE, 0);
+      if (!added)
+        return -1;
+      n = smartlist_len(added);
+      smartlist_free(added);
+      return n;
+    default:
+      return -1;
+  }
+}
+
+/** Replay the ingestion of every directory document in <b>dir</b>, and
+ * print one CSV line for each and one for all of them.  Return 0 on
+ * success, -1 if we couldn't read the directory. */
+static int
+bench_replay(const char *dir)
+{
+  smartlist_t *files;
+  char *dirname;
+  uint64_t total_bytes = 0, total_usec = 0, total_allocs = 0, peak = 0;
+  int pass, n_files = 0;
+
+  tor_asprintf((unsigned char **)&dirname, "%s%s", dir,
+               (*dir && dir[strlen(dir)-1] == '\\') ? "" : "\\");
+  files = tor_listdir(dirname);
+  if (!files) {
+    printf("Could not list %s\n", dirname);
+    tor_free(dirname);
+    return -1;
+  }
+  smartlist_sort_strings(files);
+  /* We need the certificates before we can take any consensus. */
+  dlgAuthorities_initDirServers(&get_options()->DirServers);
+
+  printf("file,kind,bytes,usec,mb_per_sec,allocs,peak_heap_bytes,"
+         "heap_bytes_after,result\n");
+  for (pass = 0; pass < 2; ++pass) {
+    SMARTLIST_FOREACH_BEGIN(files, const char *, name) {
+      char *fname, *body;
+      const char *flavor;
+      replay_kind_t kind;
+      uint64_t start, usec, allocs;
+      size_t len;
+      int r;
+
+      tor_asprintf((unsigned char **)&fname, "%s%s", dirname, name);
+      body = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+      tor_free(fname);
+      if (!body)
+        continue;
+      kind = replay_kind_of(body, &flavor);
+      if (kind == REPLAY_UNKNOWN || (kind == REPLAY_CERTS) != (pass == 0)) {
+        tor_free(body);
+        continue;
+      }
+      len = strlen(body);
+      update_approx_time(time(NULL));
+      tor_malloc_peak_bytes = tor_malloc_live_bytes;
+      allocs = tor_malloc_calls;
+      start = perf_now_usec();
+      r = replay_ingest(kind, body, flavor);
+      usec = perf_now_usec() - start;
+      allocs = tor_malloc_calls - allocs;
+      tor_free(body);
+      printf("%s,%s,%lu,"U64_FORMAT",%.2f,"U64_FORMAT","U64_FORMAT","
+             U64_FORMAT",%d\n", name, replay_kind_names[kind],
+             (unsigned long)len, U64_PRINTF_ARG(usec),
+             usec ? (double)len / usec : 0.0, U64_PRINTF_ARG(allocs),
+             U64_PRINTF_ARG(tor_malloc_peak_bytes),
+             U64_PRINTF_ARG(tor_malloc_live_bytes), r);
+      fflush(stdout);
+      total_bytes += len;
+      total_usec += usec;
+      total_allocs += allocs;
+      if (tor_malloc_peak_bytes > peak)
+        peak = tor_malloc_peak_bytes;
+      ++n_files;
+    } SMARTLIST_FOREACH_END(name);
+  }
+  printf("total,%d files,"U64_FORMAT","U64_FORMAT",%.2f,"U64_FORMAT","
+         U64_FORMAT","U64_FORMAT",\n", n_files, U64_PRINTF_ARG(total_bytes),
+         U64_PRINTF_ARG(total_usec),
+         total_usec ? (double)total_bytes / total_usec : 0.0,
+         U64_PRINTF_ARG(total_allocs), U64_PRINTF_ARG(peak),
+         U64_PRINTF_ARG(tor_malloc_live_bytes));
+
+  SMARTLIST_FOREACH(files, char *, cp, tor_free(cp));
+  smartlist_free(files);
+  tor_free(dirname);
+  return 0;
+}
+
+/** Print a usage message, and exit. */
+static void
+syntax(void)
+{
+  printf("Syntax:\n"
+         "  bench [benchmark...]\n"
+         "  bench --replay DIR\n"
+         "  bench --load PORT [CLIENTS [SECONDS [BYTES]]]\n"
+         "Runs the benchmarks whose names start with one of the arguments, "
+         "or all of them.\n"
+         "Prints benchmark,iterations,ns_per_op,allocs_per_op lines.\n"
+         "With --replay, takes in the certificates, consensuses, router "
+         "descriptors and\nmicrodescriptors in DIR, and prints what each "
+         "file cost.\n"
+         "With --load, keeps CLIENTS (100) SOCKS and HTTP proxy clients "
+         "busy for SECONDS (10)\nagainst the AdvOR that listens on "
+         "127.0.0.1:PORT, each asking for BYTES (16384)\nper stream. Run "
+         "that AdvOR with __LoopbackExit 1.\n");
+  exit(0);
+}
+
+/** Return true iff the benchmark <b>name</b> was asked for on the command
+ * line <b>c</b>, <b>v</b>. */
+static int
+bench_selected(const char *name, int c, char **v)
+{
+  int i;
+  if (c < 2)
+    return 1;
+  for (i = 1; i < c; ++i)
+    if (!strcmpstart(name, v[i]))
+      return 1;
+  return 0;
+}
+
+int
+main(int c, char**v)
+{
+  or_options_t *options;
+  unsigned char *errmsg = NULL;
+  const char *replay_dir = NULL;
+  long load_args[4] = { 0, 100, 10, 16384 };
+  int i, ok = 1, load = 0;
+
+  if (c == 3 && !strcmp(v[1], "--replay"))
+    replay_dir = v[2];
+  else if (c >= 3 && c <= 6 && !strcmp(v[1], "--load")) {
+    load = 1;
+    for (i = 2; i < c && ok; ++i)
+      load_args[i-2] = tor_parse_long(v[i], 10, i == 2 ? 1 : 0,
+                                      i == 2 ? 65535 : LONG_MAX, &ok, NULL);
+    if (!ok)
+      syntax();
+  } else for (i = 1; i < c; ++i)
+    if (v[i][0] == '-')
+      syntax();
+
+  tor_alloc_init();
+  update_approx_time(time(NULL));
+  options = options_new();
+  tor_threads_init();
+  setLogging(LOG_ERR);
+
+  options->command = CMD_RUN_UNITTESTS;
+  crypto_global_init();
+  rep_hist_init();
+  network_init();
+  options_init(options);
+  if (set_options(options, &errmsg) < 0) {
+    printf("Failed to set initial options: %s\n", errmsg);
+    tor_free(errmsg);
+    return 1;
+  }
+  tmpOptions = get_options();
+  crypto_seed_rng(1);
+
+  if (replay_dir) {
+    /* Whatever the replay caches goes to our own files in the temporary
+     * directory, never to those of an installed AdvOR. */
+    if (!GetTempPath(sizeof(fullpath) - 16, fullpath))
+      fullpath[0] = 0;
+    strlcat(fullpath, "AdvOR-bench", sizeof(fullpath));
+    return bench_replay(replay_dir) < 0 ? 1 : 0;
+  }
+  if (load)
+    return loadgen_run((uint16_t)load_args[0], (int)load_args[1],
+                       (int)load_args[2], (uint32_t)load_args[3]) < 0 ? 1 : 0;
+
+  printf("benchmark,iterations,ns_per_op,allocs_per_op\n");
+
+  {
+    bench_buf_t b;
+    b.in = buf_new();
+    b.out = buf_new();
+    bench_rand_bytes(b.data, sizeof(b.data));
+    if (bench_selected("buf_write", c, v))
+      bench_run("buf_write", bench_buf_write, &b);
+    if (bench_selected("buf_write_fetch", c, v))
+      bench_run("buf_write_fetch", bench_buf_write_fetch, &b);
+    if (bench_selected("buf_move", c, v))
+      bench_run("buf_move", bench_buf_move, &b);
+    buf_free(b.in);
+    buf_free(b.out);
+  }
+
+  if (bench_selected("relay_crypt_one_payload", c, v)) {
+    bench_crypt_t cr;
+    char key[CIPHER_KEY_LEN];
+    bench_rand_bytes(key, sizeof(key));
+    bench_rand_bytes(cr.payload, sizeof(cr.payload));
+    cr.cipher = crypto_create_init_cipher(key, 1);
+    bench_run("relay_crypt_one_payload", bench_relay_crypt, &cr);
+    crypto_free_cipher_env(cr.cipher);
+  }
+
+  if (bench_selected("fetch_from_buf_http", c, v)) {
+    buf_t *buf = buf_new();
+    bench_run("fetch_from_buf_http", bench_fetch_from_buf_http, buf);
+    buf_free(buf);
+  }
+
+  if (bench_selected("parse_request_headers", c, v)) {
+    edge_connection_t *conn = tor_malloc_zero(sizeof(edge_connection_t));
+    conn->_base.magic = EDGE_CONNECTION_MAGIC;
+    conn->_base.type = CONN_TYPE_AP;
+    conn->socks_request = tor_malloc_zero(sizeof(socks_request_t));
+    conn->socks_request->port = 80;
+    bench_run("parse_request_headers", bench_parse_request_headers, conn);
+    tor_free(conn->socks_request);
+    tor_free(conn);
+  }
+
+  if (bench_selected("policy_eval", c, v)) {
+    bench_policy_t *p = tor_malloc_zero(sizeof(bench_policy_t));
+    config_line_t line;
+    line.key = (char *)"ExitPolicy";
+    line.value = (char *)bench_exit_policy;
+    line.next = NULL;
+    if (policies_parse_exit_policy(&line, &p->policy, 1, NULL, 0) == 0) {
+      for (i = 0; i < BENCH_N_ADDRS; ++i) {
+        tor_addr_from_ipv4h(&p->addrs[i], bench_rand());
+        p->ports[i] = (i & 1) ? 443 : (uint16_t)bench_rand();
+      }
+      bench_run("policy_eval", bench_policy_eval, p);
+    }
+    addr_policy_list_free(p->policy);
+    tor_free(p);
+  }
+
+  {
+    bench_geoip_t *g = tor_malloc_zero(sizeof(bench_geoip_t));
+    for (i = 0; i < BENCH_N_ADDRS; ++i)
+      g->ips[i] = bench_rand();
+    for (i = 0; i < BENCH_N_ADDRS/2; ++i) {
+      g->paths[i][0] = g->ips[2*i];
+      g->paths[i][1] = g->ips[2*i+1];
+    }
+    geoip_ranges_init();
+    if (bench_selected("geoip_get_country_by_ip", c, v))
+      bench_run("geoip_get_country_by_ip", bench_geoip_country, g);
+    if (bench_selected("geoip_as_path", c, v))
+      bench_run("geoip_as_path", bench_geoip_as_path, g);
+    tor_free(g);
+  }
+
+  if (bench_selected("consensus_parse", c, v) ||
+      bench_selected("choose_by_bw_weights", c, v)) {
+    char *body = bench_make_consensus();
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(body, NULL, NS_TYPE_CONSENSUS);
+    if (!ns) {
+      printf("Could not parse the consensus fixture.\n");
+      tor_free(body);
+      return 1;
+    }
+    if (bench_selected("consensus_parse", c, v))
+      bench_run("consensus_parse", bench_consensus_parse, body);
+    if (bench_selected("choose_by_bw_weights", c, v)) {
+      networkstatus_t *old = networkstatus_swap_current_consensus(ns);
+      bench_run("choose_by_bw_weights", bench_choose_by_bw_weights, ns);
+      networkstatus_swap_current_consensus(old);
+    }
+    networkstatus_vote_free(ns);
+    tor_free(body);
+  }
+
+  return 0;
+}
+
@@ -73,6 +73,8 @@ char *CHUNK_WRITE_PTR(chunk_t *chunk)
  * running out of space. */
 size_t CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->release)
+    return 0;
   return (&chunk->mem[0] + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -92,19 +94,34 @@ typedef struct chunk_freelist_t {
   size_t alloc_size; /**< What size chunks does this freelist hold? */
   int max_length; /**< Never allow more than this number of chunks in the
                    * freelist. */
-  int slack; /**< When trimming the freelist, leave this number of extra
-              * chunks beyond lowest_length.*/
+  int slack; /**< When trimming the freelist, never keep fewer than this
+              * number of chunks on it. */
   int cur_length; /**< How many chunks on the freelist now? */
   int lowest_length; /**< What's the smallest value of cur_length since the
                       * last time we cleaned this freelist? */
-  uint64_t n_alloc;
-  uint64_t n_free;
-  uint64_t n_hit;
+  int target_length; /**< How many chunks do we want to keep on the
+                      * freelist after cleaning it?  Estimated from the
+                      * demand we saw in recent cleaning intervals. */
+  int n_in_use; /**< How many chunks of this size are on buffers now? */
+  int in_use_at_trim; /**< Value of n_in_use when we last cleaned this
+                       * freelist. */
+  int highwater; /**< Largest value of n_in_use since the last cleaning. */
+  int max_highwater; /**< Largest value of n_in_use ever. */
+  uint64_t n_alloc; /**< How many chunks of this size did we malloc? */
+  uint64_t n_free; /**< How many chunks of this size did we free? */
+  uint64_t n_hit; /**< How many chunks did we take from the freelist? */
+  uint64_t n_alloc_at_trim; /**< Value of n_alloc at the last cleaning. */
+  uint64_t n_hit_at_trim; /**< Value of n_hit at the last cleaning. */
+  unsigned int last_misses; /**< Allocations during the last complete
+                             * cleaning interval that the freelist could
+                             * not satisfy. */
+  unsigned int last_hits; /**< Allocations during the last complete cleaning
+                           * interval that the freelist satisfied. */
   chunk_t *head; /**< First chunk on the freelist. */
 } chunk_freelist_t;
 
 /** Macro to help define freelists. */
-#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
+#define FL(a,m,s) { a, m, s, 0, 0, s, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL }
 
 /** Static array of freelists, sorted by alloc_len, terminated by an entry
  * with alloc_size of 0. */
@@ -125,7 +142,7 @@ static INLINE chunk_freelist_t *
 get_freelist(size_t alloc)
 {
   int i;
-  for (i=0; freelists[i].alloc_size <= alloc; ++i) {
+  for (i=0; freelists[i].alloc_size && freelists[i].alloc_size <= alloc; ++i) {
     if (freelists[i].alloc_size == alloc) {
       return &freelists[i];
     }
@@ -140,8 +157,15 @@ chunk_free_unchecked(chunk_t *chunk)
   size_t alloc;
   chunk_freelist_t *freelist;
 
+  if (chunk->release) {
+    chunk->release(chunk->release_arg);
+    tor_free_tagged(MEM_TAG_BUFFERS, chunk, sizeof(chunk_t));
+    return;
+  }
   alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
   freelist = get_freelist(alloc);
+  if (freelist)
+    --freelist->n_in_use;
   if (freelist && freelist->cur_length < freelist->max_length) {
     chunk->next = freelist->head;
     freelist->head = chunk;
@@ -149,7 +173,19 @@ chunk_free_unchecked(chunk_t *chunk)
   } else {
     if (freelist)
       ++freelist->n_free;
-    tor_free(chunk);
+    tor_free_tagged(MEM_TAG_BUFFERS, chunk, alloc);
+  }
+}
+
+/** Note that a chunk of the size held by <b>freelist</b> has been put on a
+ * buffer, and update its high-water marks. */
+static INLINE void
+freelist_note_in_use(chunk_freelist_t *freelist)
+{
+  if (++freelist->n_in_use > freelist->highwater) {
+    freelist->highwater = freelist->n_in_use;
+    if (freelist->highwater > freelist->max_highwater)
+      freelist->max_highwater = freelist->highwater;
   }
 }
 
@@ -175,29 +211,41 @@ chunk_t *chunk_new_with_alloc_size(size_t alloc)
       ++freelist->n_alloc;
     else
       ++n_freelist_miss;
-    ch = tor_malloc(alloc);
+    ch = tor_malloc_tagged(MEM_TAG_BUFFERS, alloc);
   }
+  if (freelist)
+    freelist_note_in_use(freelist);
   ch->next = NULL;
   ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
+  ch->release = NULL;
+  ch->release_arg = NULL;
   return ch;
 }
 #else
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
-  tor_free(chunk);
+  if (chunk->release) {
+    chunk->release(chunk->release_arg);
+    tor_free_tagged(MEM_TAG_BUFFERS, chunk, sizeof(chunk_t));
+  } else {
+    tor_free_tagged(MEM_TAG_BUFFERS, chunk, CHUNK_ALLOC_SIZE(chunk->memlen));
+  }
 }
 static INLINE chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
   ch = tor_malloc_roundup(&alloc);
+  tor_mem_account(MEM_TAG_BUFFERS, alloc);
   ch->next = NULL;
   ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
+  ch->release = NULL;
+  ch->release_arg = NULL;
   return ch;
 }
 #endif
@@ -209,7 +257,20 @@ chunk_grow(chunk_t *chunk, size_t sz)
 {
   off_t offset;
   tor_assert(sz > chunk->memlen);
+#ifdef ENABLE_BUF_FREELISTS
+  {
+    /* The chunk changes size classes, so move it between the counts. */
+    chunk_freelist_t *freelist = get_freelist(CHUNK_ALLOC_SIZE(chunk->memlen));
+    if (freelist)
+      --freelist->n_in_use;
+    freelist = get_freelist(CHUNK_ALLOC_SIZE(sz));
+    if (freelist)
+      freelist_note_in_use(freelist);
+  }
+#endif
   offset = chunk->data - &chunk->mem[0];
+  tor_mem_account(MEM_TAG_BUFFERS,
+                  CHUNK_ALLOC_SIZE(sz) - CHUNK_ALLOC_SIZE(chunk->memlen));
   chunk = tor_realloc(chunk, CHUNK_ALLOC_SIZE(sz));
   chunk->memlen = sz;
   chunk->data = &chunk->mem[0] + offset;
@@ -236,18 +297,51 @@ preferred_chunk_size(size_t target)
   return sz;
 }
 
+#ifdef ENABLE_BUF_FREELISTS
+/** Recompute how many chunks <b>fl</b> should keep after this cleaning from
+ * the demand we saw since the last one, and start a new interval of usage
+ * counters. */
+static void
+freelist_update_target(chunk_freelist_t *fl)
+{
+  int demand = fl->highwater - fl->in_use_at_trim;
+  int target;
+  if (demand < 0)
+    demand = 0;
+  fl->last_misses = (unsigned int)(fl->n_alloc - fl->n_alloc_at_trim);
+  fl->last_hits = (unsigned int)(fl->n_hit - fl->n_hit_at_trim);
+  /* Move a quarter of the way toward the latest burst, so that a single
+   * spike doesn't pin memory for long; but if the freelist ran dry during
+   * that burst, keep enough to absorb it next time. */
+  target = (3*fl->target_length + demand + 3) / 4;
+  if (fl->last_misses && target < demand)
+    target = demand;
+  if (target < fl->slack)
+    target = fl->slack;
+  if (target > fl->max_length)
+    target = fl->max_length;
+  fl->target_length = target;
+  fl->in_use_at_trim = fl->highwater = fl->n_in_use;
+  fl->n_alloc_at_trim = fl->n_alloc;
+  fl->n_hit_at_trim = fl->n_hit;
+}
+#endif
+
 /** Remove from the freelists most chunks that have not been used since the
- * last call to buf_shrink_freelists(). */
+ * last call to buf_shrink_freelists(), keeping as many as recent demand
+ * suggests we will need. */
 void buf_shrink_freelists(int free_all)
 {
 #ifdef ENABLE_BUF_FREELISTS
 	int i;
 	disable_control_logging();
 	for(i = 0; freelists[i].alloc_size; ++i)
-	{	int slack = freelists[i].slack;
+	{	int n_spare;
 		assert_freelist_ok(&freelists[i]);
-		if(free_all || freelists[i].lowest_length > slack)
-		{	int n_to_free = free_all ? freelists[i].cur_length : (freelists[i].lowest_length - slack);
+		freelist_update_target(&freelists[i]);
+		n_spare = MIN(freelists[i].lowest_length, freelists[i].cur_length - freelists[i].target_length);
+		if(free_all || n_spare > 0)
+		{	int n_to_free = free_all ? freelists[i].cur_length : n_spare;
 			int n_to_skip = freelists[i].cur_length - n_to_free;
 			int orig_length = freelists[i].cur_length;
 			int orig_n_to_free = n_to_free, n_freed=0;
@@ -270,7 +364,7 @@ void buf_shrink_freelists(int free_all)
 			*chp = NULL;
 			while(chunk)
 			{	chunk_t *next = chunk->next;
-				tor_free(chunk);
+				tor_free_tagged(MEM_TAG_BUFFERS,chunk,freelists[i].alloc_size);
 				chunk = next;
 				--n_to_free;
 				++n_freed;
@@ -303,6 +397,7 @@ buf_dump_freelist_sizes(int severity)
     uint64_t total = ((uint64_t)freelists[i].cur_length) *
       freelists[i].alloc_size;
     log(severity, LD_MM,get_lang_str(LANG_LOG_BUFFERS_CHUNKS),U64_PRINTF_ARG(total),freelists[i].cur_length, (int)freelists[i].alloc_size,U64_PRINTF_ARG(freelists[i].n_alloc),U64_PRINTF_ARG(freelists[i].n_free),U64_PRINTF_ARG(freelists[i].n_hit));
+    log(severity, LD_MM,get_lang_str(LANG_LOG_BUFFERS_CHUNK_USAGE),(int)freelists[i].alloc_size,freelists[i].n_in_use,freelists[i].highwater,freelists[i].max_highwater,freelists[i].target_length,freelists[i].last_hits,freelists[i].last_misses);
   }
   log(severity, LD_MM, get_lang_str(LANG_LOG_BUFFERS_ALLOCATIONS),U64_PRINTF_ARG(n_freelist_miss));
 #else
@@ -310,6 +405,62 @@ buf_dump_freelist_sizes(int severity)
 #endif
 }
 
+/** Return a newly allocated string describing the chunk freelists, one line
+ * per chunk size, for the "buffers/freelists" GETINFO key. */
+char *
+buf_get_freelist_stats(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+#ifdef ENABLE_BUF_FREELISTS
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *fl = &freelists[i];
+    unsigned char *line = NULL;
+    tor_asprintf(&line, "size=%d free=%d target=%d in-use=%d highwater=%d "
+                 "max-highwater=%d allocs="U64_FORMAT" frees="U64_FORMAT
+                 " hits="U64_FORMAT" recent-hits=%u recent-misses=%u",
+                 (int)fl->alloc_size, fl->cur_length, fl->target_length,
+                 fl->n_in_use, fl->highwater, fl->max_highwater,
+                 U64_PRINTF_ARG(fl->n_alloc), U64_PRINTF_ARG(fl->n_free),
+                 U64_PRINTF_ARG(fl->n_hit), fl->last_hits, fl->last_misses);
+    smartlist_add(lines, line);
+  }
+  {
+    unsigned char *line = NULL;
+    tor_asprintf(&line, "size=other allocs="U64_FORMAT,
+                 U64_PRINTF_ARG(n_freelist_miss));
+    smartlist_add(lines, line);
+  }
+#endif
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Set *<b>n_alloc</b>, *<b>n_free</b> and *<b>n_hit</b> to the number of
+ * chunks we allocated, freed and took from the freelists, summed over all
+ * chunk sizes, and *<b>n_miss</b> to the number of chunks we allocated
+ * that no freelist could hold. */
+void
+buf_get_freelist_totals(uint64_t *n_alloc, uint64_t *n_free,
+                        uint64_t *n_hit, uint64_t *n_miss)
+{
+  *n_alloc = *n_free = *n_hit = *n_miss = 0;
+#ifdef ENABLE_BUF_FREELISTS
+  {
+    int i;
+    for (i = 0; freelists[i].alloc_size; ++i) {
+      *n_alloc += freelists[i].n_alloc;
+      *n_free += freelists[i].n_free;
+      *n_hit += freelists[i].n_hit;
+    }
+    *n_miss = n_freelist_miss;
+  }
+#endif
+}
+
 
 /** Collapse data from the first N chunks from <b>buf</b> into buf->head,
  * growing it as necessary, until buf->head has the first <b>bytes</b> bytes
@@ -324,6 +475,16 @@ void buf_pullup(buf_t *buf, size_t bytes)
 	if(buf->datalen < bytes)
 		bytes = buf->datalen;
 	if(buf->head->datalen >= bytes)	return;
+	if(buf->head->release)	/* We can't write into memory we only refer to: copy it into a chunk of our own first. */
+	{	chunk_t *ref = buf->head;
+		chunk_t *newhead = chunk_new_with_alloc_size(preferred_chunk_size(bytes));
+		memcpy(newhead->data, ref->data, ref->datalen);
+		newhead->datalen = ref->datalen;
+		newhead->next = ref->next;
+		if(buf->tail == ref)	buf->tail = newhead;
+		buf->head = newhead;
+		chunk_free_unchecked(ref);
+	}
 	if(buf->head->memlen >= bytes)	/* We don't need to grow the first chunk, but we might need to repack it.*/
 	{	if(CHUNK_REMAINING_CAPACITY(buf->head) < bytes - buf->head->datalen)
 			chunk_repack(buf->head);
@@ -430,6 +591,33 @@ buf_clear(buf_t *buf)
   buf->head = buf->tail = NULL;
 }
 
+/** Remove everything but the first <b>n</b> bytes from <b>buf</b>. */
+void
+buf_truncate(buf_t *buf, size_t n)
+{
+  chunk_t *chunk, *next;
+  size_t left = n;
+  tor_assert(n <= buf->datalen);
+  if (n == buf->datalen)
+    return;
+  if (!n) {
+    buf_clear(buf);
+    return;
+  }
+  for (chunk = buf->head; left > chunk->datalen; chunk = chunk->next)
+    left -= chunk->datalen;
+  chunk->datalen = left;
+  for (next = chunk->next; next; ) {
+    chunk_t *victim = next;
+    next = next->next;
+    chunk_free_unchecked(victim);
+  }
+  chunk->next = NULL;
+  buf->tail = chunk;
+  buf->datalen = n;
+  check();
+}
+
 /** Return the number of bytes stored in <b>buf</b> */
 size_t
 buf_datalen(const buf_t *buf)
@@ -494,9 +682,9 @@ chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   return chunk;
 }
 
-/** If we're using readv and writev, how many chunks are we willing to
- * read/write at a time? */
-#define N_IOV 3
+/** If we're using readv and writev (or WSASend on Windows), how many chunks
+ * are we willing to read/write at a time? */
+#define N_IOV 16
 
 /** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
  * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
@@ -648,9 +836,11 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
 }
 
 /** Helper for flush_buf(): try to write <b>sz</b> bytes from chunk
- * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  On success, deduct
- * the bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
- * written on success, 0 on blocking, -1 on failure.
+ * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  On Windows, the
+ * write is gathered from up to N_IOV chunks starting at <b>chunk</b> with a
+ * single WSASend() call.  On success, deduct the bytes written from
+ * *<b>buf_flushlen</b>.  Return the number of bytes written on success, 0 on
+ * blocking, -1 on failure.
  */
 static INLINE int
 flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
@@ -671,6 +861,26 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
     chunk = chunk->next;
   }
   write_result = writev(s, iov, i);
+#elif defined(MS_WINDOWS)
+  WSABUF iov[N_IOV];
+  DWORD written = 0;
+  int i;
+  size_t remaining = sz;
+  for (i=0; chunk && i < N_IOV && remaining; ++i) {
+    iov[i].buf = chunk->data;
+    if (remaining > chunk->datalen)
+      iov[i].len = (u_long)chunk->datalen;
+    else
+      iov[i].len = (u_long)remaining;
+    remaining -= iov[i].len;
+    chunk = chunk->next;
+  }
+  if (!i)
+    write_result = 0;
+  else if (WSASend(s, iov, i, &written, 0, NULL, NULL) == SOCKET_ERROR)
+    write_result = -1;
+  else
+    write_result = written;
 #else
   if (sz > chunk->datalen)
     sz = chunk->datalen;
@@ -755,10 +965,24 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef MS_WINDOWS
+    {
+      /* flush_chunk() gathers up to N_IOV chunks; offer it all of them. */
+      const chunk_t *chunk;
+      int i;
+      flushlen0 = 0;
+      for (chunk = buf->head, i = 0; chunk && i < N_IOV && flushlen0 < sz;
+           chunk = chunk->next, ++i)
+        flushlen0 += chunk->datalen;
+      if (flushlen0 > sz)
+        flushlen0 = sz;
+    }
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
+#endif
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
     check();
@@ -774,11 +998,13 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
 }
 
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
- * <b>flushlen</b> bytes.
+ * <b>flushlen</b> bytes.  If <b>record_size</b> is nonzero, hand the data to
+ * TLS at most that many bytes at a time, so that it goes out in records of
+ * about that size.
  */
 int
 flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
-              size_t *buf_flushlen)
+              size_t record_size, size_t *buf_flushlen)
 {
   int r;
   size_t flushed = 0;
@@ -803,6 +1029,8 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
     } else {
       flushlen0 = 0;
     }
+    if (record_size && flushlen0 > record_size)
+      flushlen0 = record_size;
 
     r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
     check();
@@ -875,6 +1103,37 @@ peek_from_buf(char *string, size_t string_len, const buf_t *buf)
   }
 }
 
+/** Helper: copy the <b>string_len</b> bytes that start <b>offset</b> bytes
+ * into <b>buf</b> onto <b>string</b>, without draining <b>buf</b>.
+ */
+static void
+peek_from_buf_at(char *string, size_t string_len, size_t offset,
+                 const buf_t *buf)
+{
+  chunk_t *chunk;
+
+  tor_assert(string);
+  tor_assert(offset <= buf->datalen);
+  tor_assert(string_len <= buf->datalen - offset);
+
+  chunk = buf->head;
+  while (chunk && offset >= chunk->datalen) {
+    offset -= chunk->datalen;
+    chunk = chunk->next;
+  }
+  while (string_len) {
+    size_t copy = string_len;
+    tor_assert(chunk);
+    if (chunk->datalen - offset < copy)
+      copy = chunk->datalen - offset;
+    memcpy(string, chunk->data + offset, copy);
+    string_len -= copy;
+    string += copy;
+    offset = 0;
+    chunk = chunk->next;
+  }
+}
+
 /** Remove <b>string_len</b> bytes from the front of <b>buf</b>, and store
  * them into <b>string</b>.  Return the new buffer size.  <b>string_len</b>
  * must be \<= the number of bytes on the buffer.
@@ -932,25 +1191,107 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   result->command = command;
   result->circ_id = ntohs(get_uint16(hdr));
 
-  buf_remove_from_front(buf, VAR_CELL_HEADER_SIZE);
-  peek_from_buf((char*) result->payload, length, buf);
-  buf_remove_from_front(buf, length);
+  peek_from_buf_at((char*) result->payload, length, VAR_CELL_HEADER_SIZE, buf);
+  buf_remove_from_front(buf, VAR_CELL_HEADER_SIZE+length);
   check();
 
   *out = result;
   return 1;
 }
 
+/** Check <b>buf</b> for a fixed-length cell.  If there is a whole one, remove
+ * it from the buffer, decode it into *<b>out</b>, and return 1.  Otherwise
+ * leave the buffer alone and return 0.  The payload is copied straight from
+ * the buffer's chunks into <b>out</b>, even if the cell spans several of
+ * them. */
+int
+fetch_cell_from_buf(buf_t *buf, cell_t *out)
+{
+  char hdr[CELL_NETWORK_SIZE-CELL_PAYLOAD_SIZE];
+  check();
+  if (buf->datalen < CELL_NETWORK_SIZE)
+    return 0;
+  peek_from_buf(hdr, sizeof(hdr), buf);
+  out->circ_id = ntohs(get_uint16(hdr));
+  out->command = get_uint8(hdr+2);
+  peek_from_buf_at((char*) out->payload, CELL_PAYLOAD_SIZE, sizeof(hdr), buf);
+  buf_remove_from_front(buf, CELL_NETWORK_SIZE);
+  check();
+  return 1;
+}
+
+/** If a chunk on the head of a buffer holds less than 1/<b>this</b> of its
+ * storage, move_buf_to_buf() copies its data instead of relinking it, so
+ * that we don't keep mostly-empty chunks alive on the target buffer. */
+#define MOVE_RELINK_MIN_FILL 2
+
+/** Append <b>chunk</b>, which must not be on any buffer, to the tail of
+ * <b>buf</b>.  If the current tail of <b>buf</b> is empty, release it first,
+ * since only the tail of a buffer may be empty. */
+static void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
+  chunk->next = NULL;
+  if (buf->tail && !buf->tail->datalen) {
+    chunk_t *victim = buf->tail;
+    if (buf->head == victim) {
+      buf->head = buf->tail = NULL;
+    } else {
+      chunk_t *prev = buf->head;
+      while (prev->next != victim)
+        prev = prev->next;
+      prev->next = NULL;
+      buf->tail = prev;
+    }
+    chunk_free_unchecked(victim);
+  }
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    tor_assert(!buf->head);
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += chunk->datalen;
+}
+
+/** Append the <b>string_len</b> bytes at <b>string</b> to <b>buf</b>
+ * without copying them: the buffer gets a chunk that refers to
+ * <b>string</b>, which must stay unchanged until the buffer is done with it
+ * and calls <b>release</b>(<b>arg</b>).  (If <b>string_len</b> is 0, we
+ * call it right away.)  Return the new length of the buffer. */
+int
+write_ref_to_buf(const char *string, size_t string_len, buf_t *buf,
+                 void (*release)(void *arg), void *arg)
+{
+  chunk_t *chunk;
+  tor_assert(release);
+  if (!string_len) {
+    release(arg);
+    return (int)buf->datalen;
+  }
+  chunk = tor_malloc_zero_tagged(MEM_TAG_BUFFERS, sizeof(chunk_t));
+  chunk->data = (char *)string;
+  chunk->datalen = string_len;
+  chunk->release = release;
+  chunk->release_arg = arg;
+  buf_append_chunk(buf, chunk);
+  check();
+  tor_assert(buf->datalen < INT_MAX);
+  return (int)buf->datalen;
+}
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
  * Return the number of bytes actually copied.
+ *
+ * Chunks that are entirely inside the moved range are unlinked from
+ * <b>buf_in</b> and appended to <b>buf_out</b> without copying their data;
+ * only sparse chunks and a partial chunk at the end of the range are copied.
  */
 int
 move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* XXXX we can do way better here, but this doesn't turn up in any
-   * profiles. */
-  char b[4096];
   size_t cp, len;
   len = *buf_flushlen;
   if (len > buf_in->datalen)
@@ -959,65 +1300,186 @@ move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   cp = len; /* Remember the number of bytes we intend to copy. */
   tor_assert(cp < INT_MAX);
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    fetch_from_buf(b, n, buf_in);
-    write_to_buf(b, n, buf_out);
+    chunk_t *chunk = buf_in->head;
+    size_t n;
+    tor_assert(chunk);
+    n = chunk->datalen;
+    if (!n) {
+      /* Plugins can leave empty chunks in the middle of a buffer; drop them
+       * here, or we would never advance past them. */
+      buf_in->head = chunk->next;
+      if (buf_in->tail == chunk)
+        buf_in->tail = NULL;
+      chunk_free_unchecked(chunk);
+      continue;
+    }
+    if (n <= len && n * MOVE_RELINK_MIN_FILL >= chunk->memlen) {
+      /* Hand the whole chunk over to buf_out. */
+      buf_in->head = chunk->next;
+      if (buf_in->tail == chunk)
+        buf_in->tail = NULL;
+      buf_in->datalen -= n;
+      buf_append_chunk(buf_out, chunk);
+    } else {
+      /* Copy straight out of the chunk, then drop the copied bytes. */
+      if (n > len)
+        n = len;
+      write_to_buf(chunk->data, n, buf_out);
+      buf_remove_from_front(buf_in, n);
+    }
     len -= n;
   }
   *buf_flushlen -= cp;
   return (int)cp;
 }
 
-/** Internal structure: represents a position in a buffer. */
-typedef struct buf_pos_t {
-  const chunk_t *chunk; /**< Which chunk are we pointing to? */
-  int pos;/**< Which character inside the chunk's data are we pointing to? */
-  size_t chunk_pos; /**< Total length of all previous chunks. */
-} buf_pos_t;
+/* Block scanners.  Each of these searches one contiguous block of memory,
+ * such as the data of a single chunk; callers take care of matches that
+ * straddle chunk boundaries.  On x86 builds with GCC, buffers_init_scanners()
+ * picks SSE2 or AVX2 versions at runtime when the CPU supports them. */
 
-/** Initialize <b>out</b> to point to the first character of <b>buf</b>.*/
-static void
-buf_pos_init(const buf_t *buf, buf_pos_t *out)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+  ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define BUF_SIMD_SCAN
+#include <immintrin.h>
+#endif
+
+/** Return a pointer to the first occurrence of <b>ch</b> in the <b>len</b>
+ * bytes at <b>mem</b>, or NULL if there is none. */
+static const char *
+block_find_char_generic(const char *mem, size_t len, char ch)
 {
-  out->chunk = buf->head;
-  out->pos = 0;
-  out->chunk_pos = 0;
+  return memchr(mem, ch, len);
 }
 
-/** Advance <b>out</b> to the first appearance of <b>ch</b> at the current
- * position of <b>out</b>, or later.  Return -1 if no instances are found;
- * otherwise returns the absolute position of the character. */
-static off_t
-buf_find_pos_of_char(char ch, buf_pos_t *out)
+/** Return a pointer to the first place where all of the <b>n</b>-byte string
+ * <b>s</b> occurs within the <b>len</b> bytes at <b>mem</b>, or NULL if it
+ * does not occur there.  <b>n</b> must not be 0. */
+static const char *
+block_find_string_generic(const char *mem, size_t len, const char *s,
+                          size_t n)
 {
-  const chunk_t *chunk;
-  int pos;
-  tor_assert(out);
-  if (out->chunk) {
-    if (out->chunk->datalen) {
-      tor_assert(out->pos < (off_t)out->chunk->datalen);
-    } else {
-      tor_assert(out->pos == 0);
+  return tor_memmem(mem, len, s, n);
+}
+
+#ifdef BUF_SIMD_SCAN
+/** SSE2 version of block_find_char_generic(). */
+static const char * __attribute__((target("sse2")))
+block_find_char_sse2(const char *mem, size_t len, char ch)
+{
+  const __m128i needle = _mm_set1_epi8(ch);
+  size_t i;
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(mem + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask)
+      return mem + i + __builtin_ctz(mask);
+  }
+  return block_find_char_generic(mem + i, len - i, ch);
+}
+
+/** SSE2 version of block_find_string_generic().  We compare the first and
+ * the last character of <b>s</b> against 16 candidate positions at once, and
+ * only memcmp() the candidates that pass both tests. */
+static const char * __attribute__((target("sse2")))
+block_find_string_sse2(const char *mem, size_t len, const char *s, size_t n)
+{
+  const __m128i first = _mm_set1_epi8(s[0]);
+  const __m128i last = _mm_set1_epi8(s[n-1]);
+  size_t i;
+  for (i = 0; i + n - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(mem + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(mem + i + n - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+                         _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                       _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      const char *cp = mem + i + __builtin_ctz(mask);
+      if (n <= 2 || !memcmp(cp + 1, s + 1, n - 2))
+        return cp;
+      mask &= mask - 1;
     }
   }
-  pos = out->pos;
-  for (chunk = out->chunk; chunk; chunk = chunk->next) {
-    char *cp = memchr(chunk->data+pos, ch, chunk->datalen - pos);
-    if (cp) {
-      out->chunk = chunk;
-      tor_assert(cp - chunk->data < INT_MAX);
-      out->pos = (int)(cp - chunk->data);
-      return out->chunk_pos + out->pos;
-    } else {
-      out->chunk_pos += chunk->datalen;
-      pos = 0;
+  return i < len ? block_find_string_generic(mem + i, len - i, s, n) : NULL;
+}
+
+/** AVX2 version of block_find_char_generic(). */
+static const char * __attribute__((target("avx2")))
+block_find_char_avx2(const char *mem, size_t len, char ch)
+{
+  const __m256i needle = _mm256_set1_epi8(ch);
+  size_t i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(mem + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+                                       _mm256_cmpeq_epi8(v, needle));
+    if (mask)
+      return mem + i + __builtin_ctz(mask);
+  }
+  return block_find_char_sse2(mem + i, len - i, ch);
+}
+
+/** AVX2 version of block_find_string_sse2(). */
+static const char * __attribute__((target("avx2")))
+block_find_string_avx2(const char *mem, size_t len, const char *s, size_t n)
+{
+  const __m256i first = _mm256_set1_epi8(s[0]);
+  const __m256i last = _mm256_set1_epi8(s[n-1]);
+  size_t i;
+  for (i = 0; i + n - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(mem + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(mem + i + n - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+                         _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                          _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      const char *cp = mem + i + __builtin_ctz(mask);
+      if (n <= 2 || !memcmp(cp + 1, s + 1, n - 2))
+        return cp;
+      mask &= mask - 1;
     }
   }
-  return -1;
+  return i < len ? block_find_string_sse2(mem + i, len - i, s, n) : NULL;
 }
+#endif
+
+/** Function used to find a character in a block of memory. */
+static const char *(*block_find_char)(const char *mem, size_t len,
+                                      char ch) = NULL;
+/** Function used to find a string in a block of memory. */
+static const char *(*block_find_string)(const char *mem, size_t len,
+                                        const char *s, size_t n) = NULL;
+
+/** Choose the fastest block scanners that this CPU supports. */
+static void
+buffers_init_scanners(void)
+{
+  block_find_char = block_find_char_generic;
+  block_find_string = block_find_string_generic;
+#ifdef BUF_SIMD_SCAN
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    block_find_char = block_find_char_avx2;
+    block_find_string = block_find_string_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    block_find_char = block_find_char_sse2;
+    block_find_string = block_find_string_sse2;
+  }
+#endif
+}
+
+/** Make sure that block_find_char and block_find_string are set. */
+#define CHECK_SCANNERS() STMT_BEGIN                  \
+    if (PREDICT_UNLIKELY(!block_find_char))         \
+      buffers_init_scanners();                      \
+  STMT_END
+
+/** Internal structure: represents a position in a buffer. */
+typedef struct buf_pos_t {
+  const chunk_t *chunk; /**< Which chunk are we pointing to? */
+  int pos;/**< Which character inside the chunk's data are we pointing to? */
+  size_t chunk_pos; /**< Total length of all previous chunks. */
+} buf_pos_t;
 
 /** Advance <b>pos</b> by a single character, if there are any more characters
  * in the buffer.  Returns 0 on sucess, -1 on failure. */
@@ -1062,20 +1524,45 @@ buf_matches_at_pos(const buf_pos_t *pos, const char *s, size_t n)
 }
 
 /** Return the first position in <b>buf</b> at which the <b>n</b>-character
- * string <b>s</b> occurs, or -1 if it does not occur. */
+ * string <b>s</b> occurs, or -1 if it does not occur.
+ *
+ * Each chunk is scanned as one block; only the last <b>n</b>-1 bytes of a
+ * chunk, where a match could continue into the next chunk, are checked one
+ * character at a time. */
 /*private*/
 int buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
 {
-  buf_pos_t pos;
-  buf_pos_init(buf, &pos);
-  while (buf_find_pos_of_char(*s, &pos) >= 0) {
-    if (buf_matches_at_pos(&pos, s, n)) {
-      tor_assert(pos.chunk_pos + pos.pos < INT_MAX);
-      return (int)(pos.chunk_pos + pos.pos);
-    } else {
-      if (buf_pos_inc(&pos)<0)
-        return -1;
+  const chunk_t *chunk;
+  size_t chunk_pos = 0;
+  if (!n)
+    return 0;
+  CHECK_SCANNERS();
+  for (chunk = buf->head; chunk; chunk = chunk->next) {
+    size_t i = 0;
+    if (chunk->datalen >= n) {
+      const char *cp = block_find_string(chunk->data, chunk->datalen, s, n);
+      if (cp) {
+        tor_assert(chunk_pos + (cp - chunk->data) < INT_MAX);
+        return (int)(chunk_pos + (cp - chunk->data));
+      }
+      i = chunk->datalen - n + 1;
     }
+    if (chunk->next) {
+      /* Look for matches that start here and end in a later chunk. */
+      for ( ; i < chunk->datalen; ++i) {
+        buf_pos_t pos;
+        if (chunk->data[i] != *s)
+          continue;
+        pos.chunk = chunk;
+        pos.pos = (int)i;
+        pos.chunk_pos = chunk_pos;
+        if (buf_matches_at_pos(&pos, s, n)) {
+          tor_assert(chunk_pos + i < INT_MAX);
+          return (int)(chunk_pos + i);
+        }
+      }
+    }
+    chunk_pos += chunk->datalen;
   }
   return -1;
 }
@@ -1204,8 +1691,9 @@ buf_find_offset_of_char(buf_t *buf, char ch)
 {
   chunk_t *chunk;
   off_t offset = 0;
+  CHECK_SCANNERS();
   for (chunk = buf->head; chunk; chunk = chunk->next) {
-    char *cp = memchr(chunk->data, ch, chunk->datalen);
+    const char *cp = block_find_char(chunk->data, chunk->datalen, ch);
     if (cp)
       return offset + (cp - chunk->data);
     else
@@ -1310,6 +1798,12 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (ch->release) {
+        tor_assert(ch->memlen == 0);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data < &ch->mem[0]+ch->memlen);
@@ -7,6 +7,12 @@ typedef struct chunk_t {
   size_t datalen; /**< The number of bytes stored in this chunk */
   size_t memlen; /**< The number of usable bytes of storage in <b>mem</b>. */
   char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  /** If set, this chunk doesn't own its data: <b>data</b> points into memory
+   * held by somebody else, which we give back by calling
+   * release(release_arg) when we free the chunk.  Nothing is ever added to
+   * such a chunk, and its memlen is 0. */
+  void (*release)(void *arg);
+  void *release_arg; /**< Argument for <b>release</b>. */
   char mem[1]; /**< The actual memory used for storage in this chunk. May be
                 * more than one byte long. */
 } chunk_t;
@@ -44,9 +50,13 @@ buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
 void buf_free(buf_t *buf);
 void buf_clear(buf_t *buf);
+void buf_truncate(buf_t *buf, size_t n);
 void buf_shrink(buf_t *buf);
 void buf_shrink_freelists(int free_all);
 void buf_dump_freelist_sizes(int severity);
+char *buf_get_freelist_stats(void);
+void buf_get_freelist_totals(uint64_t *n_alloc, uint64_t *n_free,
+                             uint64_t *n_hit, uint64_t *n_miss);
 
 size_t buf_datalen(const buf_t *buf);
 size_t buf_allocation(const buf_t *buf);
@@ -57,14 +67,18 @@ int read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
 int read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf);
 
 int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
-int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
+int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t record_size,
+                  size_t *buf_flushlen);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+int write_ref_to_buf(const char *string, size_t string_len, buf_t *buf,
+                     void (*release)(void *arg), void *arg);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cell_from_buf(buf_t *buf, cell_t *out);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
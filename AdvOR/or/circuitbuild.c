@@ -19,9 +19,11 @@
 #include "connection_or.h"
 #include "control.h"
 #include "directory.h"
+#include "etw.h"
 #include "main.h"
 #include "networkstatus.h"
 #include "onion.h"
+#include "perf.h"
 #include "policies.h"
 #include "relay.h"
 #include "rephist.h"
@@ -30,9 +32,16 @@
 #include "routerparse.h"
 #include "crypto.h"
 #include "geoip.h"
+#include "mempool.h"
 #undef log
 #include <math.h>
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
@@ -52,12 +61,32 @@ circuit_build_times_t circ_times;
 /** A global list of all circuits at this hop. */
 extern circuit_t *global_circuitlist;
 
+/** Memory pool for extend_info_t objects, created when we first need it. */
+static mp_pool_t *extend_info_pool = NULL;
+
 /** A list of our chosen entry guards. */
 smartlist_t *entry_guards = NULL;
 /** A value of 1 means that the entry_guards list has changed
  * and those changes need to be flushed to disk. */
 static int entry_guards_dirty = 0;
 
+/** How long to wait before racing each additional entry guard while none
+ * of our guards is connected. */
+#define GUARD_RACE_STAGGER_MSEC 250
+/** How many entry guards to race against the one our first circuit picked. */
+#define GUARD_RACE_EXTRA_GUARDS 2
+/** Timer that launches the next raced guard connection. */
+static struct event *guard_race_timer = NULL;
+/** True iff <b>guard_race_timer</b> is pending. */
+static int guard_race_scheduled = 0;
+/** How many extra guard connections we've raced since a guard connection
+ * last finished (successfully or not). */
+static int guard_race_launched = 0;
+
+/** Routers that the paths we choose now may not use as middle or exit hops;
+ * only set while we launch a circuit that races another one. */
+static smartlist_t *avoid_path_routers = NULL;
+
 /** If set, we're running the unit tests: we should avoid clobbering
  * our state file or accessing get_options() or get_or_state() */
 static int unit_tests = 0;
@@ -87,7 +116,11 @@ routerinfo_t *choose_good_middle_server(uint8_t purpose,cpath_build_state_t *sta
 routerinfo_t *choose_good_entry_server(uint8_t purpose, cpath_build_state_t *state);
 
 static void entry_guards_changed(void);
+static void entry_guard_note_build_time(const char *digest, build_time_t msec);
 static time_t start_of_month(time_t when);
+static void entry_guards_race_start(void);
+static int entry_guards_have_open_conn(void);
+static void circuit_reroute_to_guard(or_connection_t *or_conn);
 
 /** This function decides if CBT learning should be disabled. It returns true if one or more of the following four conditions are met:
  *  1. If the cbtdisabled consensus parameter is set.
@@ -232,6 +265,12 @@ static double circuit_build_times_get_initial_timeout(void)
 /** Reset the build time state. Leave estimated parameters, timeout and network liveness intact for future use. */
 void circuit_build_times_reset(circuit_build_times_t *cbt)
 {	memset(cbt->circuit_build_times, 0, sizeof(cbt->circuit_build_times));
+	if(cbt->histogram_nbins)
+	{	memset(cbt->histogram, 0, cbt->histogram_nbins*sizeof(uint32_t));
+		memset(cbt->histogram_log_sum, 0, cbt->histogram_nbins*sizeof(double));
+	}
+	cbt->abandoned_count = 0;
+	cbt->max_build_time_valid = 0;
 	cbt->total_build_times = 0;
 	cbt->build_times_idx = 0;
 	cbt->have_computed_timeout = 0;
@@ -239,13 +278,23 @@ void circuit_build_times_reset(circuit_build_times_t *cbt)
 
 /** Initialize the buildtimes structure for first use. Sets the initial timeout values based on either the config setting, the consensus param, or the default (CBT_DEFAULT_TIMEOUT_INITIAL_VALUE). */
 void circuit_build_times_init(circuit_build_times_t *cbt)
-{	memset(cbt, 0, sizeof(*cbt));
+{	tor_free(cbt->histogram);
+	tor_free(cbt->histogram_log_sum);
+	memset(cbt, 0, sizeof(*cbt));
 	cbt->liveness.num_recent_circs = circuit_build_times_recent_circuit_count(NULL);
 	cbt->liveness.timeouts_after_firsthop = tor_malloc_zero(sizeof(int8_t)*cbt->liveness.num_recent_circs);
 	cbt->close_ms = cbt->timeout_ms = circuit_build_times_get_initial_timeout();
 	control_event_buildtimeout_set(cbt, BUILDTIMEOUT_SET_EVENT_RESET);
 }
 
+/** Release the histogram and the liveness history of <b>cbt</b>. */
+void circuit_build_times_free(circuit_build_times_t *cbt)
+{	tor_free(cbt->histogram);
+	tor_free(cbt->histogram_log_sum);
+	cbt->histogram_nbins = 0;
+	tor_free(cbt->liveness.timeouts_after_firsthop);
+}
+
 #if 0
 /** Rewind our build time history by n positions. */
 static void circuit_build_times_rewind_history(circuit_build_times_t *cbt, int n)
@@ -260,6 +309,49 @@ static void circuit_build_times_rewind_history(circuit_build_times_t *cbt, int n
 }
 #endif
 
+/** Make sure the histogram of <b>cbt</b> has at least <b>nbins</b> bins. */
+static void circuit_build_times_grow_histogram(circuit_build_times_t *cbt,build_time_t nbins)
+{	if(nbins <= cbt->histogram_nbins)	return;
+	nbins = MAX(nbins, cbt->histogram_nbins*2);
+	cbt->histogram = tor_realloc(cbt->histogram, nbins*sizeof(uint32_t));
+	cbt->histogram_log_sum = tor_realloc(cbt->histogram_log_sum, nbins*sizeof(double));
+	memset(cbt->histogram + cbt->histogram_nbins, 0, (nbins - cbt->histogram_nbins)*sizeof(uint32_t));
+	memset(cbt->histogram_log_sum + cbt->histogram_nbins, 0, (nbins - cbt->histogram_nbins)*sizeof(double));
+	cbt->histogram_nbins = nbins;
+}
+
+/** Add <b>time</b>, just stored at index <b>idx</b> of the build times array, to the histogram and the other running totals. */
+static void circuit_build_times_count_sample(circuit_build_times_t *cbt,int idx,build_time_t time)
+{	build_time_t bin;
+	if(!time)	return;
+	if(time == CBT_BUILD_ABANDONED)
+	{	cbt->abandoned_count++;
+		return;
+	}
+	bin = time / CBT_BIN_WIDTH;
+	circuit_build_times_grow_histogram(cbt, bin + 1);
+	cbt->build_time_logs[idx] = tor_mathlog(time);
+	cbt->histogram[bin]++;
+	cbt->histogram_log_sum[bin] += cbt->build_time_logs[idx];
+	if(cbt->max_build_time_valid && time > cbt->max_build_time)
+		cbt->max_build_time = time;
+}
+
+/** Remove <b>time</b>, about to leave index <b>idx</b> of the build times array, from the running totals. */
+static void circuit_build_times_uncount_sample(circuit_build_times_t *cbt,int idx,build_time_t time)
+{	build_time_t bin;
+	if(!time)	return;
+	if(time == CBT_BUILD_ABANDONED)
+	{	cbt->abandoned_count--;
+		return;
+	}
+	bin = time / CBT_BIN_WIDTH;
+	if(--cbt->histogram[bin])	cbt->histogram_log_sum[bin] -= cbt->build_time_logs[idx];
+	else				cbt->histogram_log_sum[bin] = 0;	/* don't let rounding errors pile up */
+	if(time == cbt->max_build_time)
+		cbt->max_build_time_valid = 0;
+}
+
 /** Add a new build time value <b>time</b> to the set of build times. Time units are milliseconds.
  * circuit_build_times <b>cbt</b> is a circular array, so loop around when array is full. */
 int circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
@@ -269,7 +361,9 @@ int circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
 		return -1;
 	}
 	log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_ADDING_BUILD_TIME),time);
+	circuit_build_times_uncount_sample(cbt, cbt->build_times_idx, cbt->circuit_build_times[cbt->build_times_idx]);
 	cbt->circuit_build_times[cbt->build_times_idx] = time;
+	circuit_build_times_count_sample(cbt, cbt->build_times_idx, time);
 	cbt->build_times_idx = (cbt->build_times_idx + 1) % CBT_NCIRCUITS_TO_OBSERVE;
 	if(cbt->total_build_times < CBT_NCIRCUITS_TO_OBSERVE)
 		cbt->total_build_times++;
@@ -280,14 +374,18 @@ int circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
 	return 0;
 }
 
-/** Return maximum circuit build time */
+/** Return maximum circuit build time. We only look through the array when the last maximum has left it. */
 static build_time_t circuit_build_times_max(circuit_build_times_t *cbt)
 {	int i = 0;
 	build_time_t max_build_time = 0;
+	if(cbt->max_build_time_valid)
+		return cbt->max_build_time;
 	for(i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++)
 	{	if(cbt->circuit_build_times[i] > max_build_time && cbt->circuit_build_times[i] != CBT_BUILD_ABANDONED)
 			max_build_time = cbt->circuit_build_times[i];
 	}
+	cbt->max_build_time = max_build_time;
+	cbt->max_build_time_valid = 1;
 	return max_build_time;
 }
 
@@ -306,23 +404,11 @@ build_time_t circuit_build_times_min(circuit_build_times_t *cbt)
 }
 #endif
 
-/** Calculate and return a histogram for the set of build times.
- * Returns an allocated array of histrogram bins representing the frequency of index*CBT_BIN_WIDTH millisecond build times. Also outputs the number of bins in nbins.
- * The return value must be freed by the caller. */
-static uint32_t *circuit_build_times_create_histogram(circuit_build_times_t *cbt,build_time_t *nbins)
-{	uint32_t *histogram;
-	build_time_t max_build_time = circuit_build_times_max(cbt);
-	int i, c;
-	*nbins = 1 + (max_build_time / CBT_BIN_WIDTH);
-	histogram = tor_malloc_zero(*nbins * sizeof(build_time_t));
-	// calculate histogram
-	for(i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++)
-	{	if(cbt->circuit_build_times[i] == 0 || cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-			continue; /* 0 <-> uninitialized */
-		c = (cbt->circuit_build_times[i] / CBT_BIN_WIDTH);
-		histogram[c]++;
-	}
-	return histogram;
+/** Return the histogram of the set of build times, which circuit_build_times_add_time() keeps up to date: bins representing the frequency of index*CBT_BIN_WIDTH millisecond build times. Also outputs the number of bins in use in nbins. */
+static uint32_t *circuit_build_times_get_histogram(circuit_build_times_t *cbt,build_time_t *nbins)
+{	*nbins = 1 + (circuit_build_times_max(cbt) / CBT_BIN_WIDTH);
+	circuit_build_times_grow_histogram(cbt, *nbins);
+	return cbt->histogram;
 }
 
 /** Return the Pareto start-of-curve parameter Xm.
@@ -332,7 +418,7 @@ static build_time_t circuit_build_times_get_xm(circuit_build_times_t *cbt)
 	build_time_t *nth_max_bin;
 	int32_t bin_counts=0;
 	build_time_t ret = 0;
-	uint32_t *histogram = circuit_build_times_create_histogram(cbt, &nbins);
+	uint32_t *histogram = circuit_build_times_get_histogram(cbt, &nbins);
 	int n=0;
 	int num_modes = circuit_build_times_default_num_xm_modes();
 
@@ -358,7 +444,6 @@ static build_time_t circuit_build_times_get_xm(circuit_build_times_t *cbt)
 	/* The following assert is safe, because we don't get called when we haven't observed at least CBT_MIN_MIN_CIRCUITS_TO_OBSERVE circuits. */
 	tor_assert(bin_counts > 0);
 	ret /= bin_counts;
-	tor_free(histogram);
 	tor_free(nth_max_bin);
 	return ret;
 }
@@ -370,17 +455,13 @@ void circuit_build_times_update_state(circuit_build_times_t *cbt,or_state_t *sta
 	build_time_t nbins = 0;
 	config_line_t **next, *line;
 
-	histogram = circuit_build_times_create_histogram(cbt, &nbins);
+	histogram = circuit_build_times_get_histogram(cbt, &nbins);
 	// write to state
 	config_free_lines(state->BuildtimeHistogram);
 	next = &state->BuildtimeHistogram;
 	*next = NULL;
 	state->TotalBuildTimes = cbt->total_build_times;
-	state->CircuitBuildAbandonedCount = 0;
-	for(i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++)
-	{	if(cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-			state->CircuitBuildAbandonedCount++;
-	}
+	state->CircuitBuildAbandonedCount = cbt->abandoned_count;
 	for(i = 0; i < nbins; i++)	// compress the histogram by skipping the blanks
 	{	if (histogram[i] == 0) continue;
 		*next = line = tor_malloc_zero(sizeof(config_line_t));
@@ -393,7 +474,6 @@ void circuit_build_times_update_state(circuit_build_times_t *cbt,or_state_t *sta
 	{	if(!get_options()->AvoidDiskWrites)
 			or_state_mark_dirty(get_or_state(), 0);
 	}
-	tor_free(histogram);
 }
 
 /** Shuffle the build times array.
@@ -431,7 +511,9 @@ static int circuit_build_times_filter_timeouts(circuit_build_times_t *cbt)
 	{	if(cbt->circuit_build_times[i] > max_timeout)
 		{	build_time_t replaced = cbt->circuit_build_times[i];
 			num_filtered++;
+			circuit_build_times_uncount_sample(cbt, i, replaced);
 			cbt->circuit_build_times[i] = CBT_BUILD_ABANDONED;
+			circuit_build_times_count_sample(cbt, i, CBT_BUILD_ABANDONED);
 			log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_REPLACED_TIMEOUT),replaced,cbt->circuit_build_times[i]);
 		}
 	}
@@ -534,28 +616,39 @@ int circuit_build_times_parse_state(circuit_build_times_t *cbt,or_state_t *state
 }
 
 /** Estimates the Xm and Alpha parameters using http://en.wikipedia.org/wiki/Pareto_distribution#Parameter_estimation
- * The notable difference is that we use mode instead of min to estimate Xm. This is because our distribution is frechet-like. We claim this is an acceptable approximation because we are only concerned with the accuracy of the CDF of the tail. */
+ * The notable difference is that we use mode instead of min to estimate Xm. This is because our distribution is frechet-like. We claim this is an acceptable approximation because we are only concerned with the accuracy of the CDF of the tail.
+ * The sums come from the running histogram, so only the bin that holds Xm needs a look at single samples. */
 int circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 {	build_time_t *x=cbt->circuit_build_times;
 	double a = 0;
-	int n=0,i=0,abandoned_count=0;
-	build_time_t max_time=0;
+	double log_xm;
+	int n=0,i=0,abandoned_count=cbt->abandoned_count;
+	build_time_t max_time=0,bin,xm_bin;
 
 	/* http://en.wikipedia.org/wiki/Pareto_distribution#Parameter_estimation */
 	/* We sort of cheat here and make our samples slightly more pareto-like and less frechet-like. */
 	cbt->Xm = circuit_build_times_get_xm(cbt);
 	tor_assert(cbt->Xm > 0);
-
-	for(i=0; i< CBT_NCIRCUITS_TO_OBSERVE; i++)
-	{	if(!x[i])				continue;
-		if(x[i] < cbt->Xm)			a += tor_mathlog(cbt->Xm);
-		else if(x[i] == CBT_BUILD_ABANDONED)	abandoned_count++;
-		else
-		{	a += tor_mathlog(x[i]);
-			if(x[i] > max_time)		max_time = x[i];
+	log_xm = tor_mathlog(cbt->Xm);
+	xm_bin = cbt->Xm / CBT_BIN_WIDTH;
+
+	for(bin = 0; bin < cbt->histogram_nbins; bin++)
+	{	if(!cbt->histogram[bin])	continue;
+		n += cbt->histogram[bin];
+		if(bin < xm_bin)						a += cbt->histogram[bin]*log_xm;
+		else if(bin > xm_bin || !(cbt->Xm % CBT_BIN_WIDTH))	a += cbt->histogram_log_sum[bin];
+	}
+	if(xm_bin < cbt->histogram_nbins && cbt->histogram[xm_bin] && (cbt->Xm % CBT_BIN_WIDTH))
+	{	/* This bin has times on both sides of Xm. */
+		for(i=0; i< CBT_NCIRCUITS_TO_OBSERVE; i++)
+		{	if(!x[i] || x[i] == CBT_BUILD_ABANDONED || x[i] / CBT_BIN_WIDTH != xm_bin)	continue;
+			if(x[i] < cbt->Xm)	a += log_xm;
+			else			a += cbt->build_time_logs[i];
 		}
-		n++;
 	}
+	n += abandoned_count;
+	if(circuit_build_times_max(cbt) >= cbt->Xm)
+		max_time = circuit_build_times_max(cbt);
 
 	/* We are erring and asserting here because this can only happen in codepaths other than startup. The startup state parsing code performs this same check, and resets state if it hits it. If we hit it at runtime, something serious has gone wrong. */
 	if(n!=cbt->total_build_times)
@@ -748,14 +841,9 @@ double circuit_build_times_timeout_rate(const circuit_build_times_t *cbt)
 
 /** Count the number of closed circuits in a set of cbt data. */
 double circuit_build_times_close_rate(const circuit_build_times_t *cbt)
-{	int i=0,closed=0;
-	for(i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++)
-	{	if(cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-			closed++;
-	}
-	if(!cbt->total_build_times)
+{	if(!cbt->total_build_times)
 		return 0;
-	return ((double)closed)/cbt->total_build_times;
+	return ((double)cbt->abandoned_count)/cbt->total_build_times;
 }
 
 /** Store a timeout as a synthetic value. Returns true if the store was successful and we should possibly update our timeout estimate. */
@@ -842,14 +930,15 @@ int circuit_timeout_want_to_count_circ(origin_circuit_t *circ)
 /** Iterate over values of circ_id, starting from conn-\>next_circ_id,
  * and with the high bit specified by conn-\>circ_id_type, until we get
  * a circ_id that is not in use by any other circuit on that conn.
+ * conn-\>circ_ids_used lets us skip used IDs a word at a time.
  *
  * Return it, or 0 if can't get a unique circ_id.
  */
 static circid_t
 get_unique_circ_id_by_conn(or_connection_t *conn)
 {
-  circid_t test_circ_id;
-  circid_t attempts=0;
+  unsigned int test_circ_id;
+  unsigned int words_seen = 0;
   circid_t high_bit;
 
   tor_assert(conn);
@@ -858,24 +947,34 @@ get_unique_circ_id_by_conn(or_connection_t *conn)
     return 0;
   }
   high_bit = (conn->circ_id_type == CIRC_ID_TYPE_HIGHER) ? 1<<15 : 0;
-  do {
-    /* Sequentially iterate over test_circ_id=1...1<<15-1 until we find a
-     * circID such that (high_bit|test_circ_id) is not already used. */
-    test_circ_id = conn->next_circ_id++;
-    if (test_circ_id == 0 || test_circ_id >= 1<<15) {
-      test_circ_id = 1;
-      conn->next_circ_id = 2;
-    }
-    if (++attempts > 1<<15) {
-      /* Make sure we don't loop forever if all circ_id's are used. This
-       * matters because it's an external DoS opportunity.
-       */
-      log_warn(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_NO_UNUSED_CIRC_IDS));
-      return 0;
+  if (!conn->circ_ids_used)
+    conn->circ_ids_used = bitarray_init_zero(1<<15);
+  bitarray_set(conn->circ_ids_used, 0); /* never a valid circ_id */
+  test_circ_id = conn->next_circ_id;
+  while (words_seen <= ((1<<15) >> BITARRAY_SHIFT)) {
+    if (test_circ_id >= 1<<15)
+      test_circ_id = 0;
+    if (conn->circ_ids_used[test_circ_id >> BITARRAY_SHIFT] ==
+        ~(bitarray_t)0) {
+      /* A whole word of used IDs; skip it. */
+      test_circ_id = ((test_circ_id >> BITARRAY_SHIFT) + 1) << BITARRAY_SHIFT;
+      ++words_seen;
+    } else if (!bitarray_is_set(conn->circ_ids_used, test_circ_id)) {
+      if (!circuit_id_in_use_on_orconn(test_circ_id|high_bit, conn)) {
+        conn->next_circ_id = test_circ_id + 1;
+        return test_circ_id|high_bit;
+      }
+      /* The other side used it before we were tracking; note that. */
+      bitarray_set(conn->circ_ids_used, test_circ_id);
+    } else if ((++test_circ_id & BITARRAY_MASK) == 0) {
+      ++words_seen;
     }
-    test_circ_id |= high_bit;
-  } while (circuit_id_in_use_on_orconn(test_circ_id, conn));
-  return test_circ_id;
+  }
+  /* Make sure we don't loop forever if all circ_id's are used. This
+   * matters because it's an external DoS opportunity.
+   */
+  log_warn(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_NO_UNUSED_CIRC_IDS));
+  return 0;
 }
 
 /** If <b>verbose</b> is false, allocate and return a comma-separated list of
@@ -1060,7 +1159,7 @@ origin_circuit_init(uint8_t purpose, int flags)
     ((flags & CIRCLAUNCH_NEED_CAPACITY) ? 1 : 0);
   circ->build_state->is_internal =
     ((flags & CIRCLAUNCH_IS_INTERNAL) ? 1 : 0);
-  circ->_base.purpose = purpose;
+  circuit_change_purpose(TO_CIRCUIT(circ), purpose);
   tree_set_circ(TO_CIRCUIT(circ));
   return circ;
 }
@@ -1089,6 +1188,8 @@ circuit_establish_circuit(uint8_t purpose, extend_info_t *exit, int flags,DWORD
 
   add_all_conns(TO_CIRCUIT(circ));
   control_event_circuit_status(circ, CIRC_EVENT_LAUNCHED, 0);
+  if (etw_enabled(ETW_KW_CIRC_BUILD))
+    etw_circuit_phase(circ, ETW_CIRC_LAUNCHED);
 
   if ((err_reason = circuit_handle_first_hop(circ)) < 0) {
     circuit_mark_for_close(TO_CIRCUIT(circ), -err_reason);
@@ -1140,6 +1241,8 @@ circuit_handle_first_hop(origin_circuit_t *circ)
         return -END_CIRC_REASON_CONNECTFAILED;
       }
     }
+    if (circ->build_state->first_hop_is_guard)
+      entry_guards_race_start();
 
     log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_IN_PROGRESS));
     /* return success. The onion/circuit/etc will be taken care of
@@ -1167,12 +1270,19 @@ circuit_handle_first_hop(origin_circuit_t *circ)
 void
 circuit_n_conn_done(or_connection_t *or_conn, int status)
 {
-  smartlist_t *pending_circs;
+  SMARTLIST_LOCAL(pending_circs_local, 16);
+  smartlist_t *pending_circs = &pending_circs_local;
   int err_reason = 0;
 
   log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_OR_CONN_STATUS),or_conn->nickname ? or_conn->nickname : "NULL",or_conn->_base.address, status);
 
-  pending_circs = smartlist_create();
+  if (!or_conn->is_connection_with_client &&
+      is_an_entry_guard(or_conn->identity_digest)) {
+    guard_race_launched = 0;
+    if (status)
+      circuit_reroute_to_guard(or_conn);
+  }
+
   circuit_get_all_pending_on_or_conn(pending_circs, or_conn);
 
   SMARTLIST_FOREACH_BEGIN(pending_circs, circuit_t *, circ)
@@ -1231,7 +1341,7 @@ circuit_n_conn_done(or_connection_t *or_conn, int status)
     }
   SMARTLIST_FOREACH_END(circ);
 
-  smartlist_free(pending_circs);
+  smartlist_local_free(pending_circs);
 }
 
 /** Find a new circid that isn't currently in use on the circ->n_conn
@@ -1377,6 +1487,8 @@ circuit_send_next_onion_skin(origin_circuit_t *circ)
 
     circ->cpath->state = CPATH_STATE_AWAITING_KEYS;
     circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_BUILDING);
+    if (etw_enabled(ETW_KW_CIRC_BUILD))
+      etw_circuit_phase(circ, ETW_CIRC_CREATE_SENT);
     log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_FIRST_HOP_CELL_SENT),fast ? "CREATE_FAST" : "CREATE",router ? router_describe(router) : "<unnamed>");
   } else {
     tor_assert(circ->cpath->state == CPATH_STATE_OPEN);
@@ -1386,6 +1498,8 @@ circuit_send_next_onion_skin(origin_circuit_t *circ)
     if (!hop) {
       /* done building the circuit. whew. */
       circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OPEN);
+      if (etw_enabled(ETW_KW_CIRC_BUILD))
+        etw_circuit_phase(circ, ETW_CIRC_OPEN);
       ///
 	if(circuit_timeout_want_to_count_circ(circ))
 	{	struct timeval end;
@@ -1399,7 +1513,10 @@ circuit_send_next_onion_skin(origin_circuit_t *circ)
 		{	/* Only count circuit times if the network is live */
 			if(circuit_build_times_network_check_live(&circ_times))
 			{	circuit_build_times_add_time(&circ_times, (build_time_t)timediff);
+				perf_hist_add(PERF_HIST_CIRC_BUILD_MSEC,(uint64_t)timediff);
 				circuit_build_times_set_timeout(&circ_times);
+				if(circ->build_state->first_hop_is_guard && entry_guards)
+					entry_guard_note_build_time(circ->cpath->extend_info->identity_digest,(build_time_t)timediff);
 			}
 			if(circ->_base.purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT)
 				circuit_build_times_network_circ_success(&circ_times);
@@ -1459,6 +1576,8 @@ circuit_send_next_onion_skin(origin_circuit_t *circ)
       return 0; /* circuit is closed */
 
     hop->state = CPATH_STATE_AWAITING_KEYS;
+    if (etw_enabled(ETW_KW_CIRC_BUILD))
+      etw_circuit_phase(circ, ETW_CIRC_EXTEND_SENT);
   }
   return 0;
 }
@@ -1482,6 +1601,24 @@ circuit_note_clock_jumped(int seconds_elapsed)
                               "CLOCK_JUMPED");
   circuit_mark_all_unused_circs();
   circuit_expire_all_dirty_circs();
+  if (seconds_elapsed > 0)
+    circuit_warm_start(get_time(NULL), seconds_elapsed);
+}
+
+/** We were asleep, or dormant, for the last <b>seconds_idle</b> seconds,
+ * so none of our OR connections can be trusted anymore, and our
+ * predictions of the circuits we'll need were about to expire without
+ * having been wrong. Keep the predictions, reconnect to our entry guards
+ * all at once, and build our predicted circuits now instead of waiting
+ * for new requests. */
+void
+circuit_warm_start(time_t now, int seconds_idle)
+{
+  log_notice(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_WARM_START),seconds_idle);
+  rep_hist_shift_predictions(seconds_idle);
+  connection_or_set_bad_connections(NULL, 1);
+  entry_guards_reconnect();
+  circuit_build_needed_circs(now);
 }
 
 /** Take the 'extend' <b>cell</b>, pull out addr/port plus the onion
@@ -1709,6 +1846,8 @@ circuit_finish_handshake(origin_circuit_t *circ, uint8_t reply_type,
   }
 
   hop->state = CPATH_STATE_OPEN;
+  if (etw_enabled(ETW_KW_CIRC_BUILD))
+    etw_circuit_phase(circ, ETW_CIRC_HOP_OPEN);
   log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_FINISHED_BUILDING_FIRST_HOP),(reply_type == CELL_CREATED_FAST) ? "fast " : "");
   circuit_log_path(LOG_INFO,LD_CIRC,circ);
   control_event_circuit_status(circ, CIRC_EVENT_EXTENDED, 0);
@@ -1920,9 +2059,15 @@ router_handles_some_port(routerinfo_t *router, smartlist_t *needed_ports)
 
   for (i = 0; i < smartlist_len(needed_ports); ++i) {
     addr_policy_result_t r;
+    int known;
     port = *(uint16_t *)smartlist_get(needed_ports, i);
     tor_assert(port);
-    r = compare_addr_to_addr_policy(0, port, router->exit_policy);
+    if ((known = router_index_exits_to_port(router, port)) >= 0) {
+      if (known)
+        return 1;
+      continue;
+    }
+    r = router_compare_addr_to_exit_policy(0, port, router);
     if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
       return 1;
   }
@@ -1978,10 +2123,18 @@ routerinfo_t *choose_good_exit_server_general(routerlist_t *dir, int need_uptime
 	n_supported = tor_malloc(sizeof(int)*smartlist_len(dir->routers));
 	for(i = 0; i < smartlist_len(dir->routers); ++i)	/* iterate over routers */
 	{	router = smartlist_get(dir->routers, i);
+		if(!router_may_be_random_exit(router))
+		{	n_supported[i] = -1;	/* the cheap checks below, done once per routerlist */
+			continue;
+		}
 		if(router_is_me(router))
 		{	n_supported[i] = -1;	/* XXX there's probably a reverse predecessor attack here, but it's slow. should we take this out? -RD */
 			continue;
 		}
+		if(avoid_path_routers && smartlist_isin(avoid_path_routers, router))
+		{	n_supported[i] = -1;
+			continue;
+		}
 		if(!is_selected_router(router->addr,router->router_id,exclKey))
 		{	n_supported[i] = -1;
 			continue;
@@ -2203,6 +2356,29 @@ onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit,DWORD exclKey)
 	return 0;
 }
 
+/** Until called again with NULL, keep the middle and exit hops of the paths
+ * we choose off every hop of <b>circ</b> after its first one. This gives a
+ * circuit that races <b>circ</b> a disjoint path; the guard may be shared. */
+void
+circuit_build_avoid_routers_of(origin_circuit_t *circ)
+{
+  crypt_path_t *hop;
+  routerinfo_t *r;
+
+  if (avoid_path_routers) {
+    smartlist_free(avoid_path_routers);
+    avoid_path_routers = NULL;
+  }
+  if (!circ || !circ->cpath)
+    return;
+  avoid_path_routers = smartlist_create();
+  for (hop = circ->cpath->next; hop != circ->cpath; hop = hop->next) {
+    if (hop->extend_info &&
+        (r = router_get_by_digest(hop->extend_info->identity_digest)))
+      smartlist_add(avoid_path_routers, r);
+  }
+}
+
 /** Give <b>circ</b> a new exit destination to <b>exit</b>, and add a
  * hop to the cpath reflecting this. Don't send the next extend cell --
  * the caller will do this if it wants to.
@@ -2279,6 +2455,31 @@ onion_append_to_cpath(crypt_path_t **head_ptr, crypt_path_t *new_hop)
   }
 }
 
+/** If EnforceDistinctSubnets asks for AS-safe paths, choose a random node
+ * like router_choose_random_node() does, but first add to <b>excluded</b>
+ * every router that shares an AS with one of the routers in <b>chosen</b>.
+ * If no router is left, choose without the AS restriction, and let
+ * onion_extend_cpath() check the full AS path. */
+static routerinfo_t *
+choose_random_node_as_distinct(smartlist_t *excluded, smartlist_t *chosen,
+                               router_crn_flags_t flags)
+{
+  or_options_t *options = get_options();
+  routerinfo_t *choice = NULL;
+  if ((options->EnforceDistinctSubnets&4) && smartlist_len(chosen)) {
+    SMARTLIST_LOCAL(as_excluded, 64);
+    smartlist_add_all(&as_excluded, excluded);
+    SMARTLIST_FOREACH(chosen, routerinfo_t *, c,
+                      routerlist_add_routers_sharing_as(&as_excluded, c));
+    choice = router_choose_random_node(&as_excluded, options->ExcludeNodes,
+                                       flags);
+    smartlist_local_free(&as_excluded);
+  }
+  if (!choice)
+    choice = router_choose_random_node(excluded, options->ExcludeNodes, flags);
+  return choice;
+}
+
 /** A helper function used by onion_extend_cpath(). Use <b>purpose</b>
  * and <b>state</b> and the cpath <b>head</b> (currently populated only
  * to length <b>cur_len</b> to decide a suitable middle hop for a
@@ -2290,16 +2491,18 @@ routerinfo_t *choose_good_middle_server(uint8_t purpose,cpath_build_state_t *sta
   int i;
   routerinfo_t *r, *choice;
   crypt_path_t *cpath;
-  smartlist_t *excluded;
+  SMARTLIST_LOCAL(excluded_local, 32);
+  SMARTLIST_LOCAL(chosen_local, 8);
+  smartlist_t *excluded = &excluded_local, *chosen = &chosen_local;
   or_options_t *options = get_options();
   router_crn_flags_t flags = 0;
   tor_assert(_CIRCUIT_PURPOSE_MIN <= purpose &&
              purpose <= _CIRCUIT_PURPOSE_MAX);
 
   log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_CONTEMPLATING_INTERMEDIATE_HOP));
-  excluded = smartlist_create();
   if ((r = build_state_get_exit_router(state))) {
     smartlist_add(excluded, r);
+    smartlist_add(chosen, r);
     routerlist_add_family(excluded, r);
   }
   if(head && head->extend_info)
@@ -2307,10 +2510,13 @@ routerinfo_t *choose_good_middle_server(uint8_t purpose,cpath_build_state_t *sta
     for (i = 0, cpath = head; i < cur_len; ++i, cpath=cpath->next) {
       if ((r = router_get_by_digest(cpath->extend_info->identity_digest))) {
         smartlist_add(excluded, r);
+        smartlist_add(chosen, r);
         routerlist_add_family(excluded, r);
       }
     }
   }
+  if (avoid_path_routers)
+    smartlist_add_all(excluded, avoid_path_routers);
 
   if (state->need_uptime)
     flags |= CRN_NEED_UPTIME;
@@ -2318,8 +2524,9 @@ routerinfo_t *choose_good_middle_server(uint8_t purpose,cpath_build_state_t *sta
     flags |= CRN_NEED_CAPACITY;
   if (options->_AllowInvalid & ALLOW_INVALID_MIDDLE)
     flags |= CRN_ALLOW_INVALID;
-  choice = router_choose_random_node(excluded, options->ExcludeNodes, flags);
-  smartlist_free(excluded);
+  choice = choose_random_node_as_distinct(excluded, chosen, flags);
+  smartlist_local_free(chosen);
+  smartlist_local_free(excluded);
   return choice;
 }
 
@@ -2334,19 +2541,22 @@ routerinfo_t *choose_good_middle_server(uint8_t purpose,cpath_build_state_t *sta
 routerinfo_t *choose_good_entry_server(uint8_t purpose, cpath_build_state_t *state)
 {
   routerinfo_t *r, *choice;
-  smartlist_t *excluded;
+  SMARTLIST_LOCAL(excluded_local, 32);
+  SMARTLIST_LOCAL(chosen_local, 8);
+  smartlist_t *excluded = &excluded_local, *chosen = &chosen_local;
   or_options_t *options = get_options();
   router_crn_flags_t flags = 0;
 
   if (state && options->UseEntryGuards &&
       (purpose != CIRCUIT_PURPOSE_TESTING || options->BridgeRelay)) {
-    return choose_random_entry(state);
+    r = choose_random_entry(state);
+    state->first_hop_is_guard = r != NULL;
+    return r;
   }
 
-  excluded = smartlist_create();
-
   if (state && (r = build_state_get_exit_router(state))) {
     smartlist_add(excluded, r);
+    smartlist_add(chosen, r);
     routerlist_add_family(excluded, r);
   }
   if (firewall_is_fascist_or()) {
@@ -2382,8 +2592,9 @@ routerinfo_t *choose_good_entry_server(uint8_t purpose, cpath_build_state_t *sta
   if (options->_AllowInvalid & ALLOW_INVALID_ENTRY)
     flags |= CRN_ALLOW_INVALID;
 
-  choice = router_choose_random_node(excluded,options->ExcludeNodes,flags);
-  smartlist_free(excluded);
+  choice = choose_random_node_as_distinct(excluded, chosen, flags);
+  smartlist_local_free(chosen);
+  smartlist_local_free(excluded);
   return choice;
 }
 
@@ -2423,8 +2634,8 @@ onion_extend_cpath(origin_circuit_t *circ)
   log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_PATH_LENGTH), cur_len,state->desired_path_len);
 
 	if((options->EnforceDistinctSubnets&4)!=0)
-	{	uint32_t *iplist,*aslist;
-		iplist=tor_malloc(100);aslist=tor_malloc(4096);
+	{	uint32_t *iplist;
+		iplist=tor_malloc(100);
 		int i=0,j=0;
 		routerinfo_t *r;
 		while(j<MAX_AS_RETRIES)
@@ -2455,11 +2666,12 @@ onion_extend_cpath(origin_circuit_t *circ)
 				if(r)	iplist[i++] = r->addr;
 			}
 			iplist[i] = 0;
-			geoip_get_full_as_path(iplist,aslist,8188);
-			if(geoip_is_as_path_safe(aslist))	break;
+			if(geoip_is_ip_path_safe(iplist))	break;
+			extend_info_free(info);
+			info = NULL;
 			j++;i=0;
 		}
-		tor_free(aslist);tor_free(iplist);
+		tor_free(iplist);
 		if(j==MAX_AS_RETRIES)
 		{	if(info)	extend_info_free(info);
 			info = NULL;
@@ -2499,12 +2711,11 @@ onion_extend_cpath(origin_circuit_t *circ)
  * end of the cpath <b>head_ptr</b>. */
 int onion_append_hop(crypt_path_t **head_ptr, extend_info_t *choice)
 {
-  crypt_path_t *hop = tor_malloc_zero(sizeof(crypt_path_t));
+  crypt_path_t *hop = crypt_path_new();
 
   /* link hop into the cpath, at the end. */
   onion_append_to_cpath(head_ptr, hop);
 
-  hop->magic = CRYPT_PATH_MAGIC;
   hop->state = CPATH_STATE_CLOSED;
   hop->hItem=NULL;
 
@@ -2516,13 +2727,22 @@ int onion_append_hop(crypt_path_t **head_ptr, extend_info_t *choice)
   return 0;
 }
 
+/** Allocate and return a new, zeroed extend_info_t.  Free it with
+ * extend_info_free(). */
+extend_info_t *
+extend_info_new(void)
+{
+  return mp_pool_get_zero(&extend_info_pool, sizeof(extend_info_t),
+                          32*1024);
+}
+
 /** Allocate a new extend_info object based on the various arguments. */
 extend_info_t *
 extend_info_alloc(const char *nickname, const char *digest,
                   crypto_pk_env_t *onion_key,
                   const tor_addr_t *addr, uint16_t port)
 {
-  extend_info_t *info = tor_malloc_zero(sizeof(extend_info_t));
+  extend_info_t *info = extend_info_new();
   memcpy(info->identity_digest, digest, DIGEST_LEN);
   if (nickname)
     strlcpy(info->nickname, nickname, sizeof(info->nickname));
@@ -2553,7 +2773,7 @@ extend_info_free(extend_info_t *info)
   tor_assert(info);
   if (info->onion_key)
     crypto_free_pk_env(info->onion_key);
-  tor_free(info);
+  mp_pool_release(info);
 }
 
 /** Allocate and return a new extend_info_t with the same contents as
@@ -2563,7 +2783,7 @@ extend_info_dup(extend_info_t *info)
 {
   extend_info_t *newinfo;
   tor_assert(info);
-  newinfo = tor_malloc(sizeof(extend_info_t));
+  newinfo = extend_info_new();
   memcpy(newinfo, info, sizeof(extend_info_t));
   if (info->onion_key)
     newinfo->onion_key = crypto_pk_dup_key(info->onion_key);
@@ -2572,6 +2792,26 @@ extend_info_dup(extend_info_t *info)
   return newinfo;
 }
 
+/** Free the empty chunks of the extend_info_t pool, keeping those we have
+ * used recently. */
+void
+clean_extend_info_pool(void)
+{
+  if (extend_info_pool)
+    mp_pool_clean(extend_info_pool, 0, 1);
+}
+
+/** Free all storage used by the extend_info_t pool.  Every extend_info_t
+ * must have been freed already. */
+void
+free_extend_info_pool(void)
+{
+  if (extend_info_pool) {
+    mp_pool_destroy(extend_info_pool);
+    extend_info_pool = NULL;
+  }
+}
+
 /** Return the routerinfo_t for the chosen exit router in <b>state</b>.
  * If there is no chosen exit, or if we don't know the routerinfo_t for
  * the chosen exit, return NULL.
@@ -2731,6 +2971,156 @@ entry_is_live(entry_guard_t *e, int need_uptime, int need_capacity,
   return r;
 }
 
+/** Launch a connection to each of the entry guards that we would use for
+ * our next circuits and that we don't have a usable connection to. */
+void
+entry_guards_reconnect(void)
+{
+  or_options_t *options = get_options();
+  int n = 0;
+  if (!entry_guards || (!options->UseEntryGuards && !options->UseBridges))
+    return;
+  SMARTLIST_FOREACH_BEGIN(entry_guards, entry_guard_t *, entry) {
+    const char *msg;
+    int launch = 0;
+    tor_addr_t addr;
+    routerinfo_t *r = entry_is_live(entry, 0, 1, 0, &msg);
+    if (!r)
+      continue;
+    if (++n > options->NumEntryGuards)
+      break;
+    tor_addr_from_ipv4h(&addr, r->addr);
+    if (!connection_or_get_for_extend(r->cache_info.identity_digest, &addr,
+                                      &msg, &launch) && launch) {
+      log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_RECONNECTING_GUARD),r->nickname);
+      connection_or_connect(&addr, r->or_port, r->cache_info.identity_digest);
+    }
+  } SMARTLIST_FOREACH_END(entry);
+}
+
+/** Return the first entry guard that we think is usable, or NULL. */
+static routerinfo_t *
+entry_guards_get_primary(void)
+{
+  or_options_t *options = get_options();
+  const char *msg;
+  routerinfo_t *r;
+  if (!entry_guards || (!options->UseEntryGuards && !options->UseBridges))
+    return NULL;
+  SMARTLIST_FOREACH(entry_guards, entry_guard_t *, entry,
+    if ((r = entry_is_live(entry, 0, 1, 0, &msg)))
+      return r;);
+  return NULL;
+}
+
+/** Return true iff <b>digest</b> is the identity of our first usable entry
+ * guard. */
+int
+entry_guard_is_primary(const char *digest)
+{
+  routerinfo_t *r = entry_guards_get_primary();
+  return r && tor_memeq(r->cache_info.identity_digest, digest, DIGEST_LEN);
+}
+
+/** Don't open another connection to our primary guard more often than
+ * this. */
+#define PARALLEL_GUARD_CONN_INTERVAL (60)
+/** Don't open another connection to our primary guard until its
+ * connection carries this many circuits. */
+#define PARALLEL_GUARD_CONN_MIN_CIRCS 2
+
+/** If PrimaryGuardConnections is more than 1 and the connection to our
+ * primary guard is busy, open another one next to it, so that new
+ * circuits go to whichever is less loaded and one busy circuit doesn't
+ * hold up the cells of all the others. */
+void
+entry_guards_keep_parallel_conns(time_t now)
+{
+  static time_t last_launched = 0;
+  or_options_t *options = get_options();
+  routerinfo_t *r;
+  tor_addr_t addr;
+  int n, n_circuits;
+
+  if (options->PrimaryGuardConnections < 2 ||
+      now < last_launched + PARALLEL_GUARD_CONN_INTERVAL)
+    return;
+  r = entry_guards_get_primary();
+  if (!r)
+    return;
+  /* The first connection is made when we need it. */
+  n = connection_or_count_for_circs(r->cache_info.identity_digest,
+                                    &n_circuits);
+  if (!n || n >= options->PrimaryGuardConnections ||
+      n_circuits < PARALLEL_GUARD_CONN_MIN_CIRCS)
+    return;
+  last_launched = now;
+  log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_PARALLEL_GUARD_CONN),r->nickname);
+  tor_addr_from_ipv4h(&addr, r->addr);
+  connection_or_connect(&addr, r->or_port, r->cache_info.identity_digest);
+}
+
+/** Wait this long after a guard became unreachable before we probe it. */
+#define ENTRY_GUARD_PROBE_MIN_INTERVAL (30)
+/** Never wait longer than this between two probes of a guard. */
+#define ENTRY_GUARD_PROBE_MAX_INTERVAL (30*60)
+/** Don't have more probes than this in progress at a time. */
+#define ENTRY_GUARD_PROBE_MAX_PARALLEL 4
+/** Forget about a probe that didn't end after this long. */
+#define ENTRY_GUARD_PROBE_TIMEOUT (2*60)
+
+/** Open OR connections to the entry guards that we have used before but
+ * marked as unreachable, a few at a time, each guard after a delay that
+ * doubles from ENTRY_GUARD_PROBE_MIN_INTERVAL to
+ * ENTRY_GUARD_PROBE_MAX_INTERVAL. The TLS handshake is the whole probe:
+ * connection_or tells entry_guard_register_connect_status() whether it
+ * worked, as for any other connection, so that the guards we lost when the
+ * network went down are back in use soon after it comes back, instead of
+ * when entry_is_time_to_retry() lets a circuit try them. */
+void
+entry_guards_probe_unreachable(time_t now)
+{
+  int n_probing = 0;
+  tor_addr_t addr;
+
+  if (!entry_guards || !router_have_minimum_dir_info())
+    return;
+  SMARTLIST_FOREACH(entry_guards, entry_guard_t *, e, {
+    if (e->probing && e->probe_started + ENTRY_GUARD_PROBE_TIMEOUT <= now)
+      e->probing = 0;
+    if (e->probing)
+      ++n_probing;
+  });
+  SMARTLIST_FOREACH_BEGIN(entry_guards, entry_guard_t *, e) {
+    routerinfo_t *r;
+    if (n_probing >= ENTRY_GUARD_PROBE_MAX_PARALLEL)
+      break;
+    if (!e->made_contact || !e->unreachable_since || e->bad_since ||
+        e->probing)
+      continue;
+    if (!e->next_probe) {
+      e->probe_interval = ENTRY_GUARD_PROBE_MIN_INTERVAL;
+      e->next_probe = e->unreachable_since + e->probe_interval;
+    }
+    if (now < e->next_probe)
+      continue;
+    r = router_get_by_digest(e->identity);
+    if (!r || !fascist_firewall_allows_or(r) ||
+        connection_or_count_for_circs(e->identity, NULL))
+      continue;
+    e->next_probe = now + e->probe_interval;
+    e->probe_interval = MIN(e->probe_interval*2,
+                            ENTRY_GUARD_PROBE_MAX_INTERVAL);
+    e->probing = 1;
+    e->probe_started = now;
+    ++n_probing;
+    log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_PROBING_GUARD),
+             e->nickname);
+    tor_addr_from_ipv4h(&addr, r->addr);
+    connection_or_connect(&addr, r->or_port, r->cache_info.identity_digest);
+  } SMARTLIST_FOREACH_END(e);
+}
+
 /** Return the number of entry guards that we think are usable. */
 static int
 num_live_entry_guards(void)
@@ -2758,6 +3148,68 @@ entry_guard_t *is_an_entry_guard(const char *digest)
   return NULL;
 }
 
+/** Remember that a circuit through the entry guard <b>digest</b> took
+ * <b>msec</b> milliseconds to build. */
+static void
+entry_guard_note_build_time(const char *digest, build_time_t msec)
+{
+  entry_guard_t *entry = is_an_entry_guard(digest);
+  if (!entry)
+    return;
+  entry->build_times[entry->build_times_idx] = msec;
+  entry->build_times_idx = (entry->build_times_idx + 1) %
+                           ENTRY_GUARD_BUILD_TIMES;
+  if (entry->n_build_times < ENTRY_GUARD_BUILD_TIMES)
+    ++entry->n_build_times;
+}
+
+/** Return the median of the completed build times in <b>cbt</b>, to the
+ * nearest histogram bin, or 0 if there are none. */
+static build_time_t
+circuit_build_times_median(circuit_build_times_t *cbt)
+{
+  int n = cbt->total_build_times - cbt->abandoned_count, seen = 0;
+  build_time_t bin;
+  for (bin = 0; bin < cbt->histogram_nbins && n > 0; ++bin) {
+    seen += cbt->histogram[bin];
+    if (seen*2 >= n)
+      return CBT_BIN_TO_MS(bin);
+  }
+  return 0;
+}
+
+/** Return the build timeout in milliseconds for a circuit whose first hop
+ * is <b>digest</b>. Once an entry guard has enough build times of its own,
+ * we scale the global timeout by how its median build time compares to the
+ * global one, within a factor of two and never past the close timeout.
+ * Otherwise, use the global timeout. */
+double
+circuit_build_times_timeout_for_guard(const char *digest)
+{
+  entry_guard_t *entry;
+  uint32_t times[ENTRY_GUARD_BUILD_TIMES];
+  build_time_t global_median;
+  double ratio, timeout;
+
+  if (!circ_times.have_computed_timeout || !entry_guards ||
+      !(entry = is_an_entry_guard(digest)) ||
+      entry->n_build_times < ENTRY_GUARD_MIN_BUILD_TIMES ||
+      !(global_median = circuit_build_times_median(&circ_times)))
+    return circ_times.timeout_ms;
+  memcpy(times, entry->build_times, sizeof(build_time_t)*entry->n_build_times);
+  ratio = (double)median_uint32(times, entry->n_build_times) / global_median;
+  if (ratio < 0.5)
+    ratio = 0.5;
+  else if (ratio > 2.0)
+    ratio = 2.0;
+  timeout = circ_times.timeout_ms * ratio;
+  if (timeout < circuit_build_times_min_timeout())
+    timeout = circuit_build_times_min_timeout();
+  if (timeout > circ_times.close_ms)
+    timeout = MAX(circ_times.close_ms, circ_times.timeout_ms);
+  return timeout;
+}
+
 /** Dump a description of our list of entry guards to the log at level
  * <b>severity</b>. */
 static void
@@ -3063,6 +3515,7 @@ entry_guard_register_connect_status(const char *digest, int succeeded,
     return 0;
 
   base16_encode(buf, sizeof(buf), entry->identity, DIGEST_LEN);
+  entry->probing = 0;
 
   if (succeeded) {
     if (entry->unreachable_since) {
@@ -3070,6 +3523,7 @@ entry_guard_register_connect_status(const char *digest, int succeeded,
       entry->can_retry = 0;
       entry->unreachable_since = 0;
       entry->last_attempted = now;
+      entry->next_probe = 0;
       control_event_guard(entry->nickname, entry->identity, "UP");
       changed = 1;
     }
@@ -3240,8 +3694,10 @@ int entry_list_is_constrained(or_options_t *options)
 routerinfo_t *
 choose_random_entry(cpath_build_state_t *state)
 {	or_options_t *options = get_options();
-	smartlist_t *live_entry_guards = smartlist_create();
-	smartlist_t *exit_family = smartlist_create();
+	SMARTLIST_LOCAL(live_entry_guards_local, 16);
+	SMARTLIST_LOCAL(exit_family_local, 16);
+	smartlist_t *live_entry_guards = &live_entry_guards_local;
+	smartlist_t *exit_family = &exit_family_local;
 	routerinfo_t *chosen_exit = state?build_state_get_exit_router(state) : NULL;
 	routerinfo_t *r = NULL;
 	int need_uptime = state ? state->need_uptime : 0;
@@ -3307,11 +3763,121 @@ choose_random_entry(cpath_build_state_t *state)
 		r = routerlist_sl_choose_by_bandwidth(live_entry_guards, WEIGHT_FOR_GUARD);
 	else	/* We choose uniformly at random here, because choose_good_entry_server() already weights its choices by bandwidth, so we don't want to *double*-weight our guard selection. */
 		r = smartlist_choose(live_entry_guards);
-	smartlist_free(live_entry_guards);
-	smartlist_free(exit_family);
+	smartlist_local_free(live_entry_guards);
+	smartlist_local_free(exit_family);
 	return r;
 }
 
+/** Return true iff we have an open OR connection to one of our entry guards. */
+static int entry_guards_have_open_conn(void)
+{	connection_t *conn;
+	or_connection_t *or_conn;
+	for(conn = connection_array_first_of_type(CONN_TYPE_OR); conn; conn = conn->next_of_type)
+	{	if(conn->marked_for_close || conn->state != OR_CONN_STATE_OPEN)	continue;
+		or_conn = TO_OR_CONN(conn);
+		if(!or_conn->is_connection_with_client && is_an_entry_guard(or_conn->identity_digest))
+			return 1;
+	}
+	return 0;
+}
+
+/** Launch a connection to the next live entry guard that we have reached before and that we're not connected or connecting to already. Guards we never contacted are left alone so that a race can't grow our guard list. Return 1 if a connection was launched. */
+static int entry_guards_race_one(void)
+{	const char *msg;
+	int should_launch;
+	routerinfo_t *r;
+	tor_addr_t addr;
+	if(!entry_guards)	return 0;
+	SMARTLIST_FOREACH_BEGIN(entry_guards, entry_guard_t *, entry)
+	{	if(!entry->made_contact)	continue;
+		msg = NULL;
+		r = entry_is_live(entry, 0, 0, 0, &msg);
+		if(!r)	continue;
+		tor_addr_from_ipv4h(&addr, r->addr);
+		should_launch = 0;
+		if(connection_or_get_for_extend(entry->identity, &addr, &msg, &should_launch) || !should_launch)
+			continue;
+		log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_GUARD_RACE_LAUNCH),safe_str(entry->nickname));
+		if(connection_or_connect(&addr, r->or_port, r->cache_info.identity_digest))
+			return 1;
+	}
+	SMARTLIST_FOREACH_END(entry);
+	return 0;
+}
+
+static void entry_guards_race_schedule(void)
+{	struct timeval delay;
+	delay.tv_sec = 0;
+	delay.tv_usec = GUARD_RACE_STAGGER_MSEC * 1000;
+	if(evtimer_add(guard_race_timer, &delay) == 0)
+		guard_race_scheduled = 1;
+}
+
+/** Timer callback: while no entry guard is connected, race one more guard and schedule the next one. */
+static void entry_guards_race_cb(evutil_socket_t fd,short what,void *arg)
+{	(void)fd;
+	(void)what;
+	(void)arg;
+	guard_race_scheduled = 0;
+	if(entry_guards_have_open_conn() || guard_race_launched >= GUARD_RACE_EXTRA_GUARDS)
+		return;
+	if(entry_guards_race_one() && ++guard_race_launched < GUARD_RACE_EXTRA_GUARDS)
+		entry_guards_race_schedule();
+}
+
+/** A circuit has just launched a connection to its entry guard. If none of our guards is connected yet, start racing connections to our other guards a little later, so that circuits can move to whichever guard answers first (see circuit_reroute_to_guard()); the guards that lose the race stay connected as spares. */
+static void entry_guards_race_start(void)
+{	if(guard_race_scheduled || guard_race_launched >= GUARD_RACE_EXTRA_GUARDS || entry_guards_have_open_conn())
+		return;
+	if(!guard_race_timer)
+	{	guard_race_timer = tor_evtimer_new(tor_libevent_get_base(), entry_guards_race_cb, NULL);
+		tor_assert(guard_race_timer);
+	}
+	entry_guards_race_schedule();
+}
+
+/** <b>or_conn</b> to one of our entry guards has just opened. Move every origin circuit that is still waiting for a connection to some other entry guard onto <b>or_conn</b>, as long as its guard was picked by us and the rest of its path allows the new guard. */
+static void circuit_reroute_to_guard(or_connection_t *or_conn)
+{	or_options_t *options = get_options();
+	entry_guard_t *entry = is_an_entry_guard(or_conn->identity_digest);
+	routerinfo_t *r = router_get_by_digest(or_conn->identity_digest);
+	circuit_t *circ;
+	origin_circuit_t *ocirc;
+	crypt_path_t *hop;
+	routerinfo_t *hr;
+	const char *msg;
+	int ok;
+
+	if(!entry || !r || (options->EnforceDistinctSubnets&4)!=0)	/* AS-safe paths were checked against the guard they picked */
+		return;
+	for(circ = _circuit_get_global_list(); circ; circ = circ->next)
+	{	if(circ->marked_for_close || !CIRCUIT_IS_ORIGIN(circ) || circ->state != CIRCUIT_STATE_OR_WAIT || circ->n_conn || !circ->n_hop)
+			continue;
+		ocirc = TO_ORIGIN_CIRCUIT(circ);
+		if(!ocirc->build_state || !ocirc->build_state->first_hop_is_guard || !ocirc->cpath || ocirc->cpath->state != CPATH_STATE_CLOSED)
+			continue;
+		if(tor_memeq(circ->n_hop->identity_digest, or_conn->identity_digest, DIGEST_LEN) || !is_an_entry_guard(circ->n_hop->identity_digest))
+			continue;
+		msg = NULL;
+		if(!entry_is_live(entry, ocirc->build_state->need_uptime, ocirc->build_state->need_capacity, 0, &msg))
+			continue;
+		ok = 1;
+		for(hop = ocirc->cpath->next; ok && hop != ocirc->cpath; hop = hop->next)
+		{	if(!hop->extend_info)	continue;
+			if(tor_memeq(hop->extend_info->identity_digest, or_conn->identity_digest, DIGEST_LEN))
+				ok = 0;
+			else if((hr = router_get_by_digest(hop->extend_info->identity_digest)) != NULL && routers_in_same_family(r, hr))
+				ok = 0;
+		}
+		if(!ok)	continue;
+		log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITBUILD_GUARD_REROUTE),safe_str(entry->nickname),ocirc->global_identifier);
+		extend_info_free(ocirc->cpath->extend_info);
+		ocirc->cpath->extend_info = extend_info_from_router(r);
+		extend_info_free(circ->n_hop);
+		circ->n_hop = extend_info_dup(ocirc->cpath->extend_info);
+	}
+}
+
 
 /** Helper: Return the start of the month containing <b>time</b>. */
 static time_t
@@ -4034,5 +4600,10 @@ entry_guards_free_all(void)
   clear_bridge_list();
   smartlist_free(bridge_list);
   bridge_list = NULL;
+  if (guard_race_timer) {
+    tor_event_free(guard_race_timer);
+    guard_race_timer = NULL;
+  }
+  guard_race_scheduled = guard_race_launched = 0;
 }
 
@@ -27,6 +27,7 @@ int inform_testing_reachability(void);
 int circuit_timeout_want_to_count_circ(origin_circuit_t *circ);
 int circuit_send_next_onion_skin(origin_circuit_t *circ);
 void circuit_note_clock_jumped(int seconds_elapsed);
+void circuit_warm_start(time_t now, int seconds_idle);
 int circuit_extend(cell_t *cell, circuit_t *circ);
 int circuit_init_cpath_crypto(crypt_path_t *cpath, const char *key_data,
                               int reverse);
@@ -40,6 +41,7 @@ int circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
 
 int circuit_append_new_exit(origin_circuit_t *circ, extend_info_t *info);
 int circuit_extend_to_new_exit(origin_circuit_t *circ, extend_info_t *info);
+void circuit_build_avoid_routers_of(origin_circuit_t *circ);
 void onion_append_to_cpath(crypt_path_t **head_ptr, crypt_path_t *new_hop);
 extend_info_t *extend_info_alloc(const char *nickname, const char *digest,
                                  crypto_pk_env_t *onion_key,
@@ -47,10 +49,17 @@ extend_info_t *extend_info_alloc(const char *nickname, const char *digest,
 extend_info_t *extend_info_from_router(routerinfo_t *r);
 extend_info_t *extend_info_dup(extend_info_t *info);
 void extend_info_free(extend_info_t *info);
+extend_info_t *extend_info_new(void);
+void clean_extend_info_pool(void);
+void free_extend_info_pool(void);
 routerinfo_t *build_state_get_exit_router(cpath_build_state_t *state);
 const char *build_state_get_exit_nickname(cpath_build_state_t *state);
 
 void entry_guards_compute_status(or_options_t *options, time_t now);
+void entry_guards_reconnect(void);
+int entry_guard_is_primary(const char *digest);
+void entry_guards_keep_parallel_conns(time_t now);
+void entry_guards_probe_unreachable(time_t now);
 int entry_guard_register_connect_status(const char *digest, int succeeded,
                                         int mark_relay_status, time_t now);
 void entry_nodes_should_be_added(void);
@@ -96,6 +105,7 @@ int circuit_build_times_needs_circuits(circuit_build_times_t *cbt);
 
 int circuit_build_times_needs_circuits_now(circuit_build_times_t *cbt);
 void circuit_build_times_init(circuit_build_times_t *cbt);
+void circuit_build_times_free(circuit_build_times_t *cbt);
 void circuit_build_times_new_consensus_params(circuit_build_times_t *cbt,
                                               networkstatus_t *ns);
 double circuit_build_times_timeout_rate(const circuit_build_times_t *cbt);
@@ -126,6 +136,7 @@ int circuit_build_times_get_bw_scale(networkstatus_t *ns);
 void addentryguards(void);
 void clear_bridge_list(void);
 entry_guard_t *is_an_entry_guard(const char *digest);
+double circuit_build_times_timeout_for_guard(const char *digest);
 
 #endif
 
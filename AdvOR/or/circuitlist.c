@@ -10,6 +10,7 @@
  **/
 
 #include "or.h"
+#include "buffers.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuituse.h"
@@ -18,6 +19,7 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "etw.h"
 #include "networkstatus.h"
 #include "onion.h"
 #include "relay.h"
@@ -27,15 +29,36 @@
 #include "routerlist.h"
 #include "ht.h"
 #include "main.h"
+#include "mempool.h"
 
 /********* START VARIABLES **********/
 
 /** A global list of all circuits at this hop. */
 circuit_t *global_circuitlist=NULL;
 
+/** Heads of the doubly linked lists of circuits with each purpose, linked
+ * through next_by_purpose.  Circuits that haven't been given a purpose yet
+ * live on the list for purpose 0. */
+static circuit_t *circuits_by_purpose[256];
+
 /** A list of all the circuits in CIRCUIT_STATE_OR_WAIT. */
 static smartlist_t *circuits_pending_or_conns=NULL;
 
+/** Open, clean general-purpose circuits that may be cannibalized, bucketed by
+ * CANNIBALIZE_BUCKET() of their build state. Circuits that stop qualifying
+ * are dropped lazily by circuit_find_to_cannibalize(). */
+static smartlist_t *cannibalize_buckets[8];
+
+/** Memory pools for origin circuits, OR circuits and cpath hops, created
+ * when we first need them. */
+static mp_pool_t *origin_circuit_pool = NULL, *or_circuit_pool = NULL,
+                 *crypt_path_pool = NULL;
+
+/** How many bytes should each chunk of a circuit pool hold? */
+#define CIRCUIT_POOL_CHUNK_SIZE (64*1024)
+#define CANNIBALIZE_BUCKET(is_internal,need_uptime,need_capacity) \
+  (((is_internal)?4:0)|((need_uptime)?2:0)|((need_capacity)?1:0))
+
 void circuit_free(circuit_t *circ);
 void circuit_free_cpath(crypt_path_t *cpath);
 void circuit_free_cpath_node(crypt_path_t *victim);
@@ -46,7 +69,7 @@ int info_in_cpath(extend_info_t *info,origin_circuit_t *circ);
 /** A map from OR connection and circuit ID to circuit.  (Lookup performance is
  * very important here, since we need to do it every time a cell arrives.) */
 typedef struct orconn_circid_circuit_map_t {
-  HT_ENTRY(orconn_circid_circuit_map_t) node;
+  OAHT_ENTRY(orconn_circid_circuit_map_t) node;
   or_connection_t *or_conn;
   circid_t circ_id;
   circuit_t *circuit;
@@ -70,13 +93,14 @@ _orconn_circid_entry_hash(orconn_circid_circuit_map_t *a)
   return (((unsigned)a->circ_id)<<8) ^ (unsigned)(uintptr_t)(a->or_conn);
 }
 
-/** Map from [orconn,circid] to circuit. */
-static HT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t)
-     orconn_circid_circuit_map = HT_INITIALIZER();
-HT_PROTOTYPE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-             _orconn_circid_entry_hash, _orconn_circid_entries_eq)
-HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-            _orconn_circid_entry_hash, _orconn_circid_entries_eq, 0.6)
+/** Map from [orconn,circid] to circuit.  Open-addressed, since we look it
+ * up for every cell. */
+static OAHT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t)
+     orconn_circid_circuit_map = OAHT_INITIALIZER();
+OAHT_PROTOTYPE(orconn_circid_map, orconn_circid_circuit_map_t, node,
+               _orconn_circid_entry_hash, _orconn_circid_entries_eq)
+OAHT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
+              _orconn_circid_entry_hash, _orconn_circid_entries_eq, 0.8)
 
 /** The most recently returned entry from circuit_get_by_circid_orconn;
  * used to improve performance when many cells arrive in a row from the
@@ -84,6 +108,21 @@ HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
  */
 orconn_circid_circuit_map_t *_last_circid_orconn_ent = NULL;
 
+/** If <b>id</b> is in the half of the circuit ID space that we pick from on
+ * <b>conn</b>, note whether it's <b>used</b> in conn-\>circ_ids_used. */
+static INLINE void
+circuit_id_note_used(or_connection_t *conn, circid_t id, int used)
+{
+  circid_t high_bit = (conn->circ_id_type == CIRC_ID_TYPE_HIGHER) ? 1<<15 : 0;
+  if (!conn->circ_ids_used || conn->circ_id_type == CIRC_ID_TYPE_NEITHER ||
+      (id & (1<<15)) != high_bit)
+    return;
+  if (used)
+    bitarray_set(conn->circ_ids_used, id & ((1<<15)-1));
+  else
+    bitarray_clear(conn->circ_ids_used, id & ((1<<15)-1));
+}
+
 /** Implementation helper for circuit_set_{p,n}_circid_orconn: A circuit ID
  * and/or or_connection for circ has just changed from <b>old_conn, old_id</b>
  * to <b>conn, id</b>.  Adjust the conn,circid map as appropriate, removing
@@ -135,7 +174,9 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     found = HT_REMOVE(orconn_circid_map, &orconn_circid_circuit_map, &search);
     if (found) {
       tor_free(found);
-      --old_conn->n_circuits;
+      circuit_id_note_used(old_conn, old_id, 0);
+      if (--old_conn->n_circuits == 0)
+        connection_housekeeping_reschedule(TO_CONN(old_conn));
     }
     if (was_active && old_conn != conn)
       make_circuit_inactive_on_conn(circ,old_conn);
@@ -162,6 +203,7 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     found->circuit = circ;
     HT_INSERT(orconn_circid_map, &orconn_circid_circuit_map, found);
   }
+  circuit_id_note_used(conn, id, 1);
   if (make_active && old_conn != conn)
     make_circuit_active_on_conn(circ,conn);
 
@@ -195,6 +237,34 @@ circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
     tor_assert(bool_eq(circ->n_conn_cells.n, circ->next_active_on_n_conn));
 }
 
+/** Unlist <b>circ</b> from the cannibalization buckets if it's listed. */
+static void
+circuit_cannibalize_bucket_remove(origin_circuit_t *circ)
+{
+  if (circ->cannibalize_bucket) {
+    smartlist_remove(cannibalize_buckets[circ->cannibalize_bucket-1], circ);
+    circ->cannibalize_bucket = 0;
+  }
+}
+
+/** Note that <b>circ</b> has just become an open general-purpose circuit, so
+ * circuit_find_to_cannibalize() should consider it. */
+void
+circuit_note_cannibalizable(origin_circuit_t *circ)
+{
+  cpath_build_state_t *state = circ->build_state;
+  int b;
+  if (circ->cannibalize_bucket || !state || state->onehop_tunnel ||
+      circ->_base.purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return;
+  b = CANNIBALIZE_BUCKET(state->is_internal, state->need_uptime,
+                         state->need_capacity);
+  if (!cannibalize_buckets[b])
+    cannibalize_buckets[b] = smartlist_create();
+  smartlist_add(cannibalize_buckets[b], circ);
+  circ->cannibalize_bucket = b+1;
+}
+
 /** Change the state of <b>circ</b> to <b>state</b>, adding it to or removing
  * it from lists as appropriate. */
 void
@@ -216,9 +286,36 @@ circuit_set_state(circuit_t *circ, uint8_t state)
   if (state == CIRCUIT_STATE_OPEN)
     tor_assert(!circ->n_conn_onionskin);
   circ->state = state;
+  if (state == CIRCUIT_STATE_OPEN && CIRCUIT_IS_ORIGIN(circ))
+    circuit_note_cannibalizable(TO_ORIGIN_CIRCUIT(circ));
   tree_set_circ(circ);
 }
 
+/** Link <b>circ</b> at the head of the list for its current purpose. */
+static void
+circuit_purpose_list_add(circuit_t *circ)
+{
+  circuit_t **head = &circuits_by_purpose[circ->purpose];
+  circ->prev_by_purpose = NULL;
+  circ->next_by_purpose = *head;
+  if (*head)
+    (*head)->prev_by_purpose = circ;
+  *head = circ;
+}
+
+/** Unlink <b>circ</b> from the list for its current purpose. */
+static void
+circuit_purpose_list_remove(circuit_t *circ)
+{
+  if (circ->prev_by_purpose)
+    circ->prev_by_purpose->next_by_purpose = circ->next_by_purpose;
+  else if (circuits_by_purpose[circ->purpose] == circ)
+    circuits_by_purpose[circ->purpose] = circ->next_by_purpose;
+  if (circ->next_by_purpose)
+    circ->next_by_purpose->prev_by_purpose = circ->prev_by_purpose;
+  circ->next_by_purpose = circ->prev_by_purpose = NULL;
+}
+
 /** Add <b>circ</b> to the global list of circuits. This is called only from
  * within circuit_new.
  */
@@ -232,9 +329,30 @@ circuit_add(circuit_t *circ)
     circ->next = global_circuitlist;
     global_circuitlist = circ;
   }
+  circuit_purpose_list_add(circ);
   tree_add_new_circ(circ);
 }
 
+/** Return the most recent circuit to take on <b>purpose</b>, or NULL; later
+ * ones follow through next_by_purpose. */
+circuit_t *
+circuit_get_first_by_purpose(uint8_t purpose)
+{
+  return circuits_by_purpose[purpose];
+}
+
+/** Change the purpose of <b>circ</b> to <b>purpose</b>, moving it to the
+ * right per-purpose list.  Every purpose change must go through here. */
+void
+circuit_change_purpose(circuit_t *circ, uint8_t purpose)
+{
+  if (circ->purpose == purpose)
+    return;
+  circuit_purpose_list_remove(circ);
+  circ->purpose = purpose;
+  circuit_purpose_list_add(circ);
+}
+
 /** Append to <b>out</b> all circuits in state OR_WAIT waiting for
  * the given connection. */
 void
@@ -480,7 +598,8 @@ origin_circuit_new(void)
    * controller */
   static uint32_t n_circuits_allocated = 1;
 
-  circ = tor_malloc_zero(sizeof(origin_circuit_t));
+  circ = mp_pool_get_zero(&origin_circuit_pool, sizeof(origin_circuit_t),
+                          CIRCUIT_POOL_CHUNK_SIZE);
   circ->_base.magic = ORIGIN_CIRCUIT_MAGIC;
 
   circ->next_stream_id = crypto_rand_int(1<<16);
@@ -503,7 +622,8 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
   /* CircIDs */
   or_circuit_t *circ;
 
-  circ = tor_malloc_zero(sizeof(or_circuit_t));
+  circ = mp_pool_get_zero(&or_circuit_pool, sizeof(or_circuit_t),
+                          CIRCUIT_POOL_CHUNK_SIZE);
   circ->_base.magic = OR_CIRCUIT_MAGIC;
 
   if (p_conn)
@@ -534,11 +654,14 @@ void circuit_free(circuit_t *circ)
   size_t memlen;
   if(!circ)	return;
   tree_remove_circ(circ);
+  circuit_stream_index_free(circ);
+  circuit_purpose_list_remove(circ);
   if (CIRCUIT_IS_ORIGIN(circ)) {
     origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+    circuit_cannibalize_bucket_remove(ocirc);
     if (ocirc->build_state) {
       if (ocirc->build_state->chosen_exit)
         extend_info_free(ocirc->build_state->chosen_exit);
@@ -596,7 +719,7 @@ void circuit_free(circuit_t *circ)
   cell_queue_clear(&circ->n_conn_cells);
 
   memset(mem, 0xAA, memlen); /* poison memory */
-  tor_free(mem);
+  mp_pool_release(mem);
 }
 
 /** Deallocate space associated with the linked list <b>cpath</b>. */
@@ -618,11 +741,93 @@ void circuit_free_cpath(crypt_path_t *cpath)
   circuit_free_cpath_node(cpath);
 }
 
+/** A circuit that circuits_handle_oom() may close, and how many bytes of
+ * queued data closing it would free. */
+typedef struct circuit_oom_t {
+  circuit_t *circ;
+  size_t bytes;
+} circuit_oom_t;
+
+/** Helper for circuits_handle_oom(): sort the circuits with the most queued
+ * data first. */
+static int
+_compare_circuits_by_queued_bytes(const void *a, const void *b)
+{
+  size_t na = ((const circuit_oom_t *)a)->bytes;
+  size_t nb = ((const circuit_oom_t *)b)->bytes;
+  if (na > nb)
+    return -1;
+  return na < nb ? 1 : 0;
+}
+
+/** Return the number of bytes queued on <b>circ</b>: its cell queues, and
+ * the buffers of the streams attached to it. */
+static size_t
+circuit_queued_bytes(circuit_t *circ)
+{
+  size_t n = circ->n_conn_cells.n;
+  edge_connection_t *stream;
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    stream = TO_ORIGIN_CIRCUIT(circ)->p_streams;
+  } else {
+    n += TO_OR_CIRCUIT(circ)->p_conn_cells.n;
+    stream = TO_OR_CIRCUIT(circ)->n_streams;
+  }
+  n *= sizeof(packed_cell_t);
+  for (; stream; stream = stream->next_stream) {
+    if (stream->_base.inbuf)
+      n += buf_allocation(stream->_base.inbuf);
+    if (stream->_base.outbuf)
+      n += buf_allocation(stream->_base.outbuf);
+  }
+  return n;
+}
+
+/** We are short of memory: close the circuits with the most data queued on
+ * them, biggest first, until we have freed about <b>bytes_to_free</b>
+ * bytes.  Return the number of circuits we closed, and set
+ * *<b>freed_out</b> to the number of bytes we expect that to free. */
+int
+circuits_handle_oom(size_t bytes_to_free, size_t *freed_out)
+{
+  circuit_oom_t *victims;
+  circuit_t *circ;
+  int n = 0, i, n_closed = 0;
+  size_t freed = 0;
+
+  for (circ = global_circuitlist; circ; circ = circ->next)
+    ++n;
+  victims = tor_malloc(sizeof(circuit_oom_t) * (n ? n : 1));
+  n = 0;
+  for (circ = global_circuitlist; circ; circ = circ->next) {
+    size_t bytes;
+    if (circ->marked_for_close)
+      continue;
+    bytes = circuit_queued_bytes(circ);
+    if (!bytes)
+      continue;
+    victims[n].circ = circ;
+    victims[n].bytes = bytes;
+    ++n;
+  }
+  qsort(victims, n, sizeof(circuit_oom_t), _compare_circuits_by_queued_bytes);
+  for (i = 0; i < n && freed < bytes_to_free; ++i) {
+    circuit_mark_for_close(victims[i].circ, END_CIRC_REASON_RESOURCELIMIT);
+    freed += victims[i].bytes;
+    ++n_closed;
+  }
+  tor_free(victims);
+  if (freed_out)
+    *freed_out = freed;
+  return n_closed;
+}
+
 /** Release all storage held by circuits. */
 void
 circuit_free_all(void)
 {
   circuit_t *next;
+  int i;
   while (global_circuitlist) {
     next = global_circuitlist->next;
     if (! CIRCUIT_IS_ORIGIN(global_circuitlist)) {
@@ -642,6 +847,13 @@ circuit_free_all(void)
     smartlist_free(circuits_pending_or_conns);
     circuits_pending_or_conns = NULL;
   }
+  for (i = 0; i < 8; ++i) {
+    if (cannibalize_buckets[i]) {
+      smartlist_free(cannibalize_buckets[i]);
+      cannibalize_buckets[i] = NULL;
+    }
+  }
+  memset(circuits_by_purpose, 0, sizeof(circuits_by_purpose));
   HT_CLEAR(orconn_circid_map, &orconn_circid_circuit_map);
 }
 
@@ -662,7 +874,50 @@ void circuit_free_cpath_node(crypt_path_t *victim)
     extend_info_free(victim->extend_info);
   if(victim->hItem)	tree_remove_hop(victim);
   memset(victim, 0xBB, sizeof(crypt_path_t)); /* poison memory */
-  tor_free(victim);
+  mp_pool_release(victim);
+}
+
+/** Allocate and return a new, zeroed crypt_path_t, for the caller to link
+ * into a cpath.  Free it with circuit_free_cpath_node(). */
+crypt_path_t *
+crypt_path_new(void)
+{
+  crypt_path_t *hop = mp_pool_get_zero(&crypt_path_pool, sizeof(crypt_path_t),
+                                       CIRCUIT_POOL_CHUNK_SIZE);
+  hop->magic = CRYPT_PATH_MAGIC;
+  return hop;
+}
+
+/** Free the empty chunks of the circuit and cpath pools, keeping those we
+ * have used recently. */
+void
+clean_circuit_pools(void)
+{
+  if (origin_circuit_pool)
+    mp_pool_clean(origin_circuit_pool, 0, 1);
+  if (or_circuit_pool)
+    mp_pool_clean(or_circuit_pool, 0, 1);
+  if (crypt_path_pool)
+    mp_pool_clean(crypt_path_pool, 0, 1);
+}
+
+/** Free all storage used by the circuit and cpath pools.  Every circuit
+ * must have been freed already. */
+void
+free_circuit_pools(void)
+{
+  if (origin_circuit_pool) {
+    mp_pool_destroy(origin_circuit_pool);
+    origin_circuit_pool = NULL;
+  }
+  if (or_circuit_pool) {
+    mp_pool_destroy(or_circuit_pool);
+    or_circuit_pool = NULL;
+  }
+  if (crypt_path_pool) {
+    mp_pool_destroy(crypt_path_pool);
+    crypt_path_pool = NULL;
+  }
 }
 
 /** A helper function for circuit_dump_by_conn() below. Log a bunch
@@ -880,9 +1135,9 @@ circuit_get_by_rend_query_and_purpose(const char *rend_query, uint8_t purpose)
 
   tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (!circ->marked_for_close &&
-        circ->purpose == purpose) {
+  for (circ = circuits_by_purpose[purpose]; circ;
+       circ = circ->next_by_purpose) {
+    if (!circ->marked_for_close) {
       origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
       if (ocirc->rend_data &&
           !rend_cmp_service_ids(rend_query,
@@ -893,23 +1148,29 @@ circuit_get_by_rend_query_and_purpose(const char *rend_query, uint8_t purpose)
   return NULL;
 }
 
-/** Return the first circuit originating here in global_circuitlist after
- * <b>start</b> whose purpose is <b>purpose</b>, and where
- * <b>digest</b> (if set) matches the rend_pk_digest field. Return NULL if no
- * circuit is found.  If <b>start</b> is NULL, begin at the start of the list.
+/** Return the first circuit originating here after <b>start</b> on the list
+ * for <b>purpose</b>, and where <b>digest</b> (if set) matches the
+ * rend_pk_digest field. Return NULL if no circuit is found.  If <b>start</b>
+ * is NULL, begin at the start of the list.  If <b>start</b> has changed
+ * purpose since it was returned, continue through the global list instead.
  */
 origin_circuit_t *
 circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
                                    const char *digest, uint8_t purpose)
 {
   circuit_t *circ;
+  int by_purpose = 1;
   tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
   if (start == NULL)
-    circ = global_circuitlist;
-  else
+    circ = circuits_by_purpose[purpose];
+  else if (TO_CIRCUIT(start)->purpose == purpose)
+    circ = TO_CIRCUIT(start)->next_by_purpose;
+  else {
     circ = TO_CIRCUIT(start)->next;
+    by_purpose = 0;
+  }
 
-  for ( ; circ; circ = circ->next) {
+  for ( ; circ; circ = by_purpose ? circ->next_by_purpose : circ->next) {
     if (circ->marked_for_close)
       continue;
     if (circ->purpose != purpose)
@@ -932,9 +1193,9 @@ circuit_get_by_rend_token_and_purpose(uint8_t purpose, const char *token,
                                       size_t len)
 {
   circuit_t *circ;
-  for (circ = global_circuitlist; circ; circ = circ->next) {
+  for (circ = circuits_by_purpose[purpose]; circ;
+       circ = circ->next_by_purpose) {
     if (! circ->marked_for_close &&
-        circ->purpose == purpose &&
         tor_memeq(TO_OR_CIRCUIT(circ)->rend_token, token, len))
       return TO_OR_CIRCUIT(circ);
   }
@@ -987,23 +1248,32 @@ int info_in_cpath(extend_info_t *info,origin_circuit_t *circ)
  * If !CIRCLAUNCH_NEED_UPTIME, prefer returning non-uptime circuits.
  */
 origin_circuit_t *circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,int flags)
-{	circuit_t *_circ;
-	origin_circuit_t *best=NULL;
-	int need_uptime = (flags & CIRCLAUNCH_NEED_UPTIME) != 0;
+{	int need_uptime = (flags & CIRCLAUNCH_NEED_UPTIME) != 0;
 	int need_capacity = (flags & CIRCLAUNCH_NEED_CAPACITY) != 0;
 	int internal = (flags & CIRCLAUNCH_IS_INTERNAL) != 0;
+	int uptime,capacity,i;
 	/* Make sure we're not trying to create a onehop circ by cannibalization. */
 	tor_assert(!(flags & CIRCLAUNCH_ONEHOP_TUNNEL));
 	log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITLIST_FIND_OPEN_CIRCUIT),purpose, need_uptime, need_capacity, internal);
-	for(_circ=global_circuitlist; _circ; _circ = _circ->next)
-	{	if(CIRCUIT_IS_ORIGIN(_circ) && _circ->state == CIRCUIT_STATE_OPEN && !_circ->marked_for_close && _circ->purpose == CIRCUIT_PURPOSE_C_GENERAL && !_circ->timestamp_dirty)
-		{	origin_circuit_t *circ = TO_ORIGIN_CIRCUIT(_circ);
-			if((!need_uptime || circ->build_state->need_uptime) && (!need_capacity || circ->build_state->need_capacity) && (internal == circ->build_state->is_internal) && circ->remaining_relay_early_cells && !circ->build_state->onehop_tunnel)
-			{	if((!info || !info_in_cpath(info,circ)) && (!best || (best->build_state->need_uptime && !need_uptime)))	best = circ;
+	/* Only buckets that satisfy the flags are searched, non-uptime ones first so we don't use up the stable circuits. */
+	for(uptime = need_uptime; uptime < 2; uptime++)
+	{	for(capacity = need_capacity; capacity < 2; capacity++)
+		{	smartlist_t *bucket = cannibalize_buckets[CANNIBALIZE_BUCKET(internal,uptime,capacity)];
+			if(!bucket)	continue;
+			for(i = 0; i < smartlist_len(bucket); i++)
+			{	origin_circuit_t *circ = smartlist_get(bucket, i);
+				circuit_t *_circ = TO_CIRCUIT(circ);
+				if(_circ->state != CIRCUIT_STATE_OPEN || _circ->marked_for_close || _circ->purpose != CIRCUIT_PURPOSE_C_GENERAL || _circ->timestamp_dirty || !circ->remaining_relay_early_cells)
+				{	/* it won't qualify again unless it's reopened as a general circuit */
+					smartlist_del(bucket, i--);
+					circ->cannibalize_bucket = 0;
+					continue;
+				}
+				if(!circ->is_next_identity && (!info || !info_in_cpath(info,circ)))	return circ;
 			}
 		}
 	}
-	return best;
+	return NULL;
 }
 
 /** Return the number of hops in circuit's path. */
@@ -1043,12 +1313,16 @@ void
 circuit_mark_all_unused_circs(void)
 {
   circuit_t *circ;
-
-  for (circ=global_circuitlist; circ; circ = circ->next) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        !circ->marked_for_close &&
-        !circ->timestamp_dirty)
-      circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
+  int purpose;
+
+  for (purpose = _CIRCUIT_PURPOSE_OR_MAX+1;
+       purpose <= CIRCUIT_PURPOSE_UNKNOWN; ++purpose) {
+    for (circ = circuits_by_purpose[purpose]; circ;
+         circ = circ->next_by_purpose) {
+      if (!circ->marked_for_close &&
+          !circ->timestamp_dirty)
+        circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
+    }
   }
 }
 
@@ -1064,26 +1338,39 @@ circuit_expire_all_dirty_circs(void)
 {
   circuit_t *circ;
   or_options_t *options = get_options();
+  int purpose;
 
 #ifdef int3
         if(!get_options()->MaxCircuitDirtiness) return;
 #endif
 
-  for (circ=global_circuitlist; circ; circ = circ->next) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        !circ->marked_for_close &&
-        circ->timestamp_dirty)
-      circ->timestamp_dirty -= options->MaxCircuitDirtiness;
+  for (purpose = _CIRCUIT_PURPOSE_OR_MAX+1;
+       purpose <= CIRCUIT_PURPOSE_UNKNOWN; ++purpose) {
+    for (circ = circuits_by_purpose[purpose]; circ;
+         circ = circ->next_by_purpose) {
+      if (!circ->marked_for_close &&
+          circ->timestamp_dirty)
+        circ->timestamp_dirty -= options->MaxCircuitDirtiness;
+    }
   }
 }
 
 void circuit_expire_all_circuits(void)
 {	circuit_t *circ;
 	or_options_t *options = get_options();
-	for(circ=global_circuitlist;circ;circ = circ->next)
-	{	if(CIRCUIT_IS_ORIGIN(circ) && !circ->marked_for_close)
+	int warm = 0, purpose;
+	for(purpose = _CIRCUIT_PURPOSE_OR_MAX+1;purpose <= CIRCUIT_PURPOSE_UNKNOWN;purpose++)
+	for(circ=circuits_by_purpose[purpose];circ;circ = circ->next_by_purpose)
+	{	if(!circ->marked_for_close)
+		{	if(TO_ORIGIN_CIRCUIT(circ)->is_next_identity)	/* built for the identity that starts now */
+			{	TO_ORIGIN_CIRCUIT(circ)->is_next_identity = 0;
+				warm++;
+				continue;
+			}
 			circ->timestamp_dirty = get_time(NULL) - options->MaxCircuitDirtiness-1;
+		}
 	}
+	if(warm)	log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITLIST_NEXT_IDENTITY_READY),warm);
 }
 
 void circuit_expire_all_circs(DWORD exclKey)
@@ -1165,6 +1452,8 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
       origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
       circuit_build_failed(ocirc); /* take actions if necessary */
       circuit_rep_hist_note_result(ocirc);
+      if (etw_enabled(ETW_KW_CIRC_BUILD))
+        etw_circuit_phase(ocirc, ETW_CIRC_FAILED);
     }
   }
   if (circ->state == CIRCUIT_STATE_OR_WAIT) {
@@ -1192,6 +1481,7 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
   }
 
   tree_remove_streams(circ);
+  circuit_stream_index_free(circ);
   if (! CIRCUIT_IS_ORIGIN(circ)) {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     edge_connection_t *conn;
@@ -1429,13 +1719,8 @@ char *circuit_find_most_recent_exit(char *address)
 
 void circuit_tree_add_circs(void)
 {	circuit_t *circ;
-	char *nodeName=tor_malloc(1024);
-
 	for(circ=global_circuitlist;circ;circ = circ->next)
-	{	tor_snprintf(nodeName,1023,"[%s][%s] %s_%d - %s",CIRCUIT_IS_ORIGIN(circ)?TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal?"Internal":"Exit":"",(circ->magic==ORIGIN_CIRCUIT_MAGIC)?"Origin":(circ->magic==OR_CIRCUIT_MAGIC)?"OR":"Unknown",circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
-		tree_add_circ(circ,nodeName);
-	}
-	tor_free(nodeName);
+		tree_add_new_circ(circ);
 }
 
 circuit_t *get_circuit_by_hitem(HTREEITEM hItem)
@@ -1445,25 +1730,3 @@ circuit_t *get_circuit_by_hitem(HTREEITEM hItem)
 	}
 	return NULL;
 }
-
-char *circuit_dump(circuit_t *circ)
-{	char *s=tor_malloc_zero(8192);
-	char s2[30];
-	circid_t n_circ_id = circ->n_circ_id;
-	if(!circ->marked_for_close)
-	{	format_rfc1123_time(s2,(long)circ->timestamp_created.tv_sec);
-		if(!CIRCUIT_IS_ORIGIN(circ))
-		{	tor_snprintf(s,8192,get_lang_str(LANG_NETINFO_CIRCUIT_DUMP),n_circ_id,circuit_purpose_to_string(circ->purpose),circ->state,circuit_state_to_string(circ->state),s2);
-		}
-		else
-		{	char *s1 = circuit_list_path(TO_ORIGIN_CIRCUIT(circ),1);
-			tor_snprintf(s,8192,get_lang_str(LANG_NETINFO_CIRCUIT_DUMP_2),n_circ_id,circuit_purpose_to_string(circ->purpose),circ->state,circuit_state_to_string(circ->state),s2,s1);
-			tor_free(s1);
-		}
-	}
-	else
-	{	tor_free(s);
-		return NULL;
-	}
-	return s;
-}
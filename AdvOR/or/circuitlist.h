@@ -22,6 +22,8 @@ void circuit_set_p_circid_orconn(or_circuit_t *circ, circid_t id,
 void circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
                                  or_connection_t *conn);
 void circuit_set_state(circuit_t *circ, uint8_t state);
+circuit_t *circuit_get_first_by_purpose(uint8_t purpose);
+void circuit_change_purpose(circuit_t *circ, uint8_t purpose);
 void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
@@ -38,6 +40,7 @@ origin_circuit_t *circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
                                          const char *digest, uint8_t purpose);
 or_circuit_t *circuit_get_rendezvous(const char *cookie);
 or_circuit_t *circuit_get_intro_point(const char *digest);
+void circuit_note_cannibalizable(origin_circuit_t *circ);
 origin_circuit_t *circuit_find_to_cannibalize(uint8_t purpose,
                                               extend_info_t *info, int flags);
 void circuit_mark_all_unused_circs(void);
@@ -57,11 +60,14 @@ int circuit_count_pending_on_or_conn(or_connection_t *or_conn);
 
 void assert_cpath_layer_ok(const crypt_path_t *cp);
 void assert_circuit_ok(const circuit_t *c);
+int circuits_handle_oom(size_t bytes_to_free, size_t *freed_out);
 void circuit_free_all(void);
+crypt_path_t *crypt_path_new(void);
+void clean_circuit_pools(void);
+void free_circuit_pools(void);
 char *circuit_find_most_recent_exit(char *address);
 void circuit_tree_add_circs(void);
 circuit_t *get_circuit_by_hitem(HTREEITEM hItem);
-char *circuit_dump(circuit_t *circ);
 
 #endif
 
@@ -18,6 +18,7 @@
 #include "connection_edge.h"
 #include "control.h"
 #include "policies.h"
+#include "relay.h"
 #include "rendclient.h"
 #include "rendcommon.h"
 #include "rendservice.h"
@@ -25,19 +26,73 @@
 #include "router.h"
 #include "routerlist.h"
 #include "main.h"
+#include "perf.h"
 
 /********* START VARIABLES **********/
 
 extern circuit_t *global_circuitlist; /* from circuitlist.c */
 
+/** Recent stream demand from one isolation key, used to keep clean circuits
+ * ready that only streams with this key can use. */
+typedef struct isolation_demand_t
+{	DWORD exclKey;		/**< The isolation key of the streams. */
+	unsigned int need_uptime:1;	/**< Were the streams for LongLivedPorts? */
+	time_t last_used;	/**< When did we last see a stream with this key? */
+	time_t window_start;	/**< When did the current counting window start? */
+	int window_streams;	/**< Streams seen in the current window. */
+	int last_window_streams;	/**< Streams seen in the previous window. */
+} isolation_demand_t;
+
+/** Isolation keys that asked for circuits recently, most recently used first. */
+static smartlist_t *isolation_demand = NULL;
+
 /********* END VARIABLES ************/
 
 static void circuit_expire_old_circuits_clientside(void);
 static void circuit_increment_failure_count(void);
+static void circuit_note_isolation_demand(edge_connection_t *conn);
+static int circuit_refill_isolation_pool(time_t now,int num);
 
 /* XXX022 make this 15 be a function of circuit finishing times we've seen lately, a la Fallon Chen's GSoC work -RD */
 #define REND_PARALLEL_INTRO_DELAY 15
 
+/** How long do we keep using a pooled directory tunnel after its first
+ * stream?  Long enough to carry the hourly directory refresh. */
+#define DIR_TUNNEL_POOL_DIRTINESS (3*60*60)
+
+/** Return true iff <b>circ</b> is a one-hop directory tunnel to one of our
+ * entry guards or bridges, or to a directory authority or fallback
+ * directory.  There are few of those, so we keep their tunnels for
+ * DIR_TUNNEL_POOL_DIRTINESS instead of MaxCircuitDirtiness, and send our
+ * directory fetches through them again instead of building new ones.
+ * One-hop tunnels are not anonymous, so reusing them for longer doesn't
+ * link anything that they don't link already. */
+int
+circuit_is_pooled_dir_tunnel(circuit_t *circ)
+{
+  cpath_build_state_t *build_state;
+  const char *digest;
+  if (!CIRCUIT_IS_ORIGIN(circ) || circ->purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return 0;
+  build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
+  if (!build_state || !build_state->onehop_tunnel || !build_state->chosen_exit)
+    return 0;
+  digest = build_state->chosen_exit->identity_digest;
+  return is_an_entry_guard(digest) ||
+    router_get_trusteddirserver_by_digest(digest);
+}
+
+/** Return how long <b>circ</b> may be used after it became dirty. */
+static int
+circuit_max_dirtiness(circuit_t *circ)
+{
+  int max_dirtiness = get_options()->MaxCircuitDirtiness;
+  if (max_dirtiness && max_dirtiness < DIR_TUNNEL_POOL_DIRTINESS &&
+      circuit_is_pooled_dir_tunnel(circ))
+    return DIR_TUNNEL_POOL_DIRTINESS;
+  return max_dirtiness;
+}
+
 /** Find the best circ that conn can use, preferably one which is
  * dirty. Circ must not be too old.
  *
@@ -60,13 +115,27 @@ static origin_circuit_t *circuit_get_best(edge_connection_t *conn, int must_be_o
 	int intro_going_on_but_too_old = 0;
 	routerinfo_t *exitrouter;
 	cpath_build_state_t *build_state;
+	uint8_t purposes[4];
+	int n_purposes = 1, i;
 	tor_assert(conn);
 	tor_assert(purpose == CIRCUIT_PURPOSE_C_GENERAL || purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT || purpose == CIRCUIT_PURPOSE_C_REND_JOINED);
 	tor_assert(conn->socks_request);
 	int max_dirtiness = get_options()->MaxCircuitDirtiness;
 	tor_gettimeofday(&now);
 
-	for(circ=global_circuitlist;circ;circ = circ->next)
+	/* only walk the lists of the purposes that can match */
+	purposes[0] = purpose;
+	if(purpose == CIRCUIT_PURPOSE_C_REND_JOINED && !must_be_open)
+	{	purposes[0] = CIRCUIT_PURPOSE_C_ESTABLISH_REND;
+		purposes[1] = CIRCUIT_PURPOSE_C_REND_READY;
+		purposes[2] = CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED;
+		purposes[3] = CIRCUIT_PURPOSE_C_REND_JOINED;
+		n_purposes = 4;
+	}
+	else if(purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT && !must_be_open)
+		purposes[0] = CIRCUIT_PURPOSE_C_INTRODUCING;
+	for(i = 0;i < n_purposes;i++)
+	for(circ=circuit_get_first_by_purpose(purposes[i]);circ;circ = circ->next_by_purpose)
 	{	tor_assert(circ);
 		if(!CIRCUIT_IS_ORIGIN(circ))
 			continue; /* this circ doesn't start at us */
@@ -86,8 +155,10 @@ static origin_circuit_t *circuit_get_best(edge_connection_t *conn, int must_be_o
 		else if(purpose != circ->purpose)
 			continue;
 		else if(circ->exclKey && circ->exclKey!=conn->_base.exclKey) continue;
+		if(TO_ORIGIN_CIRCUIT(circ)->is_next_identity)
+			continue;	/* saved for the next identity */
 		if(max_dirtiness && (purpose == CIRCUIT_PURPOSE_C_GENERAL || purpose == CIRCUIT_PURPOSE_C_REND_JOINED))
-			if(circ->timestamp_dirty && circ->timestamp_dirty+max_dirtiness <= now.tv_sec)
+			if(circ->timestamp_dirty && circ->timestamp_dirty+circuit_max_dirtiness(circ) <= now.tv_sec)
 				continue;
 		/* decide if this circ is suitable for this conn */
 
@@ -180,13 +251,15 @@ static origin_circuit_t *circuit_get_best(edge_connection_t *conn, int must_be_o
 void circuit_expire_building(void)
 {
 	if(!get_options()->CircuitBuildTimeout)	return;
-	circuit_t *victim, *next_circ = global_circuitlist;
+	circuit_t *victim, *next_circ;
+	int purpose;
 	struct timeval general_cutoff,begindir_cutoff,fourhop_cutoff,cannibalize_cutoff,close_cutoff,extremely_old_cutoff;
 	struct timeval now;
 ///	time_t general_cutoff = now - get_options()->CircuitBuildTimeout;
 ///	time_t begindir_cutoff = now - get_options()->CircuitBuildTimeout/2;
 ///	time_t introcirc_cutoff = begindir_cutoff;
 	cpath_build_state_t *build_state;
+	int i;
 
 	tor_gettimeofday(&now);
 #define SET_CUTOFF(target, msec) do {                       \
@@ -205,11 +278,18 @@ void circuit_expire_building(void)
 	SET_CUTOFF(cannibalize_cutoff, circ_times.timeout_ms / 2.0);
 	SET_CUTOFF(close_cutoff, circ_times.close_ms);
 	SET_CUTOFF(extremely_old_cutoff, circ_times.close_ms*2 + 1000);
-	while(next_circ)
+	/* Walk MEASURE_TIMEOUT first, then the other origin purposes from the highest down: the circuits that we switch to MEASURE_TIMEOUT below
+	 * move to a list that we've already walked, so they are not visited again in this pass. */
+	for(i = CIRCUIT_PURPOSE_UNKNOWN + 1;i > _CIRCUIT_PURPOSE_OR_MAX;i--)
+	for(purpose = (i > CIRCUIT_PURPOSE_UNKNOWN) ? CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT : i,next_circ = (i == CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT) ? NULL : circuit_get_first_by_purpose(purpose);next_circ;)
 	{	struct timeval cutoff;
 		victim = next_circ;
-		next_circ = next_circ->next;
-		if(!CIRCUIT_IS_ORIGIN(victim) || victim->marked_for_close) /* don't mess with marked circs */
+		if(victim->purpose != purpose)	/* repurposed while we were handling the one before it; start this list over */
+		{	next_circ = circuit_get_first_by_purpose(purpose);
+			continue;
+		}
+		next_circ = victim->next_by_purpose;
+		if(victim->marked_for_close) /* don't mess with marked circs */
 			continue;
 		build_state = TO_ORIGIN_CIRCUIT(victim)->build_state;
 		if(build_state && build_state->onehop_tunnel)
@@ -222,6 +302,12 @@ void circuit_expire_building(void)
 			cutoff = close_cutoff;
 		else
 			cutoff = general_cutoff;
+		if(build_state && build_state->first_hop_is_guard && !TO_ORIGIN_CIRCUIT(victim)->has_opened && !build_state->onehop_tunnel && victim->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT && TO_ORIGIN_CIRCUIT(victim)->cpath)
+		{	/* entry guards that have enough build times of their own get their own timeout */
+			double guard_ms = circuit_build_times_timeout_for_guard(TO_ORIGIN_CIRCUIT(victim)->cpath->extend_info->identity_digest);
+			if(build_state->desired_path_len == 4)	guard_ms *= 4/3.0;
+			SET_CUTOFF(cutoff, guard_ms);
+		}
 		if(timercmp(&victim->timestamp_created, &cutoff, >))
 			continue;	/* it's still young, leave it alone */
 		/* if circ is !open, or if it's open but purpose is a non-finished intro or rend, then mark it for close */
@@ -258,7 +344,7 @@ void circuit_expire_building(void)
 			{	/* Circuits are allowed to last longer for measurement. Switch their purpose and wait. */
 				if(victim->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT)
 				{	control_event_circuit_status(TO_ORIGIN_CIRCUIT(victim),CIRC_EVENT_FAILED,END_CIRC_REASON_TIMEOUT);
-					victim->purpose = CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT;
+					circuit_change_purpose(victim, CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT);
 					/* Record this failure to check for too many timeouts in a row. This function does not record a time value yet (we do that later); it only counts the fact that we did have a timeout. */
 					circuit_build_times_count_timeout(&circ_times,first_hop_succeeded);
 					continue;
@@ -303,8 +389,8 @@ int circuit_stream_is_being_handled(edge_connection_t *conn,uint16_t port, int m
 	int num=0;
 	time_t now = get_time(NULL);
 	int need_uptime = smartlist_string_num_isin(get_options()->LongLivedPorts,conn ? conn->socks_request->port : port);
-	for(circ=global_circuitlist;circ;circ = circ->next)
-	{	if(CIRCUIT_IS_ORIGIN(circ) && !circ->marked_for_close && circ->purpose == CIRCUIT_PURPOSE_C_GENERAL && (!circ->timestamp_dirty || ((get_options()->MaxCircuitDirtiness)&&(circ->timestamp_dirty + get_options()->MaxCircuitDirtiness > now))))
+	for(circ=circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);circ;circ = circ->next_by_purpose)
+	{	if(!circ->marked_for_close && !TO_ORIGIN_CIRCUIT(circ)->is_next_identity && (!circ->timestamp_dirty || ((get_options()->MaxCircuitDirtiness)&&(circ->timestamp_dirty + get_options()->MaxCircuitDirtiness > now))))
 		{	cpath_build_state_t *build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
 			if(build_state->is_internal || build_state->onehop_tunnel)
 				continue;
@@ -314,7 +400,7 @@ int circuit_stream_is_being_handled(edge_connection_t *conn,uint16_t port, int m
 				if(conn)
 					ok = connection_ap_can_use_exit(conn, exitrouter);
 				else
-				{	addr_policy_result_t r = compare_addr_to_addr_policy(0, port, exitrouter->exit_policy);
+				{	addr_policy_result_t r = router_compare_addr_to_exit_policy(0, port, exitrouter);
 					ok = r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
 				}
 				if(ok)
@@ -328,6 +414,161 @@ int circuit_stream_is_being_handled(edge_connection_t *conn,uint16_t port, int m
 }
 
 
+/** How long is one window for counting the streams of an isolation key? */
+#define ISOLATION_DEMAND_WINDOW 60
+/** Forget isolation keys that haven't had a stream for this long. */
+#define ISOLATION_DEMAND_RELEVANCE_TIME (30*60)
+/** How many isolation keys do we keep preemptive circuits for? */
+#define MAX_ISOLATION_DEMAND_KEYS 8
+/** Ask for one more clean circuit per this many streams in a window. */
+#define ISOLATION_STREAMS_PER_CIRCUIT 5
+
+/** Count <b>conn</b> as a new stream for its isolation key. Streams that any circuit can take, or that need a special circuit, are skipped. */
+static void circuit_note_isolation_demand(edge_connection_t *conn)
+{	isolation_demand_t *d = NULL;
+	time_t now = get_time(NULL);
+	int need_uptime, i;
+	if(conn->isolation_demand_noted)	return;
+	conn->isolation_demand_noted = 1;
+	if(!get_options()->IsolatedPreemptiveCircuits || !conn->_base.exclKey || conn->_base.exclKey == EXCLUSIVITY_DIRCONN || conn->_base.exclKey == EXCLUSIVITY_INTERNAL)
+		return;
+	if(conn->want_onehop || conn->use_begindir || conn->chosen_exit_name || conn->is_dns_prefetch)
+		return;
+	need_uptime = smartlist_string_num_isin(get_options()->LongLivedPorts,conn->socks_request->port);
+	if(!isolation_demand)	isolation_demand = smartlist_create();
+	for(i = 0; i < smartlist_len(isolation_demand); i++)
+	{	d = smartlist_get(isolation_demand, i);
+		if(d->exclKey == conn->_base.exclKey && d->need_uptime == need_uptime)
+		{	smartlist_del_keeporder(isolation_demand, i);
+			break;
+		}
+		d = NULL;
+	}
+	if(!d)
+	{	if(smartlist_len(isolation_demand) >= MAX_ISOLATION_DEMAND_KEYS)	/* drop the least recently used key */
+		{	d = smartlist_pop_last(isolation_demand);
+			tor_free(d);
+		}
+		d = tor_malloc_zero(sizeof(isolation_demand_t));
+		d->exclKey = conn->_base.exclKey;
+		d->need_uptime = need_uptime;
+		d->window_start = now;
+	}
+	smartlist_insert(isolation_demand, 0, d);
+	if(now - d->window_start >= ISOLATION_DEMAND_WINDOW)
+	{	d->last_window_streams = (now - d->window_start < 2*ISOLATION_DEMAND_WINDOW) ? d->window_streams : 0;
+		d->window_streams = 0;
+		d->window_start = now;
+	}
+	d->window_streams++;
+	d->last_used = now;
+}
+
+/** Launch a clean circuit for the isolation key that is most short of them, given its recent stream rate. <b>num</b> is how many clean circuits we have in all. Return 1 if we launched one. */
+static int circuit_refill_isolation_pool(time_t now,int num)
+{	or_options_t *options = get_options();
+	circuit_t *circ;
+	cpath_build_state_t *build_state;
+	isolation_demand_t *best = NULL, *stale;
+	int best_missing = 0, have, want;
+	if(!isolation_demand || !options->IsolatedPreemptiveCircuits)
+		return 0;
+	/* the list is kept in LRU order, so stale keys are at its end */
+	while(smartlist_len(isolation_demand))
+	{	stale = smartlist_get(isolation_demand, smartlist_len(isolation_demand)-1);
+		if(stale->last_used + ISOLATION_DEMAND_RELEVANCE_TIME >= now)
+			break;
+		smartlist_pop_last(isolation_demand);
+		tor_free(stale);
+	}
+	SMARTLIST_FOREACH_BEGIN(isolation_demand, isolation_demand_t *, d)
+	{	want = 1 + MAX(d->window_streams, d->last_window_streams) / ISOLATION_STREAMS_PER_CIRCUIT;
+		if(want > options->IsolatedPreemptiveCircuits)
+			want = options->IsolatedPreemptiveCircuits;
+		have = 0;
+		for(circ=circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);circ;circ = circ->next_by_purpose)
+		{	if(circ->marked_for_close || circ->timestamp_dirty || circ->exclKey != d->exclKey)
+				continue;
+			build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
+			if(build_state->onehop_tunnel || build_state->is_internal || (d->need_uptime && !build_state->need_uptime))
+				continue;
+			have++;
+		}
+		if(want - have > best_missing)
+		{	best_missing = want - have;
+			best = d;
+		}
+	}
+	SMARTLIST_FOREACH_END(d);
+	if(!best)	return 0;
+	log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_NEED_ISOLATED_CIRC),(unsigned long)best->exclKey,best_missing,num);
+	circuit_launch_by_extend_info(CIRCUIT_PURPOSE_C_GENERAL,NULL,CIRCLAUNCH_NEED_CAPACITY | (best->need_uptime ? CIRCLAUNCH_NEED_UPTIME : 0),best->exclKey);
+	return 1;
+}
+
+/** Release the isolation demand we've been tracking. */
+void circuit_isolation_demand_free_all(void)
+{	if(isolation_demand)
+	{	SMARTLIST_FOREACH(isolation_demand, isolation_demand_t *, d, tor_free(d));
+		smartlist_free(isolation_demand);
+		isolation_demand = NULL;
+	}
+}
+
+/** Return true iff circuits that we build now may be kept for the next identity: changing identity must expire old circuits rather than destroy them together with their OR connections, must not pick its exit from the exit list, and no exit may be pinned for the current identity. */
+static int circuit_can_warm_next_identity(or_options_t *options)
+{	if(!(options->IdentityFlags&(IDENTITY_FLAG_EXPIRE_CIRCUITS|IDENTITY_FLAG_AUTO_CHANGE_IP)))
+		return 0;
+	if(options->IdentityFlags&(IDENTITY_FLAG_DESTROY_CIRCUITS|IDENTITY_FLAG_LIST_SELECTION))
+		return 0;
+	return !get_router_sel();
+}
+
+/** Never keep more than this many clean internal circuits for the rendezvous and introduction circuits of our hidden service streams. */
+#define MAX_REND_CIRCUIT_POOL 8
+
+/** Return how many clean internal circuits should be waiting for our hidden service streams: as many rendezvous and introduction circuits as we took in the busiest minute of the last hour, but at least what one connection needs. */
+static int circuit_rend_pool_target(time_t now)
+{	or_options_t *options = get_options();
+	int want = rep_hist_get_predicted_rend_circs(now);
+	int least = options->RendParallelIntro ? 3 : 2;	/* the rendezvous circuit and one or two intro circuits */
+	if(want < least)	want = least;
+	if(want > MAX_REND_CIRCUIT_POOL)	want = MAX_REND_CIRCUIT_POOL;
+	if(options->MaxUnusedOpenCircuits && want > options->MaxUnusedOpenCircuits)
+		want = options->MaxUnusedOpenCircuits;
+	return want;
+}
+
+/** Return how many clean internal circuits we have open or on the way. */
+static int circuit_count_rend_pool(void)
+{	circuit_t *circ;
+	cpath_build_state_t *build_state;
+	int n = 0;
+	for(circ=circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);circ;circ = circ->next_by_purpose)
+	{	if(circ->marked_for_close || circ->timestamp_dirty)
+			continue;
+		build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
+		if(build_state->onehop_tunnel || !build_state->is_internal || TO_ORIGIN_CIRCUIT(circ)->is_next_identity)
+			continue;
+		n++;
+	}
+	return n;
+}
+
+/** A stream asked for a hidden service at <b>now</b>. Top up the pool of clean internal circuits right away, so that the rendezvous and introduction circuits can be cannibalized from it as soon as the descriptor is there. */
+void circuit_fill_rend_pool(time_t now)
+{	int missing;
+	if(!get_options()->MaxUnusedOpenCircuits)
+		return;
+	missing = circuit_rend_pool_target(now) - circuit_count_rend_pool();
+	if(missing > 0)
+		log_info(LD_CIRC|LD_REND,get_lang_str(LANG_LOG_CIRCUITUSE_FILLING_REND_POOL),missing);
+	while(missing-- > 0)
+	{	if(!circuit_launch_by_router(CIRCUIT_PURPOSE_C_GENERAL, NULL, CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_INTERNAL))
+			break;
+	}
+}
+
 /** Build a new test circuit every 5 minutes */
 #define TESTING_CIRCUIT_INTERVAL 300
 
@@ -352,26 +593,26 @@ void circuit_build_needed_circs(time_t now)
 	if(options->MaxUnusedOpenCircuits)
 	{	/** Figure out how many circuits we have open that are clean. Make sure it's enough for all the upcoming behaviors we predict we'll have. But if we have too many, close the not-so-useful ones. */
 		circuit_t *circ;
-		int num=0, num_internal=0, num_uptime_internal=0;
+		int num=0, num_internal=0, num_uptime_internal=0, num_next_identity=0;
 		int hidserv_needs_uptime=0, hidserv_needs_capacity=1;
 		int port_needs_uptime=0, port_needs_capacity=1;
 		now = get_time(NULL);
 		int flags = 0;
 
 		/* First, count how many of each type of circuit we have already. */
-		for(circ=global_circuitlist;circ;circ = circ->next)
+		for(circ=circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);circ;circ = circ->next_by_purpose)
 		{	cpath_build_state_t *build_state;
-			if(!CIRCUIT_IS_ORIGIN(circ))
-				continue;
 			if(circ->marked_for_close)
 				continue;	/* don't mess with marked circs */
 			if(circ->timestamp_dirty)
 				continue;	/* only count clean circs */
-			if(circ->purpose != CIRCUIT_PURPOSE_C_GENERAL)
-				continue;	/* only pay attention to general-purpose circs */
 			build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
 			if(build_state->onehop_tunnel)
 				continue;
+			if(TO_ORIGIN_CIRCUIT(circ)->is_next_identity)
+			{	num_next_identity++;	/* not usable before the identity changes */
+				continue;
+			}
 			num++;
 			if(build_state->is_internal)
 				num_internal++;
@@ -389,7 +630,7 @@ void circuit_build_needed_circs(time_t now)
 				log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_NEED_ANOTHER_EXIT),num, num_internal);
 				circuit_launch_by_router(CIRCUIT_PURPOSE_C_GENERAL, NULL, flags);
 			}
-			else
+			else if(!circuit_refill_isolation_pool(now,num))
 			{	/* Third, see if we need any more hidden service (server) circuits. */
 				if(num_rend_services() && num_uptime_internal < 3)
 				{	flags = (CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_NEED_UPTIME | CIRCLAUNCH_IS_INTERNAL);
@@ -398,7 +639,7 @@ void circuit_build_needed_circs(time_t now)
 				}
 				else
 				{	/* Fourth, see if we need any more hidden service (client) circuits. */
-					if(rep_hist_get_predicted_internal(now, &hidserv_needs_uptime,&hidserv_needs_capacity) && ((num_uptime_internal<2 && hidserv_needs_uptime) || num_internal<2))
+					if(rep_hist_get_predicted_internal(now, &hidserv_needs_uptime,&hidserv_needs_capacity) && ((num_uptime_internal<2 && hidserv_needs_uptime) || num_internal<circuit_rend_pool_target(now)))
 					{	if(hidserv_needs_uptime)
 							flags |= CIRCLAUNCH_NEED_UPTIME;
 						if(hidserv_needs_capacity)
@@ -412,6 +653,12 @@ void circuit_build_needed_circs(time_t now)
 						log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_BUILDING_NEW_TEST_CIRC), num);
 						circuit_launch_by_router(CIRCUIT_PURPOSE_C_GENERAL, NULL, flags);
 					}
+					else if(num_next_identity < options->WarmNextIdentity && circuit_can_warm_next_identity(options))	/* Last, build ahead the exit circuits the next identity will start with. */
+					{	origin_circuit_t *warm;
+						log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_WARM_NEXT_IDENTITY),num_next_identity,options->WarmNextIdentity);
+						warm = circuit_launch_by_router(CIRCUIT_PURPOSE_C_GENERAL, NULL, CIRCLAUNCH_NEED_CAPACITY);
+						if(warm)	warm->is_next_identity = 1;
+					}
 				}
 			}
 		}
@@ -426,6 +673,7 @@ void circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
 	tor_assert(conn);
 
 	tree_remove_stream(conn);
+	circuit_stream_index_remove(circ, conn);
 	conn->cpath_layer = NULL;	/* make sure we don't keep a stale pointer */
 	conn->on_circuit = NULL;
 
@@ -481,6 +729,7 @@ circuit_expire_old_circuits_clientside(void)
 #endif
   circuit_t *circ;
   struct timeval cutoff, now;
+  int purpose;
 
   tor_gettimeofday(&now);
   cutoff = now;
@@ -493,8 +742,11 @@ circuit_expire_old_circuits_clientside(void)
     cutoff.tv_sec -= get_options()->CircuitIdleTimeout;
   }
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (circ->marked_for_close || ! CIRCUIT_IS_ORIGIN(circ))
+  for (purpose = _CIRCUIT_PURPOSE_OR_MAX+1;
+       purpose <= CIRCUIT_PURPOSE_UNKNOWN; ++purpose)
+  for (circ = circuit_get_first_by_purpose(purpose); circ;
+       circ = circ->next_by_purpose) {
+    if (circ->marked_for_close)
       continue;
     /* If the circuit has been dirty for too long, and there are no streams
      * on it, mark it for close.
@@ -503,7 +755,7 @@ circuit_expire_old_circuits_clientside(void)
 #ifdef int3
 	get_options()->MaxCircuitDirtiness &&
 #endif
-        circ->timestamp_dirty + get_options()->MaxCircuitDirtiness < now.tv_sec &&
+        circ->timestamp_dirty + circuit_max_dirtiness(circ) < now.tv_sec &&
         !TO_ORIGIN_CIRCUIT(circ)->p_streams /* nothing attached */ ) {
       log_debug(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_CLOSING_N_CIRC_ID),circ->n_circ_id, (long)(now.tv_sec - circ->timestamp_dirty),circ->purpose);
       circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
@@ -563,9 +815,9 @@ circuit_enough_testing_circs(void)
   if (have_performed_bandwidth_test)
     return 1;
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (!circ->marked_for_close && CIRCUIT_IS_ORIGIN(circ) &&
-        circ->purpose == CIRCUIT_PURPOSE_TESTING &&
+  for (circ = circuit_get_first_by_purpose(CIRCUIT_PURPOSE_TESTING); circ;
+       circ = circ->next_by_purpose) {
+    if (!circ->marked_for_close &&
         circ->state == CIRCUIT_STATE_OPEN)
       num++;
   }
@@ -697,6 +949,7 @@ circuit_build_failed(origin_circuit_t *circ)
       }
       log_info(LD_OR,get_lang_str(LANG_LOG_CIRCUITUSE_FIRST_HOP_TIMEOUT),n_conn->_base.address, n_conn->_base.port);
       n_conn->is_bad_for_new_circs = 1;
+      connection_housekeeping_reschedule(TO_CONN(n_conn));
     } else {
       log_info(LD_OR,get_lang_str(LANG_LOG_CIRCUITUSE_CIRCUIT_DIED));
     }
@@ -805,6 +1058,11 @@ circuit_launch_by_extend_info(uint8_t purpose,
     return NULL;
   }
 
+  /* size the pool of internal circuits from what our streams take */
+  if (purpose == CIRCUIT_PURPOSE_C_ESTABLISH_REND ||
+      purpose == CIRCUIT_PURPOSE_C_INTRODUCING)
+    rep_hist_note_rend_circ_taken(get_time(NULL));
+
 //  if ((extend_info || purpose != CIRCUIT_PURPOSE_C_GENERAL) &&
   if ((purpose != CIRCUIT_PURPOSE_C_GENERAL) &&
       purpose != CIRCUIT_PURPOSE_TESTING && !onehop_tunnel) {
@@ -814,7 +1072,7 @@ circuit_launch_by_extend_info(uint8_t purpose,
     circ = circuit_find_to_cannibalize(purpose, extend_info, flags);
     if (circ) {
       log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_CANNIBALIZE_CIRCUIT),build_state_get_exit_nickname(circ->build_state), purpose);
-      circ->_base.purpose = purpose;
+      circuit_change_purpose(TO_CIRCUIT(circ), purpose);
       tree_set_circ(TO_CIRCUIT(circ));
       /* reset the birth date of this circ, else expire_building
        * will see it and think it's been trying to build since it
@@ -1033,6 +1291,13 @@ static int circuit_get_open_circ_or_launch(edge_connection_t *conn,uint8_t desir
 		else
 		{	conn->_base.timestamp_lastcircuit = get_time(NULL);
 			circ = circuit_launch_by_extend_info(new_circ_purpose, extend_info,flags,conn->_base.exclKey);
+			if(circ && options->RaceCircuitBuilds && !extend_info && !want_onehop && !need_internal && new_circ_purpose == CIRCUIT_PURPOSE_C_GENERAL && !(options->IdentityFlags&IDENTITY_FLAG_LIST_SELECTION))
+			{	/* Race a second circuit through other relays. The stream attaches to whichever opens first; the other one stays around as a clean circuit for later streams. */
+				circuit_build_avoid_routers_of(circ);
+				if(circuit_launch_by_extend_info(new_circ_purpose, NULL, flags, conn->_base.exclKey))
+					log_info(LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_RACING_CIRCUIT),circ->global_identifier);
+				circuit_build_avoid_routers_of(NULL);
+			}
 		}
 
 		if(extend_info)	extend_info_free(extend_info);
@@ -1050,6 +1315,18 @@ static int circuit_get_open_circ_or_launch(edge_connection_t *conn,uint8_t desir
 			{	circ->rend_data = rend_data_dup(conn->rend_data);
 				if(circ->_base.purpose == CIRCUIT_PURPOSE_C_ESTABLISH_REND && circ->_base.state == CIRCUIT_STATE_OPEN)
 					rend_client_rendcirc_has_opened(circ);
+				else if(circ->_base.purpose == CIRCUIT_PURPOSE_C_INTRODUCING && options->RendParallelIntro)
+				{	/* Introduce ourselves through a second intro point too; the first ACK wins. */
+					extend_info = rend_client_get_parallel_intro(conn->rend_data,circ->build_state->chosen_exit->identity_digest);
+					if(extend_info)
+					{	origin_circuit_t *circ2 = circuit_launch_by_extend_info(CIRCUIT_PURPOSE_C_INTRODUCING,extend_info,flags,conn->_base.exclKey);
+						if(circ2)
+						{	circ2->rend_data = rend_data_dup(conn->rend_data);
+							log_info(LD_REND,get_lang_str(LANG_LOG_CIRCUITUSE_PARALLEL_INTRO),circ2->global_identifier,extend_info->nickname,safe_str(conn->rend_data->onion_address));
+						}
+						extend_info_free(extend_info);
+					}
+				}
 			}
 		}
 	}
@@ -1083,7 +1360,7 @@ link_apconn_to_circ(edge_connection_t *apconn, origin_circuit_t *circ,
   /* add it into the linked list of streams on this circuit */
   log_debug(LD_APP|LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_ATTACHING_NEW_CONN),circ->_base.n_circ_id);
   /* reset it, so we can measure circ timeouts */
-  add_all_streams(circ->_base.hItem,apconn);
+  tree_add_streams(TO_CIRCUIT(circ));
   if(apconn->_base.exclKey)	circ->_base.exclKey=apconn->_base.exclKey;
   apconn->_base.timestamp_lastread = get_time(NULL);
   apconn->next_stream = circ->p_streams;
@@ -1100,6 +1377,7 @@ link_apconn_to_circ(edge_connection_t *apconn, origin_circuit_t *circ,
     tor_assert(circ->cpath->prev->state == CPATH_STATE_OPEN);
     apconn->cpath_layer = circ->cpath->prev;
   }
+  stream_trace_stamp(apconn, STREAM_TRACE_CIRC_CHOSEN);
 }
 
 /** Return true iff <b>address</b> is matched by one of the entries in
@@ -1204,7 +1482,7 @@ connection_ap_handshake_attach_chosen_circuit(edge_connection_t *conn,
  */
 /* XXXX this function should mark for close whenever it returns -1;
  * its callers shouldn't have to worry about that. */
-int connection_ap_handshake_attach_circuit(edge_connection_t *conn)
+static int _connection_ap_handshake_attach_circuit(edge_connection_t *conn)
 {	int retval;
 	int conn_age;
 	int want_onehop;
@@ -1246,6 +1524,10 @@ int connection_ap_handshake_attach_circuit(edge_connection_t *conn)
 				return -1;
 			}
 		}
+		/* if the same name is being resolved already, wait for that answer */
+		if(SOCKS_COMMAND_IS_RESOLVE(conn->socks_request->command) && connection_ap_join_pending_resolve(conn))
+			return 1;
+		circuit_note_isolation_demand(conn);
 		/* find the circuit that we should use, if there is one. */
 		retval = circuit_get_open_circ_or_launch(conn,CIRCUIT_PURPOSE_C_GENERAL, &circ);
 		if(retval < 1)	// XXX021 if we totally fail, this still returns 0 -RD
@@ -1286,13 +1568,22 @@ int connection_ap_handshake_attach_circuit(edge_connection_t *conn)
 		{	circuit_t *c = NULL;
 			tor_assert(introcirc);
 			log_info(LD_REND,get_lang_str(LANG_LOG_CIRCUITUSE_INTRO_CIRC_PRESENT_AWAITING_ACK),introcirc->_base.n_circ_id,rendcirc ? rendcirc->_base.n_circ_id : 0,conn_age);
-			/* abort parallel intro circs, if any */
-			for(c = global_circuitlist; c; c = c->next)
-			{	if(c->purpose == CIRCUIT_PURPOSE_C_INTRODUCING && !c->marked_for_close && CIRCUIT_IS_ORIGIN(c))
+			/* abort parallel intro circs, if any, or send the introduction through them too */
+			for(c = circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_INTRODUCING); c; c = c->next_by_purpose)
+			{	if(!c->marked_for_close)
 				{	origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(c);
 					if(oc->rend_data && !rend_cmp_service_ids(conn->rend_data->onion_address,oc->rend_data->onion_address))
-					{	log_info(LD_REND|LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_CLOSING_INTRO_CIRCUIT_BUILT_IN_PARALLEL));
-						circuit_mark_for_close(c, END_CIRC_REASON_TIMEOUT);
+					{	if(!get_options()->RendParallelIntro)
+						{	log_info(LD_REND|LD_CIRC,get_lang_str(LANG_LOG_CIRCUITUSE_CLOSING_INTRO_CIRCUIT_BUILT_IN_PARALLEL));
+							circuit_mark_for_close(c, END_CIRC_REASON_TIMEOUT);
+						}
+						else if(c->state == CIRCUIT_STATE_OPEN && rendcirc && rendcirc->_base.purpose == CIRCUIT_PURPOSE_C_REND_READY)
+						{	log_info(LD_REND,get_lang_str(LANG_LOG_CIRCUITUSE_PARALLEL_INTRODUCTION),c->n_circ_id,rendcirc->_base.n_circ_id);
+							/* this changes the purpose of c, so stop here; the next attach attempt looks again */
+							if(rend_client_send_introduction(oc, rendcirc) == -2)
+								return -1;
+							break;
+						}
 					}
 				}
 			}
@@ -1325,3 +1616,11 @@ int connection_ap_handshake_attach_circuit(edge_connection_t *conn)
 	}
 }
 
+/** Try to attach the AP stream <b>conn</b> as _connection_ap_handshake_attach_circuit() does, and remember it as waiting for a circuit if it has to wait. Return as _connection_ap_handshake_attach_circuit(). */
+int connection_ap_handshake_attach_circuit(edge_connection_t *conn)
+{	int retval = _connection_ap_handshake_attach_circuit(conn);
+	if(!retval && !conn->_base.marked_for_close && conn->_base.state == AP_CONN_STATE_CIRCUIT_WAIT)
+		connection_ap_mark_as_pending_circuit(conn);
+	return retval;
+}
+
@@ -13,6 +13,7 @@
 #define _TOR_CIRCUITUSE_H
 
 void circuit_expire_building(void);
+int circuit_is_pooled_dir_tunnel(circuit_t *circ);
 void circuit_remove_handled_ports(smartlist_t *needed_ports);
 int circuit_stream_is_being_handled(edge_connection_t *conn, uint16_t port,
                                     int min);
@@ -52,6 +53,8 @@ int connection_ap_handshake_attach_chosen_circuit(edge_connection_t *conn,
 int connection_ap_handshake_attach_circuit(edge_connection_t *conn);
 
 int hostname_in_track_host_exits(or_options_t *options, const char *address);
+void circuit_isolation_demand_free_all(void);
+void circuit_fill_rend_pool(time_t now);
 
 #endif
 
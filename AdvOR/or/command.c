@@ -13,6 +13,8 @@
  *
  * - command_process_cell(), called from
  *   connection_or_process_cells_from_inbuf() in connection_or.c
+ * - command_process_precrypted_cell(), called from
+ *   connection_or_process_cell_batch() in connection_or.c
  */
 
 #include "or.h"
@@ -50,6 +52,8 @@ uint64_t stats_n_netinfo_cells_processed = 0;
 static void command_process_create_cell(cell_t *cell, or_connection_t *conn);
 static void command_process_created_cell(cell_t *cell, or_connection_t *conn);
 static void command_process_relay_cell(cell_t *cell, or_connection_t *conn);
+static void command_handle_relay_cell(cell_t *cell, or_connection_t *conn,
+                                      const relay_precrypt_t *precrypt);
 static void command_process_destroy_cell(cell_t *cell, or_connection_t *conn);
 static void command_process_versions_cell(var_cell_t *cell,
                                           or_connection_t *conn);
@@ -267,7 +271,7 @@ command_process_create_cell(cell_t *cell, or_connection_t *conn)
   }
 
   circ = or_circuit_new(cell->circ_id, conn);
-  circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+  circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_OR);
   tree_set_circ(TO_CIRCUIT(circ));
   circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_ONIONSKIN_PENDING);
   if (cell->command == CELL_CREATE) {
@@ -275,7 +279,7 @@ command_process_create_cell(cell_t *cell, or_connection_t *conn)
     memcpy(onionskin, cell->payload, ONIONSKIN_CHALLENGE_LEN);
 
     /* hand it off to the cpuworkers, and then return. */
-    if (assign_onionskin_to_cpuworker(NULL, circ, onionskin) < 0) {
+    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0) {
 #define WARN_HANDOFF_FAILURE_INTERVAL (6*60*60)
       static ratelim_t handoff_warning =
         RATELIM_INIT(WARN_HANDOFF_FAILURE_INTERVAL);
@@ -369,6 +373,37 @@ command_process_created_cell(cell_t *cell, or_connection_t *conn)
  */
 static void
 command_process_relay_cell(cell_t *cell, or_connection_t *conn)
+{
+  command_handle_relay_cell(cell, conn, NULL);
+}
+
+/** Process a relay <b>cell</b> from <b>conn</b> whose crypto may already
+ * have been done by a relay crypto worker, as recorded in
+ * <b>precrypt</b>.  Cells that were not crypted ahead of time go through
+ * command_process_cell() as usual.
+ */
+void
+command_process_precrypted_cell(cell_t *cell, or_connection_t *conn,
+                                const relay_precrypt_t *precrypt)
+{
+  if (!precrypt->circ) {
+    command_process_cell(cell, conn);
+    return;
+  }
+  if (conn->_base.marked_for_close)
+    return;
+  ++stats_n_relay_cells_processed;
+  command_handle_relay_cell(cell, conn, precrypt);
+}
+
+/** Helper for command_process_relay_cell() and
+ * command_process_precrypted_cell(): check <b>cell</b> against the circuit
+ * it names on <b>conn</b> and hand it to the relay code, along with
+ * <b>precrypt</b> if its crypto was done ahead of time.
+ */
+static void
+command_handle_relay_cell(cell_t *cell, or_connection_t *conn,
+                          const relay_precrypt_t *precrypt)
 {
   circuit_t *circ;
   int reason, direction;
@@ -380,6 +415,13 @@ command_process_relay_cell(cell_t *cell, or_connection_t *conn)
     return;
   }
 
+  if (precrypt && precrypt->circ != circ) {
+    /* The circuit we crypted this cell for went away; its payload is no
+     * good to anybody now. */
+    tor_fragile_assert();
+    return;
+  }
+
   if (circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING) {
     log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,get_lang_str(LANG_LOG_COMMAND_CIRCUIT_IN_CREATE_WAIT));
     circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
@@ -416,7 +458,8 @@ command_process_relay_cell(cell_t *cell, or_connection_t *conn)
     }
   }
 
-  if ((reason = circuit_receive_relay_cell(cell, circ, direction)) < 0) {
+  if ((reason = circuit_receive_precrypted_relay_cell(cell, circ, direction,
+                                                    precrypt)) < 0) {
     log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,get_lang_str(LANG_LOG_COMMAND_CIRCUIT_RECEIVE_RELAY_CELL_FAILED),direction==CELL_DIRECTION_OUT?"forward":"backward");
     circuit_mark_for_close(circ, -reason);
   }
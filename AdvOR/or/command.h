@@ -14,6 +14,8 @@
 
 void command_process_cell(cell_t *cell, or_connection_t *conn);
 void command_process_var_cell(var_cell_t *cell, or_connection_t *conn);
+void command_process_precrypted_cell(cell_t *cell, or_connection_t *conn,
+                                     const relay_precrypt_t *precrypt);
 
 extern uint64_t stats_n_padding_cells_processed;
 extern uint64_t stats_n_create_cells_processed;
@@ -29,12 +29,15 @@
 #include "networkstatus.h"
 #include "policies.h"
 #include "relay.h"
+#include "relaycrypt.h"
 #include "rendclient.h"
+#include "rendpin.h"
 #include "rendservice.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "seh.h"
+#include "watchdog.h"
 
 #include "procmon.h"
 
@@ -160,6 +163,7 @@ typedef struct config_var_t {
 static config_var_t _option_vars[] = {
   OBSOLETE("AccountingMaxKB"),
   V(AccountingMax,               MEMUNIT,  "0 bytes"),
+  V(AccountingPacing,            BOOL,     "0"),
   V(AccountingStart,             STRING,   NULL),
   V(Address,                     STRING,   NULL),
   V(AllowTorHosts,                UINT,     "2"),
@@ -171,6 +175,9 @@ static config_var_t _option_vars[] = {
   V(AlternateDirAuthority,       LINELIST, NULL),
   V(AlternateHSAuthority,        LINELIST, NULL),
   V(AssumeReachable,             BOOL,     "0"),
+  V(AsyncLogging,                BOOL,     "0"),
+  V(AsyncLogOverflow,            STRING,   "DropOldest"),
+  V(AsyncLogQueueSize,           UINT,     "4096"),
   V(AuthDirBadDir,               LINELIST, NULL),
   V(AuthDirBadExit,              LINELIST, NULL),
   V(AuthDirInvalid,              LINELIST, NULL),
@@ -186,6 +193,7 @@ static config_var_t _option_vars[] = {
   V(AutomapHostsOnResolve,       BOOL,     "0"),
   V(AutomapHostsSuffixes,        CSV,      ".onion,.exit"),
   V(AvoidDiskWrites,             BOOL,     "0"),
+  V(AutoTuneSocketBuffers,       BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "10 MB"),
   V(BandwidthRate,               MEMUNIT,  "5 MB"),
   V(CircuitBandwidthRate,        MEMUNIT,  "0"),
@@ -199,6 +207,7 @@ static config_var_t _option_vars[] = {
   V(CircuitBuildTimeout,         INTERVAL, "1 minute"),
   V(CircuitIdleTimeout,          INTERVAL, "1 hour"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
+  V(CircuitPriorityBuckets,      BOOL,     "1"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-100.0"), /*negative:'Use default'*/
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientRejectInternalAddresses, BOOL,   "1"),
@@ -208,6 +217,7 @@ static config_var_t _option_vars[] = {
   V(ConstrainedSockets,          BOOL,     "0"),
   V(ConstrainedSockSize,         MEMUNIT,  "8192"),
   V(ContactInfo,                 STRING,   NULL),
+  V(ControlBandwidthEventInterval, INTERVAL, "1 second"),
   V(ControlListenAddress,        LINELIST, NULL),
   V(ControlPort,                 UINT,     "0"),
   V(ControlSocket,               LINELIST, NULL),
@@ -258,6 +268,7 @@ static config_var_t _option_vars[] = {
   V(FetchHidServDescriptors,     BOOL,     "1"),
   V(FetchUselessDescriptors,     BOOL,     "0"),
   V(FetchV2Networkstatus,        BOOL,     "0"),
+  V(GeoIPExactClientCounts,      BOOL,     "0"),
   V(GiveGuardFlagTo_CVE_2011_2768_VulnerableRelays,BOOL,     "0"),
   OBSOLETE("Group"),
   V(HardwareAccel,               BOOL,     "0"),
@@ -271,6 +282,7 @@ static config_var_t _option_vars[] = {
   VAR("HiddenServiceVersion",LINELIST_S, RendConfigLines,    NULL),
   VAR("HiddenServiceAuthorizeClient",LINELIST_S,RendConfigLines, NULL),
   V(HidServAuth,                 LINELIST, NULL),
+  V(HidServLocalShortcut,        BOOL,     "1"),
   V(HSAuthoritativeDir,          BOOL,     "0"),
   OBSOLETE("HSAuthorityRecordStats"),
   V(DirProxy,                   STRING,   NULL),
@@ -283,18 +295,29 @@ static config_var_t _option_vars[] = {
   V(CorporateProxyDomain,     STRING,   NULL),
   V(CorporateProxyAuthenticator,     STRING,   NULL),
   V(CorporateProxyProtocol,             UINT,   "0"),
+  V(CorporateProxyPoolSize,     UINT,     "4"),
   OBSOLETE("IgnoreVersion"),
+  V(InteractiveStreamBoost,      UINT,     "4"),
+  V(IsolatedPreemptiveCircuits,  UINT,     "2"),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
+  V(LazyDescriptorLoading,       BOOL,     "1"),
   VAR("Log",                     LINELIST, Logs,             NULL),
+  V(LogDomains,                  CSV,      ""),
   OBSOLETE("LinkPadding"),
   OBSOLETE("LogLevel"),
   OBSOLETE("LogFile"),
   V(LongLivedPorts,              CSV,
                          "21,22,706,1863,5050,5190,5222,5223,6667,6697,8300"),
   V(AddressMap,              LINELIST, NULL),
+  V(MainLoopStallThreshold,      UINT,     "2000"),
+  V(MaxAddressMappings,          UINT,     "65536"),
   V(MaxAdvertisedBandwidth,      MEMUNIT,  "1 GB"),
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
+  V(MaxMemInUse,                 MEMUNIT,  "0"),
+  V(MaxOldDescriptorBytes,       MEMUNIT,  "0"),
+  V(MaxOldDescriptorsPerRouter,  UINT,     "0"),
   V(MaxOnionsPending,            UINT,     "100"),
+  V(MaxSocketBufferMemory,       MEMUNIT,  "32 MB"),
   OBSOLETE("MonthlyAccountingStart"),
   V(MyFamily,                    STRING,   NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
@@ -304,8 +327,9 @@ static config_var_t _option_vars[] = {
   V(Nickname,                    STRING,   NULL),
   V(NoPublish,                   BOOL,     "0"),
   V(NodeFamilies,              LINELIST, NULL),
-  V(NumCpus,                     UINT,     "1"),
+  V(NumCpus,                     UINT,     "0"),
   V(NumEntryGuards,              UINT,     "3"),
+  V(OptimisticData,              BOOL,     "0"),
   V(ORListenAddress,             LINELIST, NULL),
   V(ORPort,                      PORT,     "0"),
   V(OutboundBindAddress,         STRING,   NULL),
@@ -313,10 +337,13 @@ static config_var_t _option_vars[] = {
   V(PerConnBWBurst,              MEMUNIT,  "0"),
   V(PerConnBWRate,               MEMUNIT,  "0"),
   V(PidFile,                     STRING,   NULL),
+  V(PinnedHiddenServices,        CSV,      NULL),
+  V(PrimaryGuardConnections,     UINT,     "1"),
   V(TestingTorNetwork,           BOOL,     "0"),
   V(ProtocolWarnings,            BOOL,     "0"),
   V(PublishServerDescriptor,     CSV,      "1"),
   V(PublishHidServDescriptors,   BOOL,     "1"),
+  V(RaceCircuitBuilds,           BOOL,     "0"),
   V(ReachableAddresses,          LINELIST, NULL),
   V(RecommendedVersions,         LINELIST, NULL),
   V(RecommendedClientVersions,   LINELIST, NULL),
@@ -326,8 +353,10 @@ static config_var_t _option_vars[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoThreads,          UINT,     "0"),
   OBSOLETE("RendExcludeNodes"),
   OBSOLETE("RendNodes"),
+  V(RendParallelIntro,           BOOL,     "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   OBSOLETE("RouterFile"),
@@ -339,6 +368,8 @@ static config_var_t _option_vars[] = {
   V(ServerDNSAllowBrokenConfig,  BOOL,     "1"),
   V(ServerDNSAllowNonRFC953Hostnames, BOOL,"0"),
   V(ServerDNSDetectHijacking,    BOOL,     "1"),
+  V(ServerDNSMaxCacheSize,       MEMUNIT,  "8 MB"),
+  V(ServerDNSNegativeTTL,        INTERVAL, "15 minutes"),
   V(ServerDNSRandomizeCase,      BOOL,     "1"),
   V(ServerDNSResolvConfFile,     STRING,   NULL),
   V(ServerDNSSearchDomains,      BOOL,     "0"),
@@ -350,12 +381,15 @@ static config_var_t _option_vars[] = {
   V(SocksPort,                   PORT,     "9050"),
   V(SocksAuthenticator,          STRING,   NULL),
   V(SocksTimeout,                INTERVAL, "2 minutes"),
+  V(StreamCoalesceDelay,         UINT,     "0"),
+  V(StreamTracing,               BOOL,     "0"),
   OBSOLETE("StatusFetchPeriod"),
   V(StrictEntryNodes,            BOOL,     "0"),
   V(StrictExitNodes,             BOOL,     "0"),
   OBSOLETE("SysLog"),
   V(TestSocks,                   BOOL,     "0"),
   OBSOLETE("TestVia"),
+  V(TokenBucketRefillInterval,   UINT,     "100"),
   V(TrackHostExits,              CSV,      NULL),
   V(TrackHostExitsExpire,        INTERVAL, "30 minutes"),
   OBSOLETE("TrafficShaping"),
@@ -365,6 +399,7 @@ static config_var_t _option_vars[] = {
   V(UpdateBridgesFromAuthority,  BOOL,     "0"),
   V(UseBridges,                  BOOL,     "0"),
   V(UseEntryGuards,              BOOL,     "1"),
+  V(UseMicrodescriptors,         BOOL,     "0"),
   V(User,                        STRING,   NULL),
   VAR("V1AuthoritativeDirectory",BOOL, V1AuthoritativeDir,   "0"),
   VAR("V2AuthoritativeDirectory",BOOL, V2AuthoritativeDir,   "0"),
@@ -380,10 +415,12 @@ static config_var_t _option_vars[] = {
   V(V3BandwidthsFile,            FILENAME, NULL),
   VAR("VersioningAuthoritativeDirectory",BOOL,VersioningAuthoritativeDir, "0"),
   V(VirtualAddrNetwork,          STRING,   "127.192.0.0/10"),
+  V(WarmNextIdentity,            UINT,     "0"),
   V(WarnPlaintextPorts,          CSV,      "23,109,110,143"),
   VAR("__ReloadTorrcOnSIGHUP",   BOOL,  ReloadTorrcOnSIGHUP,      "1"),
   VAR("__AllDirActionsPrivate",  BOOL,  AllDirActionsPrivate,     "0"),
   VAR("__LeaveStreamsUnattached",BOOL,  LeaveStreamsUnattached,   "0"),
+  VAR("__LoopbackExit",          BOOL,  LoopbackExit,             "0"),
   VAR("__HashedControlSessionPassword", LINELIST, HashedControlSessionPassword,
       NULL),
   V(MaxUnusedOpenCircuits,              UINT,     "14"),
@@ -427,6 +464,7 @@ static config_var_t _option_vars[] = {
   V(DebugFilter,                 LINELIST, NULL),
   V(BannedHosts,                 LINELIST, NULL),
   V(QuickStart,                  LINELIST, NULL),
+  V(ProcessBandwidthClass,       LINELIST, NULL),
   V(SynchronizeExit,             LINELIST, NULL),
   V(Plugins,                     LINELIST, NULL),
   V(PluginOptions,               LINELIST, NULL),
@@ -504,6 +542,8 @@ static config_var_t _state_vars[] = {
   V(BWHistoryDirWriteValues,          CSV,      ""),
   V(BWHistoryDirWriteMaxima,          CSV,      ""),
 
+  V(PredictedPorts,                   CSV,      ""),
+
   V(TorVersion,                       STRING,   NULL),
 
   V(LastRotatedOnionKey,              ISOTIME,  NULL),
@@ -538,12 +578,33 @@ static config_var_description_t options_description[] = {
     "this node to the specified number of bytes per second." },
   { "BandwidthBurst", "Limit the maximum token buffer size (also known as "
     "burst) to the given number of bytes." },
+  { "TokenBucketRefillInterval", "Add tokens to the bandwidth buckets every "
+    "this many milliseconds, instead of once per second, so that throttled "
+    "traffic does not come in bursts." },
+  { "AccountingPacing", "If set, limit the bandwidth so that AccountingMax "
+    "lasts until the end of the accounting period, instead of using it up "
+    "early and hibernating for the rest of the period." },
   { "ConnLimit", "Minimum number of simultaneous sockets we must have." },
   { "ConstrainedSockets", "Shrink tx and rx buffers for sockets to avoid "
     "system limits on vservers and related environments.  See man page for "
     "more information regarding this option." },
   { "ConstrainedSockSize", "Limit socket buffers to this size when "
     "ConstrainedSockets is enabled." },
+  { "AutoTuneSocketBuffers", "If set, grow the socket buffers of busy OR "
+    "connections to their bandwidth-delay product and shrink them again "
+    "when they go quiet, instead of leaving them to the system.  Ignored "
+    "when ConstrainedSockets is enabled." },
+  { "MaxSocketBufferMemory", "Never let the socket buffers that "
+    "AutoTuneSocketBuffers sets grow past this many bytes in all." },
+  { "MainLoopStallThreshold", "If nonzero, when the event loop doesn't "
+    "run for this many milliseconds, log what the tor thread is busy with "
+    "and its stack." },
+  { "MaxMemInUse", "If nonzero, when buffers, cell queues and caches take "
+    "more than this many bytes, trim the caches, and then close the circuits "
+    "with the most queued data until we are under it again." },
+  { "ControlBandwidthEventInterval", "Send BW and STREAM_BW events to "
+    "controllers once every this many seconds, with the bytes of the whole "
+    "interval, instead of every second." },
   /*  ControlListenAddress */
   { "ControlPort", "If set, Tor will accept connections from the same machine "
     "(localhost only) on this port, and allow those connections to control "
@@ -573,6 +634,18 @@ static config_var_description_t options_description[] = {
     "from closing our connections while Tor is not in use." },
   { "Log", "Where to send logging messages.  Format is "
     "minSeverity[-maxSeverity] (stderr|stdout|syslog|file FILENAME)." },
+  { "LogDomains", "Comma-separated list of the logging domains to log, such "
+    "as CIRC,DIR,NET.  Messages from other domains are dropped before they "
+    "are formatted.  Empty means every domain; BUG is always logged." },
+  { "AsyncLogging", "If set, log messages are queued and written to the log "
+    "file and the debug window by a separate thread, so that verbose logging "
+    "doesn't slow down the threads that log.  Messages still queued when "
+    "AdvOR crashes are lost." },
+  { "AsyncLogOverflow", "What to do with a new log message when the "
+    "AsyncLogging queue is full: DropOldest or DropNewest.  Dropped "
+    "messages are counted and reported." },
+  { "AsyncLogQueueSize", "How many messages the AsyncLogging queue holds.  "
+    "Read when asynchronous logging is first turned on." },
   { "OutboundBindAddress", "Make all outbound connections originate from the "
     "provided IP address (only useful for multiple network interfaces)." },
   { "PIDFile", "On startup, write our PID to this file. On clean shutdown, "
@@ -594,6 +667,9 @@ static config_var_description_t options_description[] = {
   { "AllowNonRFC953Hostnames", "If set to 1, we don't automatically reject "
     "hostnames for having invalid characters." },
   /*  CircuitBuildTimeout, CircuitIdleTimeout */
+  { "HidServLocalShortcut", "If set, connect streams to our own hidden "
+    "services, unless they authorize their clients, directly instead of "
+    "through a rendezvous circuit." },
   { "ClientOnly", "If set to 1, Tor will under no circumstances run as a "
     "server, even if ORPort is enabled." },
   { "EntryNodes", "A list of preferred entry nodes to use for the first hop "
@@ -602,22 +678,65 @@ static config_var_description_t options_description[] = {
   { "ExitNodes", "A list of preferred nodes to use for the last hop in "
     "circuits, when possible." },
   { "ExcludeNodes", "A list of nodes never to use when building a circuit." },
+  { "GeoIPExactClientCounts", "If set, count the unique clients in the "
+    "bridge, entry and directory request statistics exactly, remembering "
+    "every client address, instead of estimating the counts." },
   { "FascistFirewall", "If set, Tor will only create outgoing connections to "
     "servers running on the ports listed in FirewallPorts." },
   { "FirewallPorts", "A list of ports that we can connect to.  Only used "
     "when FascistFirewall is set." },
+  { "LazyDescriptorLoading", "If set, clients don't parse the cached router "
+    "descriptors that the current consensus doesn't list at startup." },
+  { "MaxOldDescriptorBytes", "If nonzero, drop the oldest superseded router "
+    "descriptors that nobody lists any more once they take more than this "
+    "many bytes." },
+  { "MaxOldDescriptorsPerRouter", "Keep at most this many superseded "
+    "descriptors for each router.  0 means 2 for directory caches and 1 "
+    "otherwise." },
   { "LongLivedPorts", "A list of ports for services that tend to require "
     "high-uptime connections." },
+  { "InteractiveStreamBoost", "When a circuit can send again, a stream that "
+    "had been idle gets this many times the share of a busy stream on the "
+    "same circuit.  1 disables the boost." },
+  { "WarmNextIdentity", "Build this many exit circuits ahead for the next "
+    "identity, so that streams don't wait for new circuits after an identity "
+    "change.  Has no effect when identity changes destroy all circuits or "
+    "use exit list selection.  0 disables." },
+  { "IsolatedPreemptiveCircuits", "Keep up to this many clean circuits ready "
+    "for each isolated program that opened streams recently, more for busier "
+    "programs.  0 disables these circuits." },
+  { "StreamCoalesceDelay", "Let the last partial cell of a busy stream wait "
+    "this many milliseconds for more data, so that programs that write a few "
+    "bytes at a time fill their cells.  0 disables waiting." },
+  { "StreamTracing", "If set, time each stage of stream setup and keep "
+    "statistics for each exit and each identity, which the debug window "
+    "can show or export." },
+  { "RaceCircuitBuilds", "If set, a stream that has to wait for a new "
+    "circuit launches two circuits with different middle and exit relays and "
+    "uses whichever is built first.  The other one is kept for later "
+    "streams." },
+  { "RendParallelIntro", "If set, introduce ourselves to a hidden service "
+    "through two introduction points at once and use whichever "
+    "acknowledges first." },
+  { "PinnedHiddenServices", "A list of hidden services whose descriptors "
+    "we keep fresh in the background and on disk, so that connecting to them "
+    "doesn't have to wait for a descriptor fetch." },
   { "AddressMap", "Force Tor to treat all requests for one address as if "
     "they were for another." },
   { "NewCircuitPeriod", "Force Tor to consider whether to build a new circuit "
     "every NUM seconds." },
   { "MaxCircuitDirtiness", "Do not attach new streams to a circuit that has "
     "been used more than this many seconds ago." },
+  { "MaxAddressMappings", "When there are more address mappings than this, "
+    "drop the DNS, TrackHostExits and automap mappings that weren't used for "
+    "the longest time. 0 means no limit." },
   /* NatdPort, NatdListenAddress */
   { "NodeFamily", "A list of servers that constitute a 'family' and should "
     "never be used in the same circuit." },
   { "NumEntryGuards", "How many entry guards should we keep at a time?" },
+  { "PrimaryGuardConnections", "How many TLS connections do we keep open to "
+    "our first entry guard?  With 2, new circuits go to the less loaded one, "
+    "so that a busy circuit holds up fewer of the others." },
   /* PathlenCoinWeight */
   { "ReachableAddresses", "Addresses we can connect to, as IP/bits:port-port. "
     "By default, we assume all addresses are reachable." },
@@ -643,6 +762,8 @@ static config_var_description_t options_description[] = {
   { "UseEntryGuards", "Set to 0 if we want to pick from the whole set of "
     "servers for the first position in each circuit, rather than picking a "
     "set of 'Guards' to prevent profiling attacks." },
+  { "UseMicrodescriptors", "If set, clients download the microdesc "
+    "consensus and microdescriptors instead of full router descriptors." },
 
   /* === server options */
   { "Address", "The advertised (external) address we should use." },
@@ -671,6 +792,10 @@ static config_var_description_t options_description[] = {
   { "PublishServerDescriptor", "Set to 0 to keep the server from "
     "uploading info to the directory authorities." },
   /* ServerDNS: DetectHijacking, ResolvConfFile, SearchDomains */
+  { "ServerDNSMaxCacheSize", "Drop the least recently used answers from "
+    "the DNS cache when it grows above this size. 0 means no limit." },
+  { "ServerDNSNegativeTTL", "Cache failed resolves for as long as the "
+    "nameserver allows, but never longer than this. 0 means no limit." },
   { "ShutdownWaitLength", "Wait this long for clients to finish when "
     "shutting down because of a SIGINT." },
 
@@ -691,8 +816,9 @@ static config_var_description_t options_description[] = {
   { "MaxDlFailures", "Maximum number of download failures when downloading router descriptors." },
   { "MaxFileAge", "Maximum time cached consensus can be kept." },
   { "MaxTimeDelta","Maximum time difference when sending fake system time." },
-  { "BannedHosts", "Local blacklist for hostnames and IPs." },
+  { "BannedHosts", "Local blacklist for hostnames, \"*.domain\" wildcards, IPs and \"IP/mask\" ranges." },
   { "QuickStart", "Programs added to \"Quick Start\" menu can be executed with \"Force TOR\" enabled." },
+  { "ProcessBandwidthClass", "\"rate burst weight process\": limit the connections of the named program to rate bytes per second in each direction, with buckets of burst bytes, and give them weight percent of the usual share of each read or write." },
   { "SynchronizeExit", "Programs added to \"Quick Start\" menu can be executed with \"Force TOR\" enabled and when AdvOR exits it will also close them, or when one of those programs exits, AdvOR will close the rest of them and will exit." },
   { "Plugins", "Plugins that can be used by Advanced Onion Router must be placed in %[exename]-plugins\\ directory. For more information about writing plugins, see plugins.txt." },
   { "PluginOptions","Configuration values used by plugins."},
@@ -703,6 +829,8 @@ static config_var_description_t options_description[] = {
   { "MaxRendTimeout", "How many seconds should we spend trying to connect to a requested rendezvous point before giving up." },
   { "MaxUnusedOpenCircuits","Maximum number of predicted circuits that are not in use."},
   { "FavoriteExitNodesPriority","A percent that is used when deciding if to use an exit node from favorites when StrictExitNodes is disabled."},
+  { "CorporateProxyPoolSize","How many idle connections to an NTLM corporate proxy are kept already authenticated, so new connections can skip most of the NTLM handshake. 0 disables the pool."},
+  { "OptimisticData","If set, answer SOCKS connect requests as soon as the BEGIN cell is sent, and send the client's first data before the exit has connected. The data is sent again if the stream is retried on another circuit."},
 
   /*  Authority options: AuthDirBadExit, AuthDirInvalid, AuthDirReject,
    * AuthDirRejectUnlisted, AuthDirListBadExits, AuthoritativeDirectory,
@@ -714,7 +842,8 @@ static config_var_description_t options_description[] = {
   /* Hidden service options: HiddenService: dir,excludenodes, nodes,
    * options, port.  PublishHidServDescriptor */
 
-  /* Nonpersistent options: __LeaveStreamsUnattached, __AllDirActionsPrivate */
+  /* Nonpersistent options: __LeaveStreamsUnattached, __AllDirActionsPrivate,
+   * __LoopbackExit */
   { NULL, NULL },
 };
 
@@ -747,6 +876,9 @@ static config_var_description_t state_description[] = {
     "building circuits." },
   { "LastWritten", "When was this state last regenerated?" },
 
+  { "PredictedPorts", "Ports that our streams used lately, so that we build "
+    "circuits for them as soon as we start." },
+
   { "TorVersion", "Which version of Tor generated this state ?" },
   { NULL, NULL },
 };
@@ -774,6 +906,9 @@ typedef struct {
   /** If present, extra is a LINELIST variable for unrecognized
    * lines.  Otherwise, unrecognized lines are an error. */
   config_var_t *extra;
+  /** Map from lowercased variable name to its entry in <b>vars</b>. Built
+   * by config_find_option() the first time it's needed. */
+  strmap_t *index;
 } config_format_t;
 
 /** Macro: assert that <b>cfg</b> has the right magic field for format
@@ -800,6 +935,10 @@ static or_options_t *options_dup(config_format_t *fmt, or_options_t *old);
 static int options_validate(or_options_t *old_options, or_options_t *options, unsigned char **msg);
 static int options_act_reversible(char **msg);
 static int options_act(or_options_t *old_options);
+static void options_act_logging(or_options_t *options);
+static int options_trial_assign_incremental(or_options_t *trial_options,
+                                            config_line_t *list,
+                                            unsigned char **msg);
 static int options_transition_affects_workers(or_options_t *old_options,
                                               or_options_t *new_options);
 static int options_transition_affects_descriptor(or_options_t *old_options,
@@ -832,6 +971,7 @@ static config_format_t options_format = {
   _option_vars,
   (validate_fn_t)options_validate,
   options_description,
+  NULL,
   NULL
 };
 
@@ -854,6 +994,7 @@ static config_format_t state_format = {
   (validate_fn_t)or_state_validate,
   state_description,
   &state_extra_var,
+  NULL
 };
 
 /*
@@ -959,6 +1100,10 @@ config_free_all(void)
   tor_free(torrc_fname);
   tor_free(_version);
   tor_free(global_dirfrontpagecontents);
+  strmap_free(options_format.index, NULL);
+  options_format.index = NULL;
+  strmap_free(state_format.index, NULL);
+  state_format.index = NULL;
 }
 
 /** Make <b>address</b> -- a piece of information related to our operation as
@@ -1127,6 +1272,20 @@ get_effective_bwburst(or_options_t *options)
   return (uint32_t)bw;
 }
 
+/** Return the number of cpus configured in <b>options</b>.  If we are told
+ * to use 0 cpus, use the number of logical CPUs on this machine instead.
+ */
+int
+get_num_cpus(or_options_t *options)
+{
+  if (options->NumCpus == 0) {
+    int n = compute_num_cpus();
+    return (n >= 1) ? n : 1;
+  } else {
+    return options->NumCpus;
+  }
+}
+
 /** Fetch the active option list, and take actions based on it. All of the
  * things we do should survive being done repeatedly.  If present,
  * <b>old_options</b> contains the previous value of the options.
@@ -1273,6 +1432,7 @@ options_act(or_options_t *old_options)
   if((options->logging&0xff)<LOG_ADDR)	options->SafeLogging=1;
   else	options->SafeLogging=0;
   setLogging(options->logging&0xff);
+  options_act_logging(options);
 
   if (options->_ExcludeExitNodesUnion)	routerset_free(options->_ExcludeExitNodesUnion);
   if (options->ExcludeExitNodes || options->ExcludeNodes) {
@@ -1291,6 +1451,10 @@ options_act(or_options_t *old_options)
 //    return -1;
   }
 
+  /* Needs the client authorizations to decrypt the saved descriptors. */
+  if (running_tor)
+    rend_pin_config_services(options, 0);
+
 
   /* Bail out at this point if we're not going to be a client or server:
    * we want to not fork, and to log stuff to stderr. */
@@ -1311,6 +1475,7 @@ options_act(or_options_t *old_options)
   /* Register addressmap directives */
   config_register_addressmaps(options);
   parse_virtual_addr_network(options->VirtualAddrNetwork, 0, &msg);
+  parse_process_bandwidth_classes(options->ProcessBandwidthClass, 0, NULL);
 
   /* Update address policies. */
   if (policies_parse_from_options(options) < 0) {
@@ -1375,6 +1540,9 @@ options_act(or_options_t *old_options)
   /* Change the cell EWMA settings */
   cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
 
+  /* Start or stop relay crypto workers */
+  relaycrypt_set_threads(options->RelayCryptoThreads);
+
   /* Update the BridgePassword's hashed version as needed.  We store this as a
    * digest so that we can do side-channel-proof comparisons on it.
    */
@@ -1475,8 +1643,14 @@ options_act(or_options_t *old_options)
     if (options->PerConnBWRate != old_options->PerConnBWRate ||
         options->PerConnBWBurst != old_options->PerConnBWBurst)
       connection_or_update_token_buckets(get_connection_array(), options);
+
+    if (options->TokenBucketRefillInterval !=
+        old_options->TokenBucketRefillInterval)
+      refill_timer_reset();
   }
 
+  watchdog_set_threshold(options->MainLoopStallThreshold);
+
   if (options->Nickname == NULL) {
       options->Nickname = tor_strdup(UNNAMED_ROUTER_NICKNAME);
       log_notice(LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_DEFAULT_NICKNAME_CHOSEN),options->Nickname);
@@ -1798,14 +1972,19 @@ config_find_option(config_format_t *fmt, const char *key)
 {
   int i;
   size_t keylen = strlen(key);
+  config_var_t *var;
   if (!keylen)
     return NULL; /* if they say "--" on the commandline, it's not an option */
   /* First, check for an exact (case-insensitive) match */
-  for (i=0; fmt->vars[i].name; ++i) {
-    if (!strcasecmp(key, fmt->vars[i].name)) {
-      return &fmt->vars[i];
-    }
+  if (!fmt->index) {
+    fmt->index = strmap_new();
+    for (i=0; fmt->vars[i].name; ++i)
+      if (!strmap_get_lc(fmt->index, fmt->vars[i].name))
+        strmap_set_lc(fmt->index, fmt->vars[i].name, &fmt->vars[i]);
   }
+  var = strmap_get_lc(fmt->index, key);
+  if (var)
+    return var;
   /* If none, check for an abbreviated match */
   for (i=0; fmt->vars[i].name; ++i) {
     if (!strncasecmp(key, fmt->vars[i].name, keylen)) {
@@ -2365,6 +2544,14 @@ options_trial_assign(config_line_t *list, int use_defaults,
     return r;
   }
 
+  r = options_trial_assign_incremental(trial_options, list, msg);
+  if (r > 0)
+    return SETOPT_OK;
+  if (r < 0) {
+    config_free(&options_format, trial_options);
+    return SETOPT_ERR_PARSE;
+  }
+
   if (options_validate(get_options(), trial_options, msg) < 0) {
     config_free(&options_format, trial_options);
     return SETOPT_ERR_PARSE; /*XXX make this a separate return value. */
@@ -2935,6 +3122,50 @@ int compute_publishserverdescriptor(or_options_t *options)
  * will generate too many circuits and potentially overload the network. */
 #define MIN_MAX_CIRCUIT_DIRTINESS 10
 
+/** Lowest allowable nonzero value for MaxMemInUse. */
+#define MIN_MAX_MEM_IN_USE (16*1024*1024)
+
+/** Lowest allowable nonzero value for MainLoopStallThreshold. */
+#define MIN_MAIN_LOOP_STALL_THRESHOLD 100
+
+/** Return an explanation of what's wrong with the logging options in
+ * <b>options</b>, or NULL if they're fine. */
+static const char *
+options_check_logging(or_options_t *options)
+{
+  log_domain_mask_t domains;
+  if (parse_log_domains(options->LogDomains, &domains) < 0)
+    return get_lang_str(LANG_LOG_CONFIG_LOGDOMAINS);
+  if (strcasecmp(options->AsyncLogOverflow, "DropOldest") &&
+      strcasecmp(options->AsyncLogOverflow, "DropNewest"))
+    return get_lang_str(LANG_LOG_CONFIG_ASYNCLOGOVERFLOW);
+  return NULL;
+}
+
+/** Start logging the way <b>options</b> says. */
+static void
+options_act_logging(or_options_t *options)
+{
+  log_domain_mask_t domains;
+  if (parse_log_domains(options->LogDomains, &domains) == 0)
+    setLogDomains(domains);
+  if(setLogAsync(options->AsyncLogging ? MAX(options->AsyncLogQueueSize, 1) : 0, strcasecmp(options->AsyncLogOverflow, "DropNewest") != 0) < 0)
+    log_warn(LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_ASYNC_LOG_FAILED));
+}
+
+#ifndef int3
+/** Raise MaxCircuitDirtiness in <b>options</b> to the lowest value that
+ * we allow. */
+static void
+options_clamp_dirtiness(or_options_t *options)
+{
+  if (options->MaxCircuitDirtiness < MIN_MAX_CIRCUIT_DIRTINESS) {
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_MAXCIRCUITDIRTINESS_TOO_SHORT),MIN_MAX_CIRCUIT_DIRTINESS);
+    options->MaxCircuitDirtiness = MIN_MAX_CIRCUIT_DIRTINESS;
+  }
+}
+#endif
+
 /** Return 0 if every setting in <b>options</b> is reasonable, and a
  * permissible transition from <b>old_options</b>. Else return -1.
  * Should have no side effects, except for normalizing the contents of
@@ -2952,6 +3183,7 @@ static int options_validate(or_options_t *old_options, or_options_t *options, un
 //	return 0;
   int i;
   config_line_t *cl;
+  const char *err;
 #define REJECT(arg) \
   STMT_BEGIN *msg = (unsigned char *)tor_strdup(arg); return 0; STMT_END
 #define COMPLAIN(arg) STMT_BEGIN log(LOG_WARN, LD_CONFIG, arg); STMT_END
@@ -3062,6 +3294,9 @@ static int options_validate(or_options_t *old_options, or_options_t *options, un
     REJECT(get_lang_str(LANG_LOG_CONFIG_REFUSEUNKNOWNEXITS));
   }
 
+  if ((err = options_check_logging(options)) != NULL)
+    REJECT(err);
+
   if (options->SocksPort == 0 && options->TransPort == 0 &&
       options->NatdPort == 0 && options->ORPort == 0 &&
       options->DNSPort == 0 && !options->RendConfigLines)
@@ -3243,15 +3478,71 @@ static int options_validate(or_options_t *old_options, or_options_t *options, un
 #endif
 
 #ifndef int3
-  if (options->MaxCircuitDirtiness < MIN_MAX_CIRCUIT_DIRTINESS) {
-    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_MAXCIRCUITDIRTINESS_TOO_SHORT),MIN_MAX_CIRCUIT_DIRTINESS);
-    options->MaxCircuitDirtiness = MIN_MAX_CIRCUIT_DIRTINESS;
-  }
+  options_clamp_dirtiness(options);
 #endif
 
+  if (options->MaxMemInUse && options->MaxMemInUse < MIN_MAX_MEM_IN_USE) {
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_MAXMEMINUSE_TOO_LOW),MIN_MAX_MEM_IN_USE>>20);
+    options->MaxMemInUse = MIN_MAX_MEM_IN_USE;
+  }
+
+  if (options->MainLoopStallThreshold &&
+      options->MainLoopStallThreshold < MIN_MAIN_LOOP_STALL_THRESHOLD) {
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_MAINLOOPSTALLTHRESHOLD),MIN_MAIN_LOOP_STALL_THRESHOLD);
+    options->MainLoopStallThreshold = MIN_MAIN_LOOP_STALL_THRESHOLD;
+  }
+
   if (options->KeepalivePeriod < 1)
     REJECT(get_lang_str(LANG_LOG_CONFIG_KEEPALIVE_NEGATIVE));
 
+/** The largest InteractiveStreamBoost we accept. */
+#define MAX_INTERACTIVE_STREAM_BOOST 16
+  if (options->InteractiveStreamBoost < 1 ||
+      options->InteractiveStreamBoost > MAX_INTERACTIVE_STREAM_BOOST) {
+    options->InteractiveStreamBoost =
+      options->InteractiveStreamBoost < 1 ? 1 : MAX_INTERACTIVE_STREAM_BOOST;
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_INTERACTIVESTREAMBOOST),options->InteractiveStreamBoost);
+  }
+
+/** The most clean circuits we keep for one isolation key. */
+#define MAX_ISOLATED_PREEMPTIVE_CIRCUITS 4
+  if (options->IsolatedPreemptiveCircuits > MAX_ISOLATED_PREEMPTIVE_CIRCUITS) {
+    options->IsolatedPreemptiveCircuits = MAX_ISOLATED_PREEMPTIVE_CIRCUITS;
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_ISOLATEDPREEMPTIVECIRCUITS),options->IsolatedPreemptiveCircuits);
+  }
+
+/** The most circuits we build ahead for the next identity. */
+#define MAX_WARM_NEXT_IDENTITY 4
+  if (options->WarmNextIdentity > MAX_WARM_NEXT_IDENTITY) {
+    options->WarmNextIdentity = MAX_WARM_NEXT_IDENTITY;
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_WARMNEXTIDENTITY),options->WarmNextIdentity);
+  }
+
+/** The longest StreamCoalesceDelay we accept, in milliseconds. */
+#define MAX_STREAM_COALESCE_DELAY 50
+  if (options->StreamCoalesceDelay > MAX_STREAM_COALESCE_DELAY) {
+    options->StreamCoalesceDelay = MAX_STREAM_COALESCE_DELAY;
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_STREAMCOALESCEDELAY),options->StreamCoalesceDelay);
+  }
+
+/** The longest ControlBandwidthEventInterval we accept, in seconds. */
+#define MAX_CONTROL_BANDWIDTH_EVENT_INTERVAL 3600
+  if (options->ControlBandwidthEventInterval < 1 ||
+      options->ControlBandwidthEventInterval >
+        MAX_CONTROL_BANDWIDTH_EVENT_INTERVAL) {
+    options->ControlBandwidthEventInterval =
+      options->ControlBandwidthEventInterval < 1 ? 1 :
+        MAX_CONTROL_BANDWIDTH_EVENT_INTERVAL;
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_CONTROLBANDWIDTHEVENTINTERVAL),options->ControlBandwidthEventInterval);
+  }
+
+  if (options->TokenBucketRefillInterval < 1 ||
+      options->TokenBucketRefillInterval > 1000) {
+    options->TokenBucketRefillInterval =
+      options->TokenBucketRefillInterval < 1 ? 1 : 1000;
+    log(LOG_WARN,LD_CONFIG,get_lang_str(LANG_LOG_CONFIG_TOKENBUCKETREFILLINTERVAL),options->TokenBucketRefillInterval);
+  }
+
   if (options->RelayBandwidthRate && !options->RelayBandwidthBurst)
     options->RelayBandwidthBurst = options->RelayBandwidthRate;
   if (options->RelayBandwidthBurst && !options->RelayBandwidthRate)
@@ -3374,6 +3665,10 @@ static int options_validate(or_options_t *old_options, or_options_t *options, un
   if (options->UseEntryGuards && ! options->NumEntryGuards)
     REJECT(get_lang_str(LANG_LOG_CONFIG_USEENTRYGUARDS_WITHOUT_NUMENTRYGUARDS));
 
+  if (options->PrimaryGuardConnections < 1 ||
+      options->PrimaryGuardConnections > 2)
+    REJECT(get_lang_str(LANG_LOG_CONFIG_PRIMARYGUARDCONNECTIONS_RANGE));
+
   if (check_nickname_list(options->MyFamily, "MyFamily", msg))
     return -1;
   for (cl = options->NodeFamilies; cl; cl = cl->next) {
@@ -3441,9 +3736,16 @@ static int options_validate(or_options_t *old_options, or_options_t *options, un
   if (rend_parse_service_authorization(options, 1) < 0)
     REJECT(get_lang_str(LANG_LOG_CONFIG_RENDEZVOUS_AUTH_CONFIG_FAILED));
 
+  if (rend_pin_config_services(options, 1) < 0)
+    REJECT(get_lang_str(LANG_LOG_CONFIG_PINNED_HS_FAILED));
+
   if (parse_virtual_addr_network(options->VirtualAddrNetwork, 1, NULL)<0)
     return -1;
 
+  if (parse_process_bandwidth_classes(options->ProcessBandwidthClass, 1,
+                                      (char **)msg) < 0)
+    return -1;
+
   if (options->AutomapHostsSuffixes) {
     SMARTLIST_FOREACH(options->AutomapHostsSuffixes, char *, suf,
     {
@@ -3517,6 +3819,144 @@ static int options_validate(or_options_t *old_options, or_options_t *options, un
 #undef COMPLAIN
 }
 
+/** Check the logging options in <b>options</b> for the incremental
+ * SETCONF path. */
+static int
+options_validate_logging(or_options_t *options, unsigned char **msg)
+{
+  const char *err = options_check_logging(options);
+  if (err) {
+    *msg = (unsigned char *)tor_strdup(err);
+    return -1;
+  }
+  return 0;
+}
+
+#ifndef int3
+/** Clamp MaxCircuitDirtiness for the incremental SETCONF path. */
+static int
+options_validate_dirtiness(or_options_t *options, unsigned char **msg)
+{
+  (void) msg;
+  options_clamp_dirtiness(options);
+  return 0;
+}
+#endif
+
+/** Reparse our address policies from <b>options</b>. */
+static void
+options_act_policies(or_options_t *options)
+{
+  if (policies_parse_from_options(options) < 0)
+    log_warn(LD_BUG,get_lang_str(LANG_LOG_CONFIG_ERROR_PARSING_POLICY));
+}
+
+/** An option that can be changed without running all of options_validate()
+ * and options_act(): <b>validate</b> checks (and normalizes) everything
+ * the option's value depends on, and <b>act</b> makes the new value take
+ * effect.  Either may be NULL; options that only get read when they're
+ * needed have neither. */
+typedef struct option_dep_t {
+  const char *name;
+  int (*validate)(or_options_t *options, unsigned char **msg);
+  void (*act)(or_options_t *options);
+} option_dep_t;
+
+/** The options that options_trial_assign_incremental() handles. */
+static option_dep_t option_deps[] = {
+  { "AsyncLogging", options_validate_logging, options_act_logging },
+  { "AsyncLogOverflow", options_validate_logging, options_act_logging },
+  { "AsyncLogQueueSize", options_validate_logging, options_act_logging },
+  { "AddressMap", NULL, config_register_addressmaps },
+  { "DirPolicy", validate_addr_policies, options_act_policies },
+  { "LogDomains", options_validate_logging, options_act_logging },
+#ifndef int3
+  { "MaxCircuitDirtiness", options_validate_dirtiness, NULL },
+#endif
+  { "SocksPolicy", validate_addr_policies, options_act_policies },
+  { NULL, NULL, NULL },
+};
+
+/** Move the values that options_validate() and options_act() compute from
+ * the options that the user set, and that options_dup() doesn't copy, from
+ * <b>from</b> to <b>to</b>. */
+static void
+options_move_derived(or_options_t *to, or_options_t *from)
+{
+  to->command = from->command;
+  to->command_arg = from->command_arg;
+  to->_ExcludeExitNodesUnion = from->_ExcludeExitNodesUnion;
+  from->_ExcludeExitNodesUnion = NULL;
+  to->_BridgePassword_AuthDigest = from->_BridgePassword_AuthDigest;
+  from->_BridgePassword_AuthDigest = NULL;
+  to->_AllowInvalid = from->_AllowInvalid;
+  to->_PublishServerDescriptor = from->_PublishServerDescriptor;
+  to->RefuseUnknownExits_ = from->RefuseUnknownExits_;
+  to->DirProxyAddr = from->DirProxyAddr;
+  to->DirProxyPort = from->DirProxyPort;
+  to->ORProxyAddr = from->ORProxyAddr;
+  to->ORProxyPort = from->ORProxyPort;
+  to->CorporateProxyAddr = from->CorporateProxyAddr;
+  to->CorporateProxyPort = from->CorporateProxyPort;
+}
+
+/** Called by options_trial_assign() once <b>list</b> has been assigned to
+ * <b>trial_options</b>. If every option in <b>list</b> is in option_deps,
+ * validate and act on only the ones whose value changed, make
+ * <b>trial_options</b> our options and return 1. Return 0 if the change
+ * needs the full options_validate() and set_options(), or -1 (with an
+ * explanation in *<b>msg</b>) if a new value is invalid. */
+static int
+options_trial_assign_incremental(or_options_t *trial_options,
+                                 config_line_t *list, unsigned char **msg)
+{
+  or_options_t *old_options = global_options;
+  option_dep_t *changed[sizeof(option_deps)/sizeof(option_deps[0])];
+  int n_changed = 0, i, j;
+  config_line_t *p;
+
+  if (!old_options || !list)
+    return 0;
+  for (p = list; p; p = p->next) {
+    option_dep_t *dep = NULL;
+    if (p->key[0] == '[')
+      return 0;
+    for (i = 0; option_deps[i].name; i++) {
+      if (!strcasecmp((char *)p->key, option_deps[i].name)) {
+        dep = &option_deps[i];
+        break;
+      }
+    }
+    if (!dep)
+      return 0;
+    for (i = 0; i < n_changed && changed[i] != dep; i++)
+      ;
+    if (i == n_changed &&
+        !option_is_same(&options_format, old_options, trial_options,
+                        dep->name))
+      changed[n_changed++] = dep;
+  }
+
+  for (i = 0; i < n_changed; i++) {
+    if (changed[i]->validate && changed[i]->validate(trial_options, msg) < 0)
+      return -1;
+  }
+
+  options_move_derived(trial_options, old_options);
+  global_options = trial_options;
+  for (i = 0; i < n_changed; i++) {
+    if (!changed[i]->act)
+      continue;
+    /* several options can share an action; run it once */
+    for (j = 0; j < i && changed[j]->act != changed[i]->act; j++)
+      ;
+    if (j == i)
+      changed[i]->act(trial_options);
+  }
+  config_free(&options_format, old_options);
+  return 1;
+}
+
 /** Helper: return true iff s1 and s2 are both NULL, or both non-NULL
  * equal strings. */
 static int
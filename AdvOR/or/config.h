@@ -54,6 +54,7 @@ int getinfo_helper_config(control_connection_t *conn,
 const char *tor_get_digests(void);
 uint32_t get_effective_bwrate(or_options_t *options);
 uint32_t get_effective_bwburst(or_options_t *options);
+int get_num_cpus(or_options_t *options);
 int parse_dir_server_line(const char *line,authority_type_t required_type,int validate_only);
 int parse_bridge_line(const char *line, int validate_only);
 void config_register_addressmaps(or_options_t *options);
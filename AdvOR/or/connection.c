@@ -19,23 +19,29 @@
 #include "connection.h"
 #include "connection_edge.h"
 #include "connection_or.h"
+#include "connection_proxy.h"
 #include "control.h"
 #include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dns.h"
 #include "dnsserv.h"
+#include "etw.h"
 #include "geoip.h"
+#include "hibernate.h"
 #include "main.h"
+#include "perf.h"
 #include "policies.h"
 #include "reasons.h"
 #include "relay.h"
 #include "rendclient.h"
 #include "rendcommon.h"
+#include "rendlocal.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerparse.h"
 #include "proxy.h"
+#include "mempool.h"
 
 #ifdef HAVE_EVENT2_EVENT_H
 #include <event2/event.h>
@@ -45,6 +51,7 @@
 
 void plugins_read_event(connection_t *conn,size_t before);
 void plugins_write_event(connection_t *conn,size_t before);
+int plugins_translate_writes(connection_t *conn);
 
 static connection_t *connection_create_listener(
                                struct sockaddr *listensockaddr,
@@ -77,6 +84,20 @@ static uint32_t last_interface_ip = 0;
  * Used to detect IP address changes. */
 static smartlist_t *outgoing_addrs = NULL;
 
+/** Memory pools for each connection_t subtype and for socks_request_t.  Each
+ * is created when we first need it; connections that come and go quickly
+ * don't then churn the heap. */
+static mp_pool_t *or_conn_pool = NULL, *edge_conn_pool = NULL,
+                 *dir_conn_pool = NULL, *control_conn_pool = NULL,
+                 *base_conn_pool = NULL, *socks_request_pool = NULL;
+
+/** How many bytes should each chunk of a connection pool hold? */
+#define CONNECTION_POOL_CHUNK_SIZE (64*1024)
+
+/** Allocate a zeroed item of type <b>type</b> from the pool at <b>poolp</b>. */
+#define CONNECTION_POOL_GET(poolp, type) \
+  ((type *)mp_pool_get_zero((poolp), sizeof(type), CONNECTION_POOL_CHUNK_SIZE))
+
 /**************************************************************/
 
 /**
@@ -152,6 +173,7 @@ conn_state_to_string(int type, int state)
       switch (state) {
         case AP_CONN_STATE_SOCKS_WAIT: return "waiting for socks info";
         case AP_CONN_STATE_NATD_WAIT: return "waiting for natd dest info";
+        case AP_CONN_STATE_PLUGIN_WAIT: return "waiting for plugins";
         case AP_CONN_STATE_RENDDESC_WAIT: return "waiting for rendezvous desc";
         case AP_CONN_STATE_CONTROLLER_WAIT: return "waiting for controller";
         case AP_CONN_STATE_CIRCUIT_WAIT: return "waiting for circuit";
@@ -197,7 +219,8 @@ conn_state_to_string(int type, int state)
 dir_connection_t *
 dir_connection_new(int socket_family)
 {
-  dir_connection_t *dir_conn = tor_malloc_zero(sizeof(dir_connection_t));
+  dir_connection_t *dir_conn =
+    CONNECTION_POOL_GET(&dir_conn_pool, dir_connection_t);
   connection_init(get_time(NULL), TO_CONN(dir_conn), CONN_TYPE_DIR, socket_family);
   dir_conn->_base.exclKey=EXCLUSIVITY_DIRCONN;
   return dir_conn;
@@ -208,7 +231,8 @@ dir_connection_new(int socket_family)
 or_connection_t *
 or_connection_new(int socket_family)
 {
-  or_connection_t *or_conn = tor_malloc_zero(sizeof(or_connection_t));
+  or_connection_t *or_conn =
+    CONNECTION_POOL_GET(&or_conn_pool, or_connection_t);
   time_t now = get_time(NULL);
   connection_init(now, TO_CONN(or_conn), CONN_TYPE_OR, socket_family);
 
@@ -226,11 +250,16 @@ or_connection_new(int socket_family)
 edge_connection_t *
 edge_connection_new(int type, int socket_family)
 {
-  edge_connection_t *edge_conn = tor_malloc_zero(sizeof(edge_connection_t));
+  edge_connection_t *edge_conn =
+    CONNECTION_POOL_GET(&edge_conn_pool, edge_connection_t);
   tor_assert(type == CONN_TYPE_EXIT || type == CONN_TYPE_AP);
   connection_init(get_time(NULL), TO_CONN(edge_conn), type, socket_family);
-  if (type == CONN_TYPE_AP)
-    edge_conn->socks_request = tor_malloc_zero(sizeof(socks_request_t));
+  edge_conn->expiry_idx = -1;
+  if (type == CONN_TYPE_AP) {
+    edge_conn->socks_request =
+      CONNECTION_POOL_GET(&socks_request_pool, socks_request_t);
+    connection_ap_schedule_expiry(edge_conn);
+  }
   return edge_conn;
 }
 
@@ -240,7 +269,7 @@ control_connection_t *
 control_connection_new(int socket_family)
 {
   control_connection_t *control_conn =
-    tor_malloc_zero(sizeof(control_connection_t));
+    CONNECTION_POOL_GET(&control_conn_pool, control_connection_t);
   connection_init(get_time(NULL),
                   TO_CONN(control_conn), CONN_TYPE_CONTROL, socket_family);
   log_notice(LD_CONTROL,get_lang_str(LANG_LOG_CONNECTION_NEW_CONTROL_CONN));
@@ -268,7 +297,7 @@ connection_new(int type, int socket_family)
       return TO_CONN(control_connection_new(socket_family));
 
     default: {
-      connection_t *conn = tor_malloc_zero(sizeof(connection_t));
+      connection_t *conn = CONNECTION_POOL_GET(&base_conn_pool, connection_t);
       connection_init(get_time(NULL), conn, type, socket_family);
       return conn;
     }
@@ -315,6 +344,7 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = -1; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
+  conn->housekeeping_slot = -1;
   conn->global_identifier = n_connections_allocated++;
 
   conn->type = type;
@@ -426,6 +456,8 @@ _connection_free(connection_t *conn)
   }
 
   tor_free(conn->address);
+  tor_free(conn->proxy_auth);
+  tor_free(conn->traffic_plugins);
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -437,10 +469,16 @@ _connection_free(connection_t *conn)
       or_handshake_state_free(or_conn->handshake_state);
       or_conn->handshake_state = NULL;
     }
+    bitarray_free(or_conn->circ_ids_used);
+    or_conn->circ_ids_used = NULL;
     tor_free(or_conn->nickname);
   }
   if (CONN_IS_EDGE(conn)) {
     edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+    connection_edge_coalesce_cancel(edge_conn);
+    connection_ap_forget_pending(edge_conn);
+    if (edge_conn->local_peer)
+      edge_conn->local_peer->local_peer = NULL;
     tor_free(edge_conn->chosen_exit_name);
     if (edge_conn->socks_request) {
       if(edge_conn->socks_request->address)
@@ -452,15 +490,24 @@ _connection_free(connection_t *conn)
       	tor_free(edge_conn->socks_request->original_address);
       }
       memset(edge_conn->socks_request, 0xcc, sizeof(socks_request_t));
-      tor_free(edge_conn->socks_request);
+      mp_pool_release(edge_conn->socks_request);
+      edge_conn->socks_request = NULL;
     }
     if (edge_conn->rend_data)
       rend_data_free(edge_conn->rend_data);
+    if (edge_conn->pending_optimistic_data)
+      buf_free(edge_conn->pending_optimistic_data);
+    if (edge_conn->sending_optimistic_data)
+      buf_free(edge_conn->sending_optimistic_data);
+    tor_free(edge_conn->resolve_key);
+    if (edge_conn->resolve_followers)
+      smartlist_free(edge_conn->resolve_followers);
   }
   if (conn->type == CONN_TYPE_CONTROL) {
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
     tor_free(control_conn->safecookie_client_hash);
     tor_free(control_conn->incoming_cmd);
+    control_getinfo_spool_free(control_conn);
   }
 
   tor_free(conn->read_event); /* Probably already freed by connection_free. */
@@ -471,6 +518,12 @@ _connection_free(connection_t *conn)
     tor_free(dir_conn->requested_resource);
     if (dir_conn->zlib_state)
       tor_zlib_free(dir_conn->zlib_state);
+    tor_free(dir_conn->stream_headers);
+    tor_free(dir_conn->stream_body);
+    if (dir_conn->stream_which) {
+      SMARTLIST_FOREACH(dir_conn->stream_which, char *, cp, tor_free(cp));
+      smartlist_free(dir_conn->stream_which);
+    }
     if (dir_conn->fingerprint_stack) {
       SMARTLIST_FOREACH(dir_conn->fingerprint_stack, char *, cp, tor_free(cp));
       smartlist_free(dir_conn->fingerprint_stack);
@@ -494,7 +547,7 @@ _connection_free(connection_t *conn)
   }
 
   memset(conn, 0xAA, memlen); /* poison memory */
-  tor_free(mem);
+  mp_pool_release(mem);
 }
 
 /** Make sure <b>conn</b> isn't in any of the global conn lists; then free it.
@@ -553,12 +606,47 @@ connection_free_all(void)
   connection_or_clear_identity_map();
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, _connection_free(conn));
+  connection_edge_coalesce_free_all();
+  connection_ap_pending_free_all();
 
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, void*, addr, tor_free(addr));
     smartlist_free(outgoing_addrs);
     outgoing_addrs = NULL;
   }
+  connection_free_process_bandwidth_classes();
+}
+
+/** Free the empty chunks of the connection pools, keeping those we have
+ * used recently. */
+void
+clean_connection_pools(void)
+{
+  mp_pool_t *pools[] = { or_conn_pool, edge_conn_pool, dir_conn_pool,
+                         control_conn_pool, base_conn_pool,
+                         socks_request_pool };
+  unsigned i;
+  for (i = 0; i < sizeof(pools)/sizeof(pools[0]); ++i) {
+    if (pools[i])
+      mp_pool_clean(pools[i], 0, 1);
+  }
+}
+
+/** Free all storage used by the connection pools.  Every connection must
+ * have been freed already. */
+void
+free_connection_pools(void)
+{
+  mp_pool_t **pools[] = { &or_conn_pool, &edge_conn_pool, &dir_conn_pool,
+                          &control_conn_pool, &base_conn_pool,
+                          &socks_request_pool };
+  unsigned i;
+  for (i = 0; i < sizeof(pools)/sizeof(pools[0]); ++i) {
+    if (*pools[i]) {
+      mp_pool_destroy(*pools[i]);
+      *pools[i] = NULL;
+    }
+  }
 }
 
 /** Do any cleanup needed:
@@ -588,6 +676,8 @@ connection_about_to_close_connection(connection_t *conn)
       log_warn(LD_BUG,get_lang_str(LANG_LOG_CONNECTION_EDGE_CONNECTION_HASNT_SENT_END),conn->marked_for_close_file, conn->marked_for_close);
       tor_fragile_assert();
     }
+    if (edge_conn->local_peer)
+      rend_local_detach(edge_conn);
   }
 
   switch (conn->type) {
@@ -661,6 +751,8 @@ connection_about_to_close_connection(connection_t *conn)
       }
       control_event_stream_status(edge_conn, STREAM_EVENT_CLOSED,
                                   edge_conn->end_reason);
+      stream_trace_closed(edge_conn);
+      connection_ap_resolve_detach(edge_conn);
       circ = circuit_get_by_edge_conn(edge_conn);
       if (circ)
         circuit_detach_stream(circ, edge_conn);
@@ -1028,11 +1120,18 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
- */
+/** How many connections we accept at most each time a listener is readable.
+ * A browser opens many connections at once when it loads a page; taking
+ * them in one go saves a trip through the event loop for each of them. */
+#define MAX_ACCEPTS_PER_READ 64
+
+/** Call accept() once on the listener <b>conn</b>, and add the new
+ * connection if necessary. Return 1 if we took a connection off the
+ * listen queue, whether we kept it or not, 0 if there was nothing more
+ * to accept or we can't take more connections now, and -1 if the listener
+ * failed. */
 static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+connection_accept_one(connection_t *conn, int new_type, or_options_t *options)
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn=NULL;
@@ -1041,7 +1140,6 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   struct sockaddr *remote = (struct sockaddr*)addrbuf;
   /* length of the remote address. Must be whatever accept() needs. */
   socklen_t remotelen = (socklen_t)sizeof(addrbuf);
-  or_options_t *options = get_options();
 
   tor_assert((size_t)remotelen >= sizeof(struct sockaddr_in));
   memset(addrbuf, 0, sizeof(addrbuf));
@@ -1070,7 +1168,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (conn->socket_family == AF_INET || conn->socket_family == AF_INET6) {
@@ -1088,14 +1186,14 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                               LOG_WARN) < 0) {
           log_warn(LD_NET,get_lang_str(LANG_LOG_CONNECTION_UNEXPECTED_SOCKADDR));
           tor_close_socket(news);
-          return 0;
+          return 1;
         }
       }
     }
 
     if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
       tor_close_socket(news);
-      return 0;
+      return 1;
     }
 
     tor_addr_from_sockaddr(&addr, remote, &port);
@@ -1106,7 +1204,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       if (socks_policy_permits_address(&addr) == 0) {
         log_notice(LD_APP,get_lang_str(LANG_LOG_CONNECTION_DENYING_CONNECTION),fmt_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_DIR) {
@@ -1114,7 +1212,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       if (dir_policy_permits_address(&addr) == 0) {
         log_notice(LD_DIRSERV,get_lang_str(LANG_LOG_CONNECTION_DENYING_DIR_CONNECTION),fmt_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
 
@@ -1151,7 +1249,27 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (connection_init_accepted_conn(newconn, conn->type) < 0) {
     if(!(newconn->marked_for_close)) connection_mark_for_close(newconn);
-    return 0;
+    return 1;
+  }
+  return 1;
+}
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept the connections that are waiting on conn-\>s, up to
+ * MAX_ACCEPTS_PER_READ, and add the new connections if necessary.
+ */
+static int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  or_options_t *options = get_options();
+  int i, r;
+
+  for (i = 0; i < MAX_ACCEPTS_PER_READ; i++) {
+    r = connection_accept_one(conn, new_type, options);
+    if (r < 0)
+      return -1;
+    if (r == 0 || conn->marked_for_close)
+      break;
   }
   return 0;
 }
@@ -1243,6 +1361,18 @@ connection_connect(connection_t *conn, const char *address,
     return -1;
   }
 
+  /* A pooled connection to our corporate proxy is already connected; report
+   * it as in progress so that the first write event finishes connecting. */
+  if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_DIR) {
+    s = proxy_pool_take(addr, port, &conn->proxy_auth);
+    if (SOCKET_OK(s)) {
+      conn->s = s;
+      if (connection_add(conn) < 0)
+        return -1;
+      return 0;
+    }
+  }
+
   if (tor_addr_family(addr) == AF_INET6)
     protocol_family = PF_INET6;
   else
@@ -1604,6 +1734,166 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
   return 0;
 }
 
+/** A bandwidth class for the connections of an intercepted process, set by
+ * a ProcessBandwidthClass line. */
+typedef struct process_bw_class_t {
+  char *process; /**< Executable name or full path of the process. */
+  int rate; /**< Bytes per second that the process may read, and write. */
+  int burst; /**< Size of the buckets. */
+  int weight; /**< Percent of the usual share of a round-robin pass. */
+  int read_bucket; /**< Bytes that the process may read now. */
+  int write_bucket; /**< Bytes that the process may write now. */
+} process_bw_class_t;
+
+/** The process bandwidth classes, in the order of the configuration. */
+static smartlist_t *process_bw_classes = NULL;
+/** Incremented whenever process_bw_classes is replaced, so that connections
+ * know that they must look for their class again. */
+static int process_bw_classes_generation = 1;
+
+/** Free all storage held by the process bandwidth class <b>cls</b>. */
+static void
+process_bw_class_free(process_bw_class_t *cls)
+{
+  if (!cls)
+    return;
+  tor_free(cls->process);
+  tor_free(cls);
+}
+
+/** Parse the ProcessBandwidthClass lines in <b>lines</b>, of the form
+ * "rate burst weight process".  Return 0 on success, or -1 and set *<b>msg</b>
+ * on failure.  Unless <b>validate_only</b>, replace the current classes. */
+int
+parse_process_bandwidth_classes(config_line_t *lines, int validate_only,
+                                char **msg)
+{
+  smartlist_t *classes = smartlist_create();
+  smartlist_t *items = smartlist_create();
+  config_line_t *line;
+  int r = 0;
+
+  for (line = lines; line; line = line->next) {
+    process_bw_class_t *cls;
+    int ok1, ok2, ok3;
+    long rate, burst, weight;
+
+    smartlist_split_string(items, (char *)line->value, NULL,
+                           SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 4);
+    if (smartlist_len(items) == 4) {
+      rate = tor_parse_long(smartlist_get(items, 0), 10, 1, INT_MAX, &ok1,
+                            NULL);
+      burst = tor_parse_long(smartlist_get(items, 1), 10, 0, INT_MAX, &ok2,
+                             NULL);
+      weight = tor_parse_long(smartlist_get(items, 2), 10, 1, 100, &ok3, NULL);
+    } else
+      ok1 = 0;
+    if (!ok1 || !ok2 || !ok3) {
+      if (msg)
+        tor_asprintf((unsigned char **)msg,
+                     get_lang_str(LANG_LOG_CONFIG_PROCESSBANDWIDTHCLASS_INVALID),
+                     line->value);
+      SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+      r = -1;
+      break;
+    }
+    cls = tor_malloc_zero(sizeof(process_bw_class_t));
+    cls->rate = (int)rate;
+    cls->burst = burst < rate ? (int)rate : (int)burst;
+    cls->weight = (int)weight;
+    cls->read_bucket = cls->write_bucket = cls->burst;
+    cls->process = smartlist_get(items, 3);
+    smartlist_del_keeporder(items, 3);
+    SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+    smartlist_clear(items);
+    smartlist_add(classes, cls);
+  }
+  smartlist_free(items);
+
+  if (r < 0 || validate_only) {
+    SMARTLIST_FOREACH(classes, process_bw_class_t *, cls,
+                      process_bw_class_free(cls));
+    smartlist_free(classes);
+    return r;
+  }
+  connection_free_process_bandwidth_classes();
+  if (smartlist_len(classes))
+    process_bw_classes = classes;
+  else
+    smartlist_free(classes);
+  return 0;
+}
+
+/** Free all the process bandwidth classes. */
+void
+connection_free_process_bandwidth_classes(void)
+{
+  process_bw_classes_generation++;
+  if (!process_bw_classes)
+    return;
+  SMARTLIST_FOREACH(process_bw_classes, process_bw_class_t *, cls,
+                    process_bw_class_free(cls));
+  smartlist_free(process_bw_classes);
+  process_bw_classes = NULL;
+}
+
+/** Return the bandwidth class of the process that opened <b>conn</b>, or
+ * NULL if it has none. */
+static process_bw_class_t *
+connection_process_bw_class(connection_t *conn)
+{
+  if (!process_bw_classes || conn->type != CONN_TYPE_AP || !conn->pid)
+    return NULL;
+  if (conn->bw_class_generation != process_bw_classes_generation) {
+    char name[MAX_PATH+1];
+    const char *base;
+    conn->bw_class_generation = process_bw_classes_generation;
+    conn->bw_class = 0;
+    getProcessName(name, sizeof(name), conn->pid);
+    base = strrchr(name, '\\');
+    base = base ? base+1 : name;
+    SMARTLIST_FOREACH(process_bw_classes, process_bw_class_t *, cls,
+      if (!strcasecmp(cls->process, strchr(cls->process, '\\') ? name : base)) {
+        conn->bw_class = cls_sl_idx + 1;
+        break;
+      });
+  }
+  if (!conn->bw_class)
+    return NULL;
+  return smartlist_get(process_bw_classes, conn->bw_class - 1);
+}
+
+/** Return how many of the <b>at_most</b> bytes that we would read (or write,
+ * if <b>is_write</b>) on <b>conn</b> its process bandwidth class allows. */
+static ssize_t
+connection_process_bw_limit(connection_t *conn, ssize_t at_most, int is_write)
+{
+  process_bw_class_t *cls = connection_process_bw_class(conn);
+  int bucket;
+  if (!cls)
+    return at_most;
+  if (at_most > 0) {
+    at_most = at_most * cls->weight / 100;
+    if (at_most < 1)
+      at_most = 1;
+  }
+  bucket = is_write ? cls->write_bucket : cls->read_bucket;
+  if (at_most > bucket)
+    at_most = bucket > 0 ? bucket : 0;
+  return at_most;
+}
+
+/** Return 1 if the process bandwidth class of <b>conn</b>, if any, has
+ * tokens left for reading (or writing, if <b>is_write</b>). */
+static int
+connection_process_bw_allows(connection_t *conn, int is_write)
+{
+  process_bw_class_t *cls = connection_process_bw_class(conn);
+  if (!cls)
+    return 1;
+  return (is_write ? cls->write_bucket : cls->read_bucket) > 0;
+}
+
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
@@ -1656,15 +1946,17 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to read on local conns even if our buckets are empty */
-    return conn_bucket>=0 ? conn_bucket : 1<<14;
+    return connection_process_bw_limit(conn,
+                                       conn_bucket>=0 ? conn_bucket : 1<<14, 0);
   }
 
   if (connection_counts_as_relayed_traffic(conn, now) &&
       global_relayed_read_bucket <= global_read_bucket)
     global_bucket = global_relayed_read_bucket;
 
-  return connection_bucket_round_robin(base, priority,
-                                       global_bucket, conn_bucket);
+  return connection_process_bw_limit(conn,
+             connection_bucket_round_robin(base, priority,
+                                           global_bucket, conn_bucket), 0);
 }
 
 /** How many bytes at most can we write onto this connection? */
@@ -1679,7 +1971,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
 
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
-    return conn->outbuf_flushlen;
+    return connection_process_bw_limit(conn, conn->outbuf_flushlen, 1);
   }
 
   if (connection_speaks_cells(conn)) {
@@ -1696,8 +1988,9 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
       global_relayed_write_bucket <= global_write_bucket)
     global_bucket = global_relayed_write_bucket;
 
-  return connection_bucket_round_robin(base, priority, global_bucket,
-                                       conn->outbuf_flushlen);
+  return connection_process_bw_limit(conn,
+             connection_bucket_round_robin(base, priority, global_bucket,
+                                           conn->outbuf_flushlen), 1);
 }
 
 /** Return 1 if the global write buckets are low enough that we
@@ -1757,6 +2050,7 @@ static void
 connection_buckets_decrement(connection_t *conn, time_t now,
                              size_t num_read, size_t num_written)
 {
+  int relayed;
   if (num_written >= INT_MAX || num_read >= INT_MAX) {
     log_err(LD_BUG,get_lang_str(LANG_LOG_CONNECTION_RATE_OUT_OF_RANGE),(unsigned long)num_read, (unsigned long)num_written,conn_type_to_string(conn->type),conn_state_to_string(conn->type, conn->state));
     if (num_written >= INT_MAX) num_written = 1;
@@ -1764,6 +2058,9 @@ connection_buckets_decrement(connection_t *conn, time_t now,
     tor_fragile_assert();
   }
 
+  if (etw_enabled(ETW_KW_CONN_IO))
+    etw_conn_io(conn, num_read, num_written);
+
   /* Count bytes of answering direct and tunneled directory requests */
   if (conn->type == CONN_TYPE_DIR && conn->purpose == DIR_PURPOSE_SERVER) {
     if (num_read > 0)
@@ -1772,6 +2069,20 @@ connection_buckets_decrement(connection_t *conn, time_t now,
       rep_hist_note_dir_bytes_written(num_written, now);
   }
 
+  if (conn->type == CONN_TYPE_OR) {
+    TO_OR_CONN(conn)->tune_bytes_read += num_read;
+    TO_OR_CONN(conn)->tune_bytes_written += num_written;
+    connection_or_note_traffic(TO_OR_CONN(conn), num_read + num_written, now);
+  }
+
+  if (process_bw_classes) {
+    process_bw_class_t *cls = connection_process_bw_class(conn);
+    if (cls) {
+      cls->read_bucket -= (int)num_read;
+      cls->write_bucket -= (int)num_written;
+    }
+  }
+
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
   if (num_read > 0) {
@@ -1783,7 +2094,9 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   if (conn->type == CONN_TYPE_EXIT)
     rep_hist_note_exit_bytes(conn->port, num_written, num_read);
 
-  if (connection_counts_as_relayed_traffic(conn, now)) {
+  relayed = connection_counts_as_relayed_traffic(conn, now);
+  rep_hist_note_bw_sample(num_read, num_written, relayed);
+  if (relayed) {
     global_relayed_read_bucket -= (int)num_read;
     global_relayed_write_bucket -= (int)num_written;
   }
@@ -1811,6 +2124,8 @@ connection_consider_empty_read_buckets(connection_t *conn)
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->read_bucket <= 0) {
     reason = "connection read bucket exhausted. Pausing.";
+  } else if (!connection_process_bw_allows(conn, 0)) {
+    reason = "process bandwidth class read bucket exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
@@ -1835,6 +2150,8 @@ connection_consider_empty_write_buckets(connection_t *conn)
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->write_bucket <= 0) {
     reason = "connection write bucket exhausted. Pausing.";
+  } else if (!connection_process_bw_allows(conn, 1)) {
+    reason = "process bandwidth class write bucket exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
@@ -1860,71 +2177,95 @@ connection_bucket_init(void)
   }
 }
 
+/** How many milliseconds of the current second the buckets were already
+ * refilled for.  A bucket gets rate*t/1000 tokens after t milliseconds of
+ * the second, so fractions of a token are not lost between refills. */
+static int bucket_refill_msec = 0;
+
 /** Refill a single <b>bucket</b> called <b>name</b> with bandwith rate
  * <b>rate</b> and bandwidth burst <b>burst</b>, assuming that
- * <b>seconds_elapsed</b> seconds have passed since the last call.
+ * <b>milliseconds_elapsed</b> milliseconds have passed since the last call.
  **/
 static void
 connection_bucket_refill_helper(int *bucket, int rate, int burst,
-                                int seconds_elapsed, const char *name)
+                                int milliseconds_elapsed, const char *name)
 {
   int starting_bucket = *bucket;
-  if (starting_bucket < burst && seconds_elapsed) {
-    if (((burst - starting_bucket)/seconds_elapsed) < rate) {
+  if (starting_bucket < burst && milliseconds_elapsed > 0) {
+    int64_t incr =
+      (int64_t)rate*(bucket_refill_msec + milliseconds_elapsed)/1000 -
+      (int64_t)rate*bucket_refill_msec/1000;
+    if (incr >= (int64_t)burst - starting_bucket) {
       *bucket = burst;  /* We would overflow the bucket; just set it to
                          * the maximum. */
     } else {
-      int incr = rate*seconds_elapsed;
-      *bucket += incr;
-      if (*bucket > burst || *bucket < starting_bucket) {
-        /* If we overflow the burst, or underflow our starting bucket,
-         * cap the bucket value to burst. */
-        /* XXXX this might be redundant now, but it doesn't show up
-         * in profiles.  Remove it after analysis. */
-        *bucket = burst;
-      }
+      *bucket += (int)incr;
     }
     log(LOG_DEBUG, LD_NET,"%s now %d.", name, *bucket);
   }
 }
 
-/** A second has rolled over; increment buckets appropriately. */
+/** <b>milliseconds_elapsed</b> milliseconds have passed since the last
+ * refill; increment buckets appropriately. */
 void
-connection_bucket_refill(int seconds_elapsed, time_t now)
+connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   or_options_t *options = get_options();
   smartlist_t *conns = get_connection_array();
-  int relayrate, relayburst;
+  int rate = (int)options->BandwidthRate;
+  int burst = (int)options->BandwidthBurst;
+  int relayrate, relayburst, pacedrate;
 
   if (options->RelayBandwidthRate) {
     relayrate = (int)options->RelayBandwidthRate;
     relayburst = (int)options->RelayBandwidthBurst;
   } else {
-    relayrate = (int)options->BandwidthRate;
-    relayburst = (int)options->BandwidthBurst;
+    relayrate = rate;
+    relayburst = burst;
   }
 
-  tor_assert(seconds_elapsed >= 0);
+  /* Spread what is left of the accounting quota over the rest of the
+   * interval, instead of using it up and hibernating. */
+  pacedrate = accounting_get_paced_rate(now);
+  if (pacedrate) {
+    rate = MIN(rate, pacedrate);
+    burst = MIN(burst, pacedrate);
+    relayrate = MIN(relayrate, pacedrate);
+    relayburst = MIN(relayburst, pacedrate);
+  }
+
+  tor_assert(milliseconds_elapsed >= 0);
+  /* more than a day can't fill any bucket more than a second does */
+  if (milliseconds_elapsed > 86400*1000)
+    milliseconds_elapsed = 86400*1000;
 
   write_buckets_empty_last_second =
     global_relayed_write_bucket <= 0 || global_write_bucket <= 0;
 
   /* refill the global buckets */
-  connection_bucket_refill_helper(&global_read_bucket,
-                                  (int)options->BandwidthRate,
-                                  (int)options->BandwidthBurst,
-                                  seconds_elapsed, "global_read_bucket");
-  connection_bucket_refill_helper(&global_write_bucket,
-                                  (int)options->BandwidthRate,
-                                  (int)options->BandwidthBurst,
-                                  seconds_elapsed, "global_write_bucket");
+  connection_bucket_refill_helper(&global_read_bucket, rate, burst,
+                                  milliseconds_elapsed, "global_read_bucket");
+  connection_bucket_refill_helper(&global_write_bucket, rate, burst,
+                                  milliseconds_elapsed, "global_write_bucket");
   connection_bucket_refill_helper(&global_relayed_read_bucket,
-                                  relayrate, relayburst, seconds_elapsed,
+                                  relayrate, relayburst, milliseconds_elapsed,
                                   "global_relayed_read_bucket");
   connection_bucket_refill_helper(&global_relayed_write_bucket,
-                                  relayrate, relayburst, seconds_elapsed,
+                                  relayrate, relayburst, milliseconds_elapsed,
                                   "global_relayed_write_bucket");
 
+  /* refill the process bandwidth classes */
+  if (process_bw_classes) {
+    SMARTLIST_FOREACH(process_bw_classes, process_bw_class_t *, cls, {
+      connection_bucket_refill_helper(&cls->read_bucket, cls->rate,
+                                      cls->burst, milliseconds_elapsed,
+                                      "process_bw_class->read_bucket");
+      connection_bucket_refill_helper(&cls->write_bucket, cls->rate,
+                                      cls->burst, milliseconds_elapsed,
+                                      "process_bw_class->write_bucket");
+    });
+  }
+
   /* refill the per-connection buckets */
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
@@ -1934,14 +2275,14 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
         connection_bucket_refill_helper(&or_conn->read_bucket,
                                         or_conn->bandwidthrate,
                                         or_conn->bandwidthburst,
-                                        seconds_elapsed,
+                                        milliseconds_elapsed,
                                         "or_conn->read_bucket");
       }
       if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
         connection_bucket_refill_helper(&or_conn->write_bucket,
                                         or_conn->bandwidthrate,
                                         or_conn->bandwidthburst,
-                                        seconds_elapsed,
+                                        milliseconds_elapsed,
                                         "or_conn->write_bucket");
       }
     }
@@ -1952,8 +2293,10 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
             global_relayed_read_bucket > 0) /* even if we're relayed traffic */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->read_bucket > 0)) {
+            TO_OR_CONN(conn)->read_bucket > 0)
         /* and either a non-cell conn or a cell conn with non-empty bucket */
+        && connection_process_bw_allows(conn, 0)) {
+        /* and its process may read too */
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,get_lang_str(LANG_LOG_CONNECTION_WAKING_UP_CONN_FOR_READ),conn->s));
       conn->read_blocked_on_bw = 0;
       connection_start_reading(conn);
@@ -1965,12 +2308,15 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
             global_relayed_write_bucket > 0) /* even if it's relayed traffic */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->write_bucket > 0)) {
+            TO_OR_CONN(conn)->write_bucket > 0)
+        && connection_process_bw_allows(conn, 1)) {
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,get_lang_str(LANG_LOG_CONNECTION_WAKING_UP_CONN_FOR_WRITE),conn->s));
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
   });
+
+  bucket_refill_msec = (bucket_refill_msec + milliseconds_elapsed) % 1000;
 }
 
 /** Is the receiver bucket for connection <b>conn</b> low enough that we
@@ -2230,6 +2576,18 @@ int connection_outbuf_too_full(connection_t *conn)
 {	return (conn->outbuf_flushlen > 10*CELL_PAYLOAD_SIZE);
 }
 
+/** While an OR connection has written fewer than this many bytes since it was last idle, it writes TLS records of about one cell. */
+#define TLS_RECORD_RAMP_BYTES (64*CELL_NETWORK_SIZE)
+/** An OR connection that wrote nothing for this many seconds counts as idle. */
+#define TLS_RECORD_IDLE_SECONDS 1
+
+/** Return how large the TLS records that <b>or_conn</b> writes at <b>now</b> should be, or 0 for as large as they get. A connection that is ramping up, or that only sends a few cells now and then, writes records of one cell, so that the first cells of a stream don't wait for a whole record to arrive and be checked. Once it keeps sending, it switches to full-sized records for throughput. */
+static size_t connection_or_tls_record_size(or_connection_t *or_conn,time_t now)
+{	if(or_conn->tls_last_flushed + TLS_RECORD_IDLE_SECONDS < now)
+		or_conn->tls_ramp_bytes = 0;
+	return or_conn->tls_ramp_bytes < TLS_RECORD_RAMP_BYTES ? CELL_NETWORK_SIZE : 0;
+}
+
 /** Try to flush more bytes onto conn-\>s.
  * This function gets called either from conn_write() in main.c when poll() has declared that conn wants to write, or below from connection_write_to_buf() when an entire TLS record is ready.
  * Update conn-\>timestamp_lastwritten to now, and call flush_buf or flush_buf_tls appropriately. If it succeeds and there are no more more bytes on conn->outbuf, then call connection_finished_flushing on it too.
@@ -2285,7 +2643,7 @@ int connection_handle_write_impl(connection_t *conn, int force)
 		}
 		else if (conn->state == OR_CONN_STATE_TLS_SERVER_RENEGOTIATING)
 			return connection_handle_read(conn);
-		result = flush_buf_tls(or_conn->tls, conn->outbuf,max_to_write, &conn->outbuf_flushlen);	/* else open, or closing */
+		result = flush_buf_tls(or_conn->tls, conn->outbuf,max_to_write, connection_or_tls_record_size(or_conn, now), &conn->outbuf_flushlen);	/* else open, or closing */
 		/* If we just flushed the last bytes, check if this tunneled dir request is done. */
 		if(buf_datalen(conn->outbuf) == 0 && conn->dirreq_id)	geoip_change_dirreq_state(conn->dirreq_id, DIRREQ_TUNNELED,DIRREQ_OR_CONN_BUFFER_FLUSHED);
 		switch(result)
@@ -2310,6 +2668,10 @@ int connection_handle_write_impl(connection_t *conn, int force)
 			* is empty, so we can stop writing. */
 		}
 		tor_tls_get_n_raw_bytes(or_conn->tls, &n_read, &n_written);
+		if(n_written)
+		{	or_conn->tls_last_flushed = now;
+			if(or_conn->tls_ramp_bytes < TLS_RECORD_RAMP_BYTES)	or_conn->tls_ramp_bytes += n_written;
+		}
 		log_debug(LD_GENERAL,get_lang_str(LANG_LOG_CONNECTION_AFTER_TLS_WRITE),result,(long)n_read, (long)n_written);
 	}
 	else
@@ -2396,7 +2758,14 @@ void _connection_write_to_buf_impl(const char *string, size_t len,connection_t *
 				enable_control_logging();
 			}
 			else
-			{	r = proxy_handle_server_data(conn,string,len);
+			{	if(conn->type == CONN_TYPE_AP && conn->mode != (unsigned int)CONNECTION_MODE_OTHER)
+				{	uint64_t filter_started = perf_now_usec();
+					r = proxy_handle_server_data(conn,string,len);
+					filter_started = perf_now_usec() - filter_started;
+					perf_hist_add(PERF_HIST_FILTER_USEC,filter_started);
+					stream_trace_note_filter(TO_EDGE_CONN(conn),filter_started);
+				}
+				else	r = proxy_handle_server_data(conn,string,len);
 				if(r == (int)old_datalen)	return;
 				if(r > (int)old_datalen)	len = r - old_datalen;
 				else			len = 0;
@@ -2458,6 +2827,23 @@ void _connection_write_to_buf_impl(const char *string, size_t len,connection_t *
 	}
 }
 
+/** Append <b>len</b> bytes of <b>string</b> onto <b>conn</b>'s outbuf
+ * without copying them, and call <b>release</b>(<b>arg</b>) once the outbuf
+ * is done with them; <b>string</b> must not change until then.  If a plugin
+ * might rewrite what we send on <b>conn</b>, give it a copy instead. */
+void connection_write_ref_to_buf(const char *string, size_t len,connection_t *conn,void (*release)(void *arg),void *arg)
+{	size_t old_datalen;
+	if(!len || (conn->marked_for_close && !conn->hold_open_until_flushed) || conn->hPlugin || conn->plugin_write || plugins_translate_writes(conn))
+	{	connection_write_to_buf(string,len,conn);
+		release(arg);
+		return;
+	}
+	old_datalen = buf_datalen(conn->outbuf);
+	write_ref_to_buf(string,len,conn->outbuf,release,arg);
+	conn->outbuf_flushlen += buf_datalen(conn->outbuf) - old_datalen;
+	connection_start_writing(conn);
+}
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists. */
 connection_t *
@@ -2465,16 +2851,15 @@ connection_get_by_type_addr_port_purpose(int type,
                                          const tor_addr_t *addr, uint16_t port,
                                          int purpose)
 {
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->type == type &&
-        tor_addr_eq(&conn->addr, addr) &&
+  connection_t *conn;
+  for (conn = connection_array_first_of_type(type); conn;
+       conn = conn->next_of_type) {
+    if (tor_addr_eq(&conn->addr, addr) &&
         conn->port == port &&
         conn->purpose == purpose &&
         !conn->marked_for_close)
       return conn;
-  });
+  }
   return NULL;
 }
 
@@ -2484,13 +2869,7 @@ connection_get_by_type_addr_port_purpose(int type,
 connection_t *
 connection_get_by_global_id(uint64_t id)
 {
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->global_identifier == id)
-      return conn;
-  });
-  return NULL;
+  return connection_array_get_by_global_id(id);
 }
 
 /** Return a connection of type <b>type</b> that is not marked for close.
@@ -2498,12 +2877,12 @@ connection_get_by_global_id(uint64_t id)
 connection_t *
 connection_get_by_type(int type)
 {
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->type == type && !conn->marked_for_close)
+  connection_t *conn;
+  for (conn = connection_array_first_of_type(type); conn;
+       conn = conn->next_of_type) {
+    if (!conn->marked_for_close)
       return conn;
-  });
+  }
   return NULL;
 }
 
@@ -2513,12 +2892,12 @@ connection_get_by_type(int type)
 connection_t *
 connection_get_by_type_state(int type, int state)
 {
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->type == type && conn->state == state && !conn->marked_for_close)
+  connection_t *conn;
+  for (conn = connection_array_first_of_type(type); conn;
+       conn = conn->next_of_type) {
+    if (conn->state == state && !conn->marked_for_close)
       return conn;
-  });
+  }
   return NULL;
 }
 
@@ -2531,16 +2910,15 @@ connection_t *
 connection_get_by_type_state_rendquery(int type, int state,
                                        const char *rendquery)
 {
-  smartlist_t *conns = get_connection_array();
+  connection_t *conn;
 
   tor_assert(type == CONN_TYPE_DIR ||
              type == CONN_TYPE_AP || type == CONN_TYPE_EXIT);
   tor_assert(rendquery);
 
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->type == type &&
-        !conn->marked_for_close &&
+  for (conn = connection_array_first_of_type(type); conn;
+       conn = conn->next_of_type) {
+    if (!conn->marked_for_close &&
         (!state || state == conn->state)) {
       if (type == CONN_TYPE_DIR &&
           TO_DIR_CONN(conn)->rend_data &&
@@ -2553,7 +2931,7 @@ connection_get_by_type_state_rendquery(int type, int state,
                             TO_EDGE_CONN(conn)->rend_data->onion_address))
         return conn;
     }
-  });
+  }
   return NULL;
 }
 
@@ -2562,14 +2940,13 @@ connection_get_by_type_state_rendquery(int type, int state,
 connection_t *
 connection_get_by_type_purpose(int type, int purpose)
 {
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->type == type &&
-        !conn->marked_for_close &&
+  connection_t *conn;
+  for (conn = connection_array_first_of_type(type); conn;
+       conn = conn->next_of_type) {
+    if (!conn->marked_for_close &&
         (purpose == conn->purpose))
       return conn;
-  });
+  }
   return NULL;
 }
 
@@ -2736,6 +3113,120 @@ void set_constrained_socket_buffers(tor_socket_t sock, int size)
   }
 }
 
+/** The smallest socket buffer that connection_or_tune_socket_buffers() sets. */
+#define MIN_TUNED_SOCKET_BUFFER (8*1024)
+/** The largest socket buffer that connection_or_tune_socket_buffers() sets. */
+#define MAX_TUNED_SOCKET_BUFFER (4*1024*1024)
+/** The round trip time we assume for OR connections we couldn't time. */
+#define DEFAULT_TUNED_RTT_MSEC 200
+
+/** Return the size of the socket buffer <b>optname</b> of <b>sock</b>, or
+ * 0 if we can't tell. */
+static int
+get_socket_buffer_size(tor_socket_t sock, int optname)
+{
+  int size = 0;
+  socklen_t sz_sz = (socklen_t) sizeof(size);
+  if (getsockopt(sock, SOL_SOCKET, optname, (void*)&size, &sz_sz) < 0)
+    return 0;
+  return size;
+}
+
+/** A socket buffer of <b>current</b> bytes moved <b>bytes</b> bytes in
+ * <b>msec</b> milliseconds over a round trip of <b>rtt_msec</b>.  Return how
+ * large it should be: a buffer can move at most its size every round trip,
+ * so one that came close to that holds the connection back and doubles,
+ * while one that stays mostly empty halves. */
+static int
+socket_buffer_target(uint64_t bytes, long msec, int rtt_msec, int current)
+{
+  uint64_t bdp = bytes * rtt_msec / (msec > 0 ? msec : 1);
+  int target = current;
+  if (bdp * 2 >= (uint64_t)current)
+    target = current * 2;
+  else if (bdp * 8 < (uint64_t)current)
+    target = current / 2;
+  if (target < MIN_TUNED_SOCKET_BUFFER)
+    target = MIN_TUNED_SOCKET_BUFFER;
+  if (target > MAX_TUNED_SOCKET_BUFFER)
+    target = MAX_TUNED_SOCKET_BUFFER;
+  return target;
+}
+
+/** Move the socket buffers of each open OR connection toward the
+ * bandwidth-delay product of the traffic it carried since we last looked,
+ * keeping the buffers we set under MaxSocketBufferMemory in all.  Called
+ * every few seconds when AutoTuneSocketBuffers is set. */
+void
+connection_or_tune_socket_buffers(time_t now)
+{
+  static time_t last_tuned = 0;
+  or_options_t *options = get_options();
+  uint64_t total = 0;
+  long msec = (long)(now - last_tuned) * 1000;
+  int fresh = !last_tuned || now <= last_tuned || now - last_tuned > 60;
+  connection_t *conn;
+
+  last_tuned = now;
+  for (conn = connection_array_first_of_type(CONN_TYPE_OR); conn;
+       conn = conn->next_of_type) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    total += or_conn->sndbuf_size + or_conn->rcvbuf_size;
+  }
+  for (conn = connection_array_first_of_type(CONN_TYPE_OR); conn;
+       conn = conn->next_of_type) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    int rtt, cur, target;
+    uint64_t n_read = or_conn->tune_bytes_read;
+    uint64_t n_written = or_conn->tune_bytes_written;
+
+    or_conn->tune_bytes_read = or_conn->tune_bytes_written = 0;
+    /* After a pause we can't tell how long these bytes took. */
+    if (fresh || conn->marked_for_close || !SOCKET_OK(conn->s) ||
+        conn->state != OR_CONN_STATE_OPEN)
+      continue;
+    rtt = or_conn->rtt_msec ? or_conn->rtt_msec : DEFAULT_TUNED_RTT_MSEC;
+
+    cur = or_conn->sndbuf_size ? or_conn->sndbuf_size :
+      get_socket_buffer_size(conn->s, SO_SNDBUF);
+    if (cur <= 0)
+      cur = MIN_TUNED_SOCKET_BUFFER;
+    target = socket_buffer_target(n_written, msec, rtt, cur);
+    if (target > cur &&
+        total - or_conn->sndbuf_size + target > options->MaxSocketBufferMemory)
+      target = cur;
+    if (target != cur) {
+      if (setsockopt(conn->s, SOL_SOCKET, SO_SNDBUF, (void*)&target,
+                     (socklen_t) sizeof(target)) < 0) {
+        int e = tor_socket_errno(conn->s);
+        log_info(LD_NET,get_lang_str(LANG_LOG_CONNECTION_SETSOCKOPT_FAILED),target,tor_socket_strerror(e));
+      } else {
+        total = total - or_conn->sndbuf_size + target;
+        or_conn->sndbuf_size = target;
+      }
+    }
+
+    cur = or_conn->rcvbuf_size ? or_conn->rcvbuf_size :
+      get_socket_buffer_size(conn->s, SO_RCVBUF);
+    if (cur <= 0)
+      cur = MIN_TUNED_SOCKET_BUFFER;
+    target = socket_buffer_target(n_read, msec, rtt, cur);
+    if (target > cur &&
+        total - or_conn->rcvbuf_size + target > options->MaxSocketBufferMemory)
+      target = cur;
+    if (target != cur) {
+      if (setsockopt(conn->s, SOL_SOCKET, SO_RCVBUF, (void*)&target,
+                     (socklen_t) sizeof(target)) < 0) {
+        int e = tor_socket_errno(conn->s);
+        log_info(LD_NET,get_lang_str(LANG_LOG_CONNECTION_SETSOCKOPT_FAILED_2),target,tor_socket_strerror(e));
+      } else {
+        total = total - or_conn->rcvbuf_size + target;
+        or_conn->rcvbuf_size = target;
+      }
+    }
+  }
+}
+
 /** Process new bytes that have arrived on conn-\>inbuf.
  *
  * This function just passes conn to the connection-specific
@@ -2751,7 +3242,13 @@ connection_process_inbuf(connection_t *conn, int package_partial)
     case CONN_TYPE_OR:
       return connection_or_process_inbuf(TO_OR_CONN(conn));
     case CONN_TYPE_AP:
-      if(conn->state!=AP_CONN_STATE_SOCKS_WAIT && conn->exclKey != EXCLUSIVITY_INTERNAL)	proxy_handle_client_data(TO_EDGE_CONN(conn));
+      if(conn->state!=AP_CONN_STATE_SOCKS_WAIT && conn->exclKey != EXCLUSIVITY_INTERNAL)
+      {	uint64_t filter_started = perf_now_usec();
+	proxy_handle_client_data(TO_EDGE_CONN(conn));
+	filter_started = perf_now_usec() - filter_started;
+	perf_hist_add(PERF_HIST_FILTER_USEC,filter_started);
+	stream_trace_note_filter(TO_EDGE_CONN(conn),filter_started);
+      }
       if(conn->marked_for_close)	return -1;
     case CONN_TYPE_EXIT:
       return connection_edge_process_inbuf(TO_EDGE_CONN(conn),
@@ -2783,6 +3280,8 @@ connection_flushed_some(connection_t *conn)
     r = connection_or_flushed_some(TO_OR_CONN(conn));
   } else if (CONN_IS_EDGE(conn)) {
     r = connection_edge_flushed_some(TO_EDGE_CONN(conn));
+  } else if (conn->type == CONN_TYPE_CONTROL) {
+    r = connection_control_flushed_some(TO_CONTROL_CONN(conn));
   }
   conn->in_flushed_some = 0;
   return r;
@@ -2996,7 +3495,8 @@ assert_connection_ok(connection_t *conn, time_t now)
       tor_assert(edge_conn->socks_request);
       if (conn->state == AP_CONN_STATE_OPEN) {
         tor_assert(edge_conn->socks_request->has_finished);
-        if (!conn->marked_for_close) {
+        if (!conn->marked_for_close && !edge_conn->loopback_exit &&
+            !edge_conn->local_peer) {
           tor_assert(edge_conn->cpath_layer);
           assert_cpath_layer_ok(edge_conn->cpath_layer);
         }
@@ -24,6 +24,8 @@ connection_t *connection_new(int type, int socket_family);
 void connection_link_connections(connection_t *conn_a, connection_t *conn_b);
 void connection_free(connection_t *conn);
 void connection_free_all(void);
+void clean_connection_pools(void);
+void free_connection_pools(void);
 void connection_about_to_close_connection(connection_t *conn);
 void connection_close_immediate(connection_t *conn);
 void _connection_mark_for_close(connection_t *conn,int line, const char *file);
@@ -43,7 +45,11 @@ int retry_all_listeners(smartlist_t *replaced_conns,
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
-void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_bucket_refill(int milliseconds_elapsed, time_t now);
+int parse_process_bandwidth_classes(config_line_t *lines, int validate_only,
+                                    char **msg);
+void connection_free_process_bandwidth_classes(void);
+void connection_or_tune_socket_buffers(time_t now);
 
 int connection_handle_read(connection_t *conn);
 
@@ -70,6 +76,10 @@ connection_write_to_buf_zlib(const char *string, size_t len,
   _connection_write_to_buf_impl(string, len, TO_CONN(conn), done ? -1 : 1);
 }
 
+void connection_write_ref_to_buf(const char *string, size_t len,
+                                 connection_t *conn,
+                                 void (*release)(void *arg), void *arg);
+
 connection_t *connection_get_by_global_id(uint64_t id);
 
 connection_t *connection_get_by_type(int type);
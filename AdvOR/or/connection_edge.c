@@ -22,16 +22,26 @@
 #include "dnsserv.h"
 #include "dirserv.h"
 #include "hibernate.h"
+#include "loopexit.h"
 #include "main.h"
+#include "perf.h"
 #include "policies.h"
 #include "reasons.h"
 #include "relay.h"
 #include "rendclient.h"
 #include "rendcommon.h"
+#include "rendlocal.h"
 #include "rendservice.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
+#include "routerparse.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 
 #ifdef HAVE_LINUX_TYPES_H
 #include <linux/types.h>
@@ -62,9 +72,13 @@ static int connection_exit_connect_dir(edge_connection_t *exitconn);
 static int address_is_in_virtual_range(const char *addr);
 static int consider_plaintext_ports(edge_connection_t *conn, uint16_t port);
 static void clear_trackexithost_mappings(const char *exitname);
+static void addressmap_enforce_limit(const char *keep);
+static void virtual_addr_release(const char *address);
+static int connection_ap_can_use_exit_for_optimistic_data(origin_circuit_t *circ);
 int plugins_remap(edge_connection_t *conn,char **address,char *original_address,BOOL is_error);
+int plugins_remap_async(edge_connection_t *conn);
 char *onionptr(char *address);
-static void client_dns_set_addressmap_impl(const char *address, const char *name,const char *exitname,int ttl) __attribute__ ((format(ms_printf, 1, 0)));
+static void client_dns_set_addressmap_impl(const char *address, const char *name,const char *exitname,int ttl,DWORD exclKey) __attribute__ ((format(ms_printf, 1, 0)));
 static void client_dns_set_reverse_addressmap(const char *address, const char *v, const char *exitname, int ttl) __attribute__ ((format(ms_printf, 1, 0)));
 
 
@@ -91,6 +105,80 @@ void _connection_mark_unattached_ap(edge_connection_t *conn, int endreason,int l
 	conn->end_reason = endreason;
 }
 
+/** Edge connections that hold back a partial cell until more data arrives
+ * or coalesce_timer fires; see connection_edge_package_coalesced(). */
+static smartlist_t *coalescing_edge_conns = NULL;
+/** Timer that packages the partial cells of coalescing_edge_conns. */
+static struct event *coalesce_timer = NULL;
+
+/** Libevent callback: StreamCoalesceDelay milliseconds went by since the first of coalescing_edge_conns held back a partial cell. Package whatever they have now. */
+static void connection_edge_coalesce_cb(evutil_socket_t fd,short what,void *arg)
+{	smartlist_t *conns = coalescing_edge_conns;
+	(void)fd;
+	(void)what;
+	(void)arg;
+	coalescing_edge_conns = smartlist_create();
+	SMARTLIST_FOREACH(conns, edge_connection_t *, conn,
+	{	conn->coalesce_pending = 0;
+		if(conn->_base.marked_for_close || (conn->_base.state != AP_CONN_STATE_OPEN && conn->_base.state != EXIT_CONN_STATE_OPEN))
+			continue;
+		if(connection_edge_package_raw_inbuf(conn, 1, NULL) < 0)	/* (We already sent an end cell if possible) */
+			connection_mark_for_close(TO_CONN(conn));
+		else if(conn->_base.inbuf_reached_eof)
+			connection_edge_reached_eof(conn);
+	});
+	smartlist_free(conns);
+}
+
+/** Package the bytes on the inbuf of the open stream <b>conn</b>. If <b>package_partial</b> is set and StreamCoalesceDelay is on, a partial cell that is left at the end waits up to that many milliseconds for more data to fill it. Streams that had been idle, and so look interactive, and streams that reached EOF send their partial cells at once. Return -1 if packaging failed, else 0. */
+static int connection_edge_package_coalesced(edge_connection_t *conn,int package_partial)
+{	or_options_t *options = get_options();
+	struct timeval delay;
+	size_t left;
+	if(!package_partial || !options->StreamCoalesceDelay || conn->_base.inbuf_reached_eof || conn->last_packaged_at + STREAM_INTERACTIVE_IDLE_SECONDS <= approx_time())
+		return connection_edge_package_raw_inbuf(conn, package_partial, NULL);
+	if(connection_edge_package_raw_inbuf(conn, 0, NULL) < 0)
+		return -1;
+	left = buf_datalen(conn->_base.inbuf);
+	/* Nothing to wait for, or something else than a partial cell is holding the data back. */
+	if(!left || left >= RELAY_PAYLOAD_SIZE || conn->package_window <= 0 || conn->coalesce_pending || conn->_base.marked_for_close)
+		return 0;
+	if(!coalescing_edge_conns)
+		coalescing_edge_conns = smartlist_create();
+	if(!coalesce_timer)
+	{	coalesce_timer = tor_evtimer_new(tor_libevent_get_base(), connection_edge_coalesce_cb, NULL);
+		tor_assert(coalesce_timer);
+	}
+	if(!smartlist_len(coalescing_edge_conns))
+	{	delay.tv_sec = options->StreamCoalesceDelay / 1000;
+		delay.tv_usec = (options->StreamCoalesceDelay % 1000) * 1000;
+		if(evtimer_add(coalesce_timer, &delay) < 0)
+			return connection_edge_package_raw_inbuf(conn, 1, NULL);
+	}
+	smartlist_add(coalescing_edge_conns, conn);
+	conn->coalesce_pending = 1;
+	return 0;
+}
+
+/** <b>conn</b> is about to be freed: forget that it was holding back a partial cell. */
+void connection_edge_coalesce_cancel(edge_connection_t *conn)
+{	if(conn->coalesce_pending && coalescing_edge_conns)
+		smartlist_remove(coalescing_edge_conns, conn);
+	conn->coalesce_pending = 0;
+}
+
+/** Free the list and the timer of the streams that hold back partial cells. */
+void connection_edge_coalesce_free_all(void)
+{	if(coalescing_edge_conns)
+	{	smartlist_free(coalescing_edge_conns);
+		coalescing_edge_conns = NULL;
+	}
+	if(coalesce_timer)
+	{	tor_event_free(coalesce_timer);
+		coalesce_timer = NULL;
+	}
+}
+
 /** There was an EOF. Send an end and mark the connection for close. */
 int connection_edge_reached_eof(edge_connection_t *conn)
 {	if(buf_datalen(conn->_base.inbuf) && connection_state_is_open(TO_CONN(conn)))	/* it still has stuff to process. don't let it die yet. */
@@ -125,17 +213,28 @@ int connection_edge_process_inbuf(edge_connection_t *conn, int package_partial)
 			return 0;
 		case AP_CONN_STATE_OPEN:
 		case EXIT_CONN_STATE_OPEN:
-			if(connection_edge_package_raw_inbuf(conn, package_partial,NULL) < 0)	/* (We already sent an end cell if possible) */
+			if(connection_edge_package_coalesced(conn, package_partial) < 0)	/* (We already sent an end cell if possible) */
 			{	connection_mark_for_close(TO_CONN(conn));
 				return -1;
 			}
 			return 0;
+		case AP_CONN_STATE_CONNECT_WAIT:
+			if(connection_ap_supports_optimistic_data(conn))
+			{	log_info(LD_EDGE,"Data from edge while in '%s' state. Sending it anyway.",conn_state_to_string(conn->_base.type, conn->_base.state));
+				if(connection_edge_package_raw_inbuf(conn, package_partial,NULL) < 0)	/* (We already sent an end cell if possible) */
+				{	connection_mark_for_close(TO_CONN(conn));
+					return -1;
+				}
+				return 0;
+			}
+			log_info(LD_EDGE,get_lang_str(LANG_LOG_EDGE_RECEIVED_DATA_IN_UNEXPECTED_STATE),conn_state_to_string(conn->_base.type, conn->_base.state));
+			return 0;
 		case EXIT_CONN_STATE_CONNECTING:
 		case AP_CONN_STATE_RENDDESC_WAIT:
 		case AP_CONN_STATE_CIRCUIT_WAIT:
-		case AP_CONN_STATE_CONNECT_WAIT:
 		case AP_CONN_STATE_RESOLVE_WAIT:
 		case AP_CONN_STATE_CONTROLLER_WAIT:
+		case AP_CONN_STATE_PLUGIN_WAIT:
 			log_info(LD_EDGE,get_lang_str(LANG_LOG_EDGE_RECEIVED_DATA_IN_UNEXPECTED_STATE),conn_state_to_string(conn->_base.type, conn->_base.state));
 			return 0;
 	}
@@ -238,7 +337,16 @@ connection_edge_flushed_some(edge_connection_t *conn)
 {
   switch (conn->_base.state) {
     case AP_CONN_STATE_OPEN:
+      if (conn->loopback_exit) {
+        loopback_exit_flushed_some(conn);
+        break;
+      }
+      /* fall through */
     case EXIT_CONN_STATE_OPEN:
+      if (conn->local_peer) {
+        rend_local_flushed_some(conn);
+        break;
+      }
       connection_edge_consider_sending_sendme(conn);
       break;
   }
@@ -255,7 +363,8 @@ int connection_edge_finished_flushing(edge_connection_t *conn)
 	{	case AP_CONN_STATE_OPEN:
 		case EXIT_CONN_STATE_OPEN:
 			connection_stop_writing(TO_CONN(conn));
-			connection_edge_consider_sending_sendme(conn);
+			if(conn->local_peer)	rend_local_flushed_some(conn);
+			else			connection_edge_consider_sending_sendme(conn);
 			return 0;
 		case AP_CONN_STATE_SOCKS_WAIT:
 		case AP_CONN_STATE_NATD_WAIT:
@@ -263,6 +372,7 @@ int connection_edge_finished_flushing(edge_connection_t *conn)
 		case AP_CONN_STATE_CIRCUIT_WAIT:
 		case AP_CONN_STATE_CONNECT_WAIT:
 		case AP_CONN_STATE_CONTROLLER_WAIT:
+		case AP_CONN_STATE_PLUGIN_WAIT:
 			connection_stop_writing(TO_CONN(conn));
 			return 0;
 		default:
@@ -287,6 +397,7 @@ int connection_edge_finished_connecting(edge_connection_t *edge_conn)
 	conn->state = EXIT_CONN_STATE_OPEN;
 	connection_watch_events(conn,READ_EVENT); /* stop writing, continue reading */
 	if (connection_wants_to_flush(conn))	connection_start_writing(conn);	/* in case there are any queued relay cells */
+	if(edge_conn->local_peer)	return rend_local_connected(edge_conn);	/* no circuit to send a 'connected' cell to */
 	/* deliver a 'connected' relay cell back through the circuit. */
 	if(connection_edge_is_rendezvous_stream(edge_conn))
 	{	if(connection_edge_send_command(edge_conn,RELAY_COMMAND_CONNECTED, NULL, 0) < 0)	return 0; /* circuit is closed, don't continue */
@@ -319,89 +430,199 @@ static int compute_retry_timeout(edge_connection_t *conn)
 	return 15;
 }
 
-/** Find all general-purpose AP streams waiting for a response that sent their begin/resolve cell >=15 seconds ago. Detach from their current circuit, and mark their current circuit as unsuitable for new streams. Then call connection_ap_handshake_attach_circuit() to attach to a new circuit (if available) or launch a new one.
- * For rendezvous streams, simply give up after SocksTimeout seconds (with no retry attempt). */
-void connection_ap_expire_beginning(void)
-{	edge_connection_t *conn;
-	circuit_t *circ;
-	time_t now = get_time(NULL);
-	or_options_t *options = get_options();
+/** Non-open AP streams ordered by expiry_at, the time at which connection_ap_expire_beginning() should look at them again. */
+static smartlist_t *ap_expiry_queue = NULL;
+/** AP streams in state circuit_wait that connection_ap_handshake_attach_circuit() didn't find a circuit for. */
+static smartlist_t *pending_circ_conns = NULL;
+/** While connection_ap_attach_pending() walks the streams that were on pending_circ_conns, the list that it walks. */
+static smartlist_t *attaching_circ_conns = NULL;
+
+/** Compare the expiry_at fields of two AP streams, for ap_expiry_queue. */
+static int compare_ap_expiry(const void *a,const void *b)
+{	const edge_connection_t *ca = a, *cb = b;
+	if(ca->expiry_at < cb->expiry_at)	return -1;
+	if(ca->expiry_at > cb->expiry_at)	return 1;
+	return 0;
+}
+
+/** Return the time at which connection_ap_expire_beginning() should look at <b>conn</b> again. Unattached streams time out SocksTimeout seconds after they were born, streams that sent their begin or resolve cell are retried compute_retry_timeout() seconds after they last read. The state of an unattached stream can change without telling us, so we look at it at least every compute_retry_timeout() seconds. */
+static time_t connection_ap_next_expiry(edge_connection_t *conn,time_t now)
+{	time_t when;
+	if(AP_CONN_STATE_IS_UNATTACHED(conn->_base.state) || conn->resolve_leader)
+	{	when = conn->_base.timestamp_created + get_options()->SocksTimeout;
+		if(when > now + compute_retry_timeout(conn))
+			when = now + compute_retry_timeout(conn);
+	}
+	else	when = conn->_base.timestamp_lastread + compute_retry_timeout(conn);
+	return when > now ? when : now + 1;
+}
+
+/** Put the AP stream <b>conn</b> on ap_expiry_queue, or move it forward if it has to be looked at sooner than it is queued for. Streams that are queued too soon are queued again when connection_ap_expire_beginning() finds that they didn't expire. */
+void connection_ap_schedule_expiry(edge_connection_t *conn)
+{	time_t when;
+	if(conn->_base.type != CONN_TYPE_AP || conn->_base.marked_for_close || conn->_base.state == AP_CONN_STATE_OPEN)
+		return;
+	when = connection_ap_next_expiry(conn,get_time(NULL));
+	if(!ap_expiry_queue)
+		ap_expiry_queue = smartlist_create();
+	if(conn->expiry_idx >= 0)
+	{	if(conn->expiry_at <= when)
+			return;
+		smartlist_pqueue_remove(ap_expiry_queue,compare_ap_expiry,STRUCT_OFFSET(edge_connection_t, expiry_idx),conn);
+	}
+	conn->expiry_at = when;
+	smartlist_pqueue_add(ap_expiry_queue,compare_ap_expiry,STRUCT_OFFSET(edge_connection_t, expiry_idx),conn);
+}
+
+/** Remember that the AP stream <b>conn</b> waits for a circuit, so that connection_ap_attach_pending() tries it again when one opens. */
+void connection_ap_mark_as_pending_circuit(edge_connection_t *conn)
+{	if(conn->pending_circ || conn->_base.marked_for_close)
+		return;
+	if(!pending_circ_conns)
+		pending_circ_conns = smartlist_create();
+	smartlist_add(pending_circ_conns, conn);
+	conn->pending_circ = 1;
+	connection_ap_schedule_expiry(conn);
+}
+
+/** <b>conn</b> is about to be freed: take it off ap_expiry_queue and off the list of streams that wait for a circuit. */
+void connection_ap_forget_pending(edge_connection_t *conn)
+{	if(conn->expiry_idx >= 0 && ap_expiry_queue)
+		smartlist_pqueue_remove(ap_expiry_queue,compare_ap_expiry,STRUCT_OFFSET(edge_connection_t, expiry_idx),conn);
+	conn->expiry_idx = -1;
+	if(conn->pending_circ && pending_circ_conns)
+		smartlist_remove(pending_circ_conns, conn);
+	if(attaching_circ_conns)
+	{	SMARTLIST_FOREACH(attaching_circ_conns, edge_connection_t *, c,
+		{	if(c == conn)	smartlist_set(attaching_circ_conns, c_sl_idx, NULL);	});
+	}
+	conn->pending_circ = 0;
+}
+
+/** Free ap_expiry_queue and the lists of the streams that wait for a circuit. */
+void connection_ap_pending_free_all(void)
+{	if(ap_expiry_queue)
+	{	smartlist_free(ap_expiry_queue);
+		ap_expiry_queue = NULL;
+	}
+	if(pending_circ_conns)
+	{	smartlist_free(pending_circ_conns);
+		pending_circ_conns = NULL;
+	}
+}
+
+/** See if the AP stream <b>conn</b>, that isn't open, expired at <b>now</b>. Streams that are still unattached after SocksTimeout seconds are closed. Streams that wait for a reply to their begin/resolve cell since compute_retry_timeout() seconds are detached from their current circuit, their circuit is marked as unsuitable for new streams, and they try to attach to a new circuit (if available) or launch a new one. For rendezvous streams, simply give up after SocksTimeout seconds (with no retry attempt). */
+static void connection_ap_expire_one(edge_connection_t *conn,time_t now,or_options_t *options)
+{	circuit_t *circ;
 	int severity;
 	int cutoff;
 	int seconds_idle, seconds_since_born;
-	smartlist_t *conns = get_connection_array();
-	SMARTLIST_FOREACH_BEGIN(conns, connection_t *, c)
-	{	if(c->type != CONN_TYPE_AP || c->marked_for_close)
-			continue;
-		conn = TO_EDGE_CONN(c);
-		if(get_router_sel()==0x100007f)
-		{	connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
-			continue;
+	/* if it's an internal linked connection, don't yell its status. */
+	severity = (tor_addr_is_null(&conn->_base.addr) && !conn->_base.port) ? LOG_INFO : LOG_NOTICE;
+	seconds_idle = (int)( now - conn->_base.timestamp_lastread );
+	seconds_since_born = (int)( now - conn->_base.timestamp_created );
+	/* We already consider SocksTimeout in connection_ap_handshake_attach_circuit(), but we need to consider it here too because controllers that put streams in controller_wait state never ask Tor to attach the circuit. */
+	if(AP_CONN_STATE_IS_UNATTACHED(conn->_base.state))
+	{	if(seconds_since_born >= options->SocksTimeout)
+		{	log_fn(severity, LD_APP,get_lang_str(LANG_LOG_EDGE_CONNECTION_TIMEOUT),seconds_since_born, safe_str_client(conn->socks_request->address),conn->socks_request->port,conn_state_to_string(CONN_TYPE_AP, conn->_base.state));
+			connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
 		}
-		/* if it's an internal linked connection, don't yell its status. */
-		severity = (tor_addr_is_null(&conn->_base.addr) && !conn->_base.port) ? LOG_INFO : LOG_NOTICE;
-		seconds_idle = (int)( now - conn->_base.timestamp_lastread );
-		seconds_since_born = (int)( now - conn->_base.timestamp_created );
-		if(conn->_base.state == AP_CONN_STATE_OPEN)	continue;
-		/* We already consider SocksTimeout in connection_ap_handshake_attach_circuit(), but we need to consider it here too because controllers that put streams in controller_wait state never ask Tor to attach the circuit. */
-		if(AP_CONN_STATE_IS_UNATTACHED(conn->_base.state))
-		{	if(seconds_since_born >= options->SocksTimeout)
-			{	log_fn(severity, LD_APP,get_lang_str(LANG_LOG_EDGE_CONNECTION_TIMEOUT),seconds_since_born, safe_str_client(conn->socks_request->address),conn->socks_request->port,conn_state_to_string(CONN_TYPE_AP, conn->_base.state));
-				connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
-			}
-			continue;
+		return;
+	}
+	if(conn->resolve_leader)	/* waiting for another connection's resolve */
+	{	if(seconds_since_born >= options->SocksTimeout)
+		{	log_fn(severity, LD_APP,get_lang_str(LANG_LOG_EDGE_CONNECTION_TIMEOUT),seconds_since_born, safe_str_client(conn->socks_request->address),conn->socks_request->port,conn_state_to_string(CONN_TYPE_AP, conn->_base.state));
+			connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
 		}
-		/* We're in state connect_wait or resolve_wait now -- waiting for a reply to our relay cell. See if we want to retry/give up. */
-		cutoff = compute_retry_timeout(conn);
-		if(seconds_idle < cutoff)	continue;
-		circ = circuit_get_by_edge_conn(conn);
-		if(!circ)	/* it's vanished? */
-		{	log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_CONN_LOST_CIRC),safe_str_client(conn->socks_request->address));
+		return;
+	}
+	/* We're in state connect_wait or resolve_wait now -- waiting for a reply to our relay cell. See if we want to retry/give up. */
+	cutoff = compute_retry_timeout(conn);
+	if(seconds_idle < cutoff)	return;
+	circ = circuit_get_by_edge_conn(conn);
+	if(!circ)	/* it's vanished? */
+	{	log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_CONN_LOST_CIRC),safe_str_client(conn->socks_request->address));
+		connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
+		return;
+	}
+	if(circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED)
+	{	if(seconds_idle >= options->SocksTimeout)
+		{	log_fn(severity, LD_REND,get_lang_str(LANG_LOG_EDGE_REND_TIMEOUT),seconds_idle,safe_str_client(conn->socks_request->address));
+			connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
 			connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
-			continue;
 		}
-		if(circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED)
-		{	if(seconds_idle >= options->SocksTimeout)
-			{	log_fn(severity, LD_REND,get_lang_str(LANG_LOG_EDGE_REND_TIMEOUT),seconds_idle,safe_str_client(conn->socks_request->address));
-				connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-				connection_mark_unattached_ap(conn, END_STREAM_REASON_TIMEOUT);
-			}
+		return;
+	}
+	tor_assert(circ->purpose == CIRCUIT_PURPOSE_C_GENERAL);
+	log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,get_lang_str(LANG_LOG_EDGE_CONNECTION_TIMEOUT_2),seconds_idle, safe_str_client(conn->socks_request->address),conn->cpath_layer ?extend_info_describe(conn->cpath_layer->extend_info) : "*unnamed*");
+	/* send an end down the circuit */
+	connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
+	/* un-mark it as ending, since we're going to reuse it */
+	conn->edge_has_sent_end = 0;
+	conn->end_reason = 0;
+	/* kludge to make us not try this circuit again, yet to allow current streams on it to survive if they can: make it unattractive to use for new streams */
+	if(options->MaxCircuitDirtiness)
+		circ->timestamp_dirty -= options->MaxCircuitDirtiness;
+	/* give our stream another 'cutoff' seconds to try */
+	conn->_base.timestamp_lastread += cutoff;
+	if(conn->num_socks_retries < 250)	conn->num_socks_retries++;	/* avoid overflow */
+	/* move it back into 'pending' state, and try to attach. */
+	if(connection_ap_detach_retriable(conn, TO_ORIGIN_CIRCUIT(circ),END_STREAM_REASON_TIMEOUT)<0)
+	{	if(!conn->_base.marked_for_close)
+			connection_mark_unattached_ap(conn, END_STREAM_REASON_CANT_ATTACH);
+	}
+}
+
+/** Look at the AP streams on ap_expiry_queue whose time came, with connection_ap_expire_one(), and queue the ones that are still waiting again. */
+void connection_ap_expire_beginning(void)
+{	edge_connection_t *conn;
+	time_t now = get_time(NULL);
+	or_options_t *options = get_options();
+	if(get_router_sel()==0x100007f)
+	{	smartlist_t *conns = get_connection_array();
+		SMARTLIST_FOREACH(conns, connection_t *, c,
+		{	if(c->type == CONN_TYPE_AP && !c->marked_for_close)
+				connection_mark_unattached_ap(TO_EDGE_CONN(c), END_STREAM_REASON_TIMEOUT);
+		});
+		return;
+	}
+	while(ap_expiry_queue && smartlist_len(ap_expiry_queue))
+	{	conn = smartlist_get(ap_expiry_queue, 0);
+		if(conn->expiry_at > now)
+			break;
+		smartlist_pqueue_pop(ap_expiry_queue,compare_ap_expiry,STRUCT_OFFSET(edge_connection_t, expiry_idx));
+		if(conn->_base.marked_for_close || conn->_base.state == AP_CONN_STATE_OPEN)
 			continue;
-		}
-		tor_assert(circ->purpose == CIRCUIT_PURPOSE_C_GENERAL);
-		log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,get_lang_str(LANG_LOG_EDGE_CONNECTION_TIMEOUT_2),seconds_idle, safe_str_client(conn->socks_request->address),conn->cpath_layer ?extend_info_describe(conn->cpath_layer->extend_info) : "*unnamed*");
-		/* send an end down the circuit */
-		connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-		/* un-mark it as ending, since we're going to reuse it */
-		conn->edge_has_sent_end = 0;
-		conn->end_reason = 0;
-		/* kludge to make us not try this circuit again, yet to allow current streams on it to survive if they can: make it unattractive to use for new streams */
-		if(options->MaxCircuitDirtiness)
-			circ->timestamp_dirty -= options->MaxCircuitDirtiness;
-		/* give our stream another 'cutoff' seconds to try */
-		conn->_base.timestamp_lastread += cutoff;
-		if(conn->num_socks_retries < 250)	conn->num_socks_retries++;	/* avoid overflow */
-		/* move it back into 'pending' state, and try to attach. */
-		if(connection_ap_detach_retriable(conn, TO_ORIGIN_CIRCUIT(circ),END_STREAM_REASON_TIMEOUT)<0)
-		{	if(!conn->_base.marked_for_close)
-				connection_mark_unattached_ap(conn, END_STREAM_REASON_CANT_ATTACH);
-		}
-	} SMARTLIST_FOREACH_END(conn);
+		connection_ap_expire_one(conn,now,options);
+		if(conn->_base.marked_for_close)
+			continue;
+		if(conn->_base.state == AP_CONN_STATE_CIRCUIT_WAIT)
+			connection_ap_mark_as_pending_circuit(conn);
+		connection_ap_schedule_expiry(conn);
+	}
 }
 
-/** Tell any AP streams that are waiting for a new circuit to try again, either attaching to an available circ or launching a new one. */
+/** Tell any AP streams that are waiting for a new circuit to try again, either attaching to an available circ or launching a new one. The streams that still wait are put on pending_circ_conns again by connection_ap_handshake_attach_circuit(). */
 void connection_ap_attach_pending(void)
-{	edge_connection_t *edge_conn;
-	smartlist_t *conns = get_connection_array();
-	SMARTLIST_FOREACH(conns, connection_t *, conn,
-	{	if(conn->marked_for_close || conn->type != CONN_TYPE_AP || conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
+{	smartlist_t *conns;
+	edge_connection_t *edge_conn;
+	int i;
+	if(!pending_circ_conns || !smartlist_len(pending_circ_conns) || attaching_circ_conns)
+		return;
+	conns = attaching_circ_conns = pending_circ_conns;
+	pending_circ_conns = smartlist_create();
+	SMARTLIST_FOREACH(conns, edge_connection_t *, c, c->pending_circ = 0);
+	for(i = 0; i < smartlist_len(conns); i++)
+	{	edge_conn = smartlist_get(conns, i);
+		if(!edge_conn || edge_conn->_base.marked_for_close || edge_conn->_base.state != AP_CONN_STATE_CIRCUIT_WAIT)
 			continue;
-		edge_conn = TO_EDGE_CONN(conn);
 		if(connection_ap_handshake_attach_circuit(edge_conn) < 0)
 		{	if(!edge_conn->_base.marked_for_close)
 				connection_mark_unattached_ap(edge_conn,END_STREAM_REASON_CANT_ATTACH);
 		}
-	});
+	}
+	attaching_circ_conns = NULL;
+	smartlist_free(conns);
 }
 
 /** Tell any AP streams that are waiting for a onehop tunnel to <b>failed_digest</b> that they are going to fail. */
@@ -471,6 +692,17 @@ void circuit_discard_optional_exit_enclaves(extend_info_t *info)
 int connection_ap_detach_retriable(edge_connection_t *conn, origin_circuit_t *circ,int reason)
 {	control_event_stream_status(conn, STREAM_EVENT_FAILED_RETRIABLE, reason);
 	conn->_base.timestamp_lastread = get_time(NULL);
+	if(conn->pending_optimistic_data)
+	{	/* everything that we sent on this circuit is sent again on the next one, followed by what we didn't get to send */
+		if(conn->sending_optimistic_data)
+		{	size_t n = buf_datalen(conn->sending_optimistic_data);
+			move_buf_to_buf(conn->pending_optimistic_data,conn->sending_optimistic_data,&n);
+			buf_free(conn->sending_optimistic_data);
+		}
+		conn->sending_optimistic_data = conn->pending_optimistic_data;
+		conn->pending_optimistic_data = NULL;
+	}
+	conn->may_use_optimistic_data = 0;
 	if(!get_options()->LeaveStreamsUnattached || conn->use_begindir)
 	{	/* If we're attaching streams ourself, or if this connection is a tunneled directory connection, then just attach it. */
 		conn->_base.state = AP_CONN_STATE_CIRCUIT_WAIT;
@@ -505,11 +737,33 @@ int connection_ap_detach_retriable(edge_connection_t *conn, origin_circuit_t *ci
  * interface, and other values for DNS and TrackHostExit mappings that can
  * expire.)
  */
-typedef struct {
+typedef struct addressmap_entry_t {
   char *new_address;
   time_t expires;
   addressmap_entry_source_t source:3;
+  /** For ADDRMAPSRC_DNS entries: true while we are resolving the address
+   * again before this entry expires. */
+  unsigned int prefetching:1;
   short num_resolve_failures;
+  /** For ADDRMAPSRC_DNS entries: how many times the entry was used since it
+   * was set. */
+  uint16_t hits;
+  /** For ADDRMAPSRC_DNS entries: exclKey of the stream that resolved it, so
+   * that we re-resolve it on a circuit that this stream could use. */
+  DWORD exclKey;
+  /** When this mapping was registered or last used; transient mappings that
+   * weren't used for the longest time are dropped first when there are more
+   * than MaxAddressMappings mappings. */
+  time_t last_used;
+  /** The address at the end of the chain of mappings that starts here, or
+   * NULL if we don't know it.  Only valid while <b>chain_generation</b> is
+   * equal to addressmap_generation. */
+  char *chain_address;
+  /** The expiry time of the chain of mappings that starts here. */
+  time_t chain_expires;
+  /** The last ADDRMAPSRC_DNS entry of the chain, if any. */
+  struct addressmap_entry_t *chain_dns;
+  uint32_t chain_generation;
 } addressmap_entry_t;
 
 /** Entry for mapping addresses to which virtual address we mapped them to. */
@@ -520,10 +774,153 @@ typedef struct {
  
 /** A hash table to store client-side address rewrite instructions. */
 static strmap_t *addressmap=NULL;
+/** Incremented whenever a mapping is added, changed or removed, so that the
+ * chains cached in the addressmap entries are recomputed. */
+static uint32_t addressmap_generation = 1;
+/** Don't try to drop transient mappings again before the addressmap has this
+ * many more entries than MaxAddressMappings. */
+static int addressmap_limit_slack = 0;
 /** Table mapping addresses to which virtual address, if any, we assigned them to.
  *  We maintain the following invariant: if [A,B] is in virtaddress_reversemap, then B must be a virtual address, and [A,B] must be in addressmap. We do not require that the converse hold: if it fails, then we could end up mapping two virtual addresses to the same address, which is no disaster. **/
 static strmap_t *virtaddress_reversemap=NULL;
 
+/** Virtual IPv4 addresses (in host order) whose mappings were removed, from
+ * the oldest to the newest, starting at index <b>free_virtual_addrs_head</b>.
+ * Reusing the oldest first keeps a removed address unused for as long as we
+ * can, in case an application still remembers it. */
+static smartlist_t *free_virtual_addrs = NULL;
+static int free_virtual_addrs_head = 0;
+
+/* Shared memory copy of the virtual IPv4 mappings, so that the resolver hooks of intercepted processes can answer repeated lookups without asking us. It is a file mapping named "<instance>_virtaddr" (the pipe name without "\\.\pipe\") that other processes can only open with FILE_MAP_READ. The table uses open addressing: a hostname is stored lowercase in slot (FNV-1a hash of the name) % slots, or in the next slots after it. A slot with addr == 0 ends a lookup, VIRTADDR_SHM_DELETED marks a removed entry. Readers must read <b>sequence</b> before and after a lookup, and ignore the result if it was odd or changed. */
+#define VIRTADDR_SHM_VERSION 1
+#define VIRTADDR_SHM_SLOTS 4096
+#define VIRTADDR_SHM_NAME_LEN 252
+#define VIRTADDR_SHM_DELETED 0xffffffff
+
+typedef struct virtaddr_shm_ent_t
+{	uint32_t addr;	/**< Virtual address in network order. */
+	char hostname[VIRTADDR_SHM_NAME_LEN];
+} virtaddr_shm_ent_t;
+
+typedef struct virtaddr_shm_t
+{	uint32_t version;
+	volatile LONG sequence;
+	uint32_t slots;
+	uint32_t reserved;
+	virtaddr_shm_ent_t ent[VIRTADDR_SHM_SLOTS];
+} virtaddr_shm_t;
+
+static HANDLE virtaddr_shm_handle = NULL;
+static virtaddr_shm_t *virtaddr_shm = NULL;
+/** True if we couldn't create the mapping; don't try again. */
+static int virtaddr_shm_failed = 0;
+
+static uint32_t virtaddr_shm_hash(const char *hostname)
+{	uint32_t h = 2166136261u;
+	while(*hostname)
+	{	h ^= (unsigned char)TOR_TOLOWER(*hostname);
+		h *= 16777619u;
+		hostname++;
+	}
+	return h;
+}
+
+/** Create the shared table on first use. Return 0 on success, -1 if it is not available. */
+static int virtaddr_shm_init(void)
+{	SECURITY_DESCRIPTOR sd;
+	SECURITY_ATTRIBUTES sa;
+	SID_IDENTIFIER_AUTHORITY world = {SECURITY_WORLD_SID_AUTHORITY};
+	PSID everyone = NULL;
+	char acl_buf[256];
+	PACL acl = (PACL)acl_buf;
+	char *name;
+	if(virtaddr_shm)	return 0;
+	if(virtaddr_shm_failed || strlen(pipeName) < 9)	return -1;
+	virtaddr_shm_failed = 1;
+	/* everyone can map the table for reading; our own handle keeps write access */
+	if(!AllocateAndInitializeSid(&world,1,SECURITY_WORLD_RID,0,0,0,0,0,0,0,&everyone))	return -1;
+	if(InitializeAcl(acl,sizeof(acl_buf),ACL_REVISION) && AddAccessAllowedAce(acl,ACL_REVISION,SECTION_MAP_READ|SECTION_QUERY,everyone) && InitializeSecurityDescriptor(&sd,SECURITY_DESCRIPTOR_REVISION) && SetSecurityDescriptorDacl(&sd,1,acl,0))
+	{	sa.nLength = sizeof(sa);
+		sa.lpSecurityDescriptor = &sd;
+		sa.bInheritHandle = 0;
+		tor_asprintf((unsigned char **)&name,"%s_virtaddr",pipeName + 9);
+		virtaddr_shm_handle = CreateFileMapping(INVALID_HANDLE_VALUE,&sa,PAGE_READWRITE,0,sizeof(virtaddr_shm_t),name);
+		tor_free(name);
+	}
+	FreeSid(everyone);
+	if(!virtaddr_shm_handle)	return -1;
+	virtaddr_shm = MapViewOfFile(virtaddr_shm_handle,FILE_MAP_WRITE,0,0,sizeof(virtaddr_shm_t));
+	if(!virtaddr_shm)
+	{	CloseHandle(virtaddr_shm_handle);
+		virtaddr_shm_handle = NULL;
+		return -1;
+	}
+	memset(virtaddr_shm,0,sizeof(virtaddr_shm_t));
+	virtaddr_shm->slots = VIRTADDR_SHM_SLOTS;
+	virtaddr_shm->version = VIRTADDR_SHM_VERSION;
+	virtaddr_shm_failed = 0;
+	return 0;
+}
+
+/** Return the slot that holds <b>hostname</b>, or NULL. If <b>free_slot</b> is set, store the first slot that can hold it there. */
+static virtaddr_shm_ent_t *virtaddr_shm_find(const char *hostname,virtaddr_shm_ent_t **free_slot)
+{	uint32_t i,idx = virtaddr_shm_hash(hostname) % VIRTADDR_SHM_SLOTS;
+	if(free_slot)	*free_slot = NULL;
+	for(i = 0;i < VIRTADDR_SHM_SLOTS;i++,idx = (idx + 1) % VIRTADDR_SHM_SLOTS)
+	{	virtaddr_shm_ent_t *ent = &virtaddr_shm->ent[idx];
+		if(!ent->addr)
+		{	if(free_slot && !*free_slot)	*free_slot = ent;
+			return NULL;
+		}
+		if(ent->addr == VIRTADDR_SHM_DELETED)
+		{	if(free_slot && !*free_slot)	*free_slot = ent;
+		}
+		else if(!strcasecmp(ent->hostname,hostname))	return ent;
+	}
+	return NULL;
+}
+
+/** Publish that <b>hostname</b> is mapped to the virtual IPv4 address <b>address</b>. */
+static void virtaddr_shm_publish(const char *hostname,const char *address)
+{	struct in_addr in;
+	virtaddr_shm_ent_t *ent,*free_slot;
+	if(strlen(hostname) >= VIRTADDR_SHM_NAME_LEN || !tor_inet_aton(address,&in) || virtaddr_shm_init() < 0)	return;
+	InterlockedIncrement(&virtaddr_shm->sequence);
+	ent = virtaddr_shm_find(hostname,&free_slot);
+	if(!ent && free_slot)
+	{	ent = free_slot;
+		strlcpy(ent->hostname,hostname,VIRTADDR_SHM_NAME_LEN);
+		tor_strlower(ent->hostname);
+	}
+	if(ent)	ent->addr = in.s_addr;
+	InterlockedIncrement(&virtaddr_shm->sequence);
+}
+
+/** Stop publishing <b>hostname</b>, if it is still mapped to <b>address</b>. */
+static void virtaddr_shm_unpublish(const char *hostname,const char *address)
+{	struct in_addr in;
+	virtaddr_shm_ent_t *ent;
+	if(!virtaddr_shm || !hostname || !tor_inet_aton(address,&in))	return;
+	ent = virtaddr_shm_find(hostname,NULL);
+	if(ent && ent->addr == in.s_addr)
+	{	InterlockedIncrement(&virtaddr_shm->sequence);
+		ent->addr = VIRTADDR_SHM_DELETED;
+		InterlockedIncrement(&virtaddr_shm->sequence);
+	}
+}
+
+/** Remove all published mappings and release the shared table. */
+static void virtaddr_shm_free(void)
+{	if(!virtaddr_shm)	return;
+	InterlockedIncrement(&virtaddr_shm->sequence);
+	memset(virtaddr_shm->ent,0,sizeof(virtaddr_shm->ent));
+	InterlockedIncrement(&virtaddr_shm->sequence);
+	UnmapViewOfFile(virtaddr_shm);
+	CloseHandle(virtaddr_shm_handle);
+	virtaddr_shm = NULL;
+	virtaddr_shm_handle = NULL;
+}
+
 /** Initialize addressmap. */
 void addressmap_init(void)
 {	addressmap = strmap_new();
@@ -537,7 +934,8 @@ static void addressmap_ent_free(void *_ent,const char *c,int n)
 	if(!_ent)	return;
 	ent = _ent;
 	_tor_free_(ent->new_address,c,n);
-	tor_free(ent);
+	_tor_free_(ent->chain_address,c,n);
+	tor_free_tagged(MEM_TAG_ADDRESSMAP,ent,sizeof(addressmap_entry_t));
 }
 #else
 static void addressmap_ent_free(void *_ent)
@@ -545,7 +943,8 @@ static void addressmap_ent_free(void *_ent)
 	if(!_ent)	return;
 	ent = _ent;
 	_tor_free_(ent->new_address);
-	tor_free(ent);
+	_tor_free_(ent->chain_address);
+	tor_free_tagged(MEM_TAG_ADDRESSMAP,ent,sizeof(addressmap_entry_t));
 }
 #endif
 
@@ -590,7 +989,10 @@ static void addressmap_virtaddress_remove(const char *address, addressmap_entry_
 
 /** Remove <b>ent</b> (which must be mapped to by <b>address</b>) from the client address maps. */
 static void addressmap_ent_remove(const char *address, addressmap_entry_t *ent)
-{	addressmap_virtaddress_remove(address, ent);
+{	addressmap_generation++;
+	virtaddr_shm_unpublish(ent->new_address,address);
+	addressmap_virtaddress_remove(address, ent);
+	virtual_addr_release(address);
 #ifdef DEBUG_MALLOC
 	addressmap_ent_free(ent,__FILE__,__LINE__);
 #else
@@ -700,24 +1102,57 @@ void addressmap_free_all(void)
 	{	strmap_free(virtaddress_reversemap, addressmap_virtaddress_ent_free);
 		virtaddress_reversemap = NULL;
 	}
+	if(free_virtual_addrs)
+	{	smartlist_free(free_virtual_addrs);
+		free_virtual_addrs = NULL;
+		free_virtual_addrs_head = 0;
+	}
+	virtaddr_shm_free();
 }
 
 /** Look at address, and rewrite it until it doesn't want any more rewrites; but don't get into an infinite loop. Don't write more than maxlen chars into address. Return true if the address changed; false otherwise. Set *<b>expires_out</b> to the expiry time of the result, or to <b>time_max</b> if the result does not expire. */
 int addressmap_rewrite(char **address, time_t *expires_out)
-{	addressmap_entry_t *ent;
+{	addressmap_entry_t *ent, *first, *dns_ent = NULL;
 	int rewrites;
 	char *cp,*esc_l;
 	time_t expires = TIME_MAX;
+	first = strmap_get(addressmap, *address);
+	if(first && first->new_address)
+	{	first->last_used = get_time(NULL);
+		if(first->chain_address && first->chain_generation == addressmap_generation)	/* nothing changed since we followed this chain */
+		{	cp = escaped_safe_str_client(first->chain_address);
+			esc_l = escaped_safe_str_client(*address);
+			log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_ADDRESSMAP_REWRITE_ADDRESS),esc_l, cp);
+			tor_free(cp);
+			tor_free(esc_l);
+			if(first->chain_dns && first->chain_dns->hits < 0xffff)	first->chain_dns->hits++;
+			tor_free(*address);
+			*address = tor_strdup(first->chain_address);
+			if(expires_out)	*expires_out = first->chain_expires;
+			return 1;
+		}
+	}
 	for(rewrites = 0; rewrites < 16; rewrites++)
-	{	ent = strmap_get(addressmap, *address);
+	{	ent = rewrites ? strmap_get(addressmap, *address) : first;
 		if(!ent || !ent->new_address)
 		{	if(expires_out)	*expires_out = expires;
+			if(rewrites)	/* remember where this chain ends */
+			{	tor_free(first->chain_address);
+				first->chain_address = tor_strdup(*address);
+				first->chain_expires = expires;
+				first->chain_dns = dns_ent;
+				first->chain_generation = addressmap_generation;
+			}
 			return (rewrites > 0); /* done, no rewrite needed */
 		}
 		cp = escaped_safe_str_client(ent->new_address);
 		esc_l = escaped_safe_str_client(*address);
 		log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_ADDRESSMAP_REWRITE_ADDRESS),esc_l, cp);
 		if(ent->expires > 1 && ent->expires < expires)	expires = ent->expires;
+		if(ent->source == ADDRMAPSRC_DNS)
+		{	if(ent->hits < 0xffff)	ent->hits++;
+			dns_ent = ent;
+		}
 		tor_free(cp);
 		tor_free(esc_l);
 		if(*address)	tor_free(*address);
@@ -759,14 +1194,75 @@ int addressmap_have_mapping(const char *address, int update_expiry)
 	if(!(ent=strmap_get_lc(addressmap, address)))
 		return 0;
 	if(update_expiry && ent->source==ADDRMAPSRC_TRACKEXIT)
-		ent->expires=get_time(NULL) + update_expiry;
+	{	ent->expires=get_time(NULL) + update_expiry;
+		addressmap_generation++;
+	}
 	return 1;
 }
 
+/** A transient mapping that addressmap_enforce_limit() may drop. */
+typedef struct {
+	const char *address;
+	addressmap_entry_t *ent;
+} addressmap_victim_t;
+
+static int compare_addressmap_victims(const void *a,const void *b)
+{	time_t t1 = ((const addressmap_victim_t *)a)->ent->last_used;
+	time_t t2 = ((const addressmap_victim_t *)b)->ent->last_used;
+	if(t1 < t2)	return -1;
+	if(t1 > t2)	return 1;
+	return 0;
+}
+
+/** Drop the DNS, TrackHostExits and automap mappings that weren't used for the longest time, except the mapping from <b>keep</b> (if any), until there are at most <b>target</b> mappings. Return how many we dropped. */
+static int addressmap_drop_lru(int target,const char *keep)
+{	int size, n = 0, i, excess;
+	addressmap_victim_t *victims;
+	size = strmap_size(addressmap);
+	if(size <= target)	return 0;
+	victims = tor_malloc(sizeof(addressmap_victim_t) * size);
+	STRMAP_FOREACH(addressmap, address, addressmap_entry_t *, ent)
+	{	if((ent->source == ADDRMAPSRC_DNS || ent->source == ADDRMAPSRC_TRACKEXIT || ent->source == ADDRMAPSRC_AUTOMAP) && ent->new_address && (!keep || strcmp(address,keep)))
+		{	victims[n].address = address;
+			victims[n].ent = ent;
+			n++;
+		}
+	} STRMAP_FOREACH_END;
+	qsort(victims,n,sizeof(addressmap_victim_t),compare_addressmap_victims);
+	excess = size - target;
+	if(excess > n)	excess = n;
+	for(i = 0; i < excess; i++)
+	{	addressmap_ent_remove(victims[i].address,victims[i].ent);
+		strmap_remove(addressmap,victims[i].address);
+	}
+	tor_free(victims);
+	return excess;
+}
+
+/** If there are more than MaxAddressMappings mappings, drop the transient mappings that weren't used for the longest time, except the mapping from <b>keep</b>, until 10% of the limit is free. */
+static void addressmap_enforce_limit(const char *keep)
+{	int max = (int)get_options()->MaxAddressMappings;
+	int size, excess;
+	if(!max || !addressmap)	return;
+	size = strmap_size(addressmap);
+	if(size <= max + addressmap_limit_slack)	return;
+	excess = addressmap_drop_lru(max - max / 10,keep);
+	size -= excess;
+	/* if we couldn't free enough, don't try again for every new mapping */
+	addressmap_limit_slack = (size > max) ? size - max + max / 10 : 0;
+	log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_ADDRESSMAP_LIMIT),excess,size);
+}
+
+/** Drop the least recently used half of the mappings that we can recreate, because we are short of memory. */
+void addressmap_shrink(void)
+{	if(addressmap)	addressmap_drop_lru(strmap_size(addressmap) / 2,NULL);
+}
+
 /** Register a request to map <b>address</b> to <b>new_address</b>, which will expire on <b>expires</b> (or 0 if never expires from config file, 1 if never expires from controller, 2 if never expires (virtual address mapping) from the controller.)
  * <b>new_address</b> should be a newly dup'ed string, which we'll use or free as appropriate. We will leave address alone. If <b>new_address</b> is NULL, or equal to <b>address</b>, remove any mappings that exist from <b>address</b>. */
 void addressmap_register(char *address, char *new_address, time_t expires,addressmap_entry_source_t source)
 {	addressmap_entry_t *ent;
+	addressmap_generation++;
 	ent = strmap_get(addressmap, address);
 	if(!new_address || !strcasecmp(address,new_address))	/* Remove the mapping, if any. */
 	{	tor_free(new_address);
@@ -777,7 +1273,7 @@ void addressmap_register(char *address, char *new_address, time_t expires,addres
 		return;
 	}
 	if(!ent)	/* make a new one and register it */
-	{	ent = tor_malloc_zero(sizeof(addressmap_entry_t));
+	{	ent = tor_malloc_zero_tagged(MEM_TAG_ADDRESSMAP,sizeof(addressmap_entry_t));
 		strmap_set(addressmap, address, ent);
 	}
 	else if(ent->new_address)	/* we need to clean up the old mapping. */
@@ -788,14 +1284,18 @@ void addressmap_register(char *address, char *new_address, time_t expires,addres
 		}
 		if(address_is_in_virtual_range(ent->new_address) && expires != 2)	/* XXX This isn't the perfect test; we want to avoid removing mappings set from the control interface _as virtual mapping */
 			addressmap_virtaddress_remove(address, ent);
+		virtaddr_shm_unpublish(ent->new_address,address);
 		tor_free(ent->new_address);
 	} /* else { we have an in-progress resolve with no mapping. } */
 	ent->new_address = new_address;
 	ent->expires = expires==2 ? 1 : expires;
 	ent->num_resolve_failures = 0;
 	ent->source = source;
+	ent->last_used = get_time(NULL);
 	log_info(LD_CONFIG,get_lang_str(LANG_LOG_EDGE_ADDRESSMAP_REMAPPED_ADDR),safe_str_client(address), safe_str_client(ent->new_address));
 	control_event_address_mapped(address, &ent->new_address, expires, NULL);
+	if(source == ADDRMAPSRC_DNS || source == ADDRMAPSRC_TRACKEXIT || source == ADDRMAPSRC_AUTOMAP)
+		addressmap_enforce_limit(address);
 }
 
 /** An attempt to resolve <b>address</b> failed at some OR.
@@ -807,7 +1307,8 @@ client_dns_incr_failures(const char *address)
 {
   addressmap_entry_t *ent = strmap_get(addressmap, address);
   if (!ent) {
-    ent = tor_malloc_zero(sizeof(addressmap_entry_t));
+    ent = tor_malloc_zero_tagged(MEM_TAG_ADDRESSMAP,
+                                 sizeof(addressmap_entry_t));
     ent->expires = get_time(NULL) + MAX_DNS_ENTRY_AGE;
     strmap_set(addressmap,address,ent);
   }
@@ -830,6 +1331,162 @@ client_dns_clear_failures(const char *address)
     ent->num_resolve_failures = 0;
 }
 
+/** How long we avoid an exit for a destination after it failed for it. */
+#define EXIT_FAILURE_TTL (10*60)
+/** Don't remember more destinations than this. */
+#define MAX_EXIT_FAILURE_DESTS 1024
+/** Don't remember more failing exits than this for one destination. */
+#define MAX_EXIT_FAILURES_PER_DEST 16
+
+/** An exit that failed a stream to some destination. */
+typedef struct exit_failure_t {
+  char identity_digest[DIGEST_LEN]; /**< Identity of the exit. */
+  int reason; /**< END_STREAM_REASON_* that the exit sent. */
+  time_t expires; /**< When we'll try this exit for the destination again. */
+} exit_failure_t;
+
+/** Map from "address:port" (lowercase) to a smartlist of exit_failure_t
+ * for the exits that failed streams to that destination. */
+static strmap_t *exit_failures = NULL;
+
+/** Write the key of the destination of <b>conn</b> in exit_failures to
+ * <b>key</b>, of <b>key_len</b> bytes. */
+static void
+exit_failure_key(char *key, size_t key_len, edge_connection_t *conn)
+{
+  tor_snprintf(key, key_len, "%s:%d", conn->socks_request->address,
+               conn->socks_request->port);
+  tor_strlower(key);
+}
+
+/** Free the smartlist of exit_failure_t <b>_fl</b>. */
+#ifdef DEBUG_MALLOC
+static void
+exit_failure_list_free(void *_fl, const char *c, int n)
+{
+  smartlist_t *fl = _fl;
+  SMARTLIST_FOREACH(fl, exit_failure_t *, ef, _tor_free_(ef, c, n));
+  smartlist_free(fl);
+}
+#else
+static void
+exit_failure_list_free(void *_fl)
+{
+  smartlist_t *fl = _fl;
+  SMARTLIST_FOREACH(fl, exit_failure_t *, ef, tor_free(ef));
+  smartlist_free(fl);
+}
+#endif
+
+/** Forget the exit failures that expired before <b>now</b>. */
+static void
+exit_failures_clean(time_t now)
+{
+  STRMAP_FOREACH_MODIFY(exit_failures, key, smartlist_t *, fl) {
+    SMARTLIST_FOREACH(fl, exit_failure_t *, ef, {
+      if (ef->expires <= now) {
+        tor_free(ef);
+        SMARTLIST_DEL_CURRENT(fl, ef);
+      }
+    });
+    if (!smartlist_len(fl)) {
+      smartlist_free(fl);
+      MAP_DEL_CURRENT(key);
+    }
+  } STRMAP_FOREACH_END;
+}
+
+/** The exit with identity <b>exit_digest</b> ended the stream <b>conn</b>
+ * before it opened, with <b>reason</b>. If the reason is specific to the
+ * destination of the stream, remember it for EXIT_FAILURE_TTL seconds, so
+ * that connection_ap_can_use_exit() doesn't send the retries or the next
+ * streams to that destination to the same exit. */
+void
+connection_ap_note_exit_failure(edge_connection_t *conn,
+                                const char *exit_digest, int reason)
+{
+  char key[MAX_SOCKS_ADDR_LEN+8];
+  smartlist_t *fl;
+  exit_failure_t *ef = NULL;
+  time_t now = get_time(NULL);
+
+  if (reason != END_STREAM_REASON_EXITPOLICY &&
+      reason != END_STREAM_REASON_RESOLVEFAILED &&
+      reason != END_STREAM_REASON_CONNECTREFUSED)
+    return;
+  if (!conn->socks_request || !conn->socks_request->address ||
+      tor_digest_is_zero(exit_digest))
+    return;
+  if (!exit_failures)
+    exit_failures = strmap_new();
+  exit_failure_key(key, sizeof(key), conn);
+  fl = strmap_get(exit_failures, key);
+  if (!fl) {
+    if (strmap_size(exit_failures) >= MAX_EXIT_FAILURE_DESTS) {
+      exit_failures_clean(now);
+      if (strmap_size(exit_failures) >= MAX_EXIT_FAILURE_DESTS)
+        return;
+    }
+    fl = smartlist_create();
+    strmap_set(exit_failures, key, fl);
+  }
+  SMARTLIST_FOREACH(fl, exit_failure_t *, e, {
+    if (tor_memeq(e->identity_digest, exit_digest, DIGEST_LEN) ||
+        e->expires <= now) {
+      ef = e;
+      break;
+    }
+  });
+  if (!ef) {
+    if (smartlist_len(fl) >= MAX_EXIT_FAILURES_PER_DEST)
+      return;
+    ef = tor_malloc_zero(sizeof(exit_failure_t));
+    smartlist_add(fl, ef);
+  }
+  memcpy(ef->identity_digest, exit_digest, DIGEST_LEN);
+  ef->reason = reason;
+  ef->expires = now + EXIT_FAILURE_TTL;
+  log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_EXIT_FAILURE_NOTED),
+           safe_str_client(key), stream_end_reason_to_string(reason));
+}
+
+/** Return true iff the exit <b>exit</b> failed a stream to the destination
+ * of <b>conn</b> in the last EXIT_FAILURE_TTL seconds. */
+static int
+connection_ap_exit_failed_before(edge_connection_t *conn, routerinfo_t *exit)
+{
+  char key[MAX_SOCKS_ADDR_LEN+8];
+  smartlist_t *fl;
+  time_t now;
+
+  if (!exit_failures || strmap_isempty(exit_failures) ||
+      !conn->socks_request->address)
+    return 0;
+  exit_failure_key(key, sizeof(key), conn);
+  fl = strmap_get(exit_failures, key);
+  if (!fl)
+    return 0;
+  now = get_time(NULL);
+  SMARTLIST_FOREACH(fl, exit_failure_t *, ef, {
+    if (ef->expires > now &&
+        tor_memeq(ef->identity_digest, exit->cache_info.identity_digest,
+                  DIGEST_LEN))
+      return 1;
+  });
+  return 0;
+}
+
+/** Forget all the exits that failed streams, e.g. because we changed our
+ * identity. */
+void
+connection_ap_exit_failures_clear(void)
+{
+  if (exit_failures) {
+    strmap_free(exit_failures, exit_failure_list_free);
+    exit_failures = NULL;
+  }
+}
+
 /** Record the fact that <b>address</b> resolved to <b>name</b>.
  * We can now use this in subsequent streams via addressmap_rewrite()
  * so we can more correctly choose an exit that will allow <b>address</b>.
@@ -840,13 +1497,16 @@ client_dns_clear_failures(const char *address)
  * If <b>ttl</b> is nonnegative, the mapping will be valid for
  * <b>ttl</b>seconds; otherwise, we use the default.
  */
-static void client_dns_set_addressmap_impl(const char *address, const char *name,const char *exitname,int ttl)
-{	unsigned char *extendedaddress;	/* <address>.<hex or nickname>.exit\0  or just  <address>\0 */
+static void client_dns_set_addressmap_impl(const char *address, const char *name,const char *exitname,int ttl,DWORD exclKey)
+{	addressmap_entry_t *ent;
+	time_t expires;
+	unsigned char *extendedaddress;	/* <address>.<hex or nickname>.exit\0  or just  <address>\0 */
 	unsigned char *extendedval;	/* 123.123.123.123.<hex or nickname>.exit\0  or just  123.123.123.123\0 */
 	tor_assert(address);
 	tor_assert(name);
 	if(ttl<0)	ttl = DEFAULT_DNS_TTL;
 	else		ttl = dns_clip_ttl(ttl);
+	expires = get_time(NULL) + ttl;
 
 	if(exitname)	/* XXXX fails to ever get attempts to get an exit address of google.com.digest[=~]nickname.exit; we need a syntax for this that won't make strict RFC952-compliant applications (like us) barf. */
 	{	tor_asprintf(&extendedaddress,"%s.%s.exit", address, exitname);
@@ -856,7 +1516,18 @@ static void client_dns_set_addressmap_impl(const char *address, const char *name
 	{	extendedaddress = (unsigned char *)tor_strdup(address);
 		extendedval = (unsigned char *)tor_strdup(name);
 	}
-	addressmap_register((char *)extendedaddress,(char *)extendedval,get_time(NULL) + ttl,ADDRMAPSRC_DNS);
+	ent = strmap_get(addressmap,(char *)extendedaddress);
+	if(ent && ent->prefetching && ent->source == ADDRMAPSRC_DNS)	/* a refreshed answer replaces the entry that is about to expire */
+	{	addressmap_ent_remove((char *)extendedaddress,ent);
+		strmap_remove(addressmap,(char *)extendedaddress);
+	}
+	addressmap_register((char *)extendedaddress,(char *)extendedval,expires,ADDRMAPSRC_DNS);
+	ent = strmap_get(addressmap,(char *)extendedaddress);
+	if(ent && ent->source == ADDRMAPSRC_DNS && ent->expires == expires)
+	{	ent->exclKey = exclKey;
+		ent->prefetching = 0;
+		ent->hits = 0;
+	}
 	tor_free(extendedaddress);
 }
 
@@ -870,7 +1541,7 @@ static void client_dns_set_addressmap_impl(const char *address, const char *name
  * If <b>ttl</b> is nonnegative, the mapping will be valid for
  * <b>ttl</b>seconds; otherwise, we use the default.
  */
-void client_dns_set_addressmap(const char *address, uint32_t val, const char *exitname, int ttl)
+void client_dns_set_addressmap(const char *address, uint32_t val, const char *exitname, int ttl, DWORD exclKey)
 {
   struct in_addr in;
   char valbuf[INET_NTOA_BUF_LEN];
@@ -882,7 +1553,7 @@ void client_dns_set_addressmap(const char *address, uint32_t val, const char *ex
   in.s_addr = htonl(val);
   tor_inet_ntoa(&in,valbuf,sizeof(valbuf));
 
-  client_dns_set_addressmap_impl(address, valbuf, exitname, ttl);
+  client_dns_set_addressmap_impl(address, valbuf, exitname, ttl, exclKey);
 }
 
 /** Add a cache entry noting that <b>address</b> (ordinarily a dotted quad)
@@ -899,10 +1570,77 @@ static void client_dns_set_reverse_addressmap(const char *address, const char *v
   size_t len = strlen(address) + 16;
   char *s = tor_malloc(len);
   tor_snprintf(s, len, "REVERSE[%s]", address);
-  client_dns_set_addressmap_impl(s, v, exitname, ttl);
+  client_dns_set_addressmap_impl(s, v, exitname, ttl, EXCLUSIVITY_UNDEFINED);
   tor_free(s);
 }
 
+/** Re-resolve a cached address this many seconds before it expires. */
+#define DNS_PREFETCH_LEAD_TIME 30
+/** Only re-resolve cached addresses that were used at least this many times. */
+#define DNS_PREFETCH_MIN_HITS 3
+/** Don't launch more than this many prefetches at once. */
+#define DNS_PREFETCH_MAX_LAUNCH 8
+
+/** Make a dummy AP connection that resolves <b>address</b> on a circuit that a stream with <b>exclKey</b> could use. Return 0 on success, -1 on failure. */
+static int connection_ap_launch_dns_prefetch(const char *address,DWORD exclKey)
+{	edge_connection_t *conn;
+	conn = edge_connection_new(CONN_TYPE_AP, AF_INET);
+	conn->is_dns_request = 1;
+	conn->is_dns_prefetch = 1;
+	conn->socks_request->command = SOCKS_COMMAND_RESOLVE;
+	conn->socks_request->address = tor_strdup(address);
+	conn->socks_request->original_address = tor_strdup(address);
+	conn->_base.address = tor_strdup("(Tor_internal)");
+	conn->_base.exclKey = exclKey;
+	tor_addr_make_unspec(&conn->_base.addr);
+	if(connection_add(TO_CONN(conn)) < 0)
+	{	connection_free(TO_CONN(conn));
+		return -1;
+	}
+	conn->_base.state = AP_CONN_STATE_CIRCUIT_WAIT;
+	control_event_stream_status(conn, STREAM_EVENT_NEW, 0);
+	if(connection_ap_handshake_attach_circuit(conn) < 0)
+	{	if(!conn->_base.marked_for_close)
+			connection_mark_unattached_ap(conn, END_STREAM_REASON_CANT_ATTACH);
+		return -1;
+	}
+	return 0;
+}
+
+/** Resolve again the client DNS cache entries that were used often and that expire soon, so that the streams that use them next don't have to wait for a new resolve. The new answer replaces the old entry when it arrives. */
+void addressmap_dns_prefetch(time_t now)
+{	smartlist_t *addresses, *keys;
+	if(!addressmap)	return;
+	addresses = smartlist_create();
+	keys = smartlist_create();
+	STRMAP_FOREACH(addressmap, address, addressmap_entry_t *, ent)
+	{	if(smartlist_len(addresses) >= DNS_PREFETCH_MAX_LAUNCH)	break;
+		if(ent->source != ADDRMAPSRC_DNS || ent->prefetching || ent->hits < DNS_PREFETCH_MIN_HITS)	continue;
+		if(ent->expires <= now || ent->expires > now + DNS_PREFETCH_LEAD_TIME)	continue;
+		if(!strcmpstart(address,"REVERSE[") || !strcmpend(address,".exit"))	continue;	/* reverse lookups and lookups at a chosen exit aren't refreshed */
+		ent->prefetching = 1;
+		log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_DNS_PREFETCH),safe_str_client(address),ent->hits);
+		smartlist_add(addresses,tor_strdup(address));
+		smartlist_add(keys,(void *)(uintptr_t)ent->exclKey);
+	} STRMAP_FOREACH_END;
+	SMARTLIST_FOREACH(addresses, char *, address,
+	{	connection_ap_launch_dns_prefetch(address,(DWORD)(uintptr_t)smartlist_get(keys,address_sl_idx));
+		tor_free(address);
+	});
+	smartlist_free(addresses);
+	smartlist_free(keys);
+}
+
+/** Forget which cached addresses were used often, and stop replacing the ones being re-resolved. Called when we change identity, so that the new identity doesn't refresh the addresses that the old one used. */
+void addressmap_dns_prefetch_reset(void)
+{	if(!addressmap)	return;
+	STRMAP_FOREACH(addressmap, address, addressmap_entry_t *, ent)
+	{	(void)address;
+		ent->hits = 0;
+		ent->prefetching = 0;
+	} STRMAP_FOREACH_END;
+}
+
 /* By default, we hand out 127.192.0.1 through 127.254.254.254.
  * These addresses should map to localhost, so even if the
  * application accidentally tried to connect to them directly (not
@@ -917,6 +1655,9 @@ static uint32_t virtual_addr_network = 0x7fc00000u;
 static maskbits_t virtual_addr_netmask_bits = 10;
 /** What's the next virtual address we will hand out? */
 static uint32_t next_virtual_addr    = 0x7fc00000u;
+/** True once next_virtual_addr went through the whole virtual range: after
+ * that, we only hand out addresses from free_virtual_addrs. */
+static int virtual_addrs_wrapped = 0;
 
 /** Read a netmask of the form 127.192.0.0/10 from "val", and check whether
  * it's a valid set of virtual addresses to hand out in response to MAPADDRESS
@@ -950,6 +1691,14 @@ parse_virtual_addr_network(const char *val, int validate_only,
   if (validate_only)
     return 0;
 
+  if (virtual_addr_network != (uint32_t)( addr & (0xfffffffful << (32-bits)) )
+      || virtual_addr_netmask_bits != bits) {
+    /* start over in the new range */
+    virtual_addrs_wrapped = 0;
+    if (free_virtual_addrs)
+      smartlist_clear(free_virtual_addrs);
+    free_virtual_addrs_head = 0;
+  }
   virtual_addr_network = (uint32_t)( addr & (0xfffffffful << (32-bits)) );
   virtual_addr_netmask_bits = bits;
 
@@ -988,8 +1737,55 @@ increment_virtual_addr(void)
 {
   ++next_virtual_addr;
   if (addr_mask_cmp_bits(next_virtual_addr, virtual_addr_network,
-                         virtual_addr_netmask_bits))
+                         virtual_addr_netmask_bits)) {
     next_virtual_addr = virtual_addr_network;
+    virtual_addrs_wrapped = 1;
+  }
+}
+
+/** The mapping from <b>address</b> was removed: if it is a virtual IPv4
+ * address, remember that we can hand it out again. */
+static void
+virtual_addr_release(const char *address)
+{
+  struct in_addr in;
+  uint32_t addr;
+  if (!tor_inet_aton(address, &in))
+    return;
+  addr = ntohl(in.s_addr);
+  if (addr_mask_cmp_bits(addr, virtual_addr_network,
+                         virtual_addr_netmask_bits))
+    return;
+  if (!free_virtual_addrs)
+    free_virtual_addrs = smartlist_create();
+  smartlist_add(free_virtual_addrs, (void*)(uintptr_t)addr);
+}
+
+/** Remove the oldest address from free_virtual_addrs and store it in
+ * *<b>addr_out</b>.  Return 0 if there is none. */
+static int
+virtual_addr_pop_free(uint32_t *addr_out)
+{
+  int n;
+  if (!free_virtual_addrs)
+    return 0;
+  n = smartlist_len(free_virtual_addrs);
+  if (free_virtual_addrs_head >= n) {
+    smartlist_clear(free_virtual_addrs);
+    free_virtual_addrs_head = 0;
+    return 0;
+  }
+  *addr_out = (uint32_t)(uintptr_t)
+    smartlist_get(free_virtual_addrs, free_virtual_addrs_head++);
+  if (free_virtual_addrs_head >= 1024 && free_virtual_addrs_head * 2 >= n) {
+    /* drop the addresses we already used from the start of the list */
+    memmove(free_virtual_addrs->list,
+            free_virtual_addrs->list + free_virtual_addrs_head,
+            (n - free_virtual_addrs_head) * sizeof(void*));
+    free_virtual_addrs->num_used = n - free_virtual_addrs_head;
+    free_virtual_addrs_head = 0;
+  }
+  return 1;
 }
 
 /** Return a newly allocated string holding an address of <b>type</b>
@@ -1012,35 +1808,33 @@ addressmap_get_virtual_address(int type)
     } while (strmap_get(addressmap, buf));
     return tor_strdup(buf);
   } else if (type == RESOLVED_TYPE_IPV4) {
-    // This is an imperfect estimate of how many addresses are available, but
-    // that's ok.
-    uint32_t available = 1u << (32-virtual_addr_netmask_bits);
-    while (available) {
+    uint32_t addr;
+    /* First hand out every address of the range once. */
+    while (!virtual_addrs_wrapped) {
+      addr = next_virtual_addr;
+      increment_virtual_addr();
       /* Don't hand out any .0 or .255 address. */
-      while ((next_virtual_addr & 0xff) == 0 ||
-             (next_virtual_addr & 0xff) == 0xff) {
-        increment_virtual_addr();
-        if (! --available) {
-          log_warn(LD_CONFIG,get_lang_str(LANG_LOG_EDGE_OUT_OF_VIRTUAL_ADDRESSES));
-          return NULL;
-        }
-      }
-      in.s_addr = htonl(next_virtual_addr);
+      if ((addr & 0xff) == 0 || (addr & 0xff) == 0xff)
+        continue;
+      in.s_addr = htonl(addr);
       tor_inet_ntoa(&in, buf, sizeof(buf));
-      if (!strmap_get(addressmap, buf)) {
-        increment_virtual_addr();
-        break;
-      }
-
-      increment_virtual_addr();
-      --available;
-//      log_info(LD_CONFIG,get_lang_str(LANG_LOG_EDGE_ADDRS_AVAILABLE),(int)available);
-      if (!available) {
-        log_warn(LD_CONFIG,get_lang_str(LANG_LOG_EDGE_OUT_OF_VIRTUAL_ADDRESSES));
-        return NULL;
-      }
+      if (!strmap_get(addressmap, buf))
+        return tor_strdup(buf);
     }
-    return tor_strdup(buf);
+    /* Then reuse the addresses of removed mappings, oldest first. The range
+     * may have changed, or the address may have been mapped again by the
+     * configuration or the controller since. */
+    while (virtual_addr_pop_free(&addr)) {
+      if (addr_mask_cmp_bits(addr, virtual_addr_network,
+                             virtual_addr_netmask_bits))
+        continue;
+      in.s_addr = htonl(addr);
+      tor_inet_ntoa(&in, buf, sizeof(buf));
+      if (!strmap_get(addressmap, buf))
+        return tor_strdup(buf);
+    }
+    log_warn(LD_CONFIG,get_lang_str(LANG_LOG_EDGE_OUT_OF_VIRTUAL_ADDRESSES));
+    return NULL;
   } else {
     log_warn(LD_BUG,get_lang_str(LANG_LOG_EDGE_UNSUPPORTED_ADDRESS_TYPE),type);
     return NULL;
@@ -1057,7 +1851,8 @@ addressmap_get_virtual_address(int type)
  * as appropriate.
  **/
 const char *
-addressmap_register_virtual_address(int type, char *new_address)
+addressmap_register_virtual_address(int type, char *new_address,
+                                    addressmap_entry_source_t source)
 {
   char **addrp;
   virtaddress_entry_t *vent;
@@ -1081,6 +1876,7 @@ addressmap_register_virtual_address(int type, char *new_address)
         !strcasecmp(new_address, ent->new_address)) {
       tor_free(new_address);
       tor_assert(!vent_needs_to_be_added);
+      ent->last_used = get_time(NULL);
       return tor_strdup(*addrp);
     } else
       log_warn(LD_BUG,get_lang_str(LANG_LOG_EDGE_INTERNAL_CONFUSION),safe_str_client(new_address), safe_str_client(*addrp), safe_str_client(*addrp),ent?safe_str_client(ent->new_address):"(nothing)");
@@ -1096,7 +1892,9 @@ addressmap_register_virtual_address(int type, char *new_address)
   log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_ADDRESSMAP_REGISTERING_NEW),*addrp,new_address);
   if (vent_needs_to_be_added)
     strmap_set(virtaddress_reversemap, new_address, vent);
-  addressmap_register(*addrp, new_address, 2, ADDRMAPSRC_CONTROLLER);
+  addressmap_register(*addrp, new_address, 2, source);
+  if (type == RESOLVED_TYPE_IPV4)
+    virtaddr_shm_publish(new_address, *addrp);
 
 //#if 0
   {
@@ -1241,8 +2039,13 @@ int connection_ap_handshake_rewrite_and_attach(edge_connection_t *conn,origin_ci
 	time_t map_expires = TIME_MAX;
 	int remapped_to_exit = 0;
 	time_t now = get_time(NULL);
-	int started_without_chosen_exit = strcasecmpend(socks->address, ".exit");
+	int started_without_chosen_exit;
 
+	if(!circ && !cpath && !conn->plugin_remap_done && plugins_remap_async(conn))
+	{	conn->_base.state = AP_CONN_STATE_PLUGIN_WAIT;
+		return 0;
+	}
+	started_without_chosen_exit = strcasecmpend(socks->address, ".exit");
 	orig_address = tor_strdup(socks->address);
 	tor_strlower(socks->address); /* normalize it */
 	if(addressmap_rewrite(&socks->address,&map_expires)) control_event_stream_status(conn, STREAM_EVENT_REMAP,REMAP_STREAM_SOURCE_CACHE);
@@ -1271,7 +2074,7 @@ int connection_ap_handshake_rewrite_and_attach(edge_connection_t *conn,origin_ci
 		if(automap)
 		{	const char *new_addr;
 			char *esc_l;
-			new_addr = addressmap_register_virtual_address(RESOLVED_TYPE_IPV4, tor_strdup(socks->address));
+			new_addr = addressmap_register_virtual_address(RESOLVED_TYPE_IPV4, tor_strdup(socks->address), ADDRMAPSRC_AUTOMAP);
 			if(! new_addr)
 			{	esc_l = escaped_safe_str(socks->address);
 				log_warn(LD_APP,get_lang_str(LANG_LOG_EDGE_UNABLE_TO_AUTOMAP),esc_l);
@@ -1465,6 +2268,10 @@ int connection_ap_handshake_rewrite_and_attach(edge_connection_t *conn,origin_ci
 		else{	tor_fragile_assert();}
 
 		conn->_base.state = AP_CONN_STATE_CIRCUIT_WAIT;
+		if(options->LoopbackExit && !circ && socks->command == SOCKS_COMMAND_CONNECT && !conn->use_begindir)
+		{	tor_free(orig_address);
+			return loopback_exit_attach(conn);
+		}
 		if((circ && connection_ap_handshake_attach_chosen_circuit(conn, circ, cpath) < 0) || (!circ && connection_ap_handshake_attach_circuit(conn) < 0))
 		{	if(!conn->_base.marked_for_close)
 				connection_mark_unattached_ap(conn, END_STREAM_REASON_CANT_ATTACH);
@@ -1494,6 +2301,12 @@ int connection_ap_handshake_rewrite_and_attach(edge_connection_t *conn,origin_ci
 		conn->rend_data = tor_malloc_zero(sizeof(rend_data_t));
 		strlcpy(conn->rend_data->onion_address, onionptr(socks->address),sizeof(conn->rend_data->onion_address));
 		log_info(LD_REND,get_lang_str(LANG_LOG_EDGE_HS_REQUEST),safe_str_client(conn->rend_data->onion_address));
+		/* see if it's one of our own services */
+		r = rend_local_attach(conn);
+		if(r <= 0)
+		{	tor_free(orig_address);
+			return r;
+		}
 		/* see if we already have it cached */
 		r = rend_cache_lookup_entry(conn->rend_data->onion_address, -1, &entry);
 		if(r<0)
@@ -1504,6 +2317,7 @@ int connection_ap_handshake_rewrite_and_attach(edge_connection_t *conn,origin_ci
 		}
 		/* Help predict this next time. We're not sure if it will need a stable circuit yet, but we know we'll need *something*. */
 		rep_hist_note_used_internal(now, 0, 1);
+		circuit_fill_rend_pool(now);
 		/* Look up if we have client authorization for it. */
 		client_auth = rend_client_lookup_service_authorization(conn->rend_data->onion_address);
 		if(client_auth)
@@ -1689,6 +2503,13 @@ static streamid_t get_unique_stream_id_by_circ(origin_circuit_t *circ)
 {	edge_connection_t *tmpconn;
 	streamid_t test_stream_id;
 	uint32_t attempts=0;
+	/* We hand the IDs out in sequence, so until they wrap around they can't clash. Services get streams whose IDs the client picked, so check those. */
+	if(circ->n_stream_ids_issued < (1<<16)-1 && circ->_base.purpose != CIRCUIT_PURPOSE_S_REND_JOINED)
+	{	test_stream_id = circ->next_stream_id++;
+		if(!test_stream_id)	test_stream_id = circ->next_stream_id++;
+		circ->n_stream_ids_issued++;
+		return test_stream_id;
+	}
 	while(++attempts < (1<<16))
 	{	test_stream_id = circ->next_stream_id++;
 		if(test_stream_id)
@@ -1753,11 +2574,152 @@ connection_ap_handshake_send_begin(edge_connection_t *ap_conn)
   ap_conn->package_window = STREAMWINDOW_START;
   ap_conn->deliver_window = STREAMWINDOW_START;
   ap_conn->_base.state = AP_CONN_STATE_CONNECT_WAIT;
+  connection_ap_schedule_expiry(ap_conn);
+  stream_trace_stamp(ap_conn, STREAM_TRACE_BEGIN_SENT);
   log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_HANDSHAKE_ADDR_SENT),ap_conn->_base.s, circ->_base.n_circ_id);
   control_event_stream_status(ap_conn, STREAM_EVENT_SENT_CONNECT, 0);
+
+  ap_conn->may_use_optimistic_data = begin_type == RELAY_COMMAND_BEGIN &&
+    connection_ap_can_use_exit_for_optimistic_data(circ);
+  if (connection_ap_supports_optimistic_data(ap_conn)) {
+    /* Tell the client to go ahead, and send whatever it has queued. */
+    if (!ap_conn->socks_request->has_finished)
+      connection_ap_handshake_socks_reply(ap_conn, NULL, 0, 0);
+    if ((buf_datalen(ap_conn->_base.inbuf) || ap_conn->sending_optimistic_data) &&
+        connection_edge_package_raw_inbuf(ap_conn, 1, NULL) < 0) {
+      connection_mark_for_close(TO_CONN(ap_conn));
+      return -1;
+    }
+  }
   return 0;
 }
 
+/** Return true iff the exit of <b>circ</b> accepts stream data before it
+ * has answered our BEGIN cell and we are configured to send it. */
+static int
+connection_ap_can_use_exit_for_optimistic_data(origin_circuit_t *circ)
+{
+  routerinfo_t *exit;
+  if (!get_options()->OptimisticData)
+    return 0;
+  if (circ->_base.purpose != CIRCUIT_PURPOSE_C_GENERAL ||
+      !circ->build_state || !circ->build_state->chosen_exit)
+    return 0;
+  exit = router_get_by_digest(circ->build_state->chosen_exit->identity_digest);
+  /* Exits before 0.2.3.1-alpha could close streams that got data while
+   * they were still resolving. */
+  return exit && exit->platform &&
+    tor_version_as_new_as(exit->platform, "0.2.3.1-alpha");
+}
+
+/** Return true iff we may package data from <b>conn</b> before its stream
+ * is open. */
+int
+connection_ap_supports_optimistic_data(const edge_connection_t *conn)
+{
+  if (conn->_base.type != CONN_TYPE_AP || !conn->on_circuit ||
+      conn->on_circuit->state != CIRCUIT_STATE_OPEN ||
+      conn->on_circuit->purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return 0;
+  return conn->may_use_optimistic_data;
+}
+
+/** Map from the key returned by connection_ap_resolve_key() to the AP
+ * connection that sent a resolve for it. Other resolve requests with the same
+ * key wait for its answer instead of sending their own RELAY_RESOLVE cell. */
+static strmap_t *pending_resolves = NULL;
+
+/** Return a newly allocated key that identifies the resolve request of
+ * <b>conn</b>: the command, the name, and the exit and process chain that the
+ * request is isolated to. */
+static char *
+connection_ap_resolve_key(edge_connection_t *conn)
+{
+  char *key;
+  tor_asprintf((unsigned char **)&key, "%d %lu %s %s",
+               conn->socks_request->command, (unsigned long)conn->_base.exclKey,
+               conn->chosen_exit_name ? conn->chosen_exit_name : "",
+               conn->socks_request->address);
+  tor_strlower(key);
+  return key;
+}
+
+/** If a resolve for the same key as <b>conn</b> is already waiting for an
+ * answer, make <b>conn</b> wait for that answer too and return 1. Else
+ * return 0. */
+int
+connection_ap_join_pending_resolve(edge_connection_t *conn)
+{
+  edge_connection_t *leader;
+  char *key;
+  if (!pending_resolves || conn->resolve_key)
+    return 0;
+  key = connection_ap_resolve_key(conn);
+  leader = strmap_get(pending_resolves, key);
+  tor_free(key);
+  if (!leader || leader == conn || leader->_base.marked_for_close)
+    return 0;
+  if (!leader->resolve_followers)
+    leader->resolve_followers = smartlist_create();
+  smartlist_add(leader->resolve_followers, conn);
+  conn->resolve_leader = leader;
+  conn->_base.state = AP_CONN_STATE_RESOLVE_WAIT;
+  log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_RESOLVE_JOINED),
+           safe_str_client(conn->socks_request->address),
+           smartlist_len(leader->resolve_followers));
+  return 1;
+}
+
+/** The resolve sent by <b>conn</b> is done: stop sharing it, and give the
+ * same answer to every connection that was waiting for it. */
+static void
+connection_ap_resolve_finished(edge_connection_t *conn, int answer_type,
+                               size_t answer_len, const uint8_t *answer,
+                               int ttl, time_t expires)
+{
+  smartlist_t *followers = conn->resolve_followers;
+  int endreason = (answer_type == RESOLVED_TYPE_IPV4 ||
+                   answer_type == RESOLVED_TYPE_IPV6 ||
+                   answer_type == RESOLVED_TYPE_HOSTNAME) ?
+                  END_STREAM_REASON_DONE : END_STREAM_REASON_RESOLVEFAILED;
+  if (pending_resolves && strmap_get(pending_resolves, conn->resolve_key) == conn) {
+    strmap_remove(pending_resolves, conn->resolve_key);
+    if (strmap_isempty(pending_resolves)) {
+      strmap_free(pending_resolves, NULL);
+      pending_resolves = NULL;
+    }
+  }
+  tor_free(conn->resolve_key);
+  conn->resolve_followers = NULL;
+  if (!followers)
+    return;
+  SMARTLIST_FOREACH(followers, edge_connection_t *, f, {
+    f->resolve_leader = NULL;
+    if (f->_base.marked_for_close)
+      continue;
+    connection_ap_handshake_socks_resolved(f, answer_type, answer_len, answer,
+                                           ttl, expires);
+    connection_mark_unattached_ap(f, endreason |
+                                END_STREAM_REASON_FLAG_ALREADY_SOCKS_REPLIED);
+  });
+  smartlist_free(followers);
+}
+
+/** <b>conn</b> is about to close: if it was waiting for another resolve,
+ * stop waiting; if others were waiting for its resolve, fail them. */
+void
+connection_ap_resolve_detach(edge_connection_t *conn)
+{
+  if (conn->resolve_leader) {
+    if (conn->resolve_leader->resolve_followers)
+      smartlist_remove(conn->resolve_leader->resolve_followers, conn);
+    conn->resolve_leader = NULL;
+  }
+  if (conn->resolve_key)
+    connection_ap_resolve_finished(conn, RESOLVED_TYPE_ERROR_TRANSIENT, 0,
+                                   NULL, -1, -1);
+}
+
 /** Write a relay resolve cell, using destaddr and destport from ap_conn's
  * socks_request field, and send it down circ.
  *
@@ -1832,10 +2794,23 @@ connection_ap_handshake_send_resolve(edge_connection_t *ap_conn)
                            string_addr, payload_len) < 0)
     return -1; /* circuit is closed, don't continue */
 
+  if (!ap_conn->resolve_key) {
+    /* let identical requests wait for our answer; this must be done before
+     * exclKey is changed below. */
+    if (!pending_resolves)
+      pending_resolves = strmap_new();
+    ap_conn->resolve_key = connection_ap_resolve_key(ap_conn);
+    if (!strmap_get(pending_resolves, ap_conn->resolve_key))
+      strmap_set(pending_resolves, ap_conn->resolve_key, ap_conn);
+  }
+
+  if (ap_conn->_base.exclKey != EXCLUSIVITY_INTERNAL)
+    ap_conn->resolve_exclKey = ap_conn->_base.exclKey;
   tor_free(ap_conn->_base.address); /* Maybe already set by dnsserv. */
   ap_conn->_base.address = tor_strdup("(Tor_internal)");
   ap_conn->_base.exclKey = EXCLUSIVITY_INTERNAL;
   ap_conn->_base.state = AP_CONN_STATE_RESOLVE_WAIT;
+  connection_ap_schedule_expiry(ap_conn);
   log_info(LD_APP,get_lang_str(LANG_LOG_EDGE_REVDNS_ADDR_SENT),ap_conn->_base.s,circ->_base.n_circ_id);
   control_event_stream_status(ap_conn, STREAM_EVENT_NEW, 0);
   control_event_stream_status(ap_conn, STREAM_EVENT_SENT_RESOLVE, 0);
@@ -1946,12 +2921,18 @@ connection_ap_handshake_socks_resolved(edge_connection_t *conn,
   char buf[384];
   size_t replylen;
 
+  if (conn->resolve_key)
+    connection_ap_resolve_finished(conn, answer_type, answer_len, answer,
+                                   ttl, expires);
+
   if (ttl >= 0) {
     if (answer_type == RESOLVED_TYPE_IPV4 && answer_len == 4) {
       uint32_t a = ntohl(get_uint32(answer));
       if (a)
         client_dns_set_addressmap(conn->socks_request->address, a,
-                                  conn->chosen_exit_name, ttl);
+                                  conn->chosen_exit_name, ttl,
+                                  conn->_base.exclKey == EXCLUSIVITY_INTERNAL ?
+                                  conn->resolve_exclKey : conn->_base.exclKey);
     } else if (answer_type == RESOLVED_TYPE_HOSTNAME) {
       char *cp = tor_strndup((char*)answer, answer_len);
       client_dns_set_reverse_addressmap(conn->socks_request->address,
@@ -1962,7 +2943,11 @@ connection_ap_handshake_socks_resolved(edge_connection_t *conn,
   }
 
   if (conn->is_dns_request) {
-    if (conn->dns_server_request) {
+    if (conn->is_dns_prefetch) {
+      /* Nobody asked for this one; we only wanted to refresh the cache. */
+      conn->socks_request->has_finished = 1;
+      return;
+    } else if (conn->dns_server_request) {
       /* We had a request on our DNS port: answer it. */
       dnsserv_resolved(conn, answer_type, answer_len, (char*)answer, ttl);
       conn->socks_request->has_finished = 1;
@@ -2227,7 +3212,7 @@ connection_exit_begin_conn(cell_t *cell, circuit_t *circ)
     n_stream->cpath_layer = origin_circ->cpath->prev; /* link it */
 
     /* add it into the linked list of n_streams on this circuit */
-    add_all_streams(circ->hItem,n_stream);
+    tree_add_streams(circ);
     n_stream->next_stream = origin_circ->p_streams;
     n_stream->on_circuit = circ;
     origin_circ->p_streams = n_stream;
@@ -2462,7 +3447,7 @@ connection_exit_connect_dir(edge_connection_t *exitconn)
   }
 
   /* link exitconn to circ, now that we know we can use it. */
-  add_all_streams(circ->_base.hItem,exitconn);
+  tree_add_streams(TO_CIRCUIT(circ));
   exitconn->next_stream = circ->n_streams;
   circ->n_streams = exitconn;
 
@@ -2544,8 +3529,8 @@ connection_ap_can_use_exit(edge_connection_t *conn, routerinfo_t *exit)
     addr_policy_result_t r;
     if (tor_inet_aton(conn->socks_request->address, &in))
       addr = ntohl(in.s_addr);
-    r = compare_addr_to_addr_policy(addr, conn->socks_request->port,
-                                    exit->exit_policy);
+    r = router_compare_addr_to_exit_policy(addr, conn->socks_request->port,
+                                           exit);
     if (r == ADDR_POLICY_REJECTED)
       return 0; /* We know the address, and the exit policy rejects it. */
     if (r == ADDR_POLICY_PROBABLY_REJECTED && !conn->chosen_exit_name)
@@ -2567,6 +3552,10 @@ connection_ap_can_use_exit(edge_connection_t *conn, routerinfo_t *exit)
     /* Not a suitable exit. Refuse it. */
     return 0;
   }
+  /* The user didn't ask for this node, and it failed for this destination
+   * a moment ago. */
+  if (!conn->chosen_exit_name && connection_ap_exit_failed_before(conn, exit))
+    return 0;
   return 1;
 }
 
@@ -26,8 +26,11 @@ int connection_edge_end_errno(edge_connection_t *conn);
 int connection_edge_flushed_some(edge_connection_t *conn);
 int connection_edge_finished_flushing(edge_connection_t *conn);
 int connection_edge_finished_connecting(edge_connection_t *conn);
+void connection_edge_coalesce_cancel(edge_connection_t *conn);
+void connection_edge_coalesce_free_all(void);
 
 int connection_ap_handshake_send_begin(edge_connection_t *ap_conn);
+int connection_ap_supports_optimistic_data(const edge_connection_t *conn);
 int connection_ap_handshake_send_resolve(edge_connection_t *ap_conn);
 
 edge_connection_t  *connection_ap_make_link(char *address, uint16_t port,
@@ -48,6 +51,13 @@ int connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ);
 void connection_exit_connect(edge_connection_t *conn);
 int connection_edge_is_rendezvous_stream(edge_connection_t *conn);
 int connection_ap_can_use_exit(edge_connection_t *conn, routerinfo_t *exit);
+void connection_ap_schedule_expiry(edge_connection_t *conn);
+void connection_ap_mark_as_pending_circuit(edge_connection_t *conn);
+void connection_ap_forget_pending(edge_connection_t *conn);
+void connection_ap_pending_free_all(void);
+void connection_ap_note_exit_failure(edge_connection_t *conn,
+                                     const char *exit_digest, int reason);
+void connection_ap_exit_failures_clear(void);
 void connection_ap_expire_beginning(void);
 void connection_ap_attach_pending(void);
 void connection_ap_fail_onehop(const char *failed_digest,
@@ -66,6 +76,7 @@ void addressmap_clear_invalid_automaps(or_options_t *options);
 void addressmap_clean(time_t now);
 void addressmap_clear_configured(void);
 void addressmap_clear_transient(void);
+void addressmap_shrink(void);
 void addressmap_free_all(void);
 int addressmap_rewrite(char **address, time_t *expires_out);
 int addressmap_have_mapping(const char *address, int update_timeout);
@@ -77,8 +88,13 @@ int parse_virtual_addr_network(const char *val, int validate_only,
 int client_dns_incr_failures(const char *address);
 void client_dns_clear_failures(const char *address);
 void client_dns_set_addressmap(const char *address, uint32_t val,
-                               const char *exitname, int ttl) __attribute__ ((format(ms_printf, 1, 0)));
-const char *addressmap_register_virtual_address(int type, char *new_address);
+                               const char *exitname, int ttl, DWORD exclKey) __attribute__ ((format(ms_printf, 1, 0)));
+void addressmap_dns_prefetch(time_t now);
+void addressmap_dns_prefetch_reset(void);
+const char *addressmap_register_virtual_address(int type, char *new_address,
+                                        addressmap_entry_source_t source);
+int connection_ap_join_pending_resolve(edge_connection_t *conn);
+void connection_ap_resolve_detach(edge_connection_t *conn);
 void addressmap_get_mappings(smartlist_t *sl, time_t min_expires,
                              time_t max_expires, int want_expiry);
 int connection_ap_rewrite_and_attach_if_allowed(edge_connection_t *conn,
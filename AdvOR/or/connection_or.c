@@ -24,6 +24,7 @@
 #include "networkstatus.h"
 #include "reasons.h"
 #include "relay.h"
+#include "relaycrypt.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
@@ -140,9 +141,6 @@ connection_or_set_identity_digest(or_connection_t *conn, const char *digest)
 /** Pack the cell_t host-order structure <b>src</b> into network-order
  * in the buffer <b>dest</b>. See tor-spec.txt for details about the
  * wire format.
- *
- * Note that this function doesn't touch <b>dst</b>-\>next: the caller
- * should set it or clear it as appropriate.
  */
 void
 cell_pack(packed_cell_t *dst, const cell_t *src)
@@ -153,17 +151,6 @@ cell_pack(packed_cell_t *dst, const cell_t *src)
   memcpy(dest+3, src->payload, CELL_PAYLOAD_SIZE);
 }
 
-/** Unpack the network-order buffer <b>src</b> into a host-order
- * cell_t structure <b>dest</b>.
- */
-static void
-cell_unpack(cell_t *dest, const char *src)
-{
-  dest->circ_id = ntohs(get_uint16(src));
-  dest->command = *(uint8_t*)(src+2);
-  memcpy(dest->payload, src+3, CELL_PAYLOAD_SIZE);
-}
-
 /** Write the header of <b>cell</b> into the first VAR_CELL_HEADER_SIZE
  * bytes of <b>hdr_out</b>. */
 void
@@ -296,6 +283,7 @@ connection_or_finished_flushing(or_connection_t *conn)
     case OR_CONN_STATE_OPEN:
     case OR_CONN_STATE_OR_HANDSHAKING:
       connection_stop_writing(TO_CONN(conn));
+      conn->timestamp_lastempty = approx_time();
       break;
     default:
       log_err(LD_BUG,get_lang_str(LANG_LOG_CONN_OR_FINISHED_FLUSHING_UNEXPECTED),conn->_base.state);
@@ -312,6 +300,13 @@ int connection_or_finished_connecting(or_connection_t *or_conn)
 	conn = TO_CONN(or_conn);
 	tor_assert(conn->state == OR_CONN_STATE_CONNECTING);
 	log_debug(LD_HANDSHAKE,get_lang_str(LANG_LOG_CONN_OR_FINISHED_CONNECTING),conn->address,conn->port);
+	if(or_conn->rtt_probe_started.tv_sec)	/* connecting took one round trip */
+	{	struct timeval now;
+		tor_gettimeofday(&now);
+		or_conn->rtt_msec = (int)tv_mdiff(&or_conn->rtt_probe_started, &now);
+		if(or_conn->rtt_msec <= 0)	or_conn->rtt_msec = 1;
+		or_conn->rtt_probe_started.tv_sec = 0;
+	}
 	control_event_bootstrap(BOOTSTRAP_STATUS_HANDSHAKE, 0);
 	if((get_options()->DirFlags&DIR_FLAG_NTLM_PROXY) && get_options()->CorporateProxy)
 	{	if(connection_proxy_connect(conn,1) < 0)
@@ -484,6 +479,81 @@ connection_or_is_better(time_t now,
   return 0;
 }
 
+/** Note that <b>n</b> bytes were just read or written on <b>conn</b>, for
+ * connection_or_get_load(). */
+void
+connection_or_note_traffic(or_connection_t *conn, size_t n, time_t now)
+{
+  if (now != conn->recent_bytes_at) {
+    time_t elapsed = now - conn->recent_bytes_at;
+    conn->recent_bytes = (elapsed > 0 && elapsed < 32) ?
+      conn->recent_bytes >> elapsed : 0;
+    conn->recent_bytes_at = now;
+  }
+  if (n >= UINT32_MAX - conn->recent_bytes)
+    conn->recent_bytes = UINT32_MAX;
+  else
+    conn->recent_bytes += (uint32_t)n;
+}
+
+/** Return how busy <b>conn</b> is, in cells: the cells on its outbuf and in
+ * the queues of its circuits, the cells it carried in the last second or
+ * two, and one for each of its circuits. */
+static int
+connection_or_get_load(or_connection_t *conn, time_t now)
+{
+  uint32_t recent = conn->recent_bytes;
+  time_t elapsed = now - conn->recent_bytes_at;
+  if (elapsed)
+    recent = (elapsed > 0 && elapsed < 32) ? recent >> elapsed : 0;
+  return (int)(buf_datalen(conn->_base.outbuf) / CELL_NETWORK_SIZE) +
+    connection_or_count_queued_cells(conn) +
+    (int)(recent / CELL_NETWORK_SIZE) + conn->n_circuits;
+}
+
+/** Return true iff <b>a</b> is a better connection than <b>b</b> for a new
+ * circuit.  Of two connections that are both canonical or both not, the one
+ * with the lower load is better, so that one connection doesn't end up
+ * with most of the circuits; we fall back on connection_or_is_better() if
+ * they are equally loaded. */
+static int
+connection_or_is_better_for_circ(time_t now, or_connection_t *a,
+                                 or_connection_t *b)
+{
+  int load_a, load_b;
+  if (a->is_canonical != b->is_canonical)
+    return a->is_canonical;
+  load_a = connection_or_get_load(a, now);
+  load_b = connection_or_get_load(b, now);
+  if (load_a != load_b)
+    return load_a < load_b;
+  return connection_or_is_better(now, a, b, 0);
+}
+
+/** Return how many connections to the router whose identity is
+ * <b>digest</b> we could attach new circuits to, including the ones that
+ * are not open yet.  If <b>n_circuits_out</b> is not NULL, set it to how
+ * many circuits the open ones carry. */
+int
+connection_or_count_for_circs(const char *digest, int *n_circuits_out)
+{
+  or_connection_t *conn;
+  int n = 0, n_circuits = 0;
+  conn = orconn_identity_map ? digestmap_get(orconn_identity_map, digest) :
+    NULL;
+  for (; conn; conn = conn->next_with_same_id) {
+    if (conn->_base.marked_for_close || conn->is_bad_for_new_circs ||
+        conn->is_connection_with_client)
+      continue;
+    ++n;
+    if (conn->_base.state == OR_CONN_STATE_OPEN)
+      n_circuits += conn->n_circuits;
+  }
+  if (n_circuits_out)
+    *n_circuits_out = n_circuits;
+  return n;
+}
+
 /** Return the OR connection we should use to extend a circuit to the router
  * whose identity is <b>digest</b>, and whose address we believe (or have been
  * told in an extend cell) is <b>target_addr</b>.  If there is no good
@@ -556,7 +626,7 @@ connection_or_get_for_extend(const char *digest,
       continue;
     }
 
-    if (connection_or_is_better(now, conn, best, 0))
+    if (connection_or_is_better_for_circ(now, conn, best))
       best = conn;
   }
 
@@ -593,6 +663,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
 {
   or_connection_t *or_conn = NULL, *best = NULL;
   int n_old = 0, n_inprogress = 0, n_canonical = 0, n_other = 0;
+  int n_keep = 1;
   time_t now = get_time(NULL);
 
   /* Pass 1: expire everything that's old, and see what the status of
@@ -606,6 +677,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
         < now) {
       log_info(LD_OR,get_lang_str(LANG_LOG_CONN_OR_CONN_TOO_OLD),or_conn->_base.address,or_conn->_base.port,or_conn->_base.s,(int)(now - or_conn->_base.timestamp_created));
       or_conn->is_bad_for_new_circs = 1;
+      connection_housekeeping_reschedule(TO_CONN(or_conn));
     }
 
     if (or_conn->is_bad_for_new_circs) {
@@ -633,6 +705,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
        * and this one is open but not canonical.  Mark it bad. */
       log_info(LD_OR,get_lang_str(LANG_LOG_CONN_OR_CONN_TOO_OLD_2),or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,(int)(now - or_conn->_base.timestamp_created));
       or_conn->is_bad_for_new_circs = 1;
+      connection_housekeeping_reschedule(TO_CONN(or_conn));
       continue;
     }
 
@@ -643,6 +716,13 @@ connection_or_group_set_badness(or_connection_t *head, int force)
   if (!best)
     return;
 
+  /* PrimaryGuardConnections asks for more than one canonical connection to
+   * our first entry guard. */
+  if (best->is_canonical && n_canonical > 1 &&
+      get_options()->PrimaryGuardConnections > 1 &&
+      entry_guard_is_primary(best->identity_digest))
+    n_keep = get_options()->PrimaryGuardConnections;
+
   /* Pass 3: One connection to OR is best.  If it's canonical, mark as bad
    * every other open connection.  If it's non-canonical, mark as bad
    * every other open connection to the same address.
@@ -665,13 +745,17 @@ connection_or_group_set_badness(or_connection_t *head, int force)
     if (or_conn != best && connection_or_is_better(now, best, or_conn, 1)) {
       /* This isn't the best conn, _and_ the best conn is better than it,
          even when we're being forgiving. */
-      if (best->is_canonical) {
+      if (best->is_canonical && or_conn->is_canonical && n_keep > 1) {
+        --n_keep;
+      } else if (best->is_canonical) {
         log_info(LD_OR,get_lang_str(LANG_LOG_CONN_OR_CONN_TOO_OLD_3),or_conn->_base.address,or_conn->_base.port, or_conn->_base.s,(int)(now - or_conn->_base.timestamp_created),best->_base.s,(int)(now - best->_base.timestamp_created));
         or_conn->is_bad_for_new_circs = 1;
+        connection_housekeeping_reschedule(TO_CONN(or_conn));
       } else if (!tor_addr_compare(&or_conn->real_addr,
                                    &best->real_addr, CMP_EXACT)) {
         log_info(LD_OR,get_lang_str(LANG_LOG_CONN_OR_CONN_TOO_OLD_4),or_conn->_base.address,or_conn->_base.port,or_conn->_base.s,(int)(now - or_conn->_base.timestamp_created),best->_base.s,(int)(now - best->_base.timestamp_created));
         or_conn->is_bad_for_new_circs = 1;
+        connection_housekeeping_reschedule(TO_CONN(or_conn));
       }
     }
   }
@@ -771,6 +855,7 @@ connection_or_connect(const tor_addr_t *_addr, uint16_t port,
     port = options->ORProxyPort;
   }
 
+  tor_gettimeofday(&conn->rtt_probe_started);
   switch (connection_connect(TO_CONN(conn), conn->_base.address,
                              &addr, port, &socket_error)) {
     case -1:
@@ -812,6 +897,8 @@ int
 connection_tls_start_handshake(or_connection_t *conn, int receiving)
 {
   conn->_base.state = OR_CONN_STATE_TLS_HANDSHAKING;
+  if (receiving)
+    tor_gettimeofday(&conn->rtt_probe_started);
   conn->tls = tor_tls_new(conn->_base.s, receiving);
   char *esc_l = escaped_safe_str(conn->_base.address);
   tor_tls_set_logged_address(conn->tls,esc_l);
@@ -820,6 +907,10 @@ connection_tls_start_handshake(or_connection_t *conn, int receiving)
     log_warn(LD_BUG,get_lang_str(LANG_LOG_CONN_OR_TOR_TLS_NEW_FAILED));
     return -1;
   }
+  /* We reconnect to our guards far more than to anybody else, so let those
+   * connections resume their last TLS session. */
+  if (!receiving && is_an_entry_guard(conn->identity_digest))
+    tor_tls_set_session_digest(conn->tls, conn->identity_digest);
   connection_start_reading(TO_CONN(conn));
   log_debug(LD_OR,get_lang_str(LANG_LOG_CONN_OR_TLS_HANDSHAKE_START), conn->_base.s);
   note_crypto_pk_op(receiving ? TLS_HANDSHAKE_S : TLS_HANDSHAKE_C);
@@ -1063,6 +1154,13 @@ connection_tls_finish_handshake(or_connection_t *conn)
                                               digest_rcvd) < 0)
     return -1;
 
+  if (started_here) {
+    if (tor_tls_session_was_resumed(conn->tls))
+      log_debug(LD_HANDSHAKE,get_lang_str(LANG_LOG_CONN_OR_TLS_SESSION_RESUMED),
+                safe_str_client(conn->_base.address));
+    tor_tls_save_session(conn->tls);
+  }
+
   circuit_build_times_network_is_live(&circ_times);
 
   if (tor_tls_used_v1_handshake(conn->tls)) {
@@ -1116,6 +1214,17 @@ connection_or_set_state_open(or_connection_t *conn)
   time_t now = get_time(NULL);
   conn->_base.state = OR_CONN_STATE_OPEN;
   control_event_or_conn_status(conn, OR_CONN_EVENT_CONNECTED, 0);
+  if (!conn->rtt_msec && conn->rtt_probe_started.tv_sec) {
+    /* We didn't time a connect: the handshake we answered took about two
+     * round trips. */
+    struct timeval tv_now;
+    tor_gettimeofday(&tv_now);
+    conn->rtt_msec = (int)(tv_mdiff(&conn->rtt_probe_started, &tv_now) / 2);
+    if (conn->rtt_msec <= 0)
+      conn->rtt_msec = 1;
+    conn->rtt_probe_started.tv_sec = 0;
+  }
+  connection_housekeeping_reschedule(TO_CONN(conn));
 
   if (started_here) {
     circuit_build_times_network_is_live(&circ_times);
@@ -1198,10 +1307,75 @@ connection_fetch_var_cell_from_buf(or_connection_t *conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->_base.inbuf, out, conn->link_proto);
 }
 
+/** See whether there's a whole fixed-length cell waiting on <b>conn</b>'s
+ * inbuf, and if so, remove it into <b>out</b> and return 1.  Return 0 if
+ * there isn't one yet. */
+static int
+connection_fetch_cell_from_buf(or_connection_t *conn, cell_t *out)
+{
+  if (!fetch_cell_from_buf(conn->_base.inbuf, out))
+    return 0;
+  if (conn->_base.processed_from_inbuf >= CELL_NETWORK_SIZE)
+    conn->_base.processed_from_inbuf -= CELL_NETWORK_SIZE;
+  else
+    conn->_base.processed_from_inbuf = 0;
+  return 1;
+}
+
+/** Pull up to RELAYCRYPT_BATCH_CELLS cells off <b>conn</b>'s inbuf, stopping
+ * after the first one that isn't a relay cell, and let the relay crypto
+ * workers crypt the relay cells among them in parallel.  Then process the
+ * cells in the order they arrived, followed by the variable-length cell
+ * that ended the batch, if any.
+ *
+ * Return 0 if there are no more whole cells on the inbuf, else 1.
+ */
+static int
+connection_or_process_cell_batch(or_connection_t *conn)
+{
+  cell_t cells[RELAYCRYPT_BATCH_CELLS];
+  relay_precrypt_t precrypt[RELAYCRYPT_BATCH_CELLS];
+  var_cell_t *var_cell = NULL;
+  int n = 0, i, more = 1;
+
+  while (n < RELAYCRYPT_BATCH_CELLS) {
+    /* Any other command may create, destroy or renumber circuits, so it
+     * has to be the last cell whose circuit we look up ahead of time. */
+    if (n && cells[n-1].command != CELL_RELAY &&
+        cells[n-1].command != CELL_RELAY_EARLY)
+      break;
+    if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+      if (!var_cell)
+        more = 0; /* not yet. */
+      break;
+    }
+    if (!connection_fetch_cell_from_buf(conn, &cells[n])) {
+      more = 0; /* not yet */
+      break;
+    }
+    ++n;
+  }
+
+  if (n) {
+    circuit_build_times_network_is_live(&circ_times);
+    relaycrypt_prepare_cells(conn, cells, precrypt, n);
+    for (i = 0; i < n; ++i)
+      command_process_precrypted_cell(&cells[i], conn, &precrypt[i]);
+  }
+  if (var_cell) {
+    circuit_build_times_network_is_live(&circ_times);
+    command_process_var_cell(var_cell, conn);
+    var_cell_free(var_cell);
+  }
+  return more;
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * and hand it to command_process_cell().  Once the connection is open and
+ * relay crypto workers are running, take the cells in batches instead;
+ * see connection_or_process_cell_batch().
  *
  * Always return 0.
  */
@@ -1212,6 +1386,11 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
 
   while (1) {
     log_debug(LD_OR,get_lang_str(LANG_LOG_CONN_OR_PROCESS_CELLS_FROM_INBUF),conn->_base.s,(int)buf_datalen(conn->_base.inbuf),tor_tls_get_pending_bytes(conn->tls));
+    if (relaycrypt_is_enabled() && conn->_base.state == OR_CONN_STATE_OPEN) {
+      if (!connection_or_process_cell_batch(conn))
+        return 0;
+      continue;
+    }
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
         return 0; /* not yet. */
@@ -1219,19 +1398,13 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       command_process_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      char buf[CELL_NETWORK_SIZE];
       cell_t cell;
-      if (buf_datalen(conn->_base.inbuf) < CELL_NETWORK_SIZE) /* whole response
-                                                                 available? */
+      /* Decode the cell straight out of the inbuf into the host-order
+       * struct, if the whole cell is available. */
+      if (!connection_fetch_cell_from_buf(conn, &cell))
         return 0; /* not yet */
 
       circuit_build_times_network_is_live(&circ_times);
-      connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf);
-
       command_process_cell(&cell, conn);
     }
   }
@@ -19,6 +19,8 @@ or_connection_t *connection_or_get_for_extend(const char *digest,
                                               const char **msg_out,
                                               int *launch_out);
 void connection_or_set_bad_connections(const char *digest, int force);
+void connection_or_note_traffic(or_connection_t *conn, size_t n, time_t now);
+int connection_or_count_for_circs(const char *digest, int *n_circuits_out);
 
 int connection_or_reached_eof(or_connection_t *conn);
 int connection_or_process_inbuf(or_connection_t *conn);
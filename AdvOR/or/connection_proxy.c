@@ -161,9 +161,16 @@ int connection_proxy_connect(connection_t *conn,int ntlm)
 	options = get_options();
 	if(ntlm)
 	{	unsigned char *buf;
+		char addrbuf[TOR_ADDR_BUF_LEN];
+		const tor_addr_t *addr = &conn->addr;
 		if(options->DirFlags&DIR_FLAG_HTTPS_PROXY && options->ORProxy)
-			tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr(&options->ORProxyAddr), conn->port);
-		else	tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr(&conn->addr), conn->port);
+			addr = &options->ORProxyAddr;
+		if(conn->proxy_auth)	/* pooled connection, answer the challenge it already received */
+		{	log_info(LD_NET,get_lang_str(LANG_LOG_NTLM_POOL_USED),fmt_addr_buf(addrbuf,addr),conn->port);
+			tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\nAuthorization: NTLM %s\r\n\r\n",fmt_addr_buf(addrbuf,addr),conn->port,conn->proxy_auth);
+			tor_free(conn->proxy_auth);
+		}
+		else	tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr_buf(addrbuf,addr), conn->port);
 		connection_write_to_buf((char *)buf,strlen((char *)buf), conn);
 		tor_free(buf);
 		conn->proxy_state = PROXY_NTLM_WANT_CONNECT_OK;
@@ -173,6 +180,8 @@ int connection_proxy_connect(connection_t *conn,int ntlm)
 		switch(type)
 		{	case PROXY_CONNECT:
 			{	char buf[1024];
+				char addrbuf[TOR_ADDR_BUF_LEN];
+				const char *address = fmt_addr_buf(addrbuf,&conn->addr);
 				char *base64_authenticator=NULL;
 				const char *authenticator = options->ORProxyAuthenticator;
 				/* Send HTTP CONNECT and authentication (if available) in one request */
@@ -181,11 +190,11 @@ int connection_proxy_connect(connection_t *conn,int ntlm)
 					if(!base64_authenticator)	log_warn(LD_OR,get_lang_str(LANG_LOG_CONNECTION_ENCODING_HTTPS_AUTH_FAILED));
 				}
 				if(base64_authenticator)
-				{	tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\nProxy-Authorization: Basic %s\r\n\r\n",fmt_addr(&conn->addr),conn->port,fmt_addr(&conn->addr),conn->port,base64_authenticator);
+				{	tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\nProxy-Authorization: Basic %s\r\n\r\n",address,conn->port,address,conn->port,base64_authenticator);
 					tor_free(base64_authenticator);
 				}
 				else
-					tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr(&conn->addr), conn->port);
+					tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.0\r\n\r\n",address, conn->port);
 				connection_write_to_buf(buf, strlen(buf), conn);
 				conn->proxy_state = PROXY_HTTPS_WANT_CONNECT_OK;
 				break;
@@ -245,9 +254,16 @@ int dir_proxy_connect(connection_t *conn,int ntlm)
 	options = get_options();
 	if(ntlm)
 	{	unsigned char *buf;
+		char addrbuf[TOR_ADDR_BUF_LEN];
+		const tor_addr_t *addr = &conn->addr;
 		if(options->DirFlags&DIR_FLAG_HTTP_PROXY && options->DirProxy)
-			tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr(&options->DirProxyAddr), conn->port);
-		else	tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr(&conn->addr), conn->port);
+			addr = &options->DirProxyAddr;
+		if(conn->proxy_auth)	/* pooled connection, answer the challenge it already received */
+		{	log_info(LD_NET,get_lang_str(LANG_LOG_NTLM_POOL_USED),fmt_addr_buf(addrbuf,addr),conn->port);
+			tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\nAuthorization: NTLM %s\r\n\r\n",fmt_addr_buf(addrbuf,addr),conn->port,conn->proxy_auth);
+			tor_free(conn->proxy_auth);
+		}
+		else	tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr_buf(addrbuf,addr), conn->port);
 		connection_write_to_buf((char *)buf,strlen((char *)buf), conn);
 		tor_free(buf);
 		conn->proxy_state = PROXY_NTLM_WANT_CONNECT_OK;
@@ -257,6 +273,8 @@ int dir_proxy_connect(connection_t *conn,int ntlm)
 		switch(type)
 		{	case PROXY_CONNECT:
 			{	char buf[1024];
+				char addrbuf[TOR_ADDR_BUF_LEN];
+				const char *address = fmt_addr_buf(addrbuf,&conn->addr);
 				char *base64_authenticator=NULL;
 				const char *authenticator = options->DirProxyAuthenticator;
 				/* Send HTTP CONNECT and authentication (if available) in one request */
@@ -265,11 +283,11 @@ int dir_proxy_connect(connection_t *conn,int ntlm)
 					if(!base64_authenticator)	log_warn(LD_OR,get_lang_str(LANG_LOG_CONNECTION_ENCODING_HTTPS_AUTH_FAILED));
 				}
 				if(base64_authenticator)
-				{	tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.1\r\nProxy-Authorization: Basic %s\r\n\r\n",fmt_addr(&conn->addr),conn->port, base64_authenticator);
+				{	tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.1\r\nProxy-Authorization: Basic %s\r\n\r\n",address,conn->port, base64_authenticator);
 					tor_free(base64_authenticator);
 				}
 				else
-					tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.0\r\n\r\n",fmt_addr(&conn->addr), conn->port);
+					tor_snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.0\r\n\r\n",address, conn->port);
 				connection_write_to_buf(buf, strlen(buf), conn);
 				conn->proxy_state = PROXY_HTTPS_WANT_CONNECT_OK;
 				break;
@@ -395,12 +413,382 @@ static int connection_read_https_proxy_response(connection_t *conn)
 	return -1;
 }
 
+/** Remove the line breaks that base64_encode() inserted in <b>s</b>. */
+static void ntlm_strip_crlf(char *s)
+{	int i,j = 0;
+	for(i=0;s[i];i++)
+	{	if(s[i]!=13 && s[i]!=10)
+			s[j++] = s[i];
+	}
+	s[j] = 0;
+}
+
+/** Write the base64 encoded NTLM negotiation message (type 1) for the "workstation@domain" string <b>proxydomain</b> to <b>out</b>. */
+static void ntlm_build_negotiate(char *out,size_t outlen,const char *proxydomain)
+{	tSmbNtlmAuthRequest request;
+	char *workstation,*domain = NULL;
+	int i,j;
+	workstation = tor_malloc_zero(256);
+	if(proxydomain)
+	{	domain = tor_malloc_zero(256);
+		for(i=0;proxydomain[i] && proxydomain[i]!='@' && i < 255;i++)
+			workstation[i] = proxydomain[i];
+		workstation[i] = 0;
+		if(proxydomain[i])
+		{	i++;
+			for(j=0;proxydomain[i+j] && j<255;j++)
+				domain[j] = proxydomain[i+j];
+			domain[j] = 0;
+		}
+		else
+		{	strcpy(domain,workstation);
+			gethostname(workstation,255);
+		}
+	}
+	else	gethostname(workstation,255);
+	tor_strupper(workstation);
+	if(domain)	tor_strupper(domain);
+	buildSmbNtlmAuthRequest(&request,workstation,domain);
+	tor_free(workstation);
+	if(domain)	tor_free(domain);
+	base64_encode(out,outlen,(char *)&request,SmbLength(&request),0);
+	ntlm_strip_crlf(out);
+}
+
+/** Write the base64 encoded NTLM authentication message (type 3) that answers the base64 encoded <b>challenge</b> with the "user:pass" string <b>authenticator</b> to <b>out</b>. */
+static void ntlm_build_response(char *out,size_t outlen,const char *challengestr,const char *authenticator)
+{	tSmbNtlmAuthChallenge challenge;
+	tSmbNtlmAuthResponse  response;
+	int i,j;
+	char *user = tor_malloc(256);
+	char *pass = tor_malloc(256);
+	memset(&challenge,0,sizeof(challenge));
+	base64_decode((char *)&challenge,sizeof(tSmbNtlmAuthChallenge),challengestr,strlen(challengestr));
+	user[0] = pass[0] = 0;
+	if(authenticator)
+	{	for(i=0;authenticator[i] && authenticator[i]!=':' && i<255;i++)
+			user[i] = authenticator[i];
+		user[i] = 0;
+		if(authenticator[i]==':')	i++;
+		for(j=0;authenticator[i+j] && j < 255;j++)
+			pass[j] = authenticator[i+j];
+		pass[j] = 0;
+	}
+	buildSmbNtlmAuthResponse(&challenge,&response,user,pass);
+	tor_free(user);tor_free(pass);
+	base64_encode(out,outlen,(char *)&response,SmbLength(&response),0);
+	ntlm_strip_crlf(out);
+}
+
+/** If the header line <b>s</b> is a "WWW-Authenticate: NTLM ..." or "Proxy-Authenticate: NTLM ..." header, return a pointer to the NTLM data (which is empty when the proxy only asks for NTLM). Return NULL otherwise. */
+static const char *ntlm_find_challenge(const char *s)
+{	if(!strcasecmpstart(s,"www-authenticate:"))		s += 17;
+	else if(!strcasecmpstart(s,"proxy-authenticate:"))	s += 19;
+	else	return NULL;
+	while(*s==32)	s++;
+	if(strcasecmpstart(s,"ntlm"))	return NULL;
+	s += 4;
+	while(*s==32)	s++;
+	return s;
+}
+
+/* Pool of idle connections to the corporate proxy that went through the first half of the NTLM handshake. NTLM authenticates the TCP connection and a CONNECT tunnel is bound to one destination, so the pool thread stops after it received the proxy challenge and keeps the prepared answer with the socket. A new OR or directory connection that takes a pooled socket sends its own CONNECT together with that answer, which costs one round trip instead of three. */
+/** How long a connection can wait in the pool before we assume the proxy closed it. */
+#define PROXY_POOL_MAX_AGE 30
+/** Socket timeout used by the pool thread, in seconds. */
+#define PROXY_POOL_TIMEOUT 20
+/** How long the pool thread waits after a failed attempt, in seconds. */
+#define PROXY_POOL_RETRY 30
+/** How long proxy_pool_free_all() waits for the pool thread, in milliseconds; a blocking connect() or two receive timeouts. */
+#define PROXY_POOL_JOIN_TIMEOUT ((PROXY_POOL_TIMEOUT * 2 + 30) * 1000)
+
+typedef struct proxy_pool_ent_t
+{	tor_socket_t s;
+	/** Base64 encoded NTLM response for the challenge received on <b>s</b>. */
+	char *auth;
+	time_t created;
+} proxy_pool_ent_t;
+
+/** Protects every proxy_pool_* variable below, which are shared with the pool thread. */
+static tor_mutex_t *proxy_pool_mutex = NULL;
+/** List of proxy_pool_ent_t that are ready to use. */
+static smartlist_t *proxy_pool = NULL;
+/** Copies of the proxy settings, so the pool thread never reads the options. */
+static tor_addr_t proxy_pool_addr;
+static uint16_t proxy_pool_port = 0;
+static char *proxy_pool_target = NULL;
+static char *proxy_pool_authenticator = NULL;
+static char *proxy_pool_domain = NULL;
+static int proxy_pool_size = 0;
+/** Incremented when the settings change, so that a connection authenticated with old settings is dropped. */
+static int proxy_pool_generation = 0;
+static int proxy_pool_thread_running = 0;
+static int proxy_pool_shutdown = 0;
+/** Manual-reset event that proxy_pool_free_all() sets to stop the pool thread. */
+static HANDLE proxy_pool_stop = NULL;
+/** Manual-reset event that the pool thread sets when it exits. */
+static HANDLE proxy_pool_done = NULL;
+
+static void proxy_pool_ent_free(proxy_pool_ent_t *ent)
+{	if(SOCKET_OK(ent->s))	tor_close_socket(ent->s);
+	tor_free(ent->auth);
+	tor_free(ent);
+}
+
+/** Send all of <b>buf</b> on the blocking socket <b>s</b>. Return 0 on success, -1 on error. */
+static int proxy_pool_send(tor_socket_t s,const char *buf,size_t len)
+{	int n;
+	while(len)
+	{	n = tor_socket_send(s,buf,len,0);
+		if(n <= 0)	return -1;
+		buf += n;len -= n;
+	}
+	return 0;
+}
+
+/** Open a blocking connection to the proxy at <b>addr</b>:<b>port</b>, send a CONNECT request for <b>target</b> with an NTLM negotiation message and read the challenge. Return a pool entry with the non-blocking socket and the answer to the challenge, or NULL on failure. */
+static proxy_pool_ent_t *proxy_pool_open(const tor_addr_t *addr,uint16_t port,const char *target,const char *authenticator,const char *domain)
+{	char addrbuf[256];
+	struct sockaddr *dest_addr = (struct sockaddr *)addrbuf;
+	socklen_t dest_addr_len;
+	char *request,*headers,*body;
+	const char *challenge = NULL;
+	const char *err = "connection failed";
+	size_t len = 0;
+	int n,keepalive = 1;
+	unsigned int n1,status_code;
+	long content_length = 0;
+	proxy_pool_ent_t *ent = NULL;
+	DWORD timeout = PROXY_POOL_TIMEOUT * 1000;
+	tor_socket_t s;
+	s = tor_open_socket(tor_addr_family(addr) == AF_INET6 ? PF_INET6 : PF_INET,SOCK_STREAM,IPPROTO_TCP);
+	if(s < 0)	return NULL;
+	setsockopt(s,SOL_SOCKET,SO_RCVTIMEO,(const char *)&timeout,sizeof(timeout));
+	setsockopt(s,SOL_SOCKET,SO_SNDTIMEO,(const char *)&timeout,sizeof(timeout));
+	memset(addrbuf,0,sizeof(addrbuf));
+	dest_addr_len = tor_addr_to_sockaddr(addr,port,dest_addr,sizeof(addrbuf));
+	if(!dest_addr_len || connect(s,dest_addr,dest_addr_len) < 0)
+	{	log_info(LD_NET,get_lang_str(LANG_LOG_NTLM_POOL_FAILED),err);
+		tor_close_socket(s);
+		return NULL;
+	}
+	headers = tor_malloc(MAX_HEADERS_SIZE + 1);
+	ntlm_build_negotiate(headers,MAX_HEADERS_SIZE,domain);
+	tor_asprintf((unsigned char **)&request,"CONNECT %s HTTP/1.0\r\nProxy-Connection: Keep-Alive\r\nAuthorization: NTLM %s\r\n\r\n",target,headers);
+	n = proxy_pool_send(s,request,strlen(request));
+	tor_free(request);
+	body = NULL;
+	if(n == 0)
+	{	err = "no response";
+		while(len < MAX_HEADERS_SIZE)
+		{	n = tor_socket_recv(s,headers + len,MAX_HEADERS_SIZE - len,0);
+			if(n <= 0)	break;
+			len += n;
+			headers[len] = 0;
+			body = strstr(headers,"\r\n\r\n");
+			if(body)	break;
+		}
+	}
+	if(body)
+	{	smartlist_t *parsed_headers = smartlist_create();
+		body += 4;
+		len -= body - headers;
+		body[-2] = 0;
+		err = "unexpected response";
+		if(tor_sscanf(headers,"HTTP/1.%u %u",&n1,&status_code) == 2 && status_code >= 400 && status_code < 500)
+		{	smartlist_split_string(parsed_headers,headers,"\n",SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK,-1);
+			SMARTLIST_FOREACH(parsed_headers,char *,h,
+			{	const char *c = ntlm_find_challenge(h);
+				if(c && *c > 32)	challenge = c;
+				else if(!strcasecmpstart(h,"content-length:"))	content_length = atol(h + 15);
+				else if((!strcasecmpstart(h,"proxy-connection:") || !strcasecmpstart(h,"connection:")) && strstr(h,"lose"))
+					keepalive = 0;
+			});
+			if(!challenge)	err = "the proxy did not send an NTLM challenge";
+			else if(!keepalive)	err = "the proxy does not keep connections alive";
+			else	/* discard the rest of the 407 body, the connection must be idle when it is used */
+			{	content_length -= (long)len;
+				while(content_length > 0)
+				{	n = tor_socket_recv(s,headers,content_length > MAX_HEADERS_SIZE ? MAX_HEADERS_SIZE : content_length,0);
+					if(n <= 0)	break;
+					content_length -= n;
+				}
+				if(content_length <= 0)
+				{	ent = tor_malloc_zero(sizeof(proxy_pool_ent_t));
+					ent->auth = tor_malloc_zero(1024);
+					ntlm_build_response(ent->auth,1023,challenge,authenticator);
+					ent->created = get_time(NULL);
+					set_socket_nonblocking(s);
+					ent->s = s;
+				}
+			}
+		}
+		SMARTLIST_FOREACH(parsed_headers,char *,h,tor_free(h));
+		smartlist_free(parsed_headers);
+	}
+	tor_free(headers);
+	if(!ent)
+	{	log_info(LD_NET,get_lang_str(LANG_LOG_NTLM_POOL_FAILED),err);
+		tor_close_socket(s);
+	}
+	return ent;
+}
+
+/** Keep the pool filled until proxy_pool_free_all() is called. */
+static void proxy_pool_thread(void *arg)
+{	(void) arg;
+	while(1)
+	{	tor_addr_t addr;
+		uint16_t port = 0;
+		char *target = NULL,*authenticator = NULL,*domain = NULL;
+		int generation,wanted;
+		time_t now = get_time(NULL);
+		proxy_pool_ent_t *ent;
+		tor_mutex_acquire(proxy_pool_mutex);
+		if(proxy_pool_shutdown)
+		{	proxy_pool_thread_running = 0;
+			tor_mutex_release(proxy_pool_mutex);
+			SetEvent(proxy_pool_done);
+			spawn_exit();
+		}
+		SMARTLIST_FOREACH(proxy_pool,proxy_pool_ent_t *,e,
+		{	if(e->created + PROXY_POOL_MAX_AGE < now)
+			{	proxy_pool_ent_free(e);
+				SMARTLIST_DEL_CURRENT(proxy_pool,e);
+			}
+		});
+		wanted = proxy_pool_target && smartlist_len(proxy_pool) < proxy_pool_size;
+		if(wanted)
+		{	tor_addr_copy(&addr,&proxy_pool_addr);
+			port = proxy_pool_port;
+			target = tor_strdup(proxy_pool_target);
+			if(proxy_pool_authenticator)	authenticator = tor_strdup(proxy_pool_authenticator);
+			if(proxy_pool_domain)	domain = tor_strdup(proxy_pool_domain);
+		}
+		generation = proxy_pool_generation;
+		tor_mutex_release(proxy_pool_mutex);
+		if(!wanted)
+		{	WaitForSingleObject(proxy_pool_stop,250);
+			continue;
+		}
+		ent = proxy_pool_open(&addr,port,target,authenticator,domain);
+		tor_free(target);
+		if(authenticator)	tor_free(authenticator);
+		if(domain)	tor_free(domain);
+		tor_mutex_acquire(proxy_pool_mutex);
+		if(!ent)	wanted = generation == proxy_pool_generation;	/* wait before retrying with the same settings */
+		else if(generation == proxy_pool_generation && !proxy_pool_shutdown)
+		{	smartlist_add(proxy_pool,ent);
+			log_info(LD_NET,get_lang_str(LANG_LOG_NTLM_POOL_ADDED),smartlist_len(proxy_pool));
+			ent = NULL;
+			wanted = 0;
+		}
+		tor_mutex_release(proxy_pool_mutex);
+		if(ent)	proxy_pool_ent_free(ent);
+		else if(wanted)	WaitForSingleObject(proxy_pool_stop,PROXY_POOL_RETRY * 1000);
+	}
+}
+
+static int proxy_pool_strcmp(const char *a,const char *b)
+{	if(!a || !b)	return a != b;
+	return strcmp(a,b);
+}
+
+static void proxy_pool_setstr(char **dest,const char *src)
+{	if(*dest)	tor_free(*dest);
+	if(src)	*dest = tor_strdup(src);
+}
+
+/** Called when the corporate proxy asked a connection for NTLM authentication; <b>addr</b>:<b>port</b> is what that connection
+ * wanted to connect to, and it is used as the destination of the CONNECT requests sent by the pool thread. Start to keep
+ * CorporateProxyPoolSize connections ready, or update the pool if the proxy settings changed. */
+static void proxy_pool_learn(const tor_addr_t *addr,int port)
+{	or_options_t *options = get_options();
+	char *target;
+	char addrbuf[TOR_ADDR_BUF_LEN];
+	if(!options->CorporateProxyPoolSize && !proxy_pool_thread_running)	return;
+	if(!proxy_pool_mutex)
+	{	proxy_pool_mutex = tor_mutex_new();
+		proxy_pool = smartlist_create();
+		proxy_pool_stop = CreateEvent(NULL,TRUE,FALSE,NULL);
+		proxy_pool_done = CreateEvent(NULL,TRUE,FALSE,NULL);
+	}
+	tor_asprintf((unsigned char **)&target,"%s:%d",fmt_addr_buf(addrbuf,addr),port);
+	tor_mutex_acquire(proxy_pool_mutex);
+	proxy_pool_size = options->CorporateProxyPoolSize;
+	if(!tor_addr_eq(&proxy_pool_addr,&options->CorporateProxyAddr) || proxy_pool_port != options->CorporateProxyPort || proxy_pool_strcmp(proxy_pool_authenticator,options->CorporateProxyAuthenticator) || proxy_pool_strcmp(proxy_pool_domain,options->CorporateProxyDomain))
+	{	tor_addr_copy(&proxy_pool_addr,&options->CorporateProxyAddr);
+		proxy_pool_port = options->CorporateProxyPort;
+		proxy_pool_setstr(&proxy_pool_authenticator,options->CorporateProxyAuthenticator);
+		proxy_pool_setstr(&proxy_pool_domain,options->CorporateProxyDomain);
+		proxy_pool_generation++;
+		SMARTLIST_FOREACH(proxy_pool,proxy_pool_ent_t *,e,proxy_pool_ent_free(e));
+		smartlist_clear(proxy_pool);
+	}
+	if(proxy_pool_target)	tor_free(proxy_pool_target);
+	proxy_pool_target = target;
+	tor_mutex_release(proxy_pool_mutex);
+	if(!proxy_pool_thread_running && !proxy_pool_shutdown)
+	{	proxy_pool_thread_running = 1;
+		if(spawn_func(proxy_pool_thread,NULL) < 0)
+			proxy_pool_thread_running = 0;
+	}
+}
+
+/** If a pre-authenticated connection to the proxy at <b>addr</b>:<b>port</b> is ready, remove it from the pool, store the NTLM response that must be sent with its CONNECT request in <b>auth</b> and return its socket. Return -1 otherwise. */
+tor_socket_t proxy_pool_take(const tor_addr_t *addr,uint16_t port,char **auth)
+{	tor_socket_t s = -1;
+	time_t now;
+	if(!proxy_pool_mutex)	return -1;
+	now = get_time(NULL);
+	tor_mutex_acquire(proxy_pool_mutex);
+	if(port == proxy_pool_port && tor_addr_eq(addr,&proxy_pool_addr))
+	{	while(smartlist_len(proxy_pool))
+		{	proxy_pool_ent_t *ent = smartlist_get(proxy_pool,0);
+			smartlist_del_keeporder(proxy_pool,0);
+			if(ent->created + PROXY_POOL_MAX_AGE >= now)
+			{	s = ent->s;
+				ent->s = -1;
+				*auth = ent->auth;
+				ent->auth = NULL;
+			}
+			proxy_pool_ent_free(ent);
+			if(SOCKET_OK(s))	break;
+		}
+	}
+	tor_mutex_release(proxy_pool_mutex);
+	return s;
+}
+
+/** Stop the pool thread, wait for it to exit, close all pooled connections and free the pool. */
+void proxy_pool_free_all(void)
+{	int running;
+	if(!proxy_pool_mutex)	return;
+	tor_mutex_acquire(proxy_pool_mutex);
+	proxy_pool_shutdown = 1;
+	running = proxy_pool_thread_running;
+	SMARTLIST_FOREACH(proxy_pool,proxy_pool_ent_t *,e,proxy_pool_ent_free(e));
+	smartlist_clear(proxy_pool);
+	tor_mutex_release(proxy_pool_mutex);
+	SetEvent(proxy_pool_stop);
+	/* If the thread is still stuck in a blocking call, leave it what it uses. */
+	if(running && WaitForSingleObject(proxy_pool_done,PROXY_POOL_JOIN_TIMEOUT) != WAIT_OBJECT_0)	return;
+	smartlist_free(proxy_pool);
+	proxy_pool = NULL;
+	if(proxy_pool_target)	tor_free(proxy_pool_target);
+	if(proxy_pool_authenticator)	tor_free(proxy_pool_authenticator);
+	if(proxy_pool_domain)	tor_free(proxy_pool_domain);
+	CloseHandle(proxy_pool_stop);
+	CloseHandle(proxy_pool_done);
+	proxy_pool_stop = proxy_pool_done = NULL;
+	tor_mutex_free(proxy_pool_mutex);
+	proxy_pool_mutex = NULL;
+}
+
 static int connection_read_ntlm_proxy_response(connection_t *conn,int isdir)
 {	char *headers;
 	int status_code;
 	unsigned int n1,n2;
-	char *workstation,*domain;
-	int i,j;
 	smartlist_t *parsed_headers;
 	or_options_t *options = get_options();
 	switch(fetch_from_buf_http(conn->inbuf,&headers, MAX_HEADERS_SIZE,NULL, NULL, 10000, 0))
@@ -430,76 +818,10 @@ static int connection_read_ntlm_proxy_response(connection_t *conn,int isdir)
 	else if(status_code >= 400 && status_code < 500)
 	{	status_code = -1;
 		SMARTLIST_FOREACH(parsed_headers,char *, s,
-		{	if(!strcasecmpstart(s, "www-authenticate:"))
-			{	headers = s + 17;
-				while(*headers==32)	headers++;
-				if(!strcasecmpstart(headers,"ntlm"))
-				{	tSmbNtlmAuthRequest request;
-					headers += 4;
-					while(*headers==32)	headers++;
-					char *requeststr = tor_malloc_zero(1024);
-					if(headers[0] > 32)
-					{	log(LOG_DEBUG,LD_APP,get_lang_str(LANG_LOG_NTLM_CHALLENGE),headers);
-						tSmbNtlmAuthChallenge challenge;
-						tSmbNtlmAuthResponse  response;
-						base64_decode((char *)&challenge,sizeof(tSmbNtlmAuthChallenge),(const char *)headers,strlen(headers));
-						char *user = tor_malloc(256);
-						char *pass = tor_malloc(256);
-						user[0] = pass[0] = 0;
-						if(options->CorporateProxyAuthenticator)
-						{	for(i=0;options->CorporateProxyAuthenticator[i] && options->CorporateProxyAuthenticator[i]!=':' && i<255;i++)
-								user[i] = options->CorporateProxyAuthenticator[i];
-							user[i] = 0;
-							if(options->CorporateProxyAuthenticator[i]==':')	i++;
-							for(j=0;options->CorporateProxyAuthenticator[i+j] && j < 255;j++)
-								pass[j] = options->CorporateProxyAuthenticator[i+j];
-							pass[j] = 0;
-						}
-						buildSmbNtlmAuthResponse(&challenge,&response,user,pass);
-						tor_free(user);tor_free(pass);
-						base64_encode(requeststr,1023,(char *)&response,SmbLength(&response),0);
-					}
-					else
-					{	log(LOG_DEBUG,LD_APP,get_lang_str(LANG_LOG_NTLM_MESSAGE_TYPE_1));
-						workstation=NULL;
-						domain=NULL;
-						if(options->CorporateProxyDomain)
-						{	workstation = tor_malloc(256);
-							domain = tor_malloc(256);
-							for(i=0;options->CorporateProxyDomain[i] && options->CorporateProxyDomain[i]!='@' && i < 255;i++)
-							{	workstation[i] = options->CorporateProxyDomain[i];
-							}
-							workstation[i] = 0;
-							if(options->CorporateProxyDomain[i])
-							{	i++;
-								for(j=0;j<255;j++)
-								{	domain[j] = options->CorporateProxyDomain[i+j];
-								}
-							}
-							else
-							{	strcpy(domain,workstation);
-								gethostname(workstation,255);
-							}
-						}
-						else
-						{	workstation = tor_malloc(256);
-							gethostname(workstation,255);
-						}
-						if(workstation)	tor_strupper(workstation);
-						if(domain)	tor_strupper(domain);
-						buildSmbNtlmAuthRequest(&request,workstation,domain);
-						if(workstation)	tor_free(workstation);
-						if(domain)	tor_free(domain);
-						base64_encode(requeststr,1023,(char *)&request,SmbLength(&request),0);
-					}
-					j=0;
-					for(i=0;requeststr[i];i++)
-					{	if(requeststr[i]!=13 && requeststr[i]!=10)
-						{	requeststr[j] = requeststr[i];
-							j++;
-						}
-					}
-					requeststr[j] = 0;
+		{	if(!strcasecmpstart(s, "www-authenticate:") || !strcasecmpstart(s, "proxy-authenticate:"))
+			{	const char *challengestr = ntlm_find_challenge(s);
+				if(challengestr)
+				{	char *requeststr = tor_malloc_zero(1024);
 					tor_addr_t *addr = &conn->addr;
 					int port = conn->port;
 					if(isdir)
@@ -514,8 +836,18 @@ static int connection_read_ntlm_proxy_response(connection_t *conn,int isdir)
 							port = options->ORProxyPort;
 						}
 					}
+					if(challengestr[0] > 32)
+					{	log(LOG_DEBUG,LD_APP,get_lang_str(LANG_LOG_NTLM_CHALLENGE),challengestr);
+						ntlm_build_response(requeststr,1023,challengestr,options->CorporateProxyAuthenticator);
+					}
+					else
+					{	log(LOG_DEBUG,LD_APP,get_lang_str(LANG_LOG_NTLM_MESSAGE_TYPE_1));
+						ntlm_build_negotiate(requeststr,1023,options->CorporateProxyDomain);
+						proxy_pool_learn(addr,port);
+					}
 					unsigned char *buf;
-					tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\nAuthorization: NTLM %s\r\n\r\n",fmt_addr(addr),port,requeststr);
+					char addrbuf[TOR_ADDR_BUF_LEN];
+					tor_asprintf(&buf,"CONNECT %s:%d HTTP/1.0\r\nAuthorization: NTLM %s\r\n\r\n",fmt_addr_buf(addrbuf,addr),port,requeststr);
 					connection_write_to_buf((char *)buf,strlen((char *)buf),conn);
 					tor_free(buf);
 					tor_free(requeststr);
@@ -5,5 +5,7 @@ int connection_proxy_connect(connection_t *conn,int ntlm);
 int dir_proxy_connect(connection_t *conn,int ntlm);
 int connection_read_proxy_handshake(connection_t *conn);
 int dir_read_proxy_handshake(connection_t *conn);
+tor_socket_t proxy_pool_take(const tor_addr_t *addr,uint16_t port,char **auth);
+void proxy_pool_free_all(void);
 
 #endif
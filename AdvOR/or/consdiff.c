@@ -0,0 +1,273 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Rebuild a consensus from the consensus we have and a diff.
+ *
+ * When we know which consensus we have, we name it in the
+ * X-Or-Diff-From-Consensus header of our consensus requests.  A directory
+ * cache that still has that consensus may answer with a diff instead of
+ * the whole document:
+ *
+ *   network-status-diff-version 1
+ *   hash <base digest> <target digest>
+ *   <ed commands>
+ *
+ * The digests are the hex SHA3-256 digests of the base consensus as signed,
+ * and of the whole target consensus.  The commands ("Na", "N[,M]c" and
+ * "N[,M]d", with "$" for the last line) refer to the lines of the base
+ * consensus, and come last line first, so each one can be applied without
+ * renumbering the lines before it.
+ **/
+
+#define CONSDIFF_PRIVATE
+
+#include "or.h"
+#include "consdiff.h"
+#include "routerparse.h"
+
+/** The first line of every consensus diff we understand. */
+#define CONSDIFF_HEADER "network-status-diff-version 1\n"
+
+/** One ed command from a consensus diff. */
+typedef struct consdiff_cmd_t {
+  int start; /**< First base line the command applies to, counting from 1. */
+  int end; /**< Last base line the command applies to. */
+  char action; /**< 'a', 'c' or 'd'. */
+  int first_line; /**< Index in the diff of the first line to insert. */
+  int n_lines; /**< How many lines to insert. */
+} consdiff_cmd_t;
+
+/** Return true iff the <b>len</b> bytes at <b>body</b> look like a
+ * consensus diff rather than a consensus. */
+int
+looks_like_a_consensus_diff(const char *body, size_t len)
+{
+  return len >= strlen(CONSDIFF_HEADER) &&
+         fast_memeq(body, CONSDIFF_HEADER, strlen(CONSDIFF_HEADER));
+}
+
+/** Return the length of <b>line</b>, not counting the newline that ends
+ * it. */
+static INLINE size_t
+consdiff_line_len(const char *line)
+{
+  return strchr(line, '\n') - line;
+}
+
+/** Split the NUL-terminated string <b>s</b> into lines, and return a newly
+ * allocated list of pointers to the start of each line.  Return NULL if the
+ * last line of <b>s</b> doesn't end with a newline. */
+static smartlist_t *
+consdiff_split_lines(const char *s)
+{
+  smartlist_t *lines = smartlist_create();
+  const char *eol;
+
+  while (*s) {
+    if (!(eol = strchr(s, '\n'))) {
+      smartlist_free(lines);
+      return NULL;
+    }
+    smartlist_add(lines, (void *)s);
+    s = eol + 1;
+  }
+  return lines;
+}
+
+/** Parse the command at <b>line</b> into <b>cmd</b>, which may not touch any
+ * base line after <b>limit</b>.  <b>n_base</b> is the number of lines in the
+ * base consensus.  Return 0 on success, -1 on failure. */
+static int
+consdiff_parse_command(const char *line, int n_base, int limit,
+                       consdiff_cmd_t *cmd)
+{
+  char *cp;
+  unsigned long n;
+
+  if (!TOR_ISDIGIT(*line))
+    return -1;
+  n = strtoul(line, &cp, 10);
+  if (n > (unsigned long)n_base)
+    return -1;
+  cmd->start = cmd->end = (int)n;
+  if (*cp == ',') {
+    ++cp;
+    if (*cp == '$') {
+      cmd->end = n_base;
+      ++cp;
+    } else {
+      if (!TOR_ISDIGIT(*cp))
+        return -1;
+      n = strtoul(cp, &cp, 10);
+      if (n > (unsigned long)n_base)
+        return -1;
+      cmd->end = (int)n;
+    }
+  }
+  cmd->action = *cp++;
+  if (*cp != '\n')
+    return -1;
+  switch (cmd->action) {
+    case 'a':
+      return (cmd->start == cmd->end && cmd->start <= limit) ? 0 : -1;
+    case 'c':
+    case 'd':
+      return (cmd->start >= 1 && cmd->start <= cmd->end &&
+              cmd->end <= limit) ? 0 : -1;
+    default:
+      return -1;
+  }
+}
+
+/** Apply the ed commands in <b>diff</b>, from line <b>diff_start</b>
+ * onwards, to the lines in <b>base</b>.  Both lists hold pointers to lines
+ * that end with a newline.  Return a newly allocated list of the lines of
+ * the result, pointing into <b>base</b> and <b>diff</b>, or NULL if the diff
+ * is malformed. */
+/* (private; exposed for testing.) */
+smartlist_t *
+consdiff_apply_ed_diff(const smartlist_t *base, const smartlist_t *diff,
+                       int diff_start)
+{
+  smartlist_t *cmds = smartlist_create();
+  smartlist_t *result = NULL;
+  int n_base = smartlist_len(base);
+  int limit = n_base;
+  int i, cur;
+
+  for (i = diff_start; i < smartlist_len(diff); ) {
+    const char *line = smartlist_get(diff, i);
+    consdiff_cmd_t *cmd = tor_malloc_zero(sizeof(consdiff_cmd_t));
+    smartlist_add(cmds, cmd);
+    if (consdiff_parse_command(line, n_base, limit, cmd) < 0) {
+      log_warn(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_MALFORMED),i+1);
+      goto done;
+    }
+    limit = cmd->action == 'a' ? cmd->start : cmd->start - 1;
+    ++i;
+    if (cmd->action == 'd')
+      continue;
+    cmd->first_line = i;
+    for (;;) {
+      if (i == smartlist_len(diff)) {
+        log_warn(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_MALFORMED),i+1);
+        goto done;
+      }
+      line = smartlist_get(diff, i++);
+      if (line[0] == '.' && line[1] == '\n')
+        break;
+      ++cmd->n_lines;
+    }
+  }
+
+  /* The commands are sorted last line first; build the result from the
+   * front. */
+  result = smartlist_create();
+  cur = 1;
+  for (i = smartlist_len(cmds) - 1; i >= 0; --i) {
+    consdiff_cmd_t *cmd = smartlist_get(cmds, i);
+    int j, copy_to = cmd->action == 'a' ? cmd->start : cmd->start - 1;
+    for ( ; cur <= copy_to; ++cur)
+      smartlist_add(result, smartlist_get(base, cur-1));
+    for (j = 0; j < cmd->n_lines; ++j)
+      smartlist_add(result, smartlist_get(diff, cmd->first_line + j));
+    if (cmd->action != 'a')
+      cur = cmd->end + 1;
+  }
+  for ( ; cur <= n_base; ++cur)
+    smartlist_add(result, smartlist_get(base, cur-1));
+
+ done:
+  SMARTLIST_FOREACH(cmds, consdiff_cmd_t *, cmd, tor_free(cmd));
+  smartlist_free(cmds);
+  return result;
+}
+
+/** Return a newly allocated string holding every line in <b>lines</b>, in
+ * order, each followed by a newline. */
+static char *
+consdiff_join_lines(const smartlist_t *lines)
+{
+  size_t len = 1;
+  char *result, *cp;
+
+  SMARTLIST_FOREACH(lines, const char *, line,
+                    len += consdiff_line_len(line) + 1);
+  cp = result = tor_malloc(len);
+  SMARTLIST_FOREACH(lines, const char *, line,
+  {
+    size_t n = consdiff_line_len(line) + 1;
+    memcpy(cp, line, n);
+    cp += n;
+  });
+  *cp = '\0';
+  return result;
+}
+
+/** Rebuild a consensus from the consensus <b>base</b> and the consensus
+ * diff <b>diff</b>, both NUL-terminated.  Check that the diff was made for
+ * <b>base</b>, and that the result is the consensus the diff promised.
+ * Return the new consensus in a newly allocated string, or NULL on
+ * failure. */
+char *
+consensus_diff_apply(const char *base, const char *diff)
+{
+  smartlist_t *diff_lines, *base_lines = NULL, *result_lines = NULL;
+  char base_digest[DIGEST256_LEN], target_digest[DIGEST256_LEN];
+  char digest[DIGEST256_LEN];
+  char *result = NULL;
+  const char *hash_line;
+
+  tor_assert(base);
+  tor_assert(diff);
+
+  if (!looks_like_a_consensus_diff(diff, strlen(diff)) ||
+      !(diff_lines = consdiff_split_lines(diff))) {
+    log_warn(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_MALFORMED),1);
+    return NULL;
+  }
+  hash_line = smartlist_len(diff_lines) > 1 ?
+                smartlist_get(diff_lines, 1) : "";
+  if (strcmpstart(hash_line, "hash ") ||
+      consdiff_line_len(hash_line) != 5+2*HEX_DIGEST256_LEN+1 ||
+      hash_line[5+HEX_DIGEST256_LEN] != ' ' ||
+      base16_decode(base_digest, DIGEST256_LEN, hash_line+5,
+                    HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(target_digest, DIGEST256_LEN,
+                    hash_line+5+HEX_DIGEST256_LEN+1, HEX_DIGEST256_LEN) < 0) {
+    log_warn(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_MALFORMED),2);
+    goto done;
+  }
+
+  if (router_get_networkstatus_v3_sha3_as_signed(base, digest) < 0 ||
+      tor_memneq(digest, base_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_BASE_MISMATCH));
+    goto done;
+  }
+  if (!(base_lines = consdiff_split_lines(base))) {
+    log_info(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_BASE_MISMATCH));
+    goto done;
+  }
+  if (!(result_lines = consdiff_apply_ed_diff(base_lines, diff_lines, 2)))
+    goto done;
+
+  result = consdiff_join_lines(result_lines);
+  crypto_digest_sha3_256(digest, result, strlen(result));
+  if (tor_memneq(digest, target_digest, DIGEST256_LEN)) {
+    log_warn(LD_DIR,get_lang_str(LANG_LOG_CONSDIFF_RESULT_MISMATCH));
+    tor_free(result);
+  }
+
+ done:
+  smartlist_free(diff_lines);
+  if (base_lines)
+    smartlist_free(base_lines);
+  if (result_lines)
+    smartlist_free(result_lines);
+  return result;
+}
@@ -0,0 +1,24 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef _TOR_CONSDIFF_H
+#define _TOR_CONSDIFF_H
+
+int looks_like_a_consensus_diff(const char *body, size_t len);
+char *consensus_diff_apply(const char *base, const char *diff);
+
+#ifdef CONSDIFF_PRIVATE
+smartlist_t *consdiff_apply_ed_diff(const smartlist_t *base,
+                                    const smartlist_t *diff,
+                                    int diff_start);
+#endif
+
+#endif
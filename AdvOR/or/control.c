@@ -26,8 +26,11 @@
 #include "hibernate.h"
 #include "main.h"
 #include "networkstatus.h"
+#include "onion.h"
+#include "perf.h"
 #include "policies.h"
 #include "reasons.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
@@ -131,6 +134,7 @@ static void connection_printf_to_buf(control_connection_t *conn,
 static void send_control_event_impl(uint16_t event, event_format_t which,
                                     const char *format, va_list ap)
   CHECK_PRINTF(3,0);
+static void send_stream_bandwidth_event(edge_connection_t *edge_conn);
 static int control_event_status(int type, int severity, const char *format,
                                 va_list args)
   CHECK_PRINTF(3,0);
@@ -182,6 +186,9 @@ static int handle_control_resolve(control_connection_t *conn, uint32_t len,char
 static int handle_control_usefeature(control_connection_t *conn,
                                      uint32_t len,
                                      const char *body);
+static int handle_control_resetperf(control_connection_t *conn,
+                                    uint32_t len,
+                                    const char *body);
 static int write_stream_target_to_buf(edge_connection_t *conn, char *buf,
                                       size_t len);
 static void orconn_target_get_name(char *buf, size_t len,
@@ -570,15 +577,14 @@ static void
 send_control_event_string(uint16_t event, event_format_t which,
                           const char *msg)
 {
+  connection_t *conn;
   if(!num_controllers)	return;
-  smartlist_t *conns = get_connection_array();
   (void)which;
   tor_assert(event >= _EVENT_MIN && event <= _EVENT_MAX);
 
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
-  {
-    if (conn->type == CONN_TYPE_CONTROL &&
-        !conn->marked_for_close &&
+  for (conn = connection_array_first_of_type(CONN_TYPE_CONTROL); conn;
+       conn = conn->next_of_type) {
+    if (!conn->marked_for_close &&
         conn->state == CONTROL_CONN_STATE_OPEN) {
       control_connection_t *control_conn = TO_CONTROL_CONN(conn);
       if (control_conn->event_mask & (1<<event)) {
@@ -592,11 +598,11 @@ send_control_event_string(uint16_t event, event_format_t which,
           is_err = !strcmpstart(msg, "STATUS_CLIENT ERR ");
         else if (event == EVENT_STATUS_SERVER)
           is_err = !strcmpstart(msg, "STATUS_SERVER ERR ");
-        if (is_err)
+        if (is_err && !conn->in_flushed_some)
           connection_handle_write(TO_CONN(control_conn), 1);
       }
     }
-  } SMARTLIST_FOREACH_END(conn);
+  }
 }
 
 /** Helper for send_control1_event and send_control1_event_extended:
@@ -638,9 +644,9 @@ static void
 send_control_event(uint16_t event, event_format_t which,
                    const char *format, ...)
 {
-  if(!num_controllers)
-  	return;
   va_list ap;
+  if (!num_controllers || !EVENT_IS_INTERESTING(event))
+    return;
   va_start(ap, format);
   send_control_event_impl(event, which, format, ap);
   va_end(ap);
@@ -1275,7 +1281,7 @@ handle_control_mapaddress(control_connection_t *conn, uint32_t len,
       } else if (!strcmp(from, ".") || !strcmp(from, "0.0.0.0")) {
         const char *address = addressmap_register_virtual_address(
               !strcmp(from,".") ? RESOLVED_TYPE_HOSTNAME : RESOLVED_TYPE_IPV4,
-               tor_strdup(to));
+               tor_strdup(to), ADDRMAPSRC_CONTROLLER);
         if (!address) {
           tor_snprintf(ans, anslen,
                        "451-resource exhausted: skipping '%s'", line);
@@ -1353,6 +1359,18 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     *answer = tor_dup_ip(addr);
   } else if (!strcmp(question, "dir-usage")) {
     *answer = directory_dump_request_log();
+  } else if (!strcmp(question, "buffers/freelists")) {
+    *answer = buf_get_freelist_stats();
+  } else if (!strcmp(question, "onion-queue")) {
+    *answer = onion_queue_get_stats();
+  } else if (!strcmp(question, "onion-dh-pool")) {
+    *answer = onion_dh_pool_get_stats();
+  } else if (!strcmp(question, "periodic-events")) {
+    *answer = periodic_events_get_stats();
+  } else if (!strcmp(question, "bw-samples")) {
+    *answer = rep_hist_format_bw_samples();
+  } else if (!strcmp(question, "log-queue")) {
+    *answer = log_async_get_stats();
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_env_t *server_key;
     if (!server_mode(get_options())) {
@@ -1695,6 +1713,7 @@ getinfo_helper_events(control_connection_t *control_conn,
         {
         case AP_CONN_STATE_CONTROLLER_WAIT:
         case AP_CONN_STATE_CIRCUIT_WAIT:
+        case AP_CONN_STATE_PLUGIN_WAIT:
           if (conn->socks_request &&
               SOCKS_COMMAND_IS_RESOLVE(conn->socks_request->command))
             state = "NEWRESOLVE";
@@ -1945,6 +1964,18 @@ static const getinfo_item_t getinfo_items[] = {
       "current version"),
   ITEM("address", misc, "IP address of this Tor host, if we can guess it."),
   ITEM("dir-usage", misc, "Breakdown of bytes transferred over DirPort."),
+  ITEM("buffers/freelists", misc,
+       "Usage and sizing of the buffer chunk freelists."),
+  ITEM("onion-queue", misc,
+       "Length of the onionskin queue and how long onionskins wait on it."),
+  ITEM("onion-dh-pool", misc,
+       "Size of the precomputed circuit DH keypair pool and how often it ran dry."),
+  ITEM("periodic-events", misc,
+       "How often each periodic task ran, how long it took, and when it is due."),
+  ITEM("bw-samples", misc,
+       "Bytes read, written and relayed in each 100 ms of the last minute."),
+  ITEM("log-queue", misc,
+       "Fill level of the async log queue and how many messages it dropped."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -1954,6 +1985,25 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("exit-policy/default", policies,
        "The default value appended to the configured exit policy."),
   PREFIX("ip-to-country/", geoip, "Perform a GEOIP lookup"),
+  PREFIX("perf/", perf, NULL),
+  DOC("perf/all", "All performance counters, one key per line."),
+  DOC("perf/cells", "Cells relayed in total and per second."),
+  DOC("perf/queue-depth", "Length of circuit cell queues as cells are added."),
+  DOC("perf/ewma-latency",
+      "Microseconds spent picking the next circuit to flush."),
+  DOC("perf/circuit-build", "Circuit build times in milliseconds."),
+  DOC("perf/dns", "Exit DNS cache hits and misses."),
+  DOC("perf/buffers", "Buffer chunk freelist hits and misses."),
+  DOC("perf/proxy-filter",
+      "Microseconds spent in the HTTP proxy filters per call."),
+  DOC("perf/cell-wait",
+      "Microseconds that cells waited in circuit queues before we wrote "
+      "them to a connection."),
+  DOC("perf/cell-wait/circuits",
+      "Queue waits of the cells of each circuit, one circuit per line."),
+  DOC("perf/cell-wait/orconns",
+      "Queue waits of the cells written to each OR connection, one "
+      "connection per line."),
   { NULL, NULL, NULL, 0 }
 };
 
@@ -2007,19 +2057,220 @@ static int handle_getinfo_helper(control_connection_t *control_conn, const char
   return 0; /* unrecognized */
 }
 
+/** Keep adding spooled GETINFO answers to the outbuf of a control connection
+ * until it has this many bytes. */
+#define GETINFO_SPOOL_BUFFER_MIN 16384
+
+/** Sources of a spooled GETINFO answer. */
+#define GETINFO_SPOOL_STRING 0
+#define GETINFO_SPOOL_NS_ALL 1
+#define GETINFO_SPOOL_DESC_ALL 2
+#define GETINFO_SPOOL_DESC_ALL_EXTRAINFO 3
+
+/** One answer of a GETINFO command. */
+typedef struct getinfo_spool_item_t {
+  char *key;
+  int source; /**< GETINFO_SPOOL_* */
+  char *value; /**< For GETINFO_SPOOL_STRING, the whole answer. */
+  /** For the other sources, the identity digests of the routers that we
+   * still have to write. Routers that disappear before we get to them are
+   * skipped. */
+  smartlist_t *digests;
+} getinfo_spool_item_t;
+
+/** The answers of a GETINFO command that are written as the outbuf of the
+ * control connection drains, like the directory spools in dirserv.c. */
+typedef struct getinfo_spool_t {
+  smartlist_t *items; /**< getinfo_spool_item_t, in the order asked. */
+  int next_item; /**< Index of the item that we are writing. */
+  int next_digest; /**< Index in the digests of the item we write. */
+  unsigned int started:1; /**< True iff we wrote the header of next_item. */
+} getinfo_spool_t;
+
+/** Return the GETINFO_SPOOL_* source that can write the answer for
+ * <b>question</b> piece by piece, or GETINFO_SPOOL_STRING if it is answered
+ * at once. */
+static int
+getinfo_spool_source(const char *question)
+{
+  if (!strcmp(question, "ns/all"))
+    return GETINFO_SPOOL_NS_ALL;
+  if (!strcmp(question, "desc/all-recent"))
+    return GETINFO_SPOOL_DESC_ALL;
+  if (!strcmp(question, "desc/all-recent-extrainfo-hack"))
+    return GETINFO_SPOOL_DESC_ALL_EXTRAINFO;
+  return GETINFO_SPOOL_STRING;
+}
+
+/** Return the identity digests of the routers whose entries make up the
+ * answer of source <b>src</b>. */
+static smartlist_t *
+getinfo_spool_get_digests(int src)
+{
+  smartlist_t *digests = smartlist_create();
+  if (src == GETINFO_SPOOL_NS_ALL) {
+    networkstatus_t *consensus = networkstatus_get_latest_consensus();
+    if (consensus)
+      SMARTLIST_FOREACH(consensus->routerstatus_list, routerstatus_t *, rs,
+        smartlist_add(digests, tor_memdup(rs->identity_digest, DIGEST_LEN)));
+  } else {
+    routerlist_t *routerlist = router_get_routerlist();
+    if (routerlist && routerlist->routers)
+      SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+        smartlist_add(digests,
+                      tor_memdup(ri->cache_info.identity_digest,
+                                 DIGEST_LEN)));
+  }
+  return digests;
+}
+
+/** Return a newly allocated entry of source <b>src</b> for the router with
+ * identity <b>digest</b>, or NULL if we don't know it anymore. */
+static char *
+getinfo_spool_get_entry(int src, const char *digest)
+{
+  if (src == GETINFO_SPOOL_NS_ALL) {
+    routerstatus_t *rs = router_get_consensus_status_by_id(digest);
+    return rs ? networkstatus_getinfo_helper_single(rs) : NULL;
+  } else {
+    routerinfo_t *ri = router_get_by_digest(digest);
+    const char *body;
+    char *r = NULL;
+    if (!ri || !(body = signed_descriptor_get_body(&ri->cache_info)))
+      return NULL;
+    if (src == GETINFO_SPOOL_DESC_ALL_EXTRAINFO) {
+      signed_descriptor_t *ei = extrainfo_get_by_descriptor_digest(
+                                     ri->cache_info.extra_info_digest);
+      if (ei)
+        r = munge_extrainfo_into_routerinfo(body, &ri->cache_info, ei);
+    }
+    if (!r)
+      r = tor_strndup(body, ri->cache_info.signed_descriptor_len);
+    return r;
+  }
+}
+
+/** Write <b>data</b> to <b>conn</b> escaped as a part of a multi-line
+ * answer, without the final ".\r\n". */
+static void
+getinfo_spool_write_escaped(control_connection_t *conn, const char *data)
+{
+  char *esc = NULL;
+  size_t esc_len = write_escaped_data(data, strlen(data), &esc);
+  connection_write_to_buf(esc, esc_len - 3, TO_CONN(conn));
+  tor_free(esc);
+}
+
+static void
+getinfo_spool_item_free(getinfo_spool_item_t *item)
+{
+  tor_free(item->key);
+  tor_free(item->value);
+  if (item->digests) {
+    SMARTLIST_FOREACH(item->digests, char *, d, tor_free(d));
+    smartlist_free(item->digests);
+  }
+  tor_free(item);
+}
+
+/** Free the GETINFO answer that <b>conn</b> is spooling, if any. */
+void
+control_getinfo_spool_free(control_connection_t *conn)
+{
+  getinfo_spool_t *spool = conn->getinfo_spool;
+  if (!spool)
+    return;
+  SMARTLIST_FOREACH(spool->items, getinfo_spool_item_t *, item,
+                    getinfo_spool_item_free(item));
+  smartlist_free(spool->items);
+  tor_free(spool);
+  conn->getinfo_spool = NULL;
+}
+
+/** Add the answers that <b>conn</b> is spooling to its outbuf until the
+ * outbuf has GETINFO_SPOOL_BUFFER_MIN bytes. When all answers are written,
+ * end the reply and free the spool. */
+static void
+getinfo_spool_fill(control_connection_t *conn)
+{
+  getinfo_spool_t *spool = conn->getinfo_spool;
+  while (spool->next_item < smartlist_len(spool->items)) {
+    getinfo_spool_item_t *item = smartlist_get(spool->items,
+                                               spool->next_item);
+    if (buf_datalen(conn->_base.outbuf) >= GETINFO_SPOOL_BUFFER_MIN)
+      return;
+    if (item->source == GETINFO_SPOOL_STRING) {
+      if (!strchr(item->value, '\n') && !strchr(item->value, '\r')) {
+        connection_printf_to_buf(conn, "250-%s=", item->key);
+        connection_write_str_to_buf(item->value, conn);
+        connection_write_str_to_buf("\r\n", conn);
+      } else {
+        connection_printf_to_buf(conn, "250+%s=\r\n", item->key);
+        getinfo_spool_write_escaped(conn, item->value);
+        connection_write_str_to_buf(".\r\n", conn);
+      }
+    } else {
+      if (!spool->started) {
+        connection_printf_to_buf(conn, "250+%s=\r\n", item->key);
+        spool->started = 1;
+      }
+      while (spool->next_digest < smartlist_len(item->digests) &&
+             buf_datalen(conn->_base.outbuf) < GETINFO_SPOOL_BUFFER_MIN) {
+        char *entry = getinfo_spool_get_entry(item->source,
+                        smartlist_get(item->digests, spool->next_digest++));
+        if (entry) {
+          getinfo_spool_write_escaped(conn, entry);
+          tor_free(entry);
+        }
+      }
+      if (spool->next_digest < smartlist_len(item->digests))
+        return;
+      connection_write_str_to_buf(".\r\n", conn);
+    }
+    spool->next_item++;
+    spool->next_digest = 0;
+    spool->started = 0;
+  }
+  connection_write_str_to_buf("250 OK\r\n", conn);
+  control_getinfo_spool_free(conn);
+}
+
+/** Called when we've flushed some of the outbuf of <b>conn</b>: if we are
+ * spooling a GETINFO answer, add more of it. */
+int
+connection_control_flushed_some(control_connection_t *conn)
+{
+  if (conn->getinfo_spool && !conn->_base.marked_for_close)
+    getinfo_spool_fill(conn);
+  return 0;
+}
+
 /** Called when we receive a GETINFO command.  Try to fetch all requested
- * information, and reply with information or error message. */
+ * information, and reply with information or error message. Large
+ * directory answers, such as ns/all and desc/all-recent, are spooled: they
+ * are added to the outbuf piece by piece as it drains. */
 static int handle_control_getinfo(control_connection_t *conn, uint32_t len,const char *body)
 {	smartlist_t *questions = smartlist_create();
-	smartlist_t *answers = smartlist_create();
 	smartlist_t *unrecognized = smartlist_create();
+	getinfo_spool_t *spool = tor_malloc_zero(sizeof(getinfo_spool_t));
+	getinfo_spool_item_t *item;
 	char *ans = NULL;
-	int i = 0;
+	int i = 0,src;
 	(void) len; /* body is nul-terminated, so it's safe to ignore the length. */
 
+	spool->items = smartlist_create();
 	smartlist_split_string(questions, body, " ",SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
 	SMARTLIST_FOREACH_BEGIN(questions, const char *, q)
 	{	const char *errmsg = NULL;
+		src = getinfo_spool_source(q);
+		if(src != GETINFO_SPOOL_STRING && (src != GETINFO_SPOOL_NS_ALL || networkstatus_get_latest_consensus()))
+		{	item = tor_malloc_zero(sizeof(getinfo_spool_item_t));
+			item->key = tor_strdup(q);
+			item->source = src;
+			item->digests = getinfo_spool_get_digests(src);
+			smartlist_add(spool->items, item);
+			continue;
+		}
 		if(handle_getinfo_helper(conn, q, &ans,&errmsg) < 0)
 		{	if(!errmsg)	errmsg = "Internal error";
 			connection_printf_to_buf(conn, "551 %s\r\n", errmsg);
@@ -2030,39 +2281,24 @@ static int handle_control_getinfo(control_connection_t *conn, uint32_t len,const
 		{	smartlist_add(unrecognized, (char*)q);
 		}
 		else
-		{	smartlist_add(answers, tor_strdup(q));
-			smartlist_add(answers, ans);
+		{	item = tor_malloc_zero(sizeof(getinfo_spool_item_t));
+			item->key = tor_strdup(q);
+			item->source = GETINFO_SPOOL_STRING;
+			item->value = ans;
+			smartlist_add(spool->items, item);
 		}
 	} SMARTLIST_FOREACH_END(q);
+	conn->getinfo_spool = spool;
 	if(!i)
 	{	if(smartlist_len(unrecognized))
 		{	for(i=0; i < smartlist_len(unrecognized)-1; ++i)
 				connection_printf_to_buf(conn,"552-Unrecognized key \"%s\"\r\n",(char*)smartlist_get(unrecognized, i));
 			connection_printf_to_buf(conn,"552 Unrecognized key \"%s\"\r\n",(char*)smartlist_get(unrecognized, i));
+			control_getinfo_spool_free(conn);
 		}
-		else
-		{	for(i = 0; i < smartlist_len(answers); i += 2)
-			{	char *k = smartlist_get(answers, i);
-				char *v = smartlist_get(answers, i+1);
-				if(!strchr(v, '\n') && !strchr(v, '\r'))
-				{	connection_printf_to_buf(conn, "250-%s=", k);
-					connection_write_str_to_buf(v, conn);
-					connection_write_str_to_buf("\r\n", conn);
-				}
-				else
-				{	char *esc = NULL;
-					size_t esc_len;
-					esc_len = write_escaped_data(v, strlen(v), &esc);
-					connection_printf_to_buf(conn, "250+%s=\r\n", k);
-					connection_write_to_buf(esc, esc_len, TO_CONN(conn));
-					tor_free(esc);
-				}
-			}
-			connection_write_str_to_buf("250 OK\r\n", conn);
-		}
+		else	getinfo_spool_fill(conn);
 	}
-	SMARTLIST_FOREACH(answers, char *, cp, tor_free(cp));
-	smartlist_free(answers);
+	else	control_getinfo_spool_free(conn);
 	SMARTLIST_FOREACH(questions, char *, cp, tor_free(cp));
 	smartlist_free(questions);
 	smartlist_free(unrecognized);
@@ -2216,7 +2452,7 @@ static int handle_control_setcircuitpurpose(control_connection_t *conn,uint32_t
 			else if(new_purpose == CIRCUIT_PURPOSE_UNKNOWN)
 				connection_printf_to_buf(conn, "552 Unknown purpose \"%s\"\r\n", purp);
 			else
-			{	circ->_base.purpose = new_purpose;
+			{	circuit_change_purpose(TO_CIRCUIT(circ), new_purpose);
 				tree_set_circ(TO_CIRCUIT(circ));
 				connection_write_str_to_buf("250 OK\r\n", conn);
 			}
@@ -2685,6 +2921,20 @@ static int handle_control_authchallenge(control_connection_t *conn,uint32_t len,
 	return 0;
 }
 
+/** Called when we get a RESETPERF command: clear the counters behind the
+ * "perf/" GETINFO keys. */
+static int
+handle_control_resetperf(control_connection_t *conn,
+                         uint32_t len,
+                         const char *body)
+{
+  (void) len;
+  (void) body;
+  perf_reset();
+  send_control_done(conn);
+  return 0;
+}
+
 /** Called when we get a USEFEATURE command: parse the feature list, and
  * set up the control_connection's options properly. */
 static int
@@ -2727,6 +2977,11 @@ connection_control_finished_flushing(control_connection_t *conn)
   tor_assert(conn);
 
   connection_stop_writing(TO_CONN(conn));
+  /* Read the commands that arrived while we were spooling a GETINFO
+   * answer. */
+  if (!conn->getinfo_spool && !conn->_base.marked_for_close &&
+      buf_datalen(conn->_base.inbuf))
+    return connection_control_process_inbuf(conn);
   return 0;
 }
 
@@ -2799,6 +3054,7 @@ int connection_control_process_inbuf(control_connection_t *conn)
 
 	tor_assert(conn);
 	tor_assert(conn->_base.state == CONTROL_CONN_STATE_OPEN || conn->_base.state == CONTROL_CONN_STATE_NEEDAUTH);
+	if(conn->getinfo_spool)	return 0;	/* Answer the other commands after the answer that we are spooling. */
 	if(!conn->incoming_cmd)
 	{	conn->incoming_cmd = tor_malloc(1024);
 		conn->incoming_cmd_len = 1024;
@@ -2944,6 +3200,9 @@ int connection_control_process_inbuf(control_connection_t *conn)
 		else if(!strcasecmp(conn->incoming_cmd, "USEFEATURE"))
 		{	if(handle_control_usefeature(conn, cmd_data_len, args))	return -1;
 		}
+		else if(!strcasecmp(conn->incoming_cmd, "RESETPERF"))
+		{	if(handle_control_resetperf(conn, cmd_data_len, args))	return -1;
+		}
 		else if(!strcasecmp(conn->incoming_cmd, "RESOLVE"))
 		{	if(handle_control_resolve(conn, cmd_data_len, args))	return -1;
 		}
@@ -2957,6 +3216,7 @@ int connection_control_process_inbuf(control_connection_t *conn)
 		{	connection_printf_to_buf(conn, "510 Unrecognized command \"%s\"\r\n",conn->incoming_cmd);
 		}
 		conn->incoming_cmd_cur_len = 0;
+		if(conn->getinfo_spool)	return 0;
 	}
 }
 
@@ -3056,6 +3316,14 @@ control_event_stream_status(edge_connection_t *conn, stream_status_event_t tp,
   char buf[256];
   const char *purpose = "";
 
+  /* Don't lose the bytes that a closing stream moved since its last
+   * STREAM_BW event. */
+  if (tp == STREAM_EVENT_CLOSED &&
+      get_options()->ControlBandwidthEventInterval > 1 &&
+      EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED) &&
+      (conn->n_read || conn->n_written))
+    send_stream_bandwidth_event(conn);
+
   if (!EVENT_IS_INTERESTING(EVENT_STREAM_STATUS))
     return 0;
 
@@ -3223,47 +3491,74 @@ control_event_or_conn_status(or_connection_t *conn, or_conn_status_event_t tp,
   return 0;
 }
 
+/** When we last sent STREAM_BW events. */
+static time_t last_stream_bw_event = 0;
+/** When we last sent a BW event. */
+static time_t last_bw_event = 0;
+/** Bytes read and written since the last BW event. */
+static uint64_t bw_event_read = 0, bw_event_written = 0;
+
+/** Send a STREAM_BW event for the bytes that <b>edge_conn</b> moved since its
+ * last one, and reset its counters. */
+static void
+send_stream_bandwidth_event(edge_connection_t *edge_conn)
+{
+  send_control_event(EVENT_STREAM_BANDWIDTH_USED, ALL_FORMATS,
+                     "650 STREAM_BW "U64_FORMAT" %lu %lu\r\n",
+                     U64_PRINTF_ARG(edge_conn->_base.global_identifier),
+                     (unsigned long)edge_conn->n_read,
+                     (unsigned long)edge_conn->n_written);
+  edge_conn->n_written = edge_conn->n_read = 0;
+}
+
 /** A second or more has elapsed: tell any interested control
- * connections how much bandwidth streams have used. */
+ * connections how much bandwidth streams have used, if
+ * ControlBandwidthEventInterval has elapsed since we last told them. */
 int
 control_event_stream_bandwidth_used(void)
 {
   if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
-    smartlist_t *conns = get_connection_array();
+    connection_t *conn;
     edge_connection_t *edge_conn;
+    time_t now = approx_time();
 
-    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
-    {
-        if (conn->type != CONN_TYPE_AP)
-          continue;
-        edge_conn = TO_EDGE_CONN(conn);
-        if (!edge_conn->n_read && !edge_conn->n_written)
-          continue;
-
-        send_control_event(EVENT_STREAM_BANDWIDTH_USED, ALL_FORMATS,
-                           "650 STREAM_BW "U64_FORMAT" %lu %lu\r\n",
-                           U64_PRINTF_ARG(edge_conn->_base.global_identifier),
-                           (unsigned long)edge_conn->n_read,
-                           (unsigned long)edge_conn->n_written);
-
-        edge_conn->n_written = edge_conn->n_read = 0;
+    if (now - last_stream_bw_event <
+        get_options()->ControlBandwidthEventInterval)
+      return 0;
+    last_stream_bw_event = now;
+    for (conn = connection_array_first_of_type(CONN_TYPE_AP); conn;
+         conn = conn->next_of_type) {
+      edge_conn = TO_EDGE_CONN(conn);
+      if (!edge_conn->n_read && !edge_conn->n_written)
+        continue;
+      send_stream_bandwidth_event(edge_conn);
     }
-    SMARTLIST_FOREACH_END(conn);
   }
 
   return 0;
 }
 
 /** A second or more has elapsed: tell any interested control
- * connections how much bandwidth we used. */
+ * connections how much bandwidth we used. With a
+ * ControlBandwidthEventInterval of more than a second, the bytes are added up
+ * and sent once per interval. */
 int
 control_event_bandwidth_used(uint32_t n_read, uint32_t n_written)
 {
   if (EVENT_IS_INTERESTING(EVENT_BANDWIDTH_USED)) {
+    time_t now = approx_time();
+    bw_event_read += n_read;
+    bw_event_written += n_written;
+    if (now - last_bw_event < get_options()->ControlBandwidthEventInterval)
+      return 0;
+    last_bw_event = now;
     send_control_event(EVENT_BANDWIDTH_USED, ALL_FORMATS,
-                       "650 BW %lu %lu\r\n",
-                       (unsigned long)n_read,
-                       (unsigned long)n_written);
+                       "650 BW "U64_FORMAT" "U64_FORMAT"\r\n",
+                       U64_PRINTF_ARG(bw_event_read),
+                       U64_PRINTF_ARG(bw_event_written));
+    bw_event_read = bw_event_written = 0;
+  } else {
+    bw_event_read = bw_event_written = 0;
   }
 
   return 0;
@@ -3499,9 +3794,10 @@ control_event_newconsensus(const networkstatus_t *consensus)
 /** Called when we compute a new circuitbuildtimeout */	///
 int control_event_buildtimeout_set(const circuit_build_times_t *cbt,buildtimeout_set_event_t type)
 {	const char *type_string = NULL;
-	double qnt = circuit_build_times_quantile_cutoff();
+	double qnt;
 	if(!control_event_is_interesting(EVENT_BUILDTIMEOUT_SET))
 		return 0;
+	qnt = circuit_build_times_quantile_cutoff();
 	switch(type)
 	{	case BUILDTIMEOUT_SET_EVENT_COMPUTED:
 			type_string = "COMPUTED";
@@ -3567,6 +3863,8 @@ control_event_status(int type, int severity, const char *format, va_list args)
   char format_buf[160];
   const char *status, *sev;
 
+  if (!EVENT_IS_INTERESTING(type))
+    return 0;
   switch (type) {
     case EVENT_STATUS_GENERAL:
       status = "STATUS_GENERAL";
@@ -26,6 +26,8 @@ void control_ports_write_to_file(void);
   CONN_LOG_PROTECT(conn, log_fn args)
 
 int connection_control_finished_flushing(control_connection_t *conn);
+int connection_control_flushed_some(control_connection_t *conn);
+void control_getinfo_spool_free(control_connection_t *conn);
 int connection_control_reached_eof(control_connection_t *conn);
 void connection_control_closed(control_connection_t *conn);
 
@@ -5,11 +5,24 @@
 
 /**
  * \file cpuworker.c
- * \brief Implements a farm of 'CPU worker' processes to perform
- * CPU-intensive tasks in another thread or process, to not
- * interrupt the main thread.
+ * \brief Implements a farm of 'CPU worker' threads to perform
+ * CPU-intensive tasks in another thread, to not interrupt the main
+ * thread.
  *
- * Right now, we only use this for processing onionskins.
+ * Right now, we only use this for processing onionskins, for the
+ * INTRODUCE2 cells of our hidden services through cpuworker_queue_task(),
+ * and, through cpuworker_run_batch(), for checking the signatures on
+ * directory documents.
+ *
+ * Each cpuworker owns a ring of job slots that it shares with the main
+ * thread.  The main thread is the only one that adds jobs to the ring and
+ * the worker is the only one that completes them, so the ring works as a
+ * pair of lock-free single-producer/single-consumer queues: one carrying
+ * onionskins and tasks to the worker, the other carrying answers back.  Workers
+ * sleep on an event while their ring is empty.  When a worker finishes a
+ * job it wakes the main loop by writing one byte to a notification
+ * socket, unless a wakeup is already pending; libevent can only wait on
+ * sockets here, so that byte is the only thing that crosses the socket.
  **/
 
 #include "or.h"
@@ -19,36 +32,89 @@
 #include "config.h"
 #include "connection.h"
 #include "cpuworker.h"
+#include "etw.h"
 #include "main.h"
 #include "onion.h"
+#include "perf.h"
+#include "rendservice.h"
 #include "router.h"
 
-/** The maximum number of cpuworker processes we will keep around. */
+/** The maximum number of cpuworker threads we will keep around. */
 #define MAX_CPUWORKERS 16
-/** The minimum number of cpuworker processes we will keep around. */
+/** The minimum number of cpuworker threads we will keep around. */
 #define MIN_CPUWORKERS 1
-
-/** The tag specifies which circuit this onionskin was from. */
-#define TAG_LEN 10
-/** How many bytes are sent from the cpuworker back to tor? */
-#define LEN_ONION_RESPONSE \
-  (1+TAG_LEN+ONIONSKIN_REPLY_LEN+CPATH_KEY_MATERIAL_LEN)
-
-/** How many cpuworkers we have running right now. */
-static int num_cpuworkers=0;
-/** How many of the running cpuworkers have an assigned task right now. */
-static int num_cpuworkers_busy=0;
-/** We need to spawn new cpuworkers whenever we rotate the onion keys
- * on platforms where execution contexts==processes.  This variable stores
- * the last time we got a key rotation event. */
-static time_t last_rotation_time=0;
+/** How many onionskins can be waiting for, or worked on by, any one
+ * cpuworker?  Anything beyond that waits in onion.c's pending queue, which
+ * knows how to drop old requests when we're overloaded.  Must be a power
+ * of two. */
+#define CPUWORKER_QUEUE_LEN 4
+
+/** One onionskin or task handed to a cpuworker, and its answer. */
+typedef struct cpuworker_job_t {
+  /** If this job is a task from cpuworker_queue_task(), the function to run
+   * on the worker; NULL if it is an onionskin. */
+  cpuworker_task_fn_t task_work;
+  /** The function to give the task back to on the main thread. */
+  cpuworker_task_fn_t task_reply;
+  /** Argument for <b>task_work</b> and <b>task_reply</b>. */
+  void *task_arg;
+  /** Global identifier of the OR connection the request came from. */
+  uint64_t conn_id;
+  /** Circuit ID of the request on that connection. */
+  circid_t circ_id;
+  /** True iff the handshake succeeded. */
+  int success;
+  /** The onionskin we were asked to answer. */
+  char onionskin[ONIONSKIN_CHALLENGE_LEN];
+  /** Our reply to the client. */
+  char reply[ONIONSKIN_REPLY_LEN];
+  /** The keys we negotiated. */
+  char keys[CPATH_KEY_MATERIAL_LEN];
+} cpuworker_job_t;
+
+/** State shared between the main thread and one cpuworker thread. */
+typedef struct cpuworker_t {
+  /** Ring of job slots, indexed by a counter modulo CPUWORKER_QUEUE_LEN. */
+  cpuworker_job_t jobs[CPUWORKER_QUEUE_LEN];
+  /** How many jobs has the main thread added?  Written by the main
+   * thread only. */
+  volatile LONG n_submitted;
+  /** How many jobs has the worker finished?  Written by the worker
+   * only. */
+  volatile LONG n_completed;
+  /** How many finished jobs has the main thread taken back?  Used by the
+   * main thread only. */
+  LONG n_reaped;
+  /** When did the main thread last hand this worker a job while it had
+   * none left to do? */
+  time_t busy_since;
+  /** Signalled whenever there are new jobs, or the worker should exit. */
+  HANDLE wakeup;
+  /** True iff the worker should exit as soon as it sees this. */
+  volatile LONG exiting;
+  /** Number of threads still holding this structure; the last one to let
+   * go of it frees it. */
+  volatile LONG refcount;
+} cpuworker_t;
+
+/** The cpuworkers we are running right now, as a list of cpuworker_t. */
+static smartlist_t *cpuworkers = NULL;
+/** The notification connection on which finished workers wake us up. */
+static connection_t *cpuworker_notify_conn = NULL;
+/** The workers' end of the notification socketpair. */
+static tor_socket_t cpuworker_notify_fd = -1;
+/** True iff a worker has written a wakeup byte that we haven't acted on
+ * yet. */
+static volatile LONG cpuworker_notify_pending = 0;
+/** Incremented whenever the onion keys change, so that the workers know to
+ * fetch fresh copies of them. */
+static volatile LONG cpuworker_key_generation = 0;
 
 static void cpuworker_main(void *data) ATTR_NORETURN;
 static int spawn_cpuworker(void);
 static void spawn_enough_cpuworkers(void);
-static void process_pending_task(connection_t *cpuworker);
-ssize_t write_all(int fd, const char *buf, size_t count);
-ssize_t read_all(int fd, char *buf, size_t count);
+static void process_pending_tasks(void);
+static void cpuworker_housekeeping(void);
 
 /** Initialize the cpuworker subsystem.
  */
@@ -68,322 +134,350 @@ connection_cpu_finished_flushing(connection_t *conn)
   return 0;
 }
 
-/** Pack global_id and circ_id; set *tag to the result. (See note on
- * cpuworker_main for wire format.) */
-static void
-tag_pack(char *tag, uint64_t conn_id, circid_t circ_id)
+/** Called when the onion key has changed, or the number of workers we want
+ * has.  Tell the workers to pick up the new keys before their next job,
+ * and start or stop workers as needed.
+ */
+void
+cpuworkers_rotate(void)
 {
-  /*XXXX RETHINK THIS WHOLE MESS !!!! !NM NM NM NM*/
-  set_uint64(tag, conn_id);
-  set_uint16(tag+8, circ_id);
+  InterlockedIncrement(&cpuworker_key_generation);
+  if (server_mode(get_options()))
+    spawn_enough_cpuworkers();
 }
 
-/** Unpack <b>tag</b> into addr, port, and circ_id.
- */
+/** Drop our reference to <b>worker</b>, freeing it if we were the last. */
 static void
-tag_unpack(const char *tag, uint64_t *conn_id, circid_t *circ_id)
+cpuworker_decref(cpuworker_t *worker)
 {
-  *conn_id = get_uint64(tag);
-  *circ_id = get_uint16(tag+8);
+  if (InterlockedDecrement(&worker->refcount) == 0) {
+    CloseHandle(worker->wakeup);
+    tor_free(worker);
+  }
 }
 
-/** Called when the onion key has changed and we need to spawn new
- * cpuworkers.  Close all currently idle cpuworkers, and mark the last
- * rotation time as now.
- */
-void
-cpuworkers_rotate(void)
+/** Tell <b>worker</b>, which the caller has already taken out of the pool,
+ * to exit.  Any jobs it still has are abandoned; the circuits that were
+ * waiting for them will be culled in run_connection_housekeeping().  The
+ * arguments of abandoned tasks are leaked rather than freed under a worker
+ * that may still be using them. */
+static void
+cpuworker_stop(cpuworker_t *worker)
 {
-  connection_t *cpuworker;
-  while ((cpuworker = connection_get_by_type_state(CONN_TYPE_CPUWORKER,
-                                                   CPUWORKER_STATE_IDLE))) {
-    connection_mark_for_close(cpuworker);
-    --num_cpuworkers;
-  }
-  last_rotation_time = get_time(NULL);
-  if (server_mode(get_options()))
-    spawn_enough_cpuworkers();
+  InterlockedExchange(&worker->exiting, 1);
+  SetEvent(worker->wakeup);
+  cpuworker_decref(worker);
 }
 
-/** If the cpuworker closes the connection,
- * mark it as closed and spawn a new one as needed. */
+/** If the notification socket closes, the workers can't wake us up any
+ * more: stop them all, and start over with a new socket. */
 int
 connection_cpu_reached_eof(connection_t *conn)
 {
   log_warn(LD_GENERAL,get_lang_str(LANG_LOG_WORKER_READ_EOF));
-  if (conn->state != CPUWORKER_STATE_IDLE) {
-    /* the circ associated with this cpuworker will have to wait until
-     * it gets culled in run_connection_housekeeping(), since we have
-     * no way to find out which circ it was. */
-    log_warn(LD_GENERAL,get_lang_str(LANG_LOG_WORKER_ABANDONING_CIRC));
-    num_cpuworkers_busy--;
+  if (cpuworkers) {
+    SMARTLIST_FOREACH(cpuworkers, cpuworker_t *, worker,
+    {
+      if (worker->n_reaped != worker->n_submitted)
+        log_warn(LD_GENERAL,get_lang_str(LANG_LOG_WORKER_ABANDONING_CIRC));
+      SMARTLIST_DEL_CURRENT(cpuworkers, worker);
+      cpuworker_stop(worker);
+    });
+  }
+  if (conn == cpuworker_notify_conn) {
+    cpuworker_notify_conn = NULL;
+    tor_close_socket(cpuworker_notify_fd);
+    cpuworker_notify_fd = -1;
   }
-  num_cpuworkers--;
+  connection_mark_for_close(conn);
   spawn_enough_cpuworkers(); /* try to regrow. hope we don't end up
                                 spinning. */
-  connection_mark_for_close(conn);
   return 0;
 }
 
-/** Called when we get data from a cpuworker.  If the answer is not complete,
- * wait for a complete answer. If the answer is complete,
- * process it as appropriate.
- */
-int connection_cpu_process_inbuf(connection_t *conn)
-{	char success;
-	char buf[LEN_ONION_RESPONSE];
-	uint64_t conn_id;
-	circid_t circ_id;
-	connection_t *tmp_conn;
-	or_connection_t *p_conn = NULL;
-	circuit_t *circ;
-
-	tor_assert(conn);
-	tor_assert(conn->type == CONN_TYPE_CPUWORKER);
-	if(!buf_datalen(conn->inbuf))	return 0;
-	if(conn->state == CPUWORKER_STATE_BUSY_ONION)
-	{	if(buf_datalen(conn->inbuf) < LEN_ONION_RESPONSE) /* answer available? */
-			return 0; /* not yet */
-		tor_assert(buf_datalen(conn->inbuf) == LEN_ONION_RESPONSE);
-		connection_fetch_from_buf(&success,1,conn);
-		connection_fetch_from_buf(buf,LEN_ONION_RESPONSE-1,conn);
-		/* parse out the circ it was talking about */
-		tag_unpack(buf, &conn_id, &circ_id);
-		circ = NULL;
-		tmp_conn = connection_get_by_global_id(conn_id);
-		if(tmp_conn && !tmp_conn->marked_for_close && tmp_conn->type == CONN_TYPE_OR)
-			p_conn = TO_OR_CONN(tmp_conn);
-		if(p_conn)	circ = circuit_get_by_circid_orconn(circ_id, p_conn);
-		if(success == 0)
-		{	log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_DECODING_FAILED));
-			if(circ)	circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-		}
-		else if(!circ)	/* This happens because somebody sends us a destroy cell and the circuit goes away, while the cpuworker is working. This is also why our tag doesn't include a pointer to the circ, because we'd never know if it's still valid. */
-			log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_CIRC_GONE));
-		else
-		{	tor_assert(! CIRCUIT_IS_ORIGIN(circ));
-			if(onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, buf+TAG_LEN,buf+TAG_LEN+ONIONSKIN_REPLY_LEN) < 0)
-			{	log_warn(LD_OR,get_lang_str(LANG_LOG_WORKER_ONIONSKIN_ANSWER_FAILED));
-				circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
-			}
-			else	log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_ONIONSKIN_ANSWER_OK));
-		}
-	}
-	else	tor_assert(0); /* don't ask me to do handshakes yet */
-	conn->state = CPUWORKER_STATE_IDLE;
-	num_cpuworkers_busy--;
-	if(conn->timestamp_created < last_rotation_time)
-	{	connection_mark_for_close(conn);
-		num_cpuworkers--;
-		spawn_enough_cpuworkers();
-	}
-	else	process_pending_task(conn);
-	return 0;
-}
-
+/** Act on the answer that a cpuworker left in <b>job</b>. */
+static void
+cpuworker_handle_answer(cpuworker_job_t *job)
+{
+  connection_t *tmp_conn;
+  or_connection_t *p_conn = NULL;
+  circuit_t *circ = NULL;
 
-/** Write <b>count</b> bytes from <b>buf</b> to <b>fd</b>.  <b>isSocket</b> must be 1 if fd was returned by socket() or accept(), and 0 if fd was returned by open().  Return the number of bytes written, or -1 on error.  Only use if fd is a blocking fd.  */
-ssize_t write_all(int fd, const char *buf, size_t count)
-{	size_t written = 0;
-	ssize_t result;
-	tor_assert(count < SSIZE_T_MAX);
-	while(written != count)
-	{		result = tor_socket_send(fd, buf+written, count-written, 0);
-			if (result<0)
-				return -1;
-			written += result;
-	}
-	return (ssize_t)count;
+  if (job->task_work) {
+    job->task_reply(job->task_arg);
+    return;
+  }
+  /* parse out the circ it was talking about */
+  tmp_conn = connection_get_by_global_id(job->conn_id);
+  if (tmp_conn && !tmp_conn->marked_for_close &&
+      tmp_conn->type == CONN_TYPE_OR)
+    p_conn = TO_OR_CONN(tmp_conn);
+  if (p_conn)
+    circ = circuit_get_by_circid_orconn(job->circ_id, p_conn);
+  if (!job->success) {
+    log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_DECODING_FAILED));
+    if (circ)
+      circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
+  } else if (!circ) {
+    /* This happens because somebody sends us a destroy cell and the circuit
+     * goes away, while the cpuworker is working.  This is also why our job
+     * doesn't include a pointer to the circ, because we'd never know if it's
+     * still valid. */
+    log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_CIRC_GONE));
+  } else {
+    tor_assert(! CIRCUIT_IS_ORIGIN(circ));
+    if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, job->reply,
+                         job->keys) < 0) {
+      log_warn(LD_OR,get_lang_str(LANG_LOG_WORKER_ONIONSKIN_ANSWER_FAILED));
+      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    } else
+      log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_ONIONSKIN_ANSWER_OK));
+  }
+  memset(job->keys, 0, sizeof(job->keys));
 }
 
-/** Read from <b>fd</b> to <b>buf</b>, until we get <b>count</b> bytes or reach the end of the file. <b>isSocket</b> must be 1 if fd was returned by socket() or accept(), and 0 if fd was returned by open().  Return the number of bytes read, or -1 on error. Only use if fd is a blocking fd. */
-ssize_t read_all(int fd, char *buf, size_t count)
-{	size_t numread = 0;
-	ssize_t result;
-
-	if(count > SIZE_T_CEILING || count > SSIZE_T_MAX)
-		return -1;
-	while(numread != count)
-	{	result = tor_socket_recv(fd, buf+numread, count-numread, 0);
-		if(result<0)
-			return -1;
-		else if (result == 0)
-			break;
-		numread += result;
-	}
-	return (ssize_t)numread;
+/** Called when a cpuworker has woken us up.  Take back every finished job
+ * from every worker, act on the answers, and hand out whatever onionskins
+ * are waiting.
+ */
+int
+connection_cpu_process_inbuf(connection_t *conn)
+{
+  tor_assert(conn);
+  tor_assert(conn->type == CONN_TYPE_CPUWORKER);
+  if (buf_datalen(conn->inbuf))
+    buf_clear(conn->inbuf);
+  /* Clear the flag before looking at the rings, so that a worker that
+   * finishes after we've looked will wake us up again. */
+  InterlockedExchange(&cpuworker_notify_pending, 0);
+  if (!cpuworkers)
+    return 0;
+  SMARTLIST_FOREACH(cpuworkers, cpuworker_t *, worker,
+  {
+    LONG n_completed = worker->n_completed;
+    while (worker->n_reaped != n_completed) {
+      cpuworker_handle_answer(
+                 &worker->jobs[worker->n_reaped & (CPUWORKER_QUEUE_LEN-1)]);
+      ++worker->n_reaped;
+    }
+    if (worker->n_reaped != worker->n_submitted)
+      worker->busy_since = get_time(NULL);
+  });
+  process_pending_tasks();
+  return 0;
 }
 
+/** Tell the main loop that a cpuworker has finished a job, unless somebody
+ * already has. */
+static void
+cpuworker_notify_main(void)
+{
+  char c = 0;
+  if (InterlockedExchange(&cpuworker_notify_pending, 1) == 0)
+    tor_socket_send(cpuworker_notify_fd, &c, 1, 0);
+}
 
-/** Implement a cpuworker.  'data' is an fdarray as returned by socketpair.
- * Read and writes from fdarray[1].  Reads requests, writes answers.
- *
- *   Request format:
- *          Task type           [1 byte, always CPUWORKER_TASK_ONION]
- *          Opaque tag          TAG_LEN
- *          Onionskin challenge ONIONSKIN_CHALLENGE_LEN
- *   Response format:
- *          Success/failure     [1 byte, boolean.]
- *          Opaque tag          TAG_LEN
- *          Onionskin challenge ONIONSKIN_REPLY_LEN
- *          Negotiated keys     KEY_LEN*2+DIGEST_LEN*2
- *
- *  (Note: this _should_ be by addr/port, since we're concerned with specific
- * connections, not with routers (where we'd use identity).)
+/** Implement a cpuworker.  <b>data</b> is the cpuworker_t it shares with the
+ * main thread.  Answer the onionskins and run the tasks in its ring in order
+ * until we are told to exit, sleeping whenever the ring is empty.
  */
-static void cpuworker_main(void *data)
-{	char question[ONIONSKIN_CHALLENGE_LEN];
-	uint8_t question_type;
-	tor_socket_t *fdarray = data;
-	tor_socket_t fd;
-
-	/* variables for onion processing */
-	char keys[CPATH_KEY_MATERIAL_LEN];
-	char reply_to_proxy[ONIONSKIN_REPLY_LEN];
-	char buf[LEN_ONION_RESPONSE];
-	char tag[TAG_LEN];
-	crypto_pk_env_t *onion_key = NULL, *last_onion_key = NULL;
-
-	fd = fdarray[1]; /* this side is ours */
-#ifndef TOR_IS_MULTITHREADED
-	tor_close_socket(fdarray[0]); /* this is the side of the socketpair the parent uses */
-	tor_free_all(1); /* so the child doesn't hold the parent's fd's open */
-	handle_signals(0); /* ignore interrupts from the keyboard, etc */
-#endif
-	tor_free(data);
-	dup_onion_keys(&onion_key, &last_onion_key);
-	for(;;)
-	{	ssize_t r;
-		if((r = recv(fd, (void *)&question_type, 1, 0)) != 1)
-		{//	log_fn(LOG_ERR,"read type failed. Exiting.");
-			if(r == 0)	log_info(LD_OR,get_lang_str(LANG_LOG_WORKER_CONN_CLOSED));
-			else		log_info(LD_OR,get_lang_str(LANG_LOG_WORKER_CONN_ERROR),fd,tor_socket_strerror(tor_socket_errno(fd)));
-			break;
-		}
-		tor_assert(question_type == CPUWORKER_TASK_ONION);
-		if(read_all(fd, tag, TAG_LEN) != TAG_LEN)
-		{	log_err(LD_BUG,get_lang_str(LANG_LOG_WORKER_READ_TAG_FAILED));
-			break;
-		}
-		if(read_all(fd, question, ONIONSKIN_CHALLENGE_LEN) != ONIONSKIN_CHALLENGE_LEN)
-		{	log_err(LD_BUG,get_lang_str(LANG_LOG_WORKER_READ_QUESTION_FAILED));
-			break;
-		}
-		if(question_type == CPUWORKER_TASK_ONION)
-		{	if(onion_skin_server_handshake(question, onion_key, last_onion_key,reply_to_proxy, keys, CPATH_KEY_MATERIAL_LEN) < 0)	/* failure */
-			{	log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_ONION_SKIN_SERVER_HANDSHAKE_FAILED));
-				*buf = 0; /* indicate failure in first byte */
-				memcpy(buf+1,tag,TAG_LEN);
-				/* send all zeros as answer */
-				memset(buf+1+TAG_LEN, 0, LEN_ONION_RESPONSE-(1+TAG_LEN));
-			}
-			else	/* success */
-			{	log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_ONION_SKIN_SERVER_HANDSHAKE_SUCCEEDED));
-				buf[0] = 1; /* 1 means success */
-				memcpy(buf+1,tag,TAG_LEN);
-				memcpy(buf+1+TAG_LEN,reply_to_proxy,ONIONSKIN_REPLY_LEN);
-				memcpy(buf+1+TAG_LEN+ONIONSKIN_REPLY_LEN,keys,CPATH_KEY_MATERIAL_LEN);
-			}
-			if(write_all(fd, buf, LEN_ONION_RESPONSE) != LEN_ONION_RESPONSE)
-			{	log_err(LD_BUG,get_lang_str(LANG_LOG_WORKER_WRITING_RESPONSE_FAILED));
-				break;
-			}
-			log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_FINISHED_WRITING_RESPONSE));
-		}
-	}
-	if(onion_key)		crypto_free_pk_env(onion_key);
-	if(last_onion_key)	crypto_free_pk_env(last_onion_key);
-	tor_close_socket(fd);
-	crypto_thread_cleanup();
-	spawn_exit();
+static void
+cpuworker_main(void *data)
+{
+  cpuworker_t *worker = data;
+  crypto_pk_env_t *onion_key = NULL, *last_onion_key = NULL;
+  LONG key_generation = -1;
+  LONG n_started = 0;
+
+  for (;;) {
+    cpuworker_job_t *job;
+    uint64_t started = 0;
+    if (worker->exiting)
+      break;
+    if (n_started == worker->n_submitted) {
+      WaitForSingleObject(worker->wakeup, INFINITE);
+      continue;
+    }
+    job = &worker->jobs[n_started & (CPUWORKER_QUEUE_LEN-1)];
+    if (etw_enabled(ETW_KW_CPUWORKER))
+      started = perf_now_usec();
+    if (job->task_work) {
+      job->task_work(job->task_arg);
+      if (started)
+        etw_cpuworker_task(ETW_TASK_QUEUED, 1, perf_now_usec() - started);
+      InterlockedExchange(&worker->n_completed, ++n_started);
+      cpuworker_notify_main();
+      continue;
+    }
+    /* We only have onion keys when we are a server, so don't ask for them
+     * before the first onionskin. */
+    if (key_generation != cpuworker_key_generation) {
+      key_generation = cpuworker_key_generation;
+      if (onion_key)
+        crypto_free_pk_env(onion_key);
+      if (last_onion_key)
+        crypto_free_pk_env(last_onion_key);
+      onion_key = last_onion_key = NULL;
+      dup_onion_keys(&onion_key, &last_onion_key);
+    }
+    if (onion_skin_server_handshake(job->onionskin, onion_key, last_onion_key,
+                                    job->reply, job->keys,
+                                    CPATH_KEY_MATERIAL_LEN) < 0) {
+      log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_ONION_SKIN_SERVER_HANDSHAKE_FAILED));
+      job->success = 0;
+    } else {
+      log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_ONION_SKIN_SERVER_HANDSHAKE_SUCCEEDED));
+      job->success = 1;
+    }
+    if (started)
+      etw_cpuworker_task(ETW_TASK_ONIONSKIN, 1, perf_now_usec() - started);
+    /* Publish the answer before telling anybody about it. */
+    InterlockedExchange(&worker->n_completed, ++n_started);
+    cpuworker_notify_main();
+  }
+  if (onion_key)
+    crypto_free_pk_env(onion_key);
+  if (last_onion_key)
+    crypto_free_pk_env(last_onion_key);
+  cpuworker_decref(worker);
+  crypto_thread_cleanup();
+  spawn_exit();
 }
 
-/** Launch a new cpuworker. Return 0 if we're happy, -1 if we failed.
- */
+/** Make sure we have a socket on which the cpuworkers can wake the main
+ * loop.  Return 0 on success, -1 on failure. */
 static int
-spawn_cpuworker(void)
+cpuworker_open_notify_socket(void)
 {
-  tor_socket_t *fdarray;
-  tor_socket_t fd;
+  tor_socket_t fdarray[2];
   connection_t *conn;
   int err;
 
-  fdarray = tor_malloc(sizeof(tor_socket_t)*2);
+  if (cpuworker_notify_conn)
+    return 0;
   if ((err = tor_socketpair(SOCK_STREAM, 0, fdarray)) < 0) {
     log_warn(LD_NET,get_lang_str(LANG_LOG_WORKER_SOCKETPAIR_ERROR),tor_socket_strerror(-err));
-    tor_free(fdarray);
     return -1;
   }
-
   tor_assert(fdarray[0] >= 0);
   tor_assert(fdarray[1] >= 0);
 
-  fd = fdarray[0];
-  spawn_func(cpuworker_main, (void*)fdarray);
-  log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_NEW));
-#ifndef TOR_IS_MULTITHREADED
-  tor_close_socket(fdarray[1]); /* don't need the worker's side of the pipe */
-  tor_free(fdarray);
-#endif
-
   conn = connection_new(CONN_TYPE_CPUWORKER, AF_UNIX);
-
-  set_socket_nonblocking(fd);
+  set_socket_nonblocking(fdarray[0]);
+  set_socket_nonblocking(fdarray[1]);
 
   /* set up conn so it's got all the data we need to remember */
-  conn->s = fd;
+  conn->s = fdarray[0];
   conn->address = tor_strdup("localhost");
 
   if (connection_add(conn) < 0) { /* no space, forget it */
     log_warn(LD_NET,get_lang_str(LANG_LOG_WORKER_CONNECTION_ADD_FAILED));
     connection_free(conn); /* this closes fd */
+    tor_close_socket(fdarray[1]);
     return -1;
   }
 
   conn->state = CPUWORKER_STATE_IDLE;
   connection_start_reading(conn);
+  cpuworker_notify_conn = conn;
+  cpuworker_notify_fd = fdarray[1];
+  InterlockedExchange(&cpuworker_notify_pending, 0);
+  return 0;
+}
 
+/** Launch a new cpuworker. Return 0 if we're happy, -1 if we failed.
+ */
+static int
+spawn_cpuworker(void)
+{
+  cpuworker_t *worker;
+
+  if (cpuworker_open_notify_socket() < 0)
+    return -1;
+  worker = tor_malloc_zero(sizeof(cpuworker_t));
+  worker->wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!worker->wakeup) {
+    tor_free(worker);
+    return -1;
+  }
+  worker->refcount = 2; /* one for us, one for the thread */
+  if (spawn_func(cpuworker_main, worker) < 0) {
+    CloseHandle(worker->wakeup);
+    tor_free(worker);
+    return -1;
+  }
+  log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_NEW));
+  if (!cpuworkers)
+    cpuworkers = smartlist_create();
+  smartlist_add(cpuworkers, worker);
   return 0; /* success */
 }
 
-/** If we have too few or too many active cpuworkers, try to spawn new ones
- * or kill idle ones.
+/** If we have too few or too many cpuworkers, try to spawn new ones
+ * or stop idle ones.
  */
 static void
 spawn_enough_cpuworkers(void)
 {
-  int num_cpuworkers_needed = get_options()->NumCpus;
+  int num_cpuworkers_needed = get_num_cpus(get_options());
+  int i;
 
   if (num_cpuworkers_needed < MIN_CPUWORKERS)
     num_cpuworkers_needed = MIN_CPUWORKERS;
   if (num_cpuworkers_needed > MAX_CPUWORKERS)
     num_cpuworkers_needed = MAX_CPUWORKERS;
 
-  while (num_cpuworkers < num_cpuworkers_needed) {
+  while (!cpuworkers || smartlist_len(cpuworkers) < num_cpuworkers_needed) {
     if (spawn_cpuworker() < 0) {
       log_warn(LD_GENERAL,get_lang_str(LANG_LOG_WORKER_FAILED_NEW));
       return;
     }
-    num_cpuworkers++;
   }
+  for (i = smartlist_len(cpuworkers) - 1;
+       i >= 0 && smartlist_len(cpuworkers) > num_cpuworkers_needed; --i) {
+    cpuworker_t *worker = smartlist_get(cpuworkers, i);
+    if (worker->n_reaped == worker->n_submitted) {
+      smartlist_del(cpuworkers, i);
+      cpuworker_stop(worker);
+    }
+  }
+}
+
+/** Return the cpuworker with the fewest outstanding jobs, or NULL if every
+ * worker's ring is full. */
+static cpuworker_t *
+cpuworker_choose(void)
+{
+  cpuworker_t *best = NULL;
+  LONG best_load = CPUWORKER_QUEUE_LEN;
+  if (!cpuworkers)
+    return NULL;
+  SMARTLIST_FOREACH(cpuworkers, cpuworker_t *, worker,
+  {
+    LONG load = worker->n_submitted - worker->n_reaped;
+    if (load < best_load) {
+      best = worker;
+      best_load = load;
+    }
+  });
+  return best;
 }
 
-/** Take a pending task from the queue and assign it to 'cpuworker'. */
+/** Hand pending tasks from the queue to cpuworkers while they have room. */
 static void
-process_pending_task(connection_t *cpuworker)
+process_pending_tasks(void)
 {
   or_circuit_t *circ;
   char *onionskin = NULL;
 
-  tor_assert(cpuworker);
+  /* onionskins go first: they are what we owe the rest of the network */
 
-  /* for now only process onion tasks */
-
-  circ = onion_next_task(&onionskin);
-  if (!circ)
-    return;
-  if (assign_onionskin_to_cpuworker(cpuworker, circ, onionskin))
-    log_warn(LD_OR,get_lang_str(LANG_LOG_WORKER_ASSIGN_FAILED));
+  while (cpuworker_choose() && (circ = onion_next_task(&onionskin))) {
+    if (assign_onionskin_to_cpuworker(circ, onionskin))
+      log_warn(LD_OR,get_lang_str(LANG_LOG_WORKER_ASSIGN_FAILED));
+  }
+  if (cpuworker_choose())
+    rend_service_assign_pending_intros();
 }
 
 /** How long should we let a cpuworker stay busy before we give
@@ -393,49 +487,168 @@ process_pending_task(connection_t *cpuworker)
 #define CPUWORKER_BUSY_TIMEOUT (60*60*12)
 
 /** We have a bug that I can't find. Sometimes, very rarely, cpuworkers get
- * stuck in the 'busy' state, even though the cpuworker process thinks of
- * itself as idle. I don't know why. But here's a workaround to kill any
- * cpuworker that's been busy for more than CPUWORKER_BUSY_TIMEOUT.
+ * stuck in the 'busy' state, even though the cpuworker thread thinks of
+ * itself as idle. I don't know why. But here's a workaround to give up on
+ * any cpuworker that's been busy for more than CPUWORKER_BUSY_TIMEOUT.
  */
 static void
 cull_wedged_cpuworkers(void)
 {
   time_t now = get_time(NULL);
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
+  if (!cpuworkers)
+    return;
+  SMARTLIST_FOREACH(cpuworkers, cpuworker_t *, worker,
   {
-    if (!conn->marked_for_close &&
-        conn->type == CONN_TYPE_CPUWORKER &&
-        conn->state == CPUWORKER_STATE_BUSY_ONION &&
-        conn->timestamp_lastwritten + CPUWORKER_BUSY_TIMEOUT < now) {
+    if (worker->n_reaped != worker->n_submitted &&
+        worker->busy_since + CPUWORKER_BUSY_TIMEOUT < now) {
       log_notice(LD_BUG,get_lang_str(LANG_LOG_WORKER_CLOSING_WEDGED_WORKER));
-      num_cpuworkers_busy--;
-      num_cpuworkers--;
-      connection_mark_for_close(conn);
+      SMARTLIST_DEL_CURRENT(cpuworkers, worker);
+      cpuworker_stop(worker);
     }
   });
 }
 
-/** Try to tell a cpuworker to perform the public key operations necessary to
- * respond to <b>onionskin</b> for the circuit <b>circ</b>.
+/** Most helper threads we will start for cpuworker_run_batch(). */
+#define MAX_BATCH_HELPERS (MAX_CPUWORKERS-1)
+
+/** The batch of independent jobs that the main thread is sharing out
+ * between itself and the batch helper threads.  Only the main thread writes
+ * anything but <b>next_item</b> and <b>n_busy_helpers</b>, and only while no
+ * helper is looking at the batch. */
+static struct {
+  /** Function to call on each item. */
+  cpuworker_batch_fn_t fn;
+  /** First argument for <b>fn</b>. */
+  void *arg;
+  /** How many items are in the batch? */
+  LONG n_items;
+  /** Index of the next item that nobody has taken yet. */
+  volatile LONG next_item;
+  /** How many helpers were woken for this batch and haven't left it? */
+  volatile LONG n_busy_helpers;
+  /** Released once for every helper that should join a new batch. */
+  HANDLE start;
+  /** Signalled by the last helper to leave a batch. */
+  HANDLE done;
+} batch;
+/** How many batch helper threads have we started? */
+static int n_batch_helpers = 0;
+/** True while the main thread is inside cpuworker_run_batch(). */
+static int batch_running = 0;
+
+/** Take items from the current batch and run them until none are left. */
+static void
+cpuworker_batch_work(void)
+{
+  LONG idx;
+  while ((idx = InterlockedIncrement(&batch.next_item) - 1) < batch.n_items)
+    batch.fn(batch.arg, (int)idx);
+}
+
+/** Implement a batch helper: each time we are woken, help with the current
+ * batch, then tell the main thread if we were the last helper on it. */
+static void
+cpuworker_batch_main(void *data)
+{
+  (void)data;
+  for (;;) {
+    WaitForSingleObject(batch.start, INFINITE);
+    cpuworker_batch_work();
+    if (InterlockedDecrement(&batch.n_busy_helpers) == 0)
+      SetEvent(batch.done);
+  }
+}
+
+/** Start batch helpers until we have one for every CPU but the one the main
+ * thread runs on.  Return the number of helpers we can use. */
+static int
+cpuworker_batch_spawn_helpers(void)
+{
+  int wanted = get_num_cpus(get_options()) - 1;
+  if (wanted > MAX_BATCH_HELPERS)
+    wanted = MAX_BATCH_HELPERS;
+  if (wanted <= 0)
+    return 0;
+  if (!batch.start) {
+    batch.start = CreateSemaphore(NULL, 0, MAX_BATCH_HELPERS, NULL);
+    batch.done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!batch.start || !batch.done) {
+      if (batch.start)
+        CloseHandle(batch.start);
+      if (batch.done)
+        CloseHandle(batch.done);
+      batch.start = batch.done = NULL;
+      return 0;
+    }
+  }
+  while (n_batch_helpers < wanted) {
+    if (spawn_func(cpuworker_batch_main, NULL) < 0) {
+      log_warn(LD_GENERAL,get_lang_str(LANG_LOG_WORKER_FAILED_NEW));
+      break;
+    }
+    ++n_batch_helpers;
+  }
+  return n_batch_helpers < wanted ? n_batch_helpers : wanted;
+}
+
+/** Call <b>fn</b>(<b>arg</b>, <b>i</b>) for every <b>i</b> from 0 to
+ * <b>n_items</b>-1, sharing the calls out between the main thread and
+ * the batch helper threads, and return once they have all finished.
  *
- * If <b>cpuworker</b> is defined, assert that he's idle, and use him. Else,
- * look for an idle cpuworker and use him. If none idle, queue task onto the
- * pending onion list and return.  Return 0 if we successfully assign the
- * task, or -1 on failure.
- */
-int
-assign_onionskin_to_cpuworker(connection_t *cpuworker,
-                              or_circuit_t *circ, char *onionskin)
+ * The calls may run in any order and at the same time, so <b>fn</b> must
+ * only write to state that belongs to its own item; anything shared it
+ * reads has to stay unchanged until we return.  Must be called from the main
+ * thread only, and <b>fn</b> must not call us again. */
+void
+cpuworker_run_batch(int n_items, cpuworker_batch_fn_t fn, void *arg)
 {
-  char qbuf[1];
-  char tag[TAG_LEN];
+  int n_helpers, i;
+  uint64_t started = 0;
 
+  tor_assert(fn);
+  tor_assert(!batch_running);
+  if (n_items <= 0)
+    return;
+  if (etw_enabled(ETW_KW_CPUWORKER))
+    started = perf_now_usec();
+  n_helpers = n_items > 1 ? cpuworker_batch_spawn_helpers() : 0;
+  if (n_helpers > n_items - 1)
+    n_helpers = n_items - 1;
+  if (n_helpers <= 0) {
+    for (i = 0; i < n_items; ++i)
+      fn(arg, i);
+    if (started)
+      etw_cpuworker_task(ETW_TASK_BATCH, n_items, perf_now_usec() - started);
+    return;
+  }
+
+  batch_running = 1;
+  batch.fn = fn;
+  batch.arg = arg;
+  batch.n_items = n_items;
+  batch.next_item = 0;
+  batch.n_busy_helpers = n_helpers;
+  /* Releasing the semaphore publishes the batch to the helpers. */
+  ReleaseSemaphore(batch.start, n_helpers, NULL);
+  cpuworker_batch_work();
+  /* Every item has been taken; wait until the helpers are done with theirs,
+   * and have let go of the batch. */
+  WaitForSingleObject(batch.done, INFINITE);
+  batch_running = 0;
+  if (started)
+    etw_cpuworker_task(ETW_TASK_BATCH, n_items, perf_now_usec() - started);
+}
+
+/** Cull wedged cpuworkers, and start or stop workers as needed, once a
+ * minute. */
+static void
+cpuworker_housekeeping(void)
+{
   time_t now = approx_time();
   static time_t last_culled_cpuworkers = 0;
 
-  /* Checking for wedged cpuworkers requires a linear search over all
-   * connections, so let's do it only once a minute.
+  /* Checking for wedged cpuworkers requires a look at every worker, so
+   * let's do it only once a minute.
    */
 #define CULL_CPUWORKERS_INTERVAL 60
 
@@ -444,44 +657,94 @@ assign_onionskin_to_cpuworker(connection_t *cpuworker,
     spawn_enough_cpuworkers();
     last_culled_cpuworkers = now;
   }
+}
 
-  if (1) {
-    if (num_cpuworkers_busy == num_cpuworkers) {
-      log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_QUEUE_NEW));
-      if (onion_pending_add(circ, onionskin) < 0) {
-        tor_free(onionskin);
-        return -1;
-      }
-      return 0;
-    }
-
-    if (!cpuworker)
-      cpuworker = connection_get_by_type_state(CONN_TYPE_CPUWORKER,
-                                               CPUWORKER_STATE_IDLE);
+/** Try to tell a cpuworker to perform the public key operations necessary to
+ * respond to <b>onionskin</b> for the circuit <b>circ</b>.
+ *
+ * Use the cpuworker with the least work waiting.  If every worker is full,
+ * queue task onto the pending onion list and return.  Return 0 if we
+ * successfully assign the task, or -1 on failure.
+ */
+int
+assign_onionskin_to_cpuworker(or_circuit_t *circ, char *onionskin)
+{
+  cpuworker_t *worker;
+  cpuworker_job_t *job;
 
-    tor_assert(cpuworker);
+  cpuworker_housekeeping();
 
-    if (!circ->p_conn) {
-      log_info(LD_OR,get_lang_str(LANG_LOG_WORKER_FAILING_CIRC));
+  if (!(worker = cpuworker_choose())) {
+    log_debug(LD_OR,get_lang_str(LANG_LOG_WORKER_QUEUE_NEW));
+    if (onion_pending_add(circ, onionskin) < 0) {
       tor_free(onionskin);
       return -1;
     }
-    tag_pack(tag, circ->p_conn->_base.global_identifier,
-             circ->p_circ_id);
-
-    cpuworker->state = CPUWORKER_STATE_BUSY_ONION;
-    /* touch the lastwritten timestamp, since that's how we check to
-     * see how long it's been since we asked the question, and sometimes
-     * we check before the first call to connection_handle_write(). */
-    cpuworker->timestamp_lastwritten = get_time(NULL);
-    num_cpuworkers_busy++;
-
-    qbuf[0] = CPUWORKER_TASK_ONION;
-    connection_write_to_buf(qbuf, 1, cpuworker);
-    connection_write_to_buf(tag, sizeof(tag), cpuworker);
-    connection_write_to_buf(onionskin, ONIONSKIN_CHALLENGE_LEN, cpuworker);
+    return 0;
+  }
+
+  if (!circ->p_conn) {
+    log_info(LD_OR,get_lang_str(LANG_LOG_WORKER_FAILING_CIRC));
     tor_free(onionskin);
+    return -1;
   }
+
+  job = &worker->jobs[worker->n_submitted & (CPUWORKER_QUEUE_LEN-1)];
+  job->task_work = NULL;
+  job->conn_id = circ->p_conn->_base.global_identifier;
+  job->circ_id = circ->p_circ_id;
+  memcpy(job->onionskin, onionskin, ONIONSKIN_CHALLENGE_LEN);
+  tor_free(onionskin);
+
+  /* remember when the worker went from idle to busy, since that's how we
+   * check to see how long it's been since we asked the question. */
+  if (worker->n_reaped == worker->n_submitted)
+    worker->busy_since = get_time(NULL);
+  /* Publish the job before waking the worker. */
+  InterlockedExchange(&worker->n_submitted, worker->n_submitted + 1);
+  SetEvent(worker->wakeup);
   return 0;
 }
 
+/** Have a cpuworker call <b>work</b>(<b>arg</b>), then call
+ * <b>reply</b>(<b>arg</b>) on the main thread once it has finished.
+ *
+ * Use the cpuworker with the least work waiting.  If every worker is full,
+ * return -1: the caller keeps the task and tries again from
+ * rend_service_assign_pending_intros() when a worker has room.  If we can't
+ * start any worker at all, run both functions right away.  Return 0 if the
+ * task is taken care of.  Until <b>reply</b> is called, <b>work</b> owns
+ * <b>arg</b>, and must not look at anything else that the main thread could
+ * change. */
+int
+cpuworker_queue_task(cpuworker_task_fn_t work, cpuworker_task_fn_t reply,
+                     void *arg)
+{
+  cpuworker_t *worker;
+  cpuworker_job_t *job;
+
+  tor_assert(work);
+  tor_assert(reply);
+  if (!cpuworkers || !smartlist_len(cpuworkers))
+    spawn_enough_cpuworkers();
+  else
+    cpuworker_housekeeping();
+  if (!cpuworkers || !smartlist_len(cpuworkers)) {
+    work(arg);
+    reply(arg);
+    return 0;
+  }
+  if (!(worker = cpuworker_choose()))
+    return -1;
+
+  job = &worker->jobs[worker->n_submitted & (CPUWORKER_QUEUE_LEN-1)];
+  job->task_work = work;
+  job->task_reply = reply;
+  job->task_arg = arg;
+  if (worker->n_reaped == worker->n_submitted)
+    worker->busy_since = get_time(NULL);
+  /* Publish the job before waking the worker. */
+  InterlockedExchange(&worker->n_submitted, worker->n_submitted + 1);
+  SetEvent(worker->wakeup);
+  return 0;
+}
@@ -17,9 +17,17 @@ void cpuworkers_rotate(void);
 int connection_cpu_finished_flushing(connection_t *conn);
 int connection_cpu_reached_eof(connection_t *conn);
 int connection_cpu_process_inbuf(connection_t *conn);
-int assign_onionskin_to_cpuworker(connection_t *cpuworker,
-                                  or_circuit_t *circ,
-                                  char *onionskin);
+int assign_onionskin_to_cpuworker(or_circuit_t *circ, char *onionskin);
+
+/** A function that cpuworker_run_batch() calls on item <b>idx</b>. */
+typedef void (*cpuworker_batch_fn_t)(void *arg, int idx);
+void cpuworker_run_batch(int n_items, cpuworker_batch_fn_t fn, void *arg);
+
+/** A function that cpuworker_queue_task() calls on a cpuworker, or on the
+ * main thread once the cpuworker is done. */
+typedef void (*cpuworker_task_fn_t)(void *arg);
+int cpuworker_queue_task(cpuworker_task_fn_t work, cpuworker_task_fn_t reply,
+                         void *arg);
 
 #endif
 
@@ -6,15 +6,19 @@
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
+#include "circuitlist.h"
+#include "circuituse.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "geoip.h"
 #include "main.h"
+#include "microdesc.h"
 #include "networkstatus.h"
 #include "policies.h"
 #include "rendclient.h"
@@ -79,6 +83,8 @@ static void dir_routerdesc_download_failed(smartlist_t *failed,
                                            int router_purpose,
                                            int was_extrainfo,
                                            int was_descriptor_digests);
+static void dir_microdesc_download_failed(smartlist_t *failed,
+                                          int status_code);
 static void note_client_request(int purpose, int compressed, size_t bytes);
 static int client_likes_consensus(networkstatus_t *v, const char *want_url);
 
@@ -117,6 +123,35 @@ static void directory_initiate_command_rend(const char *address,
 #define ROBOTS_CACHE_LIFETIME (24*60*60)
 #define MICRODESC_CACHE_LIFETIME (48*60*60)
 
+/** How many directory mirrors do we consider each time we choose where to
+ * send a batch of descriptor downloads? */
+#define DESC_MIRROR_CHOICES 3
+/** How many bytes per second do we expect from a mirror we haven't
+ * downloaded descriptors from yet?  This is optimistic on purpose, so that
+ * new mirrors get tried. */
+#define DESC_MIRROR_DEFAULT_BW (64*1024)
+/** How long do we give a descriptor download before we ask another mirror
+ * for the same descriptors? */
+#define DESC_FETCH_STRAGGLER_TIMEOUT 30
+
+/** Return true iff <b>purpose</b> is a purpose for fetching router, extrainfo
+ * or micro- descriptors in batches. */
+#define DIR_PURPOSE_IS_DESC_FETCH(purpose)          \
+  ((purpose) == DIR_PURPOSE_FETCH_SERVERDESC ||     \
+   (purpose) == DIR_PURPOSE_FETCH_EXTRAINFO ||      \
+   (purpose) == DIR_PURPOSE_FETCH_MICRODESC)
+
+/** What we have seen of one directory mirror while downloading descriptors
+ * from it. */
+typedef struct dir_mirror_stats_t {
+  /** Weighted average of the bytes per second the mirror sent us. */
+  double bytes_per_sec;
+} dir_mirror_stats_t;
+
+/** Map from identity digest to the dir_mirror_stats_t of each directory
+ * mirror we downloaded descriptors from. */
+static digestmap_t *dir_mirror_stats = NULL;
+
 /********* END VARIABLES ************/
 
 /** Return true iff the directory purpose 'purpose' must use an
@@ -137,7 +172,8 @@ purpose_needs_anonymity(uint8_t dir_purpose, uint8_t router_purpose)
       dir_purpose == DIR_PURPOSE_FETCH_CONSENSUS ||
       dir_purpose == DIR_PURPOSE_FETCH_CERTIFICATE ||
       dir_purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
-      dir_purpose == DIR_PURPOSE_FETCH_EXTRAINFO)
+      dir_purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
+      dir_purpose == DIR_PURPOSE_FETCH_MICRODESC)
     return 0;
   return 1;
 }
@@ -188,6 +224,8 @@ const char *dir_conn_purpose_to_string(int purpose)
       return get_lang_str(LANG_LOG_DIR_P_SERVER_DESC_FETCH);
     case DIR_PURPOSE_FETCH_EXTRAINFO:
       return get_lang_str(LANG_LOG_DIR_P_EXTRA_INFO_FETCH);
+    case DIR_PURPOSE_FETCH_MICRODESC:
+      return get_lang_str(LANG_LOG_DIR_P_MICRODESC_FETCH);
     case DIR_PURPOSE_FETCH_CONSENSUS:
       return get_lang_str(LANG_LOG_DIR_P_CONSENSUS_NETWORKSTATUS_FETCH);
     case DIR_PURPOSE_FETCH_CERTIFICATE:
@@ -321,6 +359,206 @@ directory_post_to_dirservers(uint8_t dir_purpose, uint8_t router_purpose,
   }
 }
 
+/** Remember that the directory mirror with identity <b>digest</b> sent us
+ * <b>bytes</b> bytes of descriptors in <b>elapsed</b> seconds. */
+static void
+note_dir_mirror_throughput(const char *digest, size_t bytes, long elapsed)
+{
+  dir_mirror_stats_t *stats;
+  double rate;
+
+  if (tor_digest_is_zero(digest))
+    return;
+  if (elapsed < 1)
+    elapsed = 1;
+  rate = ((double)bytes) / elapsed;
+  if (!dir_mirror_stats)
+    dir_mirror_stats = digestmap_new();
+  stats = digestmap_get(dir_mirror_stats, digest);
+  if (!stats) {
+    stats = tor_malloc_zero(sizeof(dir_mirror_stats_t));
+    stats->bytes_per_sec = rate;
+    digestmap_set(dir_mirror_stats, digest, stats);
+  } else {
+    stats->bytes_per_sec = .7*stats->bytes_per_sec + .3*rate;
+  }
+}
+
+/** Return how many bytes per second we expect the directory mirror with
+ * identity <b>digest</b> to send us, if it had nothing else to do for us. */
+static double
+dir_mirror_expected_throughput(const char *digest)
+{
+  dir_mirror_stats_t *stats =
+    dir_mirror_stats ? digestmap_get(dir_mirror_stats, digest) : NULL;
+  return stats ? stats->bytes_per_sec : DESC_MIRROR_DEFAULT_BW;
+}
+
+/** Choose a directory mirror of type <b>type</b> to send a batch of
+ * descriptor downloads to.  Look at a few mirrors picked by
+ * router_pick_directory_server() with <b>pds_flags</b>, never at the one
+ * with identity <b>avoid_digest</b> if it is set, and take the one that
+ * should send us the batch the soonest: the throughput we have seen from
+ * it, shared with the descriptor downloads it is already answering.  Since
+ * tunneled dir requests to a mirror we have an open OR connection to skip
+ * the TLS handshake, and ride along with the other streams on it, prefer
+ * those mirrors too.  Return NULL if we found no mirror. */
+static routerstatus_t *
+pick_descriptor_mirror(authority_type_t type, int pds_flags,
+                       const char *avoid_digest)
+{
+  smartlist_t *conns = get_connection_array();
+  routerstatus_t *best = NULL;
+  double best_score = -1.0;
+  int tunnel = (get_options()->TunnelDirConns & 2) != 0;
+  int i;
+
+  for (i = 0; i < DESC_MIRROR_CHOICES; ++i) {
+    routerstatus_t *rs = router_pick_directory_server(type, pds_flags);
+    int n_fetches = 0, have_or_conn = 0;
+    double score;
+    if (!rs)
+      break;
+    if (rs == best ||
+        (avoid_digest &&
+         tor_memeq(rs->identity_digest, avoid_digest, DIGEST_LEN)))
+      continue;
+    SMARTLIST_FOREACH(conns, connection_t *, conn,
+    {
+      if (conn->marked_for_close)
+        continue;
+      if (conn->type == CONN_TYPE_DIR &&
+          DIR_PURPOSE_IS_DESC_FETCH(conn->purpose) &&
+          tor_memeq(TO_DIR_CONN(conn)->identity_digest, rs->identity_digest,
+                    DIGEST_LEN))
+        ++n_fetches;
+      else if (tunnel && conn->type == CONN_TYPE_OR &&
+               conn->state == OR_CONN_STATE_OPEN &&
+               tor_memeq(TO_OR_CONN(conn)->identity_digest,
+                         rs->identity_digest, DIGEST_LEN))
+        have_or_conn = 1;
+    });
+    score = dir_mirror_expected_throughput(rs->identity_digest) /
+      (1 + n_fetches);
+    if (have_or_conn)
+      score *= 2;
+    if (score > best_score) {
+      best = rs;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+/** Return a directory server of type <b>type</b> that we have a pooled
+ * directory tunnel open to (see circuit_is_pooled_dir_tunnel()), so that
+ * our request can go through it instead of through a new one-hop circuit.
+ * If <b>trusted</b>, look for an authority or fallback directory;
+ * otherwise, look for a mirror among our entry guards, so that we don't
+ * send the clients' load to the authorities.  Return NULL if there is
+ * none. */
+static routerstatus_t *
+pick_pooled_dir_server(authority_type_t type, int trusted)
+{
+  or_options_t *options = get_options();
+  time_t now = approx_time();
+  circuit_t *circ;
+
+  if (!(options->TunnelDirConns & 2))
+    return NULL;
+  for (circ = circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);
+       circ; circ = circ->next_by_purpose) {
+    const char *digest;
+    routerstatus_t *rs;
+    if (circ->marked_for_close || circ->state != CIRCUIT_STATE_OPEN ||
+        !circuit_is_pooled_dir_tunnel(circ))
+      continue;
+    digest = TO_ORIGIN_CIRCUIT(circ)->build_state->chosen_exit->
+      identity_digest;
+    if (router_digest_is_me(digest))
+      continue;
+    if (trusted) {
+      trusted_dir_server_t *ds = router_get_trusteddirserver_by_digest(digest);
+      if (!ds || !ds->is_running || !(ds->type & type) ||
+          ds->fake_status.last_dir_503_at + DIR_503_TIMEOUT > now)
+        continue;
+      return &ds->fake_status;
+    }
+    if (router_digest_is_trusted_dir(digest))
+      continue;
+    rs = router_get_consensus_status_by_id(digest);
+    if (!rs || !rs->is_running || !rs->is_valid || !rs->dir_port ||
+        rs->is_bad_directory || !rs->version_supports_begindir ||
+        rs->last_dir_503_at + DIR_503_TIMEOUT > now)
+      continue;
+    if ((type & V3_AUTHORITY) && !rs->version_supports_v3_dir)
+      continue;
+    if ((type & V2_AUTHORITY) && !rs->is_v2_dir)
+      continue;
+    if (options->ExcludeNodes &&
+        routerset_contains_routerstatus(options->ExcludeNodes, rs))
+      continue;
+    return rs;
+  }
+  return NULL;
+}
+
+/** Return the time at which we should ask another mirror for the
+ * descriptors we asked of <b>conn</b>, or 0 if we never will.  Only clients
+ * that fetch from mirrors hedge their descriptor downloads, and only once
+ * per request. */
+time_t
+directory_straggler_deadline(dir_connection_t *conn)
+{
+  if (conn->_base.marked_for_close || conn->straggler_reissued ||
+      DIR_CONN_IS_SERVER(TO_CONN(conn)) ||
+      !DIR_PURPOSE_IS_DESC_FETCH(conn->_base.purpose) ||
+      conn->router_purpose != ROUTER_PURPOSE_GENERAL ||
+      !conn->requested_resource ||
+      directory_fetches_from_authorities(get_options()))
+    return 0;
+  return conn->_base.timestamp_created + DESC_FETCH_STRAGGLER_TIMEOUT;
+}
+
+/** The descriptor download on <b>conn</b> is taking too long: count what it
+ * sent us so far against its mirror, and ask a different mirror for the
+ * same descriptors.  We leave <b>conn</b> open; whichever answer comes first
+ * fills in the descriptors, and the other one only brings duplicates. */
+void
+directory_reissue_straggler(dir_connection_t *conn)
+{
+  routerstatus_t *rs;
+  authority_type_t type;
+  time_t now = get_time(NULL);
+
+  conn->straggler_reissued = 1;
+  note_dir_mirror_throughput(conn->identity_digest,
+                             buf_datalen(conn->_base.inbuf),
+                             (long)(now - conn->_base.timestamp_created));
+  type = conn->_base.purpose == DIR_PURPOSE_FETCH_EXTRAINFO ?
+    (EXTRAINFO_CACHE|V3_AUTHORITY) : V3_AUTHORITY;
+  rs = pick_descriptor_mirror(type, PDS_RETRY_IF_NO_SERVERS,
+                              conn->identity_digest);
+  if (!rs)
+    return;
+  log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_REISSUE_STRAGGLER),dir_conn_purpose_to_string(conn->_base.purpose),conn->_base.address,rs->nickname);
+  directory_initiate_command_routerstatus(rs, conn->_base.purpose,
+                                          conn->router_purpose,
+                                          !conn->dirconn_direct,
+                                          conn->requested_resource,
+                                          NULL, 0, 0);
+}
+
+/** Release all storage held by the descriptor download scheduler. */
+void
+directory_free_all(void)
+{
+  if (dir_mirror_stats) {
+    digestmap_free(dir_mirror_stats, _tor_free_);
+    dir_mirror_stats = NULL;
+  }
+}
+
 /** Start a connection to a random running directory server, using
  * connection purpose <b>dir_purpose</b>, intending to fetch descriptors
  * of purpose <b>router_purpose</b>, and requesting <b>resource</b>.
@@ -363,6 +601,7 @@ directory_get_from_dirserver(uint8_t dir_purpose, uint8_t router_purpose,
       break;
     case DIR_PURPOSE_FETCH_CONSENSUS:
     case DIR_PURPOSE_FETCH_CERTIFICATE:
+    case DIR_PURPOSE_FETCH_MICRODESC:
       type = V3_AUTHORITY;
       break;
     default:
@@ -372,7 +611,7 @@ directory_get_from_dirserver(uint8_t dir_purpose, uint8_t router_purpose,
 
   if (dir_purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
     networkstatus_t *v = networkstatus_get_latest_consensus();
-    if (v)
+    if (v && v->flavor == USABLE_CONSENSUS_FLAVOR)
       if_modified_since = v->valid_after + 180;
   }
 
@@ -403,7 +642,10 @@ directory_get_from_dirserver(uint8_t dir_purpose, uint8_t router_purpose,
     } else {
       if (prefer_authority || type == BRIDGE_AUTHORITY) {
         /* only ask authdirservers, and don't ask myself */
-        rs = router_pick_trusteddirserver(type, pds_flags);
+        if (!DIR_PURPOSE_IS_DESC_FETCH(dir_purpose))
+          rs = pick_pooled_dir_server(type, 1);
+        if (!rs)
+          rs = router_pick_trusteddirserver(type, pds_flags);
         if (rs == NULL && (pds_flags & PDS_NO_EXISTING_SERVERDESC_FETCH)) {
           /* We don't want to fetch from any authorities that we're currently
            * fetching server descriptors from, and we got no match.  Did we
@@ -422,7 +664,10 @@ directory_get_from_dirserver(uint8_t dir_purpose, uint8_t router_purpose,
       }
       if (!rs && type != BRIDGE_AUTHORITY) {
         /* anybody with a non-zero dirport will do */
-        rs = router_pick_directory_server(type, pds_flags);
+        if (DIR_PURPOSE_IS_DESC_FETCH(dir_purpose))
+          rs = pick_descriptor_mirror(type, pds_flags, NULL);
+        else if (!(rs = pick_pooled_dir_server(type, 0)))
+          rs = router_pick_directory_server(type, pds_flags);
         if (!rs) {
           log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_NO_ROUTER_FOUND),dir_conn_purpose_to_string(dir_purpose));
           rs = router_pick_trusteddirserver(type, pds_flags);
@@ -605,6 +850,9 @@ connection_dir_request_failed(dir_connection_t *conn)
     if (conn->router_purpose == ROUTER_PURPOSE_BRIDGE)
       connection_dir_bridge_routerdesc_failed(conn);
     connection_dir_download_routerdesc_failed(conn);
+  } else if (conn->_base.purpose == DIR_PURPOSE_FETCH_MICRODESC) {
+    /* Not the microdescriptors' fault; we'll ask again soon enough. */
+    log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_REQUEST_FAILED_1),conn->_base.address);
   } else if (conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
     networkstatus_consensus_download_failed(0);
   } else if (conn->_base.purpose == DIR_PURPOSE_FETCH_CERTIFICATE) {
@@ -938,10 +1186,18 @@ _compare_strs(const void **a, const void **b)
  * i.e. GET .../consensus/<b>fpr</b>+<b>fpr</b>+<b>fpr</b>
  */
 static char *
-directory_get_consensus_url(int supports_conditional_consensus)
+directory_get_consensus_url(int supports_conditional_consensus,
+                            const char *resource)
 {
   char *url;
   size_t len;
+  char flavor[64];
+
+  /* A resource names a consensus flavor other than the plain one. */
+  if (resource)
+    tor_snprintf(flavor, sizeof(flavor), "consensus-%s", resource);
+  else
+    strlcpy(flavor, "consensus", sizeof(flavor));
 
   if (supports_conditional_consensus) {
     char *authority_id_list;
@@ -963,16 +1219,18 @@ directory_get_consensus_url(int supports_conditional_consensus)
     authority_id_list = smartlist_join_strings(authority_digests,
                                                "+", 0, NULL);
 
-    len = strlen(authority_id_list)+64;
+    len = strlen(authority_id_list)+128;
     url = tor_malloc(len);
-    tor_snprintf(url, len, "/tor/status-vote/current/consensus/%s.z",
-                 authority_id_list);
+    tor_snprintf(url, len, "/tor/status-vote/current/%s/%s.z",
+                 flavor, authority_id_list);
 
     SMARTLIST_FOREACH(authority_digests, char *, cp, tor_free(cp));
     smartlist_free(authority_digests);
     tor_free(authority_id_list);
   } else {
-    url = tor_strdup("/tor/status-vote/current/consensus.z");
+    len = strlen(flavor)+64;
+    url = tor_malloc(len);
+    tor_snprintf(url, len, "/tor/status-vote/current/%s.z", flavor);
   }
   tor_snprintf(last_dir_status,256,get_lang_str(LANG_LOG_DIR_STATUS_URL),url);updateDirStatus();
   return url;
@@ -992,6 +1250,7 @@ directory_send_command(dir_connection_t *conn,
   char proxyauthstring[256];
   char hoststring[128];
   char imsstring[RFC1123_TIME_LEN+32];
+  char diffstring[HEX_DIGEST256_LEN+32];
   char *url;
   unsigned char *request;
   const char *httpcommand = NULL;
@@ -1021,6 +1280,18 @@ directory_send_command(dir_connection_t *conn,
     tor_snprintf(imsstring, sizeof(imsstring), "\r\nIf-Modified-Since: %s", b);
   }
 
+  /* Ask for a diff from the consensus we have, if we can use one. */
+  diffstring[0] = '\0';
+  if (purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
+    char digest[DIGEST256_LEN];
+    char hexdigest[HEX_DIGEST256_LEN+1];
+    if (networkstatus_get_consensus_diff_base(digest)) {
+      base16_encode(hexdigest, sizeof(hexdigest), digest, DIGEST256_LEN);
+      tor_snprintf(diffstring, sizeof(diffstring),
+                   "\r\nX-Or-Diff-From-Consensus: %s", hexdigest);
+    }
+  }
+
   /* come up with some proxy lines, if we're using one. */
   if (direct && (get_options()->DirFlags & DIR_FLAG_HTTP_PROXY) && get_options()->DirProxy && get_options()->DirProxyProtocol==PROXY_HTTP) {
     char *base64_authenticator=NULL;
@@ -1054,10 +1325,10 @@ directory_send_command(dir_connection_t *conn,
       tor_snprintf(url, len, "/tor/status/%s", resource);
       break;
     case DIR_PURPOSE_FETCH_CONSENSUS:
-      tor_assert(!resource);
       tor_assert(!payload);
       httpcommand = "GET";
-      url = directory_get_consensus_url(supports_conditional_consensus);
+      url = directory_get_consensus_url(supports_conditional_consensus,
+                                        resource);
       log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_DOWNLOADING_CONSENSUS),hoststring,url);
       break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:
@@ -1096,6 +1367,13 @@ directory_send_command(dir_connection_t *conn,
       url = tor_malloc(len);
       tor_snprintf(url, len, "/tor/extra/%s", resource);
       break;
+    case DIR_PURPOSE_FETCH_MICRODESC:
+      tor_assert(resource);
+      httpcommand = "GET";
+      len = strlen(resource)+32;
+      url = tor_malloc(len);
+      tor_snprintf(url, len, "/tor/micro/%s", resource);
+      break;
     case DIR_PURPOSE_UPLOAD_DIR:
       tor_assert(!resource);
       tor_assert(payload);
@@ -1167,10 +1445,11 @@ directory_send_command(dir_connection_t *conn,
 
   if (!strcmp(httpcommand, "GET") && !payload) {
     tor_asprintf(&request,
-                 "%s %s%s HTTP/1.0\r\nHost: %s%s%s\r\n\r\n",
+                 "%s %s%s HTTP/1.0\r\nHost: %s%s%s%s\r\n\r\n",
 		 httpcommand, proxystring,url,
                  hoststring,
                  imsstring,
+                 diffstring,
                  proxyauthstring);
   } else {
     tor_asprintf(&request,
@@ -1461,6 +1740,237 @@ load_downloaded_routers(const char *body, smartlist_t *which,
   return added;
 }
 
+/** If any directory object is arriving, and it's over 10MB large, we're
+ * getting DoS'd.  (As of 0.1.2.x, raw directories are about 1MB, and we never
+ * ask for more than 96 router descriptors at a time.)
+ */
+#define MAX_DIRECTORY_OBJECT_SIZE (10*(1<<20))
+
+/** Return true iff we take apart responses to downloads with purpose
+ * <b>purpose</b> as they arrive. */
+#define DIR_PURPOSE_STREAMS_BODY(purpose) \
+  ((purpose) == DIR_PURPOSE_FETCH_CONSENSUS ||     \
+   DIR_PURPOSE_IS_DESC_FETCH(purpose))
+
+/** Don't start taking a response apart until this much of it has arrived;
+ * smaller responses are handled all at once when they are complete. */
+#define DIR_STREAM_MIN_LEN (16*1024)
+/** Parse the complete descriptors of a download once this many uncompressed
+ * bytes of them have piled up. */
+#define DIR_STREAM_PARSE_LEN (64*1024)
+
+/** Make room for at least <b>n</b> more bytes, plus a NUL, at the end of the
+ * stream_body of <b>conn</b>. */
+static void
+dir_stream_body_reserve(dir_connection_t *conn, size_t n)
+{
+  size_t sz;
+  if (conn->stream_body_len + n + 1 <= conn->stream_body_alloc)
+    return;
+  sz = conn->stream_body_alloc ? conn->stream_body_alloc : 16384;
+  while (sz < conn->stream_body_len + n + 1)
+    sz *= 2;
+  conn->stream_body = tor_realloc(conn->stream_body, sz);
+  conn->stream_body_alloc = sz;
+}
+
+/** Uncompress the <b>in_len</b> bytes at <b>in</b> with the zlib_state of
+ * <b>conn</b>, and append them to its stream_body.  If <b>finish</b>, no more
+ * input will come.  Return 0 on success, -1 if the input is corrupt. */
+static int
+dir_stream_inflate(dir_connection_t *conn, const char *in, size_t in_len,
+                   int finish)
+{
+  for (;;) {
+    char *out;
+    size_t out_len;
+    tor_zlib_output_t r;
+    dir_stream_body_reserve(conn, 4096);
+    out = conn->stream_body + conn->stream_body_len;
+    out_len = conn->stream_body_alloc - conn->stream_body_len - 1;
+    r = tor_zlib_process(conn->zlib_state, &out, &out_len, &in, &in_len,
+                         finish);
+    conn->stream_body_len = out - conn->stream_body;
+    conn->stream_body[conn->stream_body_len] = '\0';
+    switch (r) {
+      case TOR_ZLIB_DONE:
+        /* Anything after the end of the compressed data is junk. */
+        tor_zlib_free(conn->zlib_state);
+        conn->zlib_state = NULL;
+        return 0;
+      case TOR_ZLIB_OK:
+        if (!in_len)
+          return 0;
+        break;
+      case TOR_ZLIB_BUF_FULL:
+        break;
+      case TOR_ZLIB_ERR:
+      default:
+        return -1;
+    }
+  }
+}
+
+/** Return a pointer just after the last newline in the <b>len</b> bytes at
+ * <b>s</b> that is followed by <b>keyword</b>, or NULL if there is none. */
+static char *
+dir_stream_find_last_keyword(char *s, size_t len, const char *keyword)
+{
+  size_t kwlen = strlen(keyword);
+  size_t i;
+  if (len <= kwlen)
+    return NULL;
+  for (i = len - kwlen; i-- > 0; ) {
+    if (s[i] == '\n' && fast_memeq(s+i+1, keyword, kwlen))
+      return s+i+1;
+  }
+  return NULL;
+}
+
+/** Parse and add every descriptor that is complete in the stream_body of
+ * the descriptor download on <b>conn</b>, and keep only the rest. */
+static void
+dir_stream_parse_descriptors(dir_connection_t *conn)
+{
+  const char *keyword;
+  char *body = conn->stream_body, *cut;
+  char saved;
+  size_t done;
+
+  switch (conn->_base.purpose) {
+    case DIR_PURPOSE_FETCH_SERVERDESC: keyword = "router "; break;
+    case DIR_PURPOSE_FETCH_EXTRAINFO: keyword = "extra-info "; break;
+    case DIR_PURPOSE_FETCH_MICRODESC: keyword = "onion-key"; break;
+    default: return;
+  }
+  if (conn->_base.purpose != DIR_PURPOSE_FETCH_MICRODESC &&
+      !conn->stream_which)
+    return;
+  if (!(cut = dir_stream_find_last_keyword(body, conn->stream_body_len,
+                                           keyword)))
+    return;
+
+  /* Everything before the last descriptor that we have the start of is
+   * complete. */
+  saved = *cut;
+  *cut = '\0';
+  if (conn->_base.purpose == DIR_PURPOSE_FETCH_SERVERDESC) {
+    if (load_downloaded_routers(body, conn->stream_which,
+                                !strcmpstart(conn->requested_resource, "d/"),
+                                conn->router_purpose, conn->_base.address))
+      directory_info_has_arrived(get_time(NULL), 0);
+  } else if (conn->_base.purpose == DIR_PURPOSE_FETCH_EXTRAINFO) {
+    router_load_extrainfo_from_string(body, NULL, SAVED_NOWHERE,
+                              conn->stream_which,
+                              !strcmpstart(conn->requested_resource, "d/"));
+  } else {
+    smartlist_t *added = microdescs_add_to_cache(get_microdesc_cache(),
+                                                 body, cut, SAVED_NOWHERE, 0);
+    if (added)
+      smartlist_free(added);
+  }
+  *cut = saved;
+
+  done = cut - body;
+  memmove(body, cut, conn->stream_body_len - done + 1);
+  conn->stream_body_len -= done;
+}
+
+/** Take apart as much as has arrived of the response to the download on
+ * <b>conn</b>.  Once all the headers of a large enough response are in,
+ * take them off the inbuf; then uncompress the body as it arrives, and, for
+ * descriptor downloads, parse and add each descriptor once it is complete.
+ * That way we never hold the whole compressed response, and we hold the
+ * whole uncompressed one only when we can't use part of it (as for a
+ * consensus, whose signatures cover all of it).  If <b>finish</b>, the
+ * whole response is in.  Return 0 on success, -1 if the response is
+ * malformed or too large. */
+static int
+connection_dir_client_stream_body(dir_connection_t *conn, int finish)
+{
+  buf_t *inbuf = conn->_base.inbuf;
+  char in_buf[4096];
+
+  if (!conn->stream_headers) {
+    compress_method_t compression;
+    char *reason = NULL;
+    if (finish || !DIR_PURPOSE_STREAMS_BODY(conn->_base.purpose) ||
+        buf_datalen(inbuf) < DIR_STREAM_MIN_LEN ||
+        buf_find_string_offset(inbuf, "\r\n\r\n", 4) < 0)
+      return 0;
+    if (fetch_from_buf_http(inbuf, &conn->stream_headers, MAX_HEADERS_SIZE,
+                            NULL, NULL, MAX_DIR_DL_SIZE, 1) != 1 ||
+        parse_http_response(conn->stream_headers, &conn->stream_status,
+                            NULL, &compression, &reason) < 0) {
+      log_warn(LD_HTTP,get_lang_str(LANG_LOG_DIR_HTTP_UNPARSEABLE_HEADERS),conn->_base.address,conn->_base.port);
+      tor_free(reason);
+      return -1;
+    }
+    tor_free(reason);
+    if (conn->stream_status == 200 &&
+        (conn->_base.purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
+         conn->_base.purpose == DIR_PURPOSE_FETCH_EXTRAINFO) &&
+        conn->requested_resource &&
+        (!strcmpstart(conn->requested_resource,"d/") ||
+         !strcmpstart(conn->requested_resource,"fp/"))) {
+      conn->stream_which = smartlist_create();
+      dir_split_resource_into_fingerprints(conn->requested_resource +
+                   (!strcmpstart(conn->requested_resource,"d/") ? 2 : 3),
+                   conn->stream_which, NULL, 0);
+    }
+  }
+
+  while (buf_datalen(inbuf)) {
+    size_t n = buf_datalen(inbuf);
+    if (!conn->stream_in_len && n < 3 && !finish)
+      return 0; /* Not enough to tell whether it is compressed. */
+    if (n > sizeof(in_buf))
+      n = sizeof(in_buf);
+    fetch_from_buf(in_buf, n, inbuf);
+    if (!conn->stream_in_len) {
+      compress_method_t guessed = detect_compression_method(in_buf, n);
+      if (guessed == ZLIB_METHOD || guessed == GZIP_METHOD) {
+        conn->zlib_state = tor_zlib_new(0, guessed);
+        conn->stream_compressed = 1;
+      }
+    }
+    conn->stream_in_len += n;
+    if (conn->stream_in_len > MAX_DIR_DL_SIZE ||
+        conn->stream_body_len > MAX_DIRECTORY_OBJECT_SIZE) {
+      log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_DIR_FETCH_RESPONSE_TOO_LARGE),conn->_base.address,conn->_base.port);
+      return -1;
+    }
+    if (!conn->stream_compressed) {
+      dir_stream_body_reserve(conn, n);
+      memcpy(conn->stream_body + conn->stream_body_len, in_buf, n);
+      conn->stream_body_len += n;
+      conn->stream_body[conn->stream_body_len] = '\0';
+    } else if (conn->zlib_state &&
+               dir_stream_inflate(conn, in_buf, n, 0) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,get_lang_str(LANG_LOG_DIR_HTTP_DECOMPRESS_FAILED),conn->_base.address,conn->_base.port);
+      return -1;
+    }
+  }
+
+  if (finish) {
+    if (conn->zlib_state) {
+      int r = dir_stream_inflate(conn, "", 0, 1);
+      if (conn->zlib_state) {
+        tor_zlib_free(conn->zlib_state);
+        conn->zlib_state = NULL;
+      }
+      if (r < 0) {
+        log_fn(LOG_PROTOCOL_WARN, LD_HTTP,get_lang_str(LANG_LOG_DIR_HTTP_DECOMPRESS_FAILED),conn->_base.address,conn->_base.port);
+        return -1;
+      }
+    }
+  } else if (conn->stream_status == 200 &&
+             conn->stream_body_len >= DIR_STREAM_PARSE_LEN) {
+    dir_stream_parse_descriptors(conn);
+  }
+  return 0;
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -1485,23 +1995,38 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   int plausible;
   int skewed=0;
   int allow_partial = (conn->_base.purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
-                       conn->_base.purpose == DIR_PURPOSE_FETCH_EXTRAINFO);
+                       conn->_base.purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
+                       conn->_base.purpose == DIR_PURPOSE_FETCH_MICRODESC);
   int was_compressed=0;
   time_t now = get_time(NULL);
 
-  switch (fetch_from_buf_http(conn->_base.inbuf,
-                              &headers, MAX_HEADERS_SIZE,
-                              &body, &body_len, MAX_DIR_DL_SIZE,
-                              allow_partial)) {
-    case -1: /* overflow */
-      log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_DIR_FETCH_RESPONSE_TOO_LARGE),conn->_base.address,conn->_base.port);
-      return -1;
-    case 0:
-      log_info(LD_HTTP,get_lang_str(LANG_LOG_DIR_FETCH_RESPONSE_INCOMPLETE));
+  if (conn->stream_headers) {
+    /* We took the response apart as it arrived; finish the job. */
+    if (connection_dir_client_stream_body(conn, 1) < 0)
       return -1;
-    /* case 1, fall through */
+    headers = conn->stream_headers;
+    conn->stream_headers = NULL;
+    body = conn->stream_body ? conn->stream_body : tor_strdup("");
+    body_len = conn->stream_body_len;
+    conn->stream_body = NULL;
+    conn->stream_body_len = conn->stream_body_alloc = 0;
+    orig_len = conn->stream_in_len;
+    was_compressed = conn->stream_compressed;
+  } else {
+    switch (fetch_from_buf_http(conn->_base.inbuf,
+                                &headers, MAX_HEADERS_SIZE,
+                                &body, &body_len, MAX_DIR_DL_SIZE,
+                                allow_partial)) {
+      case -1: /* overflow */
+        log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_DIR_FETCH_RESPONSE_TOO_LARGE),conn->_base.address,conn->_base.port);
+        return -1;
+      case 0:
+        log_info(LD_HTTP,get_lang_str(LANG_LOG_DIR_FETCH_RESPONSE_INCOMPLETE));
+        return -1;
+      /* case 1, fall through */
+    }
+    orig_len = body_len;
   }
-  orig_len = body_len;
 
   if (parse_http_response(headers, &status_code, &date_header,
                           &compression, &reason) < 0) {
@@ -1511,6 +2036,10 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
   if (!reason) reason = tor_strdup("[no reason given]");
 
+  if (DIR_PURPOSE_IS_DESC_FETCH(conn->_base.purpose) && status_code == 200)
+    note_dir_mirror_throughput(conn->identity_digest, orig_len,
+                               (long)(now - conn->_base.timestamp_created));
+
   esc_l = esc_for_log(reason);
   log_debug(LD_DIR,get_lang_str(LANG_LOG_DIR_RESPONSE_RECEIVED),conn->_base.address,conn->_base.port,status_code,esc_l);
   tor_free(esc_l);
@@ -1572,7 +2101,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
 
   plausible = body_is_plausible(body, body_len, conn->_base.purpose);
-  if (compression != NO_METHOD || !plausible) {
+  if (!was_compressed && (compression != NO_METHOD || !plausible)) {
     char *new_body = NULL;
     size_t new_len = 0;
     compress_method_t guessed = detect_compression_method(body, body_len);
@@ -1692,6 +2221,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
 
   if (conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
     int r;
+    const char *flavor = conn->requested_resource ?
+                           conn->requested_resource : "ns";
     if (status_code != 200) {
       int severity = (status_code == 304) ? LOG_INFO : LOG_WARN;
       char *esc_l1 = esc_for_log(reason);
@@ -1701,8 +2232,19 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       networkstatus_consensus_download_failed(status_code);
       return -1;
     }
+    if (looks_like_a_consensus_diff(body, body_len)) {
+      char *rebuilt;
+      log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_RECEIVED_CONSENSUS_DIFF),(int) body_len, conn->_base.address, conn->_base.port);
+      if (!(rebuilt = networkstatus_apply_consensus_diff(body, flavor))) {
+        tor_free(body); tor_free(headers); tor_free(reason);
+        return -1;
+      }
+      tor_free(body);
+      body = rebuilt;
+      body_len = strlen(body);
+    }
     log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_RECEIVED_CONSENSUS),(int) body_len, conn->_base.address, conn->_base.port);
-    if ((r=networkstatus_set_current_consensus(body,"ns", 0))<0) {
+    if ((r=networkstatus_set_current_consensus(body, flavor, 0))<0) {
       log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,get_lang_str(LANG_LOG_DIR_CONSENSUS_LOAD_ERROR),conn->_base.address,conn->_base.port);
       tor_free(body); tor_free(headers); tor_free(reason);
       networkstatus_consensus_download_failed(0);
@@ -1781,6 +2323,13 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
                                              (descriptor_digests ? 2 : 3),
                                            which, NULL, 0);
       n_asked_for = smartlist_len(which);
+      if (conn->stream_which) {
+        /* We already learned some of them as they arrived. */
+        SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
+        smartlist_free(which);
+        which = conn->stream_which;
+        conn->stream_which = NULL;
+      }
     }
     if (status_code != 200) {
       int dir_okay = status_code == 404 ||
@@ -1841,6 +2390,51 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       router_dirport_found_reachable();
   }
 
+  if (conn->_base.purpose == DIR_PURPOSE_FETCH_MICRODESC) {
+    microdesc_cache_t *cache = get_microdesc_cache();
+    smartlist_t *which, *added;
+    int n_asked_for;
+    log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_RECEIVED_MICRODESCS),(int)body_len,conn->_base.address,conn->_base.port);
+    tor_assert(conn->requested_resource &&
+               !strcmpstart(conn->requested_resource, "d/"));
+    which = smartlist_create();
+    dir_split_resource_into_fingerprints(conn->requested_resource+2,
+                                         which, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+    n_asked_for = smartlist_len(which);
+    if (status_code != 200) {
+      char *esc_l1 = esc_for_log(reason);
+      log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_HTTP_ERROR_MICRODESC),status_code,esc_l1,conn->_base.address,conn->_base.port,conn->requested_resource);
+      tor_free(esc_l1);
+      dir_microdesc_download_failed(which, status_code);
+      SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
+      smartlist_free(which);
+      tor_free(body); tor_free(headers); tor_free(reason);
+      return 0;
+    }
+    added = microdescs_add_to_cache(cache, body, body+body_len,
+                                    SAVED_NOWHERE, 0);
+    if (added)
+      smartlist_free(added);
+    /* Whatever we asked for and now have, we got (or had already). */
+    SMARTLIST_FOREACH_BEGIN(which, char *, cp) {
+      if (microdesc_cache_lookup_by_digest256(cache, cp)) {
+        tor_free(cp);
+        SMARTLIST_DEL_CURRENT(which, cp);
+      }
+    } SMARTLIST_FOREACH_END(cp);
+    log_info(LD_DIR,get_lang_str(LANG_LOG_DIR_RECEIVED_DESC),n_asked_for-smartlist_len(which),n_asked_for,"microdescriptors",conn->_base.address,(int)conn->_base.port);
+    if (smartlist_len(which))
+      dir_microdesc_download_failed(which, status_code);
+    if (smartlist_len(which) < n_asked_for) {
+      /* Build routers from the new microdescriptors right away. */
+      update_router_descriptor_downloads(now);
+      directory_info_has_arrived(now, 0);
+    }
+    SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
+    smartlist_free(which);
+  }
+
   if (conn->_base.purpose == DIR_PURPOSE_UPLOAD_DIR) {
     switch (status_code) {
       case 200: {
@@ -2056,12 +2650,6 @@ connection_dir_reached_eof(dir_connection_t *conn)
   return retval;
 }
 
-/** If any directory object is arriving, and it's over 10MB large, we're
- * getting DoS'd.  (As of 0.1.2.x, raw directories are about 1MB, and we never
- * ask for more than 96 router descriptors at a time.)
- */
-#define MAX_DIRECTORY_OBJECT_SIZE (10*(1<<20))
-
 /** Read handler for directory connections.  (That's connections <em>to</em>
  * directory servers and connections <em>at</em> directory servers.)
  */
@@ -2091,6 +2679,13 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     return 0;
   }
 
+  if (conn->_base.state == DIR_CONN_STATE_CLIENT_READING &&
+      !conn->_base.inbuf_reached_eof &&
+      connection_dir_client_stream_body(conn, 0) < 0) {
+    connection_mark_for_close(TO_CONN(conn));
+    return -1;
+  }
+
   if (buf_datalen(conn->_base.inbuf) > MAX_DIRECTORY_OBJECT_SIZE) {
     log_warn(LD_HTTP,get_lang_str(LANG_LOG_DIR_RECEIVED_TOO_MUCH));
     connection_mark_for_close(TO_CONN(conn));
@@ -2232,6 +2827,7 @@ note_client_request(int purpose, int compressed, size_t bytes)
          break;
     case DIR_PURPOSE_FETCH_SERVERDESC:    kind = "dl/server"; break;
     case DIR_PURPOSE_FETCH_EXTRAINFO:     kind = "dl/extra"; break;
+    case DIR_PURPOSE_FETCH_MICRODESC:     kind = "dl/micro"; break;
     case DIR_PURPOSE_UPLOAD_DIR:          kind = "dl/ul-dir"; break;
     case DIR_PURPOSE_UPLOAD_VOTE:         kind = "dl/ul-vote"; break;
     case DIR_PURPOSE_UPLOAD_SIGNATURES:   kind = "dl/ul-sig"; break;
@@ -2453,7 +3049,7 @@ static int directory_handle_command_get(dir_connection_t *conn, const char *head
 				write_http_response_header(conn, dlen, compressed,FULL_DIR_CACHE_LIFETIME);
 				conn->cached_dir = d;
 				conn->cached_dir_offset = 0;
-				if(!compressed)	conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
+				conn->cached_dir_plain = !compressed;
 				++d->refcnt;
 				/* Prime the connection with some data. */
 				conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
@@ -2571,7 +3167,7 @@ static int directory_handle_command_get(dir_connection_t *conn, const char *head
 					(void) request_type;	// note_request(request_type,dlen);
 					write_http_response_header(conn, -1, compressed,smartlist_len(dir_fps) == 1 ? lifetime : 0);
 					conn->fingerprint_stack = dir_fps;
-					if(! compressed)	conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
+					conn->cached_dir_plain = !compressed;
 					/* Prime the connection with some data. */
 					conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
 					connection_dirserv_flushed_some(conn);
@@ -2725,12 +3321,25 @@ static int directory_handle_command_get(dir_connection_t *conn, const char *head
 		}
 		if(res < 0)	write_http_status_line(conn, 404, msg);
 		else
-		{	dlen = dirserv_estimate_data_size(conn->fingerprint_stack,1, compressed);
+		{	cached_dir_t *d = (compressed && !strcmp(url, "all")) ? dirserv_get_all_descriptors_z(is_extra) : NULL;
+			dlen = d ? d->dir_z_len : dirserv_estimate_data_size(conn->fingerprint_stack,1, compressed);
 			if(global_write_bucket_low(TO_CONN(conn), dlen, 2))
 			{	log_info(LD_DIRSERV,get_lang_str(LANG_LOG_DIR_HTTP_SEND_503_5));
 				write_http_status_line(conn, 503, "Directory busy, try again later");
 				conn->dir_spool_src = DIR_SPOOL_NONE;
 			}
+			else if(d)	/* send the prebuilt compressed answer instead of compressing each descriptor again */
+			{	write_http_response_header(conn, dlen, compressed, cache_lifetime);
+				SMARTLIST_FOREACH(conn->fingerprint_stack, char *, fp, tor_free(fp));
+				smartlist_free(conn->fingerprint_stack);
+				conn->fingerprint_stack = NULL;
+				conn->cached_dir = d;
+				conn->cached_dir_offset = 0;
+				++d->refcnt;
+				/* Prime the connection with some data. */
+				conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+				connection_dirserv_flushed_some(conn);
+			}
 			else
 			{	write_http_response_header(conn, -1, compressed, cache_lifetime);
 				if(compressed)	conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
@@ -3333,6 +3942,28 @@ dir_routerdesc_download_failed(smartlist_t *failed, int status_code,
    * every 10 or 60 seconds (FOO_DESCRIPTOR_RETRY_INTERVAL) in main.c. */
 }
 
+/** Called when a connection to download microdescriptors has failed in
+ * whole or in part.  <b>failed</b> is a list of every microdesc digest we
+ * didn't get.  <b>status_code</b> is the http status code we received.
+ * Reschedule the microdesc downloads as appropriate. */
+static void
+dir_microdesc_download_failed(smartlist_t *failed, int status_code)
+{
+  time_t now = get_time(NULL);
+  int server = directory_fetches_from_authorities(get_options());
+  SMARTLIST_FOREACH(failed, const char *, d,
+  {
+    /* A microdesc-flavored consensus entry uses the start of the microdesc
+     * digest as its descriptor digest. */
+    download_status_t *dls = router_get_dl_status_by_descriptor_digest(d);
+    char buf[BASE64_DIGEST256_LEN+1];
+    if (!dls || dls->n_download_failures >= (get_options()->MaxDlFailures?get_options()->MaxDlFailures:32767))
+      continue;
+    digest256_to_base64(buf, d);
+    download_status_increment_failure(dls, status_code, buf, server, now);
+  });
+}
+
 /** Helper.  Compare two fp_pair_t objects, and return -1, 0, or 1 as
  * appropriate. */
 static int
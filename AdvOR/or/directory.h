@@ -20,6 +20,9 @@ void directory_post_to_dirservers(uint8_t dir_purpose, uint8_t router_purpose,
 void directory_get_from_dirserver(uint8_t dir_purpose, uint8_t router_purpose,
                                   const char *resource,
                                   int pds_flags);
+time_t directory_straggler_deadline(dir_connection_t *conn);
+void directory_reissue_straggler(dir_connection_t *conn);
+void directory_free_all(void);
 void directory_get_from_all_authorities(uint8_t dir_purpose,
                                         uint8_t router_purpose,
                                         const char *resource) __attribute__ ((format(printf, 3, 0)));
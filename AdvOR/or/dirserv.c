@@ -41,6 +41,12 @@
 #define MAX_V1_DIRECTORY_AGE (30*24*60*60)
 /** If a v1 running-routers is older than this, discard it. */
 #define MAX_V1_RR_AGE (7*24*60*60)
+/** Don't rebuild our compressed answer to requests for all descriptors more
+ * often than this, however often the descriptors change. */
+#define ALL_DESCS_Z_MIN_AGE (5*60)
+/** Rebuild our compressed answer to requests for all descriptors when it
+ * gets this old, even if nobody told us that the descriptors changed. */
+#define ALL_DESCS_Z_MAX_AGE (30*60)
 
 extern time_t time_of_process_start; /* from main.c */
 extern long stats_n_seconds_working; /* from main.c */
@@ -61,6 +67,12 @@ static cached_dir_t *the_directory = NULL;
 /** For authoritative directories: the current (v1) network status. */
 static cached_dir_t the_runningrouters;
 
+/** Prebuilt compressed answers to requests for all router descriptors
+ * (index 0) and for all extra-info documents (index 1). */
+static cached_dir_t *all_descs_z[2] = { NULL, NULL };
+/** When did the descriptors last change? */
+static time_t all_descs_changed = 0;
+
 static void directory_remove_invalid(void);
 static cached_dir_t *dirserv_regenerate_directory(void);
 static char *format_versions_list(config_line_t *ln);
@@ -600,7 +612,7 @@ dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
   s = desc;
   list = smartlist_create();
   if (!router_parse_list_from_string(&s, NULL, list, SAVED_NOWHERE, 0, 0,
-                                     annotation_buf)) {
+                                     annotation_buf, 0)) {
     SMARTLIST_FOREACH(list, routerinfo_t *, ri, {
         msg_out = NULL;
         tor_assert(ri->purpose == purpose);
@@ -616,7 +628,7 @@ dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
 
   s = desc;
   if (!router_parse_list_from_string(&s, NULL, list, SAVED_NOWHERE, 1, 0,
-                                     NULL)) {
+                                     NULL, 0)) {
     SMARTLIST_FOREACH(list, extrainfo_t *, ei, {
         msg_out = NULL;
 
@@ -839,6 +851,7 @@ directory_set_dirty(void)
   }
   if (!the_v2_networkstatus_is_dirty)
     the_v2_networkstatus_is_dirty = now;
+  all_descs_changed = now;
 }
 
 /**
@@ -1549,6 +1562,69 @@ dirserv_get_consensus(const char *flavor_name)
   return strmap_get(cached_consensuses, flavor_name);
 }
 
+/** Return a cached_dir_t holding the compressed answer to a request for
+ * all router descriptors, or for all extra-info documents if
+ * <b>is_extra</b>, so that we can send it without compressing each
+ * descriptor again for every request.  Like every "all" answer, it only
+ * holds the descriptors that may be sent unencrypted.  Build the answer
+ * again if the descriptors changed since we last built it.  Return NULL if
+ * we have nothing to send. */
+cached_dir_t *
+dirserv_get_all_descriptors_z(int is_extra)
+{
+  cached_dir_t **dp = &all_descs_z[is_extra ? 1 : 0];
+  cached_dir_t *d = *dp;
+  time_t now = get_time(NULL);
+  time_t publish_cutoff = now - ROUTER_MAX_AGE_TO_PUBLISH;
+  smartlist_t *descs;
+  size_t len = 0;
+  char *body, *cp;
+
+  if (d && (d->published >= all_descs_changed ||
+            d->published + ALL_DESCS_Z_MIN_AGE > now) &&
+      d->published + ALL_DESCS_Z_MAX_AGE > now)
+    return d;
+
+  descs = smartlist_create();
+  SMARTLIST_FOREACH(router_get_routerlist()->routers, routerinfo_t *, r,
+  {
+    signed_descriptor_t *sd =
+      get_signed_descriptor_by_fp(r->cache_info.identity_digest, is_extra,
+                                  publish_cutoff);
+    if (sd && sd->send_unencrypted && signed_descriptor_get_body(sd)) {
+      smartlist_add(descs, sd);
+      len += sd->signed_descriptor_len;
+    }
+  });
+  cached_dir_decref(d);
+  *dp = NULL;
+  if (!smartlist_len(descs)) {
+    smartlist_free(descs);
+    return NULL;
+  }
+
+  cp = body = tor_malloc(len);
+  SMARTLIST_FOREACH(descs, signed_descriptor_t *, sd,
+  {
+    memcpy(cp, signed_descriptor_get_body(sd), sd->signed_descriptor_len);
+    cp += sd->signed_descriptor_len;
+  });
+  smartlist_free(descs);
+
+  d = tor_malloc_zero(sizeof(cached_dir_t));
+  d->refcnt = 1;
+  d->published = now;
+  if (tor_gzip_compress(&(d->dir_z), &(d->dir_z_len), body, len,
+                        ZLIB_METHOD) < 0) {
+    log_warn(LD_BUG,get_lang_str(LANG_LOG_DIRSERV_DIR_COMPRESSION_ERROR));
+    tor_free(d->dir_z);
+    tor_free(d);
+  }
+  tor_free(body);
+  *dp = d;
+  return d;
+}
+
 /** For authoritative directories: the current (v2) network status. */
 static cached_dir_t *the_v2_networkstatus = NULL;
 
@@ -1991,7 +2067,7 @@ routerstatus_format_entry(char *buf, size_t buf_len,
     }
 
     if (desc) {
-      summary = policy_summarize(desc->exit_policy);
+      summary = router_summarize_exit_policy(desc);
       r = tor_snprintf(cp, buf_len - (cp-buf), "p %s\n", summary);
       if (r<0) {
         log_warn(LD_BUG,get_lang_str(LANG_LOG_DIRSERV_BUFFER_TOO_SMALL));
@@ -3409,37 +3485,57 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
   return 0;
 }
 
+/** Helper for connection_write_ref_to_buf(): the outbuf is done with the
+ * part of the cached_dir_t <b>d</b> it was spooling. */
+static void
+cached_dir_release(void *d)
+{
+  cached_dir_decref(d);
+}
+
 /** Spooling helper: Called when we're sending a directory or networkstatus,
  * and the outbuf has become too empty.  Pulls some bytes from
- * <b>conn</b>-\>cached_dir-\>dir_z, uncompresses them if appropriate, and
- * puts them on the outbuf.  If we run out of entries, flushes the zlib state
- * and sets the spool source to NONE.  Returns 0 on success, negative on
- * failure. */
+ * <b>conn</b>-\>cached_dir-\>dir_z (or from its dir, if we're sending it
+ * uncompressed), uncompresses them if appropriate, and puts them on the
+ * outbuf.  Unless we need to uncompress them, the outbuf only refers to the
+ * bytes of the cached_dir_t instead of copying them.  If we run out of
+ * entries, flushes the zlib state and sets the spool source to NONE.
+ * Returns 0 on success, negative on failure. */
 static int
 connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
 {
   ssize_t bytes;
   int64_t remaining;
+  const char *src;
+  size_t src_len;
 
   bytes = DIRSERV_BUFFER_MIN - buf_datalen(conn->_base.outbuf);
   tor_assert(bytes > 0);
   tor_assert(conn->cached_dir);
+  if (conn->cached_dir_plain) {
+    src = conn->cached_dir->dir;
+    src_len = conn->cached_dir->dir_len;
+  } else {
+    src = conn->cached_dir->dir_z;
+    src_len = conn->cached_dir->dir_z_len;
+  }
   if (bytes < 8192)
     bytes = 8192;
-  remaining = conn->cached_dir->dir_z_len - conn->cached_dir_offset;
+  remaining = src_len - conn->cached_dir_offset;
   if (bytes > remaining)
     bytes = (ssize_t) remaining;
 
   if (conn->zlib_state) {
-    connection_write_to_buf_zlib(
-                             conn->cached_dir->dir_z + conn->cached_dir_offset,
-                             bytes, conn, bytes == remaining);
+    connection_write_to_buf_zlib(src + conn->cached_dir_offset,
+                                 bytes, conn, bytes == remaining);
   } else {
-    connection_write_to_buf(conn->cached_dir->dir_z + conn->cached_dir_offset,
-                            bytes, TO_CONN(conn));
+    ++conn->cached_dir->refcnt;
+    connection_write_ref_to_buf(src + conn->cached_dir_offset, bytes,
+                                TO_CONN(conn), cached_dir_release,
+                                conn->cached_dir);
   }
   conn->cached_dir_offset += bytes;
-  if (conn->cached_dir_offset == (int)conn->cached_dir->dir_z_len) {
+  if (conn->cached_dir_offset == (int)src_len) {
     /* We just wrote the last one; finish up. */
     connection_dirserv_finish_spooling(conn);
     cached_dir_decref(conn->cached_dir);
@@ -3538,6 +3634,9 @@ dirserv_free_all(void)
   cached_dir_decref(the_v2_networkstatus);
   cached_dir_decref(cached_directory);
   clear_cached_dir(&cached_runningrouters);
+  cached_dir_decref(all_descs_z[0]);
+  cached_dir_decref(all_descs_z[1]);
+  all_descs_z[0] = all_descs_z[1] = NULL;
   digestmap_free(cached_v2_networkstatus, _free_cached_dir);
   cached_v2_networkstatus = NULL;
   strmap_free(cached_consensuses, _free_cached_dir);
@@ -85,6 +85,7 @@ int directory_too_idle_to_fetch_descriptors(or_options_t *options, time_t now);
 
 void directory_set_dirty(void);
 cached_dir_t *dirserv_get_directory(void);
+cached_dir_t *dirserv_get_all_descriptors_z(int is_extra);
 cached_dir_t *dirserv_get_runningrouters(void);
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
 void dirserv_set_cached_directory(const char *directory, time_t when,
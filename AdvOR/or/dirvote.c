@@ -6,6 +6,7 @@
 #define DIRVOTE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -964,6 +965,451 @@ static void networkstatus_compute_bw_weights_v9(smartlist_t *chunks, int64_t G,
 	log_notice(LD_CIRC,get_lang_str(LANG_LOG_DIRVOTE_COMPUTED_BW_WEIGHTS_2),casename,I64_PRINTF_ARG(G), I64_PRINTF_ARG(M), I64_PRINTF_ARG(E),I64_PRINTF_ARG(D), I64_PRINTF_ARG(T));
 }
 
+/** How many identity digest ranges we split the routers into when we
+ * compute a consensus, so that the batch helpers can work on the ranges at
+ * the same time. */
+#define CONSENSUS_N_RANGES 16
+
+/** A log message that one of the consensus ranges wants to write.  The
+ * ranges don't log from the batch helpers; we write their messages once
+ * they're done, in router order, so that the log reads as if we had computed
+ * the ranges one after the other. */
+typedef struct consensus_range_msg_t {
+  int severity;
+  log_domain_mask_t domain;
+  char *msg;
+} consensus_range_msg_t;
+
+/** What we know about the routers in one identity digest range of a
+ * consensus we're computing, and what we computed for them. */
+typedef struct consensus_range_t {
+  int *index; /**< index[j] is the current index into votes[j]. */
+  int *end; /**< end[j] is the first index in votes[j] past this range. */
+  smartlist_t *chunks; /**< The routerstatus entries for this range. */
+  smartlist_t *msgs; /**< consensus_range_msg_t to log, in order. */
+  int64_t G, M, E, D, T; /**< Bandwidth totals for the weights. */
+} consensus_range_t;
+
+/** Everything that networkstatus_compute_consensus() works out before it
+ * looks at the routers.  The ranges only read it. */
+typedef struct consensus_routers_t {
+  smartlist_t *votes;
+  smartlist_t *flags;
+  int total_authorities;
+  int consensus_method;
+  consensus_flavor_t flavor;
+  routerstatus_format_type_t rs_format;
+  int *n_voter_flags; /**< How many flags votes[j] knows about. */
+  int *n_flag_voters; /**< How many votes care about flags[f]. */
+  int **flag_map; /**< flag_map[j][b] is the index in flags of
+                   * votes[j]->known_flags[b]. */
+  int *named_flag; /**< Index of the flag "Named" for votes[j]. */
+  int chosen_named_idx; /**< Index of "Named" in flags. */
+  strmap_t *name_to_id_map; /**< Map from nickname to the identity we'll
+                             * name, or to a conflict or unknown marker. */
+  consensus_range_t *ranges;
+} consensus_routers_t;
+
+/** Remember a message for <b>range</b> to log once it's done. */
+static void
+consensus_range_log(consensus_range_t *range, int severity,
+                    log_domain_mask_t domain, const char *format, ...)
+{
+  consensus_range_msg_t *m = tor_malloc(sizeof(consensus_range_msg_t));
+  va_list ap;
+  va_start(ap, format);
+  if (tor_vasprintf((unsigned char **)&m->msg, format, ap) < 0)
+    m->msg = tor_strdup(format);
+  va_end(ap);
+  m->severity = severity;
+  m->domain = domain;
+  smartlist_add(range->msgs, m);
+}
+
+/** Compute the consensus entries for the routers in <b>range</b>, from
+ * what <b>ctx</b> says about the votes, and add them to range-\>chunks.
+ * This runs on the batch helpers, so it only writes to <b>range</b>. */
+static void
+compute_consensus_range(const consensus_routers_t *ctx,
+                        consensus_range_t *range)
+{
+  smartlist_t *votes = ctx->votes;
+  smartlist_t *flags = ctx->flags;
+  const int total_authorities = ctx->total_authorities;
+  const int consensus_method = ctx->consensus_method;
+  const consensus_flavor_t flavor = ctx->flavor;
+  const routerstatus_format_type_t rs_format = ctx->rs_format;
+  const int *n_voter_flags = ctx->n_voter_flags;
+  const int *n_flag_voters = ctx->n_flag_voters;
+  int **flag_map = ctx->flag_map;
+  const int *named_flag = ctx->named_flag;
+  const int chosen_named_idx = ctx->chosen_named_idx;
+  strmap_t *name_to_id_map = ctx->name_to_id_map;
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  int i;
+  smartlist_t *matching_descs = smartlist_create();
+  smartlist_t *chosen_flags = smartlist_create();
+  smartlist_t *versions_ = smartlist_create();
+  smartlist_t *exitsummaries = smartlist_create();
+  uint32_t *bandwidths = tor_malloc(sizeof(uint32_t) * smartlist_len(votes));
+  uint32_t *measured_bws = tor_malloc(sizeof(uint32_t) *
+                                      smartlist_len(votes));
+  int num_bandwidths;
+  int num_mbws;
+
+  flag_counts = tor_malloc(sizeof(int) * smartlist_len(flags));
+  while (1) {
+    vote_routerstatus_t *rs;
+    routerstatus_t rs_out;
+    const char *lowest_id = NULL;
+    const char *chosen_version;
+    const char *chosen_name = NULL;
+    int exitsummary_disagreement = 0;
+    int is_named = 0, is_unnamed = 0, is_running = 0;
+    int is_guard = 0, is_exit = 0, is_bad_exit = 0;
+    int naming_conflict = 0;
+    int n_listing = 0;
+    unsigned char *buf=NULL;
+    char microdesc_digest[DIGEST256_LEN];
+
+    /* Of the next-to-be-considered digest in each voter, which is first? */
+    SMARTLIST_FOREACH(votes, networkstatus_t *, v, {
+      if (range->index[v_sl_idx] < range->end[v_sl_idx]) {
+        rs = smartlist_get(v->routerstatus_list, range->index[v_sl_idx]);
+        if (!lowest_id ||
+            fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN) < 0)
+          lowest_id = rs->status.identity_digest;
+      }
+    });
+    if (!lowest_id) /* we're out of routers. */
+      break;
+
+    memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
+    smartlist_clear(matching_descs);
+    smartlist_clear(chosen_flags);
+    smartlist_clear(versions_);
+    num_bandwidths = 0;
+    num_mbws = 0;
+
+    /* Okay, go through all the entries for this digest. */
+    SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
+      if (range->index[v_sl_idx] >= range->end[v_sl_idx])
+        continue; /* out of entries. */
+      rs = smartlist_get(v->routerstatus_list, range->index[v_sl_idx]);
+      if (fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN))
+        continue; /* doesn't include this router. */
+      /* At this point, we know that we're looking at a routerstatus with
+       * identity "lowest".
+       */
+      ++range->index[v_sl_idx];
+      ++n_listing;
+
+      smartlist_add(matching_descs, rs);
+      if (rs->version && rs->version[0])
+        smartlist_add(versions_, rs->version);
+
+      /* Tally up all the flags. */
+      for (i = 0; i < n_voter_flags[v_sl_idx]; ++i) {
+        if (rs->flags & (U64_LITERAL(1) << i))
+          ++flag_counts[flag_map[v_sl_idx][i]];
+      }
+      if (rs->flags & (U64_LITERAL(1) << named_flag[v_sl_idx])) {
+        if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+          consensus_range_log(range,LOG_NOTICE,LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_ROUTER_NAME_CONFLICT),chosen_name,rs->status.nickname);
+          naming_conflict = 1;
+        }
+        chosen_name = rs->status.nickname;
+      }
+
+      /* count bandwidths */
+      if (rs->status.has_measured_bw)
+        measured_bws[num_mbws++] = rs->status.measured_bw;
+      if (rs->status.has_bandwidth)
+        bandwidths[num_bandwidths++] = rs->status.bandwidth;
+    } SMARTLIST_FOREACH_END(v);
+
+    /* We don't include this router at all unless more than half of
+     * the authorities we believe in list it. */
+    if (n_listing <= total_authorities/2)
+      continue;
+
+    /* Figure out the most popular opinion of what the most recent
+     * routerinfo and its contents are. */
+    memset(microdesc_digest, 0, sizeof(microdesc_digest));
+    rs = compute_routerstatus_consensus(matching_descs, consensus_method,
+                                        microdesc_digest);
+    /* Copy bits of that into rs_out. */
+    tor_assert(fast_memeq(lowest_id, rs->status.identity_digest,DIGEST_LEN));
+    memcpy(rs_out.identity_digest, lowest_id, DIGEST_LEN);
+    memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+           DIGEST_LEN);
+    rs_out.addr = rs->status.addr;
+    rs_out.published_on = rs->status.published_on;
+    rs_out.dir_port = rs->status.dir_port;
+    rs_out.or_port = rs->status.or_port;
+    rs_out.has_bandwidth = 0;
+    rs_out.has_exitsummary = 0;
+
+    if (chosen_name && !naming_conflict) {
+      strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+    } else {
+      strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+    }
+
+    if (consensus_method == 1) {
+      is_named = chosen_named_idx >= 0 &&
+        (!naming_conflict && flag_counts[chosen_named_idx]);
+    } else {
+      const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
+      if (!d) {
+        is_named = is_unnamed = 0;
+      } else if (fast_memeq(d, lowest_id, DIGEST_LEN)) {
+        is_named = 1; is_unnamed = 0;
+      } else {
+        is_named = 0; is_unnamed = 1;
+      }
+    }
+
+    /* Set the flags. */
+    smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
+    SMARTLIST_FOREACH(flags, const char *, fl,
+    {
+      if (!strcmp(fl, "Named")) {
+        if (is_named)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "Unnamed") && consensus_method >= 2) {
+        if (is_unnamed)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else {
+        if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
+          smartlist_add(chosen_flags, (char*)fl);
+          if (!strcmp(fl, "Exit"))
+            is_exit = 1;
+          else if (!strcmp(fl, "Guard"))
+            is_guard = 1;
+          else if (!strcmp(fl, "Running"))
+            is_running = 1;
+          else if (!strcmp(fl, "BadExit"))
+            is_bad_exit = 1;
+        }
+      }
+    });
+
+    /* Starting with consensus method 4 we do not list servers
+     * that are not running in a consensus.  See Proposal 138 */
+    if (consensus_method >= 4 && !is_running)
+      continue;
+
+    /* Pick the version. */
+    if (smartlist_len(versions_)) {
+      sort_version_list(versions_, 0);
+      chosen_version = get_most_frequent_member(versions_);
+    } else {
+      chosen_version = NULL;
+    }
+
+    /* Pick a bandwidth */
+    if (consensus_method >= 6 && num_mbws > 2) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bandwidth = median_uint32(measured_bws, num_mbws);
+    } else if (consensus_method >= 5 && num_bandwidths > 0) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bandwidth = median_uint32(bandwidths, num_bandwidths);
+    }
+
+    /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+    if (consensus_method >= 11) {
+      is_exit = is_exit && !is_bad_exit;
+    }
+
+    if (consensus_method >= MIN_METHOD_FOR_BW_WEIGHTS) {
+      if (rs_out.has_bandwidth) {
+        range->T += rs_out.bandwidth;
+        if (is_exit && is_guard)
+          range->D += rs_out.bandwidth;
+        else if (is_exit)
+          range->E += rs_out.bandwidth;
+        else if (is_guard)
+          range->G += rs_out.bandwidth;
+        else
+          range->M += rs_out.bandwidth;
+      } else {
+        consensus_range_log(range,LOG_WARN,LD_BUG,
+                              "Missing consensus bandwidth for router %s",
+                              rs_out.nickname);
+      }
+    }
+
+    /* Ok, we already picked a descriptor digest we want to list
+     * previously.  Now we want to use the exit policy summary from
+     * that descriptor.  If everybody plays nice all the voters who
+     * listed that descriptor will have the same summary.  If not then
+     * something is fishy and we'll use the most common one (breaking
+     * ties in favor of lexicographically larger one (only because it
+     * lets me reuse more existing code.
+     *
+     * The other case that can happen is that no authority that voted
+     * for that descriptor has an exit policy summary.  That's
+     * probably quite unlikely but can happen.  In that case we use
+     * the policy that was most often listed in votes, again breaking
+     * ties like in the previous case.
+     */
+    if (consensus_method >= 5) {
+      /* Okay, go through all the votes for this router.  We prepared
+       * that list previously */
+      const char *chosen_exitsummary = NULL;
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+        /* Check if the vote where this status comes from had the
+         * proper descriptor */
+        tor_assert(fast_memeq(rs_out.identity_digest,
+                           vsr->status.identity_digest,
+                           DIGEST_LEN));
+        if (vsr->status.has_exitsummary &&
+             fast_memeq(rs_out.descriptor_digest,
+                     vsr->status.descriptor_digest,
+                     DIGEST_LEN)) {
+          tor_assert(vsr->status.exitsummary);
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+          if (!chosen_exitsummary) {
+            chosen_exitsummary = vsr->status.exitsummary;
+          } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+            /* Great.  There's disagreement among the voters.  That
+             * really shouldn't be */
+            exitsummary_disagreement = 1;
+          }
+        }
+      });
+
+      if (exitsummary_disagreement) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        consensus_range_log(range,LOG_WARN,LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_VOTERS_DISAGREED),id,dd);
+
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+      } else if (!chosen_exitsummary) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        consensus_range_log(range,LOG_WARN,LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_NO_SUMMARY_FROM_VOTERS),dd,id);
+
+        /* Ok, none of those voting for the digest we chose had an
+         * exit policy for us.  Well, that kinda sucks.
+         */
+        smartlist_clear(exitsummaries);
+        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+          if (vsr->status.has_exitsummary)
+            smartlist_add(exitsummaries, vsr->status.exitsummary);
+        });
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+        if (!chosen_exitsummary)
+          consensus_range_log(range,LOG_WARN,LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_NO_SUMMARY_FROM_VOTERS_2),id);
+      }
+
+      if (chosen_exitsummary) {
+        rs_out.has_exitsummary = 1;
+        /* yea, discards the const */
+        rs_out.exitsummary = (char *)chosen_exitsummary;
+      }
+    }
+
+    {
+      char buf1[4096];
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line goes into "buf". */
+      routerstatus_format_entry(buf1, sizeof(buf1), &rs_out, NULL,
+                                rs_format);
+      smartlist_add(range->chunks, tor_strdup(buf1));
+    }
+    /*     Now an m line, if applicable. */
+    if (flavor == FLAV_MICRODESC &&
+        !tor_digest256_is_zero(microdesc_digest)) {
+      unsigned char m[BASE64_DIGEST256_LEN+1], *cp;
+      digest256_to_base64((char *)m, microdesc_digest);
+      tor_asprintf(&cp, "m %s\n", m);
+      smartlist_add(range->chunks, cp);
+    }
+    smartlist_add(range->chunks,
+                  smartlist_join_strings(chosen_flags, " ", 0, NULL));
+    /*     Now the version line. */
+    if (chosen_version) {
+      smartlist_add(range->chunks, tor_strdup("\nv "));
+      smartlist_add(range->chunks, tor_strdup(chosen_version));
+    }
+    smartlist_add(range->chunks, tor_strdup("\n"));
+    /*     Now the weight line. */
+    if (rs_out.has_bandwidth) {
+      unsigned char *cp=NULL;
+      tor_asprintf(&cp, "w Bandwidth=%d\n", rs_out.bandwidth);
+      smartlist_add(range->chunks, cp);
+    };
+    /*     Now the exitpolicy summary line. */
+    if (rs_out.has_exitsummary && flavor == FLAV_NS) {
+      tor_asprintf(&buf, "p %s\n", rs_out.exitsummary);
+      smartlist_add(range->chunks, buf);
+    };
+
+    /* And the loop is over and we move on to the next router */
+  }
+
+  tor_free(flag_counts);
+  smartlist_free(matching_descs);
+  smartlist_free(chosen_flags);
+  smartlist_free(versions_);
+  smartlist_free(exitsummaries);
+  tor_free(bandwidths);
+  tor_free(measured_bws);
+}
+
+/** cpuworker_run_batch() callback: compute consensus range <b>idx</b> of
+ * the consensus_routers_t <b>arg</b>. */
+static void
+compute_consensus_range_batch_fn(void *arg, int idx)
+{
+  consensus_routers_t *ctx = arg;
+  compute_consensus_range(ctx, &ctx->ranges[idx]);
+}
+
+/** Split the routers in <b>votes</b> into CONSENSUS_N_RANGES ranges by
+ * the first byte of their identity digests, and return a newly allocated
+ * array of the ranges.  Each vote lists its routers sorted by identity, so
+ * a router never has entries in two ranges. */
+static consensus_range_t *
+consensus_ranges_new(smartlist_t *votes)
+{
+  consensus_range_t *ranges =
+    tor_malloc_zero(sizeof(consensus_range_t) * CONSENSUS_N_RANGES);
+  int k;
+  for (k = 0; k < CONSENSUS_N_RANGES; ++k) {
+    ranges[k].index = tor_malloc_zero(sizeof(int) * smartlist_len(votes));
+    ranges[k].end = tor_malloc_zero(sizeof(int) * smartlist_len(votes));
+    ranges[k].chunks = smartlist_create();
+    ranges[k].msgs = smartlist_create();
+  }
+  SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
+    int n = smartlist_len(v->routerstatus_list), pos = 0;
+    for (k = 0; k < CONSENSUS_N_RANGES; ++k) {
+      ranges[k].index[v_sl_idx] = pos;
+      while (pos < n) {
+        vote_routerstatus_t *rs = smartlist_get(v->routerstatus_list, pos);
+        if ((uint8_t)rs->status.identity_digest[0] * CONSENSUS_N_RANGES / 256
+            > k)
+          break;
+        ++pos;
+      }
+      ranges[k].end[v_sl_idx] = pos;
+    }
+  } SMARTLIST_FOREACH_END(v);
+  return ranges;
+}
+
 /** Given a list of vote networkstatus_t in <b>votes</b>, our public
  * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
  * and the number of <b>total_authorities</b> that we believe exist in our
@@ -1197,20 +1643,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
   /* Add the actual router entries. */
   {
-    int *index; /* index[j] is the current index into votes[j]. */
-    int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
+    consensus_routers_t ctx;
     int i;
-    smartlist_t *matching_descs = smartlist_create();
-    smartlist_t *chosen_flags = smartlist_create();
-    smartlist_t *versions_ = smartlist_create();
-    smartlist_t *exitsummaries = smartlist_create();
-    uint32_t *bandwidths = tor_malloc(sizeof(uint32_t) * smartlist_len(votes));
-    uint32_t *measured_bws = tor_malloc(sizeof(uint32_t) *
-                                        smartlist_len(votes));
-    int num_bandwidths;
-    int num_mbws;
 
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
@@ -1228,8 +1662,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
     memset(conflict, 0, sizeof(conflict));
     memset(unknown, 0xff, sizeof(conflict));
 
-    index = tor_malloc_zero(sizeof(int)*smartlist_len(votes));
-    size = tor_malloc_zero(sizeof(int)*smartlist_len(votes));
     n_voter_flags = tor_malloc_zero(sizeof(int) * smartlist_len(votes));
     n_flag_voters = tor_malloc_zero(sizeof(int) * smartlist_len(flags));
     flag_map = tor_malloc_zero(sizeof(int*) * smartlist_len(votes));
@@ -1256,7 +1688,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
           unnamed_flag[v_sl_idx] = fl_sl_idx;
       });
       n_voter_flags[v_sl_idx] = smartlist_len(v->known_flags);
-      size[v_sl_idx] = smartlist_len(v->routerstatus_list);
     });
 
     /* Named and Unnamed get treated specially */
@@ -1311,324 +1742,52 @@ networkstatus_compute_consensus(smartlist_t *votes,
       });
     }
 
-    /* Now go through all the votes */
-    flag_counts = tor_malloc(sizeof(int) * smartlist_len(flags));
-    while (1) {
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *lowest_id = NULL;
-      const char *chosen_version;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      unsigned char *buf=NULL;
-      char microdesc_digest[DIGEST256_LEN];
-
-      /* Of the next-to-be-considered digest in each voter, which is first? */
-      SMARTLIST_FOREACH(votes, networkstatus_t *, v, {
-        if (index[v_sl_idx] < size[v_sl_idx]) {
-          rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
-          if (!lowest_id ||
-              fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN) < 0)
-            lowest_id = rs->status.identity_digest;
-        }
-      });
-      if (!lowest_id) /* we're out of routers. */
-        break;
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions_);
-      num_bandwidths = 0;
-      num_mbws = 0;
-
-      /* Okay, go through all the entries for this digest. */
-      SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
-        if (index[v_sl_idx] >= size[v_sl_idx])
-          continue; /* out of entries. */
-        rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
-        if (fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN))
-          continue; /* doesn't include this router. */
-        /* At this point, we know that we're looking at a routerstatus with
-         * identity "lowest".
-         */
-        ++index[v_sl_idx];
-        ++n_listing;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions_, rs->version);
-
-        /* Tally up all the flags. */
-        for (i = 0; i < n_voter_flags[v_sl_idx]; ++i) {
-          if (rs->flags & (U64_LITERAL(1) << i))
-            ++flag_counts[flag_map[v_sl_idx][i]];
-        }
-        if (rs->flags & (U64_LITERAL(1) << named_flag[v_sl_idx])) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_ROUTER_NAME_CONFLICT),chosen_name,rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* count bandwidths */
-        if (rs->status.has_measured_bw)
-          measured_bws[num_mbws++] = rs->status.measured_bw;
-        if (rs->status.has_bandwidth)
-          bandwidths[num_bandwidths++] = rs->status.bandwidth;
-      } SMARTLIST_FOREACH_END(v);
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest);
-      /* Copy bits of that into rs_out. */
-      tor_assert(fast_memeq(lowest_id, rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, lowest_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      rs_out.addr = rs->status.addr;
-      rs_out.published_on = rs->status.published_on;
-      rs_out.dir_port = rs->status.dir_port;
-      rs_out.or_port = rs->status.or_port;
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      if (consensus_method == 1) {
-        is_named = chosen_named_idx >= 0 &&
-          (!naming_conflict && flag_counts[chosen_named_idx]);
-      } else {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, lowest_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
-      SMARTLIST_FOREACH(flags, const char *, fl,
+    /* Now go through all the votes, one identity digest range at a time,
+     * and put the ranges back together in order. */
+    ctx.votes = votes;
+    ctx.flags = flags;
+    ctx.total_authorities = total_authorities;
+    ctx.consensus_method = consensus_method;
+    ctx.flavor = flavor;
+    ctx.rs_format = rs_format;
+    ctx.n_voter_flags = n_voter_flags;
+    ctx.n_flag_voters = n_flag_voters;
+    ctx.flag_map = flag_map;
+    ctx.named_flag = named_flag;
+    ctx.chosen_named_idx = chosen_named_idx;
+    ctx.name_to_id_map = name_to_id_map;
+    ctx.ranges = consensus_ranges_new(votes);
+    cpuworker_run_batch(CONSENSUS_N_RANGES, compute_consensus_range_batch_fn,
+                        &ctx);
+    for (i = 0; i < CONSENSUS_N_RANGES; ++i) {
+      consensus_range_t *range = &ctx.ranges[i];
+      smartlist_add_all(chunks, range->chunks);
+      SMARTLIST_FOREACH(range->msgs, consensus_range_msg_t *, m,
       {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed") && consensus_method >= 2) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-          }
-        }
+        log_fn(m->severity, m->domain, "%s", m->msg);
+        tor_free(m->msg);
+        tor_free(m);
       });
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (consensus_method >= 4 && !is_running)
-        continue;
-
-      /* Pick the version. */
-      if (smartlist_len(versions_)) {
-        sort_version_list(versions_, 0);
-        chosen_version = get_most_frequent_member(versions_);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* Pick a bandwidth */
-      if (consensus_method >= 6 && num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bandwidth = median_uint32(measured_bws, num_mbws);
-      } else if (consensus_method >= 5 && num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bandwidth = median_uint32(bandwidths, num_bandwidths);
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      if (consensus_method >= 11) {
-        is_exit = is_exit && !is_bad_exit;
-      }
-
-      if (consensus_method >= MIN_METHOD_FOR_BW_WEIGHTS) {
-        if (rs_out.has_bandwidth) {
-          T += rs_out.bandwidth;
-          if (is_exit && is_guard)
-            D += rs_out.bandwidth;
-          else if (is_exit)
-            E += rs_out.bandwidth;
-          else if (is_guard)
-            G += rs_out.bandwidth;
-          else
-            M += rs_out.bandwidth;
-        } else {
-          log_warn(LD_BUG, "Missing consensus bandwidth for router %s",
-              rs_out.nickname);
-        }
-      }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code.
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      if (consensus_method >= 5) {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        });
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_VOTERS_DISAGREED),id,dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_NO_SUMMARY_FROM_VOTERS),dd,id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR,get_lang_str(LANG_LOG_DIRVOTE_NO_SUMMARY_FROM_VOTERS_2),id);
-        }
-
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
-
-      {
-        char buf1[4096];
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        routerstatus_format_entry(buf1, sizeof(buf1), &rs_out, NULL,
-                                  rs_format);
-        smartlist_add(chunks, tor_strdup(buf1));
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        unsigned char m[BASE64_DIGEST256_LEN+1], *cp;
-        digest256_to_base64((char *)m, microdesc_digest);
-        tor_asprintf(&cp, "m %s\n", m);
-        smartlist_add(chunks, cp);
-      }
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add(chunks, tor_strdup("\nv "));
-        smartlist_add(chunks, tor_strdup(chosen_version));
-      }
-      smartlist_add(chunks, tor_strdup("\n"));
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        unsigned char *cp=NULL;
-        tor_asprintf(&cp, "w Bandwidth=%d\n", rs_out.bandwidth);
-        smartlist_add(chunks, cp);
-      };
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        tor_asprintf(&buf, "p %s\n", rs_out.exitsummary);
-        smartlist_add(chunks, buf);
-      };
-
-      /* And the loop is over and we move on to the next router */
+      G += range->G;
+      M += range->M;
+      E += range->E;
+      D += range->D;
+      T += range->T;
+      tor_free(range->index);
+      tor_free(range->end);
+      smartlist_free(range->chunks);
+      smartlist_free(range->msgs);
     }
+    tor_free(ctx.ranges);
 
-    tor_free(index);
-    tor_free(size);
     tor_free(n_voter_flags);
     tor_free(n_flag_voters);
     for (i = 0; i < smartlist_len(votes); ++i)
       tor_free(flag_map[i]);
     tor_free(flag_map);
-    tor_free(flag_counts);
     tor_free(named_flag);
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions_);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths);
-    tor_free(measured_bws);
   }
 
   if (consensus_method >= MIN_METHOD_FOR_FOOTER) {
@@ -2946,7 +3105,7 @@ microdesc_t *dirvote_create_microdescriptor(const routerinfo_t *ri)
 	size_t keylen;
 	char *out = buf, *end = buf+sizeof(buf);
 	if(crypto_pk_write_public_key_to_string(ri->onion_pkey, &key, &keylen) >= 0)
-	{	summary = policy_summarize(ri->exit_policy);
+	{	summary = router_summarize_exit_policy(ri);
 		if(ri->declared_family)
 			family = smartlist_join_strings(ri->declared_family, " ", 0, NULL);
 		if(tor_snprintf(out, end-out, "onion-key\n%s", key) >= 0)
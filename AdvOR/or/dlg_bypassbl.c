@@ -1,4 +1,5 @@
 #include "or.h"
+#include "ht.h"
 #include "dlg_util.h"
 #include "geoip.h"
 #include "main.h"
@@ -28,29 +29,90 @@ lang_dlg_info lang_dlg_bypass_blacklists[]={
 
 #pragma pack(push,1)
 typedef struct ip_info_t
-{	struct ip_info_t *next;
+{	struct ip_info_t *next;	/**< Next less recently seen entry in <b>exitlist</b>. */
+	struct ip_info_t *prev;	/**< Previous more recently seen entry in <b>exitlist</b>. */
+	HT_ENTRY(ip_info_t) node;
+	/* Only the fields below are saved by iplist_write(). */
 	int flags;
 	uint32_t addr[4];
 	time_t added;
 	time_t last_seen;
 } ip_info_t;
-#define IPLIST_SIZE sizeof(ip_info_t) - sizeof(int)
+#define IPLIST_SIZE (sizeof(ip_info_t) - STRUCT_OFFSET(ip_info_t,flags))
 #pragma pack(pop)
 
 int __stdcall dlgBypassBlacklists(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 int dlgBypassBlacklists_isRecent(uint32_t addr,routerinfo_t *router,time_t now);
 
+/** All the exits that we remember, most recently seen first. */
 ip_info_t *exitlist = NULL;
+/** The least recently seen exit in <b>exitlist</b>. */
+static ip_info_t *exitlist_tail = NULL;
+
+/** Index of the exit nodes in <b>exitlist</b> by their first address. */
+static HT_HEAD(exitmap, ip_info_t) exitmap = HT_INITIALIZER();
+
+static INLINE unsigned
+ip_info_hash(const ip_info_t *a)
+{
+	return ht_improve_hash((unsigned) a->addr[0]);
+}
+
+static INLINE int
+ip_info_eq(const ip_info_t *a, const ip_info_t *b)
+{
+	return a->addr[0] == b->addr[0];
+}
+
+HT_PROTOTYPE(exitmap, ip_info_t, node, ip_info_hash, ip_info_eq);
+HT_GENERATE(exitmap, ip_info_t, node, ip_info_hash, ip_info_eq, 0.6);
 
 #define DAY_IN_SECONDS 24*60*60
 
+static void iplist_unlink(ip_info_t *list)
+{	if(list->prev)	list->prev->next = list->next;
+	else		exitlist = list->next;
+	if(list->next)	list->next->prev = list->prev;
+	else		exitlist_tail = list->prev;
+	list->next = list->prev = NULL;
+}
+
+static void iplist_push(ip_info_t *list)
+{	list->prev = NULL;
+	list->next = exitlist;
+	if(exitlist)	exitlist->prev = list;
+	else		exitlist_tail = list;
+	exitlist = list;
+}
+
+/** Add <b>list</b> to the front of <b>exitlist</b> and, if it is the first exit node with its address, to the index. */
+static void iplist_add(ip_info_t *list)
+{	iplist_push(list);
+	if((list->flags & IP_FLAG_EXIT_NODE) && !HT_FIND(exitmap,&exitmap,list))
+		HT_INSERT(exitmap,&exitmap,list);
+}
+
+/** Forget the exits that we haven't seen since <b>old</b>. Since <b>exitlist</b> is kept in the order of <b>last_seen</b>, they are at its end. */
+static void iplist_remove_older_than(time_t old)
+{	ip_info_t *list;
+	while(exitlist_tail && exitlist_tail->last_seen <= old)
+	{	list = exitlist_tail;
+		iplist_unlink(list);
+		if(HT_FIND(exitmap,&exitmap,list) == list)
+			HT_REMOVE(exitmap,&exitmap,list);
+		tor_free(list);
+	}
+}
+
 void iplist_free(void)
 {	ip_info_t *tmp;
+	HT_CLEAR(exitmap,&exitmap);
 	while(exitlist)
 	{	tmp = exitlist->next;
 		tor_free(exitlist);
 		exitlist = tmp;
 	}
+	exitlist_tail = NULL;
 }
 
 void iplist_write(void)
@@ -61,11 +123,13 @@ void iplist_write(void)
 		{	ip_info_t *list;
 			time_t old = get_time(NULL) - (tmpOptions->ExitMaxSeen * DAY_IN_SECONDS);
 			DWORD written;
-			list = exitlist;
+			iplist_remove_older_than(old);
+			/* oldest first, so that iplist_init() rebuilds the list in the same order */
+			list = exitlist_tail;
 			while(list)
 			{	if(old < list->last_seen)
 					WriteFile(hFile,&list->flags,IPLIST_SIZE,&written,NULL);
-				list = list->next;
+				list = list->prev;
 			}
 			CloseHandle(hFile);
 		}
@@ -74,12 +138,20 @@ void iplist_write(void)
 	tor_free(fname);
 }
 
+/** Helper for smartlist_sort(): order ip_info_t entries by increasing <b>last_seen</b>. */
+static int iplist_compare_last_seen(const void **a,const void **b)
+{	const ip_info_t *i1 = *a,*i2 = *b;
+	if(i1->last_seen < i2->last_seen)	return -1;
+	return i1->last_seen > i2->last_seen;
+}
+
 void iplist_init(void)
 {	if(tmpOptions->ExitSeenFlags & EXIT_SEEN_FLAG_SAVE_STATS)
 	{	char *fname = get_datadir_fname(DATADIR_IPLIST);
 		HANDLE hFile = open_file(fname,GENERIC_READ,OPEN_EXISTING);
 		if(hFile!=INVALID_HANDLE_VALUE)
 		{	ip_info_t *list = NULL;
+			smartlist_t *loaded = smartlist_create();
 			time_t old = get_time(NULL) - (tmpOptions->ExitMaxSeen * DAY_IN_SECONDS);
 			DWORD read=1;
 			while(read)
@@ -88,14 +160,17 @@ void iplist_init(void)
 				read = 0;
 				ReadFile(hFile,&list->flags,IPLIST_SIZE,&read,NULL);
 				if(read && old < list->last_seen)
-				{	list->next = exitlist;
-					exitlist = list;
+				{	smartlist_add(loaded,list);
 					list = NULL;
 				}
 			}
 			if(list)
 				tor_free(list);
 			CloseHandle(hFile);
+			/* Files written by older versions are not in the order of last_seen, and iplist_remove_older_than() needs that order. */
+			smartlist_sort(loaded,iplist_compare_last_seen);
+			SMARTLIST_FOREACH(loaded,ip_info_t *,l,iplist_add(l));
+			smartlist_free(loaded);
 		}
 		tor_free(fname);
 	}
@@ -145,27 +220,24 @@ time_t dlgBypassBlacklists_getLongevity(routerinfo_t *router)
 	if(!router) return now;
 	rstart = now - router->uptime;
 	if((tmpOptions->ExitSeenFlags & EXIT_SEEN_FLAG_SAVE_STATS))// && (router->is_exit))
-	{	ip_info_t *list;
-		uint32_t raddr=geoip_reverse(router->addr);
-		list = exitlist;
-		while(list)
-		{	if((raddr == list->addr[0]) && (list->flags&IP_FLAG_EXIT_NODE) != 0)
-			{	if(rstart < list->added)
-					list->added = rstart;
-				else	rstart = list->added;
-				list->last_seen = now;
-				break;
-			}
-			list = list->next;
+	{	ip_info_t *list,lookup;
+		lookup.addr[0] = geoip_reverse(router->addr);
+		list = HT_FIND(exitmap,&exitmap,&lookup);
+		if(list)
+		{	if(rstart < list->added)
+				list->added = rstart;
+			else	rstart = list->added;
+			list->last_seen = now;
+			iplist_unlink(list);
+			iplist_push(list);
 		}
-		if(!list)
+		else
 		{	list = tor_malloc_zero(sizeof(ip_info_t));
-			list->next = exitlist;
-			list->addr[0] = raddr;
+			list->addr[0] = lookup.addr[0];
 			list->added = rstart;
 			list->last_seen = now;
 			list->flags = IP_FLAG_EXIT_NODE;
-			exitlist = list;
+			iplist_add(list);
 		}
 	}
 	return rstart;
@@ -2,6 +2,7 @@
 #include "dlg_util.h"
 #include "main.h"
 #include "language.h"
+#include "perf.h"
 
 HWND hDlgDebug=NULL;
 WNDPROC oldEditProc;
@@ -23,6 +24,7 @@ lang_dlg_info lang_dlg_debug[]={
 BOOL is_dns_letter(char c);
 int is_NaN(char *str);
 void dlgDebug_logFilterAdd(char *strban);
+void dlgDebug_exportStreamTraces(void);
 int __stdcall dlgFilters(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 int __stdcall newEditProc(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 int __stdcall dlgDebug(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
@@ -281,6 +283,8 @@ int __stdcall newEditProc(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			}
 		}
 		LangAppendMenu(hMenu,MF_STRING|MF_UNCHECKED|MF_ENABLED,20107,LANG_MNU_DUMP_STATS);
+		LangAppendMenu(hMenu,MF_STRING|MF_UNCHECKED|MF_ENABLED,20108,LANG_MNU_STREAM_TRACES);
+		LangAppendMenu(hMenu,MF_STRING|MF_UNCHECKED|MF_ENABLED,20109,LANG_MNU_EXPORT_STREAM_TRACES);
 		GetCursorPos(&cPoint);
 		TrackPopupMenu(hMenu,TPM_LEFTALIGN,cPoint.x,cPoint.y,0,hMainDialog,0);
 		DestroyMenu(hMenu);
@@ -290,6 +294,39 @@ int __stdcall newEditProc(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 	return CallWindowProc(oldEditProc,hDlg,uMsg,wParam,lParam);
 }
 
+const WCHAR csvFilter[]=L"CSV files (*.csv)\0*.csv\0All files\0*.*\0\0";
+void dlgDebug_exportStreamTraces(void)
+{	char *csv = stream_trace_get_csv();
+	OPENFILENAMEW ofn;
+	LPWSTR fileName;
+	if(!csv)
+	{	stream_trace_log(LOG_NOTICE);
+		return;
+	}
+	ZeroMemory(&ofn,sizeof(ofn));
+	ofn.lStructSize=sizeof(ofn);
+	ofn.hwndOwner=hMainDialog;
+	ofn.hInstance=hInstance;
+	ofn.lpstrFilter=csvFilter;
+	ofn.lpstrDefExt=L"csv";
+	fileName=tor_malloc(8192);fileName[0]=0;
+	ofn.lpstrFile=fileName;
+	ofn.nMaxFile=4095;
+	ofn.Flags=OFN_EXPLORER|OFN_HIDEREADONLY|OFN_NOCHANGEDIR|OFN_PATHMUSTEXIST|OFN_OVERWRITEPROMPT;
+	if(GetSaveFileNameW(&ofn))
+	{	HANDLE hFile = CreateFileW(fileName,GENERIC_WRITE,FILE_SHARE_READ,NULL,CREATE_ALWAYS,0,NULL);
+		DWORD len = strlen(csv),written = 0;
+		if(hFile == INVALID_HANDLE_VALUE || !WriteFile(hFile,csv,len,&written,NULL) || written != len)
+		{	char *fname = get_utf(fileName);
+			log(LOG_WARN,LD_APP,get_lang_str(LANG_LOG_DLG_STREAM_TRACE_EXPORT_FAILED),fname);
+			tor_free(fname);
+		}
+		if(hFile != INVALID_HANDLE_VALUE)	CloseHandle(hFile);
+	}
+	tor_free(fileName);
+	tor_free(csv);
+}
+
 void dlgDebug_langUpdate(void)
 {	if(!hDlgDebug || !LangGetLanguage()) return;
 	int i,j=0;
@@ -1,4 +1,5 @@
 #include "or.h"
+#include "config.h"
 #include "dlg_util.h"
 #include "plugins.h"
 #include "rendservice.h"
@@ -92,63 +93,197 @@ int __stdcall dlgHSKey(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 	return 0;
 }
 
+/** The most key generation threads we will run for one search. */
+#define MAX_GEN_ADDR_THREADS 64
+
+/** The prefix that the current (or last) search is looking for. */
+static char gen_prefix[100];
+/** How many characters of the best address so far match <b>gen_prefix</b>. */
+static int gen_best = 0;
+/** The address of <b>gen_bestkey</b>. */
+static char gen_bestaddr[100];
+/** The key with the best match so far. */
+static crypto_pk_env_t *gen_bestkey = NULL;
+/** How many keys we have tried for <b>gen_prefix</b>, over all runs. */
+static uint64_t gen_tried = 0;
+/** Keys tried since the status line was last updated. */
+static volatile LONG gen_tried_recent = 0;
+/** How many key generation threads are still running? */
+static volatile LONG gen_threads_running = 0;
+/** True once a key generation thread found a full match. */
+static volatile LONG gen_found = 0;
+/** Protects <b>gen_best</b>, <b>gen_bestaddr</b> and <b>gen_bestkey</b>. */
+static CRITICAL_SECTION gen_lock;
+/** True once <b>gen_lock</b> has been initialized. */
+static int gen_lock_initialized = 0;
+/** Signalled when a thread finds a better match, or exits. */
+static HANDLE gen_wakeup = NULL;
+
+void __stdcall gen_addr_worker(LPARAM unused) __attribute__((noreturn));
+
+/** Return how many characters of <b>addr</b> match <b>prefix</b>, comparing
+ * case-insensitively, position by position. */
+static int gen_addr_match(const char *prefix,const char *addr)
+{	int i,j=0;
+	for(i=0;prefix[i] && addr[i];i++)
+		if((prefix[i]|0x20) == (addr[i]|0x20))
+			j++;
+	return j;
+}
+
+/** One of the key generation threads of a search: generate keys until the
+ * search is cancelled or some thread finds a full match, and keep the best
+ * match in <b>gen_bestkey</b>. */
+void __stdcall gen_addr_worker(LPARAM unused)
+{	crypto_pk_env_t *key;
+	char addr[100];
+	int j,plen = strlen(gen_prefix);
+	(void) unused;
+	key = crypto_new_pk_env();
+	if(!key)	log_err(LD_GENERAL,get_lang_str(LANG_LOG_ROUTER_ERROR_CONSTRUCTING_KEY));
+	while(key && thread_active && !gen_found)
+	{	if(crypto_pk_generate_key(key) || rend_get_service_id(key,addr))
+			break;
+		InterlockedIncrement(&gen_tried_recent);
+		j = gen_addr_match(gen_prefix,addr);
+		if(j <= gen_best)	continue;
+		EnterCriticalSection(&gen_lock);
+		if(j > gen_best)
+		{	gen_best = j;
+			strlcpy(gen_bestaddr,addr,sizeof(gen_bestaddr));
+			if(gen_bestkey)	crypto_free_pk_env(gen_bestkey);
+			gen_bestkey = key;
+			key = NULL;
+			if(j >= plen)	gen_found = 1;
+		}
+		LeaveCriticalSection(&gen_lock);
+		SetEvent(gen_wakeup);
+		if(!key && !(key = crypto_new_pk_env()))
+			log_err(LD_GENERAL,get_lang_str(LANG_LOG_ROUTER_ERROR_CONSTRUCTING_KEY));
+	}
+	if(key)	crypto_free_pk_env(key);
+	crypto_thread_cleanup();
+	InterlockedDecrement(&gen_threads_running);
+	SetEvent(gen_wakeup);
+	ExitThread(0);
+}
+
+/** Format <b>seconds</b> as a short duration into <b>buf</b>. */
+static void gen_addr_format_eta(char *buf,size_t buflen,double seconds)
+{	unsigned long t;
+	if(seconds > 99999.0*86400.0)
+		tor_snprintf(buf,buflen,"> 99999d");
+	else
+	{	t = (unsigned long)seconds;
+		if(t >= 86400)	tor_snprintf(buf,buflen,"%lud %02lu:%02lu:%02lu",t/86400,(t/3600)%24,(t/60)%60,t%60);
+		else		tor_snprintf(buf,buflen,"%02lu:%02lu:%02lu",t/3600,(t/60)%60,t%60);
+	}
+}
+
+/** Show the best match in the dialog. */
+static void gen_addr_show_best(HWND hDlg)
+{	char *tmponion,*tmpmask;
+	int i;
+	tmponion = tor_malloc(256);
+	tmpmask = tor_malloc(100);
+	EnterCriticalSection(&gen_lock);
+	for(i=0;gen_prefix[i] && gen_bestaddr[i];i++)
+	{	if((gen_prefix[i]|0x20) == (gen_bestaddr[i]|0x20))
+			tmpmask[i]=gen_bestaddr[i]|0x20;
+		else	tmpmask[i]='-';
+	}
+	tmpmask[i]=0;
+	tor_snprintf(tmponion,255,"%s.onion ( %s )",gen_bestaddr,tmpmask);
+	i = gen_best;
+	LeaveCriticalSection(&gen_lock);
+	SetDlgItemText(hDlg,13,tmponion);
+	SendDlgItemMessage(hDlg,500,PBM_SETPOS,i,0);
+	tor_free(tmpmask);
+	tor_free(tmponion);
+}
+
+/** Drive a search for an address that matches the prefix in the dialog:
+ * start one low-priority key generation thread per CPU, show the best match,
+ * the key rate and the expected time to a full match once a second, and
+ * collect the result when the search ends.  A search for the prefix of the
+ * last search resumes from its best match and key count. */
 void __stdcall gen_addr_thread(LPARAM hDlg)
 {	char *prefix;
-	char *tmpaddr;
-	char *tmpmask;
-	int i,j,best=0;
-	thread_active++;
-	crypto_pk_env_t *bestkey = NULL;
+	char eta[50];
+	char *status;
+	int i,n_threads,plen;
+	DWORD thr_id,now,last_tick;
+	double expected,rate = 0;
+	HANDLE h1;
 	prefix = tor_malloc(100);
-	tmpaddr = tor_malloc(100);
-	tmpmask = tor_malloc(100);
+	status = tor_malloc(256);
+	*prefix = 0;
 	GetDlgItemText((HWND)hDlg,12,prefix,99);
-	SendDlgItemMessage((HWND)hDlg,500,PBM_SETRANGE,0,MAKELPARAM(0,strlen(prefix)));
-	SendDlgItemMessage((HWND)hDlg,500,PBM_SETPOS,best,0);
-	if(!(prkey = crypto_new_pk_env()))
-		log_err(LD_GENERAL,get_lang_str(LANG_LOG_ROUTER_ERROR_CONSTRUCTING_KEY));
-	while(thread_active)
-	{	crypto_pk_generate_key(prkey);
-		rend_get_service_id(prkey,tmpaddr);
-		j=0;
-		for(i=0;prefix[i] && tmpaddr[i];i++)
-			if((prefix[i]|0x20) == (tmpaddr[i]|0x20))
-				j++;
-		if(j>best)
-		{	best = j;
-			for(i=0;prefix[i] && tmpaddr[i];i++)
-			{	if((prefix[i]|0x20) == (tmpaddr[i]|0x20))
-				{	tmpmask[i]=tmpaddr[i]|0x20;
-				}
-				else	tmpmask[i]='-';
-			}
-			tmpmask[i]=0;
-			char *tmponion = tor_malloc(100);
-			tor_snprintf(tmponion,99,"%s.onion ( %s )",tmpaddr,tmpmask);
-			SetDlgItemText((HWND)hDlg,13,tmponion);
-			tor_free(tmponion);
-			if(bestkey)
-				crypto_free_pk_env(bestkey);
-			bestkey = prkey;
-			if(!(prkey = crypto_new_pk_env()))
-				log_err(LD_GENERAL,get_lang_str(LANG_LOG_ROUTER_ERROR_CONSTRUCTING_KEY));
-			SendDlgItemMessage((HWND)hDlg,500,PBM_SETPOS,best,0);
-			if(prefix[best]==0 || tmpaddr[best]==0)
-				break;
+	if(strcmp(prefix,gen_prefix) || !prkey || gen_found)
+	{	/* A new search. */
+		strlcpy(gen_prefix,prefix,sizeof(gen_prefix));
+		if(prkey)	crypto_free_pk_env(prkey);
+		prkey = NULL;
+		gen_best = 0;
+		gen_tried = 0;
+		*gen_bestaddr = 0;
+	}
+	gen_bestkey = prkey;
+	prkey = NULL;
+	gen_found = 0;
+	gen_tried_recent = 0;
+	plen = strlen(gen_prefix);
+	SendDlgItemMessage((HWND)hDlg,500,PBM_SETRANGE,0,MAKELPARAM(0,plen));
+	if(gen_bestkey)	gen_addr_show_best((HWND)hDlg);
+	else		SendDlgItemMessage((HWND)hDlg,500,PBM_SETPOS,0,0);
+	/* Each character of the address is one of 32, so a full match takes
+	 * 32^plen keys on average, however many we have tried already. */
+	expected = 1.0;
+	for(i=0;i<plen;i++)	expected *= 32.0;
+	n_threads = get_num_cpus(tmpOptions);
+	if(n_threads < 1)	n_threads = 1;
+	if(n_threads > MAX_GEN_ADDR_THREADS)	n_threads = MAX_GEN_ADDR_THREADS;
+	gen_wakeup = CreateEvent(NULL,FALSE,FALSE,NULL);
+	gen_threads_running = 0;
+	for(i=0;i<n_threads;i++)
+	{	InterlockedIncrement(&gen_threads_running);
+		h1 = CreateThread(0,0,(LPTHREAD_START_ROUTINE)gen_addr_worker,NULL,0,&thr_id);
+		if(!h1)
+		{	InterlockedDecrement(&gen_threads_running);
+			break;
 		}
+		SetThreadPriority(h1,THREAD_PRIORITY_LOWEST);
+		CloseHandle(h1);
 	}
-	if(bestkey)
-	{	crypto_free_pk_env(prkey);
-		prkey = bestkey;
+	n_threads = i;
+	last_tick = GetTickCount();
+	while(gen_threads_running)
+	{	WaitForSingleObject(gen_wakeup,1000);
+		if(gen_bestkey)	gen_addr_show_best((HWND)hDlg);
+		now = GetTickCount();
+		if(now - last_tick >= 1000)
+		{	LONG n = InterlockedExchange(&gen_tried_recent,0);
+			gen_tried += n;
+			rate = (double)n * 1000.0 / (double)(now - last_tick);
+			last_tick = now;
+			if(rate > 0)	gen_addr_format_eta(eta,sizeof(eta),expected / rate);
+			else		strlcpy(eta,"?",sizeof(eta));
+			tor_snprintf(status,255,get_lang_str(LANG_HS_GEN_STATUS),n_threads,gen_tried,(unsigned long)rate,eta);
+			SetDlgItemText((HWND)hDlg,14,status);
+		}
 	}
+	gen_tried += InterlockedExchange(&gen_tried_recent,0);
+	CloseHandle(gen_wakeup);
+	gen_wakeup = NULL;
+	prkey = gen_bestkey;
+	gen_bestkey = NULL;
 	tor_free(*genAddress);
-	*genAddress=tor_strdup(tmpaddr);
+	*genAddress=tor_strdup(gen_bestaddr);
 	EnableWindow(GetDlgItem((HWND)hDlg,1),1);
 	EnableWindow(GetDlgItem((HWND)hDlg,12),1);
 	LangSetDlgItemText((HWND)hDlg,2,LANG_HS_GEN_CLOSE);
 	tor_free(prefix);
-	tor_free(tmpaddr);
-	tor_free(tmpmask);
+	tor_free(status);
 	thread_active = 0;
 	ExitThread(0);
 }
@@ -160,6 +295,11 @@ int __stdcall dlgGenHSKey(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			changeDialogStrings(hDlg,lang_dlg_gen_hs_key);
 		}
 		thread_active = 0;
+		if(!gen_lock_initialized)
+		{	InitializeCriticalSection(&gen_lock);
+			gen_lock_initialized = 1;
+		}
+		*gen_prefix = 0;
 		service=(rend_service_t *)lParam;
 		if(genAddress)	SetDlgItemText(hDlg,12,*genAddress);
 		EnableWindow(GetDlgItem(hDlg,1),1);
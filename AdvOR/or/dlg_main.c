@@ -9,6 +9,7 @@
 #include "circuitlist.h"
 #include "hibernate.h"
 #include "control.h"
+#include "perf.h"
 #include <shellapi.h>
 
 #define STARTUP_OPTION_START_TOR 1
@@ -107,6 +108,25 @@ LPFN10 GetChainKeyName=NULL;
 LPFN14 RelinkStoredProc=NULL;
 int __stdcall tor_thread(LPARAM lParam);
 
+#ifndef PROCESS_QUERY_LIMITED_INFORMATION
+#define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+#endif
+/** Number of slots in <b>process_name_cache</b>. Windows PIDs are multiples of 4, so a slot is selected with (pid >> 2). */
+#define PROCESS_NAME_CACHE_SIZE 256
+/** Cached result of ProcessNameFromPid(), which enumerates all processes each time it is called. */
+typedef struct process_name_cache_t
+{	DWORD pid;
+	FILETIME created;
+	char *name;
+	int namelen;
+	int result;
+} process_name_cache_t;
+static process_name_cache_t process_name_cache[PROCESS_NAME_CACHE_SIZE];
+/** Protects <b>process_name_cache</b>, which is used by both the tor thread and the dialogs. */
+static CRITICAL_SECTION process_name_lock;
+static int process_name_cache_initialized = 0;
+static void process_name_cache_forget(DWORD pid);
+
 lang_dlg_info lang_dlg_main[]={
 	{1,LANG_DLG_START_TOR},
 	{6,LANG_DLG_NEW_IDENTITY},
@@ -152,6 +172,7 @@ void initSplitter(HWND hParent,int ctrl,SplitterAdjust moveW);
 void splt_resize3(void);
 void dlgProxy_banDebugAddress(char *strban);
 void dlgDebug_logFilterAdd(char *strban);
+void dlgDebug_exportStreamTraces(void);
 void dlgTrackedHosts_trackedHostExitAdd(HWND hDlg,char *newAddr);
 void dlgTrackedHosts_trackedDomainExitAdd(HWND hDlg,char *newAddr);
 void dlgTrackedHosts_addressMapAdd(HWND hDlg,char *newAddr);
@@ -187,7 +208,9 @@ HANDLE getStateIcon(void);
 void setLastSort(int newSort);
 
 void __stdcall _proxy_log(int log_level,const char *msg)
-{	log(log_level,LD_APP,"%s",msg);
+{	const char *s = strstr(msg,get_lang_str(LANG_DLL_CREATED_A_NEW_PROCESS));
+	if(s)	process_name_cache_forget(atol(s + strlen(get_lang_str(LANG_DLL_CREATED_A_NEW_PROCESS))));
+	log(log_level,LD_APP,"%s",msg);
 }
 
 void setStartupOption(int commandId)
@@ -237,10 +260,59 @@ char *getLanguageFileName(const char *source)
 	return lngname;
 }
 
+/** Return the creation time of <b>pid</b> in <b>created</b>, used to tell a process from a later one that reuses its PID. Return 0 if the process can't be opened. */
+static int get_process_creation_time(DWORD pid,FILETIME *created)
+{	FILETIME t1,t2,t3;
+	int r = 0;
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION,0,pid);
+	if(!hProcess)	hProcess = OpenProcess(PROCESS_QUERY_INFORMATION,0,pid);
+	if(hProcess)
+	{	r = GetProcessTimes(hProcess,created,&t1,&t2,&t3) != 0;
+		CloseHandle(hProcess);
+	}
+	return r;
+}
+
+/** Forget the cached name of <b>pid</b>; called when the interceptor reports a new process. */
+static void process_name_cache_forget(DWORD pid)
+{	process_name_cache_t *ent = &process_name_cache[(pid >> 2) % PROCESS_NAME_CACHE_SIZE];
+	if(!process_name_cache_initialized)	return;
+	EnterCriticalSection(&process_name_lock);
+	if(ent->pid == pid)
+	{	ent->pid = 0;
+		tor_free(ent->name);
+	}
+	LeaveCriticalSection(&process_name_lock);
+}
+
 int getProcessName(char *buffer,int bufsize,DWORD pid)
-{	if(ProcessNameFromPid) return ProcessNameFromPid(buffer,bufsize,pid);
+{	process_name_cache_t *ent;
+	FILETIME created;
+	int r;
 	*buffer=0;
-	return 0;
+	if(!ProcessNameFromPid || bufsize <= 0)	return 0;
+	if(!pid || !get_process_creation_time(pid,&created))	return ProcessNameFromPid(buffer,bufsize,pid);
+	ent = &process_name_cache[(pid >> 2) % PROCESS_NAME_CACHE_SIZE];
+	EnterCriticalSection(&process_name_lock);
+	if(ent->pid == pid && ent->name && !CompareFileTime(&ent->created,&created) && ent->namelen < bufsize)
+	{	memcpy(buffer,ent->name,ent->namelen + 1);
+		r = ent->result;
+		LeaveCriticalSection(&process_name_lock);
+		return r;
+	}
+	LeaveCriticalSection(&process_name_lock);
+	r = ProcessNameFromPid(buffer,bufsize,pid);
+	if(*buffer)
+	{	EnterCriticalSection(&process_name_lock);
+		if(ent->name)	tor_free(ent->name);
+		ent->pid = pid;
+		ent->created = created;
+		ent->namelen = strlen(buffer);
+		ent->name = tor_memdup(buffer,ent->namelen + 1);
+		ent->result = r;
+		LeaveCriticalSection(&process_name_lock);
+	}
+	return r;
 }
 
 DWORD getPID(uint32_t addr,int port)
@@ -596,6 +668,10 @@ int __stdcall dlgfunc(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 				GetProcessChainKey=(LPFN1)GetProcAddress(hLibrary,"GetProcessChainKey");
 				GetChainKeyName=(LPFN10)GetProcAddress(hLibrary,"GetChainKeyName");
 				ProcessNameFromPid=(LPFN9)GetProcAddress(hLibrary,"ProcessNameFromPid");
+				if(!process_name_cache_initialized)
+				{	InitializeCriticalSection(&process_name_lock);
+					process_name_cache_initialized = 1;
+				}
 				ShowOpenPorts=(LPFN11)GetProcAddress(hLibrary,"ShowOpenPorts");
 				RegisterPluginKey=(LPFN1)GetProcAddress(hLibrary,"RegisterPluginKey");
 				UnregisterPluginKey=(LPFN1)GetProcAddress(hLibrary,"UnregisterPluginKey");
@@ -765,6 +841,8 @@ int __stdcall dlgfunc(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			}
 		}
 		else if(LOWORD(wParam)==20107)	dumpstats(LOG_NOTICE);
+		else if(LOWORD(wParam)==20108)	stream_trace_log(LOG_NOTICE);
+		else if(LOWORD(wParam)==20109)	dlgDebug_exportStreamTraces();
 		else if(LOWORD(wParam)==20199)
 		{	set_router_sel((uint32_t)0x0100007f,1);
 			signewnym_impl(get_time(NULL),1);
@@ -11,6 +11,8 @@
 #include "config.h"
 #include "circuitbuild.h"
 #include "control.h"
+#include "dlg_snapshot.h"
+#include "perf.h"
 
 #define NODE_TYPE_CIRCUIT 1
 #define NODE_TYPE_ROUTER 2
@@ -78,7 +80,7 @@ void drawGraph(HWND hWnd);
 void recalcGraph(void);
 void releaseGraph(void);
 void dlgShowCircuits(void);
-void show_connection_info(connection_t *conn,char *s1);
+void show_connection_info(const gui_snapshot_t *snap,const gui_conn_t *conn,char *s1);
 void tree_destroy_circuit_menu(void);
 HTREEITEM insert_new_node(TV_INSERTSTRUCT *nodeinfo);
 void tree_ban_entry_menu(void);
@@ -99,12 +101,7 @@ void tree_lang_update(void);
 circuit_t *tree_get_selected_circuit(void);
 void tree_show_menu(HTREEITEM hItem);
 
-uint32_t stats_bw_read[128];
-uint32_t stats_bw_written[128];
-unsigned int draw_bw_read[128],draw_bw_written[128];
-uint64_t totals_read=0,totals_written=0;
-uint32_t last_max=1,last_max_128=1;
-int stats_idx=0;
+unsigned int draw_bw_read[GUI_BW_HISTORY],draw_bw_written[GUI_BW_HISTORY];
 int flag_busy=0;
 BITMAPINFO bmdata;
 HBITMAP hBitmap=NULL,hOldBitmap=NULL;
@@ -113,10 +110,23 @@ TV_ITEM tvit;
 TV_INSERTSTRUCT tvins;
 unsigned char *bmpbits=NULL;
 int adding_circuits=0;
+
+/** Flags for circuit_t.tree_pending: the circuit needs a new tree node, ... */
+#define TREE_PENDING_ADD 1
+/** ... its node needs the new text in circuit_t.tree_label, ... */
+#define TREE_PENDING_LABEL 2
+/** ... it has new hops, ... */
+#define TREE_PENDING_HOPS 4
+/** ... or it has new streams. */
+#define TREE_PENDING_STREAMS 8
+static void tree_apply_pending(void);
 char lastMid[20];
 LPARAM selected_item=0;
 HTREEITEM selected_node=0;
 int selection_type=0;
+/** The selected node whose details weren't in the last snapshot yet; we show them when the next one arrives. */
+HTREEITEM selection_pending=0;
+time_t selection_pending_since=0;
 HTREEITEM lastContextSel=0;
 uint32_t lastRouterSel=0;
 int lastPortSel=0;
@@ -124,32 +134,8 @@ int lastPid=0;
 char lastSocksAddress[MAX_SOCKS_ADDR_LEN];
 char lastSocksOriginalAddress[MAX_SOCKS_ADDR_LEN];
 
-void dlgStatsRWInit(void)
-{	int i;
-	for(i=0;i<128;i++)	stats_bw_read[i]=stats_bw_written[i]=0;
-}
-
-void dlgUpdateRWStats(int seconds,uint32_t bw_read,uint32_t bw_written)
-{	totals_read += bw_read;
-	totals_written += bw_written;
-	if(stats_idx==0)
-	{	last_max=last_max_128;
-		last_max_128=1;
-	}
-	if(bw_read>last_max || bw_written>last_max) last_max=bw_read>bw_written?bw_read:bw_written;
-	if(bw_read>last_max_128 || bw_written>last_max_128) last_max_128=bw_read>bw_written?bw_read:bw_written;
-	if(seconds>1)
-	{	bw_read /= seconds;
-		bw_written /= seconds;
-	}
-	stats_bw_read[stats_idx]=bw_read;
-	stats_bw_written[stats_idx]=bw_written;
-	stats_idx++;
-	stats_idx &= 0x7f;
-}
-
 void drawGraph(HWND hWnd)
-{	int i,j,k,l;
+{	int i,j,l;
 	unsigned char *memPtr;
 	HDC hTmpDC=NULL;
 	HDC hMemDC;
@@ -175,12 +161,15 @@ void drawGraph(HWND hWnd)
 		DeleteDC(hMemDC);
 	}
 	if(bmpbits)
-	{	for(l=0;last_max>>l!=0;l++)	;
-		memPtr=bmpbits;k=stats_idx;
-		for(i=0;i<128;i++)
-		{	draw_bw_read[i]=(stats_bw_read[(i+k)&0x7f]<<6)>>l;
-			draw_bw_written[i]=(stats_bw_written[(i+k)&0x7f]<<6)>>l;
+	{	gui_snapshot_t *snap=gui_snapshot_acquire();
+		uint32_t bw_max=snap?snap->bw_max:1;
+		for(l=0;bw_max>>l!=0;l++)	;
+		memPtr=bmpbits;
+		for(i=0;i<GUI_BW_HISTORY;i++)
+		{	draw_bw_read[i]=snap?(snap->bw_read[i]<<6)>>l:0;
+			draw_bw_written[i]=snap?(snap->bw_written[i]<<6)>>l:0;
 		}
+		gui_snapshot_release(snap);
 		for(j=63;j>32;j--)
 		{
 			for(i=0;i<128;i++)
@@ -257,34 +246,50 @@ void dlgShowCircuits(void)
 	SendDlgItemMessage(hDlgNetInfo,25500,TVM_DELETEITEM,0,(LPARAM)TVI_ROOT);
 	tvins.hParent=TVI_ROOT;
 	tvins.hInsertAfter=TVI_FIRST;
-	circuit_tree_add_circs();
 	adding_circuits++;
-//control_event_circuit_status
+	circuit_tree_add_circs();
 }
 
 void dlgShowRWStats(HWND hDlg)
 {	if(flag_busy) return;
 	flag_busy++;
 	char memInt[20];int i;
-	FormatMemInt(memInt,stats_bw_read[(stats_idx-1)&0xff]);
-	for(i=0;memInt[i];i++)	;
-	memInt[i++]='/';memInt[i++]='s';memInt[i]=0;
-	SetDlgItemText(hDlg,25013,memInt);
-	FormatMemInt(memInt,stats_bw_written[(stats_idx-1)&0xff]);
-	for(i=0;memInt[i];i++)	;
-	memInt[i++]='/';memInt[i++]='s';memInt[i]=0;
-	SetDlgItemText(hDlg,25015,memInt);
-	FormatMemInt64(memInt,&totals_read);
-	SetDlgItemText(hDlg,25017,memInt);
-	FormatMemInt64(memInt,&totals_written);
-	SetDlgItemText(hDlg,25019,memInt);
+	gui_snapshot_t *snap=gui_snapshot_acquire();
+	if(snap)
+	{	FormatMemInt(memInt,snap->bw_read[GUI_BW_HISTORY-1]);
+		for(i=0;memInt[i];i++)	;
+		memInt[i++]='/';memInt[i++]='s';memInt[i]=0;
+		SetDlgItemText(hDlg,25013,memInt);
+		FormatMemInt(memInt,snap->bw_written[GUI_BW_HISTORY-1]);
+		for(i=0;memInt[i];i++)	;
+		memInt[i++]='/';memInt[i++]='s';memInt[i]=0;
+		SetDlgItemText(hDlg,25015,memInt);
+		FormatMemInt64(memInt,&snap->total_read);
+		SetDlgItemText(hDlg,25017,memInt);
+		FormatMemInt64(memInt,&snap->total_written);
+		SetDlgItemText(hDlg,25019,memInt);
+	}
 	drawGraph(GetDlgItem(hDlg,25051));
 	dlgShowCircuits();
+	tree_apply_pending();
+	if(selection_pending && snap && snap->has_details && snap->taken > selection_pending_since)
+		tree_show_sel(selection_pending,0);
+	gui_snapshot_release(snap);
 	flag_busy=0;
 }
 
 
-void show_connection_info(connection_t *conn,char *s1)
+/** Describe the connection <b>conn</b> of <b>snap</b> in <b>s1</b>. */
+/** Write a line with the queue waits in <b>hist</b> to <b>s1</b>. */
+static void show_cell_wait(const cell_wait_hist_t *hist,char *s1)
+{	uint32_t p50=0,p90=0,p99=0;
+	cell_wait_hist_get_percentile(hist,50,&p50);
+	cell_wait_hist_get_percentile(hist,90,&p90);
+	cell_wait_hist_get_percentile(hist,99,&p99);
+	tor_snprintf(s1,200,get_lang_str(LANG_NETINFO_CELL_WAIT),(unsigned long)hist->n,(unsigned long)(hist->total_usec/hist->n),(unsigned long)hist->max_usec,(unsigned long)p50,(unsigned long)p90,(unsigned long)p99);
+}
+
+void show_connection_info(const gui_snapshot_t *snap,const gui_conn_t *conn,char *s1)
 {
 	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_TYPE),conn_type_to_string(conn->type));s1 += strlen(s1);
 	switch(conn->magic)
@@ -313,39 +318,40 @@ void show_connection_info(connection_t *conn,char *s1)
 	{	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_PURPOSE),dir_conn_purpose_to_string(conn->purpose));s1 += strlen(s1);}
 	else if(conn->purpose>=_EXIT_PURPOSE_MIN && conn->purpose <= _EXIT_PURPOSE_MAX)
 	{	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_PURPOSE),conn->purpose==EXIT_PURPOSE_CONNECT?get_lang_str(LANG_NETINFO_CONNECTION_PURPOSE_CONNECT):get_lang_str(LANG_NETINFO_CONNECTION_PURPOSE_RESOLVE));s1 += strlen(s1);}
-	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_TIME_CREATED));s1 += strlen(s1);format_iso_time(s1,conn->timestamp_created);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
-	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_LAST_READ_TIME));s1 += strlen(s1);format_iso_time(s1,conn->timestamp_lastread);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
-	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_LAST_WRITE_TIME));s1 += strlen(s1);format_iso_time(s1,conn->timestamp_lastwritten);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
-	if(conn->address){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_ADDRESS),conn->address);s1 += strlen(s1);}
+	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_TIME_CREATED));s1 += strlen(s1);format_iso_time(s1,conn->created);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
+	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_LAST_READ_TIME));s1 += strlen(s1);format_iso_time(s1,conn->lastread);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
+	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_LAST_WRITE_TIME));s1 += strlen(s1);format_iso_time(s1,conn->lastwritten);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
+	if(conn->address){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_ADDRESS),GUI_SNAPSHOT_STR(snap,conn->address));s1 += strlen(s1);}
 	if(conn->type==CONN_TYPE_OR || conn->magic==OR_CONNECTION_MAGIC)
-	{	or_connection_t *conn1=TO_OR_CONN(conn);
+	{	const gui_conn_t *conn1=conn;
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_TIME_CLIENT));s1 += strlen(s1);format_iso_time(s1,conn1->client_used);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
-		uint32_t raddr1=tor_addr_to_ipv4n(&conn1->real_addr);
+		uint32_t raddr1=conn1->real_addr;
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_ACTUAL_ADDRESS),raddr1&0xff,(raddr1>>8)&0xff,(raddr1>>16)&0xff,(raddr1>>24)&0xff);s1 += strlen(s1);
 		if(conn1->is_bad_for_new_circs){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_TOO_OLD));s1 += strlen(s1);}
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_ROUTER_BW_RATE));s1 += strlen(s1);
 		FormatMemInt(s1,conn1->bandwidthrate);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_ROUTER_BW_BURST));s1 += strlen(s1);
 		FormatMemInt(s1,conn1->bandwidthburst);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
+		if(conn1->cell_wait.n){	show_cell_wait(&conn1->cell_wait,s1);s1 += strlen(s1);}
 	}
 	else if(conn->type==CONN_TYPE_AP || conn->type==CONN_TYPE_EXIT || conn->magic==EDGE_CONNECTION_MAGIC)
-	{	edge_connection_t *conn2=TO_EDGE_CONN(conn);
+	{	const gui_conn_t *conn2=conn;
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_EXCL_KEY));s1 += strlen(s1);getExclKeyName(s1,conn->exclKey);s1 += strlen(s1);*s1++=13;*s1++=10;*s1=0;
-		if(conn2->chosen_exit_name){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_CHOSEN_EXIT),conn2->chosen_exit_name);s1 += strlen(s1);}
-		if(conn2->_base.pid)
-		{	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_PID),(unsigned int)conn2->_base.pid);s1 += strlen(s1);
-			getProcessName(s1,200,conn2->_base.pid);s1 += strlen(s1);*s1++=13;*s1++=10;*s1=0;
+		if(conn2->chosen_exit_name){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_CHOSEN_EXIT),GUI_SNAPSHOT_STR(snap,conn2->chosen_exit_name));s1 += strlen(s1);}
+		if(conn2->pid)
+		{	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_PID),(unsigned int)conn2->pid);s1 += strlen(s1);
+			getProcessName(s1,200,conn2->pid);s1 += strlen(s1);*s1++=13;*s1++=10;*s1=0;
 		}
-		else if(conn2->_base.hPlugin)
+		else if(conn2->hPlugin)
 		{	tor_snprintf(s1,100,get_lang_str(LANG_PLUGINS_PLUGIN));s1 += strlen(s1);
-			get_dll_name(s1,conn2->_base.hPlugin);s1 += strlen(s1);*s1++=13;*s1++=10;*s1=0;
+			get_dll_name(s1,conn2->hPlugin);s1 += strlen(s1);*s1++=13;*s1++=10;*s1=0;
 		}
-		if(conn2->socks_request)
-		{	if(conn2->socks_request->original_address){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_SOCKS_ADDRESS),conn2->socks_request->original_address,conn2->socks_request->port);s1 += strlen(s1);}
-			if(conn2->socks_request->address){		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_SOCKS_FINAL_ADDRESS),conn2->socks_request->address,conn2->socks_request->port);s1 += strlen(s1);}
-			tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_SOCKS_LAST_REQUEST),conn2->socks_request->command==SOCKS_COMMAND_CONNECT?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_CONNECT):conn2->socks_request->command==SOCKS_COMMAND_RESOLVE?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_RESOLVE):conn2->socks_request->command==SOCKS_COMMAND_RESOLVE_PTR?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_NAME):conn2->socks_request->command==SOCKS_COMMAND_SELECT_ROUTER?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_SELECT):get_lang_str(LANG_NETINFO_SOCKS_REQUEST_UNKNOWN));s1 += strlen(s1);
+		if(conn2->has_socks_request)
+		{	if(conn2->socks_original_address){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_SOCKS_ADDRESS),GUI_SNAPSHOT_STR(snap,conn2->socks_original_address),conn2->socks_port);s1 += strlen(s1);}
+			if(conn2->socks_address){		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_SOCKS_FINAL_ADDRESS),GUI_SNAPSHOT_STR(snap,conn2->socks_address),conn2->socks_port);s1 += strlen(s1);}
+			tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_SOCKS_LAST_REQUEST),conn2->socks_command==SOCKS_COMMAND_CONNECT?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_CONNECT):conn2->socks_command==SOCKS_COMMAND_RESOLVE?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_RESOLVE):conn2->socks_command==SOCKS_COMMAND_RESOLVE_PTR?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_NAME):conn2->socks_command==SOCKS_COMMAND_SELECT_ROUTER?get_lang_str(LANG_NETINFO_SOCKS_REQUEST_SELECT):get_lang_str(LANG_NETINFO_SOCKS_REQUEST_UNKNOWN));s1 += strlen(s1);
 		}
-		if(conn2->chosen_exit_name){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_CHOSEN_EXIT),conn2->chosen_exit_name);s1 += strlen(s1);}
+		if(conn2->chosen_exit_name){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_CHOSEN_EXIT),GUI_SNAPSHOT_STR(snap,conn2->chosen_exit_name));s1 += strlen(s1);}
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_BYTES_READ));s1 += strlen(s1);
 		FormatMemInt(s1,conn2->n_read);s1+=strlen(s1);*s1++=13;*s1++=10;*s1=0;
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_BYTES_WRITTEN));s1 += strlen(s1);
@@ -355,51 +361,103 @@ void show_connection_info(connection_t *conn,char *s1)
 		if(conn2->chosen_exit_retries){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_CONNECTION_TRACKED_EXIT));s1 += strlen(s1);}
 	}
 	else if(conn->type==CONN_TYPE_DIR || conn->magic==DIR_CONNECTION_MAGIC)
-	{	dir_connection_t *conn3=TO_DIR_CONN(conn);
-		if(conn3->requested_resource){	tor_snprintf(s1,500,get_lang_str(LANG_NETINFO_DIR_REQUEST),conn3->requested_resource);s1 += strlen(s1);}
+	{	const gui_conn_t *conn3=conn;
+		if(conn3->requested_resource){	tor_snprintf(s1,500,get_lang_str(LANG_NETINFO_DIR_REQUEST),GUI_SNAPSHOT_STR(snap,conn3->requested_resource));s1 += strlen(s1);}
 		if(!conn3->dirconn_direct){	tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_DIR_CONNECTED_VIA_TOR));s1 += strlen(s1);}
 		tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_ROUTER_PURPOSE_2),router_purpose_to_string(conn3->router_purpose));s1 += strlen(s1);
 	}
 }
 
+/** Write the path of the origin circuit <b>circ</b> of <b>snap</b> to <b>s</b>, like circuit_list_path(circ,1) does. */
+static void tree_format_path(const gui_snapshot_t *snap,const gui_circ_t *circ,char *s,size_t len)
+{	const char *states[] = {"closed", "waiting for keys", "open"};
+	const char *nickname=GUI_SNAPSHOT_STR(snap,circ->exit_nickname);
+	char id[HEX_DIGEST_LEN+1];
+	size_t l;
+	int i;
+	tor_snprintf(s,len,"%s%s circ (length %d%s%s):",circ->is_internal ? "internal" : "exit",circ->need_uptime ? " (high-uptime)" : "",circ->desired_path_len,circ->state == CIRCUIT_STATE_OPEN ? "" : ", last hop ",circ->state == CIRCUIT_STATE_OPEN ? "" :(nickname?nickname:"*unnamed*"));
+	for(i=0;i<circ->n_hops;i++)
+	{	const gui_hop_t *hop=&snap->hops[circ->first_hop+i];
+		const char *state=hop->state<=2?states[hop->state]:"unknown";
+		l=strlen(s);
+		if(hop->is_named)	tor_snprintf(s+l,len-l," %s(%s)",hop->nickname,state);
+		else
+		{	base16_encode(id,sizeof(id),hop->identity_digest,DIGEST_LEN);
+			tor_snprintf(s+l,len-l," $%s(%s)",id,state);
+		}
+	}
+}
+
+/** Remember that the details of <b>hItem</b> weren't in the last snapshot, unless <b>found</b>. We stop waiting for them after a few seconds, since the node was probably removed. */
+static void tree_set_pending_sel(HTREEITEM hItem,int found)
+{	time_t now=get_time(NULL);
+	if(found)	selection_pending=0;
+	else if(selection_pending!=hItem)
+	{	selection_pending=hItem;
+		selection_pending_since=now;
+	}
+	else if(now > selection_pending_since+GUI_SNAPSHOT_IDLE_TIMEOUT)	selection_pending=0;
+}
+
+/** The IP list of the last AS path that we showed, and the path. Only the GUI thread uses them. */
+static uint32_t as_path_iplist[32];
+static char *as_path_str=NULL;
+
+/** Write the AS path through our address and the hops of <b>circ</b> to <b>s</b>. The AS path only changes with the hops, so when the same circuit is selected again we don't walk the AS tables again. */
+static void tree_format_as_path(const gui_snapshot_t *snap,const gui_circ_t *circ,char *s,size_t len)
+{	uint32_t iplist[32];
+	uint32_t *aslist;
+	int i,n=0;
+	if(last_guessed_ip)	iplist[n++]=last_guessed_ip;
+	for(i=0;i<circ->n_hops && n<31;i++)
+		if(snap->hops[circ->first_hop+i].addr)	iplist[n++]=snap->hops[circ->first_hop+i].addr;
+	iplist[n++]=0;
+	if(!as_path_str || memcmp(iplist,as_path_iplist,n*sizeof(uint32_t)))
+	{	tor_free(as_path_str);
+		as_path_str=tor_malloc(16384);
+		aslist=tor_malloc(8192);
+		geoip_get_full_as_path(iplist,aslist,8188);
+		geoip_as_path_to_str(aslist,as_path_str,16384);
+		tor_free(aslist);
+		memcpy(as_path_iplist,iplist,n*sizeof(uint32_t));
+	}
+	strlcpy(s,as_path_str,len);
+}
+
+/** Show the details of the tree node <b>hItem</b>. Circuits and streams are described from the last snapshot; if it doesn't have them yet, they are shown when the next one arrives. */
 void tree_show_sel(HTREEITEM hItem,LPARAM lParam)
-{	tvit.hItem=hItem;tvit.mask=TVIF_PARAM;tvit.lParam=0;
+{	gui_snapshot_t *snap;
+	const gui_conn_t *stream;
+	tvit.hItem=hItem;tvit.mask=TVIF_PARAM;tvit.lParam=0;
 	SendDlgItemMessage(hDlgNetInfo,25500,TVM_GETITEM,0,(LPARAM)&tvit);
 	lParam=tvit.lParam;
 	if(lParam==0) return;
+	if(selection_pending!=hItem)	selection_pending=0;
+	snap=gui_snapshot_acquire();
 	if(lParam==NODE_TYPE_CIRCUIT)
-	{	circuit_t *circ=get_circuit_by_hitem(hItem);
+	{	const gui_circ_t *circ=gui_snapshot_get_circ(snap,hItem);
+		tree_set_pending_sel(hItem,circ!=NULL);
 		if(circ)
-		{	char *s=circuit_dump(circ),*s1;
-			s1 = tor_malloc(32768);
-			if(s)
-			{	tor_snprintf(s1,1024,"%s\r\n",s);
-				tor_free(s);s = s1;
-				s1=s+strlen(s);*s1++=13;*s1++=10;
-			}
-			else s = s1;
-			tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_EXCL_KEY));
-			s1 += strlen(s1);getExclKeyName(s1,circ->exclKey);s1 += strlen(s1);*s1++=13;*s1++=10;
-			uint32_t *iplist,*aslist;
-			iplist=tor_malloc(100);aslist=tor_malloc(8192);
-			int i=0;
-			if(last_guessed_ip)
-			{	iplist[0]=last_guessed_ip;i++;}
-			if(CIRCUIT_IS_ORIGIN(circ))
-			{	origin_circuit_t *c=TO_ORIGIN_CIRCUIT(circ);
-				crypt_path_t *hop=c->cpath;
-				while(hop && hop->extend_info)
-				{	routerinfo_t *ri = router_get_by_digest(hop->extend_info->identity_digest);
-					if(ri)	iplist[i++] = ri->addr;
-					hop=hop->next;
-					if(hop==c->cpath) break;
+		{	char *s=tor_malloc(32768),*s1=s;
+			char created[RFC1123_TIME_LEN+1];
+			*s=0;
+			if(!circ->marked_for_close)
+			{	format_rfc1123_time(created,circ->created);
+				if(!circ->is_origin)
+					tor_snprintf(s1,8192,get_lang_str(LANG_NETINFO_CIRCUIT_DUMP),circ->n_circ_id,circuit_purpose_to_string(circ->purpose),circ->state,circuit_state_to_string(circ->state),created);
+				else
+				{	char *path=tor_malloc(8192);
+					tree_format_path(snap,circ,path,8192);
+					tor_snprintf(s1,8192,get_lang_str(LANG_NETINFO_CIRCUIT_DUMP_2),circ->n_circ_id,circuit_purpose_to_string(circ->purpose),circ->state,circuit_state_to_string(circ->state),created,path);
+					tor_free(path);
 				}
+				s1 += strlen(s1);*s1++=13;*s1++=10;*s1++=13;*s1++=10;
 			}
-			iplist[i] = 0;
+			tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_EXCL_KEY));
+			s1 += strlen(s1);getExclKeyName(s1,circ->exclKey);s1 += strlen(s1);*s1++=13;*s1++=10;*s1=0;
+			if(circ->cell_wait.n){	show_cell_wait(&circ->cell_wait,s1);s1 += strlen(s1);}
 			tor_snprintf(s1,100,get_lang_str(LANG_NETINFO_AS_PATH));s1 += strlen(s1);*s1=0;
-			geoip_get_full_as_path(iplist,aslist,8188);
-			geoip_as_path_to_str(aslist,s1,16384);
-			tor_free(iplist);tor_free(aslist);
+			tree_format_as_path(snap,circ,s1,16384);
 			SetDlgItemTextL(hDlgNetInfo,25100,s);
 			tor_free(s);
 		}
@@ -409,9 +467,21 @@ void tree_show_sel(HTREEITEM hItem,LPARAM lParam)
 		SetDlgItemTextL(hDlgNetInfo,25001,get_lang_str(LANG_NETINFO_DESTROY_CIRCUIT));
 		SetDlgItemTextL(hDlgNetInfo,25002,get_lang_str(LANG_NETINFO_NEW_CIRCUIT));
 	}
+	else if((stream=gui_snapshot_get_stream(snap,hItem)) != NULL)
+	{	char *s=tor_malloc(32767);
+		tree_set_pending_sel(hItem,1);
+		show_connection_info(snap,stream,s);
+		SetDlgItemTextL(hDlgNetInfo,25100,s);
+		tor_free(s);
+		selected_item=lParam;
+		selection_type=SELECTION_TYPE_STREAM;
+		selected_node=hItem;
+		SetDlgItemTextL(hDlgNetInfo,25001,get_lang_str(LANG_NETINFO_CLOSE_CONNECTION));
+		SetDlgItemTextL(hDlgNetInfo,25002,get_lang_str(LANG_NETINFO_KILL_PROCESS));
+	}
 	else
 	{	crypt_path_t *hop=(crypt_path_t*)lParam;
-		connection_t *conn=NULL;
+		const gui_conn_t *conn=NULL;
 		if(hop->magic == CRYPT_PATH_MAGIC)
 		{	char *s=tor_malloc(32767),*s1;
 			routerinfo_t *ri=NULL;
@@ -449,9 +519,9 @@ void tree_show_sel(HTREEITEM hItem,LPARAM lParam)
 			else	tor_snprintf(s1,20," (AS_UNKNOWN)\r\n");
 			s1 += strlen(s1);
 			while(1)
-			{	conn=get_connection_by_addr(raddr,port,conn);
+			{	conn=gui_snapshot_get_conn_by_addr(snap,raddr,port,conn);
 				if(!conn) break;
-				show_connection_info(conn,s1);
+				show_connection_info(snap,conn,s1);
 				s1 += strlen(s1);
 			}
 			if(ri)
@@ -531,28 +601,23 @@ void tree_show_sel(HTREEITEM hItem,LPARAM lParam)
 			SetDlgItemTextL(hDlgNetInfo,25001,get_lang_str(LANG_NETINFO_DESTROY_CIRCUIT));
 			SetDlgItemTextL(hDlgNetInfo,25002,get_lang_str(LANG_NETINFO_NEW_CIRCUIT));
 		}
-		else
-		{	conn=(connection_t*)lParam;
-			if(conn->magic==EDGE_CONNECTION_MAGIC)
-			{	char *s=tor_malloc(32767);
-				show_connection_info(conn,s);
-				SetDlgItemTextL(hDlgNetInfo,25100,s);
-				tor_free(s);
-				selected_item=lParam;
-				selection_type=SELECTION_TYPE_STREAM;
-				selected_node=hItem;
-				SetDlgItemTextL(hDlgNetInfo,25001,get_lang_str(LANG_NETINFO_CLOSE_CONNECTION));
-				SetDlgItemTextL(hDlgNetInfo,25002,get_lang_str(LANG_NETINFO_KILL_PROCESS));
-			}
+		else if(((connection_t*)lParam)->magic==EDGE_CONNECTION_MAGIC)
+		{	tree_set_pending_sel(hItem,0);
+			selected_item=lParam;
+			selection_type=SELECTION_TYPE_STREAM;
+			selected_node=hItem;
+			SetDlgItemTextL(hDlgNetInfo,25001,get_lang_str(LANG_NETINFO_CLOSE_CONNECTION));
+			SetDlgItemTextL(hDlgNetInfo,25002,get_lang_str(LANG_NETINFO_KILL_PROCESS));
 		}
 	}
+	gui_snapshot_release(snap);
 }
 
-void add_all_conns(circuit_t *circ)
+/** Insert the tree nodes of the hops of <b>circ</b> that aren't in the tree yet. Called from the GUI thread by tree_apply_pending(). */
+static void tree_insert_hops(circuit_t *circ)
 {	if(!circ->hItem || circ->marked_for_close) return;
 	if(CIRCUIT_IS_ORIGIN(circ))
-	{	LangEnterCriticalSection();
-		origin_circuit_t *c=TO_ORIGIN_CIRCUIT(circ);
+	{	origin_circuit_t *c=TO_ORIGIN_CIRCUIT(circ);
 		crypt_path_t *hop=c->cpath;
 		uint32_t raddr;
 		char *nodename=tor_malloc(1024);
@@ -601,17 +666,16 @@ void add_all_conns(circuit_t *circ)
 			if(hop==c->cpath) break;
 		}
 		tor_free(nodename);
-		LangLeaveCriticalSection();
 	}
 }
 
 TV_INSERTSTRUCTW tvinsw;
-void add_all_streams(HTREEITEM hItem,edge_connection_t *streams)
+/** Insert the tree nodes of the <b>streams</b> that aren't in the tree yet under <b>hItem</b>. Called from the GUI thread by tree_apply_pending(). */
+static void tree_insert_streams(HTREEITEM hItem,edge_connection_t *streams)
 {	if(!hItem) return;
 	char *nodename=tor_malloc(2048),*s1;
-	LangEnterCriticalSection();
 	while(streams)
-	{	if(!streams->_base.marked_for_close)
+	{	if(!streams->_base.marked_for_close && !streams->_base.hItem)
 		{	uint32_t raddr=tor_addr_to_ipv4n(&streams->_base.addr);
 			nodename[0]=0;
 			if(streams->_base.hPlugin)	get_dll_name(nodename,streams->_base.hPlugin);
@@ -654,10 +718,6 @@ void add_all_streams(HTREEITEM hItem,edge_connection_t *streams)
 			tvinsw.item.iSelectedImage=0;
 			tvinsw.item.cChildren=0;
 			tvinsw.item.lParam=(LPARAM)streams;
-			if(streams->_base.hItem)
-			{	if(streams->_base.hItem==selected_node) selected_node=0;
-				SendDlgItemMessage(hDlgNetInfo,25500,TVM_DELETEITEM,0,(LPARAM)streams->_base.hItem);
-			}
 			int retries = 0;
 			while(retries < MAX_TV_INSERT_RETRIES)
 			{	LONG h = SendDlgItemMessageW(hDlgNetInfo,25500,TVM_INSERTITEMW,0,(LPARAM)&tvinsw);
@@ -671,123 +731,112 @@ void add_all_streams(HTREEITEM hItem,edge_connection_t *streams)
 			streams->_base.hItem=tvinsw.hInsertAfter;
 			tor_free(tvinsw.item.pszText);
 		}
-		else break;
 		streams=streams->next_stream;
 	}
 	tor_free(nodename);
-	LangLeaveCriticalSection();
 }
 
-void tree_add_streams(circuit_t *circ)
-{	if(!adding_circuits || circ->hItem==NULL) return;
+/** Return the text of the tree node of <b>circ</b> in a newly allocated string. */
+static char *tree_format_circ(circuit_t *circ)
+{	char *nodeName=tor_malloc(1024);
+	const char *magic=(circ->magic==ORIGIN_CIRCUIT_MAGIC)?"Origin":(circ->magic==OR_CIRCUIT_MAGIC)?"OR":"Unknown";
 	if(CIRCUIT_IS_ORIGIN(circ))
-	{	origin_circuit_t *c=TO_ORIGIN_CIRCUIT(circ);
-		if(c->p_streams)	add_all_streams(circ->hItem,c->p_streams);
-	}
-	else
-	{	or_circuit_t *c1=TO_OR_CIRCUIT(circ);
-		if(c1->n_streams)	add_all_streams(circ->hItem,c1->n_streams);
-		if(c1->resolving_streams) add_all_streams(circ->hItem,c1->resolving_streams);
-	}
+		tor_snprintf(nodeName,1023,"[%s][%s] %s_%d - %s",TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal?"Internal":"Exit",magic,circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
+	else	tor_snprintf(nodeName,1023,"[%s] %s_%d - %s",magic,circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
+	return nodeName;
 }
 
-void tree_add_circ(circuit_t *circ,char *nodename)
+/** Circuits whose tree nodes have changes that the GUI thread didn't apply yet, in the order the changes were posted. Protected by the language critical section. */
+static smartlist_t *tree_pending_circs=NULL;
+
+/** Post the <b>what</b> changes (TREE_PENDING_* flags) of <b>circ</b> to the GUI thread. If <b>label</b> is not NULL, it becomes the new cached text of the circuit's node. The Tor thread doesn't touch the tree view here, so it never waits for the GUI thread; tree_apply_pending() applies all posted changes at once. */
+static void tree_post(circuit_t *circ,int what,char *label)
 {	LangEnterCriticalSection();
-	tvins.item.mask=TVIF_PARAM|TVIF_TEXT;
-	tvins.hParent=TVI_ROOT;
-	tvins.hInsertAfter=TVI_LAST;
-	tvins.item.hItem=0;
-	tvins.item.state=0;
-	tvins.item.stateMask=0;
-	tvins.item.pszText=nodename;
-	tvins.item.cchTextMax=1024;
-	tvins.item.iImage=0;
-	tvins.item.iSelectedImage=0;
-	tvins.item.cChildren=0;
-	tvins.item.lParam=NODE_TYPE_CIRCUIT;
-	circ->hItem=tvins.hInsertAfter=insert_new_node(&tvins);
-	LangLeaveCriticalSection();
-	add_all_conns(circ);
-	if(CIRCUIT_IS_ORIGIN(circ))
-	{	origin_circuit_t *c=TO_ORIGIN_CIRCUIT(circ);
-		if(c->p_streams)	add_all_streams(circ->hItem,c->p_streams);
-		if(!c->build_state->is_internal && circ->state == CIRCUIT_STATE_OPEN)	setState(STATE_CONNECTED);
+	if(!tree_pending_circs)	tree_pending_circs=smartlist_create();
+	if(!circ->tree_pending)	smartlist_add(tree_pending_circs,circ);
+	circ->tree_pending |= what;
+	if(label)
+	{	tor_free(circ->tree_label);
+		circ->tree_label=label;
 	}
-	else
-	{	or_circuit_t *c1=TO_OR_CIRCUIT(circ);
-		if(c1->n_streams)	add_all_streams(circ->hItem,c1->n_streams);
-		if(c1->resolving_streams) add_all_streams(circ->hItem,c1->resolving_streams);
+	LangLeaveCriticalSection();
+}
+
+/** Apply the circuit changes that were posted since the last call. Called from the GUI thread when the network information page is refreshed. If the Tor thread is updating the tree right now, we try again on the next refresh instead of waiting for it, since it may be waiting for us. */
+static void tree_apply_pending(void)
+{	if(!tree_pending_circs || !smartlist_len(tree_pending_circs))	return;
+	if(!LangTryEnterCriticalSection())	return;
+	int bulk=smartlist_len(tree_pending_circs) > 8;
+	if(bulk)	SendDlgItemMessage(hDlgNetInfo,25500,WM_SETREDRAW,FALSE,0);
+	SMARTLIST_FOREACH(tree_pending_circs, circuit_t *, circ,
+	{	int what=circ->tree_pending;
+		circ->tree_pending=0;
+		if(!circ->hItem && (what & TREE_PENDING_ADD))
+		{	tvins.item.mask=TVIF_PARAM|TVIF_TEXT;
+			tvins.item.hItem=0;
+			tvins.item.state=0;
+			tvins.item.stateMask=0;
+			tvins.item.pszText=circ->tree_label;
+			tvins.item.cchTextMax=1024;
+			tvins.item.iImage=0;
+			tvins.item.iSelectedImage=0;
+			tvins.item.cChildren=0;
+			tvins.item.lParam=NODE_TYPE_CIRCUIT;
+			tvins.hParent=TVI_ROOT;
+			tvins.hInsertAfter=TVI_LAST;
+			circ->hItem=tvins.hInsertAfter=insert_new_node(&tvins);
+			what |= TREE_PENDING_HOPS|TREE_PENDING_STREAMS;
+		}
+		else if(circ->hItem && (what & TREE_PENDING_LABEL) && circ->tree_label)
+		{	tvit.mask=TVIF_TEXT;
+			tvit.hItem=circ->hItem;
+			tvit.pszText=circ->tree_label;
+			tvit.cchTextMax=1024;
+			SendDlgItemMessage(hDlgNetInfo,25500,TVM_SETITEM,0,(LPARAM)&tvit);
+		}
+		if(!circ->hItem)	continue;
+		if(what & TREE_PENDING_HOPS)	tree_insert_hops(circ);
+		if(what & TREE_PENDING_STREAMS)
+		{	if(CIRCUIT_IS_ORIGIN(circ))
+				tree_insert_streams(circ->hItem,TO_ORIGIN_CIRCUIT(circ)->p_streams);
+			else
+			{	or_circuit_t *c1=TO_OR_CIRCUIT(circ);
+				tree_insert_streams(circ->hItem,c1->n_streams);
+				tree_insert_streams(circ->hItem,c1->resolving_streams);
+			}
+		}
+	});
+	smartlist_clear(tree_pending_circs);
+	if(bulk)
+	{	SendDlgItemMessage(hDlgNetInfo,25500,WM_SETREDRAW,TRUE,0);
+		InvalidateRect(GetDlgItem(hDlgNetInfo,25500),NULL,TRUE);
 	}
+	LangLeaveCriticalSection();
+}
+
+void add_all_conns(circuit_t *circ)
+{	if(adding_circuits && !circ->marked_for_close)
+		tree_post(circ,TREE_PENDING_HOPS,NULL);
+}
+
+void tree_add_streams(circuit_t *circ)
+{	if(adding_circuits)
+		tree_post(circ,TREE_PENDING_STREAMS,NULL);
 }
 
 void tree_add_new_circ(circuit_t *circ)
-{	if(!adding_circuits)
-	{	if(CIRCUIT_IS_ORIGIN(circ) && !TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal && circ->state == CIRCUIT_STATE_OPEN)
-			setState(STATE_CONNECTED);
-		return;
-	}
+{	if(CIRCUIT_IS_ORIGIN(circ) && !TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal && circ->state == CIRCUIT_STATE_OPEN)
+		setState(STATE_CONNECTED);
+	if(!adding_circuits)	return;
 	if(circ->hItem)	tree_remove_circ(circ);
-	LangEnterCriticalSection();
-	char *nodeName=tor_malloc(1024);
-	tor_snprintf(nodeName,1023,"[%s] Circuit_%d - %s",circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
-	tvins.item.mask=TVIF_PARAM|TVIF_TEXT;
-	tvins.item.hItem=0;
-	tvins.item.state=0;
-	tvins.item.stateMask=0;
-	tvins.item.pszText=nodeName;
-	tvins.item.cchTextMax=1024;
-	tvins.item.iImage=0;
-	tvins.item.iSelectedImage=0;
-	tvins.item.cChildren=0;
-	tvins.item.lParam=NODE_TYPE_CIRCUIT;
-	tvins.hParent=TVI_ROOT;
-	tvins.hInsertAfter=TVI_LAST;
-	circ->hItem=tvins.hInsertAfter=insert_new_node(&tvins);
-	tor_free(nodeName);
-	LangLeaveCriticalSection();
-	add_all_conns(circ);
-	if(CIRCUIT_IS_ORIGIN(circ))
-	{	origin_circuit_t *c=TO_ORIGIN_CIRCUIT(circ);
-		if(c->p_streams)	add_all_streams(circ->hItem,c->p_streams);
-		if(!c->build_state->is_internal && circ->state == CIRCUIT_STATE_OPEN)	setState(STATE_CONNECTED);
-	}
-	else if(circ->magic==OR_CIRCUIT_MAGIC)
-	{	or_circuit_t *c=TO_OR_CIRCUIT(circ);
-		if(c->n_streams)	add_all_streams(circ->hItem,c->n_streams);
-		if(c->resolving_streams) add_all_streams(circ->hItem,c->resolving_streams);
-	}
+	tree_post(circ,TREE_PENDING_ADD,tree_format_circ(circ));
 }
 
 void tree_set_circ(circuit_t *circ)
-{	if(!adding_circuits || circ->hItem==NULL)
-	{	if(CIRCUIT_IS_ORIGIN(circ) && !TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal && circ->state == CIRCUIT_STATE_OPEN)
-			setState(STATE_CONNECTED);
-		return;
-	}
-	LangEnterCriticalSection();
-	char *nodeName=tor_malloc(1024);
-	if(CIRCUIT_IS_ORIGIN(circ))
-	{	if(TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal)
-			tor_snprintf(nodeName,1023,"[Internal][%s] %s_%d - %s",(circ->magic==ORIGIN_CIRCUIT_MAGIC)?"Origin":(circ->magic==OR_CIRCUIT_MAGIC)?"OR":"Unknown",circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
-		else
-		{	tor_snprintf(nodeName,1023,"[Exit][%s] %s_%d - %s",(circ->magic==ORIGIN_CIRCUIT_MAGIC)?"Origin":(circ->magic==OR_CIRCUIT_MAGIC)?"OR":"Unknown",circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
-			if(circ->state == CIRCUIT_STATE_OPEN)	setState(STATE_CONNECTED);
-		}
-	}
-	else	tor_snprintf(nodeName,1023,"[%s] %s_%d - %s",(circ->magic==ORIGIN_CIRCUIT_MAGIC)?"Origin":(circ->magic==OR_CIRCUIT_MAGIC)?"OR":"Unknown",circuit_purpose_to_string(circ->purpose),(unsigned int)circ->n_circ_id,circuit_state_to_string(circ->state));
-	tvit.mask=TVIF_TEXT;
-	tvit.hItem=circ->hItem;
-	tvit.state=0;
-	tvit.stateMask=0;
-	tvit.pszText=nodeName;
-	tvit.cchTextMax=1024;
-	tvit.iImage=0;
-	tvit.iSelectedImage=0;
-	tvit.cChildren=0;
-	tvit.lParam=NODE_TYPE_CIRCUIT;
-	SendDlgItemMessage(hDlgNetInfo,25500,TVM_SETITEM,0,(LPARAM)&tvit);
-	tor_free(nodeName);
-	LangLeaveCriticalSection();
+{	if(CIRCUIT_IS_ORIGIN(circ) && !TO_ORIGIN_CIRCUIT(circ)->build_state->is_internal && circ->state == CIRCUIT_STATE_OPEN)
+		setState(STATE_CONNECTED);
+	if(!adding_circuits || (circ->hItem==NULL && !circ->tree_pending))	return;
+	tree_post(circ,TREE_PENDING_LABEL,tree_format_circ(circ));
 }
 
 void tree_remove_stream(edge_connection_t *stream)
@@ -823,8 +872,22 @@ void tree_remove_streams(circuit_t *circ)
 	}
 }
 
+/** Remove <b>circ</b> from the tree, and forget its pending changes and cached strings. Also called by circuit_free(). */
 void tree_remove_circ(circuit_t *circ)
-{	if(adding_circuits && circ->hItem)
+{	LangEnterCriticalSection();
+	if(circ->tree_pending)
+	{	int i;
+		for(i=0;i<smartlist_len(tree_pending_circs);i++)
+		{	if(smartlist_get(tree_pending_circs,i)==circ)
+			{	smartlist_del_keeporder(tree_pending_circs,i);
+				break;
+			}
+		}
+		circ->tree_pending=0;
+	}
+	tor_free(circ->tree_label);
+	LangLeaveCriticalSection();
+	if(adding_circuits && circ->hItem)
 	{	tree_remove_streams(circ);
 		LangEnterCriticalSection();
 		if(circ->hItem==selected_node) selected_node=0;
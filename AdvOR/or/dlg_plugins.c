@@ -161,6 +161,7 @@ int __stdcall dlgPluginRights(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 				else tmp_plugin->rights &= PLUGIN_RIGHT__ALL_RIGHTS ^ PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER;
 				if(IsDlgButtonChecked(hDlg,407)==BST_CHECKED)	tmp_plugin->rights|=PLUGIN_RIGHT__CAN_INTERCEPT_PROCESSES;
 				else tmp_plugin->rights &= PLUGIN_RIGHT__ALL_RIGHTS ^ PLUGIN_RIGHT__CAN_INTERCEPT_PROCESSES;
+				plugins_traffic_changed();
 			}
 			EndDialog(hDlg,0);
 		}
@@ -43,20 +43,89 @@ lang_dlg_info lang_dlg_advanced_proxy[]={
 };
 
 BOOL is_banned(const char *_addr);
+void banlist_invalidate(void);
 void dlgProxy_banSocksAddress(char *socksAddress);
 void dlgProxy_banDebugAddress(char *strban);
 int __stdcall dlgProxy(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 int __stdcall dlgBannedAddresses(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 int __stdcall dlgAdvancedProxy(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 
+/** The BannedHosts list compiled for fast lookups by is_banned(). */
+typedef struct banlist_t {
+	strmap_t *hosts;	/**< Banned hosts and IPs, lowercased. */
+	strmap_t *domains;	/**< Domains banned with a "*." wildcard, lowercased, without the wildcard. */
+	ip_range_set_t *ranges;	/**< Banned "address/mask" ranges. */
+	const config_line_t *source;	/**< The list that we compiled. */
+	int generation;	/**< The value of <b>banlist_generation</b> when we compiled the list. */
+} banlist_t;
+
+static banlist_t banlist;
+/** Incremented by banlist_invalidate() every time BannedHosts changes. */
+static int banlist_generation = 0;
+
+/** Tell is_banned() that BannedHosts has changed and needs to be compiled again. */
+void banlist_invalidate(void)
+{	banlist_generation++;
+}
+
+static void banlist_free_contents(void)
+{	if(banlist.hosts)	strmap_free(banlist.hosts,NULL);
+	if(banlist.domains)	strmap_free(banlist.domains,NULL);
+	ip_range_set_free(banlist.ranges);
+	banlist.hosts = banlist.domains = NULL;
+	banlist.ranges = NULL;
+}
+
+/** Compile BannedHosts into <b>banlist</b>: exact hosts go into a hash set, "*.domain" entries into a set of domains that also matches their subdomains, and "address/mask" entries into a sorted set of IP ranges. */
+static void banlist_compile(void)
+{	config_line_t *cfg;
+	uint32_t addr;
+	maskbits_t bits;
+	uint16_t port_min,port_max;
+	banlist_free_contents();
+	banlist.hosts = strmap_new();
+	banlist.domains = strmap_new();
+	banlist.ranges = ip_range_set_new();
+	for(cfg = tmpOptions->BannedHosts;cfg;cfg = cfg->next)
+	{	const char *value = (const char *)cfg->value;
+		if(!value || !*value)	continue;
+		if(value[0] == '*' && value[1] == '.' && value[2])
+			strmap_set_lc(banlist.domains,value+2,(void *)1);
+		else if(strchr(value,'/') && !parse_addr_and_port_range(value,&addr,&bits,&port_min,&port_max))
+		{	if(bits > 32)	bits = 32;
+			addr &= bits ? (0xffffffffu << (32 - bits)) : 0;
+			ip_range_set_add(banlist.ranges,addr,bits ? (addr | (0xffffffffu >> bits)) : 0xffffffffu);
+		}
+		strmap_set_lc(banlist.hosts,value,(void *)1);
+	}
+	ip_range_set_compile(banlist.ranges);
+	banlist.source = tmpOptions->BannedHosts;
+	banlist.generation = banlist_generation;
+}
+
+/** Return true iff <b>_addr</b> is in the BannedHosts list: either listed as it is, or under a listed "*.domain", or, if it is an IPv4 address, in a listed "address/mask" range. */
 BOOL is_banned(const char *_addr)
-{	if(tmpOptions->BannedHosts)
-	{	config_line_t *cfg;
-		for(cfg=tmpOptions->BannedHosts;cfg;cfg=cfg->next)
-		{	if(!stricmp((char *)cfg->value,_addr)) return 1;
+{	BOOL result = 0;
+	struct in_addr in;
+	const char *p;
+	if(!tmpOptions->BannedHosts || !_addr)	return 0;
+	LangEnterCriticalSection();
+	if(banlist.source != tmpOptions->BannedHosts || banlist.generation != banlist_generation || !banlist.hosts)
+		banlist_compile();
+	if(strmap_get_lc(banlist.hosts,_addr))	result = 1;
+	else if(banlist.ranges->n_ranges && tor_inet_aton(_addr,&in))
+		result = ip_range_set_contains(banlist.ranges,ntohl(in.s_addr));
+	else if(!strmap_isempty(banlist.domains))
+	{	for(p = _addr;p;p = strchr(p,'.'))
+		{	if(*p == '.')	p++;
+			if(strmap_get_lc(banlist.domains,p))
+			{	result = 1;
+				break;
+			}
 		}
 	}
-	return 0;
+	LangLeaveCriticalSection();
+	return result;
 }
 
 
@@ -85,6 +154,7 @@ void dlgProxy_banSocksAddress(char *socksAddress)
 			cfg->key = (unsigned char *)tor_strdup("BannedHosts");
 			cfg->value = (unsigned char *)tor_strdup(socksAddress);
 		}
+		banlist_invalidate();
 		tor_snprintf(tmp,255,get_lang_str(LANG_MB_BAN_ADDED),&socksAddress[0]);
 		LangMessageBox(hMainDialog,tmp,LANG_LB_CONNECTIONS,MB_OK);
 		tor_free(tmp);
@@ -99,6 +169,7 @@ void dlgProxy_banSocksAddress(char *socksAddress)
 		*tmp2++=13;*tmp2++=10;*tmp2++=0;
 		SetDlgItemText(hDlgBannedAddresses,13105,tmp3);
 		getEditData(hDlgBannedAddresses,13105,&tmpOptions->BannedHosts,"BannedHosts");
+		banlist_invalidate();
 		tor_snprintf(tmp3,256,get_lang_str(LANG_MB_BAN_ADDED),&socksAddress[0]);
 		LangMessageBox(hMainDialog,tmp3,LANG_LB_CONNECTIONS,MB_OK);
 		tor_free(tmp3);
@@ -126,6 +197,7 @@ void dlgProxy_banDebugAddress(char *strban)
 				cfg->key = (unsigned char *)tor_strdup("BannedHosts");
 				cfg->value = (unsigned char *)tor_strdup(&strban[i]);
 			}
+			banlist_invalidate();
 		}
 		else
 		{	int tmpsize=SendDlgItemMessage(hDlgBannedAddresses,13105,WM_GETTEXTLENGTH,0,0);
@@ -138,6 +210,7 @@ void dlgProxy_banDebugAddress(char *strban)
 			*tmp2++=13;*tmp2++=10;*tmp2++=0;
 			SetDlgItemText(hDlgBannedAddresses,13105,tmp3);
 			getEditData(hDlgBannedAddresses,13105,&tmpOptions->BannedHosts,"BannedHosts");
+			banlist_invalidate();
 			tor_free(tmp3);
 		}
 	}
@@ -283,7 +356,9 @@ int __stdcall dlgBannedAddresses(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam
 			tor_free(tmp1);
 		}
 		else if((LOWORD(wParam)==13105)&&(HIWORD(wParam)==EN_CHANGE))
-			getEditData(hDlg,13105,&tmpOptions->BannedHosts,"BannedHosts");
+		{	getEditData(hDlg,13105,&tmpOptions->BannedHosts,"BannedHosts");
+			banlist_invalidate();
+		}
 		else if(LOWORD(wParam)==13401)
 		{	if(IsDlgButtonChecked(hDlg,13401)==BST_UNCHECKED)	tmpOptions->AllowTorHosts |= ALLOW_DOT_EXIT;
 			else						tmpOptions->AllowTorHosts &= ALLOW_DOT_EXIT ^ 0xffffffff;
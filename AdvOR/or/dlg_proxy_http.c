@@ -172,7 +172,9 @@ int __stdcall dlgProxyHTTP(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			else						tmpOptions->HTTPFlags &= HTTP_SETTING_LOG_RESPONSE_TRAFFIC ^ 0xffffffff;
 		}
 		else if((LOWORD(wParam)==16100)&&(HIWORD(wParam)==EN_CHANGE))
-			getEditData(hDlg,16100,&tmpOptions->BannedHeaders,"BannedHeaders");
+		{	getEditData(hDlg,16100,&tmpOptions->BannedHeaders,"BannedHeaders");
+			banned_headers_invalidate();
+		}
 		else if(!(lngFlag & LANGUAGE_FLAG_UPDATING_COMBOBOXES))
 		{	if(LOWORD(wParam)==16300 && HIWORD(wParam)==CBN_SELCHANGE)
 			{	int i = SendDlgItemMessage(hDlg,16300,CB_GETCURSEL,0,0);
@@ -19,6 +19,16 @@ const char *maxstr="\xff\xff\xff\xff\xff\xff\xff\xff";
 int lastSort=0,lastSel=0;
 uint32_t lastRouter=0;
 
+/** Exit routers in the order of the current sort column, for next_router_from_sorted_exits(). Sorted when first needed or when the sort column or country filter changes; routerlist.c keeps it up to date as routers come and go. */
+static smartlist_t *sorted_exits = NULL;
+static int sorted_exits_sort = 0, sorted_exits_country = 0;
+/** Index in sorted_exits of the last exit that we selected, or -1. */
+static int sorted_exits_pos = -1;
+
+/** The rows of the router list, as list parameters (see add_all_routers_to_list()). The list view is LVS_OWNERDATA: it only knows how many rows there are, and asks for the text of the rows that it shows. */
+static smartlist_t *list_rows = NULL;
+static int list_sel_type = SELECT_EXIT, list_country_sel = 0x200;
+
 lang_dlg_info lang_dlg_exit[]={
 	{10,LANG_EXIT_DLG_COUNTRY},
 	{401,LANG_EXIT_DLG_CLOSE_CONN},
@@ -49,9 +59,13 @@ void sort_all_items(void);
 void dlgIdentity_updateFlags(void);
 int dlgBypassBlacklists_isRecent(uint32_t addr,routerinfo_t *router,time_t now);
 int CALLBACK CompareFunc1(LPARAM lParam1,LPARAM lParam2,LPARAM lParamSort);
+static int compare_routers(routerinfo_t *r1,routerinfo_t *r2,int lastSort);
 int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
 void next_router_from_sorted_exits(void);
+void sorted_exits_add(routerinfo_t *router);
+void sorted_exits_remove(routerinfo_t *router);
+void sorted_exits_invalidate(void);
 
 
 int CALLBACK CompareFunc1(LPARAM lParam1,LPARAM lParam2,LPARAM lParamSort)
@@ -64,12 +78,17 @@ int CALLBACK CompareFunc1(LPARAM lParam1,LPARAM lParam2,LPARAM lParamSort)
 	}
 	else if(lParam2<0)	return -1;
 	routerinfo_t *r1,*r2;
-	int result=0;
 	r1=get_router(lParam1);
 	r2=get_router(lParam2);
 	if(!r1) r1=r2;
 	if(!r2) r2=r1;
 	if(!r1) return 0;
+	return compare_routers(r1,r2,lastSort);
+}
+
+/** Compare <b>r1</b> and <b>r2</b> by the list column <b>lastSort</b> (negative for descending order), then by router_id. */
+static int compare_routers(routerinfo_t *r1,routerinfo_t *r2,int lastSort)
+{	int result=0;
 	if((lastSort==2)||(lastSort==-2)||(lastSort==4)||(lastSort==-4))
 	{	if(lastSort==2)
 		{	if((r1->addr>>16) == (r2->addr>>16)) result = (r1->addr&0xffff) - (r2->addr&0xffff);
@@ -83,8 +102,8 @@ int CALLBACK CompareFunc1(LPARAM lParam1,LPARAM lParam2,LPARAM lParamSort)
 		else result = r2->bandwidthcapacity - r1->bandwidthcapacity;
 	}
 	else if((lastSort==1) || (lastSort==-1))
-	{	if(lastSort==1) result = strcmp(geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(r1->addr))&0xff),geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(r2->addr))&0xff));
-		else result = strcmp(geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(r2->addr))&0xff),geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(r1->addr))&0xff));
+	{	if(lastSort==1) result = strcmp(geoip_get_country_name(r1->country),geoip_get_country_name(r2->country));
+		else result = strcmp(geoip_get_country_name(r2->country),geoip_get_country_name(r1->country));
 	}
 	else if((lastSort==3) || (lastSort==-3))
 	{	if(lastSort==3) result = stricmp(r1->nickname,r2->nickname);
@@ -95,14 +114,198 @@ int CALLBACK CompareFunc1(LPARAM lParam1,LPARAM lParam2,LPARAM lParamSort)
 		else result = (r2->is_exit?2:0)+(r2->is_possible_guard?1:0)-(r1->is_exit?2:0)-(r1->is_possible_guard?1:0);
 	}
 	if(!result)
-	{	if(lastSort>0)	result = r1->router_id - r2->router_id;
-		else result = r2->router_id - r1->router_id;
+	{	if(lastSort>=0)	result = (r1->router_id > r2->router_id) - (r1->router_id < r2->router_id);
+		else result = (r2->router_id > r1->router_id) - (r2->router_id < r1->router_id);
 	}
 	return result;
 }
 
+static int compare_sorted_exits_(const void **a,const void **b)
+{	return compare_routers(*(routerinfo_t **)a,*(routerinfo_t **)b,sorted_exits_sort);
+}
+
+static int compare_router_to_sorted_exit_(const void *key,const void **member)
+{	return compare_routers((routerinfo_t *)key,*(routerinfo_t **)member,sorted_exits_sort);
+}
+
+static int sorted_exit_wanted(routerinfo_t *router)
+{	return router->is_exit && (sorted_exits_country==0x200 || router->country==sorted_exits_country);
+}
+
+/** Sort the exits of <b>rl</b> in country <b>csel</b> (0x200 for all) by the current sort column. */
+static void sorted_exits_rebuild(routerlist_t *rl,int csel)
+{	if(!sorted_exits)	sorted_exits = smartlist_create();
+	else	smartlist_clear(sorted_exits);
+	sorted_exits_sort = lastSort;
+	sorted_exits_country = csel;
+	sorted_exits_pos = -1;
+	SMARTLIST_FOREACH(rl->routers, routerinfo_t *, router,
+	{	if(sorted_exit_wanted(router))	smartlist_add(sorted_exits,router);
+	});
+	smartlist_sort(sorted_exits,compare_sorted_exits_);
+}
+
+/** Called when <b>router</b> was added to the routerlist or became an exit. */
+void sorted_exits_add(routerinfo_t *router)
+{	int idx,found;
+	if(!sorted_exits || !sorted_exit_wanted(router))	return;
+	idx = smartlist_bsearch_idx(sorted_exits,router,compare_router_to_sorted_exit_,&found);
+	if(found)	return;
+	smartlist_insert(sorted_exits,idx,router);
+	if(idx <= sorted_exits_pos)	sorted_exits_pos++;
+}
+
+/** Called when <b>router</b> is about to leave the routerlist or is no longer an exit. */
+void sorted_exits_remove(routerinfo_t *router)
+{	int idx,found;
+	if(!sorted_exits)	return;
+	idx = smartlist_bsearch_idx(sorted_exits,router,compare_router_to_sorted_exit_,&found);
+	if(!found || smartlist_get(sorted_exits,idx)!=router)
+	{	for(idx = 0;idx < smartlist_len(sorted_exits);idx++)
+			if(smartlist_get(sorted_exits,idx)==router)	break;
+		if(idx==smartlist_len(sorted_exits))	return;
+	}
+	smartlist_del_keeporder(sorted_exits,idx);
+	if(idx <= sorted_exits_pos)	sorted_exits_pos--;
+}
+
+/** Forget the sorted exits; called when router IDs or countries change under them. */
+void sorted_exits_invalidate(void)
+{	if(sorted_exits)
+	{	smartlist_free(sorted_exits);
+		sorted_exits = NULL;
+	}
+	sorted_exits_pos = -1;
+}
+
+/** Return the list parameter of row <b>iItem</b> of the router list, or <b>dflt</b> if there is no such row. */
+static LPARAM list_row_param(int iItem,LPARAM dflt)
+{	if(!list_rows || iItem < 0 || iItem >= smartlist_len(list_rows))	return dflt;
+	return (LPARAM)(intptr_t)smartlist_get(list_rows,iItem);
+}
+
+static int compare_list_rows_(const void **a,const void **b)
+{	return CompareFunc1((LPARAM)(intptr_t)*a,(LPARAM)(intptr_t)*b,lastSort);
+}
+
+/** Select row <b>iItem</b> of the router list, or nothing if it is -1. */
+static void list_select_row(int iItem)
+{	LV_ITEM lvst;
+	lvst.stateMask=LVIS_SELECTED|LVIS_FOCUSED;
+	lvst.state=0;
+	SendMessage(hListView,LVM_SETITEMSTATE,-1,(LPARAM)&lvst);
+	if(iItem>=0)
+	{	lvst.state=LVIS_SELECTED|LVIS_FOCUSED;
+		SendMessage(hListView,LVM_SETITEMSTATE,iItem,(LPARAM)&lvst);
+	}
+}
+
+/** Take a new snapshot of the routers for the router list, and show it. Only the rows that are visible get formatted, when the list view asks for them. */
+static void list_refresh(int selType,int csel)
+{	int sel;
+	if(!list_rows)	list_rows=smartlist_create();
+	list_sel_type=selType;
+	list_country_sel=csel;
+	sel=add_all_routers_to_list(list_rows,selType,csel);
+	SendMessage(hListView,LVM_SETITEMCOUNT,smartlist_len(list_rows),LVSICF_NOSCROLL);
+	list_select_row(sel);
+	InvalidateRect(hListView,NULL,FALSE);
+}
+
+/** Format column <b>subItem</b> of the router list row with list parameter <b>param</b> into the <b>len</b> byte buffer <b>buf</b>. */
+static void list_format_cell(LPARAM param,int subItem,char *buf,size_t len)
+{	routerinfo_t *router;
+	uint32_t raddr;
+	int country;
+	double bandwidthrate;
+	const char *unknown;
+	buf[0]=0;
+	if(param==0 || param==1)
+	{	static const char *special[2][4]={{NULL,"<< Random >>","<< Random router >>","*"},{"NONE","<< localhost >>","<< No exit >>","-"}};
+		if(subItem==0 && param==0)	strlcpy(buf,list_country_sel==0x200?"ANY":geoip_get_country_name(list_country_sel),len);
+		else if(subItem<4)	strlcpy(buf,special[param][subItem],len);
+		return;
+	}
+	router=get_router(param);
+	if(!router || router->router_id!=(uint32_t)(param<0?-param:param))	return;
+	raddr=geoip_reverse(router->addr);
+	switch(subItem)
+	{	case 0:
+			country=geoip_get_country_by_ip(raddr);
+			tor_snprintf(buf,len<4?len:4,"%s%s",geoip_get_country_name(country&0xff),country>0xff?"*":"");
+			break;
+		case 1:
+			tor_snprintf(buf,len,"%d.%d.%d.%d:%d",raddr&0xff,(raddr>>8)&0xff,(raddr>>16)&0xff,(raddr>>24)&0xff,router->or_port);
+			break;
+		case 2:
+			strlcpy(buf,router->nickname,len);
+			break;
+		case 3:
+			unknown=(router->is_running && router->is_valid && !router->is_bad_exit)?"":"[?] ";
+			if(param<0)	strlcpy(buf,bannedBW,len);
+			else if(router->bandwidthcapacity>1024)
+			{	bandwidthrate=(double)router->bandwidthcapacity/1024;
+				if(bandwidthrate>1024)
+				{	bandwidthrate/=1024;
+					if(bandwidthrate>1024)
+					{	bandwidthrate/=1024;
+						tor_snprintf(buf,len,"%s%.2f GB",unknown,bandwidthrate);
+					}
+					else tor_snprintf(buf,len,"%s%.2f MB",unknown,bandwidthrate);
+				}
+				else tor_snprintf(buf,len,"%s%.2f kB",unknown,bandwidthrate);
+			}
+			else tor_snprintf(buf,len,"%s%d B",unknown,router->bandwidthcapacity);
+			break;
+		case 4:
+			if(list_sel_type==SELECT_ANY)
+				tor_snprintf(buf,len,"%s%s",router->is_possible_guard?"E":"",router->is_exit?"X":"");
+			break;
+		default:
+			break;
+	}
+}
+
+/** Answer the list view's request for the text of a row of the router list. Return 1 if <b>hdr</b> was such a request. */
+static int list_get_dispinfo(NMHDR *hdr)
+{	char buf[256];
+	if(hdr->code==LVN_GETDISPINFOA)
+	{	NMLVDISPINFOA *di=(NMLVDISPINFOA *)hdr;
+		if(di->item.mask&LVIF_TEXT)
+		{	list_format_cell(list_row_param(di->item.iItem,-1),di->item.iSubItem,buf,sizeof(buf));
+			strlcpy(di->item.pszText,buf,di->item.cchTextMax);
+		}
+		return 1;
+	}
+	else if(hdr->code==LVN_GETDISPINFOW)
+	{	NMLVDISPINFOW *di=(NMLVDISPINFOW *)hdr;
+		if((di->item.mask&LVIF_TEXT) && di->item.cchTextMax>0)
+		{	list_format_cell(list_row_param(di->item.iItem,-1),di->item.iSubItem,buf,sizeof(buf));
+			if(!MultiByteToWideChar(CP_UTF8,0,buf,-1,di->item.pszText,di->item.cchTextMax))	di->item.pszText[0]=0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/** Mark the selected row of the router list as banned. */
+static void list_ban_row(int iItem)
+{	LPARAM param=list_row_param(iItem,0);
+	if(param>1)	smartlist_set(list_rows,iItem,(void *)(intptr_t)(-param));
+}
+
 void sort_all_items(void)
-{	if(lastSort)	SendMessage(hListView,LVM_SORTITEMS,lastSort,(LPARAM)(PFNLVCOMPARE)CompareFunc1);
+{	if(lastSort && list_rows)
+	{	LPARAM sel=list_row_param(SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED),-1);
+		smartlist_sort(list_rows,compare_list_rows_);
+		if(sel!=-1)
+		{	int i;
+			for(i=0;i<smartlist_len(list_rows);i++)
+				if(list_row_param(i,-1)==sel)	break;
+			list_select_row(i<smartlist_len(list_rows)?i:-1);
+		}
+		InvalidateRect(hListView,NULL,FALSE);
+	}
 	lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
 	if(lvit.iItem!=-1)
 	{	RECT rcItem;
@@ -149,7 +352,7 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		LangInsertColumn(hDlg,400,70,LANG_COLUMN_EXIT_4,3,LVCFMT_RIGHT);
 		hListView=GetDlgItem(hDlg,400);
 		routerlist_reindex();
-		add_all_routers_to_list(hDlg,SELECT_EXIT,last_country_sel);
+		list_refresh(SELECT_EXIT,last_country_sel);
 		if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DESTROY_CIRCUITS)	CheckDlgButton(hDlg,401,BST_CHECKED);
 		if(tmpOptions->IdentityFlags&IDENTITY_FLAG_EXPIRE_TRACKED_HOSTS)	CheckDlgButton(hDlg,402,BST_CHECKED);
 		if(tmpOptions->IdentityFlags&IDENTITY_FLAG_LIST_SELECTION)	CheckDlgButton(hDlg,403,BST_CHECKED);
@@ -163,10 +366,7 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		}
 		else if(LOWORD(wParam)==1)
 		{	lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=0;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,0);
 			if(lvit.lParam==0 && last_country_sel!=0x1ff)
 			{	set_country_sel(last_country_sel,1);
 				if(tmpOptions->IdentityFlags&IDENTITY_FLAG_LIST_SELECTION)
@@ -205,10 +405,7 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		else if(LOWORD(wParam)==3)
 		{	char *favtmp1=NULL;
 			lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam>=0) favtmp1=find_router_by_index(lvit.lParam);
 			if(lvit.lParam>=0 && favtmp1==NULL)
 			{	lvit.lParam=SendDlgItemMessage(hDlg,300,CB_GETITEMDATA,SendDlgItemMessage(hDlg,300,CB_GETCURSEL,0,0),0);
@@ -226,10 +423,7 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		else if(LOWORD(wParam)==4)
 		{	char *bantmp1=NULL,cBan=0;
 			lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam>=0) bantmp1=find_router_by_index(lvit.lParam);
 			if(lvit.lParam>=0 && bantmp1==NULL)
 			{	lvit.lParam=SendDlgItemMessage(hDlg,300,CB_GETITEMDATA,SendDlgItemMessage(hDlg,300,CB_GETCURSEL,0,0),0);
@@ -241,21 +435,8 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			}
 			if(bantmp1)
 			{	add_router_to_banlist(hDlg,bantmp1,'X');
-				if(cBan)
-				{	SendMessage(hListView,LVM_DELETEALLITEMS,0,0);
-					add_all_routers_to_list(hDlg,SELECT_EXIT,last_country_sel);
-				}
-				else
-				{	lvit.pszText=(char *)bannedBW;
-					lvit.cchTextMax=10;
-					lvit.mask=LVIF_TEXT;
-					lvit.iSubItem=3;
-					SendMessage(hListView,LVM_SETITEM,0,(LPARAM)&lvit);
-					lvit.mask=LVIF_PARAM;
-					lvit.lParam=0-lvit.lParam;
-					lvit.iSubItem=0;
-					SendMessage(hListView,LVM_SETITEM,0,(LPARAM)&lvit);
-				}
+				if(cBan)	list_refresh(SELECT_EXIT,last_country_sel);
+				else	list_ban_row(lvit.iItem);
 				sort_all_items();
 				tor_free(bantmp1);
 				EnableWindow(GetDlgItem(hDlg,1),0);EnableWindow(GetDlgItem(hDlg,3),0);EnableWindow(GetDlgItem(hDlg,4),0);
@@ -266,8 +447,7 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			cbErr=SendDlgItemMessage(hDlg,300,CB_GETITEMDATA,SendDlgItemMessage(hDlg,300,CB_GETCURSEL,0,0),0);
 			if(cbErr!=CB_ERR)
 			{	last_country_sel=cbErr;
-				SendMessage(hListView,LVM_DELETEALLITEMS,0,0);
-				add_all_routers_to_list(hDlg,SELECT_EXIT,last_country_sel);
+				list_refresh(SELECT_EXIT,last_country_sel);
 				sort_all_items();
 			}
 		}
@@ -288,13 +468,13 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		else if(LOWORD(wParam)==404)
 		{	if(IsDlgButtonChecked(hDlg,404)==BST_CHECKED)	tmpOptions->ExitSeenFlags |= EXIT_SEEN_FLAG_ENABLED;
 			else	tmpOptions->ExitSeenFlags &= 0xffff^EXIT_SEEN_FLAG_ENABLED;
-			SendMessage(hListView,LVM_DELETEALLITEMS,0,0);
-			add_all_routers_to_list(hDlg,SELECT_EXIT,last_country_sel);
+			list_refresh(SELECT_EXIT,last_country_sel);
 			sort_all_items();
 		}
 	}
 	else if(uMsg==WM_NOTIFY)
 	{	nmLV=(LPNMLISTVIEW)lParam;
+		if(list_get_dispinfo(&nmLV->hdr))	return 0;
 		if(nmLV->hdr.code==LVN_COLUMNCLICK)
 		{	if(((nmLV->iSubItem+1)==lastSort)||((nmLV->iSubItem+1)==-lastSort))	setLastSort(-lastSort);
 			else	setLastSort(nmLV->iSubItem+1);
@@ -302,10 +482,7 @@ int __stdcall dlgExitSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		}
 		else if((nmLV->hdr.code==LVN_ITEMCHANGED) && ((nmLV->uChanged&LVIF_STATE)!=0) && (nmLV->iItem!=-1) && (((nmLV->uNewState ^ nmLV->uOldState)&LVIS_SELECTED)!=0) && ((nmLV->uNewState & LVIS_SELECTED) != 0))
 		{	lvit.iItem=nmLV->iItem;
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam<0)
 			{	EnableWindow(GetDlgItem(hDlg,1),0);
 				EnableWindow(GetDlgItem(hDlg,3),0);
@@ -363,7 +540,7 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		}
 		hListView=GetDlgItem(hDlg,400);
 		routerlist_reindex();
-		add_all_routers_to_list(hDlg,lastSel,last_country_sel);
+		list_refresh(lastSel,last_country_sel);
 		sort_all_items();SetFocus(hListView);
 	}
 	else if(uMsg==WM_COMMAND)
@@ -371,10 +548,7 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			EndDialog(hDlg,-1);
 		else if(LOWORD(wParam)==1)
 		{	lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam==0)
 			{	lvit.lParam=get_random_router_index(lastSel,last_country_sel);
 			}
@@ -383,10 +557,7 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		else if(LOWORD(wParam)==3)
 		{	char *favtmp1=NULL;
 			lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam>=0) favtmp1=find_router_by_index(lvit.lParam);
 			if(lvit.lParam>=0 && favtmp1==NULL)
 			{	lvit.lParam=SendDlgItemMessage(hDlg,300,CB_GETITEMDATA,SendDlgItemMessage(hDlg,300,CB_GETCURSEL,0,0),0);
@@ -404,10 +575,7 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		else if(LOWORD(wParam)==4)
 		{	char *bantmp1=NULL,cBan=0;
 			lvit.iItem=SendMessage(hListView,LVM_GETNEXTITEM,-1,LVNI_SELECTED);
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam>=0) bantmp1=find_router_by_index(lvit.lParam);
 			if(lvit.lParam>=0 && bantmp1==NULL)
 			{	lvit.lParam=SendDlgItemMessage(hDlg,300,CB_GETITEMDATA,SendDlgItemMessage(hDlg,300,CB_GETCURSEL,0,0),0);
@@ -419,21 +587,8 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 			}
 			if(bantmp1)
 			{	add_router_to_banlist(hDlg,bantmp1,(lastSel==SELECT_EXIT)?'X':0);
-				if(cBan)
-				{	SendMessage(hListView,LVM_DELETEALLITEMS,0,0);
-					add_all_routers_to_list(hDlg,lastSel,last_country_sel);
-				}
-				else
-				{	lvit.pszText=(char *)bannedBW;
-					lvit.cchTextMax=10;
-					lvit.mask=LVIF_TEXT;
-					lvit.iSubItem=3;
-					SendMessage(hListView,LVM_SETITEM,0,(LPARAM)&lvit);
-					lvit.mask=LVIF_PARAM;
-					lvit.lParam=0-lvit.lParam;
-					lvit.iSubItem=0;
-					SendMessage(hListView,LVM_SETITEM,0,(LPARAM)&lvit);
-				}
+				if(cBan)	list_refresh(lastSel,last_country_sel);
+				else	list_ban_row(lvit.iItem);
 				sort_all_items();
 				tor_free(bantmp1);
 				EnableWindow(GetDlgItem(hDlg,1),0);EnableWindow(GetDlgItem(hDlg,3),0);EnableWindow(GetDlgItem(hDlg,4),0);
@@ -443,13 +598,13 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		{	int cbErr;
 			cbErr=SendDlgItemMessage(hDlg,300,CB_GETITEMDATA,SendDlgItemMessage(hDlg,300,CB_GETCURSEL,0,0),0);
 			if(cbErr!=CB_ERR) last_country_sel=cbErr;
-			SendMessage(hListView,LVM_DELETEALLITEMS,0,0);
-			add_all_routers_to_list(hDlg,lastSel,last_country_sel);
+			list_refresh(lastSel,last_country_sel);
 			sort_all_items();
 		}
 	}
 	else if(uMsg==WM_NOTIFY)
 	{	nmLV=(LPNMLISTVIEW)lParam;
+		if(list_get_dispinfo(&nmLV->hdr))	return 0;
 		if(nmLV->hdr.code==LVN_COLUMNCLICK)
 		{	if(((nmLV->iSubItem+1)==lastSort)||((nmLV->iSubItem+1)==-lastSort))	setLastSort(-lastSort);
 			else	setLastSort(nmLV->iSubItem+1);
@@ -457,10 +612,7 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 		}
 		else if((nmLV->hdr.code==LVN_ITEMCHANGED) && ((nmLV->uChanged&LVIF_STATE)!=0) && (nmLV->iItem!=-1) && (((nmLV->uNewState ^ nmLV->uOldState)&LVIS_SELECTED)!=0) && ((nmLV->uNewState & LVIS_SELECTED) != 0))
 		{	lvit.iItem=nmLV->iItem;
-			lvit.mask=LVIF_PARAM;
-			lvit.iSubItem=0;
-			lvit.lParam=-1;
-			SendMessage(hListView,LVM_GETITEM,0,(LPARAM)&lvit);
+			lvit.lParam=list_row_param(lvit.iItem,-1);
 			if(lvit.lParam<0)
 			{	EnableWindow(GetDlgItem(hDlg,1),0);
 				EnableWindow(GetDlgItem(hDlg,3),0);
@@ -477,243 +629,39 @@ int __stdcall dlgRouterSelect(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam)
 }
 
 void next_router_from_sorted_exits(void)
-{	routerlist_t *rl;
-	int retries = 0;
-	routerinfo_t *prev,*prev2;
-	smartlist_t *sl;
-	time_t now = get_time(NULL);;
-	unsigned int i,min,min2;
-	int r;
-	unsigned long l,minl;
-	char *rstr,*minstr;
+{	routerlist_t *rl = router_get_routerlist();
+	int retries = 0, n, found;
+	int csel = get_country_sel();
+	routerinfo_t *prev, *router = NULL;
+	time_t now = get_time(NULL);
+	if(!rl) return;
+	if(!sorted_exits || sorted_exits_sort != lastSort || sorted_exits_country != csel)
+		sorted_exits_rebuild(rl,csel);
+	n = smartlist_len(sorted_exits);
 	lastRouter = get_router_id_sel();
-	prev = get_router_by_index(lastRouter);
-	if(!prev)
-	{	if(get_router_sel())	prev = get_router_by_ip(get_router_sel());
-		else	prev = get_router_by_index(get_random_router_index(SELECT_EXIT,get_country_sel()));
-	}
-	if(prev) lastRouter = prev->router_id;
-	while(1)
-	{	rl = router_get_routerlist();
-		if(!rl) return;
-		sl = rl->routers;
-		int csel=get_country_sel();
-		prev2 = prev = get_router_by_index(lastRouter);
-		i=0;min=0;min2=0;
-		if(prev) i = prev->router_id;
-		min = i;
-		switch(lastSort)
-		{	case 0:
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	if(((router->router_id <=min) || (i==min)) && router->router_id > i)
-						{	prev = router;
-							min = router->router_id;
-						}
-					}
-				});
-				break;
-			case 1:		//country,asc
-				if(prev) rstr = (char*)geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(prev->addr))&0xff);
-				else rstr = (char*)geoip_get_country_name(0);
-				minstr = rstr;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	r = strcmp(rstr,geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff));
-						if(r==0)
-						{	if(((router->router_id <=min) || (i==min)) && router->router_id > i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(r<0)
-						{	if((strcmp(geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff),minstr) <= 0) || !strcmp(minstr,rstr))
-							{	prev2 = router;
-								minstr=(char*)geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff);
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case -1:	//country,desc
-				if(prev) rstr = (char*)geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(prev->addr))&0xff);
-				else rstr = (char *)maxstr;
-				minstr = rstr;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	r = strcmp(rstr,geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff));
-						if(r==0)
-						{	if(((router->router_id >=min) || (i==min)) && router->router_id < i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(r>0)
-						{	if((strcmp(geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff),minstr) >= 0) || !strcmp(minstr,rstr))
-							{	prev2 = router;
-								minstr=(char*)geoip_get_country_name(geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff);
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case 2:		//IP,asc
-				if(prev) l = prev->addr;
-				else l = 0;
-				minl = l;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	if(l==router->addr)
-						{	if(((router->router_id <=min) || (i==min)) && router->router_id > i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(l < (unsigned long)router->addr)
-						{	if(((unsigned long)router->addr <= minl) || (l==minl))
-							{	prev2 = router;
-								minl = router->addr;
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case -2:	//IP,desc
-				if(prev) l = prev->addr;
-				else l = 0xffffffff;
-				minl = l;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	if(l==router->addr)
-						{	if(((router->router_id >=min) || (i==min)) && router->router_id < i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(l > (unsigned long)router->addr)
-						{	if(((unsigned long)router->addr >= minl) || (l==minl))
-							{	prev2 = router;
-								minl = router->addr;
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case 3:		//nickname,asc
-				if(prev) rstr = prev->nickname;
-				else rstr = (char *)nostr;
-				minstr = rstr;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	r = strcasecmp(rstr,router->nickname);
-						if(r==0)
-						{	if(((router->router_id <=min) || (i==min)) && router->router_id > i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(r<0)
-						{	if((strcasecmp(router->nickname,minstr) <= 0) || !strcasecmp(rstr,minstr))
-							{	prev2 = router;
-								minstr=router->nickname;
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case -3:	//nickname,desc
-				if(prev) rstr = prev->nickname;
-				else rstr = (char *)maxstr;
-				minstr = rstr;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	r = strcasecmp(rstr,router->nickname);
-						if(r==0)
-						{	if(((router->router_id >=min) || (i==min)) && router->router_id < i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(r>0)
-						{	if((strcasecmp(router->nickname,minstr) >= 0) || !strcasecmp(rstr,minstr))
-							{	prev2 = router;
-								minstr=router->nickname;
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case 4:		//bandwidth,asc
-				if(prev) l = prev->bandwidthcapacity;
-				else l = 0;
-				minl = l;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	if(l==router->bandwidthcapacity)
-						{	if(((router->router_id <=min) || (i==min)) && router->router_id > i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(l<router->bandwidthcapacity)
-						{	if((router->bandwidthcapacity <= minl) || (l==minl))
-							{	prev2 = router;
-								minl = router->bandwidthcapacity;
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			case -4:	//bandwidth,desc
-				if(prev) l = prev->bandwidthcapacity;
-				else l = 0xffffffff;
-				minl = l;
-				SMARTLIST_FOREACH(sl,routerinfo_t *, router,
-				{	if(router->is_exit &&(csel==0x200 || (geoip_get_country_by_ip(geoip_reverse(router->addr))&0xff)==csel))
-					{	if(l==router->bandwidthcapacity)
-						{	if(((router->router_id >=min) || (i==min)) && router->router_id < i)
-							{	prev = router;
-								min = router->router_id;
-							}
-						}
-						else if(l>router->bandwidthcapacity)
-						{	if((router->bandwidthcapacity >= minl)||(l==minl))
-							{	prev2 = router;
-								minl = router->bandwidthcapacity;
-								min2 = router->router_id;
-							}
-						}
-					}
-				});
-				break;
-			default:
-				break;
+	/* the cursor normally still points at the exit we selected last time */
+	if(sorted_exits_pos < 0 || sorted_exits_pos >= n || ((routerinfo_t *)smartlist_get(sorted_exits,sorted_exits_pos))->router_id != lastRouter)
+	{	prev = get_router_by_index(lastRouter);
+		if(!prev)
+		{	if(get_router_sel())	prev = get_router_by_ip(get_router_sel());
+			else	prev = get_router_by_index(get_random_router_index(SELECT_EXIT,csel));
 		}
-		if(min==i)
-		{	min=min2;
-			prev=prev2;
+		sorted_exits_pos = -1;
+		if(prev)
+		{	sorted_exits_pos = smartlist_bsearch_idx(sorted_exits,prev,compare_router_to_sorted_exit_,&found);
+			if(!found)	sorted_exits_pos--;	/* continue with the first exit that sorts after prev */
 		}
-		lastRouter = min;
-		if(prev && ((tmpOptions->_ExcludeExitNodesUnion && (routerset_contains_router(tmpOptions->_ExcludeExitNodesUnion,prev))) || (!prev->is_running) || (prev->is_bad_exit) || (!(prev->is_valid)) || (tmpOptions->CircuitBandwidthRate && (prev->bandwidthcapacity < tmpOptions->CircuitBandwidthRate))))
-		{	if(++retries >= MAX_ROUTERSELECT_RETRIES)
-			{	lastRouter = min = 0;
-				break;
-			}
-		}
-		if(tmpOptions->ExitSeenFlags & EXIT_SEEN_FLAG_ENABLED && !dlgBypassBlacklists_isRecent(geoip_reverse(prev->addr),prev,now))
-		{	if(++retries >= MAX_ROUTERSELECT_RETRIES)
-			{	lastRouter = min = 0;
+	}
+	while(n)
+	{	if(++sorted_exits_pos >= n)	sorted_exits_pos = 0;
+		router = smartlist_get(sorted_exits,sorted_exits_pos);
+		if((tmpOptions->_ExcludeExitNodesUnion && (routerset_contains_router(tmpOptions->_ExcludeExitNodesUnion,router))) || (!router->is_running) || (router->is_bad_exit) || (!(router->is_valid)) || (tmpOptions->CircuitBandwidthRate && (router->bandwidthcapacity < tmpOptions->CircuitBandwidthRate)) || (tmpOptions->ExitSeenFlags & EXIT_SEEN_FLAG_ENABLED && !dlgBypassBlacklists_isRecent(geoip_reverse(router->addr),router,now)))
+		{	router = NULL;
+			if(++retries >= MAX_ROUTERSELECT_RETRIES || retries >= n)
 				break;
-			}
 		}
 		else break;
 	}
-	set_router_id_sel(min,0);
+	lastRouter = router ? router->router_id : 0;
+	set_router_id_sel(lastRouter,0);
 }
@@ -0,0 +1,285 @@
+#include "or.h"
+#include "circuitbuild.h"
+#include "circuitlist.h"
+#include "main.h"
+#include "routerlist.h"
+#include "dlg_snapshot.h"
+
+/* The dialogs run in the GUI thread, while connections, circuits and routers belong to the Tor thread. Once per second the Tor thread copies what the network information page shows to a gui_snapshot_t and publishes it; the GUI thread only reads published snapshots, and does all the formatting, sorting and geoip lookups itself. There are normally two snapshots: the published one, and a spare one that the next update fills, so their buffers are reused. */
+
+/** Bandwidth history of the last GUI_BW_HISTORY seconds. Only the Tor thread touches it. */
+static uint32_t stats_bw_read[GUI_BW_HISTORY];
+static uint32_t stats_bw_written[GUI_BW_HISTORY];
+static uint64_t totals_read=0,totals_written=0;
+static uint32_t last_max=1,last_max_128=1;
+static int stats_idx=0;
+
+/** Protects published_snapshot, spare_snapshot, last_acquired and the reference counts. It is only held while a few pointers are copied, so neither thread waits for the other. */
+static tor_mutex_t *snapshot_mutex=NULL;
+/** The most recent snapshot, or NULL. It holds one reference. */
+static gui_snapshot_t *published_snapshot=NULL;
+/** A snapshot that nobody uses anymore, kept for the next update. */
+static gui_snapshot_t *spare_snapshot=NULL;
+/** When the GUI thread last asked for a snapshot. */
+static time_t last_acquired=0;
+
+void dlgStatsRWInit(void)
+{	int i;
+	for(i=0;i<GUI_BW_HISTORY;i++)	stats_bw_read[i]=stats_bw_written[i]=0;
+	if(!snapshot_mutex)	snapshot_mutex=tor_mutex_new();
+}
+
+void dlgUpdateRWStats(int seconds,uint32_t bw_read,uint32_t bw_written)
+{	totals_read += bw_read;
+	totals_written += bw_written;
+	if(stats_idx==0)
+	{	last_max=last_max_128;
+		last_max_128=1;
+	}
+	if(bw_read>last_max || bw_written>last_max) last_max=bw_read>bw_written?bw_read:bw_written;
+	if(bw_read>last_max_128 || bw_written>last_max_128) last_max_128=bw_read>bw_written?bw_read:bw_written;
+	if(seconds>1)
+	{	bw_read /= seconds;
+		bw_written /= seconds;
+	}
+	stats_bw_read[stats_idx]=bw_read;
+	stats_bw_written[stats_idx]=bw_written;
+	stats_idx++;
+	stats_idx &= GUI_BW_HISTORY-1;
+}
+
+/** Copy <b>s</b> to the string arena of <b>snap</b> and return its offset, or 0 if <b>s</b> is NULL. */
+static uint32_t snapshot_add_string(gui_snapshot_t *snap,const char *s)
+{	size_t len;
+	uint32_t off;
+	if(!s)	return 0;
+	len=strlen(s)+1;
+	if(snap->strings_len+len > snap->strings_size)
+	{	while(snap->strings_len+len > snap->strings_size)
+			snap->strings_size=snap->strings_size?snap->strings_size*2:4096;
+		snap->strings=tor_realloc(snap->strings,snap->strings_size);
+	}
+	off=(uint32_t)snap->strings_len;
+	memcpy(snap->strings+off,s,len);
+	snap->strings_len += len;
+	return off;
+}
+
+/** Make room for one more element in the array <b>*arr</b> of <b>*n</b> elements of <b>elt_size</b> bytes that has room for <b>*size</b> elements, and return a pointer to the new, zeroed element. */
+static void *snapshot_add_elt(void **arr,int *n,int *size,size_t elt_size)
+{	char *elt;
+	if(*n >= *size)
+	{	*size=*size?*size*2:64;
+		*arr=tor_realloc(*arr,*size*elt_size);
+	}
+	elt=(char *)*arr + (*n)++ * elt_size;
+	memset(elt,0,elt_size);
+	return elt;
+}
+
+/** Copy all circuits and their hops to <b>snap</b>. */
+static void snapshot_add_circuits(gui_snapshot_t *snap)
+{	circuit_t *circ;
+	for(circ=_circuit_get_global_list();circ;circ=circ->next)
+	{	gui_circ_t *c=snapshot_add_elt((void **)&snap->circs,&snap->n_circs,&snap->circs_size,sizeof(gui_circ_t));
+		c->hItem=circ->hItem;
+		c->n_circ_id=circ->n_circ_id;
+		c->purpose=circ->purpose;
+		c->state=circ->state;
+		c->marked_for_close=circ->marked_for_close?1:0;
+		c->created=(time_t)circ->timestamp_created.tv_sec;
+		c->exclKey=circ->exclKey;
+		c->first_hop=snap->n_hops;
+		c->cell_wait=circ->cell_wait;
+		if(CIRCUIT_IS_ORIGIN(circ))
+		{	origin_circuit_t *ocirc=TO_ORIGIN_CIRCUIT(circ);
+			crypt_path_t *hop=ocirc->cpath;
+			c->is_origin=1;
+			if(ocirc->build_state)
+			{	c->is_internal=ocirc->build_state->is_internal;
+				c->need_uptime=ocirc->build_state->need_uptime;
+				c->desired_path_len=ocirc->build_state->desired_path_len;
+				c->exit_nickname=snapshot_add_string(snap,build_state_get_exit_nickname(ocirc->build_state));
+			}
+			while(hop && hop->extend_info)
+			{	routerinfo_t *ri=router_get_by_digest(hop->extend_info->identity_digest);
+				gui_hop_t *h=snapshot_add_elt((void **)&snap->hops,&snap->n_hops,&snap->hops_size,sizeof(gui_hop_t));
+				memcpy(h->identity_digest,hop->extend_info->identity_digest,DIGEST_LEN);
+				strlcpy(h->nickname,hop->extend_info->nickname,sizeof(h->nickname));
+				h->addr=ri?ri->addr:0;
+				h->state=hop->state;
+				h->is_named=(ri && ri->is_named)?1:0;
+				c->n_hops++;
+				hop=hop->next;
+				if(hop==ocirc->cpath)	break;
+			}
+		}
+	}
+}
+
+/** Copy all connections to <b>snap</b>. */
+static void snapshot_add_conns(gui_snapshot_t *snap)
+{	smartlist_t *conns=get_connection_array();
+	SMARTLIST_FOREACH(conns, connection_t *, conn,
+	{	gui_conn_t *c=snapshot_add_elt((void **)&snap->conns,&snap->n_conns,&snap->conns_size,sizeof(gui_conn_t));
+		c->magic=conn->magic;
+		c->type=conn->type;
+		c->state=conn->state;
+		c->purpose=conn->purpose;
+		c->created=conn->timestamp_created;
+		c->lastread=conn->timestamp_lastread;
+		c->lastwritten=conn->timestamp_lastwritten;
+		c->address=snapshot_add_string(snap,conn->address);
+		c->addr=tor_addr_to_ipv4n(&conn->addr);
+		c->port=conn->port;
+		c->exclKey=conn->exclKey;
+		c->pid=conn->pid;
+		c->hPlugin=conn->hPlugin;
+		c->hItem=conn->hItem;
+		if(conn->type==CONN_TYPE_OR || conn->magic==OR_CONNECTION_MAGIC)
+		{	or_connection_t *or_conn=TO_OR_CONN(conn);
+			c->client_used=or_conn->client_used;
+			c->real_addr=tor_addr_to_ipv4n(&or_conn->real_addr);
+			c->bandwidthrate=or_conn->bandwidthrate;
+			c->bandwidthburst=or_conn->bandwidthburst;
+			c->is_bad_for_new_circs=or_conn->is_bad_for_new_circs;
+			c->cell_wait=or_conn->cell_wait;
+		}
+		else if(conn->type==CONN_TYPE_AP || conn->type==CONN_TYPE_EXIT || conn->magic==EDGE_CONNECTION_MAGIC)
+		{	edge_connection_t *edge_conn=TO_EDGE_CONN(conn);
+			c->chosen_exit_name=snapshot_add_string(snap,edge_conn->chosen_exit_name);
+			if(edge_conn->socks_request)
+			{	c->has_socks_request=1;
+				c->socks_original_address=snapshot_add_string(snap,edge_conn->socks_request->original_address);
+				c->socks_address=snapshot_add_string(snap,edge_conn->socks_request->address);
+				c->socks_port=edge_conn->socks_request->port;
+				c->socks_command=edge_conn->socks_request->command;
+			}
+			c->n_read=edge_conn->n_read;
+			c->n_written=edge_conn->n_written;
+			c->want_onehop=edge_conn->want_onehop;
+			c->chosen_exit_optional=edge_conn->chosen_exit_optional;
+			c->chosen_exit_retries=edge_conn->chosen_exit_retries;
+		}
+		else if(conn->type==CONN_TYPE_DIR || conn->magic==DIR_CONNECTION_MAGIC)
+		{	dir_connection_t *dir_conn=TO_DIR_CONN(conn);
+			c->requested_resource=snapshot_add_string(snap,dir_conn->requested_resource);
+			c->dirconn_direct=dir_conn->dirconn_direct;
+			c->router_purpose=dir_conn->router_purpose;
+		}
+	});
+}
+
+static void snapshot_free(gui_snapshot_t *snap)
+{	tor_free(snap->circs);
+	tor_free(snap->hops);
+	tor_free(snap->conns);
+	tor_free(snap->strings);
+	tor_free(snap);
+}
+
+/** Make a new snapshot and publish it. Called by the Tor thread once per second, after dlgUpdateRWStats(). */
+void gui_snapshot_update(void)
+{	gui_snapshot_t *snap,*old;
+	time_t now=get_time(NULL);
+	int i,j,details;
+	if(!snapshot_mutex)	return;
+	tor_mutex_acquire(snapshot_mutex);
+	snap=spare_snapshot;
+	spare_snapshot=NULL;
+	details=last_acquired && now < last_acquired+GUI_SNAPSHOT_IDLE_TIMEOUT;
+	tor_mutex_release(snapshot_mutex);
+
+	if(!snap)	snap=tor_malloc_zero(sizeof(gui_snapshot_t));
+	snap->taken=now;
+	snap->n_circs=snap->n_hops=snap->n_conns=0;
+	snap->strings_len=0;
+	snapshot_add_string(snap,"");
+	for(i=0,j=stats_idx;i<GUI_BW_HISTORY;i++,j=(j+1)&(GUI_BW_HISTORY-1))
+	{	snap->bw_read[i]=stats_bw_read[j];
+		snap->bw_written[i]=stats_bw_written[j];
+	}
+	snap->bw_max=last_max;
+	snap->total_read=totals_read;
+	snap->total_written=totals_written;
+	snap->has_details=details;
+	if(details)
+	{	snapshot_add_circuits(snap);
+		snapshot_add_conns(snap);
+	}
+	snap->refcnt=1;
+
+	tor_mutex_acquire(snapshot_mutex);
+	old=published_snapshot;
+	published_snapshot=snap;
+	tor_mutex_release(snapshot_mutex);
+	if(old)	gui_snapshot_release(old);
+}
+
+/** Return a reference to the most recent snapshot, or NULL if there is none yet. The caller must give it back with gui_snapshot_release(). */
+gui_snapshot_t *gui_snapshot_acquire(void)
+{	gui_snapshot_t *snap;
+	if(!snapshot_mutex)	return NULL;
+	tor_mutex_acquire(snapshot_mutex);
+	snap=published_snapshot;
+	if(snap)	snap->refcnt++;
+	last_acquired=get_time(NULL);
+	tor_mutex_release(snapshot_mutex);
+	return snap;
+}
+
+/** Drop a reference to <b>snap</b>. The last reference makes it the spare snapshot, or frees it if we already have one. */
+void gui_snapshot_release(gui_snapshot_t *snap)
+{	if(!snap)	return;
+	tor_mutex_acquire(snapshot_mutex);
+	if(--snap->refcnt==0 && !spare_snapshot)
+	{	spare_snapshot=snap;
+		snap=NULL;
+	}
+	else if(snap->refcnt)	snap=NULL;
+	tor_mutex_release(snapshot_mutex);
+	if(snap)	snapshot_free(snap);
+}
+
+/** Free the published and the spare snapshots. Snapshots that the GUI thread still uses are freed when it releases them. */
+void gui_snapshot_free_all(void)
+{	gui_snapshot_t *old;
+	if(!snapshot_mutex)	return;
+	tor_mutex_acquire(snapshot_mutex);
+	old=published_snapshot;
+	published_snapshot=NULL;
+	tor_mutex_release(snapshot_mutex);
+	if(old)	gui_snapshot_release(old);
+	tor_mutex_acquire(snapshot_mutex);
+	old=spare_snapshot;
+	spare_snapshot=NULL;
+	tor_mutex_release(snapshot_mutex);
+	if(old)	snapshot_free(old);
+}
+
+/** Return the circuit of <b>snap</b> that has the tree node <b>hItem</b>, or NULL. */
+const gui_circ_t *gui_snapshot_get_circ(const gui_snapshot_t *snap,HTREEITEM hItem)
+{	int i;
+	if(!snap || !hItem)	return NULL;
+	for(i=0;i<snap->n_circs;i++)
+		if(snap->circs[i].hItem==hItem)	return &snap->circs[i];
+	return NULL;
+}
+
+/** Return the stream of <b>snap</b> that has the tree node <b>hItem</b>, or NULL. */
+const gui_conn_t *gui_snapshot_get_stream(const gui_snapshot_t *snap,HTREEITEM hItem)
+{	int i;
+	if(!snap || !hItem)	return NULL;
+	for(i=0;i<snap->n_conns;i++)
+		if(snap->conns[i].hItem==hItem && snap->conns[i].magic==EDGE_CONNECTION_MAGIC)	return &snap->conns[i];
+	return NULL;
+}
+
+/** Return the first connection of <b>snap</b> after <b>after</b> (or the first one, if <b>after</b> is NULL) to <b>ip</b>:<b>port</b>, or NULL. */
+const gui_conn_t *gui_snapshot_get_conn_by_addr(const gui_snapshot_t *snap,uint32_t ip,int port,const gui_conn_t *after)
+{	int i;
+	if(!snap)	return NULL;
+	for(i=after?(int)(after-snap->conns)+1:0;i<snap->n_conns;i++)
+		if(snap->conns[i].addr==ip && snap->conns[i].port==port)	return &snap->conns[i];
+	return NULL;
+}
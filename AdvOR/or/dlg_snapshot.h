@@ -0,0 +1,109 @@
+#ifndef __DLG_SNAPSHOT__
+#define __DLG_SNAPSHOT__ 1
+
+/** How many seconds of bandwidth history the graph shows. */
+#define GUI_BW_HISTORY 128
+/** Stop copying circuits and connections when the GUI thread didn't ask for a snapshot for this many seconds. */
+#define GUI_SNAPSHOT_IDLE_TIMEOUT 5
+
+/** Return the string at offset <b>off</b> in the string arena of <b>snap</b>, or NULL if <b>off</b> is 0. */
+#define GUI_SNAPSHOT_STR(snap,off) ((off) ? (snap)->strings+(off) : NULL)
+
+/** A hop of a circuit, as seen by the GUI. */
+typedef struct gui_hop_t
+{	char identity_digest[DIGEST_LEN];
+	char nickname[MAX_NICKNAME_LEN+1];
+	uint32_t addr;	/**< Address of the router in host order, or 0 if we don't have its descriptor. */
+	uint8_t state;	/**< CPATH_STATE_* */
+	unsigned int is_named:1;	/**< True iff the router is Named, so we show its nickname instead of its digest. */
+} gui_hop_t;
+
+/** A circuit, as seen by the GUI. */
+typedef struct gui_circ_t
+{	HTREEITEM hItem;
+	circid_t n_circ_id;
+	uint8_t purpose;
+	uint8_t state;
+	unsigned int is_origin:1;
+	unsigned int is_internal:1;
+	unsigned int need_uptime:1;
+	unsigned int marked_for_close:1;
+	int desired_path_len;
+	time_t created;
+	DWORD exclKey;
+	uint32_t exit_nickname;	/**< Offset in the string arena. */
+	int first_hop;	/**< Index of the first hop of this circuit in gui_snapshot_t.hops. */
+	int n_hops;
+	cell_wait_hist_t cell_wait;
+} gui_circ_t;
+
+/** A connection, as seen by the GUI. The uint32_t string fields are offsets in the string arena. */
+typedef struct gui_conn_t
+{	uint32_t magic;
+	uint8_t type;
+	uint8_t state;
+	uint8_t purpose;
+	time_t created;
+	time_t lastread;
+	time_t lastwritten;
+	uint32_t address;
+	uint32_t addr;	/**< Address of the other end, as returned by tor_addr_to_ipv4n(). */
+	uint16_t port;
+	DWORD exclKey;
+	DWORD pid;
+	HANDLE hPlugin;
+	HTREEITEM hItem;
+	/* OR connections */
+	time_t client_used;
+	uint32_t real_addr;
+	int bandwidthrate;
+	int bandwidthburst;
+	unsigned int is_bad_for_new_circs:1;
+	cell_wait_hist_t cell_wait;
+	/* Edge connections */
+	unsigned int has_socks_request:1;
+	unsigned int want_onehop:1;
+	unsigned int chosen_exit_optional:1;
+	unsigned int chosen_exit_retries;
+	uint32_t chosen_exit_name;
+	uint32_t socks_original_address;
+	uint32_t socks_address;
+	uint16_t socks_port;
+	uint8_t socks_command;
+	uint32_t n_read;
+	uint32_t n_written;
+	/* Directory connections */
+	uint32_t requested_resource;
+	unsigned int dirconn_direct:1;
+	uint8_t router_purpose;
+} gui_conn_t;
+
+/** A copy of the bandwidth, circuit and connection state that the GUI shows, made by the Tor thread once per second. A published snapshot is never changed; the GUI thread takes a reference with gui_snapshot_acquire() and drops it with gui_snapshot_release(). */
+typedef struct gui_snapshot_t
+{	int refcnt;	/**< Protected by snapshot_mutex. */
+	time_t taken;
+	uint32_t bw_read[GUI_BW_HISTORY];	/**< Bytes read per second, oldest first. */
+	uint32_t bw_written[GUI_BW_HISTORY];	/**< Bytes written per second, oldest first. */
+	uint32_t bw_max;
+	uint64_t total_read;
+	uint64_t total_written;
+	unsigned int has_details:1;	/**< False if the circuits and connections weren't copied because nobody looked at them. */
+	int n_circs,circs_size;
+	gui_circ_t *circs;
+	int n_hops,hops_size;
+	gui_hop_t *hops;
+	int n_conns,conns_size;
+	gui_conn_t *conns;
+	size_t strings_len,strings_size;
+	char *strings;	/**< NUL-terminated strings; offset 0 holds an empty string, and means NULL. */
+} gui_snapshot_t;
+
+void gui_snapshot_update(void);
+void gui_snapshot_free_all(void);
+gui_snapshot_t *gui_snapshot_acquire(void);
+void gui_snapshot_release(gui_snapshot_t *snap);
+const gui_circ_t *gui_snapshot_get_circ(const gui_snapshot_t *snap,HTREEITEM hItem);
+const gui_conn_t *gui_snapshot_get_stream(const gui_snapshot_t *snap,HTREEITEM hItem);
+const gui_conn_t *gui_snapshot_get_conn_by_addr(const gui_snapshot_t *snap,uint32_t ip,int port,const gui_conn_t *after);
+
+#endif
@@ -20,6 +20,7 @@
 #include "control.h"
 #include "dns.h"
 #include "main.h"
+#include "perf.h"
 #include "policies.h"
 #include "relay.h"
 #include "router.h"
@@ -154,6 +155,10 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** Neighbours of this element in the list of cached answers, from least
+   * to most recently used. Only CACHED_VALID and CACHED_FAILED entries are
+   * in this list. */
+  struct cached_resolve_t *lru_prev, *lru_next;
 } cached_resolve_t;
 
 static void purge_expired_resolves(time_t now);
@@ -332,6 +337,20 @@ dns_get_expiry_ttl(uint32_t ttl)
     return ttl;
 }
 
+/** Helper: Given the negative caching TTL of a failed DNS response (0 if
+ * the nameserver didn't send one), determine how long to hold the failure
+ * in our cache. */
+static uint32_t
+dns_get_negative_ttl(uint32_t ttl)
+{
+  uint32_t max_ttl = (uint32_t)get_options()->ServerDNSNegativeTTL;
+  if (ttl < MIN_DNS_TTL)
+    ttl = MIN_DNS_TTL;
+  if (max_ttl && ttl > max_ttl)
+    ttl = max_ttl;
+  return dns_get_expiry_ttl(ttl);
+}
+
 /** Helper: free storage held by an entry in the DNS cache. */
 static void
 _free_cached_resolve(cached_resolve_t *r)
@@ -383,6 +402,97 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Least and most recently used cached answers. */
+static cached_resolve_t *cache_lru_head = NULL, *cache_lru_tail = NULL;
+/** Approximate number of bytes used by the cached answers. */
+static size_t cache_lru_bytes = 0;
+/** How many lookups were answered from the cache, and how many had to
+ * launch a resolve. */
+static uint64_t dns_cache_hits = 0, dns_cache_misses = 0;
+
+/** Return the approximate number of bytes used by <b>resolve</b>. */
+static size_t
+cached_resolve_mem_usage(const cached_resolve_t *resolve)
+{
+  size_t len = sizeof(cached_resolve_t);
+  if (resolve->is_reverse && resolve->result.hostname)
+    len += strlen(resolve->result.hostname) + 1;
+  return len;
+}
+
+/** Add the cached answer <b>resolve</b> as the most recently used one. */
+static void
+cache_lru_add(cached_resolve_t *resolve)
+{
+  resolve->lru_prev = cache_lru_tail;
+  resolve->lru_next = NULL;
+  if (cache_lru_tail)
+    cache_lru_tail->lru_next = resolve;
+  else
+    cache_lru_head = resolve;
+  cache_lru_tail = resolve;
+  cache_lru_bytes += cached_resolve_mem_usage(resolve);
+  tor_mem_account(MEM_TAG_DNS_CACHE, cached_resolve_mem_usage(resolve));
+}
+
+/** Remove the cached answer <b>resolve</b> from the LRU list. */
+static void
+cache_lru_remove(cached_resolve_t *resolve)
+{
+  if (resolve->lru_prev)
+    resolve->lru_prev->lru_next = resolve->lru_next;
+  else
+    cache_lru_head = resolve->lru_next;
+  if (resolve->lru_next)
+    resolve->lru_next->lru_prev = resolve->lru_prev;
+  else
+    cache_lru_tail = resolve->lru_prev;
+  resolve->lru_prev = resolve->lru_next = NULL;
+  cache_lru_bytes -= cached_resolve_mem_usage(resolve);
+  tor_mem_account(MEM_TAG_DNS_CACHE, -(LONG)cached_resolve_mem_usage(resolve));
+}
+
+/** Drop the least recently used answers until the cache takes at most
+ * <b>max_bytes</b>. Pending resolves are never dropped. */
+static void
+cache_lru_shrink_to(uint64_t max_bytes)
+{
+  cached_resolve_t *resolve, *removed;
+  int n = 0;
+  while (cache_lru_head && cache_lru_bytes > max_bytes) {
+    resolve = cache_lru_head;
+    cache_lru_remove(resolve);
+    removed = HT_REMOVE(cache_map, &cache_root, resolve);
+    tor_assert(removed == resolve);
+    smartlist_pqueue_remove(cached_resolve_pqueue,
+                            _compare_cached_resolves_by_expiry,
+                            STRUCT_OFFSET(cached_resolve_t, minheap_idx),
+                            resolve);
+    _free_cached_resolve(resolve);
+    n++;
+  }
+  if (n)
+    log_info(LD_EXIT,get_lang_str(LANG_LOG_DNS_CACHE_EVICTED),n,(unsigned)cache_lru_bytes);
+}
+
+/** Drop the least recently used answers until the cache fits in
+ * ServerDNSMaxCacheSize. */
+static void
+cache_lru_enforce_limit(void)
+{
+  uint64_t max_bytes = get_options()->ServerDNSMaxCacheSize;
+  if (max_bytes)
+    cache_lru_shrink_to(max_bytes);
+}
+
+/** Drop the least recently used half of the cached answers, because we are
+ * short of memory. */
+void
+dns_cache_shrink(void)
+{
+  cache_lru_shrink_to(cache_lru_bytes / 2);
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -405,6 +515,9 @@ dns_free_all(void)
   if (cached_resolve_pqueue)
     smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
+  cache_lru_head = cache_lru_tail = NULL;
+  tor_mem_account(MEM_TAG_DNS_CACHE, -(LONG)cache_lru_bytes);
+  cache_lru_bytes = 0;
   tor_free(resolv_conf_fname);
 }
 
@@ -439,6 +552,7 @@ purge_expired_resolves(time_t now)
       log_debug(LD_EXIT,get_lang_str(LANG_LOG_DNS_ENTRY_EXPIRED),esc_l,(unsigned long)resolve->expire);
       tor_free(esc_l);
       tor_assert(!resolve->pending_connections);
+      cache_lru_remove(resolve);
     } else {
       tor_assert(resolve->state == CACHE_STATE_DONE);
       tor_assert(!resolve->pending_connections);
@@ -763,6 +877,10 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
 	tor_free(esc_l);
         return 0;
       case CACHE_STATE_CACHED_VALID:
+        dns_cache_hits++;
+        perf_count(PERF_DNS_CACHE_HITS);
+        cache_lru_remove(resolve);
+        cache_lru_add(resolve);
         esc_l = escaped_safe_str(resolve->address);
         log_debug(LD_EXIT,get_lang_str(LANG_LOG_DNS_CACHED_ANSWER_FOUND),exitconn->_base.s,esc_l);
 	tor_free(esc_l);
@@ -775,6 +893,10 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
         }
         return 1;
       case CACHE_STATE_CACHED_FAILED:
+        dns_cache_hits++;
+        perf_count(PERF_DNS_CACHE_HITS);
+        cache_lru_remove(resolve);
+        cache_lru_add(resolve);
         esc_l = escaped_safe_str(exitconn->_base.address);
         log_debug(LD_EXIT,get_lang_str(LANG_LOG_DNS_CACHED_ERROR_FOUND),exitconn->_base.s,esc_l);
 	tor_free(esc_l);
@@ -787,6 +909,8 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
+  dns_cache_misses++;
+  perf_count(PERF_DNS_CACHE_MISSES);
   resolve = tor_malloc_zero(sizeof(cached_resolve_t));
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
@@ -1020,7 +1144,12 @@ add_answer_to_cache(const char *address, uint8_t is_reverse, uint32_t addr,
   resolve->ttl = ttl;
   assert_resolve_ok(resolve);
   HT_INSERT(cache_map, &cache_root, resolve);
-  set_expiry(resolve, get_time(NULL) + dns_get_expiry_ttl(ttl));
+  if (outcome == DNS_RESOLVE_SUCCEEDED)
+    set_expiry(resolve, get_time(NULL) + dns_get_expiry_ttl(ttl));
+  else
+    set_expiry(resolve, get_time(NULL) + dns_get_negative_ttl(ttl));
+  cache_lru_add(resolve);
+  cache_lru_enforce_limit();
 }
 
 /** Return true iff <b>address</b> is one of the addresses we use to verify
@@ -1713,6 +1842,7 @@ dump_dns_mem_usage(int severity)
      hostnames in cached reverse resolves.
    */
   log(severity, LD_MM,get_lang_str(LANG_LOG_DNS_MEM_USAGE), hash_count,(unsigned)hash_mem);
+  log(severity, LD_MM,get_lang_str(LANG_LOG_DNS_CACHE_STATS),(unsigned)cache_lru_bytes,U64_PRINTF_ARG(get_options()->ServerDNSMaxCacheSize),U64_PRINTF_ARG(dns_cache_hits),U64_PRINTF_ARG(dns_cache_misses),(dns_cache_hits + dns_cache_misses) ? (int)(dns_cache_hits * 100 / (dns_cache_hits + dns_cache_misses)) : 0);
 }
 
 #ifdef DEBUG_DNS_CACHE
@@ -26,6 +26,7 @@ void dns_launch_correctness_checks(void);
 int dns_seems_to_be_broken(void);
 void dns_reset_correctness_checks(void);
 void dump_dns_mem_usage(int severity);
+void dns_cache_shrink(void);
 
 #endif
 
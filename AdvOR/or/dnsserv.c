@@ -15,6 +15,7 @@
 #include "connection_edge.h"
 #include "control.h"
 #include "main.h"
+#include "plugins.h"
 #include "policies.h"
 #ifdef HAVE_EVENT2_DNS_H
 #include <event2/dns.h>
@@ -25,6 +26,60 @@
 #include "eventdns.h"
 #endif
 
+/** Helper function: if <b>name</b> is already mapped to an IPv4 address in
+ * the addressmap, or only needs a virtual address, store that address (in
+ * network order) in <b>addr_out</b> and its ttl in <b>ttl_out</b>, and
+ * return 1.  Otherwise return 0, and let the request take the usual path
+ * through an AP connection. */
+static int
+dnsserv_resolve_from_addressmap(const char *name, char *addr_out, int *ttl_out)
+{
+  or_options_t *options = get_options();
+  char *address = tor_strdup(name);
+  struct in_addr in;
+  time_t map_expires = TIME_MAX;
+  time_t now = get_time(NULL);
+  int automap = 0;
+
+  tor_strlower(address);
+  addressmap_rewrite(&address, &map_expires);
+  if (!plugins_remap(NULL, &address, (char *)name, 0) || is_banned(address)) {
+    tor_free(address);
+    return 0;
+  }
+  if (!tor_inet_aton(address, &in) && options->AutomapHostsOnResolve &&
+      options->AutomapHostsSuffixes) {
+    SMARTLIST_FOREACH(options->AutomapHostsSuffixes, const char *, cp,
+      if (!strcasecmpend(address, cp)) {
+        automap = 1;
+        break;
+      });
+    if (automap) {
+      const char *new_addr;
+      new_addr = addressmap_register_virtual_address(RESOLVED_TYPE_IPV4,
+                                                     tor_strdup(address),
+                                                     ADDRMAPSRC_AUTOMAP);
+      tor_free(address);
+      if (!new_addr)
+        return 0;
+      address = tor_strdup(new_addr);
+    }
+  }
+  if (!automap)
+    addressmap_rewrite(&address, &map_expires);
+  if (!tor_inet_aton(address, &in)) {
+    tor_free(address);
+    return 0;
+  }
+  memcpy(addr_out, &in.s_addr, 4);
+  if (map_expires < TIME_MAX && map_expires > now)
+    *ttl_out = (int)(map_expires - now);
+  else
+    *ttl_out = -1;
+  tor_free(address);
+  return 1;
+}
+
 /** Helper function: called by evdns whenever the client sends a request to our
  * DNSPort.  We need to eventually answer the request <b>req</b>.
  */
@@ -110,6 +165,23 @@ evdns_server_callback(struct evdns_server_request *req, void *_data)
     return;
   }
 
+  /* Names that are already mapped don't need a connection: answer them
+   * right now. */
+  if (q->type == EVDNS_TYPE_A) {
+    char answer[4];
+    int ttl;
+    if (dnsserv_resolve_from_addressmap(q->name, answer, &ttl)) {
+      char *esc_l = escaped_safe_str(q->name);
+      log_info(LD_APP,get_lang_str(LANG_LOG_DNSSERV_ANSWERED_FROM_ADDRESSMAP),esc_l);
+      tor_free(esc_l);
+      if (ttl < 60)
+        ttl = 60;
+      evdns_server_request_add_a_reply(req, q->name, 1, answer, ttl);
+      evdns_server_request_respond(req, DNS_ERR_NONE);
+      return;
+    }
+  }
+
   /* Make a new dummy AP connection, and attach the request to it. */
   conn = edge_connection_new(CONN_TYPE_AP, AF_INET);
   conn->_base.state = AP_CONN_STATE_RESOLVE_WAIT;
@@ -0,0 +1,316 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file etw.c
+ * \brief Event Tracing for Windows provider for the hot paths.
+ *
+ * The provider, its keywords and the layout of every event are declared in
+ * advor_etw.man; build its resources and register it as described there
+ * so that xperf, WPR or tracerpt can decode the events.  The descriptors
+ * below are written by hand to match it, and the Event* functions are
+ * looked up at run time, so we still start on Windows versions that don't
+ * have them.
+ *
+ * Windows tells us which keywords the trace sessions want through
+ * etw_enable_callback(); callers test etw_enabled() before they gather the
+ * data for an event, so with no session running an event costs one load
+ * and one test.  Events may be written from any thread.
+ **/
+
+#include "or.h"
+#include "etw.h"
+#include "perf.h"
+
+/** Layout of EVENT_DESCRIPTOR from evntprov.h. */
+typedef struct etw_event_descriptor_t {
+  USHORT id;
+  UCHAR version;
+  UCHAR channel;
+  UCHAR level;
+  UCHAR opcode;
+  USHORT task;
+  uint64_t keyword;
+} etw_event_descriptor_t;
+
+/** Layout of EVENT_DATA_DESCRIPTOR from evntprov.h. */
+typedef struct etw_data_descriptor_t {
+  uint64_t ptr;
+  ULONG size;
+  ULONG reserved;
+} etw_data_descriptor_t;
+
+typedef void (WINAPI *etw_enable_callback_fn)(const GUID *source_id,
+               ULONG is_enabled, UCHAR level, uint64_t match_any_keyword,
+               uint64_t match_all_keyword, void *filter_data, void *context);
+typedef ULONG (WINAPI *etw_event_register_fn)(const GUID *provider_id,
+               etw_enable_callback_fn callback, void *context,
+               uint64_t *reg_handle);
+typedef ULONG (WINAPI *etw_event_unregister_fn)(uint64_t reg_handle);
+typedef ULONG (WINAPI *etw_event_write_fn)(uint64_t reg_handle,
+               const etw_event_descriptor_t *descriptor, ULONG n_data,
+               etw_data_descriptor_t *data);
+
+/** Values of <b>is_enabled</b> passed to etw_enable_callback(). */
+#define ETW_CONTROL_DISABLE 0
+#define ETW_CONTROL_ENABLE 1
+
+/** Event levels, as in the manifest. */
+#define ETW_LEVEL_INFO 4
+#define ETW_LEVEL_VERBOSE 5
+
+/** Keywords of the events that are logged at ETW_LEVEL_VERBOSE. */
+#define ETW_KW_VERBOSE (ETW_KW_CELLS|ETW_KW_CONN_IO)
+
+/** AdvOR-HotPath, {e14797b4-f1cf-49b9-854f-6eeefae1074a}. */
+static const GUID etw_provider_guid =
+  { 0xe14797b4, 0xf1cf, 0x49b9,
+    { 0x85, 0x4f, 0x6e, 0xee, 0xfa, 0xe1, 0x07, 0x4a } };
+
+/* Tasks, as in the manifest. */
+#define ETW_TASK_CELL 1
+#define ETW_TASK_RELAYCRYPT 2
+#define ETW_TASK_CONNECTION 3
+#define ETW_TASK_CIRCUIT 4
+#define ETW_TASK_CPUWORKER 5
+#define ETW_TASK_PLUGIN 6
+
+static const etw_event_descriptor_t etw_ev_cell_queued =
+  { 1, 0, 0, ETW_LEVEL_VERBOSE, 0, ETW_TASK_CELL, ETW_KW_CELLS };
+static const etw_event_descriptor_t etw_ev_cell_dequeued =
+  { 2, 0, 0, ETW_LEVEL_VERBOSE, 0, ETW_TASK_CELL, ETW_KW_CELLS };
+static const etw_event_descriptor_t etw_ev_relaycrypt_batch =
+  { 3, 0, 0, ETW_LEVEL_INFO, 0, ETW_TASK_RELAYCRYPT, ETW_KW_RELAYCRYPT };
+static const etw_event_descriptor_t etw_ev_conn_read =
+  { 4, 0, 0, ETW_LEVEL_VERBOSE, 0, ETW_TASK_CONNECTION, ETW_KW_CONN_IO };
+static const etw_event_descriptor_t etw_ev_conn_write =
+  { 5, 0, 0, ETW_LEVEL_VERBOSE, 0, ETW_TASK_CONNECTION, ETW_KW_CONN_IO };
+static const etw_event_descriptor_t etw_ev_circuit_phase =
+  { 6, 0, 0, ETW_LEVEL_INFO, 0, ETW_TASK_CIRCUIT, ETW_KW_CIRC_BUILD };
+static const etw_event_descriptor_t etw_ev_cpuworker_task =
+  { 7, 0, 0, ETW_LEVEL_INFO, 0, ETW_TASK_CPUWORKER, ETW_KW_CPUWORKER };
+static const etw_event_descriptor_t etw_ev_plugin_callback =
+  { 8, 0, 0, ETW_LEVEL_INFO, 0, ETW_TASK_PLUGIN, ETW_KW_PLUGINS };
+
+/** Keywords that some trace session wants, filtered by level; 0 when
+ * nobody is tracing us.  Written by etw_enable_callback(). */
+volatile LONG etw_enabled_keywords = 0;
+/** Our registration handle, or 0 if we are not registered. */
+static uint64_t etw_reg_handle = 0;
+static etw_event_unregister_fn etw_event_unregister = NULL;
+static etw_event_write_fn etw_event_write = NULL;
+
+/** Called by Windows, on a thread of its own, whenever a trace session
+ * enables or disables us.  Remember which of our events are wanted.  We
+ * only use this to skip the work of building events nobody wants;
+ * EventWrite() does the exact filtering for each session. */
+static void WINAPI
+etw_enable_callback(const GUID *source_id, ULONG is_enabled, UCHAR level,
+                    uint64_t match_any_keyword, uint64_t match_all_keyword,
+                    void *filter_data, void *context)
+{
+  LONG keywords;
+  (void)source_id;
+  (void)match_all_keyword;
+  (void)filter_data;
+  (void)context;
+
+  if (is_enabled == ETW_CONTROL_DISABLE) {
+    keywords = 0;
+  } else if (is_enabled == ETW_CONTROL_ENABLE) {
+    /* An empty keyword mask asks for everything. */
+    keywords = match_any_keyword ? (LONG)(match_any_keyword & ETW_KW_ALL) :
+      ETW_KW_ALL;
+    if (level && level < ETW_LEVEL_INFO)
+      keywords = 0;
+    else if (level && level < ETW_LEVEL_VERBOSE)
+      keywords &= ~ETW_KW_VERBOSE;
+  } else {
+    return; /* A request to capture state; we have none. */
+  }
+  InterlockedExchange(&etw_enabled_keywords, keywords);
+}
+
+/** Register our event provider, if this version of Windows has ETW. */
+void
+etw_init(void)
+{
+  HMODULE advapi;
+  etw_event_register_fn event_register;
+  ULONG err;
+
+  if (etw_reg_handle)
+    return;
+  /* Make sure the counter frequency is known before any worker thread
+   * times an event. */
+  perf_now_usec();
+  advapi = GetModuleHandle("advapi32.dll");
+  if (!advapi)
+    return;
+  event_register = (etw_event_register_fn)GetProcAddress(advapi,
+                                                         "EventRegister");
+  etw_event_unregister = (etw_event_unregister_fn)GetProcAddress(advapi,
+                                                         "EventUnregister");
+  etw_event_write = (etw_event_write_fn)GetProcAddress(advapi, "EventWrite");
+  if (!event_register || !etw_event_unregister || !etw_event_write) {
+    etw_event_unregister = NULL;
+    etw_event_write = NULL;
+    return;
+  }
+  err = event_register(&etw_provider_guid, etw_enable_callback, NULL,
+                       &etw_reg_handle);
+  if (err != ERROR_SUCCESS) {
+    log_info(LD_GENERAL,get_lang_str(LANG_LOG_ETW_REGISTER_FAILED),
+             (unsigned long)err);
+    etw_reg_handle = 0;
+  }
+}
+
+/** Unregister our event provider. */
+void
+etw_free_all(void)
+{
+  uint64_t handle = etw_reg_handle;
+  InterlockedExchange(&etw_enabled_keywords, 0);
+  etw_reg_handle = 0;
+  if (handle && etw_event_unregister)
+    etw_event_unregister(handle);
+}
+
+/** Point <b>d</b> at the <b>len</b> bytes at <b>p</b>. */
+static INLINE void
+etw_data(etw_data_descriptor_t *d, const void *p, size_t len)
+{
+  d->ptr = (uint64_t)(uintptr_t)p;
+  d->size = (ULONG)len;
+  d->reserved = 0;
+}
+
+/** Write the event <b>ev</b> with the <b>n</b> fields in <b>data</b>. */
+static void
+etw_write(const etw_event_descriptor_t *ev, etw_data_descriptor_t *data,
+          int n)
+{
+  uint64_t handle = etw_reg_handle;
+  if (handle)
+    etw_event_write(handle, ev, (ULONG)n, data);
+}
+
+/** Report that we added <b>n_cells</b> cells to the queue of the circuit
+ * with ID <b>circ_id</b>, which now holds <b>queue_len</b> cells. */
+void
+etw_cell_queued(circid_t circ_id, int queue_len, int n_cells)
+{
+  etw_data_descriptor_t d[3];
+  uint16_t id = circ_id;
+  uint32_t len = (uint32_t)queue_len, n = (uint32_t)n_cells;
+  etw_data(&d[0], &id, sizeof(id));
+  etw_data(&d[1], &len, sizeof(len));
+  etw_data(&d[2], &n, sizeof(n));
+  etw_write(&etw_ev_cell_queued, d, 3);
+}
+
+/** Report that we took a cell off the queue of the circuit with ID
+ * <b>circ_id</b>, which now holds <b>queue_len</b> cells. */
+void
+etw_cell_dequeued(circid_t circ_id, int queue_len)
+{
+  etw_data_descriptor_t d[3];
+  uint16_t id = circ_id;
+  uint32_t len = (uint32_t)queue_len, n = 1;
+  etw_data(&d[0], &id, sizeof(id));
+  etw_data(&d[1], &len, sizeof(len));
+  etw_data(&d[2], &n, sizeof(n));
+  etw_write(&etw_ev_cell_dequeued, d, 3);
+}
+
+/** Report that we crypted a batch of <b>n_cells</b> cells, grouped into
+ * <b>n_jobs</b> jobs, in <b>usec</b> microseconds. */
+void
+etw_relaycrypt_batch(int n_cells, int n_jobs, uint64_t usec)
+{
+  etw_data_descriptor_t d[3];
+  uint32_t cells = (uint32_t)n_cells, jobs = (uint32_t)n_jobs;
+  etw_data(&d[0], &cells, sizeof(cells));
+  etw_data(&d[1], &jobs, sizeof(jobs));
+  etw_data(&d[2], &usec, sizeof(usec));
+  etw_write(&etw_ev_relaycrypt_batch, d, 3);
+}
+
+/** Write one connection I/O event <b>ev</b> for <b>bytes</b> bytes. */
+static void
+etw_conn_io_event(const etw_event_descriptor_t *ev, connection_t *conn,
+                  size_t bytes)
+{
+  etw_data_descriptor_t d[3];
+  uint64_t id = conn->global_identifier;
+  uint8_t type = conn->type;
+  uint32_t n = (uint32_t)bytes;
+  etw_data(&d[0], &id, sizeof(id));
+  etw_data(&d[1], &type, sizeof(type));
+  etw_data(&d[2], &n, sizeof(n));
+  etw_write(ev, d, 3);
+}
+
+/** Report that we just read <b>n_read</b> and wrote <b>n_written</b> bytes
+ * on <b>conn</b>. */
+void
+etw_conn_io(connection_t *conn, size_t n_read, size_t n_written)
+{
+  if (n_read)
+    etw_conn_io_event(&etw_ev_conn_read, conn, n_read);
+  if (n_written)
+    etw_conn_io_event(&etw_ev_conn_write, conn, n_written);
+}
+
+/** Report that <b>circ</b> has reached <b>phase</b>, along with how many
+ * of its hops are open. */
+void
+etw_circuit_phase(origin_circuit_t *circ, etw_circ_phase_t phase)
+{
+  etw_data_descriptor_t d[3];
+  uint32_t id = circ->global_identifier;
+  uint8_t ph = (uint8_t)phase, hops = 0;
+  crypt_path_t *hop = circ->cpath;
+  if (hop) {
+    do {
+      if (hop->state == CPATH_STATE_OPEN)
+        ++hops;
+      hop = hop->next;
+    } while (hop != circ->cpath);
+  }
+  etw_data(&d[0], &id, sizeof(id));
+  etw_data(&d[1], &ph, sizeof(ph));
+  etw_data(&d[2], &hops, sizeof(hops));
+  etw_write(&etw_ev_circuit_phase, d, 3);
+}
+
+/** Report that a cpuworker spent <b>usec</b> microseconds on a
+ * <b>task</b> of <b>n_items</b> items.  May be called from any thread. */
+void
+etw_cpuworker_task(etw_cpuworker_task_t task, int n_items, uint64_t usec)
+{
+  etw_data_descriptor_t d[3];
+  uint8_t t = (uint8_t)task;
+  uint32_t n = (uint32_t)n_items;
+  etw_data(&d[0], &t, sizeof(t));
+  etw_data(&d[1], &n, sizeof(n));
+  etw_data(&d[2], &usec, sizeof(usec));
+  etw_write(&etw_ev_cpuworker_task, d, 3);
+}
+
+/** Report that the <b>callback</b> of <b>plugin</b> took <b>usec</b>
+ * microseconds to return. */
+void
+etw_plugin_callback(const char *plugin, const char *callback, uint64_t usec)
+{
+  etw_data_descriptor_t d[3];
+  etw_data(&d[0], plugin, strlen(plugin)+1);
+  etw_data(&d[1], callback, strlen(callback)+1);
+  etw_data(&d[2], &usec, sizeof(usec));
+  etw_write(&etw_ev_plugin_callback, d, 3);
+}
+
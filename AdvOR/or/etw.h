@@ -0,0 +1,64 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file etw.h
+ * \brief Header file for etw.c.
+ **/
+
+#ifndef _TOR_ETW_H
+#define _TOR_ETW_H
+
+/** Keywords of our event provider.  These must match advor_etw.man. */
+#define ETW_KW_CELLS 0x01
+#define ETW_KW_RELAYCRYPT 0x02
+#define ETW_KW_CONN_IO 0x04
+#define ETW_KW_CIRC_BUILD 0x08
+#define ETW_KW_CPUWORKER 0x10
+#define ETW_KW_PLUGINS 0x20
+#define ETW_KW_ALL 0x3f
+
+/** Phases of building an origin circuit, as reported by
+ * etw_circuit_phase(). */
+typedef enum etw_circ_phase_t {
+  ETW_CIRC_LAUNCHED = 1,
+  ETW_CIRC_CREATE_SENT = 2,
+  ETW_CIRC_EXTEND_SENT = 3,
+  ETW_CIRC_HOP_OPEN = 4,
+  ETW_CIRC_OPEN = 5,
+  ETW_CIRC_FAILED = 6
+} etw_circ_phase_t;
+
+/** Kinds of work done by the cpuworkers, as reported by
+ * etw_cpuworker_task(). */
+typedef enum etw_cpuworker_task_t {
+  ETW_TASK_ONIONSKIN = 1,
+  ETW_TASK_BATCH = 2,
+  ETW_TASK_QUEUED = 3
+} etw_cpuworker_task_t;
+
+extern volatile LONG etw_enabled_keywords;
+
+/** True iff some trace session may want the events of keyword <b>kw</b>.
+ * Check this before gathering the data for an event: when nobody is
+ * tracing us, it is all that an event costs. */
+#define etw_enabled(kw) (etw_enabled_keywords & (kw))
+
+void etw_init(void);
+void etw_free_all(void);
+
+void etw_cell_queued(circid_t circ_id, int queue_len, int n_cells);
+void etw_cell_dequeued(circid_t circ_id, int queue_len);
+void etw_relaycrypt_batch(int n_cells, int n_jobs, uint64_t usec);
+void etw_conn_io(connection_t *conn, size_t n_read, size_t n_written);
+void etw_circuit_phase(origin_circuit_t *circ, etw_circ_phase_t phase);
+void etw_cpuworker_task(etw_cpuworker_task_t task, int n_items,
+                        uint64_t usec);
+void etw_plugin_callback(const char *plugin, const char *callback,
+                         uint64_t usec);
+
+#endif
+
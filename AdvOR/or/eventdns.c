@@ -147,6 +147,7 @@ typedef unsigned int uint;
 
 #define TYPE_A		EVDNS_TYPE_A
 #define TYPE_CNAME	5
+#define TYPE_SOA	6
 #define TYPE_PTR	EVDNS_TYPE_PTR
 #define TYPE_AAAA	EVDNS_TYPE_AAAA
 
@@ -295,6 +296,9 @@ static int global_good_nameservers = 0;
 /* inflight requests are contained in the req_head list */
 /* and are actually going out across the network */
 static int global_requests_inflight = 0;
+/* inflight requests indexed by transaction id, so that a reply */
+/* doesn't have to walk the req_head list */
+static struct evdns_request *req_by_trans_id[0x10000];
 /* requests which aren't inflight are in the waiting list */
 /* and are counted here */
 static int global_requests_waiting = 0;
@@ -315,6 +319,16 @@ static int global_randomize_case = 1;
 static const struct timeval global_nameserver_timeouts[] = {{10, 0}, {60, 0}, {300, 0}, {900, 0}, {3600, 0}};
 static const int global_nameserver_timeouts_length = (int)(sizeof(global_nameserver_timeouts)/sizeof(struct timeval));
 
+/* nameservers which were down when the nameserver list was cleared, so */
+/* that configuring them again doesn't reset their probe backoff */
+#define MAX_NAMESERVER_BACKOFF 16
+struct nameserver_backoff {
+	struct sockaddr_storage address;
+	int failed_times;
+};
+static struct nameserver_backoff nameserver_backoff[MAX_NAMESERVER_BACKOFF];
+static int nameserver_backoff_count = 0;
+
 static struct nameserver *nameserver_pick(void);
 static void evdns_request_insert(struct evdns_request *req, struct evdns_request **head);
 static void nameserver_ready_callback(int fd, short events, void *arg);
@@ -475,21 +489,11 @@ sockaddr_eq(const struct sockaddr *sa1, const struct sockaddr *sa2,
 #define del_timeout_event(s)                                    \
         (event_del(&(s)->timeout_event))
 
-/* This walks the list of inflight requests to find the */
-/* one with a matching transaction id. Returns NULL on */
-/* failure */
+/* This looks up the inflight request with a matching */
+/* transaction id. Returns NULL on failure */
 static struct evdns_request *
 request_find_from_trans_id(u16 trans_id) {
-	struct evdns_request *req = req_head, *const started_at = req_head;
-
-	if (req) {
-		do {
-			if (req->trans_id == trans_id) return req;
-			req = req->next;
-		} while (req != started_at);
-	}
-
-	return NULL;
+	return req_by_trans_id[trans_id];
 }
 
 /* a libevent callback function which is called when a nameserver */
@@ -595,6 +599,8 @@ request_trans_id_set(struct evdns_request *const req, const u16 trans_id) {
 /* removed from or NULL if the request isn't in a list. */
 static void
 request_finished(struct evdns_request *const req, struct evdns_request **head) {
+	if (head == &req_head && req_by_trans_id[req->trans_id] == req)
+		req_by_trans_id[req->trans_id] = NULL;
 	if (head) {
 		if (req->next == req) {
 			/* only item in the list */
@@ -657,6 +663,7 @@ request_reissue(struct evdns_request *req) {
 /* requests from the waiting queue if it can. */
 static void
 evdns_requests_pump_waiting_queue(void) {
+	int pumped = 0;
 	while (global_requests_inflight < global_max_requests_inflight &&
 		global_requests_waiting) {
 		struct evdns_request *req;
@@ -681,8 +688,12 @@ evdns_requests_pump_waiting_queue(void) {
 
 		evdns_request_insert(req, &req_head);
 		evdns_request_transmit(req);
-		evdns_transmit();
+		pumped = 1;
 	}
+	/* retry the other requests that are waiting to be sent once, */
+	/* not once for every request that we moved */
+	if (pumped)
+		evdns_transmit();
 }
 
 static void
@@ -695,7 +706,7 @@ reply_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *
 							   reply->data.a.addresses,
 							   req->user_pointer);
 		else
-			req->user_callback(err, 0, 0, 0, NULL, req->user_pointer);
+			req->user_callback(err, 0, 0, ttl, NULL, req->user_pointer);
 		return;
 	case TYPE_PTR:
 		if (reply) {
@@ -703,7 +714,7 @@ reply_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *
 			req->user_callback(DNS_ERR_NONE, DNS_PTR, 1, ttl,
 							   &name, req->user_pointer);
 		} else {
-			req->user_callback(err, 0, 0, 0, NULL,
+			req->user_callback(err, 0, 0, ttl, NULL,
 							   req->user_pointer);
 		}
 		return;
@@ -714,7 +725,7 @@ reply_callback(struct evdns_request *const req, u32 ttl, u32 err, struct reply *
 							   reply->data.aaaa.addresses,
 							   req->user_pointer);
 		else
-			req->user_callback(err, 0, 0, 0, NULL, req->user_pointer);
+			req->user_callback(err, 0, 0, ttl, NULL, req->user_pointer);
 		return;
 	}
 	tor_assert(0);
@@ -775,8 +786,9 @@ reply_handle(struct evdns_request *const req, u16 flags, u32 ttl, struct reply *
 			}
 		}
 
-		/* all else failed. Pass the failure up */
-		reply_callback(req, 0, error, NULL);
+		/* all else failed. Pass the failure up, with the time that a */
+		/* negative answer may be cached for */
+		reply_callback(req, ttl, error, NULL);
 		request_finished(req, &req_head);
 	} else {
 		/* all ok, tell the user */
@@ -830,6 +842,45 @@ static INLINE int name_parse(u8 *packet, int length, int *idx, char *name_out, s
 	return 0;
 }
 
+/* Returns how long a negative reply may be cached (RFC 2308): the smaller */
+/* of the ttl and of the MINIMUM field of the SOA record in the authority */
+/* section, or 0 if the reply has no such record. */
+static u32
+reply_negative_ttl(u8 *packet, int length, u16 questions, u16 answers, u16 authority) {
+	int j = 12;	/* skip the header */
+	unsigned int i;
+	u16 _t, type, datalength;
+	u32 _t32, ttl, minimum;
+	char tmp_name[256];
+
+	for (i = 0; i < questions; ++i) {
+		if (name_parse(packet, length, &j, tmp_name, sizeof(tmp_name)) < 0)
+			return 0;
+		j += 4;
+	}
+	/* the records look like <label:name><u16:type><u16:class><u32:ttl><u16:len><data...> */
+	for (i = 0; i < (unsigned int)answers + authority; ++i) {
+		if (name_parse(packet, length, &j, tmp_name, sizeof(tmp_name)) < 0 ||
+			j + 10 > length)
+			return 0;
+		memcpy(&_t, packet + j, 2); type = ntohs(_t);
+		memcpy(&_t32, packet + j + 4, 4); ttl = ntohl(_t32);
+		memcpy(&_t, packet + j + 8, 2); datalength = ntohs(_t);
+		j += 10;
+		if (j + datalength > length)
+			return 0;
+		if (i >= answers && type == TYPE_SOA) {
+			/* <label:mname><label:rname><u32:serial><u32:refresh><u32:retry><u32:expire><u32:minimum> */
+			if (datalength < 22)
+				return 0;
+			memcpy(&_t32, packet + j + datalength - 4, 4); minimum = ntohl(_t32);
+			return MIN(ttl, minimum);
+		}
+		j += datalength;
+	}
+	return 0;
+}
+
 /* parses a raw reply from a nameserver. */
 static int
 reply_parse(u8 *packet, int length) {
@@ -854,7 +905,6 @@ reply_parse(u8 *packet, int length) {
 	memcpy(&_t, packet + j, 2); j += 2; answers = ntohs(_t);
 	memcpy(&_t, packet + j, 2); j += 2; authority = ntohs(_t);
 	memcpy(&_t, packet + j, 2); j += 2; additional = ntohs(_t);
-	(void) authority; /* suppress "unused variable" warnings. */
 	(void) additional; /* suppress "unused variable" warnings. */
 
 	req = request_find_from_trans_id(trans_id);
@@ -969,11 +1019,17 @@ reply_parse(u8 *packet, int length) {
 				}
 			}
 			if(name_matches)
-			{	reply_handle(req, flags, ttl_r, &reply);
+			{	if(!reply.have_answer)	/* the name exists, but has no record of the type we asked for */
+					ttl_r = reply_negative_ttl(packet, length, questions, answers, authority);
+				reply_handle(req, flags, ttl_r, &reply);
 				return 0;
 			}
 		}
 	}
+	else if((flags & 0x020f) == 3)	/* the name doesn't exist */
+	{	reply_handle(req, flags, reply_negative_ttl(packet, length, questions, answers, authority), NULL);
+		return 0;
+	}
 	if (req)	reply_handle(req, flags, 0, NULL);
 	return -1;
 }
@@ -1135,20 +1191,11 @@ evdns_set_random_bytes_fn(void (*fn)(char *, size_t))
 static u16
 transaction_id_pick(void) {
 	for (;;) {
-		const struct evdns_request *req = req_head, *started_at;
 		u16 trans_id = trans_id_function();
 
 		if (trans_id == 0xffff) continue;
 		/* now check to see if that id is already inflight */
-		req = started_at = req_head;
-		if (req) {
-			do {
-				if (req->trans_id == trans_id) break;
-				req = req->next;
-			} while (req != started_at);
-		}
-		/* we didn't find it, so this is a good id */
-		if (req == started_at) return trans_id;
+		if (!req_by_trans_id[trans_id]) return trans_id;
 	}
 }
 
@@ -2104,8 +2151,14 @@ evdns_clear_nameservers_and_suspend(void)
 
 	if (!server)
 		return 0;
+	nameserver_backoff_count = 0;
 	while (1) {
 		struct nameserver *next = server->next;
+		if (!server->state && nameserver_backoff_count < MAX_NAMESERVER_BACKOFF) {
+			memcpy(&nameserver_backoff[nameserver_backoff_count].address, &server->address, sizeof(server->address));
+			nameserver_backoff[nameserver_backoff_count].failed_times = server->failed_times;
+			nameserver_backoff_count++;
+		}
 		(void) event_del(&server->event);
 		CLEAR(&server->event);
 		del_timeout_event(server);
@@ -2126,6 +2179,8 @@ evdns_clear_nameservers_and_suspend(void)
 		req->ns = NULL;
 		/* ???? What to do about searches? */
 		del_timeout_event(req);
+		if (req_by_trans_id[req->trans_id] == req)
+			req_by_trans_id[req->trans_id] = NULL;
 		req->trans_id = 0;
 		req->transmit_me = 0;
 
@@ -2190,7 +2245,7 @@ static int _evdns_nameserver_add_impl(const struct sockaddr *address,socklen_t a
 {	/* first check to see if we already have this nameserver */
 	const struct nameserver *server = server_head, *const started_at = server_head;
 	struct nameserver *ns;
-	int err = 0;
+	int err = 0, i;
 	if(server)
 	{	do
 		{	if (sockaddr_eq(address, (struct sockaddr *)&server->address, 1))
@@ -2244,6 +2299,17 @@ static int _evdns_nameserver_add_impl(const struct sockaddr *address,socklen_t a
 					server_head->next = ns;
 					if(server_head->prev == server_head)	server_head->prev = ns;
 				}
+				for(i = 0; i < nameserver_backoff_count; i++)
+				{	if(sockaddr_eq(address, (struct sockaddr *)&nameserver_backoff[i].address, 1))
+					{	/* it was down before we were reconfigured: keep probing it instead of sending it requests */
+						ns->state = 0;
+						ns->failed_times = nameserver_backoff[i].failed_times;
+						log(EVDNS_LOG_WARN,get_lang_str(LANG_LOG_EVENTDNS_NS_STILL_DOWN),debug_ntop(address));
+						if(add_timeout_event(ns, (struct timeval *) &global_nameserver_timeouts[MIN(ns->failed_times, global_nameserver_timeouts_length - 1)]) < 0)
+							log(EVDNS_LOG_WARN,get_lang_str(LANG_LOG_EVENTDNS_TIMER_ERROR),debug_ntop(address));
+						return 0;
+					}
+				}
 				global_good_nameservers++;
 				return 0;
 			}
@@ -2379,6 +2445,8 @@ evdns_nameserver_sockaddr_add(const struct sockaddr *sa, socklen_t len)
 /* insert into the tail of the queue */
 static void
 evdns_request_insert(struct evdns_request *req, struct evdns_request **head) {
+	if (head == &req_head)
+		req_by_trans_id[req->trans_id] = req;
 	if (!*head) {
 		*head = req;
 		req->next = req->prev = req;
@@ -1,12 +1,16 @@
 #include "or.h"
 #include "main.h"
 #include "config.h"
+#include "watchdog.h"
 
 int encryption = 0;	// bit 0 = cache all configuration files in RAM (read-only mode)
-			// bit 1 = encrypt configuration files using AES (not implemented yet)
+			// bit 1 = encrypt configuration files using AES
 file_info_t *first_file = NULL;
 char *password = NULL;
 DWORD password_size = 0;
+/** Keys for the sections of the .dat file we read at startup. */
+static char dat_key[CIPHER_KEY_LEN];
+static char dat_mac_key[DIGEST256_LEN];
 extern HINSTANCE hInstance;
 extern HWND hMainDialog;
 
@@ -29,6 +33,16 @@ void init_kernel_functions(void);
 DWORD WINAPI closeHandles(LPVOID lParam) __attribute__((noreturn));
 int close_all_handles(char *fname);
 int CaNtDeleteFile(char *fname);
+static void dat_ensure_loaded(file_info_t *finfo);
+static void file_ensure_loaded(file_info_t *finfo);
+static void load_all_pending_files(void);
+static void dat_forget_journal(void);
+static void dat_free_deleted_files(void);
+
+/** In read-only mode, compress the contents of files that we keep only in memory when they were not used for this long. */
+#define FILE_COLD_AGE (10*60)
+/** Don't compress files smaller than this. */
+#define FILE_COLD_MIN_SIZE 8192
 
 
 void alloc_password(void)
@@ -109,6 +123,21 @@ DWORD get_file_attributes(char *fname)
 	return attrs;
 }
 
+/** Store the last write time of <b>fname</b> in <b>ft</b>. For a directory, it changes when entries are created, deleted or renamed in it. Return 0 if fname doesn't exist. */
+int get_file_write_time(char *fname,FILETIME *ft)
+{	int i=strlen(fname);
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	BOOL r;
+	LPWSTR tmp=tor_malloc(i*2+4);
+	i=MultiByteToWideChar(CP_UTF8,0,(LPSTR)fname,-1,tmp,i*2);
+	if(i >= 0)	tmp[i]=0;
+	r = GetFileAttributesExW(tmp,GetFileExInfoStandard,&data);
+	tor_free(tmp);
+	if(!r)	return 0;
+	*ft = data.ftLastWriteTime;
+	return 1;
+}
+
 int file_exists(char *fname)
 {	if(get_file_attributes(fname) == 0xffffffff)	return 0;
 	return 1;
@@ -129,6 +158,8 @@ HANDLE find_first_file(char *pattern,LPWIN32_FIND_DATAW findData)
 void unload_file(file_info_t *file)
 {	if(file->filename)	tor_free(file->filename);
 	if(file->filedata)	tor_free(file->filedata);
+	if(file->diskname)	tor_free(file->diskname);
+	if(file->zdata)		tor_free(file->zdata);
 	tor_free(file);
 }
 
@@ -140,6 +171,9 @@ void unload_all_files(void)
 		unload_file(first_file);
 		first_file = next_file;
 	}
+	memset(dat_key,0,sizeof(dat_key));
+	memset(dat_mac_key,0,sizeof(dat_mac_key));
+	dat_free_deleted_files();
 	free_password();
 }
 
@@ -157,6 +191,7 @@ time_t convert_file_time(FILETIME *ft)
 	return (ull.QuadPart - EPOCH_BIAS)/EPOCH_RATE;
 }
 
+/** Add <b>fname</b> to the list of files that we keep in memory without reading it yet: its contents are read from the disk on first use, and dropped again after each use for as long as we don't change them. */
 file_info_t *load_file(char *fname)
 {	char *fdata;
 	HANDLE hFile;
@@ -169,15 +204,12 @@ file_info_t *load_file(char *fname)
 	{	CloseHandle(hFile);
 		return NULL;
 	}
-	fdata = tor_malloc(fsize+1);
-	DWORD numread = 0;
-	ReadFile(hFile,fdata,fsize,&numread,NULL);
 	file_info_t *finfo = tor_malloc_zero(sizeof(file_info_t));
 	GetFileTime(hFile,NULL,NULL,&ft);
 	CloseHandle(hFile);
 	finfo->filetime = convert_file_time(&ft);
-	finfo->filedata = fdata;
-	finfo->filesize = finfo->allocsize = fsize;
+	finfo->filesize = fsize;
+	finfo->diskname = tor_strdup(fname);
 	fdata = fname;
 	while(*fdata)
 	{	if(fdata[0]=='\\' && fdata[1]!=0)	fname=fdata+1;
@@ -187,6 +219,102 @@ file_info_t *load_file(char *fname)
 	return finfo;
 }
 
+/** Read the contents of <b>finfo</b> from its file on disk. */
+static void load_file_contents(file_info_t *finfo)
+{	HANDLE hFile;
+	uint32_t fsize = 0;
+	DWORD numread = 0;
+	hFile = open_file(finfo->diskname,GENERIC_READ,OPEN_EXISTING);
+	if(hFile!=INVALID_HANDLE_VALUE)
+	{	fsize = GetFileSize(hFile,NULL);
+		if(fsize+1 >= SIZE_T_CEILING)	fsize = 0;
+	}
+	finfo->filedata = tor_malloc(fsize+1);
+	if(hFile!=INVALID_HANDLE_VALUE)
+	{	ReadFile(hFile,finfo->filedata,fsize,&numread,NULL);
+		CloseHandle(hFile);
+	}
+	finfo->filedata[numread] = 0;
+	finfo->filesize = finfo->allocsize = numread;
+}
+
+/** Uncompress the contents of <b>finfo</b> that compress_cold_files() compressed. */
+static void file_uncompress(file_info_t *finfo)
+{	size_t len = 0;
+	if(tor_gzip_uncompress(&finfo->filedata,&len,finfo->zdata,finfo->zsize,ZLIB_METHOD,1,LOG_WARN) < 0 || len != finfo->filesize)
+	{	log_warn(LD_BUG,get_lang_str(LANG_LOG_FILE_IO_UNCOMPRESS_FAILED),finfo->filename);
+		if(finfo->filedata)	tor_free(finfo->filedata);
+		finfo->filedata = tor_malloc_zero(1);
+		len = 0;
+	}
+	finfo->filesize = finfo->allocsize = len;
+	tor_free(finfo->zdata);
+	finfo->zsize = 0;
+}
+
+/** Make sure that the contents of <b>finfo</b> are in memory. */
+static void file_ensure_loaded(file_info_t *finfo)
+{	finfo->last_used = get_time(NULL);
+	if(finfo->filedata)	return;
+	if(finfo->zdata)	file_uncompress(finfo);
+	else if(finfo->diskname)	load_file_contents(finfo);
+	else			dat_ensure_loaded(finfo);
+}
+
+/** Read every file that is not in memory yet and keep it there, e.g. before its copy on disk or in the .dat file goes away. */
+static void load_all_pending_files(void)
+{	file_info_t *finfo;
+	for(finfo = first_file;finfo;finfo = finfo->next)
+	{	file_ensure_loaded(finfo);
+		if(finfo->diskname)	tor_free(finfo->diskname);
+	}
+}
+
+/** If nobody is using the contents of <b>finfo</b> and we can read them again from the disk, release them. */
+static void release_file_contents(file_info_t *finfo)
+{	if(finfo->diskname && finfo->filedata && !finfo->n_maps)
+	{	tor_free(finfo->filedata);
+		finfo->allocsize = 0;
+	}
+}
+
+/** As get_file(), but the caller is about to change the contents of <b>fname</b>, so from now on they exist only in memory. */
+static file_info_t *get_file_for_writing(const char *fname)
+{	file_info_t *file = get_file(fname);
+	if(file->diskname)	tor_free(file->diskname);
+	file->dirty = 1;
+	file->incompressible = 0;
+	return file;
+}
+
+/** In read-only mode, compress the contents of the files that exist only in memory and that nobody used for FILE_COLD_AGE
+ * seconds, e.g. the cached consensus that we parsed at startup. file_ensure_loaded() uncompresses them when they are needed
+ * again. Files that are mapped or open for writing, and files that we can read again from the disk, are left alone. */
+void compress_cold_files(time_t now)
+{	file_info_t *finfo;
+	char *zdata;
+	size_t zsize;
+	if(!is_read_only())	return;
+	for(finfo = first_file;finfo;finfo = finfo->next)
+	{	if(!finfo->filedata || finfo->diskname || finfo->n_maps || finfo->n_writers || finfo->incompressible)	continue;
+		if(finfo->filesize < FILE_COLD_MIN_SIZE || finfo->last_used + FILE_COLD_AGE > now)	continue;
+		if(tor_gzip_compress(&zdata,&zsize,finfo->filedata,finfo->filesize,ZLIB_METHOD) < 0)
+		{	finfo->incompressible = 1;
+			continue;
+		}
+		if(zsize >= finfo->filesize - finfo->filesize / 4)
+		{	/* Not worth the time it takes to uncompress it again. */
+			tor_free(zdata);
+			finfo->incompressible = 1;
+			continue;
+		}
+		finfo->zdata = tor_realloc(zdata,zsize);
+		finfo->zsize = zsize;
+		tor_free(finfo->filedata);
+		finfo->allocsize = 0;
+	}
+}
+
 file_info_t *add_new_file(file_info_t *filelist,const char *getname)
 {	file_info_t *loadedfile;
 	char *fname = get_datadir_fname(getname);
@@ -235,7 +363,10 @@ void load_all_files(void)
 	new_file = add_new_file(new_file,DATADIR_FINGERPRINT);
 	new_file = add_new_file(new_file,DATADIR_GEOIP_STATS);
 	new_file = add_new_file(new_file,DATADIR_ROUTER_STABILITY);
+	new_file = add_new_file(new_file,DATADIR_ROUTER_STABILITY_BIN);
 	new_file = add_new_file(new_file,DATADIR_HSUSAGE);
+	new_file = add_new_file(new_file,DATADIR_PINNED_HS_DESCS);
+	new_file = add_new_file(new_file,DATADIR_VERIFIED_SIGNATURES);
 	new_file = add_new_filename(new_file,get_default_conf_file());
 
 	fname = get_datadir_fname(DATADIR_CACHED_STATUS);
@@ -314,13 +445,16 @@ void delete_config_filename(char *path)
 }
 
 void delete_dat_file(void)
-{	char *fname = get_datadir_fname_suffix(NULL,".dat");
+{	load_all_pending_files();
+	char *fname = get_datadir_fname_suffix(NULL,".dat");
 	delete_config_filename(fname);
 	tor_free(fname);
+	dat_forget_journal();
 }
 
 void delete_all_files(void)
 {	if((encryption&1) != 0)	return;
+	load_all_pending_files();
 	char *fname,*fname1;
 	int i,j,k;
 	char wcards[10];
@@ -346,7 +480,10 @@ void delete_all_files(void)
 	delete_config_file(DATADIR_FINGERPRINT);
 	delete_config_file(DATADIR_GEOIP_STATS);
 	delete_config_file(DATADIR_ROUTER_STABILITY);
+	delete_config_file(DATADIR_ROUTER_STABILITY_BIN);
 	delete_config_file(DATADIR_HSUSAGE);
+	delete_config_file(DATADIR_PINNED_HS_DESCS);
+	delete_config_file(DATADIR_VERIFIED_SIGNATURES);
 	delete_config_filename(get_default_conf_file());
 
 	fname = get_datadir_fname(DATADIR_CACHED_STATUS);
@@ -404,7 +541,8 @@ void delete_all_files(void)
 	tor_free(fname1);
 }
 
-file_info_t *find_file(const char *fname)
+/** Return the entry for <b>fname</b> in the list of files, without loading its contents. */
+static file_info_t *lookup_file(const char *fname)
 {	file_info_t *result;
 	const char *tmp;
 	tmp = fname;
@@ -420,6 +558,12 @@ file_info_t *find_file(const char *fname)
 	return result;
 }
 
+file_info_t *find_file(const char *fname)
+{	file_info_t *result = lookup_file(fname);
+	if(result)	file_ensure_loaded(result);
+	return result;
+}
+
 file_info_t *get_file(const char *fname)
 {	file_info_t *file = find_file(fname);
 	if(file)	return file;
@@ -461,85 +605,622 @@ char *get_file_name(char *fname)
 	return fname + strlen(exename);
 }
 
-char bufzero[4] = "\0\0\0\0";
+/* Encrypted .dat files start with DAT_MAGIC and a random nonce, followed by
+ * one section per file and a trailer.  Each section is a run of chunks: a
+ * 4-byte chunk header (the length of the chunk, with DAT_CHUNK_LAST set on
+ * the section's last chunk), the chunk encrypted with AES-CTR and an
+ * HMAC-SHA256 tag that also covers the chunk's position in the file.  The
+ * first chunk of a section holds the file time and name, the others hold the
+ * gzipped file contents, at most DAT_CHUNK_LEN bytes each.  The trailer is a
+ * zero chunk header and a tag over the number of sections.  Keys are derived
+ * from the password and the nonce, so every flush uses fresh keys.
+ *
+ * Sections are located when the .dat file is read but only decrypted when a
+ * file is first used, a chunk at a time.  Files without DAT_MAGIC are read
+ * with the old single-stream format.
+ *
+ * Rewriting the whole .dat file each time we save is slow on USB sticks and
+ * wears them, so a flush usually appends just the files that changed to a
+ * journal next to it.  Each append is a group: JNL_MAGIC, a random nonce,
+ * sections like those of the .dat file and a trailer.  The keys of a group
+ * are derived from its nonce XORed with the nonce of the .dat file, so a
+ * left-over journal of an older .dat file doesn't authenticate.  A section
+ * whose first chunk is also its last records a file that was removed.
+ * Groups are applied in order when the .dat file is read, and a torn last
+ * group is ignored and cut off by the next append.  When the journal grows
+ * past half the size of the .dat file, or the password changes, the next
+ * flush writes a new .dat file instead and the journal is deleted. */
+#define DAT_MAGIC "AdvOR\x02\r\n"
+#define DAT_MAGIC_LEN 8
+#define DAT_NONCE_LEN 16
+#define DAT_CHUNK_LEN 65536
+#define DAT_CHUNK_LAST 0x80000000U
+#define DAT_MAC_LEN DIGEST256_LEN
+#define JNL_MAGIC "AdvORj\r\n"
+#define JNL_MAGIC_LEN 8
+/** Let the journal grow to at least this many bytes before we compact it,
+ * however small the .dat file is. */
+#define JNL_MIN_COMPACT_SIZE (256*1024)
+
+/** Nonce of the .dat file we read or wrote last. */
+static char dat_nonce[DAT_NONCE_LEN];
+/** Size of that .dat file, or 0 if we have to write a new one. */
+static uint32_t dat_size = 0;
+/** Size of the valid groups at the start of the journal. */
+static uint32_t dat_journal_size = 0;
+/** Digest of the password that the .dat file was written with. */
+static char dat_password_digest[DIGEST256_LEN];
+/** Names, as get_file_name() returns them, of the files that were stored
+ * in the .dat file or its journal and were removed since the last flush. */
+static smartlist_t *dat_deleted_files = NULL;
+
+/** Store in <b>digest_out</b> a digest of the current password. */
+static void dat_password_hash(char *digest_out)
+{	size_t pwlen = password_size ? password_size : CIPHER_KEY_LEN;
+	if(pwlen > MAX_PASSWORD_SIZE)	pwlen = MAX_PASSWORD_SIZE;
+	crypto_digest256(digest_out,password,pwlen,DIGEST_SHA256);
+}
+
+/** Remember that the file <b>finfo</b>, which is going away or getting a new
+ * name, must be removed from the .dat file at the next flush. */
+static void dat_note_file_removed(file_info_t *finfo)
+{	if(!finfo->stored)	return;
+	if(!dat_deleted_files)	dat_deleted_files = smartlist_create();
+	smartlist_add(dat_deleted_files,tor_strdup(get_file_name(finfo->filename)));
+	finfo->stored = 0;
+}
+
+/** Forget the files that were removed since the last flush. */
+static void dat_free_deleted_files(void)
+{	if(!dat_deleted_files)	return;
+	SMARTLIST_FOREACH(dat_deleted_files,char *,cp,tor_free(cp));
+	smartlist_free(dat_deleted_files);
+	dat_deleted_files = NULL;
+}
+
+/** Delete the journal, and forget what we knew about the .dat file. */
+static void dat_forget_journal(void)
+{	char *fname = get_datadir_fname_suffix(NULL,".jnl");
+	delete_config_filename(fname);
+	tor_free(fname);
+	dat_size = dat_journal_size = 0;
+	dat_free_deleted_files();
+}
+
+/** Derive the cipher and MAC keys for a .dat file with nonce <b>nonce</b>
+ * from the current password. */
+static void dat_derive_keys(const char *nonce,char *key_out,char *mac_key_out)
+{	char msg[16+DAT_NONCE_LEN];
+	char out[DIGEST256_LEN];
+	size_t pwlen = password_size ? password_size : CIPHER_KEY_LEN;
+	if(pwlen > MAX_PASSWORD_SIZE)	pwlen = MAX_PASSWORD_SIZE;
+	memcpy(msg,"AdvOR data key\0\0",16);
+	memcpy(msg+16,nonce,DAT_NONCE_LEN);
+	crypto_hmac_sha256(out,password,pwlen,msg,sizeof(msg));
+	memcpy(key_out,out,CIPHER_KEY_LEN);
+	memcpy(msg,"AdvOR data mac\0\0",16);
+	crypto_hmac_sha256(mac_key_out,password,pwlen,msg,sizeof(msg));
+	memset(out,0,sizeof(out));
+}
+
+/** Compute the tag of chunk <b>chunk</b> of section <b>section</b>, with
+ * chunk header <b>header</b> and ciphertext <b>data</b>. */
+static void dat_chunk_mac(char *mac_out,const char *mac_key,uint32_t section,uint32_t chunk,uint32_t header,const char *data,size_t len)
+{	char msg[12+DIGEST256_LEN];
+	memcpy(msg,&section,4);
+	memcpy(msg+4,&chunk,4);
+	memcpy(msg+8,&header,4);
+	crypto_digest256(msg+12,data,len,DIGEST_SHA256);
+	crypto_hmac_sha256(mac_out,mac_key,DIGEST256_LEN,msg,sizeof(msg));
+}
+
+/** Point <b>cipher</b> at the keystream of the given chunk. */
+static void dat_chunk_iv(crypto_cipher_env_t *cipher,uint32_t section,uint32_t chunk)
+{	char iv[CIPHER_IV_LEN];
+	memset(iv,0,sizeof(iv));
+	memcpy(iv,&section,4);
+	memcpy(iv+4,&chunk,4);
+	crypto_cipher_set_iv(cipher,iv);
+}
+
+/** Read exactly <b>len</b> bytes from <b>hFile</b>.  Return 0 on success. */
+static int dat_read(HANDLE hFile,void *buf,DWORD len)
+{	DWORD bytesRead = 0;
+	if(!ReadFile(hFile,buf,len,&bytesRead,NULL) || bytesRead != len)	return -1;
+	return 0;
+}
+
+/** Read, check and decrypt the next chunk of the .dat file into <b>buf</b>,
+ * which must hold DAT_CHUNK_LEN bytes.  Store its length in <b>len_out</b>
+ * and whether it ends its section in <b>last_out</b>.  Return 0 on success,
+ * 1 if we reached the trailer and it is valid, -1 on failure. */
+static int dat_read_chunk(HANDLE hFile,crypto_cipher_env_t *cipher,const char *mac_key,uint32_t section,uint32_t chunk,char *buf,char *cbuf,uint32_t *len_out,int *last_out)
+{	uint32_t header,len;
+	char mac[DAT_MAC_LEN],mac1[DAT_MAC_LEN];
+	if(dat_read(hFile,&header,4))	return -1;
+	len = header & ~DAT_CHUNK_LAST;
+	if(len > DAT_CHUNK_LEN)	return -1;
+	if(dat_read(hFile,cbuf,len) || dat_read(hFile,mac,DAT_MAC_LEN))	return -1;
+	if(!header)	chunk = 0xffffffffU;
+	dat_chunk_mac(mac1,mac_key,section,chunk,header,cbuf,len);
+	if(tor_memneq(mac,mac1,DAT_MAC_LEN))	return -1;
+	if(!header)	return 1;
+	dat_chunk_iv(cipher,section,chunk);
+	crypto_cipher_decrypt(cipher,buf,cbuf,len);
+	*len_out = len;
+	*last_out = (header & DAT_CHUNK_LAST) != 0;
+	return 0;
+}
+
+/** Skip the rest of the current section of the .dat file.  Return 0 on
+ * success. */
+static int dat_skip_section(HANDLE hFile)
+{	uint32_t header;
+	LONG high = 0;
+	do
+	{	if(dat_read(hFile,&header,4))	return -1;
+		if(!header || (header & ~DAT_CHUNK_LAST) > DAT_CHUNK_LEN)	return -1;
+		if(SetFilePointer(hFile,(header & ~DAT_CHUNK_LAST) + DAT_MAC_LEN,&high,FILE_CURRENT) == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
+			return -1;
+	}	while(!(header & DAT_CHUNK_LAST));
+	return 0;
+}
+
+/** Read the nonce and the section list of a chunked .dat file, whose magic
+ * we have already read from <b>hFile</b>.  Add each file to the file list
+ * without loading its contents. */
+static void dat_read_sections(HANDLE hFile)
+{	char nonce[DAT_NONCE_LEN];
+	char *buf,*cbuf;
+	crypto_cipher_env_t *cipher;
+	file_info_t *finfo,*filelist;
+	uint32_t len,section;
+	LONG high;
+	DWORD pos;
+	int last,k,r;
+	if(dat_read(hFile,nonce,DAT_NONCE_LEN))	return;
+	dat_derive_keys(nonce,dat_key,dat_mac_key);
+	memcpy(dat_nonce,nonce,DAT_NONCE_LEN);
+	if(!(cipher = crypto_create_init_cipher(dat_key,0)))	return;
+	buf = tor_malloc(DAT_CHUNK_LEN+1);
+	cbuf = tor_malloc(DAT_CHUNK_LEN);
+	filelist = first_file;
+	if(filelist)
+	{	while(filelist->next)	filelist = filelist->next;
+	}
+	for(section = 0;;section++)
+	{	r = dat_read_chunk(hFile,cipher,dat_mac_key,section,0,buf,cbuf,&len,&last);
+		if(r)
+		{	/* A bad first section just means a wrong password. */
+			if(r < 0 && section)	log_warn(LD_FS,get_lang_str(LANG_LOG_FILE_IO_DAT_TRUNCATED));
+			/* Only a complete .dat file can take a journal. */
+			if(r > 0)
+			{	dat_size = GetFileSize(hFile,NULL);
+				dat_password_hash(dat_password_digest);
+			}
+			break;
+		}
+		if(len < 9 || last)	break;
+		buf[len] = 0;
+		high = 0;
+		pos = SetFilePointer(hFile,0,&high,FILE_CURRENT);
+		if(pos == INVALID_SET_FILE_POINTER || high)	break;
+		finfo = tor_malloc_zero(sizeof(file_info_t));
+		memcpy(&finfo->filetime,buf,8);
+		k = strlen(buf+8) + strlen(exename) + 2;
+		finfo->filename = tor_malloc(k);
+		tor_snprintf(finfo->filename,k,"%s%s",exename,buf+8);
+		finfo->dat_offset = pos;
+		finfo->dat_section = section;
+		finfo->stored = 1;
+		if(filelist)	filelist->next = finfo;
+		else	first_file = finfo;
+		filelist = finfo;
+		if(dat_skip_section(hFile))
+		{	log_warn(LD_FS,get_lang_str(LANG_LOG_FILE_IO_DAT_TRUNCATED));
+			break;
+		}
+	}
+	memset(buf,0,DAT_CHUNK_LEN+1);
+	tor_free(buf);
+	tor_free(cbuf);
+	crypto_free_cipher_env(cipher);
+}
+
+/** Decrypt and uncompress the contents chunks of section <b>section</b>,
+ * which start at the current position of <b>hFile</b>, into a newly
+ * allocated <b>finfo</b>->filedata.  <b>buf</b> and <b>cbuf</b> must hold
+ * DAT_CHUNK_LEN bytes each.  Return 0 on success, -1 if the section is
+ * corrupt. */
+static int dat_read_contents(HANDLE hFile,crypto_cipher_env_t *cipher,const char *mac_key,uint32_t section,file_info_t *finfo,char *buf,char *cbuf)
+{	tor_zlib_state_t *zlib;
+	char *out;
+	const char *in;
+	size_t in_len,out_len;
+	uint32_t len,chunk;
+	int last = 0,ok = 0;
+	finfo->allocsize = 1024;
+	finfo->filesize = 0;
+	finfo->filedata = tor_malloc(finfo->allocsize);
+	zlib = tor_zlib_new(0,GZIP_METHOD);
+	for(chunk = 1;zlib && !last;chunk++)
+	{	if(dat_read_chunk(hFile,cipher,mac_key,section,chunk,buf,cbuf,&len,&last))	break;
+		in = buf;
+		in_len = len;
+		while(1)
+		{	out = finfo->filedata + finfo->filesize;
+			out_len = finfo->allocsize - finfo->filesize - 1;
+			tor_zlib_output_t r = tor_zlib_process(zlib,&out,&out_len,&in,&in_len,last);
+			finfo->filesize = out - finfo->filedata;
+			if(r == TOR_ZLIB_ERR)	break;
+			if(r == TOR_ZLIB_DONE)
+			{	ok = last;
+				break;
+			}
+			if(r == TOR_ZLIB_BUF_FULL || out_len == 0)
+			{	finfo->allocsize *= 2;
+				finfo->filedata = tor_realloc(finfo->filedata,finfo->allocsize);
+			}
+			else if(!in_len)
+			{	ok = last;
+				break;
+			}
+		}
+		if(!ok && last)	break;
+	}
+	memset(buf,0,DAT_CHUNK_LEN);
+	if(zlib)	tor_zlib_free(zlib);
+	if(!ok)	finfo->filesize = 0;
+	finfo->filedata[finfo->filesize] = 0;
+	return ok ? 0 : -1;
+}
+
+/** Decrypt and uncompress the contents of <b>finfo</b> from its section of
+ * the .dat file, one chunk at a time. */
+static void dat_load_section(file_info_t *finfo)
+{	char *fname = get_datadir_fname_suffix(NULL,".dat");
+	HANDLE hFile = open_file(fname,GENERIC_READ,OPEN_EXISTING);
+	crypto_cipher_env_t *cipher = NULL;
+	char *buf,*cbuf;
+	int ok = 0;
+	LONG high = 0;
+	tor_free(fname);
+	if(hFile == INVALID_HANDLE_VALUE)
+	{	finfo->allocsize = 1024;
+		finfo->filesize = 0;
+		finfo->filedata = tor_malloc_zero(finfo->allocsize);
+		return;
+	}
+	if(SetFilePointer(hFile,finfo->dat_offset,&high,FILE_BEGIN) != INVALID_SET_FILE_POINTER && (cipher = crypto_create_init_cipher(dat_key,0)) != NULL)
+	{	buf = tor_malloc(DAT_CHUNK_LEN);
+		cbuf = tor_malloc(DAT_CHUNK_LEN);
+		ok = !dat_read_contents(hFile,cipher,dat_mac_key,finfo->dat_section,finfo,buf,cbuf);
+		tor_free(buf);
+		tor_free(cbuf);
+	}
+	if(cipher)	crypto_free_cipher_env(cipher);
+	CloseHandle(hFile);
+	if(!ok)
+	{	log_warn(LD_FS,get_lang_str(LANG_LOG_FILE_IO_DAT_SECTION_CORRUPT),finfo->filename);
+		if(!finfo->filedata)
+		{	finfo->allocsize = 1024;
+			finfo->filedata = tor_malloc(finfo->allocsize);
+		}
+		finfo->filesize = 0;
+		finfo->filedata[0] = 0;
+	}
+}
+
+/** If the contents of <b>finfo</b> are still in the .dat file, load them. */
+static void dat_ensure_loaded(file_info_t *finfo)
+{	if(!finfo->filedata && finfo->dat_offset)
+		dat_load_section(finfo);
+	finfo->dat_offset = 0;
+}
+
+/** Encrypt, tag and write one chunk of the .dat file.  Return 0 on
+ * success. */
+static int dat_write_chunk(HANDLE hFile,crypto_cipher_env_t *cipher,const char *mac_key,uint32_t section,uint32_t chunk,int last,const char *data,char *cbuf,uint32_t len)
+{	uint32_t header = len | (last ? DAT_CHUNK_LAST : 0);
+	char mac[DAT_MAC_LEN];
+	DWORD bytesWritten;
+	dat_chunk_iv(cipher,section,chunk);
+	crypto_cipher_encrypt(cipher,cbuf,data,len);
+	dat_chunk_mac(mac,mac_key,section,chunk,header,cbuf,len);
+	if(!WriteFile(hFile,&header,4,&bytesWritten,NULL) || bytesWritten != 4)	return -1;
+	if(len && (!WriteFile(hFile,cbuf,len,&bytesWritten,NULL) || bytesWritten != len))	return -1;
+	if(!WriteFile(hFile,mac,DAT_MAC_LEN,&bytesWritten,NULL) || bytesWritten != DAT_MAC_LEN)	return -1;
+	return 0;
+}
+
+/** Write <b>finfo</b> as section <b>section</b> of the .dat file,
+ * compressing and encrypting it a chunk at a time.  Return 0 on success. */
+static int dat_write_section(HANDLE hFile,crypto_cipher_env_t *cipher,const char *mac_key,uint32_t section,file_info_t *finfo,char *buf,char *cbuf)
+{	char *filename = get_file_name(finfo->filename);
+	size_t k = strlen(filename)+1;
+	tor_zlib_state_t *zlib;
+	const char *in;
+	char *out;
+	size_t in_len,out_len;
+	uint32_t chunk = 1;
+	int r = -1;
+	if(k + 8 > DAT_CHUNK_LEN)	return -1;
+	memcpy(buf,&finfo->filetime,8);
+	memcpy(buf+8,filename,k);
+	if(dat_write_chunk(hFile,cipher,mac_key,section,0,0,buf,cbuf,8+k))	return -1;
+	if(!(zlib = tor_zlib_new(1,GZIP_METHOD)))	return -1;
+	in = finfo->filedata;
+	in_len = finfo->filesize;
+	out = buf;
+	out_len = DAT_CHUNK_LEN;
+	while(1)
+	{	tor_zlib_output_t z = tor_zlib_process(zlib,&out,&out_len,&in,&in_len,1);
+		if(z == TOR_ZLIB_ERR)	break;
+		if(z == TOR_ZLIB_DONE)
+		{	r = dat_write_chunk(hFile,cipher,mac_key,section,chunk,1,buf,cbuf,DAT_CHUNK_LEN - out_len);
+			break;
+		}
+		if(!out_len)
+		{	if(dat_write_chunk(hFile,cipher,mac_key,section,chunk++,0,buf,cbuf,DAT_CHUNK_LEN))	break;
+			out = buf;
+			out_len = DAT_CHUNK_LEN;
+		}
+	}
+	tor_zlib_free(zlib);
+	return r;
+}
+
+/** Derive the keys of a journal group with nonce <b>nonce</b>. */
+static void dat_derive_journal_keys(const char *nonce,char *key_out,char *mac_key_out)
+{	char n[DAT_NONCE_LEN];
+	int i;
+	for(i = 0;i < DAT_NONCE_LEN;i++)	n[i] = nonce[i] ^ dat_nonce[i];
+	dat_derive_keys(n,key_out,mac_key_out);
+}
+
+/** Replace the file that <b>finfo</b> has the name of, if any, by
+ * <b>finfo</b>; if <b>finfo</b> has no contents, it records the removal of
+ * that file, and is freed. */
+static void dat_apply_journal_record(file_info_t *finfo)
+{	file_info_t *old = lookup_file(finfo->filename),*prev;
+	if(old)
+	{	if(first_file == old)	first_file = old->next;
+		else
+		{	for(prev = first_file;prev && prev->next != old;prev = prev->next)	;
+			if(prev)	prev->next = old->next;
+		}
+		unload_file(old);
+	}
+	if(!finfo->filedata)
+	{	unload_file(finfo);
+		return;
+	}
+	finfo->stored = 1;
+	if(!first_file)	first_file = finfo;
+	else
+	{	for(prev = first_file;prev->next;prev = prev->next)	;
+		prev->next = finfo;
+	}
+}
+
+/** Apply the complete groups of the journal of the .dat file that we just
+ * read to the list of files. */
+static void dat_read_journal(void)
+{	char *fname = get_datadir_fname_suffix(NULL,".jnl");
+	HANDLE hFile = open_file(fname,GENERIC_READ,OPEN_EXISTING);
+	char magic[JNL_MAGIC_LEN],nonce[DAT_NONCE_LEN];
+	char key[CIPHER_KEY_LEN],mac_key[DIGEST256_LEN];
+	char *buf,*cbuf;
+	crypto_cipher_env_t *cipher;
+	smartlist_t *records;
+	file_info_t *finfo;
+	uint32_t len,section;
+	DWORD pos;
+	int last,k,r,ok;
+	tor_free(fname);
+	dat_journal_size = 0;
+	if(hFile == INVALID_HANDLE_VALUE)	return;
+	buf = tor_malloc(DAT_CHUNK_LEN+1);
+	cbuf = tor_malloc(DAT_CHUNK_LEN);
+	records = smartlist_create();
+	while(!dat_read(hFile,magic,JNL_MAGIC_LEN) && !memcmp(magic,JNL_MAGIC,JNL_MAGIC_LEN) && !dat_read(hFile,nonce,DAT_NONCE_LEN))
+	{	dat_derive_journal_keys(nonce,key,mac_key);
+		if(!(cipher = crypto_create_init_cipher(key,0)))	break;
+		ok = 0;
+		for(section = 0;;section++)
+		{	r = dat_read_chunk(hFile,cipher,mac_key,section,0,buf,cbuf,&len,&last);
+			if(r)
+			{	ok = r > 0;
+				break;
+			}
+			if(len < 9)	break;
+			buf[len] = 0;
+			finfo = tor_malloc_zero(sizeof(file_info_t));
+			memcpy(&finfo->filetime,buf,8);
+			k = strlen(buf+8) + strlen(exename) + 2;
+			finfo->filename = tor_malloc(k);
+			tor_snprintf(finfo->filename,k,"%s%s",exename,buf+8);
+			smartlist_add(records,finfo);
+			/* A first chunk that ends its section records a removal. */
+			if(!last && dat_read_contents(hFile,cipher,mac_key,section,finfo,buf,cbuf))	break;
+		}
+		crypto_free_cipher_env(cipher);
+		if(!ok)	break;
+		SMARTLIST_FOREACH(records,file_info_t *,f,dat_apply_journal_record(f));
+		smartlist_clear(records);
+		pos = SetFilePointer(hFile,0,NULL,FILE_CURRENT);
+		if(pos == INVALID_SET_FILE_POINTER)	break;
+		dat_journal_size = pos;
+	}
+	SMARTLIST_FOREACH(records,file_info_t *,f,unload_file(f));
+	smartlist_free(records);
+	memset(buf,0,DAT_CHUNK_LEN+1);
+	memset(key,0,sizeof(key));
+	memset(mac_key,0,sizeof(mac_key));
+	tor_free(buf);
+	tor_free(cbuf);
+	CloseHandle(hFile);
+}
+
+/** Write a section that records the removal of the file <b>filename</b>.
+ * Return 0 on success. */
+static int dat_write_removal(HANDLE hFile,crypto_cipher_env_t *cipher,const char *mac_key,uint32_t section,const char *filename,char *buf,char *cbuf)
+{	size_t k = strlen(filename)+1;
+	if(k + 8 > DAT_CHUNK_LEN)	return -1;
+	memset(buf,0,8);
+	memcpy(buf+8,filename,k);
+	return dat_write_chunk(hFile,cipher,mac_key,section,0,1,buf,cbuf,8+k);
+}
+
+/** True iff the .dat file doesn't have the current contents of
+ * <b>finfo</b>. */
+#define dat_file_changed(finfo) ((finfo)->dirty || (!(finfo)->stored && (finfo)->filesize))
+
+/** Append the files that changed since the last flush to the journal.
+ * Return 0 on success or if nothing changed, or -1 if the caller should
+ * write a new .dat file instead. */
+static int dat_flush_journal(void)
+{	char *fname;
+	char digest[DIGEST256_LEN],nonce[DAT_NONCE_LEN];
+	char key[CIPHER_KEY_LEN],mac_key[DIGEST256_LEN];
+	char *buf,*cbuf;
+	crypto_cipher_env_t *cipher;
+	file_info_t *finfo;
+	HANDLE hFile;
+	DWORD bytesWritten,pos;
+	uint64_t pending = 0;
+	uint32_t limit,section = 0;
+	int n = 0,ok = 0;
+	if(!dat_size)	return -1;
+	dat_password_hash(digest);
+	ok = tor_memeq(digest,dat_password_digest,DIGEST256_LEN);
+	memset(digest,0,sizeof(digest));
+	if(!ok)	return -1;
+	if(dat_deleted_files)	n = smartlist_len(dat_deleted_files);
+	for(finfo = first_file;finfo;finfo = finfo->next)
+	{	if(dat_file_changed(finfo))
+		{	pending += finfo->filesize;
+			n++;
+		}
+	}
+	if(!n)	return 0;
+	/* Gzip only makes the files smaller, so this is how big the group can get. */
+	limit = dat_size / 2;
+	if(limit < JNL_MIN_COMPACT_SIZE)	limit = JNL_MIN_COMPACT_SIZE;
+	if(dat_journal_size + pending + 1024 * n > limit)	return -1;
+	fname = get_datadir_fname_suffix(NULL,".jnl");
+	hFile = open_file(fname,GENERIC_WRITE,OPEN_ALWAYS);
+	if(hFile == INVALID_HANDLE_VALUE)
+	{	tor_free(fname);
+		return -1;
+	}
+	ok = 0;
+	/* Cut off whatever a torn append left behind the last good group. */
+	if(SetFilePointer(hFile,dat_journal_size,NULL,FILE_BEGIN) != INVALID_SET_FILE_POINTER && SetEndOfFile(hFile))
+	{	crypto_rand(nonce,DAT_NONCE_LEN);
+		dat_derive_journal_keys(nonce,key,mac_key);
+		buf = tor_malloc(DAT_CHUNK_LEN);
+		cbuf = tor_malloc(DAT_CHUNK_LEN);
+		cipher = crypto_create_init_cipher(key,1);
+		if(cipher && WriteFile(hFile,JNL_MAGIC,JNL_MAGIC_LEN,&bytesWritten,NULL) && WriteFile(hFile,nonce,DAT_NONCE_LEN,&bytesWritten,NULL))
+		{	ok = 1;
+			/* Removals go first, so that a file that was renamed over another one is not removed again. */
+			if(dat_deleted_files)
+			{	SMARTLIST_FOREACH(dat_deleted_files,const char *,name,
+				{	if(ok && dat_write_removal(hFile,cipher,mac_key,section++,name,buf,cbuf))	ok = 0;
+				});
+			}
+			for(finfo = first_file;finfo && ok;finfo = finfo->next)
+			{	if(!dat_file_changed(finfo))	continue;
+				if(finfo->filesize)
+				{	if(dat_write_section(hFile,cipher,mac_key,section++,finfo,buf,cbuf))	ok = 0;
+				}
+				else if(finfo->stored && dat_write_removal(hFile,cipher,mac_key,section++,get_file_name(finfo->filename),buf,cbuf))	ok = 0;
+			}
+			if(ok && dat_write_chunk(hFile,cipher,mac_key,section,0xffffffffU,0,buf,cbuf,0))	ok = 0;
+		}
+		if(cipher)	crypto_free_cipher_env(cipher);
+		memset(buf,0,DAT_CHUNK_LEN);
+		tor_free(buf);
+		tor_free(cbuf);
+		memset(key,0,sizeof(key));
+		memset(mac_key,0,sizeof(mac_key));
+	}
+	pos = ok ? SetFilePointer(hFile,0,NULL,FILE_CURRENT) : INVALID_SET_FILE_POINTER;
+	if(pos == INVALID_SET_FILE_POINTER)
+	{	/* Don't leave half a group behind; a new .dat file replaces the journal anyway. */
+		SetFilePointer(hFile,dat_journal_size,NULL,FILE_BEGIN);
+		SetEndOfFile(hFile);
+		CloseHandle(hFile);
+		log_warn(LD_FS,get_lang_str(LANG_LOG_FILE_IO_DAT_WRITE_FAILED),fname);
+		tor_free(fname);
+		return -1;
+	}
+	CloseHandle(hFile);
+	tor_free(fname);
+	dat_journal_size = pos;
+	for(finfo = first_file;finfo;finfo = finfo->next)
+	{	if(dat_file_changed(finfo))	finfo->stored = finfo->filesize != 0;
+		finfo->dirty = 0;
+	}
+	dat_free_deleted_files();
+	return 0;
+}
+
+/** Save the files we keep in memory: append the ones that changed to the journal of the .dat file if we can, or write a new .dat file. */
 void flush_configuration_data(void)
 {	HANDLE hFile;
 	file_info_t *finfo;
 	if((encryption & 2) == 0 || (encryption&1) != 0)	return;
+	watchdog_push("flush_configuration_data",NULL);
+	if(password && !dat_flush_journal())
+	{	watchdog_pop();
+		return;
+	}
 	if(password)
 	{	char *fname = get_datadir_fname_suffix(NULL,".new");
-		#ifdef RANDOMIZE_ENCRYPTION
-			char *random_garbage;
-		#endif
-		char *wbuf,*cbuf;
+		char nonce[DAT_NONCE_LEN];
+		char key[CIPHER_KEY_LEN],mac_key[DIGEST256_LEN];
+		char *buf,*cbuf;
 		crypto_cipher_env_t *env1;
-		int i,j,k;
-		uint32_t fsize;
-		#ifdef RANDOMIZE_ENCRYPTION
-			uint32_t ssize = crypto_rand_int(512)+256;
-		#endif
+		uint32_t section = 0,size = 0;
+		int i,j,ok = 0;
+		load_all_pending_files();
 		hFile=open_file(fname,GENERIC_WRITE,CREATE_ALWAYS);
 		if(hFile != INVALID_HANDLE_VALUE)
 		{	DWORD bytesWritten;
-			#ifdef RANDOMIZE_ENCRYPTION
-				random_garbage = tor_malloc(ssize);
-				crypto_rand(random_garbage,ssize);
-				WriteFile(hFile,&ssize,2,&bytesWritten,NULL);
-				WriteFile(hFile,random_garbage,ssize,&bytesWritten,NULL);
-			#endif
-			finfo = first_file;
-			env1 = crypto_new_cipher_env();
-			crypto_cipher_set_key(env1,password);
-			crypto_cipher_encrypt_init_cipher(env1);
-			while(finfo)
-			{	if(finfo->filesize)
-				{	char *filename = get_file_name(finfo->filename);
-					k = strlen(filename)+1;
-					i = finfo->filesize+k+8+4;
-					fsize = finfo->filesize + k;
-					char *compressed = NULL;
-					size_t cbytes = 0;
-					if(!tor_gzip_compress(&compressed,&cbytes,finfo->filedata,finfo->filesize,GZIP_METHOD))
-					{	i = i + cbytes - finfo->filesize;
-						fsize = fsize + cbytes - finfo->filesize;
-						wbuf = tor_malloc(i);
-						cbuf = tor_malloc(i+1024);
-						memcpy(wbuf,&fsize,4);
-						memcpy(wbuf+4,&finfo->filetime,8);
-						memcpy(wbuf+12,filename,k);
-						memcpy(wbuf+12+k,compressed,cbytes);
-						tor_free(compressed);
-					}
-					else
-					{	wbuf = tor_malloc(i);
-						cbuf = tor_malloc(i+1024);
-						memcpy(wbuf,&fsize,4);
-						memcpy(wbuf+4,&finfo->filetime,8);
-						memcpy(wbuf+12,filename,k);
-						memcpy(wbuf+12+k,finfo->filedata,finfo->filesize);
+			crypto_rand(nonce,DAT_NONCE_LEN);
+			dat_derive_keys(nonce,key,mac_key);
+			buf = tor_malloc(DAT_CHUNK_LEN);
+			cbuf = tor_malloc(DAT_CHUNK_LEN);
+			env1 = crypto_create_init_cipher(key,1);
+			if(env1 && WriteFile(hFile,DAT_MAGIC,DAT_MAGIC_LEN,&bytesWritten,NULL) && WriteFile(hFile,nonce,DAT_NONCE_LEN,&bytesWritten,NULL))
+			{	ok = 1;
+				for(finfo = first_file;finfo && ok;finfo = finfo->next)
+				{	if(finfo->filesize)
+					{	if(dat_write_section(hFile,env1,mac_key,section,finfo,buf,cbuf))	ok = 0;
+						else	section++;
 					}
-					#ifdef RANDOMIZE_ENCRYPTION
-						k=0;
-						for(j=12;j<i;j++)
-						{	wbuf[j] ^= random_garbage[k];
-							k++;
-							if(k >= ssize)	k = 0;
-						}
-					#endif
-					memcpy(cbuf,wbuf,12);
-					crypto_cipher_encrypt(env1,cbuf+4,wbuf+4,i-4);
-					WriteFile(hFile,cbuf,i,&bytesWritten,NULL);
-					tor_free(wbuf);
-					tor_free(cbuf);
 				}
-				finfo = finfo->next;
+				/* The trailer tells a reader that no section is missing. */
+				if(ok && dat_write_chunk(hFile,env1,mac_key,section,0xffffffffU,0,buf,cbuf,0))	ok = 0;
 			}
-			WriteFile(hFile,&bufzero,4,&bytesWritten,NULL);
+			if(ok)	size = GetFileSize(hFile,NULL);
 			CloseHandle(hFile);
-			crypto_free_cipher_env(env1);
-			#ifdef RANDOMIZE_ENCRYPTION
-				tor_free(random_garbage);
-			#endif
+			if(env1)	crypto_free_cipher_env(env1);
+			memset(buf,0,DAT_CHUNK_LEN);
+			tor_free(buf);
+			tor_free(cbuf);
+			memset(key,0,sizeof(key));
+			memset(mac_key,0,sizeof(mac_key));
+		}
+		if(!ok)
+		{	/* Keep the last good .dat file. */
+			log_warn(LD_FS,get_lang_str(LANG_LOG_FILE_IO_DAT_WRITE_FAILED),fname);
+			delete_config_filename(fname);
+			tor_free(fname);
+			watchdog_pop();
+			return;
 		}
 		delete_dat_file();
 		char *fnametmp = get_datadir_fname_suffix(NULL,".dat");
@@ -556,9 +1237,20 @@ void flush_configuration_data(void)
 		tor_free(tmp);
 		tor_free(tmp1);
 		tor_free(fname);
+		/* delete_dat_file() also deleted the journal. */
+		if(i && size != INVALID_FILE_SIZE)
+		{	memcpy(dat_nonce,nonce,DAT_NONCE_LEN);
+			dat_size = size;
+			dat_password_hash(dat_password_digest);
+			for(finfo = first_file;finfo;finfo = finfo->next)
+			{	finfo->stored = finfo->filesize != 0;
+				finfo->dirty = 0;
+			}
+		}
 	}
 	else
-	{	finfo = first_file;
+	{	load_all_pending_files();
+		finfo = first_file;
 		DWORD bytesWritten;
 		char *fpath = tor_malloc(MAX_PATH+1);
 		while(finfo)
@@ -572,6 +1264,7 @@ void flush_configuration_data(void)
 		}
 		tor_free(fpath);
 	}
+	watchdog_pop();
 }
 
 void read_configuration_data(void)
@@ -589,8 +1282,13 @@ void read_configuration_data(void)
 			if(!DialogBoxParamW(hInstance,(LPWSTR)MAKEINTRESOURCE(1015),hMainDialog,&dlgGetPassword,0) || !password)
 				ExitProcess(0);
 		}
-		if(password)
-		{
+		char magic[DAT_MAGIC_LEN];
+		if(password && !dat_read(hFile,magic,DAT_MAGIC_LEN) && !memcmp(magic,DAT_MAGIC,DAT_MAGIC_LEN))
+		{	dat_read_sections(hFile);
+			if(dat_size)	dat_read_journal();
+		}
+		else if(password)
+		{	SetFilePointer(hFile,0,NULL,FILE_BEGIN);
 			#ifdef RANDOMIZE_ENCRYPTION
 				ReadFile(hFile,&ssize,2,&bytesRead,NULL);
 				if(bytesRead)
@@ -689,7 +1387,7 @@ int ftime_definitely_before(time_t now, time_t when)	/* It is definitely before
 int delete_file(char *fname)
 {	if(encryption)
 	{	file_info_t *file1,*file2;
-		file1 = find_file(fname);
+		file1 = lookup_file(fname);
 		if(file1)
 		{	if(first_file == file1)	first_file = file1->next;
 			else
@@ -699,6 +1397,7 @@ int delete_file(char *fname)
 				{	file2->next = file1->next;
 				}
 			}
+			dat_note_file_removed(file1);
 			unload_file(file1);
 		}
 		return 0;
@@ -716,9 +1415,9 @@ int delete_file(char *fname)
 /** Rename the file <b>from</b> to the file <b>to</b>.  On unix, this is the same as rename(2). On windows, this removes <b>to</b> first if it already exists. Returns 0 on success. Returns -1 and sets errno on failure. */
 int replace_file(char *from,char *to)
 {	if(encryption)
-	{	file_info_t *file1 = find_file(to);
+	{	file_info_t *file1 = lookup_file(to);
 		if(file1)	delete_file(file1->filename);
-		file1 = find_file(from);
+		file1 = lookup_file(from);
 		if(!file1)	return -1;
 		char *tmp;
 		tmp=to;
@@ -726,8 +1425,10 @@ int replace_file(char *from,char *to)
 		{	if(tmp[0]=='\\' && tmp[1]!=0)	to = tmp+1;
 			tmp++;
 		}
+		dat_note_file_removed(file1);
 		tor_free(file1->filename);
 		file1->filename = tor_strdup(to);
+		file1->dirty = 1;
 		return 0;
 	}
 	switch(file_status(to))
@@ -761,7 +1462,7 @@ int replace_file(char *from,char *to)
 /** Return FN_ERROR if filename can't be read, FN_NOENT if it doesn't exist, FN_FILE if it is a regular file, or FN_DIR if it's a directory.  On FN_ERROR, sets errno. */
 file_status_t file_status(char *fname)
 {	if(encryption)
-	{	if(find_file(fname))	return FN_FILE;
+	{	if(lookup_file(fname))	return FN_FILE;
 		return FN_NOENT;
 	}
 	int i=strlen(fname)+1;
@@ -795,7 +1496,8 @@ int start_writing_to_file(char *fname,open_file_t **data_out)
 	tor_snprintf(new_file->tempname, tempname_len, "%s.tmp", fname);
 	*data_out = new_file;
 	if(encryption)
-	{	new_file->mem_file = get_file(fname);
+	{	new_file->mem_file = get_file_for_writing(fname);
+		new_file->mem_file->n_writers++;
 		return 1;
 	}
 	new_file->hFile = open_file(fname,GENERIC_WRITE,CREATE_ALWAYS);
@@ -822,7 +1524,8 @@ int start_appending_to_file(char *fname,open_file_t **data_out)
 	tor_snprintf(new_file->tempname, tempname_len, "%s.tmp", fname);
 	*data_out = new_file;
 	if(encryption)
-	{	new_file->mem_file = get_file(fname);
+	{	new_file->mem_file = get_file_for_writing(fname);
+		new_file->mem_file->n_writers++;
 		return 1;
 	}
 	new_file->hFile = open_file(fname,GENERIC_READ|GENERIC_WRITE,OPEN_ALWAYS);
@@ -846,6 +1549,7 @@ int finish_writing_to_file(open_file_t *file_data, int abort_write)
 	tor_assert(file_data && file_data->filename);
 	if(encryption && file_data->mem_file)
 	{	file_data->mem_file->filetime = get_time(NULL);
+		file_data->mem_file->n_writers--;
 	}
 	else
 	{	if(file_data->hFile && !CloseHandle(file_data->hFile))
@@ -932,7 +1636,7 @@ int write_chunks_to_file(char *fname,smartlist_t *chunks, int bin)
 		SMARTLIST_FOREACH(chunks, sized_chunk_t *, chunk,
 		{	bufsize += chunk->len;
 		});
-		file_info_t *file = get_file(fname);
+		file_info_t *file = get_file_for_writing(fname);
 		char *tmp = file->filedata;
 		file->filedata = tor_malloc(bufsize);
 		file->filesize = bufsize;
@@ -971,7 +1675,7 @@ int write_chunks_to_file(char *fname,smartlist_t *chunks, int bin)
 /** As write_str_to_file, but does not assume a NUL-terminated string. Instead, we write <b>bufsize</b> bytes, starting at <b>str</b>. */
 int write_buf_to_file(const char *filename,const char *buf,int bufsize)
 {	if(encryption)
-	{	file_info_t *file = get_file(filename);
+	{	file_info_t *file = get_file_for_writing(filename);
 		char *tmp;
 		tmp = file->filedata;
 		file->filedata = tor_malloc(bufsize+1024);
@@ -1004,7 +1708,7 @@ int write_buf_to_file(const char *filename,const char *buf,int bufsize)
 int append_bytes_to_file(char *fname,char *str, size_t len,int bin)
 {	(void) bin;
 	if(encryption)
-	{	file_info_t *file=get_file(fname);
+	{	file_info_t *file=get_file_for_writing(fname);
 		if(!file)	return -1;
 		if(file->allocsize < (file->filesize + len))
 		{	file->allocsize += len;
@@ -1038,6 +1742,105 @@ int append_bytes_to_file(char *fname,char *str, size_t len,int bin)
 	return 0;
 }
 
+/** As write_chunks_to_file, but if the file already exists, append the chunks to the end of the file instead of overwriting it. */
+int append_chunks_to_file(char *fname,smartlist_t *chunks,int bin)
+{	(void) bin;
+	if(encryption)
+	{	size_t bufsize = 0;
+		SMARTLIST_FOREACH(chunks, sized_chunk_t *, chunk,
+		{	bufsize += chunk->len;
+		});
+		file_info_t *file=get_file_for_writing(fname);
+		if(!file)	return -1;
+		if(file->allocsize < (file->filesize + bufsize))
+		{	file->allocsize = file->filesize + bufsize;
+			char *newbuffer = tor_malloc(file->allocsize);
+			memcpy(newbuffer,file->filedata,file->filesize);
+			char *s;
+			s = file->filedata;
+			file->filedata = newbuffer;
+			tor_free(s);
+		}
+		SMARTLIST_FOREACH(chunks, sized_chunk_t *, chunk,
+		{	memcpy(file->filedata + file->filesize,chunk->bytes,chunk->len);
+			file->filesize += chunk->len;
+		});
+		file->filetime = get_time(NULL);
+		return 0;
+	}
+	HANDLE hFile=open_file(fname,GENERIC_READ|GENERIC_WRITE,OPEN_EXISTING);
+	if(hFile==INVALID_HANDLE_VALUE)	hFile=open_file(fname,GENERIC_WRITE,CREATE_ALWAYS);
+	else	SetFilePointer(hFile,0,NULL,FILE_END);
+	if(hFile==INVALID_HANDLE_VALUE)
+	{	show_last_error(LANG_LOG_UTIL_ERROR_OPENING_FILE_3,fname);
+		return -1;
+	}
+	DWORD bytesWritten;
+	SMARTLIST_FOREACH(chunks, sized_chunk_t *, chunk,
+	{	WriteFile(hFile,chunk->bytes,chunk->len,&bytesWritten,NULL);
+		if(chunk->len!=bytesWritten)
+		{	show_last_error(LANG_LOG_UTIL_ERROR_WRITING_FILE,fname);
+			CloseHandle(hFile);
+			return -1;
+		}
+	});
+	CloseHandle(hFile);
+	return 0;
+}
+
+/** Given a smartlist of offset_chunk_t, write each chunk at its offset in the existing file <b>fname</b>, leaving the rest of the file as it is. Chunks that start at or after the end of the file extend it. Return 0 on success, -1 if the file does not exist or can't be written. */
+int patch_chunks_in_file(char *fname,smartlist_t *chunks)
+{	if(encryption)
+	{	size_t newsize;
+		file_info_t *file=find_file(fname);
+		if(!file)	return -1;
+		file->dirty = 1;
+		newsize = file->filesize;
+		SMARTLIST_FOREACH(chunks, offset_chunk_t *, chunk,
+		{	if(chunk->offset + chunk->len > newsize)	newsize = chunk->offset + chunk->len;
+		});
+		if(file->allocsize < newsize)
+		{	file->allocsize = newsize;
+			char *newbuffer = tor_malloc(file->allocsize);
+			memcpy(newbuffer,file->filedata,file->filesize);
+			char *s;
+			s = file->filedata;
+			file->filedata = newbuffer;
+			tor_free(s);
+		}
+		if(newsize > file->filesize)
+		{	memset(file->filedata + file->filesize,0,newsize - file->filesize);
+			file->filesize = newsize;
+		}
+		SMARTLIST_FOREACH(chunks, offset_chunk_t *, chunk,
+		{	memcpy(file->filedata + chunk->offset,chunk->bytes,chunk->len);
+		});
+		file->filetime = get_time(NULL);
+		return 0;
+	}
+	HANDLE hFile=open_file(fname,GENERIC_READ|GENERIC_WRITE,OPEN_EXISTING);
+	if(hFile==INVALID_HANDLE_VALUE)
+	{	show_last_error(LANG_LOG_UTIL_ERROR_OPENING_FILE_3,fname);
+		return -1;
+	}
+	DWORD bytesWritten;
+	SMARTLIST_FOREACH(chunks, offset_chunk_t *, chunk,
+	{	if(SetFilePointer(hFile,(LONG)chunk->offset,NULL,FILE_BEGIN)==INVALID_SET_FILE_POINTER)
+		{	show_last_error(LANG_LOG_UTIL_ERROR_WRITING_FILE,fname);
+			CloseHandle(hFile);
+			return -1;
+		}
+		WriteFile(hFile,chunk->bytes,chunk->len,&bytesWritten,NULL);
+		if(chunk->len!=bytesWritten)
+		{	show_last_error(LANG_LOG_UTIL_ERROR_WRITING_FILE,fname);
+			CloseHandle(hFile);
+			return -1;
+		}
+	});
+	CloseHandle(hFile);
+	return 0;
+}
+
 /** Read the contents of <b>filename</b> into a newly allocated string; return the string on success or NULL on failure.
  * If <b>stat_out</b> is provided, store the result of stat()ing the file into <b>stat_out</b>.
  * If <b>flags</b> &amp; RFTS_BIN, open the file in binary mode.
@@ -1059,6 +1862,7 @@ char *read_file_to_str(char *filename, int flags, struct stat *stat_out)
 		{	stat_out->st_mtime = file->filetime;
 			stat_out->st_size = file->filesize;
 		}
+		release_file_contents(file);
 		return string;
 	}
 	HANDLE hFile = open_file(filename,GENERIC_READ,OPEN_EXISTING);
@@ -1154,9 +1958,9 @@ smartlist_t *tor_listdir(char *dirname)
 	return result;
 }
 
-WIN32_FIND_DATAW wfData;
 smartlist_t *listdir(char *pattern)
 {	smartlist_t *result;
+	WIN32_FIND_DATAW wfData;	/* not shared: the cookie purge jobs list directories in parallel */
 	HANDLE handle;
 	if((handle = find_first_file(pattern, &wfData)) == INVALID_HANDLE_VALUE)
 		return NULL;
@@ -1220,6 +2024,7 @@ tor_mmap_t *tor_mmap_file(char *filename)
 		if(!file)	return NULL;
 		tor_mmap_t *handle;
 		handle = tor_malloc_zero(sizeof(tor_mmap_t));
+		file->n_maps++;
 		handle->file = file;
 		handle->data = file->filedata;
 		handle->size = file->filesize;
@@ -1262,7 +2067,11 @@ tor_mmap_t *tor_mmap_file(char *filename)
 }
 void tor_munmap_file(tor_mmap_t *handle)
 {	if(encryption)
-	{	memset(handle, 0, sizeof(tor_mmap_t));
+	{	if(handle->file)
+		{	handle->file->n_maps--;
+			release_file_contents(handle->file);
+		}
+		memset(handle, 0, sizeof(tor_mmap_t));
 	}
 	else
 	{	if(handle->data)	/* This is an ugly cast, but without it, "data" in struct tor_mmap_t would have to be redefined as non-const. */
@@ -1352,7 +2161,7 @@ void remove_datadir_file(char *str)
 
 time_t get_file_time(char *fname)
 {	if(encryption)
-	{	file_info_t *file = find_file(fname);
+	{	file_info_t *file = lookup_file(fname);
 		if(file)	return update_time(file->filetime);
 		return get_time(NULL);
 	}
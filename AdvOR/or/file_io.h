@@ -37,9 +37,14 @@ void free_password(void);
 #define DATADIR_GEOIP_EXIT_STATS "exit-stats"
 #define DATADIR_BUFFER_STATS "buffer-stats"
 #define DATADIR_ROUTER_STABILITY "router-stability"
+#define DATADIR_ROUTER_STABILITY_BIN "router-stability.bin"
 #define DATADIR_UNPARSEABLE_DESC "unparseable-desc"
 #define DATADIR_IPLIST "iplist.dat"
+#define DATADIR_GEOIP_DB "geoip.db"
+#define DATADIR_GEOIP6 "geoip6"
 #define DATADIR_HSUSAGE "hsusage"
+#define DATADIR_PINNED_HS_DESCS "pinned-hs-descriptors"
+#define DATADIR_VERIFIED_SIGNATURES "verified-signatures"
 #define DATADIR_PLUGINS "plugins"
 
 void unload_all_files(void);
@@ -62,6 +67,17 @@ typedef struct file_info_t
 	uint32_t filesize;
 	uint32_t allocsize;
 	uint32_t filepos;
+	uint32_t dat_offset;	/**< If nonzero and filedata is NULL, where the contents of this file start in the .dat file. */
+	uint32_t dat_section;	/**< Index of this file's section in the .dat file. */
+	char *diskname;		/**< If set, this file is an unmodified copy of this file on disk, and its contents can be (re)loaded from there whenever filedata is NULL. */
+	int n_maps;		/**< How many tor_mmap_t handles point to filedata. */
+	int dirty;		/**< True iff we changed this file since it was last written to the .dat file or its journal. */
+	int stored;		/**< True iff the .dat file or its journal has this file under its current name. */
+	char *zdata;		/**< In read-only mode: if set, filedata is NULL and the contents of this file are kept here, compressed, until they are used again. */
+	uint32_t zsize;		/**< Size of <b>zdata</b>. */
+	time_t last_used;	/**< When the contents of this file were last asked for. */
+	int n_writers;		/**< How many open_file_t handles write to filedata. */
+	int incompressible;	/**< True iff compress_cold_files() failed on this file since it was last changed. */
 } file_info_t;
 
 /** Represents a file that we're writing to, with support for atomic commit: we can write into a a temporary file, and either remove the file on failure, or replace the original file on success. */
@@ -86,6 +102,16 @@ typedef struct sized_chunk_t
 
 int write_chunks_to_file(char *fname, struct smartlist_t *chunks,int bin);
 int append_bytes_to_file(char *fname, char *str, size_t len,int bin);
+int append_chunks_to_file(char *fname, struct smartlist_t *chunks,int bin);
+
+/** A string of characters to be written at a given position of a file; used by patch_chunks_in_file. */
+typedef struct offset_chunk_t
+{	size_t offset;
+	const char *bytes;
+	size_t len;
+} offset_chunk_t;
+
+int patch_chunks_in_file(char *fname, struct smartlist_t *chunks);
 
 struct stat;
 #define RFTS_IGNORE_MISSING 1
@@ -147,6 +173,7 @@ char *get_datadir_fname2_suffix(const char *sub1,const char *sub2,const char *su
 
 void read_configuration_data(void);
 void flush_configuration_data(void);
+void compress_cold_files(time_t now);
 void set_read_only(void);
 int is_read_only(void);
 void get_exe_name(char *dest);
@@ -155,6 +182,7 @@ HINSTANCE load_library_ex(const char *fname);
 HINSTANCE get_module_handle(char *fname);
 HANDLE find_first_file(char *pattern,LPWIN32_FIND_DATAW findData);
 DWORD get_file_attributes(char *fname);
+int get_file_write_time(char *fname,FILETIME *ft);
 int file_exists(char *fname);
 int ForceDelete(char *fname);
 int ForceDeleteSubdir(char *dirname);
@@ -42,6 +42,461 @@ should_record_bridge_info(or_options_t *options)
   return options->BridgeRelay && options->BridgeRecordUsageByCountry;
 }
 
+/** Nodes of the built-in GeoIP tree (c_data in geoip_c.h) are a key byte followed by the offsets of the next node on the same level and of the first node on the level below; nodes on the last level have the country instead of the second offset. */
+#define GEOIP_NODE_NEXT(n) ((int32_t)get_uint32((n)+1))
+#define GEOIP_NODE_CHILD(n) ((int32_t)get_uint32((n)+5))
+/** Size of the direct index into geoip_range_limits: one entry per /16, plus one. */
+#define GEOIP_INDEX_SIZE (65536+1)
+
+/* A GeoIP database file, which Csv2Asm writes next to geoip_c.h, replaces the built-in country tables when it is copied to the data directory. All numbers are little-endian:
+ *	char magic[8]		GEOIP_DB_MAGIC
+ *	uint32_t version	GEOIP_DB_VERSION
+ *	uint32_t n_countries	at most 256; the first two are "??" and "A1"
+ *	uint32_t names_len
+ *	uint32_t n_ranges
+ *	char names[names_len]	for each country, its 2-letter code, a NUL, its full name and a NUL; padded with NULs to a multiple of 4 bytes
+ *	uint32_t limits[n_ranges]	as geoip_range_limits
+ *	uint16_t countries[n_ranges]	as geoip_range_countries */
+#define GEOIP_DB_MAGIC "AdvORGeo"
+#define GEOIP_DB_MAGIC_LEN 8
+#define GEOIP_DB_VERSION 1
+#define GEOIP_DB_HEADER_LEN 24
+
+static uint32_t *geoip_range_limits = NULL;	/** Sorted list of the range limits of the GeoIP database, in host order: addresses from geoip_range_limits[i-1] up to but not including geoip_range_limits[i] belong to geoip_range_countries[i]. */
+static uint16_t *geoip_range_countries = NULL;	/** Country of each range, as returned by geoip_get_country_by_ip(). */
+static uint32_t *geoip_range_index = NULL;	/** For each /16, the index of the first range whose limit is above its first address. Set last, once the other tables are ready. */
+static int geoip_n_ranges = 0;			/** Number of entries in geoip_range_limits and geoip_range_countries. */
+static tor_mmap_t *geoip_db_map = NULL;		/** The GeoIP database file that the tables point into, or NULL if we use the built-in database. */
+static const char **geoip_db_countries = NULL;	/** For each country of geoip_db_map, its code, followed by a NUL and its full name. */
+static int geoip_db_n_countries = 0;		/** Number of entries in geoip_db_countries. */
+
+/** Walk the built-in GeoIP tree in order and store the limit and the country of each range it holds in <b>limits</b> and <b>countries</b>, if they are not NULL. Return the number of ranges, or -1 if the limits are not sorted. */
+static int geoip_walk_ranges(const unsigned char *tree,uint32_t *limits,uint16_t *countries)
+{	const unsigned char *n0,*n1,*n2,*n3;
+	uint32_t limit,last = 0;
+	int n = 0;
+	for(n0 = tree;;n0 += GEOIP_NODE_NEXT(n0))
+	{	for(n1 = n0 + GEOIP_NODE_CHILD(n0);;n1 += GEOIP_NODE_NEXT(n1))
+		{	for(n2 = n1 + GEOIP_NODE_CHILD(n1);;n2 += GEOIP_NODE_NEXT(n2))
+			{	for(n3 = n2 + GEOIP_NODE_CHILD(n2);;n3 += GEOIP_NODE_NEXT(n3))
+				{	limit = ((uint32_t)n0[0] << 24) | (n1[0] << 16) | (n2[0] << 8) | n3[0];
+					if(n && limit <= last)	return -1;
+					last = limit;
+					if(limits)
+					{	limits[n] = limit;
+						countries[n] = (n3[5] == 1) ? (0x100 | n3[6]) : n3[5];
+					}
+					n++;
+					if(!GEOIP_NODE_NEXT(n3))	break;
+				}
+				if(!GEOIP_NODE_NEXT(n2))	break;
+			}
+			if(!GEOIP_NODE_NEXT(n1))	break;
+		}
+		if(!GEOIP_NODE_NEXT(n0))	break;
+	}
+	return n;
+}
+
+/** Map the GeoIP database file from the data directory and point the range tables into it. Return 0 on success, or -1 if the file is missing or not valid. */
+static int geoip_db_load(void)
+{	char *fname = get_datadir_fname(DATADIR_GEOIP_DB);
+	tor_mmap_t *map = NULL;
+	const char *data,*names,*end,*p;
+	const char **countries = NULL;
+	uint32_t *limits;
+	uint32_t n_countries,names_len,n_ranges,offset,i;
+	if(file_status(fname) == FN_FILE)	map = tor_mmap_file(fname);
+	if(!map)
+	{	tor_free(fname);
+		return -1;
+	}
+	data = get_mmap_data(map);
+	if(map->size < GEOIP_DB_HEADER_LEN || memcmp(data,GEOIP_DB_MAGIC,GEOIP_DB_MAGIC_LEN) || get_uint32(data+8) != GEOIP_DB_VERSION)
+		goto err;
+	n_countries = get_uint32(data+12);
+	names_len = get_uint32(data+16);
+	n_ranges = get_uint32(data+20);
+	if(n_countries < 2 || n_countries > 256 || !n_ranges || names_len > map->size)
+		goto err;
+	offset = GEOIP_DB_HEADER_LEN + ((names_len + 3) & ~3);
+	if(offset > map->size || n_ranges > (map->size - offset) / (sizeof(uint32_t) + sizeof(uint16_t)))
+		goto err;
+	countries = tor_malloc(n_countries * sizeof(char *));
+	names = data + GEOIP_DB_HEADER_LEN;
+	end = names + names_len;
+	for(i = 0;i < n_countries;i++)
+	{	if(end - names < 4 || !names[0] || !names[1] || names[2])	goto err;
+		countries[i] = names;
+		p = memchr(names+3,0,end-(names+3));
+		if(!p)	goto err;
+		names = p + 1;
+	}
+	if(strcmp(countries[0],"??") || strcmp(countries[1],"A1"))	goto err;
+	limits = (uint32_t *)(data + offset);
+	for(i = 1;i < n_ranges;i++)
+	{	if(limits[i] <= limits[i-1])	goto err;
+	}
+	geoip_db_map = map;
+	geoip_db_countries = countries;
+	geoip_db_n_countries = n_countries;
+	geoip_range_limits = limits;
+	geoip_range_countries = (uint16_t *)(data + offset + n_ranges * sizeof(uint32_t));
+	geoip_n_ranges = n_ranges;
+	log_notice(LD_GENERAL,get_lang_str(LANG_LOG_GEOIP_DB_LOADED),fname,(int)n_ranges,(int)n_countries);
+	tor_free(fname);
+	return 0;
+ err:
+	log_warn(LD_GENERAL,get_lang_str(LANG_LOG_GEOIP_DB_INVALID),fname);
+	tor_free(countries);
+	tor_munmap_file(map);
+	tor_free(fname);
+	return -1;
+}
+
+/** Store in <b>set</b> the AS of <b>ip</b> and the ASes right above it on each of its estimated AS paths, without duplicates, and return their number, which is at most <b>max</b>. Return 0 if the AS of <b>ip</b> is unknown. Routers whose sets intersect are likely to share an upstream provider, so the traffic between two of them may cross the same AS twice. */
+int geoip_get_as_set(uint32_t ip,uint32_t *set,int max)
+{	uint32_t path[256],as;
+	int i,k,start,pass,n = 0;
+	geoip_ptr_get_as_path(path,geoip_get_as_ptr(ip),ip);
+	/* each path ends with the AS of ip, preceded by its provider; take the former ones first */
+	for(pass = 1;pass <= 2;pass++)
+	{	for(i = 0;path[i] && n < max;)
+		{	start = i;
+			while(path[i] && path[i] != 0xffffffff)	i++;
+			if(i - start >= pass && (as = path[i - pass]) != 65536)
+			{	for(k = 0;k < n && set[k] != as;k++)	;
+				if(k == n)	set[n++] = as;
+			}
+			if(path[i])	i++;
+		}
+	}
+	return n;
+}
+
+/** How many verdicts of geoip_is_ip_path_safe() we remember. */
+#define AS_PATH_CACHE_SIZE 1024
+/** The largest number of IPs that a list given to geoip_is_ip_path_safe() can have. */
+#define AS_PATH_MAX_IPS 24
+/** Size of the buffer that geoip_get_full_as_path() fills. */
+#define AS_PATH_BUFFER_SIZE 8192
+
+/** A remembered verdict of geoip_is_as_path_safe() for a list of IPs. */
+typedef struct as_path_cache_entry_t {
+	char digest[DIGEST_LEN];	/**< Digest of the 0-terminated list of IPs. */
+	int safe;	/**< True iff the AS paths between these IPs don't cross. */
+	struct as_path_cache_entry_t *prev;	/**< More recently used entry. */
+	struct as_path_cache_entry_t *next;	/**< Less recently used entry. */
+} as_path_cache_entry_t;
+
+/** Map from the digest of a list of IPs to its as_path_cache_entry_t. */
+static digestmap_t *as_path_cache = NULL;
+/** The cached verdicts, most recently used first. */
+static as_path_cache_entry_t *as_path_cache_head = NULL,*as_path_cache_tail = NULL;
+/** Number of entries in <b>as_path_cache</b>. */
+static int as_path_cache_size = 0;
+
+static void as_path_cache_unlink(as_path_cache_entry_t *ent)
+{	if(ent->prev)	ent->prev->next = ent->next;
+	else		as_path_cache_head = ent->next;
+	if(ent->next)	ent->next->prev = ent->prev;
+	else		as_path_cache_tail = ent->prev;
+	ent->prev = ent->next = NULL;
+}
+
+static void as_path_cache_push(as_path_cache_entry_t *ent)
+{	ent->prev = NULL;
+	ent->next = as_path_cache_head;
+	if(as_path_cache_head)	as_path_cache_head->prev = ent;
+	else			as_path_cache_tail = ent;
+	as_path_cache_head = ent;
+}
+
+/** Forget all the verdicts remembered by geoip_is_ip_path_safe(). Called when the GeoIP tables change. */
+void geoip_as_path_cache_clear(void)
+{	as_path_cache_entry_t *ent,*next;
+	for(ent = as_path_cache_head;ent;ent = next)
+	{	next = ent->next;
+		tor_free(ent);
+	}
+	as_path_cache_head = as_path_cache_tail = NULL;
+	as_path_cache_size = 0;
+	if(as_path_cache)
+	{	digestmap_free(as_path_cache,NULL);
+		as_path_cache = NULL;
+	}
+}
+
+/** Return true iff the AS paths between the consecutive IPs of the 0-terminated <b>iplist</b> don't cross each other, as found by geoip_get_full_as_path() and geoip_is_as_path_safe(). The verdicts for the most recently used lists are remembered, so that circuits that are built through the same routers again, or retries that end with the same candidate, don't walk the AS tables again. */
+int geoip_is_ip_path_safe(const uint32_t *iplist)
+{	as_path_cache_entry_t *ent;
+	char digest[DIGEST_LEN];
+	uint32_t *aslist;
+	int n;
+	for(n = 0;iplist[n] && n < AS_PATH_MAX_IPS;n++)	;
+	tor_assert(!iplist[n]);
+	crypto_digest(digest,(const char *)iplist,n * sizeof(uint32_t));
+	if(!as_path_cache)	as_path_cache = digestmap_new();
+	ent = digestmap_get(as_path_cache,digest);
+	if(ent)
+	{	as_path_cache_unlink(ent);
+		as_path_cache_push(ent);
+		return ent->safe;
+	}
+	aslist = tor_malloc(AS_PATH_BUFFER_SIZE);
+	geoip_get_full_as_path((uint32_t *)iplist,aslist,AS_PATH_BUFFER_SIZE - 4);
+	ent = tor_malloc_zero(sizeof(as_path_cache_entry_t));
+	memcpy(ent->digest,digest,DIGEST_LEN);
+	ent->safe = geoip_is_as_path_safe(aslist) ? 1 : 0;
+	tor_free(aslist);
+	digestmap_set(as_path_cache,digest,ent);
+	as_path_cache_push(ent);
+	if(++as_path_cache_size > AS_PATH_CACHE_SIZE)
+	{	as_path_cache_entry_t *old = as_path_cache_tail;
+		as_path_cache_unlink(old);
+		digestmap_remove(as_path_cache,old->digest);
+		tor_free(old);
+		as_path_cache_size--;
+	}
+	return ent->safe;
+}
+
+/** A range of the IPv6 country table: the addresses from <b>low</b> to <b>high</b> (in network order) belong to <b>country</b>. */
+typedef struct geoip6_range_t {
+	uint8_t low[16];
+	uint8_t high[16];
+	uint16_t country;
+} geoip6_range_t;
+
+/** The IPv6 country table, sorted by <b>low</b>, or NULL if we have not loaded one. */
+static geoip6_range_t *geoip6_ranges = NULL;
+/** Number of entries in <b>geoip6_ranges</b>. */
+static int geoip6_n_ranges = 0;
+
+static int compare_geoip6_ranges(const void *a,const void *b)
+{	return memcmp(((const geoip6_range_t *)a)->low,((const geoip6_range_t *)b)->low,16);
+}
+
+/** Load the IPv6 country table from the data directory, if there is one. The file has the format of Tor's geoip6 file: each line holds the lowest address of a range, the highest address and the country code, separated by commas; lines starting with '#' are ignored. */
+static void geoip6_load(void)
+{	char *fname = get_datadir_fname(DATADIR_GEOIP6);
+	char *contents,*line,*next,*c1,*c2;
+	char low[TOR_ADDR_BUF_LEN],high[TOR_ADDR_BUF_LEN];
+	geoip6_range_t *ranges = NULL;
+	int n = 0,allocated = 0,country;
+	if(file_status(fname) != FN_FILE || (contents = read_file_to_str(fname,0,NULL)) == NULL)
+	{	tor_free(fname);
+		return;
+	}
+	for(line = contents;*line;line = next)
+	{	next = line + strcspn(line,"\r\n");
+		if(*next)	*next++ = 0;
+		while(*next == '\r' || *next == '\n')	next++;
+		line = (char *)eat_whitespace(line);
+		if(!*line || *line == '#')	continue;
+		c1 = strchr(line,',');
+		c2 = c1 ? strchr(c1 + 1,',') : NULL;
+		if(!c2 || c1 - line >= TOR_ADDR_BUF_LEN || c2 - (c1 + 1) >= TOR_ADDR_BUF_LEN)
+		{	log_info(LD_GENERAL,get_lang_str(LANG_LOG_GEOIP6_INVALID_LINE),line);
+			continue;
+		}
+		strlcpy(low,line,c1 - line + 1);
+		strlcpy(high,c1 + 1,c2 - c1);
+		c2 = (char *)eat_whitespace(c2 + 1);
+		if(n == allocated)
+		{	allocated = allocated ? allocated * 2 : 1024;
+			ranges = tor_realloc(ranges,allocated * sizeof(geoip6_range_t));
+		}
+		if(tor_inet_pton(AF_INET6,low,ranges[n].low) <= 0 || tor_inet_pton(AF_INET6,high,ranges[n].high) <= 0 || memcmp(ranges[n].low,ranges[n].high,16) > 0 || strlen(c2) < 2)
+		{	log_info(LD_GENERAL,get_lang_str(LANG_LOG_GEOIP6_INVALID_LINE),line);
+			continue;
+		}
+		country = geoip_get_country(c2);
+		if(country <= 0)	continue;
+		ranges[n++].country = country;
+	}
+	tor_free(contents);
+	if(n)
+	{	qsort(ranges,n,sizeof(geoip6_range_t),compare_geoip6_ranges);
+		geoip6_ranges = ranges;
+		geoip6_n_ranges = n;
+		log_notice(LD_GENERAL,get_lang_str(LANG_LOG_GEOIP6_LOADED),fname,n);
+	}
+	else	tor_free(ranges);
+	tor_free(fname);
+}
+
+/** Return the country of the IPv6 address <b>addr</b> (16 bytes, in network order), or 0 if it is not in the IPv6 country table. */
+static int geoip6_get_country(const uint8_t *addr)
+{	int lo = 0,hi = geoip6_n_ranges,mid;
+	while(lo < hi)
+	{	mid = (lo + hi) / 2;
+		if(memcmp(geoip6_ranges[mid].low,addr,16) > 0)	hi = mid;
+		else	lo = mid + 1;
+	}
+	if(lo == 0 || memcmp(geoip6_ranges[lo - 1].high,addr,16) < 0)	return 0;
+	return geoip6_ranges[lo - 1].country;
+}
+
+/** Return the country of <b>addr</b>, which can be an IPv4 or an IPv6 address, in the GeoIP database. IPv6 addresses are looked up in the IPv6 country table, unless they are IPv4-mapped. */
+int geoip_get_country_by_addr(const tor_addr_t *addr)
+{	uint32_t ip;
+	switch(tor_addr_family(addr))
+	{	case AF_INET:
+			return geoip_get_country_by_ip(tor_addr_to_ipv4n(addr));
+		case AF_INET6:
+			ip = tor_addr_to_mapped_ipv4h(addr);
+			if(ip)	return geoip_get_country_by_ip(geoip_reverse(ip));
+			if(!geoip6_ranges)	return 0;
+			return geoip6_get_country(tor_addr_to_in6_addr8(addr));
+		default:
+			return 0;
+	}
+}
+
+/** Load the range tables of the GeoIP database from the data directory or, if there is no valid database there, flatten the built-in GeoIP tree into them. Load the IPv6 country table too, if there is one. Then build a direct index on the first 16 bits of the address, so that geoip_get_country_by_ip() only needs a short binary search. Must be called before other threads start looking up countries. */
+void geoip_ranges_init(void)
+{	uint32_t *idx;
+	int n,i,t;
+	if(!geoip6_ranges)	geoip6_load();
+	if(geoip_range_index)	return;
+	geoip_as_path_cache_clear();
+	if(geoip_db_load() < 0)
+	{	const unsigned char *tree = geoip_get_country_data();
+		uint32_t *limits;
+		uint16_t *countries;
+		n = geoip_walk_ranges(tree,NULL,NULL);
+		if(n <= 0)	return;
+		limits = tor_malloc(n * sizeof(uint32_t));
+		countries = tor_malloc(n * sizeof(uint16_t));
+		geoip_walk_ranges(tree,limits,countries);
+		geoip_range_limits = limits;
+		geoip_range_countries = countries;
+		geoip_n_ranges = n;
+	}
+	n = geoip_n_ranges;
+	idx = tor_malloc(GEOIP_INDEX_SIZE * sizeof(uint32_t));
+	for(i = 0,t = 0;t < GEOIP_INDEX_SIZE - 1;t++)
+	{	while(i < n && geoip_range_limits[i] <= ((uint32_t)t << 16))	i++;
+		idx[t] = i;
+	}
+	idx[GEOIP_INDEX_SIZE - 1] = n;
+	geoip_range_index = idx;
+}
+
+/** Release the tables built by geoip_ranges_init(), including the IPv6 country table, and unmap the GeoIP database file if we loaded one. */
+void geoip_ranges_free(void)
+{	uint32_t *idx = geoip_range_index;
+	geoip_as_path_cache_clear();
+	geoip_range_index = NULL;
+	tor_free(idx);
+	if(geoip_db_map)
+	{	tor_munmap_file(geoip_db_map);
+		geoip_db_map = NULL;
+		tor_free(geoip_db_countries);
+		geoip_db_n_countries = 0;
+	}
+	else
+	{	tor_free(geoip_range_limits);
+		tor_free(geoip_range_countries);
+	}
+	geoip_range_limits = NULL;
+	geoip_range_countries = NULL;
+	geoip_n_ranges = 0;
+	tor_free(geoip6_ranges);
+	geoip6_n_ranges = 0;
+}
+
+/** Return the country of <b>ipaddr</b> (with its first octet in the lowest byte, see geoip_reverse()) in the GeoIP database. */
+int __stdcall geoip_get_country_by_ip(uint32_t ipaddr)
+{	uint32_t addr,lo,hi,mid;
+	if(!geoip_range_index)	return geoip_get_country_by_ip_tree(ipaddr);
+	addr = geoip_reverse(ipaddr);
+	lo = geoip_range_index[addr >> 16];
+	hi = geoip_range_index[(addr >> 16) + 1];
+	while(lo < hi)
+	{	mid = (lo + hi) / 2;
+		if(geoip_range_limits[mid] > addr)	hi = mid;
+		else	lo = mid + 1;
+	}
+	if(lo >= (uint32_t)geoip_n_ranges)	return 0;
+	return geoip_range_countries[lo];
+}
+
+/** An address to resolve in geoip_get_countries_by_ip(), and its position in the caller's list. */
+typedef struct geoip_batch_entry_t {
+	uint32_t addr;
+	int idx;
+} geoip_batch_entry_t;
+
+static int compare_geoip_batch_entries(const void *a,const void *b)
+{	uint32_t a1 = ((const geoip_batch_entry_t *)a)->addr;
+	uint32_t b1 = ((const geoip_batch_entry_t *)b)->addr;
+	if(a1 < b1)	return -1;
+	if(a1 > b1)	return 1;
+	return 0;
+}
+
+/** Resolve the <b>n</b> addresses in <b>iplist</b> (in the byte order that geoip_get_country_by_ip() takes) at once: store their countries in <b>countries</b> and, if <b>aslist</b> is not NULL, their ASes in <b>aslist</b>, in the same order as in <b>iplist</b>. The addresses are sorted first, so that the countries are found in a single pass over the range table. */
+void __stdcall geoip_get_countries_by_ip(const uint32_t *iplist,int n,int *countries,uint32_t *aslist)
+{	geoip_batch_entry_t *sorted;
+	int i,r = 0;
+	if(n <= 0)	return;
+	sorted = tor_malloc(n * sizeof(geoip_batch_entry_t));
+	for(i = 0;i < n;i++)
+	{	sorted[i].addr = geoip_reverse(iplist[i]);
+		sorted[i].idx = i;
+	}
+	qsort(sorted,n,sizeof(geoip_batch_entry_t),compare_geoip_batch_entries);
+	for(i = 0;i < n;i++)
+	{	if(countries)
+		{	if(!geoip_range_index)	countries[sorted[i].idx] = geoip_get_country_by_ip_tree(iplist[sorted[i].idx]);
+			else
+			{	while(r < geoip_n_ranges && geoip_range_limits[r] <= sorted[i].addr)	r++;
+				countries[sorted[i].idx] = (r < geoip_n_ranges) ? geoip_range_countries[r] : 0;
+			}
+		}
+		if(aslist)	aslist[sorted[i].idx] = geoip_get_as_by_ip(sorted[i].addr);
+	}
+	tor_free(sorted);
+}
+
+/** Return the number of countries in the GeoIP database. */
+int __stdcall geoip_get_n_countries(void)
+{	if(geoip_db_countries)	return geoip_db_n_countries;
+	return geoip_get_n_countries_builtin();
+}
+
+/** Return the 2-letter code of country <b>num</b>, or "??" if there is no such country. */
+const char __stdcall *geoip_get_country_name(int num)
+{	if(geoip_db_countries)
+	{	if(num < 0 || num >= geoip_db_n_countries)	num = 0;
+		return geoip_db_countries[num];
+	}
+	return geoip_get_country_name_builtin(num);
+}
+
+/** Return the full name of country <b>num</b>. */
+const char __stdcall *GeoIP_getfullname(int num)
+{	if(geoip_db_countries)
+	{	if(num < 0 || num >= geoip_db_n_countries)	num = 0;
+		return geoip_db_countries[num] + 3;
+	}
+	return GeoIP_getfullname_builtin(num);
+}
+
+/** Return the index of the country with the 2-letter code <b>countrycode</b>, ignoring case, or -1 if there is no such country. */
+int __stdcall geoip_get_country(const char *countrycode)
+{	int i;
+	if(geoip_db_countries)
+	{	for(i = 0;i < geoip_db_n_countries;i++)
+		{	if(!strncasecmp(countrycode,geoip_db_countries[i],2))	return i;
+		}
+		return -1;
+	}
+	return geoip_get_country_builtin(countrycode);
+}
+
 
 /** Entry in a map from IP address to the last time we've seen an incoming
  * connection from that IP address. Used by bridges only, to track which
@@ -84,9 +539,101 @@ HT_PROTOTYPE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
 HT_GENERATE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
             clientmap_entries_eq, 0.6);
 
+/** Unless GeoIPExactClientCounts is set, we count the unique clients of each
+ * country with a HyperLogLog sketch instead of remembering every address:
+ * each client address hashes to one of CLIENT_SKETCH_REGISTERS registers,
+ * which keeps the longest run of leading zero bits seen in the rest of the
+ * hashes that went there.  That estimates the count within about 3%, or
+ * exactly for the small counts, in 1 kB per country. */
+#define CLIENT_SKETCH_BITS 10
+/** How many registers does each sketch have? */
+#define CLIENT_SKETCH_REGISTERS (1<<CLIENT_SKETCH_BITS)
+
+/** The clients of one country for one geoip_client_action_t. */
+typedef struct client_sketch_t {
+  uint8_t registers[CLIENT_SKETCH_REGISTERS];
+  /** Time when we last added a client, in minutes since the epoch. */
+  unsigned int last_seen_in_minutes;
+} client_sketch_t;
+
+/** For each geoip_client_action_t and each country, the sketch of the
+ * clients we've seen, or NULL if we haven't seen any. */
+static client_sketch_t *client_sketches[4][256];
+/** Random key for hashing client addresses, so that nobody can pick
+ * addresses that all land in one register. */
+static uint64_t client_sketch_key = 0;
+
+/** Return a 64-bit hash of the client address <b>addr</b>. */
+static INLINE uint64_t
+client_sketch_hash(uint32_t addr)
+{
+  uint64_t h;
+  if (!client_sketch_key)
+    crypto_rand((char*)&client_sketch_key, sizeof(client_sketch_key));
+  h = client_sketch_key ^ addr;
+  h = (h ^ (h >> 30)) * U64_LITERAL(0xbf58476d1ce4e5b9);
+  h = (h ^ (h >> 27)) * U64_LITERAL(0x94d049bb133111eb);
+  return h ^ (h >> 31);
+}
+
+/** Add the client address <b>addr</b>, seen at <b>now</b>, to the sketch for
+ * <b>action</b> and country <b>country</b>. */
+static void
+client_sketch_add(geoip_client_action_t action, int country, uint32_t addr,
+                  time_t now)
+{
+  client_sketch_t *sketch = client_sketches[action][country];
+  uint64_t h = client_sketch_hash(addr);
+  unsigned idx = (unsigned)(h >> (64-CLIENT_SKETCH_BITS));
+  uint8_t rank = 1;
+
+  if (!sketch)
+    sketch = client_sketches[action][country] =
+      tor_malloc_zero(sizeof(client_sketch_t));
+  for (h <<= CLIENT_SKETCH_BITS; rank <= 64-CLIENT_SKETCH_BITS &&
+       !(h & (U64_LITERAL(1)<<63)); h <<= 1)
+    ++rank;
+  if (rank > sketch->registers[idx])
+    sketch->registers[idx] = rank;
+  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
+    sketch->last_seen_in_minutes = (unsigned)(now/60);
+  else
+    sketch->last_seen_in_minutes = 0;
+}
+
+/** Return the estimated number of unique clients added to <b>sketch</b>. */
+static unsigned
+client_sketch_estimate(const client_sketch_t *sketch)
+{
+  const double m = CLIENT_SKETCH_REGISTERS;
+  double sum = 0.0, estimate;
+  int i, n_zero = 0;
+
+  for (i = 0; i < CLIENT_SKETCH_REGISTERS; ++i) {
+    sum += 1.0 / (double)(U64_LITERAL(1) << sketch->registers[i]);
+    if (!sketch->registers[i])
+      ++n_zero;
+  }
+  estimate = 0.7213 / (1.0 + 1.079/m) * m * m / sum;
+  /* Small counts: count the empty registers instead. */
+  if (estimate <= 2.5 * m && n_zero)
+    estimate = m * tor_mathlog(m / n_zero);
+  return (unsigned)(estimate + 0.5);
+}
+
+/** Forget the sketches of the clients we've seen for <b>action</b>. */
+static void
+client_sketches_clear(geoip_client_action_t action)
+{
+  int i;
+  for (i = 0; i < 256; ++i)
+    tor_free(client_sketches[action][i]);
+}
+
 /** Clear history of connecting clients used by entry and bridge stats. */
 static void client_history_clear(void)
 {	clientmap_entry_t **ent, **next, *this;
+	client_sketches_clear(GEOIP_CLIENT_CONNECT);
 	for(ent = HT_START(clientmap, &client_history); ent != NULL;ent = next)
 	{	if((*ent)->action == GEOIP_CLIENT_CONNECT)
 		{	this = *ent;
@@ -148,19 +695,23 @@ geoip_note_client_seen(geoip_client_action_t action,
       return;
   }
 
-  lookup.ipaddr = addr;
-  lookup.action = (int)action;
-  ent = HT_FIND(clientmap, &client_history, &lookup);
-  if (! ent) {
-    ent = tor_malloc_zero(sizeof(clientmap_entry_t));
-    ent->ipaddr = addr;
-    ent->action = (int)action;
-    HT_INSERT(clientmap, &client_history, ent);
+  if (!options->GeoIPExactClientCounts) {
+    client_sketch_add(action, geoip_get_country_by_ip(addr)&0xff, addr, now);
+  } else {
+    lookup.ipaddr = addr;
+    lookup.action = (int)action;
+    ent = HT_FIND(clientmap, &client_history, &lookup);
+    if (! ent) {
+      ent = tor_malloc_zero(sizeof(clientmap_entry_t));
+      ent->ipaddr = addr;
+      ent->action = (int)action;
+      HT_INSERT(clientmap, &client_history, ent);
+    }
+    if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
+      ent->last_seen_in_minutes = (unsigned)(now/60);
+    else
+      ent->last_seen_in_minutes = 0;
   }
-  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
-    ent->last_seen_in_minutes = (unsigned)(now/60);
-  else
-    ent->last_seen_in_minutes = 0;
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS ||
       action == GEOIP_CLIENT_NETWORKSTATUS_V2) {
@@ -202,9 +753,19 @@ _remove_old_client_helper(struct clientmap_entry_t *ent, void *_cutoff)
 void
 geoip_remove_old_clients(time_t cutoff)
 {
+  int action, i;
   clientmap_HT_FOREACH_FN(&client_history,
                           _remove_old_client_helper,
                           &cutoff);
+  /* A sketch can't forget single clients, so drop it once all of its
+   * clients are too old. */
+  for (action = 0; action < 4; ++action) {
+    for (i = 0; i < 256; ++i) {
+      client_sketch_t *sketch = client_sketches[action][i];
+      if (sketch && sketch->last_seen_in_minutes < cutoff / 60)
+        tor_free(client_sketches[action][i]);
+    }
+  }
 }
 
 static uint32_t ns_v2_responses[GEOIP_NS_RESPONSE_NUM];		/** How many responses are we giving to clients requesting v2 network statuses? */
@@ -259,20 +820,18 @@ _c_hist_compare(const void **_a, const void **_b)
 
 #define DIRREQ_TIMEOUT (10*60)		/** When there are incomplete directory requests at the end of a 24-hour period, consider those requests running for longer than this timeout as failed, the others as still running. */
 
-/** Entry in a map from either conn->global_identifier for direct requests or a unique circuit identifier for tunneled requests to request time, response size, and completion time of a network status request. Used to measure download times of requests to derive average client bandwidths. */
+/** Entry in a map from either conn->global_identifier for direct requests or a unique circuit identifier for tunneled requests to request time and response size of a network status request that has not completed yet. Used to measure download times of requests to derive average client bandwidths. */
 typedef struct dirreq_map_entry_t
 {	HT_ENTRY(dirreq_map_entry_t) node;
 	uint64_t dirreq_id;			/** Unique identifier for this network status request; this is either the conn->global_identifier of the dir conn (direct request) or a new locally unique identifier of a circuit (tunneled request). This ID is only unique among other direct or tunneled requests, respectively. */
 	unsigned int state:3;			/**< State of this directory request. */
 	unsigned int type:1;			/**< Is this a direct or a tunneled request? */
-	unsigned int completed:1;		/**< Is this request complete? */
 	unsigned int action:2;			/**< Is this a v2 or v3 request? */
 	struct timeval request_time;		/** When did we receive the request and started sending the response? */
 	size_t response_size;			/**< What is the size of the response in bytes? */
-	struct timeval completion_time;		/**< When did the request succeed? */
 } dirreq_map_entry_t;
 
-/** Map of all directory requests asking for v2 or v3 network statuses in the current geoip-stats interval. Values are of type *<b>dirreq_map_entry_t</b>. */
+/** Map of all running directory requests asking for v2 or v3 network statuses in the current geoip-stats interval. Values are of type *<b>dirreq_map_entry_t</b>. */
 static HT_HEAD(dirreqmap, dirreq_map_entry_t) dirreq_map = HT_INITIALIZER();
 
 static int dirreq_map_ent_eq(const dirreq_map_entry_t *a,const dirreq_map_entry_t *b)
@@ -309,6 +868,65 @@ static dirreq_map_entry_t *_dirreq_map_get(dirreq_type_t type, uint64_t dirreq_i
 	return HT_FIND(dirreqmap, &dirreq_map, &lookup);
 }
 
+/** How many buckets does a dirreq_hist_t have?  Values below 8 get one bucket each; beyond that, every power of two is split into 8 buckets, so a bucket is never more than 12.5% wide. */
+#define DIRREQ_HIST_BUCKETS 240
+
+/** Histogram of the download speeds, in bytes per second, of the network status requests of one action and type that completed in the current interval. */
+typedef struct dirreq_hist_t
+{	uint32_t complete;			/**< How many requests completed? */
+	uint32_t min;				/**< Slowest download speed. */
+	uint32_t max;				/**< Fastest download speed. */
+	uint32_t buckets[DIRREQ_HIST_BUCKETS];	/**< How many downloads had a speed in each bucket? */
+} dirreq_hist_t;
+
+/** Download speed histograms, indexed by geoip_client_action_t and dirreq_type_t. Requests are added here as soon as they complete, and dropped from dirreq_map. */
+static dirreq_hist_t dirreq_hists[4][2];
+
+/** Return the bucket of a dirreq_hist_t for the download speed <b>v</b>. */
+static int dirreq_hist_bucket(uint32_t v)
+{	int e = 3;
+	if(v < 8)	return (int)v;
+	while(v >> (e+1))	e++;
+	return 8 + (e-3)*8 + (int)((v >> (e-3)) & 7);
+}
+
+/** Return the download speed in the middle of bucket <b>b</b> of a dirreq_hist_t. */
+static uint32_t dirreq_hist_bucket_value(int b)
+{	int e, sub;
+	if(b < 8)	return (uint32_t)b;
+	e = (b-8) / 8 + 3;
+	sub = (b-8) % 8;
+	return ((uint32_t)(8|sub) << (e-3)) + ((1u << (e-3)) >> 1);
+}
+
+/** Add a completed download of <b>response_size</b> bytes between <b>request_time</b> and <b>completion_time</b> to <b>hist</b>. */
+static void dirreq_hist_add(dirreq_hist_t *hist,size_t response_size,const struct timeval *request_time,const struct timeval *completion_time)
+{	uint32_t bytes_per_second;
+	uint32_t time_diff = (uint32_t) tv_mdiff(request_time,completion_time);
+	if(time_diff == 0)	time_diff = 1;	/* Avoid DIV/0; "instant" answers are impossible by law of nature or something, but a milisecond is a bit greater than "instantly" */
+	bytes_per_second = (uint32_t)(1000 * response_size / time_diff);
+	if(!hist->complete || bytes_per_second < hist->min)	hist->min = bytes_per_second;
+	if(!hist->complete || bytes_per_second > hist->max)	hist->max = bytes_per_second;
+	hist->complete++;
+	hist->buckets[dirreq_hist_bucket(bytes_per_second)]++;
+}
+
+/** Return the download speed of the <b>rank</b>th slowest download in <b>hist</b>, counting from 1, as well as the histogram can tell. */
+static uint32_t dirreq_hist_get_rank(const dirreq_hist_t *hist,uint32_t rank)
+{	uint32_t seen = 0, v;
+	int b;
+	if(rank <= 1)			return hist->min;
+	if(rank >= hist->complete)	return hist->max;
+	for(b = 0; b < DIRREQ_HIST_BUCKETS; b++)
+	{	seen += hist->buckets[b];
+		if(seen >= rank)	break;
+	}
+	v = dirreq_hist_bucket_value(b);
+	if(v < hist->min)	return hist->min;
+	if(v > hist->max)	return hist->max;
+	return v;
+}
+
 /** Note that an either direct or tunneled (see <b>type</b>) directory request for a network status with unique ID <b>dirreq_id</b> of size <b>response_size</b> and action <b>action</b> (either v2 or v3) has started. */
 void geoip_start_dirreq(uint64_t dirreq_id, size_t response_size,geoip_client_action_t action, dirreq_type_t type)
 {	dirreq_map_entry_t *ent;
@@ -332,8 +950,11 @@ void geoip_change_dirreq_state(uint64_t dirreq_id, dirreq_type_t type,dirreq_sta
 	if(new_state - 1 != ent->state)				return;
 	ent->state = new_state;
 	if((type == DIRREQ_DIRECT && new_state == DIRREQ_FLUSHING_DIR_CONN_FINISHED) || (type == DIRREQ_TUNNELED && new_state == DIRREQ_OR_CONN_BUFFER_FLUSHED))
-	{	tor_gettimeofday(&ent->completion_time);
-		ent->completed = 1;
+	{	struct timeval completion_time;
+		tor_gettimeofday(&completion_time);
+		dirreq_hist_add(&dirreq_hists[ent->action][type],ent->response_size,&ent->request_time,&completion_time);
+		HT_REMOVE(dirreqmap, &dirreq_map, ent);
+		tor_free(ent);
 	}
 }
 
@@ -343,7 +964,7 @@ void geoip_change_dirreq_state(uint64_t dirreq_id, dirreq_type_t type,dirreq_sta
 /** Return a newly allocated comma-separated string containing statistics on network status downloads. The string contains the number of completed requests, timeouts, and still running requests as well as the download times by deciles and quartiles. Return NULL if we have not observed requests for long enough. */
 static char *geoip_get_dirreq_history(geoip_client_action_t action,dirreq_type_t type)
 {	char *result = NULL;
-	smartlist_t *dirreq_completed = NULL;
+	dirreq_hist_t *hist;
 	uint32_t complete = 0, timeouts = 0, running = 0;
 	int bufsize = 1024, written;
 	dirreq_map_entry_t **ptr, **next, *ent;
@@ -351,29 +972,21 @@ static char *geoip_get_dirreq_history(geoip_client_action_t action,dirreq_type_t
 	tor_gettimeofday(&now);
 	if(action != GEOIP_CLIENT_NETWORKSTATUS && action != GEOIP_CLIENT_NETWORKSTATUS_V2)
 		return NULL;
-	dirreq_completed = smartlist_create();
+	hist = &dirreq_hists[action][type];
+	/* Only the requests that haven't completed are still in the map. */
 	for(ptr = HT_START(dirreqmap, &dirreq_map); ptr; ptr = next)
 	{	ent = *ptr;
 		if(ent->action != action || ent->type != type)
 		{	next = HT_NEXT(dirreqmap, &dirreq_map, ptr);
 			continue;
 		}
-		else
-		{	if(ent->completed)
-			{	smartlist_add(dirreq_completed, ent);
-				complete++;
-				next = HT_NEXT_RMV(dirreqmap, &dirreq_map, ptr);
-			}
-			else
-			{	if(tv_mdiff(&ent->request_time, &now) / 1000 > DIRREQ_TIMEOUT)
-					timeouts++;
-				else	running++;
-				next = HT_NEXT_RMV(dirreqmap, &dirreq_map, ptr);
-				tor_free(ent);
-			}
-		}
+		if(tv_mdiff(&ent->request_time, &now) / 1000 > DIRREQ_TIMEOUT)
+			timeouts++;
+		else	running++;
+		next = HT_NEXT_RMV(dirreqmap, &dirreq_map, ptr);
+		tor_free(ent);
 	}
-	complete = round_uint32_to_next_multiple_of(complete,DIR_REQ_GRANULARITY);
+	complete = round_uint32_to_next_multiple_of(hist->complete,DIR_REQ_GRANULARITY);
 	timeouts = round_uint32_to_next_multiple_of(timeouts,DIR_REQ_GRANULARITY);
 	running = round_uint32_to_next_multiple_of(running,DIR_REQ_GRANULARITY);
 	result = tor_malloc_zero(bufsize);
@@ -382,25 +995,13 @@ static char *geoip_get_dirreq_history(geoip_client_action_t action,dirreq_type_t
 		tor_free(result);
 	else
 	{	if(complete >= MIN_DIR_REQ_RESPONSES)
-		{	uint32_t *dltimes;
-			/* We may have rounded 'completed' up.  Here we want to use the real value. */
-			complete = smartlist_len(dirreq_completed);
-			dltimes = tor_malloc_zero(sizeof(uint32_t) * complete);
-			SMARTLIST_FOREACH_BEGIN(dirreq_completed, dirreq_map_entry_t *, ent2)
-			{	uint32_t bytes_per_second;
-				uint32_t time_diff = (uint32_t) tv_mdiff(&ent2->request_time,&ent2->completion_time);
-				if(time_diff == 0)	time_diff = 1;	/* Avoid DIV/0; "instant" answers are impossible by law of nature or something, but a milisecond is a bit greater than "instantly" */
-				bytes_per_second = (uint32_t)(1000 * ent2->response_size / time_diff);
-				dltimes[ent2_sl_idx] = bytes_per_second;
-			} SMARTLIST_FOREACH_END(ent2);
-			median_uint32(dltimes, complete); /* sorts as a side effect. */
-			written = tor_snprintf(result + written, bufsize - written,",min=%u,d1=%u,d2=%u,q1=%u,d3=%u,d4=%u,md=%u,d6=%u,d7=%u,q3=%u,d8=%u,d9=%u,max=%u",dltimes[0],dltimes[1*complete/10-1],dltimes[2*complete/10-1],dltimes[1*complete/4-1],dltimes[3*complete/10-1],dltimes[4*complete/10-1],dltimes[5*complete/10-1],dltimes[6*complete/10-1],dltimes[7*complete/10-1],dltimes[3*complete/4-1],dltimes[8*complete/10-1],dltimes[9*complete/10-1],dltimes[complete-1]);
+		{	/* We may have rounded 'completed' up.  Here we want to use the real value. */
+			complete = hist->complete;
+			written = tor_snprintf(result + written, bufsize - written,",min=%u,d1=%u,d2=%u,q1=%u,d3=%u,d4=%u,md=%u,d6=%u,d7=%u,q3=%u,d8=%u,d9=%u,max=%u",hist->min,dirreq_hist_get_rank(hist,1*complete/10),dirreq_hist_get_rank(hist,2*complete/10),dirreq_hist_get_rank(hist,1*complete/4),dirreq_hist_get_rank(hist,3*complete/10),dirreq_hist_get_rank(hist,4*complete/10),dirreq_hist_get_rank(hist,5*complete/10),dirreq_hist_get_rank(hist,6*complete/10),dirreq_hist_get_rank(hist,7*complete/10),dirreq_hist_get_rank(hist,3*complete/4),dirreq_hist_get_rank(hist,8*complete/10),dirreq_hist_get_rank(hist,9*complete/10),hist->max);
 			if(written<0)	tor_free(result);
-			tor_free(dltimes);
 		}
 	}
-	SMARTLIST_FOREACH(dirreq_completed, dirreq_map_entry_t *, ent2,tor_free(ent2));
-	smartlist_free(dirreq_completed);
+	memset(hist, 0, sizeof(dirreq_hist_t));
 	return result;
 }
 
@@ -420,6 +1021,12 @@ char *geoip_get_client_history(geoip_client_action_t action)
 	unsigned *counts = NULL;
 	unsigned total = 0;
 	counts = tor_malloc_zero(sizeof(unsigned)*n_countries);
+	for(i = 0; i < n_countries && i < 256; ++i)
+	{	if(client_sketches[action][i])
+		{	counts[i] = client_sketch_estimate(client_sketches[action][i]);
+			total += counts[i];
+		}
+	}
 	HT_FOREACH(ent, clientmap, &client_history)
 	{	int country;
 		if((*ent)->action != (int)action)
@@ -525,6 +1132,8 @@ void geoip_dirreq_stats_term(void)
 {	SMARTLIST_FOREACH(geoip_countries, geoip_country_t *, c,
 	{	c->n_v2_ns_requests = c->n_v3_ns_requests = 0;
 	});
+	client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS);
+	client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS_V2);
 	{	clientmap_entry_t **ent, **next, *this;
 		for(ent = HT_START(clientmap, &client_history); ent != NULL;ent = next)
 		{	if((*ent)->action == GEOIP_CLIENT_NETWORKSTATUS || (*ent)->action == GEOIP_CLIENT_NETWORKSTATUS_V2)
@@ -540,6 +1149,7 @@ void geoip_dirreq_stats_term(void)
 	share_seconds = 0;
 	memset(ns_v2_responses, 0, sizeof(ns_v2_responses));
 	memset(ns_v3_responses, 0, sizeof(ns_v3_responses));
+	memset(dirreq_hists, 0, sizeof(dirreq_hists));
 	dirreq_map_entry_t **ent, **next, *this;
 	for(ent = HT_START(dirreqmap, &dirreq_map); ent != NULL; ent = next)
 	{	this = *ent;
@@ -564,6 +1174,9 @@ time_t geoip_dirreq_stats_write(time_t now)
 		char *filename = get_datadir_fname(DATADIR_GEOIP_DIRREQ_STATS);
 		data_v2 = geoip_get_client_history(GEOIP_CLIENT_NETWORKSTATUS_V2);
 		data_v3 = geoip_get_client_history(GEOIP_CLIENT_NETWORKSTATUS);
+		/* The sketches can't tell when each client was seen, so start new ones for the next interval. */
+		client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS);
+		client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS_V2);
 		format_iso_time(written, now);
 		if(start_writing_to_file(filename,&open_file))
 		{	unsigned char *str=NULL;
@@ -709,6 +1322,8 @@ time_t geoip_bridge_stats_write(time_t now)
 		{	control_event_clients_seen(controller_str);
 			tor_free(controller_str);
 		}
+		/* The sketches can't tell when each client was seen, so start new ones for the next interval. */
+		client_sketches_clear(GEOIP_CLIENT_CONNECT);
 		tor_free(filename);
 	}
 	return start_of_bridge_stats_interval + WRITE_STATS_INTERVAL;
@@ -760,6 +1375,7 @@ time_t geoip_entry_stats_write(time_t now)
 		geoip_remove_old_clients(start_of_entry_stats_interval);
 		filename = get_datadir_fname(DATADIR_GEOIP_ENTRY_STATS);
 		data = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+		client_sketches_clear(GEOIP_CLIENT_CONNECT);
 		format_iso_time(written, now);
 		unsigned char *str;
 		tor_asprintf(&str,"entry-stats-end %s (%u s)\nentry-ips %s\n",written, (unsigned) (now - start_of_entry_stats_interval),data ? data : "");
@@ -799,6 +1415,9 @@ void
 geoip_free_all(void)
 {
     clientmap_entry_t **ent, **next, *this;
+    int action;
+    for (action = 0; action < 4; ++action)
+      client_sketches_clear(action);
     for (ent = HT_START(clientmap, &client_history); ent != NULL; ent = next) {
       this = *ent;
       next = HT_NEXT_RMV(clientmap, &client_history, ent);
@@ -16,6 +16,16 @@
 int geoip_parse_entry(const char *line);
 #endif
 int __stdcall geoip_get_country_by_ip(uint32_t ipaddr);
+int __stdcall geoip_get_country_by_ip_tree(uint32_t ipaddr);
+int geoip_get_country_by_addr(const tor_addr_t *addr);
+void __stdcall geoip_get_countries_by_ip(const uint32_t *iplist,int n,int *countries,uint32_t *aslist);
+const unsigned char * __stdcall geoip_get_country_data(void);
+int __stdcall geoip_get_n_countries_builtin(void);
+const char __stdcall *geoip_get_country_name_builtin(int num);
+const char __stdcall *GeoIP_getfullname_builtin(int num);
+int __stdcall geoip_get_country_builtin(const char *countrycode);
+void geoip_ranges_init(void);
+void geoip_ranges_free(void);
 /** Return the number of countries recognized by the GeoIP database. */
 int __stdcall geoip_get_n_countries(void);
 char * __stdcall get_lang_name(const char *,uint32_t);
@@ -31,6 +41,9 @@ uint32_t __stdcall geoip_ptr_get_as_path(uint32_t *buffer,uint32_t idx,uint32_t
 int __stdcall geoip_get_as_by_ip(uint32_t ip);
 uint32_t __stdcall geoip_get_full_as_path(uint32_t *iplist,uint32_t *buffer,int buffersize);
 BOOL __stdcall geoip_is_as_path_safe(uint32_t *path);
+int geoip_is_ip_path_safe(const uint32_t *iplist);
+int geoip_get_as_set(uint32_t ip,uint32_t *set,int max);
+void geoip_as_path_cache_clear(void);
 void __stdcall geoip_as_path_to_str(uint32_t *path,char *buffer,int buffersize);
 /** Return the index of the <b>country</b>'s entry in the GeoIP DB
  * if it is a valid 2-letter country code, otherwise return zero.
@@ -4,11 +4,13 @@ option casemap:none
 
 GlobalAlloc	PROTO	:DWORD,:DWORD
 GlobalFree	PROTO	:DWORD
+geoip_get_country_by_ip	PROTO	:DWORD
+geoip_get_country_name	PROTO	:DWORD
 GPTR = 40h
 
 .code
 
-geoip_get_country_name	PROC	STDCALL	idx:DWORD
+geoip_get_country_name_builtin	PROC	STDCALL	idx:DWORD
 	lea	eax,c_names
 	.if idx>=num_c
 		ret
@@ -30,9 +32,9 @@ geoip_get_country_name	PROC	STDCALL	idx:DWORD
 	include	geoip_c.h
 	include	geoip_as.h
 	include	geoip_lng.h
-geoip_get_country_name	ENDP
+geoip_get_country_name_builtin	ENDP
 
-GeoIP_getfullname	PROC	STDCALL	idx:DWORD
+GeoIP_getfullname_builtin	PROC	STDCALL	idx:DWORD
 	mov	ecx,idx
 	.if ecx<num_c
 		lea	eax,c_names
@@ -56,9 +58,9 @@ GeoIP_getfullname	PROC	STDCALL	idx:DWORD
 		inc	eax
 	.endif
 	ret
-GeoIP_getfullname	ENDP
+GeoIP_getfullname_builtin	ENDP
 
-geoip_get_country_by_ip	PROC	STDCALL	uses ebx ip:DWORD
+geoip_get_country_by_ip_tree	PROC	STDCALL	uses ebx ip:DWORD
 	mov	eax,ip
 	lea	ebx,c_data
 	.while 1
@@ -213,14 +215,19 @@ geoip_get_country_by_ip	PROC	STDCALL	uses ebx ip:DWORD
 	.endif
 	movzx	eax,ax
 	ret
-geoip_get_country_by_ip	ENDP
+geoip_get_country_by_ip_tree	ENDP
 
-geoip_get_n_countries	PROC
+geoip_get_country_data	PROC
+	lea	eax,c_data
+	ret
+geoip_get_country_data	ENDP
+
+geoip_get_n_countries_builtin	PROC
 	mov	eax,num_c
 	ret
-geoip_get_n_countries	ENDP
+geoip_get_n_countries_builtin	ENDP
 
-geoip_get_country	PROC	uses ebx lpCountry:DWORD
+geoip_get_country_builtin	PROC	uses ebx lpCountry:DWORD
 	xor	ecx,ecx
 	lea	ebx,c_names
 	mov	edx,lpCountry
@@ -247,7 +254,7 @@ geoip_get_country	PROC	uses ebx lpCountry:DWORD
 	.endif
 	mov	eax,ecx
 	ret
-geoip_get_country	ENDP
+geoip_get_country_builtin	ENDP
 
 geoip_reverse	PROC	raddr:DWORD
 	mov	eax,raddr
@@ -701,6 +708,74 @@ geoip_get_as_ptr	PROC STDCALL	uses ebx ip_1:DWORD
 	ret
 geoip_get_as_ptr	ENDP
 
+;as_paths holds one record for each path of the AS database: the varint of the last AS of the path, then the varint of
+;the distance back to the record of the same path without its last AS, 0 for paths of one AS. as_pid holds the 3-byte
+;number of the record of the path of each range of as_ip_1 / as_ip_2, as_pblk and as_poff locate the records.
+
+;eax = number of a record of as_paths, returns esi = the record
+as_path_ptr:
+	push	eax
+	shr	eax,6
+	mov	esi,as_pblk[eax*4]
+	pop	eax
+	push	eax
+	movzx	eax,word ptr as_poff[eax*2]
+	lea	esi,as_paths[esi+eax]
+	pop	eax
+	ret
+
+;esi = varint, returns it in eax and esi after it
+as_varint:
+	push	ebx
+	push	ecx
+	push	edx
+	xor	eax,eax
+	xor	ecx,ecx
+	.repeat
+		movzx	edx,byte ptr[esi]
+		inc	esi
+		mov	ebx,edx
+		and	ebx,7fh
+		shl	ebx,cl
+		or	eax,ebx
+		add	cl,7
+	.until !(dl&80h)
+	pop	edx
+	pop	ecx
+	pop	ebx
+	ret
+
+;edx = index in as_ip_1, returns eax = number of the record of its path
+as_get_pid:
+	lea	eax,[edx+edx*2]
+	mov	eax,dword ptr as_pid[eax]
+	and	eax,0ffffffh
+	ret
+
+;Write the AS numbers of the path pid to edi, from the first AS to the last one, and return the last AS.
+as_path_decode	PROC	uses esi ebx ecx edx pid:DWORD
+	local	rev[16]:DWORD
+	mov	ebx,pid
+	xor	ecx,ecx
+	.repeat
+		mov	eax,ebx
+		call	as_path_ptr
+		call	as_varint
+		mov	rev[ecx*4],eax
+		inc	ecx
+		call	as_varint
+		sub	ebx,eax
+	.until (eax==0)||(ecx>=16)
+	push	rev[0]
+	.while ecx
+		dec	ecx
+		mov	eax,rev[ecx*4]
+		stosd
+	.endw
+	pop	eax
+	ret
+as_path_decode	ENDP
+
 geoip_ptr_get_as_path	PROC STDCALL	uses edi esi ebx buffer:DWORD,idx:DWORD,ip_1:DWORD	;3*10*4
 	local	my_as:DWORD,writeptr:DWORD
 	.if idx>=as_cnt
@@ -718,40 +793,8 @@ geoip_ptr_get_as_path	PROC STDCALL	uses edi esi ebx buffer:DWORD,idx:DWORD,ip_1:
 		.break .if eax<as_ip_1[edx*4]
 		.if eax<=as_ip_2[edx*4]
 			push	eax
-			lea	esi,as_path
-			lea	ebx,as_path
-			add	ebx,as_idx[edx*4]
-			.while esi<ebx
-				.if word ptr[esi]==65535
-					mov	eax,[esi+2+4]
-					add	eax,esi
-					.if eax<=ebx && eax!=esi
-						mov	esi,eax
-					.else
-						mov	eax,[esi+2]
-						stosd
-						lea	esi,[esi+2+4+4]
-					.endif
-				.else
-					mov	eax,[esi+2]
-					add	eax,esi
-					.if eax<=ebx && eax!=esi
-						mov	esi,eax
-					.else
-						movzx	eax,word ptr[esi]
-						stosd
-						lea	esi,[esi+2+4]
-					.endif
-				.endif
-			.endw
-			.if esi!=ebx
-				int 3
-			.endif
-			movzx	eax,word ptr[esi]
-			.if eax==65535
-				mov	eax,[esi+2]
-			.endif
-			stosd
+			call	as_get_pid
+			invoke	as_path_decode,eax
 			mov	my_as,eax
 			xor	eax,eax
 			dec	eax
@@ -775,7 +818,6 @@ geoip_ptr_get_as_path	PROC STDCALL	uses edi esi ebx buffer:DWORD,idx:DWORD,ip_1:
 geoip_ptr_get_as_path	ENDP
 
 geoip_get_as_by_ip	PROC	uses edi esi ebx ip_1:DWORD
-	local	my_as:DWORD
 	mov	eax,ip_1
 	invoke	geoip_get_as_ptr,eax
 	mov	edx,eax
@@ -785,39 +827,12 @@ geoip_get_as_by_ip	PROC	uses edi esi ebx ip_1:DWORD
 	.endif
 	mov	eax,ip_1
 	.if eax>=as_ip_1[edx*4] && eax<=as_ip_2[edx*4]
-		push	eax
-		lea	esi,as_path
-		lea	ebx,as_path
-		add	ebx,as_idx[edx*4]
-		.while esi<ebx
-			.if word ptr[esi]==65535
-				mov	eax,[esi+2+4]
-				add	eax,esi
-				.if eax<ebx && eax!=esi
-					mov	esi,eax
-				.else
-					lea	esi,[esi+2+4+4]
-				.endif
-			.else
-				mov	eax,[esi+2]
-				add	eax,esi
-				.if eax<ebx && eax!=esi
-					mov	esi,eax
-				.else
-					lea	esi,[esi+2+4]
-				.endif
-			.endif
-		.endw
-		movzx	eax,word ptr[esi]
-		.if eax==65535
-			mov	eax,[esi+2]
-		.endif
-		mov	my_as,eax
-		pop	eax
+		call	as_get_pid
+		call	as_path_ptr
+		call	as_varint
 	.else
 		mov	eax,65536
 	.endif
-	mov	eax,my_as
 	ret
 geoip_get_as_by_ip	ENDP
 
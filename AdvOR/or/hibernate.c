@@ -22,6 +22,7 @@ hibernating, phase 2:
 */
 
 #include "or.h"
+#include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
@@ -52,6 +53,8 @@ static hibernate_state_t hibernate_state = HIBERNATE_STATE_LIVE;
 /** If are hibernating, when do we plan to wake up? Set to 0 if we
  * aren't hibernating. */
 static time_t hibernate_end_time = 0;
+/** When did we last become dormant? 0 if we're not dormant. */
+static time_t hibernate_dormant_since = 0;
 /** If we are shutting down, when do we plan finally exit? Set to 0 if
  * we aren't shutting down. */
 static time_t shutdown_time = 0;
@@ -232,6 +235,32 @@ accounting_add_bytes(size_t n_read, size_t n_written, int seconds)
   n_seconds_active_in_interval += (seconds < 10) ? seconds : 0;
 }
 
+/** If AccountingPacing is set, return how many bytes per second we can
+ * read and write from <b>now</b> on and still have some of our quota left
+ * at the end of the accounting interval.  The buckets are refilled with
+ * this rate, so it follows our usage every time they are refilled; we go
+ * faster when we used less than our share and slower when we used more.
+ * Return 0 if we aren't pacing. */
+int
+accounting_get_paced_rate(time_t now)
+{
+  or_options_t *options = get_options();
+  uint64_t used, rate;
+  time_t left;
+
+  if (!options->AccountingPacing || !options->AccountingMax ||
+      !interval_end_time || now >= interval_end_time)
+    return 0;
+  used = MAX(n_bytes_read_in_interval, n_bytes_written_in_interval);
+  if (used >= options->AccountingMax)
+    return 1; /* hibernate_hard_limit_reached() puts us to sleep. */
+  left = interval_end_time - now;
+  rate = (options->AccountingMax - used) / (uint64_t)left;
+  if (rate > INT_MAX)
+    rate = INT_MAX;
+  return rate ? (int)rate : 1;
+}
+
 /** If get_end, return the end of the accounting period that contains
  * the time <b>now</b>.  Else, return the start of the accounting
  * period that contains the time <b>now</b> */
@@ -503,6 +532,17 @@ accounting_set_wakeup_time(void)
     crypto_rand(digest, DIGEST_LEN);
   }
 
+  if (get_options()->AccountingPacing) {
+    char buf1[ISO_TIME_LEN+1];
+    char buf2[ISO_TIME_LEN+1];
+    format_local_iso_time(buf1, interval_start_time);
+    format_local_iso_time(buf2, interval_end_time);
+    interval_wakeup_time = interval_start_time;
+
+    log_notice(LD_ACCT,get_lang_str(LANG_LOG_HIBERNATE_PACING),buf1,buf2);
+    return;
+  }
+
   if (!expected_bandwidth_usage) {
     char buf1[ISO_TIME_LEN+1];
     char buf2[ISO_TIME_LEN+1];
@@ -651,6 +691,8 @@ static int
 hibernate_soft_limit_reached(void)
 {
   const uint64_t acct_max = get_options()->AccountingMax;
+  if (get_options()->AccountingPacing)
+    return 0; /* The paced rate makes our quota last until the end. */
 #define SOFT_LIM_PCT (.95)
 #define SOFT_LIM_BYTES (500*1024*1024)
 #define SOFT_LIM_MINUTES (3*60)
@@ -743,6 +785,11 @@ hibernate_end(hibernate_state_t new_state)
   hibernate_end_time = 0; /* no longer hibernating */
   stats_n_seconds_working = 0; /* reset published uptime */
   time_to_check_listeners = 0;
+  if (hibernate_dormant_since) {
+    time_t now = get_time(NULL);
+    circuit_warm_start(now, (int)(now - hibernate_dormant_since));
+    hibernate_dormant_since = 0;
+  }
 }
 
 /** A wrapper around hibernate_begin, for when we get SIGINT. */
@@ -773,6 +820,7 @@ void hibernate_go_dormant(time_t now)
     hibernate_begin(HIBERNATE_STATE_DORMANT, now);
 
   log_notice(LD_ACCT,get_lang_str(LANG_LOG_HIBERNATE_PERIOD_STARTED));
+  hibernate_dormant_since = now;
 
   /* Close all OR/AP/exit conns. Leave dir conns because we still want
    * to be able to upload server descriptors so people know we're still
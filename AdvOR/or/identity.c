@@ -1,6 +1,7 @@
 #include "or.h"
 #include "proxy.h"
 #include "plugins.h"
+#include "perf.h"
 #include "geoip.h"
 #include "config.h"
 #include "circuitlist.h"
@@ -10,10 +11,13 @@
 #include "connection_edge.h"
 #include "router.h"
 #include "routerlist.h"
+#include "watchdog.h"
+#include "procmon.h"
 #include <shlobj.h>
 
 #define MAX_CACHED_WARNS 10
 #define MAX_CACHED_PIDS 100
+#define MAX_WATCHED_PIDS 256
 #define IDENTITY_EXPIRE_CIRCUITS 1
 #define IDENTITY_EXPIRE_TRACKED_HOSTS 2
 #define IDENTITY_DESTROY_CIRCUITS 4
@@ -24,6 +28,7 @@
 #define IDENTITY_EXIT_CHANGED 128
 #define IDENTITY_ADDRMAP_CHANGED 256
 #define IDENTITY_TRACKHOST_CHANGED 512
+#define IDENTITY_RESET_DNS_PREFETCH 1024
 
 #define STORED_PROC_FIREFOX 0
 #define STORED_PROC_CHROME 1
@@ -47,11 +52,36 @@ int signewnym_pending = 0;
 char *appdata = NULL;
 char *localappdata = NULL;
 char *userprofile = NULL;
+/** Nonzero while the background jobs of cookie_purge_start() run. */
+static volatile LONG cookie_purge_running = 0;
+/** Set when no background jobs of cookie_purge_start() run. */
+static HANDLE cookie_purge_idle = NULL;
+
+/** A listing of a browser profile directory, kept until the directory is written to. */
+typedef struct profile_dir_t
+{	FILETIME mtime;
+	smartlist_t *entries;
+} profile_dir_t;
+
+/** Listings of the browser profile directories, by the pattern that listed them. */
+static strmap_t *profile_dirs = NULL;
+/** Protects profile_dirs from the cookie purge jobs, which run in parallel. */
+static tor_mutex_t *profile_dirs_mutex = NULL;
+static void profile_dir_free(void *_dir);
+
+/** A process that connected to us, and the monitor that tells us when it ends. */
+typedef struct watched_process_t
+{	DWORD pid;
+	tor_process_monitor_t *procmon;
+} watched_process_t;
+
+/** The processes that we watch for their exit. Only the Tor thread touches it. */
+static smartlist_t *watched_processes = NULL;
 
 int randomize_wmplayer(void);
 int delete_flash_cookies(char **msg,int *msgsize);
 int delete_silverlight_cookies(char **msg,int *msgsize);
-void delete_cookies(char **msg,int *msgsize);
+int cookie_purge_start(char *msg);
 void dlgForceTor_scheduledExec(void);
 void scheduled_addrmap_change(void);
 void scheduled_trackhost_change(void);
@@ -68,6 +98,7 @@ void identity_auto_change(time_t now);
 void identity_exit(void);
 void get_appdata(void);
 void free_smartlist(smartlist_t *entries);
+smartlist_t *profile_listdir(char *pattern);
 void delete_ie_cookies(DWORD pid,const char *module,char **msg,int *msgsize);
 void delete_opera_cookies(DWORD pid,const char *module,char **msg,int *msgsize,const char *path);
 void delete_firefox_cookies(DWORD pid,const char *module,char **msg,int *msgsize,const char *path);
@@ -135,8 +166,65 @@ unsigned long get_seed(int bitpos)	//128*2
 }
 
 
+/** Process-termination monitor callback for the process of <b>arg</b>, a watched_process_t: forget the process, and close its connections that wait for a circuit or for a reply, since nobody will read them. The open ones get their EOF from the socket. */
+static void identity_process_exited(void *arg)
+{	watched_process_t *wp = arg;
+	DWORD pid = wp->pid;
+	int i,n = 0;
+	smartlist_remove(watched_processes,wp);
+	tor_process_monitor_free(wp->procmon);
+	tor_free(wp);
+	for(i = 0;i<pid_index;i++)
+	{	if(pid_list[i]==pid)
+		{	pid_list[i] = pid_list[--pid_index];
+			break;
+		}
+	}
+	SMARTLIST_FOREACH(get_connection_array(),connection_t *,conn,
+	{	if(conn->type==CONN_TYPE_AP && conn->pid==pid && !conn->marked_for_close && conn->state!=AP_CONN_STATE_OPEN)
+		{	connection_edge_reached_eof(TO_EDGE_CONN(conn));
+			n++;
+		}
+	});
+	log_info(LD_APP,get_lang_str(LANG_LOG_IDENTITY_PROCESS_EXITED),(unsigned long)pid,n);
+}
+
+/** Have the system tell us when <b>pid</b> ends, unless we watch it already. */
+static void identity_watch_process(DWORD pid)
+{	watched_process_t *wp;
+	char spec[16];
+	const char *msg = NULL;
+	if(!pid || pid==GetCurrentProcessId())	return;
+	if(!watched_processes)	watched_processes = smartlist_create();
+	SMARTLIST_FOREACH(watched_processes,watched_process_t *,w,
+	{	if(w->pid==pid)	return;
+	});
+	if(smartlist_len(watched_processes) >= MAX_WATCHED_PIDS)	return;
+	wp = tor_malloc_zero(sizeof(watched_process_t));
+	wp->pid = pid;
+	tor_snprintf(spec,sizeof(spec),"%lu",(unsigned long)pid);
+	wp->procmon = tor_process_monitor_new(tor_libevent_get_base(),spec,LD_APP,identity_process_exited,wp,&msg);
+	if(!wp->procmon)
+	{	tor_free(wp);
+		return;
+	}
+	smartlist_add(watched_processes,wp);
+}
+
+/** Stop watching all processes. */
+void identity_processes_free_all(void)
+{	if(!watched_processes)	return;
+	SMARTLIST_FOREACH(watched_processes,watched_process_t *,wp,
+	{	tor_process_monitor_free(wp->procmon);
+		tor_free(wp);
+	});
+	smartlist_free(watched_processes);
+	watched_processes = NULL;
+}
+
 void identity_add_process(DWORD pid)
 {	int i;
+	identity_watch_process(pid);
 	for(i = 0;i<pid_index;i++)
 	{	if(pid_list[i]==pid)	return;
 	}
@@ -155,6 +243,11 @@ void identity_init(void)
 	identity_seed2 &= 0x7fffffff;
 	identity_seed3 &= 0x7fffffff;
 	identity_seed4 &= 0x7fffffff;
+	if(!cookie_purge_idle)	cookie_purge_idle = CreateEvent(NULL,TRUE,TRUE,NULL);
+	if(!profile_dirs)
+	{	profile_dirs = strmap_new();
+		profile_dirs_mutex = tor_mutex_new();
+	}
 }
 
 void schedule_expire_tracked_hosts(void)
@@ -190,7 +283,9 @@ void signewnym_scheduled_tasks(void)
 	{	circuit_expire_all_circuits();
 		rend_client_purge_state();
 	}
+	if(signewnym_pending & (IDENTITY_DESTROY_CIRCUITS|IDENTITY_EXPIRE_CIRCUITS))	connection_ap_exit_failures_clear();
 	if(signewnym_pending & IDENTITY_EXPIRE_TRACKED_HOSTS)	addressmap_clear_transient();
+	if(signewnym_pending & IDENTITY_RESET_DNS_PREFETCH)	addressmap_dns_prefetch_reset();
 	if(signewnym_pending & IDENTITY_REGISTER_ADDRESSMAPS)
 	{	config_register_addressmaps(tmpOptions);
 		parse_virtual_addr_network(tmpOptions->VirtualAddrNetwork, 0, 0);
@@ -212,19 +307,17 @@ void signewnym_scheduled_tasks(void)
 }
 
 void signewnym_impl(time_t now,int msgshow)
-{	char *msg = NULL,*msgp = NULL;
-	int msgsize = 0;
+{	char *msg = NULL;
 	(void) now;
 	if(msgshow)
 	{	msg = tor_malloc(2048);
 		char *str=print_router_sel();
 		tor_snprintf(msg,2047,"%s\r\n\r\n",str);
-		msgsize = 2048 - strlen(msg);
 		tor_free(str);
-		msgp = msg + strlen(msg);
 	}
 	showLastExit(NULL,0);
 	plugins_new_identity();
+	stream_trace_new_identity();
 	if((tmpOptions->BestTimeDelta)&&(tmpOptions->DirFlags&DIR_FLAG_USE_ROUTER_TIME)) delta_t=tmpOptions->BestTimeDelta;
 	else delta_t=crypto_rand_int(tmpOptions->MaxTimeDelta*2)-tmpOptions->MaxTimeDelta;
 	update_best_delta_t(delta_t);
@@ -240,14 +333,15 @@ void signewnym_impl(time_t now,int msgshow)
 	}
 	showLastExit(NULL,-1);
 	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_EXPIRE_HTTP_COOKIES)		signewnym_pending |= IDENTITY_EXPIRE_COOKIES;
-	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DELETE_HTTP_COOKIES)
-	{	delete_cookies(&msgp,&msgsize);
-	}
-	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DELETE_FLASH_COOKIES)
-	{	delete_flash_cookies(&msgp,&msgsize);
+	if(msgshow && (tmpOptions->IdentityFlags&IDENTITY_FLAG_NO_MESSAGEBOX))
+	{	tor_free(msg);
+		msgshow = 0;
 	}
-	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DELETE_SILVERLIGHT_COOKIES)
-	{	delete_silverlight_cookies(&msgp,&msgsize);
+	/* the cookies are deleted by background jobs that show the message box when they finish */
+	if(tmpOptions->IdentityFlags&(IDENTITY_FLAG_DELETE_HTTP_COOKIES|IDENTITY_FLAG_DELETE_FLASH_COOKIES|IDENTITY_FLAG_DELETE_SILVERLIGHT_COOKIES))
+	{	watchdog_push("cookie_purge_start",NULL);
+		if(cookie_purge_start(msg))	msgshow = 0;
+		watchdog_pop();
 	}
 	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_RANDOMIZE_WMPLAYER_ID)
 	{	randomize_wmplayer();
@@ -255,11 +349,11 @@ void signewnym_impl(time_t now,int msgshow)
 	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DESTROY_CIRCUITS)		signewnym_pending |= IDENTITY_DESTROY_CIRCUITS;
 //	http_warnings[0] = 0;
 //	http_warn_idx = 0;
-	if(msgshow && !(tmpOptions->IdentityFlags&IDENTITY_FLAG_NO_MESSAGEBOX))
+	if(msgshow)
 	{	LangMessageBox(NULL,msg,LANG_MB_NEW_IDENTITY,MB_OK|MB_TASKMODAL|MB_SETFOREGROUND);
 		tor_free(msg);
 	}
-	signewnym_pending |= IDENTITY_EXIT_CHANGED;
+	signewnym_pending |= IDENTITY_EXIT_CHANGED|IDENTITY_RESET_DNS_PREFETCH;
 	last_country = -1;
 	pid_index = 0;
 }
@@ -274,6 +368,7 @@ void identity_auto_change(time_t now)
 	{	showLastExit(NULL,-1);
 		signewnym_pending |= IDENTITY_EXPIRE_CIRCUITS;
 		signewnym_pending |= IDENTITY_EXPIRE_TRACKED_HOSTS;
+		signewnym_pending |= IDENTITY_RESET_DNS_PREFETCH;
 		last_country = -1;
 		pid_index = 0;
 	}
@@ -282,10 +377,25 @@ void identity_auto_change(time_t now)
 }
 
 void identity_exit(void)
-{	if(appdata)		tor_free(appdata);
+{	if(cookie_purge_idle)
+	{	WaitForSingleObject(cookie_purge_idle,10000);
+		CloseHandle(cookie_purge_idle);
+		cookie_purge_idle = NULL;
+	}
+	if(profile_dirs)
+	{	STRMAP_FOREACH(profile_dirs,pattern,profile_dir_t *,dir)
+		{	profile_dir_free(dir);
+		} STRMAP_FOREACH_END;
+		strmap_free(profile_dirs,NULL);
+		profile_dirs = NULL;
+		tor_mutex_free(profile_dirs_mutex);
+		profile_dirs_mutex = NULL;
+	}
+	if(appdata)		tor_free(appdata);
 	if(localappdata)	tor_free(localappdata);
 	if(userprofile)		tor_free(userprofile);
-	free_cookies();
+	free_all_cookies();
+	free_header_templates();
 }
 
 int get_identity_user_agent(void)
@@ -496,6 +606,51 @@ void free_smartlist(smartlist_t *entries)
 	}
 }
 
+static void profile_dir_free(void *_dir)
+{	profile_dir_t *dir = _dir;
+	free_smartlist(dir->entries);
+	tor_free(dir);
+}
+
+/** Like listdir(), but keep what we found in profile_dirs and list the directory again only when its last write time changed, that is when something was created, deleted or renamed in it. The caller frees the result with free_smartlist(). */
+smartlist_t *profile_listdir(char *pattern)
+{	char *dirname = tor_strdup(pattern);
+	int i = strlen(dirname);
+	FILETIME mtime;
+	profile_dir_t *dir;
+	smartlist_t *result = NULL;
+	if(i > 4 && !strcmp(dirname+i-4,"\\*.*"))	dirname[i-4] = 0;
+	i = get_file_write_time(dirname,&mtime);
+	tor_free(dirname);
+	if(!profile_dirs)	return i ? listdir(pattern) : NULL;
+	tor_mutex_acquire(profile_dirs_mutex);
+	dir = strmap_get(profile_dirs,pattern);
+	if(!i)
+	{	if(dir)
+		{	strmap_remove(profile_dirs,pattern);
+			profile_dir_free(dir);
+		}
+	}
+	else
+	{	if(!dir)
+		{	dir = tor_malloc_zero(sizeof(profile_dir_t));
+			strmap_set(profile_dirs,pattern,dir);
+			dir->entries = listdir(pattern);
+		}
+		else if(CompareFileTime(&dir->mtime,&mtime))
+		{	free_smartlist(dir->entries);
+			dir->entries = listdir(pattern);
+		}
+		dir->mtime = mtime;
+		if(dir->entries)
+		{	result = smartlist_create();
+			SMARTLIST_FOREACH(dir->entries,char *,fn,smartlist_add(result,tor_strdup(fn)));
+		}
+	}
+	tor_mutex_release(profile_dirs_mutex);
+	return result;
+}
+
 const char *fpath1 = "\\Macromedia\\Flash Player\\#SharedObjects";
 const char *fpath1a = "\\Macromedia\\Flash Player";	// some versions of flash players save cookies here
 const char *fpath2 = "\\Macromedia\\Flash Player\\macromedia.com\\support\\flashplayer\\sys";
@@ -510,13 +665,13 @@ int delete_flash_cookies(char **msg,int *msgsize)
 		char *dstr = tor_malloc(512);
 		tor_snprintf(newpath,1023,"%s%s\\*.*",appdata,fpath1);
 		smartlist_t *objdir,*domains;
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	tmppath = tor_malloc(1024);
 			SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s%s\\%s\\*.*",appdata,fpath1,fn);
 				log(LOG_INFO,LD_APP,get_lang_str(LANG_IDENTITY_DELETING_FILE),newpath);
-				domains = listdir(newpath);
+				domains = profile_listdir(newpath);
 				if(domains)
 				{	SMARTLIST_FOREACH(domains,char *,fn1,
 					{	if(*msgsize)
@@ -540,14 +695,14 @@ int delete_flash_cookies(char **msg,int *msgsize)
 			tor_free(tmppath);
 		}
 		tor_snprintf(newpath,1023,"%s%s\\*.*",appdata,fpath1a);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	tmppath = tor_malloc(1024);
 			SMARTLIST_FOREACH(objdir,char *,fn,
 			{	if(strcasecmp(fn,"#SharedObjects") && strcasecmp(fn,"macromedia.com"))
 				{	tor_snprintf(newpath,1023,"%s%s\\%s\\*.*",appdata,fpath1a,fn);
 					log(LOG_INFO,LD_APP,get_lang_str(LANG_IDENTITY_DELETING_FILE),newpath);
-					domains = listdir(newpath);
+					domains = profile_listdir(newpath);
 					if(domains)
 					{	SMARTLIST_FOREACH(domains,char *,fn1,
 						{	if(*msgsize)
@@ -578,7 +733,7 @@ int delete_flash_cookies(char **msg,int *msgsize)
 		}
 		numcookies = 0;
 		tor_snprintf(newpath,1023,"%s%s\\*.*",appdata,fpath2);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	tmppath = tor_malloc(1024);
 			SMARTLIST_FOREACH(objdir,char *,fn,
@@ -640,7 +795,7 @@ int delete_flash_cookies(char **msg,int *msgsize)
 		}
 		numcookies = 0;
 		tor_snprintf(newpath,1023,"%s%s\\*.*",appdata,fpath3);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	tmppath = tor_malloc(1024);
 			SMARTLIST_FOREACH(objdir,char *,fn,
@@ -669,7 +824,7 @@ int delete_silverlight_cookies(char **msg,int *msgsize)
 	char *newpath = tor_malloc(1024);
 	if(localappdata)
 	{	tor_snprintf(newpath,1023,"%s\\Microsoft\\Silverlight\\is\\*.*",localappdata);		// 2k/XP
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\Microsoft\\Silverlight\\is\\%s",localappdata,fn);
@@ -681,7 +836,7 @@ int delete_silverlight_cookies(char **msg,int *msgsize)
 	}
 	if(userprofile)
 	{	tor_snprintf(newpath,1023,"%s\\AppData\\LocalLow\\Microsoft\\Silverlight\\is\\*.*",userprofile);	// 7ista
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\AppData\\LocalLow\\Microsoft\\Silverlight\\is\\%s",userprofile,fn);
@@ -819,7 +974,7 @@ void delete_ie_cookies(DWORD pid,const char *module,char **msg,int *msgsize)
 	smartlist_t *objdir;
 	if(userprofile)
 	{	tor_snprintf(newpath,1023,"%s\\Cookies\\*.*",userprofile);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\Cookies\\%s",userprofile,fn);
@@ -830,7 +985,7 @@ void delete_ie_cookies(DWORD pid,const char *module,char **msg,int *msgsize)
 			free_smartlist(objdir);
 		}
 		tor_snprintf(newpath,1023,"%s\\AppData\\LocalLow\\Microsoft\\Internet Explorer\\DOMStore\\*.*",userprofile);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\AppData\\LocalLow\\Microsoft\\Internet Explorer\\DOMStore\\%s",userprofile,fn);
@@ -841,7 +996,7 @@ void delete_ie_cookies(DWORD pid,const char *module,char **msg,int *msgsize)
 	}
 	if(appdata)
 	{	tor_snprintf(newpath,1023,"%s\\Microsoft\\Windows\\Cookies\\*.*",appdata);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\Microsoft\\Windows\\Cookies\\%s",appdata,fn);
@@ -854,7 +1009,7 @@ void delete_ie_cookies(DWORD pid,const char *module,char **msg,int *msgsize)
 	}
 	if(localappdata)
 	{	tor_snprintf(newpath,1023,"%s\\Microsoft\\Internet Explorer\\DOMStore\\*.*",localappdata);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\Microsoft\\Internet Explorer\\DOMStore\\%s",localappdata,fn);
@@ -887,7 +1042,7 @@ void delete_ie_cookies(DWORD pid,const char *module,char **msg,int *msgsize)
 		if(i && tmp[i-1]=='\\')	i--;
 		tmp[i] = 0;
 		tor_snprintf(newpath,1023,"%s\\*.*",tmp);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\%s",tmp,fn);
@@ -1112,7 +1267,7 @@ void delete_opera_cookies(DWORD pid,const char *module,char **msg,int *msgsize,c
 	if(!portable)
 	{	if(appdata)
 		{	tor_snprintf(newpath,1023,"%s\\Opera\\*.*",appdata);
-			objdir = listdir(newpath);
+			objdir = profile_listdir(newpath);
 			if(objdir)
 			{	SMARTLIST_FOREACH(objdir,char *,fn,
 				{	tor_snprintf(newpath,1023,"%s\\Opera\\%s\\cookies4.dat",appdata,fn);
@@ -1136,7 +1291,7 @@ void delete_opera_cookies(DWORD pid,const char *module,char **msg,int *msgsize,c
 		}
 		if(localappdata)
 		{	tor_snprintf(newpath,1023,"%s\\Opera\\*.*",localappdata);
-			objdir = listdir(newpath);
+			objdir = profile_listdir(newpath);
 			if(objdir)
 			{	SMARTLIST_FOREACH(objdir,char *,fn,
 				{	tor_snprintf(newpath,1023,"%s\\Opera\\%s\\icons\\cache\\cookies4.dat",localappdata,fn);
@@ -1187,7 +1342,7 @@ void delete_firefox_cookies(DWORD pid,const char *module,char **msg,int *msgsize
 	int numcookies = 0;
 	if(appdata)
 	{	tor_snprintf(newpath,1023,"%s\\Mozilla\\Firefox\\Profiles\\*.*",appdata);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\Mozilla\\Firefox\\Profiles\\%s\\cookies.sqlite",appdata,fn);
@@ -1341,7 +1496,7 @@ void delete_chrome_cookies(DWORD pid,const char *module,char **msg,int *msgsize,
 		tor_snprintf(newpath,1023,"%s\\Google\\Chrome\\User Data\\Default\\Extension Cookies",localappdata);
 		if(file_exists(newpath) && ForceDelete(newpath))	numcookies ++;
 		tor_snprintf(newpath,1023,"%s\\Google\\Chrome\\User Data\\Default\\Local Storage\\*.*",localappdata);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	if(!strcasecmpstart(fn,"http"))
@@ -1462,7 +1617,7 @@ void delete_safari_cookies(DWORD pid,const char *module,char **msg,int *msgsize,
 	}
 	if(localappdata)
 	{	tor_snprintf(newpath,1023,"%s\\Apple Computer\\Safari\\LocalStorage\\*.*",localappdata);
-		objdir = listdir(newpath);
+		objdir = profile_listdir(newpath);
 		if(objdir)
 		{	SMARTLIST_FOREACH(objdir,char *,fn,
 			{	tor_snprintf(newpath,1023,"%s\\Apple Computer\\Safari\\LocalStorage\\%s",localappdata,fn);
@@ -1494,15 +1649,60 @@ void delete_safari_cookies(DWORD pid,const char *module,char **msg,int *msgsize,
 	tor_free(newpath);
 }
 
-#define COOKIES_IE 1
-#define COOKIES_OPERA 2
+#define COOKIES_IE 0
+#define COOKIES_OPERA 1
+#define COOKIES_CHROME 2
 #define COOKIES_FIREFOX 3
-#define COOKIES_CHROME 4
-#define COOKIES_SAFARI 5
-void delete_cookies(char **msg,int *msgsize)
+#define COOKIES_SAFARI 4
+#define COOKIES_FLASH 5
+#define COOKIES_SILVERLIGHT 6
+#define COOKIES_KINDS 7
+#define COOKIE_PURGE_MSG_SIZE 1024
+
+static const char *cookie_purge_names[COOKIES_KINDS] = {"Internet Explorer","Opera","Chrome","Firefox","Safari","Flash","Silverlight"};
+
+struct cookie_purge_t;
+
+/** A background job that deletes the cookies of one kind, for every browser process of that kind that used us. */
+typedef struct cookie_purge_job_t
+{	struct cookie_purge_t *purge;
+	int kind;
+	int n;
+	DWORD pids[MAX_CACHED_PIDS];
+	char *paths[MAX_CACHED_PIDS];
+	char msg[COOKIE_PURGE_MSG_SIZE];
+} cookie_purge_job_t;
+
+/** The jobs started by one identity change. */
+typedef struct cookie_purge_t
+{	cookie_purge_job_t *jobs[COOKIES_KINDS];
+	int n_jobs;
+	volatile LONG n_left;
+	DWORD started;
+	char *msg;	/**< The text of the new identity message box, or NULL if we shouldn't show it. */
+} cookie_purge_t;
+
+/** Add the browser process <b>pid</b>, that loaded <b>path</b>, to the job of <b>kind</b>, creating it if needed. */
+static void cookie_purge_add(cookie_purge_t *purge,int kind,DWORD pid,const char *path)
+{	cookie_purge_job_t *job = purge->jobs[kind];
+	if(!job)
+	{	job = tor_malloc_zero(sizeof(cookie_purge_job_t));
+		job->purge = purge;
+		job->kind = kind;
+		purge->jobs[kind] = job;
+		purge->n_jobs++;
+	}
+	if(job->n < MAX_CACHED_PIDS)
+	{	job->pids[job->n] = pid;
+		job->paths[job->n] = path ? tor_strdup(path) : NULL;
+		job->n++;
+	}
+}
+
+/** Find the browsers loaded by the processes that used us since the last identity change, and add a job for each kind of browser. */
+static void cookie_purge_add_browsers(cookie_purge_t *purge)
 {	int i,j,k;
 	smartlist_t *modules;
-	int cdeleted = 0;
 	for(i=0;i<pid_index;i++)
 	{	modules = list_modules(pid_list[i]);
 		if(modules)
@@ -1511,28 +1711,111 @@ void delete_cookies(char **msg,int *msgsize)
 				for(j=0;fn[j];j++)
 				{	if(fn[j]=='\\')	k = j + 1;
 				}
-				if(!strcasecmpstart(fn+k,"wininet.dll") && ((cdeleted & COOKIES_IE) == 0))
-				{	delete_ie_cookies(pid_list[i],"wininet.dll",msg,msgsize);
-					cdeleted |= COOKIES_IE;
-				}
+				if(!strcasecmpstart(fn+k,"wininet.dll") && !purge->jobs[COOKIES_IE])	/* IE's cookies are deleted once for all processes */
+					cookie_purge_add(purge,COOKIES_IE,pid_list[i],NULL);
 				else if(!strcasecmpstart(fn+k,"opera.dll"))
-				{	delete_opera_cookies(pid_list[i],"opera.dll",msg,msgsize,fn);
-					cdeleted |= COOKIES_OPERA;
-				}
+					cookie_purge_add(purge,COOKIES_OPERA,pid_list[i],fn);
 				else if(!strcasecmpstart(fn+k,"chrome.dll"))
-				{	delete_chrome_cookies(pid_list[i],"chrome.dll",msg,msgsize,fn);
-					cdeleted |= COOKIES_CHROME;
-				}
+					cookie_purge_add(purge,COOKIES_CHROME,pid_list[i],fn);
 				else if(!strcasecmpstart(fn+k,"xul.dll"))
-				{	delete_firefox_cookies(pid_list[i],"xul.dll",msg,msgsize,fn);
-					cdeleted |= COOKIES_FIREFOX;
-				}
+					cookie_purge_add(purge,COOKIES_FIREFOX,pid_list[i],fn);
 				else if(!strcasecmpstart(fn+k,"cfnetwork.dll"))
-				{	delete_safari_cookies(pid_list[i],"CFNetwork.dll",msg,msgsize,fn);
-					cdeleted |= COOKIES_SAFARI;
-				}
+					cookie_purge_add(purge,COOKIES_SAFARI,pid_list[i],fn);
 			});
 			free_smartlist(modules);
 		}
 	}
 }
+
+/** Called by the last job of <b>purge</b> to finish: free it, let the next identity change start its own jobs, and show the message box with what all the jobs deleted. */
+static void cookie_purge_finish(cookie_purge_t *purge)
+{	char *msg = purge->msg;
+	int i,j;
+	log(LOG_NOTICE,LD_APP,get_lang_str(LANG_LOG_IDENTITY_PURGE_FINISHED),(unsigned long)(GetTickCount() - purge->started));
+	for(i=0;i<COOKIES_KINDS;i++)
+	{	cookie_purge_job_t *job = purge->jobs[i];
+		if(job)
+		{	if(msg)	strlcat(msg,job->msg,2048);
+			for(j=0;j<job->n;j++)	tor_free(job->paths[j]);
+			tor_free(job);
+		}
+	}
+	tor_free(purge);
+	InterlockedExchange(&cookie_purge_running,0);
+	SetEvent(cookie_purge_idle);
+	if(msg)
+	{	LangMessageBox(NULL,msg,LANG_MB_NEW_IDENTITY,MB_OK|MB_TASKMODAL|MB_SETFOREGROUND);
+		tor_free(msg);
+	}
+}
+
+/** Thread function of a cookie_purge_job_t. */
+static void cookie_purge_main(void *arg)
+{	cookie_purge_job_t *job = arg;
+	cookie_purge_t *purge = job->purge;
+	char *msg = job->msg;
+	int msgsize = purge->msg ? COOKIE_PURGE_MSG_SIZE : 0;
+	int i;
+	LONG left;
+	DWORD started = GetTickCount();
+	switch(job->kind)
+	{	case COOKIES_IE:
+			delete_ie_cookies(job->pids[0],"wininet.dll",&msg,&msgsize);
+			break;
+		case COOKIES_OPERA:
+			for(i=0;i<job->n;i++)	delete_opera_cookies(job->pids[i],"opera.dll",&msg,&msgsize,job->paths[i]);
+			break;
+		case COOKIES_CHROME:
+			for(i=0;i<job->n;i++)	delete_chrome_cookies(job->pids[i],"chrome.dll",&msg,&msgsize,job->paths[i]);
+			break;
+		case COOKIES_FIREFOX:
+			for(i=0;i<job->n;i++)	delete_firefox_cookies(job->pids[i],"xul.dll",&msg,&msgsize,job->paths[i]);
+			break;
+		case COOKIES_SAFARI:
+			for(i=0;i<job->n;i++)	delete_safari_cookies(job->pids[i],"CFNetwork.dll",&msg,&msgsize,job->paths[i]);
+			break;
+		case COOKIES_FLASH:
+			delete_flash_cookies(&msg,&msgsize);
+			break;
+		case COOKIES_SILVERLIGHT:
+			delete_silverlight_cookies(&msg,&msgsize);
+			break;
+		default:
+			break;
+	}
+	left = InterlockedDecrement(&purge->n_left);
+	log(LOG_NOTICE,LD_APP,get_lang_str(LANG_LOG_IDENTITY_PURGE_JOB_DONE),cookie_purge_names[job->kind],(unsigned long)(GetTickCount() - started),purge->n_jobs - (int)left,purge->n_jobs);
+	if(!left)	cookie_purge_finish(purge);
+}
+
+/** Start the background jobs that delete the browser, Flash and Silverlight cookies that IdentityFlags asks for, one job for each kind, so that a new identity doesn't wait for them.  If it returns 1, the jobs own <b>msg</b> and show it with what they deleted when they finish; if it returns 0, no jobs were started and the caller keeps msg. */
+int cookie_purge_start(char *msg)
+{	cookie_purge_t *purge;
+	int i,n;
+	if(InterlockedCompareExchange(&cookie_purge_running,1,0) != 0)
+	{	log(LOG_NOTICE,LD_APP,get_lang_str(LANG_LOG_IDENTITY_PURGE_BUSY));
+		return 0;
+	}
+	get_appdata();	/* the jobs only read appdata, localappdata and userprofile */
+	purge = tor_malloc_zero(sizeof(cookie_purge_t));
+	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DELETE_HTTP_COOKIES)		cookie_purge_add_browsers(purge);
+	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DELETE_FLASH_COOKIES)	cookie_purge_add(purge,COOKIES_FLASH,0,NULL);
+	if(tmpOptions->IdentityFlags&IDENTITY_FLAG_DELETE_SILVERLIGHT_COOKIES)	cookie_purge_add(purge,COOKIES_SILVERLIGHT,0,NULL);
+	if(!purge->n_jobs)
+	{	tor_free(purge);
+		InterlockedExchange(&cookie_purge_running,0);
+		return 0;
+	}
+	purge->msg = msg;
+	purge->started = GetTickCount();
+	purge->n_left = n = purge->n_jobs;
+	ResetEvent(cookie_purge_idle);
+	log(LOG_NOTICE,LD_APP,get_lang_str(LANG_LOG_IDENTITY_PURGE_STARTED),n);
+	for(i=0;i<COOKIES_KINDS;i++)
+	{	cookie_purge_job_t *job = purge->jobs[i];
+		if(job && spawn_func(cookie_purge_main,job) < 0)
+			cookie_purge_main(job);
+		if(job && !--n)	break;	/* purge may be freed by now */
+	}
+	return 1;
+}
@@ -3386,6 +3386,116 @@ lang_str_info lang_tbl[]={
 {LANG_LOG_RENDSERVICE_DISABLING,"Disabling hidden service key %i (%s.onion)"},
 {LANG_LOG_UNKNOWN_LOGIN_VERSION,"Unknown login version"},
 {LANG_LOG_UNRECOGNIZED_LOGIN,"Received an unrecognized login with user: \"%s\" and password \"%s\". This request is allowed, but please configure your browser properly."},
-
+{LANG_LOG_BUFFERS_CHUNK_USAGE,"  %d-byte chunks: %d in use, peak %d since last cleaning, %d ever; keeping %d [%u hits, %u misses in the last interval]"},
+{LANG_HS_GEN_STATUS,"%d threads, %I64u keys tried, %lu keys/s, expected time for a full match: %s"},
+{LANG_LOG_CONN_OR_TLS_SESSION_RESUMED,"Resumed TLS session with %s."},
+{LANG_LOG_FILE_IO_DAT_SECTION_CORRUPT,"The encrypted copy of \"%s\" is damaged or was modified; ignoring it."},
+{LANG_LOG_FILE_IO_DAT_WRITE_FAILED,"Error writing encrypted configuration data to \"%s\"; keeping the previous copy."},
+{LANG_LOG_FILE_IO_DAT_TRUNCATED,"The encrypted configuration data is truncated or damaged; some files could not be read."},
+{LANG_LOG_GEOIP_DB_LOADED,"Loaded the GeoIP database from \"%s\" (%d ranges, %d countries)."},
+{LANG_LOG_GEOIP_DB_INVALID,"The GeoIP database \"%s\" is not valid; using the built-in database."},
+{LANG_LOG_GEOIP6_LOADED,"Loaded the IPv6 GeoIP table from \"%s\" (%d ranges)."},
+{LANG_LOG_GEOIP6_INVALID_LINE,"Ignoring an invalid line in the IPv6 GeoIP table: %s"},
+{LANG_LOG_NTLM_POOL_ADDED,"Added a pre-authenticated corporate proxy connection to the pool (%d ready)."},
+{LANG_LOG_NTLM_POOL_USED,"Using a pre-authenticated corporate proxy connection for %s:%d."},
+{LANG_LOG_NTLM_POOL_FAILED,"Could not pre-authenticate a corporate proxy connection: %s"},
+{LANG_LOG_EDGE_RESOLVE_JOINED,"Waiting for the answer to a pending resolve request for %s (%d requests waiting)."},
+{LANG_LOG_EDGE_DNS_PREFETCH,"Resolving %s again before its cached address expires (used %d times)."},
+{LANG_LOG_EVENTDNS_NS_STILL_DOWN,"Nameserver %s was down before the nameservers were reconfigured; we'll probe it before sending it requests again."},
+{LANG_LOG_DNS_CACHE_EVICTED,"Dropped %d least recently used entries from our DNS cache; the cached answers now use %u bytes."},
+{LANG_LOG_DNS_CACHE_STATS,"Our cached DNS answers use %u bytes (limit: %I64u bytes). %I64u lookups were answered from the cache and %I64u were not (%d%% hit rate)."},
+{LANG_LOG_DNSSERV_ANSWERED_FROM_ADDRESSMAP,"Answered DNS request for %s from the address map."},
+{LANG_LOG_EDGE_ADDRESSMAP_LIMIT,"Too many address mappings: dropped the %d least recently used transient mappings, %d mappings left."},
+{LANG_LOG_CONFIG_TOKENBUCKETREFILLINTERVAL,"TokenBucketRefillInterval must be between 1 and 1000 milliseconds; using %d."},
+{LANG_LOG_CONFIG_PROCESSBANDWIDTHCLASS_INVALID,"Invalid ProcessBandwidthClass line \"%s\": expected a rate and a burst in bytes, a weight from 1 to 100 and a process name."},
+{LANG_LOG_MAIN_PERIODIC_EVENT_SCHEDULE_ERROR,"Error scheduling the %s periodic event."},
+{LANG_LOG_CONFIG_INTERACTIVESTREAMBOOST,"InteractiveStreamBoost must be between 1 and 16; using %d."},
+{LANG_LOG_CONFIG_STREAMCOALESCEDELAY,"StreamCoalesceDelay can be at most 50 milliseconds; using %d."},
+{LANG_LOG_CIRCUITBUILD_GUARD_RACE_LAUNCH,"No entry guard is connected yet; also connecting to entry guard %s."},
+{LANG_LOG_CIRCUITBUILD_GUARD_REROUTE,"Entry guard %s answered first; moving circuit %u to it."},
+{LANG_LOG_CIRCUITUSE_RACING_CIRCUIT,"Launched a second circuit to race circuit %u."},
+{LANG_LOG_CIRCUITUSE_NEED_ISOLATED_CIRC,"Isolation key %lu needs %d more clean circuits (have %d clean circuits in all); launching one."},
+{LANG_LOG_CONFIG_ISOLATEDPREEMPTIVECIRCUITS,"IsolatedPreemptiveCircuits can be at most 4; using %d."},
+{LANG_LOG_CONFIG_WARMNEXTIDENTITY,"WarmNextIdentity can be at most 4; using %d."},
+{LANG_LOG_CIRCUITUSE_WARM_NEXT_IDENTITY,"Have %d of %d circuits for the next identity; launching another one."},
+{LANG_LOG_CIRCUITLIST_NEXT_IDENTITY_READY,"New identity: switching to %d circuits that were built ahead."},
+{LANG_LOG_ROUTERPARSE_SKIPPED_UNLISTED,"Skipped %d cached router descriptors that the consensus doesn't list."},
+{LANG_LOG_ROUTERLIST_STORE_SNAPSHOT_MATCHES,"The %s are unchanged since we wrote them; not checking their signatures again."},
+{LANG_LOG_CONSDIFF_MALFORMED,"Refusing to apply a malformed consensus diff (error at line %d)."},
+{LANG_LOG_CONSDIFF_BASE_MISMATCH,"Refusing to apply a consensus diff that was made for a consensus we don't have."},
+{LANG_LOG_CONSDIFF_RESULT_MISMATCH,"Refusing to use the consensus rebuilt from a diff, because it doesn't match the digest in the diff."},
+{LANG_LOG_NETWORKSTATUS_CONSENSUS_DIFF_FAILED,"Couldn't rebuild the consensus from a diff; fetching the full consensus instead."},
+{LANG_LOG_DIR_RECEIVED_CONSENSUS_DIFF,"Received consensus diff (size %d) from server '%s:%d'"},
+{LANG_LOG_DIR_P_MICRODESC_FETCH,"microdescriptor fetch"},
+{LANG_LOG_DIR_RECEIVED_MICRODESCS,"Received microdescriptors (size %d) from server '%s:%d'"},
+{LANG_LOG_DIR_HTTP_ERROR_MICRODESC,"Received http status code %d (%s) from server '%s:%d' while fetching \"/tor/micro/%s\". I'll try again soon."},
+{LANG_LOG_ROUTERLIST_MICRODESC_STATS,"%d microdescriptors downloadable. %d delayed; %d present (%d of those newly built into routers); %d wouldnt_use; %d in progress."},
+{LANG_LOG_DIR_REISSUE_STRAGGLER,"The %s from %s is taking too long; asking %s for the same descriptors."},
+{LANG_LOG_ROUTERLIST_MERGING_JOURNAL,"Appending %d journal bytes to the %s cache"},
+{LANG_LOG_ROUTERLIST_OLD_DESCS_OVER_LIMIT,"Removed %d old router descriptors to keep them under MaxOldDescriptorBytes."},
+{LANG_LOG_REPHIST_MTBF_BIN_FORMAT_ERROR,"Unrecognized format in binary mtbf history file. Trying the text file."},
+{LANG_LOG_REPHIST_MTBF_BAD_RECORDS,"Skipped %d damaged records in the binary mtbf history file."},
+{LANG_LOG_REPHIST_MTBF_REWRITTEN,"Wrote %d records to the binary mtbf history file."},
+{LANG_LOG_REPHIST_MTBF_PATCHED,"Updated %d records in the binary mtbf history file."},
+{LANG_LOG_LOG_ASYNC_DROPPED,"The log queue was full; dropped %d messages."},
+{LANG_LOG_CONFIG_ASYNCLOGOVERFLOW,"AsyncLogOverflow must be DropOldest or DropNewest"},
+{LANG_LOG_CONFIG_ASYNC_LOG_FAILED,"Could not start the log thread; logging synchronously."},
+{LANG_LOG_CONFIG_LOGDOMAINS,"LogDomains must be a list of logging domains, such as CIRC,DIR,NET"},
+
+{LANG_PLUGINS_INVALID_REPLACEMENTS,"The plugin %s returned invalid replacement ranges for connection %u; the data was not changed."},
+{LANG_LOG_CONFIG_CONTROLBANDWIDTHEVENTINTERVAL,"ControlBandwidthEventInterval must be between 1 second and 1 hour; using %d seconds."},
+{LANG_LOG_PERF_STREAM_TRACE_HEADER,"Stream setup times in milliseconds (median/90th percentile/longest) for each exit and each identity:"},
+{LANG_LOG_PERF_STREAM_TRACE_EXIT,"Exit %s: %I64u streams, %I64u incomplete;%s"},
+{LANG_LOG_PERF_STREAM_TRACE_IDENTITY,"Identity started %s: %I64u streams, %I64u incomplete;%s"},
+{LANG_LOG_PERF_STREAM_TRACE_NONE,"No stream setup times were recorded. Set StreamTracing to 1 to record them."},
+{LANG_MNU_STREAM_TRACES,"Show stream setup &times"},
+{LANG_MNU_EXPORT_STREAM_TRACES,"E&xport stream setup times ..."},
+{LANG_LOG_DLG_STREAM_TRACE_EXPORT_FAILED,"Could not write stream setup times to %s."},
+{LANG_LOG_ETW_REGISTER_FAILED,"Could not register the ETW event provider (error %lu)."},
+{LANG_LOG_MEMGOV_USAGE,"Memory by subsystem: buffers %I64u, cell queues %I64u, routerlist %I64u, DNS cache %I64u, address map %I64u, cookies %I64u, log cache %I64u, plugins %I64u; total %I64u bytes."},
+{LANG_LOG_MEMGOV_OVER_LIMIT,"We are using %I64u bytes, more than MaxMemInUse (%I64u). Trimming the caches brought us down to %I64u bytes."},
+{LANG_LOG_MEMGOV_CLOSED_CIRCS,"Still over MaxMemInUse; closed %d circuits with %I64u bytes of queued data."},
+{LANG_LOG_CONFIG_MAXMEMINUSE_TOO_LOW,"MaxMemInUse option is too low; raising to %d MB."},
+{LANG_LOG_LOOPEXIT_ATTACHED,"Loopback exit: answering the stream to %s:%d ourselves."},
+{LANG_LOG_WATCHDOG_STALL,"The event loop has not run for %lu ms, busy in %s. Stack of the tor thread:"},
+{LANG_LOG_WATCHDOG_STALL_FRAME,"Stall stack: %s"},
+{LANG_LOG_WATCHDOG_STALL_ENDED,"The event loop ran again after a stall of %lu ms."},
+{LANG_LOG_WATCHDOG_START_FAILED,"Could not start the watchdog of the event loop."},
+{LANG_LOG_CONFIG_MAINLOOPSTALLTHRESHOLD,"MainLoopStallThreshold option is too low; raising to %d ms."},
+{LANG_LOG_IDENTITY_PURGE_STARTED,"Deleting cookies in the background, in %d jobs."},
+{LANG_LOG_IDENTITY_PURGE_JOB_DONE,"Deleting the %s cookies took %lu ms (%d of %d jobs done)."},
+{LANG_LOG_IDENTITY_PURGE_FINISHED,"Deleted the cookies in %lu ms."},
+{LANG_LOG_IDENTITY_PURGE_BUSY,"The cookies of the previous identity are still being deleted, not starting again."},
+{LANG_LOG_RENDLOCAL_ATTACHED,"Connecting the stream to our own hidden service %s:%d without a rendezvous."},
+{LANG_LOG_CIRCUITUSE_PARALLEL_INTRO,"Launched a parallel introduction circuit %d to %s for service %s."},
+{LANG_LOG_CIRCUITUSE_PARALLEL_INTRODUCTION,"Sending the introduction again through parallel intro circ %d (rend circ %d)."},
+{LANG_LOG_RENDCLIENT_CLOSING_PARALLEL_INTRO,"Got an ACK for service %s, closing the other introduction circuit %d."},
+{LANG_LOG_RENDCLIENT_PARALLEL_INTRO_NACKED,"Introduction point %s refused our request, but another introduction to %s is still pending."},
+{LANG_LOG_CIRCUITUSE_FILLING_REND_POOL,"A stream wants a hidden service, building %d more internal circuits ahead of its rendezvous."},
+{LANG_LOG_CONFIG_PINNED_HS_FAILED,"Failed to configure pinned hidden services."},
+{LANG_LOG_RENDPIN_BAD_ADDRESS,"PinnedHiddenServices: \"%s\" is not a hidden service address."},
+{LANG_LOG_RENDPIN_CACHE_CORRUPT,"The saved descriptors of pinned hidden services are corrupt; ignoring the rest of them."},
+{LANG_LOG_RENDPIN_LOADED,"Loaded %d saved descriptors of pinned hidden services."},
+{LANG_LOG_RENDPIN_SAVE_FAILED,"Couldn't save the descriptors of pinned hidden services to %s."},
+{LANG_LOG_RENDPIN_FETCHING_MISSING,"Fetching the descriptor of pinned hidden service %s."},
+{LANG_LOG_RENDPIN_FETCHING_OLD,"Refreshing the descriptor of pinned hidden service %s before it gets stale."},
+{LANG_LOG_RENDPIN_FETCHING_HSDIRS_CHANGED,"Other directories are responsible for pinned hidden service %s now, fetching its descriptor from them."},
+{LANG_LOG_RENDSERVICE_BATCHED_UPLOAD,"Posted %d hidden service descriptors in one request to hidden service directory %s."},
+{LANG_LOG_RENDSERVICE_INTRO_QUEUE_FULL,"Too many INTRODUCE2 cells are waiting for a cpuworker; dropped the oldest one for hidden service %s."},
+{LANG_LOG_RENDSERVICE_INTRO_WAITED_TOO_LONG,"Dropped an INTRODUCE2 cell for hidden service %s that waited %d seconds for a cpuworker."},
+{LANG_LOG_STARTUP_STEP_DONE,"Startup step \"%s\" took %lu msec."},
+{LANG_LOG_CIRCUITBUILD_WARM_START,"We were idle for %d seconds. Reconnecting to our entry guards and rebuilding our predicted circuits."},
+{LANG_LOG_CIRCUITBUILD_RECONNECTING_GUARD,"Reconnecting to entry guard %s."},
+{LANG_LOG_HIBERNATE_PACING,"Configured accounting pacing. This interval begins at %s and ends at %s. We will stay awake and spread the rest of our quota over the whole interval."},
+{LANG_LOG_CONFIG_PRIMARYGUARDCONNECTIONS_RANGE,"PrimaryGuardConnections must be 1 or 2."},
+{LANG_LOG_CIRCUITBUILD_PARALLEL_GUARD_CONN,"Opening another connection to our primary entry guard %s."},
+{LANG_LOG_SIGCACHE_CORRUPT,"The list of the signatures that we checked is corrupt; ignoring the rest of it."},
+{LANG_LOG_SIGCACHE_LOADED,"Loaded %d signatures that we checked before."},
+{LANG_LOG_SIGCACHE_SAVE_FAILED,"Couldn't write the list of the signatures that we checked to %s."},
+{LANG_LOG_EDGE_EXIT_FAILURE_NOTED,"Avoiding the last exit for %s for a while: %s."},
+{LANG_LOG_CIRCUITBUILD_PROBING_GUARD,"Checking whether the unreachable entry guard %s is back."},
+{LANG_NETINFO_CELL_WAIT,"Queued cells: %lu flushed, waited %lu us on average, %lu us at most (50%%: %lu us, 90%%: %lu us, 99%%: %lu us)\r\n"},
+{LANG_LOG_IDENTITY_PROCESS_EXITED,"Process %lu exited, closed %d of its connections that were still waiting."},
+{LANG_LOG_FILE_IO_UNCOMPRESS_FAILED,"Could not uncompress the contents of \"%s\" that we kept in memory; the file is empty now."},
 {LANG_MAX,NULL}
 };
@@ -30,6 +30,9 @@ int isUtf(char *str,int len);
 int is_digit(char c);
 void checkFormat(char *src,char *dest,int max);
 void matchExpected(char *str1,char *str2);
+void freeWideStrings(void);
+void buildWideStrings(void);
+LPWSTR to_wide(const char *str,WCHAR *buf);
 #define RFTS_BIN_ 2
 extern int isTopMost;
 
@@ -58,55 +61,93 @@ void LangLeaveCriticalSection(void)
 {	LeaveCriticalSection(&hCriticalSection);
 }
 
+int LangTryEnterCriticalSection(void)
+{	return TryEnterCriticalSection(&hCriticalSection);
+}
+
+/* When the loaded language is UTF-8, all its strings are converted to UTF-16
+   once, when it's loaded, so that dialogs can be repainted and list views
+   filled without a conversion and an allocation for each string. */
+WCHAR *langWide=NULL;		// the strings of lang_tbl, one after another
+LPWSTR *langWideStr=NULL;	// langWideStr[x] points to string x in langWide
+#define LANG_WBUF_SIZE 256	// strings shorter than this are converted on the stack
+
+void freeWideStrings(void)
+{	if(langWide)	tor_free(langWide);
+	if(langWideStr)	tor_free(langWideStr);
+	langWide=NULL;langWideStr=NULL;
+}
+
+void buildWideStrings(void)
+{	int langStrCnt,langStrLen,total=0;
+	WCHAR *w;
+	freeWideStrings();
+	if(languageType==LANUGAGE_ANSI)	return;
+	for(langStrCnt=0;langStrCnt<LANG_MAX;langStrCnt++)
+	{	if(lang_tbl[langStrCnt].langStr)
+			total+=MultiByteToWideChar(CP_UTF8,0,(LPSTR)lang_tbl[langStrCnt].langStr,-1,NULL,0);
+		total++;
+	}
+	langWide=tor_malloc(total*sizeof(WCHAR));
+	langWideStr=tor_malloc(LANG_MAX*sizeof(LPWSTR));
+	w=langWide;
+	for(langStrCnt=0;langStrCnt<LANG_MAX;langStrCnt++)
+	{	langWideStr[langStrCnt]=w;
+		langStrLen=0;
+		if(lang_tbl[langStrCnt].langStr)
+			langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)lang_tbl[langStrCnt].langStr,-1,w,total-(w-langWide));
+		if(langStrLen<=0)
+		{	*w=0;
+			langStrLen=1;
+		}
+		w+=langStrLen;
+	}
+}
+
+LPCWSTR get_lang_wstr(int x)
+{	if(!langWideStr || x>=LANG_MAX)	return NULL;
+	return langWideStr[x];
+}
+
+/* Convert str to UTF-16 into buf if it fits, else into a new buffer; release the result with free_wide(). */
+LPWSTR to_wide(const char *str,WCHAR *buf)
+{	int langStrLen=strlen(str);
+	LPWSTR txt=buf;
+	if(langStrLen>=LANG_WBUF_SIZE)	txt=tor_malloc(langStrLen*2+2);
+	langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)str,langStrLen,txt,langStrLen);
+	txt[langStrLen]=0;
+	return txt;
+}
+
+#define free_wide(txt,buf) STMT_BEGIN if((txt)!=(buf)) tor_free(txt); STMT_END
+
 int LangSetDlgItemText(HWND hDlg,int item,int langId)
 {	if(languageType==LANUGAGE_ANSI)	return SetDlgItemText(hDlg,item,get_lang_str(langId));
-	else
-	{	const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		langStrLen=SendMessageW(GetDlgItem(hDlg,item),WM_SETTEXT,0,(LPARAM)txt);
-		tor_free(txt);
-		return langStrLen;
-	}
+	return SendMessageW(GetDlgItem(hDlg,item),WM_SETTEXT,0,(LPARAM)get_lang_wstr(langId));
 }
 
 int SetDlgItemTextL(HWND hDlg,int item,LPCTSTR lpString)
 {	if(languageType==LANUGAGE_ANSI)	return SetDlgItemText(hDlg,item,lpString);
 	else
-	{	int langStrLen=strlen(lpString);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)lpString,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		langStrLen=SetDlgItemTextW(hDlg,item,txt);
-		tor_free(txt);
-		return langStrLen;
+	{	WCHAR buf[LANG_WBUF_SIZE];
+		LPWSTR txt=to_wide(lpString,buf);
+		int r=SetDlgItemTextW(hDlg,item,txt);
+		free_wide(txt,buf);
+		return r;
 	}
 }
 
 int SetWindowTextL(HWND hDlg,int langId)
 {	if(languageType==LANUGAGE_ANSI)	return SetWindowText(hDlg,get_lang_str(langId));
-	else
-	{	const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		langStrLen=SetWindowTextW(hDlg,txt);
-		tor_free(txt);
-		return langStrLen;
-	}
+	return SetWindowTextW(hDlg,get_lang_wstr(langId));
 }
 
 int LangSetWindowText(HWND hDlg,LPCTSTR lpString)
-{	int langStrLen=strlen(lpString);
-	LPWSTR txt=tor_malloc(langStrLen*2+2);
-	langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)lpString,langStrLen,txt,langStrLen*2);
-	txt[langStrLen]=0;
-	langStrLen=SetWindowTextW(hDlg,txt);
-	tor_free(txt);
-	return langStrLen;
+{	WCHAR buf[LANG_WBUF_SIZE];
+	LPWSTR txt=to_wide(lpString,buf);
+	int r=SetWindowTextW(hDlg,txt);
+	free_wide(txt,buf);
+	return r;
 }
 
 void LangInsertColumn(HWND hDlg,int item,int width,int langId,int subItem,int format)
@@ -121,19 +162,13 @@ void LangInsertColumn(HWND hDlg,int item,int width,int langId,int subItem,int fo
 		SendDlgItemMessage(hDlg,item,LVM_INSERTCOLUMN,subItem,(LPARAM)&lvcol);
 	}
 	else
-	{	const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		lvcol1.mask=LVCF_FMT|LVCF_TEXT|LVCF_WIDTH;
+	{	lvcol1.mask=LVCF_FMT|LVCF_TEXT|LVCF_WIDTH;
 		lvcol1.fmt=format;
 		lvcol1.cx=width;
 		lvcol1.iSubItem=0;
-		lvcol1.pszText=txt;
-		lvcol1.cchTextMax=langStrLen;
+		lvcol1.pszText=(LPWSTR)get_lang_wstr(langId);
+		lvcol1.cchTextMax=lstrlenW(lvcol1.pszText);
 		SendDlgItemMessageW(hDlg,item,LVM_INSERTCOLUMNW,subItem,(LPARAM)&lvcol1);
-		tor_free(txt);
 	}
 }
 
@@ -153,15 +188,9 @@ void LangSetColumn(HWND hDlg,int item,int width,int langId,int subItem)
 		lvcol1.fmt=LVCFMT_LEFT;
 		lvcol1.cx=width;
 		lvcol1.iSubItem=0;
-		const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		lvcol1.pszText=txt;
-		lvcol1.cchTextMax=langStrLen;
+		lvcol1.pszText=(LPWSTR)get_lang_wstr(langId);
+		lvcol1.cchTextMax=lstrlenW(lvcol1.pszText);
 		SendDlgItemMessageW(hDlg,item,LVM_SETCOLUMNW,subItem,(LPARAM)&lvcol1);
-		tor_free(txt);
 	}
 }
 
@@ -176,50 +205,36 @@ void LangSetLVItem(HWND hDlg,int listcontrol,int item,int subitem,const char *la
 		SendDlgItemMessage(hDlg,listcontrol,LVM_SETITEM,0,(LPARAM)&lvit);
 	}
 	else
-	{	lvit1.mask=LVIF_TEXT;
+	{	WCHAR buf[LANG_WBUF_SIZE];
+		LPWSTR txt=to_wide(langstr,buf);
+		lvit1.mask=LVIF_TEXT;
 		lvit1.iItem=item;
 		lvit1.iSubItem=subitem;
-		int langStrLen=strlen(langstr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langstr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
 		lvit1.pszText=txt;
-		lvit1.cchTextMax=langStrLen;
+		lvit1.cchTextMax=lstrlenW(txt);
 		SendDlgItemMessageW(hDlg,listcontrol,LVM_SETITEMW,0,(LPARAM)&lvit1);
-		tor_free(txt);
+		free_wide(txt,buf);
 	}
 }
 
 void LangAppendMenu(HMENU hMenu,UINT uFlags,UINT item,int langId)
 {
 	if(languageType==LANUGAGE_ANSI)	AppendMenu(hMenu,uFlags,item,get_lang_str(langId));
-	else
-	{	const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		AppendMenuW(hMenu,uFlags,item,txt);
-		tor_free(txt);
-	}
+	else	AppendMenuW(hMenu,uFlags,item,get_lang_wstr(langId));
 }
 
 void LangAppendMenuStr(HMENU hMenu,UINT uFlags,UINT item,LPCTSTR lpLangStr)
-{	int langStrLen=strlen(lpLangStr);
-	LPWSTR txt=tor_malloc(langStrLen*2+2);
-	langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)lpLangStr,langStrLen,txt,langStrLen*2);
-	txt[langStrLen]=0;
+{	WCHAR buf[LANG_WBUF_SIZE];
+	LPWSTR txt=to_wide(lpLangStr,buf);
 	AppendMenuW(hMenu,uFlags,item,txt);
-	tor_free(txt);
+	free_wide(txt,buf);
 }
 
 void LangInsertMenuStr(HMENU hMenu,UINT uPosition,UINT uFlags,UINT item,LPCTSTR lpLangStr)
-{	int langStrLen=strlen(lpLangStr);
-	LPWSTR txt=tor_malloc(langStrLen*2+2);
-	langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)lpLangStr,langStrLen,txt,langStrLen*2);
-	txt[langStrLen]=0;
+{	WCHAR buf[LANG_WBUF_SIZE];
+	LPWSTR txt=to_wide(lpLangStr,buf);
 	InsertMenuW(hMenu,uPosition,uFlags,item,txt);
-	tor_free(txt);
+	free_wide(txt,buf);
 }
 
 int LangCbAddString(HWND hDlg,UINT combo,int langId)
@@ -228,34 +243,18 @@ int LangCbAddString(HWND hDlg,UINT combo,int langId)
 	{	const char *l=get_lang_str(langId);
 		return SendDlgItemMessage(hDlg,combo,CB_ADDSTRING,0,(LPARAM)l);
 	}
-	else
-	{	const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		langStrLen=SendDlgItemMessageW(hDlg,combo,CB_ADDSTRING,0,(LPARAM)txt);
-		tor_free(txt);
-		return langStrLen;
-	}
+	return SendDlgItemMessageW(hDlg,combo,CB_ADDSTRING,0,(LPARAM)get_lang_wstr(langId));
 }
 
 int LangMessageBox(HWND hDlg,const char *message,int titleId,UINT uType)
 {	if(isTopMost)	uType |= MB_TOPMOST;
 	if(languageType==LANUGAGE_ANSI)	return MessageBox(hDlg,message,get_lang_str(titleId),uType);
 	else
-	{	const char *langStr=get_lang_str(titleId);
-		int langStrLen=strlen(message),titleStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		LPWSTR title=tor_malloc(titleStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)message,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		titleStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,titleStrLen,title,titleStrLen*2);
-		title[titleStrLen]=0;
-		langStrLen=MessageBoxW(hDlg,txt,title,uType);
-		tor_free(txt);
-		tor_free(title);
-		return langStrLen;
+	{	WCHAR buf[LANG_WBUF_SIZE];
+		LPWSTR txt=to_wide(message,buf);
+		int r=MessageBoxW(hDlg,txt,get_lang_wstr(titleId),uType);
+		free_wide(txt,buf);
+		return r;
 	}
 }
 
@@ -265,16 +264,7 @@ int LangLbAddString(HWND hDlg,UINT listbox,int langId)
 	{	const char *l=get_lang_str(langId);
 		return SendDlgItemMessage(hDlg,listbox,LB_ADDSTRING,0,(LPARAM)l);
 	}
-	else
-	{	const char *langStr=get_lang_str(langId);
-		int langStrLen=strlen(langStr);
-		LPWSTR txt=tor_malloc(langStrLen*2+2);
-		langStrLen=MultiByteToWideChar(CP_UTF8,0,(LPSTR)langStr,langStrLen,txt,langStrLen*2);
-		txt[langStrLen]=0;
-		langStrLen=SendDlgItemMessageW(hDlg,listbox,LB_ADDSTRING,0,(LPARAM)txt);
-		tor_free(txt);
-		return langStrLen;
-	}
+	return SendDlgItemMessageW(hDlg,listbox,LB_ADDSTRING,0,(LPARAM)get_lang_wstr(langId));
 }
 
 char noText[]="\0\0";
@@ -421,7 +411,7 @@ void LangShowCache(HWND hDlg)
 	{	LangEnterCriticalSection();
 		SMARTLIST_FOREACH(logcache,char *,s1,
 		{	LangReplaceSel(s1,hDlg);
-			tor_free(s1);
+			tor_free_tagged(MEM_TAG_LOG_CACHE,s1,strlen(s1)+1);
 		});
 		smartlist_clear(logcache);
 		smartlist_free(logcache);
@@ -564,7 +554,8 @@ int is_digit(char c)
 }
 
 void unload_languages(void)
-{	if(langDefault)
+{	freeWideStrings();
+	if(langDefault)
 	{	tor_free(langDefault);
 		langDefault=NULL;
 	}
@@ -585,6 +576,7 @@ int load_lng(char *file)
 	checkLangDefault();
 	if(file[0]=='<')
 	{	checkLangDefault();
+		buildWideStrings();
 		return LANG_MAX-1;
 	}
 	if(file_status(file)==FN_FILE)	loadedFile = read_file_to_str(file,RFTS_BIN_,NULL);
@@ -665,6 +657,7 @@ int load_lng(char *file)
 		}
 		languageIndex=1;
 		languageType=lType;
+		buildWideStrings();
 		if(toFree) tor_free(toFree);
 		setNewLanguage();
 		return numDefs;
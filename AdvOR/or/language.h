@@ -14,6 +14,7 @@ typedef struct lang_str_info
 } lang_str_info;
 
 const char *get_lang_str(int x);
+LPCWSTR get_lang_wstr(int x);
 int LangSetDlgItemText(HWND hDlg,int item,int langId);
 int SetDlgItemTextL(HWND hDlg,int item,LPCTSTR lpString);
 int SetWindowTextL(HWND hDlg,int langId);
@@ -39,6 +40,7 @@ void LangInitCriticalSection(void);
 void LangDeleteCriticalSection(void);
 void LangEnterCriticalSection(void);
 void LangLeaveCriticalSection(void);
+int LangTryEnterCriticalSection(void);
 void LangShowCache(HWND hDlg);
 void enumLanguages(HWND hCombo,char *selected);
 void verify_lng(char *file);
@@ -3422,6 +3424,116 @@ struct lang_str_info *plugin_load_lng(char *dllname,int *maxdefs,char *language,
 #define LANG_LOG_UNKNOWN_LOGIN_VERSION 3262
 #define LANG_LOG_UNRECOGNIZED_LOGIN 3263
 
-#define LANG_MAX 3264
+#define LANG_LOG_BUFFERS_CHUNK_USAGE 3264
+#define LANG_HS_GEN_STATUS 3265
+#define LANG_LOG_CONN_OR_TLS_SESSION_RESUMED 3266
+#define LANG_LOG_FILE_IO_DAT_SECTION_CORRUPT 3267
+#define LANG_LOG_FILE_IO_DAT_WRITE_FAILED 3268
+#define LANG_LOG_FILE_IO_DAT_TRUNCATED 3269
+#define LANG_LOG_GEOIP_DB_LOADED 3270
+#define LANG_LOG_GEOIP_DB_INVALID 3271
+#define LANG_LOG_GEOIP6_LOADED 3272
+#define LANG_LOG_GEOIP6_INVALID_LINE 3273
+#define LANG_LOG_NTLM_POOL_ADDED 3274
+#define LANG_LOG_NTLM_POOL_USED 3275
+#define LANG_LOG_NTLM_POOL_FAILED 3276
+#define LANG_LOG_EDGE_RESOLVE_JOINED 3277
+#define LANG_LOG_EDGE_DNS_PREFETCH 3278
+#define LANG_LOG_EVENTDNS_NS_STILL_DOWN 3279
+#define LANG_LOG_DNS_CACHE_EVICTED 3280
+#define LANG_LOG_DNS_CACHE_STATS 3281
+#define LANG_LOG_DNSSERV_ANSWERED_FROM_ADDRESSMAP 3282
+#define LANG_LOG_EDGE_ADDRESSMAP_LIMIT 3283
+#define LANG_LOG_CONFIG_TOKENBUCKETREFILLINTERVAL 3284
+#define LANG_LOG_CONFIG_PROCESSBANDWIDTHCLASS_INVALID 3285
+#define LANG_LOG_MAIN_PERIODIC_EVENT_SCHEDULE_ERROR 3286
+#define LANG_LOG_CONFIG_INTERACTIVESTREAMBOOST 3287
+#define LANG_LOG_CONFIG_STREAMCOALESCEDELAY 3288
+#define LANG_LOG_CIRCUITBUILD_GUARD_RACE_LAUNCH 3289
+#define LANG_LOG_CIRCUITBUILD_GUARD_REROUTE 3290
+#define LANG_LOG_CIRCUITUSE_RACING_CIRCUIT 3291
+#define LANG_LOG_CIRCUITUSE_NEED_ISOLATED_CIRC 3292
+#define LANG_LOG_CONFIG_ISOLATEDPREEMPTIVECIRCUITS 3293
+#define LANG_LOG_CONFIG_WARMNEXTIDENTITY 3294
+#define LANG_LOG_CIRCUITUSE_WARM_NEXT_IDENTITY 3295
+#define LANG_LOG_CIRCUITLIST_NEXT_IDENTITY_READY 3296
+#define LANG_LOG_ROUTERPARSE_SKIPPED_UNLISTED 3297
+#define LANG_LOG_ROUTERLIST_STORE_SNAPSHOT_MATCHES 3298
+#define LANG_LOG_CONSDIFF_MALFORMED 3299
+#define LANG_LOG_CONSDIFF_BASE_MISMATCH 3300
+#define LANG_LOG_CONSDIFF_RESULT_MISMATCH 3301
+#define LANG_LOG_NETWORKSTATUS_CONSENSUS_DIFF_FAILED 3302
+#define LANG_LOG_DIR_RECEIVED_CONSENSUS_DIFF 3303
+#define LANG_LOG_DIR_P_MICRODESC_FETCH 3304
+#define LANG_LOG_DIR_RECEIVED_MICRODESCS 3305
+#define LANG_LOG_DIR_HTTP_ERROR_MICRODESC 3306
+#define LANG_LOG_ROUTERLIST_MICRODESC_STATS 3307
+#define LANG_LOG_DIR_REISSUE_STRAGGLER 3308
+#define LANG_LOG_ROUTERLIST_MERGING_JOURNAL 3309
+#define LANG_LOG_ROUTERLIST_OLD_DESCS_OVER_LIMIT 3310
+#define LANG_LOG_REPHIST_MTBF_BIN_FORMAT_ERROR 3311
+#define LANG_LOG_REPHIST_MTBF_BAD_RECORDS 3312
+#define LANG_LOG_REPHIST_MTBF_REWRITTEN 3313
+#define LANG_LOG_REPHIST_MTBF_PATCHED 3314
+#define LANG_LOG_LOG_ASYNC_DROPPED 3315
+#define LANG_LOG_CONFIG_ASYNCLOGOVERFLOW 3316
+#define LANG_LOG_CONFIG_ASYNC_LOG_FAILED 3317
+#define LANG_LOG_CONFIG_LOGDOMAINS 3318
+#define LANG_PLUGINS_INVALID_REPLACEMENTS 3319
+#define LANG_LOG_CONFIG_CONTROLBANDWIDTHEVENTINTERVAL 3320
+#define LANG_LOG_PERF_STREAM_TRACE_HEADER 3321
+#define LANG_LOG_PERF_STREAM_TRACE_EXIT 3322
+#define LANG_LOG_PERF_STREAM_TRACE_IDENTITY 3323
+#define LANG_LOG_PERF_STREAM_TRACE_NONE 3324
+#define LANG_MNU_STREAM_TRACES 3325
+#define LANG_MNU_EXPORT_STREAM_TRACES 3326
+#define LANG_LOG_DLG_STREAM_TRACE_EXPORT_FAILED 3327
+#define LANG_LOG_ETW_REGISTER_FAILED 3328
+#define LANG_LOG_MEMGOV_USAGE 3329
+#define LANG_LOG_MEMGOV_OVER_LIMIT 3330
+#define LANG_LOG_MEMGOV_CLOSED_CIRCS 3331
+#define LANG_LOG_CONFIG_MAXMEMINUSE_TOO_LOW 3332
+#define LANG_LOG_LOOPEXIT_ATTACHED 3333
+#define LANG_LOG_WATCHDOG_STALL 3334
+#define LANG_LOG_WATCHDOG_STALL_FRAME 3335
+#define LANG_LOG_WATCHDOG_STALL_ENDED 3336
+#define LANG_LOG_WATCHDOG_START_FAILED 3337
+#define LANG_LOG_CONFIG_MAINLOOPSTALLTHRESHOLD 3338
+#define LANG_LOG_IDENTITY_PURGE_STARTED 3339
+#define LANG_LOG_IDENTITY_PURGE_JOB_DONE 3340
+#define LANG_LOG_IDENTITY_PURGE_FINISHED 3341
+#define LANG_LOG_IDENTITY_PURGE_BUSY 3342
+#define LANG_LOG_RENDLOCAL_ATTACHED 3343
+#define LANG_LOG_CIRCUITUSE_PARALLEL_INTRO 3344
+#define LANG_LOG_CIRCUITUSE_PARALLEL_INTRODUCTION 3345
+#define LANG_LOG_RENDCLIENT_CLOSING_PARALLEL_INTRO 3346
+#define LANG_LOG_RENDCLIENT_PARALLEL_INTRO_NACKED 3347
+#define LANG_LOG_CIRCUITUSE_FILLING_REND_POOL 3348
+#define LANG_LOG_CONFIG_PINNED_HS_FAILED 3349
+#define LANG_LOG_RENDPIN_BAD_ADDRESS 3350
+#define LANG_LOG_RENDPIN_CACHE_CORRUPT 3351
+#define LANG_LOG_RENDPIN_LOADED 3352
+#define LANG_LOG_RENDPIN_SAVE_FAILED 3353
+#define LANG_LOG_RENDPIN_FETCHING_MISSING 3354
+#define LANG_LOG_RENDPIN_FETCHING_OLD 3355
+#define LANG_LOG_RENDPIN_FETCHING_HSDIRS_CHANGED 3356
+#define LANG_LOG_RENDSERVICE_BATCHED_UPLOAD 3357
+#define LANG_LOG_RENDSERVICE_INTRO_QUEUE_FULL 3358
+#define LANG_LOG_RENDSERVICE_INTRO_WAITED_TOO_LONG 3359
+#define LANG_LOG_STARTUP_STEP_DONE 3360
+#define LANG_LOG_CIRCUITBUILD_WARM_START 3361
+#define LANG_LOG_CIRCUITBUILD_RECONNECTING_GUARD 3362
+#define LANG_LOG_HIBERNATE_PACING 3363
+#define LANG_LOG_CONFIG_PRIMARYGUARDCONNECTIONS_RANGE 3364
+#define LANG_LOG_CIRCUITBUILD_PARALLEL_GUARD_CONN 3365
+#define LANG_LOG_SIGCACHE_CORRUPT 3366
+#define LANG_LOG_SIGCACHE_LOADED 3367
+#define LANG_LOG_SIGCACHE_SAVE_FAILED 3368
+#define LANG_LOG_EDGE_EXIT_FAILURE_NOTED 3369
+#define LANG_LOG_CIRCUITBUILD_PROBING_GUARD 3370
+#define LANG_NETINFO_CELL_WAIT 3371
+#define LANG_LOG_IDENTITY_PROCESS_EXITED 3372
+#define LANG_LOG_FILE_IO_UNCOMPRESS_FAILED 3373
+#define LANG_MAX 3374
 
 #endif
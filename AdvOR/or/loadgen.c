@@ -0,0 +1,505 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file loadgen.c
+ * \brief Drive many SOCKS and HTTP proxy clients against a running AdvOR,
+ * for AdvOR-bench --load.
+ *
+ * The clients connect to 127.0.0.1 on the given port and ask, in turn, for
+ * SOCKS4, SOCKS5, HTTP CONNECT and plain HTTP proxy streams to
+ * LOADGEN_TARGET_ADDR.  Through each tunnel they send "GET /<bytes>" and
+ * read the answer to its end, then close and start again until the time is
+ * up.  Run AdvOR with __LoopbackExit 1 so that loopexit.c answers these
+ * requests: the front-end then does all of its work without any network.
+ *
+ * We report, for each protocol and for all of them, the streams finished
+ * per second, the 50th and 99th percentiles of the setup time (from
+ * connect() until the proxy accepted the request, or until the headers of
+ * the answer came for plain HTTP proxy requests) and the throughput of the
+ * response bodies.
+ **/
+
+/* Windows' select() only looks at the first FD_SETSIZE sockets of a set;
+ * make room for LOADGEN_MAX_CLIENTS. */
+#define FD_SETSIZE 1024
+
+#include "or.h"
+#include "loadgen.h"
+#include "perf.h"
+
+/** Where the clients ask the proxy to connect to: TEST-NET-1, which is
+ * never routed, so that a stream that leaks out to the network fails. */
+#define LOADGEN_TARGET_ADDR "192.0.2.1"
+/** And the port they ask for. */
+#define LOADGEN_TARGET_PORT 80
+
+/** Proxy protocols that the clients speak. */
+typedef enum loadgen_proto_t {
+  LOADGEN_SOCKS4,
+  LOADGEN_SOCKS5,
+  LOADGEN_HTTP_CONNECT,
+  LOADGEN_HTTP_PROXY,
+  _LOADGEN_PROTO_MAX
+} loadgen_proto_t;
+
+/** Names of the loadgen_proto_t values, for our output. */
+static const char *loadgen_proto_names[] = {
+  "socks4", "socks5", "http-connect", "http-proxy"
+};
+
+/** What a client is waiting for. */
+typedef enum loadgen_state_t {
+  LOADGEN_IDLE, /**< Nothing: it has no connection. */
+  LOADGEN_CONNECTING, /**< connect() to finish. */
+  LOADGEN_SOCKS5_METHOD, /**< The SOCKS5 method that the proxy chose. */
+  LOADGEN_HANDSHAKE, /**< The proxy's answer to its request. */
+  LOADGEN_RESPONSE /**< The answer to its GET request. */
+} loadgen_state_t;
+
+/** One of our clients. */
+typedef struct loadgen_client_t {
+  tor_socket_t s; /**< Its socket, if it isn't idle. */
+  loadgen_proto_t proto; /**< The protocol that it speaks. */
+  loadgen_state_t state; /**< What it is waiting for. */
+  uint64_t started; /**< When it started to connect. */
+  char out[512]; /**< What it still has to send. */
+  size_t out_len; /**< How many bytes of out are used. */
+  size_t out_pos; /**< How many bytes of out it sent. */
+  char in[1024]; /**< Proxy answer or response headers received so far. */
+  size_t in_len; /**< How many bytes of in are used. */
+  uint64_t body_left; /**< How many bytes of the response body are still to
+                       * come, once we have the headers. */
+  int have_headers; /**< True iff we have the response headers. */
+  int has_length; /**< True iff the response headers gave its length. */
+} loadgen_client_t;
+
+/** A growing set of setup times. */
+typedef struct loadgen_samples_t {
+  uint32_t *usec; /**< The times, in microseconds. */
+  int n; /**< How many of them there are. */
+  int capacity; /**< How many of them fit in usec. */
+} loadgen_samples_t;
+
+/** What we measured for one protocol. */
+typedef struct loadgen_result_t {
+  uint64_t finished; /**< Streams that ended with the whole response. */
+  uint64_t failed; /**< Streams that failed at any point. */
+  uint64_t body_bytes; /**< Response body bytes received. */
+  loadgen_samples_t setup; /**< Setup times. */
+} loadgen_result_t;
+
+/** The results for each protocol. */
+static loadgen_result_t loadgen_results[_LOADGEN_PROTO_MAX];
+/** The request path of our GET requests: "/<bytes>". */
+static char loadgen_path[16];
+/** The port of the proxy. */
+static uint16_t loadgen_port;
+
+/** Add <b>usec</b> to <b>s</b>. */
+static void
+loadgen_samples_add(loadgen_samples_t *s, uint64_t usec)
+{
+  if (s->n == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 1024;
+    s->usec = tor_realloc(s->usec, s->capacity * sizeof(uint32_t));
+  }
+  s->usec[s->n++] = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+}
+
+/** qsort() helper: compare two uint32_t. */
+static int
+_compare_uint32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Return the <b>percentile</b>th percentile of the sorted set <b>s</b>, in
+ * milliseconds. */
+static double
+loadgen_samples_percentile(const loadgen_samples_t *s, int percentile)
+{
+  int idx;
+  if (!s->n)
+    return 0.0;
+  idx = (int)(((int64_t)s->n * percentile + 99) / 100) - 1;
+  if (idx < 0)
+    idx = 0;
+  return s->usec[idx] / 1000.0;
+}
+
+/** Queue the <b>len</b> bytes at <b>data</b> for <b>c</b> to send. */
+static void
+loadgen_queue(loadgen_client_t *c, const char *data, size_t len)
+{
+  tor_assert(len <= sizeof(c->out));
+  memcpy(c->out, data, len);
+  c->out_len = len;
+  c->out_pos = 0;
+}
+
+/** Queue the GET request of <b>c</b>: for the target itself when
+ * <b>absolute</b> is set (a plain HTTP proxy request), else through the
+ * tunnel that c has opened. */
+static void
+loadgen_queue_get(loadgen_client_t *c, int absolute)
+{
+  char req[256];
+  tor_snprintf(req, sizeof(req), "GET %s%s HTTP/1.1\r\nHost: %s\r\n"
+               "Connection: close\r\n\r\n",
+               absolute ? "http://"LOADGEN_TARGET_ADDR : "", loadgen_path,
+               LOADGEN_TARGET_ADDR);
+  loadgen_queue(c, req, strlen(req));
+  c->state = LOADGEN_RESPONSE;
+  c->in_len = 0;
+  c->have_headers = 0;
+}
+
+/** Open a new connection for <b>c</b> and queue the first message of its
+ * protocol.  Return 0 on success, -1 on failure. */
+static int
+loadgen_start(loadgen_client_t *c)
+{
+  struct sockaddr_in sin;
+  char msg[64];
+  int e;
+
+  c->s = tor_open_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (c->s < 0)
+    return -1;
+  set_socket_nonblocking(c->s);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(loadgen_port);
+  c->started = perf_now_usec();
+  if (connect(c->s, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    e = tor_socket_errno(c->s);
+    if (!ERRNO_IS_CONN_EINPROGRESS(e)) {
+      tor_close_socket(c->s);
+      c->state = LOADGEN_IDLE;
+      return -1;
+    }
+  }
+  c->state = LOADGEN_CONNECTING;
+  c->in_len = 0;
+  c->have_headers = 0;
+  switch (c->proto) {
+    case LOADGEN_SOCKS4:
+      msg[0] = 4;
+      msg[1] = 1; /* CONNECT */
+      set_uint16(msg+2, htons(LOADGEN_TARGET_PORT));
+      set_uint32(msg+4, htonl(0xc0000201)); /* LOADGEN_TARGET_ADDR */
+      memcpy(msg+8, "lg", 3);
+      loadgen_queue(c, msg, 11);
+      break;
+    case LOADGEN_SOCKS5:
+      loadgen_queue(c, "\x05\x01\x00", 3);
+      break;
+    case LOADGEN_HTTP_CONNECT:
+      tor_snprintf(msg, sizeof(msg), "CONNECT %s:%d HTTP/1.0\r\n\r\n",
+                   LOADGEN_TARGET_ADDR, LOADGEN_TARGET_PORT);
+      loadgen_queue(c, msg, strlen(msg));
+      break;
+    default:
+      loadgen_queue_get(c, 1);
+      c->state = LOADGEN_CONNECTING;
+      break;
+  }
+  return 0;
+}
+
+/** Close the connection of <b>c</b>, and count its stream as finished if
+ * <b>ok</b>, else as failed. */
+static void
+loadgen_end(loadgen_client_t *c, int ok)
+{
+  if (ok)
+    ++loadgen_results[c->proto].finished;
+  else
+    ++loadgen_results[c->proto].failed;
+  tor_close_socket(c->s);
+  c->state = LOADGEN_IDLE;
+}
+
+/** <b>c</b> has the response headers in c->in: find out how long the body
+ * is and count whatever of it came with them.  Return 0 on success, -1 if
+ * the response is not "200". */
+static int
+loadgen_got_headers(loadgen_client_t *c, const char *end)
+{
+  const char *cp;
+  size_t extra = c->in_len - (end - c->in);
+  c->in[c->in_len] = 0;
+  if (strcmpstart(c->in, "HTTP/1.") || strlen(c->in) < 12 ||
+      strcmpstart(c->in+9, "200"))
+    return -1;
+  c->have_headers = 1;
+  c->has_length = 0;
+  for (cp = c->in; cp && cp < end; cp = strchr(cp, '\n')) {
+    if (*cp == '\n')
+      ++cp;
+    if (!strcasecmpstart(cp, "Content-Length:")) {
+      c->body_left = strtoul(cp+15, NULL, 10);
+      c->has_length = 1;
+      break;
+    }
+  }
+  if (c->proto == LOADGEN_HTTP_PROXY)
+    loadgen_samples_add(&loadgen_results[c->proto].setup,
+                        perf_now_usec() - c->started);
+  loadgen_results[c->proto].body_bytes += extra;
+  if (c->has_length)
+    c->body_left = c->body_left > extra ? c->body_left - extra : 0;
+  return 0;
+}
+
+/** The proxy accepted the request of <b>c</b>: note the setup time and
+ * send the GET request through the tunnel. */
+static void
+loadgen_tunnel_open(loadgen_client_t *c)
+{
+  loadgen_samples_add(&loadgen_results[c->proto].setup,
+                      perf_now_usec() - c->started);
+  loadgen_queue_get(c, 0);
+}
+
+/** Read what has arrived for <b>c</b> and act on it.  Return 0 if c goes
+ * on, 1 if its stream is over. */
+static int
+loadgen_read(loadgen_client_t *c)
+{
+  char buf[16384], *end;
+  char req[10];
+  int n;
+
+  if (c->state == LOADGEN_RESPONSE && c->have_headers) {
+    n = recv(c->s, buf, sizeof(buf), 0);
+    if (n < 0 && ERRNO_IS_EAGAIN(tor_socket_errno(c->s)))
+      return 0;
+    if (n <= 0) {
+      loadgen_end(c, n == 0 && !c->has_length);
+      return 1;
+    }
+    loadgen_results[c->proto].body_bytes += n;
+    if (c->has_length) {
+      c->body_left = c->body_left > (uint64_t)n ? c->body_left - n : 0;
+      if (!c->body_left) {
+        loadgen_end(c, 1);
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  n = recv(c->s, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len, 0);
+  if (n < 0 && ERRNO_IS_EAGAIN(tor_socket_errno(c->s)))
+    return 0;
+  if (n <= 0) {
+    loadgen_end(c, 0);
+    return 1;
+  }
+  c->in_len += n;
+  switch (c->state) {
+    case LOADGEN_SOCKS5_METHOD:
+      if (c->in_len < 2)
+        return 0;
+      if (c->in[0] != 5 || c->in[1] != 0)
+        break;
+      req[0] = 5;
+      req[1] = 1; /* CONNECT */
+      req[2] = 0;
+      req[3] = 1; /* IPv4 */
+      set_uint32(req+4, htonl(0xc0000201)); /* LOADGEN_TARGET_ADDR */
+      set_uint16(req+8, htons(LOADGEN_TARGET_PORT));
+      loadgen_queue(c, req, 10);
+      c->state = LOADGEN_HANDSHAKE;
+      c->in_len = 0;
+      return 0;
+    case LOADGEN_HANDSHAKE:
+      if (c->proto == LOADGEN_SOCKS4) {
+        if (c->in_len < 8)
+          return 0;
+        if (c->in[1] != 90)
+          break;
+      } else if (c->proto == LOADGEN_SOCKS5) {
+        if (c->in_len < 10)
+          return 0;
+        if (c->in[0] != 5 || c->in[1] != 0)
+          break;
+      } else {
+        c->in[c->in_len] = 0;
+        if (!strstr(c->in, "\r\n\r\n"))
+          return c->in_len + 1 < sizeof(c->in) ? 0 : (loadgen_end(c, 0), 1);
+        if (strcmpstart(c->in, "HTTP/1.") || strlen(c->in) < 12 ||
+            strcmpstart(c->in+9, "200"))
+          break;
+      }
+      loadgen_tunnel_open(c);
+      return 0;
+    case LOADGEN_RESPONSE:
+      c->in[c->in_len] = 0;
+      end = strstr(c->in, "\r\n\r\n");
+      if (!end)
+        return c->in_len + 1 < sizeof(c->in) ? 0 : (loadgen_end(c, 0), 1);
+      if (loadgen_got_headers(c, end + 4) < 0)
+        break;
+      if (c->has_length && !c->body_left) {
+        loadgen_end(c, 1);
+        return 1;
+      }
+      return 0;
+    default:
+      return 0;
+  }
+  loadgen_end(c, 0);
+  return 1;
+}
+
+/** Send what <b>c</b> has queued.  Return 0 if c goes on, 1 if its stream
+ * failed. */
+static int
+loadgen_write(loadgen_client_t *c)
+{
+  int n, e, len = sizeof(e);
+  if (c->state == LOADGEN_CONNECTING) {
+    if (getsockopt(c->s, SOL_SOCKET, SO_ERROR, (void*)&e, &len) < 0 || e) {
+      loadgen_end(c, 0);
+      return 1;
+    }
+    if (c->proto == LOADGEN_SOCKS5)
+      c->state = LOADGEN_SOCKS5_METHOD;
+    else if (c->proto == LOADGEN_HTTP_PROXY)
+      c->state = LOADGEN_RESPONSE;
+    else
+      c->state = LOADGEN_HANDSHAKE;
+  }
+  n = send(c->s, c->out + c->out_pos, c->out_len - c->out_pos, 0);
+  if (n < 0) {
+    if (ERRNO_IS_EAGAIN(tor_socket_errno(c->s)))
+      return 0;
+    loadgen_end(c, 0);
+    return 1;
+  }
+  c->out_pos += n;
+  return 0;
+}
+
+/** Print the CSV line of <b>name</b> for <b>r</b>, measured over
+ * <b>usec</b> microseconds. */
+static void
+loadgen_print(const char *name, loadgen_result_t *r, uint64_t usec)
+{
+  double secs = usec / 1000000.0;
+  qsort(r->setup.usec, r->setup.n, sizeof(uint32_t), _compare_uint32);
+  printf("%s,"U64_FORMAT","U64_FORMAT",%.1f,%.2f,%.2f,%.2f\n", name,
+         U64_PRINTF_ARG(r->finished), U64_PRINTF_ARG(r->failed),
+         secs > 0 ? r->finished / secs : 0.0,
+         loadgen_samples_percentile(&r->setup, 50),
+         loadgen_samples_percentile(&r->setup, 99),
+         secs > 0 ? r->body_bytes / secs / (1024*1024) : 0.0);
+}
+
+/** Keep <b>n_clients</b> clients busy against the proxy on 127.0.0.1 port
+ * <b>port</b> for <b>seconds</b> seconds, each of them asking for a
+ * response body of <b>body_bytes</b> bytes per stream, and print what we
+ * measured.  Return 0 on success, -1 if no stream could be set up at
+ * all. */
+int
+loadgen_run(uint16_t port, int n_clients, int seconds, uint32_t body_bytes)
+{
+  loadgen_client_t *clients;
+  loadgen_result_t all;
+  uint64_t started, stop, now;
+  fd_set rfds, wfds, efds;
+  struct timeval tv;
+  int i, p, n_active, max_fd;
+
+  if (n_clients < 1)
+    n_clients = 1;
+  if (n_clients > LOADGEN_MAX_CLIENTS)
+    n_clients = LOADGEN_MAX_CLIENTS;
+  loadgen_port = port;
+  tor_snprintf(loadgen_path, sizeof(loadgen_path), "/%lu",
+               (unsigned long)body_bytes);
+  memset(loadgen_results, 0, sizeof(loadgen_results));
+  clients = tor_malloc_zero(n_clients * sizeof(loadgen_client_t));
+  for (i = 0; i < n_clients; ++i)
+    clients[i].proto = (loadgen_proto_t)(i % _LOADGEN_PROTO_MAX);
+
+  started = perf_now_usec();
+  stop = started + (uint64_t)seconds * 1000000;
+  while (1) {
+    now = perf_now_usec();
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    n_active = max_fd = 0;
+    for (i = 0; i < n_clients; ++i) {
+      loadgen_client_t *c = &clients[i];
+      if (c->state == LOADGEN_IDLE && now < stop)
+        if (loadgen_start(c) < 0)
+          ++loadgen_results[c->proto].failed;
+      if (c->state == LOADGEN_IDLE)
+        continue;
+      ++n_active;
+      if (c->s > max_fd)
+        max_fd = (int)c->s;
+      if (c->state == LOADGEN_CONNECTING || c->out_pos < c->out_len)
+        FD_SET(c->s, &wfds);
+      if (c->state == LOADGEN_CONNECTING) /* Where Windows reports that
+                                           * connect() failed. */
+        FD_SET(c->s, &efds);
+      else
+        FD_SET(c->s, &rfds);
+    }
+    if (!n_active)
+      break;
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    if (select(max_fd + 1, &rfds, &wfds, &efds, &tv) < 0)
+      break;
+    for (i = 0; i < n_clients; ++i) {
+      loadgen_client_t *c = &clients[i];
+      if (c->state == LOADGEN_IDLE)
+        continue;
+      if (FD_ISSET(c->s, &efds)) {
+        loadgen_end(c, 0);
+        continue;
+      }
+      if (FD_ISSET(c->s, &wfds) && loadgen_write(c))
+        continue;
+      if (FD_ISSET(c->s, &rfds))
+        loadgen_read(c);
+    }
+    /* Streams that are still going a while after the end fail. */
+    if (now > stop + 10000000)
+      for (i = 0; i < n_clients; ++i)
+        if (clients[i].state != LOADGEN_IDLE)
+          loadgen_end(&clients[i], 0);
+  }
+  now = perf_now_usec() - started;
+
+  printf("protocol,streams,failed,streams_per_sec,setup_p50_ms,"
+         "setup_p99_ms,mb_per_sec\n");
+  memset(&all, 0, sizeof(all));
+  for (p = 0; p < _LOADGEN_PROTO_MAX; ++p) {
+    loadgen_result_t *r = &loadgen_results[p];
+    loadgen_print(loadgen_proto_names[p], r, now);
+    all.finished += r->finished;
+    all.failed += r->failed;
+    all.body_bytes += r->body_bytes;
+    for (i = 0; i < r->setup.n; ++i)
+      loadgen_samples_add(&all.setup, r->setup.usec[i]);
+    tor_free(r->setup.usec);
+  }
+  loadgen_print("all", &all, now);
+  tor_free(all.setup.usec);
+  tor_free(clients);
+  return all.finished ? 0 : -1;
+}
+
@@ -0,0 +1,22 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file loadgen.h
+ * \brief Header file for loadgen.c.
+ **/
+
+#ifndef _TOR_LOADGEN_H
+#define _TOR_LOADGEN_H
+
+/** The most clients that loadgen_run() keeps connected at once. */
+#define LOADGEN_MAX_CLIENTS 1000
+
+int loadgen_run(uint16_t port, int n_clients, int seconds,
+                uint32_t body_bytes);
+
+#endif
+
@@ -0,0 +1,171 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file loopexit.c
+ * \brief A fake exit inside AdvOR, for load tests of the proxy front-end.
+ *
+ * With __LoopbackExit set, a CONNECT stream that has been through the SOCKS
+ * or HTTP proxy handshake, the address rewriting and the checks of
+ * connection_ap_handshake_rewrite_and_attach() is answered here instead of
+ * being attached to a circuit.  Its data is cut up into relay payloads as
+ * connection_edge_package_raw_inbuf() would, and the answer comes back
+ * through connection_write_to_buf() like the payloads of DATA cells, so
+ * that the HTTP filters, the buffers and the buckets all do their usual
+ * work without any network.
+ *
+ * A payload that starts with "GET " is answered with an HTTP response whose
+ * body is as long as the number after the last '/' of the request target;
+ * anything else is echoed.  Bodies are streamed as the client takes them,
+ * STREAMWINDOW_INCREMENT payloads at a time.
+ **/
+
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_edge.h"
+#include "loopexit.h"
+#include "main.h"
+#include "perf.h"
+#include "relay.h"
+
+/** How many bytes of an answer we keep on the outbuf of a stream, like the
+ * data of the cells that the exit may send before it waits for a SENDME. */
+#define LOOPBACK_EXIT_WINDOW (STREAMWINDOW_INCREMENT*RELAY_PAYLOAD_SIZE)
+
+/** Hand the <b>len</b> bytes at <b>data</b> to <b>conn</b> as they would
+ * arrive in DATA cells. */
+static void
+loopback_exit_deliver(edge_connection_t *conn, const char *data, size_t len)
+{
+  size_t n;
+  while (len && !conn->_base.marked_for_close) {
+    n = len > RELAY_PAYLOAD_SIZE ? RELAY_PAYLOAD_SIZE : len;
+    ++stats_n_data_cells_received;
+    stats_n_data_bytes_received += n;
+    connection_write_to_buf(data, n, TO_CONN(conn));
+    data += n;
+    len -= n;
+  }
+  stream_trace_stamp(conn, STREAM_TRACE_FIRST_BYTE);
+}
+
+/** Put more of the response body that <b>conn</b> waits for on its outbuf,
+ * until it holds a stream window's worth. */
+static void
+loopback_exit_stream(edge_connection_t *conn)
+{
+  static char body[RELAY_PAYLOAD_SIZE];
+  size_t n;
+  if (!body[0])
+    memset(body, 'x', sizeof(body));
+  while (conn->loopback_remaining && !conn->_base.marked_for_close &&
+         buf_datalen(conn->_base.outbuf) < LOOPBACK_EXIT_WINDOW) {
+    n = conn->loopback_remaining > RELAY_PAYLOAD_SIZE ?
+        RELAY_PAYLOAD_SIZE : conn->loopback_remaining;
+    loopback_exit_deliver(conn, body, n);
+    conn->loopback_remaining -= n;
+  }
+}
+
+/** Answer the <b>len</b> bytes that <b>conn</b> sent in one relay payload
+ * at <b>payload</b>. */
+static void
+loopback_exit_answer(edge_connection_t *conn, const char *payload,
+                     size_t len)
+{
+  char target[64], answer[160];
+  const char *cp, *end, *num;
+  unsigned long size;
+  int ok;
+
+  if (conn->loopback_remaining)
+    return; /* Still streaming the last answer; drop what comes meanwhile. */
+  if (len < 4 || memcmp(payload, "GET ", 4)) {
+    loopback_exit_deliver(conn, payload, len);
+    return;
+  }
+  cp = payload + 4;
+  end = memchr(cp, ' ', len - 4);
+  if (!end || end - cp >= (int)sizeof(target))
+    end = cp;
+  memcpy(target, cp, end - cp);
+  target[end - cp] = 0;
+  num = strrchr(target, '/');
+  size = tor_parse_ulong(num ? num+1 : "0", 10, 0, LOOPBACK_EXIT_MAX_BODY,
+                         &ok, NULL);
+  if (!ok)
+    size = 0;
+  tor_snprintf(answer, sizeof(answer), "HTTP/1.1 200 OK\r\n"
+               "Content-Type: application/octet-stream\r\n"
+               "Content-Length: %lu\r\nConnection: close\r\n\r\n", size);
+  loopback_exit_deliver(conn, answer, strlen(answer));
+  conn->loopback_remaining = size;
+  loopback_exit_stream(conn);
+}
+
+/** Take the stream <b>conn</b>, which
+ * connection_ap_handshake_rewrite_and_attach() would attach to a circuit
+ * now, and answer it ourselves.  Return -1 if it had to be closed, else
+ * 0. */
+int
+loopback_exit_attach(edge_connection_t *conn)
+{
+  log_info(LD_APP, get_lang_str(LANG_LOG_LOOPEXIT_ATTACHED),
+           safe_str_client(conn->socks_request->address),
+           conn->socks_request->port);
+  conn->loopback_exit = 1;
+  conn->_base.state = AP_CONN_STATE_OPEN;
+  stream_trace_stamp(conn, STREAM_TRACE_CONNECTED);
+  if (!conn->socks_request->has_finished)
+    connection_ap_handshake_socks_reply(conn, NULL, 0, 0);
+  /* Answer whatever came along with the request. */
+  return loopback_exit_package(conn);
+}
+
+/** Cut what waits on the inbuf of the loopback stream <b>conn</b> into relay
+ * payloads and answer each of them.  Stop reading while the answers pile up
+ * on the outbuf, as a stream whose package window runs out does.  Return
+ * 0. */
+int
+loopback_exit_package(edge_connection_t *conn)
+{
+  char payload[RELAY_PAYLOAD_SIZE];
+  size_t length;
+
+  while ((length = buf_datalen(conn->_base.inbuf)) > 0 &&
+         !conn->_base.marked_for_close) {
+    if (connection_outbuf_too_full(TO_CONN(conn))) {
+      connection_stop_reading(TO_CONN(conn));
+      return 0;
+    }
+    if (length > RELAY_PAYLOAD_SIZE)
+      length = RELAY_PAYLOAD_SIZE;
+    connection_fetch_from_buf(payload, length, TO_CONN(conn));
+    stats_n_data_bytes_packaged += length;
+    ++stats_n_data_cells_packaged;
+    conn->last_packaged_at = approx_time();
+    loopback_exit_answer(conn, payload, length);
+  }
+  return 0;
+}
+
+/** Called when the loopback stream <b>conn</b> flushed some of its outbuf:
+ * send more of the answer, and read again if we had stopped. */
+void
+loopback_exit_flushed_some(edge_connection_t *conn)
+{
+  loopback_exit_stream(conn);
+  if (!conn->_base.marked_for_close &&
+      !connection_outbuf_too_full(TO_CONN(conn)) &&
+      !connection_is_reading(TO_CONN(conn)) &&
+      !conn->_base.inbuf_reached_eof) {
+    connection_start_reading(TO_CONN(conn));
+    loopback_exit_package(conn);
+  }
+}
+
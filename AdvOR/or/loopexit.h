@@ -0,0 +1,23 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file loopexit.h
+ * \brief Header file for loopexit.c.
+ **/
+
+#ifndef _TOR_LOOPEXIT_H
+#define _TOR_LOOPEXIT_H
+
+/** The largest response body that the loopback exit will stream. */
+#define LOOPBACK_EXIT_MAX_BODY (1<<30)
+
+int loopback_exit_attach(edge_connection_t *conn);
+int loopback_exit_package(edge_connection_t *conn);
+void loopback_exit_flushed_some(edge_connection_t *conn);
+
+#endif
+
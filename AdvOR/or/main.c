@@ -21,30 +21,41 @@
 #include "connection.h"
 #include "connection_edge.h"
 #include "connection_or.h"
+#include "connection_proxy.h"
 #include "control.h"
 #include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
+#include "dlg_snapshot.h"
 #include "dns.h"
 #include "dnsserv.h"
+#include "etw.h"
 #include "geoip.h"
 #include "hibernate.h"
 #include "main.h"
+#include "memgov.h"
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "ntmain.h"
 #include "onion.h"
+#include "perf.h"
 #include "policies.h"
+#include "procmon.h"
 #include "relay.h"
+#include "relaycrypt.h"
 #include "rendclient.h"
 #include "rendcommon.h"
+#include "rendpin.h"
 #include "rendservice.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
 #include "seh.h"
+#include "sigcache.h"
+#include "startup.h"
+#include "watchdog.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
 #include <openssl/crypto.h>
@@ -73,6 +84,8 @@ static void second_elapsed_callback(periodic_timer_t *timer, void *args);
 static int conn_close_if_marked(int i);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
+static void housekeeping_schedule(connection_t *conn, time_t when);
+static void housekeeping_unschedule(connection_t *conn);
 void dlgAuthorities_initDirServers(config_line_t **option);
 int plugin_notify_service(rend_service_t *service,int added,connection_t *conn,int port);
 int __stdcall dlgfunc(HWND hDlg,UINT uMsg,WPARAM wParam,LPARAM lParam);
@@ -113,6 +126,11 @@ static time_t time_to_check_for_correct_dns = 0;
 
 /** Smartlist of all open connections. */
 static smartlist_t *connection_array = NULL;
+/** Map from global_identifier to the connections in connection_array. */
+static OAHT_HEAD(conn_id_map, connection_t) conn_id_map = OAHT_INITIALIZER();
+/** Heads of the lists of connections in connection_array with each type,
+ * linked by next_of_type. */
+static connection_t *conns_by_type[_CONN_TYPE_MAX+1];
 /** List of connections that have been marked for close and need to be freed
  * and removed from connection_array. */
 static smartlist_t *closeable_connection_lst = NULL;
@@ -168,6 +186,45 @@ long	best_delta_t=0;
 *
 ****************************************************************************/
 
+/** Helper: hash a connection by its global identifier. */
+static INLINE unsigned int
+conn_id_hash(const connection_t *conn)
+{
+  return (unsigned)(conn->global_identifier ^ (conn->global_identifier>>32));
+}
+
+/** Helper: return true iff <b>a</b> and <b>b</b> have the same global
+ * identifier. */
+static INLINE int
+conn_id_eq(const connection_t *a, const connection_t *b)
+{
+  return a->global_identifier == b->global_identifier;
+}
+
+OAHT_PROTOTYPE(conn_id_map, connection_t, id_node, conn_id_hash, conn_id_eq)
+OAHT_GENERATE(conn_id_map, connection_t, id_node, conn_id_hash, conn_id_eq,
+              0.8)
+
+/** Return the connection in the connection array whose global identifier is
+ * <b>id</b>, or NULL if there is none. */
+connection_t *
+connection_array_get_by_global_id(uint64_t id)
+{
+  connection_t search;
+  search.global_identifier = id;
+  return HT_FIND(conn_id_map, &conn_id_map, &search);
+}
+
+/** Return the first connection of type <b>type</b> in the connection array,
+ * or NULL if there is none.  The others follow through next_of_type. */
+connection_t *
+connection_array_first_of_type(int type)
+{
+  if (type < 0 || type > _CONN_TYPE_MAX)
+    return NULL;
+  return conns_by_type[type];
+}
+
 /** Add <b>conn</b> to the array of connections that we can poll on.  The
  * connection's socket must be set; the connection starts out
  * non-reading and non-writing.
@@ -187,6 +244,15 @@ connection_add(connection_t *conn)
 
   conn->conn_array_index = smartlist_len(connection_array);
   smartlist_add(connection_array, conn);
+  HT_INSERT(conn_id_map, &conn_id_map, conn);
+  tor_assert(conn->type <= _CONN_TYPE_MAX);
+  conn->prev_of_type = NULL;
+  conn->next_of_type = conns_by_type[conn->type];
+  if (conn->next_of_type)
+    conn->next_of_type->prev_of_type = conn;
+  conns_by_type[conn->type] = conn;
+  if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_DIR)
+    housekeeping_schedule(conn, approx_time());
 
   if (SOCKET_OK(conn->s) || conn->linked || conn->hs_plugin) {
     conn->read_event = tor_event_new(tor_libevent_get_base(),
@@ -217,6 +283,15 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  HT_REMOVE(conn_id_map, &conn_id_map, conn);
+  housekeeping_unschedule(conn);
+  if (conn->prev_of_type)
+    conn->prev_of_type->next_of_type = conn->next_of_type;
+  else
+    conns_by_type[conn->type] = conn->next_of_type;
+  if (conn->next_of_type)
+    conn->next_of_type->prev_of_type = conn->prev_of_type;
+  conn->next_of_type = conn->prev_of_type = NULL;
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -503,19 +578,15 @@ close_closeable_connections(void)
   }
 }
 
-/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
- * some data to read. */
+/** How many times, after an event, do we hand the data written on linked
+ * connections directly to the other side, before we leave the rest to the
+ * main loop? */
+#define MAX_LINKED_CONN_HANDOFF_ROUNDS 4
+
+/** Read on <b>conn</b>, and mark it for close if that failed. */
 static void
-conn_read_callback(evutil_socket_t fd, short event, void *_conn)
+connection_read_or_close(connection_t *conn)
 {
-  connection_t *conn = _conn;
-  (void)fd;
-  (void)event;
-
-  log_debug(LD_NET,get_lang_str(LANG_LOG_MAIN_READ_EVENT),(int)conn->s);
-
-//  assert_connection_ok(conn, get_time(NULL));
-
   if (connection_handle_read(conn) < 0) {
     if (!conn->marked_for_close) {
 #ifndef MS_WINDOWS
@@ -527,10 +598,58 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
       connection_mark_for_close(conn);
     }
   }
+}
+
+/** Some linked connections may have been given data to read by the event
+ * we just handled: read it now instead of waiting for the main loop to
+ * activate their read events.  Reading may write more data on other links,
+ * so we do a few rounds, and leave what is left to the main loop. */
+static void
+run_linked_conn_handoffs(void)
+{
+  static int in_handoff = 0;
+  smartlist_t *pending;
+  int round;
+
+  if (in_handoff || !smartlist_len(active_linked_connection_lst))
+    return;
+  in_handoff = 1;
+  pending = smartlist_create();
+  for (round = 0; round < MAX_LINKED_CONN_HANDOFF_ROUNDS &&
+         smartlist_len(active_linked_connection_lst); round++) {
+    smartlist_add_all(pending, active_linked_connection_lst);
+    SMARTLIST_FOREACH(pending, connection_t *, conn, {
+      /* skip connections that stopped reading since the round started */
+      if (conn->active_on_link)
+        connection_read_or_close(conn);
+    });
+    smartlist_clear(pending);
+  }
+  smartlist_free(pending);
+  in_handoff = 0;
+}
+
+/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
+ * some data to read. */
+static void
+conn_read_callback(evutil_socket_t fd, short event, void *_conn)
+{
+  connection_t *conn = _conn;
+  (void)fd;
+  (void)event;
+
+  log_debug(LD_NET,get_lang_str(LANG_LOG_MAIN_READ_EVENT),(int)conn->s);
+
 //  assert_connection_ok(conn, get_time(NULL));
 
+  watchdog_push("conn_read_callback", conn_type_to_string(conn->type));
+  connection_read_or_close(conn);
+//  assert_connection_ok(conn, get_time(NULL));
+
+  run_linked_conn_handoffs();
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+  watchdog_pop();
 }
 
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
@@ -546,6 +665,7 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
 
 //  assert_connection_ok(conn, get_time(NULL));
 
+  watchdog_push("conn_write_callback", conn_type_to_string(conn->type));
   if (connection_handle_write(conn, 0) < 0) {
     if (!conn->marked_for_close) {
       /* this connection is broken. remove it. */
@@ -564,8 +684,10 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   }
 //  assert_connection_ok(conn, get_time(NULL));
 
+  run_linked_conn_handoffs();
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+  watchdog_pop();
 }
 
 /** If the connection at connection_array[i] is marked for close, then:
@@ -612,7 +734,7 @@ conn_close_if_marked(int i)
       log_debug(LD_GENERAL,get_lang_str(LANG_LOG_MAIN_CONN_FLUSH_2),retval,(int)buf_datalen(conn->outbuf),(int)conn->outbuf_flushlen,connection_wants_to_flush(conn));
     } else if (connection_speaks_cells(conn)) {
       if (conn->state == OR_CONN_STATE_OPEN) {
-        retval = flush_buf_tls(TO_OR_CONN(conn)->tls, conn->outbuf, sz,
+        retval = flush_buf_tls(TO_OR_CONN(conn)->tls, conn->outbuf, sz, 0,
                                &conn->outbuf_flushlen);
       } else
         retval = -1; /* never flush non-open broken tls connections */
@@ -713,14 +835,129 @@ directory_info_has_arrived(time_t now, int from_cache)
  */
 #define IDLE_OR_CONN_TIMEOUT 180
 
+/* Connections that need housekeeping are kept in a timer wheel, by the time
+ * when run_connection_housekeeping() should next look at them, so that we
+ * don't have to check every connection every second. The first level has a
+ * slot for each of the next HK_WHEEL_SIZE seconds; the second level has a
+ * slot for each of the next HK_WHEEL_SIZE blocks of HK_WHEEL_SIZE seconds,
+ * whose connections are moved to the first level when their block starts.
+ * Times further away go to the last slot of the second level, and are put
+ * back in the wheel from there. */
+#define HK_WHEEL_BITS 8
+#define HK_WHEEL_SIZE (1<<HK_WHEEL_BITS)
+#define HK_WHEEL_MASK (HK_WHEEL_SIZE-1)
+/** Heads of the lists of connections in each slot of the timer wheel. */
+static connection_t *housekeeping_wheel[2*HK_WHEEL_SIZE];
+/** The last second for which we ran housekeeping, or 0 if we never did. */
+static time_t housekeeping_wheel_time = 0;
+/** KeepalivePeriod when we computed the deadlines in the wheel. */
+static int housekeeping_keepalive = 0;
+
+/** Put <b>conn</b> in the slot of the housekeeping wheel for <b>when</b>,
+ * or for the next second if <b>when</b> is not in the future. */
+static void
+housekeeping_schedule(connection_t *conn, time_t when)
+{
+  time_t base = housekeeping_wheel_time ? housekeeping_wheel_time
+                                        : approx_time() - 1;
+  time_t delta;
+  int slot;
+
+  housekeeping_unschedule(conn);
+  if (when <= base)
+    when = base + 1;
+  conn->housekeeping_at = when;
+  delta = when - base;
+  if (delta <= HK_WHEEL_SIZE) {
+    slot = (int)(when & HK_WHEEL_MASK);
+  } else {
+    if (delta >= (time_t)(HK_WHEEL_SIZE-1) * HK_WHEEL_SIZE)
+      when = base + (time_t)(HK_WHEEL_SIZE-1) * HK_WHEEL_SIZE;
+    slot = HK_WHEEL_SIZE + (int)((when >> HK_WHEEL_BITS) & HK_WHEEL_MASK);
+  }
+  conn->housekeeping_slot = slot;
+  conn->housekeeping_prev = NULL;
+  conn->housekeeping_next = housekeeping_wheel[slot];
+  if (conn->housekeeping_next)
+    conn->housekeeping_next->housekeeping_prev = conn;
+  housekeeping_wheel[slot] = conn;
+}
+
+/** Remove <b>conn</b> from the housekeeping wheel, if it is there. */
+static void
+housekeeping_unschedule(connection_t *conn)
+{
+  if (conn->housekeeping_slot < 0)
+    return;
+  if (conn->housekeeping_prev)
+    conn->housekeeping_prev->housekeeping_next = conn->housekeeping_next;
+  else
+    housekeeping_wheel[conn->housekeeping_slot] = conn->housekeeping_next;
+  if (conn->housekeeping_next)
+    conn->housekeeping_next->housekeeping_prev = conn->housekeeping_prev;
+  conn->housekeeping_next = conn->housekeeping_prev = NULL;
+  conn->housekeeping_slot = -1;
+}
+
+/** Return the earliest time at which run_connection_housekeeping() could
+ * find something to do for <b>conn</b>, or 0 if it never will.  The
+ * timestamps we look at only move forward, so looking at a connection too
+ * early is harmless: we compute its deadline again. */
+static time_t
+connection_housekeeping_deadline(connection_t *conn, time_t now)
+{
+  or_options_t *options = get_options();
+  or_connection_t *or_conn;
+  time_t when;
+
+  if (conn->marked_for_close)
+    return 0;
+  if (conn->type == CONN_TYPE_DIR) {
+    if (DIR_CONN_IS_SERVER(conn))
+      return conn->timestamp_lastwritten + DIR_CONN_MAX_STALL + 1;
+    when = directory_straggler_deadline(TO_DIR_CONN(conn));
+    if (when && when < conn->timestamp_lastread + DIR_CONN_MAX_STALL + 1)
+      return when;
+    return conn->timestamp_lastread + DIR_CONN_MAX_STALL + 1;
+  }
+  if (!connection_speaks_cells(conn))
+    return 0;
+
+  or_conn = TO_OR_CONN(conn);
+  if (!or_conn->n_circuits &&
+      (or_conn->is_bad_for_new_circs || we_are_hibernating()))
+    return now;
+  /* covers the expiration of non-open and stuck connections too */
+  when = conn->timestamp_lastwritten + options->KeepalivePeriod;
+  if (!or_conn->n_circuits &&
+      or_conn->timestamp_last_added_nonpadding + IDLE_OR_CONN_TIMEOUT < when)
+    when = or_conn->timestamp_last_added_nonpadding + IDLE_OR_CONN_TIMEOUT;
+  return when;
+}
+
+/** Something that run_connection_housekeeping() looks at changed for
+ * <b>conn</b>: compute again when it should look at it. */
+void
+connection_housekeeping_reschedule(connection_t *conn)
+{
+  time_t when;
+  if (conn->conn_array_index < 0)
+    return;
+  when = connection_housekeeping_deadline(conn, approx_time());
+  if (when)
+    housekeeping_schedule(conn, when);
+  else
+    housekeeping_unschedule(conn);
+}
+
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run by run_housekeeping_wheel() when a deadline computed by
+ * connection_housekeeping_deadline() for <b>conn</b> is reached.
  */
 static void
-run_connection_housekeeping(int i, time_t now)
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   or_options_t *options = get_options();
   or_connection_t *or_conn;
   int past_keepalive =
@@ -754,6 +991,13 @@ run_connection_housekeeping(int i, time_t now)
     return;
   }
 
+  /* Hedge descriptor downloads that are taking too long. */
+  if (conn->type == CONN_TYPE_DIR) {
+    time_t when = directory_straggler_deadline(TO_DIR_CONN(conn));
+    if (when && when <= now)
+      directory_reissue_straggler(TO_DIR_CONN(conn));
+  }
+
   if (!connection_speaks_cells(conn))
     return; /* we're all done here, the rest is just for OR conns */
 
@@ -802,49 +1046,593 @@ run_connection_housekeeping(int i, time_t now)
   }
 }
 
+/** Run housekeeping for the connections whose deadlines are between the
+ * last time we were called and <b>now</b>. */
+static void
+run_housekeeping_wheel(time_t now)
+{
+  smartlist_t *due = smartlist_create();
+  connection_t *conn;
+  time_t t;
+  int i;
+
+  if (!housekeeping_wheel_time || now < housekeeping_wheel_time ||
+      now - housekeeping_wheel_time >= (time_t)HK_WHEEL_SIZE * HK_WHEEL_SIZE ||
+      housekeeping_keepalive != get_options()->KeepalivePeriod) {
+    /* The clock jumped, or our deadlines may be wrong: look at everything. */
+    for (i = 0; i < 2*HK_WHEEL_SIZE; i++) {
+      while ((conn = housekeeping_wheel[i]) != NULL) {
+        housekeeping_unschedule(conn);
+        smartlist_add(due, conn);
+      }
+    }
+    housekeeping_keepalive = get_options()->KeepalivePeriod;
+  } else {
+    for (t = housekeeping_wheel_time + 1; t <= now; t++) {
+      if ((t & HK_WHEEL_MASK) == 0) {
+        /* a new block starts: spread its connections in the first level */
+        i = HK_WHEEL_SIZE + (int)((t >> HK_WHEEL_BITS) & HK_WHEEL_MASK);
+        housekeeping_wheel_time = t - 1;
+        while ((conn = housekeeping_wheel[i]) != NULL)
+          housekeeping_schedule(conn, conn->housekeeping_at);
+      }
+      i = (int)(t & HK_WHEEL_MASK);
+      while ((conn = housekeeping_wheel[i]) != NULL) {
+        housekeeping_unschedule(conn);
+        smartlist_add(due, conn);
+      }
+    }
+  }
+  housekeeping_wheel_time = now;
+
+  SMARTLIST_FOREACH(due, connection_t *, c, {
+    if (c->conn_array_index < 0)
+      continue;
+    run_connection_housekeeping(c, now);
+    connection_housekeeping_reschedule(c);
+  });
+  smartlist_free(due);
+}
+
+/** Periodically rebuild our descriptor download list, more often while we
+ * don't have enough directory info to build circuits. */
+static int
+fetch_descriptors_callback(time_t now, or_options_t *options)
+{
+  (void)options;
+  update_router_descriptor_downloads(get_time(NULL));
+  update_extrainfo_downloads(now);
+  if (router_have_minimum_dir_info())
+    return LAZY_DESCRIPTOR_RETRY_INTERVAL;
+  return GREEDY_DESCRIPTOR_RETRY_INTERVAL;
+}
+
+/** Every DESCRIPTOR_FAILURE_RESET_INTERVAL seconds, forget which router
+ * descriptors we failed to download. */
+static int
+reset_descriptor_failures_callback(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  router_reset_descriptor_download_failures();
+  return DESCRIPTOR_FAILURE_RESET_INTERVAL;
+}
+
+/** 1b. Every MAX_SSL_KEY_LIFETIME seconds, we change our TLS context. */
+static int
+rotate_x509_certificate_callback(time_t now, or_options_t *options)
+{
+  static int first = 1;
+  (void)now;
+  if (first) {
+    first = 0;
+    return MAX_SSL_KEY_LIFETIME_INTERNAL;
+  }
+  log_info(LD_GENERAL,get_lang_str(LANG_LOG_MAIN_ROTATING_TLS_CONTEXT));
+  if (tor_tls_context_init(public_server_mode(options),
+                           get_tlsclient_identity_key(),
+                           server_mode(options) ?
+                             get_server_identity_key() : NULL,
+                           MAX_SSL_KEY_LIFETIME_ADVERTISED) < 0) {
+    log_warn(LD_BUG,get_lang_str(LANG_LOG_MAIN_TLS_REINIT_ERROR));
+    /* XXX is it a bug here, that we just keep going? -RD */
+  }
+  /* We also make sure to rotate the TLS connections themselves if they've
+   * been up for too long -- but that's done via is_bad_for_new_circs in
+   * run_connection_housekeeping(). */
+  return MAX_SSL_KEY_LIFETIME_INTERNAL;
+}
+
+/** How often do we add more entropy to OpenSSL's RNG pool? */
+#define ENTROPY_INTERVAL (60*60)
+/** Every ENTROPY_INTERVAL seconds, add more entropy to the RNG pool. */
+static int
+add_entropy_callback(time_t now, or_options_t *options)
+{
+  static int first = 1;
+  (void)now;
+  (void)options;
+  if (!first) {
+    /* We already seeded once, so don't die on failure. */
+    crypto_seed_rng(0);
+  }
+  first = 0;
+  return ENTROPY_INTERVAL;
+}
+
+/** As a reachability-testing authority, try every REACHABILITY_TEST_INTERVAL
+ * seconds to determine reachability of the other Tor relays. */
+static int
+launch_reachability_tests_callback(time_t now, or_options_t *options)
+{
+  if (!authdir_mode_tests_reachability(options) || we_are_hibernating())
+    return 1;
+  dirserv_test_reachability(now);
+  return REACHABILITY_TEST_INTERVAL;
+}
+
+/** 1d. Periodically, we discount older stability information so that new
+ * stability info counts more. */
+static int
+downrate_stability_callback(time_t now, or_options_t *options)
+{
+  time_t next = rep_hist_downrate_old_runs(now);
+  (void)options;
+  return next > now ? (int)(next - now) : 1;
+}
+
+#define SAVE_STABILITY_INTERVAL (30*60)
+/** As a reachability-testing authority, save the stability information to
+ * disk every SAVE_STABILITY_INTERVAL seconds. */
+static int
+save_stability_callback(time_t now, or_options_t *options)
+{
+  static int started = 0;
+  if (!authdir_mode_tests_reachability(options))
+    return 1;
+  if (started && rep_hist_record_mtbf_data(now,1)<0) {
+    log_warn(LD_GENERAL,get_lang_str(LANG_LOG_MAIN_MTBF_WRITE_ERROR));
+  }
+  started = 1;
+  return SAVE_STABILITY_INTERVAL;
+}
+
+#define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
+/* 1e. Periodicaly, if we're a v3 authority, we check whether our cert is
+ * close to expiring and warn the admin if it is. */
+static int
+check_v3_certificate_callback(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  v3_authority_check_key_expiry();
+  return CHECK_V3_CERTIFICATE_INTERVAL;
+}
+
+#define CHECK_EXPIRED_NS_INTERVAL (2*60)
+/* 1f. Check whether our networkstatus has expired. */
+static int
+check_expired_networkstatus_callback(time_t now, or_options_t *options)
+{
+  networkstatus_t *ns;
+  if (options->DirFlags&DIR_FLAG_NO_AUTO_UPDATE)
+    return 1;
+  ns = networkstatus_get_latest_consensus();
+  /*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
+   * networkstatus_get_reasonably_live_consensus(), but that value is way
+   * way too high.  Arma: is the bridge issue there resolved yet? -NM */
+#define NS_EXPIRY_SLOP (24*60*60)
+  if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
+      router_have_minimum_dir_info()) {
+    router_dir_info_changed();
+  }
+  return CHECK_EXPIRED_NS_INTERVAL;
+}
+
+#define CHECK_WRITE_STATS_INTERVAL (60*60)
+/* 1g. Write statistics to disk when they are due, and ask each kind of
+ * statistics when to write it next. */
+static int
+write_stats_files_callback(time_t now, or_options_t *options)
+{
+  static time_t time_to_write_stats_files = 0;
+  time_t next_time_to_write_stats_files = (time_to_write_stats_files > 0 ?
+         time_to_write_stats_files : now) + CHECK_WRITE_STATS_INTERVAL;
+  if (options->CellStatistics) {
+    time_t next_write =
+        rep_hist_buffer_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->DirReqStatistics) {
+    time_t next_write = geoip_dirreq_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->EntryStatistics) {
+    time_t next_write = geoip_entry_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  if (options->ExitPortStatistics) {
+    time_t next_write = rep_hist_exit_stats_write(time_to_write_stats_files);
+    if (next_write && next_write < next_time_to_write_stats_files)
+      next_time_to_write_stats_files = next_write;
+  }
+  time_to_write_stats_files = next_time_to_write_stats_files;
+  return time_to_write_stats_files > now ?
+    (int)(time_to_write_stats_files - now) : 1;
+}
+
+/* 1h. Write bridge statistics to disk when they are due. */
+static int
+write_bridge_stats_callback(time_t now, or_options_t *options)
+{
+  static int should_init_bridge_stats = 1;
+  static time_t time_to_write_bridge_stats = 0;
+  if (!should_record_bridge_info(options)) {
+    /* Bridge mode is off. Ensure that stats are re-initialized next time
+     * bridge mode is turned on. */
+    should_init_bridge_stats = 1;
+    return 1;
+  }
+  if (should_init_bridge_stats) {
+    /* (Re-)initialize bridge statistics. */
+    geoip_bridge_stats_init(now);
+    time_to_write_bridge_stats = now + WRITE_STATS_INTERVAL;
+    should_init_bridge_stats = 0;
+  } else if (time_to_write_bridge_stats <= now) {
+    /* Possibly write bridge statistics to disk and ask when to write
+     * them next time. */
+    time_to_write_bridge_stats = geoip_bridge_stats_write(
+                                         time_to_write_bridge_stats);
+  }
+  return time_to_write_bridge_stats > now ?
+    (int)(time_to_write_bridge_stats - now) : 1;
+}
+
+#define CLEAN_CACHES_INTERVAL (30*60)
+/* Remove old information from rephist and the rend cache. */
+static int
+clean_caches_callback(time_t now, or_options_t *options)
+{
+  rep_history_clean(now - options->RephistTrackTime);
+  rend_cache_clean();
+  rend_cache_clean_v2_descs_as_dir();
+  if (authdir_mode_v3(options))
+    microdesc_cache_rebuild(NULL, 0);
+  return CLEAN_CACHES_INTERVAL;
+}
+
+#define RETRY_DNS_INTERVAL (10*60)
+/* If we're a server and initializing dns failed, retry periodically. */
+static int
+retry_dns_callback(time_t now, or_options_t *options)
+{
+  (void)now;
+  if (server_mode(options) && has_dns_init_failed())
+    dns_init();
+  return RETRY_DNS_INTERVAL;
+}
+
+/** How often do we check whether part of our router info has changed in a way
+ * that would require an upload? */
+#define CHECK_DESCRIPTOR_INTERVAL (60)
+/** How often do we (as a router) check whether our IP address has changed? */
+#define CHECK_IPADDRESS_INTERVAL (15*60)
+
+/* 2b. Once per minute, regenerate and upload the descriptor if the old
+ * one is inaccurate. */
+static int
+check_descriptor_callback(time_t now, or_options_t *options)
+{
+  static time_t time_to_check_ipaddress = 0;
+  static time_t time_to_recheck_bandwidth = 0;
+  static int dirport_reachability_count = 0;
+  check_descriptor_bandwidth_changed(now);
+  if (time_to_check_ipaddress < now) {
+    time_to_check_ipaddress = now + CHECK_IPADDRESS_INTERVAL;
+    check_descriptor_ipaddress_changed(now);
+  }
+/** If our router descriptor ever goes this long without being regenerated
+ * because something changed, we force an immediate regenerate-and-upload. */
+#define FORCE_REGENERATE_DESCRIPTOR_INTERVAL (18*60*60)
+  mark_my_descriptor_dirty_if_older_than(
+                                now - FORCE_REGENERATE_DESCRIPTOR_INTERVAL);
+  consider_publishable_server(0);
+  /* also, check religiously for reachability, if it's within the first
+   * 20 minutes of our uptime. */
+  if (server_mode(options) &&
+      (can_complete_circuit || !any_predicted_circuits(now)) &&
+      !we_are_hibernating()) {
+    if (stats_n_seconds_working < TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT) {
+      consider_testing_reachability(1, dirport_reachability_count==0);
+      if (++dirport_reachability_count > 5)
+        dirport_reachability_count = 0;
+    } else if (time_to_recheck_bandwidth < now) {
+      /* If we haven't checked for 12 hours and our bandwidth estimate is
+       * low, do another bandwidth test. This is especially important for
+       * bridges, since they might go long periods without much use. */
+      routerinfo_t *me = router_get_my_routerinfo();
+      if (time_to_recheck_bandwidth && me &&
+          me->bandwidthcapacity < me->bandwidthrate &&
+          me->bandwidthcapacity < 51200) {
+        reset_bandwidth_test();
+      }
+#define BANDWIDTH_RECHECK_INTERVAL (12*60*60)
+      time_to_recheck_bandwidth = now + BANDWIDTH_RECHECK_INTERVAL;
+    }
+  }
+
+  /* If any networkstatus documents are no longer recent, we need to
+   * update all the descriptors' running status. */
+  /* purge obsolete entries */
+  networkstatus_v2_list_clean(now);
+  /* Remove dead routers. */
+  routerlist_remove_old_routers();
+
+  /* Also, once per minute, check whether we want to download any
+   * networkstatus documents.
+   */
+  update_networkstatus_downloads(now);
+  return CHECK_DESCRIPTOR_INTERVAL;
+}
+
+#define DNS_PREFETCH_INTERVAL (5)
+/** 3e. Every few seconds, resolve again the cached addresses that are used
+ *     often and are about to expire. */
+static int
+prefetch_dns_callback(time_t now, or_options_t *options)
+{
+  if (!proxy_mode(options) || !can_complete_circuit || we_are_hibernating())
+    return 1;
+  addressmap_dns_prefetch(now);
+  return DNS_PREFETCH_INTERVAL;
+}
+
+#define PINNED_HS_CHECK_INTERVAL (60)
+/** 3f. Once a minute, fetch the descriptors of pinned hidden services that
+ *     we don't have or that are getting old. */
+static int
+refresh_pinned_hs_callback(time_t now, or_options_t *options)
+{
+  if (!proxy_mode(options) || !can_complete_circuit || we_are_hibernating())
+    return 1;
+  rend_pin_refresh(now);
+  return PINNED_HS_CHECK_INTERVAL;
+}
+
+/** How often do we check buffers and pools for empty space that can be
+ * deallocated? */
+#define MEM_SHRINK_INTERVAL (60)
+/** Every MEM_SHRINK_INTERVAL seconds, give back the empty space in our
+ * buffers and pools. */
+static int
+shrink_memory_callback(time_t now, or_options_t *options)
+{
+  (void)options;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
+      if (conn->outbuf)
+        buf_shrink(conn->outbuf);
+      if (conn->inbuf)
+        buf_shrink(conn->inbuf);
+    });
+  clean_cell_pool();
+  clean_connection_pools();
+  clean_circuit_pools();
+  clean_extend_info_pool();
+  buf_shrink_freelists(0);
+  compress_cold_files(now);
+  return MEM_SHRINK_INTERVAL;
+}
+
+/** How often do we write the signatures that we checked to disk? */
+#define SAVE_SIGCACHE_INTERVAL (60*60)
+/** Write the signatures that we checked to disk if we checked new ones. */
+static int
+save_sigcache_callback(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  sigcache_save();
+  return SAVE_SIGCACHE_INTERVAL;
+}
+
+/** How often do we retune the socket buffers of OR connections? */
+#define TUNE_SOCKET_BUFFERS_INTERVAL (10)
+/** If AutoTuneSocketBuffers is set, size the socket buffers of OR
+ * connections by the traffic they carry. */
+static int
+tune_socket_buffers_callback(time_t now, or_options_t *options)
+{
+  if (options->AutoTuneSocketBuffers && !options->ConstrainedSockets)
+    connection_or_tune_socket_buffers(now);
+  return TUNE_SOCKET_BUFFERS_INTERVAL;
+}
+
+#define BRIDGE_STATUSFILE_INTERVAL (30*60)
+/** 10b. write bridge networkstatus file to disk */
+static int
+write_bridge_ns_callback(time_t now, or_options_t *options)
+{
+  if (!options->BridgeAuthoritativeDir)
+    return 1;
+  networkstatus_dump_bridge_status_to_file(now);
+  return BRIDGE_STATUSFILE_INTERVAL;
+}
+
+/** A maintenance task that runs on its own timer rather than being polled
+ * for from run_scheduled_events(). */
+typedef struct periodic_event_item_t {
+  /** Run the task at <b>now</b>; return how many seconds from now it should
+   * run again. */
+  int (*fn)(time_t now, or_options_t *options);
+  const char *name; /**< Name of the task, for GETINFO periodic-events. */
+  struct event *ev; /**< Timer that fires when the task is due. */
+  time_t next_run; /**< When the timer is due to fire. */
+  uint64_t n_runs; /**< How often did the task run? */
+  uint64_t total_usec; /**< How long did it take, in microseconds? */
+  long max_usec; /**< How long did its slowest run take? */
+} periodic_event_item_t;
+
+#define PERIODIC_EVENT(name) { name ## _callback, #name, NULL, 0, 0, 0, 0 }
+
+/** All the tasks that run on their own timers. */
+static periodic_event_item_t periodic_events[] = {
+  PERIODIC_EVENT(fetch_descriptors),
+  PERIODIC_EVENT(reset_descriptor_failures),
+  PERIODIC_EVENT(rotate_x509_certificate),
+  PERIODIC_EVENT(add_entropy),
+  PERIODIC_EVENT(launch_reachability_tests),
+  PERIODIC_EVENT(downrate_stability),
+  PERIODIC_EVENT(save_stability),
+  PERIODIC_EVENT(check_v3_certificate),
+  PERIODIC_EVENT(check_expired_networkstatus),
+  PERIODIC_EVENT(write_stats_files),
+  PERIODIC_EVENT(write_bridge_stats),
+  PERIODIC_EVENT(clean_caches),
+  PERIODIC_EVENT(retry_dns),
+  PERIODIC_EVENT(check_descriptor),
+  PERIODIC_EVENT(prefetch_dns),
+  PERIODIC_EVENT(refresh_pinned_hs),
+  PERIODIC_EVENT(shrink_memory),
+  PERIODIC_EVENT(save_sigcache),
+  PERIODIC_EVENT(tune_socket_buffers),
+  PERIODIC_EVENT(write_bridge_ns),
+  { NULL, NULL, NULL, 0, 0, 0, 0 }
+};
+
+/** Make the timer of <b>event</b> fire after <b>tv</b>. */
+static void
+periodic_event_schedule(periodic_event_item_t *event, const struct timeval *tv)
+{
+  event->next_run = get_time(NULL) + tv->tv_sec;
+  if (event_add(event->ev, (struct timeval *)tv) < 0)
+    log_warn(LD_BUG,get_lang_str(LANG_LOG_MAIN_PERIODIC_EVENT_SCHEDULE_ERROR),event->name);
+}
+
+/** Libevent callback: run the task <b>data</b>, note how long it took and
+ * schedule its next run. */
+static void
+periodic_event_dispatch(evutil_socket_t fd, short what, void *data)
+{
+  periodic_event_item_t *event = data;
+  struct timeval start, end, interval;
+  time_t now = get_time(NULL);
+  long usec;
+  int next;
+  (void)fd;
+  (void)what;
+
+  update_approx_time(now);
+  watchdog_push("periodic_event", event->name);
+  tor_gettimeofday(&start);
+  next = event->fn(now, get_options());
+  tor_gettimeofday(&end);
+  watchdog_pop();
+  usec = tv_udiff(&start, &end);
+  if (usec > 0) {
+    event->total_usec += usec;
+    if (usec > event->max_usec)
+      event->max_usec = usec;
+  }
+  ++event->n_runs;
+  interval.tv_sec = next > 0 ? next : 1;
+  interval.tv_usec = 0;
+  periodic_event_schedule(event, &interval);
+}
+
+/** Set up the timers of all periodic events.  Their first runs are spread
+ * over the next second, and since every task schedules its next run from
+ * the end of the previous one, they stay spread out afterwards. */
+static void
+periodic_events_launch(void)
+{
+  int i, n = 0;
+  struct timeval first;
+
+  while (periodic_events[n].fn)
+    ++n;
+  for (i = 0; i < n; i++) {
+    periodic_event_item_t *event = &periodic_events[i];
+    if (event->ev)
+      continue;
+    event->ev = tor_evtimer_new(tor_libevent_get_base(),
+                                periodic_event_dispatch, event);
+    tor_assert(event->ev);
+    first.tv_sec = 1;
+    first.tv_usec = (long)(i * (1000000 / n));
+    periodic_event_schedule(event, &first);
+  }
+}
+
+/** Stop and free the timers of all periodic events. */
+static void
+periodic_events_free_all(void)
+{
+  periodic_event_item_t *event;
+  for (event = periodic_events; event->fn; event++) {
+    if (event->ev) {
+      tor_event_free(event->ev);
+      event->ev = NULL;
+    }
+  }
+}
+
+/** Return a newly allocated string with one line for each periodic event:
+ * its name, how often it ran, how long it took, and when it runs next. */
+char *
+periodic_events_get_stats(void)
+{
+  smartlist_t *lines = smartlist_create();
+  periodic_event_item_t *event;
+  time_t now = get_time(NULL);
+  char *result;
+
+  for (event = periodic_events; event->fn; event++) {
+    unsigned char *line = NULL;
+    tor_asprintf(&line, "%s runs="U64_FORMAT" total-usec="U64_FORMAT
+                 " max-usec=%ld next-in=%ld", event->name,
+                 U64_PRINTF_ARG(event->n_runs),
+                 U64_PRINTF_ARG(event->total_usec), event->max_usec,
+                 event->ev ? (long)(event->next_run - now) : -1L);
+    smartlist_add(lines, line);
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
 time_t time_to_check_listeners = 0;
 time_t time_to_change_identity = 0;
 /** Perform regular maintenance tasks.  This function gets run once per
- * second by second_elapsed_callback().
+ * second by second_elapsed_callback(); the tasks that only need to run
+ * every so often have their own timers in periodic_events.
  */
 static void
 run_scheduled_events(time_t now)
 {
-  static time_t last_rotated_x509_certificate = 0;
-  static time_t time_to_check_v3_certificate = 0;
-  static time_t time_to_check_descriptor = 0;
-  static time_t time_to_check_ipaddress = 0;
-  static time_t time_to_shrink_memory = 0;
-  static time_t time_to_try_getting_descriptors = 0;
-  static time_t time_to_reset_descriptor_failures = 0;
-  static time_t time_to_add_entropy = 0;
-  static time_t time_to_write_bridge_status_file = 0;
-  static time_t time_to_downrate_stability = 0;
-  static time_t time_to_save_stability = 0;
-  static time_t time_to_clean_caches = 0;
-  static time_t time_to_recheck_bandwidth = 0;
-  static time_t time_to_check_for_expired_networkstatus = 0;
-  static time_t time_to_write_stats_files = 0;
-  static time_t time_to_write_bridge_stats = 0;
-  static time_t time_to_launch_reachability_tests = 0;
-  static int should_init_bridge_stats = 1;
-  static time_t time_to_retry_dns_init = 0;
   or_options_t *options = get_options();
   int is_server = server_mode(options);
-  int i;
   int have_dir_info;
 
   /** 0. See if we've been asked to shut down and our timeout has
    * expired; or if our bandwidth limits are exhausted and we
    * should hibernate; or if it's time to wake up from hibernation.
    */
+	watchdog_push("run_scheduled_events", "consider_hibernation");
 	consider_hibernation(now);
 	if(options->IdentityAutoChange && time_to_change_identity < now)
 	{
+		watchdog_step("identity_auto_change");
 		identity_auto_change(now);
 		time_to_change_identity = now + options->IdentityAutoChange;
 	}
-	else if(signewnym_pending)	signewnym_scheduled_tasks();
+	else if(signewnym_pending)
+	{	watchdog_step("signewnym_scheduled_tasks");
+		signewnym_scheduled_tasks();
+	}
 
   /* 0c. If we've deferred log messages for the controller, handle them now */
 //  flush_pending_log_callbacks();
@@ -855,6 +1643,7 @@ run_scheduled_events(time_t now)
    */
   if (is_server &&
       get_onion_key_set_at()+MIN_ONION_KEY_LIFETIME < now) {
+    watchdog_step("rotate_onion_key");
     log_info(LD_GENERAL,get_lang_str(LANG_LOG_MAIN_ROTATING_ONION_KEY));
     rotate_onion_key();
     cpuworkers_rotate();
@@ -865,239 +1654,21 @@ run_scheduled_events(time_t now)
       router_upload_dir_desc_to_dirservers(0);
   }
 
-  if (time_to_try_getting_descriptors < now) {
-    update_router_descriptor_downloads(get_time(NULL));
-    update_extrainfo_downloads(now);
-    if (router_have_minimum_dir_info())
-      time_to_try_getting_descriptors = now + LAZY_DESCRIPTOR_RETRY_INTERVAL;
-    else
-      time_to_try_getting_descriptors = now + GREEDY_DESCRIPTOR_RETRY_INTERVAL;
-  }
-
-  if (time_to_reset_descriptor_failures < now) {
-    router_reset_descriptor_download_failures();
-    time_to_reset_descriptor_failures =
-      now + DESCRIPTOR_FAILURE_RESET_INTERVAL;
-  }
-
+  watchdog_step("fetch_bridge_descriptors");
   if (options->UseBridges)
     fetch_bridge_descriptors(options, now);
 
-  /** 1b. Every MAX_SSL_KEY_LIFETIME seconds, we change our TLS context. */
-  if (!last_rotated_x509_certificate)
-    last_rotated_x509_certificate = now;
-  if (last_rotated_x509_certificate+MAX_SSL_KEY_LIFETIME_INTERNAL < now) {
-    log_info(LD_GENERAL,get_lang_str(LANG_LOG_MAIN_ROTATING_TLS_CONTEXT));
-    if (tor_tls_context_init(public_server_mode(options),
-                             get_tlsclient_identity_key(),
-                             is_server ? get_server_identity_key() : NULL,
-                             MAX_SSL_KEY_LIFETIME_ADVERTISED) < 0) {
-      log_warn(LD_BUG,get_lang_str(LANG_LOG_MAIN_TLS_REINIT_ERROR));
-      /* XXX is it a bug here, that we just keep going? -RD */
-    }
-    last_rotated_x509_certificate = now;
-    /* We also make sure to rotate the TLS connections themselves if they've
-     * been up for too long -- but that's done via is_bad_for_new_circs in
-     * connection_run_housekeeping() above. */
-  }
-
-  if (time_to_add_entropy < now) {
-    if (time_to_add_entropy) {
-      /* We already seeded once, so don't die on failure. */
-      crypto_seed_rng(0);
-    }
-/** How often do we add more entropy to OpenSSL's RNG pool? */
-#define ENTROPY_INTERVAL (60*60)
-    time_to_add_entropy = now + ENTROPY_INTERVAL;
-  }
-
   /** 1c. If we have to change the accounting interval or record
    * bandwidth used in this accounting interval, do so. */
+  watchdog_step("accounting_run_housekeeping");
   if (accounting_is_enabled(options))
     accounting_run_housekeeping(now);
 
-  if (time_to_launch_reachability_tests < now &&
-      (authdir_mode_tests_reachability(options)) &&
-       !we_are_hibernating()) {
-    time_to_launch_reachability_tests = now + REACHABILITY_TEST_INTERVAL;
-    /* try to determine reachability of the other Tor relays */
-    dirserv_test_reachability(now);
-  }
-
-  /** 1d. Periodically, we discount older stability information so that new
-   * stability info counts more, and save the stability information to disk as
-   * appropriate. */
-  if (time_to_downrate_stability < now)
-    time_to_downrate_stability = rep_hist_downrate_old_runs(now);
-  if (authdir_mode_tests_reachability(options)) {
-    if (time_to_save_stability < now) {
-      if (time_to_save_stability && rep_hist_record_mtbf_data(now,1)<0) {
-        log_warn(LD_GENERAL,get_lang_str(LANG_LOG_MAIN_MTBF_WRITE_ERROR));
-      }
-#define SAVE_STABILITY_INTERVAL (30*60)
-      time_to_save_stability = now + SAVE_STABILITY_INTERVAL;
-    }
-  }
-
-  /* 1e. Periodicaly, if we're a v3 authority, we check whether our cert is
-   * close to expiring and warn the admin if it is. */
-  if (time_to_check_v3_certificate < now) {
-    v3_authority_check_key_expiry();
-#define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
-    time_to_check_v3_certificate = now + CHECK_V3_CERTIFICATE_INTERVAL;
-  }
-
-  /* 1f. Check whether our networkstatus has expired.
-   */
-  if ((!(options->DirFlags&DIR_FLAG_NO_AUTO_UPDATE))&&(time_to_check_for_expired_networkstatus < now)) {
-    networkstatus_t *ns = networkstatus_get_latest_consensus();
-    /*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
-     * networkstatus_get_reasonably_live_consensus(), but that value is way
-     * way too high.  Arma: is the bridge issue there resolved yet? -NM */
-#define NS_EXPIRY_SLOP (24*60*60)
-    if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
-        router_have_minimum_dir_info()) {
-      router_dir_info_changed();
-    }
-#define CHECK_EXPIRED_NS_INTERVAL (2*60)
-    time_to_check_for_expired_networkstatus = now + CHECK_EXPIRED_NS_INTERVAL;
-  }
-
-  /* 1g. Check whether we should write statistics to disk.
-   */
-  if (time_to_write_stats_files < now) {
-#define CHECK_WRITE_STATS_INTERVAL (60*60)
-    time_t next_time_to_write_stats_files = (time_to_write_stats_files > 0 ?
-           time_to_write_stats_files : now) + CHECK_WRITE_STATS_INTERVAL;
-    if (options->CellStatistics) {
-      time_t next_write =
-          rep_hist_buffer_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->DirReqStatistics) {
-      time_t next_write = geoip_dirreq_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->EntryStatistics) {
-      time_t next_write = geoip_entry_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    if (options->ExitPortStatistics) {
-      time_t next_write = rep_hist_exit_stats_write(time_to_write_stats_files);
-      if (next_write && next_write < next_time_to_write_stats_files)
-        next_time_to_write_stats_files = next_write;
-    }
-    time_to_write_stats_files = next_time_to_write_stats_files;
-  }
-
-  /* 1h. Check whether we should write bridge statistics to disk.
-   */
-  if (should_record_bridge_info(options)) {
-    if (time_to_write_bridge_stats < now) {
-      if (should_init_bridge_stats) {
-        /* (Re-)initialize bridge statistics. */
-        geoip_bridge_stats_init(now);
-        time_to_write_bridge_stats = now + WRITE_STATS_INTERVAL;
-        should_init_bridge_stats = 0;
-      } else {
-        /* Possibly write bridge statistics to disk and ask when to write
-         * them next time. */
-        time_to_write_bridge_stats = geoip_bridge_stats_write(
-                                           time_to_write_bridge_stats);
-      }
-    }
-  } else if (!should_init_bridge_stats) {
-    /* Bridge mode was turned off. Ensure that stats are re-initialized
-     * next time bridge mode is turned on. */
-    should_init_bridge_stats = 1;
-  }
-
-  /* Remove old information from rephist and the rend cache. */
-  if (time_to_clean_caches < now) {
-    rep_history_clean(now - options->RephistTrackTime);
-    rend_cache_clean();
-    rend_cache_clean_v2_descs_as_dir();
-    if (authdir_mode_v3(options))
-      microdesc_cache_rebuild(NULL, 0);
-#define CLEAN_CACHES_INTERVAL (30*60)
-    time_to_clean_caches = now + CLEAN_CACHES_INTERVAL;
-  }
-
-#define RETRY_DNS_INTERVAL (10*60)
-  /* If we're a server and initializing dns failed, retry periodically. */
-  if (time_to_retry_dns_init < now) {
-    time_to_retry_dns_init = now + RETRY_DNS_INTERVAL;
-    if (server_mode(options) && has_dns_init_failed())
-      dns_init();
-  }
+  watchdog_step("dlgServerUpdate");
   dlgServerUpdate();
 
-  /** 2. Periodically, we consider force-uploading our descriptor
-   * (if we've passed our internal checks). */
-
-/** How often do we check whether part of our router info has changed in a way
- * that would require an upload? */
-#define CHECK_DESCRIPTOR_INTERVAL (60)
-/** How often do we (as a router) check whether our IP address has changed? */
-#define CHECK_IPADDRESS_INTERVAL (15*60)
-
-  /* 2b. Once per minute, regenerate and upload the descriptor if the old
-   * one is inaccurate. */
-  if (time_to_check_descriptor < now) {
-    static int dirport_reachability_count = 0;
-    time_to_check_descriptor = now + CHECK_DESCRIPTOR_INTERVAL;
-    check_descriptor_bandwidth_changed(now);
-    if (time_to_check_ipaddress < now) {
-      time_to_check_ipaddress = now + CHECK_IPADDRESS_INTERVAL;
-      check_descriptor_ipaddress_changed(now);
-    }
-/** If our router descriptor ever goes this long without being regenerated
- * because something changed, we force an immediate regenerate-and-upload. */
-#define FORCE_REGENERATE_DESCRIPTOR_INTERVAL (18*60*60)
-    mark_my_descriptor_dirty_if_older_than(
-                                  now - FORCE_REGENERATE_DESCRIPTOR_INTERVAL);
-    consider_publishable_server(0);
-    /* also, check religiously for reachability, if it's within the first
-     * 20 minutes of our uptime. */
-    if (server_mode(options) &&
-        (can_complete_circuit || !any_predicted_circuits(now)) &&
-        !we_are_hibernating()) {
-      if (stats_n_seconds_working < TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT) {
-        consider_testing_reachability(1, dirport_reachability_count==0);
-        if (++dirport_reachability_count > 5)
-          dirport_reachability_count = 0;
-      } else if (time_to_recheck_bandwidth < now) {
-        /* If we haven't checked for 12 hours and our bandwidth estimate is
-         * low, do another bandwidth test. This is especially important for
-         * bridges, since they might go long periods without much use. */
-        routerinfo_t *me = router_get_my_routerinfo();
-        if (time_to_recheck_bandwidth && me &&
-            me->bandwidthcapacity < me->bandwidthrate &&
-            me->bandwidthcapacity < 51200) {
-          reset_bandwidth_test();
-        }
-#define BANDWIDTH_RECHECK_INTERVAL (12*60*60)
-        time_to_recheck_bandwidth = now + BANDWIDTH_RECHECK_INTERVAL;
-      }
-    }
-
-    /* If any networkstatus documents are no longer recent, we need to
-     * update all the descriptors' running status. */
-    /* purge obsolete entries */
-    networkstatus_v2_list_clean(now);
-    /* Remove dead routers. */
-    routerlist_remove_old_routers();
-
-    /* Also, once per minute, check whether we want to download any
-     * networkstatus documents.
-     */
-    update_networkstatus_downloads(now);
-  }
-
   /** 2c. Let directory voting happen. */
+  watchdog_step("dirvote_act");
   if (authdir_mode_v3(options))
     dirvote_act(options, now);
 
@@ -1106,6 +1677,7 @@ run_scheduled_events(time_t now)
    *    We do this before step 4, so it can try building more if
    *    it's not comfortable with the number of available circuits.
    */
+  watchdog_step("circuit_expire_building");
   circuit_expire_building();
 
   /** 3b. Also look at pending streams and prune the ones that 'began'
@@ -1113,14 +1685,17 @@ run_scheduled_events(time_t now)
    *     Do this before step 4, so we can put them back into pending
    *     state to be picked up by the new circuit.
    */
+  watchdog_step("connection_ap_expire_beginning");
   connection_ap_expire_beginning();
 
   /** 3c. And expire connections that we've held open for too long.
    */
+  watchdog_step("connection_expire_held_open");
   connection_expire_held_open();
 
   /** 3d. And every 60 seconds, we relaunch listeners if any died. */
   if (!we_are_hibernating() && time_to_check_listeners < now) {
+    watchdog_step("retry_all_listeners");
     retry_all_listeners(NULL, NULL);
     time_to_check_listeners = now+60;
   }
@@ -1130,6 +1705,7 @@ run_scheduled_events(time_t now)
    *    that became dirty more than MaxCircuitDirtiness seconds ago,
    *    and we make a new circ if there are no clean circuits.
    */
+  watchdog_step("circuit_build_needed_circs");
   have_dir_info = router_have_minimum_dir_info();
   if (have_dir_info && !we_are_hibernating())
     circuit_build_needed_circs(now);
@@ -1139,30 +1715,21 @@ run_scheduled_events(time_t now)
   //  circuit_expire_old_circuits_serverside(now);
 
   /** 5. We do housekeeping for each connection... */
+  watchdog_step("run_housekeeping_wheel");
   connection_or_set_bad_connections(NULL, 0);
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
-  if (time_to_shrink_memory < now) {
-    SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
-        if (conn->outbuf)
-          buf_shrink(conn->outbuf);
-        if (conn->inbuf)
-          buf_shrink(conn->inbuf);
-      });
-    clean_cell_pool();
-    buf_shrink_freelists(0);
-/** How often do we check buffers and pools for empty space that can be
- * deallocated? */
-#define MEM_SHRINK_INTERVAL (60)
-    time_to_shrink_memory = now + MEM_SHRINK_INTERVAL;
+  if (!we_are_hibernating()) {
+    entry_guards_keep_parallel_conns(now);
+    entry_guards_probe_unreachable(now);
   }
+  run_housekeeping_wheel(now);
 
   /** 6. And remove any marked circuits... */
+  watchdog_step("circuit_close_all_marked");
   circuit_close_all_marked();
 
   /** 7. And upload service descriptors if necessary. */
   if (can_complete_circuit && !we_are_hibernating()) {
+    watchdog_step("rend_consider_services_upload");
     rend_consider_services_upload(now);
     rend_consider_descriptor_republication();
   }
@@ -1171,6 +1738,7 @@ run_scheduled_events(time_t now)
    * because if we marked a conn for close and left its socket -1, then
    * we'll pass it to poll/select and bad things will happen.
    */
+  watchdog_step("close_closeable_connections");
   close_closeable_connections();
 
   /** 9. and if we're a server, check whether our DNS is telling stories to
@@ -1179,23 +1747,87 @@ run_scheduled_events(time_t now)
     if (!time_to_check_for_correct_dns) {
       time_to_check_for_correct_dns = now + 60 + crypto_rand_int(120);
     } else {
+      watchdog_step("dns_launch_correctness_checks");
       dns_launch_correctness_checks();
       time_to_check_for_correct_dns = now + 12*3600 +
         crypto_rand_int(12*3600);
     }
   }
-
-  /** 10b. write bridge networkstatus file to disk */
-  if (options->BridgeAuthoritativeDir &&
-      time_to_write_bridge_status_file < now) {
-    networkstatus_dump_bridge_status_to_file(now);
-#define BRIDGE_STATUSFILE_INTERVAL (30*60)
-    time_to_write_bridge_status_file = now+BRIDGE_STATUSFILE_INTERVAL;
-  }
+  watchdog_pop();
 }
 
 /** Timer: used to invoke second_elapsed_callback() once per second. */
 static periodic_timer_t *second_timer = NULL;
+/** Timer: used to invoke refill_callback() every TokenBucketRefillInterval
+ * milliseconds. */
+static periodic_timer_t *refill_timer = NULL;
+/** TokenBucketRefillInterval when we created refill_timer. */
+static int refill_timer_interval = 0;
+/** Bytes taken from the global buckets since the last call of
+ * second_elapsed_callback(). */
+static size_t bytes_read_since_last_second = 0;
+static size_t bytes_written_since_last_second = 0;
+
+/** Add the bytes taken from the global buckets since we last looked at them
+ * to the bytes read and written in this second. */
+static void
+note_global_bucket_usage(void)
+{
+  bytes_read_since_last_second +=
+    stats_prev_global_read_bucket - global_read_bucket;
+  bytes_written_since_last_second +=
+    stats_prev_global_write_bucket - global_write_bucket;
+  stats_prev_global_read_bucket = global_read_bucket;
+  stats_prev_global_write_bucket = global_write_bucket;
+}
+
+/** Libevent callback: invoked every TokenBucketRefillInterval milliseconds.
+ * Refill the bandwidth buckets for the time that passed, and wake up the
+ * connections that were waiting for them. */
+static void
+refill_callback(periodic_timer_t *timer, void *arg)
+{
+  static struct timeval last_refill;
+  struct timeval now;
+  long milliseconds_elapsed = 0;
+  (void)timer;
+  (void)arg;
+
+  tor_gettimeofday(&now);
+  if (last_refill.tv_sec) {
+    milliseconds_elapsed = tv_mdiff(&last_refill, &now);
+    /* the clock went back, or tv_mdiff() overflowed: just start again */
+    if (milliseconds_elapsed < 0)
+      milliseconds_elapsed = 0;
+  }
+  note_global_bucket_usage();
+  if (milliseconds_elapsed > 0)
+    connection_bucket_refill((int)milliseconds_elapsed, approx_time());
+  stats_prev_global_read_bucket = global_read_bucket;
+  stats_prev_global_write_bucket = global_write_bucket;
+  last_refill = now;
+}
+
+/** Create refill_timer, or create it again if TokenBucketRefillInterval
+ * changed.  Do nothing before the main loop set up its timers. */
+void
+refill_timer_reset(void)
+{
+  or_options_t *options = get_options();
+  struct timeval interval;
+
+  if (!second_timer)
+    return;
+  if (refill_timer && refill_timer_interval == options->TokenBucketRefillInterval)
+    return;
+  periodic_timer_free(refill_timer);
+  refill_timer_interval = options->TokenBucketRefillInterval;
+  interval.tv_sec = refill_timer_interval / 1000;
+  interval.tv_usec = (refill_timer_interval % 1000) * 1000;
+  refill_timer = periodic_timer_new(tor_libevent_get_base(), &interval,
+                                    refill_callback, NULL);
+  tor_assert(refill_timer);
+}
 /** Number of libevent errors in the last second: we die if we get too many. */
 static int n_libevent_errors = 0;
 
@@ -1203,9 +1835,6 @@ static int n_libevent_errors = 0;
 static void
 second_elapsed_callback(periodic_timer_t *timer, void *arg)
 {
-  /* XXXX This could be sensibly refactored into multiple callbacks, and we
-   * could use libevent's timers for this rather than checking the current
-   * time against a bunch of timeouts every second. */
   static time_t current_second = 0;
   time_t now;
   size_t bytes_written;
@@ -1216,16 +1845,25 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   (void)arg;
 
   n_libevent_errors = 0;
+  watchdog_push("second_elapsed_callback", NULL);
 
   /* log_fn(LOG_NOTICE, "Tick."); */
   now = get_time(NULL);
   update_approx_time(now);
 
   /* the second has rolled over. check more stuff. */
-  bytes_written = stats_prev_global_write_bucket - global_write_bucket;
-  bytes_read = stats_prev_global_read_bucket - global_read_bucket;
+  note_global_bucket_usage();
+  bytes_written = bytes_written_since_last_second;
+  bytes_read = bytes_read_since_last_second;
+  bytes_written_since_last_second = bytes_read_since_last_second = 0;
   seconds_elapsed = current_second ? (int)(now - current_second) : 0;
   dlgUpdateRWStats(seconds_elapsed,bytes_read,bytes_written);
+  watchdog_step("gui_snapshot_update");
+  gui_snapshot_update();
+  perf_second_elapsed();
+  watchdog_step("memgov_check");
+  memgov_check(now);
+  watchdog_step(NULL);
   stats_n_bytes_read += bytes_read;
   stats_n_bytes_written += bytes_written;
   if (accounting_is_enabled(options) && seconds_elapsed >= 0)
@@ -1233,11 +1871,6 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   control_event_bandwidth_used((uint32_t)bytes_read,(uint32_t)bytes_written);
   control_event_stream_bandwidth_used();
 
-  if (seconds_elapsed > 0)
-    connection_bucket_refill(seconds_elapsed, now);
-  stats_prev_global_read_bucket = global_read_bucket;
-  stats_prev_global_write_bucket = global_write_bucket;
-
   if (server_mode(options) &&
       !we_are_hibernating() &&
       seconds_elapsed > 0 &&
@@ -1264,9 +1897,11 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   } else if (seconds_elapsed > 0)
     stats_n_seconds_working += seconds_elapsed;
 
+  watchdog_step("run_scheduled_events");
   run_scheduled_events(now);
 
   current_second = now; /* remember which second it is, for next time */
+  watchdog_pop();
 }
 
 #ifndef MS_WINDOWS
@@ -1463,6 +2098,7 @@ dumpmemusage(int severity)
   dump_cell_pool_usage(severity);
   dump_dns_mem_usage(severity);
   buf_dump_freelist_sizes(severity);
+  memgov_dump(severity);
   tor_log_mallinfo(severity);
 }
 
@@ -1521,17 +2157,6 @@ void dumpstats(int severity)
   dump_distinct_digest_count(severity);
 }
 
-connection_t *get_connection_by_addr(uint32_t ip,int port,connection_t *after)
-{	SMARTLIST_FOREACH(connection_array, connection_t *, conn,
-	{	if(after && conn==after) after=NULL;
-		else if(after==NULL)
-		{	if((tor_addr_to_ipv4n(&conn->addr)==ip)&&(conn->port==port))	return conn;
-		}
-	});
-	return NULL;
-}
-
-
 /** Set up the signal handlers for either parent or child. */
 void
 handle_signals(int is_parent)
@@ -1559,16 +2184,34 @@ tor_free_all(int postfork)
   routerlist_free_all();
   networkstatus_free_all();
   addressmap_free_all();
+  connection_ap_exit_failures_clear();
   dirserv_free_all();
   rend_service_free_all();
+  rend_pin_free_all();
+  sigcache_free_all();
   rend_cache_free_all();
   rend_service_authorization_free_all();
   rep_hist_free_all();
   dns_free_all();
+  relaycrypt_free_all();
+  stream_trace_free_all();
   clear_pending_onions();
+  onion_dh_pool_free_all();
   circuit_free_all();
+  circuit_build_times_free(&circ_times);
+  circuit_isolation_demand_free_all();
   entry_guards_free_all();
+  identity_processes_free_all();
+  monitor_owning_controller_process(NULL);
+  tor_process_monitor_free_all();
   connection_free_all();
+  directory_free_all();
+  tor_zlib_free_all();
+  proxy_pool_free_all();
+  gui_snapshot_free_all();
+  plugins_async_free_all();
+  watchdog_free_all();
+  etw_free_all();
   buf_shrink_freelists(1);
   memarea_clear_freelist();
   microdesc_free_all();
@@ -1578,12 +2221,19 @@ tor_free_all(int postfork)
     policies_free_all();
   }
   free_cell_pool();
+  free_connection_pools();
+  free_circuit_pools();
+  free_extend_info_pool();
   if (!postfork) {
     tor_tls_free_all();
   }
   /* stuff in main.c */
   if (connection_array)
     smartlist_free(connection_array);
+  HT_CLEAR(conn_id_map, &conn_id_map);
+  memset(conns_by_type, 0, sizeof(conns_by_type));
+  memset(housekeeping_wheel, 0, sizeof(housekeeping_wheel));
+  housekeeping_wheel_time = 0;
   if (closeable_connection_lst)
     smartlist_free(closeable_connection_lst);
   if (active_linked_connection_lst)
@@ -1591,6 +2241,9 @@ tor_free_all(int postfork)
   if(plugin_connection_lst)
     smartlist_free(plugin_connection_lst);
   periodic_timer_free(second_timer);
+  periodic_timer_free(refill_timer);
+  periodic_events_free_all();
+  refill_timer = NULL;
   /* Stuff in util.c and address.c*/
   if (!postfork) {
     esc_router_info(NULL);
@@ -1873,6 +2526,18 @@ char *get_default_conf_file(void)
 	return	config_file_name;
 }
 
+/** Open the control pipe of the running instance for writing. The pipe is shared with intercepted processes, so when all its instances are busy wait for one to become available instead of dropping the command. */
+static FILE *open_instance_pipe(void)
+{	FILE *f;
+	int i;
+	for(i=0;i<5;i++)
+	{	f=fopen(pipeName,"wb");
+		if(f || GetLastError()!=ERROR_PIPE_BUSY)	return f;
+		if(!WaitNamedPipe(pipeName,2000))	break;
+	}
+	return NULL;
+}
+
 int tor_main(int argc, char *argv[])
 {
 	WSADATA	WSAData;
@@ -1904,7 +2569,7 @@ int tor_main(int argc, char *argv[])
 			{	if(argc>i)
 				{	char *s=tor_malloc(512);
 					tor_snprintf(s,511,"EXEC %s",argv[i+1]);
-					f=fopen(pipeName,"wb");
+					f=open_instance_pipe();
 					if(f)
 					{	fprintf(f,"%s",s);
 						fclose(f);
@@ -1917,9 +2582,9 @@ int tor_main(int argc, char *argv[])
 			i++;
 		}
 		if(!j)
-		{	f=fopen(pipeName,"wb");
+		{	f=open_instance_pipe();
 			if(f)
-			{	fprintf(f,"SHOW");fclose(f);
+			{	fprintf(f,"SHOW");
 				fclose(f);
 			}
 		}
@@ -1968,6 +2633,8 @@ int tor_main(int argc, char *argv[])
 		load_lng(fname);
 		tor_free(fname);
 	}
+	LangInitCriticalSection();
+	startup_launch();	/* GeoIP, the exit list and disk read-ahead run on worker threads from here on */
 	crypto_global_init();
 	if(crypto_seed_rng(1)){LangMessageBox(0,get_lang_str(LANG_MB_ERROR_SEED),LANG_MB_ERROR,0);ExitProcess(0);}
 	if(tmpOptions->DirFlags&DIR_FLAG_FAKE_LOCAL_TIME)
@@ -1979,9 +2646,9 @@ int tor_main(int argc, char *argv[])
 	}
 //	options->logging=0xc000|LOG_DEBUG;
 	get_winver();
-	LangInitCriticalSection();
-	iplist_init();
+	startup_wait(STARTUP_STEP_GEOIP|STARTUP_STEP_IPLIST);	/* the dialogs need both */
 	DialogBoxParamW(hInstance,(LPWSTR)MAKEINTRESOURCE(1000),0,&dlgfunc,0);
+	startup_free_all();
 	remove_plugins();
 	options_save_current();
 	flush_configuration_data();
@@ -1991,6 +2658,7 @@ int tor_main(int argc, char *argv[])
 	LangDeleteCriticalSection();
 	restore_seh();
 	iplist_free();
+	geoip_ranges_free();
 	if(hMutex) CloseHandle(hMutex);
 	tor_alloc_exit();
 	// ExitProcess no longer works with some OpenSSL setups
@@ -2009,6 +2677,7 @@ int __stdcall tor_thread(LPARAM lParam)
 	(void)lParam;
 
 	time_of_process_start = get_time(NULL);
+	etw_init();
 	addressmap_init(); /* Init the client dns cache. Do it always, since it's cheap. */
 //	add_temp_log(LOG_NOTICE);
 	if(dns_init() < 0)
@@ -2018,15 +2687,19 @@ int __stdcall tor_thread(LPARAM lParam)
 	if((! client_identity_key_is_set())&&(init_keys() < 0))
 	{	log_err(LD_BUG,get_lang_str(LANG_LOG_MAIN_KEYS_INIT_ERROR));tor_end();}
 	init_cell_pool();
+	onion_dh_pool_init();
+	tor_zlib_pool_init();
 	connection_bucket_init();
 	stats_prev_global_read_bucket = global_read_bucket;
 	stats_prev_global_write_bucket = global_write_bucket;
 	control_event_bootstrap(BOOTSTRAP_STATUS_STARTING, 0);
+	sigcache_load();
 	if(trusted_dirs_reload_certs())    log_warn(LD_DIR,get_lang_str(LANG_LOG_MAIN_ERROR_LOADING_V3_CERTS));
 	if(router_reload_v2_networkstatus())	tor_end();
 	if(router_reload_consensus_networkstatus())	tor_end();
 	if(router_reload_router_list())	tor_end();
 	now = get_time(NULL);
+	sigcache_save();
 	directory_info_has_arrived(now, 1);
 //	if(authdir_mode_tests_reachability(get_options()))	dirserv_test_reachability(now, 1);	/* the directory is already here, run startup things */
 	if(server_mode(get_options()))	cpu_init();	/* launch cpuworkers. Need to do this *after* we've read the onion key. */
@@ -2037,6 +2710,9 @@ int __stdcall tor_thread(LPARAM lParam)
 		second_timer = periodic_timer_new(tor_libevent_get_base(),&one_second,second_elapsed_callback,NULL);
 		tor_assert(second_timer);
 	}
+	periodic_events_launch();	/* set up the timers of the periodic events. */
+	watchdog_init();	/* and the watchdog that notices when they stall. */
+	refill_timer_reset();	/* set up the bandwidth bucket refills. */
 	config_register_addressmaps(get_options());
 	parse_virtual_addr_network(get_options()->VirtualAddrNetwork,0,0);
 	while(started)
@@ -29,6 +29,11 @@ void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
 
 smartlist_t *get_connection_array(void);
+connection_t *connection_array_get_by_global_id(uint64_t id);
+connection_t *connection_array_first_of_type(int type);
+void connection_housekeeping_reschedule(connection_t *conn);
+void refill_timer_reset(void);
+char *periodic_events_get_stats(void);
 
 /** Bitmask for events that we can turn on and off with
  * connection_watch_events. */
@@ -80,14 +85,11 @@ void dlgStatsRWInit(void);
 void dlgUpdateRWStats(int seconds,uint32_t bw_read,uint32_t bw_written);
 void dlgShowRWStats(HWND hDlg);
 void tree_show_sel(HTREEITEM hItem,LPARAM lParam);
-void tree_add_circ(circuit_t *circ,char *nodename);
 void tree_add_new_circ(circuit_t *circ);
 void tree_remove_circ(circuit_t *circ);
 void tree_set_circ(circuit_t *circ);
 void tree_remove_hop(crypt_path_t *cpath);
 void add_all_conns(circuit_t *circ);
-connection_t *get_connection_by_addr(uint32_t ip,int port,connection_t *after);
-void add_all_streams(HTREEITEM hItem,edge_connection_t *streams);
 void tree_remove_stream(edge_connection_t *stream);
 void remove_all_streams(edge_connection_t *streams);
 void tree_remove_streams(circuit_t *circ);
@@ -109,6 +111,7 @@ void setState(int);
 HTREEITEM addTreeItem(HTREEITEM hParent,const char *name,DWORD lParam,int tree_idx);
 void setTreeItem(HTREEITEM hItem,const char *name);
 void identity_add_process(DWORD);
+void identity_processes_free_all(void);
 void identity_init(void);
 void dumpstats(int severity); /* log stats */
 void iplist_free(void);
@@ -0,0 +1,123 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file memgov.c
+ * \brief Report the memory each subsystem holds, and free some when we take
+ * more than MaxMemInUse.
+ *
+ * The subsystems count their own bytes in mem_tag_bytes[] as they allocate
+ * and free them (see tor_malloc_tagged() in util.h); only the routerlist is
+ * summed here, from the lengths of the descriptors it holds.  Once a second
+ * memgov_check() compares the total with MaxMemInUse.  Over the limit, it
+ * trims the caches that are cheapest to rebuild first, and only when that
+ * is not enough does it close the circuits with the most queued data.
+ **/
+
+#include "or.h"
+#include "buffers.h"
+#include "circuitlist.h"
+#include "config.h"
+#include "connection_edge.h"
+#include "dns.h"
+#include "memgov.h"
+#include "proxy.h"
+#include "routerlist.h"
+
+/** Return how many bytes <b>tag</b> holds. */
+static INLINE uint64_t
+memgov_tag_bytes(mem_tag_t tag)
+{
+  LONG n = mem_tag_bytes[tag];
+  return n > 0 ? (uint64_t)n : 0;
+}
+
+/** Return how many bytes all the subsystems that we account hold. */
+uint64_t
+memgov_total(void)
+{
+  uint64_t total = 0;
+  int i;
+  mem_tag_bytes[MEM_TAG_ROUTERLIST] = (LONG)routerlist_get_mem_usage();
+  for (i = 0; i < _MEM_TAG_MAX; i++)
+    total += memgov_tag_bytes(i);
+  return total;
+}
+
+/** Log how much memory each subsystem holds at log level
+ * <b>severity</b>. */
+void
+memgov_dump(int severity)
+{
+  uint64_t total = memgov_total();
+  log(severity,LD_GENERAL,get_lang_str(LANG_LOG_MEMGOV_USAGE),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_BUFFERS)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_CELL_QUEUES)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_ROUTERLIST)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_DNS_CACHE)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_ADDRESSMAP)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_COOKIES)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_LOG_CACHE)),
+      U64_PRINTF_ARG(memgov_tag_bytes(MEM_TAG_PLUGINS)),
+      U64_PRINTF_ARG(total));
+}
+
+/** Called once a second.  If we hold more than MaxMemInUse, trim the caches
+ * one after the other until we are back under it, and if that isn't enough,
+ * close the circuits that queue the most data. */
+void
+memgov_check(time_t now)
+{
+  static ratelim_t over_limit_warning = RATELIM_INIT(300);
+  uint64_t limit = get_options()->MaxMemInUse;
+  uint64_t total, target, before;
+  char *m;
+  if (!limit)
+    return;
+  before = total = memgov_total();
+  if (total <= limit)
+    return;
+  /* Free a tenth more than we must, so that we don't trim again on the next
+   * second. */
+  target = limit - limit / 10;
+
+  /* Cheapest first: spare chunks, then the caches that we only keep to save
+   * work or to show the user, then the address mappings and cookies that
+   * nobody has used for the longest. */
+  buf_shrink_freelists(1);
+  if ((total = memgov_total()) > target) {
+    log_cache_shrink();
+    total = memgov_total();
+  }
+  if (total > target) {
+    dns_cache_shrink();
+    total = memgov_total();
+  }
+  if (total > target) {
+    addressmap_shrink();
+    total = memgov_total();
+  }
+  if (total > target) {
+    free_expired_cookies();
+    total = memgov_total();
+  }
+  if ((m = rate_limit_log(&over_limit_warning, now))) {
+    log_notice(LD_GENERAL,get_lang_str(LANG_LOG_MEMGOV_OVER_LIMIT),
+               U64_PRINTF_ARG(before),U64_PRINTF_ARG(limit),
+               U64_PRINTF_ARG(total));
+    tor_free(m);
+  }
+
+  /* Only the cell queues and the stream buffers are left to free. */
+  if (total > target) {
+    size_t freed = 0;
+    int n = circuits_handle_oom((size_t)(total - target), &freed);
+    if (n)
+      log_notice(LD_GENERAL,get_lang_str(LANG_LOG_MEMGOV_CLOSED_CIRCS),n,
+                 U64_PRINTF_ARG(freed));
+  }
+}
+
@@ -0,0 +1,20 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file memgov.h
+ * \brief Header file for memgov.c.
+ **/
+
+#ifndef _TOR_MEMGOV_H
+#define _TOR_MEMGOV_H
+
+uint64_t memgov_total(void);
+void memgov_dump(int severity);
+void memgov_check(time_t now);
+
+#endif
+
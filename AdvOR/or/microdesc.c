@@ -5,6 +5,8 @@
 #include "config.h"
 #include "microdesc.h"
 #include "routerparse.h"
+#include "routerlist.h"
+#include "policies.h"
 #include "main.h"
 
 /** A data structure to hold a bunch of cached microdescriptors. There are two active files in the cache: a "cache file" that we mmap, and a "journal file" that we append to. Periodically, we rebuild the cache file to hold only the microdescriptors that we want to keep */
@@ -314,6 +316,39 @@ microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const
 	return md;
 }
 
+/** Build a router from the consensus entry <b>rs</b> and the microdescriptor <b>md</b> it lists, for use in circuits when we don't download full descriptors. The router takes its descriptor digest from <b>rs</b>, so it counts as the descriptor the consensus lists; it has no body, and is never written to the descriptor store. Return the new router. */
+routerinfo_t *microdesc_make_routerinfo(const routerstatus_t *rs, const microdesc_t *md)
+{	routerinfo_t *router = tor_malloc_zero(sizeof(routerinfo_t));
+	uint32_t bw = rs->bandwidth > UINT32_MAX / 1000 ? UINT32_MAX : rs->bandwidth * 1000;
+	router->cache_info.routerlist_index = -1;
+	router->cache_info.published_on = rs->published_on;
+	router->cache_info.do_not_cache = 1;
+	memcpy(router->cache_info.identity_digest, rs->identity_digest, DIGEST_LEN);
+	memcpy(router->cache_info.signed_descriptor_digest, rs->descriptor_digest, DIGEST_LEN);
+	router->from_microdesc = 1;
+	router->nickname = tor_strdup(rs->nickname);
+	router->address = tor_dup_ip(rs->addr);
+	router->addr = rs->addr;
+	router->or_port = rs->or_port;
+	router->dir_port = rs->dir_port;
+	router->platform = router_intern_string("<unknown>");
+	router->bandwidthrate = router->bandwidthburst = router->bandwidthcapacity = bw;
+	router->onion_pkey = crypto_pk_dup_key(md->onion_pkey);
+	if(md->family)
+	{	router->declared_family = smartlist_create();
+		SMARTLIST_FOREACH(md->family, const char *, cp, smartlist_add(router->declared_family, router_intern_family_member(cp)));
+	}
+	if(md->exitsummary)	policies_set_router_exitpolicy_from_summary(router, md->exitsummary);
+	else			policies_set_router_exitpolicy_to_reject_all(router);
+	router_intern_exit_policy(router);
+	if(policy_is_reject_star(router->exit_policy))
+		router->policy_is_reject_star = 1;
+	router->purpose = ROUTER_PURPOSE_GENERAL;
+	set_router_id(router);
+	routerinfo_set_country(router);
+	return router;
+}
+
 /** Return the mean size of decriptors added to <b>cache</b> since it was last cleared. Used to estimate the size of large downloads. */
 size_t microdesc_average_size(microdesc_cache_t *cache)
 {	if(!cache)		cache = get_microdesc_cache();
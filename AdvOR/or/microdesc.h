@@ -31,6 +31,9 @@ microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache,
 
 size_t microdesc_average_size(microdesc_cache_t *cache);
 
+routerinfo_t *microdesc_make_routerinfo(const routerstatus_t *rs,
+                                        const microdesc_t *md);
+
 void microdesc_free(microdesc_t *md);
 void microdesc_free_all(void);
 
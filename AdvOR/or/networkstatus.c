@@ -10,12 +10,15 @@
  * client or cache.
  */
 
+#define NETWORKSTATUS_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -26,6 +29,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 
 /* For tracking v2 networkstatus documents.  Only caches do this now. */
 
@@ -78,6 +82,9 @@ static time_t last_networkstatus_download_attempted = 0;
 static time_t time_to_download_next_consensus = 0;
 /** Download status for the current consensus networkstatus. */
 static download_status_t consensus_dl_status[N_CONSENSUS_FLAVORS];
+/** True iff the last consensus diff we got couldn't be applied, so that our
+ * next consensus request should be for the full document. */
+static int consensus_diff_failed = 0;
 
 /** True iff we have logged a warning about this OR's version being older than
  * listed by the authorities. */
@@ -92,6 +99,8 @@ void update_v2_networkstatus_cache_downloads(time_t now);
 void update_consensus_networkstatus_downloads(time_t now);
 int networkstatus_set_current_consensus1(char *consensus,const char *flavor,unsigned flags);
 void expire_consensus(void);
+void sorted_exits_add(routerinfo_t *router);
+void sorted_exits_remove(routerinfo_t *router);
 
 /** Forget that we've warned about anything networkstatus-related, so we will
  * give fresh warnings if the same behavior happens again. */
@@ -318,6 +327,28 @@ document_signature_dup(const document_signature_t *sig)
   return r;
 }
 
+/** The net_params and weight_params of a networkstatus, parsed. */
+typedef struct networkstatus_param_cache_t {
+  /** Map from parameter name to its value in <b>values</b>. */
+  strmap_t *net_params;
+  /** Map from bw weight name to its value in <b>values</b>. */
+  strmap_t *weight_params;
+  /** The value of every parameter that parsed. */
+  int32_t *values;
+} networkstatus_param_cache_t;
+
+/** Free all storage held in <b>cache</b>. */
+static void
+networkstatus_param_cache_free(networkstatus_param_cache_t *cache)
+{
+  if (!cache)
+    return;
+  strmap_free(cache->net_params, NULL);
+  strmap_free(cache->weight_params, NULL);
+  tor_free(cache->values);
+  tor_free(cache);
+}
+
 /** Free all storage held in <b>ns</b>. */
 void
 networkstatus_vote_free(networkstatus_t *ns)
@@ -339,6 +370,7 @@ networkstatus_vote_free(networkstatus_t *ns)
     SMARTLIST_FOREACH(ns->net_params, char *, c, tor_free(c));
     smartlist_free(ns->net_params);
   }
+  networkstatus_param_cache_free(ns->param_cache);
   if (ns->supported_methods) {
     SMARTLIST_FOREACH(ns->supported_methods, char *, c, tor_free(c));
     smartlist_free(ns->supported_methods);
@@ -377,6 +409,7 @@ networkstatus_vote_free(networkstatus_t *ns)
   }
 
   digestmap_free(ns->desc_digest_map, NULL);
+  digestmap_free(ns->identity_map, NULL);
 
   memset(ns, 11, sizeof(*ns));
   tor_free(ns);
@@ -411,12 +444,19 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
   const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
   char *signed_digest;
   size_t signed_digest_len;
+  char sig_id[DIGEST_LEN];
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
   if (tor_memneq(sig->signing_key_digest, key_digest, DIGEST_LEN) ||
       tor_memneq(sig->identity_digest, cert->cache_info.identity_digest,
                  DIGEST_LEN))
     return -1;
+  sigcache_get_id(sig_id, key_digest, consensus->digests.d[sig->alg], dlen,
+                  sig->signature, sig->signature_len);
+  if (sigcache_lookup(sig_id)) {
+    sig->good_signature = 1;
+    return 0;
+  }
   signed_digest_len = crypto_pk_keysize(cert->signing_key);
   signed_digest = tor_malloc(signed_digest_len);
   if (crypto_pk_public_checksig(cert->signing_key,
@@ -429,11 +469,38 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
+    sigcache_add(sig_id);
   }
   tor_free(signed_digest);
   return 0;
 }
 
+/** One signature that networkstatus_check_consensus_signature() wants
+ * checked, and the result of checking it. */
+typedef struct consensus_sig_check_t {
+  document_signature_t *sig;
+  const authority_cert_t *cert;
+  /** What networkstatus_check_document_signature() returned. */
+  int result;
+} consensus_sig_check_t;
+
+/** Argument for consensus_sig_check_batch_fn(). */
+typedef struct consensus_sig_batch_t {
+  const networkstatus_t *consensus;
+  consensus_sig_check_t *checks;
+} consensus_sig_batch_t;
+
+/** cpuworker_run_batch() callback: check signature <b>idx</b> of the batch
+ * in <b>arg</b>. */
+static void
+consensus_sig_check_batch_fn(void *arg, int idx)
+{
+  consensus_sig_batch_t *b = arg;
+  consensus_sig_check_t *check = &b->checks[idx];
+  check->result = networkstatus_check_document_signature(b->consensus,
+                                                  check->sig, check->cert);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -460,9 +527,35 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
   smartlist_t *missing_authorities = smartlist_create();
   int severity;
   time_t now = get_time(NULL);
+  consensus_sig_batch_t batch;
+  int n_sigs = 0, n_checks = 0, check_idx;
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  /* The RSA operations are independent of each other, so check every
+   * signature we have a key for at once, and only count the results below. */
+  SMARTLIST_FOREACH(consensus->voters, networkstatus_voter_info_t *, voter,
+                    n_sigs += smartlist_len(voter->sigs));
+  batch.consensus = consensus;
+  batch.checks = tor_malloc_zero(sizeof(consensus_sig_check_t)*(n_sigs+1));
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      if (!sig->good_signature && !sig->bad_signature && sig->signature &&
+          trusteddirserver_get_by_v3_auth_digest(sig->identity_digest)) {
+        authority_cert_t *cert =
+          authority_cert_get_by_digests(sig->identity_digest,
+                                        sig->signing_key_digest);
+        if (cert && cert->expires >= now-get_options()->MaxTimeDelta) {
+          batch.checks[n_checks].sig = sig;
+          batch.checks[n_checks].cert = cert;
+          ++n_checks;
+        }
+      }
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+  cpuworker_run_batch(n_checks, consensus_sig_check_batch_fn, &batch);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -472,6 +565,7 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
     SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
       if (!sig->good_signature && !sig->bad_signature &&
           sig->signature) {
+        int result = -1;
         /* we can try to check the signature. */
         int is_v3_auth = trusteddirserver_get_by_v3_auth_digest(
                                               sig->identity_digest) != NULL;
@@ -492,7 +586,15 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
             ++dl_failed_key_here;
           continue;
         }
-        if (networkstatus_check_document_signature(consensus, sig, cert) < 0) {
+        for (check_idx = 0; check_idx < n_checks; ++check_idx) {
+          if (batch.checks[check_idx].sig == sig)
+            break;
+        }
+        if (check_idx < n_checks)
+          result = batch.checks[check_idx].result;
+        else
+          result = networkstatus_check_document_signature(consensus, sig, cert);
+        if (result < 0) {
           smartlist_add(need_certs_from, voter);
           ++missing_key_here;
           if (authority_cert_dl_looks_uncertain(sig->identity_digest))
@@ -589,6 +691,7 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
   smartlist_free(unrecognized);
   smartlist_free(need_certs_from);
   smartlist_free(missing_authorities);
+  tor_free(batch.checks);
 
   if (n_good == n_v3_authorities)
     return 1;
@@ -880,11 +983,37 @@ networkstatus_v2_find_entry(networkstatus_v2_t *ns, const char *digest)
                            compare_digest_to_routerstatus_entry);
 }
 
+static networkstatus_param_cache_t *networkstatus_get_param_cache(
+                                                    networkstatus_t *ns);
+
+/** Build the digest maps of the consensus <b>ns</b>, so that looking up
+ * its entries by identity or descriptor digest doesn't need a search, and
+ * parse its parameters. */
+static void
+networkstatus_index_entries(networkstatus_t *ns)
+{
+  networkstatus_get_param_cache(ns);
+  if (!ns->identity_map) {
+    digestmap_t *m = ns->identity_map = digestmap_new();
+    SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+      digestmap_set(m, rs->identity_digest, (void*)(uintptr_t)(rs_sl_idx+1)));
+  }
+  if (!ns->desc_digest_map) {
+    digestmap_t *m = ns->desc_digest_map = digestmap_new();
+    SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+      digestmap_set(m, rs->descriptor_digest, rs));
+  }
+}
+
 /** Return the entry in <b>ns</b> for the identity digest <b>digest</b>, or
  * NULL if none was found. */
 routerstatus_t *
 networkstatus_vote_find_entry(networkstatus_t *ns, const char *digest)
 {
+  if (ns->identity_map) {
+    int idx = (int)(uintptr_t)digestmap_get(ns->identity_map, digest);
+    return idx ? smartlist_get(ns->routerstatus_list, idx-1) : NULL;
+  }
   return smartlist_bsearch(ns->routerstatus_list, digest,
                            compare_digest_to_routerstatus_entry);
 }
@@ -897,6 +1026,13 @@ int
 networkstatus_vote_find_entry_idx(networkstatus_t *ns,
                                   const char *digest, int *found_out)
 {
+  if (ns->identity_map) {
+    int idx = (int)(uintptr_t)digestmap_get(ns->identity_map, digest);
+    if (idx) {
+      *found_out = 1;
+      return idx-1;
+    }
+  }
   return smartlist_bsearch_idx(ns->routerstatus_list, digest,
                                compare_digest_to_routerstatus_entry,
                                found_out);
@@ -918,14 +1054,7 @@ routerstatus_t *
 router_get_consensus_status_by_descriptor_digest(const char *digest)
 {
   if (!current_consensus) return NULL;
-  if (!current_consensus->desc_digest_map) {
-    digestmap_t * m = current_consensus->desc_digest_map = digestmap_new();
-    SMARTLIST_FOREACH(current_consensus->routerstatus_list,
-                      routerstatus_t *, rs,
-     {
-       digestmap_set(m, rs->descriptor_digest, rs);
-     });
-  }
+  networkstatus_index_entries(current_consensus);
   return digestmap_get(current_consensus->desc_digest_map, digest);
 }
 
@@ -1146,12 +1275,14 @@ extern int bootstrap_percent;
 void update_consensus_networkstatus_downloads(time_t now)
 {
   int i;
-  if (!networkstatus_get_live_consensus(now))
+  consensus_flavor_t flav = USABLE_CONSENSUS_FLAVOR;
+  networkstatus_t *c = networkstatus_get_live_consensus(now);
+  if (!c || c->flavor != flav)
     time_to_download_next_consensus = now; /* No live consensus? Get one now!*/
 //  else if(get_options()->DirFlags&DIR_FLAG_NO_AUTO_UPDATE) return;
   if (time_to_download_next_consensus > now)
     return; /* Wait until the current consensus is older. */
-  if (!download_status_is_ready(&consensus_dl_status[FLAV_NS], now,
+  if (!download_status_is_ready(&consensus_dl_status[flav], now,
                                 get_options()->MaxDlFailures?get_options()->MaxDlFailures:32767) && (bootstrap_percent>=80 || get_options()->DirProxy || we_are_hibernating()))
     return; /* We failed downloading a consensus too recently. */
   if (connection_get_by_type_purpose(CONN_TYPE_DIR,
@@ -1166,7 +1297,7 @@ void update_consensus_networkstatus_downloads(time_t now)
         return; /* We're still getting certs for this one. */
       else {
         if (!waiting->dl_failed) {
-          download_status_failed(&consensus_dl_status[FLAV_NS], 0);
+          download_status_failed(&consensus_dl_status[flav], 0);
           waiting->dl_failed=1;
         }
       }
@@ -1174,8 +1305,11 @@ void update_consensus_networkstatus_downloads(time_t now)
   }
 
   log_info(LD_DIR,get_lang_str(LANG_LOG_NETWORKSTATUS_DOWNLOADING));
+  /* The resource names the flavor, unless it's the plain ns consensus. */
   directory_get_from_dirserver(DIR_PURPOSE_FETCH_CONSENSUS,
-                               ROUTER_PURPOSE_GENERAL, NULL,
+                               ROUTER_PURPOSE_GENERAL,
+                               flav == FLAV_NS ? NULL :
+                                 networkstatus_get_flavor_name(flav),
                                PDS_RETRY_IF_NO_SERVERS);
 }
 
@@ -1184,12 +1318,70 @@ void update_consensus_networkstatus_downloads(time_t now)
 void
 networkstatus_consensus_download_failed(int status_code)
 {
-  /* XXXXNM Microdescs: may need to handle more types. */
-  download_status_failed(&consensus_dl_status[FLAV_NS], status_code);
+  download_status_failed(&consensus_dl_status[USABLE_CONSENSUS_FLAVOR],
+                         status_code);
   /* Retry immediately, if appropriate. */
   update_consensus_networkstatus_downloads(get_time(NULL));
 }
 
+/** If our next consensus request should ask for a diff from the consensus
+ * we use, set <b>digest_out</b> to the DIGEST256_LEN-byte SHA3 digest that
+ * names it, and return 1.  Otherwise return 0. */
+int
+networkstatus_get_consensus_diff_base(char *digest_out)
+{
+  if (consensus_diff_failed || !current_consensus ||
+      current_consensus->flavor != USABLE_CONSENSUS_FLAVOR ||
+      !current_consensus->has_digest_sha3_as_signed)
+    return 0;
+  memcpy(digest_out, current_consensus->digest_sha3_as_signed,
+         DIGEST256_LEN);
+  return 1;
+}
+
+/** Rebuild a <b>flavor</b> consensus from the consensus we have cached and
+ * the consensus diff in <b>diff</b>.  Return the new consensus in a newly
+ * allocated string, or NULL if we can't; in that case, don't ask for a diff
+ * again until we've had a full consensus, and ask for that right away. */
+char *
+networkstatus_apply_consensus_diff(const char *diff, const char *flavor)
+{
+  char *base = NULL, *result = NULL;
+
+  if (directory_caches_dir_info(get_options())) {
+    cached_dir_t *cur = dirserv_get_consensus(flavor);
+    if (cur)
+      base = tor_strdup(cur->dir);
+  }
+  if (!base) {
+    char *filename;
+    if (!strcmp(flavor, "ns"))
+      filename = get_datadir_fname(DATADIR_CACHED_CONSENSUS);
+    else {
+      char buf[128];
+      tor_snprintf(buf, sizeof(buf), "%s-%s", DATADIR_CACHED_CONSENSUS, flavor);
+      filename = get_datadir_fname(buf);
+    }
+    base = read_file_to_str(filename, RFTS_IGNORE_MISSING, NULL);
+    tor_free(filename);
+  }
+  if (base) {
+    result = consensus_diff_apply(base, diff);
+    tor_free(base);
+  }
+  if (!result) {
+    log_notice(LD_DIR,get_lang_str(LANG_LOG_NETWORKSTATUS_CONSENSUS_DIFF_FAILED));
+    consensus_diff_failed = 1;
+    /* This isn't the directory server's fault, so don't count it as a
+     * failed download; just try again without the diff header. */
+    directory_get_from_dirserver(DIR_PURPOSE_FETCH_CONSENSUS,
+                                 ROUTER_PURPOSE_GENERAL,
+                                 strcmp(flavor, "ns") ? flavor : NULL,
+                                 PDS_RETRY_IF_NO_SERVERS);
+  }
+  return result;
+}
+
 /** How long do we (as a cache) wait after a consensus becomes non-fresh
  * before trying to fetch another? */
 #define CONSENSUS_MIN_SECONDS_BEFORE_CACHING 120
@@ -1339,6 +1531,18 @@ networkstatus_get_latest_consensus(void)
   return current_consensus;
 }
 
+/** Make <b>ns</b> our current consensus without any of the checks and
+ * updates that a downloaded one goes through, and return the one we had.
+ * Used by the benchmarks to install a fixture of a known size. */
+networkstatus_t *
+networkstatus_swap_current_consensus(networkstatus_t *ns)
+{
+  networkstatus_t *old = current_consensus;
+  current_consensus = ns;
+  router_dir_info_changed();
+  return old;
+}
+
 /** Return the most recent consensus that we have downloaded, or NULL if it is
  * no longer live. */
 networkstatus_t *
@@ -1619,7 +1823,9 @@ int networkstatus_set_current_consensus(char *consensus,const char *flavor,unsig
 	else if(!from_cache)	download_status_failed(&consensus_dl_status[flav], 0);
 	if(flav == USABLE_CONSENSUS_FLAVOR)
 	{	current_consensus = c;
+		networkstatus_index_entries(c);
 		free_consensus = 0; /* Prevent free. */
+		consensus_diff_failed = 0;
 		update_consensus_networkstatus_fetch_time(now);	/* XXXXNM Microdescs: needs a non-ns variant. */
 		dirvote_recalculate_timing(options, now);
 		routerstatus_list_update_named_server_map();
@@ -1779,6 +1985,7 @@ int networkstatus_set_current_consensus1(char *consensus,const char *flavor,unsi
 					download_status_failed(&consensus_dl_status[flav],0);
 				if(flav == USABLE_CONSENSUS_FLAVOR)
 				{	current_consensus = c;
+					networkstatus_index_entries(c);
 					free_consensus = 0; /* Prevent free. */
 					/* XXXXNM Microdescs: needs a non-ns variant. */
 					update_consensus_networkstatus_fetch_time(now);
@@ -1804,6 +2011,7 @@ int networkstatus_set_current_consensus1(char *consensus,const char *flavor,unsi
 				else if(!from_cache)	download_status_failed(&consensus_dl_status[flav], 0);
 				if(flav == USABLE_CONSENSUS_FLAVOR)
 				{	current_consensus = c;
+					networkstatus_index_entries(c);
 					free_consensus = 0; /* Prevent free. */
 					/* XXXXNM Microdescs: needs a non-ns variant. */
 					update_consensus_networkstatus_fetch_time(now);
@@ -2058,7 +2266,14 @@ routers_update_status_from_consensus_networkstatus(smartlist_t *routers,
       router->is_fast = rs->is_fast;
       router->is_stable = rs->is_stable;
       router->is_possible_guard = rs->is_possible_guard;
-      router->is_exit = rs->is_exit;
+      if (router->is_exit != rs->is_exit) {
+        /* keep the exits sorted for IDENTITY_FLAG_LIST_SELECTION in step */
+        if (router->is_exit)
+          sorted_exits_remove(router);
+        router->is_exit = rs->is_exit;
+        if (router->is_exit)
+          sorted_exits_add(router);
+      }
       router->is_bad_directory = rs->is_bad_directory;
       router->is_bad_exit = rs->is_bad_exit;
       router->is_hs_dir = rs->is_hs_dir;
@@ -2110,12 +2325,7 @@ signed_descs_update_status_from_consensus_networkstatus(smartlist_t *descs)
   if (!ns)
     return;
 
-  if (!ns->desc_digest_map) {
-    char dummy[DIGEST_LEN];
-    /* instantiates the digest map. */
-    memset(dummy, 0, sizeof(dummy));
-    router_get_consensus_status_by_descriptor_digest(dummy);
-  }
+  networkstatus_index_entries(ns);
   SMARTLIST_FOREACH(descs, signed_descriptor_t *, d,
   {
     routerstatus_t *rs = digestmap_get(ns->desc_digest_map,
@@ -2191,28 +2401,74 @@ networkstatus_dump_bridge_status_to_file(time_t now)
   tor_free(status);
 }
 
+/** Helper: parse the key=value strings in <b>params</b> into <b>map</b>,
+ * storing the values from *<b>n</b> onwards in <b>values</b>.  When a key
+ * appears more than once, the first value that parses wins. */
+static void
+networkstatus_parse_param_list(smartlist_t *params, strmap_t *map,
+                               int32_t *values, int *n)
+{
+  SMARTLIST_FOREACH_BEGIN(params, const char *, p) {
+    const char *eq = strchr(p, '=');
+    char *name;
+    int ok = 0;
+    long v;
+    if (!eq)
+      continue;
+    v = tor_parse_long(eq+1, 10, INT32_MIN, INT32_MAX, &ok, NULL);
+    if (!ok)
+      continue;
+    name = tor_strndup(p, eq-p);
+    if (!strmap_get(map, name)) {
+      values[*n] = (int32_t) v;
+      strmap_set(map, name, &values[(*n)++]);
+    }
+    tor_free(name);
+  } SMARTLIST_FOREACH_END(p);
+}
+
+/** Return the parsed parameters of <b>ns</b>, parsing them if we haven't
+ * yet. */
+static networkstatus_param_cache_t *
+networkstatus_get_param_cache(networkstatus_t *ns)
+{
+  if (!ns->param_cache) {
+    networkstatus_param_cache_t *cache =
+      tor_malloc_zero(sizeof(networkstatus_param_cache_t));
+    int n = 0, n_params =
+      (ns->net_params ? smartlist_len(ns->net_params) : 0) +
+      (ns->weight_params ? smartlist_len(ns->weight_params) : 0);
+    cache->net_params = strmap_new();
+    cache->weight_params = strmap_new();
+    cache->values = tor_malloc(sizeof(int32_t) * (n_params ? n_params : 1));
+    if (ns->net_params)
+      networkstatus_parse_param_list(ns->net_params, cache->net_params,
+                                     cache->values, &n);
+    if (ns->weight_params)
+      networkstatus_parse_param_list(ns->weight_params, cache->weight_params,
+                                     cache->values, &n);
+    ns->param_cache = cache;
+  }
+  return ns->param_cache;
+}
+
+/** Helper: return the value of the parameter <b>param_name</b> in
+ * <b>params</b>, a map from networkstatus_get_param_cache(), clamped to
+ * the range <b>min_val</b> through <b>max_val</b>, or <b>default_val</b>
+ * if there is no such parameter. */
 static int32_t
-get_net_param_from_list(smartlist_t *net_params, const char *param_name,
-                        int32_t default_val, int32_t min_val, int32_t max_val)
+get_net_param_from_map(strmap_t *params, const char *param_name,
+                       int32_t default_val, int32_t min_val, int32_t max_val)
 {
   int32_t res = default_val;
-  size_t name_len = strlen(param_name);
+  const int32_t *v;
 
   tor_assert(max_val > min_val);
   tor_assert(min_val <= default_val);
   tor_assert(max_val >= default_val);
 
-  SMARTLIST_FOREACH_BEGIN(net_params, const char *, p) {
-    if (!strcmpstart(p, param_name) && p[name_len] == '=') {
-      int ok=0;
-      long v = tor_parse_long(p+name_len+1, 10, INT32_MIN,
-                              INT32_MAX, &ok, NULL);
-      if (ok) {
-        res = (int32_t) v;
-        break;
-      }
-    }
-  } SMARTLIST_FOREACH_END(p);
+  if ((v = strmap_get(params, param_name)))
+    res = *v;
 
   if (res < min_val) {
     log_warn(LD_DIR,get_lang_str(LANG_LOG_NETWORKSTATUS_PARAMETER_TOO_SMALL),param_name,res,min_val);
@@ -2240,8 +2496,8 @@ networkstatus_get_param(networkstatus_t *ns, const char *param_name,
   if (!ns || !ns->net_params)
     return default_val;
 
-  return get_net_param_from_list(ns->net_params, param_name,
-                                 default_val, min_val, max_val);
+  return get_net_param_from_map(networkstatus_get_param_cache(ns)->net_params,
+                                param_name, default_val, min_val, max_val);
 }
 
 /** Return the value of a integer bw weight parameter from the networkstatus
@@ -2261,9 +2517,9 @@ networkstatus_get_bw_weight(networkstatus_t *ns, const char *weight_name,
     return default_val;
 
   max = circuit_build_times_get_bw_scale(ns);
-  param = get_net_param_from_list(ns->weight_params, weight_name,
-                                  default_val, -1,
-                                  BW_MAX_WEIGHT_SCALE);
+  param = get_net_param_from_map(
+                           networkstatus_get_param_cache(ns)->weight_params,
+                           weight_name, default_val, -1, BW_MAX_WEIGHT_SCALE);
   if (param > max) {
     log_warn(LD_DIR,get_lang_str(LANG_LOG_NETWORKSTATUS_WEIGHT_TOO_LARGE),weight_name,max);
     param = max;
@@ -2300,6 +2556,19 @@ networkstatus_parse_flavor_name(const char *flavname)
     return -1;
 }
 
+/** Return the consensus flavor we build circuits from: the microdesc flavor
+ * if UseMicrodescriptors is set and we don't need full descriptors for
+ * anything else, or the ns flavor otherwise. */
+consensus_flavor_t
+networkstatus_usable_flavor(void)
+{
+  or_options_t *options = get_options();
+  if (options->UseMicrodescriptors && !options->UseBridges &&
+      !directory_caches_dir_info(options))
+    return FLAV_MICRODESC;
+  return FLAV_NS;
+}
+
 /** If <b>question</b> is a string beginning with "ns/" in a format the
  * control interface expects for a GETINFO question, set *<b>answer</b> to a
  * newly-allocated string containing networkstatus lines for the appropriate
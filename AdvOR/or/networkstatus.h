@@ -58,6 +58,8 @@ routerstatus_t *router_get_consensus_status_by_nickname(const char *nickname,
 const char *networkstatus_get_router_digest_by_nickname(const char *nickname);
 int networkstatus_nickname_is_unnamed(const char *nickname);
 void networkstatus_consensus_download_failed(int status_code);
+int networkstatus_get_consensus_diff_base(char *digest_out);
+char *networkstatus_apply_consensus_diff(const char *diff, const char *flavor);
 void update_consensus_networkstatus_fetch_time(time_t now);
 int should_delay_dir_fetches(or_options_t *options);
 void update_networkstatus_downloads(time_t now);
@@ -95,10 +97,16 @@ int32_t networkstatus_get_bw_weight(networkstatus_t *ns, const char *weight,
                                     int32_t default_val);
 const char *networkstatus_get_flavor_name(consensus_flavor_t flav);
 int networkstatus_parse_flavor_name(const char *flavname);
+consensus_flavor_t networkstatus_usable_flavor(void);
 void document_signature_free(document_signature_t *sig);
 document_signature_t *document_signature_dup(const document_signature_t *sig);
 void networkstatus_free_all(void);
 void addTorVer(const char*);
 
+#ifdef NETWORKSTATUS_PRIVATE
+/* Used only by networkstatus.c and bench.c */
+networkstatus_t *networkstatus_swap_current_consensus(networkstatus_t *ns);
+#endif
+
 #endif
 
@@ -22,12 +22,18 @@
 typedef struct onion_queue_t {
   or_circuit_t *circ;
   char *onionskin;
-  time_t when_added;
+  struct timeval when_added;
   struct onion_queue_t *next;
+  struct onion_queue_t *prev;
 } onion_queue_t;
 
-/** 5 seconds on the onion queue til we just send back a destroy */
+/** 5 seconds on the onion queue til we just send back a destroy: by then
+ * the client has most likely given up on the circuit anyway. */
 #define ONIONQUEUE_WAIT_CUTOFF 5
+/** Once the oldest onionskin has waited this many msec, the cpuworkers are
+ * falling behind: answer the freshest onionskins first, since those
+ * clients are the most likely to still be waiting. */
+#define ONIONQUEUE_OVERLOAD_MSEC 1000
 
 /** First and last elements in the linked list of circuits waiting for CPU
  * workers, or NULL if the list is empty. */
@@ -36,33 +42,73 @@ static onion_queue_t *ol_tail=NULL;
 /** Length of ol_list */
 static int ol_length=0;
 
-/** Add <b>circ</b> to the end of ol_list and return 0, except
- * if ol_list is too long, in which case do nothing and return -1.
+/** How many onionskins have we handed to the cpuworkers from the queue? */
+static uint64_t ol_n_processed = 0;
+/** How many onionskins did we drop because they had waited too long? */
+static uint64_t ol_n_expired = 0;
+/** How many onionskins did we drop to make room when the queue was full? */
+static uint64_t ol_n_displaced = 0;
+/** Total msec that the onionskins in <b>ol_n_processed</b> spent queued. */
+static uint64_t ol_total_wait_msec = 0;
+/** Longest msec that any onionskin spent queued before we processed it. */
+static long ol_max_wait_msec = 0;
+
+/** Unlink <b>victim</b> from ol_list, and free it. */
+static void
+onion_queue_entry_remove(onion_queue_t *victim)
+{
+  if (victim->prev)
+    victim->prev->next = victim->next;
+  else
+    ol_list = victim->next;
+  if (victim->next)
+    victim->next->prev = victim->prev;
+  else
+    ol_tail = victim->prev;
+  ol_length--;
+  tor_free(victim->onionskin);
+  tor_free(victim);
+}
+
+/** Remove <b>victim</b> from the queue and close its circuit with
+ * <b>reason</b>. */
+static void
+onion_queue_entry_drop(onion_queue_t *victim, int reason)
+{
+  or_circuit_t *circ = victim->circ;
+  onion_queue_entry_remove(victim);
+  circuit_mark_for_close(TO_CIRCUIT(circ), reason);
+}
+
+/** Drop every onionskin that has been waiting for ONIONQUEUE_WAIT_CUTOFF
+ * seconds or more as of <b>now</b>: its client will time it out before we
+ * could answer it. */
+static void
+onion_queue_cull_expired(const struct timeval *now)
+{
+  while (ol_list &&
+         now->tv_sec - ol_list->when_added.tv_sec >= ONIONQUEUE_WAIT_CUTOFF) {
+    /* cull elderly requests. */
+    log_info(LD_CIRC,get_lang_str(LANG_LOG_ONION_REQUEST_TOO_OLD));
+    ++ol_n_expired;
+    onion_queue_entry_drop(ol_list, END_CIRC_REASON_RESOURCELIMIT);
+  }
+}
+
+/** Add <b>circ</b> to the end of ol_list and return 0.  If ol_list is too
+ * long, make room by dropping its oldest onionskin, which is the least
+ * likely to be answered in time.
  */
 int
 onion_pending_add(or_circuit_t *circ, char *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = get_time(NULL);
+  struct timeval now;
 
-  tmp = tor_malloc_zero(sizeof(onion_queue_t));
-  tmp->circ = circ;
-  tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  tor_gettimeofday(&now);
+  onion_queue_cull_expired(&now);
 
-  if (!ol_tail) {
-    tor_assert(!ol_list);
-    tor_assert(!ol_length);
-    ol_list = tmp;
-    ol_tail = tmp;
-    ol_length++;
-    return 0;
-  }
-
-  tor_assert(ol_list);
-  tor_assert(!ol_tail->next);
-
-  if (ol_length >= get_options()->MaxOnionsPending) {
+  if (ol_list && ol_length >= get_options()->MaxOnionsPending) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -71,41 +117,61 @@ onion_pending_add(or_circuit_t *circ, char *onionskin)
       log_warn(LD_GENERAL,get_lang_str(LANG_LOG_ONION_COMPUTER_TOO_SLOW));
       tor_free(m);
     }
-    tor_free(tmp);
-    return -1;
+    ++ol_n_displaced;
+    onion_queue_entry_drop(ol_list, END_CIRC_REASON_RESOURCELIMIT);
   }
 
-  ol_length++;
-  ol_tail->next = tmp;
+  tmp = tor_malloc_zero(sizeof(onion_queue_t));
+  tmp->circ = circ;
+  tmp->onionskin = onionskin;
+  tmp->when_added = now;
+  tmp->prev = ol_tail;
+  if (ol_tail)
+    ol_tail->next = tmp;
+  else
+    ol_list = tmp;
   ol_tail = tmp;
-  while ((int)(now - ol_list->when_added) >= ONIONQUEUE_WAIT_CUTOFF) {
-    /* cull elderly requests. */
-    circ = ol_list->circ;
-    onion_pending_remove(ol_list->circ);
-    log_info(LD_CIRC,get_lang_str(LANG_LOG_ONION_REQUEST_TOO_OLD));
-    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-  }
+  ol_length++;
   return 0;
 }
 
-/** Remove the first item from ol_list and return it, or return
- * NULL if the list is empty.
+/** Remove the next item to process from ol_list and return it, or return
+ * NULL if the list is empty.  Normally that's the oldest item; if the
+ * oldest has already waited ONIONQUEUE_OVERLOAD_MSEC, it's the newest.
  */
 or_circuit_t *
 onion_next_task(char **onionskin_out)
 {
   or_circuit_t *circ;
+  onion_queue_t *next;
+  struct timeval now;
+  long waited;
 
+  tor_gettimeofday(&now);
+  onion_queue_cull_expired(&now);
   if (!ol_list)
     return NULL; /* no onions pending, we're done */
 
-  tor_assert(ol_list->circ);
-  tor_assert(ol_list->circ->p_conn); /* make sure it's still valid */
   tor_assert(ol_length > 0);
-  circ = ol_list->circ;
-  *onionskin_out = ol_list->onionskin;
-  ol_list->onionskin = NULL; /* prevent free. */
-  onion_pending_remove(ol_list->circ);
+  if (tv_mdiff(&ol_list->when_added, &now) >= ONIONQUEUE_OVERLOAD_MSEC)
+    next = ol_tail;
+  else
+    next = ol_list;
+  tor_assert(next->circ);
+  tor_assert(next->circ->p_conn); /* make sure it's still valid */
+  circ = next->circ;
+  *onionskin_out = next->onionskin;
+  next->onionskin = NULL; /* prevent free. */
+
+  waited = tv_mdiff(&next->when_added, &now);
+  if (waited < 0)
+    waited = 0;
+  ++ol_n_processed;
+  ol_total_wait_msec += waited;
+  if (waited > ol_max_wait_msec)
+    ol_max_wait_msec = waited;
+
+  onion_queue_entry_remove(next);
   return circ;
 }
 
@@ -115,38 +181,221 @@ onion_next_task(char **onionskin_out)
 void
 onion_pending_remove(or_circuit_t *circ)
 {
-  onion_queue_t *tmpo, *victim;
+  onion_queue_t *tmpo;
 
-  if (!ol_list)
-    return; /* nothing here. */
-
-  /* first check to see if it's the first entry */
-  tmpo = ol_list;
-  if (tmpo->circ == circ) {
-    /* it's the first one. remove it from the list. */
-    ol_list = tmpo->next;
-    if (!ol_list)
-      ol_tail = NULL;
-    ol_length--;
-    victim = tmpo;
-  } else { /* we need to hunt through the rest of the list */
-    for ( ;tmpo->next && tmpo->next->circ != circ; tmpo=tmpo->next) ;
-    if (!tmpo->next) {
-      log_debug(LD_GENERAL,get_lang_str(LANG_LOG_ONION_CIRC_NOT_IN_LIST),circ->p_circ_id);
-      return;
-    }
-    /* now we know tmpo->next->circ == circ */
-    victim = tmpo->next;
-    tmpo->next = victim->next;
-    if (ol_tail == victim)
-      ol_tail = tmpo;
-    ol_length--;
+  for (tmpo = ol_list; tmpo && tmpo->circ != circ; tmpo = tmpo->next) ;
+  if (!tmpo) {
+    log_debug(LD_GENERAL,get_lang_str(LANG_LOG_ONION_CIRC_NOT_IN_LIST),circ->p_circ_id);
+    return;
   }
+  onion_queue_entry_remove(tmpo);
+}
 
-  /* now victim points to the element that needs to be removed */
+/** Return a newly allocated string describing the onion queue: how long it
+ * is, and how long onionskins have waited on it. */
+char *
+onion_queue_get_stats(void)
+{
+  unsigned char *result = NULL;
+  struct timeval now;
+  long oldest = 0;
 
-  tor_free(victim->onionskin);
-  tor_free(victim);
+  if (ol_list) {
+    tor_gettimeofday(&now);
+    oldest = tv_mdiff(&ol_list->when_added, &now);
+  }
+  tor_asprintf(&result, "queued=%d oldest-msec=%ld processed="U64_FORMAT
+               " expired="U64_FORMAT" displaced="U64_FORMAT
+               " mean-wait-msec="U64_FORMAT" max-wait-msec=%ld",
+               ol_length, oldest, U64_PRINTF_ARG(ol_n_processed),
+               U64_PRINTF_ARG(ol_n_expired), U64_PRINTF_ARG(ol_n_displaced),
+               U64_PRINTF_ARG(ol_n_processed ?
+                              ol_total_wait_msec / ol_n_processed : 0),
+               ol_max_wait_msec);
+  return (char *)result;
+}
+
+/*----------------------------------------------------------------------*/
+
+/** The fewest circuit DH keypairs we try to keep precomputed. */
+#define DH_POOL_MIN_TARGET 4
+/** The most circuit DH keypairs we will keep precomputed. */
+#define DH_POOL_MAX_TARGET 64
+/** How many seconds of keypair demand do we measure before we resize the
+ * pool? */
+#define DH_POOL_ADJUST_INTERVAL 30
+
+/** Circuit DH keypairs whose public half is already generated, ready to be
+ * handed out by onion_dh_pool_get(). */
+static crypto_dh_env_t *dh_pool[DH_POOL_MAX_TARGET];
+/** How many entries of <b>dh_pool</b> are in use? */
+static int dh_pool_len = 0;
+/** How many keypairs should the pool thread keep in <b>dh_pool</b>? */
+static int dh_pool_target = DH_POOL_MIN_TARGET;
+/** How many keypairs were asked for since <b>dh_pool_period_start</b>? */
+static int dh_pool_n_taken = 0;
+/** When did we last resize the pool? */
+static time_t dh_pool_period_start = 0;
+/** How many keypairs did we hand out from the pool, and how many did we
+ * have to generate on the spot? */
+static uint64_t dh_pool_n_hits = 0, dh_pool_n_misses = 0;
+
+#ifdef USE_WIN32_THREADS
+/** Protects every dh_pool_* variable above. */
+static tor_mutex_t *dh_pool_mutex = NULL;
+/** Set when the pool wants refilling, or when the pool thread should
+ * exit. */
+static HANDLE dh_pool_wakeup = NULL;
+/** Set by the pool thread once it has exited. */
+static HANDLE dh_pool_exited = NULL;
+/** True iff the pool thread should exit. */
+static volatile int dh_pool_exiting = 0;
+
+/** Main loop of the pool thread: at low priority, generate keypairs until
+ * the pool holds dh_pool_target of them, then wait to be woken. */
+static void onion_dh_pool_main(void *arg)
+{	crypto_dh_env_t *dh;
+	(void)arg;
+	SetThreadPriority(GetCurrentThread(),THREAD_PRIORITY_LOWEST);
+	while(!dh_pool_exiting)
+	{	tor_mutex_acquire(dh_pool_mutex);
+		if(dh_pool_len >= dh_pool_target)
+		{	tor_mutex_release(dh_pool_mutex);
+			WaitForSingleObject(dh_pool_wakeup,INFINITE);
+			continue;
+		}
+		tor_mutex_release(dh_pool_mutex);
+		dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+		if(dh && crypto_dh_generate_public(dh) < 0)
+		{	crypto_dh_free(dh);
+			dh = NULL;
+		}
+		if(!dh)
+		{	/* Leave it to onion_dh_pool_get(), which will log the failure. */
+			WaitForSingleObject(dh_pool_wakeup,INFINITE);
+			continue;
+		}
+		tor_mutex_acquire(dh_pool_mutex);
+		if(dh_pool_len < dh_pool_target && !dh_pool_exiting)
+		{	dh_pool[dh_pool_len++] = dh;
+			dh = NULL;
+		}
+		tor_mutex_release(dh_pool_mutex);
+		if(dh)	crypto_dh_free(dh);
+	}
+	SetEvent(dh_pool_exited);
+	spawn_exit();
+}
+#endif
+
+/** Start the thread that keeps a pool of precomputed circuit DH keypairs,
+ * so that building or answering a circuit doesn't have to wait for a modular
+ * exponentiation.  Called once at startup. */
+void onion_dh_pool_init(void)
+{
+#ifdef USE_WIN32_THREADS
+	if(dh_pool_mutex)	return;
+	dh_pool_mutex = tor_mutex_new();
+	dh_pool_wakeup = CreateEvent(NULL,FALSE,FALSE,NULL);
+	dh_pool_exited = CreateEvent(NULL,FALSE,FALSE,NULL);
+	dh_pool_period_start = time(NULL);
+	dh_pool_exiting = 0;
+	if(!dh_pool_wakeup || !dh_pool_exited || spawn_func(onion_dh_pool_main,NULL) < 0)
+	{	if(dh_pool_wakeup)	CloseHandle(dh_pool_wakeup);
+		if(dh_pool_exited)	CloseHandle(dh_pool_exited);
+		dh_pool_wakeup = dh_pool_exited = NULL;
+		tor_mutex_free(dh_pool_mutex);
+		dh_pool_mutex = NULL;
+	}
+#endif
+}
+
+/** Return a circuit DH keypair whose public half is already generated: from
+ * the pool if it has one, else a fresh one.  Return NULL on failure.  Safe to
+ * call from any thread.
+ *
+ * Every DH_POOL_ADJUST_INTERVAL seconds, resize the pool toward the number of
+ * keypairs that were asked for in that time, so that it covers a burst of
+ * circuit builds without holding keys nobody needs; running dry doubles it
+ * at once. */
+crypto_dh_env_t *onion_dh_pool_get(void)
+{	crypto_dh_env_t *dh = NULL;
+#ifdef USE_WIN32_THREADS
+	time_t now;
+	int want_refill = 0;
+	if(dh_pool_mutex)
+	{	now = time(NULL);
+		tor_mutex_acquire(dh_pool_mutex);
+		++dh_pool_n_taken;
+		if(dh_pool_len)
+		{	dh = dh_pool[--dh_pool_len];
+			dh_pool[dh_pool_len] = NULL;
+			++dh_pool_n_hits;
+		}
+		else
+		{	++dh_pool_n_misses;
+			dh_pool_target = MIN(dh_pool_target * 2,DH_POOL_MAX_TARGET);
+		}
+		if(now - dh_pool_period_start >= DH_POOL_ADJUST_INTERVAL)
+		{	dh_pool_target = (dh_pool_target + dh_pool_n_taken) / 2;
+			if(dh_pool_target < DH_POOL_MIN_TARGET)	dh_pool_target = DH_POOL_MIN_TARGET;
+			else if(dh_pool_target > DH_POOL_MAX_TARGET)	dh_pool_target = DH_POOL_MAX_TARGET;
+			dh_pool_n_taken = 0;
+			dh_pool_period_start = now;
+		}
+		want_refill = dh_pool_len < dh_pool_target;
+		tor_mutex_release(dh_pool_mutex);
+		if(want_refill)	SetEvent(dh_pool_wakeup);
+		if(dh)	return dh;
+	}
+#endif
+	dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+	if(dh && crypto_dh_generate_public(dh) < 0)
+	{	crypto_dh_free(dh);
+		dh = NULL;
+	}
+	return dh;
+}
+
+/** Return a newly allocated string describing the DH keypair pool. */
+char *onion_dh_pool_get_stats(void)
+{	unsigned char *result = NULL;
+	int len = 0, target = 0;
+	uint64_t hits = 0, misses = 0;
+#ifdef USE_WIN32_THREADS
+	if(dh_pool_mutex)
+	{	tor_mutex_acquire(dh_pool_mutex);
+		len = dh_pool_len;
+		target = dh_pool_target;
+		hits = dh_pool_n_hits;
+		misses = dh_pool_n_misses;
+		tor_mutex_release(dh_pool_mutex);
+	}
+#endif
+	tor_asprintf(&result,"pooled=%d target=%d hits="U64_FORMAT" misses="U64_FORMAT,len,target,U64_PRINTF_ARG(hits),U64_PRINTF_ARG(misses));
+	return (char *)result;
+}
+
+/** Stop the pool thread and free every pooled keypair.  Called from
+ * tor_free_all. */
+void onion_dh_pool_free_all(void)
+{
+#ifdef USE_WIN32_THREADS
+	if(dh_pool_mutex)
+	{	dh_pool_exiting = 1;
+		SetEvent(dh_pool_wakeup);
+		WaitForSingleObject(dh_pool_exited,INFINITE);
+		CloseHandle(dh_pool_wakeup);
+		CloseHandle(dh_pool_exited);
+		dh_pool_wakeup = dh_pool_exited = NULL;
+		tor_mutex_free(dh_pool_mutex);
+		dh_pool_mutex = NULL;
+	}
+#endif
+	while(dh_pool_len)
+	{	crypto_dh_free(dh_pool[--dh_pool_len]);
+		dh_pool[dh_pool_len] = NULL;
+	}
 }
 
 /*----------------------------------------------------------------------*/
@@ -172,7 +421,7 @@ int onion_skin_create(crypto_pk_env_t *dest_router_key,crypto_dh_env_t **handsha
 	tor_assert(onion_skin_out);
 	*handshake_state_out = NULL;
 	memset(onion_skin_out, 0, ONIONSKIN_CHALLENGE_LEN);
-	if((dh = crypto_dh_new(DH_TYPE_CIRCUIT)))
+	if((dh = onion_dh_pool_get()))
 	{	dhbytes = crypto_dh_get_bytes(dh);
 		pkbytes = (int) crypto_pk_keysize(dest_router_key);
 		tor_assert(dhbytes == 128);
@@ -219,8 +468,8 @@ int onion_skin_server_handshake(const char *onion_skin,crypto_pk_env_t *private_
 	else if(len != DH_KEY_LEN)
 		log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_ONION_UNEXPECTED_ONIONSKIN_LENGTH),(long)len);
 	else
-	{	dh = crypto_dh_new(DH_TYPE_CIRCUIT);
-		if(crypto_dh_get_public(dh, handshake_reply_out, DH_KEY_LEN))
+	{	dh = onion_dh_pool_get();
+		if(!dh || crypto_dh_get_public(dh, handshake_reply_out, DH_KEY_LEN))
 			log_info(LD_GENERAL,get_lang_str(LANG_LOG_ONION_CRYPTO_DH_GET_PUBLIC_FAILED));
 		else
 		{	key_material_len = DIGEST_LEN+key_out_len;
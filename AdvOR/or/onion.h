@@ -15,6 +15,12 @@
 int onion_pending_add(or_circuit_t *circ, char *onionskin);
 or_circuit_t *onion_next_task(char **onionskin_out);
 void onion_pending_remove(or_circuit_t *circ);
+char *onion_queue_get_stats(void);
+
+void onion_dh_pool_init(void);
+crypto_dh_env_t *onion_dh_pool_get(void);
+char *onion_dh_pool_get_stats(void);
+void onion_dh_pool_free_all(void);
 
 int onion_skin_create(crypto_pk_env_t *router_key,
                       crypto_dh_env_t **handshake_state_out,
@@ -348,12 +348,16 @@ typedef enum {
 /** State for a transparent natd connection: waiting for original
  * destination. */
 #define AP_CONN_STATE_NATD_WAIT 12
-#define _AP_CONN_STATE_MAX 12
+/** State for a SOCKS connection: waiting for an asynchronous plugin to
+ * translate the destination address. */
+#define AP_CONN_STATE_PLUGIN_WAIT 13
+#define _AP_CONN_STATE_MAX 13
 
 /** True iff the AP_CONN_STATE_* value <b>s</b> means that the corresponding
  * edge connection is not attached to any circuit. */
 #define AP_CONN_STATE_IS_UNATTACHED(s) \
-  ((s) <= AP_CONN_STATE_CIRCUIT_WAIT || (s) == AP_CONN_STATE_NATD_WAIT)
+  ((s) <= AP_CONN_STATE_CIRCUIT_WAIT || (s) == AP_CONN_STATE_NATD_WAIT || \
+   (s) == AP_CONN_STATE_PLUGIN_WAIT)
 
 #define _DIR_CONN_STATE_MIN 1
 /** State for connection to directory server: waiting for connect(). */
@@ -429,7 +433,10 @@ typedef enum {
 /** A connection to a hidden service directory server: download a v2 rendezvous
  * descriptor. */
 #define DIR_PURPOSE_FETCH_RENDDESC_V2 18
-#define _DIR_PURPOSE_MAX 18
+/** A connection to a directory server: download one or more
+ * microdescriptors. */
+#define DIR_PURPOSE_FETCH_MICRODESC 19
+#define _DIR_PURPOSE_MAX 19
 
 /** True iff <b>p</b> is a purpose corresponding to uploading data to a
  * directory server. */
@@ -916,10 +923,30 @@ typedef struct var_cell_t {
 
 /** A cell as packed for writing to the network. */
 typedef struct packed_cell_t {
-  struct packed_cell_t *next; /**< Next cell queued on this circuit. */
   char body[CELL_NETWORK_SIZE]; /**< Cell as packed for network. */
+  /** Low 32 bits of perf_now_usec() when the cell was added to a circuit
+   * queue; wraps after about 71 minutes, which is longer than any cell
+   * should wait. */
+  uint32_t inserted_usec;
 } packed_cell_t;
 
+/** Number of buckets in a cell_wait_hist_t. */
+#define CELL_WAIT_HIST_BUCKETS 16
+/** Log2 of the upper bound of the first bucket of a cell_wait_hist_t. */
+#define CELL_WAIT_HIST_MIN_LOG2 6
+
+/** How long cells waited in a circuit queue before we wrote them to the
+ * connection's outbuf, in microseconds.  Bucket 0 counts waits below
+ * 2^CELL_WAIT_HIST_MIN_LOG2 usec, bucket i waits below
+ * 2^(CELL_WAIT_HIST_MIN_LOG2+i) usec, and the last bucket everything else
+ * (a second or more). */
+typedef struct cell_wait_hist_t {
+  uint32_t n; /**< How many cells did we flush? */
+  uint32_t max_usec; /**< Longest wait. */
+  uint64_t total_usec; /**< Sum of all waits. */
+  uint32_t buckets[CELL_WAIT_HIST_BUCKETS];
+} cell_wait_hist_t;
+
 /** Number of cells added to a circuit queue including their insertion
  * time on 10 millisecond detail; used for buffer statistics. */
 typedef struct insertion_time_elem_t {
@@ -936,14 +963,29 @@ typedef struct insertion_time_queue_t {
 } insertion_time_queue_t;
 
 /** A queue of cells on a circuit, waiting to be added to the
- * or_connection_t's outbuf. */
+ * or_connection_t's outbuf.  The cells are kept in a ring that grows as
+ * needed and is released whenever the queue empties. */
 typedef struct cell_queue_t {
-  packed_cell_t *head; /**< The first cell, or NULL if the queue is empty. */
-  packed_cell_t *tail; /**< The last cell, or NULL if the queue is empty. */
+  packed_cell_t *cells; /**< Ring of <b>capacity</b> cells, or NULL if the
+                         * queue has no storage. */
+  int capacity; /**< How many cells fit in <b>cells</b>? */
+  int head; /**< Index in <b>cells</b> of the first cell in the queue. */
   int n; /**< The number of cells in the queue. */
   insertion_time_queue_t *insertion_times; /**< Insertion times of cells. */
 } cell_queue_t;
 
+/** The outcome of crypting a relay cell ahead of time on a relay crypto
+ * worker; see relaycrypt.c. */
+typedef struct relay_precrypt_t {
+  struct circuit_t *circ; /**< Circuit whose cipher state was applied to the
+                           * cell, or NULL if the cell was left alone. */
+  int result; /**< -1 if the crypto failed, -2 if no hop of an origin
+               * circuit recognized the cell, else 0. */
+  char recognized; /**< True iff the cell's digest says it is for us. */
+  /** For origin circuits, the hop that recognized the cell. */
+  struct crypt_path_t *layer_hint;
+} relay_precrypt_t;
+
 /** Beginning of a RELAY cell payload. */
 typedef struct {
   uint8_t command; /**< The end-to-end relay command. */
@@ -1028,10 +1070,26 @@ typedef struct connection_t {
 
   /** CONNECT/SOCKS proxy client handshake state (for outgoing connections). */
   unsigned int proxy_state;
+  /** NTLM response prepared for a pooled corporate proxy connection; sent
+   * with our first CONNECT request instead of restarting the handshake. */
+  char *proxy_auth;
 
   /** Our socket; -1 if this connection is closed, or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  /** Entry in the map from global_identifier to connections in the connection
+   * array. */
+  OAHT_ENTRY(connection_t) id_node;
+  /** Next and previous connections of the same type in the connection
+   * array. */
+  struct connection_t *next_of_type, *prev_of_type;
+  /** When should run_connection_housekeeping() look at this connection? */
+  time_t housekeeping_at;
+  /** Slot of the housekeeping timer wheel that holds this connection, or -1
+   * if it isn't in the wheel. */
+  int housekeeping_slot;
+  /** Next and previous connections in the same slot of the wheel. */
+  struct connection_t *housekeeping_next, *housekeeping_prev;
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
   int processed_from_inbuf;
@@ -1082,6 +1140,20 @@ typedef struct connection_t {
   DWORD lParam[MAX_PLUGIN_CONNECTION_PARAMS];
 
   DWORD pid;
+  /** 1 + index of the ProcessBandwidthClass of <b>pid</b>, or 0 for none;
+   * only valid if <b>bw_class_generation</b> is the current generation of
+   * the classes. */
+  int bw_class;
+  int bw_class_generation;
+  /** Plugins that see the traffic of this connection, in plugin order; only
+   * valid if <b>traffic_plugins_generation</b> is the current generation of
+   * the plugin list. */
+  struct plugin_info_t **traffic_plugins;
+  int n_traffic_plugins;
+  int traffic_plugins_generation;
+  /** The state of this connection that was last recorded for
+   * plugin_get_connection_changes(). */
+  uint8_t plugin_reported_state;
   HANDLE hPlugin;
   DWORD exclKey;
   HTREEITEM hItem;
@@ -1103,6 +1175,10 @@ typedef struct or_handshake_state_t {
   unsigned int received_versions : 1;
 } or_handshake_state_t;
 
+/** How many rings of active circuits does an OR connection keep when it
+ * schedules circuits with EWMA buckets?  Must be a multiple of 32. */
+#define CELL_EWMA_N_BUCKETS 96
+
 /** Subtype of connection_t for an "OR connection" -- that is, one that speaks
  * cells over TLS. */
 typedef struct or_connection_t {
@@ -1148,12 +1224,36 @@ typedef struct or_connection_t {
   circid_t next_circ_id; /**< Which circ_id do we try to use next on
                           * this connection?  This is always in the
                           * range 0..1<<15-1. */
+  /** Which circ_ids in our half of the ID space are used on this connection,
+   * indexed without the high bit? NULL until we first pick one here. */
+  bitarray_t *circ_ids_used;
 
   or_handshake_state_t *handshake_state; /**< If we are setting this connection
                                           * up, state information to do so. */
   time_t timestamp_lastempty; /**< When was the outbuf last completely empty?*/
   time_t timestamp_last_added_nonpadding; /** When did we last add a
                                            * non-padding cell to the outbuf? */
+  time_t tls_last_flushed; /**< When did we last write bytes to the TLS
+                            * connection? */
+  /** How many bytes we wrote to the TLS connection since it was last idle;
+   * see connection_or_tls_record_size(). */
+  size_t tls_ramp_bytes;
+
+  /** When did we start the TCP connect or the TLS handshake that we time to
+   * estimate rtt_msec? */
+  struct timeval rtt_probe_started;
+  int rtt_msec; /**< Rough round trip time to the other side of this
+                 * connection in milliseconds, or 0 if we don't know. */
+  /** Socket buffer sizes that connection_or_tune_socket_buffers() set, or
+   * 0 while they are the system's. */
+  int sndbuf_size, rcvbuf_size;
+  /** Bytes read and written since connection_or_tune_socket_buffers() last
+   * looked at this connection. */
+  uint64_t tune_bytes_read, tune_bytes_written;
+  /** Bytes read and written lately, halved every second since
+   * <b>recent_bytes_at</b>; see connection_or_note_traffic(). */
+  uint32_t recent_bytes;
+  time_t recent_bytes_at; /**< When did we last update recent_bytes? */
 
   /* bandwidth* and read_bucket only used by ORs in OPEN state: */
   int bandwidthrate; /**< Bytes/s added to the bucket. (OPEN ORs only.) */
@@ -1180,10 +1280,32 @@ typedef struct or_connection_t {
   /** The tick on which the cell_ewma_ts in active_circuit_pqueue last had
    * their ewma values rescaled. */
   unsigned active_circuit_pqueue_last_recalibrated;
+  /** True iff the cell_ewma_ts of the active circuits on this connection are
+   * kept in ewma_buckets instead of active_circuit_pqueue.  Only changes
+   * while the connection has no active circuits. */
+  unsigned int ewma_use_buckets : 1;
+  /** Rings of cell_ewma_t for circuits with queued cells, indexed by the
+   * binary logarithm of their priority-adjusted cell counts. */
+  struct cell_ewma_t *ewma_buckets[CELL_EWMA_N_BUCKETS];
+  /** One bit for each nonempty ring in ewma_buckets. */
+  uint32_t ewma_bucket_map[CELL_EWMA_N_BUCKETS/32];
+  /** How long the cells that we wrote to this connection waited in the
+   * queues of its circuits. */
+  cell_wait_hist_t cell_wait;
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
 } or_connection_t;
 
+/** Stages of a stream's setup that we timestamp when StreamTracing is set. */
+typedef enum stream_trace_stage_t {
+  STREAM_TRACE_ACCEPTED, /**< The SOCKS or HTTP request was parsed. */
+  STREAM_TRACE_CIRC_CHOSEN, /**< The stream was attached to a circuit. */
+  STREAM_TRACE_BEGIN_SENT, /**< We sent the BEGIN cell. */
+  STREAM_TRACE_CONNECTED, /**< We got the CONNECTED cell. */
+  STREAM_TRACE_FIRST_BYTE, /**< We delivered the first byte of data. */
+  STREAM_TRACE_N_STAGES
+} stream_trace_stage_t;
+
 /** Subtype of connection_t for an "edge connection" -- that is, a socks (ap)
  * connection, or an exit. */
 typedef struct edge_connection_t {
@@ -1196,6 +1318,34 @@ typedef struct edge_connection_t {
   int package_window; /**< How many more relay cells can I send into the
                        * circuit? */
   int deliver_window; /**< How many more relay cells can end at me? */
+  /** How many bytes this stream may still package in the current deficit
+   * round robin pass over its circuit's streams. */
+  int package_deficit;
+  /** True iff this stream had been idle when its circuit last resumed its
+   * streams: it gets InteractiveStreamBoost times the usual quantum. */
+  unsigned int package_interactive:1;
+  time_t last_packaged_at; /**< When did we last package a cell from this
+                            * stream? */
+  /** True iff this stream is holding back a partial cell until more data
+   * arrives or StreamCoalesceDelay runs out. */
+  unsigned int coalesce_pending:1;
+  /** True iff this AP stream is on the list of the streams that wait for a
+   * circuit to open. */
+  unsigned int pending_circ:1;
+  /** Index of this AP stream in the queue of connection_ap_expire_beginning(),
+   * or -1 if it isn't there. */
+  int expiry_idx;
+  /** When connection_ap_expire_beginning() looks at this AP stream again. */
+  time_t expiry_at;
+  /** True iff the loopback exit of __LoopbackExit answers this stream. */
+  unsigned int loopback_exit:1;
+  /** How many bytes of the response body that the loopback exit sends on
+   * this stream are still to come. */
+  uint32_t loopback_remaining;
+  /** The other end of a stream to one of our own hidden services, which
+   * rend_local_attach() connected without a rendezvous: the exit
+   * connection of an AP stream, or the AP stream of an exit connection. */
+  struct edge_connection_t *local_peer;
 
   /** Nickname of planned exit node -- used with .exit support. */
   char *chosen_exit_name;
@@ -1237,6 +1387,12 @@ typedef struct edge_connection_t {
 
   /** True iff this connection is for a dns request only. */
   unsigned int is_dns_request:1;
+  /** True iff this dns request only refreshes an entry of the client DNS
+   * cache, and nobody is waiting for its answer. */
+  unsigned int is_dns_prefetch:1;
+  /** True iff this stream was already counted as demand for the preemptive
+   * circuits of its isolation key. */
+  unsigned int isolation_demand_noted:1;
 
   /** True iff this stream must attach to a one-hop circuit (e.g. for
    * begin_dir). */
@@ -1269,6 +1425,41 @@ typedef struct edge_connection_t {
    * request that we're going to try to answer.  */
   struct evdns_server_request *dns_server_request;
 
+  /** For AP connections only. True iff the plugins that translate addresses
+   * asynchronously already saw this stream. */
+  unsigned int plugin_remap_done:1;
+
+  /** For AP connections only. True iff we may send data before the exit
+   * has answered our BEGIN cell. */
+  unsigned int may_use_optimistic_data:1;
+  /** For AP connections only. The data that we sent before getting a
+   * CONNECTED cell, kept in case we have to retry the stream elsewhere. */
+  buf_t *pending_optimistic_data;
+  /** For AP connections only. Data from <b>pending_optimistic_data</b> that
+   * has to be sent again, before anything on the inbuf. */
+  buf_t *sending_optimistic_data;
+
+  /** For AP connections only. If we sent a resolve that identical requests
+   * can wait for, the key of this resolve in the pending resolves map. */
+  char *resolve_key;
+  /** For AP connections only. The AP connections waiting for the answer to
+   * our resolve request, or NULL. */
+  smartlist_t *resolve_followers;
+  /** For AP connections only. The AP connection whose resolve we are waiting
+   * for instead of sending our own, or NULL. */
+  struct edge_connection_t *resolve_leader;
+  /** For AP connections only. The exclKey that this connection had before
+   * we sent its resolve request. */
+  DWORD resolve_exclKey;
+
+  /** For AP connections only, if StreamTracing was set when the request
+   * arrived. When each stage of the stream's setup happened, from
+   * perf_now_usec(), or 0 if it didn't happen yet. */
+  uint64_t trace_stamps[STREAM_TRACE_N_STAGES];
+  /** For traced AP connections. Microseconds spent in the HTTP proxy
+   * filters for this stream before its first byte was delivered. */
+  uint64_t trace_filter_usec;
+
 } edge_connection_t;
 
 /** Subtype of connection_t for an "directory connection" -- that is, an HTTP
@@ -1281,6 +1472,9 @@ typedef struct dir_connection_t {
   char *orig_request;
   int orig_request_len;
   unsigned int dirconn_direct:1; /**< Is this dirconn direct, or via Tor? */
+  /** Have we already asked another mirror for the descriptors we are
+   * downloading on this connection? */
+  unsigned int straggler_reissued:1;
 
   /* Used only for server sides of some dir connections, to implement
    * "spooling" of directory material to the outbuf.  Otherwise, we'd have
@@ -1301,9 +1495,29 @@ typedef struct dir_connection_t {
   struct cached_dir_t *cached_dir;
   /** The current offset into cached_dir. */
   off_t cached_dir_offset;
-  /** The zlib object doing on-the-fly compression for spooled data. */
+  /** Are we sending cached_dir uncompressed, from its dir rather than from
+   * its dir_z? */
+  unsigned int cached_dir_plain:1;
+  /** The zlib object doing on-the-fly compression for spooled data, or, on
+   * the client side, uncompressing a download as it arrives. */
   tor_zlib_state_t *zlib_state;
 
+  /* Used only for client sides of large downloads, which we take apart as
+   * they arrive rather than once the whole response is in the inbuf. */
+  /** The headers of the response, once we have taken them off the inbuf. */
+  char *stream_headers;
+  /** The part of the body we have uncompressed but not yet parsed. */
+  char *stream_body;
+  size_t stream_body_len; /**< How many bytes of stream_body are used? */
+  size_t stream_body_alloc; /**< How many bytes are allocated for it? */
+  size_t stream_in_len; /**< How many bytes of the body have arrived? */
+  /** The descriptors we asked for and haven't parsed yet, if we parse them
+   * as they arrive. */
+  smartlist_t *stream_which;
+  int stream_status; /**< The HTTP status code of the response. */
+  /** Is the body of the response compressed? */
+  unsigned int stream_compressed:1;
+
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
 
@@ -1338,6 +1552,11 @@ typedef struct control_connection_t {
   /** A control command that we're reading from the inbuf, but which has not
    * yet arrived completely. */
   char *incoming_cmd;
+
+  /** The answers of a GETINFO command that are still being added to the
+   * outbuf as it drains, or NULL. We don't read more commands until it is
+   * done. */
+  struct getinfo_spool_t *getinfo_spool;
 } control_connection_t;
 
 /** Cast a connection_t subtype pointer to a connection_t **/
@@ -1405,6 +1624,10 @@ typedef struct addr_policy_t
   uint32_t hash;
 } addr_policy_t;
 
+/** An exit policy compiled for fast lookups; see
+ * router_compare_addr_to_exit_policy(). */
+typedef struct compiled_policy_t compiled_policy_t;
+
 /** A cached_dir_t represents a cacheable directory object, along with its
  * compressed form. */
 typedef struct cached_dir_t {
@@ -1516,6 +1739,9 @@ typedef struct signed_descriptor_t {
 /** A signed integer representing a country code. */
 typedef int16_t country_t;
 
+/** How many ASes we remember for each router in routerinfo_t.as_set. */
+#define ROUTER_AS_SET_SIZE 4
+
 /** Information about another onion router in the network. */
 typedef struct {
   signed_descriptor_t cache_info;
@@ -1541,6 +1767,10 @@ typedef struct {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit?  NULL for 'reject *:*'. */
+  /** <b>exit_policy</b> compiled by router_compare_addr_to_exit_policy(),
+   * or shared with other routers by router_intern_exit_policy(); NULL if
+   * we haven't needed it yet. */
+  compiled_policy_t *compiled_exit_policy;
   long uptime; /**< How many seconds the router claims to have been up */
   time_t estimated_start;
   smartlist_t *declared_family; /**< Nicknames of router which this router
@@ -1580,6 +1810,10 @@ typedef struct {
   /** True if, after we have added this router, we should re-launch
    * tests for it. */
   unsigned int needs_retest_if_added:1;
+  /** True iff we built this router from its consensus entry and its
+   * microdescriptor instead of downloading its descriptor.  Such a router
+   * has no descriptor body and no identity key. */
+  unsigned int from_microdesc:1;
 
 /** Tor can use this router for general positions in circuits. */
 #define ROUTER_PURPOSE_GENERAL 0
@@ -1603,6 +1837,11 @@ typedef struct {
   uint32_t router_id;
 
   country_t country;
+  /** Number of used entries in <b>as_set</b>. */
+  uint8_t as_set_len;
+  /** The AS of this router and the ASes right above it on its estimated
+   * AS paths; see geoip_get_as_set(). */
+  uint32_t as_set[ROUTER_AS_SET_SIZE];
 } routerinfo_t;
 
 typedef struct router_info_t
@@ -1721,6 +1960,11 @@ typedef struct routerstatus_t {
                        * the vote/consensus, in kilobytes/sec. */
   char *exitsummary; /**< exit policy summary -
                       * XXX weasel: this probably should not stay a string. */
+  /** SHA256 digest of the router's microdescriptor, from the "m" line of a
+   * microdesc-flavored consensus. */
+  char microdesc_digest[DIGEST256_LEN];
+  unsigned int has_microdesc_digest:1; /**< True iff microdesc_digest is
+                                        * set. */
 
   /* ---- The fields below aren't derived from the networkstatus; they
    * hold local information only. */
@@ -1905,7 +2149,7 @@ typedef enum {
 } consensus_flavor_t;
 
 /** Which consensus flavor do we actually want to use to build circuits? */
-#define USABLE_CONSENSUS_FLAVOR FLAV_NS
+#define USABLE_CONSENSUS_FLAVOR (networkstatus_usable_flavor())
 
 /** How many different consensus flavors are there? */
 #define N_CONSENSUS_FLAVORS ((int)(FLAV_MICRODESC)+1)
@@ -1950,6 +2194,10 @@ typedef struct networkstatus_t {
    * consensus. */
   smartlist_t *weight_params;
 
+  /** The values in net_params and weight_params by name, parsed the first
+   * time we need one. */
+  struct networkstatus_param_cache_t *param_cache;
+
   /** List of networkstatus_voter_info_t.  For a vote, only one element
    * is included.  For a consensus, one element is included for every voter
    * whose vote contributed to the consensus. */
@@ -1959,6 +2207,11 @@ typedef struct networkstatus_t {
 
   /** Digest of this document, as signed. */
   digests_t digests;
+  /** Consensus only: SHA3-256 digest of this document, as signed.  This is
+   * how we name the consensus when we ask for a diff from it. */
+  char digest_sha3_as_signed[DIGEST256_LEN];
+  /** True iff digest_sha3_as_signed is set. */
+  unsigned int has_digest_sha3_as_signed : 1;
 
   /** List of router statuses, sorted by identity digest.  For a vote,
    * the elements are vote_routerstatus_t; for a consensus, the elements
@@ -1968,6 +2221,9 @@ typedef struct networkstatus_t {
   /** If present, a map from descriptor digest to elements of
    * routerstatus_list. */
   digestmap_t *desc_digest_map;
+  /** If present, a map from identity digest to one more than the index of
+   * the element of routerstatus_list with that identity. */
+  digestmap_t *identity_map;
 } networkstatus_t;
 
 /** A set of signatures for a networkstatus consensus.  All fields are as for
@@ -2021,6 +2277,9 @@ typedef struct {
   struct digest_sd_map_t *desc_digest_map;
   /** Map from server identity digest to a member of routers. */
   struct digest_ri_map_t *identity_map;
+  /** Map from lowercased nickname to a smartlist of the members of routers
+   * that have that nickname. */
+  strmap_t *nickname_map;
   /** Map from extra-info digest to an extrainfo_t.  Only exists for
    * routers in routers or old_routers. */
   struct digest_ei_map_t *extra_info_map;
@@ -2177,6 +2436,9 @@ typedef struct {
    * These are for encrypted connections that exit to this router, not
    * for arbitrary exits from the circuit. */
   int onehop_tunnel;
+  /** Was the first hop picked from our entry guards? If so, it may be
+   * swapped for another guard that we're connected to already. */
+  unsigned int first_hop_is_guard : 1;
   /** The crypt_path_t to append after rendezvous: used for rendezvous. */
   crypt_path_t *pending_final_cpath;
   /** How many times has building a circuit for this task failed? */
@@ -2191,7 +2453,7 @@ typedef struct {
  * average) of the number of cells flushed from the circuit queue onto a
  * connection in connection_or_flush_from_first_active_circuit().
  */
-typedef struct {
+typedef struct cell_ewma_t {
   /** The last 'tick' at which we recalibrated cell_count.
    *
    * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
@@ -2204,8 +2466,11 @@ typedef struct {
    * connection. */
   unsigned int is_for_p_conn : 1;
   /** The position of the circuit within the OR connection's priority
-   * queue. */
+   * queue, or the index of its ring in the connection's ewma_buckets; -1 if
+   * it is in neither. */
   int heap_index;
+  /** Next and previous cell_ewma_t in the same ring of ewma_buckets. */
+  struct cell_ewma_t *bucket_next, *bucket_prev;
 } cell_ewma_t;
 
 #define ORIGIN_CIRCUIT_MAGIC 0x35315243u
@@ -2297,6 +2562,10 @@ typedef struct circuit_t {
                                       * circuit marked for close? */
   DWORD exclKey;
   HTREEITEM hItem;
+  /** Which parts of this circuit's tree node still have to be updated by the
+   * GUI thread; a bitmask of TREE_PENDING_* flags. */
+  uint8_t tree_pending;
+  char *tree_label; /**< Cached text of this circuit's tree node. */
   int priority;
 
   /** Next circuit in the doubly-linked ring of circuits waiting to add
@@ -2315,6 +2584,18 @@ typedef struct circuit_t {
    * n_conn_cells queue.  Used to determine which circuit to flush from next.
    */
   cell_ewma_t n_cell_ewma;
+
+  /** How long the cells of this circuit waited in n_conn_cells and
+   * p_conn_cells before we wrote them to a connection. */
+  cell_wait_hist_t cell_wait;
+
+  /** Map from stream ID to the streams on this circuit, built once it carries
+   * enough streams that relay_lookup_conn() would be slow; or NULL. */
+  struct stream_index_t *stream_index;
+
+  /** Next and previous circuits with the same purpose as this one; see
+   * circuit_get_first_by_purpose(). */
+  struct circuit_t *next_by_purpose, *prev_by_purpose;
 } circuit_t;
 
 /** Largest number of relay_early cells that we can send on a given
@@ -2354,6 +2635,14 @@ typedef struct origin_circuit_t {
    * cannibalized circuits. */
   unsigned int has_opened : 1;
 
+  /** Set if this circuit was built ahead for the next identity. No stream
+   * may use it until the identity changes. */
+  unsigned int is_next_identity : 1;
+
+  /** One more than the index of the cannibalization bucket that lists this
+   * circuit, or 0 if it isn't listed. */
+  unsigned int cannibalize_bucket : 4;
+
   /** What commands were sent over this circuit that decremented the
    * RELAY_EARLY counter? This is for debugging task 878. */
   uint8_t relay_early_commands[MAX_RELAY_EARLY_CELLS_PER_CIRCUIT];
@@ -2365,6 +2654,9 @@ typedef struct origin_circuit_t {
   /** The next stream_id that will be tried when we're attempting to
    * construct a new AP stream originating at this circuit. */
   streamid_t next_stream_id;
+  /** How many stream_ids have we handed out on this circuit? Until they wrap
+   * around, the next one can't be used by an attached stream. */
+  uint32_t n_stream_ids_issued;
 
   /* The intro key replaces the hidden service's public key if purpose is
    * S_ESTABLISH_INTRO or S_INTRO, provided that no unversioned rendezvous
@@ -2493,6 +2785,11 @@ typedef enum invalid_router_usage_t {
 #define MIN_CONSTRAINED_TCP_BUFFER 0
 #define MAX_CONSTRAINED_TCP_BUFFER 1024*1024  /* 256k */
 
+/** How many recent build times do we keep for each entry guard? */
+#define ENTRY_GUARD_BUILD_TIMES 20
+/** How many of them do we need before a guard gets its own build timeout? */
+#define ENTRY_GUARD_MIN_BUILD_TIMES 10
+
 /** An entry_guard_t represents our information about a chosen long-term
  * first hop, known as a "helper" node in the literature. We can't just
  * use a routerinfo_t, since we want to remember these even when we
@@ -2516,6 +2813,19 @@ typedef struct {
                              * connect to it. */
   time_t last_attempted; /**< 0 if we can connect to this guard, or the time
                           * at which we last failed to connect to it. */
+  /** Circular array of the latest circuit build times through this guard, in
+   * milliseconds. */
+  uint32_t build_times[ENTRY_GUARD_BUILD_TIMES];
+  uint8_t build_times_idx; /**< Next slot to fill in build_times. */
+  uint8_t n_build_times; /**< How many slots of build_times are filled? */
+  unsigned int probing : 1; /**< Did entry_guards_probe_unreachable() open a
+                             * connection to this guard that didn't end
+                             * yet? */
+  time_t probe_started; /**< When did we open that connection? */
+  time_t next_probe; /**< When may entry_guards_probe_unreachable() try this
+                      * unreachable guard again? 0 if it didn't try yet. */
+  int probe_interval; /**< Seconds between two probes of this guard; doubles
+                       * after each probe. */
 } entry_guard_t;
 
 
@@ -2555,6 +2865,8 @@ typedef struct {
   char *Nickname; /**< OR only: nickname of this onion router. */
   char *Address; /**< OR only: configured address for this onion router. */
   char *PidFile; /**< Where to store PID of Tor process. */
+  smartlist_t *PinnedHiddenServices; /**< Hidden services whose descriptors
+                                      * we keep fresh in the background. */
 
   routerset_t *ExitNodes; /**< Structure containing nicknames, digests,
                            * country codes and IP address patterns of ORs to
@@ -2607,6 +2919,9 @@ typedef struct {
   config_line_t *DebugFilter;
   config_line_t *BannedHosts;
   config_line_t *QuickStart;
+  config_line_t *ProcessBandwidthClass; /**< Bandwidth limits and round-robin
+                                         * weights for the connections of
+                                         * intercepted processes. */
   config_line_t *SynchronizeExit;
   config_line_t *Plugins;
   config_line_t *PluginOptions;
@@ -2627,6 +2942,8 @@ typedef struct {
   int TransPort;
   int NatdPort; /**< Port to listen on for transparent natd connections. */
   int ControlPort; /**< Port to listen on for control connections. */
+  /** How many seconds of traffic each BW and STREAM_BW event reports. */
+  int ControlBandwidthEventInterval;
   config_line_t *ControlSocket; /**< List of Unix Domain Sockets to listen on
                                  * for control connections. */
   int ControlSocketsGroupWritable; /**< Boolean: Are control sockets g+rw? */
@@ -2691,6 +3008,17 @@ typedef struct {
   int MinUptimeHidServDirectoryV2; /**< As directory authority, accept hidden
                                     * service directories after what time? */
   int FetchUselessDescriptors; /**< Do we fetch non-running descriptors too? */
+  /** Boolean: as a client, use the microdesc consensus and microdescriptors
+   * instead of the full consensus and router descriptors. */
+  int UseMicrodescriptors;
+  /** Boolean: when loading cached-descriptors as a client, skip the
+   * descriptors that the consensus doesn't list instead of parsing them. */
+  int LazyDescriptorLoading;
+  /** How many superseded descriptors we keep for each router; 0 for the
+   * default. */
+  int MaxOldDescriptorsPerRouter;
+  /** If nonzero, how many bytes of superseded descriptors we keep, at most. */
+  uint64_t MaxOldDescriptorBytes;
   int AllDirActionsPrivate; /**< Should every directory action be sent
                              * through a Tor circuit? */
 
@@ -2703,6 +3031,15 @@ typedef struct {
 
   int ConstrainedSockets; /**< Shrink xmit and recv socket buffers. */
   uint64_t ConstrainedSockSize; /**< Size of constrained buffers. */
+  /** Size the socket buffers of OR connections by their bandwidth-delay
+   * product? */
+  int AutoTuneSocketBuffers;
+  /** How much memory may the socket buffers that AutoTuneSocketBuffers sets
+   * take in all? */
+  uint64_t MaxSocketBufferMemory;
+  /** If nonzero, how many bytes may our buffers, cell queues and caches take
+   * before memgov_check() starts freeing memory? */
+  uint64_t MaxMemInUse;
 
   /** Whether we should drop exit streams from Tors that we don't know are
    * relays.  One of "0" (never refuse), "1" (always refuse), or "auto" (do
@@ -2739,8 +3076,24 @@ typedef struct {
                        * descriptor? Remember to publish them independently. */
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
+  int InteractiveStreamBoost; /**< How many times the package share of a busy
+                               * stream does a stream that had been idle get
+                               * on the same circuit? */
+  int WarmNextIdentity; /**< How many exit circuits do we build ahead for the
+                         * next identity? */
+  int IsolatedPreemptiveCircuits; /**< How many clean circuits do we keep for
+                                   * each recently active isolation key? */
+  int StreamCoalesceDelay; /**< How many milliseconds does a busy stream's
+                            * partial cell wait for more data? 0 for none. */
+  int StreamTracing; /**< Boolean: do we time the stages of stream setup? */
   int SocksTimeout; /**< How long do we let a socks connection wait
                      * unattached before we fail it? */
+  int RaceCircuitBuilds; /**< If true, a stream that needs a new circuit
+                         * launches two with disjoint middles and exits, and
+                         * takes whichever opens first. */
+  int RendParallelIntro; /**< If true, we send our introduction to a hidden
+                         * service through two introduction points at once
+                         * and keep whichever acknowledges it first. */
   int LearnCircuitBuildTimeout; /**< If non-zero, we attempt to learn a value
                                  * for CircuitBuildTimeout based on timeout
                                  * history */
@@ -2759,6 +3112,11 @@ typedef struct {
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
                                 this interval ago. */
+  int MaxAddressMappings; /**< Drop the least recently used transient
+                           * address mappings above this many. */
+  int MainLoopStallThreshold; /**< Log the stack of the tor thread when its
+                               * event loop doesn't run for this many
+                               * milliseconds; 0 means never. */
   uint64_t BandwidthRate; /**< How much bandwidth, on average, are we willing
                            * to use in a second? */
   uint64_t BandwidthBurst; /**< How much bandwidth, at maximum, are we willing
@@ -2771,14 +3129,21 @@ typedef struct {
                                  * use in a second for all relayed conns? */
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
+  int TokenBucketRefillInterval; /**< How many milliseconds between two
+                                  * refills of the bandwidth buckets? */
   uint64_t CircuitBandwidthRate;
-  int NumCpus; /**< How many CPUs should we try to use? */
+  int NumCpus; /**< How many CPUs should we try to use?  0 means as many
+                * as the machine has. */
+  int RelayCryptoThreads; /**< How many threads should crypt relayed cells
+                           * besides the main thread? 0 for none. */
   int RunTesting; /**< If true, create testing circuits to measure how well the
                    * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   config_line_t *HidServAuth; /**< List of configuration lines for client-side
                                * authorizations for hidden services */
+  int HidServLocalShortcut; /**< Boolean: connect streams to our own hidden
+                             * services without a rendezvous? */
   char *ContactInfo; /**< Contact info to be published in the directory. */
 
   char *DirProxy; /**< hostname[:port] to use as http proxy, if any. */
@@ -2799,6 +3164,7 @@ typedef struct {
   char *CorporateProxyDomain; /**< username:password string, if any. */
   char *CorporateProxyAuthenticator; /**< username:password string, if any. */
   int CorporateProxyProtocol;
+  int CorporateProxyPoolSize; /**< How many NTLM-authenticated proxy connections we keep ready. */
 
   /** List of configuration lines for replacement directory authorities.
    * If you just want to replace one class of authority at a time,
@@ -2855,6 +3221,10 @@ typedef struct {
   uint64_t AccountingMax; /**< How many bytes do we allow per accounting
                            * interval before hibernation?  0 for "never
                            * hibernate." */
+  /** If true, limit our bandwidth so that AccountingMax lasts until the
+   * end of the accounting interval, instead of hibernating when we run
+   * out of it. */
+  int AccountingPacing;
 
   /** Base64-encoded hash of accepted passwords for the control system. */
   config_line_t *HashedControlPassword;
@@ -2868,6 +3238,9 @@ typedef struct {
   int LeaveStreamsUnattached; /**< Boolean: Does Tor attach new streams to
                           * circuits itself (0), or does it expect a controller
                           * to cope? (1) */
+  int LoopbackExit; /**< Boolean: answer streams with the fake exit of
+                     * loopexit.c instead of attaching them to circuits?
+                     * For load tests only. */
   int DisablePredictedCircuits; /**< Boolean: does Tor preemptively
                                  * make circuits in the background (0),
                                  * or not (1)? */
@@ -2890,6 +3263,8 @@ typedef struct {
 
   int SafeSocks; /**< Boolean: should we outright refuse application
                   * connections that use socks4 or socks5-with-local-dns? */
+  int OptimisticData; /**< Boolean: should we send stream data before the
+                       * exit has answered our BEGIN cell? */
 #define LOG_PROTOCOL_WARN (get_options()->ProtocolWarnings ? \
                            LOG_WARN : LOG_INFO)
   int ProtocolWarnings; /**< Boolean: when other parties screw up the Tor
@@ -2901,6 +3276,8 @@ typedef struct {
   int UseEntryGuards; /**< Boolean: Do we try to enter from a smallish number
                        * of fixed nodes? */
   int NumEntryGuards; /**< How many entry guards do we try to establish? */
+  /** How many open connections do we keep to our first entry guard? */
+  int PrimaryGuardConnections;
   int RephistTrackTime; /**< How many seconds do we keep rephist info? */
   int FastFirstHopPK; /**< If Tor believes it is safe, should we save a third
                        * of our PK time by sending CREATE_FAST cells? */
@@ -2928,6 +3305,10 @@ typedef struct {
                                  * hijacking. */
   int ServerDNSRandomizeCase; /**< Boolean: Use the 0x20-hack to prevent
                                * DNS poisoning attacks. */
+  uint64_t ServerDNSMaxCacheSize; /**< Drop the least recently used DNS
+                                   * answers above this many bytes. */
+  int ServerDNSNegativeTTL; /**< Never cache a failed resolve for longer than
+                             * this many seconds; 0 for no limit. */
   char *ServerDNSResolvConfFile; /**< If provided, we configure our internal
                      * resolver from the file here rather than from
                      * /etc/resolv.conf (Unix) or the registry (Windows). */
@@ -2985,6 +3366,10 @@ typedef struct {
   /** If true, the user wants us to collect statistics as entry node. */
   int EntryStatistics;
 
+  /** If true, count unique clients in our statistics with a map of their
+   * addresses rather than with estimating sketches. */
+  int GeoIPExactClientCounts;
+
   /** If true, include statistics file contents in extra-info documents. */
   int ExtraInfoStatistics;
 
@@ -3060,6 +3445,11 @@ typedef struct {
   char *GeoIPFile;
   int logging;
   int Logging;
+  smartlist_t *LogDomains; /**< Logging domains to log; empty for all. */
+  int AsyncLogging; /**< Boolean: write log messages from a separate thread. */
+  char *AsyncLogOverflow; /**< "DropOldest" or "DropNewest": what to do when
+                           * the async log queue is full. */
+  int AsyncLogQueueSize; /**< How many messages the async log queue holds. */
   int ForceFlags;
   int DirFlags;
   int IdentityFlags;
@@ -3096,6 +3486,10 @@ typedef struct {
    */
   double CircuitPriorityHalflife;
 
+  /** If true, OR connections order their active circuits with logarithmic
+   * buckets of cell counts instead of a priority queue. */
+  int CircuitPriorityBuckets;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -3159,6 +3553,10 @@ typedef struct {
   smartlist_t *BWHistoryDirWriteValues;
   smartlist_t *BWHistoryDirWriteMaxima;
 
+  /** The ports that we predicted our streams would use when we wrote the
+   * state; see rep_hist_get_predicted_ports(). */
+  smartlist_t *PredictedPorts;
+
   /** Build time histogram */
   config_line_t * BuildtimeHistogram;
   unsigned int TotalBuildTimes;
@@ -3360,6 +3758,22 @@ typedef struct {
   double timeout_ms;
   /** How long we wait before actually closing the circuit. */
   double close_ms;
+  /** Histogram of the completed times in <b>circuit_build_times</b>, kept in
+   * step with it. Bin i counts times from i*CBT_BIN_WIDTH ms up to but not
+   * including (i+1)*CBT_BIN_WIDTH ms. */
+  uint32_t *histogram;
+  /** Sum of tor_mathlog() of the times counted in each histogram bin. */
+  double *histogram_log_sum;
+  /** How many bins are allocated in <b>histogram</b>? */
+  build_time_t histogram_nbins;
+  /** tor_mathlog() of each completed time in <b>circuit_build_times</b>. */
+  double build_time_logs[CBT_NCIRCUITS_TO_OBSERVE];
+  /** How many entries of <b>circuit_build_times</b> are CBT_BUILD_ABANDONED? */
+  int abandoned_count;
+  /** The largest completed time in <b>circuit_build_times</b>; only
+   * meaningful if <b>max_build_time_valid</b> is set. */
+  build_time_t max_build_time;
+  int max_build_time_valid;
 } circuit_build_times_t;
 
 /********************************* config.c ***************************/
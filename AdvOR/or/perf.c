@@ -0,0 +1,846 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file perf.c
+ * \brief Counters and histograms for the "perf/" GETINFO keys.
+ *
+ * Everything here is updated from the main thread, so the counters are
+ * plain integers and updating one costs an increment.  Histograms use
+ * log-linear buckets: each power of two is split into PERF_HIST_SUB
+ * buckets, so the percentiles we report are within 25% of the real value.
+ * Readers on other threads (plugins) may see slightly stale numbers;
+ * resets asked for by them are done by the main thread on the next tick.
+ **/
+
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "circuitlist.h"
+#include "main.h"
+#include "perf.h"
+#include "relay.h"
+
+/** Log2 of the number of buckets each power of two is split into. */
+#define PERF_HIST_SUB_BITS 2
+/** Number of buckets each power of two is split into. */
+#define PERF_HIST_SUB (1<<PERF_HIST_SUB_BITS)
+/** Values at or above 2^PERF_HIST_MAX_LOG2 all go into the last bucket. */
+#define PERF_HIST_MAX_LOG2 40
+/** Number of buckets in a histogram: values below 2*PERF_HIST_SUB get one
+ * bucket each, larger ones PERF_HIST_SUB buckets per power of two. */
+#define PERF_HIST_BUCKETS \
+  (2*PERF_HIST_SUB + (PERF_HIST_MAX_LOG2-PERF_HIST_SUB_BITS-1)*PERF_HIST_SUB)
+
+/** A distribution of values. */
+typedef struct perf_histogram_t {
+  uint64_t n; /**< How many values were added? */
+  uint64_t total; /**< Sum of all values. */
+  uint64_t min; /**< Smallest value, if n is nonzero. */
+  uint64_t max; /**< Largest value. */
+  uint32_t buckets[PERF_HIST_BUCKETS];
+} perf_histogram_t;
+
+/** Names of the histograms, for the GETINFO keys; in perf_hist_t order. */
+static const char *perf_hist_names[_PERF_HIST_MAX] = {
+  "cells", "queue-depth", "ewma-latency", "circuit-build", "proxy-filter",
+  "cell-wait"
+};
+
+uint64_t perf_counters[_PERF_COUNTER_MAX];
+static perf_histogram_t perf_hists[_PERF_HIST_MAX];
+/** When did we last reset the counters? */
+static time_t perf_reset_time = 0;
+/** Nonzero if a plugin asked for a reset that the main thread hasn't done
+ * yet. */
+static volatile LONG perf_reset_pending = 0;
+/** Value of stats_n_relay_cells_relayed at the last reset. */
+static uint64_t perf_cells_at_reset = 0;
+/** Value of stats_n_relay_cells_relayed at the last perf_second_elapsed(). */
+static uint64_t perf_cells_last = 0;
+/** Cells relayed in the last second. */
+static uint64_t perf_cells_last_second = 0;
+/** Buffer freelist totals at the last reset. */
+static uint64_t perf_buf_alloc_at_reset = 0, perf_buf_free_at_reset = 0,
+  perf_buf_hit_at_reset = 0, perf_buf_miss_at_reset = 0;
+
+static void stream_trace_clear(void);
+
+/** Return the number of microseconds elapsed since some fixed point, from
+ * the high resolution performance counter. */
+uint64_t
+perf_now_usec(void)
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (!freq.QuadPart && (!QueryPerformanceFrequency(&freq) ||
+                         !freq.QuadPart))
+    freq.QuadPart = 1;
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+    (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+/** Return the index of the bucket that holds <b>value</b>. */
+static int
+perf_hist_bucket(uint64_t value)
+{
+  int lg2;
+  if (value < 2*PERF_HIST_SUB)
+    return (int)value;
+  lg2 = tor_log2(value);
+  if (lg2 >= PERF_HIST_MAX_LOG2)
+    return PERF_HIST_BUCKETS-1;
+  return 2*PERF_HIST_SUB + (lg2-PERF_HIST_SUB_BITS-1)*PERF_HIST_SUB +
+    (int)((value >> (lg2-PERF_HIST_SUB_BITS)) & (PERF_HIST_SUB-1));
+}
+
+/** Return the largest value that goes into bucket <b>b</b>. */
+static uint64_t
+perf_hist_bucket_high(int b)
+{
+  int lg2, sub;
+  if (b < 2*PERF_HIST_SUB)
+    return (uint64_t)b;
+  if (b >= PERF_HIST_BUCKETS-1)
+    return UINT64_MAX;
+  lg2 = (b - 2*PERF_HIST_SUB) / PERF_HIST_SUB + PERF_HIST_SUB_BITS + 1;
+  sub = (b - 2*PERF_HIST_SUB) % PERF_HIST_SUB;
+  return ((((uint64_t)(PERF_HIST_SUB+sub+1)) << (lg2-PERF_HIST_SUB_BITS))) - 1;
+}
+
+/** Add <b>value</b> to <b>hist</b>. */
+static void
+perf_histogram_add(perf_histogram_t *hist, uint64_t value)
+{
+  if (!hist->n || value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+  hist->n++;
+  hist->total += value;
+  hist->buckets[perf_hist_bucket(value)]++;
+}
+
+/** Add <b>value</b> to the histogram <b>h</b>.  Only call this from the
+ * main thread. */
+void
+perf_hist_add(perf_hist_t h, uint64_t value)
+{
+  perf_histogram_add(&perf_hists[h], value);
+}
+
+/** Set *<b>out</b> to an upper bound on the <b>percentile</b>th percentile
+ * of the values in <b>hist</b>, and return 0.  Return -1 if <b>hist</b> is
+ * empty. */
+static int
+perf_histogram_percentile(const perf_histogram_t *hist, int percentile,
+                          uint64_t *out)
+{
+  uint64_t wanted, seen = 0;
+  int b;
+  if (!hist->n)
+    return -1;
+  wanted = (hist->n * percentile + 99) / 100;
+  if (!wanted)
+    wanted = 1;
+  for (b = 0; b < PERF_HIST_BUCKETS; ++b) {
+    seen += hist->buckets[b];
+    if (seen >= wanted)
+      break;
+  }
+  *out = b < PERF_HIST_BUCKETS ? perf_hist_bucket_high(b) : hist->max;
+  if (*out > hist->max)
+    *out = hist->max;
+  if (*out < hist->min)
+    *out = hist->min;
+  return 0;
+}
+
+/** Set *<b>out</b> to an upper bound on the <b>percentile</b>th percentile
+ * of the values in the histogram <b>h</b>, and return 0.  Return -1 if the
+ * histogram is empty. */
+int
+perf_hist_get_percentile(perf_hist_t h, int percentile, uint64_t *out)
+{
+  return perf_histogram_percentile(&perf_hists[h], percentile, out);
+}
+
+/** Return a newly allocated string describing the histogram <b>h</b>. */
+static char *
+perf_hist_format(perf_hist_t h)
+{
+  const perf_histogram_t *hist = &perf_hists[h];
+  unsigned char *result = NULL;
+  uint64_t p50 = 0, p90 = 0, p99 = 0;
+  perf_histogram_percentile(hist, 50, &p50);
+  perf_histogram_percentile(hist, 90, &p90);
+  perf_histogram_percentile(hist, 99, &p99);
+  tor_asprintf(&result, "count="U64_FORMAT" mean="U64_FORMAT" min="U64_FORMAT
+               " max="U64_FORMAT" p50="U64_FORMAT" p90="U64_FORMAT
+               " p99="U64_FORMAT,
+               U64_PRINTF_ARG(hist->n),
+               U64_PRINTF_ARG(hist->n ? hist->total / hist->n : 0),
+               U64_PRINTF_ARG(hist->min), U64_PRINTF_ARG(hist->max),
+               U64_PRINTF_ARG(p50), U64_PRINTF_ARG(p90),
+               U64_PRINTF_ARG(p99));
+  return (char *)result;
+}
+
+/** Add a cell that waited <b>usec</b> microseconds to <b>hist</b>. */
+void
+cell_wait_hist_add(cell_wait_hist_t *hist, uint32_t usec)
+{
+  int b = 0;
+  if (usec >> CELL_WAIT_HIST_MIN_LOG2) {
+    b = tor_log2(usec) - CELL_WAIT_HIST_MIN_LOG2 + 1;
+    if (b >= CELL_WAIT_HIST_BUCKETS)
+      b = CELL_WAIT_HIST_BUCKETS-1;
+  }
+  hist->buckets[b]++;
+  hist->n++;
+  hist->total_usec += usec;
+  if (usec > hist->max_usec)
+    hist->max_usec = usec;
+}
+
+/** Set *<b>out</b> to an upper bound on the <b>percentile</b>th percentile
+ * of the waits in <b>hist</b>, and return 0.  Return -1 if <b>hist</b> is
+ * empty. */
+int
+cell_wait_hist_get_percentile(const cell_wait_hist_t *hist, int percentile,
+                              uint32_t *out)
+{
+  uint64_t wanted, seen = 0;
+  int b;
+  if (!hist->n)
+    return -1;
+  wanted = ((uint64_t)hist->n * percentile + 99) / 100;
+  if (!wanted)
+    wanted = 1;
+  for (b = 0; b < CELL_WAIT_HIST_BUCKETS-1; ++b) {
+    seen += hist->buckets[b];
+    if (seen >= wanted)
+      break;
+  }
+  if (b < CELL_WAIT_HIST_BUCKETS-1 &&
+      (((uint32_t)1) << (CELL_WAIT_HIST_MIN_LOG2+b)) - 1 < hist->max_usec)
+    *out = (((uint32_t)1) << (CELL_WAIT_HIST_MIN_LOG2+b)) - 1;
+  else
+    *out = hist->max_usec;
+  return 0;
+}
+
+/** Return a newly allocated string describing <b>hist</b>: the totals, the
+ * percentiles, and the counts of all the buckets. */
+char *
+cell_wait_hist_format(const cell_wait_hist_t *hist)
+{
+  unsigned char *result = NULL;
+  char buckets[CELL_WAIT_HIST_BUCKETS*11+1], *cp = buckets;
+  uint32_t p50 = 0, p90 = 0, p99 = 0;
+  int b;
+  cell_wait_hist_get_percentile(hist, 50, &p50);
+  cell_wait_hist_get_percentile(hist, 90, &p90);
+  cell_wait_hist_get_percentile(hist, 99, &p99);
+  for (b = 0; b < CELL_WAIT_HIST_BUCKETS; ++b) {
+    tor_snprintf(cp, buckets+sizeof(buckets)-cp, b ? ",%lu" : "%lu",
+                 (unsigned long)hist->buckets[b]);
+    cp += strlen(cp);
+  }
+  tor_asprintf(&result, "count=%lu mean=%lu max=%lu p50=%lu p90=%lu p99=%lu "
+               "buckets=%s", (unsigned long)hist->n,
+               (unsigned long)(hist->n ? hist->total_usec / hist->n : 0),
+               (unsigned long)hist->max_usec, (unsigned long)p50,
+               (unsigned long)p90, (unsigned long)p99, buckets);
+  return (char *)result;
+}
+
+/** Return a newly allocated string with one line for each circuit whose
+ * cells we flushed: "origin ID" with the global identifier of origin
+ * circuits, "relay CIRCID" with the circuit ID on the previous hop for the
+ * others, then the cell_wait_hist_format() of the circuit. */
+static char *
+perf_get_circuit_waits(void)
+{
+  smartlist_t *lines = smartlist_create();
+  circuit_t *circ;
+  char *joined;
+  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+    unsigned char *line = NULL;
+    char *hist;
+    if (!circ->cell_wait.n)
+      continue;
+    hist = cell_wait_hist_format(&circ->cell_wait);
+    if (CIRCUIT_IS_ORIGIN(circ))
+      tor_asprintf(&line, "origin %lu %s",
+                   (unsigned long)TO_ORIGIN_CIRCUIT(circ)->global_identifier,
+                   hist);
+    else
+      tor_asprintf(&line, "relay %u %s",
+                   (unsigned)TO_OR_CIRCUIT(circ)->p_circ_id, hist);
+    tor_free(hist);
+    smartlist_add(lines, line);
+  }
+  joined = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return joined;
+}
+
+/** Return a newly allocated string with one line for each OR connection
+ * that we wrote queued cells to: its nickname or address, and port, then
+ * the cell_wait_hist_format() of the connection. */
+static char *
+perf_get_orconn_waits(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *joined;
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    or_connection_t *or_conn;
+    unsigned char *line = NULL;
+    char *hist;
+    if (conn->type != CONN_TYPE_OR || conn->marked_for_close)
+      continue;
+    or_conn = TO_OR_CONN(conn);
+    if (!or_conn->cell_wait.n)
+      continue;
+    hist = cell_wait_hist_format(&or_conn->cell_wait);
+    tor_asprintf(&line, "%s:%u %s",
+                 or_conn->nickname ? or_conn->nickname :
+                 conn->address ? conn->address : "?",
+                 (unsigned)conn->port, hist);
+    tor_free(hist);
+    smartlist_add(lines, line);
+  } SMARTLIST_FOREACH_END(conn);
+  joined = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return joined;
+}
+
+/** Return <b>part</b> as a percentage of <b>part</b>+<b>rest</b>. */
+static int
+perf_percent(uint64_t part, uint64_t rest)
+{
+  return (part + rest) ? (int)(part * 100 / (part + rest)) : 0;
+}
+
+/** Called once a second from the main loop: note how many cells we relayed
+ * in the last second, and do any reset a plugin asked for. */
+void
+perf_second_elapsed(void)
+{
+  if (InterlockedExchange(&perf_reset_pending, 0))
+    perf_reset();
+  perf_cells_last_second = stats_n_relay_cells_relayed - perf_cells_last;
+  perf_cells_last = stats_n_relay_cells_relayed;
+  perf_hist_add(PERF_HIST_CELLS_PER_SECOND, perf_cells_last_second);
+}
+
+/** Clear all counters and histograms. */
+void
+perf_reset(void)
+{
+  memset(perf_counters, 0, sizeof(perf_counters));
+  memset(perf_hists, 0, sizeof(perf_hists));
+  perf_cells_at_reset = perf_cells_last = stats_n_relay_cells_relayed;
+  perf_cells_last_second = 0;
+  buf_get_freelist_totals(&perf_buf_alloc_at_reset, &perf_buf_free_at_reset,
+                          &perf_buf_hit_at_reset, &perf_buf_miss_at_reset);
+  perf_reset_time = get_time(NULL);
+  stream_trace_clear();
+}
+
+/** Ask the main thread to clear all counters and histograms on its next
+ * tick.  Safe to call from any thread. */
+void
+perf_request_reset(void)
+{
+  InterlockedExchange(&perf_reset_pending, 1);
+}
+
+/** Return a newly allocated string with the counters for the GETINFO key
+ * "perf/<b>key</b>", or NULL if there is no such key.  "all" returns every
+ * other key, one per line, each line starting with the key name. */
+char *
+perf_get_stats(const char *key)
+{
+  unsigned char *result = NULL;
+  int h;
+  if (!strcmp(key, "all")) {
+    smartlist_t *lines = smartlist_create();
+    char tbuf[ISO_TIME_LEN+1];
+    static const char *keys[] = { "cells", "queue-depth", "ewma-latency",
+      "circuit-build", "dns", "buffers", "proxy-filter", "cell-wait", NULL };
+    char *joined;
+    if (!perf_reset_time)
+      perf_reset_time = get_time(NULL);
+    format_iso_time(tbuf, perf_reset_time);
+    tor_asprintf(&result, "since=%s", tbuf);
+    smartlist_add(lines, result);
+    for (h = 0; keys[h]; ++h) {
+      char *line = perf_get_stats(keys[h]);
+      result = NULL;
+      tor_asprintf(&result, "%s %s", keys[h], line);
+      tor_free(line);
+      smartlist_add(lines, result);
+    }
+    joined = smartlist_join_strings(lines, "\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+    return joined;
+  } else if (!strcmp(key, "cell-wait/circuits")) {
+    return perf_get_circuit_waits();
+  } else if (!strcmp(key, "cell-wait/orconns")) {
+    return perf_get_orconn_waits();
+  } else if (!strcmp(key, "dns")) {
+    uint64_t hits = perf_counters[PERF_DNS_CACHE_HITS];
+    uint64_t misses = perf_counters[PERF_DNS_CACHE_MISSES];
+    tor_asprintf(&result, "hits="U64_FORMAT" misses="U64_FORMAT
+                 " hit-rate=%d", U64_PRINTF_ARG(hits), U64_PRINTF_ARG(misses),
+                 perf_percent(hits, misses));
+    return (char *)result;
+  } else if (!strcmp(key, "buffers")) {
+    uint64_t n_alloc, n_free, n_hit, n_miss;
+    buf_get_freelist_totals(&n_alloc, &n_free, &n_hit, &n_miss);
+    n_alloc -= perf_buf_alloc_at_reset;
+    n_free -= perf_buf_free_at_reset;
+    n_hit -= perf_buf_hit_at_reset;
+    n_miss -= perf_buf_miss_at_reset;
+    tor_asprintf(&result, "allocs="U64_FORMAT" frees="U64_FORMAT" hits="
+                 U64_FORMAT" misses="U64_FORMAT" hit-rate=%d",
+                 U64_PRINTF_ARG(n_alloc), U64_PRINTF_ARG(n_free),
+                 U64_PRINTF_ARG(n_hit), U64_PRINTF_ARG(n_miss),
+                 perf_percent(n_hit, n_alloc + n_miss));
+    return (char *)result;
+  }
+  for (h = 0; h < _PERF_HIST_MAX; ++h) {
+    if (!strcmp(key, perf_hist_names[h])) {
+      char *hist = perf_hist_format((perf_hist_t)h);
+      if (h != PERF_HIST_CELLS_PER_SECOND)
+        return hist;
+      tor_asprintf(&result, "relayed="U64_FORMAT" last-second="U64_FORMAT
+                   " per-second %s",
+                   U64_PRINTF_ARG(stats_n_relay_cells_relayed -
+                                  perf_cells_at_reset),
+                   U64_PRINTF_ARG(perf_cells_last_second), hist);
+      tor_free(hist);
+      return (char *)result;
+    }
+  }
+  return NULL;
+}
+
+/** Helper used to implement GETINFO perf/... queries. */
+int
+getinfo_helper_perf(control_connection_t *control_conn,
+                    const char *question, char **answer,
+                    const char **errmsg)
+{
+  (void)control_conn;
+  (void)errmsg;
+  if (!strcmpstart(question, "perf/"))
+    *answer = perf_get_stats(question+strlen("perf/"));
+  return 0;
+}
+
+/*----------------------------------------------------------------------*/
+
+/** The parts of a stream's setup that we keep a distribution of, in
+ * microseconds. */
+typedef enum stream_trace_interval_t {
+  TRACE_CIRCUIT, /**< From the request to choosing a circuit. */
+  TRACE_BEGIN, /**< From choosing a circuit to sending BEGIN. */
+  TRACE_CONNECT, /**< From sending BEGIN to getting CONNECTED. */
+  TRACE_FIRST_BYTE, /**< From getting CONNECTED to the first byte. */
+  TRACE_FILTER, /**< Time spent in the HTTP proxy filters. */
+  TRACE_TOTAL, /**< From the request to the first byte. */
+  TRACE_N_INTERVALS
+} stream_trace_interval_t;
+
+/** Names of the intervals, in stream_trace_interval_t order. */
+static const char *stream_trace_interval_names[TRACE_N_INTERVALS] = {
+  "circuit", "begin", "connect", "first-byte", "filter", "total"
+};
+
+/** How many exits do we keep separate statistics for? Streams that leave
+ * through other exits are counted as "other". */
+#define STREAM_TRACE_MAX_EXITS 512
+/** How many identities do we keep statistics for? */
+#define STREAM_TRACE_MAX_IDENTITIES 16
+
+/** Statistics for the streams that left through one exit, or that were
+ * made while one identity was in use. */
+typedef struct stream_trace_group_t {
+  char *name; /**< "$hexid~nickname" for an exit; the start time for an
+               * identity. */
+  uint64_t n_incomplete; /**< Streams that closed before their first byte. */
+  perf_histogram_t intervals[TRACE_N_INTERVALS];
+} stream_trace_group_t;
+
+/** Protects everything below: the GUI thread reads the statistics and may
+ * start a new identity. */
+static tor_mutex_t *stream_trace_mutex = NULL;
+/** Map from exit name to stream_trace_group_t. */
+static strmap_t *stream_trace_exits = NULL;
+/** List of stream_trace_group_t for the most recent identities, oldest
+ * first. */
+static smartlist_t *stream_trace_identities = NULL;
+
+/** Return a new, empty stream_trace_group_t named <b>name</b>. */
+static stream_trace_group_t *
+stream_trace_group_new(const char *name)
+{
+  stream_trace_group_t *group = tor_malloc_zero(sizeof(stream_trace_group_t));
+  group->name = tor_strdup(name);
+  return group;
+}
+
+/** Release all storage held by <b>group</b>. */
+static void
+stream_trace_group_free(void *group)
+{
+  tor_free(((stream_trace_group_t *)group)->name);
+  tor_free(group);
+}
+
+/** Helper for strmap_free(): free a stream_trace_group_t. */
+#ifdef DEBUG_MALLOC
+static void
+_stream_trace_group_free(void *group, const char *c, int n)
+{
+  (void)c;
+  (void)n;
+  stream_trace_group_free(group);
+}
+#else
+static void
+_stream_trace_group_free(void *group)
+{
+  stream_trace_group_free(group);
+}
+#endif
+
+/** Add a group for an identity that starts at <b>now</b>, and forget the
+ * oldest identity if we have too many.  Call with stream_trace_mutex
+ * held. */
+static stream_trace_group_t *
+stream_trace_add_identity(time_t now)
+{
+  char tbuf[ISO_TIME_LEN+1];
+  stream_trace_group_t *group;
+  format_iso_time(tbuf, now);
+  group = stream_trace_group_new(tbuf);
+  if (!stream_trace_identities)
+    stream_trace_identities = smartlist_create();
+  smartlist_add(stream_trace_identities, group);
+  if (smartlist_len(stream_trace_identities) > STREAM_TRACE_MAX_IDENTITIES) {
+    stream_trace_group_free(smartlist_get(stream_trace_identities, 0));
+    smartlist_del_keeporder(stream_trace_identities, 0);
+  }
+  return group;
+}
+
+/** Write the name of the exit that <b>conn</b> leaves through to
+ * <b>buf</b>. */
+static void
+stream_trace_exit_name(edge_connection_t *conn, char *buf, size_t len)
+{
+  circuit_t *circ = conn->on_circuit;
+  if (circ && CIRCUIT_IS_ORIGIN(circ) && TO_ORIGIN_CIRCUIT(circ)->rend_data) {
+    strlcpy(buf, "hidden-service", len);
+  } else if (circ && conn->cpath_layer && conn->cpath_layer->extend_info) {
+    extend_info_t *ei = conn->cpath_layer->extend_info;
+    buf[0] = '$';
+    base16_encode(buf+1, len-1, ei->identity_digest, DIGEST_LEN);
+    if (ei->nickname[0] && ei->nickname[0] != '$') {
+      strlcat(buf, "~", len);
+      strlcat(buf, ei->nickname, len);
+    }
+  } else {
+    strlcpy(buf, "none", len);
+  }
+}
+
+/** Return <b>end</b>-<b>start</b>, or 0 if either stage didn't happen. */
+static INLINE uint64_t
+stream_trace_interval(uint64_t start, uint64_t end)
+{
+  return (start && end > start) ? end - start : 0;
+}
+
+/** Add the stages of <b>conn</b> to the statistics of its exit and of the
+ * current identity.  If <b>complete</b> is false, the stream is closing
+ * before its first byte arrived, and we only count it as incomplete. */
+static void
+stream_trace_record(edge_connection_t *conn, int complete)
+{
+  char name[HEX_DIGEST_LEN+MAX_HEX_NICKNAME_LEN+3];
+  stream_trace_group_t *groups[2];
+  const uint64_t *t = conn->trace_stamps;
+  int i;
+
+  stream_trace_exit_name(conn, name, sizeof(name));
+  if (!stream_trace_mutex)
+    stream_trace_mutex = tor_mutex_new();
+  tor_mutex_acquire(stream_trace_mutex);
+  if (!stream_trace_exits)
+    stream_trace_exits = strmap_new();
+  groups[0] = strmap_get(stream_trace_exits, name);
+  if (!groups[0]) {
+    if (strmap_size(stream_trace_exits) >= STREAM_TRACE_MAX_EXITS)
+      strlcpy(name, "other", sizeof(name));
+    groups[0] = strmap_get(stream_trace_exits, name);
+    if (!groups[0]) {
+      groups[0] = stream_trace_group_new(name);
+      strmap_set(stream_trace_exits, name, groups[0]);
+    }
+  }
+  if (stream_trace_identities && smartlist_len(stream_trace_identities))
+    groups[1] = smartlist_get(stream_trace_identities,
+                              smartlist_len(stream_trace_identities)-1);
+  else
+    groups[1] = stream_trace_add_identity(get_time(NULL));
+
+  for (i = 0; i < 2; ++i) {
+    perf_histogram_t *h = groups[i]->intervals;
+    if (!complete) {
+      groups[i]->n_incomplete++;
+      continue;
+    }
+    if (t[STREAM_TRACE_CIRC_CHOSEN])
+      perf_histogram_add(&h[TRACE_CIRCUIT],
+                         stream_trace_interval(t[STREAM_TRACE_ACCEPTED],
+                                               t[STREAM_TRACE_CIRC_CHOSEN]));
+    if (t[STREAM_TRACE_BEGIN_SENT])
+      perf_histogram_add(&h[TRACE_BEGIN],
+                         stream_trace_interval(t[STREAM_TRACE_CIRC_CHOSEN],
+                                               t[STREAM_TRACE_BEGIN_SENT]));
+    if (t[STREAM_TRACE_CONNECTED]) {
+      perf_histogram_add(&h[TRACE_CONNECT],
+                         stream_trace_interval(t[STREAM_TRACE_BEGIN_SENT],
+                                               t[STREAM_TRACE_CONNECTED]));
+      perf_histogram_add(&h[TRACE_FIRST_BYTE],
+                         stream_trace_interval(t[STREAM_TRACE_CONNECTED],
+                                               t[STREAM_TRACE_FIRST_BYTE]));
+    }
+    perf_histogram_add(&h[TRACE_FILTER], conn->trace_filter_usec);
+    perf_histogram_add(&h[TRACE_TOTAL],
+                       stream_trace_interval(t[STREAM_TRACE_ACCEPTED],
+                                             t[STREAM_TRACE_FIRST_BYTE]));
+  }
+  tor_mutex_release(stream_trace_mutex);
+}
+
+/** Note that the AP connection <b>conn</b> reached <b>stage</b> of its
+ * setup.  A stream is only traced if StreamTracing was set when its request
+ * arrived; once it delivered its first byte we add it to the statistics. */
+void
+stream_trace_stamp(edge_connection_t *conn, stream_trace_stage_t stage)
+{
+  if (stage == STREAM_TRACE_ACCEPTED) {
+    if (!get_options()->StreamTracing)
+      return;
+    memset(conn->trace_stamps, 0, sizeof(conn->trace_stamps));
+    conn->trace_filter_usec = 0;
+  } else if (!conn->trace_stamps[STREAM_TRACE_ACCEPTED] ||
+             conn->trace_stamps[STREAM_TRACE_FIRST_BYTE]) {
+    return;
+  } else if (stage == STREAM_TRACE_CIRC_CHOSEN) {
+    /* A stream that is retried on another circuit starts over from here. */
+    conn->trace_stamps[STREAM_TRACE_BEGIN_SENT] = 0;
+    conn->trace_stamps[STREAM_TRACE_CONNECTED] = 0;
+  }
+  conn->trace_stamps[stage] = perf_now_usec();
+  if (stage == STREAM_TRACE_FIRST_BYTE)
+    stream_trace_record(conn, 1);
+}
+
+/** Note that the traced stream <b>conn</b> spent <b>usec</b> microseconds in
+ * the HTTP proxy filters. */
+void
+stream_trace_note_filter(edge_connection_t *conn, uint64_t usec)
+{
+  if (conn->trace_stamps[STREAM_TRACE_ACCEPTED] &&
+      !conn->trace_stamps[STREAM_TRACE_FIRST_BYTE])
+    conn->trace_filter_usec += usec;
+}
+
+/** Called when the AP connection <b>conn</b> is about to close: if it was
+ * traced and never delivered a byte, count it as incomplete. */
+void
+stream_trace_closed(edge_connection_t *conn)
+{
+  if (conn->trace_stamps[STREAM_TRACE_ACCEPTED] &&
+      !conn->trace_stamps[STREAM_TRACE_FIRST_BYTE])
+    stream_trace_record(conn, 0);
+  conn->trace_stamps[STREAM_TRACE_ACCEPTED] = 0;
+}
+
+/** Start keeping separate statistics for a new identity.  Safe to call from
+ * any thread. */
+void
+stream_trace_new_identity(void)
+{
+  if (!stream_trace_mutex)
+    return; /* Nothing traced yet; the first stream starts an identity. */
+  tor_mutex_acquire(stream_trace_mutex);
+  stream_trace_add_identity(get_time(NULL));
+  tor_mutex_release(stream_trace_mutex);
+}
+
+/** Forget all stream statistics. */
+static void
+stream_trace_clear(void)
+{
+  if (!stream_trace_mutex)
+    return;
+  tor_mutex_acquire(stream_trace_mutex);
+  if (stream_trace_exits) {
+    strmap_free(stream_trace_exits, _stream_trace_group_free);
+    stream_trace_exits = NULL;
+  }
+  if (stream_trace_identities) {
+    SMARTLIST_FOREACH(stream_trace_identities, stream_trace_group_t *, g,
+                      stream_trace_group_free(g));
+    smartlist_clear(stream_trace_identities);
+  }
+  tor_mutex_release(stream_trace_mutex);
+}
+
+/** Append to <b>lines</b> the CSV rows that describe <b>group</b>. */
+static void
+stream_trace_group_csv(smartlist_t *lines, const char *kind,
+                       const stream_trace_group_t *group)
+{
+  int i;
+  for (i = 0; i < TRACE_N_INTERVALS; ++i) {
+    const perf_histogram_t *h = &group->intervals[i];
+    uint64_t p50 = 0, p90 = 0, p99 = 0;
+    unsigned char *line = NULL;
+    perf_histogram_percentile(h, 50, &p50);
+    perf_histogram_percentile(h, 90, &p90);
+    perf_histogram_percentile(h, 99, &p99);
+    tor_asprintf(&line, "%s,%s,%s,"U64_FORMAT","U64_FORMAT","U64_FORMAT","
+                 U64_FORMAT","U64_FORMAT","U64_FORMAT","U64_FORMAT","
+                 U64_FORMAT, kind, group->name, stream_trace_interval_names[i],
+                 U64_PRINTF_ARG(h->n), U64_PRINTF_ARG(h->n ? h->total/h->n : 0),
+                 U64_PRINTF_ARG(h->min), U64_PRINTF_ARG(p50),
+                 U64_PRINTF_ARG(p90), U64_PRINTF_ARG(p99),
+                 U64_PRINTF_ARG(h->max), U64_PRINTF_ARG(group->n_incomplete));
+    smartlist_add(lines, line);
+  }
+}
+
+/** Return a newly allocated CSV document with the stream statistics of
+ * every exit and identity, or NULL if no stream was traced yet. */
+char *
+stream_trace_get_csv(void)
+{
+  smartlist_t *lines;
+  char *result;
+  if (!stream_trace_mutex)
+    return NULL;
+  lines = smartlist_create();
+  smartlist_add(lines, tor_strdup("kind,name,interval,count,mean_usec,"
+                                  "min_usec,p50_usec,p90_usec,p99_usec,"
+                                  "max_usec,incomplete"));
+  tor_mutex_acquire(stream_trace_mutex);
+  if (stream_trace_exits) {
+    STRMAP_FOREACH(stream_trace_exits, name, stream_trace_group_t *, g) {
+      (void)name;
+      stream_trace_group_csv(lines, "exit", g);
+    } STRMAP_FOREACH_END;
+  }
+  if (stream_trace_identities) {
+    SMARTLIST_FOREACH(stream_trace_identities, stream_trace_group_t *, g,
+                      stream_trace_group_csv(lines, "identity", g));
+  }
+  tor_mutex_release(stream_trace_mutex);
+  if (smartlist_len(lines) == 1) {
+    result = NULL;
+  } else {
+    result = smartlist_join_strings(lines, "\r\n", 1, NULL);
+  }
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log a summary of <b>group</b> at level <b>severity</b>: how many
+ * streams, and the median, 90th percentile and longest time of each
+ * interval, in milliseconds. */
+static void
+stream_trace_group_log(int severity, int lang_id,
+                       const stream_trace_group_t *group)
+{
+  char buf[512];
+  size_t off = 0;
+  int i;
+  for (i = 0; i < TRACE_N_INTERVALS && off < sizeof(buf); ++i) {
+    const perf_histogram_t *h = &group->intervals[i];
+    uint64_t p50 = 0, p90 = 0;
+    int r;
+    if (!h->n)
+      continue;
+    perf_histogram_percentile(h, 50, &p50);
+    perf_histogram_percentile(h, 90, &p90);
+    r = tor_snprintf(buf+off, sizeof(buf)-off, " %s=%u.%u/%u.%u/%u.%u",
+                     stream_trace_interval_names[i],
+                     (unsigned)(p50/1000), (unsigned)(p50%1000/100),
+                     (unsigned)(p90/1000), (unsigned)(p90%1000/100),
+                     (unsigned)(h->max/1000), (unsigned)(h->max%1000/100));
+    if (r < 0)
+      break;
+    off += r;
+  }
+  buf[off < sizeof(buf) ? off : sizeof(buf)-1] = 0;
+  log(severity, LD_APP, get_lang_str(lang_id), group->name,
+      U64_PRINTF_ARG(group->intervals[TRACE_TOTAL].n),
+      U64_PRINTF_ARG(group->n_incomplete), buf);
+}
+
+/** Log the stream statistics of every exit and identity at level
+ * <b>severity</b>. */
+void
+stream_trace_log(int severity)
+{
+  int any = 0;
+  if (stream_trace_mutex) {
+    tor_mutex_acquire(stream_trace_mutex);
+    if (stream_trace_exits && strmap_size(stream_trace_exits)) {
+      any = 1;
+      log(severity, LD_APP, get_lang_str(LANG_LOG_PERF_STREAM_TRACE_HEADER));
+      STRMAP_FOREACH(stream_trace_exits, name, stream_trace_group_t *, g) {
+        (void)name;
+        stream_trace_group_log(severity, LANG_LOG_PERF_STREAM_TRACE_EXIT, g);
+      } STRMAP_FOREACH_END;
+      SMARTLIST_FOREACH(stream_trace_identities, stream_trace_group_t *, g,
+        stream_trace_group_log(severity, LANG_LOG_PERF_STREAM_TRACE_IDENTITY,
+                               g));
+    }
+    tor_mutex_release(stream_trace_mutex);
+  }
+  if (!any)
+    log(severity, LD_APP, get_lang_str(LANG_LOG_PERF_STREAM_TRACE_NONE));
+}
+
+/** Release all storage held by the stream statistics. */
+void
+stream_trace_free_all(void)
+{
+  stream_trace_clear();
+  if (stream_trace_identities) {
+    smartlist_free(stream_trace_identities);
+    stream_trace_identities = NULL;
+  }
+  if (stream_trace_mutex) {
+    tor_mutex_free(stream_trace_mutex);
+    stream_trace_mutex = NULL;
+  }
+}
+
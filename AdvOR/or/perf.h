@@ -0,0 +1,63 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file perf.h
+ * \brief Header file for perf.c.
+ **/
+
+#ifndef _TOR_PERF_H
+#define _TOR_PERF_H
+
+/** Plain event counters kept by perf.c. */
+typedef enum perf_counter_t {
+  PERF_DNS_CACHE_HITS,
+  PERF_DNS_CACHE_MISSES,
+  _PERF_COUNTER_MAX
+} perf_counter_t;
+
+/** Distributions kept by perf.c. */
+typedef enum perf_hist_t {
+  PERF_HIST_CELLS_PER_SECOND, /**< Cells relayed in each second. */
+  PERF_HIST_QUEUE_DEPTH, /**< Length of a circuit cell queue after we add
+                          * cells to it. */
+  PERF_HIST_EWMA_USEC, /**< Time spent picking a circuit to flush. */
+  PERF_HIST_CIRC_BUILD_MSEC, /**< Time to build a circuit. */
+  PERF_HIST_FILTER_USEC, /**< Time spent in the HTTP proxy filters. */
+  PERF_HIST_CELL_WAIT_USEC, /**< Time cells waited in circuit queues. */
+  _PERF_HIST_MAX
+} perf_hist_t;
+
+extern uint64_t perf_counters[_PERF_COUNTER_MAX];
+
+/** Increment the counter <b>c</b>.  Only call this from the main thread. */
+#define perf_count(c) (++perf_counters[(c)])
+
+uint64_t perf_now_usec(void);
+void perf_hist_add(perf_hist_t h, uint64_t value);
+void perf_second_elapsed(void);
+void perf_reset(void);
+void perf_request_reset(void);
+char *perf_get_stats(const char *key);
+int perf_hist_get_percentile(perf_hist_t h, int percentile, uint64_t *out);
+void cell_wait_hist_add(cell_wait_hist_t *hist, uint32_t usec);
+int cell_wait_hist_get_percentile(const cell_wait_hist_t *hist,
+                                  int percentile, uint32_t *out);
+char *cell_wait_hist_format(const cell_wait_hist_t *hist);
+int getinfo_helper_perf(control_connection_t *control_conn,
+                        const char *question, char **answer,
+                        const char **errmsg);
+
+void stream_trace_stamp(edge_connection_t *conn, stream_trace_stage_t stage);
+void stream_trace_note_filter(edge_connection_t *conn, uint64_t usec);
+void stream_trace_closed(edge_connection_t *conn);
+void stream_trace_new_identity(void);
+char *stream_trace_get_csv(void);
+void stream_trace_log(int severity);
+void stream_trace_free_all(void);
+
+#endif
+
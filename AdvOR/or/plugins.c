@@ -12,6 +12,16 @@
 #include "dnsserv.h"
 #include "buffers.h"
 #include "config.h"
+#include "etw.h"
+#include "perf.h"
+#include "rephist.h"
+#include "watchdog.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 #include <windows.h>
 
 int next_plugin_id=0;
@@ -21,6 +31,15 @@ extern HWND hMainDialog;
 extern LPFN1 RegisterPluginKey,UnregisterPluginKey;
 
 int connection_params[MAX_PLUGIN_CONNECTION_PARAMS];
+/** Incremented every time the set of plugins that can see connection traffic, or their filters, change; connections compare it with their traffic_plugins_generation to know when to rebuild their traffic_plugins list. */
+static int plugins_traffic_generation = 1;
+
+/** A filter that selects the connections whose traffic a plugin sees, set with plugin_set_traffic_filter(). */
+typedef struct plugin_filter_t
+{	int type;
+	int port;
+	char *value;
+} plugin_filter_t;
 DWORD get_plugin_key(plugin_info_t *plugin_tmp);
 void set_constrained_socket_buffers(int sock, int size);
 void rend_init_plugin(plugin_info_t *plugin_tmp);
@@ -29,6 +48,7 @@ void __stdcall plugin_log(int severity,char *message);
 BOOL __stdcall plugin_tor_is_started(void);
 int __stdcall plugin_get_connection_count(void);
 int __stdcall plugin_get_connections(HANDLE hPlugin,connection_info_t *buffer,int nCount);
+int __stdcall plugin_get_connection_changes(HANDLE hPlugin,DWORD *cursor,connection_change_t *buffer,int nCount);
 int __stdcall plugin_close_connection(DWORD connection_id);
 int __stdcall plugin_connection_read(DWORD connection_id);
 int __stdcall plugin_connection_write(DWORD connection_id);
@@ -64,6 +84,18 @@ const char * __stdcall plugin_get_lang_str(HANDLE hPlugin,int langId,char *defau
 void __stdcall plugin_changeDialogStrings(HANDLE hPlugin,HWND hDlg,lang_dlg_info *dlgInfo);
 int __stdcall plugin_force_delete_file(char *fname);
 int __stdcall plugin_force_delete_subdir(char *fname);
+int __stdcall plugin_get_bandwidth_samples(bw_sample_t *buffer,int nCount);
+int __stdcall plugin_get_perf_stats(HANDLE hPlugin,const char *key,char *buffer,int buffer_size);
+void __stdcall plugin_reset_perf_stats(HANDLE hPlugin);
+BOOL __stdcall plugin_set_traffic_filter(HANDLE plugin_instance,int filter_type,const char *value);
+BOOL __stdcall plugin_complete_translate_address(HANDLE plugin_instance,DWORD request_id,BOOL allow,const char *address);
+HANDLE __stdcall plugin_ipset_new(HANDLE plugin_instance);
+BOOL __stdcall plugin_ipset_add(HANDLE plugin_instance,HANDLE ipset,DWORD low,DWORD high);
+int __stdcall plugin_ipset_add_string(HANDLE plugin_instance,HANDLE ipset,const char *ranges);
+BOOL __stdcall plugin_ipset_contains(HANDLE plugin_instance,HANDLE ipset,DWORD ip);
+void __stdcall plugin_ipset_free(HANDLE plugin_instance,HANDLE ipset);
+static void plugins_ipsets_free(HANDLE hDll);
+static void plugins_async_forget(HANDLE hDll);
 void *get_plugins_hs(void);
 resize_info_t *get_resize_info(RECT newSize,int list_item);
 void dlg_add_plugin(plugin_info_t *plugin_tmp);
@@ -131,69 +163,112 @@ int __stdcall plugin_get_connections(HANDLE hPlugin,connection_info_t *buffer,in
 	return i;
 }
 
-int __stdcall plugin_close_connection(DWORD connection_id)
+/** How many connection changes we remember for plugin_get_connection_changes(); must be a power of 2. */
+#define CONNECTION_CHANGES_SIZE 4096
+
+/** The last CONNECTION_CHANGES_SIZE connection changes; change number n is at index n % CONNECTION_CHANGES_SIZE. */
+static connection_change_t connection_changes[CONNECTION_CHANGES_SIZE];
+/** The number of the next connection change; only changes from connection_changes_next - CONNECTION_CHANGES_SIZE are remembered. */
+static DWORD connection_changes_next = 1;
+/** True once a plugin asked for connection changes; we don't record them before that. */
+static int connection_changes_enabled = 0;
+
+/** Record a change of <b>conn</b> for plugin_get_connection_changes(). */
+static void connection_change_add(connection_t *conn,DWORD change)
+{	connection_change_t *c = &connection_changes[connection_changes_next & (CONNECTION_CHANGES_SIZE-1)];
+	c->change = change;
+	c->connection_id = conn->global_identifier&0xffffffff;
+	c->connection_type = conn->type;
+	c->connection_state = conn->state;
+	conn->plugin_reported_state = conn->state;
+	connection_changes_next++;
+}
+
+int __stdcall plugin_get_connection_changes(HANDLE hPlugin,DWORD *cursor,connection_change_t *buffer,int nCount)
 {	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-		{	if(CONN_IS_EDGE(conn))
-			{	edge_connection_t *conn1=TO_EDGE_CONN(conn);
-				connection_edge_end(conn1,END_STREAM_REASON_DONE);
-				if (conn1->socks_request)	conn1->socks_request->has_finished = 1;
-			}
-			if(!conn->marked_for_close)	connection_mark_for_close(conn);
-			return 1;
+	int i=0;
+	(void) hPlugin;
+	if(!cursor)	return -1;
+	if(!connection_changes_enabled)
+	{	connection_changes_enabled = 1;
+		SMARTLIST_FOREACH(conns, connection_t *, conn,conn->plugin_reported_state = conn->state);
+	}
+	else
+	{	/* Connection states are changed in many places, so state changes are found here, when a plugin asks for them. */
+		SMARTLIST_FOREACH(conns, connection_t *, conn,
+		{	if(conn->state != conn->plugin_reported_state && !conn->marked_for_close)
+				connection_change_add(conn,PLUGIN_CONNECTION_STATE_CHANGED);
+		});
+	}
+	if(!*cursor)
+	{	*cursor = connection_changes_next;
+		return 0;
+	}
+	if(connection_changes_next - *cursor > CONNECTION_CHANGES_SIZE)
+	{	*cursor = connection_changes_next;
+		return -1;
+	}
+	while(*cursor != connection_changes_next && i < nCount)
+	{	memcpy(&buffer[i++],&connection_changes[*cursor & (CONNECTION_CHANGES_SIZE-1)],sizeof(connection_change_t));
+		(*cursor)++;
+	}
+	return i;
+}
+
+/* Find the connection that a plugin refers to by the low 32 bits of its global identifier. */
+static connection_t *plugin_connection_by_id(DWORD connection_id)
+{	connection_t *conn=connection_get_by_global_id(connection_id);
+	if(conn && (conn->global_identifier&0xffffffff)==connection_id)	return conn;
+	return NULL;
+}
+
+int __stdcall plugin_close_connection(DWORD connection_id)
+{	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+	{	if(CONN_IS_EDGE(conn))
+		{	edge_connection_t *conn1=TO_EDGE_CONN(conn);
+			connection_edge_end(conn1,END_STREAM_REASON_DONE);
+			if (conn1->socks_request)	conn1->socks_request->has_finished = 1;
 		}
-	});
+		if(!conn->marked_for_close)	connection_mark_for_close(conn);
+		return 1;
+	}
 	return 0;
 }
 
 void connection_read_event(connection_t *conn);
 void connection_write_event(connection_t *conn);
 int __stdcall plugin_connection_read(DWORD connection_id)
-{	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-		{	connection_read_event(conn);
-			return 1;
-		}
-	});
+{	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+	{	connection_read_event(conn);
+		return 1;
+	}
 	return 0;
 }
 
 int __stdcall plugin_connection_write(DWORD connection_id)
-{	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-		{	connection_write_event(conn);
-			return 1;
-		}
-	});
+{	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+	{	connection_write_event(conn);
+		return 1;
+	}
 	return 0;
 }
 
 char * __stdcall plugin_get_socks_address(DWORD connection_id,BOOL original_address)
-{	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-		{	if(CONN_IS_EDGE(conn))
-			{	edge_connection_t *conn1=TO_EDGE_CONN(conn);
-				if(conn1->socks_request)
-				{	if(original_address) return conn1->socks_request->original_address;
-					else return conn1->socks_request->address;
-				}
-				else return NULL;
+{	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+	{	if(CONN_IS_EDGE(conn))
+		{	edge_connection_t *conn1=TO_EDGE_CONN(conn);
+			if(conn1->socks_request)
+			{	if(original_address) return conn1->socks_request->original_address;
+				else return conn1->socks_request->address;
 			}
-			else	return NULL;
+			else return NULL;
 		}
-	});
+		else	return NULL;
+	}
 	return NULL;
 }
 
@@ -201,58 +276,46 @@ BOOL __stdcall plugin_set_socks_address(HANDLE plugin_instance,DWORD connection_
 {	plugin_info_t *plugin_tmp;
 	for(plugin_tmp=plugins;plugin_tmp && (plugin_tmp->hDll!=plugin_instance);plugin_tmp=plugin_tmp->next_plugin)	;
 	if(!plugin_tmp || !(plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_ADDRESSES)) return 0;
-	smartlist_t *conns=get_connection_array();
 	if(is_banned(original_address))	return 0;
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-		{	if(CONN_IS_EDGE(conn))
-			{	edge_connection_t *conn1=TO_EDGE_CONN(conn);
-				if(conn1->socks_request)
-				{	conn1->socks_request->command=command;
-					if(conn1->socks_request->address)
-						tor_free(conn1->socks_request->address);
-					if(conn1->socks_request->original_address)
-						tor_free(conn1->socks_request->original_address);
-					conn1->socks_request->address = tor_strdup(original_address);
-					conn1->socks_request->original_address = tor_strdup(original_address);
-					circuit_t *circ=circuit_get_by_edge_conn(conn1);
-					if(!circ)	conn->state=AP_CONN_STATE_CIRCUIT_WAIT;
-					else	connection_ap_detach_retriable(conn1,TO_ORIGIN_CIRCUIT(circ),END_STREAM_REASON_MISC);
-					control_event_stream_status(conn1,STREAM_EVENT_NEW,0);
-					return connection_ap_handshake_rewrite_and_attach(conn1,NULL,NULL) + 1;
-				}
-				else return 0;
+	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+	{	if(CONN_IS_EDGE(conn))
+		{	edge_connection_t *conn1=TO_EDGE_CONN(conn);
+			if(conn1->socks_request)
+			{	conn1->socks_request->command=command;
+				if(conn1->socks_request->address)
+					tor_free(conn1->socks_request->address);
+				if(conn1->socks_request->original_address)
+					tor_free(conn1->socks_request->original_address);
+				conn1->socks_request->address = tor_strdup(original_address);
+				conn1->socks_request->original_address = tor_strdup(original_address);
+				circuit_t *circ=circuit_get_by_edge_conn(conn1);
+				if(!circ)	conn->state=AP_CONN_STATE_CIRCUIT_WAIT;
+				else	connection_ap_detach_retriable(conn1,TO_ORIGIN_CIRCUIT(circ),END_STREAM_REASON_MISC);
+				control_event_stream_status(conn1,STREAM_EVENT_NEW,0);
+				return connection_ap_handshake_rewrite_and_attach(conn1,NULL,NULL) + 1;
 			}
-			else	return 0;
+			else return 0;
 		}
-	});
+		else	return 0;
+	}
 	return 0;
 }
 
 edge_connection_t *find_connection_by_id(DWORD connection_id)
-{	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-		{	if(CONN_IS_EDGE(conn))	return TO_EDGE_CONN(conn);
-			return NULL;
-		}
-	});
+{	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+	{	if(CONN_IS_EDGE(conn))	return TO_EDGE_CONN(conn);
+		return NULL;
+	}
 	return NULL;
 }
 
 
 DWORD __stdcall plugin_get_connecting_process(DWORD connection_id)
-{	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)
-			return conn->pid;
-	});
+{	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)
+		return conn->pid;
 	return 0;
 }
 
@@ -562,12 +625,8 @@ LPARAM* __stdcall plugin_get_connection_param(HANDLE plugin_instance,DWORD conne
 {	plugin_info_t *plugin_tmp;
 	for(plugin_tmp=plugins;plugin_tmp && (plugin_tmp->hDll!=plugin_instance);plugin_tmp=plugin_tmp->next_plugin)	;
 	if(!plugin_tmp || (plugin_tmp->connection_param==-1)) return NULL;
-	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(connection_id==tmpid)	return (LPARAM *)&conn->lParam[plugin_tmp->connection_param];
-	});
+	connection_t *conn=plugin_connection_by_id(connection_id);
+	if(conn)	return (LPARAM *)&conn->lParam[plugin_tmp->connection_param];
 	return NULL;
 }
 
@@ -736,6 +795,31 @@ int __stdcall plugin_force_delete_subdir(char *fname)
 {	return ForceDeleteSubdir(fname);
 }
 
+/** Copy up to <b>nCount</b> of the most recent 100 ms bandwidth samples into <b>buffer</b>, oldest first; return how many were copied. Can be called from any thread. */
+int __stdcall plugin_get_bandwidth_samples(bw_sample_t *buffer,int nCount)
+{	if(!buffer)	return 0;
+	return rep_hist_get_bw_samples(buffer,nCount);
+}
+
+int __stdcall plugin_get_perf_stats(HANDLE hPlugin,const char *key,char *buffer,int buffer_size)
+{	char *answer;
+	int len;
+	(void) hPlugin;
+	if(!key)	return -1;
+	if(!strcmpstart(key,"perf/"))	key += 5;
+	answer = perf_get_stats(key);
+	if(!answer)	return -1;
+	len = (int)strlen(answer);
+	if(buffer && buffer_size > 0)	strlcpy(buffer,answer,buffer_size);
+	tor_free(answer);
+	return len;
+}
+
+void __stdcall plugin_reset_perf_stats(HANDLE hPlugin)
+{	(void) hPlugin;
+	perf_request_reset();
+}
+
 void *function_tbl[]={
 	&plugin_log,
 	&plugin_tor_is_started,
@@ -791,6 +875,18 @@ void *function_tbl[]={
 	&plugin_changeDialogStrings,
 	&plugin_force_delete_file,
 	&plugin_force_delete_subdir,
+	&geoip_get_countries_by_ip,
+	&plugin_get_bandwidth_samples,
+	&plugin_set_traffic_filter,
+	&plugin_complete_translate_address,
+	&plugin_ipset_new,
+	&plugin_ipset_add,
+	&plugin_ipset_add_string,
+	&plugin_ipset_contains,
+	&plugin_ipset_free,
+	&plugin_get_connection_changes,
+	&plugin_get_perf_stats,
+	&plugin_reset_perf_stats,
 	NULL
 };
 
@@ -912,6 +1008,190 @@ void dlg_set_all_plugins(void)
 	}
 }
 
+/** Remove all traffic filters of <b>plugin_tmp</b>. */
+static void plugins_free_filters(plugin_info_t *plugin_tmp)
+{	if(plugin_tmp->traffic_filters)
+	{	SMARTLIST_FOREACH(plugin_tmp->traffic_filters,plugin_filter_t *,filter,
+		{	tor_free(filter->value);
+			tor_free(filter);
+		});
+		smartlist_free(plugin_tmp->traffic_filters);
+		plugin_tmp->traffic_filters = NULL;
+	}
+}
+
+/** Make all connections rebuild their lists of plugins that see their traffic. */
+void plugins_traffic_changed(void)
+{	plugins_traffic_generation++;
+}
+
+BOOL __stdcall plugin_set_traffic_filter(HANDLE plugin_instance,int filter_type,const char *value)
+{	plugin_info_t *plugin_tmp;
+	plugin_filter_t *filter;
+	for(plugin_tmp=plugins;plugin_tmp && (plugin_tmp->hDll!=plugin_instance);plugin_tmp=plugin_tmp->next_plugin)	;
+	if(!plugin_tmp || !(plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC)) return 0;
+	if(filter_type==PLUGIN_FILTER_NONE)
+	{	plugins_free_filters(plugin_tmp);
+		plugins_traffic_changed();
+		return 1;
+	}
+	if(filter_type<PLUGIN_FILTER_ADDRESS || filter_type>PLUGIN_FILTER_HIDDEN_SERVICE) return 0;
+	if(filter_type!=PLUGIN_FILTER_HIDDEN_SERVICE && (!value || !*value)) return 0;
+	filter = tor_malloc_zero(sizeof(plugin_filter_t));
+	filter->type = filter_type;
+	if(filter_type==PLUGIN_FILTER_PORT)
+	{	filter->port = atoi(value);
+		if(filter->port<=0 || filter->port>65535)
+		{	tor_free(filter);
+			return 0;
+		}
+	}
+	else if(filter_type!=PLUGIN_FILTER_HIDDEN_SERVICE)	filter->value = tor_strdup(value);
+	if(!plugin_tmp->traffic_filters)	plugin_tmp->traffic_filters = smartlist_create();
+	smartlist_add(plugin_tmp->traffic_filters,filter);
+	plugins_traffic_changed();
+	return 1;
+}
+
+/** An IP range set that a plugin created with plugin_ipset_new(). */
+typedef struct plugin_ipset_t
+{	HANDLE hDll;	/**< The plugin that owns this set. */
+	ip_range_set_t *set;
+} plugin_ipset_t;
+
+/** Protects <b>plugin_ipsets</b> and the sets in it; plugins can use their sets from any thread. */
+static tor_mutex_t *plugin_ipset_mutex = NULL;
+/** All plugin_ipset_t that were created by plugins. */
+static smartlist_t *plugin_ipsets = NULL;
+
+/** Return the set <b>ipset</b> if it was created by <b>plugin_instance</b>, or NULL. Called with plugin_ipset_mutex held. */
+static plugin_ipset_t *plugin_ipset_get(HANDLE plugin_instance,HANDLE ipset)
+{	plugin_ipset_t *r = (plugin_ipset_t *)ipset;
+	if(!r || !smartlist_isin(plugin_ipsets,r) || r->hDll != plugin_instance)	return NULL;
+	return r;
+}
+
+HANDLE __stdcall plugin_ipset_new(HANDLE plugin_instance)
+{	plugin_info_t *plugin_tmp;
+	plugin_ipset_t *r;
+	for(plugin_tmp=plugins;plugin_tmp && (plugin_tmp->hDll!=plugin_instance);plugin_tmp=plugin_tmp->next_plugin)	;
+	if(!plugin_tmp || !plugin_ipset_mutex) return NULL;
+	r = tor_malloc_zero(sizeof(plugin_ipset_t));
+	r->hDll = plugin_instance;
+	r->set = ip_range_set_new();
+	tor_mutex_acquire(plugin_ipset_mutex);
+	smartlist_add(plugin_ipsets,r);
+	tor_mutex_release(plugin_ipset_mutex);
+	return (HANDLE)r;
+}
+
+BOOL __stdcall plugin_ipset_add(HANDLE plugin_instance,HANDLE ipset,DWORD low,DWORD high)
+{	plugin_ipset_t *r;
+	if(!plugin_ipset_mutex)	return 0;
+	tor_mutex_acquire(plugin_ipset_mutex);
+	r = plugin_ipset_get(plugin_instance,ipset);
+	if(r)	ip_range_set_add(r->set,low,high);
+	tor_mutex_release(plugin_ipset_mutex);
+	return r != NULL;
+}
+
+/** Parse one range from <b>s</b>: "IP", "IP/mask" or "IP-IP". Return 0 on success, -1 if <b>s</b> is not a valid range. */
+static int plugin_ipset_parse_range(const char *s,uint32_t *low,uint32_t *high)
+{	struct in_addr in;
+	const char *p;
+	char *tmp;
+	uint32_t addr;
+	maskbits_t bits;
+	uint16_t port_min,port_max;
+	int r = -1;
+	if((p = strchr(s,'-')) != NULL)
+	{	tmp = tor_strndup(s,p-s);
+		if(tor_inet_aton(tmp,&in))
+		{	*low = ntohl(in.s_addr);
+			if(tor_inet_aton(p+1,&in))
+			{	*high = ntohl(in.s_addr);
+				r = 0;
+			}
+		}
+		tor_free(tmp);
+		return r;
+	}
+	if(parse_addr_and_port_range(s,&addr,&bits,&port_min,&port_max))	return -1;
+	if(bits > 32)	bits = 32;
+	*low = addr & (bits ? (0xffffffffu << (32 - bits)) : 0);
+	*high = bits ? (*low | (0xffffffffu >> bits)) : 0xffffffffu;
+	return 0;
+}
+
+int __stdcall plugin_ipset_add_string(HANDLE plugin_instance,HANDLE ipset,const char *ranges)
+{	plugin_ipset_t *r;
+	smartlist_t *lines;
+	uint32_t low,high;
+	char *tmp,*p;
+	int n = 0;
+	if(!plugin_ipset_mutex || !ranges)	return -1;
+	tmp = tor_strdup(ranges);
+	for(p = tmp;*p;p++)
+	{	if(*p == '\r' || *p == '\n' || *p == ',' || *p == ';')	*p = ' ';
+	}
+	lines = smartlist_create();
+	smartlist_split_string(lines,tmp,NULL,SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK,0);
+	tor_free(tmp);
+	tor_mutex_acquire(plugin_ipset_mutex);
+	r = plugin_ipset_get(plugin_instance,ipset);
+	if(!r)	n = -1;
+	else
+	{	SMARTLIST_FOREACH(lines,char *,line,
+		{	if(!plugin_ipset_parse_range(line,&low,&high))
+			{	ip_range_set_add(r->set,low,high);
+				n++;
+			}
+		});
+	}
+	tor_mutex_release(plugin_ipset_mutex);
+	SMARTLIST_FOREACH(lines,char *,line,tor_free(line));
+	smartlist_free(lines);
+	return n;
+}
+
+BOOL __stdcall plugin_ipset_contains(HANDLE plugin_instance,HANDLE ipset,DWORD ip)
+{	plugin_ipset_t *r;
+	BOOL result = 0;
+	if(!plugin_ipset_mutex)	return 0;
+	tor_mutex_acquire(plugin_ipset_mutex);
+	r = plugin_ipset_get(plugin_instance,ipset);
+	if(r)	result = ip_range_set_contains(r->set,ip);
+	tor_mutex_release(plugin_ipset_mutex);
+	return result;
+}
+
+void __stdcall plugin_ipset_free(HANDLE plugin_instance,HANDLE ipset)
+{	plugin_ipset_t *r;
+	if(!plugin_ipset_mutex)	return;
+	tor_mutex_acquire(plugin_ipset_mutex);
+	r = plugin_ipset_get(plugin_instance,ipset);
+	if(r)
+	{	smartlist_remove(plugin_ipsets,r);
+		ip_range_set_free(r->set);
+		tor_free(r);
+	}
+	tor_mutex_release(plugin_ipset_mutex);
+}
+
+/** Free all IP range sets that were created by the plugin <b>hDll</b>. */
+static void plugins_ipsets_free(HANDLE hDll)
+{	if(!plugin_ipset_mutex)	return;
+	tor_mutex_acquire(plugin_ipset_mutex);
+	SMARTLIST_FOREACH(plugin_ipsets,plugin_ipset_t *,r,
+	{	if(r->hDll == hDll)
+		{	ip_range_set_free(r->set);
+			tor_free(r);
+			SMARTLIST_DEL_CURRENT(plugin_ipsets,r);
+		}
+	});
+	tor_mutex_release(plugin_ipset_mutex);
+}
+
 void remove_all_functions(plugin_info_t *plugin_tmp)
 {	plugin_tmp->InitPlugin=NULL;
 	plugin_tmp->UnloadPlugin=NULL;
@@ -921,7 +1201,11 @@ void remove_all_functions(plugin_info_t *plugin_tmp)
 	plugin_tmp->UnregisterConnection=NULL;
 	plugin_tmp->ConnectionRead=NULL;
 	plugin_tmp->ConnectionWrite=NULL;
+	plugin_tmp->ConnectionReadV=NULL;
+	plugin_tmp->ConnectionWriteV=NULL;
 	plugin_tmp->TranslateAddress=NULL;
+	if(plugin_tmp->TranslateAddressAsync)	plugins_async_forget(plugin_tmp->hDll);
+	plugin_tmp->TranslateAddressAsync=NULL;
 	plugin_tmp->ChangeIdentity=NULL;
 	plugin_tmp->AdvTorStart=NULL;
 	plugin_tmp->RouterChanged=NULL;
@@ -929,6 +1213,9 @@ void remove_all_functions(plugin_info_t *plugin_tmp)
 	plugin_tmp->HiddenService_HandleRead=NULL;
 	plugin_tmp->InterceptProcess=NULL;
 	plugin_tmp->LanguageChange=NULL;
+	plugins_free_filters(plugin_tmp);
+	plugins_ipsets_free(plugin_tmp->hDll);
+	plugins_traffic_changed();
 	if(plugin_tmp->loaded_lng)	tor_free(plugin_tmp->loaded_lng);
 	if(plugin_tmp->lngfile)		tor_free(plugin_tmp->lngfile);
 	plugin_tmp->loaded_lng = NULL;
@@ -972,7 +1259,10 @@ void load_plugin(plugin_info_t *plugin_tmp)
 			plugin_tmp->UnregisterConnection=(LP_UnregisterConnection)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_CLOSECONN);
 			plugin_tmp->ConnectionRead=(LP_ConnectionRead)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_CONN_READ);
 			plugin_tmp->ConnectionWrite=(LP_ConnectionWrite)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_CONN_WRITE);
+			plugin_tmp->ConnectionReadV=(LP_ConnectionReadV)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_CONN_READV);
+			plugin_tmp->ConnectionWriteV=(LP_ConnectionWriteV)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_CONN_WRITEV);
 			plugin_tmp->TranslateAddress=(LP_TranslateAddress)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_REWRITE_ADDR);
+			plugin_tmp->TranslateAddressAsync=(LP_TranslateAddressAsync)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_REWRITE_ADDR_ASYNC);
 			plugin_tmp->ChangeIdentity=(LP_ChangeIdentity)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_NEW_IDENTITY);
 			plugin_tmp->AdvTorStart=(LP_Start)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_START);
 			plugin_tmp->RouterChanged=(LP_RouterChanged)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_ROUTERCHANGED);
@@ -980,6 +1270,7 @@ void load_plugin(plugin_info_t *plugin_tmp)
 			plugin_tmp->HiddenService_HandleRead=(LP_HiddenService_HandleRead)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_HS_HANDLEREAD);
 			plugin_tmp->InterceptProcess=(LP_InterceptProcess)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_INTERCEPT_PROCESS);
 			plugin_tmp->LanguageChange=(LP_LanguageChange)GetProcAddress(plugin_tmp->hDll,PLUGIN_FN_LANGUAGE_CHANGE);
+			plugins_traffic_changed();
 			if(plugin_tmp->InitPlugin)
 			{	plugin_tmp->load_status &= PLUGIN_LOADSTATUS_INIT_FAILED^PLUGIN_LOADSTATUS_MASK;
 				if((plugin_tmp->InitPlugin)(plugin_tmp->hDll,ADVTOR_DW_VER,plugin_tmp->description,function_tbl))
@@ -1018,6 +1309,7 @@ void set_plugins_config(void)
 {	or_options_t *options=get_options();
 	config_line_t *cfg,**cfg1;
 	plugin_info_t *plugin_tmp;
+	plugins_traffic_changed();
 	char *plname=tor_malloc(1024);
 	while(options->Plugins)
 	{	tor_free(options->Plugins->key);tor_free(options->Plugins->value);
@@ -1143,8 +1435,10 @@ void add_plugins(or_options_t *options)
 
 void remove_plugins(void)
 {	plugin_info_t *plugin_tmp;
+	plugins_traffic_changed();
 	while(plugins)
 	{	plugin_tmp=plugins->next_plugin;
+		plugins_free_filters(plugins);
 		tor_free(plugins);
 		plugins=plugin_tmp;
 	}
@@ -1160,6 +1454,10 @@ void load_plugins(void)
 	int i;
 	for(i=0;i<MAX_PLUGIN_CONNECTION_PARAMS;i++)	connection_params[i]=0;
 	next_plugin_id = crypto_rand_int(0x3fff) | 0x1500;
+	if(!plugin_ipset_mutex)
+	{	plugin_ipset_mutex = tor_mutex_new();
+		plugin_ipsets = smartlist_create();
+	}
 	if(!options->Plugins)	refresh_plugins(options);
 	else add_plugins(options);
 	if(plugins)	load_all_plugins();
@@ -1334,23 +1632,42 @@ void get_dll_name(char *s1,HANDLE hPlugin)
 
 
 
+/** Run <b>stmt</b>, a call to the <b>callback</b> of <b>plugin</b>, and report how long it took if somebody is tracing plugin callbacks. The watchdog blames the plugin if the call stalls the tor thread. */
+#define PLUGIN_TIMED_CALL(plugin,callback,stmt) \
+	do \
+	{	watchdog_push(callback,(plugin)->dll_name); \
+		if(etw_enabled(ETW_KW_PLUGINS)) \
+		{	uint64_t etw_started = perf_now_usec(); \
+			stmt; \
+			etw_plugin_callback((plugin)->dll_name,callback,perf_now_usec() - etw_started); \
+		} \
+		else	{ stmt; } \
+		watchdog_pop(); \
+	} while(0)
+
 int plugins_connection_add(connection_t *conn)
 {	plugin_info_t *plugin_tmp;
+	int r;
 	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
 	{	if(plugin_tmp->RegisterConnection && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC && plugin_tmp->rights&PLUGIN_RIGHT__CAN_CREATE_OR_CONNECTIONS)
-		{	if((plugin_tmp->RegisterConnection)(conn->global_identifier&0xffffffff,conn->type,conn->address,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param])==0)	return -1;
+		{	PLUGIN_TIMED_CALL(plugin_tmp,"RegisterConnection",r = (plugin_tmp->RegisterConnection)(conn->global_identifier&0xffffffff,conn->type,conn->address,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]));
+			if(r==0)	return -1;
 		}
 	}
+	if(connection_changes_enabled)	connection_change_add(conn,PLUGIN_CONNECTION_OPENED);
 	return 0;
 }
 
 int plugins_connection_remove(connection_t *conn)
 {	plugin_info_t *plugin_tmp;
+	int r;
 	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
 	{	if(plugin_tmp->UnregisterConnection && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC && plugin_tmp->rights&PLUGIN_RIGHT__CAN_CREATE_OR_CONNECTIONS)
-		{	if((plugin_tmp->UnregisterConnection)(conn->global_identifier&0xffffffff,conn->type,conn->address,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param])==0)	return -1;
+		{	PLUGIN_TIMED_CALL(plugin_tmp,"UnregisterConnection",r = (plugin_tmp->UnregisterConnection)(conn->global_identifier&0xffffffff,conn->type,conn->address,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]));
+			if(r==0)	return -1;
 		}
 	}
+	if(connection_changes_enabled)	connection_change_add(conn,PLUGIN_CONNECTION_CLOSED);
 	return 0;
 }
 
@@ -1366,21 +1683,208 @@ void close_connection(connection_t *conn)
 	if(!conn->marked_for_close)	connection_mark_for_close(conn);
 }
 
-void plugins_read_event(connection_t *conn,size_t before)
+#define PLUGIN_IOV_STACK 16
+
+/** Copy <b>len</b> bytes starting at <b>offset</b> in the data described by <b>iov</b> to <b>out</b>. */
+static void plugins_iov_copy(const plugin_iovec_t *iov,int iovcnt,int offset,int len,char *out)
+{	int i,n;
+	for(i=0;i<iovcnt && len;i++)
+	{	if(offset >= iov[i].len)
+		{	offset -= iov[i].len;
+			continue;
+		}
+		n = iov[i].len-offset;
+		if(n > len) n = len;
+		memcpy(out,iov[i].data+offset,n);
+		out += n;len -= n;offset = 0;
+	}
+}
+
+/** Replace the <b>total</b> bytes after the first <b>before</b> bytes of <b>buf</b>, which <b>iov</b> describes, with the result of applying the <b>n</b> ranges in <b>rep</b> to them. Return 0 on success, or -1 if the ranges are not sorted, overlap or are out of bounds. */
+static int plugins_apply_replacements(buf_t *buf,size_t before,int total,const plugin_iovec_t *iov,int iovcnt,const plugin_replace_t *rep,int n)
+{	int i,pos=0,newlen=0;
+	char *out,*p;
+	for(i=0;i<n;i++)
+	{	if(rep[i].offset < pos || rep[i].len < 0 || rep[i].len > total-rep[i].offset || rep[i].data_len < 0 || (rep[i].data_len && !rep[i].data))
+			return -1;
+		newlen += rep[i].offset-pos+rep[i].data_len;
+		pos = rep[i].offset+rep[i].len;
+	}
+	newlen += total-pos;
+	out = p = tor_malloc(newlen+1);
+	for(i=0,pos=0;i<n;i++)
+	{	plugins_iov_copy(iov,iovcnt,pos,rep[i].offset-pos,p);
+		p += rep[i].offset-pos;
+		if(rep[i].data_len)
+		{	memcpy(p,rep[i].data,rep[i].data_len);
+			p += rep[i].data_len;
+		}
+		pos = rep[i].offset+rep[i].len;
+	}
+	plugins_iov_copy(iov,iovcnt,pos,total-pos,p);
+	buf_truncate(buf,before);
+	write_to_buf(out,newlen,buf);
+	tor_free(out);
+	return 0;
+}
+
+/** Show the data after the first <b>before</b> bytes of <b>buf</b> to the v2 callback <b>fn</b> of <b>plugin_tmp</b> as read-only views of the buffer chunks, and apply the ranges that it replaces. If <b>hs_read</b> is true, the hidden service handler of the plugin sees the data first. Return -1 if the connection must be closed, 1 if the data was changed, 0 otherwise. */
+static int plugins_translate_buf(connection_t *conn,buf_t *buf,size_t before,plugin_info_t *plugin_tmp,LP_ConnectionReadV fn,int hs_read)
+{	plugin_iovec_t iov_stack[PLUGIN_IOV_STACK],*iov=iov_stack;
+	plugin_replace_t rep[PLUGIN_MAX_REPLACEMENTS];
+	LPARAM *lParam=(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param];
+	chunk_t *chunk;
+	size_t skip=before;
+	int iovcnt=0,iov_size=PLUGIN_IOV_STACK,total=0,i,r=0;
+	for(chunk=buf->head;chunk;chunk=chunk->next)
+	{	if(skip >= chunk->datalen)
+		{	skip -= chunk->datalen;
+			continue;
+		}
+		if(iovcnt==iov_size)
+		{	iov_size *= 2;
+			if(iov==iov_stack)
+			{	iov=tor_malloc(iov_size*sizeof(plugin_iovec_t));
+				memcpy(iov,iov_stack,sizeof(iov_stack));
+			}
+			else	iov=tor_realloc(iov,iov_size*sizeof(plugin_iovec_t));
+		}
+		iov[iovcnt].data = chunk->data+skip;
+		iov[iovcnt].len = (int)(chunk->datalen-skip);
+		total += iov[iovcnt].len;
+		iovcnt++;
+		skip = 0;
+	}
+	if(hs_read)
+	{	for(i=0;i<iovcnt;i++)
+		{	if(!(plugin_tmp->HiddenService_HandleRead)(conn->address,conn->global_identifier&0xffffffff,(char *)iov[i].data,iov[i].len,lParam))
+			{	r = -1;
+				break;
+			}
+		}
+	}
+	if(r==0)
+	{	r = (fn)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,iov,iovcnt,rep,PLUGIN_MAX_REPLACEMENTS,lParam);
+		if(r < 0)	r = -1;
+		else if(r > 0)
+		{	if(r > PLUGIN_MAX_REPLACEMENTS) r = PLUGIN_MAX_REPLACEMENTS;
+			if(plugins_apply_replacements(buf,before,total,iov,iovcnt,rep,r) < 0)
+			{	log(LOG_WARN,LD_APP,get_lang_str(LANG_PLUGINS_INVALID_REPLACEMENTS),plugin_tmp->dll_name,(unsigned int)(conn->global_identifier&0xffffffff));
+				r = 0;
+			}
+			else	r = 1;
+		}
+	}
+	if(iov!=iov_stack)	tor_free(iov);
+	return r;
+}
+
+/** Make sure that the last chunk of <b>buf</b> is empty when there is no new data after the first <b>before</b> bytes, so AdvTor_HandleRead()/AdvTor_HandleWrite() have somewhere to write. */
+static void plugins_add_empty_chunk(buf_t *buf,size_t before)
+{	if(before==buf->datalen)
+	{	if(!buf->tail || buf->tail->datalen)
+			buf_add_chunk_with_capacity(buf,4096,0);
+	}
+}
+
+/** Return 1 if the filters of <b>plugin_tmp</b> select <b>conn</b>, 0 if they don't, or -1 if we can't tell yet because we don't know where <b>conn</b> goes. <b>process</b> is a buffer of MAX_PATH+1 bytes that caches the name of the process that opened <b>conn</b>. */
+static int plugin_filters_match(plugin_info_t *plugin_tmp,connection_t *conn,char *process)
+{	plugin_filter_t *filter;
+	const char *address=conn->address,*base;
+	int port=conn->port,unknown=0,r=0,i;
+	if(!plugin_tmp->traffic_filters || !smartlist_len(plugin_tmp->traffic_filters))	return 1;
+	if(CONN_IS_EDGE(conn) && TO_EDGE_CONN(conn)->socks_request)
+	{	address = TO_EDGE_CONN(conn)->socks_request->address;
+		port = TO_EDGE_CONN(conn)->socks_request->port;
+		if(!address[0])	unknown = 1;
+	}
+	for(i=0;i<smartlist_len(plugin_tmp->traffic_filters);i++)
+	{	filter = smartlist_get(plugin_tmp->traffic_filters,i);
+		switch(filter->type)
+		{	case PLUGIN_FILTER_ADDRESS:
+				if(unknown)	r = -1;
+				else if(address && (!strcasecmp(address,filter->value) || (filter->value[0]=='*' && !strcasecmpend(address,filter->value+1))))	return 1;
+				break;
+			case PLUGIN_FILTER_PORT:
+				if(unknown)	r = -1;
+				else if(port==filter->port)	return 1;
+				break;
+			case PLUGIN_FILTER_PROCESS:
+				if(conn->pid)
+				{	if(!process[0])	getProcessName(process,MAX_PATH,conn->pid);
+					base = strrchr(process,'\\');
+					base = base ? base+1 : process;
+					if(!strcasecmp(filter->value,strchr(filter->value,'\\') ? process : base))	return 1;
+				}
+				break;
+			case PLUGIN_FILTER_HIDDEN_SERVICE:
+				if(conn->hs_plugin && conn->hPlugin==plugin_tmp->hDll)	return 1;
+				break;
+			default:
+				break;
+		}
+	}
+	return r;
+}
+
+/** Return the plugins that see the traffic of <b>conn</b>, in plugin order, and set *<b>n</b> to their number. The list is rebuilt only when the plugins or their filters changed, or while we don't know where <b>conn</b> goes; until then, plugins that filter by address or port see its traffic. */
+static plugin_info_t **plugins_get_traffic_plugins(connection_t *conn,int *n)
 {	plugin_info_t *plugin_tmp;
+	char process[MAX_PATH+1];
+	int i=0,r,partial=0;
+	if(conn->traffic_plugins_generation!=plugins_traffic_generation)
+	{	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)	i++;
+		tor_free(conn->traffic_plugins);
+		conn->n_traffic_plugins = 0;
+		if(i)	conn->traffic_plugins = tor_malloc(i*sizeof(plugin_info_t *));
+		process[0] = 0;
+		for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
+		{	if(conn->hs_plugin && plugin_tmp->HiddenService_HandleRead && plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER && (plugin_tmp->hDll==conn->hPlugin))
+				r = 1;
+			else if((plugin_tmp->ConnectionRead || plugin_tmp->ConnectionWrite || plugin_tmp->ConnectionReadV || plugin_tmp->ConnectionWriteV) && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC)
+				r = plugin_filters_match(plugin_tmp,conn,process);
+			else	r = 0;
+			if(r < 0)	partial = 1;
+			if(r)	conn->traffic_plugins[conn->n_traffic_plugins++] = plugin_tmp;
+		}
+		conn->traffic_plugins_generation = partial ? 0 : plugins_traffic_generation;
+	}
+	*n = conn->n_traffic_plugins;
+	return conn->traffic_plugins;
+}
+
+void plugins_read_event(connection_t *conn,size_t before)
+{	plugin_info_t *plugin_tmp,**traffic_plugins;
 	buf_t *buf=conn->inbuf;
 	chunk_t *dest=NULL,*next_dest;
-	size_t tmppos=before;
-	int r,data_size,capacity;
-	if(before==buf->datalen)
-	{	if(!buf->tail || buf->tail->datalen)
-			buf_add_chunk_with_capacity(buf,4096,0);
+	size_t tmppos;
+	int r,data_size,capacity,v1_plugins=0,i,n_plugins;
+	traffic_plugins = plugins_get_traffic_plugins(conn,&n_plugins);
+	if(!n_plugins)	return;
+	if(buf->datalen < before) before = buf->datalen;
+	tmppos = before;
+	for(i=0;i<n_plugins;i++)
+	{	plugin_tmp=traffic_plugins[i];
+		if(plugin_tmp->ConnectionRead && !plugin_tmp->ConnectionReadV && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC)
+			v1_plugins++;
 	}
-	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
-	{	if(plugin_tmp->ConnectionRead && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC)
+	if(v1_plugins)	plugins_add_empty_chunk(buf,before);
+	for(i=0;i<n_plugins;i++)
+	{	plugin_tmp=traffic_plugins[i];
+		if(plugin_tmp->ConnectionReadV && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC)
+		{	r = plugins_translate_buf(conn,buf,before,plugin_tmp,plugin_tmp->ConnectionReadV,conn->hs_plugin&&plugin_tmp->HiddenService_HandleRead && plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER && (plugin_tmp->hDll==conn->hPlugin));
+			if(r==-1)
+			{	close_connection(conn);
+				return;
+			}
+			else if(r==1)
+			{	dest=NULL;tmppos=before;
+				if(v1_plugins)	plugins_add_empty_chunk(buf,before);
+			}
+		}
+		else if(plugin_tmp->ConnectionRead && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC)
 		{	if(!dest)
-			{	if(buf->datalen < before) before = buf->datalen;
-				dest=buf->head;
+			{	dest=buf->head;
 				while(tmppos)
 				{	if(dest->datalen > tmppos) break;
 					else if(dest->datalen == tmppos)
@@ -1403,7 +1907,7 @@ void plugins_read_event(connection_t *conn,size_t before)
 						return;
 					}
 				}
-				r = (plugin_tmp->ConnectionRead)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,dest->data+tmppos,&data_size,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]);
+				PLUGIN_TIMED_CALL(plugin_tmp,"ConnectionRead",r = (plugin_tmp->ConnectionRead)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,dest->data+tmppos,&data_size,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]));
 				data_size -= dest->datalen-tmppos;
 				buf->datalen += data_size;
 				dest->datalen += data_size;
@@ -1431,7 +1935,7 @@ void plugins_read_event(connection_t *conn,size_t before)
 						return;
 					}
 				}
-				r = (plugin_tmp->ConnectionRead)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,next_dest->data,(int *)&next_dest->datalen,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]);
+				PLUGIN_TIMED_CALL(plugin_tmp,"ConnectionRead",r = (plugin_tmp->ConnectionRead)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,next_dest->data,(int *)&next_dest->datalen,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]));
 				if(r==-1)
 				{	close_connection(conn);
 					return;
@@ -1447,21 +1951,51 @@ void plugins_read_event(connection_t *conn,size_t before)
 	}
 }
 
+/* Return true iff plugins_write_event() would let a plugin look at or change what we write on <b>conn</b>. */
+int plugins_translate_writes(connection_t *conn)
+{	plugin_info_t *plugin_tmp,**traffic_plugins;
+	int i,n_plugins;
+	traffic_plugins = plugins_get_traffic_plugins(conn,&n_plugins);
+	for(i=0;i<n_plugins;i++)
+	{	plugin_tmp=traffic_plugins[i];
+		if(((plugin_tmp->ConnectionWrite || plugin_tmp->ConnectionWriteV) && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) || ((conn->hs_plugin)&&(plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER)&&(plugin_tmp->HiddenService_HandleRead)))
+			return 1;
+	}
+	return 0;
+}
+
 void plugins_write_event(connection_t *conn,size_t before)
-{	plugin_info_t *plugin_tmp;
+{	plugin_info_t *plugin_tmp,**traffic_plugins;
 	buf_t *buf=conn->outbuf;
 	chunk_t *dest=NULL,*next_dest;
-	size_t tmppos=before;
-	int r,data_size,capacity;
-	if(before==buf->datalen)
-	{	if(!buf->tail || buf->tail->datalen)
-			buf_add_chunk_with_capacity(buf,4096,0);
+	size_t tmppos;
+	int r,data_size,capacity,v1_plugins=0,i,n_plugins;
+	traffic_plugins = plugins_get_traffic_plugins(conn,&n_plugins);
+	if(!n_plugins)	return;
+	if(buf->datalen < before) before = buf->datalen;
+	tmppos = before;
+	for(i=0;i<n_plugins;i++)
+	{	plugin_tmp=traffic_plugins[i];
+		if((plugin_tmp->ConnectionWrite && !plugin_tmp->ConnectionWriteV && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) || ((conn->hs_plugin)&&(plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER)&&(plugin_tmp->HiddenService_HandleRead)))
+			v1_plugins++;
 	}
-	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
-	{	if((plugin_tmp->ConnectionWrite && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) || ((conn->hs_plugin)&&(plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER)&&(plugin_tmp->HiddenService_HandleRead)))
+	if(v1_plugins)	plugins_add_empty_chunk(buf,before);
+	for(i=0;i<n_plugins;i++)
+	{	plugin_tmp=traffic_plugins[i];
+		if(plugin_tmp->ConnectionWriteV && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC && !(conn->hs_plugin&&plugin_tmp->HiddenService_HandleRead && (plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER) && (plugin_tmp->hDll==conn->hPlugin)))
+		{	r = plugins_translate_buf(conn,buf,before,plugin_tmp,plugin_tmp->ConnectionWriteV,0);
+			if(r==-1)
+			{	close_connection(conn);
+				return;
+			}
+			else if(r==1)
+			{	dest=NULL;tmppos=before;
+				if(v1_plugins)	plugins_add_empty_chunk(buf,before);
+			}
+		}
+		else if((plugin_tmp->ConnectionWrite && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) || ((conn->hs_plugin)&&(plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER)&&(plugin_tmp->HiddenService_HandleRead)))
 		{	if(!dest)
-			{	if(buf->datalen < before) before = buf->datalen;
-				dest=buf->head;
+			{	dest=buf->head;
 				while(tmppos)
 				{	if(dest->datalen > tmppos) break;
 					else if(dest->datalen == tmppos)
@@ -1484,7 +2018,7 @@ void plugins_write_event(connection_t *conn,size_t before)
 						return;
 					}
 				}
-				else if(plugin_tmp->ConnectionWrite && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) r = (plugin_tmp->ConnectionWrite)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,dest->data+tmppos,&data_size,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]);
+				else if(plugin_tmp->ConnectionWrite && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) PLUGIN_TIMED_CALL(plugin_tmp,"ConnectionWrite",r = (plugin_tmp->ConnectionWrite)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,dest->data+tmppos,&data_size,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]));
 				else continue;
 				data_size -= dest->datalen-tmppos;
 				buf->datalen += data_size;
@@ -1513,7 +2047,7 @@ void plugins_write_event(connection_t *conn,size_t before)
 						return;
 					}
 				}
-				else if(plugin_tmp->ConnectionWrite && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) r = (plugin_tmp->ConnectionWrite)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,next_dest->data,(int *)&next_dest->datalen,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]);
+				else if(plugin_tmp->ConnectionWrite && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_CLIENT_TRAFFIC) PLUGIN_TIMED_CALL(plugin_tmp,"ConnectionWrite",r = (plugin_tmp->ConnectionWrite)(conn->global_identifier&0xffffffff,conn->type,conn->state,conn->address,next_dest->data,(int *)&next_dest->datalen,capacity,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&conn->lParam[plugin_tmp->connection_param]));
 				else continue;
 				if(r==-1)
 				{	close_connection(conn);
@@ -1535,39 +2069,35 @@ BOOL __stdcall plugin_hs_send_reply(HANDLE plugin_instance,DWORD client_id,char
 	buf_t *buf;chunk_t *dest;
 	for(plugin_tmp=plugins;plugin_tmp && (plugin_tmp->hDll!=plugin_instance);plugin_tmp=plugin_tmp->next_plugin)	;
 	if(!plugin_tmp || !(plugin_tmp->rights&PLUGIN_RIGHT__HIDDEN_SERVICE_PROVIDER)) return 0;
-	smartlist_t *conns=get_connection_array();
-	DWORD tmpid;
-	SMARTLIST_FOREACH(conns, connection_t *, conn,{
-		tmpid=conn->global_identifier&0xffffffff;
-		if(client_id==tmpid)
-		{	if(conn->hs_plugin)
-			{	buf=conn->inbuf;dest=NULL;
-				dest=buf->head;
-				if(dest)
-				{	while(dest->next)	dest=dest->next;
-				}
-				chunk_t *new_chunk=buf_add_chunk_with_capacity(buf,buffer_size,0);
-				memmove(new_chunk->data,buffer,buffer_size);
-				new_chunk->datalen = buffer_size;
-				buf->datalen += buffer_size;
-				connection_read_event(conn);
+	connection_t *conn=plugin_connection_by_id(client_id);
+	if(conn)
+	{	if(conn->hs_plugin)
+		{	buf=conn->inbuf;dest=NULL;
+			dest=buf->head;
+			if(dest)
+			{	while(dest->next)	dest=dest->next;
 			}
-			else
-			{	buf=conn->outbuf;dest=NULL;
-				dest=buf->head;
-				if(dest)
-				{	while(dest->next)	dest=dest->next;
-				}
-				chunk_t *new_chunk=buf_add_chunk_with_capacity(buf,buffer_size,0);
-				memmove(new_chunk->data,buffer,buffer_size);
-				new_chunk->datalen = buffer_size;
-				buf->datalen += buffer_size;
-				conn->outbuf_flushlen += buffer_size;
-				connection_start_writing(conn);
+			chunk_t *new_chunk=buf_add_chunk_with_capacity(buf,buffer_size,0);
+			memmove(new_chunk->data,buffer,buffer_size);
+			new_chunk->datalen = buffer_size;
+			buf->datalen += buffer_size;
+			connection_read_event(conn);
+		}
+		else
+		{	buf=conn->outbuf;dest=NULL;
+			dest=buf->head;
+			if(dest)
+			{	while(dest->next)	dest=dest->next;
 			}
-			return 1;
+			chunk_t *new_chunk=buf_add_chunk_with_capacity(buf,buffer_size,0);
+			memmove(new_chunk->data,buffer,buffer_size);
+			new_chunk->datalen = buffer_size;
+			buf->datalen += buffer_size;
+			conn->outbuf_flushlen += buffer_size;
+			connection_start_writing(conn);
 		}
-	});
+		return 1;
+	}
 	return 0;
 }
 
@@ -1577,13 +2107,13 @@ int plugins_remap(edge_connection_t *conn,char **address,char *original_address,
 	int r;
 	char *addrtmp = NULL;
 	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
-	{	if(plugin_tmp->TranslateAddress && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_ADDRESSES)
+	{	if(plugin_tmp->TranslateAddress && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_ADDRESSES && !(conn && plugin_tmp->TranslateAddressAsync))
 		{	if(!addrtmp)
 			{	addrtmp = tor_malloc(1024);
 				tor_snprintf(addrtmp,1023,"%s",*address);
 			}
-			if(conn)	r=(plugin_tmp->TranslateAddress)(TO_CONN(conn)->global_identifier&0xffffffff,original_address,addrtmp,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&TO_CONN(conn)->lParam[plugin_tmp->connection_param],is_error);
-			else		r=(plugin_tmp->TranslateAddress)(0,original_address,addrtmp,NULL,is_error);
+			if(conn)	PLUGIN_TIMED_CALL(plugin_tmp,"TranslateAddress",r=(plugin_tmp->TranslateAddress)(TO_CONN(conn)->global_identifier&0xffffffff,original_address,addrtmp,(plugin_tmp->connection_param==-1)?NULL:(LPARAM *)&TO_CONN(conn)->lParam[plugin_tmp->connection_param],is_error));
+			else		PLUGIN_TIMED_CALL(plugin_tmp,"TranslateAddress",r=(plugin_tmp->TranslateAddress)(0,original_address,addrtmp,NULL,is_error));
 			if(!r)
 			{	if(addrtmp)	tor_free(addrtmp);
 				log(LOG_ADDR,LD_APP,get_lang_str(LANG_PLUGINS_BANNED),plugin_tmp->dll_name,safe_str(*address));
@@ -1599,6 +2129,317 @@ int plugins_remap(edge_connection_t *conn,char **address,char *original_address,
 	return 1;
 }
 
+/** How many bytes AdvTor_TranslateAddressAsync() can write to the address buffer. */
+#define PLUGIN_ASYNC_ADDRESS_LEN 1024
+
+#define PLUGIN_ASYNC_QUEUED 0
+#define PLUGIN_ASYNC_RUNNING 1
+#define PLUGIN_ASYNC_PENDING 2
+#define PLUGIN_ASYNC_DONE 3
+
+/** A stream whose destination address is being translated by the plugins that export AdvTor_TranslateAddressAsync(). */
+typedef struct plugin_async_req_t
+{	DWORD id;
+	uint64_t conn_id;	/**< global_identifier of the stream. */
+	int state;	/**< PLUGIN_ASYNC_* */
+	int allowed;
+	int n_plugins;	/**< How many entries hDll and fn have. */
+	int next_plugin;	/**< Index of the plugin that sees the request now. */
+	HANDLE *hDll;
+	LP_TranslateAddressAsync *fn;	/**< NULL for plugins that were unloaded. */
+	char *original_address;
+	char address[PLUGIN_ASYNC_ADDRESS_LEN];
+} plugin_async_req_t;
+
+/** Protects every plugin_async_* variable below, which are shared with the plugin worker thread and with the threads that call plugin_complete_translate_address(). */
+static tor_mutex_t *plugin_async_mutex = NULL;
+/** Requests that the worker thread must pass to their next plugin. */
+static smartlist_t *plugin_async_queue = NULL;
+/** Requests that are queued, running or waiting for plugin_complete_translate_address(). */
+static smartlist_t *plugin_async_reqs = NULL;
+/** Requests that all plugins finished, for the Tor thread. */
+static smartlist_t *plugin_async_done = NULL;
+static DWORD plugin_async_next_id = 0;
+/** True iff we wrote to plugin_async_fds[1] and the Tor thread didn't read it yet. */
+static int plugin_async_signaled = 0;
+/** Set when the worker thread has something to do, or when it should exit. */
+static HANDLE plugin_async_wakeup = NULL;
+/** Set by the worker thread once it has exited. */
+static HANDLE plugin_async_exited = NULL;
+static volatile int plugin_async_exiting = 0;
+/** The worker thread writes to plugin_async_fds[1] to wake the Tor thread, which reads plugin_async_fds[0] from plugin_async_event. */
+static tor_socket_t plugin_async_fds[2] = {-1,-1};
+static struct event *plugin_async_event = NULL;
+
+/** The request whose plugin is being called by the worker thread. */
+static plugin_async_req_t *plugin_async_running = NULL;
+
+static void plugin_async_finish(plugin_async_req_t *req);
+
+static void plugin_async_req_free(plugin_async_req_t *req)
+{	tor_free(req->hDll);
+	tor_free(req->fn);
+	tor_free(req->original_address);
+	tor_free(req);
+}
+
+/** Move <b>req</b> to the next plugin that is still loaded, or hand it to the Tor thread if no plugins are left or the last plugin rejected it. Called with plugin_async_mutex held. */
+static void plugin_async_advance(plugin_async_req_t *req)
+{	if(req->allowed)
+	{	while(req->next_plugin < req->n_plugins && !req->fn[req->next_plugin])	req->next_plugin++;
+	}
+	if(req->allowed && req->next_plugin < req->n_plugins)
+	{	req->state = PLUGIN_ASYNC_QUEUED;
+		smartlist_add(plugin_async_queue,req);
+		SetEvent(plugin_async_wakeup);
+		return;
+	}
+	req->state = PLUGIN_ASYNC_DONE;
+	if(req == plugin_async_running)	return;	/* plugins_async_main() hands it over once the plugin returns */
+	plugin_async_finish(req);
+}
+
+/** Hand <b>req</b> to the Tor thread. Called with plugin_async_mutex held. */
+static void plugin_async_finish(plugin_async_req_t *req)
+{	smartlist_remove(plugin_async_reqs,req);
+	smartlist_add(plugin_async_done,req);
+	if(!plugin_async_signaled)
+	{	plugin_async_signaled = 1;
+		send(plugin_async_fds[1],"x",1,0);
+	}
+}
+
+/** Main loop of the plugin worker thread: call the next plugin of every queued request, then wait to be woken. */
+static void plugins_async_main(void *arg)
+{	plugin_async_req_t *req;
+	LP_TranslateAddressAsync fn;
+	char *address=tor_malloc(PLUGIN_ASYNC_ADDRESS_LEN);
+	int r;
+	(void)arg;
+	while(!plugin_async_exiting)
+	{	tor_mutex_acquire(plugin_async_mutex);
+		if(!smartlist_len(plugin_async_queue))
+		{	tor_mutex_release(plugin_async_mutex);
+			WaitForSingleObject(plugin_async_wakeup,INFINITE);
+			continue;
+		}
+		req = smartlist_get(plugin_async_queue,0);
+		smartlist_del_keeporder(plugin_async_queue,0);
+		fn = req->fn[req->next_plugin];
+		if(!fn)
+		{	req->next_plugin++;
+			plugin_async_advance(req);
+			tor_mutex_release(plugin_async_mutex);
+			continue;
+		}
+		req->state = PLUGIN_ASYNC_RUNNING;
+		plugin_async_running = req;
+		strlcpy(address,req->address,PLUGIN_ASYNC_ADDRESS_LEN);
+		tor_mutex_release(plugin_async_mutex);
+		/* req isn't handed to the Tor thread while plugin_async_running points to it */
+		r = (fn)(req->id,(DWORD)(req->conn_id&0xffffffff),req->original_address,address);
+		tor_mutex_acquire(plugin_async_mutex);
+		plugin_async_running = NULL;
+		if(req->state == PLUGIN_ASYNC_DONE)	plugin_async_finish(req);
+		else if(req->state == PLUGIN_ASYNC_RUNNING)
+		{	if(r == 2)	req->state = PLUGIN_ASYNC_PENDING;
+			else
+			{	if(r)
+				{	address[PLUGIN_ASYNC_ADDRESS_LEN-1] = 0;
+					strlcpy(req->address,address,PLUGIN_ASYNC_ADDRESS_LEN);
+				}
+				else	req->allowed = 0;
+				req->next_plugin++;
+				plugin_async_advance(req);
+			}
+		}
+		tor_mutex_release(plugin_async_mutex);
+	}
+	tor_free(address);
+	SetEvent(plugin_async_exited);
+	spawn_exit();
+}
+
+BOOL __stdcall plugin_complete_translate_address(HANDLE plugin_instance,DWORD request_id,BOOL allow,const char *address)
+{	plugin_async_req_t *req=NULL;
+	if(!plugin_async_mutex)	return 0;
+	tor_mutex_acquire(plugin_async_mutex);
+	SMARTLIST_FOREACH(plugin_async_reqs,plugin_async_req_t *,r,
+	{	if(r->id == request_id)
+		{	req = r;
+			break;
+		}
+	});
+	if(!req || (req->state != PLUGIN_ASYNC_RUNNING && req->state != PLUGIN_ASYNC_PENDING) || req->hDll[req->next_plugin] != plugin_instance)
+	{	tor_mutex_release(plugin_async_mutex);
+		return 0;
+	}
+	if(!allow)	req->allowed = 0;
+	else if(address)	strlcpy(req->address,address,PLUGIN_ASYNC_ADDRESS_LEN);
+	req->next_plugin++;
+	plugin_async_advance(req);
+	tor_mutex_release(plugin_async_mutex);
+	return 1;
+}
+
+/** Called on the Tor thread when plugin_async_fds[0] becomes readable: resume the streams whose addresses were translated. */
+static void plugins_async_wakeup_cb(evutil_socket_t fd,short what,void *arg)
+{	smartlist_t *done;
+	connection_t *base;
+	edge_connection_t *conn;
+	char buf[64],dll_name[100];
+	(void)what;(void)arg;
+	while(recv(fd,buf,sizeof(buf),0) > 0)	;
+	tor_mutex_acquire(plugin_async_mutex);
+	done = plugin_async_done;
+	plugin_async_done = smartlist_create();
+	plugin_async_signaled = 0;
+	tor_mutex_release(plugin_async_mutex);
+	SMARTLIST_FOREACH_BEGIN(done,plugin_async_req_t *,req)
+	{	base = connection_get_by_global_id(req->conn_id);
+		if(base && base->type == CONN_TYPE_AP && !base->marked_for_close && base->state == AP_CONN_STATE_PLUGIN_WAIT)
+		{	conn = TO_EDGE_CONN(base);
+			conn->plugin_remap_done = 1;
+			if(!req->allowed)
+			{	dll_name[0] = 0;
+				get_dll_name(dll_name,req->hDll[req->next_plugin-1]);
+				log(LOG_ADDR,LD_APP,get_lang_str(LANG_PLUGINS_BANNED),dll_name,safe_str(conn->socks_request->address));
+				conn->_base.state = AP_CONN_STATE_CONNECT_WAIT;
+				connection_ap_handshake_socks_reply(conn, NULL, 0,END_STREAM_REASON_SOCKSPROTOCOL);
+				connection_mark_unattached_ap(conn,END_STREAM_REASON_SOCKSPROTOCOL |END_STREAM_REASON_FLAG_ALREADY_SOCKS_REPLIED);
+			}
+			else
+			{	if(strcmp(conn->socks_request->address,req->address))
+				{	tor_free(conn->socks_request->address);
+					conn->socks_request->address = tor_strdup(req->address);
+				}
+				conn->_base.state = AP_CONN_STATE_CIRCUIT_WAIT;
+				if(connection_ap_handshake_rewrite_and_attach(conn,NULL,NULL) < 0 && !conn->_base.marked_for_close)
+					connection_mark_unattached_ap(conn,END_STREAM_REASON_CANT_ATTACH);
+			}
+		}
+		plugin_async_req_free(req);
+	} SMARTLIST_FOREACH_END(req);
+	smartlist_free(done);
+}
+
+/** Start the plugin worker thread and the socket pair that it uses to wake the Tor thread. Return 0 on success, -1 on failure. */
+static int plugins_async_init(void)
+{	if(plugin_async_mutex)	return 0;
+	if(tor_socketpair(SOCK_STREAM,0,plugin_async_fds) < 0)
+	{	plugin_async_fds[0] = plugin_async_fds[1] = -1;
+		return -1;
+	}
+	set_socket_nonblocking(plugin_async_fds[0]);
+	set_socket_nonblocking(plugin_async_fds[1]);
+	plugin_async_event = tor_event_new(tor_libevent_get_base(),plugin_async_fds[0],EV_READ|EV_PERSIST,plugins_async_wakeup_cb,NULL);
+	plugin_async_wakeup = CreateEvent(NULL,FALSE,FALSE,NULL);
+	plugin_async_exited = CreateEvent(NULL,FALSE,FALSE,NULL);
+	plugin_async_mutex = tor_mutex_new();
+	plugin_async_queue = smartlist_create();
+	plugin_async_reqs = smartlist_create();
+	plugin_async_done = smartlist_create();
+	plugin_async_exiting = 0;
+	if(!plugin_async_event || event_add(plugin_async_event,NULL) || !plugin_async_wakeup || !plugin_async_exited || spawn_func(plugins_async_main,NULL) < 0)
+	{	if(plugin_async_event)	tor_event_free(plugin_async_event);
+		if(plugin_async_wakeup)	CloseHandle(plugin_async_wakeup);
+		if(plugin_async_exited)	CloseHandle(plugin_async_exited);
+		plugin_async_event = NULL;
+		plugin_async_wakeup = plugin_async_exited = NULL;
+		tor_close_socket(plugin_async_fds[0]);
+		tor_close_socket(plugin_async_fds[1]);
+		plugin_async_fds[0] = plugin_async_fds[1] = -1;
+		smartlist_free(plugin_async_queue);
+		smartlist_free(plugin_async_reqs);
+		smartlist_free(plugin_async_done);
+		plugin_async_queue = plugin_async_reqs = plugin_async_done = NULL;
+		tor_mutex_free(plugin_async_mutex);
+		plugin_async_mutex = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/** If any plugin translates addresses asynchronously, queue the destination of <b>conn</b> for the plugin worker thread and return 1; the stream is resumed by plugins_async_wakeup_cb(). Otherwise return 0. */
+int plugins_remap_async(edge_connection_t *conn)
+{	plugin_info_t *plugin_tmp;
+	plugin_async_req_t *req;
+	int n=0;
+	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
+	{	if(plugin_tmp->TranslateAddressAsync && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_ADDRESSES)
+			n++;
+	}
+	if(!n || !conn->socks_request || !conn->socks_request->address || plugins_async_init() < 0)	return 0;
+	req = tor_malloc_zero(sizeof(plugin_async_req_t));
+	req->conn_id = TO_CONN(conn)->global_identifier;
+	req->allowed = 1;
+	req->hDll = tor_malloc(n*sizeof(HANDLE));
+	req->fn = tor_malloc(n*sizeof(LP_TranslateAddressAsync));
+	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
+	{	if(plugin_tmp->TranslateAddressAsync && plugin_tmp->rights&PLUGIN_RIGHT__CAN_TRANSLATE_ADDRESSES)
+		{	req->hDll[req->n_plugins] = plugin_tmp->hDll;
+			req->fn[req->n_plugins++] = plugin_tmp->TranslateAddressAsync;
+		}
+	}
+	req->original_address = tor_strdup(conn->socks_request->original_address ? conn->socks_request->original_address : conn->socks_request->address);
+	strlcpy(req->address,conn->socks_request->address,PLUGIN_ASYNC_ADDRESS_LEN);
+	tor_mutex_acquire(plugin_async_mutex);
+	req->id = ++plugin_async_next_id;
+	smartlist_add(plugin_async_reqs,req);
+	req->state = PLUGIN_ASYNC_QUEUED;
+	smartlist_add(plugin_async_queue,req);
+	SetEvent(plugin_async_wakeup);
+	tor_mutex_release(plugin_async_mutex);
+	return 1;
+}
+
+/** The plugin <b>hDll</b> is being unloaded: don't call it for any request that didn't get to it yet, and let the requests that wait for it go on without it. */
+static void plugins_async_forget(HANDLE hDll)
+{	int i;
+	if(!plugin_async_mutex)	return;
+	tor_mutex_acquire(plugin_async_mutex);
+	SMARTLIST_FOREACH_BEGIN(plugin_async_reqs,plugin_async_req_t *,req)
+	{	for(i=req->next_plugin;i<req->n_plugins;i++)
+		{	if(req->hDll[i] == hDll)	req->fn[i] = NULL;
+		}
+		if(req->state == PLUGIN_ASYNC_PENDING && req->hDll[req->next_plugin] == hDll)
+		{	req->next_plugin++;
+			plugin_async_advance(req);
+			if(req->state == PLUGIN_ASYNC_DONE)
+			{	req_sl_idx--;
+				req_sl_len--;
+			}
+		}
+	} SMARTLIST_FOREACH_END(req);
+	tor_mutex_release(plugin_async_mutex);
+}
+
+/** Stop the plugin worker thread and free all requests. A plugin that doesn't return in time is left running, and its request is leaked. */
+void plugins_async_free_all(void)
+{	int exited;
+	if(!plugin_async_mutex)	return;
+	plugin_async_exiting = 1;
+	SetEvent(plugin_async_wakeup);
+	exited = WaitForSingleObject(plugin_async_exited,2000) == WAIT_OBJECT_0;
+	tor_event_free(plugin_async_event);
+	plugin_async_event = NULL;
+	tor_close_socket(plugin_async_fds[0]);
+	tor_close_socket(plugin_async_fds[1]);
+	plugin_async_fds[0] = plugin_async_fds[1] = -1;
+	if(!exited)	return;
+	CloseHandle(plugin_async_wakeup);
+	CloseHandle(plugin_async_exited);
+	plugin_async_wakeup = plugin_async_exited = NULL;
+	SMARTLIST_FOREACH(plugin_async_reqs,plugin_async_req_t *,req,plugin_async_req_free(req));
+	SMARTLIST_FOREACH(plugin_async_done,plugin_async_req_t *,req,plugin_async_req_free(req));
+	smartlist_free(plugin_async_queue);
+	smartlist_free(plugin_async_reqs);
+	smartlist_free(plugin_async_done);
+	plugin_async_queue = plugin_async_reqs = plugin_async_done = NULL;
+	tor_mutex_free(plugin_async_mutex);
+	plugin_async_mutex = NULL;
+}
+
 void plugins_new_identity(void)
 {	uint32_t raddr=geoip_reverse(get_router_sel());
 	char *country=NULL;
@@ -1606,7 +2447,7 @@ void plugins_new_identity(void)
 	plugin_info_t *plugin_tmp;
 	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
 	{	if(plugin_tmp->ChangeIdentity)
-			(plugin_tmp->ChangeIdentity)(raddr,country,best_delta_t);
+			PLUGIN_TIMED_CALL(plugin_tmp,"ChangeIdentity",(plugin_tmp->ChangeIdentity)(raddr,country,best_delta_t));
 	}
 }
 
@@ -1622,7 +2463,7 @@ void plugins_routerchanged(uint32_t addr,char *digest,int changed)
 {	plugin_info_t *plugin_tmp;
 	for(plugin_tmp=plugins;plugin_tmp;plugin_tmp=plugin_tmp->next_plugin)
 	{	if(plugin_tmp->RouterChanged)
-			(plugin_tmp->RouterChanged)(geoip_reverse(addr),digest,changed);
+			PLUGIN_TIMED_CALL(plugin_tmp,"RouterChanged",(plugin_tmp->RouterChanged)(geoip_reverse(addr),digest,changed));
 	}
 }
 
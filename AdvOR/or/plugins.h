@@ -1,5 +1,24 @@
 #include "dlg_resize.h"
 
+/* A read-only view of data that is passed to AdvTor_HandleReadV() and AdvTor_HandleWriteV() */
+typedef struct plugin_iovec_t
+{
+	const char *data;
+	int len;
+} plugin_iovec_t;
+
+/* A range of the new data that a plugin replaces; offset and len are relative to the start of the new data, and data_len bytes from data are put in its place */
+typedef struct plugin_replace_t
+{
+	int offset;
+	int len;
+	const char *data;
+	int data_len;
+} plugin_replace_t;
+
+/* Maximum number of ranges that AdvTor_HandleReadV() and AdvTor_HandleWriteV() can replace in one call */
+#define PLUGIN_MAX_REPLACEMENTS 16
+
 typedef BOOL (WINAPI *LP_InitPlugin)(HANDLE,DWORD,char *,void *) __attribute__((stdcall));
 typedef BOOL (WINAPI *LP_UnloadPlugin)(int exit) __attribute__((stdcall));			// unload from GUI = 1 / exitting program, prompt user = 2 / exitting, must terminate = 3 / exit/unload canceled by user = 0
 typedef HWND (WINAPI *LP_GetConfigurationWindow)(HWND hParent) __attribute__((stdcall));
@@ -8,7 +27,10 @@ typedef int (WINAPI *LP_RegisterConnection)(DWORD,int,char *,LPARAM *) __attribu
 typedef int (WINAPI *LP_UnregisterConnection)(DWORD,int,char *,LPARAM *) __attribute__((stdcall));
 typedef int (WINAPI *LP_ConnectionRead)(DWORD,int,int,char *,char *,int*,int,LPARAM *) __attribute__((stdcall));
 typedef int (WINAPI *LP_ConnectionWrite)(DWORD,int,int,char *,char *,int*,int,LPARAM *) __attribute__((stdcall));
+typedef int (WINAPI *LP_ConnectionReadV)(DWORD,int,int,char *,const plugin_iovec_t *,int,plugin_replace_t *,int,LPARAM *) __attribute__((stdcall));
+typedef int (WINAPI *LP_ConnectionWriteV)(DWORD,int,int,char *,const plugin_iovec_t *,int,plugin_replace_t *,int,LPARAM *) __attribute__((stdcall));
 typedef int (WINAPI *LP_TranslateAddress)(DWORD,char *,char *,LPARAM *,BOOL) __attribute__((stdcall));
+typedef int (WINAPI *LP_TranslateAddressAsync)(DWORD,DWORD,char *,char *) __attribute__((stdcall));
 typedef int (WINAPI *LP_ChangeIdentity)(DWORD,char *,long) __attribute__((stdcall));
 typedef void (WINAPI *LP_Start)(BOOL) __attribute__((stdcall));
 typedef void (WINAPI *LP_RouterChanged)(uint32_t,char *,int) __attribute__((stdcall));
@@ -48,6 +70,13 @@ typedef struct plugin_info_t plugin_info_t;
 
 #define PLUGIN_RIGHT__ALL_RIGHTS 0xffff
 
+/* Filter types for set_traffic_filter() */
+#define PLUGIN_FILTER_NONE 0
+#define PLUGIN_FILTER_ADDRESS 1
+#define PLUGIN_FILTER_PORT 2
+#define PLUGIN_FILTER_PROCESS 3
+#define PLUGIN_FILTER_HIDDEN_SERVICE 4
+
 #define PLUGIN_FN_INIT "AdvTor_InitPlugin"
 #define PLUGIN_FN_UNLOAD "AdvTor_UnloadPlugin"
 #define PLUGIN_FN_GETCONFIG "AdvTor_GetConfigurationWindow"
@@ -58,7 +87,10 @@ typedef struct plugin_info_t plugin_info_t;
 #define PLUGIN_FN_CLOSECONN "AdvTor_UnregisterConnection"
 #define PLUGIN_FN_CONN_READ "AdvTor_HandleRead"
 #define PLUGIN_FN_CONN_WRITE "AdvTor_HandleWrite"
+#define PLUGIN_FN_CONN_READV "AdvTor_HandleReadV"
+#define PLUGIN_FN_CONN_WRITEV "AdvTor_HandleWriteV"
 #define PLUGIN_FN_REWRITE_ADDR "AdvTor_TranslateAddress"
+#define PLUGIN_FN_REWRITE_ADDR_ASYNC "AdvTor_TranslateAddressAsync"
 #define PLUGIN_FN_NEW_IDENTITY "AdvTor_ChangeIdentity"
 #define PLUGIN_FN_START "AdvTor_Start"
 #define PLUGIN_FN_ROUTERCHANGED "AdvTor_RouterChanged"
@@ -90,7 +122,10 @@ struct plugin_info_t
 	LP_UnregisterConnection UnregisterConnection __attribute__((stdcall));
 	LP_ConnectionRead ConnectionRead __attribute__((stdcall));
 	LP_ConnectionWrite ConnectionWrite __attribute__((stdcall));
+	LP_ConnectionReadV ConnectionReadV __attribute__((stdcall));
+	LP_ConnectionWriteV ConnectionWriteV __attribute__((stdcall));
 	LP_TranslateAddress TranslateAddress __attribute__((stdcall));
+	LP_TranslateAddressAsync TranslateAddressAsync __attribute__((stdcall));
 	LP_ChangeIdentity ChangeIdentity __attribute__((stdcall));
 	LP_Start AdvTorStart __attribute__((stdcall));
 	LP_RouterChanged RouterChanged __attribute__((stdcall));
@@ -98,6 +133,7 @@ struct plugin_info_t
 	LP_HiddenService_HandleRead HiddenService_HandleRead __attribute__((stdcall));
 	LP_InterceptProcess InterceptProcess __attribute__((stdcall));
 	LP_LanguageChange LanguageChange __attribute__((stdcall));
+	smartlist_t *traffic_filters;	/**< plugin_filter_t that select the connections whose traffic this plugin sees, or NULL for all connections. */
 	DWORD exclKey;
 	struct plugin_info_t* next_plugin;
 };
@@ -114,6 +150,19 @@ typedef struct connection_info_t
 	LPARAM *lParam;
 } connection_info_t;
 
+#define PLUGIN_CONNECTION_OPENED 1
+#define PLUGIN_CONNECTION_CLOSED 2
+#define PLUGIN_CONNECTION_STATE_CHANGED 3
+
+/** A change of a connection, returned by plugin_get_connection_changes(). */
+typedef struct connection_change_t
+{
+	DWORD change;	/**< PLUGIN_CONNECTION_* */
+	DWORD connection_id;
+	DWORD connection_type;
+	DWORD connection_state;
+} connection_change_t;
+
 
 void load_plugins(void);
 void load_all_plugins(void);
@@ -131,7 +180,11 @@ void dlg_set_all_plugins(void);
 HWND get_plugin_window(int list_item);
 int plugins_connection_add(connection_t *conn);
 int plugins_connection_remove(connection_t *conn);
+void plugins_traffic_changed(void);
+int plugins_remap_async(edge_connection_t *conn);
+void plugins_async_free_all(void);
 void plugins_read_event(connection_t *conn,size_t before);
+int plugins_translate_writes(connection_t *conn);
 void plugins_write_event(connection_t *conn,size_t before);
 void plugins_new_identity(void);
 int plugins_remap(edge_connection_t *conn,char **address,char *original_address,BOOL is_error);
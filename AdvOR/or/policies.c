@@ -631,6 +631,266 @@ compare_tor_addr_to_addr_policy(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** A range of ports on which every entry of a compiled policy either
+ * applies or doesn't. */
+typedef struct policy_port_range_t {
+  /** Lowest port of the range; the range ends where the next one starts. */
+  uint16_t prt_min;
+  /** What compare_unknown_tor_addr_to_addr_policy() returns for the ports
+   * of this range. */
+  addr_policy_result_t unknown_addr_result;
+  /** Index in <b>entries</b> of the first policy entry that applies to the
+   * ports of this range. */
+  int first_entry;
+} policy_port_range_t;
+
+/** An exit policy of one or more routers, and the things that we compute
+ * from it.  Policies parsed from router descriptors are interned by
+ * router_intern_exit_policy(), so that all the routers with the same
+ * policy share one list of entries, one compiled form and one summary.
+ * An interned policy must not be changed. */
+struct compiled_policy_t {
+  /** The policy, and its length when we compiled it. */
+  smartlist_t *source;
+  int source_len;
+  /** How many routers share this policy, or 0 if it belongs to a single
+   * router and isn't interned. */
+  int refcnt;
+  /** Digest of the (canonical) entries of the policy; the key of
+   * <b>interned_policies</b>. */
+  char digest[DIGEST_LEN];
+  /** Cached output of policy_summarize(), or NULL. */
+  char *summary;
+  /** The port ranges, sorted, or NULL if we haven't compiled the policy
+   * yet; there's one more entry at the end so that ranges[i+1].first_entry
+   * is always valid. */
+  policy_port_range_t *ranges;
+  int n_ranges;
+  /** For each port range, the entries of the policy that apply to its
+   * ports, in policy order. We stop after the first entry that covers all
+   * addresses, since it hides the ones after it. */
+  addr_policy_t **entries;
+};
+
+/** Map from the digest of a policy to its interned compiled_policy_t. */
+static digestmap_t *interned_policies = NULL;
+
+/** Helper for compiled_policy_build(): sort ports. */
+static int
+_compare_ports(const void *a, const void *b)
+{
+  return (int)*(const uint32_t*)a - (int)*(const uint32_t*)b;
+}
+
+/** Split the ports of the policy of <b>cp</b> into ranges; see
+ * router_compare_addr_to_exit_policy(). */
+static void
+compiled_policy_build(compiled_policy_t *cp)
+{
+  const smartlist_t *policy = cp->source;
+  int n = 0, n_starts = 0, i, j, allocated = 16, n_entries = 0, first;
+  uint32_t *starts = tor_malloc(sizeof(uint32_t)*(smartlist_len(policy)*2+1));
+
+  cp->source_len = smartlist_len(policy);
+  starts[n_starts++] = 0;
+  SMARTLIST_FOREACH(policy, addr_policy_t *, ent,
+  {
+    starts[n_starts++] = ent->prt_min;
+    if (ent->prt_max < 65535)
+      starts[n_starts++] = ent->prt_max + 1;
+  });
+  qsort(starts, n_starts, sizeof(uint32_t), _compare_ports);
+
+  cp->ranges = tor_malloc(sizeof(policy_port_range_t)*(n_starts+1));
+  cp->entries = tor_malloc(sizeof(addr_policy_t*)*allocated);
+  for (i = 0; i < n_starts; ++i) {
+    /* The first range also starts at port 0, which we never look up. */
+    uint16_t port = starts[i] ? (uint16_t)starts[i] : 1;
+    if (i && starts[i] == starts[i-1])
+      continue;
+    first = n_entries;
+    SMARTLIST_FOREACH(policy, addr_policy_t *, ent,
+    {
+      if (ent->prt_min <= port && port <= ent->prt_max) {
+        if (n_entries == allocated) {
+          allocated *= 2;
+          cp->entries = tor_realloc(cp->entries,
+                                    sizeof(addr_policy_t*)*allocated);
+        }
+        cp->entries[n_entries++] = ent;
+        if (ent->maskbits == 0 && tor_addr_family(&ent->addr) == AF_INET)
+          break;
+      }
+    });
+    /* Merge this range into the previous one if the same entries apply. */
+    if (n && n_entries - first == first - cp->ranges[n-1].first_entry) {
+      for (j = 0; j < n_entries - first; ++j)
+        if (cp->entries[first+j] != cp->entries[cp->ranges[n-1].first_entry+j])
+          break;
+      if (j == n_entries - first) {
+        n_entries = first;
+        continue;
+      }
+    }
+    cp->ranges[n].prt_min = (uint16_t)starts[i];
+    cp->ranges[n].first_entry = first;
+    cp->ranges[n].unknown_addr_result =
+      compare_unknown_tor_addr_to_addr_policy(port, policy);
+    ++n;
+  }
+  cp->ranges[n].prt_min = 0;
+  cp->ranges[n].first_entry = n_entries;
+  cp->n_ranges = n;
+  tor_free(starts);
+}
+
+/** Release the compiled form and the summary held by <b>cp</b>, and
+ * <b>cp</b> itself, but not its policy. */
+static void
+compiled_policy_free(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  tor_free(cp->ranges);
+  tor_free(cp->entries);
+  tor_free(cp->summary);
+  tor_free(cp);
+}
+
+/** Replace the exit policy of <b>router</b>, which must be complete and
+ * made of canonical entries, by the interned copy of an identical policy
+ * if there's one, or intern it. */
+void
+router_intern_exit_policy(routerinfo_t *router)
+{
+  compiled_policy_t *cp;
+  crypto_digest_env_t *d;
+  char digest[DIGEST_LEN];
+
+  if (!router->exit_policy || router->compiled_exit_policy)
+    return;
+  d = crypto_new_digest_env();
+  SMARTLIST_FOREACH(router->exit_policy, addr_policy_t *, ent,
+  {
+    tor_assert(ent->is_canonical);
+    crypto_digest_add_bytes(d, (const char*)&ent, sizeof(ent));
+  });
+  crypto_digest_get_digest(d, digest, DIGEST_LEN);
+  crypto_free_digest_env(d);
+
+  if (!interned_policies)
+    interned_policies = digestmap_new();
+  cp = digestmap_get(interned_policies, digest);
+  if (cp) {
+    addr_policy_list_free(router->exit_policy);
+    router->exit_policy = cp->source;
+  } else {
+    cp = tor_malloc_zero(sizeof(compiled_policy_t));
+    cp->source = router->exit_policy;
+    cp->source_len = smartlist_len(cp->source);
+    memcpy(cp->digest, digest, DIGEST_LEN);
+    digestmap_set(interned_policies, digest, cp);
+  }
+  ++cp->refcnt;
+  router->compiled_exit_policy = cp;
+}
+
+/** Release the exit policy of <b>router</b>: free it, or drop our reference
+ * to it if it's interned. */
+void
+router_free_exit_policy(routerinfo_t *router)
+{
+  compiled_policy_t *cp = router->compiled_exit_policy;
+  if (cp && cp->refcnt) {
+    tor_assert(cp->source == router->exit_policy);
+    if (--cp->refcnt == 0) {
+      digestmap_remove(interned_policies, cp->digest);
+      addr_policy_list_free(cp->source);
+      compiled_policy_free(cp);
+    }
+  } else {
+    addr_policy_list_free(router->exit_policy);
+    compiled_policy_free(cp);
+  }
+  router->exit_policy = NULL;
+  router->compiled_exit_policy = NULL;
+}
+
+/** Return the compiled form of the exit policy of <b>router</b>, building
+ * it if we need to. */
+static compiled_policy_t *
+router_get_compiled_exit_policy(routerinfo_t *router)
+{
+  compiled_policy_t *cp = router->compiled_exit_policy;
+  if (cp && !cp->refcnt && (cp->source != router->exit_policy ||
+                            cp->source_len != smartlist_len(cp->source))) {
+    /* Our own descriptor: the policy was changed since we compiled it. */
+    compiled_policy_free(cp);
+    cp = NULL;
+  }
+  if (!cp) {
+    cp = tor_malloc_zero(sizeof(compiled_policy_t));
+    cp->source = router->exit_policy;
+    router->compiled_exit_policy = cp;
+  }
+  if (!cp->ranges)
+    compiled_policy_build(cp);
+  return cp;
+}
+
+/** As compare_addr_to_addr_policy() on the exit policy of <b>router</b>,
+ * but compile the policy the first time we need it, so that checking a
+ * port takes a binary search over the port ranges, and checking a known
+ * address only looks at the entries that apply to the port. */
+addr_policy_result_t
+router_compare_addr_to_exit_policy(uint32_t addr, uint16_t port,
+                                   routerinfo_t *router)
+{
+  compiled_policy_t *cp;
+  const policy_port_range_t *range;
+  int lo, hi, mid, i;
+  tor_addr_t a;
+
+  if (!router->exit_policy || !port)
+    return compare_addr_to_addr_policy(addr, port, router->exit_policy);
+  cp = router_get_compiled_exit_policy(router);
+  lo = 0;
+  hi = cp->n_ranges;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cp->ranges[mid].prt_min > port)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  range = &cp->ranges[lo - 1];
+  if (!addr)
+    return range->unknown_addr_result;
+  tor_addr_from_ipv4h(&a, addr);
+  for (i = range->first_entry; i < range[1].first_entry; ++i) {
+    addr_policy_t *ent = cp->entries[i];
+    if (!tor_addr_compare_masked(&a, &ent->addr, ent->maskbits, CMP_EXACT))
+      return ent->policy_type == ADDR_POLICY_ACCEPT ?
+        ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+  }
+  /* accept all by default. */
+  return ADDR_POLICY_ACCEPTED;
+}
+
+/** Return a newly allocated summary of the exit policy of <b>router</b>, as
+ * policy_summarize() makes it.  The summary of an interned policy is only
+ * computed once. */
+char *
+router_summarize_exit_policy(const routerinfo_t *router)
+{
+  compiled_policy_t *cp = router->compiled_exit_policy;
+  if (!cp || !cp->refcnt)
+    return policy_summarize(router->exit_policy);
+  if (!cp->summary)
+    cp->summary = policy_summarize(cp->source);
+  return tor_strdup(cp->summary);
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -809,12 +1069,64 @@ void
 policies_set_router_exitpolicy_to_reject_all(routerinfo_t *r)
 {
   addr_policy_t *item;
-  addr_policy_list_free(r->exit_policy);
+  router_free_exit_policy(r);
   r->exit_policy = smartlist_create();
   item = router_parse_addr_policy_item_from_string("reject *:*", -1);
   smartlist_add(r->exit_policy, item);
 }
 
+/** Replace the exit policy of <b>r</b> with the policy described by the
+ * summary <b>summary</b>, as found in a microdescriptor: "accept" or
+ * "reject" followed by a comma-separated list of ports and port ranges, to
+ * any address, with every other port getting the opposite treatment.
+ * Return 0 on success.  If the summary is malformed, set the policy to
+ * reject *:* and return -1. */
+int
+policies_set_router_exitpolicy_from_summary(routerinfo_t *r,
+                                            const char *summary)
+{
+  smartlist_t *ports = smartlist_create();
+  const char *action, *rest;
+  char buf[64];
+  int r_val = 0;
+
+  router_free_exit_policy(r);
+  if (!strcmpstart(summary, "accept ")) {
+    action = "accept";
+    rest = "reject *:*";
+  } else if (!strcmpstart(summary, "reject ")) {
+    action = "reject";
+    rest = "accept *:*";
+  } else {
+    policies_set_router_exitpolicy_to_reject_all(r);
+    smartlist_free(ports);
+    return -1;
+  }
+  r->exit_policy = smartlist_create();
+  smartlist_split_string(ports, summary+strlen("accept "), ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH(ports, const char *, p,
+  {
+    addr_policy_t *item = NULL;
+    if (!r_val &&
+        tor_snprintf(buf, sizeof(buf), "%s *:%s", action, p) >= 0)
+      item = router_parse_addr_policy_item_from_string(buf, -1);
+    if (item)
+      smartlist_add(r->exit_policy, item);
+    else
+      r_val = -1;
+  });
+  SMARTLIST_FOREACH(ports, char *, p, tor_free(p));
+  smartlist_free(ports);
+  if (r_val < 0) {
+    policies_set_router_exitpolicy_to_reject_all(r);
+    return -1;
+  }
+  smartlist_add(r->exit_policy,
+                router_parse_addr_policy_item_from_string(rest, -1));
+  return 0;
+}
+
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
  * allows exiting to <b>port</b>.  Otherwise, return 0. */
 static int
@@ -1282,6 +1594,11 @@ policies_free_all(void)
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
 
+  if (interned_policies) {
+    digestmap_free(interned_policies, NULL);
+    interned_policies = NULL;
+  }
+
   addr_policy_t *pol;
   while(policy_list)
   {	pol = policy_list->next;
@@ -38,11 +38,18 @@ addr_policy_result_t compare_tor_addr_to_addr_policy(const tor_addr_t *addr,
                               uint16_t port, const smartlist_t *policy);
 addr_policy_result_t compare_addr_to_addr_policy(uint32_t addr,
                               uint16_t port, const smartlist_t *policy);
+addr_policy_result_t router_compare_addr_to_exit_policy(uint32_t addr,
+                              uint16_t port, routerinfo_t *router);
+void router_intern_exit_policy(routerinfo_t *router);
+void router_free_exit_policy(routerinfo_t *router);
+char *router_summarize_exit_policy(const routerinfo_t *router);
 int policies_parse_exit_policy(config_line_t *cfg, smartlist_t **dest,
                                int rejectprivate, const char *local_address,
                                int add_default_policy);
 void policies_exit_policy_append_reject_star(smartlist_t **dest);
 void policies_set_router_exitpolicy_to_reject_all(routerinfo_t *exitrouter);
+int policies_set_router_exitpolicy_from_summary(routerinfo_t *r,
+                                                const char *summary);
 int exit_policy_is_general_exit(smartlist_t *policy);
 int policy_is_reject_star(const smartlist_t *policy);
 int getinfo_helper_policies(control_connection_t *conn,
@@ -7,6 +7,7 @@
 #include "connection_edge.h"
 #include "connection.h"
 #include "control.h"
+#include "perf.h"
 
 extern or_options_t *tmpOptions;
 
@@ -31,6 +32,7 @@ int connection_ap_handshake_process_socks(edge_connection_t *conn)
 
 	log_debug(LD_APP,get_lang_str(LANG_LOG_EDGE_CONNECTION_AP_PROCESS_SOCKS));
 	sockshere = fetch_from_buf_socks(conn->_base.inbuf, socks,options->TestSocks, options->SafeSocks);
+	if(sockshere == 1 && SOCKS_COMMAND_IS_CONNECT(socks->command))	stream_trace_stamp(conn,STREAM_TRACE_ACCEPTED);
 	if(socks->address && socks->address[0] && (!socks->original_address || !socks->original_address[0]))
 	{	if(socks->original_address)	tor_free(socks->original_address);
 		socks->original_address = tor_strdup(socks->address);
@@ -88,7 +90,11 @@ int connection_ap_handshake_process_socks(edge_connection_t *conn)
 	}
 	if(SOCKS_COMMAND_IS_CONNECT(socks->command))
 	{	log(LOG_ADDR,LD_APP,get_lang_str(LANG_LOG_CONNECTION_CONNECTION_REQUEST),safe_str(socks->address),socks->port);
+		uint64_t filter_started = perf_now_usec();
 		proxy_handle_client_data(conn);
+		filter_started = perf_now_usec() - filter_started;
+		perf_hist_add(PERF_HIST_FILTER_USEC,filter_started);
+		stream_trace_note_filter(conn,filter_started);
 		if(socks->replylen){    connection_write_to_buf(socks->reply, socks->replylen, TO_CONN(conn)); socks->replylen = 0;}
 		control_event_stream_status(conn, STREAM_EVENT_NEW, 0);
 	}
@@ -617,7 +623,7 @@ int remove_unprocessed_data(connection_t *conn,int amount)
 		http_log(LOG_INFO,LANG_LOG_HTTP_SENT_TRAFFIC,conn->unprocessed,amount,conn);
 	if(conn->unprocessed_len > amount)
 	{	conn->unprocessed_len -= amount;
-		memcpy(conn->unprocessed,conn->unprocessed + amount,conn->unprocessed_len);
+		memmove(conn->unprocessed,conn->unprocessed + amount,conn->unprocessed_len);
 	}
 	else	conn->unprocessed_len = 0;
 	return conn->unprocessed_len;
@@ -626,7 +632,7 @@ int remove_unprocessed_data(connection_t *conn,int amount)
 int remove_unprocessed_headers(connection_t *conn,int amount)
 {	if(conn->unprocessed_len > amount)
 	{	conn->unprocessed_len -= amount;
-		memcpy(conn->unprocessed,conn->unprocessed + amount,conn->unprocessed_len);
+		memmove(conn->unprocessed,conn->unprocessed + amount,conn->unprocessed_len);
 	}
 	else	conn->unprocessed_len = 0;
 	return conn->unprocessed_len;
@@ -637,7 +643,7 @@ int remove_incoming_data(connection_t *conn,int amount)
 		http_log(LOG_INFO,LANG_LOG_HTTP_RESPONSE_TRAFFIC,conn->incoming,amount,conn);
 	if(conn->incoming_len > amount)
 	{	conn->incoming_len -= amount;
-		memcpy(conn->incoming,conn->incoming + amount,conn->incoming_len);
+		memmove(conn->incoming,conn->incoming + amount,conn->incoming_len);
 	}
 	else	conn->incoming_len = 0;
 	return conn->incoming_len;
@@ -672,6 +678,16 @@ void proxy_handle_client_data(edge_connection_t *conn)
 	unsigned int i = conn->_base.processed_from_inbuf;
 	if(i >= buf->datalen) return;
 	int http_hdr;
+	/* the rest of a request body with a known length is forwarded as it is, without copying or scanning it */
+	if(conn->_base.need_data > 0 && !conn->_base.unprocessed_len && !((tmpOptions->HTTPFlags & HTTP_SETTING_LOG_REQUESTS) && (tmpOptions->HTTPFlags & HTTP_SETTING_LOG_REQUEST_HEADERS) && ((tmpOptions->logging&0xff) >= LOG_INFO)))
+	{	uint64_t body = buf->datalen - i;
+		if(body > (uint64_t)conn->_base.need_data)	body = conn->_base.need_data;
+		conn->_base.processed_from_inbuf += body;
+		conn->_base.need_data -= body;
+		i += body;
+		log(LOG_DEBUG,LD_APP,"Remaining chunk: %x",(uint32_t)conn->_base.need_data);
+		if(i >= buf->datalen) return;
+	}
 	buf_pullup(buf,buf->datalen);
 	dest = buf->head;
 	if(dest)
@@ -906,10 +922,19 @@ void proxy_handle_client_data(edge_connection_t *conn)
 					{	conn->_base.need_data += 2;
 						continue;
 					}
-					conn->_base.need_trailers = 0;
+					conn->_base.need_trailers = EXPECTING_CHUNK_TRAILERS;
 				}
 				else return;
 			}
+			else if(conn->_base.need_trailers & EXPECTING_CHUNK_TRAILERS)
+			{	/* the last chunk is followed by optional trailers and an empty line */
+				http_hdr = strfind(conn->_base.unprocessed,"\r\n",conn->_base.unprocessed_len);
+				if(http_hdr < 0)	return;
+				write_to_buf(conn->_base.unprocessed,http_hdr+2,buf);
+				conn->_base.processed_from_inbuf += http_hdr+2;
+				remove_unprocessed_data(TO_CONN(conn),http_hdr+2);
+				if(!http_hdr)	conn->_base.need_trailers = 0;
+			}
 			else if(conn->_base.need_trailers & EXPECTING_BOUNDARY)
 			{	http_hdr = strfind(conn->_base.unprocessed,"--",conn->_base.unprocessed_len);
 				if(http_hdr >= 0)
@@ -1116,8 +1141,7 @@ int proxy_handle_server_data(connection_t *conn,const char *string,int len)
 				}
 				else
 				{	http_hdr += 4;
-					char *tmp = parse_response_headers(conn,conn->incoming,http_hdr);
-					remove_incoming_data(conn,http_hdr);
+					int newlen = parse_response_headers(conn,conn->incoming,http_hdr);
 					if(conn->expecting_trailers & EXPECTING_NO_DATA)
 					{	conn->expecting_trailers = 0;
 						conn->expecting_data = 0;
@@ -1125,11 +1149,14 @@ int proxy_handle_server_data(connection_t *conn,const char *string,int len)
 						if(conn->expecting_no_data > 0)
 							conn->expecting_trailers |= EXPECTING_NO_DATA;
 					}
-					if(!tmp)	return -1;
-					r = write_to_buf(tmp,strlen(tmp),conn->outbuf);
+					if(newlen < 0)
+					{	remove_incoming_data(conn,http_hdr);
+						return -1;
+					}
+					r = write_to_buf(conn->incoming,newlen,conn->outbuf);
 					if((tmpOptions->HTTPFlags & HTTP_SETTING_LOG_RESPONSE_STATUS) && (tmpOptions->HTTPFlags & HTTP_SETTING_LOG_RESPONSE_TRAFFIC))
-						http_log(LOG_NOTICE,LANG_LOG_HTTP_RESPONSE_HEADERS,tmp,strlen(tmp),conn);
-					tor_free(tmp);
+						http_log(LOG_NOTICE,LANG_LOG_HTTP_RESPONSE_HEADERS,conn->incoming,newlen,conn);
+					remove_incoming_data(conn,http_hdr);
 				}
 			}
 		}
@@ -81,6 +81,7 @@
 #define EXPECTING_CLOSE 8
 #define EXPECTING_KEEPALIVE 16
 #define EXPECTING_NO_DATA 32
+#define EXPECTING_CHUNK_TRAILERS 64
 
 typedef struct http_headers
 {	int useragent;
@@ -104,6 +105,7 @@ typedef struct http_headers
 	char *http_proxy_connection;		// Proxy-Connection:
 	char *http_keepalive;			// Keep-Alive:
 	char *http_te;				// TE:
+	char *http_transfer_encoding;		// Transfer-Encoding:
 	char *http_cache_control;		// Cache-Control: / Pragma:
 	char *http_authorization;		// Authorization:
 	char *http_proxy_authorization;		// Proxy-Authorization: / Proxy-Authentication:
@@ -137,7 +139,8 @@ typedef struct http_headers
 } http_headers;
 
 typedef struct cookie_info
-{	struct cookie_info *next;
+{	struct cookie_info *next;	/**< Next cookie with the same pid, domain and name, but a different path. */
+	HT_ENTRY(cookie_info) node;
 	char *cookie_name;
 	char *cookie_val;
 	char *cookie_path;
@@ -147,10 +150,14 @@ typedef struct cookie_info
 } cookie_info;
 
 char *parse_request_headers(char *headers,connection_t *conn);
-char *parse_response_headers(connection_t *conn,char *headers,int hdrlen);
+int parse_response_headers(connection_t *conn,char *headers,int hdrlen);
 int get_identity_user_agent(void);
 void http_log(int severity,int lang_id,char *httpdata,int len,connection_t *conn);
 void register_new_cookie(char *cookie,connection_t *conn);
 void free_cookies(void);
+void free_all_cookies(void);
+void free_expired_cookies(void);
+void free_header_templates(void);
+void banned_headers_invalidate(void);
 int is_known_cookie(char *cookie,char *host,DWORD pid);
 void write_cookies(char *headers,int *written,char *host,DWORD pid,char *cookies);
@@ -5,7 +5,30 @@
 #include "connection.h"
 #include "connection_edge.h"
 
-cookie_info *cookies = NULL;
+/** Cookies that were set by web servers, indexed by process, domain and name. */
+static HT_HEAD(cookiemap, cookie_info) cookies = HT_INITIALIZER();
+/** Cookies set before the last identity change have a different generation and are ignored. */
+static uint32_t cookie_generation = 1;
+/** When an identity change leaves more cookies than this in the table, they are all freed. */
+#define MAX_EXPIRED_COOKIES 4096
+
+/** A header that was generated by write_user_agent() or write_accept_language(), and the version numbers that were chosen with it. */
+typedef struct header_template_t
+{	const char *hdrname;
+	char *hdrval;
+	int appended;
+	int agent_version[4];
+	int rsvd[3];
+} header_template_t;
+
+/** Generated headers, indexed by everything that they were generated from. */
+static strmap_t *header_templates = NULL;
+/** The identity that the generated headers in <b>header_templates</b> belong to. */
+static uint32_t header_templates_seeds[4];
+/** If set, append_header() saves the header that it is asked to add here. */
+static header_template_t *header_template_capture = NULL;
+#define MAX_HEADER_TEMPLATES 256
+#define MAX_HEADER_TEMPLATE_KEY 1024
 
 void http_show_warning(char *headers,connection_t *conn,DWORD warn_type);
 int is_header_dangerous(char *headers,connection_t *conn);
@@ -110,140 +133,299 @@ void http_show_warning(char *headers,connection_t *conn,DWORD warn_type)
 	else	http_log(LOG_WARN,LANG_LOG_HTTP_DANGEROUS_HEADERS,headers,i,conn);
 }
 
-int is_header_dangerous(char *headers,connection_t *conn)
+/** Header prefixes that may identify the client, and the warning that is shown for each of them. When prefixes overlap, the first one wins. */
+static const struct
+{	const char *prefix;
+	int warn_type;
+} dangerous_headers[] =
 {
-	if(!strcasecmpstart(headers,"client-ip:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_IP);
-	else if(!strcasecmpstart(headers,"client_ip:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_IP);
-	else if(!strcasecmpstart(headers,"x-client-ip:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_IP);
-	else if(!strcasecmpstart(headers,"x-cluster-client-ip:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_IP);
-	else if(!strcasecmpstart(headers,"x-nas-ip:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_IP);		//X-NAS-IP: 
-	else if(!strcasecmpstart(headers,"client-id:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_ID);
-	else if(!strcasecmpstart(headers,"x-real-ip:"))	http_show_warning(headers,conn,WARN_HTTP_CLIENT_ID);		//X-Real-IP:
-	else if(!strcasecmpstart(headers,"cuda_cliip:"))	http_show_warning(headers,conn,WARN_HTTP_CUDA_CLIIP);
-	else if(!strcasecmpstart(headers,"ffi"))	http_show_warning(headers,conn,WARN_HTTP_FFI);
-	else if(!strcasecmpstart(headers,"from:"))	http_show_warning(headers,conn,WARN_HTTP_FROM);
-	else if(!strcasecmpstart(headers,"mt-proxy-id:"))	http_show_warning(headers,conn,WARN_HTTP_MT_PROXY_ID);
-	else if(!strcasecmpstart(headers,"ua-"))	http_show_warning(headers,conn,WARN_HTTP_UA);
-	else if(!strcasecmpstart(headers,"userip"))	http_show_warning(headers,conn,WARN_HTTP_USERIP);
-	else if(!strcasecmpstart(headers,"user-ip"))	http_show_warning(headers,conn,WARN_HTTP_USERIP);
-	else if(!strcasecmpstart(headers,"username"))	http_show_warning(headers,conn,WARN_HTTP_USERNAME);
-	else if(!strcasecmpstart(headers,"x-apn-id"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-imforwards"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-IMForwards: 
-	else if(!strcasecmpstart(headers,"x-power-cache"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//x-power-cache: 
-	else if(!strcasecmpstart(headers,"x-autopager"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-cc-id"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-nai-id"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-fw2-identity:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-proxy-id:"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-Proxy-ID: 
-	else if(!strcasecmpstart(headers,"x-ggsnip:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-sgsnip:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-SGSNIP: 
-	else if(!strcasecmpstart(headers,"x-charging-id"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-slipstream"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-SlipStream-Username:
-	else if(!strcasecmpstart(headers,"x-tickcount"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-lori-time-1"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-lori-time-1: 
-	else if(!strcasecmpstart(headers,"x-teacup"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-Teacup:
-	else if(!strcasecmpstart(headers,"x-saucer:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-Saucer: 
-	else if(!strcasecmpstart(headers,"xid:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-pid:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"msisdn:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-msp-msisdn:"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-MSP-MSISDN: 
-	else if(!strcasecmpstart(headers,"x-msp-rat:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-MSP-RAT: 
-	else if(!strcasecmpstart(headers,"x-up-subno:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-icap-version:"))	http_show_warning(headers,conn,WARN_HTTP_XID);
-	else if(!strcasecmpstart(headers,"x-livetool:"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-Livetool: 
-	else if(!strcasecmpstart(headers,"x-imsi:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-IMSI: 
-	else if(!strcasecmpstart(headers,"x-msp-ag:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-MSP-AG: 
-	else if(!strcasecmpstart(headers,"x-insight:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//x-insight: activate
-	else if(!strcasecmpstart(headers,"x-d-forwarder:"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-D-Forwarder: yes
-	else if(!strcasecmpstart(headers,"via:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//Via:
-	else if(!strcasecmpstart(headers,"x-via:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-Via:
-	else if(!strcasecmpstart(headers,"x-tm-via:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-TM-Via: 
-	else if(!strcasecmpstart(headers,"x-mcproxyfilter:"))	http_show_warning(headers,conn,WARN_HTTP_XID);		//X-McProxyFilter: 
-	else if(!strcasecmpstart(headers,"x-varnish:"))	http_show_warning(headers,conn,WARN_HTTP_XID);			//X-Varnish: 
-	else if(!strcasecmpstart(headers,"x-authenticated-user:"))	http_show_warning(headers,conn,WARN_HTTP_XID);	//X-Authenticated-User: default://...
-	else if(!strcasecmpstart(headers,"x-bluecoat-via"))	http_show_warning(headers,conn,WARN_HTTP_BLUECOAT);
-	else if(!strcasecmpstart(headers,"X-C4PC-LWPNB-ADDR:"))	http_show_warning(headers,conn,WARN_HTTP_BLUECOAT);	// X-C4PC-LWPNB-ADDR: 
-	else if(!strcasecmpstart(headers,"x-codemux-client:"))	http_show_warning(headers,conn,WARN_HTTP_CODEMUX);
-	else if(!strcasecmpstart(headers,"x-ebo-ua:"))	http_show_warning(headers,conn,WARN_HTTP_EBO_UA);
-	else if(!strcasecmpstart(headers,"x-fcck"))	http_show_warning(headers,conn,WARN_HTTP_FCCK);			// "X-FCCK:" / "X-FCCKV2:"
-	else if(!strcasecmpstart(headers,"x-forwarded-for:"))	http_show_warning(headers,conn,WARN_HTTP_FWD_FOR);
-	else if(!strcasecmpstart(headers,"x-up-forwarded-for:"))	http_show_warning(headers,conn,WARN_HTTP_FWD_FOR); // x-up-forwarded-for: 
-	else if(!strcasecmpstart(headers,"x-forwarded-host:"))	http_show_warning(headers,conn,WARN_HTTP_FWD_FOR);
-	else if(!strcasecmpstart(headers,"x-forwarded-proto:"))	http_show_warning(headers,conn,WARN_HTTP_FWD_FOR);
-	else if(!strcasecmpstart(headers,"x-forwarded-server:"))	http_show_warning(headers,conn,WARN_HTTP_FWD_FOR);
-	else if(!strcasecmpstart(headers,"x-network-info:"))	http_show_warning(headers,conn,WARN_HTTP_NETINFO);	// X-Network-Info: TCP, 10.0.0.1
-	else if(!strcasecmpstart(headers,"x-network-type:"))	http_show_warning(headers,conn,WARN_HTTP_NETINFO);	// x-network-type: EVDO
-	else if(!strcasecmpstart(headers,"x-nokia"))	http_show_warning(headers,conn,WARN_HTTP_NOKIA);
-	else if(!strcasecmpstart(headers,"x-processandthread"))	http_show_warning(headers,conn,WARN_HTTP_PROCESS);	// "X-ProcessAndThread: iexplore.exe [4660; 5276]"
-	else if(!strcasecmpstart(headers,"x-wap"))	http_show_warning(headers,conn,WARN_HTTP_WAP);
-	else if(!strcasecmpstart(headers,"x2-toolbar-data:"))	http_show_warning(headers,conn,WARN_HTTP_TOOLBAR);
-	else if(!strcasecmpstart(headers,"yahooremoteip"))	http_show_warning(headers,conn,WARN_HTTP_YAHOO);	// "YahooRemoteIP:" / "YahooRemoteIPSig:"
-	else if(!strcasecmpstart(headers,"x-operamini"))	http_show_warning(headers,conn,WARN_HTTP_OPERA);	// "X-OperaMini-Features:" / "X-OperaMini-Phone-UA:" / "X-OperaMini-Phone:" / "X-OperaMini-UA:"
-	else
+	{"client-ip:",WARN_HTTP_CLIENT_IP},
+	{"client_ip:",WARN_HTTP_CLIENT_IP},
+	{"x-client-ip:",WARN_HTTP_CLIENT_IP},
+	{"x-cluster-client-ip:",WARN_HTTP_CLIENT_IP},
+	{"x-nas-ip:",WARN_HTTP_CLIENT_IP},	//X-NAS-IP:
+	{"client-id:",WARN_HTTP_CLIENT_ID},
+	{"x-real-ip:",WARN_HTTP_CLIENT_ID},	//X-Real-IP:
+	{"cuda_cliip:",WARN_HTTP_CUDA_CLIIP},
+	{"ffi",WARN_HTTP_FFI},
+	{"from:",WARN_HTTP_FROM},
+	{"mt-proxy-id:",WARN_HTTP_MT_PROXY_ID},
+	{"ua-",WARN_HTTP_UA},
+	{"userip",WARN_HTTP_USERIP},
+	{"user-ip",WARN_HTTP_USERIP},
+	{"username",WARN_HTTP_USERNAME},
+	{"x-apn-id",WARN_HTTP_XID},
+	{"x-imforwards",WARN_HTTP_XID},		//X-IMForwards:
+	{"x-power-cache",WARN_HTTP_XID},	//x-power-cache:
+	{"x-autopager",WARN_HTTP_XID},
+	{"x-cc-id",WARN_HTTP_XID},
+	{"x-nai-id",WARN_HTTP_XID},
+	{"x-fw2-identity:",WARN_HTTP_XID},
+	{"x-proxy-id:",WARN_HTTP_XID},		//X-Proxy-ID:
+	{"x-ggsnip:",WARN_HTTP_XID},
+	{"x-sgsnip:",WARN_HTTP_XID},		//X-SGSNIP:
+	{"x-charging-id",WARN_HTTP_XID},
+	{"x-slipstream",WARN_HTTP_XID},		//X-SlipStream-Username:
+	{"x-tickcount",WARN_HTTP_XID},
+	{"x-lori-time-1",WARN_HTTP_XID},	//X-lori-time-1:
+	{"x-teacup",WARN_HTTP_XID},		//X-Teacup:
+	{"x-saucer:",WARN_HTTP_XID},		//X-Saucer:
+	{"xid:",WARN_HTTP_XID},
+	{"x-pid:",WARN_HTTP_XID},
+	{"msisdn:",WARN_HTTP_XID},
+	{"x-msp-msisdn:",WARN_HTTP_XID},	//X-MSP-MSISDN:
+	{"x-msp-rat:",WARN_HTTP_XID},		//X-MSP-RAT:
+	{"x-up-subno:",WARN_HTTP_XID},
+	{"x-icap-version:",WARN_HTTP_XID},
+	{"x-livetool:",WARN_HTTP_XID},		//X-Livetool:
+	{"x-imsi:",WARN_HTTP_XID},		//X-IMSI:
+	{"x-msp-ag:",WARN_HTTP_XID},		//X-MSP-AG:
+	{"x-insight:",WARN_HTTP_XID},		//x-insight: activate
+	{"x-d-forwarder:",WARN_HTTP_XID},	//X-D-Forwarder: yes
+	{"via:",WARN_HTTP_XID},			//Via:
+	{"x-via:",WARN_HTTP_XID},		//X-Via:
+	{"x-tm-via:",WARN_HTTP_XID},		//X-TM-Via:
+	{"x-mcproxyfilter:",WARN_HTTP_XID},	//X-McProxyFilter:
+	{"x-varnish:",WARN_HTTP_XID},		//X-Varnish:
+	{"x-authenticated-user:",WARN_HTTP_XID},	//X-Authenticated-User: default://...
+	{"x-bluecoat-via",WARN_HTTP_BLUECOAT},
+	{"x-c4pc-lwpnb-addr:",WARN_HTTP_BLUECOAT},	// X-C4PC-LWPNB-ADDR:
+	{"x-codemux-client:",WARN_HTTP_CODEMUX},
+	{"x-ebo-ua:",WARN_HTTP_EBO_UA},
+	{"x-fcck",WARN_HTTP_FCCK},		// "X-FCCK:" / "X-FCCKV2:"
+	{"x-forwarded-for:",WARN_HTTP_FWD_FOR},
+	{"x-up-forwarded-for:",WARN_HTTP_FWD_FOR},	// x-up-forwarded-for:
+	{"x-forwarded-host:",WARN_HTTP_FWD_FOR},
+	{"x-forwarded-proto:",WARN_HTTP_FWD_FOR},
+	{"x-forwarded-server:",WARN_HTTP_FWD_FOR},
+	{"x-network-info:",WARN_HTTP_NETINFO},	// X-Network-Info: TCP, 10.0.0.1
+	{"x-network-type:",WARN_HTTP_NETINFO},	// x-network-type: EVDO
+	{"x-nokia",WARN_HTTP_NOKIA},
+	{"x-processandthread",WARN_HTTP_PROCESS},	// "X-ProcessAndThread: iexplore.exe [4660; 5276]"
+	{"x-wap",WARN_HTTP_WAP},
+	{"x2-toolbar-data:",WARN_HTTP_TOOLBAR},
+	{"yahooremoteip",WARN_HTTP_YAHOO},	// "YahooRemoteIP:" / "YahooRemoteIPSig:"
+	{"x-operamini",WARN_HTTP_OPERA},	// "X-OperaMini-Features:" / "X-OperaMini-Phone-UA:" / "X-OperaMini-Phone:" / "X-OperaMini-UA:"
+	{NULL,0}
+};
+
+/** Hash index of <b>dangerous_headers</b> by the first DANGEROUS_HEADER_KEY_LEN letters of each prefix; every bucket holds an index
+ * in <b>dangerous_headers</b> plus 1, and <b>dangerous_header_next</b> links the entries of a bucket in table order. */
+#define DANGEROUS_HEADER_KEY_LEN 3
+#define DANGEROUS_HEADER_HASH_SIZE 64
+static uint8_t dangerous_header_hash[DANGEROUS_HEADER_HASH_SIZE];
+static uint8_t dangerous_header_next[sizeof(dangerous_headers)/sizeof(dangerous_headers[0])];
+static uint8_t dangerous_header_len[sizeof(dangerous_headers)/sizeof(dangerous_headers[0])];
+static int dangerous_headers_compiled = 0;
+
+/** Return the bucket of a header that starts with <b>name</b>, or -1 if the header is shorter than DANGEROUS_HEADER_KEY_LEN. */
+static int dangerous_header_bucket(const char *name)
+{	unsigned h = 5381;
+	int i;
+	for(i=0;i<DANGEROUS_HEADER_KEY_LEN;i++)
+	{	if(!name[i])	return -1;
+		h = (h * 33) ^ (uint8_t)TOR_TOLOWER(name[i]);
+	}
+	return h & (DANGEROUS_HEADER_HASH_SIZE-1);
+}
+
+static void dangerous_headers_compile(void)
+{	uint8_t *tail[DANGEROUS_HEADER_HASH_SIZE];
+	int i,h;
+	for(i=0;i<DANGEROUS_HEADER_HASH_SIZE;i++)	tail[i] = &dangerous_header_hash[i];
+	for(i=0;dangerous_headers[i].prefix;i++)
+	{	tor_assert(strlen(dangerous_headers[i].prefix) >= DANGEROUS_HEADER_KEY_LEN);
+		dangerous_header_len[i] = strlen(dangerous_headers[i].prefix);
+		h = dangerous_header_bucket(dangerous_headers[i].prefix);
+		*tail[h] = i + 1;
+		tail[h] = &dangerous_header_next[i];
+	}
+	dangerous_headers_compiled = 1;
+}
+
+int is_header_dangerous(char *headers,connection_t *conn)
+{	int i,h;
+	if(!dangerous_headers_compiled)	dangerous_headers_compile();
+	h = dangerous_header_bucket(headers);
+	for(i = (h < 0) ? 0 : dangerous_header_hash[h];i;i = dangerous_header_next[i-1])
+	{	if(!strncasecmp(headers,dangerous_headers[i-1].prefix,dangerous_header_len[i-1]))
+			break;
+	}
+	if(!i)
 	{	http_show_warning(headers,conn,WARN_HTTP_UNKNOWN);
 		return 0;
 	}
+	http_show_warning(headers,conn,dangerous_headers[i-1].warn_type);
 	if(tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_CLIENT_IP)	return 1;
 	return 0;
 }
 
-char *header_to_domain(char *tmp)
-{	int i;
-	while(tmp[0] && tmp[0]!=':')		tmp++;
-	while(tmp[0]==32 || tmp[0]==':')	tmp++;
-	if(strfind(tmp,"://",0)>=0)
-	{	while(*tmp)
-		{	if(tmp[0]==':')	break;
-			tmp++;
-		}
+/** Return the registrable domain (the last two labels of the host name) of the URL or host name <b>tmp</b>, as a pointer in
+ * <b>tmp</b>. The host name ends at the first ':' or '/', and the scheme is skipped if <b>tmp</b> starts with one. */
+char *url_to_domain(char *tmp)
+{	int i,last_dot = -1,prev_dot = -1;
+	for(i=0;TOR_ISALNUM(tmp[i]) || tmp[i]=='+' || tmp[i]=='-' || tmp[i]=='.';i++)	;
+	if(tmp[i]==':' && tmp[i+1]=='/' && tmp[i+2]=='/')
+	{	tmp += i;
 		while(tmp[0]==':' || tmp[0]=='/')	tmp++;
 	}
-	for(i=0;tmp[i] && tmp[i]!=':' && tmp[i]!='/';i++)	;
-	while(i && tmp[i]!='.')	i--;
-	if(i && tmp[i]=='.')
-	{	i--;
-		while(i && tmp[i]!='/' && tmp[i]!=':' && tmp[i]!='.')	i--;
-		if(tmp[i]=='/' || tmp[i]==':' || tmp[i]=='.')	i++;
-		tmp += i;
+	for(i=0;tmp[i] && tmp[i]!=':' && tmp[i]!='/';i++)
+	{	if(tmp[i]=='.')
+		{	prev_dot = last_dot;
+			last_dot = i;
+		}
 	}
+	if(last_dot > 0)	tmp += prev_dot + 1;
 	return tmp;
 }
 
-char *url_to_domain(char *tmp)
-{	int i;
-	if(strfind(tmp,"://",0)>=0)
-	{	while(*tmp)
-		{	if(tmp[0]==':')	break;
-			tmp++;
+/** Return the registrable domain of the URL in the header line <b>tmp</b>, as a pointer in <b>tmp</b>. */
+char *header_to_domain(char *tmp)
+{	while(tmp[0] && tmp[0]!=':')		tmp++;
+	while(tmp[0]==32 || tmp[0]==':')	tmp++;
+	return url_to_domain(tmp);
+}
+
+/** A BannedHeaders entry, in the list of entries that start with the same letter. */
+typedef struct banned_header_t
+{	struct banned_header_t *next;
+	size_t len;
+	char prefix[];
+} banned_header_t;
+
+/** BannedHeaders, compiled by the first letter of each entry. */
+static struct
+{	const config_line_t *source;	/**< The BannedHeaders list that was compiled. */
+	int generation;			/**< The value of <b>banned_headers_generation</b> when it was compiled. */
+	int ban_all;			/**< True if BannedHeaders has an empty entry. */
+	banned_header_t *by_char[256];
+} banned_headers;
+/** Incremented by banned_headers_invalidate() every time BannedHeaders changes. */
+static int banned_headers_generation = 1;
+
+void banned_headers_invalidate(void)
+{	banned_headers_generation++;
+}
+
+static void banned_headers_compile(void)
+{	config_line_t *cfg;
+	banned_header_t *b;
+	int i;
+	for(i=0;i<256;i++)
+	{	while(banned_headers.by_char[i])
+		{	b = banned_headers.by_char[i]->next;
+			tor_free(banned_headers.by_char[i]);
+			banned_headers.by_char[i] = b;
+		}
+	}
+	banned_headers.ban_all = 0;
+	for(cfg=tmpOptions->BannedHeaders;cfg;cfg=cfg->next)
+	{	size_t len = strlen((char *)cfg->value);
+		if(!len)
+		{	banned_headers.ban_all = 1;
+			continue;
 		}
-		while(tmp[0]==':' || tmp[0]=='/')	tmp++;
-	}
-	for(i=0;tmp[i] && tmp[i]!=':' && tmp[i]!='/';i++)	;
-	while(i && tmp[i]!='.')	i--;
-	if(i && tmp[i]=='.')
-	{	i--;
-		while(i && tmp[i]!='/' && tmp[i]!=':' && tmp[i]!='.')	i--;
-		if(tmp[i]=='/' || tmp[i]==':' || tmp[i]=='.')	i++;
-		tmp += i;
+		b = tor_malloc(sizeof(banned_header_t)+len+1);
+		memcpy(b->prefix,cfg->value,len+1);
+		b->len = len;
+		i = (uint8_t)TOR_TOLOWER(b->prefix[0]);
+		b->next = banned_headers.by_char[i];
+		banned_headers.by_char[i] = b;
 	}
-	return tmp;
+	banned_headers.source = tmpOptions->BannedHeaders;
+	banned_headers.generation = banned_headers_generation;
 }
 
 int is_header_banned(const char *name)
-{	int i = strlen(name),j;
-	if(tmpOptions->BannedHeaders)
-	{	config_line_t *cfg;
-		for(cfg=tmpOptions->BannedHeaders;cfg;cfg=cfg->next)
-		{	j = strlen((char *)cfg->value);
-			if(i >= j && !strcasecmpstart(name,(char *)cfg->value))
-				return 1;
-		}
+{	banned_header_t *b;
+	if(!tmpOptions->BannedHeaders)	return 0;
+	if(banned_headers.source != tmpOptions->BannedHeaders || banned_headers.generation != banned_headers_generation)
+		banned_headers_compile();
+	if(banned_headers.ban_all)	return 1;
+	for(b = banned_headers.by_char[(uint8_t)TOR_TOLOWER(name[0])];b;b=b->next)
+	{	if(!strncasecmp(name,b->prefix,b->len))
+			return 1;
 	}
 	return 0;
 }
 
+/** Request headers that parse_request_headers() knows about. */
+typedef enum
+{	REQUEST_HEADER_UNKNOWN=0,
+	REQUEST_HEADER_ACCEPT,REQUEST_HEADER_ACCEPT_CHARSET,REQUEST_HEADER_ACCEPT_ENCODING,REQUEST_HEADER_ACCEPT_LANGUAGE,
+	REQUEST_HEADER_CONNECTION,REQUEST_HEADER_PROXY_CONNECTION,REQUEST_HEADER_HOST,REQUEST_HEADER_KEEPALIVE,
+	REQUEST_HEADER_REFERER,REQUEST_HEADER_REFERER2,REQUEST_HEADER_ORIG_URL,REQUEST_HEADER_USERAGENT,REQUEST_HEADER_TE,REQUEST_HEADER_TRANSFER_ENCODING,
+	REQUEST_HEADER_CACHE_CONTROL,REQUEST_HEADER_AUTHORIZATION,REQUEST_HEADER_COOKIE,REQUEST_HEADER_COOKIE2,
+	REQUEST_HEADER_IF_MODIFIED_SINCE,REQUEST_HEADER_IF_UNMODIFIED_SINCE,REQUEST_HEADER_IF_MATCH,REQUEST_HEADER_IF_NONE_MATCH,REQUEST_HEADER_IF_RANGE,
+	REQUEST_HEADER_DATE,REQUEST_HEADER_RANGE,REQUEST_HEADER_CONTENT_TYPE,REQUEST_HEADER_CONTENT_LENGTH,REQUEST_HEADER_CONTENT_MD5,
+	REQUEST_HEADER_UA_CPU,REQUEST_HEADER_X_OPERA_ID,REQUEST_HEADER_X_OPERA_INFO,REQUEST_HEADER_X_OPERA_HOST,
+	REQUEST_HEADER_X_OA,REQUEST_HEADER_X_OB,REQUEST_HEADER_X_OC,REQUEST_HEADER_X_REQUESTED_WITH,REQUEST_HEADER_REQUEST_RANGE,
+	REQUEST_HEADER_PRAGMA
+} request_header_t;
+
+static const struct
+{	const char *name;
+	request_header_t id;
+} request_header_names[] =
+{	{"accept",REQUEST_HEADER_ACCEPT},{"accept-charset",REQUEST_HEADER_ACCEPT_CHARSET},{"accept-encoding",REQUEST_HEADER_ACCEPT_ENCODING},
+	{"accept-language",REQUEST_HEADER_ACCEPT_LANGUAGE},{"connection",REQUEST_HEADER_CONNECTION},{"proxy-connection",REQUEST_HEADER_PROXY_CONNECTION},
+	{"host",REQUEST_HEADER_HOST},{"keep-alive",REQUEST_HEADER_KEEPALIVE},{"close",REQUEST_HEADER_KEEPALIVE},
+	{"referer",REQUEST_HEADER_REFERER},{"npfrefr",REQUEST_HEADER_REFERER2},{"origin",REQUEST_HEADER_REFERER2},{"referrer",REQUEST_HEADER_REFERER2},
+	{"x-host",REQUEST_HEADER_ORIG_URL},{"x-orig-url",REQUEST_HEADER_ORIG_URL},{"x-pageview",REQUEST_HEADER_ORIG_URL},{"x-sfs-top",REQUEST_HEADER_ORIG_URL},
+	{"user-agent",REQUEST_HEADER_USERAGENT},{"te",REQUEST_HEADER_TE},{"transfer-encoding",REQUEST_HEADER_TRANSFER_ENCODING},{"cache-control",REQUEST_HEADER_CACHE_CONTROL},
+	{"authorization",REQUEST_HEADER_AUTHORIZATION},{"proxy-authorization",REQUEST_HEADER_AUTHORIZATION},{"proxy-authentication",REQUEST_HEADER_AUTHORIZATION},
+	{"cookie",REQUEST_HEADER_COOKIE},{"cookie2",REQUEST_HEADER_COOKIE2},
+	{"if-modified-since",REQUEST_HEADER_IF_MODIFIED_SINCE},{"if-unmodified-since",REQUEST_HEADER_IF_UNMODIFIED_SINCE},{"if-match",REQUEST_HEADER_IF_MATCH},
+	{"if-none-match",REQUEST_HEADER_IF_NONE_MATCH},{"if-range",REQUEST_HEADER_IF_RANGE},
+	{"date",REQUEST_HEADER_DATE},{"range",REQUEST_HEADER_RANGE},{"content-type",REQUEST_HEADER_CONTENT_TYPE},
+	{"content-length",REQUEST_HEADER_CONTENT_LENGTH},{"content-md5",REQUEST_HEADER_CONTENT_MD5},{"ua-cpu",REQUEST_HEADER_UA_CPU},
+	{"x-opera-id",REQUEST_HEADER_X_OPERA_ID},{"x-opera-info",REQUEST_HEADER_X_OPERA_INFO},{"x-opera-host",REQUEST_HEADER_X_OPERA_HOST},
+	{"x-oa",REQUEST_HEADER_X_OA},{"x-ob",REQUEST_HEADER_X_OB},{"x-oc",REQUEST_HEADER_X_OC},
+	{"x-requested-with",REQUEST_HEADER_X_REQUESTED_WITH},{"request-range",REQUEST_HEADER_REQUEST_RANGE},{"pragma",REQUEST_HEADER_PRAGMA},
+	{NULL,REQUEST_HEADER_UNKNOWN}
+};
+
+/** Hash index of <b>request_header_names</b>; slots hold an index in <b>request_header_names</b> plus 1. */
+#define REQUEST_HEADER_HASH_SIZE 256
+static uint8_t request_header_hash[REQUEST_HEADER_HASH_SIZE];
+
+static unsigned request_header_name_hash(const char *name,int len)
+{	unsigned h = 5381;
+	int i;
+	for(i=0;i<len;i++)	h = (h * 33) ^ (uint8_t)TOR_TOLOWER(name[i]);
+	return h;
+}
+
+/** Return the request header that the header line <b>line</b> starts with. */
+static request_header_t get_request_header(const char *line)
+{	unsigned h;
+	int len,i;
+	if(!request_header_hash[request_header_name_hash("accept",6) & (REQUEST_HEADER_HASH_SIZE-1)])
+	{	for(i=0;request_header_names[i].name;i++)
+		{	h = request_header_name_hash(request_header_names[i].name,strlen(request_header_names[i].name));
+			while(request_header_hash[h & (REQUEST_HEADER_HASH_SIZE-1)])	h++;
+			request_header_hash[h & (REQUEST_HEADER_HASH_SIZE-1)] = i + 1;
+		}
+	}
+	for(len=0;line[len] && line[len]!=':';len++)	;
+	if(line[len]!=':')	return REQUEST_HEADER_UNKNOWN;
+	h = request_header_name_hash(line,len);
+	while((i = request_header_hash[h & (REQUEST_HEADER_HASH_SIZE-1)]) != 0)
+	{	i--;
+		if(!strncasecmp(line,request_header_names[i].name,len) && !request_header_names[i].name[len])
+			return request_header_names[i].id;
+		h++;
+	}
+	return REQUEST_HEADER_UNKNOWN;
+}
+
 void append_header(char *response,int *written,const char *hdrname,const char *hdrval)
-{	if(hdrname && is_header_banned(hdrname))		return;
+{	if(header_template_capture && !header_template_capture->appended)
+	{	header_template_capture->appended = 1;
+		header_template_capture->hdrname = hdrname;
+		header_template_capture->hdrval = hdrval?tor_strdup(hdrval):NULL;
+	}
+	if(hdrname && is_header_banned(hdrname))		return;
 	else if(hdrval && is_header_banned(hdrval))		return;
 	if(hdrname)	tor_snprintf(response + *written,(MAX_HTTP_HEADERS - *written - 1),"%s: %s\r\n",hdrname,hdrval?hdrval:"");
 	else		tor_snprintf(response + *written,(MAX_HTTP_HEADERS - *written - 1),"%s\r\n",hdrval?hdrval:"");
@@ -390,7 +572,85 @@ void regen_utorrent(http_headers *hdrs,connection_t *conn,char *result,int *writ
 }
 
 extern int last_country;
-void write_accept_language(http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
+
+#ifdef DEBUG_MALLOC
+static void header_template_free(void *t,const char *c,int n)
+{	header_template_t *tmpl = t;
+	if(tmpl->hdrval)	_tor_free_(tmpl->hdrval,c,n);
+	_tor_free_(tmpl,c,n);
+}
+#else
+static void header_template_free(void *t)
+{	header_template_t *tmpl = t;
+	if(tmpl->hdrval)	tor_free(tmpl->hdrval);
+	tor_free(tmpl);
+}
+#endif
+
+void free_header_templates(void)
+{	if(header_templates)	strmap_free(header_templates,header_template_free);
+	header_templates = NULL;
+}
+
+/** Return the country that web servers will think that <b>conn</b> comes from, or -1 if it is not known. */
+static int get_conn_country(connection_t *conn)
+{	int country = last_country;
+	if(CONN_IS_EDGE(conn))
+	{	edge_connection_t *c = TO_EDGE_CONN(conn);
+		if(c->cpath_layer && c->cpath_layer->extend_info)
+		{	uint32_t addr = tor_addr_to_ipv4n(&c->cpath_layer->extend_info->addr);
+			country = geoip_get_country_by_ip(addr)&0xff;
+		}
+	}
+	return country;
+}
+
+/** Generate the header of type <b>hdrtype</b> for <b>hdrs</b> with <b>fn</b> only the first time it is needed for the current identity and exit country; next time the same header is added from <b>header_templates</b>. */
+static void write_header_template(char hdrtype,void (*fn)(http_headers *,connection_t *,char *,int *,int),http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
+{	char key[MAX_HEADER_TEMPLATE_KEY];
+	header_template_t *tmpl;
+	int country = -2;
+	if(tmpOptions->RegionalSettings != REGIONAL_SETTINGS_ORIGINAL && tmpOptions->RegionalSettings != REGIONAL_SETTINGS_US_ENGLISH)
+		country = get_conn_country(conn);
+	if(tor_snprintf(key,sizeof(key),"%c %i %i %i %i %i %i %i %i %i %i %i %i\n%s\n%s",hdrtype,browser_type,country,tmpOptions->HTTPAgent,tmpOptions->HTTPOS,tmpOptions->HTTPFlags,tmpOptions->RegionalSettings,hdrs->useragent,hdrs->detected_agent,hdrs->agent_version_1,hdrs->agent_version_2,hdrs->agent_version_3,hdrs->agent_version_4,hdrs->http_useragent?hdrs->http_useragent:"",hdrs->http_accept_language?hdrs->http_accept_language:"") < 0)
+	{	fn(hdrs,conn,result,written,browser_type);
+		return;
+	}
+	if(!header_templates || header_templates_seeds[0] != identity_seed1 || header_templates_seeds[1] != identity_seed2 || header_templates_seeds[2] != identity_seed3 || header_templates_seeds[3] != identity_seed4 || strmap_size(header_templates) >= MAX_HEADER_TEMPLATES)
+	{	free_header_templates();
+		header_templates = strmap_new();
+		header_templates_seeds[0] = identity_seed1;
+		header_templates_seeds[1] = identity_seed2;
+		header_templates_seeds[2] = identity_seed3;
+		header_templates_seeds[3] = identity_seed4;
+	}
+	tmpl = strmap_get(header_templates,key);
+	if(!tmpl)
+	{	tmpl = tor_malloc_zero(sizeof(header_template_t));
+		header_template_capture = tmpl;
+		fn(hdrs,conn,result,written,browser_type);
+		header_template_capture = NULL;
+		tmpl->agent_version[0] = hdrs->agent_version_1;
+		tmpl->agent_version[1] = hdrs->agent_version_2;
+		tmpl->agent_version[2] = hdrs->agent_version_3;
+		tmpl->agent_version[3] = hdrs->agent_version_4;
+		tmpl->rsvd[0] = hdrs->rsvd1;
+		tmpl->rsvd[1] = hdrs->rsvd2;
+		tmpl->rsvd[2] = hdrs->rsvd3;
+		strmap_set(header_templates,key,tmpl);
+		return;
+	}
+	hdrs->agent_version_1 = tmpl->agent_version[0];
+	hdrs->agent_version_2 = tmpl->agent_version[1];
+	hdrs->agent_version_3 = tmpl->agent_version[2];
+	hdrs->agent_version_4 = tmpl->agent_version[3];
+	hdrs->rsvd1 = tmpl->rsvd[0];
+	hdrs->rsvd2 = tmpl->rsvd[1];
+	hdrs->rsvd3 = tmpl->rsvd[2];
+	if(tmpl->appended)	append_header(result,written,tmpl->hdrname,tmpl->hdrval);
+}
+
+static void generate_accept_language(http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
 {	if(browser_type == BROWSER_IE)
 	{	if(!hdrs->http_accept_language)	return;
 		if(tmpOptions->RegionalSettings == REGIONAL_SETTINGS_ORIGINAL)
@@ -910,7 +1170,7 @@ void set_browser_version(http_headers *hdrs)
 	}
 }
 
-void write_user_agent(http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
+static void generate_user_agent(http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
 {	if(tmpOptions->HTTPAgent == BROWSER_NOCHANGE)
 	{	if(hdrs->http_useragent)
 			append_header(result,written,NULL,hdrs->http_useragent);
@@ -1270,6 +1530,14 @@ void write_user_agent(http_headers *hdrs,connection_t *conn,char *result,int *wr
 	tor_free(agent);
 }
 
+void write_user_agent(http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
+{	write_header_template('U',generate_user_agent,hdrs,conn,result,written,browser_type);
+}
+
+void write_accept_language(http_headers *hdrs,connection_t *conn,char *result,int *written,int browser_type)
+{	write_header_template('L',generate_accept_language,hdrs,conn,result,written,browser_type);
+}
+
 void regen_chrome(http_headers *hdrs,connection_t *conn,char *result,int *written)
 {	append_header(result,written,NULL,hdrs->http_request);
 	append_header(result,written,"Host",hdrs->http_host);
@@ -1604,105 +1872,104 @@ char *parse_request_headers(char *headers,connection_t *conn)
 		if(tmp[0]==10 && tmp[1]==10)	tmp[1] = 0;
 		tmp[0] = 0;
 		if(tmp_headers != tmp)
-		{	if(tmp_headers == headers)					hdrs->http_request = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"accept:"))		hdrs->http_accept = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"accept-charset:"))	hdrs->http_accept_charset = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"accept-encoding:"))	hdrs->http_accept_encoding = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"accept-language:"))	hdrs->http_accept_language = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"connection:"))		hdrs->http_connection = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"proxy-connection:"))	hdrs->http_proxy_connection = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"host:"))
-			{	tmp_headers += 5;
-				while(tmp_headers[0]==32)	tmp_headers++;
-				if(tmp_headers[0])	hdrs->http_host = tor_strdup(tmp_headers);
+		{	request_header_t hdr = REQUEST_HEADER_UNKNOWN;
+			if(tmp_headers != headers)
+			{	hdr = get_request_header(tmp_headers);
+				if(hdr >= REQUEST_HEADER_IF_MODIFIED_SINCE && hdr <= REQUEST_HEADER_IF_RANGE && (tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_IFS))
+					hdr = REQUEST_HEADER_UNKNOWN;
 			}
-			else if(!strcasecmpstart(tmp_headers,"keep-alive:") || !strcasecmpstart(tmp_headers,"close:"))	hdrs->http_keepalive = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"referer:"))		hdrs->http_referer = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"npfrefr:"))		hdrs->http_referer2 = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"origin:"))		hdrs->http_referer2 = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"referrer:"))		hdrs->http_referer2 = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-host:"))		hdrs->http_orig_url = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-orig-url:"))		hdrs->http_orig_url = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-pageview:"))		hdrs->http_orig_url = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-sfs-top:"))		hdrs->http_orig_url = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"user-agent:"))		hdrs->http_useragent = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"te:"))			hdrs->http_te = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"cache-control:"))		hdrs->http_cache_control = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"authorization:"))		hdrs->http_authorization = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"proxy-authorization:") || !strcasecmpstart(tmp_headers,"proxy-authentication:"))		hdrs->http_authorization = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"cookie:"))
-			{	tmp_headers += 7;
-				while(tmp_headers[0] == 32 || tmp_headers[0]==';')	tmp_headers++;
-				if(!hdrs->http_cookies)
-				{	hdrs->http_cookies = tor_malloc(MAX_COOKIES);
-					hdrs->http_cookies[0] = 0;
-				}
-				for(i=0;i<MAX_COOKIES-3 && hdrs->http_cookies[i];i++)	;
-				while(i)
-				{	if(hdrs->http_cookies[i-1] == 32 || hdrs->http_cookies[i-1] == ';')	i--;
-					else	break;
-				}
-				while(i < MAX_COOKIES-4 && tmp_headers[0]!=13 && tmp_headers[0]!=10)
-				{	if(i)
-					{	hdrs->http_cookies[i++] = ';';
-						hdrs->http_cookies[i++] = ' ';
-					}
-					while(i < MAX_COOKIES-2 && tmp_headers[0]!=';' && tmp_headers[0]!=13 && tmp_headers[0]!=10)
-					{	hdrs->http_cookies[i++] = tmp_headers[0];
-						tmp_headers++;
+			if(tmp_headers == headers)					hdrs->http_request = tmp_headers;
+			else switch(hdr)
+			{	case REQUEST_HEADER_ACCEPT:		hdrs->http_accept = tmp_headers;break;
+				case REQUEST_HEADER_ACCEPT_CHARSET:	hdrs->http_accept_charset = tmp_headers;break;
+				case REQUEST_HEADER_ACCEPT_ENCODING:	hdrs->http_accept_encoding = tmp_headers;break;
+				case REQUEST_HEADER_ACCEPT_LANGUAGE:	hdrs->http_accept_language = tmp_headers;break;
+				case REQUEST_HEADER_CONNECTION:		hdrs->http_connection = tmp_headers;break;
+				case REQUEST_HEADER_PROXY_CONNECTION:	hdrs->http_proxy_connection = tmp_headers;break;
+				case REQUEST_HEADER_HOST:
+					tmp_headers += 5;
+					while(tmp_headers[0]==32)	tmp_headers++;
+					if(tmp_headers[0])	hdrs->http_host = tor_strdup(tmp_headers);
+					break;
+				case REQUEST_HEADER_KEEPALIVE:		hdrs->http_keepalive = tmp_headers;break;
+				case REQUEST_HEADER_REFERER:		hdrs->http_referer = tmp_headers;break;
+				case REQUEST_HEADER_REFERER2:		hdrs->http_referer2 = tmp_headers;break;
+				case REQUEST_HEADER_ORIG_URL:		hdrs->http_orig_url = tmp_headers;break;
+				case REQUEST_HEADER_USERAGENT:		hdrs->http_useragent = tmp_headers;break;
+				case REQUEST_HEADER_TE:			hdrs->http_te = tmp_headers;break;
+				case REQUEST_HEADER_TRANSFER_ENCODING:	hdrs->http_transfer_encoding = tmp_headers;break;
+				case REQUEST_HEADER_CACHE_CONTROL:	hdrs->http_cache_control = tmp_headers;break;
+				case REQUEST_HEADER_AUTHORIZATION:	hdrs->http_authorization = tmp_headers;break;
+				case REQUEST_HEADER_COOKIE:
+					tmp_headers += 7;
+					while(tmp_headers[0] == 32 || tmp_headers[0]==';')	tmp_headers++;
+					if(!hdrs->http_cookies)
+					{	hdrs->http_cookies = tor_malloc(MAX_COOKIES);
+						hdrs->http_cookies[0] = 0;
 					}
+					for(i=0;i<MAX_COOKIES-3 && hdrs->http_cookies[i];i++)	;
 					while(i)
 					{	if(hdrs->http_cookies[i-1] == 32 || hdrs->http_cookies[i-1] == ';')	i--;
 						else	break;
 					}
-					while(tmp_headers[0] == 32 || tmp_headers[0]==';')	tmp_headers++;
-				}
-				hdrs->http_cookies[i] = 0;
-			}
-			else if(!strcasecmpstart(tmp_headers,"cookie2:"))		hdrs->http_cookie2 = tmp_headers;	// Cookie2: $Version="1"
-			else if(!strcasecmpstart(tmp_headers,"if-modified-since:") && !(tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_IFS))
-				hdrs->http_if_modified_since = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"if-unmodified-since:") && !(tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_IFS))
-				hdrs->http_if_unmodified_since = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"if-match:") && !(tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_IFS))
-				hdrs->http_if_match = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"if-none-match:") && !(tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_IFS))
-				hdrs->http_if_none_match = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"if-range:") && !(tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_IFS))
-				hdrs->http_if_range = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"date:"))			hdrs->http_date = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"range:"))			hdrs->http_range = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"content-type:"))		hdrs->http_content_type = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"content-length:"))
-			{	char *tmp1;
-				tmp1 = tmp_headers + 14;
-				while(tmp1[0]==32 || tmp1[0]==':')	tmp1++;
-				conn->need_data = 0;
-				while(tmp1[0]>='0' && tmp1[0]<='9')
-				{	conn->need_data = conn->need_data * 10 + (tmp1[0] - 0x30);
-					tmp1++;
-				}
-				if(conn->need_data < 0)	conn->need_data = 0;
-				hdrs->http_content_length = tmp_headers;
-				
-			}
-			else if(!strcasecmpstart(tmp_headers,"content-md5:"))		hdrs->http_content_md5 = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"ua-cpu:"))		hdrs->http_ua_cpu = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-opera-id:"))		hdrs->http_x_opera_id = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-opera-info:"))		hdrs->http_x_opera_info = tor_strdup(tmp_headers);
-			else if(!strcasecmpstart(tmp_headers,"x-opera-host:"))		hdrs->http_x_opera_host = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-oa:"))			hdrs->http_x_oa = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-ob:"))			hdrs->http_x_ob = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-oc:"))			hdrs->http_x_oc = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"x-requested-with:"))	hdrs->http_x_requested_with = tmp_headers;
-			else if(!strcasecmpstart(tmp_headers,"request-range:")){	if(!hdrs->http_range)	hdrs->http_range = tmp_headers;}
-			else if(!strcasecmpstart(tmp_headers,"pragma:"))		;
-			else if(!strcasecmpstart(tmp_headers,"cache-control:"))		;
-			else if (!is_header_dangerous(tmp_headers,conn))
-			{	if(!hdrs->http_unknown_1)				hdrs->http_unknown_1 = tmp_headers;
-				else if(!hdrs->http_unknown_2)				hdrs->http_unknown_2 = tmp_headers;
-				else if(!hdrs->http_unknown_3)				hdrs->http_unknown_3 = tmp_headers;
-				else if(!hdrs->http_unknown_4)				hdrs->http_unknown_4 = tmp_headers;
+					while(i < MAX_COOKIES-4 && tmp_headers[0]!=13 && tmp_headers[0]!=10)
+					{	if(i)
+						{	hdrs->http_cookies[i++] = ';';
+							hdrs->http_cookies[i++] = ' ';
+						}
+						while(i < MAX_COOKIES-2 && tmp_headers[0]!=';' && tmp_headers[0]!=13 && tmp_headers[0]!=10)
+						{	hdrs->http_cookies[i++] = tmp_headers[0];
+							tmp_headers++;
+						}
+						while(i)
+						{	if(hdrs->http_cookies[i-1] == 32 || hdrs->http_cookies[i-1] == ';')	i--;
+							else	break;
+						}
+						while(tmp_headers[0] == 32 || tmp_headers[0]==';')	tmp_headers++;
+					}
+					hdrs->http_cookies[i] = 0;
+					break;
+				case REQUEST_HEADER_COOKIE2:		hdrs->http_cookie2 = tmp_headers;break;	// Cookie2: $Version="1"
+				case REQUEST_HEADER_IF_MODIFIED_SINCE:	hdrs->http_if_modified_since = tmp_headers;break;
+				case REQUEST_HEADER_IF_UNMODIFIED_SINCE:	hdrs->http_if_unmodified_since = tmp_headers;break;
+				case REQUEST_HEADER_IF_MATCH:		hdrs->http_if_match = tmp_headers;break;
+				case REQUEST_HEADER_IF_NONE_MATCH:	hdrs->http_if_none_match = tmp_headers;break;
+				case REQUEST_HEADER_IF_RANGE:		hdrs->http_if_range = tmp_headers;break;
+				case REQUEST_HEADER_DATE:		hdrs->http_date = tmp_headers;break;
+				case REQUEST_HEADER_RANGE:		hdrs->http_range = tmp_headers;break;
+				case REQUEST_HEADER_CONTENT_TYPE:	hdrs->http_content_type = tmp_headers;break;
+				case REQUEST_HEADER_CONTENT_LENGTH:
+					{	char *tmp1;
+						tmp1 = tmp_headers + 14;
+						while(tmp1[0]==32 || tmp1[0]==':')	tmp1++;
+						conn->need_data = 0;
+						while(tmp1[0]>='0' && tmp1[0]<='9')
+						{	conn->need_data = conn->need_data * 10 + (tmp1[0] - 0x30);
+							tmp1++;
+						}
+						if(conn->need_data < 0)	conn->need_data = 0;
+						hdrs->http_content_length = tmp_headers;
+					}
+					break;
+				case REQUEST_HEADER_CONTENT_MD5:	hdrs->http_content_md5 = tmp_headers;break;
+				case REQUEST_HEADER_UA_CPU:		hdrs->http_ua_cpu = tmp_headers;break;
+				case REQUEST_HEADER_X_OPERA_ID:		hdrs->http_x_opera_id = tmp_headers;break;
+				case REQUEST_HEADER_X_OPERA_INFO:	hdrs->http_x_opera_info = tor_strdup(tmp_headers);break;
+				case REQUEST_HEADER_X_OPERA_HOST:	hdrs->http_x_opera_host = tmp_headers;break;
+				case REQUEST_HEADER_X_OA:		hdrs->http_x_oa = tmp_headers;break;
+				case REQUEST_HEADER_X_OB:		hdrs->http_x_ob = tmp_headers;break;
+				case REQUEST_HEADER_X_OC:		hdrs->http_x_oc = tmp_headers;break;
+				case REQUEST_HEADER_X_REQUESTED_WITH:	hdrs->http_x_requested_with = tmp_headers;break;
+				case REQUEST_HEADER_REQUEST_RANGE:	if(!hdrs->http_range)	hdrs->http_range = tmp_headers;break;
+				case REQUEST_HEADER_PRAGMA:		break;
+				default:
+					if(!is_header_dangerous(tmp_headers,conn))
+					{	if(!hdrs->http_unknown_1)				hdrs->http_unknown_1 = tmp_headers;
+						else if(!hdrs->http_unknown_2)				hdrs->http_unknown_2 = tmp_headers;
+						else if(!hdrs->http_unknown_3)				hdrs->http_unknown_3 = tmp_headers;
+						else if(!hdrs->http_unknown_4)				hdrs->http_unknown_4 = tmp_headers;
+					}
+					break;
 			}
 		}
 		if(tmp[1]==10 && tmp[2]==13 && tmp[3]==10)	break;
@@ -1985,6 +2252,8 @@ char *parse_request_headers(char *headers,connection_t *conn)
 	}
 	if(hdrs->http_authorization)
 		append_header(tmp_headers,&written,NULL,hdrs->http_authorization);
+	if(hdrs->http_transfer_encoding)	// the message body can't be framed without it
+		append_header(tmp_headers,&written,NULL,hdrs->http_transfer_encoding);
 	if(hdrs->http_x_opera_id || hdrs->http_x_opera_info || hdrs->http_x_opera_host || hdrs->http_x_oa || hdrs->http_x_ob || hdrs->http_x_oc)
 	{	i = strlen(tmp_headers);
 		if(hdrs->http_x_opera_info && i+strlen(hdrs->http_x_opera_info) < MAX_HTTP_HEADERS-30)
@@ -2033,12 +2302,15 @@ char *parse_request_headers(char *headers,connection_t *conn)
 		tor_free(tmp1);
 	}
 
-	if(hdrs->http_te && (conn->need_data == 0) && hdrs->http_request[0]!='G' && hdrs->http_request[0]!='H')
-	{	tmp = hdrs->http_te;
-		while(tmp[0]!=':' && tmp[0])	tmp++;
+	/* A request body is framed by Transfer-Encoding if it has one (RFC 2616, 4.4), otherwise by Content-Length, so that we know where the next request starts */
+	tmp = hdrs->http_transfer_encoding;
+	if(tmp)
+	{	while(tmp[0]!=':' && tmp[0])	tmp++;
 		while(tmp[0]==32 || tmp[0]==':')	tmp++;
-		if(strcasecmpstart(tmp,"identity"))
-			conn->need_trailers |= EXPECTING_CHUNK;
+	}
+	if(tmp && strcasecmpstart(tmp,"identity"))
+	{	conn->need_data = 0;
+		conn->need_trailers |= EXPECTING_CHUNK;
 	}
 	else if(hdrs->http_connection && (conn->need_data == 0) && !hdrs->http_keepalive)
 	{	tmp = hdrs->http_connection;
@@ -2103,7 +2375,8 @@ char *parse_request_headers(char *headers,connection_t *conn)
 	return tmp_headers;
 }
 
-char *parse_response_headers(connection_t *conn,char *headers,int hdrlen)
+/** Filter the <b>hdrlen</b> bytes of response headers at <b>headers</b> in place. Headers that are removed are spliced out; the others are left where they are unless an earlier header was removed. Return the new length of the headers, or -1 if they are not valid. */
+int parse_response_headers(connection_t *conn,char *headers,int hdrlen)
 {	char *tmp,*tmp_headers;
 	int i,j;
 	int httpstatus = 0;
@@ -2115,7 +2388,7 @@ char *parse_response_headers(connection_t *conn,char *headers,int hdrlen)
 		tmp[hdrlen] = 0;
 		log(LOG_WARN,LD_APP,"Unrecognized response headers: %s",tmp);
 		tor_free(tmp);
-		return NULL;
+		return -1;
 	}
 	while(tmp[0]>32)	tmp++;
 	if(tmp[0]==32)
@@ -2131,11 +2404,9 @@ char *parse_response_headers(connection_t *conn,char *headers,int hdrlen)
 		{	httpstatus = httpstatus * 10 + (tmp[0] - 0x30);
 			tmp++;
 		}
-		if(!httpstatus)	return NULL;
+		if(!httpstatus)	return -1;
 	}
-	char *response = tor_malloc(hdrlen*2);
-	response[0] = 0;
-	j = 0;
+	char *response = headers;
 	while(hdrlen)
 	{	if((tmpOptions->HTTPFlags & HTTP_SETTING_REMOVE_ETAGS) && ((!strcasecmpstart(tmp_headers,"etag")) || (!strcasecmpstart(tmp_headers,"last-modified"))))
 		{	while(tmp_headers[0]!=13 && tmp_headers[0]!=10 && hdrlen)
@@ -2209,14 +2480,13 @@ char *parse_response_headers(connection_t *conn,char *headers,int hdrlen)
 			}
 			register_new_cookie(tmp_headers,conn);
 		}
-		while(tmp_headers[0]!=13 && tmp_headers[0]!=10 && hdrlen)
-		{	response[j++] = *tmp_headers++;
-			hdrlen--;
-		}
-		while(hdrlen && ((tmp_headers[0]==13) || (tmp_headers[0]==10)))
-		{	response[j++] = *tmp_headers++;
-			hdrlen--;
-		}
+		i = 0;
+		while(i < hdrlen && tmp_headers[i]!=13 && tmp_headers[i]!=10)	i++;
+		while(i < hdrlen && (tmp_headers[i]==13 || tmp_headers[i]==10))	i++;
+		if(response != tmp_headers)	memmove(response,tmp_headers,i);
+		response += i;
+		tmp_headers += i;
+		hdrlen -= i;
 	}
 	if((conn->expecting_trailers & EXPECTING_CLOSE) && ((conn->expecting_trailers != EXPECTING_CLOSE) || conn->expecting_data))
 	{	conn->expecting_trailers ^= EXPECTING_CLOSE;
@@ -2226,8 +2496,7 @@ char *parse_response_headers(connection_t *conn,char *headers,int hdrlen)
 		{	conn->expecting_trailers |= EXPECTING_CLOSE;
 		}
 	}
-	response[j] = 0;
-	return response;
+	return response - headers;
 }
 
 void free_cookie(cookie_info *c)
@@ -2238,34 +2507,106 @@ void free_cookie(cookie_info *c)
 	tor_free(c);
 }
 
+static INLINE unsigned
+cookie_info_hash(const cookie_info *c)
+{
+	unsigned h = (unsigned) c->pid;
+	const char *s;
+	for(s = c->cookie_domain;*s;s++)	h = h*33 + TOR_TOLOWER(*s);
+	h = h*33 + '/';
+	for(s = c->cookie_name;*s;s++)	h = h*33 + TOR_TOLOWER(*s);
+	return ht_improve_hash(h);
+}
+
+static INLINE int
+cookie_info_eq(const cookie_info *a, const cookie_info *b)
+{
+	return a->pid == b->pid && !strcasecmp(a->cookie_domain,b->cookie_domain) && !strcasecmp(a->cookie_name,b->cookie_name);
+}
+
+HT_PROTOTYPE(cookiemap, cookie_info, node, cookie_info_hash, cookie_info_eq);
+HT_GENERATE(cookiemap, cookie_info, node, cookie_info_hash, cookie_info_eq, 0.6);
+
+/** Return the number of bytes used by the stored cookie <b>c</b>. */
+static size_t cookie_mem_usage(const cookie_info *c)
+{	return sizeof(cookie_info) + strlen(c->cookie_name) + strlen(c->cookie_val) + strlen(c->cookie_domain) + strlen(c->cookie_path) + 4;
+}
+
+/** Free a chain of stored cookies. */
+static void free_cookie_chain(cookie_info *c)
+{	cookie_info *tmp;
+	while(c)
+	{	tmp = c->next;
+		tor_mem_account(MEM_TAG_COOKIES,-(LONG)cookie_mem_usage(c));
+		free_cookie(c);
+		c = tmp;
+	}
+}
+
+/** Return the cookies that match the pid, domain and name of <b>key</b>, forgetting them if they were set before the last identity change. */
+static cookie_info *find_cookies(cookie_info *key)
+{	cookie_info *c = HT_FIND(cookiemap,&cookies,key);
+	if(c && c->identity != cookie_generation)
+	{	HT_REMOVE(cookiemap,&cookies,c);
+		free_cookie_chain(c);
+		c = NULL;
+	}
+	return c;
+}
+
+/** Forget all the cookies that web servers have set. Since this happens on every identity change, only the generation is changed; the old cookies are freed when they are seen again, or when there are too many of them. */
 void free_cookies(void)
-{	while(cookies)
-	{	cookie_info *c = cookies->next;
-		free_cookie(cookies);
-		cookies = c;
+{	cookie_generation++;
+	if(HT_SIZE(&cookies) > MAX_EXPIRED_COOKIES)
+		free_all_cookies();
+}
+
+void free_all_cookies(void)
+{	cookie_info **c,*tmp;
+	for(c = HT_START(cookiemap,&cookies);c;)
+	{	tmp = *c;
+		c = HT_NEXT_RMV(cookiemap,&cookies,c);
+		free_cookie_chain(tmp);
+	}
+	HT_CLEAR(cookiemap,&cookies);
+}
+
+/** Free the cookies that were set before the last identity change, because we are short of memory. */
+void free_expired_cookies(void)
+{	cookie_info **c,*tmp;
+	for(c = HT_START(cookiemap,&cookies);c;)
+	{	tmp = *c;
+		if(tmp->identity != cookie_generation)
+		{	c = HT_NEXT_RMV(cookiemap,&cookies,c);
+			free_cookie_chain(tmp);
+		}
+		else	c = HT_NEXT(cookiemap,&cookies,c);
 	}
 }
 
 int is_known_cookie(char *cookie,char *host,DWORD pid)
 {	if(!(tmpOptions->IdentityFlags & IDENTITY_FLAG_EXPIRE_HTTP_COOKIES))	return 1;
-	char *cdomain = url_to_domain(host);
-	char *c = tor_strdup(cookie);
-	char *cval = c;
-	cookie_info *cookie_tmp = cookies;
+	cookie_info key,*cookie_tmp;
+	char *cval = cookie;
+	int r = 0;
 	while(cval[0] && cval[0]!='=')	cval++;
+	key.pid = pid;
+	key.cookie_domain = url_to_domain(host);
+	key.cookie_name = cookie;
 	if(cval[0]=='=')
 	{	cval[0] = 0;
-		cval++;
+		cookie_tmp = find_cookies(&key);
+		*cval++ = '=';
 	}
+	else	cookie_tmp = find_cookies(&key);
 	while(cookie_tmp)
-	{	if(cookie_tmp->pid == pid && !strcasecmp(cdomain,cookie_tmp->cookie_domain) && !strcasecmp(cookie_tmp->cookie_name,c) && !strcasecmp(cookie_tmp->cookie_val,cval))
-		{	tor_free(c);
-			return 1;
+	{	if(!strcasecmp(cookie_tmp->cookie_val,cval))
+		{	r = 1;
+			break;
 		}
 		cookie_tmp = cookie_tmp->next;
 	}
-	tor_free(c);
-	return 0;
+	return r;
 }
 
 void write_cookies(char *headers,int *written,char *host,DWORD pid,char *cookies2)
@@ -2311,7 +2652,7 @@ void write_cookies(char *headers,int *written,char *host,DWORD pid,char *cookies
 #define COOKIE_FLAG_HTTP 1
 #define COOKIE_FLAG_HTTPS 2
 void register_new_cookie(char *cookie,connection_t *conn)
-{	cookie_info **pcookies,*tmp_cookies;
+{	cookie_info *tmp_cookies;
 	int i,j;
 	int cflags = 0;
 	cookie_info *new_cookie = tor_malloc_zero(sizeof(cookie_info));
@@ -2386,20 +2727,27 @@ void register_new_cookie(char *cookie,connection_t *conn)
 	}
 	if(!new_cookie->cookie_path)	new_cookie->cookie_path = tor_strdup("/");
 	new_cookie->pid = conn->pid;
-	pcookies = &cookies;
-	while(*pcookies)
-	{	tmp_cookies = *pcookies;
-		if(tmp_cookies->pid == conn->pid && !strcasecmp(tmp_cookies->cookie_name,new_cookie->cookie_name) && !strcasecmp(tmp_cookies->cookie_domain,new_cookie->cookie_domain) && !strcasecmp(tmp_cookies->cookie_path,new_cookie->cookie_path))
-			break;
-		pcookies = &tmp_cookies->next;
+	new_cookie->identity = cookie_generation;
+	tmp_cookies = find_cookies(new_cookie);
+	if(!tmp_cookies)
+	{	HT_INSERT(cookiemap,&cookies,new_cookie);
+		tor_mem_account(MEM_TAG_COOKIES,cookie_mem_usage(new_cookie));
+		return;
 	}
-	if(*pcookies)
-	{	tmp_cookies = *pcookies;
-		char *tmpval = tmp_cookies->cookie_val;
-		tmp_cookies->cookie_val = new_cookie->cookie_val;
-		if(tmpval)	tor_free(tmpval);
-		new_cookie->cookie_val = NULL;
-		free_cookie(new_cookie);
+	while(tmp_cookies)
+	{	if(!strcasecmp(tmp_cookies->cookie_path,new_cookie->cookie_path))
+			break;
+		if(!tmp_cookies->next)
+		{	tmp_cookies->next = new_cookie;
+			tor_mem_account(MEM_TAG_COOKIES,cookie_mem_usage(new_cookie));
+			return;
+		}
+		tmp_cookies = tmp_cookies->next;
 	}
-	else	*pcookies = new_cookie;
+	tor_mem_account(MEM_TAG_COOKIES,(LONG)strlen(new_cookie->cookie_val) - (LONG)strlen(tmp_cookies->cookie_val));
+	char *tmpval = tmp_cookies->cookie_val;
+	tmp_cookies->cookie_val = new_cookie->cookie_val;
+	if(tmpval)	tor_free(tmpval);
+	new_cookie->cookie_val = NULL;
+	free_cookie(new_cookie);
 }
@@ -20,14 +20,18 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "etw.h"
 #include "geoip.h"
+#include "loopexit.h"
 #include "main.h"
 #include "mempool.h"
 #include "networkstatus.h"
+#include "perf.h"
 #include "policies.h"
 #include "reasons.h"
 #include "relay.h"
 #include "rendcommon.h"
+#include "rendlocal.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
@@ -118,9 +122,9 @@ relay_digest_matches(crypto_digest_env_t *digest, cell_t *cell)
 {
   char received_integrity[4], calculated_integrity[4];
   relay_header_t rh;
-  crypto_digest_env_t *backup_digest=NULL;
+  crypto_digest_checkpoint_t backup_digest;
 
-  backup_digest = crypto_digest_dup(digest);
+  crypto_digest_checkpoint(&backup_digest, digest);
 
   relay_header_unpack(&rh, cell->payload);
   memcpy(received_integrity, rh.integrity, 4);
@@ -138,14 +142,12 @@ relay_digest_matches(crypto_digest_env_t *digest, cell_t *cell)
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
 // (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
+    crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
     memcpy(rh.integrity, received_integrity, 4);
     relay_header_pack(cell->payload, &rh);
-    crypto_free_digest_env(backup_digest);
     return 0;
   }
-  crypto_free_digest_env(backup_digest);
   return 1;
 }
 
@@ -186,6 +188,19 @@ relay_crypt_one_payload(crypto_cipher_env_t *cipher, uint8_t *in,
 int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
+{
+  return circuit_receive_precrypted_relay_cell(cell, circ, cell_direction,
+                                               NULL);
+}
+
+/** As circuit_receive_relay_cell(), but if <b>precrypt</b> is set, the
+ * cell has already been crypted by relay_precrypt_cell(): use its result
+ * instead of crypting the cell again.
+ */
+int
+circuit_receive_precrypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                      cell_direction_t cell_direction,
+                                      const relay_precrypt_t *precrypt)
 {
   or_connection_t *or_conn=NULL;
   crypt_path_t *layer_hint=NULL;
@@ -196,10 +211,23 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   tor_assert(circ);
   tor_assert(cell_direction == CELL_DIRECTION_OUT ||
              cell_direction == CELL_DIRECTION_IN);
+  tor_assert(!precrypt || precrypt->circ == circ);
   if (circ->marked_for_close)
     return 0;
 
-  if (relay_crypt(circ, cell, cell_direction, &layer_hint, &recognized) < 0) {
+  if (precrypt) {
+    if (precrypt->result == -2) {
+      log_fn(LOG_PROTOCOL_WARN, LD_OR,get_lang_str(LANG_LOG_RELAY_UNRECOGNIZED_CELL_4));
+      return -END_CIRC_REASON_TORPROTOCOL;
+    }
+    if (precrypt->result < 0) {
+      log_warn(LD_BUG,get_lang_str(LANG_LOG_RELAY_RELAY_ENCRYPTION_ERROR_2));
+      return -END_CIRC_REASON_INTERNAL;
+    }
+    recognized = precrypt->recognized;
+    layer_hint = precrypt->layer_hint;
+  } else if (relay_crypt(circ, cell, cell_direction, &layer_hint,
+                         &recognized) < 0) {
     log_warn(LD_BUG,get_lang_str(LANG_LOG_RELAY_RELAY_ENCRYPTION_ERROR_2));
     return -END_CIRC_REASON_INTERNAL;
   }
@@ -357,6 +385,61 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
   return 0;
 }
 
+/** Do the crypto that relay_crypt() would do for <b>cell</b> arriving on
+ * <b>circ</b> in direction <b>cell_direction</b>, and record the outcome in
+ * <b>out</b>: one hop for an or_circuit, or the layered decrypts for an
+ * inbound cell on an open origin circuit.  This only touches the cipher
+ * and digest state of <b>circ</b> for that direction and never logs, so
+ * relay crypto workers may call it for different circuits at once.
+ */
+void
+relay_precrypt_cell(circuit_t *circ, cell_t *cell,
+                    cell_direction_t cell_direction, relay_precrypt_t *out)
+{
+  or_circuit_t *or_circ;
+  crypto_cipher_env_t *cipher;
+  relay_header_t rh;
+
+  out->circ = circ;
+  out->recognized = 0;
+  out->result = 0;
+  out->layer_hint = NULL;
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    crypt_path_t *thishop, *cpath = TO_ORIGIN_CIRCUIT(circ)->cpath;
+    tor_assert(cell_direction == CELL_DIRECTION_IN);
+    thishop = cpath;
+    do {
+      if (crypto_cipher_crypt_inplace(thishop->b_crypto, (char*) cell->payload,
+                                      CELL_PAYLOAD_SIZE)) {
+        out->result = -1;
+        return;
+      }
+      relay_header_unpack(&rh, cell->payload);
+      if (rh.recognized == 0 && relay_digest_matches(thishop->b_digest, cell)) {
+        out->recognized = 1;
+        out->layer_hint = thishop;
+        return;
+      }
+      thishop = thishop->next;
+    } while (thishop != cpath && thishop->state == CPATH_STATE_OPEN);
+    out->result = -2;
+    return;
+  }
+  or_circ = TO_OR_CIRCUIT(circ);
+  cipher = cell_direction == CELL_DIRECTION_OUT ?
+    or_circ->n_crypto : or_circ->p_crypto;
+  if (crypto_cipher_crypt_inplace(cipher, (char*) cell->payload,
+                                  CELL_PAYLOAD_SIZE)) {
+    out->result = -1;
+    return;
+  }
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    relay_header_unpack(&rh, cell->payload);
+    if (rh.recognized == 0 && relay_digest_matches(or_circ->n_digest, cell))
+      out->recognized = 1;
+  }
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -412,6 +495,159 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
   return 0;
 }
 
+/** Build a stream index for a circuit once a search for a stream has passed
+ * over this many other streams. */
+#define STREAM_INDEX_MIN_STREAMS 8
+/** How many slots does a new stream index have? A power of two. */
+#define STREAM_INDEX_MIN_SIZE 32
+
+/** One slot of a stream index. */
+typedef struct stream_index_slot_t {
+  edge_connection_t *conn; /**< The stream, or NULL if this slot is empty or
+                            * was emptied (see <b>was_used</b>). */
+  streamid_t id; /**< The stream ID <b>conn</b> had when we added it. */
+  unsigned int is_resolving:1; /**< Was <b>conn</b> on resolving_streams? */
+  unsigned int was_used:1; /**< Did this slot ever hold a stream? Searches
+                            * stop only at slots that never did. */
+} stream_index_slot_t;
+
+/** An open-addressed map from stream ID to the streams on a circuit. It may
+ * lack streams, and relay_lookup_conn() searches the stream lists when it
+ * does; but every stream in it is still attached to the circuit, because
+ * circuit_detach_stream() removes them. */
+typedef struct stream_index_t {
+  int size; /**< How many slots are there? A power of two. */
+  int n_used; /**< How many slots have <b>was_used</b> set? */
+  stream_index_slot_t *slots;
+} stream_index_t;
+
+/** Return the slot of <b>idx</b> that holds a stream added as <b>id</b>, or
+ * NULL if there is none. */
+static stream_index_slot_t *
+stream_index_find(stream_index_t *idx, streamid_t id)
+{
+  int i = id & (idx->size-1);
+  while (idx->slots[i].was_used) {
+    if (idx->slots[i].conn && idx->slots[i].id == id)
+      return &idx->slots[i];
+    i = (i+1) & (idx->size-1);
+  }
+  return NULL;
+}
+
+/** Add <b>conn</b> to <b>idx</b> unless a stream with its ID is already
+ * there. Return -1 if <b>idx</b> has too few free slots left. */
+static int
+stream_index_add(stream_index_t *idx, edge_connection_t *conn,
+                 int is_resolving)
+{
+  int i;
+  if (!conn->stream_id || stream_index_find(idx, conn->stream_id))
+    return 0;
+  if ((idx->n_used+1)*4 > idx->size*3)
+    return -1;
+  i = conn->stream_id & (idx->size-1);
+  while (idx->slots[i].conn)
+    i = (i+1) & (idx->size-1);
+  if (!idx->slots[i].was_used) {
+    idx->slots[i].was_used = 1;
+    ++idx->n_used;
+  }
+  idx->slots[i].conn = conn;
+  idx->slots[i].id = conn->stream_id;
+  idx->slots[i].is_resolving = is_resolving;
+  return 0;
+}
+
+/** Replace the stream index of <b>circ</b> with one listing all of its
+ * streams, with room for as many again. */
+static void
+stream_index_rebuild(circuit_t *circ)
+{
+  stream_index_t *idx;
+  edge_connection_t *conn;
+  int n = 0;
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    for (conn = TO_ORIGIN_CIRCUIT(circ)->p_streams; conn;
+         conn = conn->next_stream)
+      ++n;
+  } else {
+    for (conn = TO_OR_CIRCUIT(circ)->n_streams; conn; conn = conn->next_stream)
+      ++n;
+    for (conn = TO_OR_CIRCUIT(circ)->resolving_streams; conn;
+         conn = conn->next_stream)
+      ++n;
+  }
+  circuit_stream_index_free(circ);
+  idx = tor_malloc_zero(sizeof(stream_index_t));
+  idx->size = STREAM_INDEX_MIN_SIZE;
+  while (idx->size*3 < n*2*4)
+    idx->size *= 2;
+  idx->slots = tor_malloc_zero(sizeof(stream_index_slot_t)*idx->size);
+  circ->stream_index = idx;
+
+  /* Add them in search order, so that the first stream with an ID wins. */
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    for (conn = TO_ORIGIN_CIRCUIT(circ)->p_streams; conn;
+         conn = conn->next_stream)
+      stream_index_add(idx, conn, 0);
+  } else {
+    for (conn = TO_OR_CIRCUIT(circ)->n_streams; conn; conn = conn->next_stream)
+      stream_index_add(idx, conn, 0);
+    for (conn = TO_OR_CIRCUIT(circ)->resolving_streams; conn;
+         conn = conn->next_stream)
+      stream_index_add(idx, conn, 1);
+  }
+}
+
+/** relay_lookup_conn() found <b>conn</b> on <b>circ</b> by searching past
+ * <b>n_seen</b> other streams. Add it to the stream index, building or
+ * growing the index if that's worthwhile. */
+static void
+stream_index_note_found(circuit_t *circ, edge_connection_t *conn,
+                        int is_resolving, int n_seen)
+{
+  if (!circ->stream_index) {
+    if (n_seen >= STREAM_INDEX_MIN_STREAMS)
+      stream_index_rebuild(circ);
+  } else if (stream_index_add(circ->stream_index, conn, is_resolving) < 0) {
+    stream_index_rebuild(circ);
+  }
+}
+
+/** Remove <b>conn</b> from the stream index of <b>circ</b>, if it's there.
+ * Call this whenever a stream leaves one of circ's stream lists. */
+void
+circuit_stream_index_remove(circuit_t *circ, edge_connection_t *conn)
+{
+  stream_index_t *idx = circ->stream_index;
+  stream_index_slot_t *slot;
+  int i;
+  if (!idx)
+    return;
+  slot = stream_index_find(idx, conn->stream_id);
+  if (slot && slot->conn == conn) {
+    slot->conn = NULL;
+    return;
+  }
+  /* Its ID changed since we added it; look everywhere. */
+  for (i = 0; i < idx->size; ++i) {
+    if (idx->slots[i].conn == conn)
+      idx->slots[i].conn = NULL;
+  }
+}
+
+/** Release the stream index of <b>circ</b>, if it has one. */
+void
+circuit_stream_index_free(circuit_t *circ)
+{
+  if (circ->stream_index) {
+    tor_free(circ->stream_index->slots);
+    tor_free(circ->stream_index);
+  }
+}
+
 /** If cell's stream_id matches the stream_id of any conn that's
  * attached to circ, return that conn, else return NULL.
  */
@@ -421,42 +657,63 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
 {
   edge_connection_t *tmpconn;
   relay_header_t rh;
+  stream_index_t *idx = circ->stream_index;
+  int n_seen = 0;
 
   relay_header_unpack(&rh, cell->payload);
 
   if (!rh.stream_id)
     return NULL;
 
+  if (idx) {
+    stream_index_slot_t *slot = stream_index_find(idx, rh.stream_id);
+    /* Anything surprising about the hit falls through to the full search. */
+    if (slot && (tmpconn = slot->conn)->stream_id == rh.stream_id &&
+        !tmpconn->_base.marked_for_close) {
+      if (CIRCUIT_IS_ORIGIN(circ)) {
+        if (tmpconn->cpath_layer == layer_hint)
+          return tmpconn;
+      } else if (slot->is_resolving ||
+                 cell_direction == CELL_DIRECTION_OUT ||
+                 connection_edge_is_rendezvous_stream(tmpconn))
+        return tmpconn;
+    }
+  }
+
   /* IN or OUT cells could have come from either direction, now
    * that we allow rendezvous *to* an OP.
    */
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
     for (tmpconn = TO_ORIGIN_CIRCUIT(circ)->p_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
+         tmpconn=tmpconn->next_stream, ++n_seen) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->_base.marked_for_close &&
           tmpconn->cpath_layer == layer_hint) {
         log_debug(LD_APP,get_lang_str(LANG_LOG_RELAY_FOUND_CONN),rh.stream_id);
+        stream_index_note_found(circ, tmpconn, 0, n_seen);
         return tmpconn;
       }
     }
   } else {
     for (tmpconn = TO_OR_CIRCUIT(circ)->n_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
+         tmpconn=tmpconn->next_stream, ++n_seen) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->_base.marked_for_close) {
         log_debug(LD_EXIT,get_lang_str(LANG_LOG_RELAY_FOUND_CONN),rh.stream_id);
         if (cell_direction == CELL_DIRECTION_OUT ||
-            connection_edge_is_rendezvous_stream(tmpconn))
+            connection_edge_is_rendezvous_stream(tmpconn)) {
+          stream_index_note_found(circ, tmpconn, 0, n_seen);
           return tmpconn;
+        }
       }
     }
     for (tmpconn = TO_OR_CIRCUIT(circ)->resolving_streams; tmpconn;
-         tmpconn=tmpconn->next_stream) {
+         tmpconn=tmpconn->next_stream, ++n_seen) {
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->_base.marked_for_close) {
         log_debug(LD_EXIT,get_lang_str(LANG_LOG_RELAY_FOUND_CONN),rh.stream_id);
+        stream_index_note_found(circ, tmpconn, 1, n_seen);
         return tmpconn;
       }
     }
@@ -695,6 +952,11 @@ connection_ap_process_end_not_open(
   int control_reason = reason | END_STREAM_REASON_FLAG_REMOTE;
   (void) layer_hint; /* unused */
 
+  if (rh->length > 0 && circ->build_state->chosen_exit &&
+      !connection_edge_is_rendezvous_stream(conn))
+    connection_ap_note_exit_failure(conn,
+                        circ->build_state->chosen_exit->identity_digest, reason);
+
   if (rh->length > 0 && edge_reason_is_retriable(reason) &&
       !connection_edge_is_rendezvous_stream(conn)  /* avoid retry if rend */
       ) {
@@ -723,7 +985,8 @@ connection_ap_process_end_not_open(
             return 0;
           }
           client_dns_set_addressmap(conn->socks_request->address, addr,
-                                    conn->chosen_exit_name, ttl);
+                                    conn->chosen_exit_name, ttl,
+                                    conn->_base.exclKey);
         }
         /* check if he *ought* to have allowed it */
         if (exitrouter &&
@@ -736,6 +999,9 @@ connection_ap_process_end_not_open(
         /* rewrite it to an IP if we learned one. */
         if (addressmap_rewrite(&conn->socks_request->address,NULL)) {
           control_event_stream_status(conn, STREAM_EVENT_REMAP, 0);
+          /* the retry goes to the address, so avoid this exit for it too */
+          connection_ap_note_exit_failure(conn,
+                        circ->build_state->chosen_exit->identity_digest, reason);
         }
         if (conn->chosen_exit_optional ||
             conn->chosen_exit_retries) {
@@ -865,6 +1131,7 @@ connection_edge_process_relay_cell_not_open(
       return 0;
     }
     conn->_base.state = AP_CONN_STATE_OPEN;
+    stream_trace_stamp(conn, STREAM_TRACE_CONNECTED);
     log_info(LD_APP,get_lang_str(LANG_LOG_RELAY_CONNECTED_RECEIVED),
              (int)(get_time(NULL) - conn->_base.timestamp_lastread));
     if (rh->length >= 4) {
@@ -886,11 +1153,17 @@ connection_edge_process_relay_cell_not_open(
       else
         ttl = -1;
       client_dns_set_addressmap(conn->socks_request->address, addr,
-                                conn->chosen_exit_name, ttl);
+                                conn->chosen_exit_name, ttl,
+                                conn->_base.exclKey);
 
       remap_event_helper(conn, addr);
     }
     circuit_log_path(LOG_INFO,LD_APP,TO_ORIGIN_CIRCUIT(circ));
+    /* The exit got everything that we sent early, so we won't have to send it again. */
+    if (conn->pending_optimistic_data) {
+      buf_free(conn->pending_optimistic_data);
+      conn->pending_optimistic_data = NULL;
+    }
     /* don't send a socks reply to transparent conns */
     if (!conn->socks_request->has_finished)
       connection_ap_handshake_socks_reply(conn, NULL, 0, 0);
@@ -911,6 +1184,7 @@ connection_edge_process_relay_cell_not_open(
           control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_STATUS, 0);
           break;
         case DIR_PURPOSE_FETCH_SERVERDESC:
+        case DIR_PURPOSE_FETCH_MICRODESC:
           control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
                                   count_loading_descriptors_progress());
           break;
@@ -1081,6 +1355,8 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       stats_n_data_bytes_received += rh.length;
       connection_write_to_buf((char*)(cell->payload + RELAY_HEADER_SIZE),
                               rh.length, TO_CONN(conn));
+      if (conn->_base.type == CONN_TYPE_AP)
+        stream_trace_stamp(conn, STREAM_TRACE_FIRST_BYTE);
       connection_edge_consider_sending_sendme(conn);
       return 0;
     case RELAY_COMMAND_END:
@@ -1240,6 +1516,96 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
+/** The largest number of DATA cells that connection_edge_package_raw_inbuf() packages in one pass. */
+#define MAX_PACKAGE_BATCH_CELLS 32
+
+/** Return how many DATA cells connection_edge_package_raw_inbuf() can package from <b>conn</b> onto <b>circ</b> in one pass with connection_edge_package_batch(), given <b>amount</b> bytes waiting on the inbuf and at most <b>max_cells</b> cells (or no limit if negative). Return 0 if the cells need to go one at a time, e.g. because some of them would have to be RELAY_EARLY cells. */
+static int connection_edge_package_batch_size(edge_connection_t *conn,circuit_t *circ,size_t amount,int package_partial,int max_cells)
+{	int n_cells,window,cells_on_queue;
+	if(conn->cpath_layer)
+	{	origin_circuit_t *origin_circ;
+		if(!CIRCUIT_IS_ORIGIN(circ) || !circ->n_conn)	return 0;
+		origin_circ = TO_ORIGIN_CIRCUIT(circ);
+		if(origin_circ->remaining_relay_early_cells > 0 && conn->cpath_layer != origin_circ->cpath)	return 0;
+		window = conn->cpath_layer->package_window;
+		cells_on_queue = circ->n_conn_cells.n;
+	}
+	else
+	{	if(CIRCUIT_IS_ORIGIN(circ) || !TO_OR_CIRCUIT(circ)->p_conn)	return 0;
+		window = circ->package_window;
+		cells_on_queue = TO_OR_CIRCUIT(circ)->p_conn_cells.n;
+	}
+	n_cells = (int)(amount / RELAY_PAYLOAD_SIZE);
+	if(package_partial && amount % RELAY_PAYLOAD_SIZE)	n_cells++;
+	if(n_cells > MAX_PACKAGE_BATCH_CELLS)			n_cells = MAX_PACKAGE_BATCH_CELLS;
+	if(n_cells > conn->package_window)			n_cells = conn->package_window;
+	if(n_cells > window)					n_cells = window;
+	if(max_cells >= 0 && n_cells > max_cells)		n_cells = max_cells;
+	/* Don't overshoot the point where append_cell_to_circuit_queue() would block the streams. */
+	if(n_cells > CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue)	n_cells = CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue;
+	return n_cells < 2 ? 0 : n_cells;
+}
+
+/** Package <b>n_cells</b> DATA cells from <b>conn</b>'s inbuf onto <b>circ</b> in one pass: fill in all the payloads, run the digest and then each layer of encryption over the whole batch, and append the cells to the circuit's queue as one block. Only the last cell may be less than full. The caller must have checked the batch with connection_edge_package_batch_size(). Return the number of bytes packaged, or -1 if the circuit got marked for close. */
+static int connection_edge_package_batch(edge_connection_t *conn,circuit_t *circ,int n_cells)
+{	cell_t cells[MAX_PACKAGE_BATCH_CELLS];
+	relay_header_t rh;
+	cell_direction_t cell_direction;
+	crypto_digest_env_t *digest;
+	or_connection_t *or_conn;
+	size_t length,total = 0;
+	int i;
+	tor_assert(n_cells <= MAX_PACKAGE_BATCH_CELLS);
+	if(conn->cpath_layer)
+	{	cell_direction = CELL_DIRECTION_OUT;
+		or_conn = circ->n_conn;
+		digest = conn->cpath_layer->f_digest;
+		or_conn->client_used = approx_time();	/* if we're using relaybandwidthrate, this conn wants priority */
+	}
+	else
+	{	cell_direction = CELL_DIRECTION_IN;
+		or_conn = TO_OR_CIRCUIT(circ)->p_conn;
+		digest = TO_OR_CIRCUIT(circ)->p_digest;
+	}
+	memset(&rh, 0, sizeof(rh));
+	rh.command = RELAY_COMMAND_DATA;
+	rh.stream_id = conn->stream_id;
+	for(i = 0; i < n_cells; i++)
+	{	length = buf_datalen(conn->_base.inbuf);
+		if(length > RELAY_PAYLOAD_SIZE)	length = RELAY_PAYLOAD_SIZE;
+		memset(&cells[i], 0, sizeof(cell_t));
+		cells[i].command = CELL_RELAY;
+		cells[i].circ_id = cell_direction == CELL_DIRECTION_OUT ? circ->n_circ_id : TO_OR_CIRCUIT(circ)->p_circ_id;
+		rh.length = (uint16_t)length;
+		relay_header_pack(cells[i].payload, &rh);
+		connection_fetch_from_buf((char *)cells[i].payload+RELAY_HEADER_SIZE, length, TO_CONN(conn));
+		total += length;
+	}
+	for(i = 0; i < n_cells; i++)
+		relay_set_digest(digest, &cells[i]);
+	if(cell_direction == CELL_DIRECTION_OUT)
+	{	crypt_path_t *thishop = conn->cpath_layer;
+		do	/* moving from farthest to nearest hop */
+		{	for(i = 0; i < n_cells; i++)
+				if(relay_crypt_one_payload(thishop->f_crypto, cells[i].payload, 1) < 0)	break;
+			if(i < n_cells)	break;
+			thishop = thishop->prev;
+		} while(thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+	}
+	else
+	{	for(i = 0; i < n_cells; i++)
+			if(relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto, cells[i].payload, 1) < 0)	break;
+	}
+	if(i < n_cells)
+	{	log_warn(LD_BUG,get_lang_str(LANG_LOG_RELAY_CPRC_FAILED));
+		circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+		return -1;
+	}
+	stats_n_relay_cells_relayed += n_cells;
+	append_cells_to_circuit_queue(circ, or_conn, cells, n_cells, cell_direction, conn->stream_id);
+	return (int)total;
+}
+
 /** While conn->inbuf has an entire relay payload of bytes on it,
  * and the appropriate package windows aren't empty, grab a cell
  * and send it down the circuit.
@@ -1249,6 +1615,7 @@ uint64_t stats_n_data_bytes_received = 0;
  */
 int connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,int *max_cells)
 {	size_t amount_to_process, length;
+	int n_cells,optimistic;
 	char payload[CELL_PAYLOAD_SIZE];
 	circuit_t *circ;
 	unsigned domain = conn->cpath_layer ? LD_APP : LD_EXIT;
@@ -1257,6 +1624,10 @@ int connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_parti
 	{	log_warn(LD_BUG,get_lang_str(LANG_LOG_RELAY_CONN_ALREADY_MARKED_FOR_CLOSE),conn->_base.marked_for_close_file,conn->_base.marked_for_close);
 		return 0;
 	}
+	if(conn->loopback_exit)
+		return loopback_exit_package(conn);
+	if(conn->local_peer)
+		return rend_local_package(conn);
 
 	while(1)
 	{	circ = circuit_get_by_edge_conn(conn);
@@ -1272,29 +1643,59 @@ int connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_parti
 			connection_stop_reading(TO_CONN(conn));
 			return 0;
 		}
-		amount_to_process = buf_datalen(conn->_base.inbuf);
+		if(conn->sending_optimistic_data && !buf_datalen(conn->sending_optimistic_data))
+		{	buf_free(conn->sending_optimistic_data);
+			conn->sending_optimistic_data = NULL;
+		}
+		optimistic = conn->_base.type == CONN_TYPE_AP && conn->_base.state == AP_CONN_STATE_CONNECT_WAIT;
+		if(conn->sending_optimistic_data)	/* data from a retried stream goes first */
+			amount_to_process = buf_datalen(conn->sending_optimistic_data);
+		else	amount_to_process = buf_datalen(conn->_base.inbuf);
 		if(!amount_to_process)
 			return 0;
-		if(!package_partial && amount_to_process < RELAY_PAYLOAD_SIZE)
-			return 0;
-		if(amount_to_process > RELAY_PAYLOAD_SIZE)
-			length = RELAY_PAYLOAD_SIZE;
-		else	length = amount_to_process;
-		stats_n_data_bytes_packaged += length;
-		stats_n_data_cells_packaged += 1;
-		connection_fetch_from_buf(payload, length, TO_CONN(conn));
-		log_debug(domain,get_lang_str(LANG_LOG_RELAY_PACKAGING),conn->_base.s,(int)length,(int)buf_datalen(conn->_base.inbuf));
-		if(connection_edge_send_command(conn, RELAY_COMMAND_DATA,payload, length) < 0 )	/* circuit got marked for close, don't continue, don't need to mark conn */
+		if(!package_partial && amount_to_process < RELAY_PAYLOAD_SIZE && !conn->sending_optimistic_data)
 			return 0;
+		if(optimistic || conn->sending_optimistic_data)	/* these cells are copied one at a time */
+			n_cells = 0;
+		else	n_cells = connection_edge_package_batch_size(conn, circ, amount_to_process, package_partial, max_cells ? MAX(*max_cells, 1) : -1);
+		if(n_cells)
+		{	int r = connection_edge_package_batch(conn, circ, n_cells);
+			if(r < 0)	/* circuit got marked for close, don't continue, don't need to mark conn */
+				return 0;
+			stats_n_data_bytes_packaged += r;
+			stats_n_data_cells_packaged += n_cells;
+			log_debug(domain,get_lang_str(LANG_LOG_RELAY_PACKAGING),conn->_base.s,r,(int)buf_datalen(conn->_base.inbuf));
+		}
+		else
+		{	if(amount_to_process > RELAY_PAYLOAD_SIZE)
+				length = RELAY_PAYLOAD_SIZE;
+			else	length = amount_to_process;
+			stats_n_data_bytes_packaged += length;
+			stats_n_data_cells_packaged += 1;
+			if(conn->sending_optimistic_data)
+				fetch_from_buf(payload, length, conn->sending_optimistic_data);
+			else	connection_fetch_from_buf(payload, length, TO_CONN(conn));
+			if(optimistic)	/* keep it until the exit answers, in case we have to retry the stream */
+			{	if(!conn->pending_optimistic_data)
+					conn->pending_optimistic_data = buf_new();
+				write_to_buf(payload, length, conn->pending_optimistic_data);
+			}
+			log_debug(domain,get_lang_str(LANG_LOG_RELAY_PACKAGING),conn->_base.s,(int)length,(int)buf_datalen(conn->_base.inbuf));
+			if(connection_edge_send_command(conn, RELAY_COMMAND_DATA,payload, length) < 0 )	/* circuit got marked for close, don't continue, don't need to mark conn */
+				return 0;
+			n_cells = 1;
+		}
 		if(!conn->cpath_layer)	/* non-rendezvous exit */
-		{	tor_assert(circ->package_window > 0);
-			circ->package_window--;
+		{	tor_assert(circ->package_window >= n_cells);
+			circ->package_window -= n_cells;
 		}
 		else			/* we're an AP, or an exit on a rendezvous circ */
-		{	tor_assert(conn->cpath_layer->package_window > 0);
-			conn->cpath_layer->package_window--;
+		{	tor_assert(conn->cpath_layer->package_window >= n_cells);
+			conn->cpath_layer->package_window -= n_cells;
 		}
-		if(--conn->package_window <= 0)	/* is it 0 after decrement? */
+		conn->package_window -= n_cells;
+		conn->last_packaged_at = approx_time();
+		if(conn->package_window <= 0)	/* is it 0 after decrement? */
 		{	connection_stop_reading(TO_CONN(conn));
 			log_debug(domain,get_lang_str(LANG_LOG_RELAY_PACKAGE_WINDOW_REACHED_0));
 			circuit_consider_stop_edge_reading(circ, conn->cpath_layer);
@@ -1303,7 +1704,7 @@ int connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_parti
 		log_debug(domain,get_lang_str(LANG_LOG_RELAY_PACKAGE_WINDOW_IS_NOW),conn->package_window);
 		if(max_cells && *max_cells <= 0)	return 0;
 		if(max_cells)
-		{	*max_cells -= 1;
+		{	*max_cells -= n_cells;
 			if(*max_cells <= 0)	return 0;
 		}
 	}	/* handle more if there's more, or return 0 if there isn't */
@@ -1360,7 +1761,8 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *first_conn,circ
 	int n_packaging_streams, n_streams_left;
 	int packaged_this_round;
 	int cells_on_queue;
-	int cells_per_conn;
+	int boost = get_options()->InteractiveStreamBoost;
+	time_t now = approx_time();
 	edge_connection_t *chosen_stream = NULL;
 	/* How many cells do we have space for? It will be the minimum of the number needed to exhaust the package window, and the minimum needed to fill the cell queue. */
 	int max_to_package = circ->package_window;
@@ -1380,54 +1782,60 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *first_conn,circ
 		if((tor_weak_random() % num_streams)==0)	chosen_stream = conn;
 		/* Invariant: chosen_stream has been chosen uniformly at random from among the first num_streams streams on first_conn. */
 	}
-	/* Count how many non-marked streams there are that have anything on their inbuf, and enable reading on all of the connections. */
+	/* Count how many non-marked streams there are that have anything on their inbuf, and enable reading on all of the connections. Streams that had been idle for a while are the interactive ones: note them before we package anything. */
 	n_packaging_streams = 0;
-	/* Activate reading starting from the chosen stream */
-	for(conn=chosen_stream; conn; conn = conn->next_stream)	/* Start reading for the streams starting from here */
+	for(conn = first_conn; conn; conn = conn->next_stream)
 	{	if(conn->_base.marked_for_close || conn->package_window <= 0)	continue;
 		if(!layer_hint || conn->cpath_layer == layer_hint)
-		{	connection_start_reading(TO_CONN(conn));
-			if(buf_datalen(conn->_base.inbuf) > 0)	++n_packaging_streams;
-		}
-	}
-	/* Go back and do the ones we skipped, circular-style */
-	for(conn = first_conn; conn != chosen_stream; conn = conn->next_stream)
-	{	if(conn->_base.marked_for_close || conn->package_window <= 0)
-			continue;
-		if(!layer_hint || conn->cpath_layer == layer_hint)
 		{	connection_start_reading(TO_CONN(conn));
 			if(buf_datalen(conn->_base.inbuf) > 0)
-				++n_packaging_streams;
+			{	++n_packaging_streams;
+				conn->package_interactive = conn->last_packaged_at + STREAM_INTERACTIVE_IDLE_SECONDS <= now;
+			}
+			else	conn->package_deficit = 0;
 		}
 	}
-	if(n_packaging_streams == 0)	return 0;	/* avoid divide-by-zero */
-	while(1)
-	{	cells_per_conn = CEIL_DIV(max_to_package, n_packaging_streams);
+	if(n_packaging_streams == 0)	return 0;
+	/* Serve the streams by deficit round robin, starting from the chosen stream: in every round, each stream with data earns a quantum of RELAY_PAYLOAD_SIZE bytes (InteractiveStreamBoost times that if it had been idle) and packages as many cells as its deficit covers. A bulk download thus can't take more than its share of the package window from the other streams on the circuit. */
+	while(max_to_package > 0)
+	{	int i;
 		packaged_this_round = 0;
 		n_streams_left = 0;
-		/* Iterate over all connections. Package up to cells_per_conn cells on each. Update packaged_this_round with the total number of cells packaged, and n_streams_left with the number that still have data to package. */
-		for(conn=first_conn; conn; conn=conn->next_stream)
-		{	if(conn->_base.marked_for_close || conn->package_window <= 0)	continue;
-			if(!layer_hint || conn->cpath_layer == layer_hint)
-			{	int n = cells_per_conn, r;
-				r = connection_edge_package_raw_inbuf(conn, 1, &n);	/* handle whatever might still be on the inbuf */
-				packaged_this_round += (cells_per_conn-n);		/* Note how many we packaged */
-				if(r<0)		/* Problem while packaging. (We already sent an end cell if possible) */
-				{	connection_mark_for_close(TO_CONN(conn));
-					continue;
-				}
-				/* If there's still data to read, we'll be coming back to this stream. */
-				if(buf_datalen(conn->_base.inbuf))	++n_streams_left;
-				/* If the circuit won't accept any more data, return without looking at any more of the streams. Any connections that should be stopped have already been stopped by connection_edge_package_raw_inbuf. */
-				if(circuit_consider_stop_edge_reading(circ, layer_hint))	return -1;
-				/* XXXX should we also stop immediately if we fill up the cell queue? Probably. */
+		for(i = 0, conn = chosen_stream; i < num_streams && packaged_this_round < max_to_package; i++, conn = conn->next_stream ? conn->next_stream : first_conn)
+		{	int quantum, n, cells, r;
+			uint64_t packaged_before;
+			if(conn->_base.marked_for_close || conn->package_window <= 0)	continue;
+			if(layer_hint && conn->cpath_layer != layer_hint)	continue;
+			if(!buf_datalen(conn->_base.inbuf) && !conn->sending_optimistic_data)
+			{	conn->package_deficit = 0;
+				continue;
+			}
+			quantum = RELAY_PAYLOAD_SIZE;
+			if(conn->package_interactive && boost > 1)	quantum *= boost;
+			conn->package_deficit += quantum;
+			n = conn->package_deficit / RELAY_PAYLOAD_SIZE;
+			if(n > max_to_package - packaged_this_round)	n = max_to_package - packaged_this_round;
+			cells = n;
+			packaged_before = stats_n_data_bytes_packaged;
+			r = connection_edge_package_raw_inbuf(conn, 1, &n);	/* handle whatever might still be on the inbuf */
+			packaged_this_round += (cells-n);	/* Note how many we packaged */
+			if(r<0)		/* Problem while packaging. (We already sent an end cell if possible) */
+			{	connection_mark_for_close(TO_CONN(conn));
+				continue;
 			}
+			conn->package_deficit -= (int)(stats_n_data_bytes_packaged - packaged_before);
+			/* If there's still data to read, we'll be coming back to this stream; a stream that couldn't use its share doesn't get to save it up. */
+			if(buf_datalen(conn->_base.inbuf))
+			{	++n_streams_left;
+				if(conn->package_deficit > quantum)	conn->package_deficit = quantum;
+			}
+			else	conn->package_deficit = 0;
+			/* If the circuit won't accept any more data, return without looking at any more of the streams. Any connections that should be stopped have already been stopped by connection_edge_package_raw_inbuf. */
+			if(circuit_consider_stop_edge_reading(circ, layer_hint))	return -1;
 		}
 		/* If we made progress, and we are willing to package more, and there are any streams left that want to package stuff... try again! */
 		if(packaged_this_round && packaged_this_round < max_to_package && n_streams_left)
-		{	max_to_package -= packaged_this_round;
-			n_packaging_streams = n_streams_left;
-		}
+			max_to_package -= packaged_this_round;
 		else break;
 	}
 	return 0;
@@ -1502,10 +1910,14 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 #define assert_active_circuits_ok_paranoid(conn)
 #endif
 
-/** The total number of cells we have allocated from the memory pool. */
+/** How many cells fit in the smallest cell queue ring?  Rings of this size
+ * come from cell_pool; larger ones are grown by doubling. */
+#define CELL_QUEUE_BLOCK_CELLS 8
+
+/** The total number of cells we have room for in cell queue rings. */
 static int total_cells_allocated = 0;
 
-/** A memory pool to allocate packed_cell_t objects. */
+/** A memory pool to allocate the smallest cell queue rings. */
 static mp_pool_t *cell_pool = NULL;
 
 /** Memory pool to allocate insertion_time_elem_t objects used for cell
@@ -1517,7 +1929,8 @@ void
 init_cell_pool(void)
 {
   tor_assert(!cell_pool);
-  cell_pool = mp_pool_new(sizeof(packed_cell_t), 128*1024);
+  cell_pool = mp_pool_new(sizeof(packed_cell_t)*CELL_QUEUE_BLOCK_CELLS,
+                          128*1024);
 }
 
 /** Free all storage used to hold cells. */
@@ -1543,20 +1956,63 @@ clean_cell_pool(void)
   mp_pool_clean(cell_pool, 0, 1);
 }
 
-/** Release storage held by <b>cell</b>. */
-static INLINE void
-packed_cell_free_unchecked(packed_cell_t *cell)
+/** Release the ring of <b>capacity</b> cells at <b>cells</b>. */
+static void
+cell_ring_free(packed_cell_t *cells, int capacity)
 {
-  --total_cells_allocated;
-  mp_pool_release(cell);
+  total_cells_allocated -= capacity;
+  tor_mem_account(MEM_TAG_CELL_QUEUES, -(LONG)(sizeof(packed_cell_t)*capacity));
+  if (capacity == CELL_QUEUE_BLOCK_CELLS)
+    mp_pool_release(cells);
+  else
+    tor_free(cells);
 }
 
-/** Allocate and return a new packed_cell_t. */
+/** Make room for at least one more cell at the end of <b>queue</b>.  The
+ * queued cells are kept in order, starting again at index 0 if we had to
+ * move them. */
+static void
+cell_queue_grow(cell_queue_t *queue)
+{
+  packed_cell_t *cells;
+  int capacity, first_part;
+  if (queue->n < queue->capacity)
+    return;
+  if (!queue->capacity) {
+    queue->cells = mp_pool_get(cell_pool);
+    queue->capacity = CELL_QUEUE_BLOCK_CELLS;
+    queue->head = 0;
+    total_cells_allocated += CELL_QUEUE_BLOCK_CELLS;
+    tor_mem_account(MEM_TAG_CELL_QUEUES,
+                    sizeof(packed_cell_t)*CELL_QUEUE_BLOCK_CELLS);
+    return;
+  }
+  capacity = queue->capacity * 2;
+  cells = tor_malloc_tagged(MEM_TAG_CELL_QUEUES,
+                            sizeof(packed_cell_t) * capacity);
+  first_part = queue->capacity - queue->head;
+  memcpy(cells, queue->cells + queue->head, sizeof(packed_cell_t)*first_part);
+  memcpy(cells + first_part, queue->cells,
+         sizeof(packed_cell_t)*(queue->n - first_part));
+  cell_ring_free(queue->cells, queue->capacity);
+  total_cells_allocated += capacity;
+  queue->cells = cells;
+  queue->capacity = capacity;
+  queue->head = 0;
+}
+
+/** Return a pointer to a new cell slot at the end of <b>queue</b>, for the
+ * caller to fill in. */
 static INLINE packed_cell_t *
-packed_cell_alloc(void)
+cell_queue_append_slot(cell_queue_t *queue)
 {
-  ++total_cells_allocated;
-  return mp_pool_get(cell_pool);
+  int idx;
+  cell_queue_grow(queue);
+  idx = queue->head + queue->n;
+  if (idx >= queue->capacity)
+    idx -= queue->capacity;
+  ++queue->n;
+  return &queue->cells[idx];
 }
 
 /** Log current statistics for cell pool allocation at log level
@@ -1577,37 +2033,31 @@ dump_cell_pool_usage(int severity)
   if(cell_pool)	mp_pool_log_status(cell_pool, severity);
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
-static INLINE packed_cell_t *
-packed_cell_copy(const cell_t *cell)
+/** Append a copy of <b>cell</b> to the end of <b>queue</b>. */
+void
+cell_queue_append(cell_queue_t *queue, const packed_cell_t *cell)
 {
-  packed_cell_t *c = packed_cell_alloc();
-  cell_pack(c, cell);
-  c->next = NULL;
-  return c;
+  packed_cell_t *slot = cell_queue_append_slot(queue);
+  memcpy(slot, cell, sizeof(packed_cell_t));
+  slot->inserted_usec = (uint32_t)perf_now_usec();
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
+/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
 void
-cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
+cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
 {
-  if (queue->tail) {
-    tor_assert(!queue->tail->next);
-    queue->tail->next = cell;
-  } else {
-    queue->head = cell;
-  }
-  queue->tail = cell;
-  cell->next = NULL;
-  ++queue->n;
+  cell_queue_append_packed_copies(queue, cell, 1);
 }
 
-/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
+/** Pack the <b>n_cells</b> cells in <b>cells</b> onto the end of
+ * <b>queue</b>, in order, noting their insertion time only once. */
 void
-cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
+cell_queue_append_packed_copies(cell_queue_t *queue, const cell_t *cells,
+                                int n_cells)
 {
-  packed_cell_t *copy = packed_cell_copy(cell);
-  /* Remember the time when this cell was put in the queue. */
+  int i;
+  uint32_t inserted_usec = (uint32_t)perf_now_usec();
+  /* Remember the time when these cells were put in the queue. */
   if (get_options()->CellStatistics) {
     struct timeval now;
     uint32_t added;
@@ -1623,12 +2073,12 @@ cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
       queue->insertion_times = it_queue;
     }
     if (it_queue->last && it_queue->last->insertion_time == added) {
-      it_queue->last->counter++;
+      it_queue->last->counter += n_cells;
     } else {
       insertion_time_elem_t *elem = mp_pool_get(it_pool);
       elem->next = NULL;
       elem->insertion_time = added;
-      elem->counter = 1;
+      elem->counter = n_cells;
       if (it_queue->last) {
         it_queue->last->next = elem;
         it_queue->last = elem;
@@ -1637,22 +2087,21 @@ cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
       }
     }
   }
-  cell_queue_append(queue, copy);
+  for (i = 0; i < n_cells; ++i) {
+    packed_cell_t *slot = cell_queue_append_slot(queue);
+    cell_pack(slot, &cells[i]);
+    slot->inserted_usec = inserted_usec;
+  }
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell, *next;
-  cell = queue->head;
-  while (cell) {
-    next = cell->next;
-    packed_cell_free_unchecked(cell);
-    cell = next;
-  }
-  queue->head = queue->tail = NULL;
-  queue->n = 0;
+  if (queue->cells)
+    cell_ring_free(queue->cells, queue->capacity);
+  queue->cells = NULL;
+  queue->capacity = queue->head = queue->n = 0;
   if (queue->insertion_times) {
     while (queue->insertion_times->first) {
       insertion_time_elem_t *elem = queue->insertion_times->first;
@@ -1663,21 +2112,25 @@ cell_queue_clear(cell_queue_t *queue)
   }
 }
 
-/** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
-static INLINE packed_cell_t *
-cell_queue_pop(cell_queue_t *queue)
+/** Remove the cell at the head of <b>queue</b>, copying it into
+ * <b>out</b>; return 0 on success, or -1 if <b>queue</b> is empty.  We hand
+ * out a copy rather than a pointer into the ring, since writing the cell
+ * can flush the connection and add to the queue again.  An emptied queue
+ * gives its ring back, so idle circuits don't hold on to cell storage. */
+static INLINE int
+cell_queue_pop(cell_queue_t *queue, packed_cell_t *out)
 {
-  packed_cell_t *cell = queue->head;
-  if (!cell)
-    return NULL;
-  queue->head = cell->next;
-  if (cell == queue->tail) {
-    tor_assert(!queue->head);
-    queue->tail = NULL;
+  if (!queue->n)
+    return -1;
+  memcpy(out, &queue->cells[queue->head], sizeof(packed_cell_t));
+  if (++queue->head == queue->capacity)
+    queue->head = 0;
+  if (!--queue->n) {
+    cell_ring_free(queue->cells, queue->capacity);
+    queue->cells = NULL;
+    queue->capacity = queue->head = 0;
   }
-  --queue->n;
-  return cell;
+  return 0;
 }
 
 /** Return a pointer to the "next_active_on_{n,p}_conn" pointer of <b>circ</b>,
@@ -1809,6 +2262,9 @@ cell_ewma_get_tick(void)
  */
 static double ewma_scale_factor = 0.1;
 static int ewma_enabled = 0;
+/** True iff OR connections should keep their active circuits in EWMA
+ * buckets; see cell_ewma_bucket(). */
+static int ewma_use_buckets = 1;
 
 #define EPSILON 0.00001
 #define LOG_ONEHALF -0.69314718055994529
@@ -1820,6 +2276,8 @@ cell_ewma_set_scale_factor(or_options_t *options, networkstatus_t *consensus)
   int32_t halflife_ms;
   double halflife;
   const char *source;
+  if (options)
+    ewma_use_buckets = options->CircuitPriorityBuckets;
   if (options && options->CircuitPriorityHalflife >= -EPSILON) {
     halflife = options->CircuitPriorityHalflife;
     source = "CircuitPriorityHalflife in configuration";
@@ -1869,6 +2327,129 @@ scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
   ewma->last_adjusted_tick = cur_tick;
 }
 
+/* ==== Bucketed scheduling of cell_ewma_t ====
+
+   On connections with many active circuits, keeping the priority queue in
+   heap order and rescaling every active circuit on each tick gets
+   expensive.  So when CircuitPriorityBuckets is set, a connection instead
+   keeps its active circuits in rings indexed by the binary logarithm of
+   their cell counts, shifted by the priority the user gave the circuit, and
+   serves the lowest nonempty ring round-robin.  Circuits in the same ring
+   have counts within a factor of two of each other, which is all the
+   precision the scheduler needs.
+
+   Multiplying every count by the same factor doesn't change which ring is
+   lowest, so a bucketed connection doesn't rescale on each tick.  It keeps
+   its counts relative to active_circuit_pqueue_last_recalibrated, weighting
+   new cells by F^-N for a cell sent N ticks after it, and only rescales and
+   rebuilds its rings once that weight exceeds CELL_EWMA_MAX_WEIGHT.
+ */
+
+/** Cell counts below 2^-CELL_EWMA_BUCKET_BIAS all go in the lowest ring. */
+#define CELL_EWMA_BUCKET_BIAS 24
+/** On a bucketed connection, rescale once a new cell would weigh this
+ * much. */
+#define CELL_EWMA_MAX_WEIGHT 4294967296.0
+
+/** Return the cell_ewma_t that <b>circ</b> uses on <b>conn</b>. */
+static INLINE cell_ewma_t *
+cell_ewma_on_conn(circuit_t *circ, or_connection_t *conn)
+{
+  if (circ->n_conn == conn) {
+    return &circ->n_cell_ewma;
+  } else {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    tor_assert(conn == orcirc->p_conn);
+    return &orcirc->p_cell_ewma;
+  }
+}
+
+/** Return the index of the ring of ewma_buckets where <b>ewma</b> belongs. */
+static int
+cell_ewma_bucket(cell_ewma_t *ewma)
+{
+  int exponent, bucket;
+  int priority = cell_ewma_to_circuit(ewma)->priority;
+  if (ewma->cell_count <= 0.0)
+    return 0;
+  (void) frexp(ewma->cell_count, &exponent);
+  if (priority < CIRCUIT_PRIORITY_HIGHEST)
+    priority = CIRCUIT_PRIORITY_HIGHEST;
+  else if (priority > CIRCUIT_PRIORITY_LOWEST)
+    priority = CIRCUIT_PRIORITY_LOWEST;
+  bucket = exponent + priority + CELL_EWMA_BUCKET_BIAS;
+  if (bucket < 0)
+    return 0;
+  if (bucket >= CELL_EWMA_N_BUCKETS)
+    return CELL_EWMA_N_BUCKETS - 1;
+  return bucket;
+}
+
+/** Add <b>ewma</b> to the back of its ring in <b>conn</b>'s ewma_buckets. */
+static void
+cell_ewma_bucket_link(or_connection_t *conn, cell_ewma_t *ewma)
+{
+  int b = cell_ewma_bucket(ewma);
+  cell_ewma_t *head = conn->ewma_buckets[b];
+  if (head) {
+    ewma->bucket_next = head;
+    ewma->bucket_prev = head->bucket_prev;
+    head->bucket_prev->bucket_next = ewma;
+    head->bucket_prev = ewma;
+  } else {
+    ewma->bucket_next = ewma->bucket_prev = ewma;
+    conn->ewma_buckets[b] = ewma;
+    conn->ewma_bucket_map[b/32] |= 1u << (b%32);
+  }
+  ewma->heap_index = b;
+}
+
+/** Remove <b>ewma</b> from its ring in <b>conn</b>'s ewma_buckets. */
+static void
+cell_ewma_bucket_unlink(or_connection_t *conn, cell_ewma_t *ewma)
+{
+  int b = ewma->heap_index;
+  tor_assert(b >= 0 && b < CELL_EWMA_N_BUCKETS);
+  if (ewma->bucket_next == ewma) {
+    tor_assert(conn->ewma_buckets[b] == ewma);
+    conn->ewma_buckets[b] = NULL;
+    conn->ewma_bucket_map[b/32] &= ~(1u << (b%32));
+  } else {
+    ewma->bucket_next->bucket_prev = ewma->bucket_prev;
+    ewma->bucket_prev->bucket_next = ewma->bucket_next;
+    if (conn->ewma_buckets[b] == ewma)
+      conn->ewma_buckets[b] = ewma->bucket_next;
+  }
+  ewma->bucket_next = ewma->bucket_prev = NULL;
+  ewma->heap_index = -1;
+}
+
+/** Forget every ring in <b>conn</b>'s ewma_buckets, without touching the
+ * cell_ewma_t objects in them. */
+static void
+cell_ewma_buckets_clear(or_connection_t *conn)
+{
+  memset(conn->ewma_buckets, 0, sizeof(conn->ewma_buckets));
+  memset(conn->ewma_bucket_map, 0, sizeof(conn->ewma_bucket_map));
+}
+
+/** Return the cell_ewma_t of the active circuit on <b>conn</b> that should
+ * send next, or NULL if there is none. */
+static cell_ewma_t *
+first_cell_ewma_on_conn(or_connection_t *conn)
+{
+  int i;
+  if (!conn->ewma_use_buckets)
+    return smartlist_len(conn->active_circuit_pqueue) ?
+      smartlist_get(conn->active_circuit_pqueue, 0) : NULL;
+  for (i = 0; i < CELL_EWMA_N_BUCKETS/32; ++i) {
+    uint32_t map = conn->ewma_bucket_map[i];
+    if (map)
+      return conn->ewma_buckets[i*32 + tor_log2(map & (~map + 1))];
+  }
+  return NULL;
+}
+
 /** Adjust the cell count of every active circuit on <b>conn</b> so
  * that they are scaled with respect to <b>cur_tick</b> */
 static void
@@ -1878,6 +2459,24 @@ scale_active_circuits(or_connection_t *conn, unsigned cur_tick)
   double factor = get_scale_factor(
               conn->active_circuit_pqueue_last_recalibrated,
               cur_tick);
+  if (conn->ewma_use_buckets) {
+    /* The rings depend on the counts, so build them anew. */
+    circuit_t *head = conn->active_circuits, *cur = head;
+    cell_ewma_buckets_clear(conn);
+    if (head) {
+      do {
+        cell_ewma_t *e = cell_ewma_on_conn(cur, conn);
+        tor_assert(e->last_adjusted_tick ==
+                   conn->active_circuit_pqueue_last_recalibrated);
+        e->cell_count *= factor;
+        e->last_adjusted_tick = cur_tick;
+        cell_ewma_bucket_link(conn, e);
+        cur = *next_circ_on_conn_p(cur, conn);
+      } while (cur != head);
+    }
+    conn->active_circuit_pqueue_last_recalibrated = cur_tick;
+    return;
+  }
   /** Ordinarily it isn't okay to change the value of an element in a heap,
    * but it's okay here, since we are preserving the order. */
   SMARTLIST_FOREACH(conn->active_circuit_pqueue, cell_ewma_t *, e, {
@@ -1898,6 +2497,10 @@ add_cell_ewma_to_conn(or_connection_t *conn, cell_ewma_t *ewma)
   scale_single_cell_ewma(ewma,
                          conn->active_circuit_pqueue_last_recalibrated);
 
+  if (conn->ewma_use_buckets) {
+    cell_ewma_bucket_link(conn, ewma);
+    return;
+  }
   smartlist_pqueue_add(conn->active_circuit_pqueue,
                        compare_cell_ewma_counts,
                        STRUCT_OFFSET(cell_ewma_t, heap_index),
@@ -1909,6 +2512,10 @@ static void
 remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma)
 {
   tor_assert(ewma->heap_index != -1);
+  if (conn->ewma_use_buckets) {
+    cell_ewma_bucket_unlink(conn, ewma);
+    return;
+  }
   smartlist_pqueue_remove(conn->active_circuit_pqueue,
                           compare_cell_ewma_counts,
                           STRUCT_OFFSET(cell_ewma_t, heap_index),
@@ -1925,6 +2532,29 @@ pop_first_cell_ewma_from_conn(or_connection_t *conn)
                               STRUCT_OFFSET(cell_ewma_t, heap_index));
 }
 
+/** The cell count of <b>ewma</b>, the first active circuit on <b>conn</b>,
+ * has just gone up: move it to where it now belongs. */
+static void
+reposition_first_cell_ewma_on_conn(or_connection_t *conn, cell_ewma_t *ewma)
+{
+  if (conn->ewma_use_buckets) {
+    /* Move it to the back of its (maybe new) ring, so that circuits with
+     * similar counts take turns.  It may have gone inactive already. */
+    if (ewma->heap_index != -1) {
+      cell_ewma_bucket_unlink(conn, ewma);
+      cell_ewma_bucket_link(conn, ewma);
+    }
+  } else {
+    cell_ewma_t *tmp;
+    /* We pop and re-add the cell_ewma_t here, not above, since we need to
+     * re-add it immediately to keep the priority queue consistent with the
+     * linked-list implementation */
+    tmp = pop_first_cell_ewma_from_conn(conn);
+    tor_assert(tmp == ewma);
+    add_cell_ewma_to_conn(conn, ewma);
+  }
+}
+
 /** Add <b>circ</b> to the list of circuits with pending cells on
  * <b>conn</b>.  No effect if <b>circ</b> is already linked. */
 void
@@ -1941,6 +2571,11 @@ make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn)
   assert_active_circuits_ok_paranoid(conn);
 
   if (! conn->active_circuits) {
+    /* Nothing is scheduled on conn, so this is when it can change how it
+     * schedules circuits. */
+    if (ewma_use_buckets && !conn->ewma_use_buckets)
+      conn->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+    conn->ewma_use_buckets = ewma_use_buckets;
     conn->active_circuits = circ;
     *prevp = *nextp = circ;
   } else {
@@ -2010,6 +2645,7 @@ connection_or_unlink_all_active_circs(or_connection_t *orconn)
 {
   circuit_t *head = orconn->active_circuits;
   circuit_t *cur = head;
+  cell_ewma_t *e;
   if (! head)
     return;
   do {
@@ -2022,6 +2658,27 @@ connection_or_unlink_all_active_circs(or_connection_t *orconn)
   SMARTLIST_FOREACH(orconn->active_circuit_pqueue, cell_ewma_t *, e,
                     e->heap_index = -1);
   smartlist_clear(orconn->active_circuit_pqueue);
+  while ((e = first_cell_ewma_on_conn(orconn)))
+    cell_ewma_bucket_unlink(orconn, e);
+}
+
+/** Return how many cells the circuits on <b>orconn</b> have queued for it. */
+int
+connection_or_count_queued_cells(or_connection_t *orconn)
+{
+  circuit_t *head = orconn->active_circuits;
+  circuit_t *cur = head;
+  int n = 0;
+  if (! head)
+    return 0;
+  do {
+    if (cur->n_conn == orconn)
+      n += cur->n_conn_cells.n;
+    else
+      n += TO_OR_CIRCUIT(cur)->p_conn_cells.n;
+    cur = *next_circ_on_conn_p(cur, orconn);
+  } while (cur != head);
+  return n;
 }
 
 /** Block (if <b>block</b> is true) or unblock (if <b>block</b> is false)
@@ -2083,19 +2740,32 @@ int connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max
 	struct timeval now_hires;		/* The current (hi-res) time */
 	cell_ewma_t *cell_ewma = NULL;		/* The EWMA cell counter for the circuit we're flushing. */
 	double ewma_increment = -1;
+	uint32_t flushed_usec;
 	circ = conn->active_circuits;
 	if(!circ)	return 0;
+	flushed_usec = (uint32_t)perf_now_usec();
 	assert_active_circuits_ok_paranoid(conn);
 	if(ewma_enabled)			/* See if we're doing the ewma circuit selection algorithm. */
 	{	unsigned tick;
 		double fractional_tick;
+		uint64_t pick_started = perf_now_usec();
 		tor_gettimeofday_cached(&now_hires);
 		tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
-		if(tick != conn->active_circuit_pqueue_last_recalibrated)
-			scale_active_circuits(conn, tick);
-		ewma_increment = pow(ewma_scale_factor, -fractional_tick);
-		cell_ewma = smartlist_get(conn->active_circuit_pqueue, 0);
+		if(conn->ewma_use_buckets)	/* Bucketed connections count new cells relative to their last recalibration, and only rescale when the weights get too big. */
+		{	ewma_increment = pow(ewma_scale_factor, -(double)(int)(tick - conn->active_circuit_pqueue_last_recalibrated) - fractional_tick);
+			if(ewma_increment > CELL_EWMA_MAX_WEIGHT)
+			{	scale_active_circuits(conn, tick);
+				ewma_increment = pow(ewma_scale_factor, -fractional_tick);
+			}
+		}
+		else
+		{	if(tick != conn->active_circuit_pqueue_last_recalibrated)
+				scale_active_circuits(conn, tick);
+			ewma_increment = pow(ewma_scale_factor, -fractional_tick);
+		}
+		cell_ewma = first_cell_ewma_on_conn(conn);
 		circ = cell_ewma_to_circuit(cell_ewma);
+		perf_hist_add(PERF_HIST_EWMA_USEC,perf_now_usec() - pick_started);
 	}
 	if(circ->n_conn == conn)
 	{	queue = &circ->n_conn_cells;
@@ -2106,9 +2776,16 @@ int connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max
 		streams_blocked = circ->streams_blocked_on_p_conn;
 	}
 	tor_assert(*next_circ_on_conn_p(circ,conn));
-	for(n_flushed = 0; n_flushed < max && queue->head; )
-	{	packed_cell_t *cell = cell_queue_pop(queue);
+	for(n_flushed = 0; n_flushed < max && queue->n; )
+	{	packed_cell_t cell;
+		cell_queue_pop(queue, &cell);
 		tor_assert(*next_circ_on_conn_p(circ,conn));
+		/* Note how long the cell waited in the queue, for the circuit, for the connection and for GETINFO perf/cell-wait. The difference is right even if the 32-bit timestamps wrapped in between. */
+		cell_wait_hist_add(&circ->cell_wait,flushed_usec - cell.inserted_usec);
+		cell_wait_hist_add(&conn->cell_wait,flushed_usec - cell.inserted_usec);
+		perf_hist_add(PERF_HIST_CELL_WAIT_USEC,flushed_usec - cell.inserted_usec);
+		if(etw_enabled(ETW_KW_CELLS))
+			etw_cell_dequeued(circ->n_conn == conn ? circ->n_circ_id : TO_OR_CIRCUIT(circ)->p_circ_id,queue->n);
 		/* Calculate the exact time that this cell has spent in the queue. */
 		if(get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ))
 		{	struct timeval now2;
@@ -2136,16 +2813,11 @@ int connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max
 		}
 		/* If we just flushed our queue and this circuit is used for a tunneled directory request, possibly advance its state. */
 		if(queue->n == 0 && TO_CONN(conn)->dirreq_id)	geoip_change_dirreq_state(TO_CONN(conn)->dirreq_id,DIRREQ_TUNNELED,DIRREQ_CIRC_QUEUE_FLUSHED);
-		connection_write_to_buf(cell->body, CELL_NETWORK_SIZE, TO_CONN(conn));
-		packed_cell_free_unchecked(cell);
+		connection_write_to_buf(cell.body, CELL_NETWORK_SIZE, TO_CONN(conn));
 		++n_flushed;
 		if(cell_ewma)
-		{	cell_ewma_t *tmp;
-			cell_ewma->cell_count += ewma_increment;
-			/* We pop and re-add the cell_ewma_t here, not above, since we need to re-add it immediately to keep the priority queue consistent with the linked-list implementation */
-			tmp = pop_first_cell_ewma_from_conn(conn);
-			tor_assert(tmp == cell_ewma);
-			add_cell_ewma_to_conn(conn, cell_ewma);
+		{	cell_ewma->cell_count += ewma_increment;
+			reposition_first_cell_ewma_on_conn(conn, cell_ewma);
 		}
 		if(circ != conn->active_circuits)	/* If this happens, the current circuit just got made inactive by a call in connection_write_to_buf().  That's nothing to worry about: circuit_make_inactive_on_conn() already advanced conn->active_circuits for us. */
 		{	assert_active_circuits_ok_paranoid(conn);
@@ -2174,6 +2846,17 @@ void
 append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                              cell_t *cell, cell_direction_t direction,
                              streamid_t fromstream)
+{
+  append_cells_to_circuit_queue(circ, orconn, cell, 1, direction, fromstream);
+}
+
+/** Add the <b>n_cells</b> cells in <b>cells</b>, in order, to the queue of
+ * <b>circ</b> writing to <b>orconn</b> transmitting in <b>direction</b>. */
+void
+append_cells_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
+                              cell_t *cells, int n_cells,
+                              cell_direction_t direction,
+                              streamid_t fromstream)
 {
   cell_queue_t *queue;
   int streams_blocked;
@@ -2193,7 +2876,11 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
 //    cell->command = CELL_RELAY;
 //  }
 
-  cell_queue_append_packed_copy(queue, cell);
+  cell_queue_append_packed_copies(queue, cells, n_cells);
+  perf_hist_add(PERF_HIST_QUEUE_DEPTH, queue->n);
+  if (etw_enabled(ETW_KW_CELLS))
+    etw_cell_queued(direction == CELL_DIRECTION_OUT ? circ->n_circ_id :
+                    TO_OR_CIRCUIT(circ)->p_circ_id, queue->n, n_cells);
 
   /* If we have too many cells on the circuit, we should stop reading from
    * the edge streams for a while. */
@@ -2206,8 +2893,8 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
   }
 
 
-  if (queue->n == 1) {
-    /* This was the first cell added to the queue.  We need to make this
+  if (queue->n == n_cells) {
+    /* These were the first cells added to the queue.  We need to make this
      * circuit active. */
     log_debug(LD_GENERAL,get_lang_str(LANG_LOG_RELAY_MADE_A_CIRCUIT_ACTIVE));
     make_circuit_active_on_conn(circ, orconn);
@@ -2328,13 +3015,21 @@ assert_active_circuits_ok(or_connection_t *orconn)
       tor_assert(ewma->is_for_p_conn);
     }
     tor_assert(ewma->heap_index != -1);
-    tor_assert(ewma == smartlist_get(orconn->active_circuit_pqueue,
-                                     ewma->heap_index));
+    if (orconn->ewma_use_buckets) {
+      tor_assert(ewma->heap_index < CELL_EWMA_N_BUCKETS);
+      tor_assert(orconn->ewma_buckets[ewma->heap_index]);
+      tor_assert(ewma->bucket_next->bucket_prev == ewma);
+      tor_assert(ewma->bucket_prev->bucket_next == ewma);
+    } else {
+      tor_assert(ewma == smartlist_get(orconn->active_circuit_pqueue,
+                                       ewma->heap_index));
+    }
     n++;
     cur = next;
   } while (cur != head);
 
-  tor_assert(n == smartlist_len(orconn->active_circuit_pqueue));
+  if (!orconn->ewma_use_buckets)
+    tor_assert(n == smartlist_len(orconn->active_circuit_pqueue));
 }
 
 /** Return 1 if we shouldn't restart reading on this circuit, even if
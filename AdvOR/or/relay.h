@@ -17,6 +17,12 @@ extern uint64_t stats_n_relay_cells_delivered;
 
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_precrypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                          cell_direction_t cell_direction,
+                                          const relay_precrypt_t *precrypt);
+void relay_precrypt_cell(circuit_t *circ, cell_t *cell,
+                         cell_direction_t cell_direction,
+                         relay_precrypt_t *out);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
 void relay_header_unpack(relay_header_t *dest, const uint8_t *src);
@@ -30,6 +36,12 @@ int connection_edge_package_raw_inbuf(edge_connection_t *conn,
                                       int package_partial,
                                       int *max_cells);
 void connection_edge_consider_sending_sendme(edge_connection_t *conn);
+void circuit_stream_index_remove(circuit_t *circ, edge_connection_t *conn);
+void circuit_stream_index_free(circuit_t *circ);
+
+/** A stream that hasn't packaged anything for this many seconds counts as
+ * interactive when it has data again. */
+#define STREAM_INTERACTIVE_IDLE_SECONDS 2
 
 extern uint64_t stats_n_data_cells_packaged;
 extern uint64_t stats_n_data_bytes_packaged;
@@ -42,13 +54,20 @@ void clean_cell_pool(void);
 void dump_cell_pool_usage(int severity);
 
 void cell_queue_clear(cell_queue_t *queue);
-void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+void cell_queue_append(cell_queue_t *queue, const packed_cell_t *cell);
 void cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell);
+void cell_queue_append_packed_copies(cell_queue_t *queue, const cell_t *cells,
+                                     int n_cells);
 
 void append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                                   cell_t *cell, cell_direction_t direction,
                                   streamid_t fromstream);
+void append_cells_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
+                                   cell_t *cells, int n_cells,
+                                   cell_direction_t direction,
+                                   streamid_t fromstream);
 void connection_or_unlink_all_active_circs(or_connection_t *conn);
+int connection_or_count_queued_cells(or_connection_t *orconn);
 int connection_or_flush_from_first_active_circuit(or_connection_t *conn,
                                                   int max, time_t now);
 void assert_active_circuits_ok(or_connection_t *orconn);
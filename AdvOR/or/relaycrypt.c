@@ -0,0 +1,285 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relaycrypt.c
+ * \brief Spread the crypto for batches of relayed cells over a pool of
+ * worker threads.
+ *
+ * connection_or_process_cell_batch() reads a run of relay cells off an OR
+ * connection and passes it to relaycrypt_prepare_cells().  We look up the
+ * circuit of each cell, group the cells by circuit and direction, and let
+ * the workers (and the main thread) crypt one group at a time, so that the
+ * cells of any one circuit are crypted in order by a single thread.  Once
+ * every group is done, the main thread processes the cells in the order
+ * they arrived, using the recorded results instead of crypting them again.
+ *
+ * We handle or_circuits, whose cells we crypt with a single layer, and
+ * inbound cells on open origin circuits, whose layered decrypts are where
+ * a busy client spends its cell crypto.  Cells for circuits that are not
+ * ready are left for the main thread.
+ **/
+
+#include "or.h"
+#include "circuitlist.h"
+#include "etw.h"
+#include "perf.h"
+#include "relay.h"
+#include "relaycrypt.h"
+
+/** The maximum number of relay crypto worker threads we will run. */
+#define MAX_RELAYCRYPT_WORKERS 16
+/** Don't wake any workers for batches with fewer cells to crypt than this:
+ * the wakeup costs more than the crypto. */
+#define RELAYCRYPT_MIN_PARALLEL_CELLS 8
+
+/** The cells of one circuit, in one direction, from the current batch. */
+typedef struct relaycrypt_job_t {
+  circuit_t *circ; /**< The circuit whose cipher state we'll use. */
+  cell_direction_t direction; /**< Which way the cells are going. */
+  int first_cell; /**< Index of the job's first cell in the batch. */
+  int last_cell; /**< Index of the job's last cell in the batch. */
+} relaycrypt_job_t;
+
+/** The jobs of the batch we're crypting right now. */
+static relaycrypt_job_t batch_jobs[RELAYCRYPT_BATCH_CELLS];
+/** For each cell in the batch, the index of the next cell of the same job,
+ * or -1 for the last one. */
+static int batch_next_cell[RELAYCRYPT_BATCH_CELLS];
+/** How many entries of <b>batch_jobs</b> are in use? */
+static int batch_n_jobs = 0;
+/** The cells of the batch we're crypting right now. */
+static cell_t *batch_cells = NULL;
+/** Where to record the results for <b>batch_cells</b>. */
+static relay_precrypt_t *batch_precrypt = NULL;
+
+/** How many relay crypto workers are running? */
+static int n_relaycrypt_workers = 0;
+
+#ifdef USE_WIN32_THREADS
+/** Index of the next job that nobody has claimed yet. */
+static volatile LONG batch_next_job = 0;
+/** Released once per worker that should run the current batch. */
+static HANDLE relaycrypt_work_sem = NULL;
+/** Signalled when the last busy worker is done. */
+static HANDLE relaycrypt_done_event = NULL;
+/** How many of the woken workers haven't finished yet? */
+static volatile LONG n_relaycrypt_workers_busy = 0;
+/** True iff woken workers should exit instead of looking for jobs. */
+static volatile int relaycrypt_workers_exit = 0;
+#define RELAYCRYPT_CLAIM_JOB() ((int)InterlockedIncrement(&batch_next_job) - 1)
+#else
+static int batch_next_job = 0;
+#define RELAYCRYPT_CLAIM_JOB() (batch_next_job++)
+#endif
+
+/** Claim and crypt jobs from the current batch until there are none
+ * left. */
+static void
+relaycrypt_run_jobs(void)
+{
+  int j, i;
+
+  while ((j = RELAYCRYPT_CLAIM_JOB()) < batch_n_jobs) {
+    relaycrypt_job_t *job = &batch_jobs[j];
+    for (i = job->first_cell; i >= 0; i = batch_next_cell[i])
+      relay_precrypt_cell(job->circ, &batch_cells[i], job->direction,
+                          &batch_precrypt[i]);
+  }
+}
+
+#ifdef USE_WIN32_THREADS
+/** Main loop of a relay crypto worker: wait to be woken, help with the
+ * current batch, and report back. */
+static void
+relaycrypt_worker_main(void *arg)
+{
+  int exiting;
+  (void)arg;
+
+  while (1) {
+    WaitForSingleObject(relaycrypt_work_sem, INFINITE);
+    exiting = relaycrypt_workers_exit;
+    if (!exiting)
+      relaycrypt_run_jobs();
+    if (InterlockedDecrement(&n_relaycrypt_workers_busy) == 0)
+      SetEvent(relaycrypt_done_event);
+    if (exiting)
+      break;
+  }
+  spawn_exit();
+}
+
+/** Wake <b>n</b> workers, telling them to exit if <b>stop</b> is set, and
+ * wait for all of them to finish.  The main thread helps with the jobs in
+ * the meantime. */
+static void
+relaycrypt_wake_workers(int n, int stop)
+{
+  relaycrypt_workers_exit = stop;
+  n_relaycrypt_workers_busy = n;
+  ReleaseSemaphore(relaycrypt_work_sem, n, NULL);
+  if (!stop)
+    relaycrypt_run_jobs();
+  WaitForSingleObject(relaycrypt_done_event, INFINITE);
+  relaycrypt_workers_exit = 0;
+}
+#endif
+
+/** Make sure that <b>n_threads</b> relay crypto workers are running,
+ * starting or stopping workers as needed.  Zero turns the pool off. */
+void
+relaycrypt_set_threads(int n_threads)
+{
+#ifdef USE_WIN32_THREADS
+  if (n_threads > MAX_RELAYCRYPT_WORKERS)
+    n_threads = MAX_RELAYCRYPT_WORKERS;
+  if (n_threads < 0)
+    n_threads = 0;
+  if (n_threads == n_relaycrypt_workers)
+    return;
+  if (!relaycrypt_work_sem) {
+    relaycrypt_work_sem = CreateSemaphore(NULL, 0, MAX_RELAYCRYPT_WORKERS,
+                                          NULL);
+    relaycrypt_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!relaycrypt_work_sem || !relaycrypt_done_event) {
+      relaycrypt_free_all();
+      return;
+    }
+  }
+  if (n_relaycrypt_workers) {
+    /* All the workers are idle between batches; stop them and start over
+     * with the number we want. */
+    relaycrypt_wake_workers(n_relaycrypt_workers, 1);
+    n_relaycrypt_workers = 0;
+  }
+  while (n_relaycrypt_workers < n_threads) {
+    if (spawn_func(relaycrypt_worker_main, NULL) < 0)
+      break;
+    ++n_relaycrypt_workers;
+  }
+#else
+  (void)n_threads;
+#endif
+}
+
+/** Return true iff OR connections should hand their relay cells to
+ * relaycrypt_prepare_cells(). */
+int
+relaycrypt_is_enabled(void)
+{
+  return n_relaycrypt_workers > 0;
+}
+
+/** Crypt the relay cells among the <b>n_cells</b> <b>cells</b> that just
+ * arrived on <b>conn</b>, spreading the work over the relay crypto workers.
+ * For each cell, record in <b>precrypt</b> the circuit it was crypted for
+ * and the outcome, or set its circuit to NULL if the cell was left for the
+ * main thread.
+ *
+ * The caller must process the cells in order with
+ * command_process_precrypted_cell() before anything else can touch the
+ * circuits involved.
+ */
+void
+relaycrypt_prepare_cells(or_connection_t *conn, cell_t *cells,
+                         relay_precrypt_t *precrypt, int n_cells)
+{
+  int i, j, n_crypted = 0;
+  uint64_t started = 0;
+
+  tor_assert(n_cells <= RELAYCRYPT_BATCH_CELLS);
+  batch_n_jobs = 0;
+
+  for (i = 0; i < n_cells; ++i) {
+    cell_t *cell = &cells[i];
+    circuit_t *circ;
+    or_circuit_t *or_circ;
+    cell_direction_t direction;
+
+    precrypt[i].circ = NULL;
+    batch_next_cell[i] = -1;
+    if (cell->command != CELL_RELAY && cell->command != CELL_RELAY_EARLY)
+      continue;
+    circ = circuit_get_by_circid_orconn(cell->circ_id, conn);
+    /* Leave anything unusual for command_process_relay_cell() to complain
+     * about. */
+    if (!circ || circ->marked_for_close ||
+        circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING)
+      continue;
+    if (CIRCUIT_IS_ORIGIN(circ)) {
+      /* Only once every hop is open: a hop that opens while we process
+       * this batch must not be skipped by cells we crypted before it. */
+      if (circ->state != CIRCUIT_STATE_OPEN || circ->n_conn != conn)
+        continue;
+      direction = CELL_DIRECTION_IN;
+    } else {
+      or_circ = TO_OR_CIRCUIT(circ);
+      /* A circuit that leaves the way it came in could see its cells in
+       * both directions in one batch; keep it simple. */
+      if (or_circ->p_conn == circ->n_conn)
+        continue;
+      if (cell->circ_id == or_circ->p_circ_id)
+        direction = CELL_DIRECTION_OUT;
+      else
+        direction = CELL_DIRECTION_IN;
+      if (!(direction == CELL_DIRECTION_OUT ? or_circ->n_crypto :
+            or_circ->p_crypto))
+        continue;
+    }
+
+    for (j = batch_n_jobs - 1; j >= 0; --j) {
+      if (batch_jobs[j].circ == circ && batch_jobs[j].direction == direction)
+        break;
+    }
+    if (j < 0) {
+      j = batch_n_jobs++;
+      batch_jobs[j].circ = circ;
+      batch_jobs[j].direction = direction;
+      batch_jobs[j].first_cell = i;
+    } else {
+      batch_next_cell[batch_jobs[j].last_cell] = i;
+    }
+    batch_jobs[j].last_cell = i;
+    precrypt[i].circ = circ;
+    ++n_crypted;
+  }
+
+  if (!batch_n_jobs)
+    return;
+  if (etw_enabled(ETW_KW_RELAYCRYPT))
+    started = perf_now_usec();
+  batch_cells = cells;
+  batch_precrypt = precrypt;
+  batch_next_job = 0;
+#ifdef USE_WIN32_THREADS
+  if (n_crypted >= RELAYCRYPT_MIN_PARALLEL_CELLS && batch_n_jobs > 1)
+    relaycrypt_wake_workers(MIN(batch_n_jobs - 1, n_relaycrypt_workers), 0);
+  else
+#endif
+    relaycrypt_run_jobs();
+  batch_cells = NULL;
+  batch_precrypt = NULL;
+  if (started)
+    etw_relaycrypt_batch(n_crypted, batch_n_jobs, perf_now_usec() - started);
+}
+
+/** Stop all relay crypto workers and release their resources. */
+void
+relaycrypt_free_all(void)
+{
+#ifdef USE_WIN32_THREADS
+  if (n_relaycrypt_workers)
+    relaycrypt_wake_workers(n_relaycrypt_workers, 1);
+  n_relaycrypt_workers = 0;
+  if (relaycrypt_work_sem)
+    CloseHandle(relaycrypt_work_sem);
+  if (relaycrypt_done_event)
+    CloseHandle(relaycrypt_done_event);
+  relaycrypt_work_sem = relaycrypt_done_event = NULL;
+#endif
+}
+
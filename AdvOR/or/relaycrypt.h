@@ -0,0 +1,26 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relaycrypt.h
+ * \brief Header file for relaycrypt.c.
+ **/
+
+#ifndef _TOR_RELAYCRYPT_H
+#define _TOR_RELAYCRYPT_H
+
+/** How many cells do we read off an OR connection's inbuf before we hand
+ * them to the relay crypto workers? */
+#define RELAYCRYPT_BATCH_CELLS 64
+
+void relaycrypt_set_threads(int n_threads);
+int relaycrypt_is_enabled(void);
+void relaycrypt_prepare_cells(or_connection_t *conn, cell_t *cells,
+                              relay_precrypt_t *precrypt, int n_cells);
+void relaycrypt_free_all(void);
+
+#endif
+
@@ -25,7 +25,8 @@
 
 static extend_info_t *rend_client_get_random_intro_impl(
                           const rend_cache_entry_t *rend_query,
-                          const int strict, const int warnings);
+                          const int strict, const int warnings,
+                          const char *exclude_digest);
 static int directory_get_from_hs_dir(const char *desc_id, const rend_data_t *rend_query) __attribute__ ((format(printf, 1, 0)));
 
 /** Purge all potentially remotely-detectable state held in the hidden
@@ -159,8 +160,7 @@ int rend_client_send_introduction(origin_circuit_t *introcirc,origin_circuit_t *
 			if(!r)
 			{	cpath = rendcirc->build_state->pending_final_cpath;
 				if(!cpath)
-				{	cpath = rendcirc->build_state->pending_final_cpath = tor_malloc_zero(sizeof(crypt_path_t));
-					cpath->magic = CRYPT_PATH_MAGIC;
+				{	cpath = rendcirc->build_state->pending_final_cpath = crypt_path_new();
 					cpath->hItem=NULL;
 					if(!(cpath->dh_handshake_state = crypto_dh_new(DH_TYPE_REND)))
 					{	log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDCLIENT_INTERNAL_ERROR_4));
@@ -223,7 +223,7 @@ int rend_client_send_introduction(origin_circuit_t *introcirc,origin_circuit_t *
 							return -1;
 						}
 						/* Now, we wait for an ACK or NAK on this circuit. */
-						introcirc->_base.purpose = CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT;
+						circuit_change_purpose(TO_CIRCUIT(introcirc), CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT);
 						/* Set timestamp_dirty, because circuit_expire_building expects it to specify when a circuit entered the _C_INTRODUCE_ACK_WAIT state. */
 						introcirc->_base.timestamp_dirty = get_time(NULL);
 						tree_set_circ(TO_CIRCUIT(introcirc));
@@ -253,6 +253,50 @@ rend_client_rendcirc_has_opened(origin_circuit_t *circ)
   }
 }
 
+/** Return true iff an introduction for the same service as <b>circ</b> is
+ * still waiting for its ACK on a circuit other than <b>circ</b>. */
+static int
+rend_client_other_intro_pending(origin_circuit_t *circ)
+{
+  circuit_t *c;
+  for (c = circuit_get_first_by_purpose(CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT);
+       c; c = c->next_by_purpose) {
+    origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(c);
+    if (oc != circ && !c->marked_for_close && oc->rend_data &&
+        !rend_cmp_service_ids(circ->rend_data->onion_address,
+                              oc->rend_data->onion_address))
+      return 1;
+  }
+  return 0;
+}
+
+/** Our introduction through <b>circ</b> was acknowledged: close the other
+ * introduction circuits for the same service, which we launched or sent
+ * in parallel with it. */
+static void
+rend_client_close_parallel_intros(origin_circuit_t *circ)
+{
+  static const uint8_t purposes[] = { CIRCUIT_PURPOSE_C_INTRODUCING,
+                                      CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT };
+  circuit_t *c;
+  unsigned i;
+  for (i = 0; i < sizeof(purposes); i++) {
+    for (c = circuit_get_first_by_purpose(purposes[i]); c;
+         c = c->next_by_purpose) {
+      origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(c);
+      if (oc != circ && !c->marked_for_close && oc->rend_data &&
+          !rend_cmp_service_ids(circ->rend_data->onion_address,
+                                oc->rend_data->onion_address)) {
+        log_info(LD_REND|LD_CIRC,
+                 get_lang_str(LANG_LOG_RENDCLIENT_CLOSING_PARALLEL_INTRO),
+                 safe_str_client(circ->rend_data->onion_address),
+                 c->n_circ_id);
+        circuit_mark_for_close(c, END_CIRC_REASON_FINISHED);
+      }
+    }
+  }
+}
+
 /** Called when get an ACK or a NAK for a REND_INTRODUCE1 cell.
  */
 int
@@ -280,7 +324,7 @@ rend_client_introduction_acked(origin_circuit_t *circ,
     rendcirc = circuit_get_by_rend_query_and_purpose(
                circ->rend_data->onion_address, CIRCUIT_PURPOSE_C_REND_READY);
     if (rendcirc) { /* remember the ack */
-      rendcirc->_base.purpose = CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED;
+      circuit_change_purpose(TO_CIRCUIT(rendcirc), CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED);
       /* Set timestamp_dirty, because circuit_expire_building expects
        * it to specify when a circuit entered the
        * _C_REND_READY_INTRO_ACKED state. */
@@ -289,13 +333,28 @@ rend_client_introduction_acked(origin_circuit_t *circ,
     } else {
       log_info(LD_REND,get_lang_str(LANG_LOG_RENDCLIENT_NO_REND_CIRC_FOUND));
     }
+    /* The first ACK wins; we won't need any parallel introductions. */
+    rend_client_close_parallel_intros(circ);
     /* close the circuit: we won't need it anymore. */
-    circ->_base.purpose = CIRCUIT_PURPOSE_C_INTRODUCE_ACKED;
+    circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_C_INTRODUCE_ACKED);
     tree_set_circ(TO_CIRCUIT(circ));
     circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_FINISHED);
   } else {
     /* It's a NAK; the introduction point didn't relay our request. */
-    circ->_base.purpose = CIRCUIT_PURPOSE_C_INTRODUCING;
+    if (rend_client_other_intro_pending(circ)) {
+      /* A parallel introduction may still succeed; don't start another
+       * one, just forget this intro point. */
+      log_info(LD_REND,
+               get_lang_str(LANG_LOG_RENDCLIENT_PARALLEL_INTRO_NACKED),
+               safe_str_client(extend_info_describe(
+                               circ->build_state->chosen_exit)),
+               safe_str_client(circ->rend_data->onion_address));
+      rend_client_remove_intro_point(circ->build_state->chosen_exit,
+                                     circ->rend_data);
+      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_FINISHED);
+      return 0;
+    }
+    circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_C_INTRODUCING);
     tree_set_circ(TO_CIRCUIT(circ));
     /* Remove this intro point from the set of viable introduction
      * points. If any remain, extend to a new one and try again.
@@ -494,9 +553,6 @@ static int directory_get_from_hs_dir(const char *desc_id, const rend_data_t *ren
 void
 rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
 {
-  char descriptor_id[DIGEST_LEN];
-  int replicas_left_to_try[REND_NUMBER_OF_NON_CONSECUTIVE_REPLICAS];
-  int i, tries_left;
   rend_cache_entry_t *e = NULL;
   tor_assert(rend_query);
   /* Are we configured to fetch descriptors? */
@@ -509,6 +565,21 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
     log_info(LD_REND,get_lang_str(LANG_LOG_RENDCLIENT_ALREADY_HAVE_DESC));
     return;
   }
+  rend_client_refresh_v2_renddesc(rend_query);
+}
+
+/** As rend_client_refetch_v2_renddesc, but fetch the descriptor even if
+ * we have one already, so that a newer one can replace it.
+ */
+void
+rend_client_refresh_v2_renddesc(const rend_data_t *rend_query)
+{
+  char descriptor_id[DIGEST_LEN];
+  int replicas_left_to_try[REND_NUMBER_OF_NON_CONSECUTIVE_REPLICAS];
+  int i, tries_left;
+  tor_assert(rend_query);
+  if (!get_options()->FetchHidServDescriptors)
+    return;
   log_debug(LD_REND,get_lang_str(LANG_LOG_RENDCLIENT_FETCHING_V2_DESC_2),safe_str(rend_query->onion_address));
   /* Randomly iterate over the replicas until a descriptor can be fetched
    * from one of the consecutive nodes, or no options are left. */
@@ -651,7 +722,7 @@ rend_client_rendezvous_acked(origin_circuit_t *circ, const uint8_t *request,
     return -1;
   }
   log_info(LD_REND,get_lang_str(LANG_LOG_RENDCLIENT_REND_ACK));
-  circ->_base.purpose = CIRCUIT_PURPOSE_C_REND_READY;
+  circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_C_REND_READY);
   /* Set timestamp_dirty, because circuit_expire_building expects it
    * to specify when a circuit entered the _C_REND_READY state. */
   circ->_base.timestamp_dirty = get_time(NULL);
@@ -692,7 +763,7 @@ int rend_client_receive_rendezvous(origin_circuit_t *circ, const uint8_t *reques
 			{	crypto_dh_free(hop->dh_handshake_state);
 				hop->dh_handshake_state = NULL;
 				/* All is well. Extend the circuit. */
-				circ->_base.purpose = CIRCUIT_PURPOSE_C_REND_JOINED;
+				circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_C_REND_JOINED);
 				tree_set_circ(TO_CIRCUIT(circ));
 				hop->state = CPATH_STATE_OPEN;
 				/* set the windows to default. these are the windows that alice thinks bob has. */
@@ -779,16 +850,30 @@ extend_info_t *rend_client_get_random_intro(const rend_data_t *rend_query)
 		return NULL;
 	}
 	/* See if we can get a node that complies with ExcludeNodes */
-	if((result = rend_client_get_random_intro_impl(entry, 1, 1)))
+	if((result = rend_client_get_random_intro_impl(entry, 1, 1, NULL)))
 		return result;
 	return NULL;
 }
 
+/** Return a newly allocated extend_info_t* for a randomly chosen introduction
+ * point for the named hidden service other than the one with identity
+ * <b>exclude_digest</b>. Return NULL, without complaining, if there is no
+ * other usable introduction point.
+ */
+extend_info_t *rend_client_get_parallel_intro(const rend_data_t *rend_query,const char *exclude_digest)
+{	rend_cache_entry_t *entry;
+
+	if(rend_cache_lookup_entry(rend_query->onion_address, -1, &entry) < 1)
+		return NULL;
+	return rend_client_get_random_intro_impl(entry, 1, 0, exclude_digest);
+}
+
 /** As rend_client_get_random_intro, except assume that StrictNodes is set
  * iff <b>strict</b> is true. If <b>warnings</b> is false, don't complain
- * to the user when we're out of nodes, even if StrictNodes is true.
+ * to the user when we're out of nodes, even if StrictNodes is true. If
+ * <b>exclude_digest</b> is set, never pick the intro point with that identity.
  */
-static extend_info_t *rend_client_get_random_intro_impl(const rend_cache_entry_t *entry,const int strict,const int warnings)
+static extend_info_t *rend_client_get_random_intro_impl(const rend_cache_entry_t *entry,const int strict,const int warnings,const char *exclude_digest)
 {	int i;
 	(void) strict;
 	rend_intro_point_t *intro;
@@ -808,6 +893,10 @@ static extend_info_t *rend_client_get_random_intro_impl(const rend_cache_entry_t
 		}
 		i = crypto_rand_int(smartlist_len(usable_nodes));
 		intro = smartlist_get(usable_nodes, i);
+		if(exclude_digest && tor_memeq(intro->extend_info->identity_digest, exclude_digest, DIGEST_LEN))
+		{	smartlist_del(usable_nodes, i);
+			continue;
+		}
 		/* Do we need to look up the router or is the extend info complete? */
 		if(!intro->extend_info->onion_key)
 		{	if(tor_digest_is_zero(intro->extend_info->identity_digest))
@@ -838,7 +927,7 @@ int
 rend_client_any_intro_points_usable(const rend_cache_entry_t *entry)
 {
   extend_info_t *extend_info =
-    rend_client_get_random_intro_impl(entry,1, 0);
+    rend_client_get_random_intro_impl(entry,1, 0, NULL);
 
   int rv = (extend_info != NULL);
 
@@ -607,7 +607,7 @@ rend_service_descriptor_t *rend_parse_service_descriptor(const char *str, size_t
 					if(!eos)	break;
 					/* Write nickname to extend info, but postpone the lookup whether we know that router. It's not part of the parsing process. */
 					intro = tor_malloc_zero(sizeof(rend_intro_point_t));
-					intro->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+					intro->extend_info = extend_info_new();
 					strlcpy(intro->extend_info->nickname, cp,sizeof(intro->extend_info->nickname));
 					smartlist_add(result->intro_nodes, intro);
 					cp = eos+1;
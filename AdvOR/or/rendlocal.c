@@ -0,0 +1,199 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file rendlocal.c
+ * \brief Connect streams to our own hidden services without a rendezvous.
+ *
+ * With HidServLocalShortcut set, a CONNECT stream to the .onion address of
+ * one of our own hidden services is not attached to a rendezvous circuit.
+ * rend_local_attach() opens the exit connection that a rendezvous would
+ * open, to the address and port that the service maps the virtual port to
+ * (or to its plugin, for plugin-backed services), and pairs it with the
+ * stream.  What each of them reads is written to the other, as the
+ * payloads of DATA cells would be, and each stops reading while the outbuf
+ * of the other is too full.  When either closes, the other is closed after
+ * it flushed what it holds.
+ *
+ * Services that authorize their clients always get a real rendezvous.
+ **/
+
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_edge.h"
+#include "main.h"
+#include "perf.h"
+#include "reasons.h"
+#include "relay.h"
+#include "rendlocal.h"
+#include "rendservice.h"
+
+/** If the hidden-service stream <b>conn</b> wants one of our own hidden
+ * services, connect it to the service directly.  Return 1 if it doesn't,
+ * -1 if it had to be closed, else 0. */
+int
+rend_local_attach(edge_connection_t *conn)
+{
+  socks_request_t *socks = conn->socks_request;
+  edge_connection_t *exitconn;
+  int r, socket_error = 0;
+
+  tor_assert(conn->rend_data);
+  if (!get_options()->HidServLocalShortcut ||
+      socks->command != SOCKS_COMMAND_CONNECT)
+    return 1;
+
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  exitconn->_base.purpose = EXIT_PURPOSE_CONNECT;
+  exitconn->_base.port = socks->port;
+  r = rend_service_set_local_addr_port(exitconn,
+                                       conn->rend_data->onion_address);
+  if (r) {
+    connection_free(TO_CONN(exitconn));
+    if (r > 0)
+      return 1;
+    connection_mark_unattached_ap(conn, END_STREAM_REASON_EXITPOLICY);
+    return -1;
+  }
+  log_info(LD_REND, get_lang_str(LANG_LOG_RENDLOCAL_ATTACHED),
+           safe_str_client(conn->rend_data->onion_address), socks->port);
+  exitconn->_base.address = tor_strdup("(local rendezvous)");
+  exitconn->package_window = STREAMWINDOW_START;
+  exitconn->deliver_window = STREAMWINDOW_START;
+  exitconn->local_peer = conn;
+  conn->local_peer = exitconn;
+  conn->_base.state = AP_CONN_STATE_CONNECT_WAIT;
+
+  if (exitconn->_base.hs_plugin) {
+    /* As connection_exit_connect() does: the plugin answers on a socket
+     * that is never connected. */
+    exitconn->_base.s = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    set_socket_nonblocking(exitconn->_base.s);
+    connection_add(TO_CONN(exitconn));
+  } else {
+    switch (connection_connect(TO_CONN(exitconn), exitconn->_base.address,
+                               &exitconn->_base.addr, exitconn->_base.port,
+                               &socket_error)) {
+      case -1:
+        conn->local_peer = NULL;
+        connection_free(TO_CONN(exitconn));
+        connection_mark_unattached_ap(conn,
+                                      errno_to_stream_end_reason(socket_error));
+        return -1;
+      case 0:
+        exitconn->_base.state = EXIT_CONN_STATE_CONNECTING;
+        connection_watch_events(TO_CONN(exitconn), READ_EVENT | WRITE_EVENT);
+        return 0;
+      /* case 1: fall through */
+    }
+  }
+  exitconn->_base.state = EXIT_CONN_STATE_OPEN;
+  connection_watch_events(TO_CONN(exitconn), READ_EVENT);
+  return rend_local_connected(exitconn);
+}
+
+/** The exit connection <b>exitconn</b> of a stream to one of our own hidden
+ * services is open: tell the client, and pass on what each of them sent
+ * meanwhile.  Return 0. */
+int
+rend_local_connected(edge_connection_t *exitconn)
+{
+  edge_connection_t *conn = exitconn->local_peer;
+
+  if (!conn || conn->_base.marked_for_close)
+    return 0; /* rend_local_detach() closes us. */
+  conn->_base.state = AP_CONN_STATE_OPEN;
+  stream_trace_stamp(conn, STREAM_TRACE_CONNECTED);
+  if (!conn->socks_request->has_finished)
+    connection_ap_handshake_socks_reply(conn, NULL, 0, 0);
+  rend_local_package(conn);
+  if (!exitconn->_base.marked_for_close)
+    rend_local_package(exitconn);
+  return 0;
+}
+
+/** Write what waits on the inbuf of <b>conn</b> to its peer, a payload at a
+ * time.  Stop reading while the peer's outbuf is too full, as a stream
+ * whose package window runs out does.  Return 0. */
+int
+rend_local_package(edge_connection_t *conn)
+{
+  edge_connection_t *peer = conn->local_peer;
+  char payload[RELAY_PAYLOAD_SIZE];
+  size_t length;
+
+  if (!peer || peer->_base.marked_for_close)
+    return 0;
+  while ((length = buf_datalen(conn->_base.inbuf)) > 0 &&
+         !conn->_base.marked_for_close && !peer->_base.marked_for_close) {
+    if (connection_outbuf_too_full(TO_CONN(peer))) {
+      connection_stop_reading(TO_CONN(conn));
+      return 0;
+    }
+    if (length > RELAY_PAYLOAD_SIZE)
+      length = RELAY_PAYLOAD_SIZE;
+    connection_fetch_from_buf(payload, length, TO_CONN(conn));
+    connection_write_to_buf(payload, length, TO_CONN(peer));
+    conn->last_packaged_at = approx_time();
+    if (peer->_base.type == CONN_TYPE_AP)
+      stream_trace_stamp(peer, STREAM_TRACE_FIRST_BYTE);
+  }
+  return 0;
+}
+
+/** Called when <b>conn</b> flushed some of its outbuf: let its peer read
+ * again if it had stopped, and pass on what it has.  If the peer reached
+ * EOF while it still had data for us, close it now that it's all here. */
+void
+rend_local_flushed_some(edge_connection_t *conn)
+{
+  edge_connection_t *peer = conn->local_peer;
+
+  if (!peer || peer->_base.marked_for_close ||
+      connection_outbuf_too_full(TO_CONN(conn)))
+    return;
+  if (!connection_is_reading(TO_CONN(peer)) &&
+      !peer->_base.inbuf_reached_eof)
+    connection_start_reading(TO_CONN(peer));
+  rend_local_package(peer);
+  if (peer->_base.inbuf_reached_eof && !peer->_base.marked_for_close &&
+      !buf_datalen(peer->_base.inbuf))
+    connection_edge_reached_eof(peer);
+}
+
+/** <b>conn</b> is about to close: close its peer too, once the peer
+ * flushed what it holds.  If it was an exit connection that never opened,
+ * tell the client why. */
+void
+rend_local_detach(edge_connection_t *conn)
+{
+  edge_connection_t *peer = conn->local_peer;
+  int reason;
+
+  conn->local_peer = NULL;
+  if (!peer)
+    return;
+  peer->local_peer = NULL;
+  if (peer->_base.marked_for_close)
+    return;
+  if (peer->_base.type == CONN_TYPE_AP) {
+    reason = conn->end_reason & END_STREAM_REASON_MASK;
+    if (conn->_base.state == EXIT_CONN_STATE_OPEN ||
+        peer->socks_request->has_finished)
+      reason = END_STREAM_REASON_DONE;
+    else if (!reason || reason == END_STREAM_REASON_DONE)
+      reason = END_STREAM_REASON_CONNECTREFUSED;
+    connection_mark_unattached_ap(peer, reason);
+  } else {
+    peer->edge_has_sent_end = 1; /* no circuit to send it on */
+    peer->end_reason = END_STREAM_REASON_DONE;
+    connection_mark_for_close(TO_CONN(peer));
+    peer->_base.hold_open_until_flushed = 1;
+  }
+}
+
@@ -0,0 +1,22 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file rendlocal.h
+ * \brief Header file for rendlocal.c.
+ **/
+
+#ifndef _TOR_RENDLOCAL_H
+#define _TOR_RENDLOCAL_H
+
+int rend_local_attach(edge_connection_t *conn);
+int rend_local_connected(edge_connection_t *exitconn);
+int rend_local_package(edge_connection_t *conn);
+void rend_local_flushed_some(edge_connection_t *conn);
+void rend_local_detach(edge_connection_t *conn);
+
+#endif
+
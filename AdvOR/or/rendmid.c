@@ -78,7 +78,7 @@ int rend_mid_establish_intro(or_circuit_t *circ, const uint8_t *request,size_t r
 					{	log_info(LD_GENERAL,get_lang_str(LANG_LOG_RENDMID_ERROR_SENDING_INTRO_ESTABLISHED));
 					}
 					else	/* Now, set up this circuit. */
-					{	circ->_base.purpose = CIRCUIT_PURPOSE_INTRO_POINT;
+					{	circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_INTRO_POINT);
 						tree_set_circ(TO_CIRCUIT(circ));
 						memcpy(circ->rend_token, pk_digest, DIGEST_LEN);
 						log_info(LD_REND,get_lang_str(LANG_LOG_RENDMID_INTRO_POINT_ESTABLISHED),circ->p_circ_id,safe_str(serviceid));
@@ -157,7 +157,7 @@ int rend_mid_establish_rendezvous(or_circuit_t *circ, const uint8_t *request,siz
 		reason = END_CIRC_REASON_INTERNAL;
 	}
 	else
-	{	circ->_base.purpose = CIRCUIT_PURPOSE_REND_POINT_WAITING;
+	{	circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_REND_POINT_WAITING);
 		tree_set_circ(TO_CIRCUIT(circ));
 		memcpy(circ->rend_token, request, REND_COOKIE_LEN);
 		base16_encode(hexid,9,(char*)request,4);
@@ -198,9 +198,9 @@ int rend_mid_rendezvous(or_circuit_t *circ, const uint8_t *request,size_t reques
 		}
 		else	/* Join the circuits. */
 		{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDMID_COMPLETING_REND),circ->p_circ_id,rend_circ->p_circ_id,hexid);
-			circ->_base.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+			circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_REND_ESTABLISHED);
 			tree_set_circ(TO_CIRCUIT(circ));
-			rend_circ->_base.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+			circuit_change_purpose(TO_CIRCUIT(rend_circ), CIRCUIT_PURPOSE_REND_ESTABLISHED);
 			tree_set_circ(TO_CIRCUIT(rend_circ));
 			memset(circ->rend_token, 0, REND_COOKIE_LEN);
 			rend_circ->rend_splice = circ;
@@ -0,0 +1,300 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file rendpin.c
+ * \brief Keep the descriptors of pinned hidden services fresh.
+ *
+ * The hidden services listed in PinnedHiddenServices never wait for their
+ * descriptor on first access.  rend_pin_refresh() runs once a minute and
+ * fetches the descriptor of each of them in the background when we don't
+ * have one, when ours is older than REND_PIN_REFRESH_INTERVAL, or when a
+ * new consensus made other HSDirs responsible for it.  The descriptors are
+ * kept in DATADIR_PINNED_HS_DESCS, which goes into the encrypted .dat file
+ * like our other caches when the configuration is encrypted, and they are
+ * put back into the descriptor cache when we start.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "file_io.h"
+#include "rendclient.h"
+#include "rendcommon.h"
+#include "rendpin.h"
+#include "routerlist.h"
+
+/** A hidden service whose descriptor we keep fresh. */
+typedef struct rend_pin_t {
+  /** Onion address of the service, without the .onion part. */
+  char onion_address[REND_SERVICE_ID_LEN_BASE32+1];
+  /** Digest of the HSDirs that were responsible for the descriptor when we
+   * last asked for it. */
+  char hsdirs[DIGEST_LEN];
+  /** When did we last ask for the descriptor? */
+  time_t last_fetch;
+  /** The receive time of the descriptor that we wrote to disk. */
+  time_t saved;
+} rend_pin_t;
+
+/** Refresh a pinned descriptor that we received this long ago. Services
+ * upload theirs every RendPostPeriod, an hour by default. */
+#define REND_PIN_REFRESH_INTERVAL (60*60)
+/** Don't ask for the descriptor of a pinned service more often than this. */
+#define REND_PIN_RETRY_INTERVAL (5*60)
+
+/** List of rend_pin_t for the services in PinnedHiddenServices. */
+static smartlist_t *pinned_services = NULL;
+/** Did we put the descriptors from disk back into the cache yet? */
+static int pinned_descs_loaded = 0;
+
+/** Return a newly allocated rend_data_t to fetch the descriptor of
+ * <b>pin</b> with, using our client authorization for it if we have one. */
+static rend_data_t *
+rend_pin_query(const rend_pin_t *pin)
+{
+  rend_data_t *rend_query = tor_malloc_zero(sizeof(rend_data_t));
+  rend_service_authorization_t *client_auth;
+  strlcpy(rend_query->onion_address, pin->onion_address,
+          sizeof(rend_query->onion_address));
+  client_auth = rend_client_lookup_service_authorization(pin->onion_address);
+  if (client_auth) {
+    memcpy(rend_query->descriptor_cookie, client_auth->descriptor_cookie,
+           REND_DESC_COOKIE_LEN);
+    rend_query->auth_type = client_auth->auth_type;
+  }
+  return rend_query;
+}
+
+/** Write into <b>digest_out</b> a digest of the HSDirs that are responsible
+ * for the descriptor IDs of <b>rend_query</b> at <b>now</b>. */
+static void
+rend_pin_get_hsdirs(const rend_data_t *rend_query, time_t now,
+                    char *digest_out)
+{
+  crypto_digest_env_t *d = crypto_new_digest_env();
+  char desc_id[DIGEST_LEN];
+  smartlist_t *dirs = smartlist_create();
+  int replica;
+  for (replica = 0; replica < REND_NUMBER_OF_NON_CONSECUTIVE_REPLICAS;
+       replica++) {
+    if (rend_compute_v2_desc_id(desc_id, rend_query->onion_address,
+                                rend_query->auth_type == REND_STEALTH_AUTH ?
+                                  rend_query->descriptor_cookie : NULL,
+                                now, (uint8_t)replica) < 0)
+      continue;
+    hid_serv_get_responsible_directories(dirs, desc_id);
+    SMARTLIST_FOREACH(dirs, routerstatus_t *, rs,
+      crypto_digest_add_bytes(d, rs->identity_digest, DIGEST_LEN));
+    smartlist_clear(dirs);
+  }
+  smartlist_free(dirs);
+  crypto_digest_get_digest(d, digest_out, DIGEST_LEN);
+  crypto_free_digest_env(d);
+}
+
+/** Return the pinned service with address <b>onion_address</b> in
+ * <b>pins</b>, or NULL if there is none. */
+static rend_pin_t *
+rend_pin_find(smartlist_t *pins, const char *onion_address)
+{
+  if (pins) {
+    SMARTLIST_FOREACH(pins, rend_pin_t *, pin,
+      if (!strcmp(pin->onion_address, onion_address))
+        return pin;);
+  }
+  return NULL;
+}
+
+/** Put the pinned descriptors that we saved last time back into the
+ * descriptor cache. */
+static void
+rend_pin_load(void)
+{
+  char *fname = get_datadir_fname(DATADIR_PINNED_HS_DESCS);
+  char *contents = read_file_to_str(fname, RFTS_IGNORE_MISSING|RFTS_BIN,
+                                    NULL);
+  const char *s, *eol;
+  int n_loaded = 0;
+  tor_free(fname);
+  if (!contents)
+    return;
+  s = contents;
+  while (*s) {
+    char onion_address[REND_SERVICE_ID_LEN_BASE32+1];
+    long received;
+    unsigned long len;
+    rend_pin_t *pin;
+    eol = strchr(s, '\n');
+    if (!eol || sscanf(s, "pinned-service %16s %ld %lu", onion_address,
+                       &received, &len) != 3 ||
+        len > strlen(eol+1)) {
+      log_warn(LD_REND,get_lang_str(LANG_LOG_RENDPIN_CACHE_CORRUPT));
+      break;
+    }
+    s = eol+1;
+    pin = rend_pin_find(pinned_services, onion_address);
+    if (pin) {
+      char *desc = tor_strndup(s, len);
+      rend_data_t *rend_query = rend_pin_query(pin);
+      rend_cache_entry_t *e = NULL;
+      if (rend_cache_store_v2_desc_as_client(desc, rend_query) == 1 &&
+          rend_cache_lookup_entry(onion_address, 2, &e) >= 0 && e) {
+        /* so that we can tell when it needs a refresh */
+        e->received = (time_t)received;
+        pin->saved = e->received;
+        n_loaded++;
+      }
+      rend_data_free(rend_query);
+      tor_free(desc);
+    }
+    s += len;
+    if (*s == '\n')
+      s++;
+  }
+  tor_free(contents);
+  if (n_loaded)
+    log_info(LD_REND,get_lang_str(LANG_LOG_RENDPIN_LOADED),n_loaded);
+}
+
+/** Write the cached descriptors of our pinned services to disk. */
+static void
+rend_pin_save(void)
+{
+  char *fname = get_datadir_fname(DATADIR_PINNED_HS_DESCS);
+  smartlist_t *chunks = smartlist_create();
+  char *str;
+  SMARTLIST_FOREACH_BEGIN(pinned_services, rend_pin_t *, pin) {
+    rend_cache_entry_t *e = NULL;
+    char *header;
+    if (rend_cache_lookup_entry(pin->onion_address, 2, &e) < 0 || !e)
+      continue;
+    tor_asprintf((unsigned char **)&header, "pinned-service %s %ld %lu\n",
+                 pin->onion_address, (long)e->received,
+                 (unsigned long)e->len);
+    smartlist_add(chunks, header);
+    smartlist_add(chunks, tor_strndup(e->desc, e->len));
+    smartlist_add(chunks, tor_strdup("\n"));
+    pin->saved = e->received;
+  } SMARTLIST_FOREACH_END(pin);
+  str = smartlist_join_strings(chunks, "", 0, NULL);
+  if (write_str_to_file(fname, str, 1) < 0)
+    log_warn(LD_REND,get_lang_str(LANG_LOG_RENDPIN_SAVE_FAILED),fname);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(str);
+  tor_free(fname);
+}
+
+/** Parse PinnedHiddenServices from <b>options</b>. Return -1 if an entry
+ * is not a hidden service address. Unless <b>validate_only</b> is set,
+ * start keeping the descriptors of the listed services fresh; the
+ * first time, also put the ones we saved back into the cache. */
+int
+rend_pin_config_services(or_options_t *options, int validate_only)
+{
+  smartlist_t *pins = smartlist_create();
+  int r = 0;
+  if (options->PinnedHiddenServices) {
+    SMARTLIST_FOREACH_BEGIN(options->PinnedHiddenServices, const char *, s) {
+      char onion_address[REND_SERVICE_ID_LEN_BASE32+1];
+      size_t len = strlen(s);
+      rend_pin_t *pin;
+      if (len > 6 && !strcasecmpend(s, ".onion"))
+        len -= 6;
+      if (len != REND_SERVICE_ID_LEN_BASE32) {
+        r = -1;
+      } else {
+        strlcpy(onion_address, s, sizeof(onion_address));
+        tor_strlower(onion_address);
+        if (!rend_valid_service_id(onion_address))
+          r = -1;
+      }
+      if (r < 0) {
+        log_warn(LD_CONFIG,get_lang_str(LANG_LOG_RENDPIN_BAD_ADDRESS),s);
+        break;
+      }
+      if (rend_pin_find(pins, onion_address))
+        continue;
+      pin = rend_pin_find(pinned_services, onion_address);
+      if (pin) {
+        smartlist_remove(pinned_services, pin);
+      } else {
+        pin = tor_malloc_zero(sizeof(rend_pin_t));
+        strlcpy(pin->onion_address, onion_address,
+                sizeof(pin->onion_address));
+      }
+      smartlist_add(pins, pin);
+    } SMARTLIST_FOREACH_END(s);
+  }
+  if (validate_only || r < 0) {
+    SMARTLIST_FOREACH(pins, rend_pin_t *, pin, tor_free(pin));
+    smartlist_free(pins);
+    return r;
+  }
+  if (pinned_services) {
+    SMARTLIST_FOREACH(pinned_services, rend_pin_t *, pin, tor_free(pin));
+    smartlist_free(pinned_services);
+  }
+  pinned_services = pins;
+  if (!pinned_descs_loaded) {
+    pinned_descs_loaded = 1;
+    rend_pin_load();
+  }
+  return 0;
+}
+
+/** Fetch in the background the descriptors of those pinned services that
+ * need it, and write the descriptors to disk when they changed. */
+void
+rend_pin_refresh(time_t now)
+{
+  int dirty = 0;
+  if (!pinned_services || !smartlist_len(pinned_services))
+    return;
+  if (!get_options()->FetchHidServDescriptors ||
+      !router_have_minimum_dir_info())
+    return;
+  SMARTLIST_FOREACH_BEGIN(pinned_services, rend_pin_t *, pin) {
+    rend_data_t *rend_query = rend_pin_query(pin);
+    rend_cache_entry_t *e = NULL;
+    char hsdirs[DIGEST_LEN];
+    int lang = 0;
+    rend_pin_get_hsdirs(rend_query, now, hsdirs);
+    if (rend_cache_lookup_entry(pin->onion_address, 2, &e) < 1 || !e)
+      lang = LANG_LOG_RENDPIN_FETCHING_MISSING;
+    else if (e->received + REND_PIN_REFRESH_INTERVAL <= now)
+      lang = LANG_LOG_RENDPIN_FETCHING_OLD;
+    else if (tor_memneq(hsdirs, pin->hsdirs, DIGEST_LEN))
+      lang = LANG_LOG_RENDPIN_FETCHING_HSDIRS_CHANGED;
+    if (e && e->received != pin->saved)
+      dirty = 1;
+    if (lang && pin->last_fetch + REND_PIN_RETRY_INTERVAL <= now) {
+      log_info(LD_REND,get_lang_str(lang),
+               safe_str_client(pin->onion_address));
+      memcpy(pin->hsdirs, hsdirs, DIGEST_LEN);
+      pin->last_fetch = now;
+      rend_client_refresh_v2_renddesc(rend_query);
+    }
+    rend_data_free(rend_query);
+  } SMARTLIST_FOREACH_END(pin);
+  if (dirty)
+    rend_pin_save();
+}
+
+/** Save the pinned descriptors and forget the pinned services. */
+void
+rend_pin_free_all(void)
+{
+  if (!pinned_services)
+    return;
+  if (smartlist_len(pinned_services))
+    rend_pin_save();
+  SMARTLIST_FOREACH(pinned_services, rend_pin_t *, pin, tor_free(pin));
+  smartlist_free(pinned_services);
+  pinned_services = NULL;
+  pinned_descs_loaded = 0;
+}
+
@@ -0,0 +1,20 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file rendpin.h
+ * \brief Header file for rendpin.c.
+ **/
+
+#ifndef _TOR_RENDPIN_H
+#define _TOR_RENDPIN_H
+
+int rend_pin_config_services(or_options_t *options, int validate_only);
+void rend_pin_refresh(time_t now);
+void rend_pin_free_all(void);
+
+#endif
+
@@ -12,6 +12,7 @@
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "networkstatus.h"
 #include "rendclient.h"
@@ -27,7 +28,10 @@
 
 static origin_circuit_t *find_intro_circuit(rend_intro_point_t *intro,
                                             const char *pk_digest);
-static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartlist_t *descs, const char *service_id, int seconds_valid) __attribute__ ((format(printf, 3, 0)));
+typedef struct rend_intro_job_t rend_intro_job_t;
+static void rend_intro_job_free(rend_intro_job_t *job);
+static smartlist_t *pending_intros;
+static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartlist_t *descs, const char *service_id, int seconds_valid, digestmap_t *uploads) __attribute__ ((format(printf, 3, 0)));
 int plugin_notify_service(rend_service_t *service,int added,connection_t *conn,int port);
 void rend_init_plugin(plugin_info_t *plugin_tmp);
 rend_service_t* find_service(char *onionaddress);
@@ -184,6 +188,12 @@ rend_service_free_all(void)
                     rend_service_free(ptr));
   smartlist_free(rend_service_list);
   rend_service_list = NULL;
+  if (pending_intros) {
+    SMARTLIST_FOREACH(pending_intros, rend_intro_job_t *, job,
+                      rend_intro_job_free(job));
+    smartlist_free(pending_intros);
+    pending_intros = NULL;
+  }
 }
 
 
@@ -842,96 +852,69 @@ clean_accepted_intros(rend_service_t *service, time_t now)
   } DIGESTMAP_FOREACH_END;
 }
 
-/******
- * Handle cells
- ******/
-
-/** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
- * rendezvous point.
- */
-int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,size_t request_len)
-{	char *ptr, *r_cookie;
-	char *esc_l;
-	extend_info_t *extend_info = NULL;
-	char buf[RELAY_PAYLOAD_SIZE];
-	char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
-	rend_service_t *service;
-	int r, i, v3_shift = 0;
-	size_t len, keylen;
-	crypto_dh_env_t *dh = NULL;
-	origin_circuit_t *launched = NULL;
-	crypt_path_t *cpath = NULL;
-	char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
-	char hexcookie[9];
-	int circ_needs_uptime;
-	int reason = END_CIRC_REASON_TORPROTOCOL;
+/** Longest an INTRODUCE2 cell may wait for a cpuworker; the client will
+ * have tried another introduction point by then. */
+#define MAX_INTRO_QUEUE_WAIT 30
+/** Most INTRODUCE2 cells that we keep waiting for a cpuworker. */
+#define MAX_PENDING_INTROS 64
+
+/** An INTRODUCE2 cell for one of our services, on its way through a
+ * cpuworker. */
+struct rend_intro_job_t
+{	/* Set by the main thread. */
+	/** Digest of the public key of the service that the cell is for. */
+	char pk_digest[DIGEST_LEN];
+	/** Our own copy of the key of the introduction point. */
 	crypto_pk_env_t *intro_key;
-	char intro_key_digest[DIGEST_LEN];
-	int auth_type;
-	size_t auth_len = 0;
+	/** The part of the cell that is encrypted to <b>intro_key</b>. */
+	char *request;
+	size_t request_len;
+	/** When did we receive the cell? */
+	time_t received;
+	/** True iff we reject v3 cells whose timestamp is too far from
+	 * <b>received</b>. */
+	int check_timestamp;
+	/* Set by the cpuworker. */
+	/** True iff the cell was well-formed and the handshake succeeded. */
+	int ok;
+	/** The rendezvous point of a v2 or v3 cell, or NULL. */
+	extend_info_t *extend_info;
+	/** The nickname of the rendezvous point of a v0 or v1 cell. */
+	char rp_nickname[MAX_HEX_NICKNAME_LEN+1];
+	char r_cookie[REND_COOKIE_LEN];
+	/** Digest of the client's half of the handshake, to detect replays. */
+	char dh_hash[DIGEST_LEN];
+	size_t auth_len;
 	char auth_data[REND_DESC_COOKIE_LEN];
-	crypto_digest_env_t *digest = NULL;
-	time_t now = get_time(NULL);
-	char diffie_hellman_hash[DIGEST_LEN];
-	time_t *access_time;
-	or_options_t *options = get_options();
-	if(circuit->_base.purpose != CIRCUIT_PURPOSE_S_INTRO)
-	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_FOR_NON_INTRO_CIRC),circuit->_base.n_circ_id);
-		return -1;
-	}
-	tor_assert(circuit->rend_data);
+	crypto_dh_env_t *dh;
+	char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN];	/* Holds KH, Df, Db, Kf, Kb */
+};
+
+/** INTRODUCE2 cells waiting for a cpuworker, oldest first. */
+static smartlist_t *pending_intros = NULL;
+
+/** Release all storage held by <b>job</b>. */
+static void rend_intro_job_free(rend_intro_job_t *job)
+{	if(job->intro_key)	crypto_free_pk_env(job->intro_key);
+	tor_free(job->request);
+	if(job->extend_info)	extend_info_free(job->extend_info);
+	if(job->dh)	crypto_dh_free(job->dh);
+	memset(job->keys, 0, sizeof(job->keys));
+	tor_free(job);
+}
 
-	base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
-	esc_l = esc_for_log(serviceid);
-	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_RECEIVED),esc_l,circuit->_base.n_circ_id);
-	tor_free(esc_l);
-	/* min key length plus digest length plus nickname length */
-	if(request_len < DIGEST_LEN+REND_COOKIE_LEN+(MAX_NICKNAME_LEN+1)+DH_KEY_LEN+42)
-	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_TRUNCATED),circuit->_base.n_circ_id);
-		return -1;
-	}
-	/* look up service depending on circuit. */
-	service = rend_service_get_by_pk_digest(circuit->rend_data->rend_pk_digest);
-	if(!service)
-	{	esc_l = esc_for_log(serviceid);
-		log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_FOR_UNRECOGNIZED_SERVICE),esc_l);
-		tor_free(esc_l);
-		return -1;
-	}
-	/* if descriptor version is 2, use intro key instead of service key. */
-	intro_key = circuit->intro_key;
-	/* first DIGEST_LEN bytes of request is intro or service pk digest */
-	crypto_pk_get_digest(intro_key, intro_key_digest);
-	if(tor_memneq(intro_key_digest, request, DIGEST_LEN))
-	{	base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,(char*)request, REND_SERVICE_ID_LEN);
-		esc_l = esc_for_log(serviceid);
-		log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_FOR_WRONG_SERVICE),esc_l);
-		tor_free(esc_l);
-		return -1;
-	}
-	keylen = crypto_pk_keysize(intro_key);
-	if(request_len < keylen+DIGEST_LEN)
-	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_TRUNCATED_2));
-		return -1;
-	}
-	if(!service->accepted_intros)	service->accepted_intros = digestmap_new();
-	char pkpart_digest[DIGEST_LEN];
-	/* Check for replay of PK-encrypted portion. It is slightly naughty to use the same digestmap to check for this and for g^x replays, but collisions are tremendously unlikely. */
-	crypto_digest(pkpart_digest, (char*)request+DIGEST_LEN, keylen);
-	access_time = digestmap_get(service->accepted_intros, pkpart_digest);
-	if(access_time != NULL)
-	{	log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_REPLAY_DETECTED_2),(int)(now-*access_time));
-		return -1;
-	}
-	access_time = tor_malloc(sizeof(time_t));
-	*access_time = now;
-	digestmap_set(service->accepted_intros, pkpart_digest, access_time);
-	/* Next N bytes is encrypted with service key */
-	note_crypto_pk_op(REND_SERVER);
-	r = crypto_pk_private_hybrid_decrypt(intro_key,buf,sizeof(buf),(char*)(request+DIGEST_LEN),request_len-DIGEST_LEN,PK_PKCS1_OAEP_PADDING,1);
+/** Decrypt and parse the INTRODUCE2 cell of <b>arg</b>, a rend_intro_job_t, and do our half of the handshake. Runs on a cpuworker, so only look at the job. */
+static void rend_service_intro_job_work(void *arg)
+{	rend_intro_job_t *job = arg;
+	char buf[RELAY_PAYLOAD_SIZE];
+	char *ptr;
+	crypto_digest_env_t *digest;
+	int r, v3_shift = 0, auth_type;
+	size_t len;
+	r = crypto_pk_private_hybrid_decrypt(job->intro_key,buf,sizeof(buf),job->request,job->request_len,PK_PKCS1_OAEP_PADDING,1);
 	if(r<0)
 	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_ERROR_DECRYPTING_INTRODUCE2));
-		return -1;
+		return;
 	}
 	len = r;
 	if(*buf == 3)	/* Version 3 INTRODUCE2 cell. */
@@ -941,12 +924,13 @@ int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,siz
 		switch(auth_type)
 		{	case REND_BASIC_AUTH:	/* fall through */
 			case REND_STEALTH_AUTH:
-				auth_len = ntohs(get_uint16(buf+2));
-				if(auth_len != REND_DESC_COOKIE_LEN)
-				{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_WRONG_AUTH_DATA_SIZE),(int)auth_len,REND_DESC_COOKIE_LEN);
-					return -1;
+				job->auth_len = ntohs(get_uint16(buf+2));
+				if(job->auth_len != REND_DESC_COOKIE_LEN)
+				{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_WRONG_AUTH_DATA_SIZE),(int)job->auth_len,REND_DESC_COOKIE_LEN);
+					memset(buf, 0, sizeof(buf));
+					return;
 				}
-				memcpy(auth_data, buf+4, sizeof(auth_data));
+				memcpy(job->auth_data, buf+4, sizeof(job->auth_data));
 				v3_shift += 2+REND_DESC_COOKIE_LEN;
 				break;
 			case REND_NO_AUTH:
@@ -957,14 +941,15 @@ int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,siz
 		/* Check timestamp. */
 		ts = ntohl(get_uint32(buf+1+v3_shift));
 		v3_shift += 4;
-		if(((now - ts) < -1 * REND_REPLAY_TIME_INTERVAL / 2 || (now - ts) > REND_REPLAY_TIME_INTERVAL / 2)&&((get_options()->DirFlags&DIR_FLAG_FAKE_LOCAL_TIME)==0))
-		{	log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_TIME),(now - ts) < 0 ? get_lang_str(LANG_LOG_RENDSERVICE__OLD) : get_lang_str(LANG_LOG_RENDSERVICE__NEW));
-			return -1;
+		if(((job->received - ts) < -1 * REND_REPLAY_TIME_INTERVAL / 2 || (job->received - ts) > REND_REPLAY_TIME_INTERVAL / 2)&&job->check_timestamp)
+		{	log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_TIME),(job->received - ts) < 0 ? get_lang_str(LANG_LOG_RENDSERVICE__OLD) : get_lang_str(LANG_LOG_RENDSERVICE__NEW));
+			memset(buf, 0, sizeof(buf));
+			return;
 		}
 	}
 	if(*buf == 2 || *buf == 3)	/* Version 2 INTRODUCE2 cell. */
 	{	int klen;
-		extend_info = tor_malloc_zero(sizeof(extend_info_t));
+		extend_info_t *extend_info = job->extend_info = extend_info_new();
 		tor_addr_from_ipv4n(&extend_info->addr, get_uint32(buf+v3_shift+1));
 		extend_info->port = ntohs(get_uint16(buf+v3_shift+5));
 		memcpy(extend_info->identity_digest, buf+v3_shift+7,DIGEST_LEN);
@@ -973,16 +958,14 @@ int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,siz
 		klen = ntohs(get_uint16(buf+v3_shift+7+DIGEST_LEN));
 		if((int)len != v3_shift+7+DIGEST_LEN+2+klen+20+128)
 		{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_BAD_LENGTH),(int)len, *buf);
-			reason = END_CIRC_REASON_TORPROTOCOL;
-			extend_info_free(extend_info);
-			return -1;
+			memset(buf, 0, sizeof(buf));
+			return;
 		}
 		extend_info->onion_key = crypto_pk_asn1_decode(buf+v3_shift+7+DIGEST_LEN+2, klen);
 		if(!extend_info->onion_key)
 		{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_ERROR_DECODING_KEY),*buf);
-			reason = END_CIRC_REASON_TORPROTOCOL;
-			extend_info_free(extend_info);
-			return -1;
+			memset(buf, 0, sizeof(buf));
+			return;
 		}
 		ptr = buf+v3_shift+7+DIGEST_LEN+2+klen;
 		len -= v3_shift+7+DIGEST_LEN+2+klen;
@@ -990,7 +973,6 @@ int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,siz
 	else
 	{	char *rp_nickname;
 		size_t nickname_field_len;
-		routerinfo_t *router;
 		int version;
 		if(*buf == 1)
 		{	rp_nickname = buf+1;
@@ -1005,129 +987,301 @@ int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,siz
 		ptr=memchr(rp_nickname,0,nickname_field_len);
 		if(!ptr || ptr == rp_nickname)
 		{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_ERROR));
-			return -1;
+			memset(buf, 0, sizeof(buf));
+			return;
 		}
 		if((version == 0 && !is_legal_nickname(rp_nickname)) || (version == 1 && !is_legal_nickname_or_hexdigest(rp_nickname)))
 		{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_ERROR_NICKNAME));
-			return -1;
+			memset(buf, 0, sizeof(buf));
+			return;
 		}
-		/* Okay, now we know that a nickname is at the start of the buffer. */
+		/* Okay, now we know that a nickname is at the start of the buffer. The main thread looks it up. */
+		strlcpy(job->rp_nickname, rp_nickname, sizeof(job->rp_nickname));
 		ptr = rp_nickname+nickname_field_len;
 		len -= nickname_field_len;
 		len -= rp_nickname - buf; /* also remove header space used by version, if any */
-		router = router_get_by_nickname(rp_nickname, 0);
+	}
+	if(len != REND_COOKIE_LEN+DH_KEY_LEN)
+	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_BAD_LENGTH_2),(int)len);
+		memset(buf, 0, sizeof(buf));
+		return;
+	}
+	memcpy(job->r_cookie, ptr, REND_COOKIE_LEN);
+	/* Determine hash of Diffie-Hellman, part 1 to detect replays. */
+	digest = crypto_new_digest_env();
+	crypto_digest_add_bytes(digest, ptr+REND_COOKIE_LEN, DH_KEY_LEN);
+	crypto_digest_get_digest(digest, job->dh_hash, DIGEST_LEN);
+	crypto_free_digest_env(digest);
+	/* Try DH handshake... */
+	job->dh = crypto_dh_new(DH_TYPE_REND);
+	if(!job->dh || crypto_dh_generate_public(job->dh)<0)
+		log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_2));
+	else if(crypto_dh_compute_secret(LOG_PROTOCOL_WARN,job->dh,ptr+REND_COOKIE_LEN,DH_KEY_LEN,job->keys,DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0)
+		log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_3));
+	else	job->ok = 1;
+	memset(buf, 0, sizeof(buf));
+}
+
+/** Launch a circuit to the rendezvous point of <b>job</b>, an INTRODUCE2 cell for <b>service</b> that a cpuworker has answered, unless the cell is a replay or its client isn't authorized. */
+static void rend_service_intro_job_launch(rend_service_t *service, rend_intro_job_t *job)
+{	char *esc_l;
+	extend_info_t *extend_info;
+	origin_circuit_t *launched = NULL;
+	crypt_path_t *cpath = NULL;
+	char hexcookie[9];
+	int circ_needs_uptime, i;
+	time_t now = get_time(NULL);
+	time_t *access_time;
+	or_options_t *options = get_options();
+	if(job->extend_info)
+	{	extend_info = job->extend_info;
+		job->extend_info = NULL;
+	}
+	else
+	{	routerinfo_t *router = router_get_by_nickname(job->rp_nickname, 0);
 		if(!router)
-		{	esc_l = escaped_safe_str(rp_nickname);
+		{	esc_l = escaped_safe_str(job->rp_nickname);
 			log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_ERROR_ROUTER),esc_l);
 			tor_free(esc_l);
-			reason = END_CIRC_REASON_TORPROTOCOL;	/* XXXX Add a no-such-router reason? */
-			return -1;
+			return;
 		}
 		extend_info = extend_info_from_router(router);
 	}
-	if(len != REND_COOKIE_LEN+DH_KEY_LEN)
-	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_BAD_LENGTH_2),(int)len);
-		reason = END_CIRC_REASON_TORPROTOCOL;
-	}
 	if(options->ExcludeNodes && routerset_contains_extendinfo(options->ExcludeNodes, extend_info))	/* Check if we'd refuse to talk to this router */
 	{	log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_EXCLUDED_NODE));
-		reason = END_CIRC_REASON_INTERNAL; /* XXX might leak why we refused */
+		extend_info_free(extend_info);
+		return;
 	}
-	else
-	{	r_cookie = ptr;
-		base16_encode(hexcookie,9,r_cookie,4);
-		/* Determine hash of Diffie-Hellman, part 1 to detect replays. */
-		digest = crypto_new_digest_env();
-		crypto_digest_add_bytes(digest, ptr+REND_COOKIE_LEN, DH_KEY_LEN);
-		crypto_digest_get_digest(digest, diffie_hellman_hash, DIGEST_LEN);
-		crypto_free_digest_env(digest);
-		/* Check whether there is a past request with the same Diffie-Hellman, part 1. */
-		access_time = digestmap_get(service->accepted_intros, diffie_hellman_hash);
-		if(access_time != NULL)
-			log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_REPLAY_DETECTED),(int) (now - *access_time));
-		else	/* Add request to access history, including time and hash of Diffie-Hellman, part 1, and possibly remove requests from the history that are older than one hour. */
-		{	access_time = tor_malloc(sizeof(time_t));
-			*access_time = now;
-			digestmap_set(service->accepted_intros, diffie_hellman_hash, access_time);
-			if(service->last_cleaned_accepted_intros + REND_REPLAY_TIME_INTERVAL < now)
-				clean_accepted_intros(service, now);
-			/* If the service performs client authorization, check included auth data. */
-			if(service->clients)
-			{	if(auth_len > 0)
-				{	if(rend_check_authorization(service, auth_data))
-						log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_AUTH_VALID));
-					else
-					{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_AUTH_INVALID));
-						reason = END_CIRC_REASON_CONNECTFAILED;
-						if(extend_info)	extend_info_free(extend_info);
-						return -1;
-					}
-				}
-				else
-				{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_WITHOUT_AUTH));
-					reason = END_CIRC_REASON_CONNECTFAILED;
-					if(extend_info)	extend_info_free(extend_info);
-					return -1;
-				}
-			}
-			/* Try DH handshake... */
-			dh = crypto_dh_new(DH_TYPE_REND);
-			if(!dh || crypto_dh_generate_public(dh)<0)
-			{	log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_2));
-				reason = END_CIRC_REASON_INTERNAL;
-			}
-			else if(crypto_dh_compute_secret(LOG_PROTOCOL_WARN,dh,ptr+REND_COOKIE_LEN,DH_KEY_LEN,keys,DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0)
-			{	log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_3));
-				reason = END_CIRC_REASON_INTERNAL;
-			}
-			else
-			{	circ_needs_uptime = rend_service_requires_uptime(service);
-				/* help predict this next time */
-				rep_hist_note_used_internal(now, circ_needs_uptime, 1);
-				/* Launch a circuit to alice's chosen rendezvous point. */
-				for(i=0;i<get_options()->MaxRendFailures;i++)
-				{	int flags = CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_INTERNAL;
-					if(circ_needs_uptime) flags |= CIRCLAUNCH_NEED_UPTIME;
-					launched = circuit_launch_by_extend_info(CIRCUIT_PURPOSE_S_CONNECT_REND, extend_info, flags,1);
-					if(launched)	break;
-				}
-				if(!launched)	/* give up */
-				{	esc_l = escaped_safe_str(extend_info->nickname);
-					log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_NOT_LAUNCHING_FIRST_HOP),esc_l,serviceid);
-					tor_free(esc_l);
-					reason = END_CIRC_REASON_CONNECTFAILED;
-				}
-				else
-				{	esc_l = escaped_safe_str(extend_info->nickname);
-					log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_ACCEPTED_INTRO),esc_l,hexcookie,serviceid);
-					tor_free(esc_l);
-					tor_assert(launched->build_state);
-					/* Fill in the circuit's state. */
-					launched->rend_data = tor_malloc_zero(sizeof(rend_data_t));
-					memcpy(launched->rend_data->rend_pk_digest,circuit->rend_data->rend_pk_digest,DIGEST_LEN);
-					memcpy(launched->rend_data->rend_cookie, r_cookie, REND_COOKIE_LEN);
-					strlcpy(launched->rend_data->onion_address, service->service_id,sizeof(launched->rend_data->onion_address));
-					launched->build_state->pending_final_cpath = cpath = tor_malloc_zero(sizeof(crypt_path_t));
-					cpath->magic = CRYPT_PATH_MAGIC;
-					cpath->hItem=NULL;
-					launched->build_state->expiry_time = now + get_options()->MaxRendTimeout;
-					cpath->dh_handshake_state = dh;
-					dh = NULL;
-					if(circuit_init_cpath_crypto(cpath,keys+DIGEST_LEN,1) >= 0)
-					{	memcpy(cpath->handshake_digest, keys, DIGEST_LEN);
-						if(extend_info) extend_info_free(extend_info);
-						memset(keys, 0, sizeof(keys));
-						return 0;
-					}
-					circuit_mark_for_close(TO_CIRCUIT(launched), reason);
-				}
+	base16_encode(hexcookie,9,job->r_cookie,4);
+	if(!service->accepted_intros)	service->accepted_intros = digestmap_new();
+	/* Check whether there is a past request with the same Diffie-Hellman, part 1. */
+	access_time = digestmap_get(service->accepted_intros, job->dh_hash);
+	if(access_time != NULL)
+	{	log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_REPLAY_DETECTED),(int) (now - *access_time));
+		extend_info_free(extend_info);
+		return;
+	}
+	/* Add request to access history, including time and hash of Diffie-Hellman, part 1, and possibly remove requests from the history that are older than one hour. */
+	access_time = tor_malloc(sizeof(time_t));
+	*access_time = now;
+	digestmap_set(service->accepted_intros, job->dh_hash, access_time);
+	if(service->last_cleaned_accepted_intros + REND_REPLAY_TIME_INTERVAL < now)
+		clean_accepted_intros(service, now);
+	/* If the service performs client authorization, check included auth data. */
+	if(service->clients)
+	{	if(job->auth_len == 0)
+		{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_WITHOUT_AUTH));
+			extend_info_free(extend_info);
+			return;
+		}
+		if(!rend_check_authorization(service, job->auth_data))
+		{	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_AUTH_INVALID));
+			extend_info_free(extend_info);
+			return;
+		}
+		log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_AUTH_VALID));
+	}
+	circ_needs_uptime = rend_service_requires_uptime(service);
+	/* help predict this next time */
+	rep_hist_note_used_internal(now, circ_needs_uptime, 1);
+	/* Launch a circuit to alice's chosen rendezvous point. */
+	for(i=0;i<options->MaxRendFailures;i++)
+	{	int flags = CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_INTERNAL;
+		if(circ_needs_uptime) flags |= CIRCLAUNCH_NEED_UPTIME;
+		launched = circuit_launch_by_extend_info(CIRCUIT_PURPOSE_S_CONNECT_REND, extend_info, flags,1);
+		if(launched)	break;
+	}
+	if(!launched)	/* give up */
+	{	esc_l = escaped_safe_str(extend_info->nickname);
+		log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_NOT_LAUNCHING_FIRST_HOP),esc_l,service->service_id);
+		tor_free(esc_l);
+		extend_info_free(extend_info);
+		return;
+	}
+	esc_l = escaped_safe_str(extend_info->nickname);
+	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_ACCEPTED_INTRO),esc_l,hexcookie,service->service_id);
+	tor_free(esc_l);
+	extend_info_free(extend_info);
+	tor_assert(launched->build_state);
+	/* Fill in the circuit's state. */
+	launched->rend_data = tor_malloc_zero(sizeof(rend_data_t));
+	memcpy(launched->rend_data->rend_pk_digest,service->pk_digest,DIGEST_LEN);
+	memcpy(launched->rend_data->rend_cookie, job->r_cookie, REND_COOKIE_LEN);
+	strlcpy(launched->rend_data->onion_address, service->service_id,sizeof(launched->rend_data->onion_address));
+	launched->build_state->pending_final_cpath = cpath = crypt_path_new();
+	cpath->hItem=NULL;
+	launched->build_state->expiry_time = now + options->MaxRendTimeout;
+	cpath->dh_handshake_state = job->dh;
+	job->dh = NULL;
+	if(circuit_init_cpath_crypto(cpath,job->keys+DIGEST_LEN,1) >= 0)
+		memcpy(cpath->handshake_digest, job->keys, DIGEST_LEN);
+	else	circuit_mark_for_close(TO_CIRCUIT(launched), END_CIRC_REASON_INTERNAL);
+}
+
+/** Called on the main thread when a cpuworker is done with <b>arg</b>, a rend_intro_job_t: act on the answer, then free the job. */
+static void rend_service_intro_job_done(void *arg)
+{	rend_intro_job_t *job = arg;
+	rend_service_t *service = rend_service_get_by_pk_digest(job->pk_digest);
+	if(service && service->n_intros_busy > 0)	service->n_intros_busy--;
+	if(service && job->ok)	rend_service_intro_job_launch(service, job);
+	rend_intro_job_free(job);
+}
+
+/** The queue of INTRODUCE2 cells is full: drop the oldest cell of the service that has the most cells waiting, so that a flood against one service crowds out that service first. */
+static void rend_service_drop_pending_intro(void)
+{	int i, j, n, best_n = 0, best_idx = 0;
+	rend_intro_job_t *job;
+	char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+	for(i = 0; i < smartlist_len(pending_intros); i++)
+	{	job = smartlist_get(pending_intros, i);
+		n = 0;
+		for(j = i; j < smartlist_len(pending_intros); j++)
+		{	rend_intro_job_t *other = smartlist_get(pending_intros, j);
+			if(tor_memeq(other->pk_digest, job->pk_digest, DIGEST_LEN))	n++;
+		}
+		if(n > best_n)
+		{	best_n = n;
+			best_idx = i;
+		}
+	}
+	job = smartlist_get(pending_intros, best_idx);
+	smartlist_del_keeporder(pending_intros, best_idx);
+	base32_encode(serviceid, sizeof(serviceid), job->pk_digest, REND_SERVICE_ID_LEN);
+	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRO_QUEUE_FULL),serviceid);
+	rend_intro_job_free(job);
+}
+
+/** Hand the INTRODUCE2 cells that are waiting to cpuworkers while they have room. The cells of the services that have the fewest cells with the cpuworkers go first, oldest first; cells that waited longer than MAX_INTRO_QUEUE_WAIT are dropped. */
+void rend_service_assign_pending_intros(void)
+{	time_t now = get_time(NULL);
+	int i;
+	rend_intro_job_t *job;
+	rend_service_t *service;
+	char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+	if(!pending_intros)	return;
+	for(i = 0; i < smartlist_len(pending_intros); )
+	{	job = smartlist_get(pending_intros, i);
+		if(!rend_service_get_by_pk_digest(job->pk_digest))	/* the service was removed */
+		{	smartlist_del_keeporder(pending_intros, i);
+			rend_intro_job_free(job);
+		}
+		else if(job->received + MAX_INTRO_QUEUE_WAIT < now)
+		{	base32_encode(serviceid, sizeof(serviceid), job->pk_digest, REND_SERVICE_ID_LEN);
+			log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRO_WAITED_TOO_LONG),serviceid,(int)(now - job->received));
+			smartlist_del_keeporder(pending_intros, i);
+			rend_intro_job_free(job);
+		}
+		else	i++;
+	}
+	while(smartlist_len(pending_intros))
+	{	int best_idx = -1, best_busy = 0;
+		rend_service_t *best_service = NULL;
+		for(i = 0; i < smartlist_len(pending_intros); i++)
+		{	job = smartlist_get(pending_intros, i);
+			service = rend_service_get_by_pk_digest(job->pk_digest);
+			if(best_idx < 0 || service->n_intros_busy < best_busy)
+			{	best_idx = i;
+				best_busy = service->n_intros_busy;
+				best_service = service;
 			}
-			memset(keys, 0, sizeof(keys));
-			if(dh)		crypto_dh_free(dh);
+		}
+		job = smartlist_get(pending_intros, best_idx);
+		smartlist_del_keeporder(pending_intros, best_idx);
+		/* Count the job before handing it out: without cpuworkers, it is done before we get it back. */
+		best_service->n_intros_busy++;
+		if(cpuworker_queue_task(rend_service_intro_job_work, rend_service_intro_job_done, job) < 0)
+		{	best_service->n_intros_busy--;
+			smartlist_insert(pending_intros, best_idx, job);
+			break;
 		}
 	}
-	if(extend_info)	extend_info_free(extend_info);
-	return -1;
+}
+
+/******
+ * Handle cells
+ ******/
+
+/** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
+ * rendezvous point.  The cheap checks, including the one for replays of the
+ * cell, are done right away; the cell is then queued for a cpuworker to
+ * decrypt, and the circuit is launched when the cpuworker is done.
+ */
+int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,size_t request_len)
+{	char *esc_l;
+	rend_service_t *service;
+	size_t keylen;
+	char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+	crypto_pk_env_t *intro_key;
+	char intro_key_digest[DIGEST_LEN];
+	char pkpart_digest[DIGEST_LEN];
+	time_t now = get_time(NULL);
+	time_t *access_time;
+	rend_intro_job_t *job;
+	if(circuit->_base.purpose != CIRCUIT_PURPOSE_S_INTRO)
+	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_FOR_NON_INTRO_CIRC),circuit->_base.n_circ_id);
+		return -1;
+	}
+	tor_assert(circuit->rend_data);
+
+	base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
+	esc_l = esc_for_log(serviceid);
+	log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_RECEIVED),esc_l,circuit->_base.n_circ_id);
+	tor_free(esc_l);
+	/* min key length plus digest length plus nickname length */
+	if(request_len < DIGEST_LEN+REND_COOKIE_LEN+(MAX_NICKNAME_LEN+1)+DH_KEY_LEN+42)
+	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_TRUNCATED),circuit->_base.n_circ_id);
+		return -1;
+	}
+	/* look up service depending on circuit. */
+	service = rend_service_get_by_pk_digest(circuit->rend_data->rend_pk_digest);
+	if(!service)
+	{	esc_l = esc_for_log(serviceid);
+		log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_FOR_UNRECOGNIZED_SERVICE),esc_l);
+		tor_free(esc_l);
+		return -1;
+	}
+	/* if descriptor version is 2, use intro key instead of service key. */
+	intro_key = circuit->intro_key;
+	/* first DIGEST_LEN bytes of request is intro or service pk digest */
+	crypto_pk_get_digest(intro_key, intro_key_digest);
+	if(tor_memneq(intro_key_digest, request, DIGEST_LEN))
+	{	base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,(char*)request, REND_SERVICE_ID_LEN);
+		esc_l = esc_for_log(serviceid);
+		log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_FOR_WRONG_SERVICE),esc_l);
+		tor_free(esc_l);
+		return -1;
+	}
+	keylen = crypto_pk_keysize(intro_key);
+	if(request_len < keylen+DIGEST_LEN)
+	{	log_warn(LD_PROTOCOL,get_lang_str(LANG_LOG_RENDSERVICE_INTRODUCE2_TRUNCATED_2));
+		return -1;
+	}
+	if(!service->accepted_intros)	service->accepted_intros = digestmap_new();
+	/* Check for replay of PK-encrypted portion. It is slightly naughty to use the same digestmap to check for this and for g^x replays, but collisions are tremendously unlikely. */
+	crypto_digest(pkpart_digest, (char*)request+DIGEST_LEN, keylen);
+	access_time = digestmap_get(service->accepted_intros, pkpart_digest);
+	if(access_time != NULL)
+	{	log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_REPLAY_DETECTED_2),(int)(now-*access_time));
+		return -1;
+	}
+	access_time = tor_malloc(sizeof(time_t));
+	*access_time = now;
+	digestmap_set(service->accepted_intros, pkpart_digest, access_time);
+	/* Next N bytes is encrypted with service key; leave them to a cpuworker. */
+	note_crypto_pk_op(REND_SERVER);
+	job = tor_malloc_zero(sizeof(rend_intro_job_t));
+	memcpy(job->pk_digest, service->pk_digest, DIGEST_LEN);
+	job->intro_key = crypto_pk_copy_full(intro_key);
+	job->request = tor_memdup(request+DIGEST_LEN, request_len-DIGEST_LEN);
+	job->request_len = request_len-DIGEST_LEN;
+	job->received = now;
+	job->check_timestamp = (get_options()->DirFlags&DIR_FLAG_FAKE_LOCAL_TIME)==0;
+	if(!pending_intros)	pending_intros = smartlist_create();
+	smartlist_add(pending_intros, job);
+	if(smartlist_len(pending_intros) > MAX_PENDING_INTROS)
+		rend_service_drop_pending_intro();
+	rend_service_assign_pending_intros();
+	return 0;
 }
 
 /** Called when we fail building a rendezvous circuit at some point other
@@ -1277,7 +1431,8 @@ void rend_service_intro_has_opened(origin_circuit_t *circuit)
 			else
 			{	tor_assert(circuit->build_state->is_internal);
 				log_info(LD_CIRC|LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_REDEFINING_PURPOSE));
-				TO_CIRCUIT(circuit)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+				circuit_change_purpose(TO_CIRCUIT(circuit), CIRCUIT_PURPOSE_C_GENERAL);
+				circuit_note_cannibalizable(circuit);
 				rend_data_t *rend_data = circuit->rend_data;
 				circuit->rend_data = NULL;
 				rend_data_free(rend_data);
@@ -1341,7 +1496,7 @@ int rend_service_intro_established(origin_circuit_t *circuit,const uint8_t *requ
 			log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_UNKNOWN_SERVICE),circuit->_base.n_circ_id);
 		else
 		{	service->desc_is_dirty = get_time(NULL);
-			circuit->_base.purpose = CIRCUIT_PURPOSE_S_INTRO;
+			circuit_change_purpose(TO_CIRCUIT(circuit), CIRCUIT_PURPOSE_S_INTRO);
 			tree_set_circ(TO_CIRCUIT(circuit));
 			base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32 + 1,circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
 			log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_INTRO_ESTABLISHED_RECEIVED),circuit->_base.n_circ_id,serviceid);
@@ -1402,7 +1557,7 @@ void rend_service_rendezvous_has_opened(origin_circuit_t *circuit)
 				onion_append_to_cpath(&circuit->cpath, hop);
 				circuit->build_state->pending_final_cpath = NULL; /* prevent double-free */
 				/* Change the circuit purpose. */
-				circuit->_base.purpose = CIRCUIT_PURPOSE_S_REND_JOINED;
+				circuit_change_purpose(TO_CIRCUIT(circuit), CIRCUIT_PURPOSE_S_REND_JOINED);
 				tree_set_circ(TO_CIRCUIT(circuit));
 				return;
 			}
@@ -1447,11 +1602,43 @@ find_intro_circuit(rend_intro_point_t *intro, const char *pk_digest)
   return NULL;
 }
 
+/** The descriptors that we post to one hidden service directory in a
+ * single request: HSDirs accept several concatenated descriptors, so
+ * hosting many services doesn't cost a connection per descriptor. */
+typedef struct hs_dir_upload_t {
+  routerstatus_t *hs_dir; /**< The directory to post to. */
+  smartlist_t *desc_strs; /**< The encoded descriptors, not owned by us. */
+  size_t len; /**< Total length of <b>desc_strs</b>. */
+} hs_dir_upload_t;
+
+/** Don't post more than this many bytes of descriptors in one request. */
+#define MAX_HS_DIR_UPLOAD_LEN (MAX_DIR_UL_SIZE/2)
+
+/** Post the descriptors queued in <b>upload</b> and empty the queue. */
+static void
+hs_dir_upload_send(hs_dir_upload_t *upload)
+{
+  char *body;
+  if (!smartlist_len(upload->desc_strs))
+    return;
+  body = smartlist_join_strings(upload->desc_strs, "", 0, NULL);
+  directory_initiate_command_routerstatus(upload->hs_dir,
+                                          DIR_PURPOSE_UPLOAD_RENDDESC_V2,
+                                          ROUTER_PURPOSE_GENERAL,
+                                          1, NULL, body, strlen(body), 0);
+  log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_BATCHED_UPLOAD),smartlist_len(upload->desc_strs),upload->hs_dir->nickname);
+  tor_free(body);
+  smartlist_clear(upload->desc_strs);
+  upload->len = 0;
+}
+
 /** Determine the responsible hidden service directories for the
- * rend_encoded_v2_service_descriptor_t's in <b>descs</b> and upload them;
+ * rend_encoded_v2_service_descriptor_t's in <b>descs</b> and queue them in
+ * <b>uploads</b>, which maps HSDir identities to hs_dir_upload_t;
  * <b>service_id</b> and <b>seconds_valid</b> are only passed for logging
- * purposes. */
-static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartlist_t *descs, const char *service_id, int seconds_valid)
+ * purposes. The descriptors must stay around until <b>uploads</b> is
+ * posted. */
+static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartlist_t *descs, const char *service_id, int seconds_valid, digestmap_t *uploads)
 {
   int i, j, failed_upload = 0;
   smartlist_t *responsible_dirs = smartlist_create();
@@ -1459,6 +1646,7 @@ static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartl
   routerstatus_t *hs_dir;
   for (i = 0; i < smartlist_len(descs); i++) {
     rend_encoded_v2_service_descriptor_t *desc = smartlist_get(descs, i);
+    size_t desc_len = strlen(desc->desc_str);
     /* Determine responsible dirs. */
     if (hid_serv_get_responsible_directories(responsible_dirs,
                                              desc->desc_id) < 0) {
@@ -1470,6 +1658,7 @@ static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartl
     for (j = 0; j < smartlist_len(responsible_dirs); j++) {
       char desc_id_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
       char *hs_dir_ip;
+      hs_dir_upload_t *upload;
       hs_dir = smartlist_get(responsible_dirs, j);
       if (smartlist_digest_isin(renddesc->successful_uploads,
                                 hs_dir->identity_digest))
@@ -1480,16 +1669,23 @@ static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartl
         failed_upload = -1;
         continue;
       }
-      /* Send publish request. */
-      directory_initiate_command_routerstatus(hs_dir,
-                                              DIR_PURPOSE_UPLOAD_RENDDESC_V2,
-                                              ROUTER_PURPOSE_GENERAL,
-                                              1, NULL, desc->desc_str,
-                                              strlen(desc->desc_str), 0);
+      /* Queue publish request. */
+      upload = digestmap_get(uploads, hs_dir->identity_digest);
+      if (!upload) {
+        upload = tor_malloc_zero(sizeof(hs_dir_upload_t));
+        upload->hs_dir = hs_dir;
+        upload->desc_strs = smartlist_create();
+        digestmap_set(uploads, hs_dir->identity_digest, upload);
+      } else if (upload->len + desc_len > MAX_HS_DIR_UPLOAD_LEN) {
+        hs_dir_upload_send(upload);
+      }
+      smartlist_add(upload->desc_strs, desc->desc_str);
+      upload->len += desc_len;
       base32_encode(desc_id_base32, sizeof(desc_id_base32),
                     desc->desc_id, DIGEST_LEN);
       hs_dir_ip = tor_dup_ip(hs_dir->addr);
       log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_PUBLISH_REQUEST),safe_str_client(service_id),safe_str_client(desc_id_base32),seconds_valid,hs_dir->nickname,hs_dir_ip,hs_dir->dir_port);
+      tor_free(hs_dir_ip);
       /* Remember successful upload to this router for next time. */
       if (!smartlist_digest_isin(successful_uploads, hs_dir->identity_digest))
         smartlist_add(successful_uploads, hs_dir->identity_digest);
@@ -1519,114 +1715,179 @@ static void directory_post_to_hs_dir(rend_service_descriptor_t *renddesc, smartl
   smartlist_free(successful_uploads);
 }
 
-/** Encode and sign up-to-date v0 and/or v2 service descriptors for
- * <b>service</b>, and upload it/them to all the dirservers/to the
- * responsible hidden service directories.
- */
+/** The replicas of one descriptor of a service for one time period, signed
+ * and waiting to be posted. */
+typedef struct rend_desc_batch_t {
+  smartlist_t *descs; /**< List of rend_encoded_v2_service_descriptor_t. */
+  int seconds_valid; /**< How long they are valid, for logging. */
+} rend_desc_batch_t;
+
+/** A service whose descriptors upload_service_descriptors() signs. */
+typedef struct rend_service_upload_t {
+  rend_service_t *service; /**< The service. */
+  time_t now; /**< The time to sign the descriptors for. */
+  int rendpostperiod; /**< RendPostPeriod, read by the main thread. */
+  char service_id[REND_SERVICE_ID_LEN_BASE32+1]; /**< For logging. */
+  smartlist_t *batches; /**< rend_desc_batch_t, in the order to post them. */
+  time_t next_upload_time; /**< When to upload next, or 0 to keep it. */
+  int failed; /**< Did we fail to encode one of the descriptors? */
+} rend_service_upload_t;
+
+/** Encode and sign up-to-date v2 service descriptors for the service of
+ * <b>up</b>, and add them to <b>up</b>-&gt;batches. This runs on a batch
+ * helper thread, so it changes nothing but <b>up</b>. */
 static void
-upload_service_descriptor(rend_service_t *service)
+rend_service_sign_descriptors(rend_service_upload_t *up)
 {
-  time_t now = get_time(NULL);
-  int rendpostperiod;
-  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
-  int uploaded = 0;
-
-  rendpostperiod = get_options()->RendPostPeriod;
-
-  /* Upload unversioned (v0) descriptor? */
-  if (get_options()->PublishHidServDescriptors) {
-    networkstatus_t *c = networkstatus_get_latest_consensus();
-    if (c && smartlist_len(c->routerstatus_list) > 0) {
-      int seconds_valid, i, j, num_descs;
+  rend_service_t *service = up->service;
+  smartlist_t *client_cookies = smartlist_create();
+  int seconds_valid, j, num_descs;
+  uint8_t period;
+  /* Either upload a single descriptor (including replicas) or one
+   * descriptor for each authorized client in case of authorization
+   * type 'stealth'. */
+  num_descs = service->auth_type == REND_STEALTH_AUTH ?
+                  smartlist_len(service->clients) : 1;
+  for (j = 0; j < num_descs && !up->failed; j++) {
+    crypto_pk_env_t *client_key = NULL;
+    rend_authorized_client_t *client = NULL;
+    smartlist_clear(client_cookies);
+    switch (service->auth_type) {
+      case REND_NO_AUTH:
+        /* Do nothing here. */
+        break;
+      case REND_BASIC_AUTH:
+        SMARTLIST_FOREACH(service->clients, rend_authorized_client_t *,
+            cl, smartlist_add(client_cookies, cl->descriptor_cookie));
+        break;
+      case REND_STEALTH_AUTH:
+        client = smartlist_get(service->clients, j);
+        client_key = client->client_key;
+        smartlist_add(client_cookies, client->descriptor_cookie);
+        break;
+    }
+    /* Encode the current descriptor, and also the next one if the current
+     * one expires soon. */
+    for (period = 0; period < 2; period++) {
+      rend_desc_batch_t *batch;
       smartlist_t *descs = smartlist_create();
-      smartlist_t *client_cookies = smartlist_create();
-      /* Either upload a single descriptor (including replicas) or one
-       * descriptor for each authorized client in case of authorization
-       * type 'stealth'. */
-      num_descs = service->auth_type == REND_STEALTH_AUTH ?
-                      smartlist_len(service->clients) : 1;
-      for (j = 0; j < num_descs; j++) {
-        crypto_pk_env_t *client_key = NULL;
-        rend_authorized_client_t *client = NULL;
-        smartlist_clear(client_cookies);
-        switch (service->auth_type) {
-          case REND_NO_AUTH:
-            /* Do nothing here. */
-            break;
-          case REND_BASIC_AUTH:
-            SMARTLIST_FOREACH(service->clients, rend_authorized_client_t *,
-                cl, smartlist_add(client_cookies, cl->descriptor_cookie));
-            break;
-          case REND_STEALTH_AUTH:
-            client = smartlist_get(service->clients, j);
-            client_key = client->client_key;
-            smartlist_add(client_cookies, client->descriptor_cookie);
-            break;
-        }
-        /* Encode the current descriptor. */
-        seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
-                                                   now, 0,
-                                                   service->auth_type,
-                                                   client_key,
-                                                   client_cookies);
-        if (seconds_valid < 0) {
-          log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_6));
-          smartlist_free(descs);
-          smartlist_free(client_cookies);
-          return;
-        }
-        /* Post the current descriptors to the hidden service directories. */
-        rend_get_service_id(service->desc->pk, serviceid);
-        log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_PUBLISH_REQUEST_2),serviceid);
-        directory_post_to_hs_dir(service->desc, descs, serviceid,
-                                 seconds_valid);
-        /* Free memory for descriptors. */
-        for (i = 0; i < smartlist_len(descs); i++)
-          rend_encoded_v2_service_descriptor_free(smartlist_get(descs, i));
-        smartlist_clear(descs);
-        /* Update next upload time. */
-        if (seconds_valid - REND_TIME_PERIOD_OVERLAPPING_V2_DESCS
-            > rendpostperiod)
-          service->next_upload_time = now + rendpostperiod;
-        else if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
-          service->next_upload_time = now + seconds_valid + 1;
-        else
-          service->next_upload_time = now + seconds_valid -
-              REND_TIME_PERIOD_OVERLAPPING_V2_DESCS + 1;
-        /* Post also the next descriptors, if necessary. */
-        if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS) {
-          seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
-                                                     now, 1,
-                                                     service->auth_type,
-                                                     client_key,
-                                                     client_cookies);
-          if (seconds_valid < 0) {
-            log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_6));
-            smartlist_free(descs);
-            smartlist_free(client_cookies);
-            return;
-          }
-          directory_post_to_hs_dir(service->desc, descs, serviceid,
-                                   seconds_valid);
-          /* Free memory for descriptors. */
-          for (i = 0; i < smartlist_len(descs); i++)
-            rend_encoded_v2_service_descriptor_free(smartlist_get(descs, i));
-          smartlist_clear(descs);
-        }
+      seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
+                                                 up->now, period,
+                                                 service->auth_type,
+                                                 client_key,
+                                                 client_cookies);
+      if (seconds_valid < 0) {
+        smartlist_free(descs);
+        up->failed = 1;
+        break;
       }
-      smartlist_free(descs);
-      smartlist_free(client_cookies);
-      uploaded = 1;
-      log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_UPLOAD_SUCCESSFULL));
+      batch = tor_malloc_zero(sizeof(rend_desc_batch_t));
+      batch->descs = descs;
+      batch->seconds_valid = seconds_valid;
+      smartlist_add(up->batches, batch);
+      if (period)
+        break;
+      /* Update next upload time. */
+      if (seconds_valid - REND_TIME_PERIOD_OVERLAPPING_V2_DESCS
+          > up->rendpostperiod)
+        up->next_upload_time = up->now + up->rendpostperiod;
+      else if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
+        up->next_upload_time = up->now + seconds_valid + 1;
+      else
+        up->next_upload_time = up->now + seconds_valid -
+            REND_TIME_PERIOD_OVERLAPPING_V2_DESCS + 1;
+      if (seconds_valid >= REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
+        break;
     }
   }
+  smartlist_free(client_cookies);
+}
+
+/** cpuworker_run_batch() callback: sign the descriptors of upload
+ * <b>idx</b> in the smartlist of rend_service_upload_t at <b>arg</b>. */
+static void
+rend_service_sign_batch_fn(void *arg, int idx)
+{
+  rend_service_sign_descriptors(smartlist_get((smartlist_t *)arg, idx));
+}
+
+/** Encode and sign up-to-date v2 service descriptors for all the
+ * rend_service_t in <b>services</b>, and upload them to the responsible
+ * hidden service directories.  The signing of all the services is shared
+ * out between the cpuworker batch helpers, and all the descriptors that go
+ * to the same HSDir are posted in one request.
+ */
+static void
+upload_service_descriptors(smartlist_t *services)
+{
+  time_t now = get_time(NULL);
+  networkstatus_t *c;
+  smartlist_t *ups;
+  digestmap_t *uploads;
 
-  /* If not uploaded, try again in one minute. */
-  if (!uploaded)
-    service->next_upload_time = now + 60;
+  if (!smartlist_len(services))
+    return;
+  c = networkstatus_get_latest_consensus();
+  if (!get_options()->PublishHidServDescriptors ||
+      !c || smartlist_len(c->routerstatus_list) == 0) {
+    /* If not uploaded, try again in one minute. */
+    SMARTLIST_FOREACH(services, rend_service_t *, service, {
+      service->next_upload_time = now + 60;
+      service->desc_is_dirty = 0;
+    });
+    return;
+  }
 
-  /* Unmark dirty flag of this service. */
-  service->desc_is_dirty = 0;
+  ups = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(services, rend_service_t *, service) {
+    rend_service_upload_t *up = tor_malloc_zero(sizeof(rend_service_upload_t));
+    up->service = service;
+    up->now = now;
+    up->rendpostperiod = get_options()->RendPostPeriod;
+    up->batches = smartlist_create();
+    rend_get_service_id(service->desc->pk, up->service_id);
+    log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_PUBLISH_REQUEST_2),up->service_id);
+    smartlist_add(ups, up);
+  } SMARTLIST_FOREACH_END(service);
+  cpuworker_run_batch(smartlist_len(ups), rend_service_sign_batch_fn, ups);
+
+  uploads = digestmap_new();
+  SMARTLIST_FOREACH_BEGIN(ups, rend_service_upload_t *, up) {
+    /* Post the descriptors to the hidden service directories. */
+    SMARTLIST_FOREACH(up->batches, rend_desc_batch_t *, batch,
+      directory_post_to_hs_dir(up->service->desc, batch->descs,
+                               up->service_id, batch->seconds_valid,
+                               uploads));
+    if (up->next_upload_time)
+      up->service->next_upload_time = up->next_upload_time;
+    if (!up->failed) {
+      log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_UPLOAD_SUCCESSFULL));
+      /* Unmark dirty flag of this service. */
+      up->service->desc_is_dirty = 0;
+    } else {
+      log_warn(LD_BUG,get_lang_str(LANG_LOG_RENDSERVICE_INTERNAL_ERROR_6));
+    }
+  } SMARTLIST_FOREACH_END(up);
+  DIGESTMAP_FOREACH(uploads, id, hs_dir_upload_t *, upload) {
+    (void)id;
+    hs_dir_upload_send(upload);
+    smartlist_free(upload->desc_strs);
+    tor_free(upload);
+  } DIGESTMAP_FOREACH_END;
+  digestmap_free(uploads, NULL);
+
+  /* Free memory for descriptors. */
+  SMARTLIST_FOREACH_BEGIN(ups, rend_service_upload_t *, up) {
+    SMARTLIST_FOREACH(up->batches, rend_desc_batch_t *, batch, {
+      SMARTLIST_FOREACH(batch->descs, rend_encoded_v2_service_descriptor_t *,
+                        d, rend_encoded_v2_service_descriptor_free(d));
+      smartlist_free(batch->descs);
+      tor_free(batch);
+    });
+    smartlist_free(up->batches);
+    tor_free(up);
+  } SMARTLIST_FOREACH_END(up);
+  smartlist_free(ups);
 }
 
 /** For every service, check how many intro points it currently has, and:
@@ -1767,10 +2028,12 @@ rend_consider_services_upload(time_t now)
   int i;
   rend_service_t *service;
   int rendpostperiod = get_options()->RendPostPeriod;
+  smartlist_t *due;
 
   if (!get_options()->PublishHidServDescriptors)
     return;
 
+  due = smartlist_create();
   for (i=0; i < smartlist_len(rend_service_list); ++i) {
     service = smartlist_get(rend_service_list, i);
     if (!service->next_upload_time) { /* never been uploaded yet */
@@ -1786,9 +2049,13 @@ rend_consider_services_upload(time_t now)
        * descriptor and ours has been stable for 30 seconds, upload a
        * new one of each format. */
       rend_service_update_descriptor(service);
-      upload_service_descriptor(service);
+      smartlist_add(due, service);
     }
   }
+  /* Sign and post them together, so that a burst of them shares out the
+   * work and the connections. */
+  upload_service_descriptors(due);
+  smartlist_free(due);
 }
 
 /** True if the list of available router descriptors might have changed so
@@ -1813,6 +2080,7 @@ rend_consider_descriptor_republication(void)
 {
   int i;
   rend_service_t *service;
+  smartlist_t *failed;
 
   if (!consider_republishing_rend_descriptors)
     return;
@@ -1821,14 +2089,17 @@ rend_consider_descriptor_republication(void)
   if (!get_options()->PublishHidServDescriptors)
     return;
 
+  failed = smartlist_create();
   for (i=0; i < smartlist_len(rend_service_list); ++i) {
     service = smartlist_get(rend_service_list, i);
     if (service->desc && !service->desc->all_uploads_performed) {
       /* If we failed in uploading a descriptor last time, try again *without*
        * updating the descriptor's contents. */
-      upload_service_descriptor(service);
+      smartlist_add(failed, service);
     }
   }
+  upload_service_descriptors(failed);
+  smartlist_free(failed);
 }
 
 /** Log the status of introduction points for all rendezvous services
@@ -1861,30 +2132,16 @@ rend_service_dump_stats(int severity)
 }
 
 HANDLE find_plugin_by_name(char *dll_name);
-/** Given <b>conn</b>, a rendezvous exit stream, look up the hidden service for
- * 'circ', and look up the port and address based on conn-\>port.
- * Assign the actual conn-\>addr and conn-\>port. Return -1 if failure,
- * or 0 for success.
- */
-int
-rend_service_set_connection_addr_port(edge_connection_t *conn,
-                                      origin_circuit_t *circ)
+
+/** Look up the port of <b>service</b> that the exit stream <b>conn</b>
+ * asks for in conn-\>port, and assign the actual conn-\>addr and
+ * conn-\>port.  Return -1 if failure, or 0 for success. */
+static int
+rend_service_choose_port(rend_service_t *service, edge_connection_t *conn)
 {
-  rend_service_t *service;
-  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   smartlist_t *matching_ports;
   rend_service_port_config_t *chosen_port;
 
-  tor_assert(circ->_base.purpose == CIRCUIT_PURPOSE_S_REND_JOINED);
-  tor_assert(circ->rend_data);
-  log_debug(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_SEARCH_FOR_ADDR_PORT));
-  base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
-                circ->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
-  service = rend_service_get_by_pk_digest(circ->rend_data->rend_pk_digest);
-  if (!service) {
-    log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_NO_SERVICE),serviceid,circ->_base.n_circ_id);
-    return -1;
-  }
   matching_ports = smartlist_create();
   SMARTLIST_FOREACH(service->ports, rend_service_port_config_t *, p,
   {
@@ -1904,10 +2161,53 @@ rend_service_set_connection_addr_port(edge_connection_t *conn,
     conn->_base.port = chosen_port->real_port;
     return 0;
   }
-  log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_NO_PORT_MAPPING),conn->_base.port,serviceid);
+  log_info(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_NO_PORT_MAPPING),conn->_base.port,service->service_id);
   return -1;
 }
 
+/** Given <b>conn</b>, a rendezvous exit stream, look up the hidden service for
+ * 'circ', and look up the port and address based on conn-\>port.
+ * Assign the actual conn-\>addr and conn-\>port. Return -1 if failure,
+ * or 0 for success.
+ */
+int
+rend_service_set_connection_addr_port(edge_connection_t *conn,
+                                      origin_circuit_t *circ)
+{
+  rend_service_t *service;
+  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+
+  tor_assert(circ->_base.purpose == CIRCUIT_PURPOSE_S_REND_JOINED);
+  tor_assert(circ->rend_data);
+  log_debug(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_SEARCH_FOR_ADDR_PORT));
+  base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
+                circ->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
+  service = rend_service_get_by_pk_digest(circ->rend_data->rend_pk_digest);
+  if (!service) {
+    log_warn(LD_REND,get_lang_str(LANG_LOG_RENDSERVICE_NO_SERVICE),serviceid,circ->_base.n_circ_id);
+    return -1;
+  }
+  return rend_service_choose_port(service, conn);
+}
+
+/** If <b>onion_address</b> is one of our own hidden services, which is
+ * enabled and doesn't authorize its clients, assign the actual
+ * conn-\>addr and conn-\>port of the exit stream <b>conn</b> as
+ * rend_service_set_connection_addr_port() would.  Return 1 if it isn't one
+ * of ours, -1 if it has no such port, or 0 for success. */
+int
+rend_service_set_local_addr_port(edge_connection_t *conn,
+                                 const char *onion_address)
+{
+  SMARTLIST_FOREACH(rend_service_list, rend_service_t *, s,
+  {
+    if (!strcasecmp(s->service_id, onion_address) && !s->disabled &&
+        s->auth_type == REND_NO_AUTH)
+      return rend_service_choose_port(s, conn);
+  });
+  return 1;
+}
+
 
 long rend_add_new_service(char *realPorts,char *virtualPorts,char *hostname,char *onionAddress)
 {
@@ -55,6 +55,9 @@ typedef struct rend_service_t {
   int disabled;
   /** Time at which we last removed expired values from accepted_intros. */
   time_t last_cleaned_accepted_intros;
+  /** How many of the INTRODUCE2 cells for this service are with the
+   * cpuworkers right now? */
+  int n_intros_busy;
 } rend_service_t;
 
 
@@ -73,9 +76,12 @@ int rend_service_intro_established(origin_circuit_t *circuit,
 void rend_service_rendezvous_has_opened(origin_circuit_t *circuit);
 int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
                            size_t request_len);
+void rend_service_assign_pending_intros(void);
 void rend_service_relaunch_rendezvous(origin_circuit_t *oldcirc);
 int rend_service_set_connection_addr_port(edge_connection_t *conn,
                                           origin_circuit_t *circ);
+int rend_service_set_local_addr_port(edge_connection_t *conn,
+                                     const char *onion_address);
 void rend_service_dump_stats(int severity);
 void rend_service_free_all(void);
 long rend_add_new_service(char *realPorts,char *virtualPorts,char *hostname,char *onionAddress);
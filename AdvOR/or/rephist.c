@@ -22,6 +22,7 @@
 
 static void bw_arrays_init(void);
 static void predicted_ports_init(void);
+static void stability_note_slot_unused(int slot);
 
 /** Total number of bytes currently allocated in fields used by rephist.c. */
 uint64_t rephist_total_alloc=0;
@@ -41,11 +42,17 @@ uint32_t rephist_total_num=0;
  * 20X as much as one that ended a month ago, and routers that have had no
  * uptime data for about half a year will get forgotten.) */
 
-/** History of an OR-\>OR link. */
+/** History of an OR-\>OR link.  These live in link_table, keyed by the
+ * pair of identity digests. */
 typedef struct link_history_t {
+  /** Identity digest of the OR we extended from. */
+  char from_id[DIGEST_LEN];
+  /** Identity digest of the OR we extended to. */
+  char to_id[DIGEST_LEN];
   /** When did we start tracking this list? */
   time_t since;
-  /** When did we most recently note a change to this link */
+  /** When did we most recently note a change to this link?  Zero iff this
+   * slot of link_table is empty. */
   time_t changed;
   /** How many times did extending from OR1 to OR2 succeed? */
   unsigned long n_extend_ok;
@@ -94,10 +101,14 @@ typedef struct or_history_t {
   time_t start_of_downtime;
   unsigned long weighted_uptime;
   unsigned long total_weighted_time;
-
-  /** Map from hex OR2 identity digest to a link_history_t for the link
-   * from this OR to OR2. */
-  digestmap_t *link_history_map;
+  /** 1 + the index of this router's record in the binary stability file, or
+   * 0 if it has no record there yet. */
+  int stability_slot;
+  /** Checksum of the record we last wrote for this router. */
+  uint32_t stability_checksum;
+
+  /** How many links from this OR do we have in link_table? */
+  int n_links;
 } or_history_t;
 
 /** When did we last multiply all routers' weighted_run_length and
@@ -125,7 +136,6 @@ get_or_history(const char* id)
     hist = tor_malloc_zero(sizeof(or_history_t));
     rephist_total_alloc += sizeof(or_history_t);
     rephist_total_num++;
-    hist->link_history_map = digestmap_new();
     hist->since = hist->changed = get_time(NULL);
     tor_addr_make_unspec(&hist->last_reached_addr);
     digestmap_set(history_map, id, hist);
@@ -133,6 +143,71 @@ get_or_history(const char* id)
   return hist;
 }
 
+/** Open-addressed table of the history of every OR-\>OR link, with
+ * link_table_size slots (a power of two, or 0) of which link_table_n are
+ * used.  We never let it get more than half full. */
+static link_history_t *link_table = NULL;
+static unsigned int link_table_size = 0;
+static unsigned int link_table_n = 0;
+/** How many slots does link_table get when we first need it? */
+#define LINK_TABLE_MIN_SIZE 256
+
+/** Return the slot of link_table where the search for the link from
+ * <b>from_id</b> to <b>to_id</b> starts. */
+static INLINE unsigned int
+link_table_hash(const char *from_id, const char *to_id)
+{
+  return ((get_uint32(from_id) * 0x9e3779b1u) ^ get_uint32(to_id+4)) &
+         (link_table_size - 1);
+}
+
+/** Return the slot of link_table that holds the link from <b>from_id</b> to
+ * <b>to_id</b>, or the empty slot where it would go. */
+static link_history_t *
+link_table_find(const char *from_id, const char *to_id)
+{
+  unsigned int i = link_table_hash(from_id, to_id);
+  while (link_table[i].changed) {
+    if (tor_memeq(link_table[i].from_id, from_id, DIGEST_LEN) &&
+        tor_memeq(link_table[i].to_id, to_id, DIGEST_LEN))
+      break;
+    i = (i + 1) & (link_table_size - 1);
+  }
+  return &link_table[i];
+}
+
+/** Replace link_table by one with <b>size</b> slots, and move into it every
+ * link that has changed since <b>before</b> and starts at an OR we still
+ * track; forget the others. */
+static void
+link_table_rebuild(unsigned int size, time_t before)
+{
+  link_history_t *old = link_table;
+  unsigned int i, old_size = link_table_size;
+
+  link_table = tor_malloc_zero(size * sizeof(link_history_t));
+  link_table_size = size;
+  link_table_n = 0;
+  rephist_total_alloc += size * sizeof(link_history_t);
+  for (i = 0; i < old_size; ++i) {
+    or_history_t *orhist;
+    if (!old[i].changed)
+      continue;
+    orhist = digestmap_get(history_map, old[i].from_id);
+    if (!orhist)
+      continue;
+    if (old[i].changed < before) {
+      --orhist->n_links;
+      continue;
+    }
+    memcpy(link_table_find(old[i].from_id, old[i].to_id), &old[i],
+           sizeof(link_history_t));
+    ++link_table_n;
+  }
+  rephist_total_alloc -= old_size * sizeof(link_history_t);
+  tor_free(old);
+}
+
 /** Return the link_history_t for the link from the first named OR to
  * the second, creating it if necessary. (ORs are identified by
  * identity digest.)
@@ -147,56 +222,41 @@ get_link_history(const char *from_id, const char *to_id)
     return NULL;
   if (tor_digest_is_zero(to_id))
     return NULL;
-  lhist = (link_history_t*) digestmap_get(orhist->link_history_map, to_id);
-  if (!lhist) {
-    lhist = tor_malloc_zero(sizeof(link_history_t));
-    rephist_total_alloc += sizeof(link_history_t);
+  if ((link_table_n + 1) * 2 > link_table_size)
+    link_table_rebuild(link_table_size ? link_table_size * 2 :
+                       LINK_TABLE_MIN_SIZE, 0);
+  lhist = link_table_find(from_id, to_id);
+  if (!lhist->changed) {
+    memcpy(lhist->from_id, from_id, DIGEST_LEN);
+    memcpy(lhist->to_id, to_id, DIGEST_LEN);
     lhist->since = lhist->changed = get_time(NULL);
-    digestmap_set(orhist->link_history_map, to_id, lhist);
+    ++link_table_n;
+    ++orhist->n_links;
   }
   return lhist;
 }
 
 #ifdef DEBUG_MALLOC
-/** Helper: free storage held by a single link history entry. */
-static void
-_free_link_history(void *val,const char *c,int n)
-{
-  rephist_total_alloc -= sizeof(link_history_t);
-  _tor_free_(val,c,n);
-}
-
 /** Helper: free storage held by a single OR history entry. */
 static void
 free_or_history(void *_hist,const char *c,int n)
 {
-  or_history_t *hist = _hist;
-  digestmap_free(hist->link_history_map, _free_link_history);
   rephist_total_alloc -= sizeof(or_history_t);
   rephist_total_num--;
-  _tor_free_(hist,c,n);
+  _tor_free_(_hist,c,n);
 }
 #else
-/** Helper: free storage held by a single link history entry. */
-static void
-_free_link_history(void *val)
-{
-  rephist_total_alloc -= sizeof(link_history_t);
-  tor_free(val);
-}
-
 /** Helper: free storage held by a single OR history entry. */
 static void
 free_or_history(void *_hist)
 {
-  or_history_t *hist = _hist;
-  digestmap_free(hist->link_history_map, _free_link_history);
   rephist_total_alloc -= sizeof(or_history_t);
   rephist_total_num--;
-  tor_free(hist);
+  tor_free(_hist);
 }
 #endif
 
+
 /** Update an or_history_t object <b>hist</b> so that its uptime/downtime
  * count is up-to-date as of <b>when</b>.
  */
@@ -640,14 +700,14 @@ rep_hist_note_extend_failed(const char *from_id, const char *to_id)
 void
 rep_hist_dump_stats(time_t now, int severity)
 {
-  digestmap_iter_t *lhist_it;
   digestmap_iter_t *orhist_it;
   const char *name1, *name2, *digest1, *digest2;
   char hexdigest1[HEX_DIGEST_LEN+1];
   char hexdigest2[HEX_DIGEST_LEN+1];
   or_history_t *or_history;
   link_history_t *link_history;
-  void *or_history_p, *link_history_p;
+  void *or_history_p;
+  unsigned int i;
   double uptime;
   char buffer[2048];
   size_t len;
@@ -684,21 +744,20 @@ rep_hist_dump_stats(time_t now, int severity)
     }
     log(severity, LD_HIST,get_lang_str(LANG_LOG_REPHIST_STATS),name1,hexdigest1,or_history->n_conn_ok,or_history->n_conn_fail+or_history->n_conn_ok,upt,upt+downt,uptime*100.0,stability/3600,(stability/60)%60,stability%60);
 
-    if (!digestmap_isempty(or_history->link_history_map)) {
+    if (or_history->n_links) {
       strlcpy(buffer, "    Extend attempts: ", sizeof(buffer));
       len = strlen(buffer);
-      for (lhist_it = digestmap_iter_init(or_history->link_history_map);
-           !digestmap_iter_done(lhist_it);
-           lhist_it = digestmap_iter_next(or_history->link_history_map,
-                                          lhist_it)) {
-        digestmap_iter_get(lhist_it, &digest2, &link_history_p);
+      for (i = 0; i < link_table_size; ++i) {
+        link_history = &link_table[i];
+        if (!link_history->changed ||
+            tor_memneq(link_history->from_id, digest1, DIGEST_LEN))
+          continue;
+        digest2 = link_history->to_id;
         if ((r = router_get_by_digest(digest2)))
           name2 = r->nickname;
         else
           name2 = "(unknown)";
 
-        link_history = (link_history_t*) link_history_p;
-
         base16_encode(hexdigest2, sizeof(hexdigest2), digest2, DIGEST_LEN);
         ret = tor_snprintf(buffer+len, 2048-len, "%s [%s](%ld/%ld); ",
                         name2,
@@ -723,10 +782,9 @@ rep_history_clean(time_t before)
 {
   int authority = authdir_mode(get_options());
   or_history_t *or_history;
-  link_history_t *link_history;
-  void *or_history_p, *link_history_p;
-  digestmap_iter_t *orhist_it, *lhist_it;
-  const char *d1, *d2;
+  void *or_history_p;
+  digestmap_iter_t *orhist_it;
+  const char *d1;
 
   orhist_it = digestmap_iter_init(history_map);
   while (!digestmap_iter_done(orhist_it)) {
@@ -739,6 +797,8 @@ rep_history_clean(time_t before)
                        : (or_history->changed < before);
     if (remove) {
       orhist_it = digestmap_iter_next_rmv(history_map, orhist_it);
+      if (or_history->stability_slot)
+        stability_note_slot_unused(or_history->stability_slot);
 #ifdef DEBUG_MALLOC
       free_or_history(or_history,__FILE__,__LINE__);
 #else
@@ -746,21 +806,214 @@ rep_history_clean(time_t before)
 #endif
       continue;
     }
-    for (lhist_it = digestmap_iter_init(or_history->link_history_map);
-         !digestmap_iter_done(lhist_it); ) {
-      digestmap_iter_get(lhist_it, &d2, &link_history_p);
-      link_history = link_history_p;
-      if (link_history->changed < before) {
-        lhist_it = digestmap_iter_next_rmv(or_history->link_history_map,
-                                           lhist_it);
-        rephist_total_alloc -= sizeof(link_history_t);
-        tor_free(link_history);
-        continue;
-      }
-      lhist_it = digestmap_iter_next(or_history->link_history_map,lhist_it);
-    }
     orhist_it = digestmap_iter_next(history_map, orhist_it);
   }
+
+  /* Forget the links that haven't changed since <b>before</b>, and those
+   * from the ORs we just forgot, and shrink the table if it got sparse. */
+  if (link_table) {
+    unsigned int size = link_table_size;
+    while (size > LINK_TABLE_MIN_SIZE && link_table_n * 8 < size)
+      size /= 2;
+    link_table_rebuild(size, before);
+  }
+}
+
+/** Magic string at the start of the binary stability file. */
+#define STABILITY_MAGIC "AdvORmtb"
+/** Version of the binary stability file format. */
+#define STABILITY_VERSION 1
+/** Length of the header of the binary stability file. */
+#define STABILITY_HEADER_LEN 48
+/** Length of each router record in the binary stability file. */
+#define STABILITY_RECORD_LEN 64
+
+/* The binary stability file is a header followed by fixed-size records:
+ *
+ *   Header = Magic[8] Version[4] RecordLen[4] StoredAt[8] TrackedSince[8]
+ *            LastDownrated[8] Reserved[4] Checksum[4]
+ *   Record = Digest[20] WeightedRunLen[4] TotalRunWeights[8] StartOfRun[8]
+ *            StartOfDowntime[8] WeightedUptime[4] TotalWeightedTime[4]
+ *            Reserved[4] Checksum[4]
+ *
+ * Each checksum covers the bytes before it.  A record with an all-zero digest
+ * is an unused slot.  Unlike the text file, the records don't depend on when
+ * the file was stored, so we only rewrite the records of the routers whose
+ * history changed since the last save. */
+
+/** True iff the binary stability file on disk matches the slots we assigned
+ * to the routers in history_map, so that we can update it in place. */
+static int stability_file_valid = 0;
+/** How many record slots the binary stability file has. */
+static int stability_n_slots = 0;
+/** Slots of the binary stability file that hold no record, as 1 + index. */
+static smartlist_t *stability_free_slots = NULL;
+/** Slots of the binary stability file that still hold the record of a
+ * router we forgot, as 1 + index. */
+static smartlist_t *stability_dirty_slots = NULL;
+
+/** Return the checksum of the <b>len</b> bytes at <b>buf</b>. */
+static uint32_t
+stability_checksum(const char *buf, size_t len)
+{
+  char d[DIGEST_LEN];
+  crypto_digest(d, buf, len);
+  return get_uint32(d);
+}
+
+/** Add a chunk of the <b>len</b> bytes at <b>bytes</b>, to be written at
+ * <b>offset</b>, to <b>chunks</b>. */
+static void
+stability_add_chunk(smartlist_t *chunks, size_t offset, const char *bytes,
+                    size_t len)
+{
+  offset_chunk_t *c = tor_malloc(sizeof(offset_chunk_t));
+  c->offset = offset;
+  c->bytes = bytes;
+  c->len = len;
+  smartlist_add(chunks, c);
+}
+
+/** Note that no router uses the record slot <b>slot</b> any longer. */
+static void
+stability_note_slot_unused(int slot)
+{
+  if (!stability_dirty_slots)
+    stability_dirty_slots = smartlist_create();
+  smartlist_add(stability_dirty_slots, (void*)(uintptr_t)slot);
+}
+
+/** Forget all the record slots of the binary stability file. */
+static void
+stability_clear_slots(void)
+{
+  if (!stability_free_slots)
+    stability_free_slots = smartlist_create();
+  if (!stability_dirty_slots)
+    stability_dirty_slots = smartlist_create();
+  smartlist_clear(stability_free_slots);
+  smartlist_clear(stability_dirty_slots);
+  stability_n_slots = 0;
+}
+
+/** Write the header of the binary stability file, stored at
+ * <b>stored_at</b>, into <b>buf</b>. */
+static void
+stability_format_header(char *buf, time_t stored_at)
+{
+  memset(buf, 0, STABILITY_HEADER_LEN);
+  memcpy(buf, STABILITY_MAGIC, 8);
+  set_uint32(buf+8, STABILITY_VERSION);
+  set_uint32(buf+12, STABILITY_RECORD_LEN);
+  set_uint64(buf+16, (uint64_t)stored_at);
+  set_uint64(buf+24, (uint64_t)started_tracking_stability);
+  set_uint64(buf+32, (uint64_t)stability_last_downrated);
+  set_uint32(buf+44, stability_checksum(buf, STABILITY_HEADER_LEN-4));
+}
+
+/** Write the record for the router with identity <b>digest</b> and history
+ * <b>hist</b> into <b>buf</b>, and return its checksum. */
+static uint32_t
+stability_format_record(char *buf, const char *digest, or_history_t *hist)
+{
+  uint32_t checksum;
+  memset(buf, 0, STABILITY_RECORD_LEN);
+  memcpy(buf, digest, DIGEST_LEN);
+  set_uint32(buf+20, (uint32_t)hist->weighted_run_length);
+  memcpy(buf+24, &hist->total_run_weights, 8);
+  set_uint64(buf+32, (uint64_t)hist->start_of_run);
+  set_uint64(buf+40, (uint64_t)hist->start_of_downtime);
+  set_uint32(buf+48, (uint32_t)hist->weighted_uptime);
+  set_uint32(buf+52, (uint32_t)hist->total_weighted_time);
+  checksum = stability_checksum(buf, STABILITY_RECORD_LEN-4);
+  set_uint32(buf+STABILITY_RECORD_LEN-4, checksum);
+  return checksum;
+}
+
+/** Write the binary stability file <b>filename</b> from scratch, starting
+ * with <b>header</b>, and give every router in history_map a new slot.
+ * Return 0 on success, -1 on failure. */
+static int
+stability_rewrite_file(char *filename, const char *header)
+{
+  size_t len = STABILITY_HEADER_LEN +
+               digestmap_size(history_map)*STABILITY_RECORD_LEN;
+  char *buf = tor_malloc(len), *cp = buf + STABILITY_HEADER_LEN;
+  int r;
+
+  memcpy(buf, header, STABILITY_HEADER_LEN);
+  stability_clear_slots();
+  DIGESTMAP_FOREACH(history_map, digest, or_history_t *, hist) {
+    hist->stability_slot = ++stability_n_slots;
+    hist->stability_checksum = stability_format_record(cp, digest, hist);
+    cp += STABILITY_RECORD_LEN;
+  } DIGESTMAP_FOREACH_END;
+  r = write_buf_to_file(filename, buf, (int)len);
+  tor_free(buf);
+  stability_file_valid = (r == 0);
+  if (r == 0)
+    log_info(LD_HIST,get_lang_str(LANG_LOG_REPHIST_MTBF_REWRITTEN),
+             stability_n_slots);
+  return r;
+}
+
+/** Update the binary stability file <b>filename</b> in place: write
+ * <b>header</b>, the records of the routers whose history changed since we
+ * last wrote them, and clear the slots of the routers we forgot.  New
+ * routers reuse free slots, or are appended.  Return 0 on success, -1 on
+ * failure. */
+static int
+stability_patch_file(char *filename, const char *header)
+{
+  smartlist_t *chunks = smartlist_create();
+  char *buf, *cp;
+  int n_changed = 0, r;
+
+  buf = tor_malloc(STABILITY_HEADER_LEN + STABILITY_RECORD_LEN *
+         (digestmap_size(history_map) + smartlist_len(stability_dirty_slots)));
+  memcpy(buf, header, STABILITY_HEADER_LEN);
+  stability_add_chunk(chunks, 0, buf, STABILITY_HEADER_LEN);
+  cp = buf + STABILITY_HEADER_LEN;
+  DIGESTMAP_FOREACH(history_map, digest, or_history_t *, hist) {
+    uint32_t checksum = stability_format_record(cp, digest, hist);
+    if (hist->stability_slot && checksum == hist->stability_checksum)
+      continue;
+    if (!hist->stability_slot) {
+      if (smartlist_len(stability_free_slots))
+        hist->stability_slot =
+          (int)(uintptr_t)smartlist_pop_last(stability_free_slots);
+      else if (smartlist_len(stability_dirty_slots))
+        hist->stability_slot =
+          (int)(uintptr_t)smartlist_pop_last(stability_dirty_slots);
+      else
+        hist->stability_slot = ++stability_n_slots;
+    }
+    hist->stability_checksum = checksum;
+    stability_add_chunk(chunks, STABILITY_HEADER_LEN +
+          (size_t)(hist->stability_slot-1)*STABILITY_RECORD_LEN,
+          cp, STABILITY_RECORD_LEN);
+    cp += STABILITY_RECORD_LEN;
+    ++n_changed;
+  } DIGESTMAP_FOREACH_END;
+  SMARTLIST_FOREACH(stability_dirty_slots, void *, slot, {
+    memset(cp, 0, STABILITY_RECORD_LEN);
+    stability_add_chunk(chunks, STABILITY_HEADER_LEN +
+          (size_t)((int)(uintptr_t)slot-1)*STABILITY_RECORD_LEN,
+          cp, STABILITY_RECORD_LEN);
+    cp += STABILITY_RECORD_LEN;
+    smartlist_add(stability_free_slots, slot);
+  });
+  smartlist_clear(stability_dirty_slots);
+
+  r = patch_chunks_in_file(filename, chunks);
+  SMARTLIST_FOREACH(chunks, offset_chunk_t *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(buf);
+  if (r < 0)
+    stability_file_valid = 0;
+  else
+    log_debug(LD_HIST,get_lang_str(LANG_LOG_REPHIST_MTBF_PATCHED),n_changed);
+  return r;
 }
 
 /** Write MTBF data to disk. Return 0 on success, negative on failure.
@@ -769,78 +1022,30 @@ rep_history_clean(time_t before)
  * that is still considered up but isn't in our routerlist, consider it
  * to be down. */
 int rep_hist_record_mtbf_data(time_t now, int missing_means_down)
-{	char time_buf[ISO_TIME_LEN+1];
-	digestmap_iter_t *orhist_it;
-	const char *digest;
-	void *or_history_p;
-	or_history_t *hist;
-	open_file_t *open_file = NULL;
+{	char header[STABILITY_HEADER_LEN];
+	char *filename;
+	int r = -1;
 
-	char *filename = get_datadir_fname(DATADIR_ROUTER_STABILITY);
-	if(!start_writing_to_file(filename,&open_file))
-	{	tor_free(filename);
-		return -1;
-	}
-	tor_free(filename);
-	/* File format is:
-	 *   FormatLine *KeywordLine Data
-	 *
-	 *   FormatLine = "format 1" NL
-	 *   KeywordLine = Keyword SP Arguments NL
-	 *   Data = "data" NL *RouterMTBFLine "." NL
-	 *   RouterMTBFLine = Fingerprint SP WeightedRunLen SP
-	 *           TotalRunWeights [SP S=StartRunTime] NL */
-
-	char *str=tor_malloc(2048);
-	while(1)
-	{	if(write_string_to_file(open_file,("format 2\r\n")) < 0) break;
-		format_iso_time(time_buf, get_time(NULL));
-		tor_snprintf(str,2047,"stored-at %s\r\n", time_buf);
-		if(write_string_to_file(open_file,str) <0) break;
-		if(started_tracking_stability)
-		{	format_iso_time(time_buf, started_tracking_stability);
-			tor_snprintf(str,2047,"tracked-since %s\r\n",time_buf);
-			if(write_string_to_file(open_file,str) <0) break;
-		}
-		if(stability_last_downrated)
-		{	format_iso_time(time_buf, stability_last_downrated);
-			tor_snprintf(str,2047,"last-downrated %s\r\n",time_buf);
-			if(write_string_to_file(open_file,str) <0) break;
-		}
-		if(write_string_to_file(open_file,("data\r\n"))<0) break;
-		for(orhist_it = digestmap_iter_init(history_map);!digestmap_iter_done(orhist_it);orhist_it = digestmap_iter_next(history_map,orhist_it))
-		{	char dbuf[HEX_DIGEST_LEN+1];
-			const char *t = NULL;
-			digestmap_iter_get(orhist_it, &digest, &or_history_p);
-			hist = (or_history_t*) or_history_p;
-			base16_encode(dbuf, sizeof(dbuf), digest, DIGEST_LEN);
-			if(missing_means_down && hist->start_of_run && !router_get_by_digest(digest))
+	if(missing_means_down)
+	{	DIGESTMAP_FOREACH(history_map, digest, or_history_t *, hist)
+		{	if(hist->start_of_run && !router_get_by_digest(digest))
 			{	/* We think this relay is running, but it's not listed in our routerlist. Somehow it fell out without telling us it went down. Complain and also correct it. */
+				char dbuf[HEX_DIGEST_LEN+1];
+				base16_encode(dbuf, sizeof(dbuf), digest, DIGEST_LEN);
 				log_info(LD_HIST,get_lang_str(LANG_LOG_REPHIST_RELAY_NOT_IN_ROUTERLIST),dbuf);
 				rep_hist_note_router_unreachable(digest, now);
 			}
-			tor_snprintf(str,2047,"R %s\r\n",dbuf);
-			if(write_string_to_file(open_file,str) <0) break;
-			if(hist->start_of_run > 0)
-			{	format_iso_time(time_buf, hist->start_of_run);
-				t = time_buf;
-			}
-			tor_snprintf(str,2047,"+MTBF %lu %.5lf%s%s\r\n",hist->weighted_run_length, hist->total_run_weights,t ? " S=" : "", t ? t : "");
-			if(write_string_to_file(open_file,str) <0) break;
-			t = NULL;
-			if(hist->start_of_downtime > 0)
-			{	format_iso_time(time_buf, hist->start_of_downtime);
-				t = time_buf;
-			}
-			tor_snprintf(str,2047,"+WFU %lu %lu%s%s\r\n",hist->weighted_uptime, hist->total_weighted_time,t ? " S=" : "", t ? t : "");
-			if(write_string_to_file(open_file,str) <0) break;
-		}
-		if(write_string_to_file(open_file,(".\r\n"))<0) break;
-		return finish_writing_to_file(open_file,0);
+		} DIGESTMAP_FOREACH_END;
 	}
-	tor_free(str);
-	finish_writing_to_file(open_file,1);
-	return -1;
+	stability_format_header(header, get_time(NULL));
+	filename = get_datadir_fname(DATADIR_ROUTER_STABILITY_BIN);
+	/* Once most of the file is unused slots, compact it. */
+	if(stability_file_valid && smartlist_len(stability_free_slots) + smartlist_len(stability_dirty_slots) > stability_n_slots / 2)
+		stability_file_valid = 0;
+	if(stability_file_valid)	r = stability_patch_file(filename, header);
+	if(r < 0)	r = stability_rewrite_file(filename, header);
+	tor_free(filename);
+	return r;
 }
 
 /** Format the current tracked status of the router in <b>hist</b> at time
@@ -1021,9 +1226,93 @@ correct_time(time_t t, time_t now, time_t stored_at, time_t started_measuring)
   }
 }
 
-/** Load MTBF data from disk.  Returns 0 on success or recoverable error, -1
- * on failure. */
-int rep_hist_load_mtbf_data(time_t now)
+/** Load MTBF data from the binary stability file, mapping it rather than
+ * reading it.  Skip records whose checksum is wrong.  Returns 0 on success,
+ * -1 if there is no usable binary file. */
+static int
+rep_hist_load_mtbf_binary(time_t now)
+{
+  tor_mmap_t *map;
+  const char *cp;
+  time_t last_downrated, stored_at, tracked_since;
+  time_t latest_possible_start = now;
+  int i, n_records, n_bad = 0;
+  char *filename = get_datadir_fname(DATADIR_ROUTER_STABILITY_BIN);
+
+  map = tor_mmap_file(filename);
+  tor_free(filename);
+  if (!map)
+    return -1;
+  if (map->size < STABILITY_HEADER_LEN ||
+      fast_memneq(map->data, STABILITY_MAGIC, 8) ||
+      get_uint32(map->data+8) != STABILITY_VERSION ||
+      get_uint32(map->data+12) != STABILITY_RECORD_LEN ||
+      get_uint32(map->data+44) !=
+        stability_checksum(map->data, STABILITY_HEADER_LEN-4)) {
+    log_warn(LD_HIST,get_lang_str(LANG_LOG_REPHIST_MTBF_BIN_FORMAT_ERROR));
+    tor_munmap_file(map);
+    return -1;
+  }
+  stored_at = (time_t)get_uint64(map->data+16);
+  tracked_since = (time_t)get_uint64(map->data+24);
+  last_downrated = (time_t)get_uint64(map->data+32);
+  if (last_downrated > now)
+    last_downrated = now;
+  if (tracked_since > now)
+    tracked_since = now;
+
+  stability_clear_slots();
+  n_records = (int)((map->size - STABILITY_HEADER_LEN) / STABILITY_RECORD_LEN);
+  if ((map->size - STABILITY_HEADER_LEN) % STABILITY_RECORD_LEN)
+    ++n_bad; /* The last record was cut short. */
+  stability_n_slots = n_records;
+  for (i = 0; i < n_records; ++i) {
+    uint32_t checksum;
+    or_history_t *hist;
+    cp = map->data + STABILITY_HEADER_LEN + (size_t)i*STABILITY_RECORD_LEN;
+    if (tor_digest_is_zero(cp)) {
+      smartlist_add(stability_free_slots, (void*)(uintptr_t)(i+1));
+      continue;
+    }
+    checksum = get_uint32(cp+STABILITY_RECORD_LEN-4);
+    hist = checksum == stability_checksum(cp, STABILITY_RECORD_LEN-4) ?
+             get_or_history(cp) : NULL;
+    if (!hist || hist->stability_slot) {
+      ++n_bad;
+      stability_note_slot_unused(i+1);
+      continue;
+    }
+    hist->weighted_run_length = get_uint32(cp+20);
+    memcpy(&hist->total_run_weights, cp+24, 8);
+    hist->start_of_run = correct_time((time_t)get_uint64(cp+32), now,
+                                      stored_at, tracked_since);
+    if (hist->start_of_run < latest_possible_start +
+        (long)hist->weighted_run_length)
+      latest_possible_start = hist->start_of_run -
+        (long)hist->weighted_run_length;
+    hist->start_of_downtime = correct_time((time_t)get_uint64(cp+40), now,
+                                           stored_at, tracked_since);
+    hist->weighted_uptime = get_uint32(cp+48);
+    hist->total_weighted_time = get_uint32(cp+52);
+    hist->stability_slot = i+1;
+    hist->stability_checksum = checksum;
+  }
+  tor_munmap_file(map);
+  if (n_bad)
+    log_warn(LD_HIST,get_lang_str(LANG_LOG_REPHIST_MTBF_BAD_RECORDS),n_bad);
+
+  if (tracked_since < 86400*365) /* Recover from insanely early value. */
+    tracked_since = latest_possible_start;
+  stability_last_downrated = last_downrated;
+  started_tracking_stability = tracked_since;
+  stability_file_valid = 1;
+  return 0;
+}
+
+/** Load MTBF data from the text stability file.  Returns 0 on success or
+ * recoverable error, -1 on failure. */
+static int
+rep_hist_load_mtbf_text(time_t now)
 {	/* XXXX won't handle being called while history is already populated. */
 	smartlist_t *lines;
 	char *esc_l;
@@ -1174,6 +1463,15 @@ int rep_hist_load_mtbf_data(time_t now)
 	return r;
 }
 
+/** Load MTBF data from disk, preferring the binary stability file to the
+ * text one.  Returns 0 on success or recoverable error, -1 on failure. */
+int rep_hist_load_mtbf_data(time_t now)
+{	if(rep_hist_load_mtbf_binary(now) == 0)	return 0;
+	/* Whatever we load, the binary file needs to be written from scratch. */
+	stability_file_valid = 0;
+	return rep_hist_load_mtbf_text(now);
+}
+
 /** For how many seconds do we keep track of individual per-second bandwidth
  * totals? */
 #define NUM_SECS_ROLLING_MEASURE 10
@@ -1366,6 +1664,143 @@ rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when)
   add_obs(dir_read_array, when, num_bytes);
 }
 
+/** How many milliseconds does each high-resolution bandwidth sample cover? */
+#define BW_SAMPLE_MSEC 100
+/** How many high-resolution bandwidth samples do we remember? */
+#define N_BW_SAMPLES 600
+
+/** Ring of the most recent high-resolution bandwidth samples, indexed by
+ * their interval number modulo N_BW_SAMPLES.  Slots that were never filled
+ * have msec 0. */
+static bw_sample_t bw_samples[N_BW_SAMPLES];
+/** Interval number (msec since the epoch / BW_SAMPLE_MSEC) of the sample we
+ * are filling. */
+static uint64_t bw_samples_tick = 0;
+/** Odd while the main thread is updating bw_samples, so that other threads
+ * can copy the ring without taking a lock: a copy is good iff the sequence
+ * was even and didn't change while copying. */
+static volatile LONG bw_samples_sequence = 0;
+
+/** Return the number of the BW_SAMPLE_MSEC interval we are in. */
+static uint64_t
+bw_sample_current_tick(void)
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  return ((uint64_t)now.tv_sec*1000 + now.tv_usec/1000) / BW_SAMPLE_MSEC;
+}
+
+/** Remember that we read <b>num_read</b> and wrote <b>num_written</b> bytes
+ * in the current BW_SAMPLE_MSEC interval; if <b>relayed</b>, count them as
+ * relayed traffic too. */
+void
+rep_hist_note_bw_sample(size_t num_read, size_t num_written, int relayed)
+{
+  uint64_t tick = bw_sample_current_tick();
+  bw_sample_t *s;
+
+  InterlockedIncrement(&bw_samples_sequence);
+  if (tick > bw_samples_tick) {
+    /* Start a new sample, and clear the ones of the intervals in which we
+     * transferred nothing. */
+    uint64_t t = bw_samples_tick;
+    if (!t || tick - t > N_BW_SAMPLES)
+      t = tick - (bw_samples_tick ? N_BW_SAMPLES : 1);
+    while (t < tick) {
+      ++t;
+      s = &bw_samples[t % N_BW_SAMPLES];
+      memset(s, 0, sizeof(bw_sample_t));
+      s->msec = t * BW_SAMPLE_MSEC;
+    }
+    bw_samples_tick = tick;
+  }
+  /* If the clock went backwards, keep adding to the sample we have. */
+  s = &bw_samples[bw_samples_tick % N_BW_SAMPLES];
+  s->n_read += (uint32_t)num_read;
+  s->n_written += (uint32_t)num_written;
+  if (relayed) {
+    s->n_relayed_read += (uint32_t)num_read;
+    s->n_relayed_written += (uint32_t)num_written;
+  }
+  InterlockedIncrement(&bw_samples_sequence);
+}
+
+/** Copy the up to <b>max</b> most recent complete high-resolution bandwidth
+ * samples into <b>out</b>, oldest first, and return how many we copied.
+ * Intervals in which we transferred nothing are reported as empty samples.
+ * Safe to call from any thread; returns 0 if the main thread kept updating
+ * the ring while we tried to copy it. */
+int
+rep_hist_get_bw_samples(bw_sample_t *out, int max)
+{
+  bw_sample_t *copy;
+  uint64_t tick, t;
+  LONG seq;
+  int tries, n = 0;
+
+  if (max > N_BW_SAMPLES-1)
+    max = N_BW_SAMPLES-1;
+  if (max <= 0)
+    return 0;
+  copy = tor_malloc(sizeof(bw_samples));
+  for (tries = 0; ; ++tries) {
+    if (tries == 16) {
+      tor_free(copy);
+      return 0;
+    }
+    seq = InterlockedCompareExchange(&bw_samples_sequence, 0, 0);
+    if (!(seq & 1)) {
+      memcpy(copy, bw_samples, sizeof(bw_samples));
+      if (InterlockedCompareExchange(&bw_samples_sequence, 0, 0) == seq)
+        break;
+    }
+    Sleep(0);
+  }
+
+  tick = bw_sample_current_tick();
+  for (t = tick - max; t < tick; ++t, ++n) {
+    const bw_sample_t *s = &copy[t % N_BW_SAMPLES];
+    if (s->msec == t * BW_SAMPLE_MSEC) {
+      memcpy(&out[n], s, sizeof(bw_sample_t));
+    } else {
+      memset(&out[n], 0, sizeof(bw_sample_t));
+      out[n].msec = t * BW_SAMPLE_MSEC;
+    }
+  }
+  tor_free(copy);
+  return n;
+}
+
+/** Return a newly allocated string listing the most recent complete
+ * high-resolution bandwidth samples, oldest first, one per line: the start of
+ * the interval in msec since the epoch, then the bytes read, written, relayed
+ * read and relayed written in it. */
+char *
+rep_hist_format_bw_samples(void)
+{
+  bw_sample_t *samples = tor_malloc(N_BW_SAMPLES*sizeof(bw_sample_t));
+  smartlist_t *lines = smartlist_create();
+  char *result;
+  int i, n;
+
+  n = rep_hist_get_bw_samples(samples, N_BW_SAMPLES);
+  for (i = 0; i < n; ++i) {
+    char *line;
+    tor_asprintf((unsigned char **)&line, U64_FORMAT" %lu %lu %lu %lu",
+                 U64_PRINTF_ARG(samples[i].msec),
+                 (unsigned long)samples[i].n_read,
+                 (unsigned long)samples[i].n_written,
+                 (unsigned long)samples[i].n_relayed_read,
+                 (unsigned long)samples[i].n_relayed_written);
+    smartlist_add(lines, line);
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(samples);
+  return result;
+}
+
 /** Helper: Return the largest value in b->maxima.  (This is equal to the
  * most bandwidth used in any NUM_SECS_ROLLING_MEASURE period for the last
  * NUM_SECS_BW_SUM_IS_VALID seconds.)
@@ -1571,10 +2006,13 @@ rep_hist_update_bwhist_state_section(or_state_t *state,
   smartlist_add(*s_maxima, cp);
 }
 
-/** Update <b>state</b> with the newest bandwidth history. */
+/** Update <b>state</b> with the newest bandwidth history and with the ports
+ * that we predict our streams will use. */
 void
 rep_hist_update_state(or_state_t *state)
 {
+  smartlist_t *ports = rep_hist_get_predicted_ports(get_time(NULL));
+
 #define UPDATE(arrname,st) \
   rep_hist_update_bwhist_state_section(state,\
                                        (arrname),\
@@ -1588,6 +2026,16 @@ rep_hist_update_state(or_state_t *state)
   UPDATE(dir_write_array, DirWrite);
   UPDATE(dir_read_array, DirRead);
 
+  if (!state->PredictedPorts)
+    state->PredictedPorts = smartlist_create();
+  SMARTLIST_FOREACH(state->PredictedPorts, char *, cp, tor_free(cp));
+  smartlist_clear(state->PredictedPorts);
+  SMARTLIST_FOREACH_BEGIN(ports, uint16_t *, port) {
+    unsigned char *cp;
+    tor_asprintf(&cp, "%d", (int)*port);
+    smartlist_add(state->PredictedPorts, cp);
+  } SMARTLIST_FOREACH_END(port);
+
   if (server_mode(get_options())) {
     or_state_mark_dirty(state, get_time(NULL)+(2*3600));
   }
@@ -1670,7 +2118,8 @@ rep_hist_load_bwhist_state_section(bw_array_t *b,
   return retval;
 }
 
-/** Set bandwidth history from the state file we just loaded. */
+/** Set bandwidth history and the predicted ports from the state file we
+ * just loaded. */
 int
 rep_hist_load_state(or_state_t *state, char **err)
 {
@@ -1695,6 +2144,15 @@ rep_hist_load_state(or_state_t *state, char **err)
   LOAD(dir_read_array, DirRead);
 
 #undef LOAD
+  if (state->PredictedPorts) {
+    time_t now = get_time(NULL);
+    SMARTLIST_FOREACH_BEGIN(state->PredictedPorts, const char *, cp) {
+      int ok;
+      long port = tor_parse_long(cp, 10, 1, 65535, &ok, NULL);
+      if (ok)
+        rep_hist_note_used_port(now, (uint16_t)port);
+    } SMARTLIST_FOREACH_END(cp);
+  }
   if (!all_ok) {
     *err = tor_strdup("Parsing of bandwidth history values failed");
     /* and create fresh arrays */
@@ -1848,6 +2306,31 @@ rep_hist_note_used_internal(time_t now, int need_uptime, int need_capacity)
     predicted_internal_capacity_time = now;
 }
 
+/** How many rendezvous and introduction circuits our streams took in each
+ * of the last 60 minutes, indexed by minute modulo 60. */
+static uint16_t rend_circs_per_minute[60];
+/** The minute (time divided by 60) that rend_circs_per_minute was last
+ * advanced to. */
+static time_t rend_circs_minute = 0;
+
+/** We were asleep for <b>seconds</b> seconds, which shouldn't count toward
+ * the relevance of our predictions: move them forward by that much. */
+void
+rep_hist_shift_predictions(int seconds)
+{
+  if (seconds <= 0 || !predicted_ports_times)
+    return;
+  SMARTLIST_FOREACH(predicted_ports_times, time_t *, t, *t += seconds);
+  if (predicted_internal_time)
+    predicted_internal_time += seconds;
+  if (predicted_internal_uptime_time)
+    predicted_internal_uptime_time += seconds;
+  if (predicted_internal_capacity_time)
+    predicted_internal_capacity_time += seconds;
+  if (rend_circs_minute)
+    rend_circs_minute += seconds / 60;
+}
+
 /** Return 1 if we've used an internal circ recently; else return 0. */
 int
 rep_hist_get_predicted_internal(time_t now, int *need_uptime,
@@ -1868,6 +2351,44 @@ rep_hist_get_predicted_internal(time_t now, int *need_uptime,
   return 1;
 }
 
+/** Advance rend_circs_per_minute to the minute of <b>now</b>, forgetting
+ * the minutes that are more than an hour old. */
+static void
+rend_circs_advance(time_t now)
+{
+  time_t minute = now / 60;
+  if (minute < rend_circs_minute || minute - rend_circs_minute >= 60) {
+    memset(rend_circs_per_minute, 0, sizeof(rend_circs_per_minute));
+  } else {
+    while (rend_circs_minute < minute)
+      rend_circs_per_minute[++rend_circs_minute % 60] = 0;
+  }
+  rend_circs_minute = minute;
+}
+
+/** Remember that we launched or cannibalized a client rendezvous or
+ * introduction circuit at time <b>now</b>. */
+void
+rep_hist_note_rend_circ_taken(time_t now)
+{
+  rend_circs_advance(now);
+  if (rend_circs_per_minute[rend_circs_minute % 60] < 0xffff)
+    rend_circs_per_minute[rend_circs_minute % 60]++;
+}
+
+/** Return the most rendezvous and introduction circuits our streams took
+ * within one minute during the last hour. */
+int
+rep_hist_get_predicted_rend_circs(time_t now)
+{
+  int i, best = 0;
+  rend_circs_advance(now);
+  for (i = 0; i < 60; i++)
+    if (rend_circs_per_minute[i] > best)
+      best = rend_circs_per_minute[i];
+  return best;
+}
+
 /** Any ports used lately? These are pre-seeded if we just started
  * up or if we're running a hidden service. */
 int
@@ -2434,6 +2955,18 @@ void
 rep_hist_free_all(void)
 {
   digestmap_free(history_map, free_or_history);
+  rephist_total_alloc -= link_table_size * sizeof(link_history_t);
+  tor_free(link_table);
+  link_table_size = link_table_n = 0;
+  if (stability_free_slots) {
+    smartlist_free(stability_free_slots);
+    stability_free_slots = NULL;
+  }
+  if (stability_dirty_slots) {
+    smartlist_free(stability_dirty_slots);
+    stability_dirty_slots = NULL;
+  }
+  stability_file_valid = stability_n_slots = 0;
   tor_free(read_array);
   tor_free(write_array);
   tor_free(last_stability_doc);
@@ -27,6 +27,20 @@ void rep_hist_note_bytes_written(size_t num_bytes, time_t when);
 void rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when);
 void rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when);
 
+/** Bytes transferred in one high-resolution bandwidth sample interval. */
+typedef struct bw_sample_t {
+  uint64_t msec; /**< When the interval started, in msec since the epoch. */
+  uint32_t n_read; /**< Bytes read. */
+  uint32_t n_written; /**< Bytes written. */
+  uint32_t n_relayed_read; /**< Bytes of relayed traffic read. */
+  uint32_t n_relayed_written; /**< Bytes of relayed traffic written. */
+} bw_sample_t;
+
+void rep_hist_note_bw_sample(size_t num_read, size_t num_written,
+                             int relayed);
+int rep_hist_get_bw_samples(bw_sample_t *out, int max);
+char *rep_hist_format_bw_samples(void);
+
 int rep_hist_bandwidth_assess(void);
 char *rep_hist_get_bandwidth_lines(void);
 void rep_hist_update_state(or_state_t *state);
@@ -48,12 +62,15 @@ int rep_hist_have_measured_enough_stability(void);
 const char *rep_hist_get_router_stability_doc(time_t now);
 
 void rep_hist_note_used_port(time_t now, uint16_t port);
+void rep_hist_shift_predictions(int seconds);
 smartlist_t *rep_hist_get_predicted_ports(time_t now);
 void rep_hist_note_used_resolve(time_t now);
 void rep_hist_note_used_internal(time_t now, int need_uptime,
                                  int need_capacity);
 int rep_hist_get_predicted_internal(time_t now, int *need_uptime,
                                     int *need_capacity);
+void rep_hist_note_rend_circ_taken(time_t now);
+int rep_hist_get_predicted_rend_circs(time_t now);
 
 int any_predicted_circuits(time_t now);
 int rep_hist_circbuilding_dormant(time_t now);
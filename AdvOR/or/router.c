@@ -1467,6 +1467,12 @@ router_rebuild_descriptor(int force)
     /* remove duplicates from the list */
     smartlist_sort_strings(ri->declared_family);
     smartlist_uniq_strings(ri->declared_family);
+    SMARTLIST_FOREACH(ri->declared_family, char *, name,
+     {
+       smartlist_set(ri->declared_family, name_sl_idx,
+                     router_intern_family_member(name));
+       tor_free(name);
+     });
 
     smartlist_free(family);
   }
@@ -22,6 +22,7 @@
 #include "geoip.h"
 #include "hibernate.h"
 #include "main.h"
+#include "microdesc.h"
 #include "networkstatus.h"
 #include "policies.h"
 #include "reasons.h"
@@ -38,7 +39,6 @@ extern or_options_t *tmpOptions;
 // #define DEBUG_ROUTERLIST
 void plugins_routerchanged(uint32_t addr,char *digest,int changed);
 int dlgBypassBlacklists_isRecent(uint32_t addr,routerinfo_t *router,time_t now);
-void insert_router_1(HWND hDlg,uint32_t lParam1,const char *country,const char *address,const char *rname,const char *bw,const char *is_exit);
 
 /****************************************************************************/
 
@@ -49,8 +49,11 @@ static routerstatus_t *router_pick_trusteddirserver_impl(
                           authority_type_t auth, int flags, int *n_busy_out);
 static void mark_all_trusteddirservers_up(void);
 static int router_nickname_matches(routerinfo_t *router, const char *nickname);
+static INLINE int router_in_nickname_smartlist(smartlist_t *lst,
+                                               routerinfo_t *r);
 static void trusted_dir_server_free(trusted_dir_server_t *ds);
-static void launch_router_descriptor_downloads(smartlist_t *downloadable,
+static void launch_router_descriptor_downloads(int purpose,
+                                       smartlist_t *downloadable,
                                                routerstatus_t *source,
                                                time_t now);
 static int signed_desc_digest_is_recognized(signed_descriptor_t *desc);
@@ -59,7 +62,16 @@ static char *signed_descriptor_get_body_impl(signed_descriptor_t *desc,
                                                    int with_annotations);
 static void list_pending_downloads(digestmap_t *result,
                                    int purpose, const char *prefix);
+static int router_load_routers_impl(const char *s, const char *eos,
+                                    saved_location_t saved_location,
+                                    smartlist_t *requested_fingerprints,
+                                    int descriptor_digests,
+                                    const char *prepend_annotations,
+                                    int parse_flags);
 void next_router_from_sorted_exits(void);
+void sorted_exits_add(routerinfo_t *router);
+void sorted_exits_remove(routerinfo_t *router);
+void sorted_exits_invalidate(void);
 DWORD __stdcall plugin_choose_exit(DWORD flags,DWORD after,DWORD ip_range_low,DWORD ip_range_high,unsigned long bandwidth_rate_min,const char *country_id,DWORD connection_id,char *buffer);
 void fill_router_info(router_info_t *rinfo,routerinfo_t *orig_info,int index);
 BOOL __stdcall plugin_get_router_info(int index,DWORD router_ip,char *nickname,router_info_t *router_info);
@@ -614,14 +626,201 @@ static int _compare_signed_descriptors_by_age(const void **_a, const void **_b)
 	return (int)(r1->published_on - r2->published_on);
 }
 
+/** Version of the store_snapshot_t layout. */
+#define STORE_SNAPSHOT_VERSION 1
+/** Magic bytes at the start of a store_snapshot_t. */
+#define STORE_SNAPSHOT_MAGIC "AdvORss"
+
+/** What we remember about the router descriptor store each time we write it,
+ * saved next to it with a ".snapshot" suffix.  Every descriptor we write to
+ * the store has had its signature checked on the way in, so while the store
+ * still has this digest there is no need to check them again. */
+typedef struct store_snapshot_t {
+  char magic[8]; /**< STORE_SNAPSHOT_MAGIC, NUL-terminated. */
+  uint32_t version; /**< STORE_SNAPSHOT_VERSION. */
+  uint32_t store_len; /**< Length of the store file. */
+  char store_digest[DIGEST_LEN]; /**< SHA-1 of the whole store file. */
+} store_snapshot_t;
+
+/** Record the current contents of the mmapped router descriptor
+ * <b>store</b> in its snapshot file. */
+static void
+router_store_snapshot_write(desc_store_t *store)
+{
+  store_snapshot_t snap;
+  char *fname;
+  if (store->type != ROUTER_STORE)
+    return;
+  fname = get_datadir_fname_suffix(store->fname_base, ".snapshot");
+  if (!store->mmap) {
+    write_buf_to_file(fname, "", 0);
+    tor_free(fname);
+    return;
+  }
+  memset(&snap, 0, sizeof(snap));
+  strlcpy(snap.magic, STORE_SNAPSHOT_MAGIC, sizeof(snap.magic));
+  snap.version = STORE_SNAPSHOT_VERSION;
+  snap.store_len = (uint32_t)store->mmap->size;
+  crypto_digest(snap.store_digest, get_mmap_data(store->mmap),
+                store->mmap->size);
+  write_buf_to_file(fname, (const char *)&snap, sizeof(snap));
+  tor_free(fname);
+}
+
+/** Return true iff the mmapped router descriptor <b>store</b> is exactly
+ * what its snapshot file says we last wrote. */
+static int
+router_store_snapshot_matches(desc_store_t *store)
+{
+  store_snapshot_t *snap;
+  char *fname, *contents;
+  char digest[DIGEST_LEN];
+  struct stat st;
+  int r = 0;
+  if (store->type != ROUTER_STORE || !store->mmap)
+    return 0;
+  fname = get_datadir_fname_suffix(store->fname_base, ".snapshot");
+  contents = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  tor_free(fname);
+  if (!contents)
+    return 0;
+  snap = (store_snapshot_t *)contents;
+  if (st.st_size == sizeof(store_snapshot_t) &&
+      !memcmp(snap->magic, STORE_SNAPSHOT_MAGIC, sizeof(STORE_SNAPSHOT_MAGIC)) &&
+      snap->version == STORE_SNAPSHOT_VERSION &&
+      snap->store_len == store->mmap->size) {
+    crypto_digest(digest, get_mmap_data(store->mmap), store->mmap->size);
+    r = tor_memeq(digest, snap->store_digest, DIGEST_LEN);
+  }
+  tor_free(contents);
+  if (r)
+    log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_STORE_SNAPSHOT_MATCHES),store->description);
+  return r;
+}
+
 #define RRS_FORCE 1
 #define RRS_DONT_REMOVE_OLD 2
+/** Flag for router_rebuild_store(): even with RRS_FORCE, it's enough to
+ * append the journal to the store instead of rewriting it. */
+#define RRS_MAY_MERGE 4
+
+/** Return a newly allocated list of every signed_descriptor_t that belongs
+ * in <b>store</b>. */
+static smartlist_t *router_store_list_descriptors(desc_store_t *store)
+{	smartlist_t *signed_descriptors = smartlist_create();
+	if(store->type == EXTRAINFO_STORE)
+	{	eimap_iter_t *iter;
+		for(iter = eimap_iter_init(routerlist->extra_info_map);!eimap_iter_done(iter);iter = eimap_iter_next(routerlist->extra_info_map, iter))
+		{	const char *key;
+			extrainfo_t *ei;
+			eimap_iter_get(iter, &key, &ei);
+			smartlist_add(signed_descriptors, &ei->cache_info);
+		}
+	}
+	else
+	{	SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+		{	smartlist_add(signed_descriptors, sd);
+		});
+		SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+		{	smartlist_add(signed_descriptors, &ri->cache_info);
+		});
+	}
+	return signed_descriptors;
+}
+
+/** Sorting helper: order signed_descriptor_t pointers by their offset in
+ * the journal. */
+static int _compare_signed_descriptors_by_offset(const void **_a, const void **_b)
+{	const signed_descriptor_t *r1 = *_a, *r2 = *_b;
+	if(r1->saved_offset < r2->saved_offset)	return -1;
+	return r1->saved_offset > r2->saved_offset;
+}
+
+/** Append the live descriptors from the journal of <b>store</b> to the end of
+ * the store file, and clear the journal.  The descriptors already in the
+ * store stay where they are, so this writes only the journal's worth of
+ * bytes instead of the whole store.  Don't do it when more than a quarter of
+ * the store is no longer used: only router_rebuild_store() gets rid of the
+ * dead bytes.  Return 0 on success, -1 if the store has to be rebuilt. */
+static int router_store_merge_journal(desc_store_t *store)
+{	smartlist_t *signed_descriptors, *journal, *chunk_list;
+	char *fname;
+	size_t live_in_store = 0, appended = 0;
+	off_t offset;
+	int r = -1;
+	if(!store->mmap || store->store_len != store->mmap->size)
+		return -1;
+	signed_descriptors = router_store_list_descriptors(store);
+	journal = smartlist_create();
+	SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
+	{	if(sd->do_not_cache)	continue;
+		if(sd->saved_location == SAVED_IN_CACHE)
+			live_in_store += sd->signed_descriptor_len + sd->annotations_len;
+		else if(sd->saved_location == SAVED_IN_JOURNAL)
+			smartlist_add(journal, sd);
+	});
+	smartlist_free(signed_descriptors);
+	if(store->store_len - live_in_store > store->store_len / 4)
+	{	smartlist_free(journal);
+		return -1;
+	}
+	/* Keep the order in which we received them. */
+	smartlist_sort(journal, _compare_signed_descriptors_by_offset);
+	chunk_list = smartlist_create();
+	SMARTLIST_FOREACH(journal, signed_descriptor_t *, sd,
+	{	sized_chunk_t *c = tor_malloc(sizeof(sized_chunk_t));
+		c->bytes = signed_descriptor_get_body_impl(sd, 1);
+		c->len = sd->signed_descriptor_len + sd->annotations_len;
+		appended += c->len;
+		smartlist_add(chunk_list, c);
+	});
+	log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_MERGING_JOURNAL),(int)appended,store->description);
+	fname = get_datadir_fname(store->fname_base);
+	offset = store->mmap->size;
+	/* The store is about to grow past the end of our mmap. */
+	tor_munmap_file(store->mmap);
+	store->mmap = NULL;
+	if(appended && append_chunks_to_file(fname, chunk_list, 1) < 0)
+		log_warn(LD_FS,get_lang_str(LANG_LOG_ROUTERLIST_ERROR_WRITING_STORE));
+	else	r = 0;
+	SMARTLIST_FOREACH(chunk_list, sized_chunk_t *, c, tor_free(c));
+	smartlist_free(chunk_list);
+	/* Whatever happened, the descriptors before <b>offset</b> are still
+	 * where they were. */
+	store->mmap = tor_mmap_file(fname);
+	if(!store->mmap)
+	{	log_warn(LD_FS,get_lang_str(LANG_LOG_ROUTERLIST_MMAP_ERROR),fname);
+		r = -1;
+	}
+	else if(r == 0 && store->mmap->size != (size_t)offset + appended)
+		r = -1;
+	if(r == 0)
+	{	SMARTLIST_FOREACH(journal, signed_descriptor_t *, sd,
+		{	sd->saved_location = SAVED_IN_CACHE;
+			tor_free(sd->signed_descriptor_body); // sets it to null
+			sd->saved_offset = offset;
+			offset += sd->signed_descriptor_len + sd->annotations_len;
+			signed_descriptor_get_body(sd); /* reconstruct and assert */
+		});
+		router_store_snapshot_write(store);
+		tor_free(fname);
+		fname = get_datadir_fname_suffix(store->fname_base,".new");
+		write_buf_to_file(fname,"",0);
+		store->store_len = (size_t) offset;
+		store->journal_len = 0;
+	}
+	smartlist_free(journal);
+	tor_free(fname);
+	return r;
+}
 
 /** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
  * <b>flags</b>, then atomically replace the saved router store with the
  * routers currently in our routerlist, and clear the journal.  Unless
  * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
- * rebuilding the store.  Return 0 on success, -1 on failure.
+ * rebuilding the store.  Without RRS_FORCE, or with RRS_MAY_MERGE, only
+ * append the journal to the store if most of the store is still in use.
+ * Return 0 on success, -1 on failure.
  */
 static int router_rebuild_store(int flags, desc_store_t *store)
 {	smartlist_t *chunk_list = NULL;
@@ -640,46 +839,36 @@ static int router_rebuild_store(int flags, desc_store_t *store)
 		else					had_any = (smartlist_len(routerlist->routers)+smartlist_len(routerlist->old_routers))>0;
 		/* Don't save deadweight. */
 		if(!(flags & RRS_DONT_REMOVE_OLD)&&!(get_options()->DirFlags&DIR_FLAG_NO_AUTO_UPDATE))
-			routerlist_remove_old_routers();
+		{	routerlist_remove_old_routers();
+			/* That may have just rebuilt the store. */
+			if(!force && !router_should_rebuild_store(store))
+				return 0;
+		}
+		if((!force || (flags & RRS_MAY_MERGE)) && router_store_merge_journal(store) == 0)
+			return 0;
 		log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_REBUILDING_CACHE),store->description);
 		fname = get_datadir_fname(store->fname_base);
 		fname_tmp = get_datadir_fname_suffix(store->fname_base,".tmp");
 		chunk_list = smartlist_create();
 
 		/* We sort the routers by age to enhance locality on disk. */
-		signed_descriptors = smartlist_create();
-		if(store->type == EXTRAINFO_STORE)
-		{	eimap_iter_t *iter;
-			for(iter = eimap_iter_init(routerlist->extra_info_map);!eimap_iter_done(iter);iter = eimap_iter_next(routerlist->extra_info_map, iter))
-			{	const char *key;
-				extrainfo_t *ei;
-				eimap_iter_get(iter, &key, &ei);
-				smartlist_add(signed_descriptors, &ei->cache_info);
-			}
-		}
-		else
-		{	SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-			{	smartlist_add(signed_descriptors, sd);
-			});
-			SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-			{	smartlist_add(signed_descriptors, &ri->cache_info);
-			});
-		}
+		signed_descriptors = router_store_list_descriptors(store);
 		smartlist_sort(signed_descriptors, _compare_signed_descriptors_by_age);
 
 		/* Now, add the appropriate members to chunk_list */
 		SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
 		{	sized_chunk_t *c;
-			const char *body = signed_descriptor_get_body_impl(sd, 1);
+			const char *body;
+			if(sd->do_not_cache)
+			{	++nocache;
+				continue;
+			}
+			body = signed_descriptor_get_body_impl(sd, 1);
 			if(!body)
 			{	log_warn(LD_BUG,get_lang_str(LANG_LOG_ROUTERLIST_NO_DESC_AVAILABLE));
 				r = -2;
 				break;
 			}
-			if(sd->do_not_cache)
-			{	++nocache;
-				continue;
-			}
 			c = tor_malloc(sizeof(sized_chunk_t));
 			c->bytes = body;
 			c->len = sd->signed_descriptor_len + sd->annotations_len;
@@ -723,6 +912,7 @@ static int router_rebuild_store(int flags, desc_store_t *store)
 						offset += sd->signed_descriptor_len + sd->annotations_len;
 						signed_descriptor_get_body(sd); /* reconstruct and assert */
 					});
+					router_store_snapshot_write(store);
 					tor_free(fname);
 					fname = get_datadir_fname_suffix(store->fname_base,".new");
 					write_buf_to_file(fname,"",0);
@@ -744,6 +934,19 @@ static int router_rebuild_store(int flags, desc_store_t *store)
 	return r;
 }
 
+/** Return true iff, when loading the router descriptor store, we should
+ * skip the descriptors that the current consensus doesn't list.  Caches
+ * and authorities keep old descriptors around, so they parse everything;
+ * so do we all until we have a consensus to check against. */
+static int
+router_store_load_only_listed(void)
+{
+  or_options_t *options = get_options();
+  return options->LazyDescriptorLoading &&
+         !directory_caches_dir_info(options) && !authdir_mode(options) &&
+         networkstatus_get_latest_consensus() != NULL;
+}
+
 /** Helper: Reload a cache file and its associated journal, setting metadata
  * appropriately.  If <b>extrainfo</b> is true, reload the extrainfo store;
  * else reload the router descriptor store. */
@@ -781,10 +984,18 @@ router_reload_router_list_impl(desc_store_t *store)
       router_load_extrainfo_from_string(get_mmap_data(store->mmap),
                                         get_mmap_data(store->mmap)+store->mmap->size,
                                         SAVED_IN_CACHE, NULL, 0);
-    else
-      router_load_routers_from_string(get_mmap_data(store->mmap),
-                                      get_mmap_data(store->mmap)+store->mmap->size,
-                                      SAVED_IN_CACHE, NULL, 0, NULL);
+    else {
+      /* Don't parse descriptors that router_add_to_routerlist() would only
+       * drop, and don't re-check signatures in a store we wrote ourselves. */
+      int parse_flags = 0;
+      if (router_store_load_only_listed())
+        parse_flags |= ROUTER_PARSE_ONLY_LISTED;
+      if (router_store_snapshot_matches(store))
+        parse_flags |= ROUTER_PARSE_SKIP_SIGNATURES;
+      router_load_routers_impl(get_mmap_data(store->mmap),
+                               get_mmap_data(store->mmap)+store->mmap->size,
+                               SAVED_IN_CACHE, NULL, 0, NULL, parse_flags);
+    }
   }
 
   tor_free(fname);
@@ -814,8 +1025,10 @@ router_reload_router_list_impl(desc_store_t *store)
   tor_free(altname);
 
   if (store->journal_len || read_from_old_location) {
-    /* Always clear the journal on startup.*/
-    router_rebuild_store(RRS_FORCE, store);
+    /* Always clear the journal on startup.  If we read the store from its
+     * old location, write all of it to the new one. */
+    router_rebuild_store(read_from_old_location ? RRS_FORCE :
+                         RRS_FORCE|RRS_MAY_MERGE, store);
   } else if (!extrainfo) {
     /* Don't cache expired routers. (This is in an else because
      * router_rebuild_store() also calls remove_old_routers().) */
@@ -995,9 +1208,6 @@ router_pick_trusteddirserver(authority_type_t type, int flags)
   return router_pick_trusteddirserver_impl(type, flags, NULL);
 }
 
-/** How long do we avoid using a directory server after it's given us a 503? */
-#define DIR_503_TIMEOUT (60*60)
-
 /** Pick a random running valid directory server/mirror from our
  * routerlist.  Arguments are as for router_pick_directory_server(), except
  * that RETRY_IF_NO_SERVERS is ignored, and:
@@ -1242,6 +1452,170 @@ router_reset_status_download_failures(void)
   mark_all_trusteddirservers_up();
 }
 
+/** Flags kept for each router in the router index. */
+#define RIDX_RUNNING (1<<0) /**< Running and general-purpose. */
+#define RIDX_VALID (1<<1)
+#define RIDX_STABLE (1<<2)
+#define RIDX_FAST (1<<3)
+#define RIDX_GUARD (1<<4) /**< Could be a guard. */
+#define RIDX_EXIT (1<<5) /**< Has the Exit flag and no BadExit flag. */
+#define RIDX_RANDOM_EXIT (1<<6) /**< Is no BadExit, isn't us, and allows some
+                                 * exit. */
+#define RIDX_DIR (1<<7) /**< Has a DirPort. */
+#define RIDX_EXITS_TO_80 (1<<8) /**< Might allow exits to port 80. */
+#define RIDX_EXITS_TO_443 (1<<9) /**< Might allow exits to port 443. */
+
+/** The fields of every router in the routerlist that scans over all the
+ * routers look at, in parallel arrays by routerlist index.  Going through a
+ * few dense arrays touches far fewer cache lines than going through the
+ * routerinfo_t and routerstatus_t of every router.  The index is rebuilt
+ * lazily after router_dir_info_changed(). */
+typedef struct router_index_t {
+  int valid; /**< False if the index must be rebuilt before use. */
+  int n; /**< How many routers does the index cover? */
+  uint16_t *flags; /**< RIDX_* flags of each router. */
+  uint32_t *addr; /**< IPv4 address of each router, in host order. */
+  country_t *country; /**< GeoIP country of each router. */
+  uint8_t *as_set_len; /**< Length of the AS set of each router. */
+  uint32_t *as_sets; /**< The AS set of each router, ROUTER_AS_SET_SIZE
+                      * entries per router. */
+  uint32_t *capacity; /**< Advertised bandwidth capacity of each router. */
+  int32_t *consensus_bw; /**< Consensus bandwidth of each router, in
+                          * kilobytes, or -1 if the consensus has none. */
+} router_index_t;
+
+/** The router index for the current routerlist. */
+static router_index_t router_index;
+
+/** Release the router index and mark it for rebuilding. */
+static void
+router_index_clear(void)
+{
+  tor_free(router_index.flags);
+  tor_free(router_index.addr);
+  tor_free(router_index.country);
+  tor_free(router_index.as_set_len);
+  tor_free(router_index.as_sets);
+  tor_free(router_index.capacity);
+  tor_free(router_index.consensus_bw);
+  memset(&router_index, 0, sizeof(router_index));
+}
+
+/** Return true iff <b>router</b>'s exit policy might allow exits to
+ * <b>port</b> on some address. */
+static INLINE int
+router_might_exit_to_port(routerinfo_t *router, uint16_t port)
+{
+  addr_policy_result_t r = router_compare_addr_to_exit_policy(0, port,
+                                                               router);
+  return r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
+}
+
+/** Return the router index, rebuilding it first if it's out of date. */
+static router_index_t *
+router_index_get(void)
+{
+  router_index_t *idx = &router_index;
+  int n = smartlist_len(routerlist->routers);
+
+  if (idx->valid && idx->n == n)
+    return idx;
+
+  router_index_clear();
+  idx->valid = 1;
+  idx->n = n;
+  idx->flags = tor_malloc_zero(sizeof(uint16_t)*(n+1));
+  idx->addr = tor_malloc(sizeof(uint32_t)*(n+1));
+  idx->country = tor_malloc(sizeof(country_t)*(n+1));
+  idx->as_set_len = tor_malloc(n+1);
+  idx->as_sets = tor_malloc(sizeof(uint32_t)*ROUTER_AS_SET_SIZE*(n+1));
+  idx->capacity = tor_malloc(sizeof(uint32_t)*(n+1));
+  idx->consensus_bw = tor_malloc(sizeof(int32_t)*(n+1));
+  SMARTLIST_FOREACH_BEGIN(routerlist->routers, routerinfo_t *, router) {
+    routerstatus_t *rs = router_get_consensus_status_by_id(
+                                      router->cache_info.identity_digest);
+    uint16_t f = 0;
+    if (router->is_running && router->purpose == ROUTER_PURPOSE_GENERAL)
+      f |= RIDX_RUNNING;
+    if (router->is_valid)
+      f |= RIDX_VALID;
+    if (router->is_stable)
+      f |= RIDX_STABLE;
+    if (router->is_fast)
+      f |= RIDX_FAST;
+    if (router->is_possible_guard)
+      f |= RIDX_GUARD;
+    if (router->is_exit && !router->is_bad_exit)
+      f |= RIDX_EXIT;
+    if (!router->is_bad_exit && !router_is_me(router) &&
+        !router_exit_policy_rejects_all(router)) {
+      f |= RIDX_RANDOM_EXIT;
+      if (router_might_exit_to_port(router, 80))
+        f |= RIDX_EXITS_TO_80;
+      if (router_might_exit_to_port(router, 443))
+        f |= RIDX_EXITS_TO_443;
+    }
+    if (router->dir_port)
+      f |= RIDX_DIR;
+    idx->flags[router_sl_idx] = f;
+    idx->addr[router_sl_idx] = router->addr;
+    idx->country[router_sl_idx] = router->country;
+    idx->as_set_len[router_sl_idx] = router->as_set_len;
+    memcpy(idx->as_sets + router_sl_idx*ROUTER_AS_SET_SIZE, router->as_set,
+           sizeof(router->as_set));
+    idx->capacity[router_sl_idx] = router->bandwidthcapacity;
+    idx->consensus_bw[router_sl_idx] =
+      (rs && rs->has_bandwidth) ? (int32_t)rs->bandwidth : -1;
+  } SMARTLIST_FOREACH_END(router);
+  return idx;
+}
+
+/** Add to <b>sl</b> every router in the routerlist whose AS set has an AS in
+ * common with the AS set of <b>router</b>, including <b>router</b> itself. */
+void
+routerlist_add_routers_sharing_as(smartlist_t *sl, const routerinfo_t *router)
+{
+  router_index_t *idx;
+  int i, j, k;
+
+  if (!routerlist || !router->as_set_len)
+    return;
+  idx = router_index_get();
+  for (i = 0; i < idx->n; ++i) {
+    const uint32_t *as_set = idx->as_sets + i*ROUTER_AS_SET_SIZE;
+    for (j = 0; j < idx->as_set_len[i]; ++j) {
+      for (k = 0; k < router->as_set_len; ++k)
+        if (as_set[j] == router->as_set[k])
+          break;
+      if (k < router->as_set_len)
+        break;
+    }
+    if (j < idx->as_set_len[i])
+      smartlist_add(sl, smartlist_get(routerlist->routers, i));
+  }
+}
+
+/** Return 1 if <b>router</b> might exit to <b>port</b>, 0 if it surely
+ * won't, or -1 if the router index can't tell; the caller should then check
+ * the exit policy itself. */
+int
+router_index_exits_to_port(routerinfo_t *router, uint16_t port)
+{
+  router_index_t *idx;
+  int i = router->cache_info.routerlist_index;
+  uint16_t f;
+
+  if (!routerlist || (port != 80 && port != 443))
+    return -1;
+  idx = router_index_get();
+  if (i < 0 || i >= idx->n || smartlist_get(routerlist->routers, i) != router)
+    return -1;
+  f = idx->flags[i];
+  if (!(f & RIDX_RANDOM_EXIT))
+    return -1; /* we didn't look at its policy */
+  return (f & (port == 80 ? RIDX_EXITS_TO_80 : RIDX_EXITS_TO_443)) != 0;
+}
+
 /** Return true iff router1 and router2 have the same /16 network. */
 static INLINE int
 routers_in_same_network_family(routerinfo_t *r1, routerinfo_t *r2)
@@ -1262,21 +1636,113 @@ routers_in_same_country(routerinfo_t *r1, routerinfo_t *r2)
 static void
 routerlist_add_network_family(smartlist_t *sl, routerinfo_t *router)
 {
-  SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, r,
-  {
-    if (router != r && routers_in_same_network_family(router, r))
+  router_index_t *idx = router_index_get();
+  uint32_t net = router->addr & 0xffff0000;
+  routerinfo_t *r;
+  int i;
+
+  for (i = 0; i < idx->n; ++i) {
+    if ((idx->addr[i] & 0xffff0000) == net &&
+        (r = smartlist_get(routerlist->routers, i)) != router)
       smartlist_add(sl, r);
-  });
+  }
 }
 
+/** The routers of each country, as bitsets over routerlist indexes, or NULL
+ * for countries that have none. */
+static bitarray_t *country_router_sets[256];
+/** How many routerlist indexes do the country sets cover? -1 if they must be
+ * rebuilt before use. */
+static int country_router_sets_n = -1;
+
+/** Release the country sets and mark them for rebuilding. */
+static void
+router_country_sets_clear(void)
+{
+  int i;
+  for (i = 0; i < 256; ++i) {
+    if (country_router_sets[i]) {
+      bitarray_free(country_router_sets[i]);
+      country_router_sets[i] = NULL;
+    }
+  }
+  country_router_sets_n = -1;
+}
+
+/** Return the set of routers in <b>country</b>, rebuilding the country sets
+ * first if the routerlist changed; NULL if no router is there. */
+static bitarray_t *
+router_country_set_get(country_t country)
+{
+  router_index_t *idx = router_index_get();
+  int n = idx->n, i;
+  if (country_router_sets_n != n) {
+    router_country_sets_clear();
+    country_router_sets_n = n;
+    for (i = 0; i < n; ++i) {
+      int c = idx->country[i] & 0xff;
+      if (!country_router_sets[c])
+        country_router_sets[c] = bitarray_init_zero(n);
+      bitarray_set(country_router_sets[c], i);
+    }
+  }
+  return country_router_sets[country & 0xff];
+}
+
+/** Look through the routerlist and identify routers that are in the same
+ * country as <b>router</b>. Add each of them to <b>sl</b>. */
 static void
 routerlist_add_same_country(smartlist_t *sl, routerinfo_t *router)
 {
-  SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, r,
-  {
-    if (router != r && routers_in_same_country(router, r))
-      smartlist_add(sl, r);
-  });
+  bitarray_t *set = router_country_set_get(router->country);
+  int words, i, bit;
+  bitarray_t m;
+  routerinfo_t *r;
+
+  if (!set)
+    return;
+  words = (country_router_sets_n + BITARRAY_MASK) >> BITARRAY_SHIFT;
+  for (i = 0; i < words; ++i) {
+    for (m = set[i], bit = 0; m; ++bit, m >>= 1) {
+      if (m & 1) {
+        r = smartlist_get(routerlist->routers, (i << BITARRAY_SHIFT) + bit);
+        if (r != router)
+          smartlist_add(sl, r);
+      }
+    }
+  }
+}
+
+/** Remove from <b>sl</b> every router in <b>excluded</b>. Unlike
+ * smartlist_subtract(), this takes time linear in the lengths of both lists,
+ * which matters once country families make <b>excluded</b> long. */
+static void
+routerlist_subtract_routers(smartlist_t *sl, smartlist_t *excluded)
+{
+  bitarray_t *mask;
+  int n, idx;
+
+  if (!smartlist_len(sl) || !smartlist_len(excluded))
+    return;
+  n = smartlist_len(routerlist->routers);
+  mask = bitarray_init_zero(n);
+  SMARTLIST_FOREACH_BEGIN(excluded, routerinfo_t *, r) {
+    idx = r->cache_info.routerlist_index;
+    if (idx < 0 || idx >= n || smartlist_get(routerlist->routers, idx) != r) {
+      /* Not one of ours; compare pointers instead. */
+      bitarray_free(mask);
+      smartlist_subtract(sl, excluded);
+      return;
+    }
+    bitarray_set(mask, idx);
+  } SMARTLIST_FOREACH_END(r);
+  SMARTLIST_FOREACH_BEGIN(sl, routerinfo_t *, r) {
+    idx = r->cache_info.routerlist_index;
+    if (idx >= 0 && idx < n && smartlist_get(routerlist->routers, idx) == r &&
+        bitarray_is_set(mask, idx))
+      SMARTLIST_DEL_CURRENT(sl, r);
+  } SMARTLIST_FOREACH_END(r);
+  bitarray_free(mask);
 }
 
 /** Add all the family of <b>router</b> to the smartlist <b>sl</b>.
@@ -1303,13 +1769,8 @@ routerlist_add_family(smartlist_t *sl, routerinfo_t *router)
       {
         if (!(r = router_get_by_nickname(n, 0)))
           continue;
-        if (!r->declared_family)
-          continue;
-        SMARTLIST_FOREACH(r->declared_family, const char *, n2,
-          {
-            if (router_nickname_matches(router, n2))
-              smartlist_add(sl, r);
-          });
+        if (router_in_nickname_smartlist(r->declared_family, router))
+          smartlist_add(sl, r);
       });
   }
 
@@ -1321,13 +1782,151 @@ routerlist_add_family(smartlist_t *sl, routerinfo_t *router)
   }
 }
 
-/** Return true iff r is named by some nickname in <b>lst</b>. */
+/** A string shared by every router descriptor that carries it; see
+ * router_intern_string(). */
+typedef struct interned_string_t {
+  HT_ENTRY(interned_string_t) node;
+  int refcnt; /**< How many holders does the string have? */
+  const char *str; /**< The string, stored right after this struct. */
+} interned_string_t;
+
+/** Helper: hash an interned string. */
+static INLINE unsigned int
+_interned_string_hash(interned_string_t *s)
+{
+  return ht_string_hash(s->str);
+}
+
+/** Helper: compare two interned strings. */
+static INLINE int
+_interned_string_eq(interned_string_t *a, interned_string_t *b)
+{
+  return !strcmp(a->str, b->str);
+}
+
+static HT_HEAD(interned_string_map, interned_string_t)
+     interned_strings = HT_INITIALIZER();
+HT_PROTOTYPE(interned_string_map, interned_string_t, node,
+             _interned_string_hash, _interned_string_eq);
+HT_GENERATE(interned_string_map, interned_string_t, node,
+            _interned_string_hash, _interned_string_eq, 0.6);
+
+/** Return a shared copy of <b>s</b>, for a field of a routerinfo_t (such as
+ * its platform or contact) that many routers have the same value for.  The
+ * copy must not be changed, and must be released with
+ * router_release_string() rather than tor_free(). */
+char *
+router_intern_string(const char *s)
+{
+  interned_string_t search, *found;
+  size_t len;
+
+  search.str = s;
+  if (!(found = HT_FIND(interned_string_map, &interned_strings, &search))) {
+    len = strlen(s);
+    found = tor_malloc(sizeof(interned_string_t) + len + 1);
+    memcpy(found+1, s, len+1);
+    found->str = (const char *)(found+1);
+    found->refcnt = 0;
+    HT_INSERT(interned_string_map, &interned_strings, found);
+  }
+  ++found->refcnt;
+  return (char *)found->str;
+}
+
+/** Return the shared copy of <b>s</b> if some router holds one, or NULL. */
+static const char *
+router_interned_string_lookup(const char *s)
+{
+  interned_string_t search, *found;
+  search.str = s;
+  found = HT_FIND(interned_string_map, &interned_strings, &search);
+  return found ? found->str : NULL;
+}
+
+/** Release <b>s</b>, a string returned by router_intern_string().  To make
+ * life easy for code that builds routerinfo_t objects by hand, <b>s</b> may
+ * also be an ordinary string, which we just free. */
+void
+router_release_string(char *s)
+{
+  interned_string_t search, *found;
+
+  if (!s)
+    return;
+  search.str = s;
+  found = HT_FIND(interned_string_map, &interned_strings, &search);
+  if (!found || found->str != s) {
+    tor_free(s);
+    return;
+  }
+  if (--found->refcnt == 0) {
+    HT_REMOVE(interned_string_map, &interned_strings, found);
+    tor_free(found);
+  }
+}
+
+/** Return true iff <b>name</b> is a family member in the form that
+ * router_intern_family_member() gives to identity digests: a dollar sign
+ * and 40 uppercase hex digits. */
+static INLINE int
+family_member_is_identity(const char *name)
+{
+  return name[0] == '$' && strlen(name) == HEX_DIGEST_LEN+1;
+}
+
+/** Return a shared copy of <b>name</b>, a member of the declared family of
+ * a router, for its declared_family list.  Identity digests, with or
+ * without their dollar sign, are first written as "$" and 40 uppercase hex
+ * digits, so that all the families that name a router by its identity hold
+ * the same pointer. */
+char *
+router_intern_family_member(const char *name)
+{
+  char buf[HEX_DIGEST_LEN+2];
+  const char *hex = name[0] == '$' ? name+1 : name;
+  char digest[DIGEST_LEN];
+
+  if (strlen(hex) == HEX_DIGEST_LEN &&
+      base16_decode(digest, DIGEST_LEN, hex, HEX_DIGEST_LEN) == 0) {
+    buf[0] = '$';
+    base16_encode(buf+1, sizeof(buf)-1, digest, DIGEST_LEN);
+    return router_intern_string(buf);
+  }
+  return router_intern_string(name);
+}
+
+/** Release every interned string that is left. */
+static void
+router_interned_strings_free_all(void)
+{
+  interned_string_t **ent, **next, *s;
+  for (ent = HT_START(interned_string_map, &interned_strings); ent; ent = next) {
+    s = *ent;
+    next = HT_NEXT_RMV(interned_string_map, &interned_strings, ent);
+    tor_free(s);
+  }
+  HT_CLEAR(interned_string_map, &interned_strings);
+}
+
+/** Return true iff r is named by some nickname in <b>lst</b>, a declared
+ * family built with router_intern_family_member(). */
 static INLINE int
 router_in_nickname_smartlist(smartlist_t *lst, routerinfo_t *r)
 {
+  char id[HEX_DIGEST_LEN+2];
+  const char *interned_id;
   if (!lst) return 0;
+  /* Families name routers by identity almost always: compare those by
+   * pointer, and match only the other names the slow way. */
+  id[0] = '$';
+  base16_encode(id+1, sizeof(id)-1, r->cache_info.identity_digest,
+                DIGEST_LEN);
+  interned_id = router_interned_string_lookup(id);
   SMARTLIST_FOREACH(lst, const char *, name,
-    if (router_nickname_matches(r, name))
+    if (name == interned_id)
+      return 1;
+    if (!family_member_is_identity(name) && router_nickname_matches(r, name))
       return 1;);
   return 0;
 }
@@ -1405,6 +2004,83 @@ add_nickname_list_to_smartlist(smartlist_t *sl, const char *list,
   smartlist_free(nickname_list);
 }
 
+/** A comma-separated list of nicknames and hexdigests from the config,
+ * such as a NodeFamily line, split up once so that we can check routers
+ * against it with a lookup or two. */
+typedef struct compiled_nickname_list_t {
+  digestmap_t *digests; /**< The identity digests it lists as "$hex". */
+  strmap_t *nicknames; /**< The nicknames it lists, lowercased. */
+  smartlist_t *others; /**< Its "$hex=name" and "$hex~name" entries. */
+} compiled_nickname_list_t;
+
+/** Map from a list given to router_nickname_is_in_list() to its compiled
+ * form.  The lists come from the config, so there are few of them; a
+ * config change just adds more. */
+static strmap_t *compiled_nickname_lists = NULL;
+/** Forget all the compiled lists if there get to be more than this many. */
+#define MAX_COMPILED_NICKNAME_LISTS 64
+
+/** Release every compiled nickname list. */
+static void
+compiled_nickname_lists_free_all(void)
+{
+  if (!compiled_nickname_lists)
+    return;
+  STRMAP_FOREACH(compiled_nickname_lists, list, compiled_nickname_list_t *,
+                 l) {
+    (void)list;
+    digestmap_free(l->digests, NULL);
+    strmap_free(l->nicknames, NULL);
+    SMARTLIST_FOREACH(l->others, char *, cp, tor_free(cp));
+    smartlist_free(l->others);
+    tor_free(l);
+  } STRMAP_FOREACH_END;
+  strmap_free(compiled_nickname_lists, NULL);
+  compiled_nickname_lists = NULL;
+}
+
+/** Return the compiled form of <b>list</b>, compiling it if we haven't. */
+static compiled_nickname_list_t *
+compiled_nickname_list_get(const char *list)
+{
+  compiled_nickname_list_t *l;
+  smartlist_t *nickname_list;
+  char digest[DIGEST_LEN];
+
+  if (compiled_nickname_lists &&
+      (l = strmap_get(compiled_nickname_lists, list)))
+    return l;
+  if (!compiled_nickname_lists ||
+      strmap_size(compiled_nickname_lists) >= MAX_COMPILED_NICKNAME_LISTS) {
+    compiled_nickname_lists_free_all();
+    compiled_nickname_lists = strmap_new();
+  }
+
+  l = tor_malloc_zero(sizeof(compiled_nickname_list_t));
+  l->digests = digestmap_new();
+  l->nicknames = strmap_new();
+  l->others = smartlist_create();
+  nickname_list = smartlist_create();
+  smartlist_split_string(nickname_list, list, ",",
+    SPLIT_SKIP_SPACE|SPLIT_STRIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(nickname_list, char *, cp) {
+    const char *hex = cp[0] == '$' ? cp+1 : cp;
+    if (strlen(hex) == HEX_DIGEST_LEN &&
+        base16_decode(digest, DIGEST_LEN, hex, HEX_DIGEST_LEN) == 0) {
+      digestmap_set(l->digests, digest, (void*)1);
+      tor_free(cp);
+    } else if (cp[0] == '$' || strlen(cp) > HEX_DIGEST_LEN) {
+      smartlist_add(l->others, cp); /* matched the slow way */
+    } else {
+      strmap_set_lc(l->nicknames, cp, (void*)1);
+      tor_free(cp);
+    }
+  } SMARTLIST_FOREACH_END(cp);
+  smartlist_free(nickname_list);
+  strmap_set(compiled_nickname_lists, list, l);
+  return l;
+}
+
 /** Return 1 iff any member of the (possibly NULL) comma-separated list
  * <b>list</b> is an acceptable nickname or hexdigest for <b>router</b>.  Else
  * return 0.
@@ -1412,21 +2088,126 @@ add_nickname_list_to_smartlist(smartlist_t *sl, const char *list,
 int
 router_nickname_is_in_list(routerinfo_t *router, const char *list)
 {
-  smartlist_t *nickname_list;
-  int v = 0;
+  compiled_nickname_list_t *l;
 
   if (!list)
     return 0; /* definitely not */
   tor_assert(router);
 
-  nickname_list = smartlist_create();
-  smartlist_split_string(nickname_list, list, ",",
-    SPLIT_SKIP_SPACE|SPLIT_STRIP_SPACE|SPLIT_IGNORE_BLANK, 0);
-  SMARTLIST_FOREACH(nickname_list, const char *, cp,
-                    if (router_nickname_matches(router, cp)) {v=1;break;});
-  SMARTLIST_FOREACH(nickname_list, char *, cp, tor_free(cp));
-  smartlist_free(nickname_list);
-  return v;
+  l = compiled_nickname_list_get(list);
+  if (digestmap_get(l->digests, router->cache_info.identity_digest) ||
+      strmap_get_lc(l->nicknames, router->nickname))
+    return 1;
+  SMARTLIST_FOREACH(l->others, const char *, cp,
+                    if (router_nickname_matches(router, cp)) return 1;);
+  return 0;
+}
+
+/** Candidate sets for router selection, as bitsets over routerlist indexes.
+ * They hold only what changes with the routerlist, the consensus or the
+ * config, so they are rebuilt lazily after router_dir_info_changed() or
+ * when CircuitBandwidthRate changes. */
+typedef struct router_candidates_t {
+  int valid; /**< False if the sets must be rebuilt before use. */
+  int n; /**< How many routerlist indexes do the sets cover? */
+  uint64_t bandwidth_rate; /**< The CircuitBandwidthRate they were built for. */
+  bitarray_t *running; /**< Running general-purpose routers with at least
+                        * CircuitBandwidthRate of capacity. */
+  bitarray_t *is_valid; /**< ...that are Valid. */
+  bitarray_t *stable; /**< ...that are Stable. */
+  bitarray_t *fast; /**< ...that are Fast. */
+  bitarray_t *guard; /**< ...that could be guards. */
+  bitarray_t *exit; /**< Running general-purpose routers, other than us,
+                     * that aren't BadExits and allow some exit. */
+} router_candidates_t;
+
+/** The candidate sets for the current routerlist. */
+static router_candidates_t router_candidates;
+
+/** Release the candidate sets and mark them for rebuilding. */
+static void
+router_candidates_clear(void)
+{
+  bitarray_free(router_candidates.running);
+  bitarray_free(router_candidates.is_valid);
+  bitarray_free(router_candidates.stable);
+  bitarray_free(router_candidates.fast);
+  bitarray_free(router_candidates.guard);
+  bitarray_free(router_candidates.exit);
+  memset(&router_candidates, 0, sizeof(router_candidates));
+}
+
+/** Return the candidate sets, rebuilding them if they're out of date, or
+ * NULL if they can't stand in for router_is_unreliable() right now. */
+static router_candidates_t *
+router_candidates_get(void)
+{
+  router_candidates_t *c = &router_candidates;
+  router_index_t *idx;
+  int n, i;
+
+  if (!routerlist)
+    return NULL;
+  /* Exit-seen filtering depends on the time; check each router then. */
+  if (tmpOptions->ExitSeenFlags & EXIT_SEEN_FLAG_ENABLED)
+    return NULL;
+  n = smartlist_len(routerlist->routers);
+  if (c->valid && c->n == n &&
+      c->bandwidth_rate == tmpOptions->CircuitBandwidthRate)
+    return c;
+  idx = router_index_get();
+
+  router_candidates_clear();
+  c->valid = 1;
+  c->n = n;
+  c->bandwidth_rate = tmpOptions->CircuitBandwidthRate;
+  c->running = bitarray_init_zero(n);
+  c->is_valid = bitarray_init_zero(n);
+  c->stable = bitarray_init_zero(n);
+  c->fast = bitarray_init_zero(n);
+  c->guard = bitarray_init_zero(n);
+  c->exit = bitarray_init_zero(n);
+  for (i = 0; i < n; ++i) {
+    uint16_t f = idx->flags[i];
+    if (!(f & RIDX_RUNNING))
+      continue;
+    if (f & RIDX_RANDOM_EXIT)
+      bitarray_set(c->exit, i);
+    if (c->bandwidth_rate && idx->capacity[i] < c->bandwidth_rate)
+      continue;
+    bitarray_set(c->running, i);
+    if (f & RIDX_VALID)
+      bitarray_set(c->is_valid, i);
+    if (f & RIDX_STABLE)
+      bitarray_set(c->stable, i);
+    if (f & RIDX_FAST)
+      bitarray_set(c->fast, i);
+    if (f & RIDX_GUARD)
+      bitarray_set(c->guard, i);
+  }
+  return c;
+}
+
+/** Return false if <b>router</b> can't be a randomly chosen exit because it
+ * isn't running, is a BadExit, rejects everything, isn't general-purpose or
+ * is us; return true otherwise. A true answer still leaves every other
+ * check to the caller. */
+int
+router_may_be_random_exit(routerinfo_t *router)
+{
+  router_candidates_t *c = router_candidates_get();
+  int idx = router->cache_info.routerlist_index;
+  if (!c || idx < 0 || idx >= c->n ||
+      smartlist_get(routerlist->routers, idx) != router)
+    return 1;
+  return bitarray_is_set(c->exit, idx) != 0;
+}
+
+/** Mark the candidate sets for rebuilding. */
+static void
+router_candidates_invalidate(void)
+{
+  router_candidates.valid = 0;
 }
 
 /** Add every suitable router from our routerlist to <b>sl</b>, so that
@@ -1437,9 +2218,33 @@ router_add_running_routers_to_smartlist(smartlist_t *sl, int allow_invalid,
                                         int need_uptime, int need_capacity,
                                         int need_guard)
 {
+  router_candidates_t *c;
+
   if (!routerlist)
     return;
 
+  if ((c = router_candidates_get())) {
+    /* Intersect the candidate sets a word at a time. */
+    int words = (c->n + BITARRAY_MASK) >> BITARRAY_SHIFT, i, bit;
+    for (i = 0; i < words; ++i) {
+      bitarray_t m = c->running[i];
+      if (!allow_invalid)
+        m &= c->is_valid[i];
+      if (need_uptime)
+        m &= c->stable[i];
+      if (need_capacity)
+        m &= c->fast[i];
+      if (need_guard)
+        m &= c->guard[i];
+      for (bit = 0; m; ++bit, m >>= 1) {
+        if (m & 1)
+          smartlist_add(sl, smartlist_get(routerlist->routers,
+                                          (i << BITARRAY_SHIFT) + bit));
+      }
+    }
+    return;
+  }
+
   SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
   {
     if (router->is_running &&
@@ -1479,20 +2284,17 @@ router_find_exact_exit_enclave(const char *address, uint16_t port)
 {
   uint32_t addr;
   struct in_addr in;
-  tor_addr_t a;
   or_options_t *options = get_options();
 
   if (!tor_inet_aton(address, &in))
     return NULL; /* it's not an IP already */
   addr = ntohl(in.s_addr);
 
-  tor_addr_from_ipv4h(&a, addr);
-
   SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
   {
     if (router->addr == addr &&
         router->is_running &&
-        compare_tor_addr_to_addr_policy(&a, port, router->exit_policy) ==
+        router_compare_addr_to_exit_policy(addr, port, router) ==
           ADDR_POLICY_ACCEPTED &&
         !routerset_contains_router(options->_ExcludeExitNodesUnion, router))
       return router;
@@ -1581,6 +2383,123 @@ kb_to_bytes(uint32_t bw)
   return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
 }
 
+/** The consensus bandwidth weights that one weighting rule gives guards,
+ * middles, exits and guard-exits, and the extra factors for directory
+ * caches of each kind, as fractions of the weight scale. */
+typedef struct bw_weights_t {
+  double Wg, Wm, We, Wd;
+  double Wgb, Wmb, Web, Wdb;
+} bw_weights_t;
+
+/** Helper: fill <b>w</b> with the bandwidth weights for <b>rule</b>.
+ * Return -1 if the consensus doesn't give usable weights, else 0. */
+static int
+bw_weights_for_rule_impl(bandwidth_weight_rule_t rule, bw_weights_t *w)
+{
+  int64_t weight_scale = circuit_build_times_get_bw_scale(NULL);
+
+  if (rule == WEIGHT_FOR_GUARD) {
+    w->Wg = networkstatus_get_bw_weight(NULL, "Wgg", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wgm", -1); /* Bridges */
+    w->We = 0;
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wgd", -1);
+
+    w->Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
+    w->Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
+    w->Web = networkstatus_get_bw_weight(NULL, "Web", -1);
+    w->Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
+  } else if (rule == WEIGHT_FOR_MID) {
+    w->Wg = networkstatus_get_bw_weight(NULL, "Wmg", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wmm", -1);
+    w->We = networkstatus_get_bw_weight(NULL, "Wme", -1);
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wmd", -1);
+
+    w->Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
+    w->Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
+    w->Web = networkstatus_get_bw_weight(NULL, "Web", -1);
+    w->Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
+  } else if (rule == WEIGHT_FOR_EXIT) {
+    // Guards CAN be exits if they have weird exit policies
+    // They are d then I guess...
+    w->We = networkstatus_get_bw_weight(NULL, "Wee", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wem", -1); /* Odd exit policies */
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wed", -1);
+    w->Wg = networkstatus_get_bw_weight(NULL, "Weg", -1); /* Odd exit policies */
+
+    w->Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
+    w->Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
+    w->Web = networkstatus_get_bw_weight(NULL, "Web", -1);
+    w->Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
+  } else if (rule == WEIGHT_FOR_DIR) {
+    w->We = networkstatus_get_bw_weight(NULL, "Wbe", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wbm", -1);
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wbd", -1);
+    w->Wg = networkstatus_get_bw_weight(NULL, "Wbg", -1);
+
+    w->Wgb = w->Wmb = w->Web = w->Wdb = weight_scale;
+  } else if (rule == NO_WEIGHTING) {
+    w->Wg = w->Wm = w->We = w->Wd = weight_scale;
+    w->Wgb = w->Wmb = w->Web = w->Wdb = weight_scale;
+  }
+
+  if (w->Wg < 0 || w->Wm < 0 || w->We < 0 || w->Wd < 0 ||
+      w->Wgb < 0 || w->Wmb < 0 || w->Wdb < 0 || w->Web < 0) {
+    log_debug(LD_CIRC,get_lang_str(LANG_LOG_ROUTERLIST_NEGATIVE_BW_WEIGHTS));
+    return -1;
+  }
+
+  w->Wg /= weight_scale;
+  w->Wm /= weight_scale;
+  w->We /= weight_scale;
+  w->Wd /= weight_scale;
+
+  w->Wgb /= weight_scale;
+  w->Wmb /= weight_scale;
+  w->Web /= weight_scale;
+  w->Wdb /= weight_scale;
+  return 0;
+}
+
+/** The bandwidth weights for each bandwidth_weight_rule_t in the current
+ * consensus. */
+static bw_weights_t bw_weights_cache[WEIGHT_FOR_DIR+1];
+/** For each rule, 1 if bw_weights_cache holds its weights, -1 if the
+ * consensus doesn't give usable weights for it, 0 if we don't know yet. */
+static int bw_weights_cache_state[WEIGHT_FOR_DIR+1];
+
+/** As bw_weights_for_rule_impl(), but only look the weights up in the
+ * consensus once for each rule, until the directory information changes. */
+static int
+bw_weights_for_rule(bandwidth_weight_rule_t rule, bw_weights_t *w)
+{
+  tor_assert((int)rule >= 0 && rule <= WEIGHT_FOR_DIR);
+  if (!bw_weights_cache_state[rule]) {
+    bw_weights_cache_state[rule] =
+      bw_weights_for_rule_impl(rule, &bw_weights_cache[rule]) < 0 ? -1 : 1;
+  }
+  if (bw_weights_cache_state[rule] < 0)
+    return -1;
+  *w = bw_weights_cache[rule];
+  return 0;
+}
+
+/** Helper: return the weight that <b>w</b> gives a relay with these
+ * flags. */
+static INLINE double
+bw_weights_for_flags(const bw_weights_t *w, int is_guard, int is_exit,
+                     int is_dir)
+{
+  if (is_guard && is_exit) {
+    return (is_dir ? w->Wdb*w->Wd : w->Wd);
+  } else if (is_guard) {
+    return (is_dir ? w->Wgb*w->Wg : w->Wg);
+  } else if (is_exit) {
+    return (is_dir ? w->Web*w->We : w->We);
+  } else { // middle
+    return (is_dir ? w->Wmb*w->Wm : w->Wm);
+  }
+}
+
 /** Helper function:
  * choose a random element of smartlist <b>sl</b>, weighted by
  * the advertised bandwidth of each element using the consensus
@@ -1603,10 +2522,8 @@ smartlist_choose_by_bandwidth_weights(smartlist_t *sl,
                                       bandwidth_weight_rule_t rule,
                                       int statuses)
 {
-  int64_t weight_scale;
   int64_t rand_bw;
-  double Wg = -1, Wm = -1, We = -1, Wd = -1;
-  double Wgb = -1, Wmb = -1, Web = -1, Wdb = -1;
+  bw_weights_t w;
   double weighted_bw = 0;
   double *bandwidths;
   double tmp = 0;
@@ -1627,67 +2544,8 @@ smartlist_choose_by_bandwidth_weights(smartlist_t *sl,
     return NULL;
   }
 
-  weight_scale = circuit_build_times_get_bw_scale(NULL);
-
-  if (rule == WEIGHT_FOR_GUARD) {
-    Wg = networkstatus_get_bw_weight(NULL, "Wgg", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wgm", -1); /* Bridges */
-    We = 0;
-    Wd = networkstatus_get_bw_weight(NULL, "Wgd", -1);
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_MID) {
-    Wg = networkstatus_get_bw_weight(NULL, "Wmg", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wmm", -1);
-    We = networkstatus_get_bw_weight(NULL, "Wme", -1);
-    Wd = networkstatus_get_bw_weight(NULL, "Wmd", -1);
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_EXIT) {
-    // Guards CAN be exits if they have weird exit policies
-    // They are d then I guess...
-    We = networkstatus_get_bw_weight(NULL, "Wee", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wem", -1); /* Odd exit policies */
-    Wd = networkstatus_get_bw_weight(NULL, "Wed", -1);
-    Wg = networkstatus_get_bw_weight(NULL, "Weg", -1); /* Odd exit policies */
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_DIR) {
-    We = networkstatus_get_bw_weight(NULL, "Wbe", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wbm", -1);
-    Wd = networkstatus_get_bw_weight(NULL, "Wbd", -1);
-    Wg = networkstatus_get_bw_weight(NULL, "Wbg", -1);
-
-    Wgb = Wmb = Web = Wdb = weight_scale;
-  } else if (rule == NO_WEIGHTING) {
-    Wg = Wm = We = Wd = weight_scale;
-    Wgb = Wmb = Web = Wdb = weight_scale;
-  }
-
-  if (Wg < 0 || Wm < 0 || We < 0 || Wd < 0 || Wgb < 0 || Wmb < 0 || Wdb < 0
-      || Web < 0) {
-    log_debug(LD_CIRC,get_lang_str(LANG_LOG_ROUTERLIST_NEGATIVE_BW_WEIGHTS));
+  if (bw_weights_for_rule(rule, &w) < 0)
     return NULL; // Use old algorithm.
-  }
-
-  Wg /= weight_scale;
-  Wm /= weight_scale;
-  We /= weight_scale;
-  Wd /= weight_scale;
-
-  Wgb /= weight_scale;
-  Wmb /= weight_scale;
-  Web /= weight_scale;
-  Wdb /= weight_scale;
 
   bandwidths = tor_malloc_zero(sizeof(double)*smartlist_len(sl));
 
@@ -1726,15 +2584,7 @@ smartlist_choose_by_bandwidth_weights(smartlist_t *sl,
       if (router_digest_is_me(router->cache_info.identity_digest))
         is_me = 1;
     }
-    if (is_guard && is_exit) {
-      weight = (is_dir ? Wdb*Wd : Wd);
-    } else if (is_guard) {
-      weight = (is_dir ? Wgb*Wg : Wg);
-    } else if (is_exit) {
-      weight = (is_dir ? Web*We : We);
-    } else { // middle
-      weight = (is_dir ? Wmb*Wm : Wm);
-    }
+    weight = bw_weights_for_flags(&w, is_guard, is_exit, is_dir);
 
     bandwidths[i] = weight*this_bw;
     weighted_bw += weight*this_bw;
@@ -1745,7 +2595,7 @@ smartlist_choose_by_bandwidth_weights(smartlist_t *sl,
   /* XXXX023 this is a kludge to expose these values. */
   sl_last_total_weighted_bw = tor_lround(weighted_bw);
 
-  log_debug(LD_CIRC,get_lang_str(LANG_LOG_ROUTERLIST_CHOOSING_NODE),bandwidth_weight_rule_to_string(rule),Wg,Wm,We,Wd,weighted_bw);
+  log_debug(LD_CIRC,get_lang_str(LANG_LOG_ROUTERLIST_CHOOSING_NODE),bandwidth_weight_rule_to_string(rule),w.Wg,w.Wm,w.We,w.Wd,weighted_bw);
 
   /* If there is no bandwidth, choose at random */
   if (DBL_TO_U64(weighted_bw) == 0) {
@@ -2043,6 +2893,192 @@ smartlist_choose_by_bandwidth(smartlist_t *sl, bandwidth_weight_rule_t rule,
   return smartlist_get(sl, i);
 }
 
+/** A Walker/Vose alias table over every router in the routerlist that has a
+ * consensus bandwidth, weighted for one rule the way
+ * smartlist_choose_by_bandwidth_weights() would weight it.  Sampling it
+ * costs O(1); picks from a subset of the routers resample until they hit
+ * the subset, which gives the same distribution as weighting the subset. */
+typedef struct router_alias_table_t {
+  int valid; /**< False if the table must be rebuilt before use. */
+  int usable; /**< False if the consensus gave no usable weights. */
+  int n; /**< How many slots are in the table? */
+  routerinfo_t **routers; /**< The router in each slot. */
+  double *weight; /**< The weighted bandwidth of each slot's router. */
+  double total; /**< The sum of <b>weight</b>. */
+  double *prob; /**< Chance of keeping a slot's own router once drawn. */
+  int *alias; /**< The slot to take instead, otherwise. */
+  int n_slot_of; /**< How many entries are in <b>slot_of</b>? */
+  int *slot_of; /**< Slot of each routerlist index, or -1 if none. */
+} router_alias_table_t;
+
+/** Alias tables for WEIGHT_FOR_GUARD, WEIGHT_FOR_MID and WEIGHT_FOR_EXIT. */
+static router_alias_table_t router_alias_tables[3];
+
+/** Give up on an alias table pick after this many draws. */
+#define ALIAS_TABLE_MAX_DRAWS 256
+/** Don't use an alias table for a subset with less than this fraction of
+ * its weight: too many draws would miss. */
+#define ALIAS_TABLE_MIN_SUBSET_SHARE (1.0/16)
+
+/** Release the contents of <b>t</b> and mark it for rebuilding. */
+static void
+router_alias_table_clear(router_alias_table_t *t)
+{
+  tor_free(t->routers);
+  tor_free(t->weight);
+  tor_free(t->prob);
+  tor_free(t->alias);
+  tor_free(t->slot_of);
+  memset(t, 0, sizeof(router_alias_table_t));
+}
+
+/** Mark every alias table for rebuilding: the routerlist, the consensus or
+ * the flags of some router have changed. */
+static void
+router_alias_tables_invalidate(void)
+{
+  int i;
+  for (i = 0; i < 3; ++i)
+    router_alias_tables[i].valid = 0;
+}
+
+/** Return the alias table for <b>rule</b>, building it first if it's out of
+ * date, or NULL if <b>rule</b> has no table or the consensus can't weight
+ * it. */
+static router_alias_table_t *
+router_alias_table_get(bandwidth_weight_rule_t rule)
+{
+  router_alias_table_t *t;
+  routerlist_t *rl = router_get_routerlist();
+  router_index_t *idx;
+  bw_weights_t w;
+  double *scaled;
+  int *small, *large;
+  int n_small = 0, n_large = 0, n_routers, i;
+
+  switch (rule) {
+    case WEIGHT_FOR_GUARD: t = &router_alias_tables[0]; break;
+    case WEIGHT_FOR_MID: t = &router_alias_tables[1]; break;
+    case WEIGHT_FOR_EXIT: t = &router_alias_tables[2]; break;
+    default: return NULL;
+  }
+  if (t->valid)
+    return t->usable ? t : NULL;
+
+  router_alias_table_clear(t);
+  t->valid = 1;
+  if (bw_weights_for_rule(rule, &w) < 0)
+    return NULL;
+  n_routers = smartlist_len(rl->routers);
+  if (!n_routers)
+    return NULL;
+  idx = router_index_get();
+  t->routers = tor_malloc(sizeof(routerinfo_t *)*n_routers);
+  t->weight = tor_malloc(sizeof(double)*n_routers);
+  t->slot_of = tor_malloc(sizeof(int)*n_routers);
+  t->n_slot_of = n_routers;
+  for (i = 0; i < n_routers; ++i) {
+    uint16_t f = idx->flags[i];
+    double weight;
+    t->slot_of[i] = -1;
+    if (idx->consensus_bw[i] < 0)
+      continue; /* weighted by its descriptor instead; no table pick */
+    weight = bw_weights_for_flags(&w, (f & RIDX_GUARD) != 0,
+                                  (f & RIDX_EXIT) != 0,
+                                  (f & RIDX_DIR) != 0) *
+             kb_to_bytes(idx->consensus_bw[i]);
+    t->slot_of[i] = t->n;
+    t->routers[t->n] = smartlist_get(rl->routers, i);
+    t->weight[t->n] = weight;
+    t->total += weight;
+    t->n++;
+  }
+  if (!t->n || t->total <= 0)
+    return NULL;
+
+  /* Vose's method: split the slots into those below and above the mean
+   * weight, and let each light slot borrow the rest of its share from a
+   * heavy one. */
+  t->prob = tor_malloc(sizeof(double)*t->n);
+  t->alias = tor_malloc(sizeof(int)*t->n);
+  scaled = tor_malloc(sizeof(double)*t->n);
+  small = tor_malloc(sizeof(int)*t->n);
+  large = tor_malloc(sizeof(int)*t->n);
+  for (i = 0; i < t->n; ++i) {
+    scaled[i] = t->weight[i] * t->n / t->total;
+    t->alias[i] = i;
+    if (scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+  while (n_small && n_large) {
+    int s = small[--n_small], l = large[--n_large];
+    t->prob[s] = scaled[s];
+    t->alias[s] = l;
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if (scaled[l] < 1.0)
+      small[n_small++] = l;
+    else
+      large[n_large++] = l;
+  }
+  /* Whatever is left is at the mean, give or take round-off. */
+  while (n_large)
+    t->prob[large[--n_large]] = 1.0;
+  while (n_small)
+    t->prob[small[--n_small]] = 1.0;
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+  t->usable = 1;
+  return t;
+}
+
+/** Choose a random router of <b>sl</b>, weighted for <b>rule</b>, from its
+ * alias table.  Return NULL if there's no table for <b>rule</b>, if some
+ * router of <b>sl</b> isn't in it, or if <b>sl</b> is too small a part of
+ * it; the caller should then weight <b>sl</b> itself. */
+static routerinfo_t *
+routerlist_sl_choose_by_alias_table(smartlist_t *sl,
+                                    bandwidth_weight_rule_t rule)
+{
+  router_alias_table_t *t;
+  routerinfo_t *choice = NULL;
+  char *in_sl;
+  double sl_weight = 0;
+  int draws, slot;
+
+  if (!smartlist_len(sl) || !(t = router_alias_table_get(rule)))
+    return NULL;
+  in_sl = tor_malloc_zero(t->n);
+  SMARTLIST_FOREACH_BEGIN(sl, routerinfo_t *, router) {
+    int idx = router->cache_info.routerlist_index;
+    if (idx < 0 || idx >= t->n_slot_of || (slot = t->slot_of[idx]) < 0 ||
+        t->routers[slot] != router) {
+      tor_free(in_sl);
+      return NULL;
+    }
+    if (!in_sl[slot]) {
+      in_sl[slot] = 1;
+      sl_weight += t->weight[slot];
+    }
+  } SMARTLIST_FOREACH_END(router);
+
+  if (sl_weight > 0 && sl_weight >= t->total * ALIAS_TABLE_MIN_SUBSET_SHARE) {
+    for (draws = 0; draws < ALIAS_TABLE_MAX_DRAWS; ++draws) {
+      slot = crypto_rand_int(t->n);
+      if (crypto_rand_double() >= t->prob[slot])
+        slot = t->alias[slot];
+      if (in_sl[slot]) {
+        choice = t->routers[slot];
+        break;
+      }
+    }
+  }
+  tor_free(in_sl);
+  return choice;
+}
+
 /** Choose a random element of router list <b>sl</b>, weighted by
  * the advertised bandwidth of each router.
  */
@@ -2051,7 +3087,9 @@ routerlist_sl_choose_by_bandwidth(smartlist_t *sl,
                                   bandwidth_weight_rule_t rule)
 {
   routerinfo_t *ret;
-  if ((ret = smartlist_choose_by_bandwidth_weights(sl, rule, 0))) {
+  if ((ret = routerlist_sl_choose_by_alias_table(sl, rule))) {
+    return ret;
+  } else if ((ret = smartlist_choose_by_bandwidth_weights(sl, rule, 0))) {
     return ret;
   } else {
     return smartlist_choose_by_bandwidth(sl, rule, 0);
@@ -2103,8 +3141,8 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int allow_invalid = (flags & CRN_ALLOW_INVALID) != 0;
   const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
 
-  smartlist_t *sl=smartlist_create(),
-              *excludednodes=smartlist_create();
+  SMARTLIST_LOCAL(excludednodes_local, 16);
+  smartlist_t *sl=smartlist_create(), *excludednodes=&excludednodes_local;
   routerinfo_t *choice = NULL, *r;
   bandwidth_weight_rule_t rule;
 
@@ -2130,9 +3168,9 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   router_add_running_routers_to_smartlist(sl, allow_invalid,
                                           need_uptime, need_capacity,
                                           need_guard);
-  smartlist_subtract(sl,excludednodes);
+  routerlist_subtract_routers(sl,excludednodes);
   if (excludedsmartlist)
-    smartlist_subtract(sl,excludedsmartlist);
+    routerlist_subtract_routers(sl,excludedsmartlist);
   if (excludedset)
     routerset_subtract_routers(sl,excludedset);
 
@@ -2150,7 +3188,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
     choice = router_choose_random_node(
                      excludedsmartlist, excludedset, flags);
   }
-  smartlist_free(excludednodes);
+  smartlist_local_free(excludednodes);
   if (!choice)
 	log_warn(LD_CIRC,get_lang_str(LANG_LOG_ROUTERLIST_NO_LIVE_ROUTERS_3));
   return choice;
@@ -2222,6 +3260,7 @@ router_get_by_nickname(const char *nickname, int warn_if_unnamed)
   routerinfo_t *best_match=NULL;
   int n_matches = 0;
   const char *named_digest = NULL;
+  smartlist_t *matches;
 
   tor_assert(nickname);
   if (!routerlist)
@@ -2242,34 +3281,35 @@ router_get_by_nickname(const char *nickname, int warn_if_unnamed)
 
   /* If we reach this point, there's no canonical value for the nickname. */
 
-  SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
-  {
-    if (!strcasecmp(router->nickname, nickname)) {
+  if (maybedigest) {
+    routerinfo_t *router = rimap_get(routerlist->identity_map, digest);
+    if (router && router_hex_digest_matches(router, nickname))
+      return router;
+    /* If we reach this point, we have a ID=name syntax that matches the
+     * identity but not the name, or no router. That isn't an acceptable
+     * match. */
+  }
+
+  matches = strmap_get_lc(routerlist->nickname_map, nickname);
+  if (matches) {
+    SMARTLIST_FOREACH(matches, routerinfo_t *, router,
+    {
       ++n_matches;
       if (n_matches <= 1 || router->is_running)
         best_match = router;
-    } else if (maybedigest &&
-               tor_memeq(digest, router->cache_info.identity_digest,
-                         DIGEST_LEN)) {
-      if (router_hex_digest_matches(router, nickname))
-        return router;
-      /* If we reach this point, we have a ID=name syntax that matches the
-       * identity but not the name. That isn't an acceptable match. */
-    }
-  });
+    });
+  }
 
   if (best_match) {
     if (warn_if_unnamed && n_matches > 1) {
       smartlist_t *fps = smartlist_create();
       int any_unwarned = 0;
-      SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
+      SMARTLIST_FOREACH(matches, routerinfo_t *, router,
         {
           routerstatus_t *rs;
           char *desc;
           size_t dlen;
           char fp[HEX_DIGEST_LEN+1];
-          if (strcasecmp(router->nickname, nickname))
-            continue;
           rs = router_get_consensus_status_by_id(
                                           router->cache_info.identity_digest);
           if (rs && !rs->name_lookup_warned) {
@@ -2477,6 +3517,8 @@ signed_descriptor_get_body_impl(signed_descriptor_t *desc,
   else
     offset += desc->annotations_len;
 
+  if (!len) /* Built from a microdescriptor: there is no body. */
+    return NULL;
   tor_assert(len > 32);
   if (desc->saved_location == SAVED_IN_CACHE && routerlist) {
     desc_store_t *store = desc_get_store(router_get_routerlist(), desc);
@@ -2536,6 +3578,7 @@ router_get_routerlist(void)
     routerlist->routers = smartlist_create();
     routerlist->old_routers = smartlist_create();
     routerlist->identity_map = rimap_new();
+    routerlist->nickname_map = strmap_new();
     routerlist->desc_digest_map = sdmap_new();
     routerlist->desc_by_eid_map = sdmap_new();
     routerlist->extra_info_map = eimap_new();
@@ -2563,17 +3606,18 @@ routerinfo_free(routerinfo_t *router)
   tor_free(router->cache_info.signed_descriptor_body);
   tor_free(router->address);
   tor_free(router->nickname);
-  tor_free(router->platform);
-  tor_free(router->contact_info);
+  router_release_string(router->platform);
+  router_release_string(router->contact_info);
   if (router->onion_pkey)
     crypto_free_pk_env(router->onion_pkey);
   if (router->identity_pkey)
     crypto_free_pk_env(router->identity_pkey);
   if (router->declared_family) {
-    SMARTLIST_FOREACH(router->declared_family, char *, s, tor_free(s));
+    SMARTLIST_FOREACH(router->declared_family, char *, s,
+                      router_release_string(s));
     smartlist_free(router->declared_family);
   }
-  addr_policy_list_free(router->exit_policy);
+  router_free_exit_policy(router);
 
   /* XXXX Remove if this turns out to affect performance. */
   memset(router, 77, sizeof(routerinfo_t));
@@ -2661,7 +3705,13 @@ routerlist_free(routerlist_t *rl)
 {
   if (!rl)
     return;
+  sorted_exits_invalidate();
   rimap_free(rl->identity_map, NULL);
+  STRMAP_FOREACH(rl->nickname_map, nickname, smartlist_t *, sl) {
+    (void)nickname;
+    smartlist_free(sl);
+  } STRMAP_FOREACH_END;
+  strmap_free(rl->nickname_map, NULL);
   sdmap_free(rl->desc_digest_map, NULL);
   sdmap_free(rl->desc_by_eid_map, NULL);
   eimap_free(rl->extra_info_map, _extrainfo_free);
@@ -2680,6 +3730,22 @@ routerlist_free(routerlist_t *rl)
   router_dir_info_changed();
 }
 
+/** Return how many bytes of descriptors the routerlist holds, live and
+ * superseded, with their annotations. */
+size_t
+routerlist_get_mem_usage(void)
+{
+  size_t n = 0;
+  if (!routerlist)
+    return 0;
+  SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, r,
+                    n += r->cache_info.signed_descriptor_len +
+                         r->cache_info.annotations_len);
+  SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                    n += sd->signed_descriptor_len + sd->annotations_len);
+  return n;
+}
+
 /** Log information about how much memory is being used for routerlist,
  * at log level <b>severity</b>. */
 void
@@ -2754,6 +3820,32 @@ _routerlist_find_elt(smartlist_t *sl, void *ri, int idx)
   return idx;
 }
 
+/** Add <b>ri</b> to the nickname map of <b>rl</b>. */
+static void
+routerlist_nickname_map_add(routerlist_t *rl, routerinfo_t *ri)
+{
+  smartlist_t *sl = strmap_get_lc(rl->nickname_map, ri->nickname);
+  if (!sl) {
+    sl = smartlist_create();
+    strmap_set_lc(rl->nickname_map, ri->nickname, sl);
+  }
+  smartlist_add(sl, ri);
+}
+
+/** Remove <b>ri</b> from the nickname map of <b>rl</b>. */
+static void
+routerlist_nickname_map_remove(routerlist_t *rl, routerinfo_t *ri)
+{
+  smartlist_t *sl = strmap_get_lc(rl->nickname_map, ri->nickname);
+  if (!sl)
+    return;
+  smartlist_remove(sl, ri);
+  if (!smartlist_len(sl)) {
+    strmap_remove_lc(rl->nickname_map, ri->nickname);
+    smartlist_free(sl);
+  }
+}
+
 /** Insert an item <b>ri</b> into the routerlist <b>rl</b>, updating indices
  * as needed.  There must be no previous member of <b>rl</b> with the same
  * identity digest as <b>ri</b>: If there is, call routerlist_replace
@@ -2773,6 +3865,7 @@ routerlist_insert(routerlist_t *rl, routerinfo_t *ri)
 
   ri_old = rimap_set(rl->identity_map, ri->cache_info.identity_digest, ri);
   tor_assert(!ri_old);
+  routerlist_nickname_map_add(rl, ri);
   sd_old = sdmap_set(rl->desc_digest_map,
                      ri->cache_info.signed_descriptor_digest,
                      &(ri->cache_info));
@@ -2794,6 +3887,7 @@ routerlist_insert(routerlist_t *rl, routerinfo_t *ri)
               &ri->cache_info);
   smartlist_add(rl->routers, ri);
   ri->cache_info.routerlist_index = smartlist_len(rl->routers) - 1;
+  sorted_exits_add(ri);
   router_dir_info_changed();
 #ifdef DEBUG_ROUTERLIST
   routerlist_assert_ok(rl);
@@ -2875,6 +3969,7 @@ routerlist_remove(routerlist_t *rl, routerinfo_t *ri, int make_old, time_t now)
   /* make sure the rephist module knows that it's not running */
   rep_hist_note_router_unreachable(ri->cache_info.identity_digest, now);
 
+  sorted_exits_remove(ri);
   ri->cache_info.routerlist_index = -1;
   smartlist_del(rl->routers, idx);
   if (idx < smartlist_len(rl->routers)) {
@@ -2884,6 +3979,7 @@ routerlist_remove(routerlist_t *rl, routerinfo_t *ri, int make_old, time_t now)
   plugins_routerchanged(ri->addr,ri->cache_info.identity_digest,0);
 
   ri_tmp = rimap_remove(rl->identity_map, ri->cache_info.identity_digest);
+  routerlist_nickname_map_remove(rl, ri);
   router_dir_info_changed();
   tor_assert(ri_tmp == ri);
 
@@ -2997,8 +4093,10 @@ routerlist_replace(routerlist_t *rl, routerinfo_t *ri_old,
 
   router_dir_info_changed();
   if (idx >= 0) {
+    sorted_exits_remove(ri_old);
     smartlist_set(rl->routers, idx, ri_new);
     ri_new->router_id = ri_old->router_id;
+    sorted_exits_add(ri_new);
     ri_old->cache_info.routerlist_index = -1;
     ri_new->cache_info.routerlist_index = idx;
     /* Check that ri_old is not in rl->routers anymore: */
@@ -3016,6 +4114,8 @@ routerlist_replace(routerlist_t *rl, routerinfo_t *ri_old,
   ri_tmp = rimap_set(rl->identity_map,
                      ri_new->cache_info.identity_digest, ri_new);
   tor_assert(!ri_tmp || ri_tmp == ri_old);
+  routerlist_nickname_map_remove(rl, ri_old);
+  routerlist_nickname_map_add(rl, ri_new);
   sdmap_set(rl->desc_digest_map,
             ri_new->cache_info.signed_descriptor_digest,
             &(ri_new->cache_info));
@@ -3099,9 +4199,17 @@ routerlist_reparse_old(routerlist_t *rl, signed_descriptor_t *sd)
 void
 routerlist_free_all(void)
 {
+  int i;
+  for (i = 0; i < 3; ++i)
+    router_alias_table_clear(&router_alias_tables[i]);
+  router_candidates_clear();
+  router_country_sets_clear();
+  router_index_clear();
   if (routerlist)
     routerlist_free(routerlist);
   routerlist = NULL;
+  router_interned_strings_free_all();
+  compiled_nickname_lists_free_all();
   if (warned_nicknames) {
     SMARTLIST_FOREACH(warned_nicknames, char *, cp, tor_free(cp));
     smartlist_free(warned_nicknames);
@@ -3415,6 +4523,18 @@ _compare_duration_idx(const void *_d1, const void *_d2)
   return d1->duration - d2->duration;
 }
 
+/** Return how many old descriptors we keep for each router: as many as
+ * MaxOldDescriptorsPerRouter says, or by default 2 if we're a directory
+ * cache and 1 otherwise. */
+static INLINE int
+max_descriptors_per_router(void)
+{
+  or_options_t *options = get_options();
+  if (options->MaxOldDescriptorsPerRouter)
+    return options->MaxOldDescriptorsPerRouter;
+  return directory_caches_dir_info(options) ? 2 : 1;
+}
+
 /** The range <b>lo</b> through <b>hi</b> inclusive of routerlist->old_routers
  * must contain routerinfo_t with the same identity and with publication time
  * in ascending order.  Remove members from this range until there are no more
@@ -3445,7 +4565,7 @@ routerlist_remove_old_cached_routers_with_id(time_t now,
 #endif
   /* Check whether we need to do anything at all. */
   {
-    int mdpr = directory_caches_dir_info(get_options()) ? 2 : 1;
+    int mdpr = max_descriptors_per_router();
     if (n <= mdpr)
       return;
     n_extra = n - mdpr;
@@ -3504,6 +4624,41 @@ routerlist_remove_old_cached_routers_with_id(time_t now,
   tor_free(lifespans);
 }
 
+/** If the members of routerlist->old_routers take more than
+ * MaxOldDescriptorBytes, remove the oldest of them that nobody lists any
+ * more until they don't.  Keep the ones in <b>retain</b>. */
+static void
+routerlist_remove_old_routers_over_limit(time_t now, digestset_t *retain)
+{
+  uint64_t limit = get_options()->MaxOldDescriptorBytes;
+  uint64_t total = 0;
+  smartlist_t *by_age;
+  int i, n_removed = 0;
+
+  if (!limit)
+    return;
+  SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                    total += sd->signed_descriptor_len + sd->annotations_len);
+  if (total <= limit)
+    return;
+
+  by_age = smartlist_create();
+  smartlist_add_all(by_age, routerlist->old_routers);
+  smartlist_sort(by_age, _compare_signed_descriptors_by_age);
+  for (i = 0; i < smartlist_len(by_age) && total > limit; ++i) {
+    signed_descriptor_t *sd = smartlist_get(by_age, i);
+    if (sd->last_listed_as_valid_until >= now ||
+        digestset_isin(retain, sd->signed_descriptor_digest))
+      continue;
+    total -= sd->signed_descriptor_len + sd->annotations_len;
+    routerlist_remove_old(routerlist, sd, -1);
+    ++n_removed;
+  }
+  smartlist_free(by_age);
+  log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_OLD_DESCS_OVER_LIMIT),
+           n_removed);
+}
+
 /** Deactivate any routers from the routerlist that are more than
  * ROUTER_MAX_AGE seconds old and not recommended by any networkstatuses;
  * remove old routers from the list of cached routers if we have too many.
@@ -3583,7 +4738,7 @@ void routerlist_remove_old_routers(void)
 	log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_ROUTER_STATS),smartlist_len(routerlist->routers),smartlist_len(routerlist->old_routers));
 
 	/* Now we might have to look at routerlist->old_routers for extraneous members. (We'd keep all the members if we could, but we need to save space.) First, check whether we have too many router descriptors, total. We're okay with having too many for some given router, so long as the total number doesn't approach max_descriptors_per_router()*len(router). */
-	if(smartlist_len(routerlist->old_routers) >= smartlist_len(routerlist->routers))
+	if(smartlist_len(routerlist->old_routers) >= smartlist_len(routerlist->routers) || get_options()->MaxOldDescriptorsPerRouter)
 	{	/* Sort by identity, then fix indices. */
 		smartlist_sort(routerlist->old_routers, _compare_old_routers_by_identity);
 		/* Fix indices. */
@@ -3606,6 +4761,8 @@ void routerlist_remove_old_routers(void)
 		}
 		if(hi>=0)	routerlist_remove_old_cached_routers_with_id(now,cutoff,0,hi,retain);
 	}
+	/* Then keep the old descriptors under MaxOldDescriptorBytes, if we have to. */
+	routerlist_remove_old_routers_over_limit(now, retain);
 	digestset_free(retain);
 	router_rebuild_store(RRS_DONT_REMOVE_OLD, &routerlist->desc_store);
 	router_rebuild_store(RRS_DONT_REMOVE_OLD,&routerlist->extrainfo_store);
@@ -3712,6 +4869,20 @@ router_load_routers_from_string(const char *s, const char *eos,
                                 smartlist_t *requested_fingerprints,
                                 int descriptor_digests,
                                 const char *prepend_annotations)
+{
+  return router_load_routers_impl(s, eos, saved_location,
+                                  requested_fingerprints, descriptor_digests,
+                                  prepend_annotations, 0);
+}
+
+/** As router_load_routers_from_string(), passing <b>parse_flags</b> on to
+ * router_parse_list_from_string(). */
+static int
+router_load_routers_impl(const char *s, const char *eos,
+                         saved_location_t saved_location,
+                         smartlist_t *requested_fingerprints,
+                         int descriptor_digests,
+                         const char *prepend_annotations, int parse_flags)
 {
   smartlist_t *routers = smartlist_create(), *changed = smartlist_create();
   char fp[HEX_DIGEST_LEN+1];
@@ -3721,7 +4892,8 @@ router_load_routers_from_string(const char *s, const char *eos,
   int any_changed = 0;
 
   router_parse_list_from_string(&s, eos, routers, saved_location, 0,
-                                allow_annotations, prepend_annotations);
+                                allow_annotations, prepend_annotations,
+                                parse_flags);
 
   routers_update_status_from_consensus_networkstatus(routers, !from_cache);
 
@@ -3789,7 +4961,7 @@ router_load_extrainfo_from_string(const char *s, const char *eos,
   int from_cache = (saved_location != SAVED_NOWHERE);
 
   router_parse_list_from_string(&s, eos, extrainfo_list, saved_location, 1, 0,
-                                NULL);
+                                NULL, 0);
 
   log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_TO_ADD),smartlist_len(extrainfo_list));
 
@@ -3869,7 +5041,7 @@ router_exit_policy_all_routers_reject(uint32_t addr, uint16_t port,
   {
     if (router->is_running &&
         !router_is_unreliable(router, need_uptime, 0, 0)) {
-      r = compare_addr_to_addr_policy(addr, port, router->exit_policy);
+      r = router_compare_addr_to_exit_policy(addr, port, router);
       if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
         return 0; /* this one could be ok. good enough. */
     }
@@ -4010,8 +5182,10 @@ any_trusted_dir_is_v1_authority(void)
 
 /** For every current directory connection whose purpose is <b>purpose</b>,
  * and where the resource being downloaded begins with <b>prefix</b>, split
- * rest of the resource into base16 fingerprints, decode them, and set the
- * corresponding elements of <b>result</b> to a nonzero value. */
+ * rest of the resource into base16 fingerprints (or base64 microdescriptor
+ * digests, for DIR_PURPOSE_FETCH_MICRODESC), decode them, and set the
+ * corresponding elements of <b>result</b> to a nonzero value.  Microdesc
+ * digests are keyed by their first DIGEST_LEN bytes. */
 static void
 list_pending_downloads(digestmap_t *result,
                        int purpose, const char *prefix)
@@ -4019,6 +5193,9 @@ list_pending_downloads(digestmap_t *result,
   const size_t p_len = strlen(prefix);
   smartlist_t *tmp = smartlist_create();
   smartlist_t *conns = get_connection_array();
+  int flags = DSR_HEX;
+  if (purpose == DIR_PURPOSE_FETCH_MICRODESC)
+    flags = DSR_DIGEST256|DSR_BASE64;
 
   tor_assert(result);
 
@@ -4030,7 +5207,7 @@ list_pending_downloads(digestmap_t *result,
       const char *resource = TO_DIR_CONN(conn)->requested_resource;
       if (!strcmpstart(resource, prefix))
         dir_split_resource_into_fingerprints(resource + p_len,
-                                             tmp, NULL, DSR_HEX);
+                                             tmp, NULL, flags);
     }
   });
   SMARTLIST_FOREACH(tmp, char *, d,
@@ -4055,7 +5232,9 @@ list_pending_descriptor_downloads(digestmap_t *result, int extrainfo)
 /** Launch downloads for all the descriptors whose digests are listed
  * as digests[i] for lo <= i < hi.  (Lo and hi may be out of range.)
  * If <b>source</b> is given, download from <b>source</b>; otherwise,
- * download from an appropriate random directory server.
+ * download from an appropriate random directory server.  For
+ * DIR_PURPOSE_FETCH_MICRODESC, the digests are DIGEST256_LEN bytes long and
+ * go in the request in base64.
  */
 static void
 initiate_descriptor_downloads(routerstatus_t *source,
@@ -4066,6 +5245,9 @@ initiate_descriptor_downloads(routerstatus_t *source,
   int i, n = hi-lo;
   char *resource, *cp;
   size_t r_len;
+  int b64_256 = purpose == DIR_PURPOSE_FETCH_MICRODESC;
+  size_t enc_len = b64_256 ? BASE64_DIGEST256_LEN : HEX_DIGEST_LEN;
+  char sep = b64_256 ? '-' : '+';
   if (n <= 0)
     return;
   if (lo < 0)
@@ -4073,15 +5255,21 @@ initiate_descriptor_downloads(routerstatus_t *source,
   if (hi > smartlist_len(digests))
     hi = smartlist_len(digests);
 
-  r_len = 8 + (HEX_DIGEST_LEN+1)*n;
+  r_len = 8 + (enc_len+1)*n;
   cp = resource = tor_malloc(r_len);
   memcpy(cp, "d/", 2);
   cp += 2;
   for (i = lo; i < hi; ++i) {
-    base16_encode(cp, r_len-(cp-resource),
-                  smartlist_get(digests,i), DIGEST_LEN);
-    cp += HEX_DIGEST_LEN;
-    *cp++ = '+';
+    if (b64_256) {
+      char b64[BASE64_DIGEST256_LEN+1];
+      digest256_to_base64(b64, smartlist_get(digests,i));
+      memcpy(cp, b64, BASE64_DIGEST256_LEN);
+    } else {
+      base16_encode(cp, r_len-(cp-resource),
+                    smartlist_get(digests,i), DIGEST_LEN);
+    }
+    cp += enc_len;
+    *cp++ = sep;
   }
   memcpy(cp-1, ".z", 3);
 
@@ -4128,6 +5316,11 @@ client_would_use_router(routerstatus_t *rs, time_t now, or_options_t *options)
  *   So use 96 because it's a nice number.
  */
 #define MAX_DL_PER_REQUEST 96
+/** Max amount of microdescriptor hashes to download per request.
+ *   4058/44 (43 for the base64 hash and 1 for the - that separates them),
+ *   less the "micro" in the URL, => 92
+ */
+#define MAX_MICRODESC_DL_PER_REQUEST 92
 /** Don't split our requests so finely that we are requesting fewer than
  * this number per server. */
 #define MIN_DL_PER_REQUEST 4
@@ -4144,13 +5337,17 @@ client_would_use_router(routerstatus_t *rs, time_t now, or_options_t *options)
 
 /** Given a list of router descriptor digests in <b>downloadable</b>, decide
  * whether to delay fetching until we have more.  If we don't want to delay,
- * launch one or more requests to the appropriate directory authorities. */
+ * launch one or more requests to the appropriate directory authorities.
+ * <b>purpose</b> is DIR_PURPOSE_FETCH_SERVERDESC, or
+ * DIR_PURPOSE_FETCH_MICRODESC if the digests are microdesc digests. */
 static void
-launch_router_descriptor_downloads(smartlist_t *downloadable,
+launch_router_descriptor_downloads(int purpose, smartlist_t *downloadable,
                                    routerstatus_t *source, time_t now)
 {
   int should_delay = 0, n_downloadable;
   or_options_t *options = get_options();
+  int max_dl_per_request = purpose == DIR_PURPOSE_FETCH_MICRODESC ?
+    MAX_MICRODESC_DL_PER_REQUEST : MAX_DL_PER_REQUEST;
 
   n_downloadable = smartlist_len(downloadable);
   if (!directory_fetches_dir_info_early(options)) {
@@ -4195,8 +5392,8 @@ launch_router_descriptor_downloads(smartlist_t *downloadable,
     }
 
     n_per_request = CEIL_DIV(n_downloadable, MIN_REQUESTS);
-    if (n_per_request > MAX_DL_PER_REQUEST)
-      n_per_request = MAX_DL_PER_REQUEST;
+    if (n_per_request > max_dl_per_request)
+      n_per_request = max_dl_per_request;
     if (n_per_request < MIN_DL_PER_REQUEST)
       n_per_request = MIN_DL_PER_REQUEST;
 
@@ -4206,9 +5403,12 @@ launch_router_descriptor_downloads(smartlist_t *downloadable,
       rtr_plural = "s";
 
     log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_DOWNLOAD_DESCS_3),(n_downloadable+n_per_request-1)/n_per_request,req_plural,n_downloadable,rtr_plural,n_per_request);
-    smartlist_sort_digests(downloadable);
+    if (purpose == DIR_PURPOSE_FETCH_MICRODESC)
+      smartlist_sort_digests256(downloadable);
+    else
+      smartlist_sort_digests(downloadable);
     for (i=0; i < n_downloadable; i += n_per_request) {
-      initiate_descriptor_downloads(source, DIR_PURPOSE_FETCH_SERVERDESC,
+      initiate_descriptor_downloads(source, purpose,
                                     downloadable, i, i+n_per_request,
                                     pds_flags);
     }
@@ -4443,12 +5643,64 @@ void update_consensus_router_descriptor_downloads(time_t now,int is_vote,network
 		routerlist_assert_ok(rl);
 	}
 	log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_ROUTER_STATS_2),smartlist_len(downloadable),n_delayed,n_have,n_in_oldrouters,n_would_reject,n_wouldnt_use,n_inprogress);
-	launch_router_descriptor_downloads(downloadable, source, now);
+	launch_router_descriptor_downloads(DIR_PURPOSE_FETCH_SERVERDESC, downloadable, source, now);
 	digestmap_free(map,NULL);
 	smartlist_free(downloadable);
 	smartlist_free(no_longer_old);
 }
 
+/** Launch microdescriptor downloads as needed for the routers listed in the
+ * microdesc-flavored <b>consensus</b>.  Every listed router whose
+ * microdescriptor we already have gets built into a router, if we haven't
+ * built it yet. */
+static void update_microdesc_downloads(time_t now,networkstatus_t *consensus)
+{	or_options_t *options = get_options();
+	microdesc_cache_t *cache;
+	digestmap_t *map;
+	smartlist_t *downloadable;
+	int n_delayed=0, n_have=0, n_built=0, n_wouldnt_use=0, n_inprogress=0;
+	if(directory_too_idle_to_fetch_descriptors(options, now))
+		return;
+	cache = get_microdesc_cache();
+	downloadable = smartlist_create();
+	map = digestmap_new();
+	list_pending_downloads(map, DIR_PURPOSE_FETCH_MICRODESC, "d/");
+	SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list, routerstatus_t *, rs)
+	{	microdesc_t *md;
+		if(!rs->has_microdesc_digest)
+			continue;
+		if((md = microdesc_cache_lookup_by_digest256(cache, rs->microdesc_digest)))
+		{	const char *msg;
+			++n_have;
+			if(md->last_listed < consensus->valid_after)
+				md->last_listed = consensus->valid_after;
+			/* The router we build takes the descriptor digest from rs, so we find it again by that digest. */
+			if(!router_get_by_descriptor_digest(rs->descriptor_digest) && WRA_WAS_ADDED(router_add_to_routerlist(microdesc_make_routerinfo(rs, md), &msg, 1, 0)))
+				++n_built;
+			continue;
+		}
+		if(digestmap_get(map, rs->descriptor_digest))
+		{	++n_inprogress;
+			continue;	/* We have an in-progress download. */
+		}
+		if(!download_status_is_ready(&rs->dl_status, now,options->MaxDlFailures?options->MaxDlFailures:32767))
+		{	++n_delayed; /* Not ready for retry. */
+			continue;
+		}
+		if((options->DirFlags&DIR_FLAG_NO_AUTO_UPDATE)==0 && !client_would_use_router(rs, now, options))
+		{	++n_wouldnt_use;
+			continue; /* We would never use it ourself. */
+		}
+		smartlist_add(downloadable, rs->microdesc_digest);
+	} SMARTLIST_FOREACH_END(rs);
+	if(n_built)
+		routers_update_status_from_consensus_networkstatus(router_get_routerlist()->routers, 0);
+	log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERLIST_MICRODESC_STATS),smartlist_len(downloadable),n_delayed,n_have,n_built,n_wouldnt_use,n_inprogress);
+	launch_router_descriptor_downloads(DIR_PURPOSE_FETCH_MICRODESC, downloadable, NULL, now);
+	digestmap_free(map,NULL);
+	smartlist_free(downloadable);
+}
+
 /** How often should we launch a server/authority request to be sure of getting
  * a guess for our IP? */
 /*XXXX021 this info should come from netinfo cells or something, or we should
@@ -4462,12 +5714,17 @@ update_router_descriptor_downloads(time_t now)
 {
   or_options_t *options = get_options();
   static time_t last_dummy_download = 0;
+  networkstatus_t *consensus;
   if (should_delay_dir_fetches(options))
     return;
   if (directory_fetches_dir_info_early(options)) {
     update_router_descriptor_cache_downloads_v2(now);
   }
-  update_consensus_router_descriptor_downloads(now,0,networkstatus_get_reasonably_live_consensus(now));
+  consensus = networkstatus_get_reasonably_live_consensus(now);
+  if (consensus && consensus->flavor == FLAV_MICRODESC)
+    update_microdesc_downloads(now, consensus);
+  else
+    update_consensus_router_descriptor_downloads(now,0,consensus);
 
   /* XXXX021 we could be smarter here; see notes on bug 652. */
   /* If we're a server that doesn't have a configured address, we rely on
@@ -4585,6 +5842,11 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  router_alias_tables_invalidate();
+  router_candidates_invalidate();
+  router_index.valid = 0;
+  memset(bw_weights_cache_state, 0, sizeof(bw_weights_cache_state));
+  country_router_sets_n = -1;
   rend_hsdir_routers_changed();
 }
 
@@ -4773,6 +6035,10 @@ router_differences_are_cosmetic(routerinfo_t *r1, routerinfo_t *r2)
     r1 = ri_tmp;
   }
 
+  /* A router built from a microdescriptor has no identity key to compare. */
+  if (r1->from_microdesc || r2->from_microdesc)
+    return 0;
+
   /* If any key fields differ, they're different. */
   if (strcasecmp(r1->address, r2->address) ||
       strcasecmp(r1->nickname, r2->nickname) ||
@@ -5271,7 +6537,7 @@ routerset_contains(const routerset_t *set, const tor_addr_t *addr,
 
   if (set->countries) {
     if (country < 0 && addr)
-      country = geoip_get_country_by_ip(geoip_reverse(tor_addr_to_ipv4h(addr)))&0xff;
+      country = geoip_get_country_by_addr(addr)&0xff;
 
     if (country >= 0 && country < set->n_countries &&
         bitarray_is_set(set->countries, country))
@@ -5493,12 +6759,14 @@ routerset_free(routerset_t *routerset)
   tor_free(routerset);
 }
 
-/** Refresh the country code of <b>ri</b>.  This function MUST be called on
- * each router when the GeoIP database is reloaded, and on all new routers. */
+/** Refresh the country code and the AS set of <b>ri</b>.  This function
+ * MUST be called on each router when the GeoIP database is reloaded, and on
+ * all new routers. */
 void
 routerinfo_set_country(routerinfo_t *ri)
 {
   ri->country = geoip_get_country_by_ip(geoip_reverse(ri->addr))&0xff;
+  ri->as_set_len = geoip_get_as_set(ri->addr, ri->as_set, ROUTER_AS_SET_SIZE);
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -5508,6 +6776,9 @@ routerlist_refresh_countries(void)
   routerlist_t *rl = router_get_routerlist();
   SMARTLIST_FOREACH(rl->routers, routerinfo_t *, ri,
                     routerinfo_set_country(ri));
+  country_router_sets_n = -1;
+  router_index.valid = 0;
+  sorted_exits_invalidate();
 }
 
 /** Determine the routers that are responsible for <b>id</b> (binary) and
@@ -5667,117 +6938,38 @@ char *print_router_sel(void)
 	return tor_strdup(get_lang_str(LANG_MB_IDENTITY_DIFFERENT_IP));
 }
 
-const char contry_all[]="*";
-const char addr_all[]="*:*";
-const char name_all[]="<< Random router >>";
-LV_ITEM lvit;
-
-void insert_router_1(HWND hDlg,uint32_t lParam1,const char *country,const char *address,const char *rname,const char *bw,const char *is_exit)
-{	int lvErr;
-	lvit.lParam=lParam1;
-	lvit.mask=LVIF_TEXT|LVIF_PARAM;
-	lvit.iSubItem=0;
-	lvit.pszText=(char *)country;
-	lvit.cchTextMax=3;
-	lvErr=SendDlgItemMessage(hDlg,400,LVM_INSERTITEM,0,(LPARAM)&lvit);
-	if(lvErr!=-1) lvit.iItem=lvErr;
-	lvit.mask=LVIF_TEXT;
-	lvit.lParam=0;
-	lvit.iSubItem++;
-	lvit.pszText=(char *)address;
-	lvit.cchTextMax=100;
-	SendDlgItemMessage(hDlg,400,LVM_SETITEM,0,(LPARAM)&lvit);
-	lvit.iSubItem++;
-	lvit.pszText=(char *)rname;
-	SendDlgItemMessage(hDlg,400,LVM_SETITEM,0,(LPARAM)&lvit);
-	lvit.iSubItem++;
-	lvit.pszText=(char *)bw;
-	SendDlgItemMessage(hDlg,400,LVM_SETITEM,0,(LPARAM)&lvit);
-	if(is_exit)
-	{	lvit.iSubItem++;
-		lvit.pszText=(char *)is_exit;
-		SendDlgItemMessage(hDlg,400,LVM_SETITEM,0,(LPARAM)&lvit);
-	}
-	lvit.iItem++;
-}
-
-
-void add_all_routers_to_list(HWND hDlg,int selType,int last_country_sel)
+/** Fill <b>rows</b> with the rows of the router selection list, as the
+ * list parameters that dlg_routers.c formats on demand: 0 for a random
+ * router, 1 for no exit, and the router_id of each router that matches
+ * <b>selType</b> and <b>last_country_sel</b>, negated if the router is
+ * banned.  Return the index of the row that should be selected, or -1. */
+int add_all_routers_to_list(smartlist_t *rows,int selType,int last_country_sel)
 {	or_options_t *options=get_options();
 	time_t now = get_time(NULL);
-	lvit.iItem=0;
-	lvit.state=0;
-	lvit.stateMask=0;
-	lvit.iImage=0;
-	char is_exit[3],*s1;
-	if(last_country_sel==0x200)	insert_router_1(hDlg,0,"ANY","<< Random >>","<< Random router >>","*",NULL);
-	else if(last_country_sel==0x1ff)
-	{	insert_router_1(hDlg,1,"NONE","<< localhost >>","<< No exit >>","-",NULL);return;}
-	else	insert_router_1(hDlg,0,(char *)geoip_get_country_name(last_country_sel),"<< Random >>","<< Random router >>","*",NULL);
-	if(selType==SELECT_EXIT && router_sel==0)
-	{	lvit.mask=LVIF_STATE;
-		lvit.iSubItem=0;
-		lvit.stateMask=LVIS_SELECTED;
-		lvit.state=LVIS_SELECTED;
-		lvit.iItem--;
-		SendDlgItemMessage(hDlg,400,LVM_SETITEM,0,(LPARAM)&lvit);
-		lvit.iItem++;
-	}
-	if(!routerlist)	return;
-	char *raddress=tor_malloc(100);
-	char *rbw=tor_malloc(100);
-	double bandwidthrate;
+	int selected=-1,j;
 	uint32_t raddr;
-	int i=0,j;
-	char country_name[5];
-	int country;
+	smartlist_clear(rows);
+	if(last_country_sel==0x1ff)
+	{	smartlist_add(rows,(void *)(intptr_t)1);
+		return -1;
+	}
+	smartlist_add(rows,(void *)(intptr_t)0);
+	if(selType==SELECT_EXIT && router_sel==0)	selected=0;
+	if(!routerlist)	return selected;
 	SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
 	{	if((selType==SELECT_EXIT&&router->is_exit)||(selType==SELECT_ENTRY&&router->is_possible_guard)||(selType==SELECT_ANY))
 		{	raddr=geoip_reverse(router->addr);
 			if((last_country_sel==0x200)||(last_country_sel==(geoip_get_country_by_ip(raddr)&0xff)))
 			{	if(selType!=SELECT_EXIT || !(tmpOptions->ExitSeenFlags & EXIT_SEEN_FLAG_ENABLED) || dlgBypassBlacklists_isRecent(raddr,router,now))
-				{
-					tor_snprintf(raddress,100,"%d.%d.%d.%d:%d",raddr&0xff,(raddr>>8)&0xff,(raddr>>16)&0xff,(raddr>>24)&0xff,router->or_port);
-					j = (selType==SELECT_EXIT&&(routerset_contains_router(options->_ExcludeExitNodesUnion,router))) || routerset_contains_router(options->ExcludeNodes,router);
-					if(j)	tor_snprintf(rbw,100,"--------");
-					else if(router->bandwidthcapacity>1024)
-					{	bandwidthrate=(double)router->bandwidthcapacity/1024;
-						if(bandwidthrate>1024)
-						{	bandwidthrate/=1024;
-							if(bandwidthrate>1024)
-							{	bandwidthrate/=1024;
-								tor_snprintf(rbw,100,"%s%.2f GB",(router->is_running && router->is_valid && !router->is_bad_exit)?"":"[?] ",bandwidthrate);
-							}
-							else tor_snprintf(rbw,100,"%s%.2f MB",(router->is_running && router->is_valid && !router->is_bad_exit)?"":"[?] ",bandwidthrate);
-						}
-						else tor_snprintf(rbw,100,"%s%.2f kB",(router->is_running && router->is_valid && !router->is_bad_exit)?"":"[?] ",bandwidthrate);
-					}
-					else tor_snprintf(rbw,100,"%s%d B",(router->is_running && router->is_valid && !router->is_bad_exit)?"":"[?] ",router->bandwidthcapacity);
-					country = geoip_get_country_by_ip(raddr);
-					tor_snprintf(country_name,4,"%s%s",(char *)geoip_get_country_name(country&0xff),country>0xff?"*":"");
-					if(selType==SELECT_ANY)
-					{	s1=&is_exit[0];
-						if(router->is_possible_guard) *s1++='E';
-						if(router->is_exit) *s1++='X';
-						*s1=0;
-						insert_router_1(hDlg,j?-(router->router_id):(router->router_id),&country_name[0],raddress,router->nickname,rbw,is_exit);
-					}
-					else	insert_router_1(hDlg,j?-(router->router_id):(router->router_id),&country_name[0],raddress,router->nickname,rbw,NULL);
+				{	j = (selType==SELECT_EXIT&&(routerset_contains_router(options->_ExcludeExitNodesUnion,router))) || routerset_contains_router(options->ExcludeNodes,router);
 					if(selType==SELECT_EXIT && ((router_id_sel && router->router_id==router_id_sel) || router->addr==router_sel))
-					{	lvit.mask=LVIF_STATE;
-						lvit.iSubItem=0;
-						lvit.stateMask=LVIS_SELECTED;
-						lvit.state=LVIS_SELECTED;
-						lvit.iItem--;
-						SendDlgItemMessage(hDlg,400,LVM_SETITEM,0,(LPARAM)&lvit);
-						lvit.iItem++;
-					}
+						selected=smartlist_len(rows);
+					smartlist_add(rows,(void *)(intptr_t)(j?-(int32_t)router->router_id:(int32_t)router->router_id));
 				}
 			}
 		}
-		i++;
 	});
-	tor_free(raddress);tor_free(rbw);
+	return selected;
 }
 
 routerinfo_t *get_router(uint32_t i)
@@ -5928,6 +7120,7 @@ uint32_t routerlist_reindex(void)
 	SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, router,
 	{	router->router_id=i++;
 	});
+	sorted_exits_invalidate();
 	return i;
 }
 
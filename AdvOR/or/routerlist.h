@@ -11,6 +11,9 @@
 #ifndef _TOR_ROUTERLIST_H
 #define _TOR_ROUTERLIST_H
 
+/** How long do we avoid using a directory server after it's given us a 503? */
+#define DIR_503_TIMEOUT (60*60)
+
 int get_n_authorities(authority_type_t type);
 int trusted_dirs_reload_certs(void);
 int trusted_dirs_load_certs_from_string(const char *contents, int from_store,
@@ -84,6 +87,7 @@ void extrainfo_free(extrainfo_t *extrainfo);
 #define EXTRAINFO_FREE(n) extrainfo_free(n)
 #endif
 void routerlist_free(routerlist_t *rl);
+size_t routerlist_get_mem_usage(void);
 void dump_routerlist_mem_usage(int severity);
 void routerlist_remove(routerlist_t *rl, routerinfo_t *ri, int make_old,
                        time_t now);
@@ -141,6 +145,13 @@ void routerlist_retry_directory_downloads(time_t now);
 int router_exit_policy_all_routers_reject(uint32_t addr, uint16_t port,
                                           int need_uptime);
 int router_exit_policy_rejects_all(routerinfo_t *router);
+int router_may_be_random_exit(routerinfo_t *router);
+int router_index_exits_to_port(routerinfo_t *router, uint16_t port);
+char *router_intern_string(const char *s);
+char *router_intern_family_member(const char *name);
+void router_release_string(char *s);
+void routerlist_add_routers_sharing_as(smartlist_t *sl,
+                                       const routerinfo_t *router);
 trusted_dir_server_t *add_trusted_dir_server(const char *nickname,
                            const char *address,
                            uint16_t dir_port, uint16_t or_port,
@@ -210,7 +221,7 @@ void getRandomExitNode(unsigned char scope_id,unsigned char circuit_pos,char *co
 uint32_t routerlist_reindex(void);
 char *print_router_sel(void);
 
-void add_all_routers_to_list(HWND hDlg,int selType,int last_country_sel);
+int add_all_routers_to_list(smartlist_t *rows,int selType,int last_country_sel);
 routerinfo_t *get_router(uint32_t i);
 BOOL is_selected_router(uint32_t addr,uint32_t routerid,DWORD exclKey);
 char *find_router_by_ip(uint32_t addr);
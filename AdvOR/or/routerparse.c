@@ -18,12 +18,14 @@
 #include "rendcommon.h"
 #include "router.h"
 #include "routerlist.h"
+#include "cpuworker.h"
 #include "memarea.h"
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "rephist.h"
 #include "routerparse.h"
 #include "main.h"
+#include "sigcache.h"
 #undef log
 #include <math.h>
 
@@ -543,7 +545,33 @@ static int router_get_hashes_impl(const char *s, size_t s_len,
                                   digests_t *digests,
                                   const char *start_str, const char *end_str,
                                   char end_char);
+static int router_get_hash_impl_helper(const char *s, size_t s_len,
+                                       const char *start_str,
+                                       const char *end_str, char end_c,
+                                       const char **start_out,
+                                       const char **end_out);
 static void token_clear(directory_token_t *tok);
+
+/** A router descriptor signature that router_parse_list_from_string() checks
+ * together with the rest of its batch, once they have all been parsed. */
+typedef struct router_sig_check_t {
+  /** The router the signature is on. */
+  routerinfo_t *router;
+  /** The digest the signature should be on. */
+  char digest[DIGEST_LEN];
+  /** The signature object. */
+  char *signature;
+  size_t signature_len;
+  /** Set to true iff the signature is good. */
+  int ok;
+} router_sig_check_t;
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                             int cache_copy,
+                                             int allow_annotations,
+                                             const char *prepend_annotations,
+                                             int verify,
+                                             router_sig_check_t *deferred);
 static smartlist_t *find_all_exitpolicy(smartlist_t *s);
 static directory_token_t *_find_by_keyword(smartlist_t *s,
                                            directory_keyword keyword,
@@ -572,6 +600,12 @@ static int check_signature_token(const char *digest,
                                  crypto_pk_env_t *pkey,
                                  int flags,
                                  const char *doctype);
+static int check_signature_digest(const char *digest,
+                                  ssize_t digest_len,
+                                  const char *signature,
+                                  size_t signature_len,
+                                  crypto_pk_env_t *pkey,
+                                  const char *doctype);
 static crypto_pk_env_t *find_dir_signing_key(const char *str, const char *eos);
 
 #undef DEBUG_AREA_ALLOC
@@ -670,6 +704,20 @@ router_get_networkstatus_v3_hashes(const char *s, digests_t *digests)
                                 ' ');
 }
 
+/** Set <b>digest</b> to the SHA3-256 digest of the consensus document in
+ * <b>s</b>, as signed.  This is the digest that names a consensus in
+ * requests for consensus diffs.  Return 0 on success, -1 on failure. */
+int
+router_get_networkstatus_v3_sha3_as_signed(const char *s, char *digest)
+{
+  const char *start=NULL, *end=NULL;
+  if (router_get_hash_impl_helper(s,strlen(s),"network-status-version",
+                                  "\ndirectory-signature",' ',
+                                  &start,&end)<0)
+    return -1;
+  return crypto_digest_sha3_256(digest, start, end-start);
+}
+
 /** Set <b>digest</b> to the SHA-1 digest of the hash of the network-status
  * string in <b>s</b>.  Return 0 on success, -1 on failure. */
 int
@@ -1010,8 +1058,6 @@ check_signature_token(const char *digest,
                       int flags,
                       const char *doctype)
 {
-  char *signed_digest;
-  size_t keysize;
   const int check_authority = (flags & CST_CHECK_AUTHORITY);
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
@@ -1032,10 +1078,39 @@ check_signature_token(const char *digest,
     }
   }
 
+  return check_signature_digest(digest, digest_len, tok->object_body,
+                                tok->object_size, pkey, doctype);
+}
+
+/** Check whether <b>signature</b> is a good signature for <b>digest</b>
+ * using key <b>pkey</b>.  Use <b>doctype</b> as the type of the document
+ * when generating log messages.  Return 0 on success, negative on failure.
+ *
+ * This only reads its arguments, so it is safe to call from a cpuworker
+ * batch. */
+static int
+check_signature_digest(const char *digest,
+                       ssize_t digest_len,
+                       const char *signature,
+                       size_t signature_len,
+                       crypto_pk_env_t *pkey,
+                       const char *doctype)
+{
+  char *signed_digest;
+  size_t keysize;
+  char key_digest[DIGEST_LEN], sig_id[DIGEST_LEN];
+  int cacheable = crypto_pk_get_digest(pkey, key_digest) == 0;
+
+  if (cacheable) {
+    sigcache_get_id(sig_id, key_digest, digest, digest_len, signature,
+                    signature_len);
+    if (sigcache_lookup(sig_id))
+      return 0;
+  }
   keysize = crypto_pk_keysize(pkey);
   signed_digest = tor_malloc(keysize);
-  if (crypto_pk_public_checksig(pkey, signed_digest, keysize,tok->object_body,
-                                tok->object_size)
+  if (crypto_pk_public_checksig(pkey, signed_digest, keysize, signature,
+                                signature_len)
       < DIGEST_LEN) {
     log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_SIGNATURE_ERROR_4),doctype);
     tor_free(signed_digest);
@@ -1049,6 +1124,8 @@ check_signature_token(const char *digest,
     return -1;
   }
   tor_free(signed_digest);
+  if (cacheable)
+    sigcache_add(sig_id);
   return 0;
 }
 
@@ -1090,6 +1167,73 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+/** Return true iff the router descriptor from <b>s</b> to <b>end</b>, with
+ * any annotations, should be parsed when we only want the descriptors that
+ * the current consensus lists: it is listed, or has an \@purpose annotation
+ * (bridge descriptors never are), or we can't tell. */
+static int
+router_desc_is_listed(const char *s, const char *end)
+{
+  const char *body = s;
+  char digest[DIGEST_LEN];
+
+  while (body < end && *body == '@') {
+    if (!strcmpstart(body, "@purpose "))
+      return 1;
+    if (!(body = memchr(body, '\n', end-body)))
+      return 1;
+    body = eat_whitespace_eos(body, end);
+  }
+  if (router_get_router_hash(body, end-body, digest) < 0)
+    return 1;
+  return router_get_consensus_status_by_descriptor_digest(digest) != NULL;
+}
+
+/** cpuworker_run_batch() callback: check router signature <b>idx</b> in the
+ * array of router_sig_check_t at <b>arg</b>. */
+static void
+router_sig_check_batch_fn(void *arg, int idx)
+{
+  router_sig_check_t *check = ((router_sig_check_t *)arg) + idx;
+  check->ok = check_signature_digest(check->digest, DIGEST_LEN,
+                                     check->signature, check->signature_len,
+                                     check->router->identity_pkey,
+                                     "router descriptor") == 0;
+}
+
+/** Check the signatures in <b>checks</b>, which were deferred while parsing
+ * the routers that <b>dest</b> holds from index <b>first</b> onwards, in the
+ * same order.  Check them all at once, then drop and free every router that
+ * doesn't have a good signature. */
+static void
+router_parse_check_deferred_signatures(smartlist_t *checks, smartlist_t *dest,
+                                       int first)
+{
+  router_sig_check_t *arr;
+  int i, n = smartlist_len(checks);
+
+  if (!n)
+    return;
+  tor_assert(smartlist_len(dest) - first == n);
+  arr = tor_malloc(sizeof(router_sig_check_t)*n);
+  for (i = 0; i < n; ++i) {
+    router_sig_check_t *check = smartlist_get(checks, i);
+    tor_assert(check->router == smartlist_get(dest, first+i));
+    memcpy(&arr[i], check, sizeof(router_sig_check_t));
+    tor_free(check);
+  }
+  smartlist_clear(checks);
+  cpuworker_run_batch(n, router_sig_check_batch_fn, arr);
+  for (i = n-1; i >= 0; --i) {
+    if (!arr[i].ok) {
+      smartlist_del_keeporder(dest, first+i);
+      routerinfo_free(arr[i].router);
+    }
+    tor_free(arr[i].signature);
+  }
+  tor_free(arr);
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
  * them and stores the result in <b>dest</b>.  All routers are marked running
@@ -1100,6 +1244,11 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
  * isn't SAVED_NOWHERE, remember the offset of each descriptor.
  *
+ * <b>flags</b> is a combination of ROUTER_PARSE_ONLY_LISTED and
+ * ROUTER_PARSE_SKIP_SIGNATURES.  Unless the signatures are skipped, the
+ * router signatures are all checked at once after parsing, so that they can
+ * be checked in parallel.
+ *
  * Returns 0 on success and -1 on failure.
  */
 int
@@ -1108,7 +1257,8 @@ router_parse_list_from_string(const char **s, const char *eos,
                               saved_location_t saved_location,
                               int want_extrainfo,
                               int allow_annotations,
-                              const char *prepend_annotations)
+                              const char *prepend_annotations,
+                              int flags)
 {
   routerinfo_t *router;
   extrainfo_t *extrainfo;
@@ -1116,6 +1266,10 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  int n_skipped = 0;
+  int first = smartlist_len(dest);
+  smartlist_t *deferred = smartlist_create();
+  router_sig_check_t *check;
 
   tor_assert(s);
   tor_assert(*s);
@@ -1140,6 +1294,13 @@ router_parse_list_from_string(const char **s, const char *eos,
     if (!end)
       break;
 
+    if ((flags & ROUTER_PARSE_ONLY_LISTED) && !have_extrainfo &&
+        !router_desc_is_listed(*s, end)) {
+      ++n_skipped;
+      *s = end;
+      continue;
+    }
+
     elt = NULL;
 
     if (have_extrainfo && want_extrainfo) {
@@ -1150,10 +1311,22 @@ router_parse_list_from_string(const char **s, const char *eos,
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations);
+      check = NULL;
+      if (!(flags & ROUTER_PARSE_SKIP_SIGNATURES))
+        check = tor_malloc_zero(sizeof(router_sig_check_t));
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations,
+                                       !(flags & ROUTER_PARSE_SKIP_SIGNATURES),
+                                       check);
+      if (check) {
+        if (router) {
+          check->router = router;
+          smartlist_add(deferred, check);
+        } else
+          tor_free(check);
+      }
       if (router) {
         log_debug(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ROUTER_PARSED),router->nickname,router_purpose_to_string(router->purpose));
         signed_desc = &router->cache_info;
@@ -1172,6 +1345,10 @@ router_parse_list_from_string(const char **s, const char *eos,
     smartlist_add(dest, elt);
   }
 
+  router_parse_check_deferred_signatures(deferred, dest, first);
+  smartlist_free(deferred);
+  if (n_skipped)
+    log_info(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_SKIPPED_UNLISTED),n_skipped);
   return 0;
 }
 
@@ -1224,6 +1401,14 @@ void set_router_id(routerinfo_t *router)
  * Only one of allow_annotations and prepend_annotations may be set.
  */
 routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,int cache_copy, int allow_annotations,const char *prepend_annotations)
+{	return router_parse_entry_impl(s,end,cache_copy,allow_annotations,prepend_annotations,1,NULL);
+}
+
+/** As router_parse_entry_from_string(); if <b>verify</b> is false, trust the
+ * router signature without checking it.  If <b>deferred</b> is set, don't
+ * check the signature either, but copy what we need to check it later into
+ * <b>deferred</b>. */
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,int cache_copy, int allow_annotations,const char *prepend_annotations,int verify,router_sig_check_t *deferred)
 {	routerinfo_t *router = NULL;
 	char *esc_l;
 	char digest[128];
@@ -1240,7 +1425,7 @@ routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,int
 	/* point 'end' to a point immediately after the final newline. */
 	while(end > s+2 && *(end-1) == '\n' && *(end-2) == '\n')
 		--end;
-	area = memarea_new();
+	area = memarea_new_sized(end - s);
 	tokens = smartlist_create();
 	if(prepend_annotations && tokenize_string(area,prepend_annotations,NULL,tokens,routerdesc_token_table,TS_NOCHECK))
 		log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_TOKENIZING_DESC));
@@ -1399,9 +1584,9 @@ routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,int
 								}
 								if(ok)
 								{	if((tok = find_opt_by_keyword(tokens, K_PLATFORM)))
-										router->platform = tor_strdup(tok->args[0]);
+										router->platform = router_intern_string(tok->args[0]);
 									if((tok = find_opt_by_keyword(tokens, K_CONTACT)))
-										router->contact_info = tor_strdup(tok->args[0]);
+										router->contact_info = router_intern_string(tok->args[0]);
 									if((tok = find_opt_by_keyword(tokens, K_EVENTDNS)))
 										router->has_old_dnsworkers = tok->n_args && !strcmp(tok->args[0], "0");
 									else if(router->platform)
@@ -1429,6 +1614,7 @@ routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,int
 									}
 									if(ok)
 									{	policy_expand_private(&router->exit_policy);
+										router_intern_exit_policy(router);
 										if(policy_is_reject_star(router->exit_policy))
 											router->policy_is_reject_star = 1;
 										if((tok = find_opt_by_keyword(tokens, K_FAMILY)) && tok->n_args)
@@ -1442,7 +1628,7 @@ routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,int
 													ok = 0;
 													break;
 												}
-												smartlist_add(router->declared_family, tor_strdup(tok->args[i]));
+												smartlist_add(router->declared_family, router_intern_family_member(tok->args[i]));
 											}
 										}
 										if(ok)
@@ -1463,17 +1649,28 @@ routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,int
 											if(find_opt_by_keyword(tokens, K_HIDDEN_SERVICE_DIR))
 												router->wants_to_be_hs_dir = 1;
 											tok = find_by_keyword(tokens, K_ROUTER_SIGNATURE);
-											note_crypto_pk_op(VERIFY_RTR);
-											if(check_signature_token(digest,DIGEST_LEN,tok, router->identity_pkey, 0,"router descriptor") < 0)
+											if(verify)	note_crypto_pk_op(VERIFY_RTR);
+											if(verify && deferred)
+											{	if(strcmp(tok->object_type, "SIGNATURE"))
+												{	log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_SIGNATURE_ERROR_3),"router descriptor");
+													ok = 0;
+												}
+												else
+												{	memcpy(deferred->digest,digest,DIGEST_LEN);
+													deferred->signature = tor_memdup(tok->object_body,tok->object_size);
+													deferred->signature_len = tok->object_size;
+												}
+											}
+											else if(verify && check_signature_token(digest,DIGEST_LEN,tok, router->identity_pkey, 0,"router descriptor") < 0)
 												ok = 0;
-											else
+											if(ok)
 											{	routerinfo_set_country(router);
 												if(!router->or_port)
 												{	log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_INVALID_PORT_3));
 													ok = 0;
 												}
 												else if(!router->platform)
-													router->platform = tor_strdup("<unknown>");
+													router->platform = router_intern_string("<unknown>");
 											}
 										}
 									}
@@ -1528,7 +1725,7 @@ extrainfo_t *extrainfo_parse_entry_from_string(const char *s, const char *end,in
 		log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_COMPUTING_DIGEST_4));
 	else
 	{	tokens = smartlist_create();
-		area = memarea_new();
+		area = memarea_new_sized(end - s);
 		if(tokenize_string(area,s,end,tokens,extrainfo_token_table,0))
 			log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_TOKENIZING_EXTRAINFO));
 		else if(smartlist_len(tokens) < 2)
@@ -1647,7 +1844,7 @@ authority_cert_t *authority_cert_parse_from_string(const char *s, const char **e
 		return NULL;
 	}
 	tokens = smartlist_create();
-	area = memarea_new();
+	area = memarea_new_sized(len);
 	if(tokenize_string(area,s, eos, tokens, dir_key_certificate_table, 0) < 0)
 		log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_TOKENIZING_KEY));
 	else if(router_get_hash_impl(s, strlen(s), digest, "dir-key-certificate-version","\ndir-key-certification", '\n',DIGEST_SHA1) < 0);
@@ -1840,11 +2037,6 @@ static routerstatus_t *routerstatus_parse_entry_from_string(memarea_t *area,cons
 			log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_DECODING_DIGEST),esc_l);
 			tor_free(esc_l);
 		}
-		else if(digest_from_base64(rs->descriptor_digest, tok->args[2]))
-		{	esc_l = esc_for_log(tok->args[2]);
-			log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_DECODING_DIGEST_2),esc_l);
-			tor_free(esc_l);
-		}
 		else if(tor_snprintf(timebuf,sizeof(timebuf), "%s %s",tok->args[3+offset], tok->args[4+offset]) < 0 || parse_iso_time(timebuf, &rs->published_on)<0)
 			log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_INVALID_TIME_2),tok->args[3+offset],tok->args[4+offset]);
 		else if(tor_inet_aton(tok->args[5+offset], &in) == 0)
@@ -1971,6 +2163,19 @@ static routerstatus_t *routerstatus_parse_entry_from_string(memarea_t *area,cons
 							}
 						} SMARTLIST_FOREACH_END(t);
 					}
+					else if(ok && flav == FLAV_MICRODESC && (tok = find_opt_by_keyword(tokens, K_M)) && tok->n_args)
+					{	/* The microdesc flavor has no descriptor digest; we use the start of the microdescriptor digest in its place, so that descriptors built from microdescriptors can be matched to their entries. */
+						if(digest256_from_base64(rs->microdesc_digest, tok->args[0]))
+						{	esc_l = esc_for_log(tok->args[0]);
+							log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_DECODING_DIGEST_2),esc_l);
+							tor_free(esc_l);
+							ok = 0;
+						}
+						else
+						{	rs->has_microdesc_digest = 1;
+							memcpy(rs->descriptor_digest, rs->microdesc_digest, DIGEST_LEN);
+						}
+					}
 					if(ok && !strcasecmp(rs->nickname, UNNAMED_ROUTER_NICKNAME))	rs->is_named = 0;
 				}
 			}
@@ -2430,13 +2635,15 @@ networkstatus_t *networkstatus_parse_vote_from_string(const char *s, const char
 	if(router_get_networkstatus_v3_hashes(s, &ns_digests))
 		log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_COMPUTING_DIGEST_6));
 	else
-	{	area = memarea_new();
-		end_of_header = find_start_of_next_routerstatus(s);
+	{	end_of_header = find_start_of_next_routerstatus(s);
+		area = memarea_new_sized(end_of_header - s);
 		if(tokenize_string(area, s, end_of_header, tokens,(ns_type == NS_TYPE_CONSENSUS) ? networkstatus_consensus_token_table : networkstatus_token_table, 0))
 			log_warn(LD_DIR,get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_TOKENIZING_NS_3));
 		else
 		{	ns = tor_malloc_zero(sizeof(networkstatus_t));
 			memcpy(&ns->digests, &ns_digests, sizeof(ns_digests));
+			if(ns_type == NS_TYPE_CONSENSUS && !router_get_networkstatus_v3_sha3_as_signed(s,ns->digest_sha3_as_signed))
+				ns->has_digest_sha3_as_signed = 1;
 			tok = find_by_keyword(tokens, K_NETWORK_STATUS_VERSION);
 			tor_assert(tok);
 			if(tok->n_args > 1)
@@ -2962,7 +3169,7 @@ ns_detached_signatures_t *networkstatus_parse_detached_signatures(const char *s,
 	sigs->digests = strmap_new();
 	sigs->signatures = strmap_new();
 	if(!eos)	eos = s + strlen(s);
-	area = memarea_new();
+	area = memarea_new_sized(eos - s);
 	if(tokenize_string(area,s, eos, tokens,networkstatus_detached_signature_token_table, 0))
 	{	log_warn(LD_DIR, get_lang_str(LANG_LOG_ROUTERPARSE_ERROR_TOKENIZING_NS_5));
 		ok = 0;
@@ -3376,6 +3583,119 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
    * attack, a bug, or some other nonsense. */
 #define MAX_LINE_LENGTH (128*1024)
 
+/** Number of slots in the keyword index of a token table; a power of two
+ * well above the size of our largest table. */
+#define TOKEN_INDEX_SIZE 256
+/** Most token tables we'll build keyword indexes for. */
+#define MAX_TOKEN_INDEXES 24
+/** How many hash seeds to try before giving up on a collision-free index. */
+#define TOKEN_INDEX_MAX_SEEDS 4096
+
+/** A perfect hash from keyword to rule for one token table: with
+ * <b>seed</b>, every keyword in <b>table</b> hashes to its own slot. */
+typedef struct token_index_t {
+  const token_rule_t *table; /**< The table this indexes. */
+  int usable; /**< False if we found no seed; scan the table instead. */
+  unsigned int seed; /**< Hash seed with no collisions in <b>table</b>. */
+  /** One more than the index in <b>table</b> of the rule whose keyword hashes
+   * here, or 0 for none. */
+  uint8_t slot[TOKEN_INDEX_SIZE];
+} token_index_t;
+
+/** Keyword indexes for the token tables we've parsed with so far. */
+static token_index_t token_indexes[MAX_TOKEN_INDEXES];
+/** Number of entries used in token_indexes. */
+static int n_token_indexes = 0;
+
+/** Hash the <b>len</b>-byte keyword <b>s</b> into a TOKEN_INDEX_SIZE slot. */
+static INLINE unsigned int
+token_keyword_hash(const char *s, size_t len, unsigned int seed)
+{
+  uint32_t h = 2166136261u ^ seed;
+  while (len--)
+    h = (h ^ (uint8_t)*s++) * 16777619u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return h & (TOKEN_INDEX_SIZE-1);
+}
+
+/** Try to fill <b>idx</b> as a perfect hash of its table under
+ * <b>seed</b>.  Later duplicates of a keyword are left out, since the first
+ * rule for a keyword is the one that matches.  Return 0 on success, -1 on
+ * a collision. */
+static int
+token_index_try_seed(token_index_t *idx, unsigned int seed)
+{
+  const token_rule_t *table = idx->table;
+  int i;
+  memset(idx->slot, 0, sizeof(idx->slot));
+  for (i = 0; table[i].t; ++i) {
+    unsigned int h = token_keyword_hash(table[i].t, strlen(table[i].t), seed);
+    if (idx->slot[h]) {
+      if (!strcmp(table[idx->slot[h]-1].t, table[i].t))
+        continue;
+      return -1;
+    }
+    idx->slot[h] = (uint8_t)(i+1);
+  }
+  idx->seed = seed;
+  return 0;
+}
+
+/** Return the keyword index for <b>table</b>, building it the first time we
+ * see the table, or NULL if we have no room for another index. */
+static token_index_t *
+token_index_get(const token_rule_t *table)
+{
+  static token_index_t *last = NULL;
+  token_index_t *idx;
+  unsigned int seed;
+  int i;
+  if (last && last->table == table)
+    return last;
+  for (i = 0; i < n_token_indexes; ++i) {
+    if (token_indexes[i].table == table)
+      return (last = &token_indexes[i]);
+  }
+  if (n_token_indexes == MAX_TOKEN_INDEXES)
+    return NULL;
+  idx = &token_indexes[n_token_indexes++];
+  idx->table = table;
+  idx->usable = 0;
+  for (i = 0; table[i].t; ++i)
+    ;
+  if (i < 255) {
+    for (seed = 0; seed < TOKEN_INDEX_MAX_SEEDS; ++seed) {
+      if (!token_index_try_seed(idx, seed)) {
+        idx->usable = 1;
+        break;
+      }
+    }
+  }
+  return (last = idx);
+}
+
+/** Return the first rule in <b>table</b> whose keyword is the <b>len</b>
+ * bytes at <b>s</b>, or NULL if there is none. */
+static INLINE const token_rule_t *
+token_table_lookup(const token_rule_t *table, const char *s, size_t len)
+{
+  token_index_t *idx = token_index_get(table);
+  int i;
+  if (idx && idx->usable) {
+    i = idx->slot[token_keyword_hash(s, len, idx->seed)];
+    if (i && !strcmp_len(s, table[i-1].t, len))
+      return &table[i-1];
+    return NULL;
+  }
+  for (i = 0; table[i].t; ++i) {
+    if (!strcmp_len(s, table[i].t, len))
+      return &table[i];
+  }
+  return NULL;
+}
+
 /** Helper function: read the next token from *s, advance *s to the end of the
  * token, and return the parsed token.  Parse *<b>s</b> according to the list
  * of tokens in <b>table</b>.
@@ -3383,7 +3703,7 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 static directory_token_t *get_next_token(memarea_t *area,const char **s, const char *eos, token_rule_t *table)
 {	const char *next, *eol, *obstart;
 	size_t obname_len;
-	int i;
+	const token_rule_t *rule;
 	directory_token_t *tok;
 	obj_syntax o_syn = NO_OBJ;
 	char ebuf[128];
@@ -3408,32 +3728,26 @@ static directory_token_t *get_next_token(memarea_t *area,const char **s, const c
 		{	*s = eat_whitespace_eos_no_nl(next, eol);
 			next = find_whitespace_eos(*s, eol);
 		}
-		/* Search the table for the appropriate entry.  (I tried a binary search instead, but it wasn't any faster.) */
-		for(i = 0; table[i].t ; ++i)
-		{	if(!strcmp_len(*s, table[i].t, next-*s))	/* We've found the keyword. */
-			{	kwd = table[i].t;
-				tok->tp = table[i].v;
-				o_syn = table[i].os;
-				*s = eat_whitespace_eos_no_nl(next, eol);
-				/* We go ahead whether there are arguments or not, so that tok->args is always set if we want arguments. */
-				if(table[i].concat_args)	/* The keyword takes the line as a single argument */
-				{	tok->args = ALLOC(sizeof(char*));
-					tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-					tok->n_args = 1;
-				}
-				else	/* This keyword takes multiple arguments. */
-				{	if(get_token_arguments(area, tok, *s, eol)<0)
-					{	tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-						break;
-					}
-					*s = eol;
-				}
-				if(tok->n_args < table[i].min_args)
-					tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-				else if(tok->n_args > table[i].max_args)
-					tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
-				break;
+		/* Look the keyword up in the table's perfect hash. */
+		rule = token_table_lookup(table, *s, next-*s);
+		if(rule)	/* We've found the keyword. */
+		{	kwd = rule->t;
+			tok->tp = rule->v;
+			o_syn = rule->os;
+			*s = eat_whitespace_eos_no_nl(next, eol);
+			/* We go ahead whether there are arguments or not, so that tok->args is always set if we want arguments. */
+			if(rule->concat_args)	/* The keyword takes the line as a single argument */
+			{	tok->args = ALLOC(sizeof(char*));
+				tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+				tok->n_args = 1;
 			}
+			else if(get_token_arguments(area, tok, *s, eol)<0)	/* This keyword takes multiple arguments. */
+				tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
+			else	*s = eol;
+			if(ebuf[0]==0 && tok->n_args < rule->min_args)
+				tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+			else if(ebuf[0]==0 && tok->n_args > rule->max_args)
+				tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
 		}
 		if(ebuf[0]==0)
 		{	if(tok->tp == _ERR)	/* No keyword matched; call it an "K_opt" or "A_unrecognized" */
@@ -4358,7 +4672,7 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,const char
 		}
 		/* Allocate new intro point and extend info. */
 		intro = tor_malloc_zero(sizeof(rend_intro_point_t));
-		info = intro->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+		info = intro->extend_info = extend_info_new();
 		/* Parse identifier. */
 		tok = find_by_keyword(tokens, R_IPO_IDENTIFIER);
 		if(base32_decode(info->identity_digest, DIGEST_LEN,tok->args[0], REND_INTRO_POINT_ID_LEN_BASE32) < 0)
@@ -19,6 +19,7 @@ int router_get_networkstatus_v2_hash(const char *s, char *digest);
 int router_get_networkstatus_v3_hash(const char *s, char *digest,
                                      digest_algorithm_t algorithm);
 int router_get_networkstatus_v3_hashes(const char *s, digests_t *digests);
+int router_get_networkstatus_v3_sha3_as_signed(const char *s, char *digest);
 int router_get_extrainfo_hash(const char *s, char *digest);
 #define DIROBJ_MAX_SIG_LEN 256
 int router_append_dirobj_signature(char *buf, size_t buf_len,
@@ -30,7 +31,16 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   saved_location_t saved_location,
                                   int is_extrainfo,
                                   int allow_annotations,
-                                  const char *prepend_annotations);
+                                  const char *prepend_annotations,
+                                  int flags);
+/** Flag for router_parse_list_from_string(): skip, unparsed, the
+ * general-purpose router descriptors that the current consensus doesn't
+ * list. */
+#define ROUTER_PARSE_ONLY_LISTED 1
+/** Flag for router_parse_list_from_string(): the descriptors come from a
+ * store we wrote ourselves and haven't been changed since, so don't check
+ * their signatures again. */
+#define ROUTER_PARSE_SKIP_SIGNATURES 2
 int router_parse_runningrouters(const char *str);
 int router_parse_directory(const char *str);
 
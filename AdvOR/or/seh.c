@@ -124,6 +124,73 @@ void tor_memdump(HANDLE hFile,char *buffer)
 }
 #endif
 
+/** seh_walk_stack() callback: write the description of a frame to the crash report <b>arg</b>. */
+static void seh_write_frame(void *arg,const char *frame)
+{	DWORD written;
+	WriteFile((HANDLE)arg,frame,strlen(frame),&written,NULL);
+	WriteFile((HANDLE)arg,"\r\n",2,&written,NULL);
+}
+
+/** Walk the stack of the thread <b>hThread</b> of our process, starting from the registers in <b>ctx</b>, and call <b>fn</b> with <b>arg</b> and the description of each frame.  Return how many frames we found. */
+int seh_walk_stack(HANDLE hThread,CONTEXT *ctx,seh_frame_fn fn,void *arg)
+{	char frame[512],module[MAX_PATH];
+	int i = 0;
+	HANDLE hProcess = GetCurrentProcess();
+	HANDLE hDbgHelp = GetModuleHandle("dbghelp.dll");
+	if(!hDbgHelp)	hDbgHelp = LoadLibrary("dbghelp.dll");
+	_StackWalk64 StackWalk64 = NULL;
+	if(hDbgHelp)	StackWalk64 = GetProcAddress(hDbgHelp,"StackWalk64");
+	HANDLE hImagehlp = GetModuleHandle("imagehlp.dll");
+	if(!hImagehlp)	hImagehlp = LoadLibrary("imagehlp.dll");
+	_StackWalk StackWalk = NULL;
+	LPVOID SymFunctionTableAccess=NULL,SymGetModuleBase=NULL;
+	if(!hImagehlp)	return 0;
+	StackWalk = GetProcAddress(hImagehlp,"StackWalk");
+	SymFunctionTableAccess = GetProcAddress(hImagehlp,"SymFunctionTableAccess");
+	SymGetModuleBase = GetProcAddress(hImagehlp,"SymGetModuleBase");
+	if(StackWalk64)
+	{	STACKFRAME64 callStack;
+		ZeroMemory(&callStack,sizeof(callStack));
+		callStack.AddrPC.Offset = ctx->Eip;
+		callStack.AddrPC.Mode = AddrModeFlat;
+		callStack.AddrStack.Offset = ctx->Esp;
+		callStack.AddrStack.Mode = AddrModeFlat;
+		callStack.AddrFrame.Offset = ctx->Ebp;
+		callStack.AddrFrame.Mode = AddrModeFlat;
+		while(1)
+		{	if(!StackWalk64(IMAGE_FILE_MACHINE_I386,hProcess,hThread,&callStack,NULL,NULL,NULL,NULL,NULL) || callStack.AddrFrame.Offset==0)
+				break;
+			module[0]=0;
+			GetModuleNameA((uint32_t)callStack.AddrPC.Offset,module);
+			if(module[0]==0)	tor_snprintf(module,sizeof(module),"unknown");
+			tor_snprintf(frame,sizeof(frame),"[%s] %s%sPC=%08X, Return = %08X, SP=%08X, Params: %08X, %08X, %08X, %08X",module,callStack.Far?"[Far] ":"",callStack.Virtual?"[Virtual] ":"",(uint32_t)callStack.AddrPC.Offset,(uint32_t)callStack.AddrReturn.Offset,(uint32_t)callStack.AddrStack.Offset,(uint32_t)callStack.Params[0],(uint32_t)callStack.Params[1],(uint32_t)callStack.Params[2],(uint32_t)callStack.Params[3]);
+			fn(arg,frame);
+			i++;
+		}
+	}
+	if(i < 2 && StackWalk && SymFunctionTableAccess && SymGetModuleBase)
+	{	STACKFRAME callStack;
+		ZeroMemory(&callStack,sizeof(callStack));
+		callStack.AddrPC.Offset = ctx->Eip;
+		callStack.AddrPC.Mode = AddrModeFlat;
+		callStack.AddrStack.Offset = ctx->Esp;
+		callStack.AddrStack.Mode = AddrModeFlat;
+		callStack.AddrFrame.Offset = ctx->Ebp;
+		callStack.AddrFrame.Mode = AddrModeFlat;
+		while(1)
+		{	if(!StackWalk(IMAGE_FILE_MACHINE_I386,hProcess,hThread,&callStack,NULL,NULL,SymFunctionTableAccess,SymGetModuleBase,NULL) || callStack.AddrFrame.Offset==0)
+				break;
+			module[0]=0;
+			GetModuleNameA((uint32_t)callStack.AddrPC.Offset,module);
+			if(module[0]==0)	tor_snprintf(module,sizeof(module),"unknown");
+			tor_snprintf(frame,sizeof(frame),"[%s] %s%sPC=%08X, Return = %08X, SP=%08X, Params: %08X, %08X, %08X, %08X",module,callStack.Far?"[Far] ":"",callStack.Virtual?"[Virtual] ":"",(uint32_t)callStack.AddrPC.Offset,(uint32_t)callStack.AddrReturn.Offset,(uint32_t)callStack.AddrStack.Offset,(uint32_t)callStack.Params[0],(uint32_t)callStack.Params[1],(uint32_t)callStack.Params[2],(uint32_t)callStack.Params[3]);
+			fn(arg,frame);
+			i++;
+		}
+	}
+	return i;
+}
+
 LONG __stdcall exception_filter(struct _EXCEPTION_POINTERS *ExceptionInfo)
 {	char errstr[8192];
 	int errstrlen = 0;
@@ -209,63 +276,7 @@ LONG __stdcall exception_filter(struct _EXCEPTION_POINTERS *ExceptionInfo)
 		{	DWORD written;
 			SetFilePointer(hFile,0,NULL,FILE_END);
 			WriteFile(hFile,errstr,errstrlen,&written,NULL);
-			HANDLE hDbgHelp = GetModuleHandle("dbghelp.dll");
-			if(!hDbgHelp)	hDbgHelp = LoadLibrary("dbghelp.dll");
-			_StackWalk64 StackWalk64 = NULL;
-			if(hDbgHelp)	StackWalk64 = GetProcAddress(hDbgHelp,"StackWalk64");
-			HANDLE hImagehlp = GetModuleHandle("imagehlp.dll");
-			if(!hImagehlp)	hImagehlp = LoadLibrary("imagehlp.dll");
-			_StackWalk StackWalk = NULL;
-			LPVOID SymFunctionTableAccess=NULL,SymGetModuleBase=NULL;
-			if(hImagehlp)
-			{	StackWalk = GetProcAddress(hImagehlp,"StackWalk");
-				SymFunctionTableAccess = GetProcAddress(hImagehlp,"SymFunctionTableAccess");
-				SymGetModuleBase = GetProcAddress(hImagehlp,"SymGetModuleBase");
-				i = 0;
-				if(StackWalk64)
-				{	STACKFRAME64 callStack;
-					HANDLE hProcess = GetCurrentProcess();
-					HANDLE hThread = GetCurrentThread();
-					ZeroMemory(&callStack,sizeof(callStack));
-					callStack.AddrPC.Offset = ExceptionInfo->ContextRecord->Eip;
-					callStack.AddrPC.Mode = AddrModeFlat;
-					callStack.AddrStack.Offset = ExceptionInfo->ContextRecord->Esp;
-					callStack.AddrStack.Mode = AddrModeFlat;
-					callStack.AddrFrame.Offset = ExceptionInfo->ContextRecord->Ebp;
-					callStack.AddrFrame.Mode = AddrModeFlat;
-					while(1)
-					{	if(!StackWalk64(IMAGE_FILE_MACHINE_I386,hProcess,hThread,&callStack,NULL,NULL,NULL,NULL,NULL) || callStack.AddrFrame.Offset==0)
-							break;
-						errstr[7000]=0;
-						GetModuleNameA((uint32_t)(uint32_t)callStack.AddrPC.Offset,&errstr[7000]);
-						if(errstr[7000]==0)	tor_snprintf(&errstr[7000],200,"unknown");
-						tor_snprintf(errstr,8191,"[%s] %s%sPC=%08X, Return = %08X, SP=%08X, Params: %08X, %08X, %08X, %08X\r\n",&errstr[7000],callStack.Far?"[Far] ":"",callStack.Virtual?"[Virtual] ":"",(uint32_t)callStack.AddrPC.Offset,(uint32_t)callStack.AddrReturn.Offset,(uint32_t)callStack.AddrStack.Offset,(uint32_t)callStack.Params[0],(uint32_t)callStack.Params[1],(uint32_t)callStack.Params[2],(uint32_t)callStack.Params[3]);
-						WriteFile(hFile,errstr,strlen(errstr),&written,NULL);
-						i++;
-					}
-				}
-				if(i < 2 && StackWalk && SymFunctionTableAccess && SymGetModuleBase)
-				{	STACKFRAME callStack;
-					HANDLE hProcess = GetCurrentProcess();
-					HANDLE hThread = GetCurrentThread();
-					ZeroMemory(&callStack,sizeof(callStack));
-					callStack.AddrPC.Offset = ExceptionInfo->ContextRecord->Eip;
-					callStack.AddrPC.Mode = AddrModeFlat;
-					callStack.AddrStack.Offset = ExceptionInfo->ContextRecord->Esp;
-					callStack.AddrStack.Mode = AddrModeFlat;
-					callStack.AddrFrame.Offset = ExceptionInfo->ContextRecord->Ebp;
-					callStack.AddrFrame.Mode = AddrModeFlat;
-					while(1)
-					{	if(!StackWalk(IMAGE_FILE_MACHINE_I386,hProcess,hThread,&callStack,NULL,NULL,SymFunctionTableAccess,SymGetModuleBase,NULL) || callStack.AddrFrame.Offset==0)
-							break;
-						errstr[7000]=0;
-						GetModuleNameA((uint32_t)(uint32_t)callStack.AddrPC.Offset,&errstr[7000]);
-						if(errstr[7000]==0)	tor_snprintf(&errstr[7000],200,"unknown");
-						tor_snprintf(&errstr[0],8191,"[%s] %s%sPC=%08X, Return = %08X, SP=%08X, Params: %08X, %08X, %08X, %08X\r\n",&errstr[7000],callStack.Far?"[Far] ":"",callStack.Virtual?"[Virtual] ":"",(uint32_t)callStack.AddrPC.Offset,(uint32_t)callStack.AddrReturn.Offset,(uint32_t)callStack.AddrStack.Offset,(uint32_t)callStack.Params[0],(uint32_t)callStack.Params[1],(uint32_t)callStack.Params[2],(uint32_t)callStack.Params[3]);
-						WriteFile(hFile,errstr,strlen(errstr),&written,NULL);
-					}
-				}
-			}
+			seh_walk_stack(GetCurrentThread(),ExceptionInfo->ContextRecord,seh_write_frame,hFile);
 #ifdef DEBUG_MALLOC
 			tor_snprintf(errstr,100,"\r\n\r\n");
 			WriteFile(hFile,errstr,strlen(errstr),&written,NULL);
@@ -76,5 +76,9 @@ typedef struct _STACKFRAME64
 typedef BOOL (WINAPI *_StackWalk)(DWORD,HANDLE,HANDLE,LPSTACKFRAME,LPVOID,LPVOID,LPVOID,LPVOID,LPVOID);
 typedef BOOL (WINAPI *_StackWalk64)(DWORD,HANDLE,HANDLE,LPSTACKFRAME64,LPVOID,LPVOID,LPVOID,LPVOID,LPVOID);
 
+/** Called by seh_walk_stack() with the description of each frame. */
+typedef void (*seh_frame_fn)(void *arg,const char *frame);
+
+int seh_walk_stack(HANDLE hThread,CONTEXT *ctx,seh_frame_fn fn,void *arg);
 void init_seh(void);
 void restore_seh(void);
@@ -0,0 +1,192 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcache.c
+ * \brief Remember which signatures on directory documents we checked.
+ *
+ * When we start, we check the signatures on the certificates, the consensus
+ * and the descriptors in our caches again, though we checked all of them
+ * when we downloaded them.  The RSA operations are most of the time that
+ * parsing these caches takes.  This module keeps the identifiers of the
+ * good signatures that we checked, a digest of the key digest, the signed
+ * digest and the signature, in DATADIR_VERIFIED_SIGNATURES, so that
+ * check_signature_digest() and networkstatus_check_document_signature() can
+ * skip the ones we checked before.
+ *
+ * The file goes into the encrypted .dat file with our other caches when the
+ * configuration is encrypted.  Someone who can change it can change our
+ * configuration and our list of directory authorities as well.
+ *
+ * Signatures are checked on cpuworker threads too, so the cache is
+ * protected by a mutex.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "file_io.h"
+#include "main.h"
+#include "sigcache.h"
+
+/** Forget the signatures that we didn't see for this long. */
+#define SIGCACHE_MAX_AGE (30*24*60*60)
+/** Don't remember more signatures than this. */
+#define SIGCACHE_MAX_ENTRIES 100000
+
+/** Map from signature identifier to the time_t (cast to void*) at which we
+ * last saw the signature, or NULL if sigcache_load() didn't run. */
+static digestmap_t *verified_sigs = NULL;
+/** Protects verified_sigs and sigcache_dirty. */
+static tor_mutex_t *sigcache_mutex = NULL;
+/** Did verified_sigs change since we last wrote it to disk? */
+static int sigcache_dirty = 0;
+
+/** Set <b>id_out</b> to the identifier of the signature <b>signature</b> of
+ * <b>signature_len</b> bytes on <b>digest</b>, made with the key whose
+ * digest is <b>key_digest</b>. */
+void
+sigcache_get_id(char *id_out, const char *key_digest, const char *digest,
+                size_t digest_len, const char *signature,
+                size_t signature_len)
+{
+  crypto_digest_env_t *d = crypto_new_digest_env();
+  crypto_digest_add_bytes(d, key_digest, DIGEST_LEN);
+  crypto_digest_add_bytes(d, digest, digest_len);
+  crypto_digest_add_bytes(d, signature, signature_len);
+  crypto_digest_get_digest(d, id_out, DIGEST_LEN);
+  crypto_free_digest_env(d);
+}
+
+/** Return true iff we checked the signature with identifier <b>id</b>
+ * before and it was good. */
+int
+sigcache_lookup(const char *id)
+{
+  int found = 0;
+  if (!sigcache_mutex)
+    return 0;
+  tor_mutex_acquire(sigcache_mutex);
+  if (verified_sigs && digestmap_get(verified_sigs, id)) {
+    /* Note that we still need it. */
+    digestmap_set(verified_sigs, id, (void*)(intptr_t)approx_time());
+    found = 1;
+  }
+  tor_mutex_release(sigcache_mutex);
+  return found;
+}
+
+/** Remember that the signature with identifier <b>id</b> is good. */
+void
+sigcache_add(const char *id)
+{
+  if (!sigcache_mutex)
+    return;
+  tor_mutex_acquire(sigcache_mutex);
+  if (verified_sigs && digestmap_size(verified_sigs) < SIGCACHE_MAX_ENTRIES) {
+    digestmap_set(verified_sigs, id, (void*)(intptr_t)approx_time());
+    sigcache_dirty = 1;
+  }
+  tor_mutex_release(sigcache_mutex);
+}
+
+/** Read the signatures that we checked before from disk.  Call once, before
+ * we parse the directory caches. */
+void
+sigcache_load(void)
+{
+  char *fname, *contents;
+  const char *s;
+  int n_loaded = 0;
+  time_t now = get_time(NULL);
+
+  if (!sigcache_mutex)
+    sigcache_mutex = tor_mutex_new();
+  tor_mutex_acquire(sigcache_mutex);
+  if (!verified_sigs)
+    verified_sigs = digestmap_new();
+  tor_mutex_release(sigcache_mutex);
+
+  fname = get_datadir_fname(DATADIR_VERIFIED_SIGNATURES);
+  contents = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  tor_free(fname);
+  if (!contents)
+    return;
+  tor_mutex_acquire(sigcache_mutex);
+  for (s = contents; *s; ) {
+    char hex[HEX_DIGEST_LEN+1];
+    char id[DIGEST_LEN];
+    long last_seen;
+    const char *eol = strchr(s, '\n');
+    if (!eol || sscanf(s, "%40s %ld", hex, &last_seen) != 2 ||
+        base16_decode(id, DIGEST_LEN, hex, HEX_DIGEST_LEN) < 0) {
+      log_warn(LD_DIR,get_lang_str(LANG_LOG_SIGCACHE_CORRUPT));
+      break;
+    }
+    s = eol+1;
+    if ((time_t)last_seen + SIGCACHE_MAX_AGE < now ||
+        digestmap_size(verified_sigs) >= SIGCACHE_MAX_ENTRIES)
+      continue;
+    digestmap_set(verified_sigs, id, (void*)(intptr_t)last_seen);
+    n_loaded++;
+  }
+  tor_mutex_release(sigcache_mutex);
+  tor_free(contents);
+  log_info(LD_DIR,get_lang_str(LANG_LOG_SIGCACHE_LOADED),n_loaded);
+}
+
+/** Write the signatures that we checked to disk if they changed, leaving
+ * out the ones that we didn't see for SIGCACHE_MAX_AGE. */
+void
+sigcache_save(void)
+{
+  smartlist_t *lines;
+  char *fname, *str;
+  time_t now = get_time(NULL);
+
+  if (!sigcache_mutex)
+    return;
+  tor_mutex_acquire(sigcache_mutex);
+  if (!verified_sigs || !sigcache_dirty) {
+    tor_mutex_release(sigcache_mutex);
+    return;
+  }
+  lines = smartlist_create();
+  DIGESTMAP_FOREACH(verified_sigs, id, void *, val) {
+    char hex[HEX_DIGEST_LEN+1];
+    char *line;
+    time_t last_seen = (time_t)(intptr_t)val;
+    if (last_seen + SIGCACHE_MAX_AGE < now)
+      continue;
+    base16_encode(hex, sizeof(hex), id, DIGEST_LEN);
+    tor_asprintf((unsigned char **)&line, "%s %ld\n", hex, (long)last_seen);
+    smartlist_add(lines, line);
+  } DIGESTMAP_FOREACH_END;
+  sigcache_dirty = 0;
+  tor_mutex_release(sigcache_mutex);
+
+  str = smartlist_join_strings(lines, "", 0, NULL);
+  fname = get_datadir_fname(DATADIR_VERIFIED_SIGNATURES);
+  if (write_str_to_file(fname, str, 0) < 0)
+    log_warn(LD_DIR,get_lang_str(LANG_LOG_SIGCACHE_SAVE_FAILED),fname);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(str);
+  tor_free(fname);
+}
+
+/** Save the signatures that we checked and forget them. */
+void
+sigcache_free_all(void)
+{
+  if (!sigcache_mutex)
+    return;
+  sigcache_save();
+  digestmap_free(verified_sigs, NULL);
+  verified_sigs = NULL;
+  tor_mutex_free(sigcache_mutex);
+  sigcache_mutex = NULL;
+}
+
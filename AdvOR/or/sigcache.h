@@ -0,0 +1,25 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcache.h
+ * \brief Header file for sigcache.c.
+ **/
+
+#ifndef _TOR_SIGCACHE_H
+#define _TOR_SIGCACHE_H
+
+void sigcache_get_id(char *id_out, const char *key_digest, const char *digest,
+                     size_t digest_len, const char *signature,
+                     size_t signature_len);
+int sigcache_lookup(const char *id);
+void sigcache_add(const char *id);
+void sigcache_load(void);
+void sigcache_save(void);
+void sigcache_free_all(void);
+
+#endif
+
@@ -0,0 +1,193 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file startup.c
+ * \brief Run the independent steps of our startup on worker threads.
+ *
+ * tor_main() used to build the GeoIP tables and load the exit list one
+ * after the other before the main dialog could come up, and the tor thread
+ * then read the certificate, consensus and descriptor caches from the disk
+ * as it parsed them.  startup_launch() starts each step of startup_steps on
+ * a thread of its own as soon as the steps that it depends on are done, and
+ * startup_wait() blocks until the given steps are done.
+ *
+ * Parsing the directory caches changes the routerlist and the networkstatus
+ * state, which are not locked, so it stays on the tor thread; the
+ * STARTUP_STEP_READ_* steps only read the cache files ahead of it, in the
+ * order in which it parses them, to get them into the file cache of the
+ * system.  That is where most of the time goes when we run from a slow
+ * removable drive.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "file_io.h"
+#include "geoip.h"
+#include "main.h"
+#include "startup.h"
+
+/** How much of a cache file we read at a time. */
+#define STARTUP_READ_CHUNK (256*1024)
+
+/** A step of our startup that can run on its own thread. */
+typedef struct startup_step_t {
+  int id; /**< STARTUP_STEP_* */
+  const char *name; /**< For the log. */
+  void (*fn)(struct startup_step_t *step); /**< Does the work. */
+  int deps; /**< STARTUP_STEP_* bits of the steps that must be done first. */
+  const char **files; /**< For read-ahead steps: NULL-terminated list of the
+                       * files to read from the data directory. */
+  smartlist_t *paths; /**< Full names of <b>files</b>. */
+  HANDLE done; /**< Manual-reset event, set once the step is done. */
+} startup_step_t;
+
+static void startup_read_ahead(startup_step_t *step);
+static void startup_geoip(startup_step_t *step);
+static void startup_iplist(startup_step_t *step);
+
+static const char *certs_files[] = {
+  DATADIR_CACHED_CERTS, NULL
+};
+static const char *consensus_files[] = {
+  DATADIR_CACHED_CONSENSUS, DATADIR_CACHED_CONSENSUS "-microdesc",
+  DATADIR_UNVERIFIED_CONSENSUS, NULL
+};
+static const char *descriptor_files[] = {
+  DATADIR_CACHED_DESCRIPTORS, DATADIR_CACHED_DESCRIPTORS_NEW,
+  "cached-microdescs", "cached-microdescs.new", NULL
+};
+
+/** The steps, each after the ones that it depends on. The read-ahead steps
+ * depend on each other so that they read one file at a time. */
+static startup_step_t startup_steps[] = {
+  { STARTUP_STEP_READ_CERTS, "certificates", startup_read_ahead, 0,
+    certs_files, NULL, NULL },
+  { STARTUP_STEP_READ_CONSENSUS, "consensus", startup_read_ahead,
+    STARTUP_STEP_READ_CERTS, consensus_files, NULL, NULL },
+  { STARTUP_STEP_READ_DESCRIPTORS, "descriptors", startup_read_ahead,
+    STARTUP_STEP_READ_CONSENSUS, descriptor_files, NULL, NULL },
+  { STARTUP_STEP_GEOIP, "GeoIP", startup_geoip, 0, NULL, NULL, NULL },
+  { STARTUP_STEP_IPLIST, "exit list", startup_iplist, 0, NULL, NULL, NULL },
+  { 0, NULL, NULL, 0, NULL, NULL, NULL }
+};
+
+/** Read the files of <b>step</b> and throw their contents away. */
+static void
+startup_read_ahead(startup_step_t *step)
+{
+  char *buf = tor_malloc(STARTUP_READ_CHUNK);
+  SMARTLIST_FOREACH_BEGIN(step->paths, const char *, fname) {
+    LPWSTR wname = get_unicode(fname);
+    DWORD n;
+    /* Don't get in the way of the tor thread if it starts writing. */
+    HANDLE h = CreateFileW(wname, GENERIC_READ,
+                           FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                           NULL);
+    tor_free(wname);
+    if (h == INVALID_HANDLE_VALUE)
+      continue;
+    while (ReadFile(h, buf, STARTUP_READ_CHUNK, &n, NULL) && n)
+      ;
+    CloseHandle(h);
+  } SMARTLIST_FOREACH_END(fname);
+  tor_free(buf);
+}
+
+/** Build the GeoIP tables. */
+static void
+startup_geoip(startup_step_t *step)
+{
+  (void) step;
+  geoip_ranges_init();
+}
+
+/** Load the list of the exits that we have seen. */
+static void
+startup_iplist(startup_step_t *step)
+{
+  (void) step;
+  iplist_init();
+}
+
+/** Wait for the steps that <b>step</b> depends on, then run it. */
+static void
+startup_run_step(startup_step_t *step)
+{
+  DWORD started;
+  if (step->deps)
+    startup_wait(step->deps);
+  started = GetTickCount();
+  step->fn(step);
+  log_info(LD_GENERAL,get_lang_str(LANG_LOG_STARTUP_STEP_DONE),step->name,
+           (unsigned long)(GetTickCount() - started));
+  SetEvent(step->done);
+}
+
+/** Thread function for startup_run_step(). */
+static void
+startup_step_main(void *arg)
+{
+  startup_run_step(arg);
+  spawn_exit();
+}
+
+/** Start all the steps of startup_steps. Call once, from the main thread,
+ * after the configuration and the language are loaded. */
+void
+startup_launch(void)
+{
+  startup_step_t *step;
+  int i;
+  for (step = startup_steps; step->fn; step++) {
+    step->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (step->files) {
+      step->paths = smartlist_create();
+      for (i = 0; step->files[i]; i++)
+        smartlist_add(step->paths, get_datadir_fname(step->files[i]));
+    }
+  }
+  for (step = startup_steps; step->fn; step++) {
+    if (spawn_func(startup_step_main, step) < 0)
+      startup_run_step(step);
+  }
+}
+
+/** Block until all the STARTUP_STEP_* steps in <b>steps</b> are done.
+ * Return at once if startup_launch() didn't run. */
+void
+startup_wait(int steps)
+{
+  HANDLE handles[STARTUP_STEPS_ALL];
+  DWORD n = 0;
+  startup_step_t *step;
+  for (step = startup_steps; step->fn; step++) {
+    if ((steps & step->id) && step->done)
+      handles[n++] = step->done;
+  }
+  if (n)
+    WaitForMultipleObjects(n, handles, TRUE, INFINITE);
+}
+
+/** Wait for the steps that are still running and release what they used. */
+void
+startup_free_all(void)
+{
+  startup_step_t *step;
+  startup_wait(STARTUP_STEPS_ALL);
+  for (step = startup_steps; step->fn; step++) {
+    if (step->done)
+      CloseHandle(step->done);
+    step->done = NULL;
+    if (step->paths) {
+      SMARTLIST_FOREACH(step->paths, char *, cp, tor_free(cp));
+      smartlist_free(step->paths);
+      step->paths = NULL;
+    }
+  }
+}
+
@@ -0,0 +1,35 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file startup.h
+ * \brief Header file for startup.c.
+ **/
+
+#ifndef _TOR_STARTUP_H
+#define _TOR_STARTUP_H
+
+/** Read the cached certificates ahead of trusted_dirs_reload_certs(). */
+#define STARTUP_STEP_READ_CERTS 1
+/** Read the cached consensuses ahead of
+ * router_reload_consensus_networkstatus(). */
+#define STARTUP_STEP_READ_CONSENSUS 2
+/** Read the descriptor caches ahead of router_reload_router_list() and
+ * of the microdescriptor cache. */
+#define STARTUP_STEP_READ_DESCRIPTORS 4
+/** Build the GeoIP tables. */
+#define STARTUP_STEP_GEOIP 8
+/** Load the list of the exits that we have seen. */
+#define STARTUP_STEP_IPLIST 16
+/** All of the above. */
+#define STARTUP_STEPS_ALL 31
+
+void startup_launch(void);
+void startup_wait(int steps);
+void startup_free_all(void);
+
+#endif
+
@@ -30,11 +30,13 @@ const char tor_svn_revision[] = "";
  * are typically file-private. */
 #define BUFFERS_PRIVATE
 #define CONFIG_PRIVATE
+#define CONSDIFF_PRIVATE
 #define CONTROL_PRIVATE
 #define CRYPTO_PRIVATE
 #define DIRSERV_PRIVATE
 #define DIRVOTE_PRIVATE
 #define GEOIP_PRIVATE
+#define LOG_PRIVATE
 #define MEMPOOL_PRIVATE
 #define ROUTER_PRIVATE
 
@@ -43,6 +45,12 @@ const char tor_svn_revision[] = "";
 #include "torgzip.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "circuitbuild.h"
+#include "consdiff.h"
+#include "networkstatus.h"
+#include "memgov.h"
+#include "perf.h"
+#include "routerlist.h"
 
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -157,6 +165,14 @@ free_pregenerated_keys(void)
   }
 }
 
+/** Helper for test_buffers: count how many times a buffer gave back memory
+ * it referred to. */
+static void
+test_buffers_release(void *arg)
+{
+  ++*(int *)arg;
+}
+
 /** Run unit tests for buffers.c */
 static void
 test_buffers(void)
@@ -166,6 +182,7 @@ test_buffers(void)
 
   buf_t *buf = NULL, *buf2 = NULL;
   const char *cp;
+  char *stats = NULL;
 
   int j;
   size_t r;
@@ -274,6 +291,28 @@ test_buffers(void)
     test_memeq(str2, str, 255);
   }
 
+  /* Truncate in the middle of a chunk, and append after it. */
+  buf_free(buf);
+  buf = buf_new();
+  for (j=0;j<67;++j) {
+    write_to_buf(str,255, buf);
+  }
+  buf_truncate(buf, 1000);
+  test_eq(buf_datalen(buf), 1000);
+  write_to_buf(str,255, buf);
+  test_eq(buf_datalen(buf), 1255);
+  for (j=0; j < 3; ++j) {
+    fetch_from_buf(str2, 255,buf);
+    test_memeq(str2, str, 255);
+  }
+  fetch_from_buf(str2, 235, buf);
+  test_memeq(str2, str, 235);
+  fetch_from_buf(str2, 255, buf);
+  test_memeq(str2, str, 255);
+  write_to_buf(str,255, buf);
+  buf_truncate(buf, 0);
+  test_eq(buf_datalen(buf), 0);
+
   /* Move from buf to buf. */
   buf_free(buf);
   buf = buf_new_with_capacity(4096);
@@ -298,6 +337,9 @@ test_buffers(void)
   r = 30000; /* incomplete move */
   move_buf_to_buf(buf2, buf, &r);
   test_eq(r, 13692);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+  test_eq(buf_datalen(buf), 0);
   for (j=0;j<97;++j) {
     fetch_from_buf(str2, 255, buf2);
     test_memeq(str2, str, 255);
@@ -306,6 +348,109 @@ test_buffers(void)
   buf_free(buf2);
   buf = buf2 = NULL;
 
+  /* Move whole chunks by relinking them, partial chunks at the end. */
+  buf = buf_new_with_capacity(4096);
+  buf2 = buf_new_with_capacity(4096);
+  for (j=0;j<64;++j)
+    write_to_buf(str, 255, buf);
+  write_to_buf(str, 10, buf2);
+  fetch_from_buf(str2, 10, buf2);
+  test_eq(buf_datalen(buf2), 0);
+  r = 255*40+7;
+  move_buf_to_buf(buf2, buf, &r);
+  test_eq(r, 0);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+  test_eq(buf_datalen(buf), 255*24-7);
+  test_eq(buf_datalen(buf2), 255*40+7);
+  for (j=0;j<40;++j) {
+    fetch_from_buf(str2, 255, buf2);
+    test_memeq(str2, str, 255);
+  }
+  fetch_from_buf(str2, 7, buf2);
+  test_memeq(str2, str, 7);
+  fetch_from_buf(str2, 248, buf);
+  test_memeq(str2, str+7, 248);
+  buf_free(buf);
+  buf_free(buf2);
+  buf = buf2 = NULL;
+
+  /* Refer to memory instead of copying it, and give it back when done. */
+  {
+    int released = 0;
+    buf = buf_new_with_capacity(4096);
+    buf2 = buf_new_with_capacity(4096);
+    write_to_buf(str, 10, buf);
+    write_ref_to_buf(str, 200, buf, test_buffers_release, &released);
+    write_to_buf(str+200, 56, buf);
+    test_eq(buf_datalen(buf), 266);
+    assert_buf_ok(buf);
+    fetch_from_buf(str2, 10, buf);
+    fetch_from_buf(str2, 100, buf);
+    test_memeq(str2, str, 100);
+    test_eq(released, 0);
+    r = 150;
+    move_buf_to_buf(buf2, buf, &r);
+    test_eq(r, 0);
+    assert_buf_ok(buf);
+    assert_buf_ok(buf2);
+    test_eq(released, 0);
+    fetch_from_buf(str2, 150, buf2);
+    test_memeq(str2, str+100, 150);
+    test_eq(released, 1);
+    /* Pulling up a chunk we refer to copies it first. */
+    write_ref_to_buf(str, 100, buf2, test_buffers_release, &released);
+    write_to_buf(str+100, 100, buf2);
+    buf_pullup(buf2, 150);
+    test_eq(released, 2);
+    assert_buf_ok(buf2);
+    fetch_from_buf(str2, 200, buf2);
+    test_memeq(str2, str, 200);
+    write_ref_to_buf(str, 100, buf2, test_buffers_release, &released);
+    buf_free(buf);
+    buf_free(buf2);
+    buf = buf2 = NULL;
+    test_eq(released, 3);
+  }
+
+  /* Decode a fixed-length cell that straddles two chunks. */
+  {
+    cell_t cell;
+    char cellbuf[CELL_NETWORK_SIZE];
+    buf = buf_new_with_capacity(4096);
+    memset(cellbuf, 'x', sizeof(cellbuf));
+    cellbuf[0] = 0x01; cellbuf[1] = 0x02; cellbuf[2] = 7;
+    write_to_buf(cellbuf, 100, buf);
+    test_eq(fetch_cell_from_buf(buf, &cell), 0);
+    test_eq(buf_datalen(buf), 100);
+    fetch_from_buf(str2, 100, buf);
+    for (j=0;j<15;++j)
+      write_to_buf(str, 255, buf);
+    write_to_buf(cellbuf, CELL_NETWORK_SIZE, buf);
+    for (j=0;j<15;++j)
+      fetch_from_buf(str2, 255, buf);
+    test_eq(fetch_cell_from_buf(buf, &cell), 1);
+    test_eq(cell.circ_id, 0x0102);
+    test_eq(cell.command, 7);
+    test_memeq(cell.payload, cellbuf+3, CELL_PAYLOAD_SIZE);
+    test_eq(buf_datalen(buf), 0);
+    buf_free(buf);
+    buf = NULL;
+  }
+
+  /* Chunks on buffers count as in use, and show up in the freelist stats. */
+  buf = buf_new_with_capacity(4096);
+  write_to_buf(str, 255, buf);
+  stats = buf_get_freelist_stats();
+  test_assert(stats);
+#ifdef ENABLE_BUF_FREELISTS
+  test_assert(strstr(stats, "size=4096 "));
+  test_assert(!strstr(stats, "in-use=-"));
+#endif
+  tor_free(stats);
+  buf_free(buf);
+  buf = NULL;
+
   buf = buf_new_with_capacity(5);
   cp = "Testing. This is a moderately long Testing string.";
   for (j = 0; cp[j]; j++)
@@ -323,6 +468,25 @@ test_buffers(void)
   buf_free(buf);
   buf = NULL;
 
+  /* Search across chunk boundaries, with long runs inside each chunk. */
+  memset(str2, 'a', sizeof(str2));
+  for (j = 3950; j < 4150; ++j) {
+    char line[8192];
+    size_t linelen = sizeof(line);
+    int k;
+    buf = buf_new_with_capacity(4096);
+    for (k = j; k > 0; k -= (int)MIN(k, 256))
+      write_to_buf(str2, MIN(k, 256), buf);
+    write_to_buf("\r\n\r\nbody", 8, buf);
+    test_eq(j, buf_find_string_offset(buf, "\r\n\r\n", 4));
+    test_eq(j+4, buf_find_string_offset(buf, "body", 4));
+    test_eq(-1, buf_find_string_offset(buf, "\r\n\r\r", 4));
+    test_eq(1, fetch_from_buf_line(buf, line, &linelen));
+    test_eq(linelen, (size_t)j+2);
+    buf_free(buf);
+    buf = NULL;
+  }
+
 #if 0
   {
   int s;
@@ -398,6 +562,7 @@ test_buffers(void)
     buf_free(buf);
   if (buf2)
     buf_free(buf2);
+  tor_free(stats);
 }
 
 /** Run unit tests for Diffie-Hellman functionality. */
@@ -455,6 +620,17 @@ test_crypto_rng(void)
   crypto_rand(data1, 100);
   crypto_rand(data2, 100);
   test_memneq(data1,data2,100);
+
+  /* Small requests come from the buffered pool: they must not repeat,
+   * whether or not the pool is refilled or reseeded in between. */
+  for (i = 0; i < 100; i += 4)
+    crypto_rand(data1+i, 4);
+  test_assert(! crypto_seed_rng(0));
+  for (i = 0; i < 100; i += 4)
+    crypto_rand(data2+i, 4);
+  test_memneq(data1,data2,100);
+  for (i = 4; i < 100; i += 4)
+    test_memneq(data1,data1+i,4);
   allok = 1;
   for (i = 0; i < 100; ++i) {
     uint64_t big;
@@ -601,6 +777,23 @@ test_crypto_aes(void)
   crypto_cipher_crypt_inplace(env1, data2, 64);
   test_assert(tor_mem_is_zero(data2, 64));
 
+  /* Rollover inside a run long enough to be encrypted many blocks at a time
+   * must give the same keystream as short pieces. */
+  crypto_cipher_set_iv(env1, "\xff\xff\xff\xff\xff\xff\xff\xff"
+                             "\xff\xff\xff\xff\xff\xff\xff\xff");
+  memset(data2, 0, 1024);
+  crypto_cipher_crypt_inplace(env1, data2, 1000);
+  test_memeq_hex(data2, "2aed2bff0de54f9328efd070bf48f70a"
+                        "0EDD33D3C621E546455BD8BA1418BEC8"
+                        "93e2c5243d6839eac58503919192f7ae"
+                        "1908e67cafa08d508816659c2e693191");
+  crypto_cipher_set_iv(env1, "\xff\xff\xff\xff\xff\xff\xff\xff"
+                             "\xff\xff\xff\xff\xff\xff\xff\xff");
+  memset(data3, 0, 1024);
+  for (j = 0; j < 1000; j += 40)
+    crypto_cipher_crypt_inplace(env1, data3+j, 40);
+  test_memeq(data2, data3, 1000);
+
  done:
   if (env1)
     crypto_free_cipher_env(env1);
@@ -616,6 +809,7 @@ static void
 test_crypto_sha(void)
 {
   crypto_digest_env_t *d1 = NULL, *d2 = NULL;
+  crypto_digest_checkpoint_t checkpoint;
   int i;
   char key[80];
   char digest[20];
@@ -626,6 +820,11 @@ test_crypto_sha(void)
   i = crypto_digest(data, "abc", 3);
   test_memeq_hex(data, "A9993E364706816ABA3E25717850C26C9CD0D89D");
 
+  /* Test SHA3-256 with a test vector from the specification. */
+  i = crypto_digest_sha3_256(data, "abc", 3);
+  test_memeq_hex(data, "3A985DA74FE225B2045C172D6BD390BD"
+                       "855F086E3E9D525B46BFE24511431532");
+
   /* Test HMAC-SHA-1 with test cases from RFC2202. */
 
   /* Case 1. */
@@ -673,6 +872,15 @@ test_crypto_sha(void)
   crypto_digest(d_out2, "abcdef", 6);
   test_memeq(d_out1, d_out2, DIGEST_LEN);
 
+  /* Saving and restoring a digest's state on the stack. */
+  crypto_digest_checkpoint(&checkpoint, d1);
+  crypto_digest_add_bytes(d1, "ghijkl", 6);
+  crypto_digest_restore(d1, &checkpoint);
+  crypto_digest_add_bytes(d1, "mno", 3);
+  crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+  crypto_digest(d_out2, "abcdefmno", 9);
+  test_memeq(d_out1, d_out2, DIGEST_LEN);
+
  done:
   if (d1)
     crypto_free_digest_env(d1);
@@ -862,6 +1070,26 @@ test_crypto(void)
   strlcpy(data1, "f0dz!8affc000100", 1024);
   test_eq(-1, base16_decode(data2, 8, data1, 16));
 
+  /* Long enough inputs to go through the block codecs, with a bad digit in
+   * the second block. */
+  for (idx = 0; idx < 100; ++idx)
+    data3[idx] = (char)(idx * 37);
+  base16_encode(data1, 201, data3, 100);
+  test_eq(strlen(data1), 200);
+  test_assert(!strcmpstart(data1, "00254A6F94B9DE03"));
+  tor_strlower(data1+40);
+  test_eq(0, base16_decode(data2, 100, data1, 200));
+  test_memeq(data2, data3, 100);
+  data1[45] = 'g';
+  test_eq(-1, base16_decode(data2, 100, data1, 200));
+
+  /* Multiline base64, decoded a line at a time by the block decoder. */
+  i = base64_encode(data1, 1024, data3, 100, BASE64_ENCODE_MULTILINE);
+  test_assert(i > 0);
+  test_assert(strchr(data1, '\n'));
+  test_eq(100, base64_decode(data2, 1024, data1, i));
+  test_memeq(data2, data3, 100);
+
   tor_free(data1);
   tor_free(data2);
   tor_free(data3);
@@ -1652,6 +1880,20 @@ test_util_ip6_helpers(void)
   p1 = tor_addr_to_str(buf, &t1, sizeof(buf), 1);
   test_streq(p1, "18.0.0.1");
 
+  /* Each part of a dotted quad is one to three digits, at most 255. */
+  test_eq(AF_INET, tor_addr_from_str(&t1, "255.0.10.009"));
+  p1 = tor_addr_to_str(buf, &t1, sizeof(buf), 0);
+  test_streq(p1, "255.0.10.9");
+  test_eq(-1, tor_addr_from_str(&t1, "1.2.3"));
+  test_eq(-1, tor_addr_from_str(&t1, "1.2.3.4."));
+  test_eq(-1, tor_addr_from_str(&t1, "1..3.4"));
+  test_eq(-1, tor_addr_from_str(&t1, "1.2.3.256"));
+  test_eq(-1, tor_addr_from_str(&t1, "1.2.3.0004"));
+  test_eq(-1, tor_addr_from_str(&t1, "[1.2.3.4"));
+  test_eq(AF_INET, tor_addr_from_str(&t1, "255.255.255.255"));
+  test_assert(!tor_addr_to_str(buf, &t1, 15, 0));
+  test_streq(tor_addr_to_str(buf, &t1, 16, 0), "255.255.255.255");
+
   /* Test tor_addr_parse_reverse_lookup_name */
   i = tor_addr_parse_reverse_lookup_name(&t1, "Foobar.baz", AF_UNSPEC, 0);
   test_eq(0, i);
@@ -1774,6 +2016,8 @@ static void
 test_util_smartlist_basic(void)
 {
   smartlist_t *sl;
+  SMARTLIST_LOCAL(local_sl, 4);
+  int i;
 
   /* XXXX test sort_digests, uniq_strings, uniq_digests */
 
@@ -1804,8 +2048,22 @@ test_util_smartlist_basic(void)
   test_assert(smartlist_isin(sl, (void*)3));
   test_assert(!smartlist_isin(sl, (void*)99));
 
+  /* A local smartlist uses its own storage until it outgrows it. */
+  for (i = 0; i < 4; ++i)
+    smartlist_add(&local_sl, (void*)(uintptr_t)(i+1));
+  test_assert(local_sl.list == local_sl_storage);
+  smartlist_insert(&local_sl, 0, (void*)0);
+  test_assert(local_sl.list != local_sl_storage);
+  test_eq(5, smartlist_len(&local_sl));
+  for (i = 0; i < 5; ++i)
+    test_eq_ptr((void*)(uintptr_t)i, smartlist_get(&local_sl, i));
+  smartlist_add_all(&local_sl, sl);
+  test_eq(9, smartlist_len(&local_sl));
+  test_eq_ptr((void*)555, smartlist_get(&local_sl, 6));
+
  done:
   smartlist_free(sl);
+  smartlist_local_free(&local_sl);
 }
 
 /** Run unit tests for smartlist-of-strings functionality. */
@@ -2259,6 +2517,136 @@ test_util_digestset(void)
   smartlist_free(included);
 }
 
+/** Run unit tests for ip_range_set_t. */
+static void
+test_util_ip_range_set(void)
+{
+  ip_range_set_t *set = ip_range_set_new();
+
+  test_assert(!ip_range_set_contains(set, 0x0a000001));
+  ip_range_set_add(set, 0x0a000000, 0x0a0000ff);
+  ip_range_set_add(set, 0xc0a80100, 0xc0a801ff);
+  ip_range_set_add(set, 0x0a000180, 0x0a000110); /* swapped bounds */
+  ip_range_set_add(set, 0x0a000050, 0x0a000060); /* inside the first */
+  ip_range_set_add(set, 0xffffff00, 0xffffffff);
+  ip_range_set_compile(set);
+  test_eq(set->n_ranges, 4);
+  test_assert(ip_range_set_contains(set, 0x0a000000));
+  test_assert(ip_range_set_contains(set, 0x0a0000ff));
+  test_assert(!ip_range_set_contains(set, 0x0a0000ff+1));
+  test_assert(ip_range_set_contains(set, 0x0a000110));
+  test_assert(ip_range_set_contains(set, 0x0a000180));
+  test_assert(!ip_range_set_contains(set, 0x0a000181));
+  test_assert(!ip_range_set_contains(set, 0x09ffffff));
+  test_assert(ip_range_set_contains(set, 0xc0a80123));
+  test_assert(ip_range_set_contains(set, 0xffffffff));
+  test_assert(!ip_range_set_contains(set, 0));
+
+  /* Touching ranges are merged once they are searched again. */
+  ip_range_set_add(set, 0x0a000100, 0x0a00010f);
+  test_assert(ip_range_set_contains(set, 0x0a0000ff));
+  test_eq(set->n_ranges, 3);
+
+  ip_range_set_clear(set);
+  test_assert(!ip_range_set_contains(set, 0x0a000001));
+
+ done:
+  ip_range_set_free(set);
+}
+
+/** An element of the open-addressed table in test_util_oaht. */
+typedef struct oaht_test_ent_t {
+  OAHT_ENTRY(oaht_test_ent_t) node;
+  int key;
+} oaht_test_ent_t;
+
+/** Helper for test_util_oaht: a deliberately poor hash, so that many keys
+ * share control tags and probe sequences. */
+static INLINE unsigned
+oaht_test_hash(oaht_test_ent_t *e)
+{
+  return (unsigned)(e->key % 37);
+}
+
+/** Helper for test_util_oaht: compare keys. */
+static INLINE int
+oaht_test_eq(oaht_test_ent_t *a, oaht_test_ent_t *b)
+{
+  return a->key == b->key;
+}
+
+static OAHT_HEAD(oaht_test_map, oaht_test_ent_t) oaht_test_map =
+  OAHT_INITIALIZER();
+OAHT_PROTOTYPE(oaht_test_map, oaht_test_ent_t, node, oaht_test_hash,
+               oaht_test_eq)
+OAHT_GENERATE(oaht_test_map, oaht_test_ent_t, node, oaht_test_hash,
+              oaht_test_eq, 0.8)
+
+/** Run unit tests for the open-addressed hash table macros. */
+static void
+test_util_oaht(void)
+{
+  oaht_test_ent_t *ents = tor_malloc_zero(sizeof(oaht_test_ent_t)*2000);
+  oaht_test_ent_t search, **ent;
+  int i, n;
+
+  search.key = 5;
+  test_eq_ptr(NULL, HT_FIND(oaht_test_map, &oaht_test_map, &search));
+  for (i = 0; i < 2000; ++i) {
+    ents[i].key = i;
+    HT_INSERT(oaht_test_map, &oaht_test_map, &ents[i]);
+  }
+  test_eq(2000, HT_SIZE(&oaht_test_map));
+  test_eq(0, _oaht_test_map_HT_REP_IS_BAD(&oaht_test_map));
+  for (i = 0; i < 2000; ++i) {
+    search.key = i;
+    test_eq_ptr(&ents[i], HT_FIND(oaht_test_map, &oaht_test_map, &search));
+  }
+  search.key = 2000;
+  test_eq_ptr(NULL, HT_FIND(oaht_test_map, &oaht_test_map, &search));
+
+  /* Remove the odd keys, and make sure the even ones are still there. */
+  for (i = 1; i < 2000; i += 2) {
+    search.key = i;
+    test_eq_ptr(&ents[i], HT_REMOVE(oaht_test_map, &oaht_test_map, &search));
+  }
+  search.key = 1;
+  test_eq_ptr(NULL, HT_REMOVE(oaht_test_map, &oaht_test_map, &search));
+  test_eq(1000, HT_SIZE(&oaht_test_map));
+  test_eq(0, _oaht_test_map_HT_REP_IS_BAD(&oaht_test_map));
+  for (i = 0; i < 2000; ++i) {
+    search.key = i;
+    test_eq_ptr((i & 1) ? NULL : &ents[i],
+                HT_FIND(oaht_test_map, &oaht_test_map, &search));
+  }
+
+  /* Reuse the freed slots. */
+  for (i = 1; i < 2000; i += 2)
+    HT_INSERT(oaht_test_map, &oaht_test_map, &ents[i]);
+  test_eq(0, _oaht_test_map_HT_REP_IS_BAD(&oaht_test_map));
+
+  /* Iterate, removing every key under 1000. */
+  n = 0;
+  for (ent = HT_START(oaht_test_map, &oaht_test_map); ent; ) {
+    ++n;
+    if ((*ent)->key < 1000)
+      ent = HT_NEXT_RMV(oaht_test_map, &oaht_test_map, ent);
+    else
+      ent = HT_NEXT(oaht_test_map, &oaht_test_map, ent);
+  }
+  test_eq(2000, n);
+  test_eq(1000, HT_SIZE(&oaht_test_map));
+  test_eq(0, _oaht_test_map_HT_REP_IS_BAD(&oaht_test_map));
+  search.key = 999;
+  test_eq_ptr(NULL, HT_FIND(oaht_test_map, &oaht_test_map, &search));
+  search.key = 1999;
+  test_eq_ptr(&ents[1999], HT_FIND(oaht_test_map, &oaht_test_map, &search));
+
+ done:
+  HT_CLEAR(oaht_test_map, &oaht_test_map);
+  tor_free(ents);
+}
+
 /** mutex for thread test to stop the threads hitting data at the same time. */
 static tor_mutex_t *_thread_test_mutex = NULL;
 /** mutexes for the thread test to make sure that the threads have to
@@ -2553,9 +2941,30 @@ test_util_gzip(void)
                                   ZLIB_METHOD, 1, LOG_WARN));
   test_streq(buf3, "ABCDEFGHIJABCDEFGHIJ"); /*Make sure it compressed right.*/
 
+  /* A state we give back gets reset and reused, and works like new. */
+  tor_zlib_pool_init();
+  {
+    tor_zlib_state_t *old_state = state;
+    tor_zlib_free(state);
+    state = tor_zlib_new(1, ZLIB_METHOD);
+    test_assert(state == old_state);
+  }
+  tor_free(buf2);
+  cp1 = buf2 = tor_malloc(1024);
+  len2 = 1024;
+  ccp2 = "ABCDEFGHIJABCDEFGHIJ";
+  len1 = 21;
+  test_assert(tor_zlib_process(state, &cp1, &len2, &ccp2, &len1, 1)
+              == TOR_ZLIB_DONE);
+  tor_free(buf3);
+  tor_assert(!tor_gzip_uncompress(&buf3, &len1, buf2, 1024-len2,
+                                  ZLIB_METHOD, 1, LOG_WARN));
+  test_streq(buf3, "ABCDEFGHIJABCDEFGHIJ");
+
  done:
   if (state)
     tor_zlib_free(state);
+  tor_zlib_free_all();
   tor_free(buf2);
   tor_free(buf3);
   tor_free(buf1);
@@ -2715,6 +3124,27 @@ test_util_mmap(void)
   tor_munmap_file(mapping);
   mapping = NULL;
 
+  /* Patch the aligned file in place, and extend it. */
+  {
+    smartlist_t *chunks = smartlist_create();
+    offset_chunk_t c1 = { 100, "patched", 7 };
+    offset_chunk_t c2 = { 16384, "tail", 4 };
+    smartlist_add(chunks, &c1);
+    smartlist_add(chunks, &c2);
+    test_eq(0, patch_chunks_in_file(fname3, chunks));
+    test_eq(-1, patch_chunks_in_file(fname1, chunks));
+    smartlist_free(chunks);
+  }
+  mapping = tor_mmap_file(fname3);
+  test_assert(mapping);
+  test_eq(mapping->size, 16388);
+  test_memeq(mapping->data, buf, 100);
+  test_memeq(mapping->data+100, "patched", 7);
+  test_memeq(mapping->data+107, buf+107, 16384-107);
+  test_memeq(mapping->data+16384, "tail", 4);
+  tor_munmap_file(mapping);
+  mapping = NULL;
+
  done:
   unlink(fname1);
   unlink(fname2);
@@ -2850,6 +3280,7 @@ test_onion_handshake(void)
 
   /* shared */
   crypto_pk_env_t *pk = NULL;
+  crypto_dh_env_t *pool_dh1 = NULL, *pool_dh2 = NULL;
 
   pk = pk_generate(0);
 
@@ -2875,7 +3306,21 @@ test_onion_handshake(void)
   memset(s_buf, 0, 40);
   test_memneq(c_keys, s_buf, 40);
 
+  /* Keypairs from the precomputed pool are never handed out twice. */
+  onion_dh_pool_init();
+  pool_dh1 = onion_dh_pool_get();
+  pool_dh2 = onion_dh_pool_get();
+  test_assert(pool_dh1 && pool_dh2);
+  test_assert(! crypto_dh_get_public(pool_dh1, c_buf, DH_KEY_LEN));
+  test_assert(! crypto_dh_get_public(pool_dh2, s_buf, DH_KEY_LEN));
+  test_memneq(c_buf, s_buf, DH_KEY_LEN);
+
  done:
+  onion_dh_pool_free_all();
+  if (pool_dh1)
+    crypto_dh_free(pool_dh1);
+  if (pool_dh2)
+    crypto_dh_free(pool_dh2);
   if (c_dh)
     crypto_dh_free(c_dh);
   if (pk)
@@ -3227,6 +3672,65 @@ test_dirutil(void)
   test_memeq(pair->first,  "secret data.\0\0\0\0\0\xff\xff\xff", DIGEST_LEN);
   test_memeq(pair->second, "Use AES-256 instead.", DIGEST_LEN);
 
+  /* Interned router strings are shared; identities in families are
+   * written one way. */
+  {
+    char *s1 = router_intern_string("Tor 0.2.2.35 on Linux");
+    char *s2 = router_intern_string("Tor 0.2.2.35 on Linux");
+    char *f1 = router_intern_family_member(
+                       "73656372657420646174612e0000000000ffffff");
+    char *f2 = router_intern_family_member(
+                       "$73656372657420646174612E0000000000FFFFFF");
+    char *f3 = router_intern_family_member("Unnamed");
+    test_assert(s1 == s2);
+    test_streq(f1, "$73656372657420646174612E0000000000FFFFFF");
+    test_assert(f1 == f2);
+    test_streq(f3, "Unnamed");
+    router_release_string(s1);
+    router_release_string(f1);
+    router_release_string(f3);
+    s1 = router_intern_string("Tor 0.2.2.35 on Linux");
+    test_assert(s1 == s2);
+    router_release_string(s1);
+    router_release_string(s2);
+    router_release_string(f2);
+    /* Strings we didn't intern are just freed. */
+    router_release_string(tor_strdup("Tor 0.2.2.35 on Linux"));
+  }
+
+  /* Nickname lists from the config match by nickname or by identity. */
+  {
+    routerinfo_t ri;
+    memset(&ri, 0, sizeof(ri));
+    ri.nickname = (char*)"Jimi";
+    memcpy(ri.cache_info.identity_digest, "secret data.\0\0\0\0\0\xff\xff\xff",
+           DIGEST_LEN);
+    test_assert(router_nickname_is_in_list(&ri, "alpha, jimi"));
+    test_assert(router_nickname_is_in_list(&ri,
+                  "alpha,$73656372657420646174612e0000000000ffffff"));
+    test_assert(router_nickname_is_in_list(&ri,
+                  "$73656372657420646174612E0000000000FFFFFF~jimi"));
+    test_assert(!router_nickname_is_in_list(&ri,
+                  "$73656372657420646174612E0000000000FFFFFF=bob"));
+    test_assert(!router_nickname_is_in_list(&ri, "alpha, beta"));
+    test_assert(!router_nickname_is_in_list(&ri, NULL));
+  }
+
+  /* Consensus parameters are parsed once, and the first good value of a
+   * parameter wins. */
+  {
+    networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+    ns->net_params = smartlist_create();
+    smartlist_split_string(ns->net_params, "bar=-5 foo=x foo=3 foo=7 junk",
+                           " ", 0, 0);
+    test_eq(3, networkstatus_get_param(ns, "foo", 0, -100, 100));
+    test_eq(0, networkstatus_get_param(ns, "bar", 1, 0, 100));
+    test_eq(42, networkstatus_get_param(ns, "baz", 42, 0, 100));
+    test_eq(42, networkstatus_get_param(ns, "ba", 42, 0, 100));
+    test_eq(-1, networkstatus_get_bw_weight(ns, "Wgg", -1));
+    networkstatus_vote_free(ns);
+  }
+
  done:
   SMARTLIST_FOREACH(sl, fp_pair_t *, pair, tor_free(pair));
   smartlist_free(sl);
@@ -3258,6 +3762,37 @@ test_same_voter(networkstatus_voter_info_t *v1,
   ;
 }
 
+/** Run unit tests for compiled log filters. */
+static void
+test_util_log_filter(void)
+{
+  log_filter_t *lf = log_filter_new("circuit\r\nhers\n\nhe\n");
+  smartlist_t *names = smartlist_create();
+  log_domain_mask_t mask = 0;
+
+  test_assert(log_filter_matches(lf, "Building a circuit"));
+  test_assert(log_filter_matches(lf, "ushers"));
+  test_assert(log_filter_matches(lf, "the end"));
+  test_assert(!log_filter_matches(lf, "circui"));
+  /* Patterns don't match across the end of a line. */
+  test_assert(!log_filter_matches(lf, "h\re"));
+  test_assert(!log_filter_matches(lf, ""));
+  log_filter_free(lf);
+  lf = log_filter_new("\r\n");
+  test_assert(!log_filter_matches(lf, "anything"));
+
+  smartlist_split_string(names, "circ,Dir", ",", 0, 0);
+  test_eq(parse_log_domains(names, &mask), 0);
+  test_eq(mask, LD_CIRC|LD_DIR);
+  smartlist_add(names, tor_strdup("nosuchdomain"));
+  test_eq(parse_log_domains(names, &mask), -1);
+
+ done:
+  log_filter_free(lf);
+  SMARTLIST_FOREACH(names, char *, cp, tor_free(cp));
+  smartlist_free(names);
+}
+
 /** Run unit tests for getting the median of a list. */
 static void
 test_util_order_functions(void)
@@ -3288,6 +3823,69 @@ test_util_order_functions(void)
   ;
 }
 
+/** Run tests for the data-independent comparisons in di_ops.c. */
+static void
+test_util_di_ops(void)
+{
+#define DI_BUF_LEN 4096
+#define DI_ROUNDS 20000
+  char *a = tor_malloc(DI_BUF_LEN + 16), *b = tor_malloc(DI_BUF_LEN + 16);
+  size_t sz, off, i;
+  struct timeval start, end;
+  long t_first, t_last;
+  int r, n_eq = 0;
+
+  /* Every size around the chunk widths, at every alignment. */
+  for (sz = 0; sz <= 70; ++sz) {
+    for (off = 0; off < 8; ++off) {
+      for (i = 0; i < DI_BUF_LEN + 16; ++i)
+        a[i] = b[i] = (char)(i * 7 + 1);
+      test_eq(1, tor_memeq(a+off, b+off, sz));
+      test_eq(0, tor_memneq(a+off, b+off, sz));
+      for (i = 0; i < sz; ++i) {
+        b[off+i] ^= (char)(1 << (i & 7));
+        test_eq(0, tor_memeq(a+off, b+off, sz));
+        test_eq(1, tor_memneq(a+off, b+off, sz));
+        /* Bytes that are different outside of the range don't count. */
+        test_eq(1, tor_memeq(a+off, b+off, i));
+        b[off+i] ^= (char)(1 << (i & 7));
+      }
+    }
+  }
+  test_eq(1, tor_memeq(a, b, DI_BUF_LEN));
+  b[DI_BUF_LEN-1] ^= (char)0x80;
+  test_eq(0, tor_memeq(a, b, DI_BUF_LEN));
+  b[DI_BUF_LEN-1] ^= (char)0x80;
+
+  /* A compare that makes up its mind at the first different byte is done
+   * long before one that has to read the whole buffer; tor_memeq() must
+   * take as long when the first byte differs as when only the last one
+   * does.  The bound is loose so that a busy machine doesn't fail it. */
+  b[0] ^= 1;
+  tor_gettimeofday(&start);
+  for (i = 0; i < DI_ROUNDS; ++i)
+    n_eq += tor_memeq(a, b, DI_BUF_LEN);
+  tor_gettimeofday(&end);
+  t_first = tv_udiff(&start, &end);
+  b[0] ^= 1;
+  b[DI_BUF_LEN-1] ^= 1;
+  tor_gettimeofday(&start);
+  for (i = 0; i < DI_ROUNDS; ++i)
+    n_eq += tor_memeq(a, b, DI_BUF_LEN);
+  tor_gettimeofday(&end);
+  t_last = tv_udiff(&start, &end);
+  b[DI_BUF_LEN-1] ^= 1;
+  test_eq(0, n_eq);
+  r = (t_first + 1) * 4 >= t_last;
+  test_assert(r);
+
+ done:
+  tor_free(a);
+  tor_free(b);
+#undef DI_BUF_LEN
+#undef DI_ROUNDS
+}
+
 /** Helper: Make a new routerinfo containing the right information for a
  * given vote_routerstatus_t. */
 static routerinfo_t *
@@ -3877,6 +4475,83 @@ test_policies(void)
   test_assert(0 == policies_parse_exit_policy(NULL, &policy2, 1, NULL));
   test_assert(policy2);
 
+  /* The compiled form of a router's exit policy gives the same answers. */
+  {
+    routerinfo_t ri;
+    smartlist_t *policy3 = NULL;
+    memset(&ri, 0, sizeof(ri));
+    line.key = (char*)"foo";
+    line.value = (char*)"accept 10.0.0.0/8:80-443,reject 10.1.0.0/16:*,"
+      "accept *:22,reject 1.2.3.4:1-1024";
+    line.next = NULL;
+    test_assert(0 == policies_parse_exit_policy(&line, &policy3, 1, NULL, 1));
+    ri.exit_policy = policy3;
+    for (i = 0; i < 2000; ++i) {
+      static const uint32_t addrs[] =
+        { 0, 0x0a010203u, 0x0a020304u, 0x01020304u, 0xc0a80101u };
+      uint32_t addr = addrs[i % 5];
+      uint16_t port = (uint16_t)(1 + crypto_rand_int(65535));
+      if (i % 7 == 0)
+        addr = (uint32_t)crypto_rand_int(0x7fffffff);
+      test_eq(compare_addr_to_addr_policy(addr, port, policy3),
+              router_compare_addr_to_exit_policy(addr, port, &ri));
+    }
+    router_free_exit_policy(&ri);
+  }
+
+  /* Routers with the same exit policy share one interned copy. */
+  {
+    routerinfo_t ri1, ri2;
+    char *s1, *s2;
+    memset(&ri1, 0, sizeof(ri1));
+    memset(&ri2, 0, sizeof(ri2));
+    test_assert(0 == policies_parse_exit_policy(NULL, &ri1.exit_policy,
+                                                1, NULL, 1));
+    test_assert(0 == policies_parse_exit_policy(NULL, &ri2.exit_policy,
+                                                1, NULL, 1));
+    router_intern_exit_policy(&ri1);
+    router_intern_exit_policy(&ri2);
+    test_assert(ri1.exit_policy == ri2.exit_policy);
+    test_assert(ri1.compiled_exit_policy == ri2.compiled_exit_policy);
+    for (i = 1; i < 65536; i += 7)
+      test_eq(compare_addr_to_addr_policy(0, i, policy2),
+              router_compare_addr_to_exit_policy(0, i, &ri2));
+    s1 = router_summarize_exit_policy(&ri1);
+    s2 = policy_summarize(policy2);
+    test_streq(s1, s2);
+    tor_free(s1);
+    tor_free(s2);
+    router_free_exit_policy(&ri1);
+    test_assert(ri2.exit_policy);
+    test_eq(ADDR_POLICY_REJECTED,
+            router_compare_addr_to_exit_policy(0, 25, &ri2));
+    router_free_exit_policy(&ri2);
+  }
+
+  /* Exit policies rebuilt from microdescriptor summaries. */
+  {
+    routerinfo_t ri;
+    memset(&ri, 0, sizeof(ri));
+    test_eq(0, policies_set_router_exitpolicy_from_summary(&ri,
+                                                   "accept 80,443,6660-6669"));
+    test_eq(ADDR_POLICY_ACCEPTED,
+            compare_addr_to_addr_policy(0x01020304u, 80, ri.exit_policy));
+    test_eq(ADDR_POLICY_ACCEPTED,
+            compare_addr_to_addr_policy(0x01020304u, 6665, ri.exit_policy));
+    test_eq(ADDR_POLICY_REJECTED,
+            compare_addr_to_addr_policy(0x01020304u, 25, ri.exit_policy));
+    test_eq(0, policies_set_router_exitpolicy_from_summary(&ri,
+                                                          "reject 1-24"));
+    test_eq(ADDR_POLICY_REJECTED,
+            compare_addr_to_addr_policy(0x01020304u, 22, ri.exit_policy));
+    test_eq(ADDR_POLICY_ACCEPTED,
+            compare_addr_to_addr_policy(0x01020304u, 25, ri.exit_policy));
+    test_eq(-1, policies_set_router_exitpolicy_from_summary(&ri,
+                                                          "accept 80,x"));
+    test_assert(policy_is_reject_star(ri.exit_policy));
+    router_free_exit_policy(&ri);
+  }
+
   test_assert(!exit_policy_is_general_exit(policy));
   test_assert(exit_policy_is_general_exit(policy2));
   test_assert(!exit_policy_is_general_exit(NULL));
@@ -4025,7 +4700,7 @@ test_rend_fns(void)
   d1->intro_nodes = smartlist_create();
   for (i = 0; i < 3; i++) {
     rend_intro_point_t *intro = tor_malloc_zero(sizeof(rend_intro_point_t));
-    intro->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+    intro->extend_info = extend_info_new();
     crypto_rand(intro->extend_info->identity_digest, DIGEST_LEN);
     intro->extend_info->nickname[0] = '$';
     base16_encode(intro->extend_info->nickname+1, HEX_DIGEST_LEN+1,
@@ -4317,6 +4992,25 @@ test_util_memarea(void)
   test_assert(memarea_owns_ptr(area, p1));
   test_assert(memarea_owns_ptr(area, p2));
 
+  /* An area sized for a document shouldn't need to grow to hold it... */
+  memarea_drop_all(area);
+  area = memarea_new_sized(100000);
+  p1_orig = memarea_alloc(area, 1);
+  for (i = 0; i < 1000; ++i)
+    memarea_alloc(area, 90);
+  {
+    size_t allocated, used;
+    memarea_get_stats(area, &allocated, &used);
+    test_assert(used > 90000);
+    test_assert(allocated < 140000);
+  }
+  memarea_assert_ok(area);
+  /* ...and the next area of that size should reuse its chunk. */
+  memarea_drop_all(area);
+  area = memarea_new_sized(100000);
+  p1 = memarea_alloc(area, 1);
+  test_eq_ptr(p1, p1_orig);
+
  done:
   memarea_drop_all(area);
   tor_free(malloced_ptr);
@@ -4572,7 +5266,7 @@ test_rend_fns_v2(void)
   for (i = 0; i < 3; i++) {
     rend_intro_point_t *intro = tor_malloc_zero(sizeof(rend_intro_point_t));
     crypto_pk_env_t *okey = pk_generate(2 + i);
-    intro->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+    intro->extend_info = extend_info_new();
     intro->extend_info->onion_key = okey;
     crypto_pk_get_digest(intro->extend_info->onion_key,
                          intro->extend_info->identity_digest);
@@ -4674,8 +5368,106 @@ test_geoip(void)
   test_streq("??", NAMEFOR(2000));
 #undef NAMEFOR
 
+  /* The flattened range table must agree with the built-in tree. */
+  geoip_ranges_init();
+  for (i = 0; i < 10000; ++i) {
+    uint32_t ip;
+    crypto_rand((char*)&ip, sizeof(ip));
+    test_eq(geoip_get_country_by_ip_tree(ip), geoip_get_country_by_ip(ip));
+  }
+  test_eq(geoip_get_country_by_ip_tree(geoip_reverse(0x01000000)),
+          geoip_get_country_by_ip(geoip_reverse(0x01000000)));
+
+  /* Batch lookups must agree with single lookups. */
+  {
+    uint32_t ips[500], ases[500];
+    int countries[500];
+    crypto_rand((char*)ips, sizeof(ips));
+    ips[1] = ips[0];
+    geoip_get_countries_by_ip(ips, 500, countries, ases);
+    for (i = 0; i < 500; ++i) {
+      test_eq(geoip_get_country_by_ip(ips[i]), countries[i]);
+      test_eq(geoip_get_as_by_ip(geoip_reverse(ips[i])), (int)ases[i]);
+    }
+  }
+
+  /* Cached AS path verdicts must match the uncached ones. */
+  for (i = 0; i < 20; ++i) {
+    uint32_t iplist[4], aslist[2048];
+    int safe;
+    crypto_rand((char*)iplist, 3*sizeof(uint32_t));
+    iplist[0] |= 1; iplist[1] |= 1; iplist[2] |= 1;
+    iplist[3] = 0;
+    geoip_get_full_as_path(iplist, aslist, sizeof(aslist)-4);
+    safe = geoip_is_as_path_safe(aslist) ? 1 : 0;
+    test_eq(safe, geoip_is_ip_path_safe(iplist));
+    test_eq(safe, geoip_is_ip_path_safe(iplist));
+  }
+  geoip_as_path_cache_clear();
+
+  /* The AS set of an address holds its own AS, without duplicates. */
+  for (i = 0; i < 100; ++i) {
+    uint32_t ip, set[ROUTER_AS_SET_SIZE];
+    int n, as;
+    crypto_rand((char*)&ip, sizeof(ip));
+    n = geoip_get_as_set(ip, set, ROUTER_AS_SET_SIZE);
+    test_assert(n >= 0 && n <= ROUTER_AS_SET_SIZE);
+    as = geoip_get_as_by_ip(ip);
+    if (as != 65536) {
+      for (j = 0; j < n && set[j] != (uint32_t)as; ++j) ;
+      test_assert(j < n);
+    }
+    for (j = 1; j < n; ++j)
+      test_assert(set[j] != set[j-1]);
+  }
+
+  /* A database file in the data directory replaces the built-in one. */
+  {
+    static const char db[] =
+      "AdvORGeo" "\x01\0\0\0" "\x03\0\0\0" "\x1f\0\0\0" "\x02\0\0\0"
+      "??\0Unknown\0" "A1\0Proxy\0" "ZZ\0Zedland\0" "\0"
+      "\0\0\0\x0a" "\0\0\0\x0b"
+      "\0\0" "\x02\0";
+    static const char db6[] =
+      "# IPv6 ranges\n"
+      "2001:db8::,2001:db8::ffff,ZZ\n"
+      "not a range\n"
+      "2001:db9::,2001:db9::1,QQ\n";
+    char *fname = get_datadir_fname(DATADIR_GEOIP_DB);
+    char *fname6 = get_datadir_fname(DATADIR_GEOIP6);
+    tor_addr_t addr;
+    test_eq(0, write_buf_to_file(fname, db, sizeof(db)-1));
+    test_eq(0, write_buf_to_file(fname6, db6, sizeof(db6)-1));
+    geoip_ranges_free();
+    geoip_ranges_init();
+    test_eq(3, geoip_get_n_countries());
+    test_eq(AF_INET6, tor_addr_from_str(&addr, "2001:db8::10"));
+    test_eq(2, geoip_get_country_by_addr(&addr));
+    test_eq(AF_INET6, tor_addr_from_str(&addr, "2001:db8::1:0"));
+    test_eq(0, geoip_get_country_by_addr(&addr));
+    test_eq(AF_INET6, tor_addr_from_str(&addr, "2001:db9::1"));
+    test_eq(0, geoip_get_country_by_addr(&addr));
+    test_eq(AF_INET6, tor_addr_from_str(&addr, "::ffff:10.1.2.3"));
+    test_eq(2, geoip_get_country_by_addr(&addr));
+    test_eq(AF_INET, tor_addr_from_str(&addr, "10.1.2.3"));
+    test_eq(2, geoip_get_country_by_addr(&addr));
+    test_eq(2, geoip_get_country("zz"));
+    test_streq("Zedland", GeoIP_getfullname(2));
+    test_eq(0, geoip_get_country_by_ip(geoip_reverse(0x09ffffff)));
+    test_eq(2, geoip_get_country_by_ip(geoip_reverse(0x0a000000)));
+    test_eq(2, geoip_get_country_by_ip(geoip_reverse(0x0affffff)));
+    test_eq(0, geoip_get_country_by_ip(geoip_reverse(0x0b000000)));
+    geoip_ranges_free();
+    delete_file(fname);
+    delete_file(fname6);
+    tor_free(fname);
+    tor_free(fname6);
+    geoip_ranges_init();
+  }
+
   get_options()->BridgeRelay = 1;
   get_options()->BridgeRecordUsageByCountry = 1;
+  get_options()->GeoIPExactClientCounts = 1;
   /* Put 9 observations in AB... */
   for (i=32; i < 40; ++i)
     geoip_note_client_seen(GEOIP_CLIENT_CONNECT, i, now);
@@ -4697,9 +5489,207 @@ test_geoip(void)
   s = geoip_get_client_history(now+5*24*60*60, GEOIP_CLIENT_CONNECT);
   test_assert(s);
   test_streq("ab=16,xy=8", s);
+  tor_free(s);
+
+  /* Without GeoIPExactClientCounts, the counts are estimated. */
+  get_options()->GeoIPExactClientCounts = 0;
+  geoip_bridge_stats_term();
+  for (j=0; j < 2; ++j)
+    for (i=1000; i < 4000; ++i)
+      geoip_note_client_seen(GEOIP_CLIENT_CONNECT, i, now);
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_assert(s);
+  test_assert(!strcmpstart(s, "??="));
+  i = atoi(s+3);
+  test_assert(i >= 2700 && i <= 3300);
+  tor_free(s);
+  /* Sketches are dropped once all their clients are too old. */
+  geoip_remove_old_clients(now+3600);
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_assert(!s);
+
+ done:
+  tor_free(s);
+}
+
+/** Run unit tests for the perf/ counters and histograms. */
+static void
+test_perf(void)
+{
+  uint64_t v;
+  uint32_t w;
+  char *s = NULL;
+  int i;
+  edge_connection_t conn;
+  cell_wait_hist_t wait;
+
+  perf_reset();
+  test_eq(perf_hist_get_percentile(PERF_HIST_CIRC_BUILD_MSEC, 50, &v), -1);
+  for (i = 1; i <= 100; ++i)
+    perf_hist_add(PERF_HIST_CIRC_BUILD_MSEC, i);
+  /* Percentiles are rounded up to the end of their bucket, but never past
+   * the largest value we saw. */
+  test_eq(perf_hist_get_percentile(PERF_HIST_CIRC_BUILD_MSEC, 0, &v), 0);
+  test_eq(v, 1);
+  test_eq(perf_hist_get_percentile(PERF_HIST_CIRC_BUILD_MSEC, 50, &v), 0);
+  test_eq(v, 55);
+  test_eq(perf_hist_get_percentile(PERF_HIST_CIRC_BUILD_MSEC, 90, &v), 0);
+  test_eq(v, 95);
+  test_eq(perf_hist_get_percentile(PERF_HIST_CIRC_BUILD_MSEC, 99, &v), 0);
+  test_eq(v, 100);
+
+  s = perf_get_stats("circuit-build");
+  test_streq(s, "count=100 mean=50 min=1 max=100 p50=55 p90=95 p99=100");
+  tor_free(s);
+
+  perf_count(PERF_DNS_CACHE_HITS);
+  perf_count(PERF_DNS_CACHE_HITS);
+  perf_count(PERF_DNS_CACHE_HITS);
+  perf_count(PERF_DNS_CACHE_MISSES);
+  s = perf_get_stats("dns");
+  test_streq(s, "hits=3 misses=1 hit-rate=75");
+  tor_free(s);
+
+  test_assert(!perf_get_stats("no-such-key"));
+
+  perf_reset();
+  s = perf_get_stats("dns");
+  test_streq(s, "hits=0 misses=0 hit-rate=0");
+  tor_free(s);
+  test_eq(perf_hist_get_percentile(PERF_HIST_CIRC_BUILD_MSEC, 50, &v), -1);
+
+  /* Queue waits: one bucket per power of two from 64 usec, and everything
+   * from about a second in the last one. */
+  memset(&wait, 0, sizeof(wait));
+  test_eq(cell_wait_hist_get_percentile(&wait, 50, &w), -1);
+  cell_wait_hist_add(&wait, 10);
+  cell_wait_hist_add(&wait, 100);
+  cell_wait_hist_add(&wait, 1000);
+  cell_wait_hist_add(&wait, 2000000);
+  test_eq(cell_wait_hist_get_percentile(&wait, 50, &w), 0);
+  test_eq(w, 127);
+  test_eq(cell_wait_hist_get_percentile(&wait, 90, &w), 0);
+  test_eq(w, 2000000);
+  s = cell_wait_hist_format(&wait);
+  test_streq(s, "count=4 mean=500277 max=2000000 p50=127 p90=2000000 "
+             "p99=2000000 buckets=1,1,0,0,1,0,0,0,0,0,0,0,0,0,0,1");
+  tor_free(s);
+
+  /* Stream tracing: a stream that isn't on a circuit counts for "none". */
+  test_assert(!stream_trace_get_csv());
+  get_options()->StreamTracing = 1;
+  memset(&conn, 0, sizeof(conn));
+  for (i = STREAM_TRACE_ACCEPTED; i <= STREAM_TRACE_FIRST_BYTE; ++i)
+    stream_trace_stamp(&conn, (stream_trace_stage_t)i);
+  memset(&conn, 0, sizeof(conn));
+  stream_trace_stamp(&conn, STREAM_TRACE_ACCEPTED);
+  stream_trace_closed(&conn);
+  s = stream_trace_get_csv();
+  test_assert(s);
+  test_assert(strstr(s, "\r\nexit,none,total,1,"));
+  test_assert(strstr(s, "\r\nidentity,"));
+  test_assert(strstr(s, ",1\r\n"));
+  tor_free(s);
+  perf_reset();
+  test_assert(!stream_trace_get_csv());
+
+ done:
+  get_options()->StreamTracing = 0;
+  tor_free(s);
+  stream_trace_free_all();
+}
+
+/** Run unit tests for the per-subsystem memory accounting. */
+static void
+test_memgov(void)
+{
+  LONG before = mem_tag_bytes[MEM_TAG_COOKIES];
+  char *s = NULL, *d = NULL;
+  uint64_t total;
+
+  s = tor_malloc_tagged(MEM_TAG_COOKIES, 100);
+  test_eq(mem_tag_bytes[MEM_TAG_COOKIES], before + 100);
+  d = tor_strdup_tagged(MEM_TAG_COOKIES, "cookie");
+  test_eq(mem_tag_bytes[MEM_TAG_COOKIES], before + 107);
+  total = memgov_total();
+  test_assert(total >= 107);
+  tor_free_tagged(MEM_TAG_COOKIES, d, 7);
+  test_assert(!d);
+  tor_free_tagged(MEM_TAG_COOKIES, s, 100);
+  test_eq(mem_tag_bytes[MEM_TAG_COOKIES], before);
+  test_eq(memgov_total(), total - 107);
+
+  /* Without a limit, the governor leaves everything alone. */
+  get_options()->MaxMemInUse = 0;
+  memgov_check(approx_time());
+  test_eq(memgov_total(), total - 107);
+
+ done:
+  tor_free(s);
+  tor_free(d);
+}
+
+/** Run unit tests for applying the ed commands in consensus diffs. */
+static void
+test_consdiff(void)
+{
+  smartlist_t *base = smartlist_create(), *diff = smartlist_create();
+  smartlist_t *result = NULL;
+  char *s = NULL;
+
+  smartlist_split_string(base, "A\n B\n C\n D\n E\n", " ", 0, 0);
+  /* Change the last line, drop two, and add two at the top; the commands
+   * come last line first. */
+  smartlist_split_string(diff, "5c\n X\n .\n 2,3d\n 0a\n Y\n Z\n .\n",
+                         " ", 0, 0);
+  result = consdiff_apply_ed_diff(base, diff, 0);
+  test_assert(result);
+  s = smartlist_join_strings(result, "", 0, NULL);
+  test_streq(s, "Y\nZ\nA\nD\nX\n");
+  tor_free(s);
+  smartlist_free(result);
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_clear(diff);
+
+  /* "$" is the last line of the base. */
+  smartlist_split_string(diff, "3,$d\n", " ", 0, 0);
+  result = consdiff_apply_ed_diff(base, diff, 0);
+  test_assert(result);
+  s = smartlist_join_strings(result, "", 0, NULL);
+  test_streq(s, "A\nB\n");
+  tor_free(s);
+  smartlist_free(result);
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_clear(diff);
+
+  /* Commands that aren't sorted last line first are refused. */
+  smartlist_split_string(diff, "2d\n 4d\n", " ", 0, 0);
+  result = consdiff_apply_ed_diff(base, diff, 0);
+  test_assert(!result);
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_clear(diff);
+
+  /* So are lines past the end, and unterminated insertions. */
+  smartlist_split_string(diff, "6d\n", " ", 0, 0);
+  test_assert(!consdiff_apply_ed_diff(base, diff, 0));
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_clear(diff);
+  smartlist_split_string(diff, "1a\n X\n", " ", 0, 0);
+  test_assert(!consdiff_apply_ed_diff(base, diff, 0));
+
+  test_assert(looks_like_a_consensus_diff(
+                     "network-status-diff-version 1\nhash", 34));
+  test_assert(!looks_like_a_consensus_diff(
+                     "network-status-version 3\n", 25));
 
  done:
   tor_free(s);
+  if (result)
+    smartlist_free(result);
+  SMARTLIST_FOREACH(base, char *, cp, tor_free(cp));
+  smartlist_free(base);
+  SMARTLIST_FOREACH(diff, char *, cp, tor_free(cp));
+  smartlist_free(diff);
 }
 
 /** For test_array. Declare an CLI-invocable off-by-default function in the
@@ -4745,6 +5735,8 @@ static struct {
   SUBENT(util, smartlist_join),
   SUBENT(util, bitarray),
   SUBENT(util, digestset),
+  SUBENT(util, ip_range_set),
+  SUBENT(util, oaht),
   SUBENT(util, mempool),
   SUBENT(util, memarea),
   SUBENT(util, strmap),
@@ -4753,7 +5745,9 @@ static struct {
   SUBENT(util, mmap),
   SUBENT(util, threads),
   SUBENT(util, order_functions),
+  SUBENT(util, di_ops),
   SUBENT(util, sscanf),
+  SUBENT(util, log_filter),
   ENT(onion_handshake),
   ENT(dir_format),
   ENT(dirutil),
@@ -4762,6 +5756,9 @@ static struct {
   ENT(rend_fns),
   SUBENT(rend_fns, v2),
   ENT(geoip),
+  ENT(perf),
+  ENT(memgov),
+  ENT(consdiff),
 
   DISABLED(bench_aes),
   DISABLED(bench_dmap),
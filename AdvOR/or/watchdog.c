@@ -0,0 +1,259 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file watchdog.c
+ * \brief Notice when the event loop of the tor thread stops running, and
+ * tell what it was busy with.
+ *
+ * A libevent timer in the tor thread notes the time every
+ * WATCHDOG_BEAT_MSEC.  A thread of our own looks at that time, and when
+ * MainLoopStallThreshold milliseconds went by without a beat, the tor
+ * thread is stuck in some callback.  We then log the tasks that it told us
+ * it was running with watchdog_push(), and the stack of the tor thread,
+ * walked by seh_walk_stack() from the registers we get while it is
+ * suspended.  We report each stall once, and the tor thread logs how long
+ * it took when it gets back to its event loop.
+ *
+ * watchdog_push(), watchdog_step() and watchdog_pop() only note what runs
+ * in the tor thread; calls from other threads are ignored.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "seh.h"
+#include "watchdog.h"
+
+/** How often the tor thread notes that its event loop runs. */
+#define WATCHDOG_BEAT_MSEC 250
+/** How deep the tasks of watchdog_push() may nest. */
+#define WATCHDOG_MAX_DEPTH 8
+
+/** A task that the tor thread runs. */
+typedef struct watchdog_task_t {
+  const char *name; /**< What it is: a callback or a function. */
+  const char *detail; /**< What it works on, or which step it is at, or
+                       * NULL. */
+} watchdog_task_t;
+
+/** The tasks that the tor thread runs now, outermost first. */
+static watchdog_task_t watchdog_tasks[WATCHDOG_MAX_DEPTH];
+/** How many tasks the tor thread runs now; those past WATCHDOG_MAX_DEPTH
+ * are counted but not kept. */
+static volatile LONG watchdog_depth = 0;
+/** GetTickCount() at the last beat of the event loop. */
+static volatile LONG watchdog_last_beat = 0;
+/** The value of watchdog_last_beat when we reported a stall, or 0. */
+static volatile LONG watchdog_reported_beat = 0;
+/** MainLoopStallThreshold, or 0 if we shouldn't watch. */
+static volatile LONG watchdog_threshold = 0;
+/** Id of the tor thread. */
+static DWORD watchdog_tor_thread_id = 0;
+/** A handle of the tor thread that we may suspend and look into. */
+static HANDLE watchdog_tor_thread = NULL;
+/** Set when the watchdog thread should exit. */
+static HANDLE watchdog_stop_event = NULL;
+/** Set by the watchdog thread when it exits. */
+static HANDLE watchdog_done_event = NULL;
+/** The timer that beats in the event loop. */
+static periodic_timer_t *watchdog_beat_timer = NULL;
+
+/** Timer callback: the event loop runs. */
+static void
+watchdog_beat(periodic_timer_t *timer, void *arg)
+{
+  LONG now = (LONG)GetTickCount(), reported = watchdog_reported_beat;
+  (void)timer;
+  (void)arg;
+  if (reported) {
+    log_notice(LD_GENERAL, get_lang_str(LANG_LOG_WATCHDOG_STALL_ENDED),
+               (unsigned long)(now - reported));
+    watchdog_reported_beat = 0;
+  }
+  InterlockedExchange(&watchdog_last_beat, now);
+}
+
+/** seh_walk_stack() callback: log a frame of the stack of the tor
+ * thread. */
+static void
+watchdog_log_frame(void *arg, const char *frame)
+{
+  (void)arg;
+  log_warn(LD_GENERAL, get_lang_str(LANG_LOG_WATCHDOG_STALL_FRAME), frame);
+}
+
+/** Log that the event loop hasn't run for <b>msec</b> milliseconds, with
+ * what the tor thread runs and its stack. */
+static void
+watchdog_report(unsigned long msec)
+{
+  char tasks[512];
+  CONTEXT ctx;
+  LONG i, depth = watchdog_depth;
+  int have_ctx = 0;
+
+  tasks[0] = 0;
+  for (i = 0; i < depth && i < WATCHDOG_MAX_DEPTH; ++i) {
+    const char *name = watchdog_tasks[i].name;
+    const char *detail = watchdog_tasks[i].detail;
+    if (i)
+      strlcat(tasks, " > ", sizeof(tasks));
+    strlcat(tasks, name ? name : "?", sizeof(tasks));
+    if (detail) {
+      strlcat(tasks, "(", sizeof(tasks));
+      strlcat(tasks, detail, sizeof(tasks));
+      strlcat(tasks, ")", sizeof(tasks));
+    }
+  }
+  if (!tasks[0])
+    strlcpy(tasks, "an unmarked callback", sizeof(tasks));
+
+  /* Keep the tor thread suspended only while we copy its registers: it may
+   * hold the heap or the log lock that we need below. */
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.ContextFlags = CONTEXT_FULL;
+  if (SuspendThread(watchdog_tor_thread) != (DWORD)-1) {
+    have_ctx = GetThreadContext(watchdog_tor_thread, &ctx);
+    ResumeThread(watchdog_tor_thread);
+  }
+  log_warn(LD_GENERAL, get_lang_str(LANG_LOG_WATCHDOG_STALL), msec, tasks);
+  if (have_ctx)
+    seh_walk_stack(watchdog_tor_thread, &ctx, watchdog_log_frame, NULL);
+}
+
+/** Main function of the watchdog thread. */
+static void
+watchdog_main(void *arg)
+{
+  DWORD last_wake = GetTickCount(), awake_since = last_wake, now;
+  LONG threshold, beat;
+  (void)arg;
+
+  while (WaitForSingleObject(watchdog_stop_event, WATCHDOG_BEAT_MSEC) ==
+         WAIT_TIMEOUT) {
+    now = GetTickCount();
+    threshold = watchdog_threshold;
+    beat = watchdog_last_beat;
+    /* If we slept much longer than we asked for, the whole machine was
+     * asleep: that's no stall, and the tor thread needs a while to catch
+     * up. */
+    if (now - last_wake > (DWORD)(4 * WATCHDOG_BEAT_MSEC) &&
+        now - last_wake > (DWORD)threshold)
+      awake_since = now;
+    last_wake = now;
+    if (!threshold || !beat || watchdog_reported_beat == beat)
+      continue;
+    if (now - (DWORD)beat < (DWORD)(threshold + WATCHDOG_BEAT_MSEC) ||
+        now - awake_since < (DWORD)(threshold + WATCHDOG_BEAT_MSEC))
+      continue;
+    watchdog_reported_beat = beat;
+    watchdog_report((unsigned long)(now - (DWORD)beat));
+  }
+  SetEvent(watchdog_done_event);
+}
+
+/** Start watching the event loop of the tor thread, which must be the
+ * one that calls us, after libevent is set up. */
+void
+watchdog_init(void)
+{
+  struct timeval tv;
+  if (watchdog_beat_timer)
+    return;
+  watchdog_tor_thread_id = GetCurrentThreadId();
+  if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+                       GetCurrentProcess(), &watchdog_tor_thread,
+                       THREAD_SUSPEND_RESUME|THREAD_GET_CONTEXT|
+                       THREAD_QUERY_INFORMATION, FALSE, 0))
+    return;
+  tv.tv_sec = 0;
+  tv.tv_usec = WATCHDOG_BEAT_MSEC * 1000;
+  watchdog_beat_timer = periodic_timer_new(tor_libevent_get_base(), &tv,
+                                           watchdog_beat, NULL);
+  watchdog_last_beat = (LONG)GetTickCount();
+  watchdog_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+  watchdog_done_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (!watchdog_beat_timer || !watchdog_stop_event || !watchdog_done_event ||
+      spawn_func(watchdog_main, NULL) < 0) {
+    log_warn(LD_GENERAL, get_lang_str(LANG_LOG_WATCHDOG_START_FAILED));
+    if (watchdog_done_event)
+      SetEvent(watchdog_done_event);
+    watchdog_free_all();
+  }
+}
+
+/** Stop the watchdog thread, and free everything that we hold. */
+void
+watchdog_free_all(void)
+{
+  if (watchdog_stop_event) {
+    SetEvent(watchdog_stop_event);
+    if (watchdog_done_event)
+      WaitForSingleObject(watchdog_done_event, 2 * WATCHDOG_BEAT_MSEC);
+    CloseHandle(watchdog_stop_event);
+    watchdog_stop_event = NULL;
+  }
+  if (watchdog_done_event) {
+    CloseHandle(watchdog_done_event);
+    watchdog_done_event = NULL;
+  }
+  if (watchdog_beat_timer) {
+    periodic_timer_free(watchdog_beat_timer);
+    watchdog_beat_timer = NULL;
+  }
+  if (watchdog_tor_thread) {
+    CloseHandle(watchdog_tor_thread);
+    watchdog_tor_thread = NULL;
+  }
+  watchdog_last_beat = watchdog_reported_beat = 0;
+}
+
+/** Report stalls of the event loop that last longer than <b>msec</b>
+ * milliseconds, or none if it is 0. */
+void
+watchdog_set_threshold(int msec)
+{
+  InterlockedExchange(&watchdog_threshold, msec > 0 ? msec : 0);
+}
+
+/** Note that the tor thread starts to run the task <b>name</b>, working on
+ * <b>detail</b> if it isn't NULL.  Both must stay valid until the matching
+ * watchdog_pop(). */
+void
+watchdog_push(const char *name, const char *detail)
+{
+  LONG depth = watchdog_depth;
+  if (GetCurrentThreadId() != watchdog_tor_thread_id)
+    return;
+  if (depth < WATCHDOG_MAX_DEPTH) {
+    watchdog_tasks[depth].name = name;
+    watchdog_tasks[depth].detail = detail;
+  }
+  InterlockedExchange(&watchdog_depth, depth + 1);
+}
+
+/** Note that the innermost task of the tor thread went on to the step
+ * <b>detail</b>. */
+void
+watchdog_step(const char *detail)
+{
+  LONG depth = watchdog_depth;
+  if (GetCurrentThreadId() != watchdog_tor_thread_id)
+    return;
+  if (depth > 0 && depth <= WATCHDOG_MAX_DEPTH)
+    watchdog_tasks[depth-1].detail = detail;
+}
+
+/** Note that the tor thread finished its innermost task. */
+void
+watchdog_pop(void)
+{
+  LONG depth = watchdog_depth;
+  if (GetCurrentThreadId() != watchdog_tor_thread_id || !depth)
+    return;
+  InterlockedExchange(&watchdog_depth, depth - 1);
+}
+
@@ -0,0 +1,23 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file watchdog.h
+ * \brief Header file for watchdog.c.
+ **/
+
+#ifndef _TOR_WATCHDOG_H
+#define _TOR_WATCHDOG_H
+
+void watchdog_init(void);
+void watchdog_free_all(void);
+void watchdog_set_threshold(int msec);
+void watchdog_push(const char *task, const char *detail);
+void watchdog_step(const char *detail);
+void watchdog_pop(void);
+
+#endif
+
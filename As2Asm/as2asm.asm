@@ -1,4 +1,8 @@
 ;aggr.html can be updated from http://www.cidr-report.org/as2.0/aggr.html
+;
+;This version still writes the AS paths as a serialized tree (as_path / as_idx). geoip_c.asm now reads the indexed
+;as_paths / as_pblk / as_poff tables, and the geoip_as.h in the tree was converted to that layout from the last file that
+;this program generated. It has to write the new tables before geoip_as.h can be regenerated from a new aggr.html.
 
 .386
 .model	flat,stdcall
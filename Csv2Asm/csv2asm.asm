@@ -23,6 +23,10 @@ geoip_get_as_ptr	PROTO	:DWORD
 	tzaraidx dd	?
 	lastidx	dd	?
 	lastip	dd	?
+	dbcount	dd	?
+	dbnode0	dd	?
+	dbnode1	dd	?
+	dbnode2	dd	?
 	count	dd	?
 	a1c	dd	?
 	a1cr	dd	?
@@ -42,6 +46,8 @@ msg2	db	13,10,'Resolved ranges from the fake "A1" country: ',0
 msg3	db	' out of ',0
 fname	db	'GeoIPCountryWhois.csv',0
 fname0	db	'geoip_c.h',0
+fname1	db	'geoip.db',0
+dbmagic	db	'AdvORGeo',1,0,0,0
 defc1	db	'??=Not Defined / Unallocated',0
 defc2	db	'A1',0,'Anonymous Proxy',0
 ranges	dd	-1
@@ -493,6 +499,15 @@ start:
 
 			invoke	WriteFile,h1,addr buffer2,ecx,addr bread,0
 			invoke	CloseHandle,h1
+
+			invoke	DeleteFile,addr fname1
+			invoke	CreateFile,addr fname1,GENERIC_WRITE,0,0,CREATE_ALWAYS,0,0
+			.if eax!=INVALID_HANDLE_VALUE
+				mov	h1,eax
+				call	writedb
+				invoke	WriteFile,h1,addr buffer1,ecx,addr bread,0
+				invoke	CloseHandle,h1
+			.endif
 		.endif
 
 		mov	edi,offset buffer1
@@ -542,6 +557,108 @@ _d1:	or	dl,30h
 	stosb
 	ret
 
+;writes the GeoIP database file (see geoip_db_load() in or/geoip.c) to buffer1, returns its size in ecx
+writedb:
+	mov	edi,offset buffer1
+	lea	esi,dbmagic
+	mov	ecx,12
+	rep	movsb
+	mov	eax,tzaraidx
+	stosd
+	xor	eax,eax
+	stosd
+	stosd
+	mov	esi,offset tzara
+	mov	ecx,tzaraidx
+	.while ecx!=0
+		lodsd
+		stosw
+		mov	al,0
+		stosb
+		lodsd
+		mov	edx,eax
+		.while byte ptr[edx]!=0
+			mov	al,[edx]
+			stosb
+			inc	edx
+		.endw
+		mov	al,0
+		stosb
+		dec	ecx
+	.endw
+	mov	eax,edi
+	sub	eax,offset buffer1+24
+	mov	dword ptr buffer1[16],eax
+	.while edi&3
+		mov	al,0
+		stosb
+	.endw
+	mov	dbcount,0
+	mov	esi,offset buffer5
+	mov	eax,offset buffer4
+	mov	dbnode0,eax
+_db0:	mov	eax,dbnode0
+	mov	edx,eax
+	add	edx,[eax+5]
+	mov	dbnode1,edx
+_db1:	mov	eax,dbnode1
+	mov	edx,eax
+	add	edx,[eax+5]
+	mov	dbnode2,edx
+_db2:	mov	eax,dbnode2
+	mov	ebx,eax
+	add	ebx,[eax+5]
+_db3:	mov	edx,dbnode0
+	movzx	eax,byte ptr[edx]
+	shl	eax,8
+	mov	edx,dbnode1
+	mov	al,[edx]
+	shl	eax,8
+	mov	edx,dbnode2
+	mov	al,[edx]
+	shl	eax,8
+	mov	al,[ebx]
+	stosd
+	movzx	eax,byte ptr[ebx+5]
+	.if al==1
+		mov	ah,1
+		mov	al,[ebx+6]
+	.endif
+	mov	[esi],ax
+	lea	esi,[esi+2]
+	inc	dbcount
+	mov	eax,[ebx+1]
+	add	ebx,eax
+	or	eax,eax
+	jnz	_db3
+	mov	eax,dbnode2
+	mov	edx,[eax+1]
+	add	eax,edx
+	mov	dbnode2,eax
+	or	edx,edx
+	jnz	_db2
+	mov	eax,dbnode1
+	mov	edx,[eax+1]
+	add	eax,edx
+	mov	dbnode1,eax
+	or	edx,edx
+	jnz	_db1
+	mov	eax,dbnode0
+	mov	edx,[eax+1]
+	add	eax,edx
+	mov	dbnode0,eax
+	or	edx,edx
+	jnz	_db0
+	mov	eax,dbcount
+	mov	dword ptr buffer1[20],eax
+	mov	ecx,eax
+	shl	ecx,1
+	mov	esi,offset buffer5
+	rep	movsb
+	mov	ecx,edi
+	sub	ecx,offset buffer1
+	ret
+
 copyedx:.while byte ptr[edx]
 		mov	al,[edx]
 		stosb
@@ -11,6 +11,7 @@ ShowProcesses		PROTO	:DWORD
 SetHook			PROTO	:DWORD,:DWORD,:DWORD,:DWORD
 NewThread		PROTO	:DWORD,:DWORD,:DWORD
 GetKernelBase		PROTO	:DWORD
+GetKernelBaseCached	PROTO	:DWORD,:DWORD
 _OpenProcess		PROTO	:DWORD
 PipeThread		PROTO	:DWORD
 TORHook			PROTO	:DWORD,:DWORD,:DWORD,:DWORD,:DWORD,:DWORD
@@ -21,6 +22,7 @@ include	resolve.h
 include	socket.h
 include	excl.h
 include	tree.h
+include	conninfo.h
 
 
 LOG_ERR = 3
@@ -153,6 +155,9 @@ MODULEENTRY32W	ends
 	hProcess	dd	?
 	hSnapshot	dd	?
 	kernelBase	dd	?
+	kplan_base	dd	?			;kernel32 base that GetKernelBaseCached found last
+	kplan_stamp	dd	?			;TimeDateStamp and SizeOfImage of that kernel32
+	kplan_size	dd	?
 	unloaded	db	?
 	pidname		db	257 dup(?)
 	localhostname	db	256 dup(?)
@@ -174,6 +179,7 @@ MODULEENTRY32W	ends
 	iphlpdata
 	resolve_data
 	socket_data
+	conninfo_data
 	excl_data
 	saveconnect	dd	?,?			;size,hMem
 			db	100 dup(?)		;old bytes
@@ -777,6 +783,7 @@ DllEntry PROC hInstance:DWORD,reason:DWORD,reserved1:DWORD
 		mov	_OpenProcessToken,0
 		resolve_init
 		socket_init
+		conninfo_init
 		excl_init
 		mov	connections_allowed,0
 		mov	saveconnect,0
@@ -818,6 +825,7 @@ DllEntry PROC hInstance:DWORD,reason:DWORD,reserved1:DWORD
 		user32init
 		iphlpinit
 		mov	kernelBase,0
+		mov	kplan_base,0
 		mov	systemtimedelta,0
 		mov	sysflags,1
 		mov	hDialog,0
@@ -1713,7 +1721,7 @@ TORHook	PROC	uses esi edi ebx pid:DWORD,proxyport:DWORD,dwFlags:DWORD,best_delta
 		mov	procKernelBase,eax
 		.if (kernelBase!=0)&&(kernelBase!=-1)
 			.if 1;(!(dwFlags&100h))
-				invoke	GetKernelBase,pid
+				invoke	GetKernelBaseCached,hProcess,pid
 				mov	procKernelBase,eax
 				sub	eax,kernelBase
 				mov	procKernelDelta,eax
@@ -2029,7 +2037,7 @@ TORHook	PROC	uses esi edi ebx pid:DWORD,proxyport:DWORD,dwFlags:DWORD,best_delta
 		mov	lvit.cColumns,0
 		mov	lvit.puColumns,0
 		push	0
-		.while 1
+		.while !(dwFlags&2048)		;a new process is not in the list yet
 			mov	lvit.imask,LVIF_PARAM or LVIF_STATE
 			mov	lvit.stateMask,LVIS_STATEIMAGEMASK
 			mov	lvit.lParam,0
@@ -2725,117 +2733,90 @@ _skipsig1:
 	.endif
 
 	assume	eax:nothing
-	.while unloaded==0
-		invoke	CreateFile,addr pipename,GENERIC_READ or GENERIC_WRITE,0,0,OPEN_EXISTING,0,0
-		.break .if eax!=INVALID_HANDLE_VALUE
-		invoke	GetLastError
-		.if eax==ERROR_PIPE_BUSY
-			invoke	WaitNamedPipe,addr pipename,NMPWAIT_WAIT_FOREVER
-		.else
-			invoke	Sleep,100
-		.endif
-	.endw
 	lea	edx,[esp+4+4]
 	push	edi
-		push	eax
-			push	edx
-				invoke	GlobalAlloc,GPTR,1024
-			pop	edx
-			mov	edi,eax
-		pop	eax
+		push	edx
+			invoke	GlobalAlloc,GPTR,1024
+		pop	edx
+		mov	edi,eax
 		push	edi
-			push	eax
-				mov	eax,'NNOC'
-				stosd
-				mov	eax,pipe_key
-				stosd
+			mov	eax,'NNOC'
+			stosd
+			mov	eax,pipe_key
+			stosd
+			push	edx
 				push	edx
+					mov	eax,[edx-4]
+					mov	dword ptr[edi],sizeof sockaddr_in
+					lea	edx,[edi+4]
+					assume	edx:ptr sockaddr_in
+					mov	dword ptr[edx].sin_addr,0
+					mov	word ptr[edx].sin_port,0
+					push	eax
+						invoke	getsockname,eax,edx,edi
+					pop	ecx
+					lea	edx,[edi+4]
 					push	edx
-						mov	eax,[edx-4]
-						mov	dword ptr[edi],sizeof sockaddr_in
+					.if ([edx].sin_port==0)||(eax==SOCKET_ERROR)
+						mov	eax,ecx
+						mov	dword ptr[edx].sin_addr,0100007fh
+						mov	[edx].sin_family,AF_INET
+						push	eax
+							invoke	bind,eax,edx,sizeof sockaddr_in
+						pop	eax
 						lea	edx,[edi+4]
-						assume	edx:ptr sockaddr_in
 						mov	dword ptr[edx].sin_addr,0
 						mov	word ptr[edx].sin_port,0
-						push	eax
-							invoke	getsockname,eax,edx,edi
-						pop	ecx
-						lea	edx,[edi+4]
-						push	edx
-						.if ([edx].sin_port==0)||(eax==SOCKET_ERROR)
-							mov	eax,ecx
-							mov	dword ptr[edx].sin_addr,0100007fh
-							mov	[edx].sin_family,AF_INET
-							push	eax
-								invoke	bind,eax,edx,sizeof sockaddr_in
-							pop	eax
-							lea	edx,[edi+4]
-							mov	dword ptr[edx].sin_addr,0
-							mov	word ptr[edx].sin_port,0
-							mov	dword ptr[edi],sizeof sockaddr_in
-							invoke	getsockname,eax,edx,edi
-						.endif
-						pop	edx
-						mov	eax,dword ptr[edx].sin_addr
-						stosd
-						movzx	eax,word ptr[edx].sin_port
-						stosw
-						assume	edx:nothing
-					pop	edx
-					mov	edx,[edx]
-					assume	edx:ptr sockaddr_in
-					.if edx
-						mov	eax,dword ptr [edx].sin_addr
-					.else
-						xor	eax,eax
+						mov	dword ptr[edi],sizeof sockaddr_in
+						invoke	getsockname,eax,edx,edi
 					.endif
+					pop	edx
+					mov	eax,dword ptr[edx].sin_addr
 					stosd
-					.if (al==0ffh)&&(ah>=16)
-						push	edx
-							mov	edx,onioncache
-							.while edx
-								lea	ecx,[edx+8]
-								.while ecx<dword ptr[edx+4]
-									.break .if eax==[ecx+4]
-									lea	ecx,[ecx+264]
-								.endw
-								.if (ecx<dword ptr[edx+4])&&(eax==dword ptr[ecx+4])
-									lea	edx,dword ptr[ecx+8]
-									call	copyedx
-									.break
-								.endif
-								mov	edx,dword ptr[edx]
-							.endw
-							mov	al,0
-							stosb
-						pop	edx
-					.endif
 					movzx	eax,word ptr[edx].sin_port
 					stosw
 					assume	edx:nothing
 				pop	edx
-				call	getdll
-			pop	eax
+				mov	edx,[edx]
+				assume	edx:ptr sockaddr_in
+				.if edx
+					mov	eax,dword ptr [edx].sin_addr
+				.else
+					xor	eax,eax
+				.endif
+				stosd
+				.if (al==0ffh)&&(ah>=16)
+					push	edx
+						mov	edx,onioncache
+						.while edx
+							lea	ecx,[edx+8]
+							.while ecx<dword ptr[edx+4]
+								.break .if eax==[ecx+4]
+								lea	ecx,[ecx+264]
+							.endw
+							.if (ecx<dword ptr[edx+4])&&(eax==dword ptr[ecx+4])
+								lea	edx,dword ptr[ecx+8]
+								call	copyedx
+								.break
+							.endif
+							mov	edx,dword ptr[edx]
+						.endw
+						mov	al,0
+						stosb
+					pop	edx
+				.endif
+				movzx	eax,word ptr[edx].sin_port
+				stosw
+				assume	edx:nothing
+			pop	edx
+			call	getdll
 			mov	ecx,edi
 			mov	edi,[esp]
 			sub	ecx,edi
-			push	eax
-				push	0
-					mov	edx,esp
-					push	eax
-						invoke	WriteFile,eax,edi,ecx,edx,0
-					pop	eax
-					mov	edx,esp
-					invoke	ReadFile,eax,edi,4,edx,0
-					mov	edx,[edi]
-				pop	eax
-				pop	eax
-				push	edx
-				invoke	CloseHandle,eax
-				pop	edx
-			pop	eax
-		push	edx
-		invoke	GlobalFree,eax
+			invoke	SendConnInfo,edi,ecx
+		pop	edx
+		push	eax
+		invoke	GlobalFree,edx
 		pop	eax
 	pop	edi
 
@@ -2868,113 +2849,86 @@ _skipsig2:
 		jmp	_s_c2
 	.endif
 	assume	eax:nothing
-	.while unloaded==0
-		invoke	CreateFile,addr pipename,GENERIC_READ or GENERIC_WRITE,0,0,OPEN_EXISTING,0,0
-		.break .if eax!=INVALID_HANDLE_VALUE
-		invoke	GetLastError
-		.if eax==ERROR_PIPE_BUSY
-			invoke	WaitNamedPipe,addr pipename,NMPWAIT_WAIT_FOREVER
-		.else
-			invoke	Sleep,100
-		.endif
-	.endw
 	lea	edx,[esp+4+4]
 	push	edi
 		push	edx
-			push	eax
-				invoke	GlobalAlloc,GPTR,1024
-				mov	edi,eax
-			pop	eax
+			invoke	GlobalAlloc,GPTR,1024
 		pop	edx
+		mov	edi,eax
 		push	edi
-			push	eax
-				mov	eax,'NNOC'
-				stosd
-				mov	eax,pipe_key
-				stosd
+			mov	eax,'NNOC'
+			stosd
+			mov	eax,pipe_key
+			stosd
+			push	edx
 				push	edx
+					mov	eax,[edx-4]
+					mov	dword ptr[edi],sizeof sockaddr_in
+					lea	edx,[edi+4]
+					assume	edx:ptr sockaddr_in
+					mov	dword ptr[edx].sin_addr,0
+					mov	word ptr[edx].sin_port,0
+					push	eax
+						invoke	getsockname,eax,edx,edi
+					pop	ecx
+					lea	edx,[edi+4]
 					push	edx
-						mov	eax,[edx-4]
-						mov	dword ptr[edi],sizeof sockaddr_in
-						lea	edx,[edi+4]
-						assume	edx:ptr sockaddr_in
-						mov	dword ptr[edx].sin_addr,0
-						mov	word ptr[edx].sin_port,0
-						push	eax
+						.if ([edx].sin_port==0)||(eax==SOCKET_ERROR)
+							mov	eax,ecx
+							mov	dword ptr[edx].sin_addr,0100007fh
+							mov	[edx].sin_family,AF_INET
+							push	eax
+								invoke	bind,eax,edx,sizeof sockaddr_in
+							pop	eax
+							lea	edx,[edi+4]
+							mov	dword ptr[edx].sin_addr,0
+							mov	word ptr[edx].sin_port,0
+							mov	dword ptr[edi],sizeof sockaddr_in
 							invoke	getsockname,eax,edx,edi
-						pop	ecx
-						lea	edx,[edi+4]
-						push	edx
-							.if ([edx].sin_port==0)||(eax==SOCKET_ERROR)
-								mov	eax,ecx
-								mov	dword ptr[edx].sin_addr,0100007fh
-								mov	[edx].sin_family,AF_INET
-								push	eax
-									invoke	bind,eax,edx,sizeof sockaddr_in
-								pop	eax
-								lea	edx,[edi+4]
-								mov	dword ptr[edx].sin_addr,0
-								mov	word ptr[edx].sin_port,0
-								mov	dword ptr[edi],sizeof sockaddr_in
-								invoke	getsockname,eax,edx,edi
-							.endif
-						pop	edx
-						mov	eax,dword ptr[edx].sin_addr
-						stosd
-						movzx	eax,word ptr[edx].sin_port
-						stosw
-						assume	edx:nothing
+						.endif
 					pop	edx
-					mov	edx,[edx]
-					assume	edx:ptr sockaddr_in
-					mov	eax,dword ptr [edx].sin_addr
+					mov	eax,dword ptr[edx].sin_addr
 					stosd
-					.if (al==0ffh)&&(ah>=16)
-						push	edx
-							mov	edx,onioncache
-							.while edx
-								lea	ecx,[edx+8]
-								.while ecx<dword ptr[edx+4]
-									.break .if eax==[ecx+4]
-									lea	ecx,[ecx+264]
-								.endw
-								.if (ecx<dword ptr[edx+4])&&(eax==dword ptr[ecx+4])
-									lea	edx,dword ptr[ecx+8]
-									call	copyedx
-									.break
-								.endif
-								mov	edx,dword ptr[edx]
-							.endw
-							mov	al,0
-							stosb
-						pop	edx
-					.endif
 					movzx	eax,word ptr[edx].sin_port
 					stosw
 					assume	edx:nothing
 				pop	edx
-				call	getdll
-			pop	eax
+				mov	edx,[edx]
+				assume	edx:ptr sockaddr_in
+				mov	eax,dword ptr [edx].sin_addr
+				stosd
+				.if (al==0ffh)&&(ah>=16)
+					push	edx
+						mov	edx,onioncache
+						.while edx
+							lea	ecx,[edx+8]
+							.while ecx<dword ptr[edx+4]
+								.break .if eax==[ecx+4]
+								lea	ecx,[ecx+264]
+							.endw
+							.if (ecx<dword ptr[edx+4])&&(eax==dword ptr[ecx+4])
+								lea	edx,dword ptr[ecx+8]
+								call	copyedx
+								.break
+							.endif
+							mov	edx,dword ptr[edx]
+						.endw
+						mov	al,0
+						stosb
+					pop	edx
+				.endif
+				movzx	eax,word ptr[edx].sin_port
+				stosw
+				assume	edx:nothing
+			pop	edx
+			call	getdll
 			mov	ecx,edi
 			mov	edi,[esp]
 			sub	ecx,edi
-			push	eax
-				push	0
-					mov	edx,esp
-					push	eax
-						invoke	WriteFile,eax,edi,ecx,edx,0
-					pop	eax
-					mov	edx,esp
-					invoke	ReadFile,eax,edi,4,edx,0
-					mov	edx,[edi]
-				pop	eax
-			pop	eax
-			push	edx
-			invoke	CloseHandle,eax
-			pop	edx
-		pop	eax
-		push	edx
-		invoke	GlobalFree,eax
+			invoke	SendConnInfo,edi,ecx
+		pop	edx
+		push	eax
+		invoke	GlobalFree,edx
 		pop	eax
 	pop	edi
 	.if eax
@@ -2996,6 +2950,7 @@ _s_c2:	jmp	dword ptr savewsaconnect[4]
 
 	resolve_procs
 	socket_procs
+	conninfo_procs
 
 
 _k_g1:	jmp	dword ptr getsystemtime[4]
@@ -3400,7 +3355,7 @@ cprocess	macro
 	push	ctx.regEax
 	.while 1
 		mov	edx,lppi
-		invoke	GetKernelBase,[edx].dwProcessId
+		invoke	GetKernelBaseCached,[edx].hProcess,[edx].dwProcessId
 		.break .if eax
 		mov	edx,lppi
 		invoke	GetThreadContext,[edx].hThread,addr ctx
@@ -4165,6 +4120,7 @@ TORWsHook	PROC	hMem:DWORD
 	call	copyedx
 	mov	al,0
 	stosb
+	invoke	ConnRingOpen
 	pop	edi
 	call	getpidname
 	mov	hooked,0
@@ -4410,6 +4366,67 @@ GetKernelBase	PROC	__pid:DWORD
 	ret
 GetKernelBase	ENDP
 
+;return the TimeDateStamp of the image at base in hProc in eax and its SizeOfImage in edx, or 0 if it can't be read
+ReadImageId	PROC	uses esi hProc:DWORD,base:DWORD
+	local	hdr[1024]:BYTE,bytes:DWORD
+	invoke	ReadProcessMemory,hProc,base,addr hdr,1024,addr bytes
+	.if eax
+		lea	esi,hdr
+		mov	eax,[esi+3ch]
+		.if (word ptr[esi]=='ZM')&&(eax<1024-54h)
+			.if dword ptr[esi+eax]=='EP'
+				mov	edx,[esi+eax+50h]
+				mov	eax,[esi+eax+8]
+				ret
+			.endif
+		.endif
+	.endif
+	xor	eax,eax
+	xor	edx,edx
+	ret
+ReadImageId	ENDP
+
+;Like GetKernelBase, but without a module snapshot when kernel32 is where it was in the last process that we looked at. System
+;DLLs are mapped at the same address in all the processes of a session, so the snapshot is needed only once for each version of
+;kernel32. hProc needs PROCESS_VM_READ for the shortcut.
+GetKernelBaseCached	PROC	hProc:DWORD,__pid:DWORD
+	local	hSelf:DWORD
+	.if kplan_base==0
+		invoke	GetModuleHandle,addr kernel
+		.if eax
+			mov	hSelf,eax
+			invoke	GetCurrentProcess
+			invoke	ReadImageId,eax,hSelf
+			.if eax
+				mov	kplan_stamp,eax
+				mov	kplan_size,edx
+				mov	eax,hSelf
+				mov	kplan_base,eax
+			.endif
+		.endif
+	.endif
+	.if kplan_base
+		invoke	ReadImageId,hProc,kplan_base
+		.if (eax!=0)&&(eax==kplan_stamp)&&(edx==kplan_size)
+			mov	eax,kplan_base
+			ret
+		.endif
+	.endif
+	invoke	GetKernelBase,__pid
+	.if eax
+		mov	hSelf,eax
+		invoke	ReadImageId,hProc,eax
+		.if eax
+			mov	kplan_stamp,eax
+			mov	kplan_size,edx
+			mov	eax,hSelf
+			mov	kplan_base,eax
+		.endif
+		mov	eax,hSelf
+	.endif
+	ret
+GetKernelBaseCached	ENDP
+
 
 CREATE_DEFAULT_ERROR_MODE=04000000h
 
@@ -4606,6 +4623,7 @@ UnloadDLL	ENDP
 SetHibernationState	PROC	newState:DWORD
 	mov	eax,newState
 	mov	connections_allowed,al
+	invoke	ConnRingSetAllowed
 	ret
 SetHibernationState	ENDP
 
@@ -4615,6 +4633,7 @@ PipeThread	PROC	lParam:DWORD
 	mov	conn_info_cnt,0
 	invoke	CreateEvent,0,1,0,0
 	mov	hEvent,eax
+	invoke	ConnRingCreate
 	.while unloaded==0
 		invoke	CreateNamedPipe,addr pipename,PIPE_ACCESS_DUPLEX,PIPE_TYPE_MESSAGE or PIPE_READMODE_MESSAGE or PIPE_WAIT,1,1024,1024,INFINITE,0
 		.break .if eax!=INVALID_HANDLE_VALUE
@@ -4841,6 +4860,7 @@ PipeThread	PROC	lParam:DWORD
 			mov	dword ptr pipeData,0
 		.endif
 	.endw
+	invoke	ConnRingClose
 	invoke	GlobalFree,conn_info_cache
 	.if hPipe
 		invoke	CloseHandle,hPipe
@@ -4851,9 +4871,12 @@ PipeThread	PROC	lParam:DWORD
 PipeThread	ENDP
 
 GetConnInfo	PROC	uses esi edi ebx _addr:DWORD,_port:DWORD,_result:DWORD,__port:DWORD
+	local	in_ring:DWORD
+	mov	in_ring,0
 	mov	esi,conn_info_cache
-	assume	esi:ptr connection_info
 	mov	edx,conn_info_cnt
+_gci_scan:
+	assume	esi:ptr connection_info
 	xor	ecx,ecx
 	mov	eax,1
 	.while edx
@@ -4942,10 +4965,12 @@ GetConnInfo	PROC	uses esi edi ebx _addr:DWORD,_port:DWORD,_result:DWORD,__port:D
 					pop	esi
 					mov	[esi].magic,0
 					pop	eax
-					xor	eax,0ffffh
-					and	conn_info_cnt,eax
 					push	edx
-					invoke	SetEvent,hEvent
+					.if in_ring==0
+						xor	eax,0ffffh
+						and	conn_info_cnt,eax
+						invoke	SetEvent,hEvent
+					.endif
 					push	LOG_WARN
 					call	Log
 					xor	eax,eax
@@ -4960,6 +4985,14 @@ GetConnInfo	PROC	uses esi edi ebx _addr:DWORD,_port:DWORD,_result:DWORD,__port:D
 		lea	ecx,[ecx+1024]
 	.endw
 	assume	esi:nothing
+	.if (in_ring==0)&&(conn_ring!=0)
+		invoke	ConnRingExpire
+		mov	in_ring,1
+		mov	esi,conn_ring
+		lea	esi,[esi+CONN_RING_SLOT_SIZE]
+		or	edx,-1			;CONN_RING_SLOTS bits
+		jmp	_gci_scan
+	.endif
 	xor	eax,eax
 	ret
 GetConnInfo	ENDP
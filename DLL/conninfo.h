@@ -0,0 +1,260 @@
+;Connection metadata ring
+;
+;The connect() hooks used to open the pipe for every connection, send the 'CONN' message and wait for AdvOR to read it and
+;to reply before they could let the connection go to saddr. The 'CONN' records now go to a file mapping named
+;"<instance>_conninfo" (the pipe name without "\\.\pipe\"), that AdvOR creates in PipeThread and that the hooked processes
+;open when they are hooked. AdvOR doesn't drain the ring on a thread of its own: GetConnInfo looks there when it doesn't find
+;the source address of an accepted connection in conn_info_cache, and the record is always written before the hook calls the
+;original connect().
+;
+;The first slot is the header, the other slots hold records in the connection_info layout. A producer claims a slot that has
+;magic==0 with lock cmpxchg, sets magic to CONN_RING_BUSY while it writes the record and to 'CONN' when it is done. GetConnInfo
+;clears the magic when it takes the record. The _key field of a record holds the GetTickCount of the producer, records that no
+;connection asked for in CONN_RING_EXPIRE ms are dropped.
+;
+;The hooks still use the pipe when the ring is not mapped, when it is full, or when AdvOR doesn't allow connections, because the
+;reply of AdvOR is needed then.
+
+ConnRingPost	PROTO	:DWORD,:DWORD
+SendConnInfo	PROTO	:DWORD,:DWORD
+
+CONN_RING_VERSION = 1
+CONN_RING_SLOTS = 32
+CONN_RING_SLOT_SIZE = 1024
+CONN_RING_SIZE = CONN_RING_SLOT_SIZE*(CONN_RING_SLOTS+1)
+CONN_RING_EXPIRE = 60*1000
+CONN_RING_BUSY = 'YSUB'
+
+conn_ring_header	struct
+	version		dd	?
+	allowed		dd	?		;connections_allowed of AdvOR
+	slots		dd	?
+	next_slot	dd	?		;where producers start looking for a free slot
+conn_ring_header	ends
+
+conninfo_data	macro
+	hConnRing	dd	?
+	conn_ring	dd	?
+endm
+
+conninfo_init	macro
+	mov	hConnRing,0
+	mov	conn_ring,0
+endm
+
+conninfo_procs	macro
+_conninfo	db	'_conninfo',0
+;edi = buffer for the name of the mapping
+conn_ring_name:
+	lea	edx,pipename[9]
+	call	copyedx
+	lea	edx,_conninfo
+	call	copyedx
+	mov	al,0
+	stosb
+	ret
+
+;called by PipeThread
+ConnRingCreate	PROC	uses edi
+	local	rname[300]:BYTE
+	lea	edi,pipename
+	xor	ecx,ecx
+	.while byte ptr[edi+ecx]
+		inc	ecx
+	.endw
+	.if (ecx<9)||(ecx>250)
+		ret
+	.endif
+	lea	edi,rname
+	call	conn_ring_name
+	invoke	CreateFileMapping,INVALID_HANDLE_VALUE,0,PAGE_READWRITE,0,CONN_RING_SIZE,addr rname
+	.if eax
+		mov	hConnRing,eax
+		invoke	MapViewOfFile,hConnRing,FILE_MAP_WRITE,0,0,CONN_RING_SIZE
+		.if eax
+			mov	edi,eax
+			mov	ecx,CONN_RING_SIZE/4
+			xor	eax,eax
+			cld
+			rep	stosd
+			mov	eax,edi
+			sub	eax,CONN_RING_SIZE
+			assume	eax:ptr conn_ring_header
+			mov	[eax].slots,CONN_RING_SLOTS
+			movzx	edx,connections_allowed
+			mov	[eax].allowed,edx
+			mov	[eax].version,CONN_RING_VERSION
+			assume	eax:nothing
+			mov	conn_ring,eax
+		.else
+			invoke	CloseHandle,hConnRing
+			mov	hConnRing,0
+		.endif
+	.endif
+	ret
+ConnRingCreate	ENDP
+
+;called by TORWsHook in the hooked process, after pipename is set
+ConnRingOpen	PROC	uses edi
+	local	rname[300]:BYTE
+	.if conn_ring
+		ret
+	.endif
+	lea	edi,pipename
+	xor	ecx,ecx
+	.while byte ptr[edi+ecx]
+		inc	ecx
+	.endw
+	.if (ecx<9)||(ecx>250)
+		ret
+	.endif
+	lea	edi,rname
+	call	conn_ring_name
+	invoke	OpenFileMapping,FILE_MAP_WRITE,0,addr rname
+	.if eax
+		mov	hConnRing,eax
+		invoke	MapViewOfFile,hConnRing,FILE_MAP_WRITE,0,0,CONN_RING_SIZE
+		.if eax
+			mov	conn_ring,eax
+		.else
+			invoke	CloseHandle,hConnRing
+			mov	hConnRing,0
+		.endif
+	.endif
+	ret
+ConnRingOpen	ENDP
+
+;called by PipeThread on exit; the hooked processes that have the ring mapped go back to the pipe
+ConnRingClose	PROC
+	mov	eax,conn_ring
+	.if eax
+		mov	conn_ring,0
+		assume	eax:ptr conn_ring_header
+		mov	[eax].allowed,0
+		assume	eax:nothing
+		invoke	UnmapViewOfFile,eax
+	.endif
+	.if hConnRing
+		invoke	CloseHandle,hConnRing
+		mov	hConnRing,0
+	.endif
+	ret
+ConnRingClose	ENDP
+
+;called by SetHibernationState
+ConnRingSetAllowed	PROC
+	mov	eax,conn_ring
+	.if eax
+		assume	eax:ptr conn_ring_header
+		movzx	edx,connections_allowed
+		mov	[eax].allowed,edx
+		assume	eax:nothing
+	.endif
+	ret
+ConnRingSetAllowed	ENDP
+
+;Store the 'CONN' message _msg of _len bytes in the ring. Return 1 if it was stored, 0 if it must go to the pipe.
+ConnRingPost	PROC	uses esi edi ebx _msg:DWORD,_len:DWORD
+	mov	ebx,conn_ring
+	.if (ebx==0)||(_len<8)||(_len>CONN_RING_SLOT_SIZE)
+		xor	eax,eax
+		ret
+	.endif
+	assume	ebx:ptr conn_ring_header
+	.if ([ebx].version!=CONN_RING_VERSION)||([ebx].allowed==0)
+		xor	eax,eax
+		ret
+	.endif
+	xor	eax,eax
+	inc	eax
+	lock	xadd	[ebx].next_slot,eax
+	assume	ebx:nothing
+	mov	esi,CONN_RING_SLOTS
+	.while esi
+		and	eax,CONN_RING_SLOTS-1
+		mov	edi,eax
+		inc	edi
+		shl	edi,10
+		add	edi,ebx
+		push	eax
+		xor	eax,eax
+		mov	edx,CONN_RING_BUSY
+		lock	cmpxchg	dword ptr[edi],edx
+		pop	eax
+		.break .if ZERO?
+		inc	eax
+		dec	esi
+	.endw
+	.if esi==0
+		xor	eax,eax
+		ret
+	.endif
+	push	edi
+	mov	esi,_msg
+	lea	esi,[esi+4]
+	lea	edi,[edi+4]
+	mov	ecx,_len
+	sub	ecx,4
+	cld
+	rep	movsb
+	pop	edi
+	invoke	GetTickCount
+	assume	edi:ptr connection_info
+	mov	[edi]._key,eax
+	mov	[edi].magic,'NNOC'
+	assume	edi:nothing
+	xor	eax,eax
+	inc	eax
+	ret
+ConnRingPost	ENDP
+
+;called by GetConnInfo before it looks in the ring
+ConnRingExpire	PROC	uses esi ebx
+	mov	esi,conn_ring
+	invoke	GetTickCount
+	mov	ebx,eax
+	lea	esi,[esi+CONN_RING_SLOT_SIZE]
+	mov	ecx,CONN_RING_SLOTS
+	assume	esi:ptr connection_info
+	.while ecx
+		.if [esi].magic=='NNOC'
+			mov	eax,ebx
+			sub	eax,[esi]._key
+			.if eax>CONN_RING_EXPIRE
+				mov	[esi].magic,0
+			.endif
+		.endif
+		lea	esi,[esi+CONN_RING_SLOT_SIZE]
+		dec	ecx
+	.endw
+	assume	esi:nothing
+	ret
+ConnRingExpire	ENDP
+
+;Report the 'CONN' message _msg of _len bytes to AdvOR, through the ring if it can be stored there. Return the reply, 0 if
+;the connection must fail.
+SendConnInfo	PROC	uses esi edi ebx _msg:DWORD,_len:DWORD
+	local	hFile:DWORD,bytes:DWORD
+	invoke	ConnRingPost,_msg,_len
+	.if eax
+		ret
+	.endif
+	.while unloaded==0
+		invoke	CreateFile,addr pipename,GENERIC_READ or GENERIC_WRITE,0,0,OPEN_EXISTING,0,0
+		.break .if eax!=INVALID_HANDLE_VALUE
+		invoke	GetLastError
+		.if eax==ERROR_PIPE_BUSY
+			invoke	WaitNamedPipe,addr pipename,NMPWAIT_WAIT_FOREVER
+		.else
+			invoke	Sleep,100
+		.endif
+	.endw
+	mov	hFile,eax
+	invoke	WriteFile,hFile,_msg,_len,addr bytes,0
+	invoke	ReadFile,hFile,_msg,4,addr bytes,0
+	invoke	CloseHandle,hFile
+	mov	edx,_msg
+	mov	eax,[edx]
+	ret
+SendConnInfo	ENDP
+endm
@@ -7,37 +7,80 @@ excl_info	struct
 						;n.n.n.n = exit IP
 excl_info	ends
 
+;GetProcessChainKey runs for every new connection, remember its last answers in a table indexed by (pid/4) mod EXCL_HASH_SIZE
+;instead of scanning exclKeyList each time; the table is cleared whenever exclKeyList changes
+EXCL_HASH_SIZE = 256
+
+excl_hash_entry	struct
+	process_id	dd	?		;0 = empty
+	chain_key	dd	?
+excl_hash_entry	ends
+
 excl_data	macro
 	exclKeyList	dd	?
 	exclKeyCount	dd	?
 	exclKeyMaxCount	dd	?
+	exclPidHash	excl_hash_entry	EXCL_HASH_SIZE dup(<>)
 endm
 
 excl_init	macro
 	mov	exclKeyList,0
 	mov	exclKeyCount,0
+	excl_hash_clear
+endm
+
+excl_hash_clear	macro
+	push	edi
+	lea	edi,exclPidHash
+	mov	ecx,EXCL_HASH_SIZE*sizeof excl_hash_entry/4
+	xor	eax,eax
+	cld
+	rep	stosd
+	pop	edi
 endm
 
 excl_procs	macro
 
-GetProcessChainKey	PROC	__pid:DWORD
+GetProcessChainKey	PROC	uses ebx __pid:DWORD
+	mov	eax,__pid
+	.if eax
+		shr	eax,2
+		and	eax,EXCL_HASH_SIZE-1
+		lea	ebx,exclPidHash[eax*sizeof excl_hash_entry]
+		assume	ebx:ptr excl_hash_entry
+		mov	eax,__pid
+		.if eax==[ebx].process_id
+			mov	eax,[ebx].chain_key
+			ret
+		.endif
+	.else
+		xor	ebx,ebx
+	.endif
+	xor	eax,eax
+	inc	eax
 	.if exclKeyCount!=0
 		mov	edx,exclKeyList
 		mov	ecx,exclKeyCount
 		assume	edx:ptr excl_info
-		mov	eax,__pid
 		.while ecx
+			mov	eax,__pid
 			.if eax==[edx].process_id
 				mov	eax,[edx].chain_key
-				ret
+				.break
 			.endif
+			xor	eax,eax
+			inc	eax
 			dec	ecx
 			lea	edx,[edx+sizeof excl_info]
 		.endw
 		assume	edx:nothing
 	.endif
-	xor	eax,eax
-	inc	eax
+	.if ebx
+		mov	[ebx].chain_key,eax
+		mov	edx,__pid
+		mov	[ebx].process_id,edx
+	.endif
+	assume	ebx:nothing
 	ret
 GetProcessChainKey	ENDP
 
@@ -121,6 +164,7 @@ RegisterNewKey	PROC	uses esi edi __pid:DWORD,_key:DWORD
 	mov	[edx].chain_name,eax
 	assume	edx:nothing
 	inc	exclKeyCount
+	excl_hash_clear
 	mov	eax,_key
 	ret
 RegisterNewKey	ENDP
@@ -145,6 +189,7 @@ UnregisterPidKey	PROC	uses esi edi __pid:DWORD
 				mov	ecx,sizeof excl_info
 				cld
 				rep	movsb
+				excl_hash_clear
 				ret
 			.endif
 			dec	ecx
@@ -369,6 +414,7 @@ RegisterPluginKey	PROC	uses esi edi _key:DWORD
 	mov	[edx].chain_name,eax
 	assume	edx:nothing
 	inc	exclKeyCount
+	excl_hash_clear
 	mov	eax,_key
 	ret
 RegisterPluginKey	ENDP
@@ -393,6 +439,7 @@ UnregisterPluginKey	PROC	uses esi edi __key:DWORD
 				mov	ecx,sizeof excl_info
 				cld
 				rep	movsb
+				excl_hash_clear
 				ret
 			.endif
 			dec	ecx
@@ -167,6 +167,37 @@
 	void	__stdcall	lang_change_dialog_strings	(HWND hDlg,
 								lang_dlg_info *dlgInfo);
 
+	BOOL	__stdcall	set_traffic_filter		(int filter_type,
+								const char *value);
+
+	BOOL	__stdcall	complete_translate_address	(DWORD request_id,
+								BOOL allow,
+								const char *translated_address);
+
+	HANDLE	__stdcall	ipset_new			(void);
+
+	BOOL	__stdcall	ipset_add			(HANDLE ipset,
+								DWORD low,
+								DWORD high);
+
+	int	__stdcall	ipset_add_string		(HANDLE ipset,
+								const char *ranges);
+
+	BOOL	__stdcall	ipset_contains			(HANDLE ipset,
+								DWORD ip);
+
+	void	__stdcall	ipset_free			(HANDLE ipset);
+
+	int	__stdcall	get_connection_changes		(DWORD *cursor,
+								connection_change_t *buffer,
+								int change_count);
+
+	int	__stdcall	get_perf_stats			(const char *key,
+								char *buffer,
+								int buffer_size);
+
+	void	__stdcall	reset_perf_stats		(void);
+
 */
 
 
@@ -229,6 +260,28 @@
 #define PLUGIN_FN_DETECT_COMPRESSION_METHOD 49
 #define PLUGIN_FN_GET_LANG_STR 50
 #define PLUGIN_FN_LANG_CHANGE_DIALOG_STRINGS 51
+#define PLUGIN_FN_SET_TRAFFIC_FILTER 56
+#define PLUGIN_FN_COMPLETE_TRANSLATE_ADDRESS 57
+#define PLUGIN_FN_IPSET_NEW 58
+#define PLUGIN_FN_IPSET_ADD 59
+#define PLUGIN_FN_IPSET_ADD_STRING 60
+#define PLUGIN_FN_IPSET_CONTAINS 61
+#define PLUGIN_FN_IPSET_FREE 62
+#define PLUGIN_FN_GET_CONNECTION_CHANGES 63
+#define PLUGIN_FN_GET_PERF_STATS 64
+#define PLUGIN_FN_RESET_PERF_STATS 65
+
+// change types for get_connection_changes()
+#define PLUGIN_CONNECTION_OPENED 1
+#define PLUGIN_CONNECTION_CLOSED 2
+#define PLUGIN_CONNECTION_STATE_CHANGED 3
+
+// filter types for set_traffic_filter()
+#define PLUGIN_FILTER_NONE 0
+#define PLUGIN_FILTER_ADDRESS 1
+#define PLUGIN_FILTER_PORT 2
+#define PLUGIN_FILTER_PROCESS 3
+#define PLUGIN_FILTER_HIDDEN_SERVICE 4
 
 
 #define PLUGIN_UNLOAD_ON_DEMAND 1
@@ -352,6 +405,33 @@ typedef struct connection_info_t
 	LPARAM *lParam;
 } connection_info_t;
 
+typedef struct connection_change_t
+{
+	DWORD change;
+	DWORD connection_id;
+	DWORD connection_type;
+	DWORD connection_state;
+} connection_change_t;
+
+/* A read-only view of data that is passed to AdvTor_HandleReadV() and AdvTor_HandleWriteV() */
+typedef struct plugin_iovec_t
+{
+	const char *data;
+	int len;
+} plugin_iovec_t;
+
+/* A range of the new data that a plugin replaces; offset and len are relative to the start of the new data, and data_len bytes from data are put in its place */
+typedef struct plugin_replace_t
+{
+	int offset;
+	int len;
+	const char *data;
+	int data_len;
+} plugin_replace_t;
+
+/* Maximum number of ranges that AdvTor_HandleReadV() and AdvTor_HandleWriteV() can replace in one call */
+#define PLUGIN_MAX_REPLACEMENTS 16
+
 // Tor constants from or.h
 
 #define _CONN_TYPE_MIN 3
@@ -649,5 +729,15 @@ typedef struct lang_dlg_info
 #define detect_compression_method ((int (*)(char *,size_t))(functions[PLUGIN_FN_DETECT_COMPRESSION_METHOD]))
 #define lang_get_string(at_a,at_b) ((char * __stdcall (*)(HANDLE,int,char *))(functions[PLUGIN_FN_GET_LANG_STR]))(hPlugin,at_a,at_b)
 #define lang_change_dialog_strings(at_a,at_b) ((void __stdcall (*)(HANDLE,HWND,lang_dlg_info *))(functions[PLUGIN_FN_LANG_CHANGE_DIALOG_STRINGS]))(hPlugin,at_a,at_b)
+#define set_traffic_filter(at_a,at_b) ((BOOL __stdcall (*)(HANDLE,int,const char *))(functions[PLUGIN_FN_SET_TRAFFIC_FILTER]))(hPlugin,at_a,at_b)
+#define complete_translate_address(at_a,at_b,at_c) ((BOOL __stdcall (*)(HANDLE,DWORD,BOOL,const char *))(functions[PLUGIN_FN_COMPLETE_TRANSLATE_ADDRESS]))(hPlugin,at_a,at_b,at_c)
+#define ipset_new() ((HANDLE __stdcall (*)(HANDLE))(functions[PLUGIN_FN_IPSET_NEW]))(hPlugin)
+#define ipset_add(at_a,at_b,at_c) ((BOOL __stdcall (*)(HANDLE,HANDLE,DWORD,DWORD))(functions[PLUGIN_FN_IPSET_ADD]))(hPlugin,at_a,at_b,at_c)
+#define ipset_add_string(at_a,at_b) ((int __stdcall (*)(HANDLE,HANDLE,const char *))(functions[PLUGIN_FN_IPSET_ADD_STRING]))(hPlugin,at_a,at_b)
+#define ipset_contains(at_a,at_b) ((BOOL __stdcall (*)(HANDLE,HANDLE,DWORD))(functions[PLUGIN_FN_IPSET_CONTAINS]))(hPlugin,at_a,at_b)
+#define ipset_free(at_a) ((void __stdcall (*)(HANDLE,HANDLE))(functions[PLUGIN_FN_IPSET_FREE]))(hPlugin,at_a)
+#define get_connection_changes(at_a,at_b,at_c) ((int __stdcall (*)(HANDLE,DWORD *,connection_change_t *,int))(functions[PLUGIN_FN_GET_CONNECTION_CHANGES]))(hPlugin,at_a,at_b,at_c)
+#define get_perf_stats(at_a,at_b,at_c) ((int __stdcall (*)(HANDLE,const char *,char *,int))(functions[PLUGIN_FN_GET_PERF_STATS]))(hPlugin,at_a,at_b,at_c)
+#define reset_perf_stats() ((void __stdcall (*)(HANDLE))(functions[PLUGIN_FN_RESET_PERF_STATS]))(hPlugin)
 
 #endif